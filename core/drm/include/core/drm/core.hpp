@@ -5,6 +5,7 @@
 #include <map>
 #include <unordered_map>
 #include <optional>
+#include <vector>
 
 #include <arch/mem_space.hpp>
 #include <async/cancellation.hpp>
@@ -69,8 +70,15 @@ struct Event {
 	uint64_t cookie;
 	uint32_t crtcId;
 	uint64_t timestamp;
+	uint32_t sequence;
 };
 
+// Maximal number of non-blocking commits that can be queued per CRTC.
+constexpr size_t maxPendingFlips = 2;
+
+// Width and height of cursor images; virtio-gpu only supports 64x64 cursors.
+constexpr uint32_t cursorSize = 64;
+
 enum PropertyId {
 	invalid,
 	srcW,
@@ -87,8 +95,37 @@ enum PropertyId {
 	srcY,
 	crtcW,
 	crtcH,
+	fbDamageClips,
+	hotspotX,
+	hotspotY,
 };
 
+/**
+ * A rectangle in framebuffer coordinates; like in drm_mode_rect,
+ * x2 and y2 are exclusive.
+ */
+struct DamageRect {
+	uint32_t x1;
+	uint32_t y1;
+	uint32_t x2;
+	uint32_t y2;
+};
+
+/**
+ * Clips damage rectangles to @p bounds.
+ *
+ * Empty rectangles are dropped. If @p rects is empty, the whole of @p bounds
+ * is considered damaged. If there are more than maxDamageRects rectangles,
+ * they are merged into their bounding box.
+ *
+ * @param rects The damaged regions as supplied by user space.
+ * @param bounds The visible region of the framebuffer.
+ * @return std::vector<drm_core::DamageRect> Regions that need to be updated.
+ */
+std::vector<DamageRect> clipDamage(const std::vector<DamageRect> &rects, DamageRect bounds);
+
+constexpr size_t maxDamageRects = 16;
+
 struct Property {
 	Property(PropertyId id, PropertyType property_type, std::string name) : Property(id, property_type, name, 0) { }
 
@@ -180,6 +217,18 @@ public:
 			uint32_t height, uint32_t bpp) = 0;
 	virtual std::shared_ptr<FrameBuffer> createFrameBuffer(std::shared_ptr<BufferObject> buff,
 			uint32_t width, uint32_t height, uint32_t format, uint32_t pitch) = 0;
+
+	/**
+	 * Wraps memory that was exported by another device (via PRIME) into a BufferObject.
+	 *
+	 * The default implementation does not support importing foreign memory.
+	 *
+	 * @param memory The memory of the exported buffer.
+	 * @param size The size of @p memory.
+	 * @return std::shared_ptr<drm_core::BufferObject> The BufferObject or nullptr.
+	 */
+	virtual std::shared_ptr<BufferObject> importBufferObject(helix::UniqueDescriptor memory,
+			size_t size);
 	//returns major, minor, patchlvl
 	virtual std::tuple<int, int, int> driverVersion() = 0;
 	//returns name, desc, date
@@ -201,6 +250,16 @@ public:
 
 	std::unique_ptr<AtomicState> atomicState();
 
+	/**
+	 * Captures and commits @p assignments.
+	 *
+	 * Commits are applied in the order in which they are submitted. The result
+	 * completes once all previous commits and this commit have completed.
+	 *
+	 * @param assignments
+	 */
+	async::result<void> performCommit(std::vector<Assignment> assignments);
+
 	uint64_t installMapping(drm_core::BufferObject *bo);
 
 	void setupMinDimensions(uint32_t width, uint32_t height);
@@ -219,6 +278,9 @@ private:
 
 	id_allocator<uint32_t> _blobIdAllocator;
 
+	// Serializes commits; only one Configuration is committed at a time.
+	async::mutex _commitMutex;
+
 	/**
 	 * Holds (property_id, property) pairs for this device.
 	 *
@@ -247,6 +309,9 @@ private:
 	std::shared_ptr<Property> _srcYProperty;
 	std::shared_ptr<Property> _crtcWProperty;
 	std::shared_ptr<Property> _crtcHProperty;
+	std::shared_ptr<Property> _fbDamageClipsProperty;
+	std::shared_ptr<Property> _hotspotXProperty;
+	std::shared_ptr<Property> _hotspotYProperty;
 
 public:
 	id_allocator<uint32_t> allocator;
@@ -285,6 +350,9 @@ public:
 	Property *srcYProperty();
 	Property *crtcWProperty();
 	Property *crtcHProperty();
+	Property *fbDamageClipsProperty();
+	Property *hotspotXProperty();
+	Property *hotspotYProperty();
 };
 
 /**
@@ -344,8 +412,10 @@ struct File {
 	}
 
 private:
-	async::detached _retirePageFlip(std::unique_ptr<Configuration> config,
-			uint64_t cookie, uint32_t crtc_id);
+	// Commits @p assignments and posts flip events on completion.
+	// Callers increment pendingFlips of each of the @p crtc_ids.
+	async::result<void> _commitFlip(std::vector<Assignment> assignments,
+			std::vector<uint32_t> crtc_ids, bool event, uint64_t cookie);
 
 	std::shared_ptr<Device> _device;
 
@@ -370,6 +440,56 @@ private:
 	bool atomic;
 };
 
+/**
+ * A BufferObject that was exported as a file descriptor via PRIME.
+ *
+ * Other processes can map the buffer by mmap()ing the file. The BufferObject
+ * stays alive as long as the file is open.
+ */
+struct PrimeFile {
+	PrimeFile(std::shared_ptr<Device> device, std::shared_ptr<BufferObject> bo);
+	~PrimeFile();
+
+	PrimeFile(const PrimeFile &) = delete;
+	PrimeFile &operator=(const PrimeFile &) = delete;
+
+	static async::result<protocols::fs::SeekResult>
+	seekAbs(void *object, int64_t offset);
+
+	static async::result<protocols::fs::SeekResult>
+	seekRel(void *object, int64_t offset);
+
+	static async::result<protocols::fs::SeekResult>
+	seekEof(void *object, int64_t offset);
+
+	static async::result<helix::BorrowedDescriptor>
+	accessMemory(void *object);
+
+	static async::result<void>
+	ioctl(void *object, managarm::fs::CntRequest req, helix::UniqueLane conversation);
+
+	/**
+	 * Finds a BufferObject that @p device exported from this process.
+	 *
+	 * Importers obtain the @p token of a PrimeFile via primeTokenIoctl.
+	 * Tokens are random, i.e., knowing one implies access to the file.
+	 *
+	 * @return std::shared_ptr<drm_core::BufferObject> The BufferObject or nullptr.
+	 */
+	static std::shared_ptr<BufferObject> findExport(Device *device, uint64_t token);
+
+private:
+	std::shared_ptr<Device> _device;
+	std::shared_ptr<BufferObject> _bo;
+	// View of exactly the memory of _bo.
+	helix::UniqueDescriptor _memory;
+	uint64_t _token;
+	int64_t _offset = 0;
+};
+
+// ioctl() on PrimeFiles that returns their token (in drm_value).
+constexpr uint32_t primeTokenIoctl = 0x50524d00;
+
 struct Configuration {
 	virtual ~Configuration() = default;
 
@@ -464,6 +584,11 @@ public:
 
 	int index;
 
+	// Commits that were submitted to this CRTC but did not complete yet.
+	size_t pendingFlips = 0;
+	// Number of completed commits; reported in flip events.
+	uint32_t flipSequence = 0;
+
 private:
 	std::shared_ptr<CrtcState> _drmState;
 };
@@ -559,7 +684,12 @@ protected:
 	~FrameBuffer() = default;
 
 public:
-	virtual void notifyDirty() = 0;
+	/**
+	 * Called for DRM_IOCTL_MODE_DIRTYFB.
+	 *
+	 * @param clips Regions that were modified, clipped to the framebuffer.
+	 */
+	virtual void notifyDirty(std::vector<DamageRect> clips) = 0;
 };
 
 struct Plane : ModeObject {
@@ -609,6 +739,26 @@ struct PlaneState {
 	uint32_t src_y;
 	uint32_t src_w;
 	uint32_t src_h;
+	// Position of the pointer within the image of a cursor plane.
+	int32_t hotspot_x = 0;
+	int32_t hotspot_y = 0;
+
+	// Value of FB_DAMAGE_CLIPS, an array of drm_mode_rect.
+	// Unlike the other members, this only applies to a single commit.
+	std::shared_ptr<Blob> damageClips;
+	// Regions of fb that a commit has to update; set by resolveDamage().
+	std::vector<DamageRect> damage;
+
+	/**
+	 * Computes damage from damageClips.
+	 *
+	 * Drivers call this during capture. The whole source rectangle is damaged
+	 * if no clips were supplied or if the framebuffer or the source rectangle
+	 * differ from the @p current state of the plane.
+	 *
+	 * @param current The state that is currently committed to the plane.
+	 */
+	void resolveDamage(const PlaneState &current);
 };
 
 /**
@@ -655,6 +805,7 @@ struct AtomicState {
 	std::shared_ptr<ConnectorState> connector(uint32_t id);
 
 	std::unordered_map<uint32_t, std::shared_ptr<CrtcState>>& crtc_states(void);
+	std::unordered_map<uint32_t, std::shared_ptr<PlaneState>>& plane_states(void);
 
 private:
 	Device *_device;
@@ -1,17 +1,20 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <algorithm>
 #include <deque>
 #include <experimental/optional>
 #include <optional>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <sys/epoll.h>
 
 #include <async/result.hpp>
 #include <helix/ipc.hpp>
+#include <protocols/fs/client.hpp>
 #include <protocols/fs/defs.hpp>
 #include <protocols/fs/server.hpp>
 #include <protocols/hw/client.hpp>
@@ -137,6 +140,16 @@ drm_core::Device::Device() {
 		bool validate(const Assignment&) override {
 			return true;
 		};
+
+		void writeToState(const Assignment assignment, std::unique_ptr<AtomicState> &state) override {
+			state->plane(assignment.object->id())->crtc_x = static_cast<int32_t>(assignment.intValue);
+		}
+
+		uint32_t intFromState(std::shared_ptr<ModeObject> obj) override {
+			auto plane = obj->asPlane();
+			assert(plane);
+			return plane->drmState()->crtc_x;
+		}
 	};
 	registerProperty(_crtcXProperty = std::make_shared<CrtcXProperty>());
 
@@ -147,6 +160,16 @@ drm_core::Device::Device() {
 		bool validate(const Assignment&) override {
 			return true;
 		};
+
+		void writeToState(const Assignment assignment, std::unique_ptr<AtomicState> &state) override {
+			state->plane(assignment.object->id())->crtc_y = static_cast<int32_t>(assignment.intValue);
+		}
+
+		uint32_t intFromState(std::shared_ptr<ModeObject> obj) override {
+			auto plane = obj->asPlane();
+			assert(plane);
+			return plane->drmState()->crtc_y;
+		}
 	};
 	registerProperty(_crtcYProperty = std::make_shared<CrtcYProperty>());
 
@@ -252,6 +275,64 @@ drm_core::Device::Device() {
 		};
 	};
 	registerProperty(_crtcHProperty = std::make_shared<CrtcHProperty>());
+
+	struct FbDamageClipsProperty : drm_core::Property {
+		FbDamageClipsProperty()
+		: drm_core::Property{fbDamageClips, drm_core::BlobPropertyType{}, "FB_DAMAGE_CLIPS"} { }
+
+		bool validate(const Assignment& assignment) override {
+			if(!assignment.blobValue)
+				return true;
+			return !(assignment.blobValue->size() % sizeof(drm_mode_rect));
+		};
+
+		void writeToState(const Assignment assignment, std::unique_ptr<AtomicState> &state) override {
+			state->plane(assignment.object->id())->damageClips = assignment.blobValue;
+		}
+	};
+	registerProperty(_fbDamageClipsProperty = std::make_shared<FbDamageClipsProperty>());
+
+	struct HotspotXProperty : drm_core::Property {
+		HotspotXProperty()
+		: drm_core::Property{hotspotX, drm_core::IntPropertyType{}, "HOTSPOT_X"} { }
+
+		bool validate(const Assignment& assignment) override {
+			auto plane = assignment.object->asPlane();
+			return plane && plane->type() == Plane::PlaneType::CURSOR;
+		};
+
+		void writeToState(const Assignment assignment, std::unique_ptr<AtomicState> &state) override {
+			state->plane(assignment.object->id())->hotspot_x = static_cast<int32_t>(assignment.intValue);
+		}
+
+		uint32_t intFromState(std::shared_ptr<ModeObject> obj) override {
+			auto plane = obj->asPlane();
+			assert(plane);
+			return plane->drmState()->hotspot_x;
+		}
+	};
+	registerProperty(_hotspotXProperty = std::make_shared<HotspotXProperty>());
+
+	struct HotspotYProperty : drm_core::Property {
+		HotspotYProperty()
+		: drm_core::Property{hotspotY, drm_core::IntPropertyType{}, "HOTSPOT_Y"} { }
+
+		bool validate(const Assignment& assignment) override {
+			auto plane = assignment.object->asPlane();
+			return plane && plane->type() == Plane::PlaneType::CURSOR;
+		};
+
+		void writeToState(const Assignment assignment, std::unique_ptr<AtomicState> &state) override {
+			state->plane(assignment.object->id())->hotspot_y = static_cast<int32_t>(assignment.intValue);
+		}
+
+		uint32_t intFromState(std::shared_ptr<ModeObject> obj) override {
+			auto plane = obj->asPlane();
+			assert(plane);
+			return plane->drmState()->hotspot_y;
+		}
+	};
+	registerProperty(_hotspotYProperty = std::make_shared<HotspotYProperty>());
 }
 
 void drm_core::Device::setupCrtc(drm_core::Crtc *crtc) {
@@ -319,6 +400,25 @@ std::unique_ptr<drm_core::AtomicState> drm_core::Device::atomicState() {
 	return std::make_unique<drm_core::AtomicState>(state);
 }
 
+std::shared_ptr<drm_core::BufferObject>
+drm_core::Device::importBufferObject(helix::UniqueDescriptor, size_t) {
+	return nullptr;
+}
+
+async::result<void> drm_core::Device::performCommit(std::vector<Assignment> assignments) {
+	co_await _commitMutex.async_lock();
+	std::unique_lock lock{_commitMutex, std::adopt_lock};
+
+	// Capture only now, such that the commit applies on top of all previous ones.
+	auto config = createConfiguration();
+	auto state = atomicState();
+	auto valid = config->capture(assignments, state);
+	assert(valid);
+	config->commit(state);
+
+	co_await config->waitForCompletion();
+}
+
 uint64_t drm_core::Device::installMapping(drm_core::BufferObject *bo) {
 	assert(bo->getSize() < (UINT64_C(1) << 32));
 	return static_cast<uint64_t>(_memorySlotAllocator.allocate()) << 32;
@@ -406,6 +506,18 @@ drm_core::Property *drm_core::Device::crtcHProperty() {
 	return _crtcHProperty.get();
 }
 
+drm_core::Property *drm_core::Device::fbDamageClipsProperty() {
+	return _fbDamageClipsProperty.get();
+}
+
+drm_core::Property *drm_core::Device::hotspotXProperty() {
+	return _hotspotXProperty.get();
+}
+
+drm_core::Property *drm_core::Device::hotspotYProperty() {
+	return _hotspotYProperty.get();
+}
+
 void drm_core::Device::registerProperty(std::shared_ptr<drm_core::Property> p) {
 	_properties.insert({p->id(), p});
 }
@@ -722,6 +834,11 @@ std::vector<drm_core::Assignment> drm_core::Plane::getAssignments(std::shared_pt
 	assignments.push_back(drm_core::Assignment::withInt(this->sharedModeObject(), dev->crtcXProperty(), drmState()->crtc_x));
 	assignments.push_back(drm_core::Assignment::withInt(this->sharedModeObject(), dev->crtcYProperty(), drmState()->crtc_y));
 	assignments.push_back(drm_core::Assignment::withModeObj(this->sharedModeObject(), dev->fbIdProperty(), drmState()->fb));
+	assignments.push_back(drm_core::Assignment::withBlob(this->sharedModeObject(), dev->fbDamageClipsProperty(), nullptr));
+	if(type() == PlaneType::CURSOR) {
+		assignments.push_back(drm_core::Assignment::withInt(this->sharedModeObject(), dev->hotspotXProperty(), drmState()->hotspot_x));
+		assignments.push_back(drm_core::Assignment::withInt(this->sharedModeObject(), dev->hotspotYProperty(), drmState()->hotspot_y));
+	}
 
 	return assignments;
 }
@@ -730,6 +847,33 @@ drm_core::Plane::PlaneType drm_core::PlaneState::type(void) {
 	return plane->type();
 }
 
+void drm_core::PlaneState::resolveDamage(const PlaneState &current) {
+	DamageRect bounds{src_x, src_y, src_x + src_w, src_y + src_h};
+
+	std::vector<DamageRect> clips;
+	bool unchanged = fb == current.fb
+			&& src_x == current.src_x && src_y == current.src_y
+			&& src_w == current.src_w && src_h == current.src_h;
+	if(unchanged && damageClips) {
+		auto rects = reinterpret_cast<const drm_mode_rect *>(damageClips->data());
+		for(size_t i = 0; i < damageClips->size() / sizeof(drm_mode_rect); i++) {
+			auto &r = rects[i];
+			if(r.x1 < 0 || r.y1 < 0 || r.x2 <= r.x1 || r.y2 <= r.y1)
+				continue;
+			clips.push_back({static_cast<uint32_t>(r.x1), static_cast<uint32_t>(r.y1),
+					static_cast<uint32_t>(r.x2), static_cast<uint32_t>(r.y2)});
+		}
+
+		// All supplied clips were empty, i.e., nothing changed.
+		if(clips.empty() && damageClips->size()) {
+			damage.clear();
+			return;
+		}
+	}
+
+	damage = clipDamage(clips, bounds);
+}
+
 // ----------------------------------------------------------------
 // Connector
 // ----------------------------------------------------------------
@@ -854,6 +998,9 @@ std::shared_ptr<drm_core::PlaneState> drm_core::AtomicState::plane(uint32_t id)
 		auto plane = _device->findObject(id)->asPlane();
 		assert(plane->drmState());
 		auto plane_state = PlaneState(*plane->drmState());
+		// Damage does not carry over from the previous commit.
+		plane_state.damageClips = nullptr;
+		plane_state.damage.clear();
 		auto plane_state_shared = std::make_shared<drm_core::PlaneState>(plane_state);
 		_planeStates.insert({id, plane_state_shared});
 		return plane_state_shared;
@@ -877,6 +1024,139 @@ std::unordered_map<uint32_t, std::shared_ptr<drm_core::CrtcState>>& drm_core::At
 	return _crtcStates;
 }
 
+std::unordered_map<uint32_t, std::shared_ptr<drm_core::PlaneState>>& drm_core::AtomicState::plane_states(void) {
+	return _planeStates;
+}
+
+// ----------------------------------------------------------------
+// PrimeFile
+// ----------------------------------------------------------------
+
+namespace {
+
+struct PrimeExport {
+	drm_core::Device *device;
+	std::weak_ptr<drm_core::BufferObject> bo;
+};
+
+// All PrimeFiles of this process, indexed by their token.
+std::unordered_map<uint64_t, PrimeExport> primeExports;
+
+} // anonymous namespace
+
+drm_core::PrimeFile::PrimeFile(std::shared_ptr<Device> device, std::shared_ptr<BufferObject> bo)
+: _device{std::move(device)}, _bo{std::move(bo)} {
+	auto [memory, offset] = _bo->getMemory();
+	HelHandle handle;
+	HEL_CHECK(helCreateSliceView(memory.getHandle(), offset, _bo->getSize(), 0, &handle));
+	_memory = helix::UniqueDescriptor{handle};
+
+	do {
+		size_t actual;
+		HEL_CHECK(helGetRandomBytes(&_token, sizeof(uint64_t), &actual));
+		assert(actual == sizeof(uint64_t));
+	} while(primeExports.contains(_token));
+	primeExports.insert({_token, PrimeExport{_device.get(), _bo}});
+}
+
+drm_core::PrimeFile::~PrimeFile() {
+	primeExports.erase(_token);
+}
+
+async::result<protocols::fs::SeekResult>
+drm_core::PrimeFile::seekAbs(void *object, int64_t offset) {
+	auto self = static_cast<drm_core::PrimeFile *>(object);
+	self->_offset = offset;
+	co_return self->_offset;
+}
+
+async::result<protocols::fs::SeekResult>
+drm_core::PrimeFile::seekRel(void *object, int64_t offset) {
+	auto self = static_cast<drm_core::PrimeFile *>(object);
+	self->_offset += offset;
+	co_return self->_offset;
+}
+
+// Clients use lseek(fd, 0, SEEK_END) to determine the size of the buffer.
+async::result<protocols::fs::SeekResult>
+drm_core::PrimeFile::seekEof(void *object, int64_t offset) {
+	auto self = static_cast<drm_core::PrimeFile *>(object);
+	self->_offset = self->_bo->getSize() + offset;
+	co_return self->_offset;
+}
+
+async::result<helix::BorrowedDescriptor>
+drm_core::PrimeFile::accessMemory(void *object) {
+	auto self = static_cast<drm_core::PrimeFile *>(object);
+	co_return self->_memory;
+}
+
+async::result<void>
+drm_core::PrimeFile::ioctl(void *object, managarm::fs::CntRequest req,
+		helix::UniqueLane conversation) {
+	auto self = static_cast<drm_core::PrimeFile *>(object);
+
+	managarm::fs::SvrResponse resp;
+	if(req.command() == primeTokenIoctl) {
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+		resp.set_drm_value(self->_token);
+	}else{
+		resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+	}
+
+	auto ser = resp.SerializeAsString();
+	auto [send_resp] = co_await helix_ng::exchangeMsgs(conversation,
+		helix_ng::sendBuffer(ser.data(), ser.size())
+	);
+	HEL_CHECK(send_resp.error());
+}
+
+std::shared_ptr<drm_core::BufferObject>
+drm_core::PrimeFile::findExport(Device *device, uint64_t token) {
+	auto it = primeExports.find(token);
+	if(it == primeExports.end() || it->second.device != device)
+		return nullptr;
+	return it->second.bo.lock();
+}
+
+namespace drm_core {
+
+static constexpr auto primeFileOperations = protocols::fs::FileOperations{
+	.seekAbs = &PrimeFile::seekAbs,
+	.seekRel = &PrimeFile::seekRel,
+	.seekEof = &PrimeFile::seekEof,
+	.accessMemory = &PrimeFile::accessMemory,
+	.ioctl = &PrimeFile::ioctl
+};
+
+} // namespace drm_core
+
+// Asks the server of @p lane for its PrimeFile token.
+// Fails if the lane does not belong to a PrimeFile.
+static async::result<std::optional<uint64_t>> queryPrimeToken(helix::BorrowedDescriptor lane) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_IOCTL);
+	req.set_command(drm_core::primeTokenIoctl);
+
+	auto ser = req.SerializeAsString();
+	auto [offer, send_req, recv_resp] = co_await helix_ng::exchangeMsgs(lane,
+		helix_ng::offer(
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::recvInline())
+	);
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	// Servers that do not implement ioctl() dismiss the request.
+	if(recv_resp.error())
+		co_return std::nullopt;
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return std::nullopt;
+	co_return resp.drm_value();
+}
+
 // ----------------------------------------------------------------
 // File
 // ----------------------------------------------------------------
@@ -953,13 +1233,13 @@ drm_core::File::read(void *object, const char *,
 
 	auto ev = &self->_pendingEvents.front();
 
-	// TODO: Support sequence number and CRTC id.
 	drm_event_vblank out;
 	memset(&out, 0, sizeof(drm_event_vblank));
 	out.base.type = DRM_EVENT_FLIP_COMPLETE;
 	out.base.length = sizeof(drm_event_vblank);
 	out.user_data = ev->cookie;
 	out.crtc_id = ev->crtcId;
+	out.sequence = ev->sequence;
 	out.tv_sec = ev->timestamp / 1000000000;
 	out.tv_usec = (ev->timestamp % 1000000000) / 1000;
 
@@ -1018,9 +1298,11 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 		}else if(req.drm_capability() == DRM_CAP_CRTC_IN_VBLANK_EVENT) {
 			resp.set_drm_value(1);
 		}else if(req.drm_capability() == DRM_CAP_CURSOR_WIDTH) {
-			resp.set_drm_value(32);
+			resp.set_drm_value(cursorSize);
 		}else if(req.drm_capability() == DRM_CAP_CURSOR_HEIGHT) {
-			resp.set_drm_value(32);
+			resp.set_drm_value(cursorSize);
+		}else if(req.drm_capability() == DRM_CAP_PRIME) {
+			resp.set_drm_value(DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT);
 		}else{
 			std::cout << "core/drm: Unknown capability " << req.drm_capability() << std::endl;
 			resp.set_drm_value(0);
@@ -1303,13 +1585,7 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 			assignments.push_back(Assignment::withBlob(crtc->sharedModeObject(), self->_device->modeIdProperty(), nullptr));
 		}
 
-		auto config = self->_device->createConfiguration();
-		auto state = self->_device->atomicState();
-		auto valid = config->capture(assignments, state);
-		assert(valid);
-		config->commit(state);
-
-		co_await config->waitForCompletion();
+		co_await self->_device->performCommit(std::move(assignments));
 
 		resp.set_error(managarm::fs::Errors::SUCCESS);
 
@@ -1333,15 +1609,14 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 		assert(fb);
 		assignments.push_back(Assignment::withModeObj(crtc->primaryPlane()->sharedModeObject(), self->_device->fbIdProperty(), fb));
 
-		auto config = self->_device->createConfiguration();
-		auto state = self->_device->atomicState();
-		auto valid = config->capture(assignments, state);
-		assert(valid);
-		config->commit(state);
-
-		self->_retirePageFlip(std::move(config), req.drm_cookie(), crtc->id());
-
-		resp.set_error(managarm::fs::Errors::SUCCESS);
+		if(crtc->pendingFlips >= maxPendingFlips) {
+			resp.set_error(managarm::fs::Errors::WOULD_BLOCK);
+		}else{
+			crtc->pendingFlips++;
+			async::detach(self->_commitFlip(std::move(assignments), {crtc->id()},
+					true, req.drm_cookie()));
+			resp.set_error(managarm::fs::Errors::SUCCESS);
+		}
 
 		auto ser = resp.SerializeAsString();
 		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
@@ -1360,7 +1635,19 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 		} else {
 			auto fb = obj->asFrameBuffer();
 			assert(fb);
-			fb->notifyDirty();
+
+			std::vector<DamageRect> clips;
+			for(size_t i = 0; i < req.drm_clips_size(); i++) {
+				auto &r = req.drm_clips(i);
+				if(r.x1() < 0 || r.y1() < 0 || r.x2() <= r.x1() || r.y2() <= r.y1())
+					continue;
+				clips.push_back({static_cast<uint32_t>(r.x1()), static_cast<uint32_t>(r.y1()),
+						static_cast<uint32_t>(r.x2()), static_cast<uint32_t>(r.y2())});
+			}
+
+			// Only drop the request if user space supplied nothing but empty clips.
+			if(clips.size() || !req.drm_clips_size())
+				fb->notifyDirty(std::move(clips));
 		}
 
 		auto ser = resp.SerializeAsString();
@@ -1368,7 +1655,8 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 			helix::action(&send_resp, ser.data(), ser.size()));
 		co_await transmit.async_wait();
 		HEL_CHECK(send_resp.error());
-	}else if(req.command() == DRM_IOCTL_MODE_CURSOR) {
+	}else if(req.command() == DRM_IOCTL_MODE_CURSOR
+			|| req.command() == DRM_IOCTL_MODE_CURSOR2) {
 		helix::SendBuffer send_resp;
 		managarm::fs::SvrResponse resp;
 
@@ -1388,9 +1676,18 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 			co_return;
 		}
 
+		// Drivers implement cursor planes natively, i.e., a commit that only
+		// moves the cursor does not touch the primary plane.
 		std::vector<Assignment> assignments;
-		if (req.drm_flags() == DRM_MODE_CURSOR_BO) {
+		if (req.drm_flags() & ~(DRM_MODE_CURSOR_BO | DRM_MODE_CURSOR_MOVE)) {
+			printf("\e[35mcore/drm: invalid request whilst handling DRM_IOCTL_MODE_CURSOR\e[39m\n");
+			resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+		}else{
 			resp.set_error(managarm::fs::Errors::SUCCESS);
+		}
+
+		if (resp.error() == managarm::fs::Errors::SUCCESS
+				&& (req.drm_flags() & DRM_MODE_CURSOR_BO)) {
 			auto bo = self->resolveHandle(req.drm_handle());
 			auto width = req.drm_width();
 			auto height = req.drm_height();
@@ -1405,31 +1702,113 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 			} else {
 				assignments.push_back(Assignment::withModeObj(crtc->cursorPlane()->sharedModeObject(), self->_device->fbIdProperty(), nullptr));
 			}
-		}else if (req.drm_flags() == DRM_MODE_CURSOR_MOVE) {
-			resp.set_error(managarm::fs::Errors::SUCCESS);
-			auto x = req.drm_x();
-			auto y = req.drm_y();
+
+			// DRM_IOCTL_MODE_CURSOR resets the hotspot.
+			int32_t hot_x = 0, hot_y = 0;
+			if (req.command() == DRM_IOCTL_MODE_CURSOR2) {
+				hot_x = req.drm_hot_x();
+				hot_y = req.drm_hot_y();
+			}
+			assignments.push_back(Assignment::withInt(cursor_plane->sharedModeObject(), self->_device->hotspotXProperty(), hot_x));
+			assignments.push_back(Assignment::withInt(cursor_plane->sharedModeObject(), self->_device->hotspotYProperty(), hot_y));
+		}
+		if (resp.error() == managarm::fs::Errors::SUCCESS
+				&& (req.drm_flags() & DRM_MODE_CURSOR_MOVE)) {
+			auto x = static_cast<int32_t>(req.drm_x());
+			auto y = static_cast<int32_t>(req.drm_y());
 
 			assignments.push_back(Assignment::withInt(cursor_plane->sharedModeObject(), self->_device->crtcXProperty(), x));
 			assignments.push_back(Assignment::withInt(cursor_plane->sharedModeObject(), self->_device->crtcYProperty(), y));
-		}else{
-			printf("\e[35mcore/drm: invalid request whilst handling DRM_IOCTL_MODE_CURSOR\e[39m\n");
-			resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
 		}
 
-		auto config = self->_device->createConfiguration();
-		auto state = self->_device->atomicState();
-		auto valid = config->capture(assignments, state);
-		assert(valid);
-		config->commit(state);
-
-		co_await config->waitForCompletion();
+		if (!assignments.empty())
+			co_await self->_device->performCommit(std::move(assignments));
 
 		auto ser = resp.SerializeAsString();
 		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 		helix::action(&send_resp, ser.data(), ser.size()));
 		co_await transmit.async_wait();
 		HEL_CHECK(send_resp.error());
+	}else if(req.command() == DRM_IOCTL_PRIME_HANDLE_TO_FD) {
+		managarm::fs::SvrResponse resp;
+
+		auto bo = self->resolveHandle(req.drm_handle());
+		if(!bo) {
+			resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
+
+		// The client turns the lane into a file descriptor via the POSIX server.
+		helix::UniqueLane local_lane, remote_lane;
+		std::tie(local_lane, remote_lane) = helix::createStream();
+		auto file = smarter::make_shared<drm_core::PrimeFile>(self->_device,
+				bo->sharedBufferObject());
+		async::detach(protocols::fs::servePassthrough(
+				std::move(local_lane), file, &primeFileOperations));
+
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp, push_lane] = co_await helix_ng::exchangeMsgs(conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::pushDescriptor(remote_lane)
+		);
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(push_lane.error());
+	}else if(req.command() == DRM_IOCTL_PRIME_FD_TO_HANDLE) {
+		managarm::fs::SvrResponse resp;
+
+		// The client pushes the passthrough lane of the file descriptor.
+		auto [pull_lane] = co_await helix_ng::exchangeMsgs(conversation,
+			helix_ng::pullDescriptor()
+		);
+		HEL_CHECK(pull_lane.error());
+		auto lane = pull_lane.descriptor();
+
+		std::shared_ptr<BufferObject> bo;
+		if(auto token = co_await queryPrimeToken(lane); token)
+			bo = PrimeFile::findExport(self->_device.get(), *token);
+
+		if(!bo) {
+			// Buffers of other devices (or other processes) are imported by their memory.
+			protocols::fs::File file{std::move(lane)};
+			auto memory = co_await file.accessMemory();
+			if(memory) {
+				size_t size;
+				HEL_CHECK(helMemoryInfo(memory.getHandle(), &size));
+				bo = self->_device->importBufferObject(std::move(memory), size);
+			}
+		}
+
+		if(bo) {
+			// Importing a buffer twice yields the same handle.
+			std::optional<uint32_t> handle;
+			for(auto &[h, existing] : self->_buffers) {
+				if(existing == bo) {
+					handle = h;
+					break;
+				}
+			}
+			if(!handle)
+				handle = self->createHandle(bo);
+
+			resp.set_drm_handle(*handle);
+			resp.set_error(managarm::fs::Errors::SUCCESS);
+		}else{
+			resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+		}
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp] = co_await helix_ng::exchangeMsgs(conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size())
+		);
+		HEL_CHECK(send_resp.error());
 	}else if(req.command() == DRM_IOCTL_MODE_DESTROY_DUMB){
 		self->_buffers.erase(req.drm_handle());
 
@@ -1538,9 +1917,6 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 
 		std::vector<drm_core::Assignment> assignments;
 
-		auto config = self->_device->createConfiguration();
-		auto state = self->_device->atomicState();
-
 		auto mode_obj = self->_device->findObject(req.drm_obj_id());
 		assert(mode_obj);
 
@@ -1562,11 +1938,7 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 			assignments.push_back(Assignment::withModeObj(mode_obj, prop.get(), obj));
 		}
 
-		auto valid = config->capture(assignments, state);
-		assert(valid);
-
-		config->commit(state);
-		co_await config->waitForCompletion();
+		co_await self->_device->performCommit(std::move(assignments));
 
 		resp.set_error(managarm::fs::Errors::SUCCESS);
 
@@ -1668,9 +2040,10 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 		std::vector<drm_core::Assignment> assignments;
 
 		std::vector<uint32_t> crtc_ids;
-
-		auto config = self->_device->createConfiguration();
-		auto state = self->_device->atomicState();
+		auto addCrtc = [&] (uint32_t id) {
+			if(std::find(crtc_ids.begin(), crtc_ids.end(), id) == crtc_ids.end())
+				crtc_ids.push_back(id);
+		};
 
 		if(!self->atomic || req.drm_flags() & ~DRM_MODE_ATOMIC_FLAGS || ((req.drm_flags() & DRM_MODE_ATOMIC_TEST_ONLY) && (req.drm_flags() & DRM_MODE_PAGE_FLIP_EVENT))) {
 			resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
@@ -1682,7 +2055,14 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 			assert(mode_obj);
 
 			if(mode_obj->type() == ObjectType::crtc) {
-				crtc_ids.push_back(mode_obj->id());
+				addCrtc(mode_obj->id());
+			}else if(mode_obj->type() == ObjectType::plane) {
+				// Plane updates are flips of the CRTC that the plane belongs to.
+				auto plane = mode_obj->asPlane();
+				for(auto crtc : self->_device->getCrtcs()) {
+					if(crtc->primaryPlane() == plane || crtc->cursorPlane() == plane)
+						addCrtc(crtc->id());
+				}
 			}
 
 			for(size_t j = 0; j < req.drm_prop_counts(i); j++) {
@@ -1710,19 +2090,41 @@ drm_core::File::ioctl(void *object, managarm::fs::CntRequest req,
 			prop_count += req.drm_prop_counts(i);
 		}
 
-		{
-			auto valid = config->capture(assignments, state);
-			assert(valid);
+		if(req.drm_flags() & DRM_MODE_ATOMIC_TEST_ONLY) {
+			auto config = self->_device->createConfiguration();
+			auto state = self->_device->atomicState();
+			if(config->capture(assignments, state)) {
+				resp.set_error(managarm::fs::Errors::SUCCESS);
+			}else{
+				resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			}
+			config->dispose();
+			goto send;
 		}
 
-		if(!(req.drm_flags() & DRM_MODE_ATOMIC_TEST_ONLY)) {
-			config->commit(state);
-			co_await config->waitForCompletion();
+		if((req.drm_flags() & DRM_MODE_PAGE_FLIP_EVENT) && crtc_ids.empty()) {
+			resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			goto send;
 		}
 
-		if(req.drm_flags() & DRM_MODE_PAGE_FLIP_EVENT) {
-			assert(crtc_ids.size() == 1);
-			self->_retirePageFlip(std::move(config), req.drm_cookie(), crtc_ids.front());
+		if(req.drm_flags() & DRM_MODE_ATOMIC_NONBLOCK) {
+			// Queue the commit and return immediately; completion is signaled by an event.
+			for(auto crtc_id : crtc_ids) {
+				if(self->_device->findObject(crtc_id)->asCrtc()->pendingFlips >= maxPendingFlips) {
+					resp.set_error(managarm::fs::Errors::WOULD_BLOCK);
+					goto send;
+				}
+			}
+
+			for(auto crtc_id : crtc_ids)
+				self->_device->findObject(crtc_id)->asCrtc()->pendingFlips++;
+			async::detach(self->_commitFlip(std::move(assignments), std::move(crtc_ids),
+					req.drm_flags() & DRM_MODE_PAGE_FLIP_EVENT, req.drm_cookie()));
+		}else{
+			for(auto crtc_id : crtc_ids)
+				self->_device->findObject(crtc_id)->asCrtc()->pendingFlips++;
+			co_await self->_commitFlip(std::move(assignments), std::move(crtc_ids),
+					req.drm_flags() & DRM_MODE_PAGE_FLIP_EVENT, req.drm_cookie());
 		}
 
 		resp.set_error(managarm::fs::Errors::SUCCESS);
@@ -1770,15 +2172,26 @@ drm_core::File::pollStatus(void *object) {
 	co_return protocols::fs::PollStatusResult{self->_eventSequence, s};
 }
 
-async::detached
-drm_core::File::_retirePageFlip(std::unique_ptr<drm_core::Configuration> config,
-			uint64_t cookie, uint32_t crtc_id) {
-	co_await config->waitForCompletion();
-
-	Event event;
-	event.cookie = cookie;
-	event.crtcId = crtc_id;
-	postEvent(event);
+async::result<void>
+drm_core::File::_commitFlip(std::vector<drm_core::Assignment> assignments,
+		std::vector<uint32_t> crtc_ids, bool event, uint64_t cookie) {
+	co_await _device->performCommit(std::move(assignments));
+
+	for(auto crtc_id : crtc_ids) {
+		auto crtc = _device->findObject(crtc_id)->asCrtc();
+		assert(crtc->pendingFlips);
+		crtc->pendingFlips--;
+		crtc->flipSequence++;
+
+		if(!event)
+			continue;
+
+		Event ev;
+		ev.cookie = cookie;
+		ev.crtcId = crtc_id;
+		ev.sequence = crtc->flipSequence;
+		postEvent(ev);
+	}
 }
 
 namespace drm_core {
@@ -1863,6 +2276,35 @@ async::detached serveDrmDevice(std::shared_ptr<drm_core::Device> device,
 // Functions
 // ----------------------------------------------------------------
 
+std::vector<drm_core::DamageRect> drm_core::clipDamage(const std::vector<DamageRect> &rects,
+		DamageRect bounds) {
+	if(rects.empty())
+		return {bounds};
+
+	std::vector<DamageRect> clipped;
+	for(auto &r : rects) {
+		DamageRect c{std::max(r.x1, bounds.x1), std::max(r.y1, bounds.y1),
+				std::min(r.x2, bounds.x2), std::min(r.y2, bounds.y2)};
+		if(c.x1 >= c.x2 || c.y1 >= c.y2)
+			continue;
+		clipped.push_back(c);
+	}
+
+	// Issuing many small updates is more expensive than one large update.
+	if(clipped.size() > maxDamageRects) {
+		DamageRect box = clipped.front();
+		for(auto &c : clipped) {
+			box.x1 = std::min(box.x1, c.x1);
+			box.y1 = std::min(box.y1, c.y1);
+			box.x2 = std::max(box.x2, c.x2);
+			box.y2 = std::max(box.y2, c.y2);
+		}
+		return {box};
+	}
+
+	return clipped;
+}
+
 uint32_t drm_core::convertLegacyFormat(uint32_t bpp, uint32_t depth) {
 	switch(bpp) {
 		case 8:
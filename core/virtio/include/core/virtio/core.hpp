@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <span>
 #include <vector>
 
 #include <arch/dma_structs.hpp>
@@ -58,6 +59,15 @@ enum {
 	PCI_L_DEVICE_SPECIFIC = 20
 };
 
+// Feature bits that are independent of the device type.
+// Except for VIRTIO_RING_F_INDIRECT_DESC, they are negotiated by the Transport.
+enum {
+	VIRTIO_RING_F_INDIRECT_DESC = 28,
+	VIRTIO_RING_F_EVENT_IDX = 29,
+	VIRTIO_F_VERSION_1 = 32,
+	VIRTIO_F_RING_PACKED = 34
+};
+
 // bits of the device status register
 enum {
 	ACKNOWLEDGE = 1,
@@ -71,9 +81,19 @@ enum {
 	// Bits of the spec::Descriptor::flags field.
 	VIRTQ_DESC_F_NEXT = 1, // descriptor is part of a chain
 	VIRTQ_DESC_F_WRITE = 2, // buffer is written by device
+	VIRTQ_DESC_F_INDIRECT = 4, // buffer contains a table of descriptors
+
+	// Additional bits of the spec::PackedDescriptor::flags field.
+	VIRTQ_DESC_F_AVAIL = 1 << 7,
+	VIRTQ_DESC_F_USED = 1 << 15,
 
 	// Bits of the spec::UsedRing::flags field.
-	VIRTQ_USED_F_NO_NOTIFY = 1 // no need to notify the device
+	VIRTQ_USED_F_NO_NOTIFY = 1, // no need to notify the device
+
+	// Values of the spec::EventSuppression::flags field.
+	RING_EVENT_FLAGS_ENABLE = 0,
+	RING_EVENT_FLAGS_DISABLE = 1,
+	RING_EVENT_FLAGS_DESC = 2 // only with VIRTIO_RING_F_EVENT_IDX
 };
 
 namespace spec {
@@ -121,6 +141,22 @@ namespace spec {
 
 		arch::scalar_variable<uint16_t> eventIndex;
 	};
+
+	// Descriptors of packed virtqs form a ring that is shared by driver and device.
+	struct PackedDescriptor {
+		arch::scalar_variable<uint64_t> address;
+		arch::scalar_variable<uint32_t> length;
+		arch::scalar_variable<uint16_t> id;
+		arch::scalar_variable<uint16_t> flags;
+	};
+	static_assert(sizeof(PackedDescriptor) == 16);
+
+	struct EventSuppression {
+		// Bits 0-14: ring offset, bit 15: wrap counter.
+		arch::scalar_variable<uint16_t> offsetWrap;
+		arch::scalar_variable<uint16_t> flags;
+	};
+	static_assert(sizeof(EventSuppression) == 4);
 };
 
 struct DeviceSpace;
@@ -165,6 +201,15 @@ struct Transport {
 	virtual Queue *setupQueue(unsigned int index) = 0;
 
 	virtual void runDevice() = 0;
+
+	// Lets a (bound) kernlet classify the buffers that the device returns on a receive virtq
+	// before the driver is woken up, see helClassifyIrqRx(). header_size is the size of
+	// the device's header in front of each frame. Queue::verdictOf() returns the verdicts.
+	// Returns false if the transport or virtq does not support this.
+	virtual bool classifyReceived(Queue *, helix::BorrowedDescriptor,
+			size_t, unsigned int) {
+		return false;
+	}
 };
 
 struct DeviceSpace {
@@ -237,6 +282,10 @@ struct Handle {
 
 	void setupLink(Handle other);
 
+	// Lets the descriptor refer to a table of indirect descriptors.
+	// The table must not cross a page boundary.
+	void setupIndirect(arch::dma_buffer_view table);
+
 private:
 	Queue *_queue;
 	size_t _tableIndex;
@@ -277,22 +326,82 @@ private:
 	Handle _back;
 };
 
+// Helper class to fill a table of indirect descriptors (VIRTIO_RING_F_INDIRECT_DESC).
+// A request that uses such a table only occupies a single descriptor of the virtq.
+// The table is owned by the caller and must stay alive until the request completes.
+struct IndirectChain {
+	IndirectChain(spec::Descriptor *table, size_t capacity)
+	: _table{table}, _capacity{capacity}, _size{0} { }
+
+	IndirectChain(const IndirectChain &) = delete;
+
+	IndirectChain &operator= (const IndirectChain &) = delete;
+
+	size_t size() {
+		return _size;
+	}
+
+	// Appends a descriptor to the table. Note the remarks on Handle::setupBuffer().
+	void setupBuffer(HostToDeviceType, arch::dma_buffer_view view);
+	void setupBuffer(DeviceToHostType, arch::dma_buffer_view view);
+
+	// Lets handle refer to the table. Call this after all buffers are set up.
+	void attach(Handle handle);
+
+private:
+	spec::Descriptor *_append(arch::dma_buffer_view view);
+
+	spec::Descriptor *_table;
+	size_t _capacity;
+	size_t _size;
+};
+
 // Helper functions that obtain descriptor from a queue as needed.
+// Each descriptor covers at most max_chunk bytes and does not cross a page boundary.
 async::result<void> scatterGather(HostToDeviceType, Chain &chain, Queue *queue,
-		arch::dma_buffer_view view);
+		arch::dma_buffer_view view, size_t max_chunk = SIZE_MAX);
 async::result<void> scatterGather(DeviceToHostType, Chain &chain, Queue *queue,
-		arch::dma_buffer_view view);
+		arch::dma_buffer_view view, size_t max_chunk = SIZE_MAX);
+
+// Same as above but for indirect tables.
+void scatterGather(HostToDeviceType, IndirectChain &chain,
+		arch::dma_buffer_view view, size_t max_chunk = SIZE_MAX);
+void scatterGather(DeviceToHostType, IndirectChain &chain,
+		arch::dma_buffer_view view, size_t max_chunk = SIZE_MAX);
 
 struct Request {
 	void (*complete)(Request *);
+	// Number of bytes that the device wrote to the buffers of the request.
+	// Set by processInterrupt() before complete() is called.
+	size_t written = 0;
+	// Index of the used ring entry that returned the request (split virtqs only).
+	// Set by processInterrupt() before complete() is called.
+	uint16_t usedIndex = 0;
+};
+
+// A request that the device has returned, see Queue::harvest().
+struct Completion {
+	Request *request;
+	// Number of bytes that the device wrote to the buffers of the request.
+	size_t written;
+	// Index of the used ring entry that returned the request (split virtqs only).
+	uint16_t usedIndex;
 };
 
 // Represents a single virtq.
+// Drivers use the same interface for split and packed virtqs: for packed virtqs,
+// descriptors are set up in a private table and copied to the ring on posting.
 struct Queue {
 	friend struct Handle;
 
+	// Constructs a virtq in the split layout.
 	Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *table,
-			spec::AvailableRing *available, spec::UsedRing *used);
+			spec::AvailableRing *available, spec::UsedRing *used, bool event_idx = false);
+
+	// Constructs a virtq in the packed layout (VIRTIO_F_RING_PACKED).
+	Queue(unsigned int queue_index, size_t queue_size, spec::PackedDescriptor *ring,
+			spec::EventSuppression *driver_event, spec::EventSuppression *device_event,
+			bool event_idx = false);
 protected:
 	~Queue() = default;
 
@@ -306,17 +415,34 @@ public:
 		return _queueSize;
 	}
 
+	bool isPacked() {
+		return _packed;
+	}
+
 	// Allocates a single descriptor.
 	// The descriptor is automatically freed when the device returns it.
+	// If no descriptor is free, this notifies the device of posted descriptors first.
 	async::result<Handle> obtainDescriptor();
 
+	// Allocates multiple descriptors at once; waits until enough descriptors are free.
+	// At most numDescriptors() descriptors can be allocated.
+	async::result<void> obtainDescriptors(std::span<Handle> descriptors);
+
 	// Posts a descriptor to the virtq's available ring.
+	// The device only sees the descriptor after the next call to notify();
+	// posting multiple chains before notifying saves notifications.
 	void postDescriptor(Handle descriptor, Request *request,
 			void (*complete)(Request *));
 
-	// Notifies the device that new descriptors have been posted.
+	// Notifies the device that new descriptors have been posted
+	// (unless the device suppresses the notification).
 	void notify();
 
+	// Posts multiple chains with a single update of the available ring
+	// and notifies the device once. All requests share the completion handler.
+	void postBatch(std::span<Handle> descriptors, std::span<Request *const> requests,
+			void (*complete)(Request *));
+
 	async::result<void> submitDescriptor(Handle descriptor) {
 		struct OneshotRequest : Request {
 			async::oneshot_event event;
@@ -334,25 +460,73 @@ public:
 	}
 
 	// Processes interrupts for this virtq.
-	// Calls retrieveDescriptor() to complete individual requests.
-	void processInterrupt();
+	// Harvests the used buffers in batches and calls the completion handlers.
+	// Completes at most budget requests; returns the number of completed requests.
+	size_t processInterrupt(size_t budget = SIZE_MAX);
+
+	// Frees the descriptors of up to completions.size() used buffers and stores
+	// their requests in completions, without calling the completion handlers.
+	// Returns the number of harvested requests.
+	size_t harvest(std::span<Completion> completions);
+
+	// Returns the verdict (kHelRxDeliver, kHelRxDrop or kHelRxSteer + n) that the kernel
+	// assigned to the buffer at the given used ring index, see Transport::classifyReceived().
+	// Buffers that were not classified are delivered.
+	unsigned int verdictOf(uint16_t used_index);
 
 protected:
 	virtual void notifyTransport() = 0;
 
+	// Called by transports once the kernel writes verdicts to this array.
+	void setVerdicts(const uint32_t *verdicts) {
+		_verdicts = verdicts;
+	}
+
 private:
+	void _initSoftwareState();
+
+	Handle _takeDescriptor();
+
+	void _postSplit(Handle handle);
+	void _postPacked(Handle handle);
+	// Copies a chain to the packed ring and returns the position of its head.
+	// The chain becomes available once the caller stores head_flags.
+	uint16_t _copyPacked(Handle handle, uint16_t &head_flags);
+
+	bool _needsKick();
+
+	// Whether the device has returned a buffer that we did not process yet.
+	bool _hasUsed();
+	// Advances past the next used buffer and returns its table index.
+	size_t _popUsed(size_t &written);
+	// Asks the device to interrupt once it returns the next buffer.
+	void _armInterrupt();
+
+	// Frees the descriptors of a chain and returns its request.
+	Request *_releaseChain(size_t table_index);
+
 	// Index of this queue as part of its owning device.
 	unsigned int _queueIndex;
 
 	// Number of descriptors in this queue.
 	size_t _queueSize;
 
+	bool _packed;
+	// Whether VIRTIO_RING_F_EVENT_IDX was negotiated.
+	bool _eventIdx;
+
 	// Pointers to different data structures of this virtq.
+	// For packed virtqs, _table is private to the driver.
 	spec::Descriptor *_table;
-	spec::AvailableRing *_availableRing;
-	spec::UsedRing *_usedRing;
-	spec::AvailableExtra *_availableExtra;
-	spec::UsedExtra *_usedExtra;
+	spec::AvailableRing *_availableRing = nullptr;
+	spec::UsedRing *_usedRing = nullptr;
+	spec::AvailableExtra *_availableExtra = nullptr;
+	spec::UsedExtra *_usedExtra = nullptr;
+
+	// Data structures of packed virtqs.
+	spec::PackedDescriptor *_ring = nullptr;
+	spec::EventSuppression *_driverEvent = nullptr;
+	spec::EventSuppression *_deviceEvent = nullptr;
 
 	// Keeps track of unused descriptor indices.
 	std::vector<uint16_t> _descriptorStack;
@@ -361,8 +535,22 @@ private:
 
 	std::vector<Request *> _activeRequests;
 
+	// Verdict entries that the kernel writes, see verdictOf().
+	const uint32_t *_verdicts = nullptr;
+
 	// Keeps track of which entries in the used ring have already been processed.
-	uint16_t _progressHead;
+	uint16_t _progressHead = 0;
+
+	// Ring positions and wrap counters of packed virtqs.
+	uint16_t _availIndex = 0;
+	bool _availWrap = true;
+	uint16_t _usedIndex = 0;
+	bool _usedWrap = true;
+	// Number of ring entries of each chain, indexed by the buffer ID (= table index of the head).
+	std::vector<uint16_t> _chainLengths;
+
+	// Number of chains (split) or descriptors (packed) posted since the last notification.
+	uint16_t _numPosted = 0;
 };
 
 } // namespace virtio_core
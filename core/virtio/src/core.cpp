@@ -1,4 +1,5 @@
 
+#include <algorithm>
 #include <assert.h>
 #include <iostream>
 #include <optional>
@@ -9,6 +10,12 @@
 
 namespace virtio_core {
 
+namespace {
+	// Maximal number of requests that are completed per queue and MSI.
+	// If a queue exhausts this budget, we ask the kernel to poll the MSI.
+	constexpr size_t queueMsiBudget = 64;
+}
+
 struct Mapping {
 	static constexpr size_t pageSize = 0x1000;
 
@@ -106,13 +113,17 @@ private:
 	arch::io_space _legacySpace;
 	helix::UniqueDescriptor _irq;
 
+	// Whether VIRTIO_RING_F_EVENT_IDX was negotiated.
+	bool _eventIdx = false;
+
 	std::vector<std::unique_ptr<LegacyPciQueue>> _queues;
 };
 
 struct LegacyPciQueue final : Queue {
 	LegacyPciQueue(LegacyPciTransport *transport,
 			unsigned int queue_index, size_t queue_size,
-			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used);
+			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
+			bool event_idx);
 
 protected:
 	void notifyTransport() override;
@@ -154,7 +165,11 @@ void LegacyPciTransport::acknowledgeDriverFeature(unsigned int feature) {
 }
 
 void LegacyPciTransport::finalizeFeatures() {
-	// Does nothing for now.
+	// Legacy devices do not know packed virtqs.
+	if(checkDeviceFeature(VIRTIO_RING_F_EVENT_IDX)) {
+		acknowledgeDriverFeature(VIRTIO_RING_F_EVENT_IDX);
+		_eventIdx = true;
+	}
 }
 
 void LegacyPciTransport::claimQueues(unsigned int max_index) {
@@ -199,7 +214,7 @@ Queue *LegacyPciTransport::setupQueue(unsigned int queue_index) {
 	auto available = reinterpret_cast<spec::AvailableRing *>((char *)window + available_offset);
 	auto used = reinterpret_cast<spec::UsedRing *>((char *)window + used_offset);
 	_queues[queue_index] = std::make_unique<LegacyPciQueue>(this, queue_index, queue_size,
-			table, available, used);
+			table, available, used, _eventIdx);
 
 	// Hand the queue to the device.
 	uintptr_t table_physical;
@@ -244,14 +259,17 @@ async::detached LegacyPciTransport::_processIrqs() {
 		}
 		if(isr & 1)
 			for(auto &queue : _queues)
-				queue->processInterrupt();
+				if(queue)
+					queue->processInterrupt();
 	}
 }
 
 LegacyPciQueue::LegacyPciQueue(LegacyPciTransport *transport,
 		unsigned int queue_index, size_t queue_size,
-		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used)
-: Queue{queue_index, queue_size, table, available, used}, _transport{transport} { }
+		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
+		bool event_idx)
+: Queue{queue_index, queue_size, table, available, used, event_idx},
+		_transport{transport} { }
 
 void LegacyPciQueue::notifyTransport() {
 	_transport->_legacySpace.store(PCI_L_QUEUE_NOTIFY, queueIndex());
@@ -296,6 +314,9 @@ struct StandardPciTransport : Transport {
 
 	void runDevice() override;
 
+	bool classifyReceived(Queue *queue, helix::BorrowedDescriptor kernlet,
+			size_t header_size, unsigned int wake_threshold) override;
+
 private:
 	arch::mem_space _commonSpace() { return arch::mem_space{_commonMapping.get()}; }
 	arch::mem_space _notifySpace() { return arch::mem_space{_notifyMapping.get()}; }
@@ -315,6 +336,9 @@ private:
 	helix::UniqueDescriptor _irq;
 	helix::UniqueDescriptor _queueMsi;
 
+	// Ring features that were negotiated by finalizeFeatures().
+	bool _eventIdx = false;
+	bool _packed = false;
 
 	std::vector<std::unique_ptr<StandardPciQueue>> _queues;
 };
@@ -323,7 +347,22 @@ struct StandardPciQueue final : Queue {
 	StandardPciQueue(StandardPciTransport *transport,
 			unsigned int queue_index, size_t queue_size,
 			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
-			arch::scalar_register<uint16_t> notify_register);
+			bool event_idx, arch::scalar_register<uint16_t> notify_register);
+
+	StandardPciQueue(StandardPciTransport *transport,
+			unsigned int queue_index, size_t queue_size, spec::PackedDescriptor *ring,
+			spec::EventSuppression *driver_event, spec::EventSuppression *device_event,
+			bool event_idx, arch::scalar_register<uint16_t> notify_register);
+
+	// Memory that holds the rings and the layout of split virtqs within it.
+	// Only set if there is room for the verdicts of the kernel's RX classification.
+	helix::UniqueDescriptor ringMemory;
+	char *ringWindow = nullptr;
+	size_t usedOffset = 0;
+	size_t eventOffset = 0;
+	size_t verdictOffset = 0;
+
+	using Queue::setVerdicts;
 
 protected:
 	void notifyTransport() override;
@@ -371,8 +410,18 @@ void StandardPciTransport::acknowledgeDriverFeature(unsigned int feature) {
 }
 
 void StandardPciTransport::finalizeFeatures() {
-	assert(checkDeviceFeature(32));
-	acknowledgeDriverFeature(32);
+	assert(checkDeviceFeature(VIRTIO_F_VERSION_1));
+	acknowledgeDriverFeature(VIRTIO_F_VERSION_1);
+
+	// Queue implements these features transparently for all drivers.
+	if(checkDeviceFeature(VIRTIO_RING_F_EVENT_IDX)) {
+		acknowledgeDriverFeature(VIRTIO_RING_F_EVENT_IDX);
+		_eventIdx = true;
+	}
+	if(checkDeviceFeature(VIRTIO_F_RING_PACKED)) {
+		acknowledgeDriverFeature(VIRTIO_F_RING_PACKED);
+		_packed = true;
+	}
 
 	_commonSpace().store(PCI_DEVICE_STATUS, _commonSpace().load(PCI_DEVICE_STATUS) | FEATURES_OK);
 	auto confirm = _commonSpace().load(PCI_DEVICE_STATUS);
@@ -392,21 +441,28 @@ Queue *StandardPciTransport::setupQueue(unsigned int queue_index) {
 	auto notify_index = _commonSpace().load(PCI_QUEUE_NOTIFY);
 	assert(queue_size);
 
-	// TODO: Ensure that the queue size is indeed a power of 2.
+	// TODO: Ensure that the queue size is indeed a power of 2 (for split virtqs).
 
-	// Determine the queue size in bytes.
+	// Determine the queue size in bytes. For packed virtqs, the "available" and "used"
+	// areas are the driver and device event suppression structures.
 	constexpr size_t available_align = 2;
 	constexpr size_t used_align = 4;
 
-	auto available_offset = (queue_size * sizeof(spec::Descriptor)
-				+ (available_align - 1))
-			& ~size_t(available_align - 1);
-	auto used_offset = (available_offset + queue_size * sizeof(spec::AvailableRing::Element)
-				+ sizeof(spec::AvailableExtra) + (used_align - 1))
-			& ~size_t(used_align - 1);
-
-	auto region_size = used_offset + queue_size * sizeof(spec::UsedRing::Element)
-				+ sizeof(spec::UsedExtra);
+	size_t available_offset, used_offset, region_size;
+	if(_packed) {
+		available_offset = queue_size * sizeof(spec::PackedDescriptor);
+		used_offset = available_offset + sizeof(spec::EventSuppression);
+		region_size = used_offset + sizeof(spec::EventSuppression);
+	}else{
+		available_offset = (queue_size * sizeof(spec::Descriptor)
+					+ (available_align - 1))
+				& ~size_t(available_align - 1);
+		used_offset = (available_offset + queue_size * sizeof(spec::AvailableRing::Element)
+					+ sizeof(spec::AvailableExtra) + (used_align - 1))
+				& ~size_t(used_align - 1);
+		region_size = used_offset + queue_size * sizeof(spec::UsedRing::Element)
+					+ sizeof(spec::UsedExtra);
+	}
 
 	// Allocate physical memory for the virtq structs.
 	assert(region_size < 0x4000); // FIXME: do not hardcode 0x4000
@@ -415,15 +471,38 @@ Queue *StandardPciTransport::setupQueue(unsigned int queue_index) {
 	HEL_CHECK(helAllocateMemory(0x4000, kHelAllocContinuous, nullptr, &memory));
 	HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr,
 			0, 0x4000, kHelMapProtRead | kHelMapProtWrite, &window));
-	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, memory));
+	helix::UniqueDescriptor ring_memory{memory};
 
 	// Setup the memory region.
-	auto table = reinterpret_cast<spec::Descriptor *>((char *)window);
-	auto available = reinterpret_cast<spec::AvailableRing *>((char *)window + available_offset);
-	auto used = reinterpret_cast<spec::UsedRing *>((char *)window + used_offset);
-	_queues[queue_index] = std::make_unique<StandardPciQueue>(this, queue_index, queue_size,
-			table, available, used,
-			arch::scalar_register<uint16_t>{_notifyMultiplier * notify_index});
+	auto table = (char *)window;
+	auto available = (char *)window + available_offset;
+	auto used = (char *)window + used_offset;
+	arch::scalar_register<uint16_t> notify_register{_notifyMultiplier * notify_index};
+	if(_packed) {
+		_queues[queue_index] = std::make_unique<StandardPciQueue>(this, queue_index, queue_size,
+				reinterpret_cast<spec::PackedDescriptor *>(table),
+				reinterpret_cast<spec::EventSuppression *>(available),
+				reinterpret_cast<spec::EventSuppression *>(used),
+				_eventIdx, notify_register);
+	}else{
+		_queues[queue_index] = std::make_unique<StandardPciQueue>(this, queue_index, queue_size,
+				reinterpret_cast<spec::Descriptor *>(table),
+				reinterpret_cast<spec::AvailableRing *>(available),
+				reinterpret_cast<spec::UsedRing *>(used),
+				_eventIdx, notify_register);
+
+		// The kernel's verdicts (see classifyReceived()) follow the rings.
+		auto verdict_offset = (region_size + 3) & ~size_t(3);
+		if(verdict_offset + queue_size * sizeof(uint32_t) <= 0x4000) {
+			auto queue = _queues[queue_index].get();
+			queue->ringMemory = std::move(ring_memory);
+			queue->ringWindow = static_cast<char *>(window);
+			queue->usedOffset = used_offset;
+			queue->eventOffset = available_offset + queue_size * sizeof(spec::AvailableRing::Element)
+					+ offsetof(spec::AvailableExtra, eventIndex);
+			queue->verdictOffset = verdict_offset;
+		}
+	}
 
 	// Hand the queue to the device.
 	uintptr_t table_physical, available_physical, used_physical;
@@ -458,6 +537,34 @@ void StandardPciTransport::runDevice() {
 	_processIrqs();
 }
 
+bool StandardPciTransport::classifyReceived(Queue *base_queue, helix::BorrowedDescriptor kernlet,
+		size_t header_size, unsigned int wake_threshold) {
+	// Without MSI-X, IRQs are handled by a kernlet that already wakes us up.
+	auto queue = static_cast<StandardPciQueue *>(base_queue);
+	assert(_queues[queue->queueIndex()].get() == queue);
+	if(!_useMsi || _packed || !queue->ringMemory)
+		return false;
+
+	// Zero entries deliver the buffer, no matter which used index they are compared to.
+	auto verdicts = reinterpret_cast<uint32_t *>(queue->ringWindow + queue->verdictOffset);
+	memset(verdicts, 0, queue->numDescriptors() * sizeof(uint32_t));
+	queue->setVerdicts(verdicts);
+
+	HelRxRing ring{};
+	ring.format = kHelRxRingVirtqSplit;
+	ring.flags = _eventIdx ? kHelRxRingEventIndex : 0;
+	ring.memory = queue->ringMemory.getHandle();
+	ring.numDescriptors = queue->numDescriptors();
+	ring.tableOffset = 0;
+	ring.usedOffset = queue->usedOffset;
+	ring.eventOffset = queue->eventOffset;
+	ring.verdictOffset = queue->verdictOffset;
+	ring.headerSize = header_size;
+	ring.wakeThreshold = wake_threshold;
+	HEL_CHECK(helClassifyIrqRx(_queueMsi.getHandle(), kernlet.getHandle(), &ring));
+	return true;
+}
+
 async::detached StandardPciTransport::_processIrqs() {
 #ifdef __x86_64__ // TODO: implement kernlet compilation for aarch64
 	co_await connectKernletCompiler();
@@ -525,7 +632,8 @@ async::detached StandardPciTransport::_processIrqs() {
 
 		if(await.bitset() & 1)
 			for(auto &queue : _queues)
-				queue->processInterrupt();
+				if(queue)
+					queue->processInterrupt();
 	}
 #else
 	co_await _hwDevice.enableBusIrq();
@@ -557,7 +665,8 @@ async::detached StandardPciTransport::_processIrqs() {
 
 		if(isr & 1)
 			for(auto &queue : _queues)
-				queue->processInterrupt();
+				if(queue)
+					queue->processInterrupt();
 	}
 #endif
 }
@@ -569,18 +678,41 @@ async::detached StandardPciTransport::_processQueueMsi() {
 		HEL_CHECK(await.error());
 		sequence = await.sequence();
 
-		HEL_CHECK(helAcknowledgeIrq(_queueMsi.getHandle(), kHelAckAcknowledge, sequence));
+		bool anyProgress = false;
+		bool exhausted = false;
+		for(auto &queue : _queues) {
+			if(!queue)
+				continue;
+			auto progress = queue->processInterrupt(queueMsiBudget);
+			if(progress)
+				anyProgress = true;
+			if(progress == queueMsiBudget)
+				exhausted = true;
+		}
 
-		for(auto &queue : _queues)
-			queue->processInterrupt();
+		// Let the kernel switch to polled mode while we find work.
+		uint32_t flags = kHelAckAcknowledge;
+		if(exhausted) {
+			flags |= kHelAckPollNow;
+		}else if(anyProgress) {
+			flags |= kHelAckPoll;
+		}
+		HEL_CHECK(helAcknowledgeIrq(_queueMsi.getHandle(), flags, sequence));
 	}
 }
 
 StandardPciQueue::StandardPciQueue(StandardPciTransport *transport,
 		unsigned int queue_index, size_t queue_size,
 		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
-		arch::scalar_register<uint16_t> notify_register)
-: Queue{queue_index, queue_size, table, available, used},
+		bool event_idx, arch::scalar_register<uint16_t> notify_register)
+: Queue{queue_index, queue_size, table, available, used, event_idx},
+		_transport{transport}, _notifyRegister{notify_register} { }
+
+StandardPciQueue::StandardPciQueue(StandardPciTransport *transport,
+		unsigned int queue_index, size_t queue_size, spec::PackedDescriptor *ring,
+		spec::EventSuppression *driver_event, spec::EventSuppression *device_event,
+		bool event_idx, arch::scalar_register<uint16_t> notify_register)
+: Queue{queue_index, queue_size, ring, driver_event, device_event, event_idx},
 		_transport{transport}, _notifyRegister{notify_register} { }
 
 void StandardPciQueue::notifyTransport() {
@@ -732,13 +864,97 @@ void Handle::setupLink(Handle other) {
 	descriptor->flags.store(descriptor->flags.load() | VIRTQ_DESC_F_NEXT);
 }
 
+void Handle::setupIndirect(arch::dma_buffer_view table) {
+	assert(table.size() && !(table.size() % sizeof(spec::Descriptor)));
+
+	// Packed virtqs expect indirect tables in their own format: entries are
+	// consecutive, and the flags are stored where the split format has next.
+	if(_queue->_packed) {
+		auto entries = reinterpret_cast<spec::Descriptor *>(table.data());
+		auto packed_entries = reinterpret_cast<spec::PackedDescriptor *>(table.data());
+		for(size_t i = 0; i < table.size() / sizeof(spec::Descriptor); i++) {
+			uint16_t flags = entries[i].flags.load() & VIRTQ_DESC_F_WRITE;
+			packed_entries[i].id.store(0);
+			packed_entries[i].flags.store(flags);
+		}
+	}
+
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(table.data(), &physical));
+
+	auto descriptor = _queue->_table + _tableIndex;
+	descriptor->address.store(physical);
+	descriptor->length.store(table.size());
+	descriptor->flags.store(VIRTQ_DESC_F_INDIRECT);
+}
+
+// --------------------------------------------------------
+// IndirectChain
+// --------------------------------------------------------
+
+spec::Descriptor *IndirectChain::_append(arch::dma_buffer_view view) {
+	assert(view.size());
+	assert(_size < _capacity);
+
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(view.data(), &physical));
+
+	if(_size) {
+		auto previous = _table + _size - 1;
+		previous->next.store(_size);
+		previous->flags.store(previous->flags.load() | VIRTQ_DESC_F_NEXT);
+	}
+
+	auto descriptor = _table + _size++;
+	descriptor->address.store(physical);
+	descriptor->length.store(view.size());
+	descriptor->flags.store(0);
+	descriptor->next.store(0);
+	return descriptor;
+}
+
+void IndirectChain::setupBuffer(HostToDeviceType, arch::dma_buffer_view view) {
+	_append(view);
+}
+
+void IndirectChain::setupBuffer(DeviceToHostType, arch::dma_buffer_view view) {
+	auto descriptor = _append(view);
+	descriptor->flags.store(descriptor->flags.load() | VIRTQ_DESC_F_WRITE);
+}
+
+void IndirectChain::attach(Handle handle) {
+	handle.setupIndirect(arch::dma_buffer_view{nullptr, _table,
+			_size * sizeof(spec::Descriptor)});
+}
+
+// --------------------------------------------------------
+// scatterGather()
+// --------------------------------------------------------
+
+namespace {
+	// Calls fn for each chunk of the view that does not cross a page boundary.
+	template<typename F>
+	void forEachChunk(arch::dma_buffer_view view, size_t max_chunk, F fn) {
+		constexpr size_t page_size = 0x1000;
+		size_t offset = 0;
+		while(offset < view.size()) {
+			auto address = reinterpret_cast<uintptr_t>(view.data()) + offset;
+			auto chunk = std::min({view.size() - offset,
+					page_size - (address & (page_size - 1)), max_chunk});
+			fn(view.subview(offset, chunk));
+			offset += chunk;
+		}
+	}
+}
+
 async::result<void> scatterGather(HostToDeviceType, Chain &chain, Queue *queue,
-		arch::dma_buffer_view view) {
+		arch::dma_buffer_view view, size_t max_chunk) {
 	constexpr size_t page_size = 0x1000;
 	size_t offset = 0;
 	while(offset < view.size()) {
 		auto address = reinterpret_cast<uintptr_t>(view.data()) + offset;
-		auto chunk = std::min(view.size() - offset, page_size - (address & (page_size - 1)));
+		auto chunk = std::min({view.size() - offset,
+				page_size - (address & (page_size - 1)), max_chunk});
 		chain.append(co_await queue->obtainDescriptor());
 		chain.setupBuffer(hostToDevice, view.subview(offset, chunk));
 		offset += chunk;
@@ -746,25 +962,56 @@ async::result<void> scatterGather(HostToDeviceType, Chain &chain, Queue *queue,
 }
 
 async::result<void> scatterGather(DeviceToHostType, Chain &chain, Queue *queue,
-		arch::dma_buffer_view view) {
+		arch::dma_buffer_view view, size_t max_chunk) {
 	constexpr size_t page_size = 0x1000;
 	size_t offset = 0;
 	while(offset < view.size()) {
 		auto address = reinterpret_cast<uintptr_t>(view.data()) + offset;
-		auto chunk = std::min(view.size() - offset, page_size - (address & (page_size - 1)));
+		auto chunk = std::min({view.size() - offset,
+				page_size - (address & (page_size - 1)), max_chunk});
 		chain.append(co_await queue->obtainDescriptor());
 		chain.setupBuffer(deviceToHost, view.subview(offset, chunk));
 		offset += chunk;
 	}
 }
 
+void scatterGather(HostToDeviceType, IndirectChain &chain,
+		arch::dma_buffer_view view, size_t max_chunk) {
+	forEachChunk(view, max_chunk, [&] (arch::dma_buffer_view chunk) {
+		chain.setupBuffer(hostToDevice, chunk);
+	});
+}
+
+void scatterGather(DeviceToHostType, IndirectChain &chain,
+		arch::dma_buffer_view view, size_t max_chunk) {
+	forEachChunk(view, max_chunk, [&] (arch::dma_buffer_view chunk) {
+		chain.setupBuffer(deviceToHost, chunk);
+	});
+}
+
 // --------------------------------------------------------
 // Queue
 // --------------------------------------------------------
 
+namespace {
+	// Orders the stores to the ring before the loads that decide about notifications.
+	void fullBarrier() {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+
+	// Whether the index event_idx was passed when moving from old_idx to new_idx.
+	bool needsEvent(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+		return static_cast<uint16_t>(new_idx - event_idx - 1)
+				< static_cast<uint16_t>(new_idx - old_idx);
+	}
+
+	// Number of used buffers that processInterrupt() harvests at once.
+	constexpr size_t harvestBatch = 16;
+}
+
 Queue::Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *table,
-		spec::AvailableRing *available, spec::UsedRing *used)
-: _queueIndex{queue_index}, _queueSize{queue_size}, _progressHead{0} {
+		spec::AvailableRing *available, spec::UsedRing *used, bool event_idx)
+: _queueIndex{queue_index}, _queueSize{queue_size}, _packed{false}, _eventIdx{event_idx} {
 	// Construct the hardware state.
 	_table = new (table) spec::Descriptor[_queueSize];
 	_availableRing = new (available) spec::AvailableRing;
@@ -787,29 +1034,83 @@ Queue::Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *tabl
 		_usedRing->elements[i].tableIndex.store(0xFFFF);
 	_usedExtra->eventIndex.store(0);
 
-	// Construct the software state.
+	_initSoftwareState();
+}
+
+Queue::Queue(unsigned int queue_index, size_t queue_size, spec::PackedDescriptor *ring,
+		spec::EventSuppression *driver_event, spec::EventSuppression *device_event,
+		bool event_idx)
+: _queueIndex{queue_index}, _queueSize{queue_size}, _packed{true}, _eventIdx{event_idx} {
+	assert(_queueSize < 0x8000);
+
+	// Construct the hardware state. Zeroed flags mark all descriptors as unavailable.
+	_ring = new (ring) spec::PackedDescriptor[_queueSize];
+	_driverEvent = new (driver_event) spec::EventSuppression;
+	_deviceEvent = new (device_event) spec::EventSuppression;
+
+	for(size_t i = 0; i < _queueSize; i++) {
+		_ring[i].address.store(0);
+		_ring[i].length.store(0);
+		_ring[i].id.store(0xFFFF);
+		_ring[i].flags.store(0);
+	}
+
+	// With event indices, we ask for an interrupt on the first used buffer.
+	// Otherwise, we always want interrupts.
+	if(_eventIdx) {
+		_driverEvent->offsetWrap.store(1 << 15);
+		_driverEvent->flags.store(RING_EVENT_FLAGS_DESC);
+	}else{
+		_driverEvent->offsetWrap.store(0);
+		_driverEvent->flags.store(RING_EVENT_FLAGS_ENABLE);
+	}
+
+	// Descriptors are set up in this table first and copied to the ring by postDescriptor().
+	_table = new spec::Descriptor[_queueSize];
+	_chainLengths.resize(_queueSize);
+
+	_initSoftwareState();
+}
+
+void Queue::_initSoftwareState() {
 	for(size_t i = 0; i < _queueSize; i++)
 		_descriptorStack.push_back(i);
 	_activeRequests.resize(_queueSize);
 }
 
 async::result<Handle> Queue::obtainDescriptor() {
-	while(true) {
-		if(_descriptorStack.empty()) {
-			co_await _descriptorDoorbell.async_wait();
-			continue;
-		}
-
-		size_t table_index = _descriptorStack.back();
-		_descriptorStack.pop_back();
+	while(_descriptorStack.empty()) {
+		// Descriptors are only freed once the device has seen them.
+		if(_numPosted)
+			notify();
+		co_await _descriptorDoorbell.async_wait();
+	}
 
-		auto descriptor = _table + table_index;
-		descriptor->address.store(0);
-		descriptor->length.store(0);
-		descriptor->flags.store(0);
+	co_return _takeDescriptor();
+}
 
-		co_return Handle{this, table_index};
+async::result<void> Queue::obtainDescriptors(std::span<Handle> descriptors) {
+	assert(descriptors.size() <= _queueSize);
+	while(_descriptorStack.size() < descriptors.size()) {
+		if(_numPosted)
+			notify();
+		co_await _descriptorDoorbell.async_wait();
 	}
+
+	for(auto &handle : descriptors)
+		handle = _takeDescriptor();
+}
+
+Handle Queue::_takeDescriptor() {
+	size_t table_index = _descriptorStack.back();
+	_descriptorStack.pop_back();
+
+	auto descriptor = _table + table_index;
+	descriptor->address.store(0);
+	descriptor->length.store(0);
+	descriptor->flags.store(0);
+
+	return Handle{this, table_index};
 }
 
 void Queue::postDescriptor(Handle handle, Request *request,
@@ -820,53 +1121,264 @@ void Queue::postDescriptor(Handle handle, Request *request,
 	assert(!_activeRequests[handle.tableIndex()]);
 	_activeRequests[handle.tableIndex()] = request;
 
+	if(_packed) {
+		_postPacked(handle);
+	}else{
+		_postSplit(handle);
+	}
+}
+
+void Queue::_postSplit(Handle handle) {
 	auto enqueue_head = _availableRing->headIndex.load();
 	auto ring_index = enqueue_head & (_queueSize - 1);
 	_availableRing->elements[ring_index].tableIndex.store(handle.tableIndex());
 
 	asm volatile ( "" : : : "memory" );
 	_availableRing->headIndex.store(enqueue_head + 1);
+	_numPosted++;
 }
 
-void Queue::notify() {
-	asm volatile ( "" : : : "memory" );
-	if(!(_usedRing->flags.load() & VIRTQ_USED_F_NO_NOTIFY))
-		notifyTransport();
+void Queue::postBatch(std::span<Handle> descriptors, std::span<Request *const> requests,
+		void (*complete)(Request *)) {
+	assert(descriptors.size() == requests.size());
+	if(descriptors.empty())
+		return;
+
+	for(size_t i = 0; i < descriptors.size(); i++) {
+		auto request = requests[i];
+		assert(request);
+		request->complete = complete;
+
+		auto table_index = descriptors[i].tableIndex();
+		assert(!_activeRequests[table_index]);
+		_activeRequests[table_index] = request;
+	}
+
+	if(_packed) {
+		// The device processes the ring in order; once it sees the first head,
+		// all following chains are already available.
+		uint16_t first_flags;
+		auto first_position = _copyPacked(descriptors[0], first_flags);
+		for(size_t i = 1; i < descriptors.size(); i++) {
+			uint16_t head_flags;
+			auto head_position = _copyPacked(descriptors[i], head_flags);
+			_ring[head_position].flags.store(head_flags);
+		}
+
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		_ring[first_position].flags.store(first_flags);
+	}else{
+		auto enqueue_head = _availableRing->headIndex.load();
+		for(size_t i = 0; i < descriptors.size(); i++) {
+			auto ring_index = (enqueue_head + i) & (_queueSize - 1);
+			_availableRing->elements[ring_index].tableIndex.store(
+					descriptors[i].tableIndex());
+		}
+
+		asm volatile ( "" : : : "memory" );
+		_availableRing->headIndex.store(enqueue_head + descriptors.size());
+		_numPosted += descriptors.size();
+	}
+
+	notify();
+}
+
+void Queue::_postPacked(Handle handle) {
+	uint16_t head_flags;
+	auto head_position = _copyPacked(handle, head_flags);
+
+	// The flags of the head make the whole chain available; write them last.
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	_ring[head_position].flags.store(head_flags);
 }
 
-void Queue::processInterrupt() {
+uint16_t Queue::_copyPacked(Handle handle, uint16_t &head_flags) {
+	auto head = handle.tableIndex();
+	auto head_position = _availIndex;
+	head_flags = 0;
+
+	// Copy the chain to consecutive ring entries. Since the chains in the ring
+	// never use more descriptors than the table has, the ring cannot overflow.
+	uint16_t length = 0;
+	auto table_index = head;
 	while(true) {
-		auto used_head = _usedRing->headIndex.load();
+		auto &source = _table[table_index];
+		auto source_flags = source.flags.load();
+
+		uint16_t flags = source_flags
+				& (VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_INDIRECT);
+		flags |= _availWrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+
+		auto &target = _ring[_availIndex];
+		target.address.store(source.address.load());
+		target.length.store(source.length.load());
+		target.id.store(head);
+		if(length) {
+			target.flags.store(flags);
+		}else{
+			head_flags = flags;
+		}
+		length++;
+
+		if(++_availIndex == _queueSize) {
+			_availIndex = 0;
+			_availWrap = !_availWrap;
+		}
 
-		if((_progressHead & 0xFFFF) == used_head)
+		if(!(source_flags & VIRTQ_DESC_F_NEXT))
 			break;
+		table_index = source.next.load();
+	}
+	_chainLengths[head] = length;
+	_numPosted += length;
+	return head_position;
+}
 
-		asm volatile ( "" : : : "memory" );
+void Queue::notify() {
+	fullBarrier();
+	if(!_numPosted)
+		return;
+	bool kick = _needsKick();
+	_numPosted = 0;
+	if(kick)
+		notifyTransport();
+}
+
+bool Queue::_needsKick() {
+	if(!_packed) {
+		auto new_head = _availableRing->headIndex.load();
+		if(_eventIdx)
+			return needsEvent(_usedExtra->eventIndex.load(), new_head,
+					new_head - _numPosted);
+		return !(_usedRing->flags.load() & VIRTQ_USED_F_NO_NOTIFY);
+	}
+
+	auto flags = _deviceEvent->flags.load();
+	if(flags == RING_EVENT_FLAGS_DISABLE)
+		return false;
+	if(flags != RING_EVENT_FLAGS_DESC || !_eventIdx)
+		return true;
+
+	// Event offsets from the previous lap are relative to the start of that lap.
+	auto offset_wrap = _deviceEvent->offsetWrap.load();
+	uint16_t event_index = offset_wrap & 0x7FFF;
+	if(static_cast<bool>(offset_wrap >> 15) != _availWrap)
+		event_index -= _queueSize;
+	return needsEvent(event_index, _availIndex, _availIndex - _numPosted);
+}
+
+bool Queue::_hasUsed() {
+	if(!_packed)
+		return _progressHead != _usedRing->headIndex.load();
 
+	auto flags = _ring[_usedIndex].flags.load();
+	bool avail = flags & VIRTQ_DESC_F_AVAIL;
+	bool used = flags & VIRTQ_DESC_F_USED;
+	return avail == used && used == _usedWrap;
+}
+
+size_t Queue::_popUsed(size_t &written) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if(!_packed) {
 		auto ring_index = _progressHead & (_queueSize - 1);
 		auto table_index = _usedRing->elements[ring_index].tableIndex.load();
 		assert(table_index < _queueSize);
+		written = _usedRing->elements[ring_index].written.load();
+		_progressHead++;
+		return table_index;
+	}
 
-		// Dequeue the Request object.
-		auto request = _activeRequests[table_index];
-		assert(request);
-		_activeRequests[table_index] = nullptr;
-
-		// Free all descriptors in the descriptor chain.
-		auto chain_index = table_index;
-		while(_table[chain_index].flags.load() & VIRTQ_DESC_F_NEXT) {
-			auto successor = _table[chain_index].next.load();
-			_descriptorStack.push_back(chain_index);
-			chain_index = successor;
-		}
+	// The device writes one used descriptor per chain but skips the whole chain.
+	size_t table_index = _ring[_usedIndex].id.load();
+	assert(table_index < _queueSize);
+	written = _ring[_usedIndex].length.load();
+	_usedIndex += _chainLengths[table_index];
+	if(_usedIndex >= _queueSize) {
+		_usedIndex -= _queueSize;
+		_usedWrap = !_usedWrap;
+	}
+	return table_index;
+}
+
+void Queue::_armInterrupt() {
+	if(_packed) {
+		_driverEvent->offsetWrap.store(static_cast<uint16_t>(_usedIndex | (_usedWrap << 15)));
+	}else{
+		_availableExtra->eventIndex.store(_progressHead);
+	}
+	fullBarrier();
+}
+
+Request *Queue::_releaseChain(size_t table_index) {
+	// Dequeue the Request object.
+	auto request = _activeRequests[table_index];
+	assert(request);
+	_activeRequests[table_index] = nullptr;
+
+	// Free all descriptors in the descriptor chain.
+	auto chain_index = table_index;
+	while(_table[chain_index].flags.load() & VIRTQ_DESC_F_NEXT) {
+		auto successor = _table[chain_index].next.load();
 		_descriptorStack.push_back(chain_index);
+		chain_index = successor;
+	}
+	_descriptorStack.push_back(chain_index);
+	return request;
+}
+
+size_t Queue::harvest(std::span<Completion> completions) {
+	size_t n = 0;
+	while(n < completions.size()) {
+		if(!_hasUsed()) {
+			if(!_eventIdx)
+				break;
+
+			// Ask for an interrupt on the next used buffer. The device might have
+			// returned that buffer before it saw our request, so check again.
+			_armInterrupt();
+			if(!_hasUsed())
+				break;
+		}
+
+		size_t written;
+		auto used_index = _progressHead;
+		auto table_index = _popUsed(written);
+		completions[n++] = Completion{_releaseChain(table_index), written, used_index};
+	}
+
+	if(n)
 		_descriptorDoorbell.raise();
+	return n;
+}
 
-		// Call the completion handler.
-		request->complete(request);
+unsigned int Queue::verdictOf(uint16_t used_index) {
+	if(!_verdicts)
+		return kHelRxDeliver;
 
-		_progressHead++;
+	// Entries that were written for an earlier pass over the ring are stale.
+	auto entry = __atomic_load_n(&_verdicts[used_index & (_queueSize - 1)], __ATOMIC_ACQUIRE);
+	if((entry >> 16) != used_index)
+		return kHelRxDeliver;
+	return entry & kHelRxVerdictMask;
+}
+
+size_t Queue::processInterrupt(size_t budget) {
+	Completion completions[harvestBatch];
+	size_t progress = 0;
+	while(progress < budget) {
+		auto limit = std::min(budget - progress, harvestBatch);
+		auto n = harvest({completions, limit});
+		for(size_t i = 0; i < n; i++) {
+			completions[i].request->written = completions[i].written;
+			completions[i].request->usedIndex = completions[i].usedIndex;
+			completions[i].request->complete(completions[i].request);
+		}
+		progress += n;
+		if(n < limit)
+			break;
 	}
+	return progress;
 }
 
 } // namespace virtio_core
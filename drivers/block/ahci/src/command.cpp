@@ -9,31 +9,35 @@
 
 namespace {
 	constexpr bool logCommands = false;
-}
 
-Command::Command(uint64_t sector, size_t numSectors, size_t numBytes, void *buffer,
-		CommandType type) : sector_{sector}, numSectors_{numSectors}, numBytes_{numBytes},
-	buffer_{buffer}, type_{type}, event_{} {
+	// Size of the data that is described by segments.
+	size_t segmentBytes(std::span<const blockfs::BlockSegment> segments) {
+		size_t bytes = 0;
+		for (auto &segment : segments)
+			bytes += segment.numSectors * 512;
+		return bytes;
+	}
+}
 
-	// TODO: Requests larger than 64k need to be split
-	assert(numBytes < 65536);
+Command::Command(uint64_t sector, size_t numSectors, std::span<const blockfs::BlockSegment> segments,
+		CommandType type) : sector_{sector}, numSectors_{numSectors}, segments_{segments},
+	singleSegment_{}, type_{type}, event_{} {
 
 	if (logCommands) {
-		printf("block/ahci: queueing %zu byte %s to %p at sector %" PRIu64 "\n",
-			numBytes, cmdTypeToString(type_),
-			reinterpret_cast<void *>(buffer), sector);
+		printf("block/ahci: queueing %zu byte %s in %zu segments at sector %" PRIu64 "\n",
+			segmentBytes(segments_), cmdTypeToString(type_), segments_.size(), sector);
 	}
 }
 
 void Command::notifyCompletion() {
 	if (logCommands) {
-		printf("block/ahci: completed %s to %p", cmdTypeToString(type_), buffer_);
+		printf("block/ahci: completed %s at sector %" PRIu64 "\n", cmdTypeToString(type_), sector_);
 	}
 
 	event_.raise();
 }
 
-void Command::prepare(commandTable& table, commandHeader& header) {
+void Command::prepare(commandTable& table, commandHeader& header, size_t slot) {
 	auto tablePhys = helix::ptrToPhysical(&table);
 	assert(tablePhys < std::numeric_limits<uint32_t>::max() &&
 			numSectors_ < std::numeric_limits<uint16_t>::max());
@@ -61,24 +65,61 @@ void Command::prepare(commandTable& table, commandHeader& header) {
 	header.ctBase = static_cast<uint32_t>(helix::ptrToPhysical(&table));
 	header.ctBaseUpper = 0;
 
+	if (queued_) {
+		// FPDMA commands pass the sector count in the features register
+		// and the tag in bits 3-7 of the count register.
+		table.commandFis.features = numSectors_ & 0xFF;
+		table.commandFis.featuresUpper = (numSectors_ >> 8) & 0xFF;
+		table.commandFis.sectorCount = static_cast<uint16_t>(slot << 3);
+	}
+
 	switch (type_) {
 		case CommandType::read:
-			table.commandFis.command = 0x25; // READ DMA EXT
+			if (queued_) {
+				table.commandFis.command = 0x60; // READ FPDMA QUEUED
+			} else {
+				table.commandFis.command = 0x25; // READ DMA EXT
+			}
 			break;
 		case CommandType::write:
-			table.commandFis.command = 0x35; // WRITE DMA EXT
+			if (queued_) {
+				table.commandFis.command = 0x61; // WRITE FPDMA QUEUED
+			} else {
+				table.commandFis.command = 0x35; // WRITE DMA EXT
+			}
 			header.configBytes[0] |= 1 << 6; // Indicates we are writing
 			break;
+		case CommandType::writeFua:
+			if (queued_) {
+				table.commandFis.command = 0x61; // WRITE FPDMA QUEUED
+				table.commandFis.devHead |= 1 << 7; // FUA bit
+			} else {
+				table.commandFis.command = 0x3D; // WRITE DMA FUA EXT
+			}
+			header.configBytes[0] |= 1 << 6;
+			break;
+		case CommandType::flush:
+			table.commandFis.command = 0xEA; // FLUSH CACHE EXT
+			break;
+		case CommandType::trim:
+			table.commandFis.command = 0x06; // DATA SET MANAGEMENT
+			table.commandFis.features = 1; // TRIM
+			header.configBytes[0] |= 1 << 6;
+			break;
 		case CommandType::identify:
 			table.commandFis.command = 0xEC; // IDENTIFY DEVICE
 			break;
+		case CommandType::readNcqLog:
+			// The log address is passed in the LBA field, see the constructor.
+			table.commandFis.command = 0x2F; // READ LOG EXT
+			break;
 		default:
 			assert(!"unknown command type");
 	}
 
 	if (logCommands) {
-		printf("block/ahci: submitting %zu byte %s to %p at sector %" PRIu64 "\n",
-				numBytes_, cmdTypeToString(type_), buffer_, sector_);
+		printf("block/ahci: submitting %zu byte %s at sector %" PRIu64 "\n",
+				segmentBytes(segments_), cmdTypeToString(type_), sector_);
 	}
 }
 
@@ -91,42 +132,46 @@ void Command::prepare(commandTable& table, commandHeader& header) {
 size_t Command::writeScatterGather_(commandTable& table) {
 	// TODO: Grab the page size for each individual address
 	size_t pageSize = getpagesize();
+	// A single PRDT entry can describe up to 4 MiB.
+	constexpr size_t maxEntryBytes = size_t{4} << 20;
 
 	size_t prdtIndex = 0;
-	auto addEntry = [&](uintptr_t phys, size_t bytesToWrite) {
-		assert(prdtIndex < commandTable::prdtEntries &&
-				phys < std::numeric_limits<uint32_t>::max() && !(phys & 1));
-
+	uintptr_t prevEnd = 0;
+	auto addEntry = [&](uintptr_t phys, size_t bytes) {
+		assert(phys < std::numeric_limits<uint32_t>::max() && !(phys & 1));
+
+		// Accumulate into the previous entry if the memory is physically contiguous.
+		if (prdtIndex && phys == prevEnd) {
+			auto &prev = table.prdts[prdtIndex - 1];
+			if (prev.info + 1 + bytes <= maxEntryBytes) {
+				prev.info += bytes;
+				prevEnd += bytes;
+				return;
+			}
+		}
+
+		assert(prdtIndex < commandTable::prdtEntries);
 		table.prdts[prdtIndex++] = prdtEntry {
 			static_cast<uint32_t>(phys),
 			0,
 			0,
-			static_cast<uint32_t>(std::min(pageSize, bytesToWrite)) - 1,
+			static_cast<uint32_t>(bytes) - 1,
 		};
+		prevEnd = phys + bytes;
 	};
 
-	uintptr_t virtStart = reinterpret_cast<uintptr_t>(buffer_);
-	uintptr_t virtEnd = virtStart + numBytes_;
-	assert(virtEnd > virtStart);
-
-	// As virtStart may not be aligned to pageSize, we split off the initial
-	// unaligned part, then work with pageSize aligned chunks.
-	if (virtStart % pageSize > 0) {
-		auto nextAlignedAddr = (virtStart + pageSize) & ~(pageSize - 1);
-		auto bytesUntilAligned = nextAlignedAddr - virtStart;
-		auto bytesToWrite = std::min(numBytes_, bytesUntilAligned);
-		addEntry(helix::addressToPhysical(virtStart), bytesToWrite);
-
-		virtStart = nextAlignedAddr;
-	}
-
-	// Insert every page in the buffer into the scatter-gather list.
-	for (uintptr_t virt = virtStart; virt < virtEnd; virt += pageSize) {
-		uintptr_t phys = helix::addressToPhysical(virt);
-		
-		// TODO: As a small optimisation, we could accumulate into the previous entry if they
-		// happen to be physically contiguous.
-		addEntry(phys, virtEnd - virt);
+	for (auto &segment : segments_) {
+		uintptr_t virt = reinterpret_cast<uintptr_t>(segment.buffer);
+		uintptr_t virtEnd = virt + segment.numSectors * 512;
+
+		// Insert every page in the buffer into the scatter-gather list, starting with
+		// the (possibly) unaligned part of the first page.
+		while (virt < virtEnd) {
+			auto nextAlignedAddr = (virt + pageSize) & ~(pageSize - 1);
+			auto bytes = std::min(virtEnd, nextAlignedAddr) - virt;
+			addEntry(helix::addressToPhysical(virt), bytes);
+			virt += bytes;
+		}
 	}
 
 	return prdtIndex;
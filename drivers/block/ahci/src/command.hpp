@@ -1,43 +1,95 @@
 #pragma once
 
+#include <span>
 #include <async/oneshot-event.hpp>
+#include <blockfs.hpp>
 
 #include "spec.hpp"
 
 enum class CommandType {
 	read,
 	write,
-	identify
+	writeFua,
+	flush,
+	trim,
+	identify,
+	readNcqLog
 };
 
 struct Command {
 public:
-	Command(uint64_t sector, size_t numSectors, size_t numBytes, void *buffer, CommandType type);
+	Command(uint64_t sector, size_t numSectors, std::span<const blockfs::BlockSegment> segments,
+			CommandType type);
 	Command() = delete;
 	Command(Command&) = delete;
 	Command& operator=(Command &) = delete;
 
 	Command(identifyDevice *buffer, CommandType type)
-		: Command(0, 0, sizeof(identifyDevice), reinterpret_cast<void *>(buffer), type) {
+		: Command(0, 0, {}, type) {
 		assert(type == CommandType::identify);
+		singleSegment_ = blockfs::BlockSegment{buffer, 1};
+		segments_ = {&singleSegment_, 1};
 	}
 
-	void prepare(commandTable& table, commandHeader& header);
+	Command(ncqErrorLog *buffer, CommandType type)
+		: Command(0x10, 1, {}, type) {
+		assert(type == CommandType::readNcqLog);
+		singleSegment_ = blockfs::BlockSegment{buffer, 1};
+		segments_ = {&singleSegment_, 1};
+	}
+
+	// Reads and writes are issued as READ/WRITE FPDMA QUEUED if the port uses NCQ.
+	bool canQueue() const {
+		return type_ == CommandType::read || type_ == CommandType::write
+				|| type_ == CommandType::writeFua;
+	}
+
+	void setQueued(bool queued) {
+		assert(!queued || canQueue());
+		queued_ = queued;
+	}
+
+	bool isQueued() const {
+		return queued_;
+	}
+
+	// The slot doubles as the NCQ tag.
+	void prepare(commandTable& table, commandHeader& header, size_t slot);
 	void notifyCompletion(); 
 
+	// Completes the command with an error.
+	void fail() {
+		failed_ = true;
+		notifyCompletion();
+	}
+
+	bool failed() const {
+		return failed_;
+	}
+
+	// Returns false once the command has been retried too often after errors.
+	bool retry() {
+		return retries_++ < maxRetries;
+	}
+
 	auto getFuture() {
 		return event_.wait();
 	}
 
 private:
+	static constexpr int maxRetries = 3;
+
 	size_t writeScatterGather_(commandTable& table);
 
 private:
 	uint64_t sector_;
 	size_t numSectors_;
-	size_t numBytes_;
-	void *buffer_;
+	std::span<const blockfs::BlockSegment> segments_;
+	blockfs::BlockSegment singleSegment_;
 	CommandType type_;
+	bool queued_ = false;
+	bool failed_ = false;
+	int retries_ = 0;
 	async::oneshot_event event_;
 };
 
@@ -47,10 +99,17 @@ constexpr const char *cmdTypeToString(CommandType type) {
 			return "read";
 		case CommandType::write:
 			return "write";
+		case CommandType::writeFua:
+			return "write (FUA)";
+		case CommandType::flush:
+			return "flush";
+		case CommandType::trim:
+			return "trim";
 		case CommandType::identify:
 			return "identify";
+		case CommandType::readNcqLog:
+			return "read NCQ log";
 		default:
 			assert(!"unknown command type");
 	}
 }
-
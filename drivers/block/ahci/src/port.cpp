@@ -1,4 +1,8 @@
 #include <inttypes.h>
+#include <string.h>
+#include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include <helix/memory.hpp>
 #include <helix/timer.hpp>
@@ -16,6 +20,7 @@ namespace regs {
 	constexpr arch::scalar_register<uint32_t> tfd{0x20};
 	constexpr arch::scalar_register<uint32_t> status{0x28};
 	constexpr arch::scalar_register<uint32_t> sErr{0x30};
+	constexpr arch::scalar_register<uint32_t> sActive{0x34};
 	constexpr arch::scalar_register<uint32_t> commandIssue{0x38};
 }
 
@@ -35,12 +40,14 @@ namespace flags {
 		constexpr int hostDataError   = 1 << 28;
 		constexpr int ifFatalError    = 1 << 27;
 		constexpr int ifNonFatalError = 1 << 26;
+		constexpr int setDeviceBits   = 1 << 3;
 		constexpr int d2hFis          = 1;
 	}
 
 	namespace tfd {
 		constexpr int bsy = 1 << 7;
 		constexpr int drq = 1 << 3;
+		constexpr int err = 1;
 	}
 }
 
@@ -50,9 +57,11 @@ namespace {
 }
 
 // TODO: We can use a more appropriate block size, but this breaks other parts of the OS.
-Port::Port(int64_t parentId, int portIndex, size_t numCommandSlots, bool staggeredSpinUp, arch::mem_space regs)
+Port::Port(int64_t parentId, int portIndex, size_t numCommandSlots, bool staggeredSpinUp,
+		bool hbaSupportsNcq, arch::mem_space regs)
 	: BlockDevice{::sectorSize, parentId},  regs_{regs}, numCommandSlots_{numCommandSlots},
-	commandsInFlight_{0}, portIndex_{portIndex}, staggeredSpinUp_{staggeredSpinUp} {
+	commandsInFlight_{0}, portIndex_{portIndex}, staggeredSpinUp_{staggeredSpinUp},
+	hbaSupportsNcq_{hbaSupportsNcq} {
 
 }
 
@@ -145,11 +154,11 @@ async::detached Port::run() {
 	cas = regs_.load(regs::commandAndStatus);
 	regs_.store(regs::commandAndStatus, cas | flags::cmd::start);
 
-	size_t slot = co_await findFreeSlot_();
+	size_t slot = co_await findFreeSlot_(false);
 
 	arch::dma_object<identifyDevice> identify{nullptr};
 	Command cmd = Command(identify.data(), CommandType::identify);
-	cmd.prepare(commandTables_[slot], commandList_->slots[slot]);
+	cmd.prepare(commandTables_[slot], commandList_->slots[slot], slot);
 
 	regs_.store(regs::commandIssue, 1 << slot);
 
@@ -168,6 +177,24 @@ async::detached Port::run() {
 			portIndex_, model.c_str(), logicalSize, physicalSize, sectorCount);
 	assert(logicalSize == 512 && "block/ahci: logical sector size > 512 is not supported");
 
+	supportsFlush_ = identify->hasWriteCache() && identify->supportsFlushExt();
+	supportsFua_ = identify->supportsFua();
+	supportsTrim_ = identify->supportsTrim();
+
+	// With NCQ, the device reorders the commands that are outstanding; without it,
+	// the HBA executes the issued commands one at a time.
+	ncq_ = hbaSupportsNcq_ && identify->supportsNcq();
+	queueDepth_ = numCommandSlots_;
+	if (ncq_) {
+		queueDepth_ = std::min(numCommandSlots_, identify->ncqDepth());
+		printf("block/ahci: Port %d uses NCQ with depth %zu\n", portIndex_, queueDepth_);
+	}
+
+	// Each segment needs one PRDT entry per page, plus one if it is not page aligned.
+	limits.queueDepth = queueDepth_;
+	limits.maxSectors = 32 * (0x1000 / ::sectorSize);
+	limits.maxSegments = commandTable::prdtEntries - 32;
+
 	// Clear errors
 	regs_.store(regs::sErr, ~0);
 
@@ -177,6 +204,7 @@ async::detached Port::run() {
 	auto ie = regs_.load(regs::interruptEnable);
 	regs_.store(regs::interruptEnable, ie
 			| flags::is::d2hFis
+			| flags::is::setDeviceBits
 			| flags::is::taskFileError
 			| flags::is::hostDataError
 			| flags::is::hostFatalError
@@ -189,8 +217,18 @@ async::detached Port::run() {
 	co_return;
 }
 
-async::result<size_t> Port::findFreeSlot_() {
-	while (commandsInFlight_ >= numCommandSlots_) {
+async::result<size_t> Port::findFreeSlot_(bool queued) {
+	// Issuing a non-queued command while queued commands are outstanding
+	// (or vice versa) is an error on the device side.
+	auto canIssue = [&] {
+		if (recovering_)
+			return false;
+		if (queued)
+			return !nonQueuedInFlight_ && queuedInFlight_ < queueDepth_;
+		return !queuedInFlight_ && commandsInFlight_ < numCommandSlots_;
+	};
+
+	while (!canIssue()) {
 		if (logCommands) {
 			printf("block/ahci: submission queue full, waiting...\n");
 		}
@@ -200,8 +238,10 @@ async::result<size_t> Port::findFreeSlot_() {
 
 	// We can't look at CI here, as the HBA might clear it before we have
 	// a chance to notify completion, so the array slot will still be occupied.
+	// Queued commands use their slot as tag, which must be below the device's depth.
 	// TODO: We could use a bitmask and CLZ for this.
-	for (size_t i = 0; i < numCommandSlots_; i++) {
+	size_t numSlots = queued ? queueDepth_ : numCommandSlots_;
+	for (size_t i = 0; i < numSlots; i++) {
 		if (!submittedCmds_[i]) {
 			co_return i;
 		}
@@ -215,7 +255,7 @@ void Port::handleIrq() {
 	auto is = regs_.load(regs::interruptStatus);
 
 	// Check errors
-	// TODO: Make this more robust (log non-fatal errors, try to recover, print more state etc.)
+	// TODO: Make this more robust (log non-fatal errors, print more state etc.)
 	if (is & (flags::is::hostFatalError | flags::is::ifFatalError)) {
 		printf("\e[31mblock/ahci: Port %d encountered fatal error, PxIS = %u, PxSERR = %u\e[39m\n",
 				portIndex_, is, regs_.load(regs::sErr));
@@ -228,30 +268,131 @@ void Port::handleIrq() {
 				regs_.load(regs::commandIssue), regs_.load(regs::commandAndStatus));
 	}
 
-	// Notify all completed commands
+	// The command engine stops on task file errors; recover_() takes over from here.
+	if (is & flags::is::taskFileError) {
+		regs_.store(regs::interruptStatus, is);
+		if (!recovering_)
+			recover_();
+		return;
+	}
+
+	if (recovering_) {
+		regs_.store(regs::interruptStatus, is);
+		return;
+	}
+
+	// Notify all completed commands. Queued commands complete once the device
+	// clears their PxSACT bit (through a Set Device Bits FIS).
 	auto numCompleted = 0;
-	auto cmdActiveMask = regs_.load(regs::commandIssue);
+	auto cmdActiveMask = regs_.load(regs::commandIssue) | regs_.load(regs::sActive);
 	for (size_t i = 0; i < numCommandSlots_; i++) {
 		if (submittedCmds_[i] && !(cmdActiveMask & (1 << i))) {
-			Command *cmd = std::exchange(submittedCmds_[i], nullptr);
-			cmd->notifyCompletion();
+			releaseSlot_(i)->notifyCompletion();
 			numCompleted++;
 		}
 	}
 
-	// If the buffer has gone from full to not full, wake the tasks waiting for a free slot.
-	// TODO: If we have a lot of waiters, this will cause many spurious wakeups. Ideally, we only
-	// notify a certain number of tasks, and the rest can stay asleep.
-	if (commandsInFlight_ == numCommandSlots_ && numCompleted > 0) {
+	// The only waiter is submitPendingLoop_(), but it might also wait for
+	// the outstanding commands of another kind to drain, so wake it on every completion.
+	if (numCompleted > 0) {
 		freeSlotDoorbell_.raise();
 	}
 
-	commandsInFlight_ -= numCompleted;
-
 	// Acknowledge the interrupt
 	regs_.store(regs::interruptStatus, is);
 }
 
+Command *Port::releaseSlot_(size_t slot) {
+	Command *cmd = std::exchange(submittedCmds_[slot], nullptr);
+	assert(cmd);
+	commandsInFlight_--;
+	if (cmd->isQueued()) {
+		queuedInFlight_--;
+	} else {
+		nonQueuedInFlight_--;
+	}
+	return cmd;
+}
+
+// Follows the error handling of AHCI 1.3.1, section 6.2.2.
+async::detached Port::recover_() {
+	recovering_ = true;
+
+	// PxCMD.CCS is only valid while the command engine is running.
+	auto cas = regs_.load(regs::commandAndStatus);
+	size_t currentSlot = (cas >> 8) & 0x1F;
+	printf("\e[31mblock/ahci: Port %d encountered task file error, PxTFD = %x, PxSERR = %x\e[39m\n",
+			portIndex_, regs_.load(regs::tfd), regs_.load(regs::sErr));
+
+	// Commands whose bits are already clear completed before the error.
+	auto cmdActiveMask = regs_.load(regs::commandIssue) | regs_.load(regs::sActive);
+	for (size_t i = 0; i < numCommandSlots_; i++) {
+		if (submittedCmds_[i] && !(cmdActiveMask & (1 << i)))
+			releaseSlot_(i)->notifyCompletion();
+	}
+
+	// Clearing PxCMD.ST also clears PxCI and PxSACT.
+	regs_.store(regs::commandAndStatus, cas & ~flags::cmd::start);
+	auto success = co_await helix::kindaBusyWait(500'000'000, [&](){
+		return !(regs_.load(regs::commandAndStatus) & flags::cmd::cmdListRunning); });
+	assert(success);
+
+	regs_.store(regs::sErr, ~0);
+	regs_.store(regs::interruptStatus, regs_.load(regs::interruptStatus));
+
+	// TODO: Issue a COMRESET if the device does not clear BSY and DRQ by itself.
+	auto tfd = regs_.load(regs::tfd);
+	if ((tfd & flags::tfd::bsy) || (tfd & flags::tfd::drq)) {
+		printf("\e[31mblock/ahci: Port %d remains busy after error, PxTFD = %x\e[39m\n",
+				portIndex_, tfd);
+		abort();
+	}
+
+	cas = regs_.load(regs::commandAndStatus);
+	regs_.store(regs::commandAndStatus, cas | flags::cmd::start);
+
+	// Find out which command failed.
+	size_t failedSlot = limits::maxCmdSlots;
+	if (queuedInFlight_) {
+		// Reading the NCQ error log aborts all queued commands and reports the tag
+		// of the one that failed. All slots are idle now, so we can borrow slot 0.
+		arch::dma_object<ncqErrorLog> log{nullptr};
+		Command logCmd{log.data(), CommandType::readNcqLog};
+		logCmd.prepare(commandTables_[0], commandList_->slots[0], 0);
+		regs_.store(regs::commandIssue, 1);
+
+		success = co_await helix::kindaBusyWait(500'000'000,
+				[&](){ return !(regs_.load(regs::commandIssue) & 1); });
+		if (!success || (regs_.load(regs::tfd) & flags::tfd::err)) {
+			printf("\e[31mblock/ahci: Port %d failed to read NCQ error log\e[39m\n", portIndex_);
+			abort();
+		}
+
+		if (!log->nonQueued()) {
+			failedSlot = log->tag();
+			printf("block/ahci: Port %d: NCQ command with tag %zu failed, status %x, error %x\n",
+					portIndex_, failedSlot, log->status, log->error);
+		}
+	} else {
+		failedSlot = currentSlot;
+	}
+
+	// Fail the command that caused the error and resubmit the ones that were aborted.
+	for (size_t i = 0; i < numCommandSlots_; i++) {
+		if (!submittedCmds_[i])
+			continue;
+		auto cmd = releaseSlot_(i);
+		if (i == failedSlot || !cmd->retry()) {
+			cmd->fail();
+		} else {
+			pendingCmdQueue_.put(cmd);
+		}
+	}
+
+	recovering_ = false;
+	freeSlotDoorbell_.raise();
+}
+
 async::detached Port::submitPendingLoop_() {
 	while (true) {
 		auto cmd =	co_await pendingCmdQueue_.async_get();
@@ -261,33 +402,126 @@ async::detached Port::submitPendingLoop_() {
 }
 
 async::result<void> Port::submitCommand_(Command *cmd) {
-	auto slot = co_await findFreeSlot_();
+	cmd->setQueued(ncq_ && cmd->canQueue());
+	auto slot = co_await findFreeSlot_(cmd->isQueued());
 	assert(!(regs_.load(regs::commandIssue) & (1 << slot)));
 	assert(!submittedCmds_[slot]);
 
 	// Setup command table and FIS
-	cmd->prepare(commandTables_[slot], commandList_->slots[slot]);
+	cmd->prepare(commandTables_[slot], commandList_->slots[slot], slot);
 
-	// Issue command
+	// Issue command. For queued commands, PxSACT must be set before PxCI.
 	submittedCmds_[slot] = cmd;
 	commandsInFlight_++;
+	if (cmd->isQueued()) {
+		queuedInFlight_++;
+		regs_.store(regs::sActive, 1 << slot);
+	} else {
+		nonQueuedInFlight_++;
+	}
 	regs_.store(regs::commandIssue, 1 << slot);
 
 	co_return;
 }
 
 async::result<void> Port::readSectors(uint64_t sector, void *buffer, size_t numSectors) {
-	Command cmd{sector, numSectors, numSectors * sectorSize,
-			buffer, CommandType::read};
-	pendingCmdQueue_.put(&cmd);
-	co_await cmd.getFuture();
+	blockfs::BlockSegment segment{buffer, numSectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::read;
+	request.sector = sector;
+	request.numSectors = numSectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
 }
 
 async::result<void> Port::writeSectors(uint64_t sector, const void *buffer, size_t numSectors) {
-	Command cmd{sector, numSectors, numSectors * sectorSize,
-			const_cast<void *>(buffer), CommandType::write};
+	blockfs::BlockSegment segment{const_cast<void *>(buffer), numSectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::write;
+	request.sector = sector;
+	request.numSectors = numSectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
+}
+
+async::result<void> Port::submit(const blockfs::BlockRequest &request) {
+	switch (request.op) {
+		case blockfs::BlockOp::read:
+		case blockfs::BlockOp::write: {
+			bool fua = request.op == blockfs::BlockOp::write && (request.flags & blockfs::kBlockFua);
+			auto type = CommandType::read;
+			if (request.op == blockfs::BlockOp::write)
+				type = (fua && supportsFua_) ? CommandType::writeFua : CommandType::write;
+
+			// Queue all parts at once such that they can occupy multiple command slots.
+			blockfs::SplitRequest split{request, sectorSize, limits};
+			std::vector<std::unique_ptr<Command>> cmds;
+			for (auto &part : split.parts) {
+				auto cmd = std::make_unique<Command>(part.sector, part.numSectors,
+						part.segments, type);
+				pendingCmdQueue_.put(cmd.get());
+				cmds.push_back(std::move(cmd));
+			}
+			bool failed = false;
+			for (auto &cmd : cmds) {
+				co_await cmd->getFuture();
+				failed |= cmd->failed();
+			}
+			if (failed)
+				throw std::runtime_error("block/ahci: I/O error");
+
+			if (fua && !supportsFua_)
+				co_await flush_();
+			break;
+		}
+		case blockfs::BlockOp::flush:
+			co_await flush_();
+			break;
+		case blockfs::BlockOp::discard:
+			// Discards are only hints; ignore them if the device does not support TRIM.
+			if (supportsTrim_)
+				co_await trim_(request.sector, request.numSectors);
+			break;
+		case blockfs::BlockOp::writeZeroes:
+			co_await BlockDevice::submit(request);
+			break;
+	}
+}
+
+async::result<void> Port::flush_() {
+	if (!supportsFlush_)
+		co_return;
+
+	Command cmd{0, 0, {}, CommandType::flush};
 	pendingCmdQueue_.put(&cmd);
 	co_await cmd.getFuture();
+	if (cmd.failed())
+		throw std::runtime_error("block/ahci: Flush failed");
+}
+
+async::result<void> Port::trim_(uint64_t sector, size_t numSectors) {
+	// Each range entry consists of a 48-bit LBA and a 16-bit sector count.
+	// We submit one 512-byte block of entries per command.
+	constexpr size_t entriesPerBlock = 512 / sizeof(uint64_t);
+	constexpr size_t maxEntrySectors = 0xFFFF;
+
+	size_t progress = 0;
+	while (progress < numSectors) {
+		arch::dma_array<uint64_t> ranges{nullptr, entriesPerBlock};
+		memset(ranges.data(), 0, 512);
+		for (size_t i = 0; i < entriesPerBlock && progress < numSectors; i++) {
+			auto n = std::min(numSectors - progress, maxEntrySectors);
+			ranges[i] = (sector + progress) | (static_cast<uint64_t>(n) << 48);
+			progress += n;
+		}
+
+		blockfs::BlockSegment segment{ranges.data(), 1};
+		Command cmd{0, 1, {&segment, 1}, CommandType::trim};
+		pendingCmdQueue_.put(&cmd);
+		co_await cmd.getFuture();
+		if (cmd.failed())
+			throw std::runtime_error("block/ahci: TRIM failed");
+	}
 }
 
 async::result<size_t> Port::getSize() {
@@ -16,7 +16,7 @@
 class Port : public blockfs::BlockDevice {
 public:
 	Port(int64_t parentId, int index, size_t numCommandSlots, bool staggeredSpinUp,
-			arch::mem_space regs);
+			bool hbaSupportsNcq, arch::mem_space regs);
 
 public:
 	async::result<bool> init();
@@ -25,14 +25,22 @@ public:
 
 	async::result<void> readSectors(uint64_t sector, void *buf, size_t numSectors) override;
 	async::result<void> writeSectors(uint64_t sector, const void *buf, size_t numSectors) override;
+	async::result<void> submit(const blockfs::BlockRequest &request) override;
 	async::result<size_t> getSize() override;
 
 	int getIndex() const { return portIndex_; }
 
 private:
-	async::result<size_t> findFreeSlot_();
+	async::result<size_t> findFreeSlot_(bool queued);
 	async::detached submitPendingLoop_();
 	async::result<void> submitCommand_(Command *cmd);
+	// Frees the slot of a command that is no longer outstanding and returns the command.
+	Command *releaseSlot_(size_t slot);
+	// Stops and restarts the command engine after a task file error
+	// and fails the command that caused it.
+	async::detached recover_();
+	async::result<void> flush_();
+	async::result<void> trim_(uint64_t sector, size_t numSectors);
 	void start_();
 	void stop_();
 
@@ -63,4 +71,19 @@ private:
 	size_t commandsInFlight_;
 	int portIndex_;
 	bool staggeredSpinUp_;
+	bool hbaSupportsNcq_;
+
+	// Queued and non-queued commands cannot be outstanding at the same time.
+	size_t queuedInFlight_ = 0;
+	size_t nonQueuedInFlight_ = 0;
+	// Number of slots that queued commands may use (the device's NCQ depth).
+	size_t queueDepth_ = 0;
+	bool ncq_ = false;
+	// Completions are ignored while the port recovers from an error.
+	bool recovering_ = false;
+
+	// Features reported by IDENTIFY DEVICE.
+	bool supportsFlush_ = false;
+	bool supportsFua_ = false;
+	bool supportsTrim_ = false;
 };
@@ -77,24 +77,32 @@ struct commandTable {
 	uint8_t atapiCommand[0x10];
 	uint8_t _reserved[0x30];
 
-	// Allows us to read 64kb into a buffer (16 * 512), plus one to deal with unaligned buffers.
-	static constexpr std::size_t prdtEntries = 16 + 1;
+	// Chosen such that the table is a multiple of 128 bytes (the required alignment).
+	static constexpr std::size_t prdtEntries = 56;
 	prdtEntry prdts[prdtEntries];
 };
 static_assert(sizeof(commandTable) == 128 + 16 * commandTable::prdtEntries);
+static_assert(!(sizeof(commandTable) % 128));
 
 struct identifyDevice {
 	uint16_t _junkA[27];
 	uint16_t model[20];
-	uint16_t _junkB[36];
-	uint16_t capabilities;
-	uint16_t _junkC[16];
+	uint16_t _junkB[28];
+	uint16_t queueDepth; // Word 75.
+	uint16_t sataCapabilities; // Word 76.
+	uint16_t _junkB2[5];
+	uint16_t commandSets; // Word 82.
+	uint16_t capabilities; // Word 83.
+	uint16_t commandSetsExt; // Word 84.
+	uint16_t _junkC[15];
 	uint64_t maxLBA48;
 	uint16_t _junkD[2];
 	uint16_t sectorSizeInfo;
 	uint16_t _junkE[9];
 	uint16_t logicalSectorSize;
-	uint16_t _junkF[139];
+	uint16_t _junkF[52];
+	uint16_t dataSetManagement; // Word 169.
+	uint16_t _junkG[86];
 
 	std::string getModel() const {
 		char modelNative[41];
@@ -139,5 +147,49 @@ struct identifyDevice {
 	bool supportsLba48() const {
 		return capabilities & (1 << 10);
 	}
+
+	bool hasWriteCache() const {
+		return commandSets & (1 << 5);
+	}
+
+	bool supportsFlushExt() const {
+		return capabilities & (1 << 13);
+	}
+
+	bool supportsFua() const {
+		return commandSetsExt & (1 << 6);
+	}
+
+	bool supportsTrim() const {
+		return dataSetManagement & 1;
+	}
+
+	bool supportsNcq() const {
+		return sataCapabilities & (1 << 8);
+	}
+
+	// Maximum number of outstanding NCQ commands.
+	size_t ncqDepth() const {
+		return (queueDepth & 0x1F) + 1;
+	}
 };
 static_assert(sizeof(identifyDevice) == 512);
+
+// Log page 10h (NCQ Command Error), read with READ LOG EXT after an NCQ error.
+struct ncqErrorLog {
+	uint8_t tagInfo; // Bits 0-4: tag of the failed command, bit 7: NQ.
+	uint8_t _reservedA;
+	uint8_t status;
+	uint8_t error;
+	uint8_t _junk[508];
+
+	// Set if the error was not caused by a queued command.
+	bool nonQueued() const {
+		return tagInfo & (1 << 7);
+	}
+
+	size_t tag() const {
+		return tagInfo & 0x1F;
+	}
+};
+static_assert(sizeof(ncqErrorLog) == 512);
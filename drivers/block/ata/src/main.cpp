@@ -1,15 +1,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <optional>
 #include <queue>
+#include <string>
 
 #include <async/result.hpp>
 #include <async/recurring-event.hpp>
 #include <async/oneshot-event.hpp>
+#include <arch/dma_structs.hpp>
 #include <arch/io_space.hpp>
 #include <arch/register.hpp>
 #include <helix/ipc.hpp>
+#include <helix/memory.hpp>
 #include <helix/timer.hpp>
 #include <protocols/hw/client.hpp>
 #include <protocols/mbus/client.hpp>
@@ -41,6 +48,22 @@ namespace alt_regs {
 	inline constexpr arch::scalar_register<uint8_t> inStatus{0};
 }
 
+// Registers of the PCI IDE bus master (relative to the channel's part of BAR4).
+namespace bm_regs {
+	inline constexpr arch::scalar_register<uint8_t> command{0};
+	inline constexpr arch::scalar_register<uint8_t> status{2};
+	inline constexpr arch::scalar_register<uint32_t> prdtAddress{4};
+}
+
+// Physical region descriptor. A region must not cross a 64 KiB boundary;
+// a byte count of zero means 64 KiB.
+struct PrdEntry {
+	uint32_t address;
+	uint16_t byteCount;
+	uint16_t flags;
+};
+static_assert(sizeof(PrdEntry) == 8);
+
 class Controller : public blockfs::BlockDevice {
 	enum class IoResult {
 		none,
@@ -58,10 +81,14 @@ public:
 public:
 	async::detached run();
 
+	// Enables DMA transfers through the bus master registers at the given offset.
+	void attachBusMaster(uint16_t offset, helix::UniqueDescriptor bar);
+
 private:
 	async::detached _doRequestLoop();
 	async::result<IoResult> _pollForBsy();
 	async::result<IoResult> _waitForBsyIrq();
+	async::result<uint8_t> _waitForDmaIrq();
 
 public:
 	async::result<void> readSectors(uint64_t sector, void *buffer,
@@ -78,6 +105,10 @@ private:
 		kCommandReadSectorsExt = 0x24,
 		kCommandWriteSectors = 0x30,
 		kCommandWriteSectorsExt = 0x34,
+		kCommandReadDma = 0xC8,
+		kCommandReadDmaExt = 0x25,
+		kCommandWriteDma = 0xCA,
+		kCommandWriteDmaExt = 0x35,
 		kCommandIdentify = 0xEC,
 	};
 
@@ -89,9 +120,20 @@ private:
 		kStatusBsy = 0x80,
 
 		kDeviceSlave = 0x10,
-		kDeviceLba = 0x40
+		kDeviceLba = 0x40,
+
+		kBmCommandStart = 0x01,
+		kBmCommandRead = 0x08, // The bus master writes to memory.
+
+		kBmStatusActive = 0x01,
+		kBmStatusError = 0x02,
+		kBmStatusIrq = 0x04,
+		kBmStatusDrive0Dma = 0x20
 	};
 
+	// 255 sectors span at most 33 pages; the table itself has to stay in one 64 KiB region.
+	static constexpr size_t numPrdEntries = 64;
+
 	struct Request {
 		bool isWrite;
 		uint64_t sector;
@@ -101,6 +143,13 @@ private:
 	};
 
 	async::result<void> _performRequest(Request *request);
+	async::result<void> _performPioRequest(Request *request);
+	async::result<bool> _performDmaRequest(Request *request);
+
+	// Fills the PRD table. Fails if the buffer is not addressable by the bus master.
+	bool _buildPrdTable(Request *request);
+
+	void _programTaskFile(Request *request);
 
 	async::result<bool> _detectDevice();
 
@@ -112,6 +161,12 @@ private:
 	arch::io_space _altSpace;
 
 	bool _supportsLBA48;
+	bool _supportsDma;
+
+	bool _hasBusMaster;
+	arch::io_space _bmSpace;
+	arch::dma_array<PrdEntry> _prdTable;
+	uintptr_t _prdTablePhys;
 
 	uint64_t _irqSequence;
 };
@@ -120,11 +175,32 @@ Controller::Controller(int64_t parentId, uint16_t mainOffset, uint16_t altOffset
 		helix::UniqueDescriptor mainBar, helix::UniqueDescriptor altBar,
 		helix::UniqueDescriptor irq)
 : BlockDevice{512, parentId}, _irq{std::move(irq)},
-		_ioSpace{mainOffset}, _altSpace{altOffset}, _supportsLBA48{false} {
+		_ioSpace{mainOffset}, _altSpace{altOffset}, _supportsLBA48{false},
+		_supportsDma{false}, _hasBusMaster{false} {
 	HEL_CHECK(helEnableIo(mainBar.getHandle()));
 	HEL_CHECK(helEnableIo(altBar.getHandle()));
 }
 
+void Controller::attachBusMaster(uint16_t offset, helix::UniqueDescriptor bar) {
+	HEL_CHECK(helEnableIo(bar.getHandle()));
+	_bmSpace = arch::io_space{offset};
+
+	// The table is page aligned and thus never crosses a 64 KiB boundary.
+	_prdTable = arch::dma_array<PrdEntry>{nullptr, numPrdEntries};
+	_prdTablePhys = helix::ptrToPhysical(&_prdTable[0]);
+	if(_prdTablePhys >= std::numeric_limits<uint32_t>::max()) {
+		std::cout << "block/ata: PRD table is not addressable, using PIO" << std::endl;
+		return;
+	}
+
+	if(!(_bmSpace.load(bm_regs::status) & kBmStatusDrive0Dma))
+		std::cout << "block/ata: Firmware did not mark drive as DMA capable" << std::endl;
+
+	// Requests check this flag before they start, so we can switch at any time.
+	_hasBusMaster = true;
+	std::cout << "block/ata: Using bus master DMA" << std::endl;
+}
+
 async::detached Controller::run() {
 	// Initialize the _irqSequence. For now, assume that this is 0.
 	// TODO: if the driver restarts, we would need to get the current IRQ sequence from the kernel.
@@ -210,6 +286,27 @@ auto Controller::_waitForBsyIrq() -> async::result<IoResult> {
 	}
 }
 
+// Returns the bus master status at the time of the IRQ.
+auto Controller::_waitForDmaIrq() -> async::result<uint8_t> {
+	while(true) {
+		if(logIrqs)
+			std::cout << "block/ata: Awaiting DMA IRQ." << std::endl;
+		auto await = co_await helix_ng::awaitEvent(_irq, _irqSequence);
+		HEL_CHECK(await.error());
+		_irqSequence = await.sequence();
+
+		// Unlike the task file, the bus master tells us whether the IRQ was raised by the drive.
+		auto bmStatus = _bmSpace.load(bm_regs::status);
+		if(!(bmStatus & (kBmStatusIrq | kBmStatusError))) {
+			HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckNack, _irqSequence));
+			continue;
+		}
+		if(logIrqs)
+			std::cout << "block/ata: DMA IRQ fired." << std::endl;
+		co_return bmStatus;
+	}
+}
+
 async::result<void> Controller::readSectors(uint64_t sector,
 		void *buffer, size_t numSectors) {
 	Request request{};
@@ -296,8 +393,12 @@ async::result<bool> Controller::_detectDevice() {
 
 	_supportsLBA48 = (ident_data[167] & (1 << 2))
 			&& (ident_data[173] & (1 << 2));
+	// Word 49, bit 8.
+	_supportsDma = ident_data[99] & 1;
 
-	printf("block/ata: detected device, model: '%s', %s 48-bit LBA\n", model, _supportsLBA48 ? "supports" : "doesn't support");
+	printf("block/ata: detected device, model: '%s', %s 48-bit LBA, %s DMA\n", model,
+			_supportsLBA48 ? "supports" : "doesn't support",
+			_supportsDma ? "supports" : "doesn't support");
 
 	co_return true;
 }
@@ -310,6 +411,55 @@ async::result<void> Controller::_performRequest(Request *request) {
 	assert(!(request->sector & ~((size_t(1) << 48) - 1)));
 	assert(request->numSectors <= 255);
 
+	if(!(_hasBusMaster && _supportsDma && co_await _performDmaRequest(request)))
+		co_await _performPioRequest(request);
+
+	if(logRequests)
+		std::cout << "block/ata: Reading/writing from " << request->sector
+				<< " complete" << std::endl;
+}
+
+bool Controller::_buildPrdTable(Request *request) {
+	size_t pageSize = getpagesize();
+
+	size_t n = 0;
+	uintptr_t regionStart = 0;
+	uintptr_t regionEnd = 0;
+	auto addRegion = [&] (uintptr_t phys, size_t bytes) -> bool {
+		if(phys + bytes > std::numeric_limits<uint32_t>::max() || (phys & 1))
+			return false;
+
+		// Merge physically contiguous pages as long as they stay within one 64 KiB region.
+		if(n && phys == regionEnd && (regionStart >> 16) == ((phys + bytes - 1) >> 16)) {
+			regionEnd += bytes;
+			_prdTable[n - 1].byteCount = static_cast<uint16_t>(regionEnd - regionStart);
+			return true;
+		}
+
+		assert(n < numPrdEntries);
+		_prdTable[n++] = PrdEntry{static_cast<uint32_t>(phys),
+				static_cast<uint16_t>(bytes), 0};
+		regionStart = phys;
+		regionEnd = phys + bytes;
+		return true;
+	};
+
+	uintptr_t virt = reinterpret_cast<uintptr_t>(request->buffer);
+	uintptr_t virtEnd = virt + request->numSectors * 512;
+	while(virt < virtEnd) {
+		auto nextAlignedAddr = (virt + pageSize) & ~(pageSize - 1);
+		auto bytes = std::min(virtEnd, nextAlignedAddr) - virt;
+		if(!addRegion(helix::addressToPhysical(virt), bytes))
+			return false;
+		virt += bytes;
+	}
+
+	assert(n);
+	_prdTable[n - 1].flags = 0x8000; // End of table.
+	return true;
+}
+
+void Controller::_programTaskFile(Request *request) {
 	_ioSpace.store(regs::outDevice, kDeviceLba);
 	// TODO: There should be a 400ns delay after drive selection.
 
@@ -324,6 +474,54 @@ async::result<void> Controller::_performRequest(Request *request) {
 	_ioSpace.store(regs::outLba1, request->sector & 0xFF);
 	_ioSpace.store(regs::outLba2, (request->sector >> 8) & 0xFF);
 	_ioSpace.store(regs::outLba3, (request->sector >> 16) & 0xFF);
+}
+
+async::result<bool> Controller::_performDmaRequest(Request *request) {
+	if(!_buildPrdTable(request)) {
+		if(logRequests)
+			std::cout << "block/ata: Buffer is not addressable by DMA" << std::endl;
+		co_return false;
+	}
+
+	// Program the bus master but do not start it before the command is issued.
+	uint8_t direction = request->isWrite ? 0 : kBmCommandRead;
+	_bmSpace.store(bm_regs::command, direction);
+	_bmSpace.store(bm_regs::prdtAddress, static_cast<uint32_t>(_prdTablePhys));
+	_bmSpace.store(bm_regs::status, (_bmSpace.load(bm_regs::status) & 0x60)
+			| kBmStatusError | kBmStatusIrq);
+
+	_programTaskFile(request);
+	if(!request->isWrite) {
+		_ioSpace.store(regs::outCommand, _supportsLBA48 ? kCommandReadDmaExt : kCommandReadDma);
+	}else{
+		_ioSpace.store(regs::outCommand, _supportsLBA48 ? kCommandWriteDmaExt : kCommandWriteDma);
+	}
+	_bmSpace.store(bm_regs::command, direction | kBmCommandStart);
+
+	auto bmStatus = co_await _waitForDmaIrq();
+
+	// Stop the bus master, then clear the drive's IRQ by reading the status.
+	_bmSpace.store(bm_regs::command, direction);
+	auto status = _ioSpace.load(regs::inStatus);
+	_bmSpace.store(bm_regs::status, (bmStatus & 0x60) | kBmStatusError | kBmStatusIrq);
+	HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckAcknowledge, _irqSequence));
+
+	if((bmStatus & (kBmStatusError | kBmStatusActive))
+			|| (status & (kStatusBsy | kStatusErr | kStatusDf | kStatusDrq))) {
+		// Retry this request (and all future ones) using PIO.
+		std::cout << "\e[31m" "block/ata: DMA transfer failed (bus master status 0x"
+				<< std::hex << static_cast<int>(bmStatus) << ", status 0x"
+				<< static_cast<int>(status) << std::dec << "), falling back to PIO"
+				"\e[39m" << std::endl;
+		_hasBusMaster = false;
+		co_return false;
+	}
+
+	co_return true;
+}
+
+async::result<void> Controller::_performPioRequest(Request *request) {
+	_programTaskFile(request);
 
 	if(!request->isWrite) {
 		if (_supportsLBA48)
@@ -371,14 +569,20 @@ async::result<void> Controller::_performRequest(Request *request) {
 			}
 		}
 	}
-
-	if(logRequests)
-		std::cout << "block/ata: Reading/writing from " << request->sector
-				<< " complete" << std::endl;
 }
 
 std::vector<std::shared_ptr<Controller>> globalControllers;
 
+// The legacy controller and the PCI IDE function are separate entities.
+// Whichever of them is bound last connects the bus master to the primary channel.
+struct BusMaster {
+	uint16_t offset;
+	helix::UniqueDescriptor bar;
+};
+
+std::optional<BusMaster> primaryBusMaster;
+std::shared_ptr<Controller> primaryController;
+
 // ------------------------------------------------------------------------
 // Freestanding discovery functions.
 // ------------------------------------------------------------------------
@@ -396,10 +600,40 @@ async::detached bindController(mbus::Entity entity) {
 			info.barInfo[0].address, info.barInfo[1].address,
 			std::move(mainBar), std::move(altBar),
 			std::move(irq));
+	if(primaryBusMaster) {
+		controller->attachBusMaster(primaryBusMaster->offset, std::move(primaryBusMaster->bar));
+		primaryBusMaster.reset();
+	}
+	primaryController = controller;
 	controller->run();
 	globalControllers.push_back(std::move(controller));
 }
 
+async::detached bindBusMaster(mbus::Entity entity, int progIf) {
+	// In native mode, the primary channel does not use the legacy ports.
+	if(progIf & 1) {
+		std::cout << "block/ata: IDE controller is in native mode, using PIO" << std::endl;
+		co_return;
+	}
+
+	protocols::hw::Device device(co_await entity.bind());
+	auto info = co_await device.getPciInfo();
+	if(info.barInfo[4].ioType != protocols::hw::IoType::kIoTypePort) {
+		std::cout << "block/ata: IDE controller has no bus master BAR, using PIO" << std::endl;
+		co_return;
+	}
+	auto bar = co_await device.accessBar(4);
+	co_await device.enableBusmaster();
+
+	// The primary channel's registers are the first eight ports of BAR4.
+	BusMaster busMaster{static_cast<uint16_t>(info.barInfo[4].address), std::move(bar)};
+	if(primaryController) {
+		primaryController->attachBusMaster(busMaster.offset, std::move(busMaster.bar));
+	}else{
+		primaryBusMaster = std::move(busMaster);
+	}
+}
+
 async::detached observeControllers() {
 	auto root = co_await mbus::Instance::global().getRoot();
 
@@ -416,6 +650,30 @@ async::detached observeControllers() {
 	co_await root.linkObserver(std::move(filter), std::move(handler));
 }
 
+async::detached observeBusMasters() {
+	auto root = co_await mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("pci-class", "01"),
+		mbus::EqualsFilter("pci-subclass", "01")
+	});
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([] (mbus::Entity entity, mbus::Properties properties) {
+		auto progIf = std::get_if<mbus::StringItem>(&properties["pci-interface"]);
+		if(!progIf)
+			return;
+		auto value = std::stoi(progIf->value, nullptr, 16);
+		// Bit 7 of the programming interface indicates bus master support.
+		if(!(value & 0x80))
+			return;
+		printf("block/ata: detected bus master IDE controller\n");
+		bindBusMaster(std::move(entity), value);
+	});
+
+	co_await root.linkObserver(std::move(filter), std::move(handler));
+}
+
 // --------------------------------------------------------
 // main() function
 // --------------------------------------------------------
@@ -424,5 +682,6 @@ int main() {
 	printf("block/ata: Starting driver\n");
 
 	observeControllers();
+	observeBusMasters();
 	async::run_forever(helix::currentDispatcher);
 }
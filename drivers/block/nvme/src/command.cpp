@@ -1,80 +1,200 @@
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
 #include <arch/bit.hpp>
 #include <helix/memory.hpp>
 #include <unistd.h>
 
 #include "command.hpp"
 
+void ListPool::init(size_t numPages) {
+	static size_t pageSize = getpagesize();
+
+	if (!numPages)
+		return;
+
+	HelHandle memory;
+	void *window;
+	HEL_CHECK(helAllocateMemory(numPages * pageSize, 0, nullptr, &memory));
+	HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr,
+						   0, numPages * pageSize, kHelMapProtRead | kHelMapProtWrite, &window));
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, memory));
+
+	// Each page is physically contiguous on its own; lists are chained page by page.
+	pages_.resize(numPages);
+	for (size_t i = 0; i < numPages; i++) {
+		auto data = reinterpret_cast<char *>(window) + i * pageSize;
+		pages_[i] = ListPage{data, helix::ptrToPhysical(data)};
+		free_.push_back(&pages_[i]);
+	}
+}
+
+ListPage *ListPool::allocate() {
+	if (free_.empty())
+		return nullptr;
+	auto page = free_.back();
+	free_.pop_back();
+	return page;
+}
+
+void ListPool::free(ListPage *page) {
+	free_.push_back(page);
+}
+
 void Command::setupBuffer(arch::dma_buffer_view view) {
-	using arch::convert_endian;
-	using arch::endian;
+	setupBuffers({&view, 1});
+}
 
+void Command::setupBuffers(std::span<const arch::dma_buffer_view> views, bool useSgl) {
 	static size_t pageSize = getpagesize();
 
-	uintptr_t virtStart = reinterpret_cast<uintptr_t>(view.data());
-	auto offset = virtStart % pageSize;
+	useSgl_ = useSgl;
+	prpEntries_.clear();
+	blocks_.clear();
+
+	for (size_t i = 0; i < views.size(); i++) {
+		auto virtStart = reinterpret_cast<uintptr_t>(views[i].data());
+		auto virtEnd = virtStart + views[i].size();
+
+		if (useSgl) {
+			// Merge pages that are also contiguous in physical memory.
+			for (auto virt = virtStart; virt < virtEnd; ) {
+				auto chunkEnd = std::min((virt & ~(pageSize - 1)) + pageSize, virtEnd);
+				auto phys = helix::addressToPhysical(virt);
+				if (!blocks_.empty() && blocks_.back().phys + blocks_.back().length == phys) {
+					blocks_.back().length += chunkEnd - virt;
+				} else {
+					blocks_.push_back(Block{phys, chunkEnd - virt});
+				}
+				virt = chunkEnd;
+			}
+			continue;
+		}
 
-	if (offset + view.size() <= pageSize * 2) {
-		// Inline
-		command_.common.dataPtr.prp1 = convert_endian<endian::little, endian::native>(
-			helix::ptrToPhysical(view.data()));
+		// Only the first PRP entry can point into the middle of a page.
+		assert(!i || !(virtStart % pageSize));
+		assert(i + 1 == views.size() || !(virtEnd % pageSize));
 
-		auto firstPrpLen = pageSize - offset;
-		if (view.size() > firstPrpLen) {
-			command_.common.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
-				helix::ptrToPhysical(view.subview(firstPrpLen).data()));
-		}
+		prpEntries_.push_back(helix::addressToPhysical(virtStart));
+		for (auto page = (virtStart & ~(pageSize - 1)) + pageSize; page < virtEnd; page += pageSize)
+			prpEntries_.push_back(helix::addressToPhysical(page));
+	}
+	assert(!prpEntries_.empty() || !blocks_.empty());
+}
 
-		return;
+void Command::buildDataPointer(ListPool &pool) {
+	if (useSgl_) {
+		buildSgl_(pool);
+	} else if (!prpEntries_.empty()) {
+		buildPrps_(pool);
 	}
+}
 
-	uintptr_t prp1, prp2;
-	auto size = view.size();
+void Command::releaseLists(ListPool &pool) {
+	for (auto page : pooledLists_)
+		pool.free(page);
+	pooledLists_.clear();
+	prpLists.clear();
+}
 
-	prp1 = helix::addressToPhysical(virtStart);
+ListPage Command::allocateList_(ListPool &pool) {
+	static size_t pageSize = getpagesize();
 
-	if (offset + view.size() <= pageSize) {
-		command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-		command_.readWrite.dataPtr.prp2 = 0;
-		return;
+	if (auto page = pool.allocate(); page) {
+		pooledLists_.push_back(page);
+		return *page;
 	}
-	size -= pageSize - offset;
-	virtStart += pageSize - offset;
 
-	if (size <= pageSize) {
-		command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-		command_.readWrite.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
-			helix::addressToPhysical(virtStart));
+	auto prpObj = arch::dma_array<uint64_t>{nullptr, pageSize >> 3};
+	ListPage page{prpObj.data(), helix::ptrToPhysical(prpObj.data())};
+	prpLists.push_back(std::move(prpObj));
+	return page;
+}
+
+void Command::buildPrps_(ListPool &pool) {
+	using arch::convert_endian;
+	using arch::endian;
+
+	static size_t pageSize = getpagesize();
+
+	auto &dataPtr = command_.common.dataPtr;
+	dataPtr.prp1 = convert_endian<endian::little, endian::native>(prpEntries_[0]);
+	dataPtr.prp2 = 0;
+
+	// With up to two entries, no PRP list is required.
+	if (prpEntries_.size() == 2)
+		dataPtr.prp2 = convert_endian<endian::little, endian::native>(prpEntries_[1]);
+	if (prpEntries_.size() <= 2)
 		return;
+
+	// Otherwise, PRP2 points to a list of the remaining entries. If the list does not fit
+	// into a page, the last entry of each page points to the next page of the list.
+	size_t perList = pageSize >> 3;
+	uint64_t *prpList = nullptr;
+	size_t n = 0;
+	for (size_t k = 1; k < prpEntries_.size(); k++) {
+		if (!prpList || (n == perList - 1 && k + 1 < prpEntries_.size())) {
+			auto page = allocateList_(pool);
+			auto listPhys = convert_endian<endian::little, endian::native>(
+				(uint64_t)page.phys);
+			if (!prpList) {
+				dataPtr.prp2 = listPhys;
+			} else {
+				prpList[n] = listPhys;
+			}
+
+			prpList = reinterpret_cast<uint64_t *>(page.data);
+			n = 0;
+		}
+		prpList[n++] = convert_endian<endian::little, endian::native>(prpEntries_[k]);
 	}
+}
 
-	auto prpObj = arch::dma_array<uint64_t>{nullptr, pageSize >> 3};
-	auto *prpList = prpObj.data();
+void Command::buildSgl_(ListPool &pool) {
+	using arch::convert_endian;
+	using arch::endian;
 
-	prp2 = helix::ptrToPhysical(prpList);
-	prpLists.push_back(std::move(prpObj));
+	static size_t pageSize = getpagesize();
 
-	int i = 0;
-	for (;;) {
-		if (i == pageSize >> 3) {
-			auto *oldPrpList = prpList;
-			prpObj = arch::dma_array<uint64_t>{nullptr, pageSize >> 3};
-			prpList = prpObj.data();
-			prpLists.push_back(std::move(prpObj));
-
-			prpList[0] = oldPrpList[i - 1];
-			oldPrpList[i - 1] = convert_endian<endian::little, endian::native>(
-				helix::ptrToPhysical(prpList));
-			i = 1;
+	auto descriptor = [] (uint64_t address, size_t length, uint8_t type) {
+		spec::SglDescriptor desc{};
+		desc.address = convert_endian<endian::little, endian::native>(address);
+		desc.length = convert_endian<endian::little, endian::native>((uint32_t)length);
+		desc.type = type;
+		return desc;
+	};
+
+	// A single data block fits into the command itself. Otherwise, SGL1 points to
+	// a segment of data blocks. If a segment does not fit into a page, its last
+	// descriptor points to the next segment. The pointer to the final segment
+	// must be a "last segment" descriptor.
+	spec::SglDescriptor sgl1;
+	if (blocks_.size() == 1) {
+		sgl1 = descriptor(blocks_[0].phys, blocks_[0].length, spec::kSglDataBlock);
+	} else {
+		size_t perSegment = pageSize / sizeof(spec::SglDescriptor);
+		spec::SglDescriptor *link = &sgl1;
+		size_t k = 0;
+		while (k < blocks_.size()) {
+			auto remaining = blocks_.size() - k;
+			bool last = remaining <= perSegment;
+			auto n = last ? remaining : perSegment - 1;
+
+			// The length includes the pointer to the next segment.
+			auto page = allocateList_(pool);
+			*link = descriptor(page.phys, (last ? n : perSegment) * sizeof(spec::SglDescriptor),
+					last ? spec::kSglLastSegment : spec::kSglSegment);
+
+			auto segment = reinterpret_cast<spec::SglDescriptor *>(page.data);
+			for (size_t i = 0; i < n; i++)
+				segment[i] = descriptor(blocks_[k + i].phys, blocks_[k + i].length,
+						spec::kSglDataBlock);
+			link = &segment[n];
+			k += n;
 		}
-		prpList[i++] = convert_endian<endian::little, endian::native>(
-			helix::addressToPhysical(virtStart));
-		virtStart += pageSize;
-
-		if (size <= pageSize)
-			break;
-		size -= pageSize;
 	}
 
-	command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-	command_.readWrite.dataPtr.prp2 = convert_endian<endian::little, endian::native>(prp2);
+	static_assert(sizeof(sgl1) == sizeof(command_.common.dataPtr));
+	memcpy(&command_.common.dataPtr, &sgl1, sizeof(sgl1));
+	command_.common.flags |= spec::kPsdtSgl;
 }
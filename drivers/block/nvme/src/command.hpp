@@ -1,5 +1,6 @@
 #pragma once
 
+#include <span>
 #include <async/result.hpp>
 #include <async/promise.hpp>
 #include <frg/std_compat.hpp>
@@ -7,6 +8,26 @@
 
 #include "spec.hpp"
 
+// Page that holds (one part of) a PRP list or an SGL segment.
+struct ListPage {
+	void *data;
+	uintptr_t phys;
+};
+
+// Preallocated ListPages; each queue owns one pool such that commands
+// do not need to allocate DMA memory on the hot path.
+struct ListPool {
+	void init(size_t numPages);
+
+	// Returns nullptr if the pool is exhausted.
+	ListPage *allocate();
+	void free(ListPage *page);
+
+private:
+	std::vector<ListPage> pages_;
+	std::vector<ListPage *> free_;
+};
+
 struct Command {
 	using Result = std::pair<uint16_t, spec::CompletionEntry::Result>;
 
@@ -15,6 +36,16 @@ struct Command {
 	}
 
 	void setupBuffer(arch::dma_buffer_view view);
+	// If useSgl is false, all views except for the first one must start at a page
+	// boundary and all views except for the last one must end at a page boundary.
+	// Otherwise, the views can be arbitrary (subject to the SGL alignment of the controller).
+	void setupBuffers(std::span<const arch::dma_buffer_view> views, bool useSgl = false);
+
+	// Called by the queue before the command is submitted.
+	// Builds the PRP list or SGL segments (if any) from the queue's pool.
+	void buildDataPointer(ListPool &pool);
+	// Returns the pages of the lists to the pool.
+	void releaseLists(ListPool &pool);
 
 	async::future<Result, frg::stl_allocator> getFuture() {
 		return promise_.get_future();
@@ -25,7 +56,23 @@ struct Command {
 	}
 
 private:
+	// Physically contiguous part of the buffers.
+	struct Block {
+		uint64_t phys;
+		size_t length;
+	};
+
+	ListPage allocateList_(ListPool &pool);
+	void buildPrps_(ListPool &pool);
+	void buildSgl_(ListPool &pool);
+
 	spec::Command command_;
 	async::promise<Result, frg::stl_allocator> promise_;
+	// PRP entries (if !useSgl_) or SGL data blocks (otherwise).
+	std::vector<uint64_t> prpEntries_;
+	std::vector<Block> blocks_;
+	bool useSgl_ = false;
+	std::vector<ListPage *> pooledLists_;
+	// Only used if the pool is exhausted.
 	std::vector<arch::dma_array<uint64_t>> prpLists;
 };
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <charconv>
+#include <iostream>
+#include <optional>
 #include <arch/bit.hpp>
 #include <helix/timer.hpp>
 
@@ -17,6 +21,7 @@ namespace flags {
 	namespace cap {
 		constexpr arch::field<uint64_t, uint16_t> mqes{0, 16};
 		constexpr arch::field<uint64_t, uint8_t> dstrd{32, 4};
+		constexpr arch::field<uint64_t, uint8_t> mpsmin{48, 4};
 	} // namespace cap
 
 	namespace vs {
@@ -36,16 +41,106 @@ namespace flags {
 	} // namespace csts
 } // namespace flags
 
+namespace {
+	// Maximal number of completions that are handled per queue and IRQ.
+	constexpr int irqBudget = 64;
+
+	// Polled queues are served by a single poller, so they do not need to be deep.
+	constexpr unsigned int polledQueueDepth = 64;
+
+	std::optional<CompletionMode> parseCompletionMode(std::string_view name) {
+		if (name == "irq")
+			return CompletionMode::interrupt;
+		if (name == "poll")
+			return CompletionMode::poll;
+		if (name == "hybrid")
+			return CompletionMode::hybrid;
+		return std::nullopt;
+	}
+
+	const char *completionModeName(CompletionMode mode) {
+		switch (mode) {
+			case CompletionMode::interrupt: return "irq";
+			case CompletionMode::poll: return "poll";
+			case CompletionMode::hybrid: return "hybrid";
+		}
+		return "?";
+	}
+} // namespace
+
+CompletionConfig CompletionConfig::parse(std::string_view cmdline) {
+	constexpr std::string_view prefix = "nvme.completion";
+
+	CompletionConfig config;
+	size_t pos = 0;
+	while (pos < cmdline.size()) {
+		auto end = cmdline.find(' ', pos);
+		if (end == std::string_view::npos)
+			end = cmdline.size();
+		auto token = cmdline.substr(pos, end - pos);
+		pos = end + 1;
+
+		if (token.substr(0, prefix.size()) != prefix)
+			continue;
+		auto eq = token.find('=');
+		if (eq == std::string_view::npos)
+			continue;
+		auto key = token.substr(prefix.size(), eq - prefix.size());
+		auto mode = parseCompletionMode(token.substr(eq + 1));
+		if (!mode) {
+			std::cout << "block/nvme: Ignoring unknown completion mode in " << token << std::endl;
+			continue;
+		}
+
+		if (key.empty()) {
+			config.defaultMode = *mode;
+		} else if (key[0] == '.') {
+			unsigned int nsid;
+			auto digits = key.substr(1);
+			auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), nsid);
+			if (ec == std::errc{} && ptr == digits.data() + digits.size())
+				config.namespaces[nsid] = *mode;
+		}
+	}
+	return config;
+}
+
+CompletionMode CompletionConfig::modeFor(unsigned int nsid) const {
+	if (auto it = namespaces.find(nsid); it != namespaces.end())
+		return it->second;
+	return defaultMode;
+}
+
+bool CompletionConfig::uses(CompletionMode mode) const {
+	if (defaultMode == mode)
+		return true;
+	return std::any_of(namespaces.begin(), namespaces.end(),
+			[&] (const auto &entry) { return entry.second == mode; });
+}
+
 Controller::Controller(int64_t parentId, protocols::hw::Device hwDevice, helix::Mapping hbaRegs,
-					   helix::UniqueDescriptor, helix::UniqueDescriptor irq)
+					   helix::UniqueDescriptor, helix::UniqueDescriptor irq,
+					   CompletionConfig config)
 	: hwDevice_{std::move(hwDevice)}, regsMapping_{std::move(hbaRegs)},
-	  regs_{regsMapping_.get()}, irq_{std::move(irq)}, parentId_{parentId} {
+	  regs_{regsMapping_.get()}, config_{std::move(config)}, parentId_{parentId} {
+	auto legacyVector = std::make_unique<IrqVector>();
+	legacyVector->irq = std::move(irq);
+	irqVectors_.push_back(std::move(legacyVector));
 }
 
 async::detached Controller::run() {
-	co_await hwDevice_.enableBusIrq();
+	auto info = co_await hwDevice_.getPciInfo();
+	numMsis_ = info.numMsis;
+
+	// With MSI-X, each I/O queue can interrupt on its own vector.
+	if (numMsis_) {
+		co_await hwDevice_.enableMsi();
+		irqVectors_.front()->irq = co_await hwDevice_.installMsi(0);
+	} else {
+		co_await hwDevice_.enableBusIrq();
+	}
 
-	handleIrqs();
+	handleIrqs(irqVectors_.front().get());
 
 	co_await reset();
 	co_await scanNamespaces();
@@ -54,23 +149,33 @@ async::detached Controller::run() {
 		ns->run();
 }
 
-async::detached Controller::handleIrqs() {
-	irqSequence_ = 0;
+async::detached Controller::handleIrqs(IrqVector *vector) {
+	uint64_t sequence = 0;
 
 	while (true) {
-		auto await = co_await helix_ng::awaitEvent(irq_, irqSequence_);
+		auto await = co_await helix_ng::awaitEvent(vector->irq, sequence);
 		HEL_CHECK(await.error());
-		irqSequence_ = await.sequence();
-
-		int found = 0;
-		for (auto &q : activeQueues_) {
-			found |= q->handleIrq();
+		sequence = await.sequence();
+
+		bool found = false;
+		bool exhausted = false;
+		for (auto q : vector->queues) {
+			auto completions = q->handleIrq(irqBudget);
+			if (completions)
+				found = true;
+			if (completions == irqBudget)
+				exhausted = true;
 		}
 
-		if (found) {
-			HEL_CHECK(helAcknowledgeIrq(irq_.getHandle(), kHelAckAcknowledge, irqSequence_));
+		// Let the kernel switch to polled mode while we find completions.
+		if (exhausted) {
+			HEL_CHECK(helAcknowledgeIrq(vector->irq.getHandle(),
+					kHelAckAcknowledge | kHelAckPollNow, sequence));
+		} else if (found) {
+			HEL_CHECK(helAcknowledgeIrq(vector->irq.getHandle(),
+					kHelAckAcknowledge | kHelAckPoll, sequence));
 		} else {
-			HEL_CHECK(helAcknowledgeIrq(irq_.getHandle(), kHelAckNack, irqSequence_));
+			HEL_CHECK(helAcknowledgeIrq(vector->irq.getHandle(), kHelAckNack, sequence));
 		}
 	}
 }
@@ -104,6 +209,7 @@ async::result<void> Controller::reset() {
 
 	queueDepth_ = std::min((cap & flags::cap::mqes) + 1, IO_QUEUE_DEPTH);
 	dbStride_ = 1 << (cap & flags::cap::dstrd);
+	minPageSize_ = size_t{0x1000} << (cap & flags::cap::mpsmin);
 
 	version_ = regs_.load(regs::vs);
 
@@ -118,19 +224,123 @@ async::result<void> Controller::reset() {
 	regs_.store(regs::acq, adminQ->getCqPhysAddr());
 
 	adminQ->run();
+	irqVectors_.front()->queues.push_back(adminQ.get());
 	activeQueues_.push_back(std::move(adminQ));
 
 	co_await enable();
 
-	auto ioQ = std::make_unique<Queue>(1, queueDepth_, regs_.subspace(doorbellsOffset + 1 * 8 * dbStride_));
-	ioQ->init();
+	co_await setupIoQueues();
+}
+
+// Negotiates the number of I/O queues; returns the number of SQ/CQ pairs that we may create.
+async::result<unsigned int> Controller::setNumberOfQueues(unsigned int n) {
+	using arch::convert_endian;
+	using arch::endian;
+
+	auto &adminQ = activeQueues_.front();
+	auto cmd = std::make_unique<Command>();
+	auto &cmdBuf = cmd->getCommandBuffer().common;
+
+	cmdBuf.opcode = spec::kSetFeatures;
+	cmdBuf.cdw10 = convert_endian<endian::little, endian::native>(
+			(uint32_t)spec::kFeatureNumberOfQueues);
+	cmdBuf.cdw11 = convert_endian<endian::little, endian::native>(
+			(uint32_t)(((n - 1) << 16) | (n - 1)));
+
+	auto res = co_await adminQ->submitCommand(std::move(cmd));
+	// The controller always supports at least one I/O queue.
+	if (res.first != 0)
+		co_return 1;
+
+	auto allocated = convert_endian<endian::little>(res.second.u32);
+	unsigned int numSqs = (allocated & 0xFFFF) + 1;
+	unsigned int numCqs = (allocated >> 16) + 1;
+	co_return std::min({n, numSqs, numCqs});
+}
+
+// Creates one I/O queue per CPU (or per group of CPUs if there are not enough
+// queues or MSI-X vectors). Queue i serves CPUs i, i + n, i + 2n, ...
+async::result<void> Controller::setupIoQueues() {
+	const auto doorbellsOffset = 0x1000;
+
+	int currentCpu, numCpus;
+	HEL_CHECK(helGetCurrentCpu(&currentCpu, &numCpus));
+
+	// Vector 0 belongs to the admin queue. If there are no other vectors,
+	// additional queues would all interrupt on the same vector; use a single one.
+	bool perQueueVectors = numMsis_ > 1;
+	unsigned int wanted = 1;
+	if (perQueueVectors)
+		wanted = std::min({(unsigned int)numCpus, numMsis_ - 1, MAX_IO_QUEUES});
+
+	// Polled queues come in addition to the per-CPU queues.
+	std::vector<CompletionMode> polledModes;
+	for (auto mode : {CompletionMode::poll, CompletionMode::hybrid}) {
+		if (config_.uses(mode))
+			polledModes.push_back(mode);
+	}
+
+	// If the controller grants fewer queues, keep at least one interrupt-driven queue.
+	auto granted = co_await setNumberOfQueues(wanted + polledModes.size());
+	auto numPolled = std::min<size_t>(polledModes.size(), granted - 1);
+	auto numQueues = granted - numPolled;
+
+	for (unsigned int i = 0; i < numQueues; i++) {
+		unsigned int qid = i + 1;
+		unsigned int vector = perQueueVectors ? qid : 0;
+
+		auto ioQ = std::make_unique<Queue>(qid, queueDepth_,
+				regs_.subspace(doorbellsOffset + qid * 8 * dbStride_), vector);
+		ioQ->init();
+
+		if (!co_await setupIoQueue(ioQ.get())) {
+			std::cout << "block/nvme: Failed to create I/O queue " << qid << std::endl;
+			break;
+		}
+
+		// The CQ does not interrupt before we submit commands, so it is safe to
+		// install the MSI only now.
+		if (vector) {
+			auto irqVector = std::make_unique<IrqVector>();
+			irqVector->irq = co_await hwDevice_.installMsi(vector, i);
+			irqVector->queues.push_back(ioQ.get());
+			handleIrqs(irqVector.get());
+			irqVectors_.push_back(std::move(irqVector));
+		} else {
+			irqVectors_.front()->queues.push_back(ioQ.get());
+		}
 
-	if (co_await setupIoQueue(ioQ.get())) {
 		ioQ->run();
 		activeQueues_.push_back(std::move(ioQ));
 	}
 
 	assert(activeQueues_.size() >= 2 && "At least need one IO queue");
+	auto numIoQueues = activeQueues_.size() - 1;
+	std::cout << "block/nvme: Using " << numIoQueues << " I/O queue(s) for "
+			<< numCpus << " CPU(s)" << std::endl;
+
+	for (int cpu = 0; cpu < numCpus; cpu++)
+		cpuQueues_.push_back(activeQueues_[1 + cpu % numIoQueues].get());
+
+	for (size_t i = 0; i < numPolled; i++) {
+		auto mode = polledModes[i];
+		unsigned int qid = activeQueues_.size();
+
+		auto pollQ = std::make_unique<Queue>(qid, std::min(queueDepth_, polledQueueDepth),
+				regs_.subspace(doorbellsOffset + qid * 8 * dbStride_), 0, mode);
+		pollQ->init();
+
+		if (!co_await setupIoQueue(pollQ.get())) {
+			std::cout << "block/nvme: Failed to create polled I/O queue " << qid << std::endl;
+			break;
+		}
+
+		std::cout << "block/nvme: Using I/O queue " << qid << " for "
+				<< completionModeName(mode) << " completions" << std::endl;
+		pollQ->run();
+		polledQueues_[static_cast<int>(mode)] = pollQ.get();
+		activeQueues_.push_back(std::move(pollQ));
+	}
 }
 
 async::result<bool> Controller::setupIoQueue(Queue *q) {
@@ -153,14 +363,16 @@ async::result<Command::Result> Controller::createCQ(Queue *q) {
 	auto cmd = std::make_unique<Command>();
 	auto &cmdBuf = cmd->getCommandBuffer().createCQ;
 
-	uint16_t flags = spec::kQueuePhysContig | spec::kCQIrqEnabled;
+	uint16_t flags = spec::kQueuePhysContig;
+	if (q->getCompletionMode() == CompletionMode::interrupt)
+		flags |= spec::kCQIrqEnabled;
 
 	cmdBuf.opcode = spec::kCreateCQ;
 	cmdBuf.prp1 = convert_endian<endian::little, endian::native>((uint64_t)q->getCqPhysAddr());
 	cmdBuf.cqid = convert_endian<endian::little, endian::native>((uint16_t)q->getQueueId());
 	cmdBuf.qSize = convert_endian<endian::little, endian::native>((uint16_t)q->getQueueDepth() - 1);
 	cmdBuf.cqFlags = convert_endian<endian::little, endian::native>((uint16_t)flags);
-	cmdBuf.irqVector = 0; // TODO: set to MSI vector
+	cmdBuf.irqVector = convert_endian<endian::little, endian::native>((uint16_t)q->getIrqVector());
 
 	return adminQ->submitCommand(std::move(cmd));
 }
@@ -240,6 +452,12 @@ async::result<void> Controller::scanNamespaces() {
 		co_return;
 
 	nn = convert_endian<endian::little>(idCtrl.nn);
+	// MDTS is in units of the minimum page size.
+	if (idCtrl.mdts)
+		maxTransferSize_ = minPageSize_ << idCtrl.mdts;
+	oncs_ = convert_endian<endian::little>(idCtrl.oncs);
+	vwc_ = idCtrl.vwc;
+	sgls_ = convert_endian<endian::little>(idCtrl.sgls);
 
 	if (version_ >= flags::vs::version(1, 1, 0)) {
 		auto nsList = arch::dma_array<uint32_t>{nullptr, 1024};
@@ -284,12 +502,33 @@ async::result<void> Controller::createNamespace(unsigned int nsid) {
 	if (!lbaShift)
 		lbaShift = 9;
 
-	auto ns = std::make_unique<Namespace>(this, nsid, lbaShift);
+	auto mode = completionModeFor(nsid);
+	if (mode != CompletionMode::interrupt)
+		std::cout << "block/nvme: Namespace " << nsid << " uses "
+				<< completionModeName(mode) << " completions" << std::endl;
+
+	auto ns = std::make_unique<Namespace>(this, nsid, lbaShift, mode);
 	activeNamespaces_.push_back(std::move(ns));
 }
 
-async::result<Command::Result> Controller::submitIoCommand(std::unique_ptr<Command> cmd) {
-	auto &ioQ = activeQueues_.back();
+CompletionMode Controller::completionModeFor(unsigned int nsid) const {
+	auto mode = config_.modeFor(nsid);
+	// Fall back to interrupts if we could not create the polled queue.
+	if (mode != CompletionMode::interrupt && !polledQueues_[static_cast<int>(mode)])
+		return CompletionMode::interrupt;
+	return mode;
+}
+
+async::result<Command::Result> Controller::submitIoCommand(std::unique_ptr<Command> cmd,
+		CompletionMode mode) {
+	if (auto pollQ = polledQueues_[static_cast<int>(mode)]; pollQ)
+		return pollQ->submitCommand(std::move(cmd));
+
+	// Use the queue of the CPU that we run on, such that the completion
+	// interrupt is delivered to the same CPU.
+	int cpu, numCpus;
+	HEL_CHECK(helGetCurrentCpu(&cpu, &numCpus));
+	auto ioQ = cpuQueues_[cpu % cpuQueues_.size()];
 
 	return ioQ->submitCommand(std::move(cmd));
 }
@@ -5,37 +5,105 @@
 #include <helix/memory.hpp>
 #include <protocols/hw/client.hpp>
 
+#include <string_view>
+#include <unordered_map>
+
 #include "queue.hpp"
 #include "namespace.hpp"
 
+// Completion mode of each namespace, parsed from the kernel command line:
+// nvme.completion=<mode> applies to all namespaces, nvme.completion.<nsid>=<mode>
+// to a single namespace. <mode> is one of irq, poll and hybrid.
+struct CompletionConfig {
+	static CompletionConfig parse(std::string_view cmdline);
+
+	CompletionMode modeFor(unsigned int nsid) const;
+	// Whether any namespace may use the given mode.
+	bool uses(CompletionMode mode) const;
+
+	CompletionMode defaultMode = CompletionMode::interrupt;
+	std::unordered_map<unsigned int, CompletionMode> namespaces;
+};
+
 struct Controller {
 	Controller(int64_t parentId, protocols::hw::Device hwDevice, helix::Mapping hbaRegs,
-			   helix::UniqueDescriptor ahciBar, helix::UniqueDescriptor irq);
+			   helix::UniqueDescriptor ahciBar, helix::UniqueDescriptor irq,
+			   CompletionConfig config);
 
 	async::detached run();
 
-	async::result<Command::Result> submitIoCommand(std::unique_ptr<Command> cmd);
+	// Commands with a polled mode go to the corresponding polled queue (if there is one).
+	async::result<Command::Result> submitIoCommand(std::unique_ptr<Command> cmd,
+			CompletionMode mode = CompletionMode::interrupt);
+
+	CompletionMode completionModeFor(unsigned int nsid) const;
 
 	inline int64_t getParentId() const {
 		return parentId_;
 	}
+
+	inline unsigned int getQueueDepth() const {
+		return queueDepth_;
+	}
+
+	// Maximal size of a data transfer in bytes (or zero if there is no limit).
+	inline size_t getMaxTransferSize() const {
+		return maxTransferSize_;
+	}
+
+	inline bool supportsDatasetManagement() const {
+		return oncs_ & spec::kOncsDatasetManagement;
+	}
+
+	inline bool hasVolatileWriteCache() const {
+		return vwc_ & 1;
+	}
+
+	// Whether I/O commands can describe their buffers by SGLs instead of PRPs.
+	inline bool supportsSgl() const {
+		return (sgls_ & 3) == spec::kSglSupported || (sgls_ & 3) == spec::kSglDwordAligned;
+	}
+
+	inline bool sglRequiresDwordAlignment() const {
+		return (sgls_ & 3) == spec::kSglDwordAligned;
+	}
 private:
 	static constexpr int IO_QUEUE_DEPTH = 1024;
+	// Upper bound on the number of I/O queues that we create.
+	static constexpr unsigned int MAX_IO_QUEUES = 64;
+
+	// An interrupt (either the legacy IRQ or an MSI-X vector) and the queues that use it.
+	struct IrqVector {
+		helix::UniqueDescriptor irq;
+		std::vector<Queue *> queues;
+	};
 
 	protocols::hw::Device hwDevice_;
 	helix::Mapping regsMapping_;
 	arch::mem_space regs_;
-	helix::UniqueDescriptor irq_;
 
+	// The admin queue comes first.
 	std::vector<std::unique_ptr<Queue>> activeQueues_;
 	std::vector<std::unique_ptr<Namespace>> activeNamespaces_;
+	// Vector 0 serves the admin queue (and all I/O queues if MSI-X is not available).
+	std::vector<std::unique_ptr<IrqVector>> irqVectors_;
+	// I/O queue of each CPU.
+	std::vector<Queue *> cpuQueues_;
+	// Polled queues, indexed by CompletionMode. They are shared by all CPUs.
+	Queue *polledQueues_[3] = {};
+	CompletionConfig config_;
+	unsigned int numMsis_ = 0;
 
 	int64_t parentId_;
 	unsigned int queueDepth_;
 	uint32_t dbStride_;
 	uint32_t version_;
-
-	uint64_t irqSequence_;
+	size_t maxTransferSize_ = 0;
+	uint16_t oncs_ = 0;
+	uint8_t vwc_ = 0;
+	uint32_t sgls_ = 0;
+	// CAP.MPSMIN in bytes; MDTS is given in these units.
+	size_t minPageSize_ = 0x1000;
 
 	async::result<void> reset();
 	async::result<void> scanNamespaces();
@@ -44,6 +112,8 @@ private:
 	async::result<void> enable();
 	async::result<void> disable();
 
+	async::result<unsigned int> setNumberOfQueues(unsigned int n);
+	async::result<void> setupIoQueues();
 	async::result<bool> setupIoQueue(Queue *q);
 	async::result<Command::Result> createCQ(Queue *q);
 	async::result<Command::Result> createSQ(Queue *q);
@@ -54,5 +124,5 @@ private:
 
 	async::result<void> createNamespace(unsigned int nsid);
 
-	async::detached handleIrqs();
+	async::detached handleIrqs(IrqVector *vector);
 };
@@ -1,11 +1,57 @@
 #include <iostream>
 
+#include <async/promise.hpp>
 #include <protocols/mbus/client.hpp>
 #include <protocols/hw/client.hpp>
+#include <kerncfg.pb.h>
 
 #include "controller.hpp"
 
 std::vector<std::unique_ptr<Controller>> globalControllers;
+CompletionConfig completionConfig;
+
+async::result<std::string> fetchKernelCmdline() {
+	auto root = co_await mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("class", "kerncfg")
+	});
+
+	async::promise<helix::UniqueLane, frg::stl_allocator> promise;
+	auto future = promise.get_future();
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([&promise] (mbus::Entity entity,
+			mbus::Properties) mutable -> async::detached {
+		promise.set_value(helix::UniqueLane(co_await entity.bind()));
+	});
+
+	co_await root.linkObserver(std::move(filter), std::move(handler));
+	auto lane = std::move(*(co_await future.get()));
+
+	managarm::kerncfg::CntRequest req;
+	req.set_req_type(managarm::kerncfg::CntReqType::GET_CMDLINE);
+
+	auto ser = req.SerializeAsString();
+	auto [offer, send_req, recv_resp, recv_cmdline] =
+		co_await helix_ng::exchangeMsgs(lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvInline(),
+				helix_ng::recvInline()
+			)
+		);
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+	HEL_CHECK(recv_cmdline.error());
+
+	managarm::kerncfg::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	assert(resp.error() == managarm::kerncfg::Error::SUCCESS);
+	co_return std::string{reinterpret_cast<const char *>(recv_cmdline.data()),
+			recv_cmdline.length()};
+}
 
 async::detached bindController(mbus::Entity entity) {
 	protocols::hw::Device device(co_await entity.bind());
@@ -19,12 +65,14 @@ async::detached bindController(mbus::Entity entity) {
 	helix::Mapping mapping{bar0, barInfo.offset, barInfo.length};
 
 	auto controller = std::make_unique<Controller>(entity.getId(), std::move(device), std::move(mapping),
-			   std::move(bar0), std::move(irq));
+			   std::move(bar0), std::move(irq), completionConfig);
 	controller->run();
 	globalControllers.push_back(std::move(controller));
 }
 
 async::detached observeControllers() {
+	completionConfig = CompletionConfig::parse(co_await fetchKernelCmdline());
+
 	auto root = co_await mbus::Instance::global().getRoot();
 
 	auto filter = mbus::Conjunction({
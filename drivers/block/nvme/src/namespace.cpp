@@ -1,11 +1,29 @@
+#include <algorithm>
+#include <unistd.h>
 #include <arch/bit.hpp>
 
 #include "namespace.hpp"
 #include "controller.hpp"
 
-Namespace::Namespace(Controller *controller, unsigned int nsid, int lbaShift)
+namespace {
+	constexpr size_t maxDriverTransfer = size_t{2} << 20;
+} // namespace
+
+Namespace::Namespace(Controller *controller, unsigned int nsid, int lbaShift,
+		CompletionMode completionMode)
 	: BlockDevice{(size_t)1 << lbaShift, controller->getParentId()}, controller_(controller), nsid_(nsid),
-	  lbaShift_(lbaShift) {
+	  lbaShift_(lbaShift), completionMode_(completionMode) {
+	// The length field of read and write commands has 16 bits.
+	size_t maxSectors = 0x10000;
+	if (auto maxTransfer = controller->getMaxTransferSize(); maxTransfer)
+		maxSectors = std::min(maxSectors, maxTransfer >> lbaShift);
+	// Larger transfers would need more than two list pages (see ListPool).
+	maxSectors = std::min(maxSectors, maxDriverTransfer >> lbaShift);
+
+	limits.queueDepth = controller->getQueueDepth() - 1;
+	limits.maxSectors = maxSectors;
+	// The PRP list can describe every page of the transfer.
+	limits.maxSegments = std::max(size_t{1}, (maxSectors << lbaShift) / getpagesize());
 }
 
 async::detached Namespace::run() {
@@ -15,35 +33,168 @@ async::detached Namespace::run() {
 }
 
 async::result<void> Namespace::readSectors(uint64_t sector, void *buffer, size_t numSectors) {
+	blockfs::BlockSegment segment{buffer, numSectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::read;
+	request.sector = sector;
+	request.numSectors = numSectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
+}
+
+async::result<void> Namespace::writeSectors(uint64_t sector, const void *buffer, size_t numSectors) {
+	blockfs::BlockSegment segment{const_cast<void *>(buffer), numSectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::write;
+	request.sector = sector;
+	request.numSectors = numSectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
+}
+
+async::result<void> Namespace::submit(const blockfs::BlockRequest &request) {
 	using arch::convert_endian;
 	using arch::endian;
 
-	auto cmd = std::make_unique<Command>();
-	auto &cmdBuf = cmd->getCommandBuffer().readWrite;
+	switch (request.op) {
+		case blockfs::BlockOp::read:
+		case blockfs::BlockOp::write:
+			co_await submitReadWrite_(request);
+			break;
+		case blockfs::BlockOp::flush: {
+			if (!controller_->hasVolatileWriteCache())
+				co_return;
+
+			auto cmd = std::make_unique<Command>();
+			auto &cmdBuf = cmd->getCommandBuffer().common;
+			cmdBuf.opcode = spec::kFlush;
+			cmdBuf.namespaceId = convert_endian<endian::little, endian::native>(nsid_);
+			co_await controller_->submitIoCommand(std::move(cmd), completionMode_);
+			break;
+		}
+		case blockfs::BlockOp::discard:
+			// Discards are only hints; ignore them if the controller does not support them.
+			if (controller_->supportsDatasetManagement())
+				co_await submitDiscard_(request);
+			break;
+		case blockfs::BlockOp::writeZeroes:
+			co_await BlockDevice::submit(request);
+			break;
+	}
+}
 
-	cmdBuf.opcode = spec::kRead;
-	cmdBuf.nsid = convert_endian<endian::little, endian::native>(nsid_);
-	cmdBuf.startLba = convert_endian<endian::little, endian::native>(sector);
-	cmdBuf.length = convert_endian<endian::little, endian::native>((uint16_t)numSectors - 1);
-	cmd->setupBuffer(arch::dma_buffer_view{nullptr, buffer, numSectors << lbaShift_});
+async::result<void> Namespace::submitReadWrite_(const blockfs::BlockRequest &request) {
+	using arch::convert_endian;
+	using arch::endian;
 
-	co_await controller_->submitIoCommand(std::move(cmd));
+	static size_t pageSize = getpagesize();
+
+	// Since PRPs can only describe page-aligned holes between segments, we issue
+	// a separate command whenever a segment boundary is not page aligned.
+	auto issue = [&] (uint64_t sector, size_t numSectors,
+			std::vector<arch::dma_buffer_view> views, bool useSgl) -> async::result<void> {
+		auto cmd = std::make_unique<Command>();
+		auto &cmdBuf = cmd->getCommandBuffer().readWrite;
+
+		cmdBuf.opcode = request.op == blockfs::BlockOp::write ? spec::kWrite : spec::kRead;
+		cmdBuf.nsid = convert_endian<endian::little, endian::native>(nsid_);
+		cmdBuf.startLba = convert_endian<endian::little, endian::native>(sector);
+		cmdBuf.length = convert_endian<endian::little, endian::native>((uint16_t)(numSectors - 1));
+		if (request.op == blockfs::BlockOp::write && (request.flags & blockfs::kBlockFua))
+			cmdBuf.control = convert_endian<endian::little, endian::native>(
+				(uint16_t)spec::kControlFua);
+		cmd->setupBuffers(views, useSgl);
+
+		co_await controller_->submitIoCommand(std::move(cmd), completionMode_);
+	};
+
+	// Whether SGLs can describe the segments of a part with a single command.
+	auto sglCompatible = [&] (const auto &part) {
+		if (!controller_->supportsSgl())
+			return false;
+		if (!controller_->sglRequiresDwordAlignment())
+			return true;
+		for (auto &segment : part.segments) {
+			if (reinterpret_cast<uintptr_t>(segment.buffer) & 3)
+				return false;
+		}
+		return true;
+	};
+
+	blockfs::SplitRequest split{request, sectorSize, limits};
+	for (auto &part : split.parts) {
+		// Transfers that exceed two pages would need a PRP list anyway.
+		// Use a single SGL command for them (and for discontiguous buffers).
+		if ((part.numSectors << lbaShift_) > 2 * pageSize && sglCompatible(part)) {
+			std::vector<arch::dma_buffer_view> views;
+			for (auto &segment : part.segments)
+				views.push_back(arch::dma_buffer_view{nullptr, segment.buffer,
+						segment.numSectors << lbaShift_});
+			co_await issue(part.sector, part.numSectors, std::move(views), true);
+			continue;
+		}
+
+		auto sector = part.sector;
+		uint64_t cmdSector = sector;
+		size_t cmdSectors = 0;
+		std::vector<arch::dma_buffer_view> views;
+
+		for (auto &segment : part.segments) {
+			auto start = reinterpret_cast<uintptr_t>(segment.buffer);
+			auto bytes = segment.numSectors << lbaShift_;
+			if (!views.empty()) {
+				auto &last = views.back();
+				auto lastEnd = reinterpret_cast<uintptr_t>(last.data()) + last.size();
+				if ((start % pageSize) || (lastEnd % pageSize)) {
+					co_await issue(cmdSector, cmdSectors, std::move(views), false);
+					views.clear();
+					cmdSector = sector;
+					cmdSectors = 0;
+				}
+			}
+			views.push_back(arch::dma_buffer_view{nullptr, segment.buffer, bytes});
+			cmdSectors += segment.numSectors;
+			sector += segment.numSectors;
+		}
+
+		if (!views.empty())
+			co_await issue(cmdSector, cmdSectors, std::move(views), false);
+	}
 }
 
-async::result<void> Namespace::writeSectors(uint64_t sector, const void *buffer, size_t numSectors) {
+async::result<void> Namespace::submitDiscard_(const blockfs::BlockRequest &request) {
 	using arch::convert_endian;
 	using arch::endian;
 
-	auto cmd = std::make_unique<Command>();
-	auto &cmdBuf = cmd->getCommandBuffer().readWrite;
+	// A single command takes up to 256 ranges.
+	constexpr size_t maxRanges = 256;
+	constexpr size_t maxRangeLength = 0xFFFFFFFF;
+
+	size_t progress = 0;
+	while (progress < request.numSectors) {
+		auto ranges = arch::dma_array<spec::DsmRange>{nullptr, maxRanges};
+		size_t numRanges = 0;
+		while (numRanges < maxRanges && progress < request.numSectors) {
+			auto n = std::min(request.numSectors - progress, maxRangeLength);
+			ranges[numRanges].attributes = 0;
+			ranges[numRanges].length = convert_endian<endian::little, endian::native>((uint32_t)n);
+			ranges[numRanges].startLba = convert_endian<endian::little, endian::native>(
+				(uint64_t)(request.sector + progress));
+			numRanges++;
+			progress += n;
+		}
 
-	cmdBuf.opcode = spec::kWrite;
-	cmdBuf.nsid = convert_endian<endian::little, endian::native>(nsid_);
-	cmdBuf.startLba = convert_endian<endian::little, endian::native>(sector);
-	cmdBuf.length = convert_endian<endian::little, endian::native>((uint16_t)numSectors - 1);
-	cmd->setupBuffer(arch::dma_buffer_view{nullptr, (char *)buffer, numSectors << lbaShift_});
+		auto cmd = std::make_unique<Command>();
+		auto &cmdBuf = cmd->getCommandBuffer().common;
+		cmdBuf.opcode = spec::kDatasetManagement;
+		cmdBuf.namespaceId = convert_endian<endian::little, endian::native>(nsid_);
+		cmdBuf.cdw10 = convert_endian<endian::little, endian::native>((uint32_t)(numRanges - 1));
+		cmdBuf.cdw11 = convert_endian<endian::little, endian::native>((uint32_t)spec::kDsmDeallocate);
+		cmd->setupBuffer(arch::dma_buffer_view{nullptr, ranges.data(),
+				numRanges * sizeof(spec::DsmRange)});
 
-	co_await controller_->submitIoCommand(std::move(cmd));
+		co_await controller_->submitIoCommand(std::move(cmd), completionMode_);
+	}
 }
 
 async::result<size_t> Namespace::getSize() {
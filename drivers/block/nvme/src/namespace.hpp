@@ -3,19 +3,27 @@
 #include <async/result.hpp>
 #include <blockfs.hpp>
 
+#include "queue.hpp"
+
 struct Controller;
 
 struct Namespace : blockfs::BlockDevice {
-	Namespace(Controller *controller, unsigned int nsid, int lbaShift);
+	Namespace(Controller *controller, unsigned int nsid, int lbaShift,
+			CompletionMode completionMode);
 
 	async::detached run();
 
 	async::result<void> readSectors(uint64_t sector, void *buf, size_t numSectors) override;
 	async::result<void> writeSectors(uint64_t sector, const void *buf, size_t numSectors) override;
+	async::result<void> submit(const blockfs::BlockRequest &request) override;
 	async::result<size_t> getSize() override;
 
 private:
+	async::result<void> submitReadWrite_(const blockfs::BlockRequest &request);
+	async::result<void> submitDiscard_(const blockfs::BlockRequest &request);
+
 	Controller *controller_;
 	unsigned int nsid_;
 	int lbaShift_;
+	CompletionMode completionMode_;
 };
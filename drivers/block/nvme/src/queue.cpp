@@ -1,13 +1,18 @@
+#include <algorithm>
 #include <arch/bit.hpp>
 #include <helix/ipc.hpp>
 #include <helix/memory.hpp>
+#include <helix/timer.hpp>
 
 #include "queue.hpp"
 #include "spec.hpp"
 
-Queue::Queue(unsigned int qid, unsigned int depth, arch::mem_space doorbells)
-	: qid_(qid), depth_(depth), doorbells_(doorbells), sqTail_(0), cqHead_(0), cqPhase_(1) {
+Queue::Queue(unsigned int qid, unsigned int depth, arch::mem_space doorbells,
+		unsigned int irqVector, CompletionMode mode)
+	: qid_(qid), depth_(depth), irqVector_(irqVector), mode_(mode), doorbells_(doorbells),
+	  sqTail_(0), cqHead_(0), cqPhase_(1) {
 	queuedCmds_.resize(depth);
+	submitTimes_.resize(depth);
 }
 
 void Queue::init() {
@@ -34,22 +39,67 @@ void Queue::init() {
 
 	cqPhys_ = helix::ptrToPhysical(cqes_);
 	sqPhys_ = helix::ptrToPhysical(sqCmds_);
+
+	// Most commands do not need a list; commands that find the pool exhausted
+	// allocate their lists on their own.
+	listPool_.init(depth_ / 8);
 }
 
 async::detached Queue::run() {
 	submitPendingLoop();
+	if (mode_ != CompletionMode::interrupt)
+		pollLoop();
 
 	co_return;
 }
 
-int Queue::handleIrq() {
+uint64_t Queue::oldestSubmission() const {
+	uint64_t oldest = UINT64_MAX;
+	for (size_t i = 0; i < queuedCmds_.size(); i++) {
+		if (queuedCmds_[i])
+			oldest = std::min(oldest, submitTimes_[i]);
+	}
+	return oldest;
+}
+
+async::detached Queue::pollLoop() {
+	// Maximal number of completions that are handled per iteration.
+	constexpr int pollBudget = 64;
+
+	bool spinning = false;
+	while (true) {
+		if (!commandsInFlight_) {
+			co_await submitDoorbell_.async_wait();
+			continue;
+		}
+
+		// Hybrid polling: the device is unlikely to complete the oldest command
+		// before half of the mean completion time has passed.
+		if (mode_ == CompletionMode::hybrid && !spinning) {
+			auto target = oldestSubmission() + meanLatency_ / 2;
+			auto now = helix::currentClock();
+			if (target > now)
+				co_await helix::sleepFor(target - now);
+			spinning = true;
+		}
+
+		if (handleIrq(pollBudget)) {
+			spinning = false;
+		} else {
+			// Let the dispatcher process other events (including new requests).
+			co_await helix::sleepFor(0);
+		}
+	}
+}
+
+int Queue::handleIrq(int budget) {
 	using arch::convert_endian;
 	using arch::endian;
 
 	int found = 0;
 	spec::CompletionEntry *cqe = &cqes_[cqHead_];
 
-	while ((convert_endian<endian::little>(cqe->status) & 1) == cqPhase_) {
+	while (found < budget && (convert_endian<endian::little>(cqe->status) & 1) == cqPhase_) {
 		found++;
 
 		auto status = convert_endian<endian::little>(cqe->status) >> 1;
@@ -58,6 +108,11 @@ int Queue::handleIrq() {
 		assert(queuedCmds_[slot]);
 
 		std::unique_ptr<Command> cmd = std::move(queuedCmds_[slot]);
+		cmd->releaseLists(listPool_);
+		if (mode_ == CompletionMode::hybrid) {
+			auto latency = helix::currentClock() - submitTimes_[slot];
+			meanLatency_ = meanLatency_ ? (meanLatency_ * 7 + latency) / 8 : latency;
+		}
 		cmd->complete(status, cqe->result);
 
 		if (++cqHead_ == depth_) {
@@ -104,6 +159,8 @@ async::detached Queue::submitPendingLoop() {
 async::result<void> Queue::submitCommandToDevice(std::unique_ptr<Command> cmd) {
 	auto slot = co_await findFreeSlot();
 
+	cmd->buildDataPointer(listPool_);
+
 	auto &cmdBuf = cmd->getCommandBuffer();
 	cmdBuf.common.commandId = (uint16_t)slot;
 
@@ -113,7 +170,11 @@ async::result<void> Queue::submitCommandToDevice(std::unique_ptr<Command> cmd) {
 	doorbells_.store(arch::scalar_register<uint32_t>{0}, sqTail_);
 
 	queuedCmds_[slot] = std::move(cmd);
+	if (mode_ == CompletionMode::hybrid)
+		submitTimes_[slot] = helix::currentClock();
 	commandsInFlight_++;
+	if (mode_ != CompletionMode::interrupt)
+		submitDoorbell_.raise();
 }
 
 async::result<Command::Result> Queue::submitCommand(std::unique_ptr<Command> cmd) {
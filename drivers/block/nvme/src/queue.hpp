@@ -8,8 +8,18 @@
 #include "command.hpp"
 #include "spec.hpp"
 
+// How the driver learns about completions.
+enum class CompletionMode {
+	interrupt,
+	// The queue has no interrupt; a poller spins on the CQ while commands are in flight.
+	poll,
+	// Like poll, but the poller first sleeps for half of the mean completion time.
+	hybrid
+};
+
 struct Queue {
-	Queue(unsigned int index, unsigned int depth, arch::mem_space doorbells);
+	Queue(unsigned int index, unsigned int depth, arch::mem_space doorbells,
+			unsigned int irqVector = 0, CompletionMode mode = CompletionMode::interrupt);
 
 	void init();
 	async::detached run();
@@ -20,6 +30,13 @@ struct Queue {
 	unsigned int getQueueDepth() const {
 		return depth_;
 	}
+	// MSI-X vector that the CQ interrupts on.
+	unsigned int getIrqVector() const {
+		return irqVector_;
+	}
+	CompletionMode getCompletionMode() const {
+		return mode_;
+	}
 
 	uintptr_t getCqPhysAddr() const {
 		return cqPhys_;
@@ -30,11 +47,14 @@ struct Queue {
 
 	async::result<Command::Result> submitCommand(std::unique_ptr<Command> cmd);
 
-	int handleIrq();
+	// Handles at most budget completions; returns the number of handled completions.
+	int handleIrq(int budget);
 
 private:
 	unsigned int qid_;
 	unsigned int depth_;
+	unsigned int irqVector_;
+	CompletionMode mode_;
 	arch::mem_space doorbells_;
 	spec::CompletionEntry *cqes_;
 	void *sqCmds_;
@@ -47,11 +67,21 @@ private:
 	async::queue<std::unique_ptr<Command>, frg::stl_allocator> pendingCmdQueue_;
 
 	std::vector<std::unique_ptr<Command>> queuedCmds_;
+	// Submission time of the command in each slot (only for hybrid polling).
+	std::vector<uint64_t> submitTimes_;
+	ListPool listPool_;
 	async::recurring_event freeSlotDoorbell_;
-	size_t commandsInFlight_;
+	size_t commandsInFlight_ = 0;
+
+	// Wakes up the poller when a command is submitted.
+	async::recurring_event submitDoorbell_;
+	// Moving average of the completion time of hybrid polled commands (in ns).
+	uint64_t meanLatency_ = 0;
 
 	async::result<size_t> findFreeSlot();
 	async::detached submitPendingLoop();
+	async::detached pollLoop();
+	uint64_t oldestSubmission() const;
 
 	async::result<void> submitCommandToDevice(std::unique_ptr<Command> cmd);
 };
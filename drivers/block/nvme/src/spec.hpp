@@ -3,16 +3,73 @@
 namespace spec {
 
 enum CommandOpcode {
+	kFlush = 0x00,
 	kWrite = 0x01,
 	kRead = 0x02,
+	kDatasetManagement = 0x09,
 };
 
+// Bits of ReadWriteCommand::control.
+enum ReadWriteControl {
+	kControlFua = 1 << 14,
+};
+
+// Bits of the optional NVM commands supported by the controller (IdentifyController::oncs).
+enum OptionalCommands {
+	kOncsDatasetManagement = 1 << 2,
+};
+
+// Attributes of dataset management commands (CDW11).
+enum DatasetManagementAttributes {
+	kDsmDeallocate = 1 << 2,
+};
+
+// Bits 0-1 of IdentifyController::sgls.
+enum SglSupport {
+	kSglSupported = 1,
+	// Data blocks must be dword aligned and have a length that is a multiple of 4.
+	kSglDwordAligned = 2,
+};
+
+// PSDT field of CommonCommand::flags: the data pointer is an SGL descriptor.
+enum CommandFlagsPsdt {
+	kPsdtSgl = 1 << 6,
+};
+
+enum SglDescriptorType {
+	kSglDataBlock = 0x00,
+	kSglSegment = 0x20,
+	kSglLastSegment = 0x30,
+};
+
+struct SglDescriptor {
+	uint64_t address;
+	uint32_t length;
+	uint8_t __reserved[3];
+	uint8_t type;
+};
+static_assert(sizeof(SglDescriptor) == 16);
+
+struct DsmRange {
+	uint32_t attributes;
+	uint32_t length; // In logical blocks.
+	uint64_t startLba;
+};
+static_assert(sizeof(DsmRange) == 16);
+
 enum AdminOpcode {
 	kDeleteSQ = 0x0,
 	kCreateSQ = 0x1,
 	kDeleteCQ = 0x4,
 	kCreateCQ = 0x5,
 	kIdentify = 0x6,
+	kSetFeatures = 0x9,
+};
+
+enum FeatureId {
+	// CDW11 and the result contain the number of SQs (bits 0-15) and CQs (bits 16-31),
+	// both zero-based.
+	kFeatureNumberOfQueues = 0x07,
 };
 
 enum CommandFlags {
@@ -1,20 +1,38 @@
 
 #include <stdlib.h>
 #include <iostream>
+#include <memory>
+#include <vector>
+
+#include <hel.h>
+#include <hel-syscalls.h>
+#include <helix/timer.hpp>
 
 #include "block.hpp"
 
 namespace block {
 namespace virtio {
 
-static bool logInitiateRetire = false;
+namespace {
+
+// Maximal number of requests that are posted with a single update of the available ring.
+constexpr size_t maxPostBatch = 16;
+
+void completeRequest(virtio_core::Request *base_request) {
+	auto request = static_cast<UserRequest *>(base_request);
+	request->event.raise();
+}
+
+} // anonymous namespace
 
 // --------------------------------------------------------
 // UserRequest
 // --------------------------------------------------------
 
-UserRequest::UserRequest(bool write_, uint64_t sector_, void *buffer_, size_t num_sectors_)
-: write{write_}, sector{sector_}, buffer{buffer_}, numSectors{num_sectors_} { }
+UserRequest::UserRequest(uint32_t type_, uint64_t sector_,
+		std::span<const blockfs::BlockSegment> segments_, size_t num_sectors_)
+: type{type_}, sector{sector_}, segments{segments_}, numSectors{num_sectors_},
+		discardSegment{} { }
 
 // --------------------------------------------------------
 // Device
@@ -22,137 +40,348 @@ UserRequest::UserRequest(bool write_, uint64_t sector_, void *buffer_, size_t nu
 
 Device::Device(std::unique_ptr<virtio_core::Transport> transport, int64_t parent_id)
 : blockfs::BlockDevice{512, parent_id}, _transport{std::move(transport)},
-		_requestQueue{nullptr}, _size{0} { }
+		_size{0} { }
+
+async::result<void> Device::setupTracing() {
+	_ostContext = co_await protocols::ostrace::createContext();
+	_ostSubmitEvent = co_await _ostContext.announceEvent("virtio-blk.submit");
+	_ostRetireEvent = co_await _ostContext.announceEvent("virtio-blk.retire");
+	_ostTypeItem = co_await _ostContext.announceItem("type");
+	_ostSectorsItem = co_await _ostContext.announceItem("numSectors");
+	_ostSegmentsItem = co_await _ostContext.announceItem("numSegments");
+	_ostQueueItem = co_await _ostContext.announceItem("queue");
+	_ostLatencyItem = co_await _ostContext.announceItem("latency");
+}
 
 void Device::runDevice() {
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_SIZE_MAX)) {
+		auto size_max = _transport->loadConfig32(spec::cfg::sizeMax);
+		if(size_max)
+			_maxChunk = size_max;
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_SIZE_MAX);
+	}
+	size_t seg_max = 0;
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_SEG_MAX)) {
+		seg_max = _transport->loadConfig32(spec::cfg::segMax);
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_SEG_MAX);
+	}
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_FLUSH)) {
+		_supportsFlush = true;
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_FLUSH);
+	}
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_DISCARD)) {
+		_supportsDiscard = true;
+		if(auto max = _transport->loadConfig32(spec::cfg::maxDiscardSectors); max)
+			_maxDiscardSectors = max;
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_DISCARD);
+	}
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_WRITE_ZEROES)) {
+		_supportsWriteZeroes = true;
+		if(auto max = _transport->loadConfig32(spec::cfg::maxWriteZeroesSectors); max)
+			_maxWriteZeroesSectors = max;
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_WRITE_ZEROES);
+	}
+	size_t num_queues = 1;
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_MQ)) {
+		num_queues = std::max(_transport->loadConfig16(spec::cfg::numQueues), uint16_t{1});
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_MQ);
+	}
+	if(_transport->checkDeviceFeature(virtio_core::VIRTIO_RING_F_INDIRECT_DESC)) {
+		_useIndirect = true;
+		_transport->acknowledgeDriverFeature(virtio_core::VIRTIO_RING_F_INDIRECT_DESC);
+	}
+
+	// Use one virtq per CPU (if the device offers that many).
+	int cpu, num_cpus;
+	HEL_CHECK(helGetCurrentCpu(&cpu, &num_cpus));
+	num_queues = std::min(num_queues, static_cast<size_t>(num_cpus));
+
 	_transport->finalizeFeatures();
-	_transport->claimQueues(1);
-	_requestQueue = _transport->setupQueue(0);
+	_transport->claimQueues(num_queues);
+	for(size_t i = 0; i < num_queues; i++) {
+		auto queue = std::make_unique<RequestQueue>();
+		queue->virtq = _transport->setupQueue(i);
+		_queues.push_back(std::move(queue));
+	}
 
 	auto size = static_cast<uint64_t>(_transport->space().load(spec::regs::capacity[0]))
 			| (static_cast<uint64_t>(_transport->space().load(spec::regs::capacity[1])) << 32);
-	std::cout << "virtio: Disk size: " << size << " sectors" << std::endl;
+	std::cout << "virtio: Disk size: " << size << " sectors, " << num_queues << " queue(s)"
+			<< (_useIndirect ? ", indirect descriptors" : "") << std::endl;
 	_size = size;
 
 	_transport->runDevice();
 
 	// perform device specific setup
-	virtRequestBuffer = new VirtRequest[_requestQueue->numDescriptors()];
-	statusBuffer = new uint8_t[_requestQueue->numDescriptors()];
+	for(auto &queue : _queues) {
+		queue->headers = new VirtRequest[queue->virtq->numDescriptors()];
+		queue->status = new uint8_t[queue->virtq->numDescriptors()];
+
+		// natural alignment makes sure that request headers do not cross page boundaries
+		assert((uintptr_t)queue->headers % sizeof(VirtRequest) == 0);
+	}
+
+	// Apart from the header and status descriptors, each page of a segment needs
+	// a descriptor, plus one extra descriptor if the segment is not page aligned.
+	// With indirect descriptors, a request only occupies one descriptor of the virtq.
+	// Otherwise, limit requests to a quarter of the virtq to ensure that we don't
+	// monopolize the device.
+	auto num_descriptors = _queues.front()->virtq->numDescriptors();
+	size_t data_descriptors;
+	if(_useIndirect) {
+		data_descriptors = maxIndirectDescriptors - 2;
+	}else{
+		data_descriptors = num_descriptors / 4 - 2;
+	}
+	if(seg_max)
+		data_descriptors = std::min(data_descriptors, seg_max);
+
+	// If SIZE_MAX is smaller than a page, each page takes multiple descriptors.
+	size_t descriptors_per_page = 1;
+	if(_maxChunk < 0x1000)
+		descriptors_per_page = (0x1000 + _maxChunk - 1) / _maxChunk;
+	auto max_pages = data_descriptors / (2 * descriptors_per_page);
+	assert(max_pages >= 1);
 
-	// natural alignment makes sure that request headers do not cross page boundaries
-	assert((uintptr_t)virtRequestBuffer % sizeof(VirtRequest) == 0);
+	limits.queueDepth = num_queues * (_useIndirect ? num_descriptors : 4);
+	limits.maxSegments = max_pages;
+	limits.maxSectors = max_pages * (0x1000 / 512);
 
 	// setup an interrupt for the device
-	_processRequests();
+	for(auto &queue : _queues)
+		_processRequests(queue.get());
 
 	blockfs::runDevice(this);
 }
 
 async::result<void> Device::readSectors(uint64_t sector,
 		void *buffer, size_t num_sectors) {
-	// Natural alignment makes sure a sector does not cross a page boundary.
-	assert(!((uintptr_t)buffer % 512));
-//	printf("readSectors(%lu, %lu)\n", sector, num_sectors);
-
-	// Limit to ensure that we don't monopolize the device.
-	auto max_sectors = _requestQueue->numDescriptors() / 4;
-	assert(max_sectors >= 1);
-
-	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
-		auto request = new UserRequest(false, sector + progress,
-				(char *)buffer + 512 * progress,
-				std::min(num_sectors - progress, max_sectors));
-		_pendingQueue.push(request);
-		_pendingDoorbell.raise();
-		co_await request->event.wait();
-		delete request;
-	}
+	blockfs::BlockSegment segment{buffer, num_sectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::read;
+	request.sector = sector;
+	request.numSectors = num_sectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
 }
 
 async::result<void> Device::writeSectors(uint64_t sector,
 		const void *buffer, size_t num_sectors) {
+	blockfs::BlockSegment segment{const_cast<void *>(buffer), num_sectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::write;
+	request.sector = sector;
+	request.numSectors = num_sectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
+}
+
+async::result<void> Device::submit(const blockfs::BlockRequest &request) {
+	auto queue = _currentQueue();
+
+	if(request.op == blockfs::BlockOp::flush) {
+		if(!_supportsFlush)
+			co_return;
+		auto user_request = std::make_unique<UserRequest>(VIRTIO_BLK_T_FLUSH,
+				0, std::span<const blockfs::BlockSegment>{}, 0);
+		co_await _submitCommand(queue, user_request.get());
+		co_return;
+	}
+
+	if(request.op == blockfs::BlockOp::discard) {
+		// Discards are only hints, we can ignore them if the device does not support them.
+		if(!_supportsDiscard)
+			co_return;
+		co_await _submitRange(queue, VIRTIO_BLK_T_DISCARD,
+				request.sector, request.numSectors, _maxDiscardSectors);
+		co_return;
+	}
+
+	if(request.op == blockfs::BlockOp::writeZeroes) {
+		if(!_supportsWriteZeroes) {
+			co_await BlockDevice::submit(request);
+			co_return;
+		}
+		co_await _submitRange(queue, VIRTIO_BLK_T_WRITE_ZEROES,
+				request.sector, request.numSectors, _maxWriteZeroesSectors);
+		co_return;
+	}
+
 	// Natural alignment makes sure a sector does not cross a page boundary.
-	assert(!((uintptr_t)buffer % 512));
-//	printf("writeSectors(%lu, %lu)\n", sector, num_sectors);
-
-	// Limit to ensure that we don't monopolize the device.
-	auto max_sectors = _requestQueue->numDescriptors() / 4;
-	assert(max_sectors >= 1);
-
-	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
-		auto request = new UserRequest(true, sector + progress,
-				(char *)buffer + 512 * progress,
-				std::min(num_sectors - progress, max_sectors));
-		_pendingQueue.push(request);
-		_pendingDoorbell.raise();
-		co_await request->event.wait();
-		delete request;
+	for(auto &segment : request.segments)
+		assert(!((uintptr_t)segment.buffer % 512));
+
+	auto type = request.op == blockfs::BlockOp::write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+
+	// Queue all parts at once such that the device can process them in parallel.
+	blockfs::SplitRequest split{request, 512, limits};
+	std::vector<std::unique_ptr<UserRequest>> user_requests;
+	for(auto &part : split.parts) {
+		auto user_request = std::make_unique<UserRequest>(type, part.sector,
+				part.segments, part.numSectors);
+		queue->pending.push(user_request.get());
+		user_requests.push_back(std::move(user_request));
+	}
+	queue->doorbell.raise();
+	for(auto &user_request : user_requests)
+		co_await _retire(user_request.get());
+
+	// virtio-blk does not know FUA writes; emulate them by a flush.
+	if(request.op == blockfs::BlockOp::write && (request.flags & blockfs::kBlockFua)
+			&& _supportsFlush) {
+		auto user_request = std::make_unique<UserRequest>(VIRTIO_BLK_T_FLUSH,
+				0, std::span<const blockfs::BlockSegment>{}, 0);
+		co_await _submitCommand(queue, user_request.get());
+	}
+}
+
+RequestQueue *Device::_currentQueue() {
+	if(_queues.size() == 1)
+		return _queues.front().get();
+
+	// The driver runs on a single thread; the CPU that it currently runs on
+	// decides which virtq the request goes to.
+	int cpu, num_cpus;
+	HEL_CHECK(helGetCurrentCpu(&cpu, &num_cpus));
+	return _queues[cpu % _queues.size()].get();
+}
+
+async::result<void> Device::_submitCommand(RequestQueue *queue, UserRequest *request) {
+	queue->pending.push(request);
+	queue->doorbell.raise();
+	co_await _retire(request);
+}
+
+async::result<void> Device::_submitRange(RequestQueue *queue, uint32_t type,
+		uint64_t sector, size_t num_sectors, size_t max_sectors) {
+	for(size_t progress = 0; progress < num_sectors; ) {
+		auto n = std::min(num_sectors - progress, max_sectors);
+		auto user_request = std::make_unique<UserRequest>(type,
+				0, std::span<const blockfs::BlockSegment>{}, n);
+		user_request->discardSegment.sector = sector + progress;
+		user_request->discardSegment.numSectors = n;
+		co_await _submitCommand(queue, user_request.get());
+		progress += n;
 	}
 }
 
+async::result<void> Device::_retire(UserRequest *request) {
+	co_await request->event.wait();
+
+	protocols::ostrace::Event oste{&_ostContext, _ostRetireEvent};
+	oste.withCounter(_ostTypeItem, request->type);
+	oste.withCounter(_ostSectorsItem, request->numSectors);
+	oste.withCounter(_ostLatencyItem, helix::currentClock() - request->submitTime);
+	co_await oste.emit();
+}
+
 async::result<size_t> Device::getSize() {
 	co_return _size * 512;
 }
 
-async::detached Device::_processRequests() {
+async::detached Device::_processRequests(RequestQueue *queue) {
+	// Requests that are set up but not posted yet.
+	std::vector<virtio_core::Handle> heads;
+	std::vector<virtio_core::Request *> batch;
+	// Keep enough descriptors free for in-flight requests to make progress.
+	auto batch_size = std::min(maxPostBatch, queue->virtq->numDescriptors() / 2);
+
 	while(true) {
-		if(_pendingQueue.empty()) {
-			co_await _pendingDoorbell.async_wait();
+		if(queue->pending.empty()) {
+			if(!heads.empty()) {
+				queue->virtq->postBatch(heads, batch, &completeRequest);
+				heads.clear();
+				batch.clear();
+			}
+			co_await queue->doorbell.async_wait();
 			continue;
 		}
 
-		auto request = _pendingQueue.front();
-		_pendingQueue.pop();
-		assert(request->numSectors);
+		auto request = queue->pending.front();
+		queue->pending.pop();
 
-		// Setup the descriptor for the request header.
-		virtio_core::Chain chain;
-		chain.append(co_await _requestQueue->obtainDescriptor());
+		// Setup the request header.
+		auto head = co_await queue->virtq->obtainDescriptor();
+		VirtRequest *header = &queue->headers[head.tableIndex()];
+		header->type = request->type;
+		header->reserved = 0;
+		header->sector = request->sector;
 
-		VirtRequest *header = &virtRequestBuffer[chain.front().tableIndex()];
-		if(request->write) {
-			header->type = VIRTIO_BLK_T_OUT;
+		arch::dma_buffer_view header_view{nullptr, header, sizeof(VirtRequest)};
+		arch::dma_buffer_view status_view{nullptr, &queue->status[head.tableIndex()], 1};
+		bool has_payload = request->type == VIRTIO_BLK_T_DISCARD
+				|| request->type == VIRTIO_BLK_T_WRITE_ZEROES;
+		arch::dma_buffer_view payload_view{nullptr,
+				&request->discardSegment, sizeof(VirtDiscardSegment)};
+
+		if(_useIndirect) {
+			// The whole request goes into the indirect table; the head refers to it.
+			virtio_core::IndirectChain chain{request->indirectTable, maxIndirectDescriptors};
+			chain.setupBuffer(virtio_core::hostToDevice, header_view);
+			if(has_payload)
+				chain.setupBuffer(virtio_core::hostToDevice, payload_view);
+			for(auto &segment : request->segments) {
+				arch::dma_buffer_view view{nullptr, segment.buffer, 512 * segment.numSectors};
+				if(request->type == VIRTIO_BLK_T_OUT) {
+					virtio_core::scatterGather(virtio_core::hostToDevice,
+							chain, view, _maxChunk);
+				}else{
+					virtio_core::scatterGather(virtio_core::deviceToHost,
+							chain, view, _maxChunk);
+				}
+			}
+			chain.setupBuffer(virtio_core::deviceToHost, status_view);
+			chain.attach(head);
 		}else{
-			header->type = VIRTIO_BLK_T_IN;
+			virtio_core::Chain chain;
+			chain.append(head);
+			chain.setupBuffer(virtio_core::hostToDevice, header_view);
+
+			// Setup descriptors for the transfered data.
+			if(has_payload) {
+				chain.append(co_await queue->virtq->obtainDescriptor());
+				chain.setupBuffer(virtio_core::hostToDevice, payload_view);
+			}
+			for(auto &segment : request->segments) {
+				arch::dma_buffer_view view{nullptr, segment.buffer, 512 * segment.numSectors};
+				if(request->type == VIRTIO_BLK_T_OUT) {
+					co_await virtio_core::scatterGather(virtio_core::hostToDevice,
+							chain, queue->virtq, view, _maxChunk);
+				}else{
+					co_await virtio_core::scatterGather(virtio_core::deviceToHost,
+							chain, queue->virtq, view, _maxChunk);
+				}
+			}
+
+			// Setup a descriptor for the status byte.
+			chain.append(co_await queue->virtq->obtainDescriptor());
+			chain.setupBuffer(virtio_core::deviceToHost, status_view);
 		}
-		header->reserved = 0;
-		header->sector = request->sector;
 
-		chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
-				header, sizeof(VirtRequest)});
-
-		// Setup descriptors for the transfered data.
-		for(size_t i = 0; i < request->numSectors; i++) {
-			chain.append(co_await _requestQueue->obtainDescriptor());
-			if(request->write) {
-				chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
-						(char *)request->buffer + 512 * i, 512});
-			}else{
-				chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr,
-						(char *)request->buffer + 512 * i, 512});
+		// Submit the request to the device.
+		request->submitTime = helix::currentClock();
+		if(_useIndirect) {
+			heads.push_back(head);
+			batch.push_back(request);
+			if(heads.size() >= batch_size) {
+				queue->virtq->postBatch(heads, batch, &completeRequest);
+				heads.clear();
+				batch.clear();
 			}
+		}else{
+			// Without indirect tables, the next request might need more descriptors
+			// than are free, so we cannot hold back this one.
+			queue->virtq->postDescriptor(head, request, &completeRequest);
+			if(queue->pending.empty())
+				queue->virtq->notify();
 		}
 
-		if(logInitiateRetire)
-			std::cout << "Submitting " << request->numSectors
-					<< " data descriptors" << std::endl;
-
-		// Setup a descriptor for the status byte.
-		chain.append(co_await _requestQueue->obtainDescriptor());
-		chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr,
-				&statusBuffer[chain.front().tableIndex()], 1});
-
-		// Submit the request to the device
-		_requestQueue->postDescriptor(chain.front(), request,
-				[] (virtio_core::Request *base_request) {
-			auto request = static_cast<UserRequest *>(base_request);
-			if(logInitiateRetire)
-				std::cout << "Retiring " << request->numSectors
-						<< " data descriptors" << std::endl;
-			request->event.raise();
-		});
-		_requestQueue->notify();
+		protocols::ostrace::Event oste{&_ostContext, _ostSubmitEvent};
+		oste.withCounter(_ostTypeItem, request->type);
+		oste.withCounter(_ostSectorsItem, request->numSectors);
+		oste.withCounter(_ostSegmentsItem, request->segments.size());
+		oste.withCounter(_ostQueueItem, queue->virtq->queueIndex());
+		co_await oste.emit();
 	}
 }
 
@@ -1,9 +1,13 @@
 
+#include <memory>
 #include <queue>
+#include <span>
+#include <vector>
 
 #include <blockfs.hpp>
 #include <core/virtio/core.hpp>
 #include <async/oneshot-event.hpp>
+#include <protocols/ostrace/ostrace.hpp>
 
 namespace block {
 namespace virtio {
@@ -21,15 +25,46 @@ static_assert(sizeof(VirtRequest) == 16, "Bad sizeof(VirtRequest)");
 
 enum {
 	VIRTIO_BLK_T_IN = 0,
-	VIRTIO_BLK_T_OUT = 1
+	VIRTIO_BLK_T_OUT = 1,
+	VIRTIO_BLK_T_FLUSH = 4,
+	VIRTIO_BLK_T_DISCARD = 11,
+	VIRTIO_BLK_T_WRITE_ZEROES = 13
 };
 
+enum {
+	VIRTIO_BLK_F_SIZE_MAX = 1,
+	VIRTIO_BLK_F_SEG_MAX = 2,
+	VIRTIO_BLK_F_FLUSH = 9,
+	VIRTIO_BLK_F_MQ = 12,
+	VIRTIO_BLK_F_DISCARD = 13,
+	VIRTIO_BLK_F_WRITE_ZEROES = 14
+};
+
+// Payload of VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES requests.
+struct VirtDiscardSegment {
+	uint64_t sector;
+	uint32_t numSectors;
+	uint32_t flags;
+};
+static_assert(sizeof(VirtDiscardSegment) == 16, "Bad sizeof(VirtDiscardSegment)");
+
 namespace spec::regs {
 	inline constexpr arch::scalar_register<uint32_t> capacity[] = {
 			arch::scalar_register<uint32_t>{0},
 			arch::scalar_register<uint32_t>{4}};
 }
 
+namespace spec::cfg {
+	inline constexpr size_t sizeMax = 8;
+	inline constexpr size_t segMax = 12;
+	inline constexpr size_t numQueues = 34;
+	inline constexpr size_t maxDiscardSectors = 36;
+	inline constexpr size_t maxWriteZeroesSectors = 48;
+}
+
+// Size of the indirect descriptor table of each request.
+inline constexpr size_t maxIndirectDescriptors = 64;
+
 struct Device;
 
 // --------------------------------------------------------
@@ -37,16 +72,49 @@ struct Device;
 // --------------------------------------------------------
 
 struct UserRequest : virtio_core::Request {
-	UserRequest(bool write, uint64_t sector, void *buffer, size_t num_sectors);
+	UserRequest(uint32_t type, uint64_t sector,
+			std::span<const blockfs::BlockSegment> segments, size_t num_sectors);
 
-	bool write;
+	// One of VIRTIO_BLK_T_*.
+	uint32_t type;
 	uint64_t sector;
-	void *buffer;
+	std::span<const blockfs::BlockSegment> segments;
 	size_t numSectors;
 
+	// Payload of VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES requests.
+	// Natural alignment makes sure that it does not cross a page boundary.
+	alignas(16) VirtDiscardSegment discardSegment;
+
+	// Used if VIRTIO_RING_F_INDIRECT_DESC was negotiated. Again, the alignment
+	// makes sure that the table does not cross a page boundary.
+	// Since coroutine frames do not respect this alignment, allocate UserRequests on the heap.
+	alignas(maxIndirectDescriptors * sizeof(virtio_core::spec::Descriptor))
+	virtio_core::spec::Descriptor indirectTable[maxIndirectDescriptors];
+
+	// Time at which the request was posted to the device (for tracing).
+	uint64_t submitTime = 0;
+
 	async::oneshot_event event;
 };
 
+// --------------------------------------------------------
+// RequestQueue
+// --------------------------------------------------------
+
+// State of one virtq. With VIRTIO_BLK_F_MQ, there is one virtq per CPU.
+struct RequestQueue {
+	virtio_core::Queue *virtq = nullptr;
+
+	// Stores UserRequest objects that have not been submitted yet.
+	std::queue<UserRequest *> pending;
+	async::recurring_event doorbell;
+
+	// these two buffer store virtio-block request header and status bytes
+	// they are indexed by the index of the request's first descriptor
+	VirtRequest *headers = nullptr;
+	uint8_t *status = nullptr;
+};
+
 // --------------------------------------------------------
 // Device
 // --------------------------------------------------------
@@ -54,6 +122,9 @@ struct UserRequest : virtio_core::Request {
 struct Device : blockfs::BlockDevice {
 	Device(std::unique_ptr<virtio_core::Transport> transport, int64_t parent_id);
 
+	// Announces the tracepoints of the driver; call this before runDevice().
+	async::result<void> setupTracing();
+
 	void runDevice();
 
 	async::result<void> readSectors(uint64_t sector,
@@ -62,28 +133,52 @@ struct Device : blockfs::BlockDevice {
 	async::result<void> writeSectors(uint64_t sector,
 			const void *buffer, size_t num_sectors) override;
 
+	async::result<void> submit(const blockfs::BlockRequest &request) override;
+
 	async::result<size_t> getSize() override;
 
 private:
-	// Submits requests from _pendingQueue to the device.
-	async::detached _processRequests();
+	// Returns the virtq that serves the current CPU.
+	RequestQueue *_currentQueue();
 
-	std::unique_ptr<virtio_core::Transport> _transport;
+	// Submits requests from the pending queue to the device.
+	async::detached _processRequests(RequestQueue *queue);
 
-	// The single virtq of this device.
-	virtio_core::Queue *_requestQueue;
+	// Submits a request without data and waits for its completion.
+	async::result<void> _submitCommand(RequestQueue *queue, UserRequest *request);
 
-	// Stores UserRequest objects that have not been submitted yet.
-	std::queue<UserRequest *> _pendingQueue;
-	async::recurring_event _pendingDoorbell;
+	// Discards or zeroes a range of sectors in parts of at most max_sectors.
+	async::result<void> _submitRange(RequestQueue *queue, uint32_t type,
+			uint64_t sector, size_t num_sectors, size_t max_sectors);
 
-	// these two buffer store virtio-block request header and status bytes
-	// they are indexed by the index of the request's first descriptor
-	VirtRequest *virtRequestBuffer;
-	uint8_t *statusBuffer;
+	// Waits for the completion of a request.
+	async::result<void> _retire(UserRequest *request);
+
+	std::unique_ptr<virtio_core::Transport> _transport;
+
+	std::vector<std::unique_ptr<RequestQueue>> _queues;
 
 	// The size of the disk
 	size_t _size;
+
+	// Negotiated features.
+	bool _supportsFlush = false;
+	bool _supportsDiscard = false;
+	bool _supportsWriteZeroes = false;
+	bool _useIndirect = false;
+	// Maximal size of a single data descriptor (or SIZE_MAX).
+	size_t _maxChunk = SIZE_MAX;
+	size_t _maxDiscardSectors = UINT32_MAX;
+	size_t _maxWriteZeroesSectors = UINT32_MAX;
+
+	protocols::ostrace::Context _ostContext;
+	protocols::ostrace::EventId _ostSubmitEvent;
+	protocols::ostrace::EventId _ostRetireEvent;
+	protocols::ostrace::ItemId _ostTypeItem;
+	protocols::ostrace::ItemId _ostSectorsItem;
+	protocols::ostrace::ItemId _ostSegmentsItem;
+	protocols::ostrace::ItemId _ostQueueItem;
+	protocols::ostrace::ItemId _ostLatencyItem;
 };
 
 } } // namespace block::virtio
@@ -26,6 +26,7 @@ async::detached bindDevice(mbus::Entity entity) {
 			virtio_core::DiscoverMode::transitional);
 
 	auto device = new block::virtio::Device{std::move(transport), entity.getId()};
+	co_await device->setupTracing();
 	device->runDevice();
 
 /*
@@ -346,8 +346,8 @@ uint32_t GfxDevice::FrameBuffer::getPixelPitch() {
 	return _pixelPitch;
 }
 
-void GfxDevice::FrameBuffer::notifyDirty() {
-
+void GfxDevice::FrameBuffer::notifyDirty(std::vector<drm_core::DamageRect>) {
+	// Buffers live in VRAM and are scanned out directly; there is nothing to copy.
 }
 
 // ----------------------------------------------------------------
@@ -369,9 +369,11 @@ GfxDevice::BufferObject::BufferObject(GfxDevice *device, size_t alignment, size_
 	assert(!((_offset + _displacement) % 0x1000));
 	assert(!((_offset + _displacement) % _alignment));
 
+	// Dumb buffers are written by the CPU (e.g., by software renderers);
+	// map them write-combining instead of uncached.
 	HelHandle handle;
 	HEL_CHECK(helCreateSliceView(_device->_videoRam.getHandle(),
-			_offset + _displacement, _size, 0, &handle));
+			_offset + _displacement, _size, kHelSliceCacheWriteCombine, &handle));
 	_memoryView = helix::UniqueDescriptor{handle};
 };
 
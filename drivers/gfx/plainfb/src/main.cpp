@@ -182,6 +182,8 @@ bool GfxDevice::Configuration::capture(std::vector<drm_core::Assignment> assignm
 			return false;
 		}
 	}
+
+	plane_state->resolveDamage(*_device->_plane->drmState());
 	return true;
 }
 
@@ -213,22 +215,7 @@ async::detached GfxDevice::Configuration::_dispatch(std::unique_ptr<drm_core::At
 			auto bo = fb->getBufferObject();
 			assert(bo->getWidth() == _device->_screenWidth);
 			assert(bo->getHeight() == _device->_screenHeight);
-			auto dest = reinterpret_cast<char *>(_device->_fbMapping.get());
-			auto src = reinterpret_cast<char *>(bo->accessMapping());
-
-			if(fb->fastScanout()) {
-				for(unsigned int k = 0; k < bo->getHeight(); k++) {
-					drm_core::fastCopy16(dest, src, bo->getWidth() * 4);
-					dest += _device->_screenPitch;
-					src += fb->getPitch();
-				}
-			}else{
-				for(unsigned int k = 0; k < bo->getHeight(); k++) {
-					memcpy(dest, src, bo->getWidth() * 4);
-					dest += _device->_screenPitch;
-					src += fb->getPitch();
-				}
-			}
+			fb->blit(plane_state->damage);
 		}
 	} else {
 		std::cout << "gfx/plainfb: Disable scanout" << std::endl;
@@ -292,9 +279,39 @@ GfxDevice::BufferObject *GfxDevice::FrameBuffer::getBufferObject() {
 	return _bo.get();
 }
 
-void GfxDevice::FrameBuffer::notifyDirty() {
-	// TODO: Re-blit the FrameBuffer if it is currently displayed.
-	std::cout << "gfx/plainfb: notifyDirty() is not implemented correctly" << std::endl;
+void GfxDevice::FrameBuffer::notifyDirty(std::vector<drm_core::DamageRect> clips) {
+	auto plane_state = _device->_plane->drmState();
+	if(plane_state->fb.get() != this || !_device->_theCrtc->drmState()->mode)
+		return;
+
+	blit(drm_core::clipDamage(clips, {0, 0, _bo->getWidth(), _bo->getHeight()}));
+}
+
+void GfxDevice::FrameBuffer::blit(const std::vector<drm_core::DamageRect> &damage) {
+	for(auto rect : damage) {
+		if(_fastScanout) {
+			// fastCopy16() copies multiples of 16 bytes (= 4 pixels). All rows
+			// are 16-byte aligned; thus we can extend the rectangle.
+			rect.x1 &= ~uint32_t{3};
+			rect.x2 = (rect.x2 + 3) & ~uint32_t{3};
+		}
+
+		auto dest = reinterpret_cast<char *>(_device->_fbMapping.get())
+				+ rect.y1 * _device->_screenPitch + rect.x1 * 4;
+		auto src = reinterpret_cast<char *>(_bo->accessMapping())
+				+ rect.y1 * _pitch + rect.x1 * 4;
+		size_t length = (rect.x2 - rect.x1) * 4;
+
+		for(unsigned int k = rect.y1; k < rect.y2; k++) {
+			if(_fastScanout) {
+				drm_core::fastCopy16(dest, src, length);
+			}else{
+				memcpy(dest, src, length);
+			}
+			dest += _device->_screenPitch;
+			src += _pitch;
+		}
+	}
 }
 
 // ----------------------------------------------------------------
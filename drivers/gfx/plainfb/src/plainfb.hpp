@@ -78,7 +78,10 @@ struct GfxDevice final : drm_core::Device, std::enable_shared_from_this<GfxDevic
 		bool fastScanout() { return _fastScanout; }
 
 		GfxDevice::BufferObject *getBufferObject();
-		void notifyDirty() override;
+		void notifyDirty(std::vector<drm_core::DamageRect> clips) override;
+
+		// Copies the damaged regions to the hardware framebuffer.
+		void blit(const std::vector<drm_core::DamageRect> &damage);
 
 	private:
 		GfxDevice *_device;
@@ -77,22 +77,27 @@ async::detached GfxDevice::initialize() {
 	auto num_scanouts = static_cast<uint32_t>(_transport->space().load(spec::cfg::numScanouts));
 	for(size_t i = 0; i < num_scanouts; i++) {
 		auto plane = std::make_shared<Plane>(this, i, Plane::PlaneType::PRIMARY);
-		auto crtc = std::make_shared<Crtc>(this, i, plane);
+		auto cursor_plane = std::make_shared<Plane>(this, i, Plane::PlaneType::CURSOR);
+		auto crtc = std::make_shared<Crtc>(this, i, plane, cursor_plane);
 		auto encoder = std::make_shared<Encoder>(this);
 
 		plane->setupWeakPtr(plane);
 		plane->setupState(plane);
+		cursor_plane->setupWeakPtr(cursor_plane);
+		cursor_plane->setupState(cursor_plane);
 		crtc->setupWeakPtr(crtc);
 		crtc->setupState(crtc);
 		encoder->setupWeakPtr(encoder);
 
 		plane->setupPossibleCrtcs({crtc.get()});
+		cursor_plane->setupPossibleCrtcs({crtc.get()});
 
 		encoder->setupPossibleCrtcs({crtc.get()});
 		encoder->setupPossibleClones({encoder.get()});
 		encoder->setCurrentCrtc(crtc.get());
 
 		registerObject(plane.get());
+		registerObject(cursor_plane.get());
 		registerObject(crtc.get());
 		registerObject(encoder.get());
 
@@ -110,6 +115,12 @@ async::detached GfxDevice::initialize() {
 		assignments.push_back(drm_core::Assignment::withInt(plane, crtcYProperty(), 0));
 		assignments.push_back(drm_core::Assignment::withModeObj(plane, fbIdProperty(), nullptr));
 
+		assignments.push_back(drm_core::Assignment::withInt(cursor_plane, planeTypeProperty(), 2));
+		assignments.push_back(drm_core::Assignment::withModeObj(cursor_plane, crtcIdProperty(), crtc));
+		assignments.push_back(drm_core::Assignment::withInt(cursor_plane, crtcXProperty(), 0));
+		assignments.push_back(drm_core::Assignment::withInt(cursor_plane, crtcYProperty(), 0));
+		assignments.push_back(drm_core::Assignment::withModeObj(cursor_plane, fbIdProperty(), nullptr));
+
 		setupCrtc(crtc.get());
 		setupEncoder(encoder.get());
 
@@ -224,11 +235,19 @@ bool GfxDevice::Configuration::capture(std::vector<drm_core::Assignment> assignm
 		assign.property->writeToState(assign, state);
 	}
 
+	// Commits that only touch a plane (e.g., page flips or damage updates)
+	// still have to be dispatched to the scanout of its CRTC.
+	for(auto crtc : _device->getCrtcs()) {
+		if(state->plane_states().contains(crtc->primaryPlane()->id()))
+			state->crtc(crtc->id());
+	}
+
 	auto crtc_states = state->crtc_states();
 
 	for(auto pair : crtc_states) {
 		auto cs = pair.second;
-		auto pps = state->plane(cs->crtc().lock()->primaryPlane()->id());
+		auto plane = cs->crtc().lock()->primaryPlane();
+		auto pps = state->plane(plane->id());
 
 		if(cs->modeChanged && cs->mode != nullptr) {
 			drm_mode_modeinfo mode_info;
@@ -241,17 +260,49 @@ bool GfxDevice::Configuration::capture(std::vector<drm_core::Assignment> assignm
 				return false;
 			}
 		}
+
+		pps->resolveDamage(*plane->drmState());
+	}
+
+	// Cursors are handled by the cursor queue; they do not touch the scanout.
+	for(auto crtc : _device->getCrtcs()) {
+		auto cursor = crtc->cursorPlane();
+		if(!state->plane_states().contains(cursor->id()))
+			continue;
+		auto cps = state->plane(cursor->id());
+		auto current = cursor->drmState();
+
+		if(cps->fb && (cps->src_w != drm_core::cursorSize || cps->src_h != drm_core::cursorSize))
+			return false;
+
+		bool define = cps->fb != current->fb
+				|| cps->hotspot_x != current->hotspot_x || cps->hotspot_y != current->hotspot_y;
+		bool move = cps->crtc_x != current->crtc_x || cps->crtc_y != current->crtc_y;
+		if(define || (move && cps->fb))
+			_cursorUpdates.push_back({static_cast<Crtc *>(crtc), define});
 	}
 
 	return true;
 }
 
 void GfxDevice::Configuration::dispose() {
-
+	_cursorUpdates.clear();
 }
 
 void GfxDevice::Configuration::commit(std::unique_ptr<drm_core::AtomicState> &state) {
 	_dispatch(state);
+
+	for(auto pair : state->crtc_states()) {
+		auto crtc = pair.second->crtc().lock();
+		crtc->setDrmState(pair.second);
+		crtc->primaryPlane()->setDrmState(state->plane(crtc->primaryPlane()->id()));
+	}
+
+	for(auto crtc : _device->getCrtcs()) {
+		auto cursor = crtc->cursorPlane();
+		if(state->plane_states().contains(cursor->id()))
+			cursor->setDrmState(state->plane(cursor->id()));
+	}
 }
 
 async::detached GfxDevice::Configuration::_dispatch(std::unique_ptr<drm_core::AtomicState> &state) {
@@ -290,26 +341,7 @@ async::detached GfxDevice::Configuration::_dispatch(std::unique_ptr<drm_core::At
 			auto fb = static_pointer_cast<GfxDevice::FrameBuffer>(pps->fb);
 
 			co_await fb->getBufferObject()->wait();
-
-			spec::XferToHost2d xfer;
-			memset(&xfer, 0, sizeof(spec::XferToHost2d));
-			xfer.header.type = spec::cmd::xferToHost2d;
-			xfer.rect.x = 0;
-			xfer.rect.y = 0;
-			xfer.rect.width = pps->src_w;
-			xfer.rect.height = pps->src_h;
-			xfer.resourceId = fb->getBufferObject()->hardwareId();
-
-			spec::Header xfer_result;
-			virtio_core::Chain xfer_chain;
-			co_await virtio_core::scatterGather(virtio_core::hostToDevice,
-					xfer_chain, _device->_controlQ,
-					arch::dma_buffer_view{nullptr, &xfer, sizeof(spec::XferToHost2d)});
-			co_await virtio_core::scatterGather(virtio_core::deviceToHost,
-					xfer_chain, _device->_controlQ,
-					arch::dma_buffer_view{nullptr, &xfer_result, sizeof(spec::Header)});
-			co_await AwaitableRequest{_device->_controlQ, xfer_chain.front()};
-			assert(xfer_result.type == spec::resp::noData);
+			co_await fb->transferToHost(pps->damage);
 
 			spec::SetScanout scanout;
 			memset(&scanout, 0, sizeof(spec::SetScanout));
@@ -332,31 +364,48 @@ async::detached GfxDevice::Configuration::_dispatch(std::unique_ptr<drm_core::At
 			co_await AwaitableRequest{_device->_controlQ, scanout_chain.front()};
 			assert(scanout_result.type == spec::resp::noData);
 
-			spec::ResourceFlush flush;
-			memset(&flush, 0, sizeof(spec::ResourceFlush));
-			flush.header.type = spec::cmd::resourceFlush;
-			flush.rect.x = 0;
-			flush.rect.y = 0;
-			flush.rect.width = pps->src_w;
-			flush.rect.height = pps->src_h;
-			flush.resourceId = fb->getBufferObject()->hardwareId();
-
-			spec::Header flush_result;
-			virtio_core::Chain flush_chain;
-			co_await virtio_core::scatterGather(virtio_core::hostToDevice,
-					flush_chain, _device->_controlQ,
-					arch::dma_buffer_view{nullptr, &flush, sizeof(spec::ResourceFlush)});
-			co_await virtio_core::scatterGather(virtio_core::deviceToHost,
-					flush_chain, _device->_controlQ,
-					arch::dma_buffer_view{nullptr, &flush_result, sizeof(spec::Header)});
-			co_await AwaitableRequest{_device->_controlQ, flush_chain.front()};
-			assert(flush_result.type == spec::resp::noData);
+			co_await fb->flush(pps->damage);
 		}
 	}
 
+	for(auto update : _cursorUpdates)
+		co_await _updateCursor(update, state->plane(update.crtc->cursorPlane()->id()));
+
 	complete();
 }
 
+async::result<void> GfxDevice::Configuration::_updateCursor(CursorUpdate update,
+		std::shared_ptr<drm_core::PlaneState> cps) {
+	spec::UpdateCursor cursor;
+	memset(&cursor, 0, sizeof(spec::UpdateCursor));
+	cursor.pos.scanoutId = update.crtc->scanoutId();
+	cursor.pos.x = cps->crtc_x;
+	cursor.pos.y = cps->crtc_y;
+
+	if(update.define) {
+		cursor.header.type = spec::cmd::updateCursor;
+		if(cps->fb) {
+			auto fb = static_pointer_cast<GfxDevice::FrameBuffer>(cps->fb);
+			auto bo = fb->getBufferObject();
+
+			co_await bo->wait();
+			co_await fb->transferToHost({{0, 0, bo->getWidth(), bo->getHeight()}});
+
+			cursor.resourceId = bo->hardwareId();
+			cursor.hotX = cps->hotspot_x;
+			cursor.hotY = cps->hotspot_y;
+		}
+	}else{
+		cursor.header.type = spec::cmd::moveCursor;
+	}
+
+	// The device does not respond to commands on the cursor queue.
+	virtio_core::Chain chain;
+	co_await virtio_core::scatterGather(virtio_core::hostToDevice, chain, _device->_cursorQ,
+			arch::dma_buffer_view{nullptr, &cursor, sizeof(spec::UpdateCursor)});
+	co_await AwaitableRequest{_device->_cursorQ, chain.front()};
+}
+
 // ----------------------------------------------------------------
 // GfxDevice::Connector.
 // ----------------------------------------------------------------
@@ -378,17 +427,23 @@ GfxDevice::Encoder::Encoder(GfxDevice *device)
 // GfxDevice::Crtc.
 // ----------------------------------------------------------------
 
-GfxDevice::Crtc::Crtc(GfxDevice *device, int id, std::shared_ptr<Plane> plane)
+GfxDevice::Crtc::Crtc(GfxDevice *device, int id, std::shared_ptr<Plane> plane,
+		std::shared_ptr<Plane> cursor_plane)
 	:drm_core::Crtc { device->allocator.allocate() } {
 	_device = device;
 	_scanoutId = id;
 	_primaryPlane = plane;
+	_cursorPlane = cursor_plane;
 }
 
 drm_core::Plane *GfxDevice::Crtc::primaryPlane() {
 	return _primaryPlane.get();
 }
 
+drm_core::Plane *GfxDevice::Crtc::cursorPlane() {
+	return _cursorPlane.get();
+}
+
 int GfxDevice::Crtc::scanoutId() {
 	return _scanoutId;
 }
@@ -408,44 +463,62 @@ GfxDevice::BufferObject *GfxDevice::FrameBuffer::getBufferObject() {
 	return _bo.get();
 }
 
-void GfxDevice::FrameBuffer::notifyDirty() {
-	_xferAndFlush();
-}
-
-async::detached GfxDevice::FrameBuffer::_xferAndFlush() {
-	spec::XferToHost2d xfer;
-	memset(&xfer, 0, sizeof(spec::XferToHost2d));
-	xfer.header.type = spec::cmd::xferToHost2d;
-	xfer.rect.x = 0;
-	xfer.rect.y = 0;
-	xfer.rect.width = _bo->getWidth();
-	xfer.rect.height = _bo->getHeight();
-	xfer.resourceId = _bo->hardwareId();
-
-	spec::Header xfer_result;
-	virtio_core::Chain xfer_chain;
-	co_await virtio_core::scatterGather(virtio_core::hostToDevice, xfer_chain, _device->_controlQ,
-		arch::dma_buffer_view{nullptr, &xfer, sizeof(spec::XferToHost2d)});
-	co_await virtio_core::scatterGather(virtio_core::deviceToHost, xfer_chain, _device->_controlQ,
-		arch::dma_buffer_view{nullptr, &xfer_result, sizeof(spec::Header)});
-	co_await AwaitableRequest{_device->_controlQ, xfer_chain.front()};
-
-	spec::ResourceFlush flush;
-	memset(&flush, 0, sizeof(spec::ResourceFlush));
-	flush.header.type = spec::cmd::resourceFlush;
-	flush.rect.x = 0;
-	flush.rect.y = 0;
-	flush.rect.width = _bo->getWidth();
-	flush.rect.height = _bo->getHeight();
-	flush.resourceId = _bo->hardwareId();
-
-	spec::Header flush_result;
-	virtio_core::Chain flush_chain;
-	co_await virtio_core::scatterGather(virtio_core::hostToDevice, flush_chain, _device->_controlQ,
-		arch::dma_buffer_view{nullptr, &flush, sizeof(spec::ResourceFlush)});
-	co_await virtio_core::scatterGather(virtio_core::deviceToHost, flush_chain, _device->_controlQ,
-		arch::dma_buffer_view{nullptr, &flush_result, sizeof(spec::Header)});
-	co_await AwaitableRequest{_device->_controlQ, flush_chain.front()};
+void GfxDevice::FrameBuffer::notifyDirty(std::vector<drm_core::DamageRect> clips) {
+	_xferAndFlush(drm_core::clipDamage(clips,
+			{0, 0, _bo->getWidth(), _bo->getHeight()}));
+}
+
+async::detached GfxDevice::FrameBuffer::_xferAndFlush(std::vector<drm_core::DamageRect> damage) {
+	co_await transferToHost(damage);
+	co_await flush(damage);
+}
+
+async::result<void> GfxDevice::FrameBuffer::transferToHost(
+		const std::vector<drm_core::DamageRect> &damage) {
+	for(auto &rect : damage) {
+		spec::XferToHost2d xfer;
+		memset(&xfer, 0, sizeof(spec::XferToHost2d));
+		xfer.header.type = spec::cmd::xferToHost2d;
+		xfer.rect.x = rect.x1;
+		xfer.rect.y = rect.y1;
+		xfer.rect.width = rect.x2 - rect.x1;
+		xfer.rect.height = rect.y2 - rect.y1;
+		// Offset of the rectangle within the (linear, 32 bpp) backing storage.
+		xfer.offset = (uint64_t{rect.y1} * _bo->getWidth() + rect.x1) * 4;
+		xfer.resourceId = _bo->hardwareId();
+
+		spec::Header xfer_result;
+		virtio_core::Chain xfer_chain;
+		co_await virtio_core::scatterGather(virtio_core::hostToDevice, xfer_chain, _device->_controlQ,
+			arch::dma_buffer_view{nullptr, &xfer, sizeof(spec::XferToHost2d)});
+		co_await virtio_core::scatterGather(virtio_core::deviceToHost, xfer_chain, _device->_controlQ,
+			arch::dma_buffer_view{nullptr, &xfer_result, sizeof(spec::Header)});
+		co_await AwaitableRequest{_device->_controlQ, xfer_chain.front()};
+		assert(xfer_result.type == spec::resp::noData);
+	}
+}
+
+async::result<void> GfxDevice::FrameBuffer::flush(
+		const std::vector<drm_core::DamageRect> &damage) {
+	for(auto &rect : damage) {
+		spec::ResourceFlush flush;
+		memset(&flush, 0, sizeof(spec::ResourceFlush));
+		flush.header.type = spec::cmd::resourceFlush;
+		flush.rect.x = rect.x1;
+		flush.rect.y = rect.y1;
+		flush.rect.width = rect.x2 - rect.x1;
+		flush.rect.height = rect.y2 - rect.y1;
+		flush.resourceId = _bo->hardwareId();
+
+		spec::Header flush_result;
+		virtio_core::Chain flush_chain;
+		co_await virtio_core::scatterGather(virtio_core::hostToDevice, flush_chain, _device->_controlQ,
+			arch::dma_buffer_view{nullptr, &flush, sizeof(spec::ResourceFlush)});
+		co_await virtio_core::scatterGather(virtio_core::deviceToHost, flush_chain, _device->_controlQ,
+			arch::dma_buffer_view{nullptr, &flush_result, sizeof(spec::Header)});
+		co_await AwaitableRequest{_device->_controlQ, flush_chain.front()};
+		assert(flush_result.type == spec::resp::noData);
+	}
 }
 
 // ----------------------------------------------------------------
@@ -18,6 +18,10 @@ namespace cmd {
 	inline constexpr uint32_t xferToHost2d = 0x105;
 	inline constexpr uint32_t attachBacking = 0x106;
 
+	// Commands on the cursor queue.
+	inline constexpr uint32_t updateCursor = 0x300;
+	inline constexpr uint32_t moveCursor = 0x301;
+
 } //namespace cmd
 
 namespace resp {
@@ -91,6 +95,23 @@ struct ResourceFlush {
 	uint32_t padding;
 };
 
+struct CursorPos {
+	uint32_t scanoutId;
+	uint32_t x;
+	uint32_t y;
+	uint32_t padding;
+};
+
+// Used by both updateCursor and moveCursor; the latter only reads pos.
+struct UpdateCursor {
+	Header header;
+	CursorPos pos;
+	uint32_t resourceId;
+	uint32_t hotX;
+	uint32_t hotY;
+	uint32_t padding;
+};
+
 namespace cfg {
 	inline constexpr arch::scalar_register<uint32_t> numScanouts(8);
 } //namespace cfg
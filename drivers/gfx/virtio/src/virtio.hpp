@@ -16,6 +16,7 @@
 
 struct GfxDevice final : drm_core::Device, std::enable_shared_from_this<GfxDevice> {
 	struct FrameBuffer;
+	struct Crtc;
 
 	struct ScanoutState {
 		ScanoutState()
@@ -36,9 +37,19 @@ struct GfxDevice final : drm_core::Device, std::enable_shared_from_this<GfxDevic
 		void commit(std::unique_ptr<drm_core::AtomicState> &state) override;
 
 	private:
+		// A cursor plane that is changed by the commit.
+		struct CursorUpdate {
+			Crtc *crtc;
+			// Whether the image (or the hotspot) changed; otherwise, the cursor only moves.
+			bool define;
+		};
+
 		async::detached _dispatch(std::unique_ptr<drm_core::AtomicState> &state);
+		async::result<void> _updateCursor(CursorUpdate update,
+				std::shared_ptr<drm_core::PlaneState> cps);
 
 		GfxDevice *_device;
+		std::vector<CursorUpdate> _cursorUpdates;
 	};
 
 	struct Plane : drm_core::Plane {
@@ -84,24 +95,31 @@ struct GfxDevice final : drm_core::Device, std::enable_shared_from_this<GfxDevic
 	};
 
 	struct Crtc final : drm_core::Crtc {
-		Crtc(GfxDevice *device, int id, std::shared_ptr<Plane> plane);
+		Crtc(GfxDevice *device, int id, std::shared_ptr<Plane> plane,
+				std::shared_ptr<Plane> cursor_plane);
 
 		drm_core::Plane *primaryPlane() override;
+		drm_core::Plane *cursorPlane() override;
 		int scanoutId();
-		// cursorPlane
 
 	private:
 		GfxDevice *_device;
 		int _scanoutId;
 		std::shared_ptr<Plane> _primaryPlane;
+		std::shared_ptr<Plane> _cursorPlane;
 	};
 
 	struct FrameBuffer final : drm_core::FrameBuffer {
 		FrameBuffer(GfxDevice *device, std::shared_ptr<GfxDevice::BufferObject> bo);
 
 		GfxDevice::BufferObject *getBufferObject();
-		void notifyDirty() override;
-		async::detached _xferAndFlush();
+		void notifyDirty(std::vector<drm_core::DamageRect> clips) override;
+		async::detached _xferAndFlush(std::vector<drm_core::DamageRect> damage);
+
+		// Copy the damaged regions from guest memory to the host resource.
+		async::result<void> transferToHost(const std::vector<drm_core::DamageRect> &damage);
+		// Update the damaged regions of all scanouts that display the resource.
+		async::result<void> flush(const std::vector<drm_core::DamageRect> &damage);
 
 	private:
 		std::shared_ptr<GfxDevice::BufferObject> _bo;
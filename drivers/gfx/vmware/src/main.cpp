@@ -212,6 +212,17 @@ std::pair<std::shared_ptr<drm_core::BufferObject>, uint32_t> GfxDevice::createDu
 	return std::make_pair(bo, w * bpp / 8);
 }
 
+// Imported buffers are plain memory, just like dumb buffers.
+std::shared_ptr<drm_core::BufferObject> GfxDevice::importBufferObject(helix::UniqueDescriptor memory,
+		size_t size) {
+	auto bo = std::make_shared<GfxDevice::BufferObject>(this, size, std::move(memory));
+
+	auto mapping = installMapping(bo.get());
+	bo->setupMapping(mapping);
+
+	return bo;
+}
+
 std::unique_ptr<drm_core::Configuration> GfxDevice::createConfiguration() {
 	return std::make_unique<Configuration>(this);
 }
@@ -222,7 +233,7 @@ async::result<void> GfxDevice::waitIrq(uint32_t irq_mask) {
 
 	if (_deviceCaps & (uint32_t)caps::irqmask) {
 		writeRegister(register_index::irqmask, irq_mask);
-		writeRegister(register_index::sync, 1);
+		_fifo.ping();
 
 		auto irq = co_await _hwDev.accessIrq();
 
@@ -254,7 +265,8 @@ async::result<void> GfxDevice::waitIrq(uint32_t irq_mask) {
 // ----------------------------------------------------------------
 
 GfxDevice::DeviceFifo::DeviceFifo(GfxDevice *device, helix::Mapping fifoMapping)
-	:_device{device}, _fifoMapping{std::move(fifoMapping)}, _fifoSize{0} {
+	:_device{device}, _fifoMapping{std::move(fifoMapping)}, _reservedSize{0}, _fifoSize{0},
+		_lastFence{0}, _usingBounceBuf{false} {
 }
 
 void inline GfxDevice::DeviceFifo::writeRegister(fifo_index idx, uint32_t value) {
@@ -310,13 +322,17 @@ async::result<void *> GfxDevice::DeviceFifo::reserve(size_t size) {
 				(next_cmd + bytes == max && stop > min)) in_place = true;
 
 			else if ((max - next_cmd) + (stop - min) <= bytes) {
-				co_await _device->waitIrq(2); // TODO: add a definiton for the mask
+				ping();
+				co_await _device->waitIrq(irq_flags::fifo_progress);
 			} else {
 				_usingBounceBuf = true;
 			}
 		} else {
 			if (next_cmd + bytes < stop) in_place = true;
-			else co_await _device->waitIrq(2); // TODO: add a definiton for the mask
+			else {
+				ping();
+				co_await _device->waitIrq(irq_flags::fifo_progress);
+			}
 		}
 
 		if (in_place) {
@@ -385,10 +401,59 @@ void GfxDevice::DeviceFifo::commitAll() {
 	commit(_reservedSize);
 }
 
+void GfxDevice::DeviceFifo::ping() {
+	// The device clears the busy flag once the FIFO is empty.
+	auto busy = static_cast<uint32_t *>(_fifoMapping.get()) + (uint32_t)fifo_index::busy;
+	uint32_t expected = 0;
+	if (__atomic_compare_exchange_n(busy, &expected, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		_device->writeRegister(register_index::sync, 1);
+}
+
+bool GfxDevice::DeviceFifo::fencePassed(uint32_t fence) {
+	return static_cast<int32_t>(readRegister(fifo_index::fence) - fence) >= 0;
+}
+
+async::result<uint32_t> GfxDevice::DeviceFifo::submitBatch() {
+	uint32_t fence = 0;
+
+	if (hasCapability(caps::fifo_fence)) {
+		fence = ++_lastFence;
+		if (!fence)
+			fence = ++_lastFence;
+
+		auto ptr = static_cast<uint32_t *>(co_await reserve(sizeof(commands::fence) / 4 + 1));
+		ptr[0] = (uint32_t)command_index::fence;
+		auto cmd = reinterpret_cast<commands::fence *>(ptr + 1);
+		cmd->fence = fence;
+		commitAll();
+	}
+
+	ping();
+	co_return fence;
+}
+
+async::result<void> GfxDevice::DeviceFifo::waitFence(uint32_t fence) {
+	// Without fences (or interrupts), we have to wait until the device is idle.
+	if (!fence || !_device->hasCapability(caps::irqmask)) {
+		_device->writeRegister(register_index::sync, 1);
+		_device->readRegister(register_index::busy);
+		co_return;
+	}
+
+	while (!fencePassed(fence)) {
+		writeRegister(fifo_index::fence_goal, fence);
+		// The fence might have passed before we set the goal.
+		if (fencePassed(fence))
+			break;
+		co_await _device->waitIrq(irq_flags::fence_goal | irq_flags::any_fence);
+	}
+}
+
 #define SVGA_BITMAP_SIZE(w, h)      ((((w) + 31) >> 5) * (h))
 #define SVGA_PIXMAP_SIZE(w, h, bpp) (((((w) * (bpp)) + 31) >> 5) * (h))
 
-async::result<void> GfxDevice::DeviceFifo::defineCursor(int width, int height, GfxDevice::BufferObject *bo) {
+async::result<void> GfxDevice::DeviceFifo::defineCursor(int width, int height,
+		int hot_x, int hot_y, GfxDevice::BufferObject *bo) {
 
 	if (!_device->hasCapability(caps::cursor))
 		co_return;
@@ -404,8 +469,8 @@ async::result<void> GfxDevice::DeviceFifo::defineCursor(int width, int height, G
 	cmd->width = width;
 	cmd->height = height;
 	cmd->id = 0;
-	cmd->hotspot_x = 1;
-	cmd->hotspot_y = 1;
+	cmd->hotspot_x = hot_x;
+	cmd->hotspot_y = hot_y;
 	cmd->and_mask_depth = 1;
 	cmd->xor_mask_depth = 32;
 
@@ -487,12 +552,17 @@ bool GfxDevice::Configuration::capture(std::vector<drm_core::Assignment> assignm
 	}
 
 	auto primary_plane_state = state->plane(_device->_primaryPlane->id());
+	// Cursor-only commits must not update the primary plane.
+	bool touches_primary = false;
 
 	for (auto &assign : assignment) {
 		assert(assign.property->validate(assign));
 		assign.property->writeToState(assign, state);
 		using namespace drm_core;
 
+		if (assign.object == _device->_primaryPlane || assign.object == _device->_crtc)
+			touches_primary = true;
+
 		switch(assign.property->id()) {
 			case srcW: {
 				if (assign.object == _device->_cursorPlane && _device->hasCapability(caps::cursor)) {
@@ -519,11 +589,20 @@ bool GfxDevice::Configuration::capture(std::vector<drm_core::Assignment> assignm
 				break;
 			}
 			case fbId: {
-				if (assign.objectValue && assign.object == _device->_cursorPlane && _device->hasCapability(caps::cursor)) {
+				if (assign.object == _device->_cursorPlane && _device->hasCapability(caps::cursor)) {
 					_cursorUpdate = true;
 				}
 				break;
 			}
+			// The device positions the hotspot, so it also has to move the cursor.
+			case hotspotX:
+			case hotspotY: {
+				if (assign.object == _device->_cursorPlane && _device->hasCapability(caps::cursor)) {
+					_cursorUpdate = true;
+					_cursorMove = true;
+				}
+				break;
+			}
 			case modeId: {
 				if(assign.blobValue) {
 					drm_mode_modeinfo new_mode;
@@ -549,6 +628,8 @@ bool GfxDevice::Configuration::capture(std::vector<drm_core::Assignment> assignm
 		}
 	}
 
+	if (touches_primary)
+		primary_plane_state->resolveDamage(*_device->_primaryPlane->drmState());
 	return true;
 }
 
@@ -561,12 +642,15 @@ void GfxDevice::Configuration::commit(std::unique_ptr<drm_core::AtomicState> & s
 
 	_device->_crtc->setDrmState(state->crtc(_device->_crtc->id()));
 	_device->_primaryPlane->setDrmState(state->plane(_device->_primaryPlane->id()));
-	_device->_cursorPlane->setDrmState(state->plane(_device->_cursorPlane->id()));
+	if (_device->hasCapability(caps::cursor))
+		_device->_cursorPlane->setDrmState(state->plane(_device->_cursorPlane->id()));
 }
 
 async::detached GfxDevice::Configuration::commitConfiguration(std::unique_ptr<drm_core::AtomicState> & state) {
 	auto primary_plane_state = state->plane(_device->_primaryPlane->id());
-	auto cursor_plane_state = state->plane(_device->_cursorPlane->id());
+	std::shared_ptr<drm_core::PlaneState> cursor_plane_state;
+	if (_device->hasCapability(caps::cursor))
+		cursor_plane_state = state->plane(_device->_cursorPlane->id());
 	auto crtc_state = state->crtc(_device->_crtc->id());
 
 	drm_mode_modeinfo last_mode;
@@ -595,30 +679,31 @@ async::detached GfxDevice::Configuration::commitConfiguration(std::unique_ptr<dr
 	}
 
 	if (_cursorUpdate) {
-		if (cursor_plane_state->src_w != 0 && cursor_plane_state->src_h != 0) {
-			_device->_fifo.setCursorState(true);
+		if (cursor_plane_state->fb && cursor_plane_state->src_w != 0 && cursor_plane_state->src_h != 0) {
 			auto cursor_fb = static_pointer_cast<GfxDevice::FrameBuffer>(cursor_plane_state->fb);
-			co_await _device->_fifo.defineCursor(cursor_plane_state->src_w, cursor_plane_state->src_h, cursor_fb->getBufferObject());
+			co_await _device->_fifo.defineCursor(cursor_plane_state->src_w, cursor_plane_state->src_h,
+					cursor_plane_state->hotspot_x, cursor_plane_state->hotspot_y,
+					cursor_fb->getBufferObject());
 			_device->_fifo.setCursorState(true);
 		} else {
 			_device->_fifo.setCursorState(false);
 		}
 	}
 
+	// Position of the hotspot on the screen.
 	if (_cursorMove) {
-		_device->_fifo.moveCursor(cursor_plane_state->src_x, cursor_plane_state->src_y);
+		_device->_fifo.moveCursor(cursor_plane_state->crtc_x + cursor_plane_state->hotspot_x,
+				cursor_plane_state->crtc_y + cursor_plane_state->hotspot_y);
 	}
 
-	if (primary_plane_state->fb != nullptr) {
+	if (primary_plane_state->fb != nullptr && !primary_plane_state->damage.empty()) {
 		auto fb = static_pointer_cast<GfxDevice::FrameBuffer>(primary_plane_state->fb);
-		helix::Mapping user_fb{fb->getBufferObject()->getMemory().first, 0, fb->getBufferObject()->getSize()};
-		drm_core::fastCopy16(_device->_fbMapping.get(), user_fb.get(), fb->getBufferObject()->getSize());
-		int w = _device->readRegister(register_index::width),
-			h = _device->readRegister(register_index::height);
-
-		co_await _device->_fifo.updateRectangle(0, 0, w, h);
+		co_await fb->blit(primary_plane_state->damage);
 	}
 
+	// Cursor and screen updates of this commit are submitted as one batch.
+	auto fence = co_await _device->_fifo.submitBatch();
+	co_await _device->_fifo.waitFence(fence);
 	complete();
 }
 
@@ -663,6 +748,7 @@ drm_core::Plane *GfxDevice::Crtc::Crtc::cursorPlane() {
 GfxDevice::FrameBuffer::FrameBuffer(GfxDevice *dev,
 		std::shared_ptr<GfxDevice::BufferObject> bo, uint32_t pixel_pitch)
 	: drm_core::FrameBuffer { dev->allocator.allocate() } {
+	_device = dev;
 	_bo = bo;
 	_pixelPitch = pixel_pitch;
 }
@@ -675,8 +761,55 @@ uint32_t GfxDevice::FrameBuffer::getPixelPitch() {
 	return _pixelPitch;
 }
 
-void GfxDevice::FrameBuffer::notifyDirty() {
+void GfxDevice::FrameBuffer::notifyDirty(std::vector<drm_core::DamageRect> clips) {
+	if(_device->_primaryPlane->drmState()->fb.get() != this)
+		return;
+
+	int w = _device->readRegister(register_index::width),
+		h = _device->readRegister(register_index::height);
+	_blitDetached(drm_core::clipDamage(clips,
+			{0, 0, static_cast<uint32_t>(w), static_cast<uint32_t>(h)}));
+}
 
+async::detached GfxDevice::FrameBuffer::_blitDetached(std::vector<drm_core::DamageRect> damage) {
+	co_await blit(std::move(damage));
+	co_await _device->_fifo.submitBatch();
+}
+
+async::result<void> GfxDevice::FrameBuffer::blit(std::vector<drm_core::DamageRect> damage) {
+	if(damage.empty())
+		co_return;
+
+	helix::Mapping user_fb{_bo->getMemory().first, 0, _bo->getSize()};
+	size_t vram_pitch = _device->readRegister(register_index::bytes_per_line);
+	// fastCopy16() copies multiples of 16 bytes (= 4 pixels).
+	bool fast = !(vram_pitch & 15) && !(_pixelPitch & 15);
+
+	for(auto rect : damage) {
+		if(fast) {
+			rect.x1 &= ~uint32_t{3};
+			rect.x2 = (rect.x2 + 3) & ~uint32_t{3};
+		}
+
+		auto dest = reinterpret_cast<char *>(_device->_fbMapping.get())
+				+ rect.y1 * vram_pitch + rect.x1 * 4;
+		auto src = reinterpret_cast<char *>(user_fb.get())
+				+ rect.y1 * _pixelPitch + rect.x1 * 4;
+		size_t length = (rect.x2 - rect.x1) * 4;
+
+		for(uint32_t k = rect.y1; k < rect.y2; k++) {
+			if(fast) {
+				drm_core::fastCopy16(dest, src, length);
+			}else{
+				memcpy(dest, src, length);
+			}
+			dest += vram_pitch;
+			src += _pixelPitch;
+		}
+
+		co_await _device->_fifo.updateRectangle(rect.x1, rect.y1,
+				rect.x2 - rect.x1, rect.y2 - rect.y1);
+	}
 }
 
 // ----------------------------------------------------------------
@@ -728,8 +861,14 @@ async::result<void> setupDevice(mbus::Entity entity) {
 	auto fb_bar_info = info.barInfo[1];
 	auto fifo_bar_info = info.barInfo[2];
 
+	// Map the framebuffer write-combining; the FIFO must stay uncached.
+	HelHandle fb_handle;
+	HEL_CHECK(helCreateSliceView(fb_bar.getHandle(), 0, fb_bar_info.length,
+			kHelSliceCacheWriteCombine, &fb_handle));
+	helix::UniqueDescriptor fb_memory{fb_handle};
+
 	auto gfx_device = std::make_shared<GfxDevice>(std::move(pci_device),
-			helix::Mapping{fb_bar, 0, fb_bar_info.length},
+			helix::Mapping{fb_memory, 0, fb_bar_info.length},
 			helix::Mapping{fifo_bar, 0, fifo_bar_info.length},
 			std::move(io_bar), io_bar_info.address);
 
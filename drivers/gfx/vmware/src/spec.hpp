@@ -151,6 +151,10 @@ namespace commands {
 		uint8_t pixel_data[];
 	};
 
+	struct fence {
+		uint32_t fence;
+	};
+
 	struct update_rectangle {
 		uint32_t x;
 		uint32_t y;
@@ -163,6 +167,13 @@ enum class caps : uint32_t {
 	cursor = 0x00000020,
 	fifo_extended = 0x00008000,
 	irqmask = 0x00040000,
+	fifo_fence = (1<<0),
 	fifo_reserve = (1<<6),
 	fifo_cursor_bypass_3 = (1<<4),
 };
+
+namespace irq_flags {
+	constexpr uint32_t any_fence = 0x1;
+	constexpr uint32_t fifo_progress = 0x2;
+	constexpr uint32_t fence_goal = 0x4;
+}
@@ -72,9 +72,16 @@ struct GfxDevice final : drm_core::Device, std::enable_shared_from_this<GfxDevic
 
 		GfxDevice::BufferObject *getBufferObject();
 		uint32_t getPixelPitch();
-		void notifyDirty() override;
+		void notifyDirty(std::vector<drm_core::DamageRect> clips) override;
+
+		// Copies the damaged regions to VRAM and queues updates for them.
+		// The updates take effect once the FIFO batch is submitted.
+		async::result<void> blit(std::vector<drm_core::DamageRect> damage);
 
 	private:
+		async::detached _blitDetached(std::vector<drm_core::DamageRect> damage);
+
+		GfxDevice *_device;
 		std::shared_ptr<GfxDevice::BufferObject> _bo;
 		uint32_t _pixelPitch;
 	};
@@ -83,12 +90,22 @@ struct GfxDevice final : drm_core::Device, std::enable_shared_from_this<GfxDevic
 		DeviceFifo(GfxDevice *device, helix::Mapping fifoMapping);
 
 		void initialize();
-		async::result<void> defineCursor(int width, int height, GfxDevice::BufferObject *bo);
+		async::result<void> defineCursor(int width, int height, int hot_x, int hot_y,
+				GfxDevice::BufferObject *bo);
 		void moveCursor(int x, int y);
 		void setCursorState(bool enabled);
 		bool hasCapability(caps capability);
 		async::result<void> updateRectangle(int x, int y, int w, int h);
+
+		// Commands are batched: they are only processed by the device after
+		// submitBatch(). Returns a fence that signals completion of the batch.
+		async::result<uint32_t> submitBatch();
+		async::result<void> waitFence(uint32_t fence);
+		// Wakes up the device unless it is already processing the FIFO.
+		void ping();
 	private:
+		bool fencePassed(uint32_t fence);
+
 		async::result<void *> reserve(size_t size);
 		void commit(size_t);
 		void commitAll();
@@ -100,6 +117,7 @@ struct GfxDevice final : drm_core::Device, std::enable_shared_from_this<GfxDevic
 
 		size_t _reservedSize;
 		size_t _fifoSize;
+		uint32_t _lastFence;
 
 		uint8_t _bounceBuf[1024 * 1024];
 		bool _usingBounceBuf;
@@ -117,6 +135,8 @@ struct GfxDevice final : drm_core::Device, std::enable_shared_from_this<GfxDevic
 	std::shared_ptr<drm_core::FrameBuffer>
 			createFrameBuffer(std::shared_ptr<drm_core::BufferObject> bo,
 			uint32_t width, uint32_t height, uint32_t format, uint32_t pitch) override;
+	std::shared_ptr<drm_core::BufferObject> importBufferObject(helix::UniqueDescriptor memory,
+			size_t size) override;
 
 	std::tuple<int, int, int> driverVersion() override;
 	std::tuple<std::string, std::string, std::string> driverInfo() override;
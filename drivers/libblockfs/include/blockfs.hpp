@@ -1,10 +1,69 @@
 #pragma once
 
 #include <async/result.hpp>
+#include <span>
+#include <stdexcept>
 #include <stdint.h>
+#include <vector>
 
 namespace blockfs {
 
+enum class BlockOp {
+	read,
+	write,
+	// Writes back the volatile cache of the device.
+	flush,
+	// Hints that the sectors are no longer in use; their contents become undefined.
+	discard,
+	// Sets the sectors to zero without transferring a buffer.
+	writeZeroes
+};
+
+// Only complete a write once its data is on stable storage.
+inline constexpr uint32_t kBlockFua = 1;
+// The request accesses file system metadata. Used as a hint by the I/O scheduler.
+inline constexpr uint32_t kBlockMeta = 2;
+
+// Part of the buffer of a request that is contiguous in virtual memory.
+struct BlockSegment {
+	void *buffer;
+	size_t numSectors;
+};
+
+struct BlockRequest {
+	BlockOp op;
+	uint32_t flags = 0;
+	uint64_t sector = 0;
+	// For reads and writes, this is the sum over all segments.
+	size_t numSectors = 0;
+	// Buffers of reads and writes. They need to be aligned to the sector size
+	// and must stay locked in memory until the request completes.
+	std::span<const BlockSegment> segments;
+};
+
+// Properties of the device that allow callers to shape their requests.
+// Devices also accept requests that exceed these limits (but split them).
+struct BlockLimits {
+	// Number of requests that the device processes in parallel.
+	size_t queueDepth = 1;
+	// Maximal number of segments per device command.
+	size_t maxSegments = 1;
+	// Maximal number of sectors per device command.
+	size_t maxSectors = 128;
+};
+
+// Policy of the I/O scheduler that sits in front of a device (see runDevice()).
+enum class IoPolicy {
+	// Chooses none for devices with deep queues and deadline otherwise.
+	automatic,
+	// Merges adjacent requests but dispatches them in FIFO order.
+	none,
+	// Sorts requests by sector but bounds their latency; prefers reads over writes.
+	deadline,
+	// Shares the device between metadata reads, other reads and writes by weighted budgets.
+	bfqLite
+};
+
 struct BlockDevice {
 	BlockDevice(size_t sector_size, int64_t parent_id);
 
@@ -17,15 +76,36 @@ struct BlockDevice {
 		throw std::runtime_error("BlockDevice does not support writeSectors()");
 	}
 
+	// The default implementation performs reads and writes segment by segment
+	// through readSectors() / writeSectors() and ignores flushes and discards.
+	// Write zeroes requests are emulated by writing a zero-filled buffer.
+	virtual async::result<void> submit(const BlockRequest &request);
+
 	virtual async::result<size_t> getSize() = 0;
 
 	size_t size;
 	const size_t sectorSize;
 	const int64_t parentId;
+	BlockLimits limits;
+	// Can be set by drivers before calling runDevice().
+	IoPolicy ioPolicy = IoPolicy::automatic;
 
 protected:
 };
 
+// Splits a read or write request into parts that respect the given limits.
+struct SplitRequest {
+	SplitRequest(const BlockRequest &request, size_t sector_size, const BlockLimits &limits);
+
+	SplitRequest(const SplitRequest &) = delete;
+
+	SplitRequest &operator= (const SplitRequest &) = delete;
+
+	std::vector<BlockSegment> segments;
+	// The segments of each part point into segments.
+	std::vector<BlockRequest> parts;
+};
+
 async::detached runDevice(BlockDevice *device);
 
 } // namespace blockfs
@@ -9,6 +9,7 @@
 #include <async/result.hpp>
 #include <helix/ipc.hpp>
 #include <helix/memory.hpp>
+#include <helix/timer.hpp>
 
 #include <array>
 
@@ -19,9 +20,269 @@ namespace ext2fs {
 
 namespace {
 	constexpr bool logSuperblock = true;
+	constexpr bool logMetadataCache = false;
 
 	constexpr int pageShift = 12;
 	constexpr size_t pageSize = size_t{1} << pageShift;
+
+	// Number of blocks that are reserved behind the last allocation of a regular file.
+	constexpr uint32_t preallocWindow = 32;
+
+	// Memory budget of the inode cache (in the absence of memory pressure).
+	constexpr size_t inodeCacheBudget = size_t{4} << 20;
+
+	// Dirty ranges are written back once they are older than this (in ns).
+	constexpr uint64_t dirtyExpire = 5'000'000'000;
+	// Interval at which the flusher looks for expired ranges.
+	constexpr uint64_t flushInterval = 1'000'000'000;
+	// Writers are throttled once this many bytes wait for writeback. The flusher
+	// starts writing back regardless of age at half of this.
+	constexpr size_t dirtyLimit = size_t{16} << 20;
+
+	// Adds [offset, offset + length) to a map of disjoint ranges; merges adjacent ranges.
+	void insertRange(std::map<uint64_t, uint64_t> &ranges, uint64_t offset, uint64_t length) {
+		auto end = offset + length;
+		auto it = ranges.upper_bound(offset);
+		if(it != ranges.begin()) {
+			auto prev = std::prev(it);
+			if(prev->first + prev->second >= offset) {
+				offset = prev->first;
+				end = std::max(end, prev->first + prev->second);
+				ranges.erase(prev);
+			}
+		}
+		while(it != ranges.end() && it->first <= end) {
+			end = std::max(end, it->first + it->second);
+			it = ranges.erase(it);
+		}
+		ranges.emplace(offset, end - offset);
+	}
+
+	// Sets up an empty extent tree in a freshly allocated inode.
+	void initExtentRoot(DiskInode *disk_inode) {
+		DiskExtentHeader header{};
+		header.magic = EXT4_EXT_MAGIC;
+		header.max = (sizeof(FileData) - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+		memcpy(disk_inode->data.embedded, &header, sizeof(DiskExtentHeader));
+		disk_inode->flags |= EXT4_EXTENTS_FL;
+	}
+
+	DiskExtent toDiskExtent(const Inode::MappedExtent &extent) {
+		DiskExtent disk_extent;
+		disk_extent.block = extent.logical;
+		disk_extent.length = extent.length;
+		if(extent.uninitialized)
+			disk_extent.length += EXT4_EXT_INIT_MAX_LEN;
+		disk_extent.startHi = extent.physical >> 32;
+		disk_extent.startLo = static_cast<uint32_t>(extent.physical);
+		return disk_extent;
+	}
+
+	// Merges extents[k] with its neighbours (if they are contiguous).
+	void mergeExtents(std::vector<Inode::MappedExtent> &extents, size_t k) {
+		auto canMerge = [] (const Inode::MappedExtent &a, const Inode::MappedExtent &b) {
+			size_t limit = EXT4_EXT_INIT_MAX_LEN;
+			if(a.uninitialized)
+				limit--;
+			return a.uninitialized == b.uninitialized
+					&& a.logical + a.length == b.logical
+					&& a.physical + a.length == b.physical
+					&& a.length + b.length <= limit;
+		};
+
+		if(k + 1 < extents.size() && canMerge(extents[k], extents[k + 1])) {
+			extents[k].length += extents[k + 1].length;
+			extents.erase(extents.begin() + k + 1);
+		}
+		if(k && canMerge(extents[k - 1], extents[k])) {
+			extents[k - 1].length += extents[k].length;
+			extents.erase(extents.begin() + k);
+		}
+	}
+
+	// Locks the pages that contain [offset, offset + size) of a page cache.
+	async::result<helix::UniqueDescriptor> lockRange(HelHandle memory,
+			size_t offset, size_t size) {
+		auto misalign = offset & (pageSize - 1);
+		helix::LockMemoryView lock_memory;
+		auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(memory),
+				&lock_memory, offset - misalign,
+				(misalign + size + pageSize - 1) & ~(pageSize - 1),
+				helix::Dispatcher::global());
+		co_await submit.async_wait();
+		HEL_CHECK(lock_memory.error());
+		co_return lock_memory.descriptor();
+	}
+
+	// Returns the first bit >= from (and < limit) that has the given value (or limit).
+	uint32_t findBit(const uint32_t *words, uint32_t from, uint32_t limit, bool value) {
+		while(from < limit) {
+			auto word = value ? words[from / 32] : ~words[from / 32];
+			word &= ~uint32_t(0) << (from % 32);
+			if(word)
+				return std::min((from & ~uint32_t(31)) + __builtin_ctz(word), limit);
+			from = (from & ~uint32_t(31)) + 32;
+		}
+		return limit;
+	}
+
+	DirEntry toDirEntry(const DiskDirEntry *disk_entry) {
+		DirEntry entry;
+		entry.inode = disk_entry->inode;
+
+		switch(disk_entry->fileType) {
+		case EXT2_FT_REG_FILE:
+			entry.fileType = kTypeRegular; break;
+		case EXT2_FT_DIR:
+			entry.fileType = kTypeDirectory; break;
+		case EXT2_FT_SYMLINK:
+			entry.fileType = kTypeSymlink; break;
+		default:
+			entry.fileType = kTypeNone;
+		}
+		return entry;
+	}
+
+	// --------------------------------------------------------
+	// Directory hashes (as used by the htree index).
+	// --------------------------------------------------------
+
+	uint32_t rotateLeft(uint32_t x, int s) {
+		return (x << s) | (x >> (32 - s));
+	}
+
+	uint32_t dxHackHash(const char *name, size_t length, bool unsignedChars) {
+		uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+		for(size_t i = 0; i < length; i++) {
+			int c = unsignedChars ? int(static_cast<unsigned char>(name[i]))
+					: int(static_cast<signed char>(name[i]));
+			uint32_t hash = hash1 + (hash0 ^ uint32_t(c * 7152373));
+			if(hash & 0x80000000)
+				hash -= 0x7FFFFFFF;
+			hash1 = hash0;
+			hash0 = hash;
+		}
+		return hash0 << 1;
+	}
+
+	// Packs (up to) num * 4 characters of the name into buffer; pads with the length.
+	void stringToHashBuffer(const char *name, size_t length, uint32_t *buffer, int num,
+			bool unsignedChars) {
+		uint32_t pad = uint32_t(length) | (uint32_t(length) << 8);
+		pad |= pad << 16;
+
+		uint32_t value = pad;
+		if(length > size_t(num) * 4)
+			length = num * 4;
+		for(size_t i = 0; i < length; i++) {
+			int c = unsignedChars ? int(static_cast<unsigned char>(name[i]))
+					: int(static_cast<signed char>(name[i]));
+			value = uint32_t(c) + (value << 8);
+			if((i % 4) == 3) {
+				*buffer++ = value;
+				value = pad;
+				num--;
+			}
+		}
+		if(--num >= 0)
+			*buffer++ = value;
+		while(--num >= 0)
+			*buffer++ = pad;
+	}
+
+	void halfMd4Transform(uint32_t buffer[4], const uint32_t in[8]) {
+		auto f = [] (uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+		auto g = [] (uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+		auto h = [] (uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+		constexpr uint32_t k2 = 013240474631;
+		constexpr uint32_t k3 = 015666365641;
+
+		uint32_t a = buffer[0], b = buffer[1], c = buffer[2], d = buffer[3];
+		auto round = [] (auto fn, uint32_t &a, uint32_t b, uint32_t c, uint32_t d,
+				uint32_t x, int s) {
+			a = rotateLeft(a + fn(b, c, d) + x, s);
+		};
+
+		round(f, a, b, c, d, in[0], 3);
+		round(f, d, a, b, c, in[1], 7);
+		round(f, c, d, a, b, in[2], 11);
+		round(f, b, c, d, a, in[3], 19);
+		round(f, a, b, c, d, in[4], 3);
+		round(f, d, a, b, c, in[5], 7);
+		round(f, c, d, a, b, in[6], 11);
+		round(f, b, c, d, a, in[7], 19);
+
+		round(g, a, b, c, d, in[1] + k2, 3);
+		round(g, d, a, b, c, in[3] + k2, 5);
+		round(g, c, d, a, b, in[5] + k2, 9);
+		round(g, b, c, d, a, in[7] + k2, 13);
+		round(g, a, b, c, d, in[0] + k2, 3);
+		round(g, d, a, b, c, in[2] + k2, 5);
+		round(g, c, d, a, b, in[4] + k2, 9);
+		round(g, b, c, d, a, in[6] + k2, 13);
+
+		round(h, a, b, c, d, in[3] + k3, 3);
+		round(h, d, a, b, c, in[7] + k3, 9);
+		round(h, c, d, a, b, in[2] + k3, 11);
+		round(h, b, c, d, a, in[6] + k3, 15);
+		round(h, a, b, c, d, in[1] + k3, 3);
+		round(h, d, a, b, c, in[5] + k3, 9);
+		round(h, c, d, a, b, in[0] + k3, 11);
+		round(h, b, c, d, a, in[4] + k3, 15);
+
+		buffer[0] += a;
+		buffer[1] += b;
+		buffer[2] += c;
+		buffer[3] += d;
+	}
+
+	void teaTransform(uint32_t buffer[4], const uint32_t in[4]) {
+		uint32_t sum = 0;
+		uint32_t b0 = buffer[0], b1 = buffer[1];
+		for(int n = 0; n < 16; n++) {
+			sum += 0x9E3779B9;
+			b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+			b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+		}
+		buffer[0] += b0;
+		buffer[1] += b1;
+	}
+
+	// Returns the major hash of a name or std::nullopt if the hash version is unknown.
+	std::optional<uint32_t> directoryHash(int version, const uint32_t seed[4],
+			const std::string &name, bool unsignedChars) {
+		uint32_t buffer[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+		if(seed[0] || seed[1] || seed[2] || seed[3])
+			memcpy(buffer, seed, sizeof(buffer));
+
+		uint32_t hash;
+		if(version == EXT2_HASH_LEGACY) {
+			hash = dxHackHash(name.data(), name.size(), unsignedChars);
+		}else if(version == EXT2_HASH_HALF_MD4) {
+			uint32_t in[8];
+			for(size_t progress = 0; progress < name.size(); progress += 32) {
+				stringToHashBuffer(name.data() + progress, name.size() - progress,
+						in, 8, unsignedChars);
+				halfMd4Transform(buffer, in);
+			}
+			hash = buffer[1];
+		}else if(version == EXT2_HASH_TEA) {
+			uint32_t in[4];
+			for(size_t progress = 0; progress < name.size(); progress += 16) {
+				stringToHashBuffer(name.data() + progress, name.size() - progress,
+						in, 4, unsignedChars);
+				teaTransform(buffer, in);
+			}
+			hash = buffer[0];
+		}else{
+			return std::nullopt;
+		}
+
+		hash &= ~uint32_t(1);
+		if(hash == (0x7FFFFFFFu << 1))
+			hash = 0x7FFFFFFEu << 1;
+		return hash;
+	}
 }
 
 // --------------------------------------------------------
@@ -31,8 +292,37 @@ namespace {
 Inode::Inode(FileSystem &fs, uint32_t number)
 : fs(fs), number(number), isReady(false) { }
 
+Inode::~Inode() {
+	fs.releaseBlocks(preallocStart, preallocCount);
+}
+
+std::pair<size_t, size_t> Inode::mapExtent(uint64_t index, size_t limit) {
+	assert(usesExtents);
+	auto it = std::upper_bound(extents.begin(), extents.end(), index,
+			[] (uint64_t index, const MappedExtent &extent) {
+				return index < extent.logical;
+			});
+
+	if(it != extents.begin()) {
+		auto &extent = *std::prev(it);
+		if(index < extent.logical + extent.length) {
+			auto n = std::min<size_t>(limit, extent.logical + extent.length - index);
+			if(extent.uninitialized)
+				return {0, n};
+			return {extent.physical + (index - extent.logical), n};
+		}
+	}
+
+	// The block is part of a hole that extends up to the next extent.
+	if(it != extents.end())
+		return {0, std::min<size_t>(limit, it->logical - index)};
+	return {0, limit};
+}
+
 void Inode::setFileSize(size_t size) {
 	assert(!(size & ~uint64_t(0xFFFFFFFF)));
+	if(diskInode()->size != size)
+		metadataDirty = true;
 	diskInode()->size = size;
 }
 
@@ -44,48 +334,164 @@ Inode::findEntry(std::string name) {
 		co_return protocols::fs::Error::notDirectory;
 	assert(fileMapping.size() == fileSize());
 
-	helix::LockMemoryView lock_memory;
-	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
-	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
-			&lock_memory,
-			0, map_size, helix::Dispatcher::global());
-	co_await submit.async_wait();
-	HEL_CHECK(lock_memory.error());
+	if(diskInode()->flags & EXT2_INDEX_FL) {
+		std::optional<DirEntry> entry;
+		if(co_await findHashedEntry(name, entry))
+			co_return entry;
+	}
 
-	// Read the directory structure.
-	uintptr_t offset = 0;
-	while(offset < fileSize()) {
-		assert(!(offset & 3));
-		assert(offset + sizeof(DiskDirEntry) <= fileSize());
+	if(!nameIndex) {
+		auto lock = co_await lockRange(frontalMemory, 0, fileSize());
+
+		// Read the directory structure.
+		std::unordered_map<std::string, size_t> index;
+		uintptr_t offset = 0;
+		while(offset < fileSize()) {
+			assert(!(offset & 3));
+			assert(offset + sizeof(DiskDirEntry) <= fileSize());
+			auto disk_entry = reinterpret_cast<DiskDirEntry *>(
+					reinterpret_cast<char *>(fileMapping.get()) + offset);
+			assert(disk_entry->recordLength);
+
+			if(disk_entry->inode)
+				index.emplace(std::string{disk_entry->name, disk_entry->nameLength}, offset);
+
+			offset += disk_entry->recordLength;
+		}
+		assert(offset == fileSize());
+
+		// Another lookup might have built the index while we waited for the lock.
+		if(!nameIndex)
+			nameIndex = std::move(index);
+	}
+
+	while(true) {
+		auto it = nameIndex->find(name);
+		if(it == nameIndex->end())
+			co_return std::nullopt;
+
+		auto offset = it->second;
+		auto lock = co_await lockRange(frontalMemory, offset, sizeof(DiskDirEntry) + name.size());
+
+		// The entry might have been unlinked while we waited for the lock.
 		auto disk_entry = reinterpret_cast<DiskDirEntry *>(
 				reinterpret_cast<char *>(fileMapping.get()) + offset);
-		assert(disk_entry->recordLength);
-
 		if(disk_entry->inode
 				&& name.length() == disk_entry->nameLength
-				&& !memcmp(disk_entry->name, name.data(), name.length())) {
-			DirEntry entry;
-			entry.inode = disk_entry->inode;
-
-			switch(disk_entry->fileType) {
-			case EXT2_FT_REG_FILE:
-				entry.fileType = kTypeRegular; break;
-			case EXT2_FT_DIR:
-				entry.fileType = kTypeDirectory; break;
-			case EXT2_FT_SYMLINK:
-				entry.fileType = kTypeSymlink; break;
-			default:
-				entry.fileType = kTypeNone;
+				&& !memcmp(disk_entry->name, name.data(), name.length()))
+			co_return toDirEntry(disk_entry);
+		auto again = nameIndex->find(name);
+		assert(again == nameIndex->end() || again->second != offset);
+		(void)again;
+	}
+}
+
+async::result<bool> Inode::findHashedEntry(const std::string &name,
+		std::optional<DirEntry> &entry) {
+	auto blockSize = fs.blockSize;
+	if(fileSize() < blockSize)
+		co_return false;
+	auto base = reinterpret_cast<char *>(fileMapping.get());
+
+	// Index blocks stay locked until the lookup completes.
+	std::vector<helix::UniqueDescriptor> locks;
+	locks.push_back(co_await lockRange(frontalMemory, 0, blockSize));
+
+	// The root info follows the "." and ".." entries (12 bytes each).
+	auto info = reinterpret_cast<DiskDxRootInfo *>(base + 24);
+	if(info->reservedZero || info->infoLength != sizeof(DiskDxRootInfo)
+			|| info->indirectLevels > 2)
+		co_return false;
+	auto hash = directoryHash(info->hashVersion, fs.hashSeed, name, fs.unsignedHash);
+	if(!hash)
+		co_return false;
+
+	// Walk down the index; entries of the last level point to leaf blocks.
+	DiskDxEntry *entries = reinterpret_cast<DiskDxEntry *>(base + 24 + info->infoLength);
+	size_t entriesEnd = blockSize;
+	size_t count;
+	size_t chosen;
+	for(int level = 0; ; level++) {
+		auto countLimit = reinterpret_cast<DiskDxCountLimit *>(entries);
+		count = countLimit->count;
+		auto entriesOffset = reinterpret_cast<char *>(entries) - base;
+		if(!count || count > countLimit->limit
+				|| entriesOffset + countLimit->limit * sizeof(DiskDxEntry) > entriesEnd)
+			co_return false;
+
+		// Find the last entry with a hash <= our hash; entries[0] has an implicit hash of 0.
+		size_t lo = 1, hi = count;
+		while(lo < hi) {
+			auto mid = (lo + hi) / 2;
+			if(entries[mid].hash > *hash) {
+				hi = mid;
+			}else{
+				lo = mid + 1;
 			}
+		}
+		chosen = lo - 1;
+
+		if(level == info->indirectLevels)
+			break;
+
+		// Interior index blocks start with an empty 8 byte directory entry.
+		uint64_t block = entries[chosen].block & 0x0FFFFFFF;
+		if((block + 1) * blockSize > fileSize())
+			co_return false;
+		locks.push_back(co_await lockRange(frontalMemory, block * blockSize, blockSize));
+		entries = reinterpret_cast<DiskDxEntry *>(base + block * blockSize + 8);
+		entriesEnd = (block + 1) * blockSize;
+	}
 
-			co_return entry;
+	while(true) {
+		uint64_t block = entries[chosen].block & 0x0FFFFFFF;
+		if((block + 1) * blockSize > fileSize())
+			co_return false;
+		auto lock = co_await lockRange(frontalMemory, block * blockSize, blockSize);
+
+		// Leaf blocks are ordinary directory blocks.
+		size_t offset = block * blockSize;
+		while(offset < (block + 1) * blockSize) {
+			auto disk_entry = reinterpret_cast<DiskDirEntry *>(base + offset);
+			if(disk_entry->recordLength < 8
+					|| offset + disk_entry->recordLength > (block + 1) * blockSize)
+				co_return false;
+
+			if(disk_entry->inode
+					&& name.length() == disk_entry->nameLength
+					&& !memcmp(disk_entry->name, name.data(), name.length())) {
+				entry = toDirEntry(disk_entry);
+				co_return true;
+			}
+
+			offset += disk_entry->recordLength;
 		}
 
-		offset += disk_entry->recordLength;
+		// If the leaf overflowed due to hash collisions, the following leaf continues
+		// with the same hash; it is marked by the lowest bit of its hash.
+		if(chosen + 1 >= count)
+			break;
+		auto next = entries[chosen + 1].hash;
+		if(!(next & 1) || (next & ~uint32_t(1)) != *hash)
+			break;
+		chosen++;
 	}
-	assert(offset == fileSize());
 
-	co_return std::nullopt;
+	entry = std::nullopt;
+	co_return true;
+}
+
+async::result<void> Inode::dropHashedIndex() {
+	if(!(diskInode()->flags & EXT2_INDEX_FL))
+		co_return;
+
+	// We do not update the htree when modifying the directory. Clear the flag such that
+	// the stale index is not used (just like kernels without dir_index support do).
+	diskInode()->flags &= ~uint32_t(EXT2_INDEX_FL);
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			diskMapping.get(), fs.inodeSize);
+	HEL_CHECK(syncInode.error());
 }
 
 async::result<std::optional<DirEntry>>
@@ -99,6 +505,8 @@ Inode::link(std::string name, int64_t ino, blockfs::FileType type) {
 	assert(fileMapping.size() == fileSize());
 
 	// Lock the mapping into memory before calling this function.
+	co_await dropHashedIndex();
+
 	auto appendDirEntry = [&](size_t offset, size_t length)
 			-> async::result<std::optional<DirEntry>> {
 		auto diskEntry = reinterpret_cast<DiskDirEntry *>(
@@ -121,6 +529,8 @@ Inode::link(std::string name, int64_t ino, blockfs::FileType type) {
 				throw std::runtime_error("unexpected type");
 		}
 		memcpy(diskEntry->name, name.data(), name.length() + 1);
+		if(nameIndex)
+			(*nameIndex)[name] = offset;
 
 		// Flush the data to disk.
 		// TODO: It would be enough to flush only one or two pages here.
@@ -215,6 +625,8 @@ async::result<frg::expected<protocols::fs::Error>> Inode::unlink(std::string nam
 		co_return protocols::fs::Error::notDirectory;
 	assert(fileMapping.size() == fileSize());
 
+	co_await dropHashedIndex();
+
 	helix::LockMemoryView lock_memory;
 	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
 	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
@@ -240,6 +652,8 @@ async::result<frg::expected<protocols::fs::Error>> Inode::unlink(std::string nam
 			// we can assume that a previous entry exists.
 			assert(previous_entry);
 			previous_entry->recordLength += disk_entry->recordLength;
+			if(nameIndex)
+				nameIndex->erase(name);
 
 			// Flush the data to disk.
 			// TODO: It would be enough to flush only one or two pages here.
@@ -402,6 +816,17 @@ FileSystem::FileSystem(BlockDevice *device)
 : device(device) {
 }
 
+async::result<void> FileSystem::readMetadata(uint64_t sector, void *buffer, size_t num_sectors) {
+	BlockSegment segment{buffer, num_sectors};
+	co_await device->submit({
+		.op = BlockOp::read,
+		.flags = kBlockMeta,
+		.sector = sector,
+		.numSectors = num_sectors,
+		.segments = {&segment, 1}
+	});
+}
+
 async::result<void> FileSystem::init() {
 	std::vector<uint8_t> buffer(1024);
 	co_await device->readSectors(2, buffer.data(), 2);
@@ -413,12 +838,14 @@ async::result<void> FileSystem::init() {
 	inodeSize = sb.inodeSize;
 	blockShift = 10 + sb.logBlockSize;
 	blockSize = 1024 << sb.logBlockSize;
-	blockPagesShift = blockShift < pageShift ? pageShift : blockShift;
 	sectorsPerBlock = blockSize / 512;
 	blocksPerGroup = sb.blocksPerGroup;
 	inodesPerGroup = sb.inodesPerGroup;
 	blocksCount = sb.blocksCount;
 	inodesCount = sb.inodesCount;
+	memcpy(hashSeed, sb.hashSeed, sizeof(hashSeed));
+	unsignedHash = sb.flags & EXT2_FLAGS_UNSIGNED_HASH;
+	useExtents = sb.featureIncompat & EXT4_FEATURE_INCOMPAT_EXTENTS;
 	numBlockGroups = (sb.blocksCount + (sb.blocksPerGroup - 1)) / sb.blocksPerGroup;
 
 	if(logSuperblock) {
@@ -436,114 +863,109 @@ async::result<void> FileSystem::init() {
 		std::cout << "ext2fs:     Inodes per group: " << inodesPerGroup << std::endl;
 	}
 
-	blockGroupDescriptorBuffer.resize((numBlockGroups * sizeof(DiskGroupDesc) + 511) & ~size_t(511));
-	bgdt = (DiskGroupDesc *)blockGroupDescriptorBuffer.data();
+	// Create a memory bundle that caches the metadata blocks of the whole file system.
+	auto cache_size = (uint64_t{blocksCount} * blockSize + pageSize - 1) & ~uint64_t(pageSize - 1);
+	HelHandle cache_frontal;
+	HelHandle cache_backing;
+	HEL_CHECK(helCreateManagedMemory(cache_size, 0, &cache_backing, &cache_frontal));
+	metadataCache = helix::UniqueDescriptor{cache_frontal};
+
+	manageMetadata(helix::UniqueDescriptor{cache_backing});
 
 	auto bgdt_offset = (2048 + blockSize - 1) & ~size_t(blockSize - 1);
-	co_await device->readSectors((bgdt_offset >> blockShift) * sectorsPerBlock,
-			blockGroupDescriptorBuffer.data(), blockGroupDescriptorBuffer.size() / 512);
-
-	// Create memory bundles to manage the block and inode bitmaps.
-	HelHandle block_bitmap_frontal, inode_bitmap_frontal;
-	HelHandle block_bitmap_backing, inode_bitmap_backing;
-	HEL_CHECK(helCreateManagedMemory(numBlockGroups << blockPagesShift,
-			0, &block_bitmap_backing, &block_bitmap_frontal));
-	HEL_CHECK(helCreateManagedMemory(numBlockGroups << blockPagesShift,
-			0, &inode_bitmap_backing, &inode_bitmap_frontal));
-	blockBitmap = helix::UniqueDescriptor{block_bitmap_frontal};
-	inodeBitmap = helix::UniqueDescriptor{inode_bitmap_frontal};
-
-	manageBlockBitmap(helix::UniqueDescriptor{block_bitmap_backing});
-	manageInodeBitmap(helix::UniqueDescriptor{inode_bitmap_backing});
-
-	// Create a memory bundle to manage the inode table.
-	assert(!((inodesPerGroup * inodeSize) & 0xFFF));
-	HelHandle inode_table_frontal;
-	HelHandle inode_table_backing;
-	HEL_CHECK(helCreateManagedMemory(inodesPerGroup * inodeSize * numBlockGroups,
-			0, &inode_table_backing, &inode_table_frontal));
-	inodeTable = helix::UniqueDescriptor{inode_table_frontal};
-
-	manageInodeTable(helix::UniqueDescriptor{inode_table_backing});
+	auto bgdt_blocks = (numBlockGroups * sizeof(DiskGroupDesc) + blockSize - 1) >> blockShift;
+	bgdtView = co_await accessMetadata(bgdt_offset >> blockShift, bgdt_blocks);
+	bgdt = reinterpret_cast<DiskGroupDesc *>(bgdtView.data());
+
+	// Collect the static metadata such that writeback can tell it apart from data.
+	staticMetadata.push_back({bgdt_offset >> blockShift, bgdt_blocks});
+	auto table_blocks = (uint64_t{inodesPerGroup} * inodeSize + blockSize - 1) >> blockShift;
+	for(uint32_t i = 0; i < numBlockGroups; i++) {
+		staticMetadata.push_back({bgdt[i].blockBitmap, 1});
+		staticMetadata.push_back({bgdt[i].inodeBitmap, 1});
+		staticMetadata.push_back({bgdt[i].inodeTable, table_blocks});
+	}
+	std::sort(staticMetadata.begin(), staticMetadata.end());
+	size_t n = 0;
+	for(auto run : staticMetadata) {
+		if(n && staticMetadata[n - 1].first + staticMetadata[n - 1].second >= run.first) {
+			auto &prev = staticMetadata[n - 1];
+			prev.second = std::max(prev.second, run.first + run.second - prev.first);
+		}else{
+			staticMetadata[n++] = run;
+		}
+	}
+	staticMetadata.resize(n);
+
+	freeBlockExtents.resize(numBlockGroups);
+	inodeSearchStart.resize(numBlockGroups, 0);
+
+	inodeCacheLimit = inodeCacheBudget;
+	watchMemoryPressure();
+	flushDirtyInodes();
 
 	co_return;
 }
 
-async::detached FileSystem::manageBlockBitmap(helix::UniqueDescriptor memory) {
-	while(true) {
-		helix::ManageMemory manage;
-		auto &&submit_manage = helix::submitManageMemory(memory,
-				&manage, helix::Dispatcher::global());
-		co_await submit_manage.async_wait();
-		HEL_CHECK(manage.error());
+async::result<helix::UniqueDescriptor> FileSystem::lockMetadata(uint64_t offset, size_t length) {
+	auto first = offset & ~uint64_t(pageSize - 1);
+	auto last = (offset + length + pageSize - 1) & ~uint64_t(pageSize - 1);
 
-		auto bg_idx = manage.offset() >> blockPagesShift;
-		auto block = bgdt[bg_idx].blockBitmap;
-		assert(block);
+	helix::LockMemoryView lock_memory;
+	auto &&submit = helix::submitLockMemoryView(metadataCache,
+			&lock_memory, first, last - first,
+			helix::Dispatcher::global());
+	co_await submit.async_wait();
+	HEL_CHECK(lock_memory.error());
+	co_return lock_memory.descriptor();
+}
 
-		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
-				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
-				&& "TODO: propery support multi-page blocks");
+async::result<MetadataView> FileSystem::accessMetadata(uint64_t block, size_t num_blocks) {
+	assert(block && block + num_blocks <= blocksCount);
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping bitmap_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->readSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
-
-			helix::Mapping bitmap_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->writeSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
-		}
-	}
+	MetadataView view;
+	view.block = block;
+	view.numBlocks = num_blocks;
+	view.lock = co_await lockMetadata(block << blockShift, num_blocks << blockShift);
+	view.mapping = helix::Mapping{metadataCache,
+			static_cast<ptrdiff_t>(block << blockShift), num_blocks << blockShift,
+			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	co_return view;
 }
 
-async::detached FileSystem::manageInodeBitmap(helix::UniqueDescriptor memory) {
-	while(true) {
-		helix::ManageMemory manage;
-		auto &&submit_manage = helix::submitManageMemory(memory,
-				&manage, helix::Dispatcher::global());
-		co_await submit_manage.async_wait();
-		HEL_CHECK(manage.error());
-
-		auto bg_idx = manage.offset() >> blockPagesShift;
-		auto block = bgdt[bg_idx].inodeBitmap;
-		assert(block);
+async::result<void> FileSystem::dirtyMetadata(MetadataView &view) {
+	for(size_t i = 0; i < view.numBlocks; i++) {
+		if(!isStaticMetadata(view.block + i))
+			dirtyMetadataBlocks.insert(view.block + i);
+	}
 
-		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
-				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
-				&& "TODO: propery support multi-page blocks");
+	auto syncView = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			view.data(), view.numBlocks << blockShift);
+	HEL_CHECK(syncView.error());
+}
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping bitmap_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->readSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
+async::result<void> FileSystem::writeMetadata(MetadataView &view) {
+	// The blocks stay dirty in the cache; writing them back again later is harmless.
+	co_await device->writeSectors(view.block * sectorsPerBlock,
+			view.data(), view.numBlocks * sectorsPerBlock);
+	metadataStats.blocksWritten += view.numBlocks;
+}
 
-			helix::Mapping bitmap_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->writeSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
-		}
-	}
+bool FileSystem::isStaticMetadata(uint64_t block) {
+	auto it = std::upper_bound(staticMetadata.begin(), staticMetadata.end(), block,
+			[] (uint64_t block, const std::pair<uint64_t, uint64_t> &run) {
+				return block < run.first;
+			});
+	if(it == staticMetadata.begin())
+		return false;
+	--it;
+	return block < it->first + it->second;
 }
 
-async::detached FileSystem::manageInodeTable(helix::UniqueDescriptor memory) {
+async::detached FileSystem::manageMetadata(helix::UniqueDescriptor memory) {
+	auto fs_size = uint64_t{blocksCount} * blockSize;
+
 	while(true) {
 		helix::ManageMemory manage;
 		auto &&submit_manage = helix::submitManageMemory(memory,
@@ -551,35 +973,71 @@ async::detached FileSystem::manageInodeTable(helix::UniqueDescriptor memory) {
 		co_await submit_manage.async_wait();
 		HEL_CHECK(manage.error());
 
-		// TODO: Make sure that we do not read/write past the end of the table.
-		assert(!((inodesPerGroup * inodeSize) & (blockSize - 1)));
+		uint64_t offset = manage.offset();
+		auto end = std::min(offset + manage.length(), fs_size);
+		assert(offset < end);
 
-		// TODO: Use shifts instead of division.
-		auto bg_idx = manage.offset() / (inodesPerGroup * inodeSize);
-		auto bg_offset = manage.offset() % (inodesPerGroup * inodeSize);
-		auto block = bgdt[bg_idx].inodeTable;
-		assert(block);
+		helix::Mapping cache_map{memory,
+				static_cast<ptrdiff_t>(manage.offset()), manage.length()};
+		auto window = reinterpret_cast<std::byte *>(cache_map.get());
 
 		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping table_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->readSectors(block * sectorsPerBlock + bg_offset / 512,
-					table_map.get(), manage.length() / 512);
+			// Pages are read completely (even if they contain data blocks).
+			co_await readMetadata(offset / 512, window, (end - offset) / 512);
+			if(end < offset + manage.length())
+				memset(window + (end - offset), 0, offset + manage.length() - end);
+			metadataStats.blocksRead += (end - offset + blockSize - 1) >> blockShift;
+
 			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
 					manage.offset(), manage.length()));
 		}else{
 			assert(manage.type() == kHelManageWriteback);
 
-			helix::Mapping table_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->writeSectors(block * sectorsPerBlock + bg_offset / 512,
-					table_map.get(), manage.length() / 512);
+			// Only write the blocks that hold metadata. Other blocks in the range are
+			// data blocks; their contents in the cache are stale.
+			auto isMetadata = [&] (uint64_t block) {
+				if(isStaticMetadata(block))
+					return true;
+				// Blocks that are modified again during the write are marked dirty again.
+				return dirtyMetadataBlocks.erase(block) > 0;
+			};
+
+			auto block = offset >> blockShift;
+			auto last = (end + blockSize - 1) >> blockShift;
+			while(block < last) {
+				if(!isMetadata(block)) {
+					metadataStats.blocksSkipped++;
+					block++;
+					continue;
+				}
+
+				uint64_t n = 1;
+				while(block + n < last && isMetadata(block + n))
+					n++;
+
+				// The range might start or end in the middle of large blocks.
+				auto first_byte = std::max(block << blockShift, offset);
+				auto last_byte = std::min((block + n) << blockShift, end);
+				co_await device->writeSectors(first_byte / 512,
+						window + (first_byte - offset), (last_byte - first_byte) / 512);
+				metadataStats.blocksWritten += n;
+				block += n;
+			}
+
 			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
 					manage.offset(), manage.length()));
 		}
 	}
 }
 
+uint64_t FileSystem::inodeAddress(uint32_t number) {
+	auto bg_idx = (number - 1) / inodesPerGroup;
+	auto index = (number - 1) % inodesPerGroup;
+	auto block = bgdt[bg_idx].inodeTable;
+	assert(block);
+	return (uint64_t{block} << blockShift) + uint64_t{index} * inodeSize;
+}
+
 auto FileSystem::accessRoot() -> std::shared_ptr<Inode> {
 	return accessInode(EXT2_ROOT_INO);
 }
@@ -588,32 +1046,96 @@ auto FileSystem::accessInode(uint32_t number) -> std::shared_ptr<Inode> {
 	assert(number > 0);
 	std::weak_ptr<Inode> &inode_slot = activeInodes[number];
 	std::shared_ptr<Inode> active_inode = inode_slot.lock();
-	if(active_inode)
+	if(active_inode) {
+		touchInode(active_inode);
 		return active_inode;
+	}
 
 	auto new_inode = std::make_shared<Inode>(*this, number);
 	inode_slot = std::weak_ptr<Inode>(new_inode);
 	initiateInode(new_inode);
+	touchInode(new_inode);
 
 	return new_inode;
 }
 
+void FileSystem::touchInode(std::shared_ptr<Inode> inode) {
+	if(inode->cacheLink) {
+		inodeCache.splice(inodeCache.begin(), inodeCache, *inode->cacheLink);
+	}else{
+		inode->cacheLink = inodeCache.insert(inodeCache.begin(), inode);
+	}
+
+	// Re-estimate the memory that the inode uses since its caches grow over time.
+	size_t cost = sizeof(Inode) + inodeSize
+			+ inode->extents.capacity() * sizeof(Inode::MappedExtent);
+	if(inode->nameIndex)
+		cost += inode->nameIndex->size() * 64;
+	inodeCacheSize += cost - inode->cacheCost;
+	inode->cacheCost = cost;
+
+	trimInodeCache(inodeCacheLimit);
+}
+
+void FileSystem::trimInodeCache(size_t limit) {
+	while(inodeCacheSize > limit && !inodeCache.empty()) {
+		auto inode = std::move(inodeCache.back());
+		inodeCache.pop_back();
+		inode->cacheLink = std::nullopt;
+		inodeCacheSize -= inode->cacheCost;
+		inode->cacheCost = 0;
+
+		// Drop the slot if this was the last reference.
+		auto number = inode->number;
+		inode = nullptr;
+		auto it = activeInodes.find(number);
+		if(it != activeInodes.end() && it->second.expired())
+			activeInodes.erase(it);
+	}
+}
+
+async::detached FileSystem::watchMemoryPressure() {
+	HelHandle handle;
+	HEL_CHECK(helAccessMemoryPressure(&handle));
+	helix::UniqueDescriptor event{handle};
+
+	uint64_t sequence = 0;
+	while(true) {
+		auto await = co_await helix_ng::awaitEvent(event, sequence);
+		HEL_CHECK(await.error());
+		sequence = await.sequence();
+
+		int level;
+		HEL_CHECK(helGetMemoryPressure(&level));
+		memoryPressure = level;
+		if(level >= kHelMemoryPressureMedium) {
+			inodeCacheLimit = 0;
+		}else if(level == kHelMemoryPressureLow) {
+			inodeCacheLimit = inodeCacheBudget / 2;
+		}else{
+			inodeCacheLimit = inodeCacheBudget;
+		}
+		// Evicted inodes unlock their pages of the metadata cache; the kernel can then reclaim them.
+		trimInodeCache(inodeCacheLimit);
+
+		if(logMetadataCache)
+			std::cout << "ext2fs: Metadata cache: " << metadataStats.blocksRead
+					<< " blocks read, " << metadataStats.blocksWritten << " written, "
+					<< metadataStats.blocksSkipped << " data blocks skipped on writeback, "
+					<< dirtyMetadataBlocks.size() << " dirty" << std::endl;
+	}
+}
+
 async::result<std::shared_ptr<Inode>> FileSystem::createRegular() {
 	auto ino = co_await allocateInode();
 	assert(ino);
 
 	// Lock and map the inode table.
-	auto inode_address = (ino - 1) * inodeSize;
+	auto inode_address = inodeAddress(ino);
+	auto lock_inode = co_await lockMetadata(inode_address, inodeSize);
 
-	helix::LockMemoryView lock_inode;
-	auto &&submit = helix::submitLockMemoryView(inodeTable,
-			&lock_inode, inode_address & ~(pageSize - 1), pageSize,
-			helix::Dispatcher::global());
-	co_await submit.async_wait();
-	HEL_CHECK(lock_inode.error());
-
-	helix::Mapping inode_map{inodeTable,
-				inode_address, inodeSize,
+	helix::Mapping inode_map{metadataCache,
+				static_cast<ptrdiff_t>(inode_address), inodeSize,
 				kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
 
 	// TODO: Set the UID, GID, timestamps.
@@ -622,6 +1144,8 @@ async::result<std::shared_ptr<Inode>> FileSystem::createRegular() {
 	memset(disk_inode, 0, inodeSize);
 	disk_inode->mode = EXT2_S_IFREG;
 	disk_inode->generation = generation + 1;
+	if(useExtents)
+		initExtentRoot(disk_inode);
 	struct timespec time;
 	// TODO: Move to CLOCK_REALTIME when supported
 	clock_gettime(CLOCK_MONOTONIC, &time);
@@ -637,17 +1161,11 @@ async::result<std::shared_ptr<Inode>> FileSystem::createDirectory() {
 	assert(ino);
 
 	// Lock and map the inode table.
-	auto inode_address = (ino - 1) * inodeSize;
+	auto inode_address = inodeAddress(ino);
+	auto lock_inode = co_await lockMetadata(inode_address, inodeSize);
 
-	helix::LockMemoryView lock_inode;
-	auto &&submit = helix::submitLockMemoryView(inodeTable,
-			&lock_inode, inode_address & ~(pageSize - 1), pageSize,
-			helix::Dispatcher::global());
-	co_await submit.async_wait();
-	HEL_CHECK(lock_inode.error());
-
-	helix::Mapping inode_map{inodeTable,
-				inode_address, inodeSize,
+	helix::Mapping inode_map{metadataCache,
+				static_cast<ptrdiff_t>(inode_address), inodeSize,
 				kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
 
 	// TODO: Set the UID, GID, timestamps.
@@ -656,6 +1174,8 @@ async::result<std::shared_ptr<Inode>> FileSystem::createDirectory() {
 	memset(disk_inode, 0, inodeSize);
 	disk_inode->mode = EXT2_S_IFDIR;
 	disk_inode->generation = generation + 1;
+	if(useExtents)
+		initExtentRoot(disk_inode);
 	struct timespec time;
 	// TODO: Move to CLOCK_REALTIME when supported
 	clock_gettime(CLOCK_MONOTONIC, &time);
@@ -676,17 +1196,11 @@ async::result<std::shared_ptr<Inode>> FileSystem::createSymlink() {
 	assert(ino);
 
 	// Lock and map the inode table.
-	auto inode_address = (ino - 1) * inodeSize;
-
-	helix::LockMemoryView lock_inode;
-	auto &&submit = helix::submitLockMemoryView(inodeTable,
-			&lock_inode, inode_address & ~(pageSize - 1), pageSize,
-			helix::Dispatcher::global());
-	co_await submit.async_wait();
-	HEL_CHECK(lock_inode.error());
+	auto inode_address = inodeAddress(ino);
+	auto lock_inode = co_await lockMetadata(inode_address, inodeSize);
 
-	helix::Mapping inode_map{inodeTable,
-				inode_address, inodeSize,
+	helix::Mapping inode_map{metadataCache,
+				static_cast<ptrdiff_t>(inode_address), inodeSize,
 				kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
 
 	// TODO: Set the UID, GID, timestamps.
@@ -709,21 +1223,7 @@ async::result<void> FileSystem::write(Inode *inode, uint64_t offset,
 		const void *buffer, size_t length) {
 	co_await inode->readyJump.wait();
 
-	// Make sure that data blocks are allocated.
-	auto blockOffset = (offset & ~(blockSize - 1)) >> blockShift;
-	auto blockCount = ((offset & (blockSize - 1)) + length + (blockSize - 1)) >> blockShift;
-	co_await assignDataBlocks(inode, blockOffset, blockCount);
-
-	// Resize the file if necessary.
-	if(offset + length > inode->fileSize()) {
-		HEL_CHECK(helResizeMemory(inode->backingMemory,
-				(offset + length + 0xFFF) & ~size_t(0xFFF)));
-		inode->setFileSize(offset + length);
-		auto syncInode = co_await helix_ng::synchronizeSpace(
-				helix::BorrowedDescriptor{kHelNullHandle},
-				inode->diskMapping.get(), inodeSize);
-		HEL_CHECK(syncInode.error());
-	}
+	co_await extend(inode, offset + length);
 
 	// TODO: If we *know* that the pages are already available,
 	//       we can also fall back to the following "old" mapping code.
@@ -752,20 +1252,28 @@ async::result<void> FileSystem::write(Inode *inode, uint64_t offset,
 	HEL_CHECK(writeMemory.error());
 }
 
-async::detached FileSystem::initiateInode(std::shared_ptr<Inode> inode) {
-	// TODO: Use a shift instead of a division.
-	auto inode_address = (inode->number - 1) * inodeSize;
+async::result<void> FileSystem::extend(Inode *inode, uint64_t end) {
+	co_await inode->readyJump.wait();
 
-	helix::LockMemoryView lock_inode;
-	auto &&submit = helix::submitLockMemoryView(inodeTable,
-			&lock_inode, inode_address & ~(pageSize - 1), pageSize,
-			helix::Dispatcher::global());
-	co_await submit.async_wait();
-	HEL_CHECK(lock_inode.error());
-	inode->diskLock = lock_inode.descriptor();
+	// Note that data blocks are allocated on writeback (see manageFileData()).
+	if(end <= inode->fileSize())
+		co_return;
 
-	inode->diskMapping = helix::Mapping{inodeTable,
-			inode_address, inodeSize,
+	HEL_CHECK(helResizeMemory(inode->backingMemory,
+			(end + 0xFFF) & ~size_t(0xFFF)));
+	inode->setFileSize(end);
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			inode->diskMapping.get(), inodeSize);
+	HEL_CHECK(syncInode.error());
+}
+
+async::detached FileSystem::initiateInode(std::shared_ptr<Inode> inode) {
+	auto inode_address = inodeAddress(inode->number);
+	inode->diskLock = co_await lockMetadata(inode_address, inodeSize);
+
+	inode->diskMapping = helix::Mapping{metadataCache,
+			static_cast<ptrdiff_t>(inode_address), inodeSize,
 			kHelMapProtWrite | kHelMapProtRead | kHelMapDontRequireBacking};
 	auto disk_inode = inode->diskInode();
 //	printf("Inode %u: file size: %u\n", inode->number, disk_inode.size);
@@ -798,17 +1306,15 @@ async::detached FileSystem::initiateInode(std::shared_ptr<Inode> inode) {
 				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
 	}
 
-	HelHandle frontalOrder1, frontalOrder2;
-	HelHandle backingOrder1, backingOrder2;
-	HEL_CHECK(helCreateManagedMemory(3 << blockPagesShift,
-			0, &backingOrder1, &frontalOrder1));
-	HEL_CHECK(helCreateManagedMemory((blockSize / 4) << blockPagesShift,
-			0, &backingOrder2, &frontalOrder2));
-	inode->indirectOrder1 = helix::UniqueDescriptor{frontalOrder1};
-	inode->indirectOrder2 = helix::UniqueDescriptor{frontalOrder2};
-
-	manageIndirect(inode, 1, helix::UniqueDescriptor{backingOrder1});
-	manageIndirect(inode, 2, helix::UniqueDescriptor{backingOrder2});
+	if(disk_inode->flags & EXT4_EXTENTS_FL) {
+		DiskExtentHeader root;
+		memcpy(&root, disk_inode->data.embedded, sizeof(DiskExtentHeader));
+		inode->usesExtents = true;
+		inode->extentDepth = root.depth;
+		co_await readExtentNode(inode.get(),
+				reinterpret_cast<const std::byte *>(disk_inode->data.embedded));
+	}
+
 	manageFileData(inode);
 
 	inode->isReady = true;
@@ -840,173 +1346,239 @@ async::detached FileSystem::manageFileData(std::shared_ptr<Inode> inode) {
 					manage.offset(), manage.length()));
 		}else{
 			assert(manage.type() == kHelManageWriteback);
-
-			helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
-					static_cast<ptrdiff_t>(manage.offset()), manage.length(), kHelMapProtRead};
-
 			assert(!(manage.offset() % inode->fs.blockSize));
-			size_t backed_size = std::min(manage.length(), inode->fileSize() - manage.offset());
-			size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
 
-			assert(num_blocks * inode->fs.blockSize <= manage.length());
-			co_await inode->fs.writeDataBlocks(inode, manage.offset() / inode->fs.blockSize,
-					num_blocks, file_map.get());
+			// Only record the range here; flushInode() writes it to disk later.
+			// This merges the writebacks of many small writes into larger ones.
+			auto &fs = inode->fs;
+			if(!inode->dirtyLink) {
+				inode->dirtySince = helix::currentClock();
+				inode->dirtyLink = fs.dirtyInodes.insert(fs.dirtyInodes.end(), inode);
+			}
+			insertRange(inode->dirtyRanges, manage.offset(), manage.length());
+			fs.dirtyBytes += manage.length();
+			inode->writebackBell.raise();
 
-			HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageWriteback,
-					manage.offset(), manage.length()));
+			// Throttle the writer if too much data waits for writeback.
+			if(fs.dirtyBytes > dirtyLimit)
+				co_await fs.flushInode(inode);
 		}
 	}
 }
 
-async::detached FileSystem::manageIndirect(std::shared_ptr<Inode> inode,
-		int order, helix::UniqueDescriptor memory) {
-	while(true) {
-		helix::ManageMemory manage;
-		auto &&submit_manage = helix::submitManageMemory(memory,
-				&manage, helix::Dispatcher::global());
-		co_await submit_manage.async_wait();
-		HEL_CHECK(manage.error());
-
-		uint32_t element = manage.offset() >> blockPagesShift;
-
-		uint32_t block;
-		if(order == 1) {
-			auto disk_inode = inode->diskInode();
+async::result<FileSystem::BlockRun>
+FileSystem::allocateBlocks(uint32_t goal, uint32_t count, uint32_t reserve) {
+	assert(count);
+	uint32_t goalGroup = 0;
+	uint32_t goalBit = 0;
+	if(goal && goal < blocksCount) {
+		goalGroup = goal / blocksPerGroup;
+		goalBit = goal % blocksPerGroup;
+	}
 
-			switch(element) {
-			case 0: block = disk_inode->data.blocks.singleIndirect; break;
-			case 1: block = disk_inode->data.blocks.doubleIndirect; break;
-			case 2: block = disk_inode->data.blocks.tripleIndirect; break;
-			default:
-				assert(!"unexpected offset");
-				abort();
+	for(uint32_t n = 0; n < numBlockGroups; n++) {
+		auto bg_idx = (goalGroup + n) % numBlockGroups;
+		if(!bgdt[bg_idx].freeBlocksCount)
+			continue;
+
+		auto bitmap = co_await accessMetadata(bgdt[bg_idx].blockBitmap);
+		auto words = reinterpret_cast<uint32_t *>(bitmap.data());
+
+		auto &extents = freeBlockExtents[bg_idx];
+		if(!extents) {
+			auto numBits = std::min(blocksPerGroup, blocksCount - bg_idx * blocksPerGroup);
+			extents.emplace();
+			uint32_t bit = 0;
+			while(bit < numBits) {
+				auto start = findBit(words, bit, numBits, false);
+				auto end = findBit(words, start, numBits, true);
+				if(start < end)
+					extents->push_back({start, end - start});
+				bit = end;
 			}
+		}
+		if(extents->empty())
+			continue;
+
+		// Prefer the extent that contains the goal (or the first one after it).
+		auto bit = n ? 0 : goalBit;
+		auto it = std::lower_bound(extents->begin(), extents->end(), bit,
+				[] (const FreeExtent &extent, uint32_t bit) {
+					return extent.start + extent.length <= bit;
+				});
+		if(it == extents->end())
+			it = extents->begin();
+		auto chosen = std::max(it->start, bit);
+		if(chosen >= it->start + it->length)
+			chosen = it->start;
+
+		// Carve the run (plus the reservation) out of the extent.
+		auto extentEnd = it->start + it->length;
+		auto runLength = std::min(count, extentEnd - chosen);
+		auto reserved = std::min(reserve, extentEnd - chosen - runLength);
+		auto carvedEnd = chosen + runLength + reserved;
+		if(chosen == it->start) {
+			it->start = carvedEnd;
+			it->length = extentEnd - carvedEnd;
+			if(!it->length)
+				extents->erase(it);
 		}else{
-			assert(order == 2);
-
-			auto indirect_frame = element >> (blockShift - 2);
-			auto indirect_index = element & ((1 << (blockShift - 2)) - 1);
-
-			helix::LockMemoryView lock_indirect;
-			auto &&submit_indirect = helix::submitLockMemoryView(inode->indirectOrder1,
-					&lock_indirect,
-					(1 + indirect_frame) << blockPagesShift, 1 << blockPagesShift,
-					helix::Dispatcher::global());
-			co_await submit_indirect.async_wait();
-			HEL_CHECK(lock_indirect.error());
-
-			helix::Mapping indirect_map{inode->indirectOrder1,
-					(1 + indirect_frame) << blockPagesShift, size_t{1} << blockPagesShift,
-					kHelMapProtRead | kHelMapDontRequireBacking};
-			block = reinterpret_cast<uint32_t *>(indirect_map.get())[indirect_index];
+			it->length = chosen - it->start;
+			if(carvedEnd < extentEnd)
+				extents->insert(std::next(it), FreeExtent{carvedEnd, extentEnd - carvedEnd});
 		}
 
-		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
-				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
-				&& "TODO: propery support multi-page blocks");
+		// TODO: Make sure we never return reserved blocks.
+		for(auto b = chosen; b < chosen + runLength; b++) {
+			assert(!(words[b / 32] & (static_cast<uint32_t>(1) << (b % 32))));
+			words[b / 32] |= static_cast<uint32_t>(1) << (b % 32);
+		}
+		co_await dirtyMetadata(bitmap);
+		auto first = bg_idx * blocksPerGroup + chosen;
+		assert(first);
+		assert(first + runLength <= blocksCount);
 
-		if (manage.type() == kHelManageInitialize) {
-			helix::Mapping out_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->readSectors(block * sectorsPerBlock,
-					out_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		} else {
-			assert(manage.type() == kHelManageWriteback);
+		bgdt[bg_idx].freeBlocksCount -= runLength;
+		co_await writebackBgdt();
 
-			helix::Mapping out_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->writeSectors(block * sectorsPerBlock,
-					out_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
-
-		}
+		co_return BlockRun{first, runLength, reserved};
 	}
+
+	co_return BlockRun{0, 0, 0};
 }
 
-async::result<uint32_t> FileSystem::allocateBlock() {
-	for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++) {
-		helix::LockMemoryView lock_bitmap;
-		auto &&submit_bitmap = helix::submitLockMemoryView(blockBitmap,
-				&lock_bitmap,
-				bg_idx << blockPagesShift, 1 << blockPagesShift,
-				helix::Dispatcher::global());
-		co_await submit_bitmap.async_wait();
-		HEL_CHECK(lock_bitmap.error());
+async::result<void> FileSystem::claimBlocks(uint32_t first, uint32_t count) {
+	auto bg_idx = first / blocksPerGroup;
+	auto start = first % blocksPerGroup;
+	assert(start + count <= blocksPerGroup);
 
-		helix::Mapping bitmap_map{blockBitmap,
-				bg_idx << blockPagesShift, size_t{1} << blockPagesShift,
-				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	auto bitmap = co_await accessMetadata(bgdt[bg_idx].blockBitmap);
+	auto words = reinterpret_cast<uint32_t *>(bitmap.data());
 
-		auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
-		for(unsigned int i = 0; i < (blocksPerGroup + 31) / 32; i++) {
-			if(words[i] == 0xFFFFFFFF)
-				continue;
-			for(int j = 0; j < 32; j++) {
-				if(i * 32 + j >= blocksPerGroup)
-					break;
-				if(words[i] & (static_cast<uint32_t>(1) << j))
-					continue;
-				// TODO: Make sure we never return reserved blocks.
-				// TODO: Make sure we never return blocks higher than the max. block in the SB.
-				auto block = bg_idx * blocksPerGroup + i * 32 + j;
-				assert(block);
-				assert(block < blocksCount);
-				words[i] |= static_cast<uint32_t>(1) << j;
+	for(auto b = start; b < start + count; b++) {
+		assert(!(words[b / 32] & (static_cast<uint32_t>(1) << (b % 32))));
+		words[b / 32] |= static_cast<uint32_t>(1) << (b % 32);
+	}
+	co_await dirtyMetadata(bitmap);
 
-				bgdt[bg_idx].freeBlocksCount--;
-				co_await writebackBgdt();
+	bgdt[bg_idx].freeBlocksCount -= count;
+	co_await writebackBgdt();
+}
 
-				co_return block;
-			}
-			assert(!"Failed to find zero-bit");
+void FileSystem::releaseBlocks(uint32_t first, uint32_t count) {
+	if(!count)
+		return;
+	auto bg_idx = first / blocksPerGroup;
+	auto start = first % blocksPerGroup;
+	auto &extents = freeBlockExtents[bg_idx];
+	assert(extents);
+
+	// Insert the blocks and merge them with adjacent extents.
+	auto it = std::lower_bound(extents->begin(), extents->end(), start,
+			[] (const FreeExtent &extent, uint32_t start) {
+				return extent.start < start;
+			});
+	it = extents->insert(it, FreeExtent{start, count});
+	if(auto next = std::next(it); next != extents->end()
+			&& it->start + it->length == next->start) {
+		it->length += next->length;
+		extents->erase(next);
+	}
+	if(it != extents->begin()) {
+		auto prev = std::prev(it);
+		if(prev->start + prev->length == it->start) {
+			prev->length += it->length;
+			extents->erase(it);
 		}
 	}
-
-	co_return 0;
 }
 
-async::result<uint32_t> FileSystem::allocateInode() {
-	// TODO: Do not start at block group zero.
-	for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++) {
-		helix::LockMemoryView lock_bitmap;
-		auto &&submit_bitmap = helix::submitLockMemoryView(inodeBitmap,
-				&lock_bitmap,
-				bg_idx << blockPagesShift, 1 << blockPagesShift,
-				helix::Dispatcher::global());
-		co_await submit_bitmap.async_wait();
-		HEL_CHECK(lock_bitmap.error());
+async::result<void> FileSystem::freeBlocks(uint32_t first, uint32_t count) {
+	auto bg_idx = first / blocksPerGroup;
+	auto start = first % blocksPerGroup;
+	assert(start + count <= blocksPerGroup);
 
-		helix::Mapping bitmap_map{inodeBitmap,
-				bg_idx << blockPagesShift, size_t{1} << blockPagesShift,
-				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	auto bitmap = co_await accessMetadata(bgdt[bg_idx].blockBitmap);
+	auto words = reinterpret_cast<uint32_t *>(bitmap.data());
 
-		auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
-		for(unsigned int i = 0; i < (inodesPerGroup + 31) / 32; i++) {
-			if(words[i] == 0xFFFFFFFF)
-				continue;
-			for(int j = 0; j < 32; j++) {
-				if(i * 32 + j >= inodesPerGroup)
-					break;
-				if(words[i] & (static_cast<uint32_t>(1) << j))
-					continue;
-				// TODO: Make sure we never return reserved inodes.
-				// TODO: Make sure we never return inodes higher than the max. inode in the SB.
-				auto ino = bg_idx * inodesPerGroup + i * 32 + j + 1;
-				assert(ino);
-				assert(ino < inodesCount);
-				words[i] |= static_cast<uint32_t>(1) << j;
+	for(auto b = start; b < start + count; b++) {
+		assert(words[b / 32] & (static_cast<uint32_t>(1) << (b % 32)));
+		words[b / 32] &= ~(static_cast<uint32_t>(1) << (b % 32));
+	}
+	co_await dirtyMetadata(bitmap);
 
-				bgdt[bg_idx].freeInodesCount--;
-				co_await writebackBgdt();
+	bgdt[bg_idx].freeBlocksCount += count;
+	co_await writebackBgdt();
 
-				co_return ino;
-			}
-			assert(!"Failed to find zero-bit");
-		}
+	// Otherwise, the free extent cache is built from the bitmap when it is first needed.
+	if(freeBlockExtents[bg_idx])
+		releaseBlocks(first, count);
+}
+
+async::result<uint32_t> FileSystem::allocateBlock(uint32_t goal) {
+	auto run = co_await allocateBlocks(goal, 1);
+	co_return run.first;
+}
+
+async::result<FileSystem::BlockRun>
+FileSystem::allocateDataBlocks(Inode *inode, uint32_t goal, uint32_t count) {
+	inode->metadataDirty = true;
+
+	// Note that we update the window before suspending such that concurrent
+	// allocations for the same inode never claim the same blocks.
+	if(inode->preallocCount && inode->preallocStart == goal) {
+		auto n = std::min(count, inode->preallocCount);
+		inode->preallocStart += n;
+		inode->preallocCount -= n;
+		co_await claimBlocks(goal, n);
+		co_return BlockRun{goal, n, 0};
+	}
+
+	releaseBlocks(inode->preallocStart, inode->preallocCount);
+	inode->preallocStart = 0;
+	inode->preallocCount = 0;
+
+	uint32_t reserve = 0;
+	if(inode->fileType == kTypeRegular)
+		reserve = preallocWindow;
+	auto run = co_await allocateBlocks(goal, count, reserve);
+	if(run.reserved) {
+		// Another allocation for this inode might have raced with us.
+		releaseBlocks(inode->preallocStart, inode->preallocCount);
+		inode->preallocStart = run.first + run.count;
+		inode->preallocCount = run.reserved;
+	}
+	co_return BlockRun{run.first, run.count, 0};
+}
+
+async::result<uint32_t> FileSystem::allocateInode() {
+	for(uint32_t n = 0; n < numBlockGroups; n++) {
+		auto bg_idx = (inodeSearchGroup + n) % numBlockGroups;
+		if(!bgdt[bg_idx].freeInodesCount)
+			continue;
+
+		auto bitmap = co_await accessMetadata(bgdt[bg_idx].inodeBitmap);
+		auto words = reinterpret_cast<uint32_t *>(bitmap.data());
+
+		auto numBits = std::min(inodesPerGroup, inodesCount - bg_idx * inodesPerGroup);
+		auto bit = findBit(words, inodeSearchStart[bg_idx], numBits, false);
+		inodeSearchStart[bg_idx] = bit;
+		if(bit == numBits)
+			continue;
+
+		// TODO: Make sure we never return reserved inodes.
+		auto ino = bg_idx * inodesPerGroup + bit + 1;
+		assert(ino);
+		assert(ino <= inodesCount);
+		words[bit / 32] |= static_cast<uint32_t>(1) << (bit % 32);
+		co_await dirtyMetadata(bitmap);
+		inodeSearchStart[bg_idx] = bit + 1;
+		inodeSearchGroup = bg_idx;
+
+		bgdt[bg_idx].freeInodesCount--;
+		co_await writebackBgdt();
+
+		co_return ino;
 	}
 
 	co_return 0;
@@ -1023,8 +1595,18 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 	size_t s_range = i_range + per_single; // Plus the first single indirect block.
 	size_t d_range = s_range + per_double; // Plus the first double indirect block.
 
+	if(inode->usesExtents) {
+		co_await assignExtentBlocks(inode, block_offset, num_blocks);
+		co_return;
+	}
+
 	auto disk_inode = inode->diskInode();
 
+	// Place blocks after the preceding block of the file, or else in the inode's group.
+	uint32_t goal = ((inode->number - 1) / inodesPerGroup) * blocksPerGroup;
+	if(block_offset && block_offset <= i_range && disk_inode->data.blocks.direct[block_offset - 1])
+		goal = disk_inode->data.blocks.direct[block_offset - 1] + 1;
+
 	size_t prg = 0;
 	while(prg < num_blocks) {
 		if(block_offset + prg < i_range) {
@@ -1032,55 +1614,65 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 					&& block_offset + prg < i_range) {
 				auto idx = block_offset + prg;
 				if(disk_inode->data.blocks.direct[idx]) {
+					goal = disk_inode->data.blocks.direct[idx] + 1;
 					prg++;
 					continue;
 				}
-				auto block = co_await allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->blocks += (blockSize / 512);
-				disk_inode->data.blocks.direct[idx] = block;
-				prg++;
+
+				// Allocate all consecutive holes at once.
+				uint32_t holes = 1;
+				while(prg + holes < num_blocks && idx + holes < i_range
+						&& !disk_inode->data.blocks.direct[idx + holes])
+					holes++;
+				auto run = co_await allocateDataBlocks(inode, goal, holes);
+				assert(run.count && "Out of disk space"); // TODO: Fix this.
+				disk_inode->blocks += run.count * (blockSize / 512);
+				for(uint32_t k = 0; k < run.count; k++)
+					disk_inode->data.blocks.direct[idx + k] = run.first + k;
+				goal = run.first + run.count;
+				prg += run.count;
 			}
 		}else if(block_offset + prg < s_range) {
 			bool needsReset = false;
 
 			// Allocate the single-indirect block itself.
 			if(!disk_inode->data.blocks.singleIndirect) {
-				auto block = co_await allocateBlock();
+				auto block = co_await allocateBlock(goal);
 				assert(block && "Out of disk space"); // TODO: Fix this.
 				disk_inode->blocks += (blockSize / 512);
 				disk_inode->data.blocks.singleIndirect = block;
+				goal = block + 1;
 				needsReset = true;
 			}
 
-			helix::LockMemoryView lock_indirect;
-			auto &&submit = helix::submitLockMemoryView(inode->indirectOrder1,
-					&lock_indirect, 0, 1 << blockPagesShift,
-					helix::Dispatcher::global());
-			co_await submit.async_wait();
-			HEL_CHECK(lock_indirect.error());
-
-			helix::Mapping indirect_map{inode->indirectOrder1,
-					0, size_t{1} << blockPagesShift,
-					kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
-			auto window = reinterpret_cast<uint32_t *>(indirect_map.get());
+			auto indirect = co_await accessMetadata(disk_inode->data.blocks.singleIndirect);
+			auto window = reinterpret_cast<uint32_t *>(indirect.data());
 
 			if(needsReset)
-				memset(window, 0, size_t{1} << blockPagesShift);
+				memset(window, 0, blockSize);
 
 			while(prg < num_blocks
 					&& block_offset + prg < s_range) {
 				auto idx = block_offset + prg - i_range;
 				if(window[idx]) {
+					goal = window[idx] + 1;
 					prg++;
 					continue;
 				}
-				auto block = co_await allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->blocks += (blockSize / 512);
-				window[idx] = block;
-				prg++;
+
+				uint32_t holes = 1;
+				while(prg + holes < num_blocks && idx + holes < per_single
+						&& !window[idx + holes])
+					holes++;
+				auto run = co_await allocateDataBlocks(inode, goal, holes);
+				assert(run.count && "Out of disk space"); // TODO: Fix this.
+				disk_inode->blocks += run.count * (blockSize / 512);
+				for(uint32_t k = 0; k < run.count; k++)
+					window[idx + k] = run.first + k;
+				goal = run.first + run.count;
+				prg += run.count;
 			}
+			co_await dirtyMetadata(indirect);
 		}else if(block_offset + prg < d_range) {
 			assert(!"TODO: Implement allocation in double indirect blocks");
 		}else{
@@ -1094,6 +1686,226 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 	HEL_CHECK(syncInode.error());
 }
 
+async::result<void> FileSystem::assignExtentBlocks(Inode *inode,
+		uint64_t block_offset, size_t num_blocks) {
+	auto disk_inode = inode->diskInode();
+	auto &extents = inode->extents;
+
+	co_await inode->extentMutex.async_lock();
+
+	auto findExtent = [&] (uint64_t index) {
+		return std::upper_bound(extents.begin(), extents.end(), index,
+				[] (uint64_t index, const Inode::MappedExtent &extent) {
+					return index < extent.logical;
+				}) - extents.begin();
+	};
+
+	uint32_t goal = ((inode->number - 1) / inodesPerGroup) * blocksPerGroup;
+	bool changed = false;
+	size_t prg = 0;
+	while(prg < num_blocks) {
+		auto index = block_offset + prg;
+		size_t k = findExtent(index);
+
+		if(k && index < extents[k - 1].logical + extents[k - 1].length) {
+			auto extent = extents[k - 1];
+			auto n = std::min<size_t>(num_blocks - prg, extent.logical + extent.length - index);
+			goal = extent.physical + (index - extent.logical) + n;
+
+			// Split uninitialized extents such that the written blocks become initialized.
+			if(extent.uninitialized) {
+				std::vector<Inode::MappedExtent> pieces;
+				if(index > extent.logical)
+					pieces.push_back({extent.logical, static_cast<uint32_t>(index - extent.logical),
+							extent.physical, true});
+				pieces.push_back({static_cast<uint32_t>(index), static_cast<uint32_t>(n),
+						extent.physical + (index - extent.logical), false});
+				if(index + n < extent.logical + extent.length)
+					pieces.push_back({static_cast<uint32_t>(index + n),
+							static_cast<uint32_t>(extent.logical + extent.length - index - n),
+							goal, true});
+
+				size_t at = k - 1;
+				size_t initialized = at + (index > extent.logical ? 1 : 0);
+				extents.erase(extents.begin() + at);
+				extents.insert(extents.begin() + at, pieces.begin(), pieces.end());
+				mergeExtents(extents, initialized);
+				changed = true;
+			}
+			prg += n;
+			continue;
+		}
+
+		// Fill the hole up to the next extent.
+		if(k)
+			goal = extents[k - 1].physical + extents[k - 1].length;
+		size_t holes = std::min<size_t>(num_blocks - prg, EXT4_EXT_INIT_MAX_LEN);
+		if(k < extents.size())
+			holes = std::min<size_t>(holes, extents[k].logical - index);
+
+		auto run = co_await allocateDataBlocks(inode, goal, holes);
+		assert(run.count && "Out of disk space"); // TODO: Fix this.
+		disk_inode->blocks += run.count * (blockSize / 512);
+
+		extents.insert(extents.begin() + k,
+				Inode::MappedExtent{static_cast<uint32_t>(index), run.count, run.first, false});
+		mergeExtents(extents, k);
+		changed = true;
+		goal = run.first + run.count;
+		prg += run.count;
+	}
+
+	if(changed)
+		co_await writeExtentTree(inode);
+	inode->extentMutex.unlock();
+
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			inode->diskMapping.get(), inodeSize);
+	HEL_CHECK(syncInode.error());
+}
+
+async::result<void> FileSystem::readExtentNode(Inode *inode, const std::byte *node) {
+	DiskExtentHeader header;
+	memcpy(&header, node, sizeof(DiskExtentHeader));
+	if(header.magic != EXT4_EXT_MAGIC) {
+		std::cerr << "ext2fs: Bad extent tree magic " << header.magic
+				<< " in inode " << inode->number << std::endl;
+		abort();
+	}
+
+	auto entries = node + sizeof(DiskExtentHeader);
+	if(!header.depth) {
+		for(size_t i = 0; i < header.entries; i++) {
+			DiskExtent disk_extent;
+			memcpy(&disk_extent, entries + i * sizeof(DiskExtent), sizeof(DiskExtent));
+
+			Inode::MappedExtent extent;
+			extent.logical = disk_extent.block;
+			extent.length = disk_extent.length;
+			extent.physical = (uint64_t{disk_extent.startHi} << 32) | disk_extent.startLo;
+			extent.uninitialized = disk_extent.length > EXT4_EXT_INIT_MAX_LEN;
+			if(extent.uninitialized)
+				extent.length -= EXT4_EXT_INIT_MAX_LEN;
+			inode->extents.push_back(extent);
+		}
+		co_return;
+	}
+
+	for(size_t i = 0; i < header.entries; i++) {
+		DiskExtentIndex disk_index;
+		memcpy(&disk_index, entries + i * sizeof(DiskExtentIndex), sizeof(DiskExtentIndex));
+		auto child = (uint64_t{disk_index.leafHi} << 32) | disk_index.leafLo;
+
+		auto view = co_await accessMetadata(child);
+		inode->extentNodes.push_back(child);
+		co_await readExtentNode(inode, reinterpret_cast<const std::byte *>(view.data()));
+	}
+}
+
+// Writes inode->extents back to disk. The tree is rebuilt from the bottom up: the blocks
+// of the old tree are reused and surplus blocks are freed. Since blocks are allocated
+// in large runs on writeback, the number of extents (and nodes) stays small.
+async::result<void> FileSystem::writeExtentTree(Inode *inode) {
+	static_assert(sizeof(DiskExtentIndex) == sizeof(DiskExtent));
+	auto disk_inode = inode->diskInode();
+	auto &extents = inode->extents;
+	auto root = disk_inode->data.embedded;
+	size_t perRoot = (sizeof(FileData) - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	size_t perNode = (blockSize - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+
+	auto oldNodes = std::move(inode->extentNodes);
+	inode->extentNodes.clear();
+	size_t numReused = 0;
+
+	// Entries of the level that is currently written: extents at depth zero,
+	// otherwise the nodes of the level below.
+	struct Child {
+		uint32_t logical;
+		uint64_t block;
+	};
+	std::vector<Child> children;
+	uint16_t depth = 0;
+	size_t numEntries = extents.size();
+
+	auto firstLogical = [&] (size_t k) -> uint32_t {
+		if(!depth)
+			return extents[k].logical;
+		return children[k].logical;
+	};
+
+	auto writeNode = [&] (void *node, size_t first, size_t count, size_t max) {
+		auto buffer = static_cast<std::byte *>(node);
+		DiskExtentHeader header{};
+		header.magic = EXT4_EXT_MAGIC;
+		header.entries = count;
+		header.max = max;
+		header.depth = depth;
+		memcpy(buffer, &header, sizeof(DiskExtentHeader));
+		for(size_t j = 0; j < count; j++) {
+			auto entry = buffer + sizeof(DiskExtentHeader) + j * sizeof(DiskExtent);
+			if(!depth) {
+				auto disk_extent = toDiskExtent(extents[first + j]);
+				memcpy(entry, &disk_extent, sizeof(DiskExtent));
+			}else{
+				DiskExtentIndex disk_index{};
+				disk_index.block = children[first + j].logical;
+				disk_index.leafLo = static_cast<uint32_t>(children[first + j].block);
+				disk_index.leafHi = children[first + j].block >> 32;
+				memcpy(entry, &disk_index, sizeof(DiskExtentIndex));
+			}
+		}
+	};
+
+	// Add levels until the top level fits into the inode.
+	while(numEntries > perRoot) {
+		auto numNodes = (numEntries + perNode - 1) / perNode;
+
+		std::vector<Child> parents;
+		size_t k = 0;
+		for(size_t i = 0; i < numNodes; i++) {
+			// Fill the nodes in order but make sure that no node is empty.
+			auto count = std::min(perNode, numEntries - k - (numNodes - 1 - i));
+
+			uint64_t block;
+			if(numReused < oldNodes.size()) {
+				block = oldNodes[numReused++];
+			}else{
+				uint32_t goal = ((inode->number - 1) / inodesPerGroup) * blocksPerGroup;
+				if(!inode->extentNodes.empty())
+					goal = inode->extentNodes.back() + 1;
+				block = co_await allocateBlock(goal);
+				assert(block && "Out of disk space"); // TODO: Fix this.
+				disk_inode->blocks += (blockSize / 512);
+			}
+			inode->extentNodes.push_back(block);
+
+			auto view = co_await accessMetadata(block);
+			memset(view.data(), 0, blockSize);
+			writeNode(view.data(), k, count, perNode);
+			co_await dirtyMetadata(view);
+
+			parents.push_back({firstLogical(k), block});
+			k += count;
+		}
+		assert(k == numEntries);
+
+		children = std::move(parents);
+		numEntries = children.size();
+		depth++;
+	}
+
+	memset(root, 0, sizeof(FileData));
+	writeNode(root, 0, numEntries, perRoot);
+	inode->extentDepth = depth;
+
+	// Free the nodes that are not needed anymore (e.g., since extents were merged).
+	for(size_t i = numReused; i < oldNodes.size(); i++) {
+		co_await freeBlocks(oldNodes[i], 1);
+		disk_inode->blocks -= (blockSize / 512);
+	}
+}
+
 async::result<void> FileSystem::readDataBlocks(std::shared_ptr<Inode> inode,
 		uint64_t offset, size_t num_blocks, void *buffer) {
 	// We perform "block-fusion" here i.e. we try to read/write multiple
@@ -1133,33 +1945,38 @@ async::result<void> FileSystem::readDataBlocks(std::shared_ptr<Inode> inode,
 //		std::cout << "Reading " << index << "-th block from inode " << inode->number
 //				<< " (" << progress << "/" << num_blocks << " in request)" << std::endl;
 
-		assert(index < d_range);
-		if(index >= d_range) {
+		if(inode->usesExtents) {
+			// Extents are cached in memory, a single lookup can map the whole request.
+			issue = inode->mapExtent(index, num_blocks - progress);
+		}else if(index >= d_range) {
 			assert(!"Fix triple indirect blocks");
 		}else if(index >= s_range) { // Use the double indirect block.
 			auto remaining = num_blocks - progress;
 			int64_t indirect_frame = (index - s_range) >> (blockShift - 2);
 			int64_t indirect_index = (index - s_range) & ((1 << (blockShift - 2)) - 1);
 
-			if (remaining > indirectBufferSize) {
-				helix::LockMemoryView lock_indirect;
-				auto &&submit = helix::submitLockMemoryView(inode->indirectOrder2, &lock_indirect,
-						indirect_frame << blockPagesShift, 1 << blockPagesShift,
-						helix::Dispatcher::global());
-				co_await submit.async_wait();
-				HEL_CHECK(lock_indirect.error());
+			uint32_t indirect_block = 0;
+			if(auto outer = inode->diskInode()->data.blocks.doubleIndirect; outer) {
+				auto readMemory = co_await helix_ng::readMemory(
+						helix::BorrowedDescriptor{metadataCache},
+						(uint64_t{outer} << blockShift) + indirect_frame * 4,
+						4, &indirect_block);
+				HEL_CHECK(readMemory.error());
+			}
 
-				helix::Mapping indirect_map{inode->indirectOrder2,
-						indirect_frame << blockPagesShift, size_t{1} << blockPagesShift,
-						kHelMapProtRead | kHelMapDontRequireBacking};
+			if(!indirect_block) {
+				// Holes are read as zeros.
+				issue = {0, std::min<size_t>(remaining, per_indirect - indirect_index)};
+			}else if (remaining > indirectBufferSize) {
+				auto indirect = co_await accessMetadata(indirect_block);
 
 				issue = fuse(remaining,
-						reinterpret_cast<uint32_t *>(indirect_map.get()) + indirect_index,
+						reinterpret_cast<uint32_t *>(indirect.data()) + indirect_index,
 						per_indirect - indirect_index);
 			} else {
 				auto readMemory = co_await helix_ng::readMemory(
-						helix::BorrowedDescriptor{inode->indirectOrder2},
-						(indirect_frame << blockPagesShift) + indirect_index * 4,
+						helix::BorrowedDescriptor{metadataCache},
+						(uint64_t{indirect_block} << blockShift) + indirect_index * 4,
 						remaining * 4, indirectBuffer.data());
 				HEL_CHECK(readMemory.error());
 
@@ -1168,26 +1985,21 @@ async::result<void> FileSystem::readDataBlocks(std::shared_ptr<Inode> inode,
 		}else if(index >= i_range) { // Use the single indirect block.
 			auto remaining = num_blocks - progress;
 			auto indirect_index = index - i_range;
+			auto indirect_block = inode->diskInode()->data.blocks.singleIndirect;
 
-			if (remaining > indirectBufferSize) {
-				helix::LockMemoryView lock_indirect;
-				auto &&submit = helix::submitLockMemoryView(inode->indirectOrder1,
-						&lock_indirect, 0, 1 << blockPagesShift,
-						helix::Dispatcher::global());
-				co_await submit.async_wait();
-				HEL_CHECK(lock_indirect.error());
-
-				helix::Mapping indirect_map{inode->indirectOrder1,
-						0, size_t{1} << blockPagesShift,
-						kHelMapProtRead | kHelMapDontRequireBacking};
+			if(!indirect_block) {
+				issue = {0, std::min<size_t>(remaining, s_range - index)};
+			}else if (remaining > indirectBufferSize) {
+				auto indirect = co_await accessMetadata(indirect_block);
 
 				issue = fuse(remaining,
-						reinterpret_cast<uint32_t *>(indirect_map.get()) + indirect_index,
+						reinterpret_cast<uint32_t *>(indirect.data()) + indirect_index,
 						per_indirect - indirect_index);
 			} else {
 				auto readMemory = co_await helix_ng::readMemory(
-						helix::BorrowedDescriptor{inode->indirectOrder1},
-						indirect_index * 4, remaining * 4, indirectBuffer.data());
+						helix::BorrowedDescriptor{metadataCache},
+						(uint64_t{indirect_block} << blockShift) + indirect_index * 4,
+						remaining * 4, indirectBuffer.data());
 				HEL_CHECK(readMemory.error());
 
 				issue = fuse(remaining, indirectBuffer.data(), remaining);
@@ -1250,40 +2062,25 @@ async::result<void> FileSystem::writeDataBlocks(std::shared_ptr<Inode> inode,
 //		std::cout << "Write " << index << "-th block to inode " << inode->number
 //				<< " (" << progress << "/" << num_blocks << " in request)" << std::endl;
 
-		assert(index < d_range);
-		if(index >= d_range) {
+		if(inode->usesExtents) {
+			issue = inode->mapExtent(index, num_blocks - progress);
+		}else if(index >= d_range) {
 			assert(!"Fix triple indirect blocks");
 		}else if(index >= s_range) { // Use the double indirect block.
 			// TODO: Use shift/and instead of div/mod.
 			int64_t indirect_frame = (index - s_range) >> (blockShift - 2);
 			int64_t indirect_index = (index - s_range) & ((1 << (blockShift - 2)) - 1);
 
-			helix::LockMemoryView lock_indirect;
-			auto &&submit = helix::submitLockMemoryView(inode->indirectOrder2, &lock_indirect,
-					indirect_frame << blockPagesShift, 1 << blockPagesShift,
-					helix::Dispatcher::global());
-			co_await submit.async_wait();
-			HEL_CHECK(lock_indirect.error());
-
-			helix::Mapping indirect_map{inode->indirectOrder2,
-					indirect_frame << blockPagesShift, size_t{1} << blockPagesShift,
-					kHelMapProtRead | kHelMapDontRequireBacking};
+			auto outer = co_await accessMetadata(inode->diskInode()->data.blocks.doubleIndirect);
+			auto indirect_block = reinterpret_cast<uint32_t *>(outer.data())[indirect_frame];
+			auto indirect = co_await accessMetadata(indirect_block);
 
 			issue = fuse(indirect_index, num_blocks - progress,
-					reinterpret_cast<uint32_t *>(indirect_map.get()), per_indirect);
-		}else if(index >= i_range) { // Use the triple indirect block.
-			helix::LockMemoryView lock_indirect;
-			auto &&submit = helix::submitLockMemoryView(inode->indirectOrder1,
-					&lock_indirect, 0, 1 << blockPagesShift,
-					helix::Dispatcher::global());
-			co_await submit.async_wait();
-			HEL_CHECK(lock_indirect.error());
-
-			helix::Mapping indirect_map{inode->indirectOrder1,
-					0, size_t{1} << blockPagesShift,
-					kHelMapProtRead | kHelMapDontRequireBacking};
+					reinterpret_cast<uint32_t *>(indirect.data()), per_indirect);
+		}else if(index >= i_range) { // Use the single indirect block.
+			auto indirect = co_await accessMetadata(inode->diskInode()->data.blocks.singleIndirect);
 			issue = fuse(index - i_range, num_blocks - progress,
-					reinterpret_cast<uint32_t *>(indirect_map.get()), per_indirect);
+					reinterpret_cast<uint32_t *>(indirect.data()), per_indirect);
 		}else{
 			auto disk_inode = inode->diskInode();
 
@@ -1304,6 +2101,9 @@ async::result<void> FileSystem::writeDataBlocks(std::shared_ptr<Inode> inode,
 
 
 async::result<void> FileSystem::truncate(Inode *inode, size_t size) {
+	// Complete pending writebacks while their ranges are still part of the file.
+	co_await flushInode(inode->shared_from_this());
+
 	HEL_CHECK(helResizeMemory(inode->backingMemory,
 			(size + 0xFFF) & ~size_t(0xFFF)));
 	inode->setFileSize(size);
@@ -1314,10 +2114,114 @@ async::result<void> FileSystem::truncate(Inode *inode, size_t size) {
 	co_return;
 }
 
+async::result<void> FileSystem::flushInode(std::shared_ptr<Inode> inode) {
+	co_await inode->flushMutex.async_lock();
+
+	auto ranges = std::move(inode->dirtyRanges);
+	inode->dirtyRanges.clear();
+	if(inode->dirtyLink) {
+		dirtyInodes.erase(*inode->dirtyLink);
+		inode->dirtyLink.reset();
+	}
+
+	for(auto [offset, length] : ranges) {
+		dirtyBytes -= length;
+
+		// Blocks are only allocated once their data is written back. This lets us
+		// allocate all blocks of a (streaming) write in a few contiguous runs.
+		if(offset < inode->fileSize()) {
+			helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
+					static_cast<ptrdiff_t>(offset), length, kHelMapProtRead};
+
+			size_t backed_size = std::min(length, inode->fileSize() - offset);
+			size_t num_blocks = (backed_size + (blockSize - 1)) / blockSize;
+			assert(num_blocks * blockSize <= length);
+
+			co_await assignDataBlocks(inode.get(), offset / blockSize, num_blocks);
+			co_await writeDataBlocks(inode, offset / blockSize, num_blocks, file_map.get());
+		}
+
+		HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageWriteback,
+				offset, length));
+	}
+
+	inode->flushMutex.unlock();
+	inode->writebackBell.raise();
+}
+
+async::detached FileSystem::flushDirtyInodes() {
+	while(true) {
+		co_await helix::sleepFor(flushInterval);
+
+		// dirtyInodes is ordered by age and flushInode() removes the inode from it.
+		auto now = helix::currentClock();
+		while(!dirtyInodes.empty()) {
+			auto inode = dirtyInodes.front();
+			if(memoryPressure == kHelMemoryPressureNone
+					&& dirtyBytes <= dirtyLimit / 2
+					&& now - inode->dirtySince < dirtyExpire)
+				break;
+			co_await flushInode(inode);
+		}
+	}
+}
+
+async::result<void> FileSystem::fsync(std::shared_ptr<Inode> inode, bool data_only) {
+	co_await inode->readyJump.wait();
+
+	if(inode->fileType == kTypeRegular || inode->fileType == kTypeDirectory) {
+		auto cache_size = (inode->fileSize() + 0xFFF) & ~size_t(0xFFF);
+		while(true) {
+			co_await flushInode(inode);
+
+			// Pages that were dirtied before fsync() might not have reached manageFileData()
+			// yet and pages can be dirtied again while we write them. Wait until the kernel
+			// does not report any pending writeback anymore.
+			size_t pending;
+			HEL_CHECK(helQueryWriteback(inode->backingMemory, 0, cache_size, &pending));
+			if(!pending)
+				break;
+			if(inode->dirtyRanges.empty())
+				co_await inode->writebackBell.async_wait();
+		}
+	}
+
+	// The size and the block map are needed to read the data back. Since blocks are
+	// only allocated through the single indirect block and extent nodes, only those
+	// (and the inode itself) can change.
+	if(!data_only || inode->metadataDirty) {
+		inode->metadataDirty = false;
+		if(inode->usesExtents) {
+			for(auto node : inode->extentNodes) {
+				auto view = co_await accessMetadata(node);
+				co_await writeMetadata(view);
+			}
+		}else if(inode->fileType != kTypeSymlink
+				&& inode->diskInode()->data.blocks.singleIndirect) {
+			auto view = co_await accessMetadata(inode->diskInode()->data.blocks.singleIndirect);
+			co_await writeMetadata(view);
+		}
+		co_await writeInodeSectors(inode.get());
+	}
+
+	co_await device->submit({.op = BlockOp::flush});
+}
+
+async::result<void> FileSystem::writeInodeSectors(Inode *inode) {
+	// The inode table is written back by manageMetadata(); we write the
+	// sectors directly to make sure that they are on disk before fsync() returns.
+	// Note that the inode keeps its page of the metadata cache locked.
+	auto inode_address = inodeAddress(inode->number);
+	auto first = inode_address & ~uint64_t(511);
+	auto last = (inode_address + inodeSize + 511) & ~uint64_t(511);
+
+	helix::Mapping table_map{metadataCache, static_cast<ptrdiff_t>(first), last - first,
+			kHelMapProtRead | kHelMapDontRequireBacking};
+	co_await device->writeSectors(first / 512, table_map.get(), (last - first) / 512);
+}
+
 async::result<void> FileSystem::writebackBgdt() {
-	auto bgdt_offset = (2048 + blockSize - 1) & ~size_t(blockSize - 1);
-	co_await device->writeSectors((bgdt_offset >> blockShift) * sectorsPerBlock,
-			blockGroupDescriptorBuffer.data(), blockGroupDescriptorBuffer.size() / 512);
+	co_await dirtyMetadata(bgdtView);
 }
 
 // --------------------------------------------------------
@@ -1371,5 +2275,74 @@ OpenFile::readEntries() {
 	co_return std::nullopt;
 }
 
+async::result<size_t>
+OpenFile::readEntriesBatch(void *buffer, size_t size, bool with_stats) {
+	co_await inode->readyJump.wait();
+	assert(inode->fileType == kTypeDirectory);
+
+	auto map_size = (inode->fileSize() + 0xFFF) & ~size_t(0xFFF);
+
+	helix::LockMemoryView lock_memory;
+	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(inode->frontalMemory),
+			&lock_memory, 0, map_size, helix::Dispatcher::global());
+	co_await submit.async_wait();
+	HEL_CHECK(lock_memory.error());
+
+	helix::Mapping file_map{helix::BorrowedDescriptor{inode->frontalMemory},
+			0, map_size,
+			kHelMapProtRead | kHelMapDontRequireBacking};
+
+	size_t length = 0;
+	assert(offset <= inode->fileSize());
+	while(offset < inode->fileSize()) {
+		assert(!(offset & 3));
+		assert(offset + sizeof(DiskDirEntry) <= inode->fileSize());
+		auto disk_entry = reinterpret_cast<DiskDirEntry *>(
+				reinterpret_cast<char *>(file_map.get()) + offset);
+		assert(offset + disk_entry->recordLength <= inode->fileSize());
+
+		if(!disk_entry->inode) {
+			offset += disk_entry->recordLength;
+			continue;
+		}
+
+		// Stop before the first entry that does not fit; it is returned by the next call.
+		auto record_size = protocols::fs::direntRecordSize(disk_entry->nameLength, with_stats);
+		if(length + record_size > size)
+			break;
+
+		uint8_t type;
+		switch(disk_entry->fileType) {
+		case EXT2_FT_REG_FILE: type = protocols::fs::kDirentRegular; break;
+		case EXT2_FT_DIR: type = protocols::fs::kDirentDirectory; break;
+		case EXT2_FT_SYMLINK: type = protocols::fs::kDirentSymlink; break;
+		default: type = protocols::fs::kDirentUnknown;
+		}
+
+		// Loading the child suspends; disk_entry stays mapped since we hold the lock.
+		protocols::fs::DirentStats stats{};
+		if(with_stats) {
+			auto child = inode->fs.accessInode(disk_entry->inode);
+			co_await child->readyJump.wait();
+			auto disk_inode = child->diskInode();
+			stats.fileSize = child->fileSize();
+			stats.mode = disk_inode->mode & 0xFFF;
+			stats.linkCount = disk_inode->linksCount;
+			stats.uid = child->uid;
+			stats.gid = child->gid;
+			stats.atimeSecs = disk_inode->atime;
+			stats.mtimeSecs = disk_inode->mtime;
+			stats.ctimeSecs = disk_inode->ctime;
+		}
+
+		length += protocols::fs::appendDirentRecord(reinterpret_cast<char *>(buffer) + length,
+				size - length, disk_entry->inode, type,
+				disk_entry->name, disk_entry->nameLength, with_stats ? &stats : nullptr);
+		offset += disk_entry->recordLength;
+	}
+
+	co_return length;
+}
+
 } } // namespace blockfs::ext2fs
 
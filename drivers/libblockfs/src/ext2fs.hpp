@@ -1,14 +1,18 @@
 
 #include <string.h>
 #include <time.h>
+#include <list>
+#include <map>
 #include <optional>
 #include <memory>
 #include <optional>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
+#include <protocols/fs/defs.hpp>
 #include <protocols/fs/file-locks.hpp>
 
+#include <async/mutex.hpp>
 #include <async/oneshot-event.hpp>
 #include <async/recurring-event.hpp>
 #include <hel.h>
@@ -24,9 +28,6 @@ namespace ext2fs {
 // On-disk structures
 // --------------------------------------------------------
 
-using FlockManager = protocols::fs::FlockManager;
-using Flock = protocols::fs::Flock;
-
 union FileData {
 	struct Blocks {
 		uint32_t direct[12];
@@ -93,7 +94,16 @@ struct DiskSuperblock {
 	//-- Other options --
 	uint32_t defaultMountOptions;
 	uint32_t firstMetaBg;
-	uint8_t unused[760];
+	uint32_t mkfsTime;
+	uint32_t jnlBlocks[17];
+	//-- 64-bit Support --
+	uint32_t blocksCountHi;
+	uint32_t rBlocksCountHi;
+	uint32_t freeBlocksCountHi;
+	uint16_t minExtraIsize;
+	uint16_t wantExtraIsize;
+	uint32_t flags;
+	uint8_t unused[668];
 };
 static_assert(sizeof(DiskSuperblock) == 1024, "Bad DiskSuperblock struct size");
 
@@ -135,6 +145,88 @@ enum {
 	EXT2_ROOT_INO = 2
 };
 
+enum {
+	// Superblock flag: directory hashes treat names as unsigned chars.
+	EXT2_FLAGS_UNSIGNED_HASH = 0x2
+};
+
+enum {
+	// Inode flag: the directory has a hashed index (htree).
+	EXT2_INDEX_FL = 0x1000
+};
+
+enum {
+	// Inode flag: the inode maps its blocks through an extent tree.
+	EXT4_EXTENTS_FL = 0x80000
+};
+
+enum {
+	// Incompatible feature: (some) inodes use extent trees.
+	EXT4_FEATURE_INCOMPAT_EXTENTS = 0x40
+};
+
+enum {
+	EXT2_HASH_LEGACY = 0,
+	EXT2_HASH_HALF_MD4 = 1,
+	EXT2_HASH_TEA = 2
+};
+
+// Header of the root block of a hashed directory. It follows the "." and ".." entries;
+// the ".." entry spans the remainder of the block such that linear readers skip the index.
+struct DiskDxRootInfo {
+	uint32_t reservedZero;
+	uint8_t hashVersion;
+	uint8_t infoLength;
+	uint8_t indirectLevels;
+	uint8_t unusedFlags;
+};
+
+// The first entry of each index block overlaps the limit and count of entries
+// (and has an implicit hash of zero).
+struct DiskDxEntry {
+	uint32_t hash;
+	uint32_t block;
+};
+
+struct DiskDxCountLimit {
+	uint16_t limit;
+	uint16_t count;
+};
+
+// Header of each node of an extent tree. The root node is stored in FileData.
+struct DiskExtentHeader {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth; // Zero for leaf nodes.
+	uint32_t generation;
+};
+static_assert(sizeof(DiskExtentHeader) == 12, "Bad DiskExtentHeader struct size");
+
+enum {
+	EXT4_EXT_MAGIC = 0xF30A,
+	// Extents longer than this are uninitialized (i.e., they read as zeros).
+	EXT4_EXT_INIT_MAX_LEN = 32768
+};
+
+// Entry of an internal node of an extent tree.
+struct DiskExtentIndex {
+	uint32_t block; // First logical block covered by the child.
+	uint32_t leafLo;
+	uint16_t leafHi;
+	uint16_t unused;
+};
+static_assert(sizeof(DiskExtentIndex) == 12, "Bad DiskExtentIndex struct size");
+
+// Entry of a leaf node of an extent tree.
+struct DiskExtent {
+	uint32_t block; // First logical block.
+	uint16_t length;
+	uint16_t startHi;
+	uint32_t startLo;
+};
+static_assert(sizeof(DiskExtent) == 12, "Bad DiskExtent struct size");
+
 enum {
 	EXT2_S_IFMT = 0xF000,
 	EXT2_S_IFLNK = 0xA000,
@@ -174,6 +266,8 @@ struct FileSystem;
 struct Inode : std::enable_shared_from_this<Inode> {
 	Inode(FileSystem &fs, uint32_t number);
 
+	~Inode();
+
 	DiskInode *diskInode() {
 		return reinterpret_cast<DiskInode *>(diskMapping.get());
 	}
@@ -185,9 +279,21 @@ struct Inode : std::enable_shared_from_this<Inode> {
 
 	void setFileSize(uint64_t size);
 
+	// For inodes that use an extent tree: returns the physical block of the given
+	// logical block (or zero if it is not backed by initialized data) and the number
+	// of following blocks (up to limit) that are mapped in the same way.
+	std::pair<size_t, size_t> mapExtent(uint64_t index, size_t limit);
+
 	async::result<frg::expected<protocols::fs::Error, std::optional<DirEntry>>>
 	findEntry(std::string name);
 
+	// Looks up name through the directory's htree. Returns false if the htree
+	// cannot be used (in that case, the directory needs to be searched linearly).
+	async::result<bool> findHashedEntry(const std::string &name, std::optional<DirEntry> &entry);
+
+	// Clears EXT2_INDEX_FL before the directory is modified.
+	async::result<void> dropHashedIndex();
+
 	async::result<std::optional<DirEntry>> link(std::string name, int64_t ino, blockfs::FileType type);
 	async::result<frg::expected<protocols::fs::Error>> unlink(std::string name);
 	async::result<std::optional<DirEntry>> mkdir(std::string name);
@@ -214,61 +320,168 @@ struct Inode : std::enable_shared_from_this<Inode> {
 	HelHandle frontalMemory;
 	helix::Mapping fileMapping;
 
-	// Caches indirection blocks reachable from the inode.
-	// - Indirection level 1/1 for single indirect blocks.
-	// - Indirection level 1/2 for double indirect blocks.
-	// - Indirection level 1/3 for triple indirect blocks.
-	helix::UniqueDescriptor indirectOrder1;
-	// Caches indirection blocks reachable from order 1 blocks.
-	// - Indirection level 2/2 for double indirect blocks.
-	// - Indirection level 2/3 for triple indirect blocks.
-	helix::UniqueDescriptor indirectOrder2;
-	// Caches indirection blocks reachable from order 2 blocks.
-	// - Indirection level 3/3 for triple indirect blocks.
-	helix::UniqueDescriptor indirectOrder3;
+	struct MappedExtent {
+		uint32_t logical;
+		uint32_t length;
+		uint64_t physical;
+		bool uninitialized;
+	};
+
+	// true if the inode uses an extent tree instead of (indirect) block lists.
+	bool usesExtents = false;
+	// All extents of the inode, sorted by logical block. The whole extent tree
+	// is read when the inode is loaded and written back when it changes.
+	std::vector<MappedExtent> extents;
+	// Blocks of all non-root nodes of the extent tree (leaves and index nodes;
+	// empty if the extents are stored in the inode).
+	std::vector<uint64_t> extentNodes;
+	// Depth of the on-disk extent tree.
+	int extentDepth = 0;
+	// Protects extents while blocks are allocated and the tree is written back.
+	async::mutex extentMutex;
 
 	// NOTE: The following fields are only meaningful if the isReady is true
 
 	FileType fileType;
 
 	int uid, gid;
-	FlockManager flockManager;
+	protocols::fs::FileLockManager fileLocks;
 
 	std::unordered_set<std::string> obstructedLinks;
+
+	// Maps names to the offsets of their directory entries. Built by findEntry()
+	// on the first linear lookup and kept up to date by link() and unlink().
+	std::optional<std::unordered_map<std::string, size_t>> nameIndex;
+
+	// Blocks that are reserved for the next writes to this file (streaming writers
+	// continue at preallocStart). They are free on disk, but not handed out to other files.
+	uint32_t preallocStart = 0;
+	uint32_t preallocCount = 0;
+
+	// Position in FileSystem::inodeCache (if the inode is cached).
+	std::optional<std::list<std::shared_ptr<Inode>>::iterator> cacheLink;
+	// Memory that is accounted for this inode in the inode cache.
+	size_t cacheCost = 0;
+
+	// Ranges of the page cache (offset to length) that the kernel handed to us for
+	// writeback but that were not written to disk yet. Adjacent ranges are merged.
+	std::map<uint64_t, uint64_t> dirtyRanges;
+	// Time at which dirtyRanges became non-empty.
+	uint64_t dirtySince = 0;
+	// Raised when writeback requests arrive and when flushes complete.
+	async::recurring_event writebackBell;
+	// Serializes flushes of dirtyRanges.
+	async::mutex flushMutex;
+	// Position in FileSystem::dirtyInodes (if dirtyRanges is not empty).
+	std::optional<std::list<std::shared_ptr<Inode>>::iterator> dirtyLink;
+	// true if the file size or the block map changed since the inode was last written by fsync().
+	bool metadataDirty = false;
 };
 
 // --------------------------------------------------------
 // FileSystem
 // --------------------------------------------------------
 
+// Run of metadata blocks that is locked in the metadata cache and mapped.
+struct MetadataView {
+	void *data() {
+		return mapping.get();
+	}
+
+	uint64_t block = 0;
+	size_t numBlocks = 0;
+	helix::UniqueDescriptor lock;
+	helix::Mapping mapping;
+};
+
+struct MetadataStats {
+	// Blocks that were read into the metadata cache.
+	uint64_t blocksRead = 0;
+	// Metadata blocks that were written back.
+	uint64_t blocksWritten = 0;
+	// Blocks that were part of a writeback but do not hold metadata.
+	uint64_t blocksSkipped = 0;
+};
+
 struct FileSystem {
 	FileSystem(BlockDevice *device);
 
 	async::result<void> init();
 
-	async::detached manageBlockBitmap(helix::UniqueDescriptor memory);
-	async::detached manageInodeBitmap(helix::UniqueDescriptor memory);
-	async::detached manageInodeTable(helix::UniqueDescriptor memory);
+	// Like device->readSectors() but marks the request as metadata for the I/O scheduler.
+	async::result<void> readMetadata(uint64_t sector, void *buffer, size_t num_sectors);
+
+	// Locks [offset, offset + length) of the metadata cache (the range is extended to pages).
+	async::result<helix::UniqueDescriptor> lockMetadata(uint64_t offset, size_t length);
+	// Locks and maps num_blocks metadata blocks starting at block.
+	async::result<MetadataView> accessMetadata(uint64_t block, size_t num_blocks = 1);
+	// Marks the blocks of the view as modified; manageMetadata() writes them back later.
+	async::result<void> dirtyMetadata(MetadataView &view);
+	// Writes the blocks of the view to disk immediately.
+	async::result<void> writeMetadata(MetadataView &view);
+	// Returns true for blocks that always hold metadata (BGDT, bitmaps and inode tables).
+	bool isStaticMetadata(uint64_t block);
+	async::detached manageMetadata(helix::UniqueDescriptor memory);
+
+	// Offset of the inode within the metadata cache (i.e., on disk).
+	uint64_t inodeAddress(uint32_t number);
 
 	std::shared_ptr<Inode> accessRoot();
 	std::shared_ptr<Inode> accessInode(uint32_t number);
+
+	// Moves the inode to the front of the inode cache.
+	void touchInode(std::shared_ptr<Inode> inode);
+	// Evicts the least recently used inodes until the cache fits into limit.
+	void trimInodeCache(size_t limit);
+	async::detached watchMemoryPressure();
 	async::result<std::shared_ptr<Inode>> createRegular();
 	async::result<std::shared_ptr<Inode>> createDirectory();
 	async::result<std::shared_ptr<Inode>> createSymlink();
 
 	async::result<void> write(Inode *inode, uint64_t offset,
 			const void *buffer, size_t length);
+	// Grows the file (but never shrinks it) such that it covers [0, end).
+	async::result<void> extend(Inode *inode, uint64_t end);
 
 	async::detached initiateInode(std::shared_ptr<Inode> inode);
 	async::detached manageFileData(std::shared_ptr<Inode> inode);
-	async::detached manageIndirect(std::shared_ptr<Inode> inode, int order,
-			helix::UniqueDescriptor memory);
 
-	async::result<uint32_t> allocateBlock();
+	struct BlockRun {
+		uint32_t first;
+		uint32_t count;
+		// Number of blocks after the run that were reserved (but not allocated).
+		uint32_t reserved;
+	};
+
+	// Allocates up to count contiguous blocks, if possible at (or after) goal.
+	// Additionally reserves up to reserve blocks after the run.
+	// Returns a run with count == 0 if the file system is full.
+	async::result<BlockRun> allocateBlocks(uint32_t goal, uint32_t count, uint32_t reserve = 0);
+	// Allocates blocks that were previously reserved by allocateBlocks().
+	async::result<void> claimBlocks(uint32_t first, uint32_t count);
+	// Returns reserved blocks to the free extent cache.
+	void releaseBlocks(uint32_t first, uint32_t count);
+	// Frees allocated blocks (i.e., the inverse of allocateBlocks()).
+	async::result<void> freeBlocks(uint32_t first, uint32_t count);
+
+	// Allocates a single block. If possible, the block is allocated at (or after) goal.
+	async::result<uint32_t> allocateBlock(uint32_t goal = 0);
 	async::result<uint32_t> allocateInode();
 
+	// Allocates up to count data blocks of inode at goal, using (or refilling)
+	// the inode's preallocation window.
+	async::result<BlockRun> allocateDataBlocks(Inode *inode, uint32_t goal, uint32_t count);
+
 	async::result<void> assignDataBlocks(Inode *inode,
 			uint64_t block_offset, size_t num_blocks);
+	// assignDataBlocks() for inodes that use an extent tree.
+	async::result<void> assignExtentBlocks(Inode *inode,
+			uint64_t block_offset, size_t num_blocks);
+
+	// Reads the extent tree (rooted at node) into inode->extents.
+	async::result<void> readExtentNode(Inode *inode, const std::byte *node);
+	// Rebuilds the on-disk extent tree (of any depth) from inode->extents.
+	async::result<void> writeExtentTree(Inode *inode);
 
 	async::result<void> readDataBlocks(std::shared_ptr<Inode> inode, uint64_t block_offset,
 			size_t num_blocks, void *buffer);
@@ -277,27 +490,79 @@ struct FileSystem {
 
 	async::result<void> truncate(Inode *inode, size_t size);
 
+	// Writes all dirtyRanges of the inode to disk and completes their writeback.
+	async::result<void> flushInode(std::shared_ptr<Inode> inode);
+	// Writes back dirty ranges that are older than dirtyExpire (or all of them
+	// if there are too many or under memory pressure).
+	async::detached flushDirtyInodes();
+	// Makes the inode's data (and unless data_only is true, also its metadata) durable.
+	async::result<void> fsync(std::shared_ptr<Inode> inode, bool data_only);
+	// Writes the sector(s) of the inode table that contain the inode to disk.
+	async::result<void> writeInodeSectors(Inode *inode);
+
 	async::result<void> writebackBgdt();
 
 	BlockDevice *device;
 	uint16_t inodeSize;
 	uint32_t blockShift;
 	uint32_t blockSize;
-	uint32_t blockPagesShift;
 	uint32_t sectorsPerBlock;
 	uint32_t numBlockGroups;
 	uint32_t blocksPerGroup;
 	uint32_t inodesPerGroup;
 	uint32_t blocksCount;
 	uint32_t inodesCount;
-	std::vector<std::byte> blockGroupDescriptorBuffer;
+	// Parameters of the directory hash (for htree lookups).
+	uint32_t hashSeed[4];
+	bool unsignedHash;
+	// true if new inodes use extent trees.
+	bool useExtents;
+	// The BGDT stays locked in the metadata cache.
+	MetadataView bgdtView;
 	DiskGroupDesc *bgdt;
 
-	helix::UniqueDescriptor blockBitmap;
-	helix::UniqueDescriptor inodeBitmap;
-	helix::UniqueDescriptor inodeTable;
+	// Run of free blocks within a block group (in bits of the group's bitmap).
+	struct FreeExtent {
+		uint32_t start;
+		uint32_t length;
+	};
+
+	// Free extents of each block group, sorted by start. Built from the bitmap when
+	// the group is first allocated from. Since we never free blocks, the cache stays exact.
+	std::vector<std::optional<std::vector<FreeExtent>>> freeBlockExtents;
+	// For each block group, all inodes below this bit are known to be allocated.
+	std::vector<uint32_t> inodeSearchStart;
+	// Group that the last inode was allocated from.
+	uint32_t inodeSearchGroup = 0;
+
+	// Managed memory that caches all metadata blocks. It covers the whole file system
+	// such that offsets in the cache are offsets on disk. Data blocks are never
+	// accessed through the cache; pages that are shared with data blocks are
+	// written back partially.
+	helix::UniqueDescriptor metadataCache;
+	// Sorted runs (first block and count) of static metadata.
+	std::vector<std::pair<uint64_t, uint64_t>> staticMetadata;
+	// Other metadata blocks (i.e., indirect blocks and extent tree nodes)
+	// that were modified since they were last written back.
+	std::unordered_set<uint64_t> dirtyMetadataBlocks;
+	MetadataStats metadataStats;
 
 	std::unordered_map<uint32_t, std::weak_ptr<Inode>> activeInodes;
+
+	// Strong references to recently used inodes (most recently used first). This keeps
+	// inodes that are repeatedly opened by short-lived processes alive.
+	std::list<std::shared_ptr<Inode>> inodeCache;
+	// Estimated memory used by the cached inodes.
+	size_t inodeCacheSize = 0;
+	// Current budget of the inode cache; reduced under memory pressure.
+	size_t inodeCacheLimit;
+
+	// Inodes with dirty ranges, in the order in which they became dirty.
+	std::list<std::shared_ptr<Inode>> dirtyInodes;
+	// Sum of the lengths of all dirty ranges.
+	size_t dirtyBytes = 0;
+	// Last memory pressure level reported by the kernel.
+	int memoryPressure = kHelMemoryPressureNone;
 };
 
 // --------------------------------------------------------
@@ -308,10 +573,12 @@ struct OpenFile {
 	OpenFile(std::shared_ptr<Inode> inode);
 
 	async::result<std::optional<std::string>> readEntries();
+	// Fills buffer with protocols::fs::DirentRecords. Returns the number of bytes used.
+	async::result<size_t> readEntriesBatch(void *buffer, size_t size, bool with_stats);
 
 	std::shared_ptr<Inode> inode;
 	uint64_t offset;
-	Flock flock;
+	protocols::fs::FileLockHolder lockHolder;
 };
 
 } } // namespace blockfs::ext2fs
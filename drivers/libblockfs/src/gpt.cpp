@@ -66,7 +66,9 @@ Partition &Table::getPartition(int index) {
 Partition::Partition(Table &table, Guid id, Guid type,
 		uint64_t start_lba, uint64_t num_sectors)
 : BlockDevice(table.getDevice()->sectorSize, table.getDevice()->parentId), _table(table),
-	_id(id), _type(type), _startLba(start_lba), _numSectors(num_sectors) { }
+	_id(id), _type(type), _startLba(start_lba), _numSectors(num_sectors) {
+	limits = table.getDevice()->limits;
+}
 
 Guid Partition::type() {
 	return _type;
@@ -84,6 +86,15 @@ async::result<void> Partition::writeSectors(uint64_t sector, const void *buffer,
 			buffer, count);
 }
 
+async::result<void> Partition::submit(const BlockRequest &request) {
+	auto forwarded = request;
+	if(request.op != BlockOp::flush) {
+		assert(request.sector + request.numSectors <= _numSectors);
+		forwarded.sector += _startLba;
+	}
+	co_await _table.getDevice()->submit(forwarded);
+}
+
 async::result<size_t> Partition::getSize() {
 	co_return _numSectors * sectorSize;
 }
@@ -0,0 +1,555 @@
+#include <assert.h>
+#include <algorithm>
+#include <iostream>
+
+#include <helix/timer.hpp>
+#include <protocols/ostrace/ostrace.hpp>
+
+#include "iosched.hpp"
+
+namespace blockfs {
+
+extern protocols::ostrace::Context ostContext;
+
+namespace iosched {
+
+namespace {
+
+constexpr bool logScheduling = false;
+
+// Maximal time that reads and writes wait in the deadline policy.
+constexpr uint64_t readExpiry = 50'000'000;
+constexpr uint64_t writeExpiry = 500'000'000;
+// Number of commands in a row that the deadline policy issues in one direction.
+constexpr unsigned int fifoBatch = 16;
+// Number of read batches that the deadline policy issues before it serves writes.
+constexpr unsigned int writesStarved = 2;
+
+// Budget of the bfq-lite policy per unit of weight.
+constexpr int64_t budgetBytes = 256 * 1024;
+
+// Time that we wait for more writes before we dispatch writes to an idle device.
+constexpr uint64_t plugDelay = 100'000;
+
+// Devices with at least this queue depth use no reordering by default.
+constexpr size_t deepQueue = 16;
+
+constexpr int classIndex(IoClass c) {
+	return static_cast<int>(c);
+}
+
+int64_t classWeight(int c) {
+	switch(static_cast<IoClass>(c)) {
+	case IoClass::meta: return 4;
+	case IoClass::sync: return 2;
+	default: return 1;
+	}
+}
+
+// Bucket 0 counts latencies below 1024 ns. Above, each power of two [2^e, 2^(e + 1))
+// is divided into four buckets. The last bucket also counts larger latencies.
+int latencyBucket(uint64_t ns) {
+	if(ns < 1024)
+		return 0;
+	int e = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (e - 2)) & 3;
+	return std::min((e - 10) * 4 + sub + 1, numLatencyBuckets - 1);
+}
+
+// Returns the upper bound of the bucket that contains the given quantile.
+uint64_t latencyQuantile(const uint64_t *histogram, double quantile) {
+	uint64_t total = 0;
+	for(int i = 0; i < numLatencyBuckets; i++)
+		total += histogram[i];
+	if(!total)
+		return 0;
+
+	auto target = std::max(uint64_t{1}, static_cast<uint64_t>(total * quantile));
+	uint64_t sum = 0;
+	for(int i = 0; i < numLatencyBuckets; i++) {
+		sum += histogram[i];
+		if(sum >= target)
+			return latencyBucketBound(i);
+	}
+	return latencyBucketBound(numLatencyBuckets - 1);
+}
+
+const char *policyName(IoPolicy policy) {
+	switch(policy) {
+	case IoPolicy::none: return "none";
+	case IoPolicy::deadline: return "deadline";
+	case IoPolicy::bfqLite: return "bfq-lite";
+	default: return "automatic";
+	}
+}
+
+// Maps operations to the groups of /proc/diskstats; Linux accounts write zeroes as writes.
+StatGroup statGroup(BlockOp op) {
+	switch(op) {
+	case BlockOp::read: return StatGroup::read;
+	case BlockOp::discard: return StatGroup::discard;
+	case BlockOp::flush: return StatGroup::flush;
+	default: return StatGroup::write;
+	}
+}
+
+} // anonymous namespace
+
+// Exclusive upper bound of the latencies in a bucket.
+uint64_t latencyBucketBound(int bucket) {
+	if(!bucket)
+		return 1024;
+	int e = (bucket - 1) / 4 + 10;
+	int sub = (bucket - 1) % 4;
+	return uint64_t(5 + sub) << (e - 2);
+}
+
+Queue::Queue(BlockDevice *device, IoPolicy policy)
+: BlockDevice{device->sectorSize, device->parentId}, device_{device}, policy_{policy} {
+	limits = device->limits;
+	size = device->size;
+
+	if(policy_ == IoPolicy::automatic)
+		policy_ = (limits.queueDepth >= deepQueue) ? IoPolicy::none : IoPolicy::deadline;
+}
+
+void Queue::run() {
+	std::cout << "libblockfs: Using I/O scheduler " << policyName(policy_)
+			<< " (queue depth " << limits.queueDepth << ")" << std::endl;
+	dispatch_();
+	reportStats_();
+}
+
+async::result<void> Queue::readSectors(uint64_t sector, void *buffer, size_t num_sectors) {
+	BlockSegment segment{buffer, num_sectors};
+	co_await submit({
+		.op = BlockOp::read,
+		.sector = sector,
+		.numSectors = num_sectors,
+		.segments = {&segment, 1}
+	});
+}
+
+async::result<void> Queue::writeSectors(uint64_t sector, const void *buffer, size_t num_sectors) {
+	BlockSegment segment{const_cast<void *>(buffer), num_sectors};
+	co_await submit({
+		.op = BlockOp::write,
+		.sector = sector,
+		.numSectors = num_sectors,
+		.segments = {&segment, 1}
+	});
+}
+
+async::result<void> Queue::submit(const BlockRequest &request) {
+	Pending pending;
+	pending.request = request;
+	if(request.op == BlockOp::read) {
+		pending.ioClass = (request.flags & kBlockMeta) ? IoClass::meta : IoClass::sync;
+	}else{
+		pending.ioClass = IoClass::async;
+	}
+	pending.arrival = helix::currentClock();
+	pending.expiry = pending.arrival
+			+ ((pending.ioClass == IoClass::async) ? writeExpiry : readExpiry);
+
+	stats_.numRequests++;
+	accountBusy_(pending.arrival);
+	stats_.inFlight++;
+	enqueue_(&pending);
+	wake_.raise();
+
+	co_await pending.done.wait();
+
+	auto now = helix::currentClock();
+	auto latency = now - pending.arrival;
+	accountBusy_(now);
+	stats_.inFlight--;
+	stats_.numCompleted++;
+	stats_.totalLatency += latency;
+	stats_.maxLatency = std::max(stats_.maxLatency, latency);
+	stats_.latencyHistogram[latencyBucket(latency)]++;
+
+	auto &group = stats_.groups[static_cast<int>(statGroup(request.op))];
+	group.numIos++;
+	group.ticks += latency;
+	if(request.op != BlockOp::flush)
+		group.numSectors += request.numSectors;
+
+	if(traceRequests_ && ostContext.isActive())
+		co_await traceRequest_(request, latency);
+
+	if(pending.error)
+		std::rethrow_exception(pending.error);
+}
+
+async::result<size_t> Queue::getSize() {
+	return device_->getSize();
+}
+
+const QueueStats &Queue::stats() {
+	accountBusy_(helix::currentClock());
+	return stats_;
+}
+
+void Queue::accountBusy_(uint64_t now) {
+	if(stats_.inFlight) {
+		stats_.ioTicks += now - lastAccount_;
+		stats_.timeInQueue += (now - lastAccount_) * stats_.inFlight;
+	}
+	lastAccount_ = now;
+}
+
+async::result<void> Queue::traceRequest_(const BlockRequest &request, uint64_t latency) {
+	protocols::ostrace::Event oste{&ostContext, ostRequestEvent_};
+	oste.withCounter(ostOpItem_, static_cast<int64_t>(request.op));
+	oste.withCounter(ostSectorItem_, request.sector);
+	oste.withCounter(ostNumSectorsItem_, request.numSectors);
+	oste.withCounter(ostLatencyItem_, latency);
+	co_await oste.emit();
+}
+
+void Queue::enqueue_(Pending *pending) {
+	auto &fifo = fifo_[classIndex(pending->ioClass)];
+	pending->fifoIt = fifo.insert(fifo.end(), pending);
+	if(mergeable_(pending)) {
+		pending->sortedIt = sorted_.emplace(pending->request.sector, pending);
+		pending->inSorted = true;
+	}
+	numPending_++;
+}
+
+void Queue::remove_(Pending *pending) {
+	fifo_[classIndex(pending->ioClass)].erase(pending->fifoIt);
+	if(pending->inSorted) {
+		sorted_.erase(pending->sortedIt);
+		pending->inSorted = false;
+	}
+	assert(numPending_);
+	numPending_--;
+}
+
+bool Queue::contiguous_(const Pending *before, const Pending *after) {
+	auto &last = before->request.segments.back();
+	auto &first = after->request.segments.front();
+	return static_cast<char *>(last.buffer) + last.numSectors * sectorSize == first.buffer;
+}
+
+// --------------------------------------------------------
+// Policies
+// --------------------------------------------------------
+
+Queue::Pending *Queue::choose_() {
+	assert(numPending_);
+
+	switch(policy_) {
+	case IoPolicy::deadline:
+		return chooseDeadline_();
+	case IoPolicy::bfqLite:
+		return chooseFair_();
+	default: {
+		// Serve the oldest request, regardless of its class.
+		Pending *oldest = nullptr;
+		for(auto &fifo : fifo_) {
+			if(fifo.empty())
+				continue;
+			if(!oldest || fifo.front()->arrival < oldest->arrival)
+				oldest = fifo.front();
+		}
+		return oldest;
+	}
+	}
+}
+
+Queue::Pending *Queue::chooseDeadline_() {
+	auto &meta = fifo_[classIndex(IoClass::meta)];
+	auto &sync = fifo_[classIndex(IoClass::sync)];
+	auto &writes = fifo_[classIndex(IoClass::async)];
+	bool have_reads = !meta.empty() || !sync.empty();
+	bool have_writes = !writes.empty();
+
+	// Start a new batch if the current one is complete or if it ran dry.
+	if(batchCount_ >= fifoBatch || (servingWrites_ ? !have_writes : !have_reads)) {
+		if(have_reads && (!have_writes || readBatches_ < writesStarved)) {
+			servingWrites_ = false;
+			readBatches_++;
+		}else{
+			servingWrites_ = true;
+			readBatches_ = 0;
+		}
+		batchCount_ = 0;
+	}
+	batchCount_++;
+
+	Pending *oldest;
+	if(servingWrites_) {
+		oldest = writes.front();
+	}else if(meta.empty() || (!sync.empty() && sync.front()->arrival < meta.front()->arrival)) {
+		oldest = sync.front();
+	}else{
+		oldest = meta.front();
+	}
+
+	if(oldest->expiry <= helix::currentClock()) {
+		stats_.numExpired++;
+		return oldest;
+	}
+
+	// Continue the elevator: pick the next request in the direction that we serve.
+	auto matches = [&] (Pending *pending) {
+		return (pending->ioClass == IoClass::async) == servingWrites_;
+	};
+	for(auto it = sorted_.lower_bound(headSector_); it != sorted_.end(); ++it)
+		if(matches(it->second))
+			return it->second;
+	for(auto it = sorted_.begin(); it != sorted_.end() && it->first < headSector_; ++it)
+		if(matches(it->second))
+			return it->second;
+	return oldest;
+}
+
+Queue::Pending *Queue::chooseFair_() {
+	constexpr int numClasses = classIndex(IoClass::count);
+	auto meta = classIndex(IoClass::meta);
+
+	// Metadata reads are small and usually block a process; do not make them
+	// wait until a large sequential stream has exhausted its budget.
+	if(!fifo_[meta].empty() && budgets_[meta] > 0)
+		activeClass_ = meta;
+
+	auto findNext = [&] () -> bool {
+		for(int i = 0; i < numClasses; ++i) {
+			auto c = (activeClass_ + i) % numClasses;
+			if(fifo_[c].empty() || budgets_[c] <= 0)
+				continue;
+			activeClass_ = c;
+			return true;
+		}
+		return false;
+	};
+
+	if(!findNext()) {
+		// All classes with pending requests have exhausted their budgets; start a new round.
+		for(int c = 0; c < numClasses; ++c)
+			budgets_[c] = classWeight(c) * budgetBytes;
+		[[maybe_unused]] bool found = findNext();
+		assert(found);
+	}
+	return fifo_[activeClass_].front();
+}
+
+// --------------------------------------------------------
+// Dispatching
+// --------------------------------------------------------
+
+std::vector<Queue::Pending *> Queue::formBatch_(Pending *first) {
+	std::vector<Pending *> batch{first};
+	remove_(first);
+	if(!mergeable_(first))
+		return batch;
+
+	auto num_sectors = first->request.numSectors;
+	auto num_segments = first->request.segments.size();
+
+	// Number of segments that next adds if it is merged between before and after.
+	auto addedSegments = [&] (const Pending *before, const Pending *after, const Pending *next) {
+		return next->request.segments.size() - (contiguous_(before, after) ? 1 : 0);
+	};
+	auto fits = [&] (const Pending *before, const Pending *after, const Pending *next) {
+		return compatible_(first, next)
+				&& num_sectors + next->request.numSectors <= limits.maxSectors
+				&& num_segments + addedSegments(before, after, next) <= limits.maxSegments;
+	};
+
+	// Back merges: requests that start where the batch ends.
+	while(true) {
+		auto back = batch.back();
+		auto range = sorted_.equal_range(back->request.sector + back->request.numSectors);
+		auto it = std::find_if(range.first, range.second, [&] (auto &entry) {
+			return mergeable_(entry.second) && fits(back, entry.second, entry.second);
+		});
+		if(it == range.second)
+			break;
+
+		auto next = it->second;
+		num_segments += addedSegments(back, next, next);
+		num_sectors += next->request.numSectors;
+		remove_(next);
+		batch.push_back(next);
+	}
+
+	// Front merges: requests that end where the batch starts.
+	while(true) {
+		auto front = batch.front();
+		Pending *next = nullptr;
+		// Only look at a few predecessors; the sectors of overlapping requests
+		// are not a useful upper bound.
+		auto it = sorted_.lower_bound(front->request.sector);
+		for(int i = 0; i < 8 && it != sorted_.begin(); ++i) {
+			--it;
+			auto candidate = it->second;
+			if(candidate->request.sector + candidate->request.numSectors == front->request.sector
+					&& fits(candidate, front, candidate)) {
+				next = candidate;
+				break;
+			}
+		}
+		if(!next)
+			break;
+
+		num_segments += addedSegments(next, front, next);
+		num_sectors += next->request.numSectors;
+		remove_(next);
+		batch.insert(batch.begin(), next);
+	}
+
+	headSector_ = batch.back()->request.sector + batch.back()->request.numSectors;
+	return batch;
+}
+
+async::detached Queue::dispatch_() {
+	while(true) {
+		if(!numPending_ || inFlight_ >= limits.queueDepth) {
+			co_await wake_.async_wait();
+			continue;
+		}
+
+		// Writeback tends to arrive in bursts of small requests. If the device is idle
+		// and only writes are pending, wait briefly such that we can merge them.
+		if(!inFlight_ && !plugged_
+				&& fifo_[classIndex(IoClass::meta)].empty()
+				&& fifo_[classIndex(IoClass::sync)].empty()) {
+			auto front = fifo_[classIndex(IoClass::async)].front();
+			if(front->request.op == BlockOp::write && !(front->request.flags & kBlockFua)) {
+				plugged_ = true;
+				stats_.numPlugs++;
+				co_await helix::sleepFor(plugDelay);
+				continue;
+			}
+		}
+
+		auto batch = formBatch_(choose_());
+		if(policy_ == IoPolicy::bfqLite) {
+			int64_t cost = 0;
+			for(auto pending : batch)
+				cost += pending->request.numSectors * sectorSize;
+			budgets_[activeClass_] -= std::max(cost, static_cast<int64_t>(sectorSize));
+		}
+
+		if(logScheduling)
+			std::cout << "libblockfs: Dispatching " << batch.size() << " requests at sector "
+					<< batch.front()->request.sector << std::endl;
+		issue_(std::move(batch));
+	}
+}
+
+async::detached Queue::issue_(std::vector<Pending *> batch) {
+	inFlight_++;
+	plugged_ = false;
+	stats_.numDispatched++;
+	stats_.maxInFlight = std::max(stats_.maxInFlight, inFlight_);
+
+	BlockRequest merged;
+	std::vector<BlockSegment> segments;
+	if(batch.size() == 1) {
+		merged = batch.front()->request;
+	}else{
+		auto front = batch.front();
+		merged.op = front->request.op;
+		merged.flags = front->request.flags;
+		merged.sector = front->request.sector;
+		for(auto pending : batch) {
+			for(auto &segment : pending->request.segments) {
+				if(!segments.empty() && static_cast<char *>(segments.back().buffer)
+						+ segments.back().numSectors * sectorSize == segment.buffer) {
+					segments.back().numSectors += segment.numSectors;
+				}else{
+					segments.push_back(segment);
+				}
+			}
+			merged.numSectors += pending->request.numSectors;
+		}
+		merged.segments = segments;
+		stats_.numMerged += batch.size() - 1;
+		stats_.groups[static_cast<int>(statGroup(merged.op))].numMerged += batch.size() - 1;
+	}
+
+	if(merged.op == BlockOp::read) {
+		stats_.sectorsRead += merged.numSectors;
+	}else if(merged.op == BlockOp::write) {
+		stats_.sectorsWritten += merged.numSectors;
+	}
+
+	std::exception_ptr error;
+	try {
+		co_await device_->submit(merged);
+	}catch(...) {
+		error = std::current_exception();
+	}
+
+	// Raising the event can destruct the Pending, so do not touch it afterwards.
+	for(auto pending : batch) {
+		pending->error = error;
+		pending->done.raise();
+	}
+
+	inFlight_--;
+	wake_.raise();
+}
+
+async::detached Queue::reportStats_() {
+	auto event_id = co_await ostContext.announceEvent("libblockfs.queue");
+	auto requests_item = co_await ostContext.announceItem("numRequests");
+	auto merged_item = co_await ostContext.announceItem("numMerged");
+	auto dispatched_item = co_await ostContext.announceItem("numDispatched");
+	auto plugs_item = co_await ostContext.announceItem("numPlugs");
+	auto expired_item = co_await ostContext.announceItem("numExpired");
+	auto read_item = co_await ostContext.announceItem("sectorsRead");
+	auto written_item = co_await ostContext.announceItem("sectorsWritten");
+	auto latency_item = co_await ostContext.announceItem("avgLatency");
+	auto max_latency_item = co_await ostContext.announceItem("maxLatency");
+	auto in_flight_item = co_await ostContext.announceItem("maxInFlight");
+	auto p50_item = co_await ostContext.announceItem("p50Latency");
+	auto p99_item = co_await ostContext.announceItem("p99Latency");
+	auto p999_item = co_await ostContext.announceItem("p999Latency");
+
+	ostRequestEvent_ = co_await ostContext.announceEvent("libblockfs.request");
+	ostOpItem_ = co_await ostContext.announceItem("op");
+	ostSectorItem_ = co_await ostContext.announceItem("sector");
+	ostNumSectorsItem_ = co_await ostContext.announceItem("numSectors");
+	ostLatencyItem_ = co_await ostContext.announceItem("latency");
+	traceRequests_ = true;
+
+	// The percentiles only cover the requests that completed since the last report.
+	uint64_t last_histogram[numLatencyBuckets] = {};
+
+	while(true) {
+		co_await helix::sleepFor(1'000'000'000);
+		if(!ostContext.isActive())
+			continue;
+
+		uint64_t interval[numLatencyBuckets];
+		for(int i = 0; i < numLatencyBuckets; i++) {
+			interval[i] = stats_.latencyHistogram[i] - last_histogram[i];
+			last_histogram[i] = stats_.latencyHistogram[i];
+		}
+
+		auto completed = stats_.numCompleted;
+		protocols::ostrace::Event oste{&ostContext, event_id};
+		oste.withCounter(requests_item, stats_.numRequests);
+		oste.withCounter(merged_item, stats_.numMerged);
+		oste.withCounter(dispatched_item, stats_.numDispatched);
+		oste.withCounter(plugs_item, stats_.numPlugs);
+		oste.withCounter(expired_item, stats_.numExpired);
+		oste.withCounter(read_item, stats_.sectorsRead);
+		oste.withCounter(written_item, stats_.sectorsWritten);
+		oste.withCounter(latency_item, completed ? stats_.totalLatency / completed : 0);
+		oste.withCounter(max_latency_item, stats_.maxLatency);
+		oste.withCounter(in_flight_item, stats_.maxInFlight);
+		oste.withCounter(p50_item, latencyQuantile(interval, 0.5));
+		oste.withCounter(p99_item, latencyQuantile(interval, 0.99));
+		oste.withCounter(p999_item, latencyQuantile(interval, 0.999));
+		co_await oste.emit();
+	}
+}
+
+} } // namespace blockfs::iosched
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <exception>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <async/oneshot-event.hpp>
+#include <async/recurring-event.hpp>
+#include <async/result.hpp>
+#include <blockfs.hpp>
+#include <protocols/ostrace/ostrace.hpp>
+
+namespace blockfs {
+namespace iosched {
+
+// Requests are grouped into classes. Policies that distinguish classes
+// prefer metadata reads over other reads and reads over writes.
+enum class IoClass {
+	meta,
+	sync,
+	async,
+	count
+};
+
+// The latency histogram has four buckets per power of two; see latencyBucket().
+constexpr int numLatencyBuckets = 121;
+
+// Upper bound (in ns) of the latencies that are counted by a histogram bucket.
+uint64_t latencyBucketBound(int bucket);
+
+// Operations are accounted in the groups of Linux' /proc/diskstats.
+enum class StatGroup {
+	read,
+	write,
+	discard,
+	flush,
+	count
+};
+
+struct GroupStats {
+	// Number of completed requests.
+	uint64_t numIos = 0;
+	uint64_t numMerged = 0;
+	uint64_t numSectors = 0;
+	// Sum of the request latencies in ns.
+	uint64_t ticks = 0;
+};
+
+struct QueueStats {
+	// Number of requests received from the file system.
+	uint64_t numRequests = 0;
+	// Number of requests that were merged into other requests.
+	uint64_t numMerged = 0;
+	uint64_t numCompleted = 0;
+	// Number of commands that were sent to the device.
+	uint64_t numDispatched = 0;
+	// Number of times that the queue waited for more requests.
+	uint64_t numPlugs = 0;
+	// Number of requests that the deadline policy served because they expired.
+	uint64_t numExpired = 0;
+
+	uint64_t sectorsRead = 0;
+	uint64_t sectorsWritten = 0;
+
+	// Sum and maximum of the request latencies (from submission to completion) in ns.
+	uint64_t totalLatency = 0;
+	uint64_t maxLatency = 0;
+	uint64_t latencyHistogram[numLatencyBuckets] = {};
+
+	size_t maxInFlight = 0;
+
+	GroupStats groups[static_cast<int>(StatGroup::count)];
+	// Number of requests that were submitted but did not complete yet.
+	size_t inFlight = 0;
+	// Time (in ns) during which at least one request was in flight.
+	uint64_t ioTicks = 0;
+	// Sum of the in-flight times of all requests (in ns).
+	uint64_t timeInQueue = 0;
+};
+
+// Block layer stage between the file system and the device driver.
+// The queue merges adjacent requests, delays small bursts of writes
+// and decides in which order requests are sent to the device.
+struct Queue final : BlockDevice {
+	Queue(BlockDevice *device, IoPolicy policy);
+
+	Queue(const Queue &) = delete;
+
+	Queue &operator= (const Queue &) = delete;
+
+	async::result<void> readSectors(uint64_t sector, void *buffer,
+			size_t num_sectors) override;
+
+	async::result<void> writeSectors(uint64_t sector, const void *buffer,
+			size_t num_sectors) override;
+
+	async::result<void> submit(const BlockRequest &request) override;
+
+	async::result<size_t> getSize() override;
+
+	IoPolicy policy() {
+		return policy_;
+	}
+
+	// Brings the busy times up to date before returning the statistics.
+	const QueueStats &stats();
+
+	// Starts the dispatcher and the statistics reporter.
+	void run();
+
+private:
+	struct Pending {
+		// The segments are owned by the caller of submit().
+		BlockRequest request;
+		IoClass ioClass;
+		uint64_t arrival;
+		uint64_t expiry;
+
+		std::list<Pending *>::iterator fifoIt;
+		std::multimap<uint64_t, Pending *>::iterator sortedIt;
+		bool inSorted = false;
+
+		async::oneshot_event done;
+		std::exception_ptr error;
+	};
+
+	static bool mergeable_(const Pending *pending) {
+		return (pending->request.op == BlockOp::read || pending->request.op == BlockOp::write)
+				&& pending->request.numSectors;
+	}
+
+	static bool compatible_(const Pending *a, const Pending *b) {
+		return a->request.op == b->request.op && a->request.flags == b->request.flags;
+	}
+
+	// Whether the buffers of two adjacent requests can be joined into a single segment.
+	bool contiguous_(const Pending *before, const Pending *after);
+
+	void enqueue_(Pending *pending);
+	void remove_(Pending *pending);
+
+	Pending *choose_();
+	Pending *chooseDeadline_();
+	Pending *chooseFair_();
+
+	std::vector<Pending *> formBatch_(Pending *first);
+
+	async::detached dispatch_();
+	async::detached issue_(std::vector<Pending *> batch);
+	async::detached reportStats_();
+
+	// Accounts the time since the last change of the number of in-flight requests.
+	void accountBusy_(uint64_t now);
+	async::result<void> traceRequest_(const BlockRequest &request, uint64_t latency);
+
+	BlockDevice *device_;
+	IoPolicy policy_;
+
+	// Requests in the order of arrival, per class.
+	std::list<Pending *> fifo_[static_cast<int>(IoClass::count)];
+	// Reads and writes sorted by their start sector.
+	std::multimap<uint64_t, Pending *> sorted_;
+	size_t numPending_ = 0;
+
+	async::recurring_event wake_;
+	size_t inFlight_ = 0;
+	// Whether we already waited for more requests since the device became idle.
+	bool plugged_ = false;
+
+	// State of the deadline policy.
+	uint64_t headSector_ = 0;
+	bool servingWrites_ = false;
+	unsigned int batchCount_ = 0;
+	unsigned int readBatches_ = 0;
+
+	// State of the bfq-lite policy.
+	int activeClass_ = 0;
+	// Remaining budgets in bytes in the current round.
+	int64_t budgets_[static_cast<int>(IoClass::count)] = {};
+
+	QueueStats stats_;
+	uint64_t lastAccount_ = 0;
+
+	// Per-request tracing is only enabled once the event is announced.
+	bool traceRequests_ = false;
+	protocols::ostrace::EventId ostRequestEvent_;
+	protocols::ostrace::ItemId ostOpItem_;
+	protocols::ostrace::ItemId ostSectorItem_;
+	protocols::ostrace::ItemId ostNumSectorsItem_;
+	protocols::ostrace::ItemId ostLatencyItem_;
+};
+
+} } // namespace blockfs::iosched
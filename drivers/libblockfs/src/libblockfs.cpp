@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <iostream>
 #include <algorithm>
@@ -14,6 +15,7 @@
 #include <blockfs.hpp>
 #include "gpt.hpp"
 #include "ext2fs.hpp"
+#include "iosched.hpp"
 #include "raw.hpp"
 #include "fs.bragi.hpp"
 #include <bragi/helpers-std.hpp>
@@ -21,6 +23,7 @@
 namespace blockfs {
 
 // TODO: Support more than one table.
+iosched::Queue *queue;
 gpt::Table *table;
 ext2fs::FileSystem *fs;
 raw::RawFs *rawFs;
@@ -51,18 +54,25 @@ async::result<protocols::fs::SeekResult> seekEof(void *object, int64_t offset) {
 	co_return static_cast<ssize_t>(self->offset);
 }
 
-using FlockManager = protocols::fs::FlockManager;
-using Flock = protocols::fs::Flock;
-
 async::result<protocols::fs::Error> flock(void *object, int flags) {
 	auto self = static_cast<ext2fs::OpenFile *>(object);
 	co_await self->inode->readyJump.wait();
 	auto inode = self->inode;
 
-	auto result = co_await inode->flockManager.lock(&self->flock, flags);
+	auto result = co_await inode->fileLocks.flock(&self->lockHolder, flags);
 	co_return result;
 }
 
+async::result<frg::expected<protocols::fs::Error, protocols::fs::RangeLock>>
+lockRange(void *object, protocols::fs::RangeLockCommand command, bool ofd,
+		protocols::fs::RangeLock lock) {
+	auto self = static_cast<ext2fs::OpenFile *>(object);
+	co_await self->inode->readyJump.wait();
+	auto inode = self->inode;
+
+	co_return co_await inode->fileLocks.lockRange(&self->lockHolder, command, ofd, lock);
+}
+
 async::result<protocols::fs::ReadResult> read(void *object, const char *,
 		void *buffer, size_t length) {
 	if (!length)
@@ -129,7 +139,7 @@ async::result<protocols::fs::ReadResult> pread(void *object, int64_t offset, con
 	auto self = static_cast<ext2fs::OpenFile *>(object);
 	co_await self->inode->readyJump.wait();
 
-	if(self->offset >= self->inode->fileSize())
+	if(static_cast<uint64_t>(offset) >= self->inode->fileSize())
 		co_return size_t{0};
 
 	auto remaining = self->inode->fileSize() - offset;
@@ -167,6 +177,33 @@ async::result<frg::expected<protocols::fs::Error, size_t>> write(void *object, c
 	co_return length;
 }
 
+async::result<frg::expected<protocols::fs::Error, size_t>> pwrite(void *object, int64_t offset,
+		const char *, const void *buffer, size_t length) {
+	assert(length);
+
+	auto self = static_cast<ext2fs::OpenFile *>(object);
+	co_await self->inode->fs.write(self->inode.get(), offset, buffer, length);
+	co_return length;
+}
+
+async::result<frg::expected<protocols::fs::Error, protocols::fs::AdvanceResult>>
+advance(void *object, size_t length, bool write) {
+	auto self = static_cast<ext2fs::OpenFile *>(object);
+	co_await self->inode->readyJump.wait();
+
+	auto offset = self->offset;
+	if(write) {
+		co_await self->inode->fs.extend(self->inode.get(), offset + length);
+	}else{
+		if(offset >= self->inode->fileSize())
+			co_return protocols::fs::AdvanceResult{static_cast<int64_t>(offset), 0};
+		length = std::min(length, static_cast<size_t>(self->inode->fileSize() - offset));
+	}
+
+	self->offset += length;
+	co_return protocols::fs::AdvanceResult{static_cast<int64_t>(offset), length};
+}
+
 async::result<helix::BorrowedDescriptor>
 accessMemory(void *object) {
 	auto self = static_cast<ext2fs::OpenFile *>(object);
@@ -184,6 +221,20 @@ readEntries(void *object) {
 	co_return co_await self->readEntries();
 }
 
+async::result<frg::expected<protocols::fs::Error, protocols::fs::ReadEntriesBatchResult>>
+readEntriesBatch(void *object, void *buffer, size_t size, bool with_stats) {
+	auto self = static_cast<ext2fs::OpenFile *>(object);
+	co_await self->inode->readyJump.wait();
+	if(self->inode->fileType != kTypeDirectory)
+		co_return protocols::fs::Error::notDirectory;
+
+	protocols::ostrace::Event oste{&ostContext, ostReaddirEvent};
+	co_await oste.emit();
+
+	auto length = co_await self->readEntriesBatch(buffer, size, with_stats);
+	co_return protocols::fs::ReadEntriesBatchResult{length, static_cast<int64_t>(self->offset)};
+}
+
 async::result<frg::expected<protocols::fs::Error>>
 truncate(void *object, size_t size) {
 	auto self = static_cast<ext2fs::OpenFile *>(object);
@@ -191,6 +242,13 @@ truncate(void *object, size_t size) {
 	co_return {};
 }
 
+async::result<frg::expected<protocols::fs::Error>>
+fsync(void *object, bool data_only) {
+	auto self = static_cast<ext2fs::OpenFile *>(object);
+	co_await self->inode->fs.fsync(self->inode, data_only);
+	co_return {};
+}
+
 async::result<int> getFileFlags(void *) {
 	std::cout << "libblockfs: getFileFlags is stubbed" << std::endl;
     co_return 0;
@@ -208,10 +266,15 @@ constexpr protocols::fs::FileOperations fileOperations {
 	.read         = &read,
 	.pread        = &pread,
 	.write        = &write,
+	.pwrite       = &pwrite,
 	.readEntries  = &readEntries,
+	.readEntriesBatch = &readEntriesBatch,
+	.advance      = &advance,
 	.accessMemory = &accessMemory,
 	.truncate     = &truncate,
 	.flock        = &flock,
+	.lockRange    = &lockRange,
+	.fsync        = &fsync,
 	.getFileFlags = &getFileFlags,
 	.setFileFlags = &setFileFlags,
 };
@@ -525,10 +588,18 @@ async::result<protocols::fs::ReadResult> rawRead(void *object, const char *,
 async::result<protocols::fs::Error> rawFlock(void *object, int flags) {
 	auto self = static_cast<raw::OpenFile*>(object);
 
-	auto result = co_await self->rawFs->flockManager.lock(&self->flock, flags);
+	auto result = co_await self->rawFs->fileLocks.flock(&self->lockHolder, flags);
 	co_return result;
 }
 
+async::result<frg::expected<protocols::fs::Error, protocols::fs::RangeLock>>
+rawLockRange(void *object, protocols::fs::RangeLockCommand command, bool ofd,
+		protocols::fs::RangeLock lock) {
+	auto self = static_cast<raw::OpenFile*>(object);
+
+	co_return co_await self->rawFs->fileLocks.lockRange(&self->lockHolder, command, ofd, lock);
+}
+
 async::result<protocols::fs::SeekResult> rawSeekAbs(void *object, int64_t offset) {
 	auto self = static_cast<raw::OpenFile*>(object);
 	self->offset = offset;
@@ -571,6 +642,7 @@ constexpr protocols::fs::FileOperations rawOperations {
 	.read = rawRead,
 	.ioctl = rawIoctl,
 	.flock = rawFlock,
+	.lockRange = rawLockRange,
 };
 
 } // anonymous namespace
@@ -578,6 +650,86 @@ constexpr protocols::fs::FileOperations rawOperations {
 BlockDevice::BlockDevice(size_t sector_size, int64_t parent_id)
 : size(0), sectorSize(sector_size), parentId(parent_id) { }
 
+async::result<void> BlockDevice::submit(const BlockRequest &request) {
+	auto sector = request.sector;
+	switch(request.op) {
+	case BlockOp::read:
+		for(auto &segment : request.segments) {
+			co_await readSectors(sector, segment.buffer, segment.numSectors);
+			sector += segment.numSectors;
+		}
+		break;
+	case BlockOp::write:
+		for(auto &segment : request.segments) {
+			co_await writeSectors(sector, segment.buffer, segment.numSectors);
+			sector += segment.numSectors;
+		}
+		break;
+	case BlockOp::flush:
+	case BlockOp::discard:
+		break;
+	case BlockOp::writeZeroes: {
+		constexpr size_t chunkSize = 0x10000;
+		std::unique_ptr<char, decltype(&free)> zeroes{
+				static_cast<char *>(aligned_alloc(0x1000, chunkSize)), &free};
+		memset(zeroes.get(), 0, chunkSize);
+		size_t progress = 0;
+		while(progress < request.numSectors) {
+			auto n = std::min(request.numSectors - progress, chunkSize / sectorSize);
+			co_await writeSectors(sector + progress, zeroes.get(), n);
+			progress += n;
+		}
+		break;
+	}
+	}
+}
+
+SplitRequest::SplitRequest(const BlockRequest &request, size_t sector_size,
+		const BlockLimits &limits) {
+	assert(request.op == BlockOp::read || request.op == BlockOp::write);
+	assert(limits.maxSegments && limits.maxSectors);
+
+	// First cut the segments, then create parts that refer to them
+	// (such that segments is not reallocated while we form the parts).
+	struct Part {
+		uint64_t sector;
+		size_t numSectors;
+		size_t firstSegment;
+		size_t numSegments;
+	};
+	std::vector<Part> cuts;
+	Part current{request.sector, 0, 0, 0};
+
+	for(auto &segment : request.segments) {
+		size_t progress = 0;
+		while(progress < segment.numSectors) {
+			auto n = std::min(segment.numSectors - progress, limits.maxSectors - current.numSectors);
+			segments.push_back({static_cast<char *>(segment.buffer) + progress * sector_size, n});
+			current.numSectors += n;
+			current.numSegments++;
+			progress += n;
+
+			if(current.numSegments == limits.maxSegments || current.numSectors == limits.maxSectors) {
+				cuts.push_back(current);
+				current = Part{current.sector + current.numSectors, 0, segments.size(), 0};
+			}
+		}
+	}
+	if(current.numSegments)
+		cuts.push_back(current);
+
+	for(auto &cut : cuts) {
+		BlockRequest part;
+		part.op = request.op;
+		part.flags = request.flags;
+		part.sector = cut.sector;
+		part.numSectors = cut.numSectors;
+		part.segments = std::span<const BlockSegment>{segments.data() + cut.firstSegment,
+				cut.numSegments};
+		parts.push_back(part);
+	}
+}
+
 async::detached servePartition(helix::UniqueLane lane) {
 	std::cout << "unix device: Connection" << std::endl;
 
@@ -730,6 +882,48 @@ async::detached servePartition(helix::UniqueLane lane) {
 			);
 			HEL_CHECK(send_resp.error());
 			HEL_CHECK(push_node.error());
+		}else if(req.req_type() == managarm::fs::CntReqType::DEV_GET_STATS) {
+			// Partitions share the queue of the disk; the statistics cover the whole disk.
+			auto &stats = queue->stats();
+			managarm::fs::SvrResponse resp;
+			auto toMs = [] (uint64_t ns) -> uint64_t {
+				return ns / 1'000'000;
+			};
+			auto group = [&] (iosched::StatGroup g) -> const iosched::GroupStats & {
+				return stats.groups[static_cast<int>(g)];
+			};
+
+			for(auto g : {iosched::StatGroup::read, iosched::StatGroup::write}) {
+				resp.add_block_stats(group(g).numIos);
+				resp.add_block_stats(group(g).numMerged);
+				resp.add_block_stats(group(g).numSectors);
+				resp.add_block_stats(toMs(group(g).ticks));
+			}
+			resp.add_block_stats(stats.inFlight);
+			resp.add_block_stats(toMs(stats.ioTicks));
+			resp.add_block_stats(toMs(stats.timeInQueue));
+			auto &discards = group(iosched::StatGroup::discard);
+			resp.add_block_stats(discards.numIos);
+			resp.add_block_stats(discards.numMerged);
+			resp.add_block_stats(discards.numSectors);
+			resp.add_block_stats(toMs(discards.ticks));
+			auto &flushes = group(iosched::StatGroup::flush);
+			resp.add_block_stats(flushes.numIos);
+			resp.add_block_stats(toMs(flushes.ticks));
+
+			for(int i = 0; i < iosched::numLatencyBuckets; i++) {
+				if(!stats.latencyHistogram[i])
+					continue;
+				resp.add_latency_histogram(iosched::latencyBucketBound(i));
+				resp.add_latency_histogram(stats.latencyHistogram[i]);
+			}
+
+			resp.set_error(managarm::fs::Errors::SUCCESS);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size()));
+			HEL_CHECK(send_resp.error());
 		}else{
 			throw std::runtime_error("Unexpected request type " + std::to_string((int)req.req_type()));
 		}
@@ -743,7 +937,12 @@ async::detached runDevice(BlockDevice *device) {
 	ostByteCounter = co_await ostContext.announceItem("numBytes");
 	ostTimeCounter = co_await ostContext.announceItem("time");
 
-	table = new gpt::Table(device);
+	// All I/O to the disk goes through the scheduler, such that requests
+	// of different partitions can be merged and ordered.
+	queue = new iosched::Queue(device, device->ioPolicy);
+	queue->run();
+
+	table = new gpt::Table(queue);
 	co_await table->parse();
 
 	int64_t diskId = 0;
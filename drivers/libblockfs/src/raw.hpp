@@ -8,9 +8,6 @@
 namespace blockfs {
 namespace raw {
 
-using FlockManager = protocols::fs::FlockManager;
-using Flock = protocols::fs::Flock;
-
 struct RawFs {
 	RawFs(BlockDevice *device);
 
@@ -22,7 +19,7 @@ struct RawFs {
 	HelHandle backingMemory;
 	HelHandle frontalMemory;
 	helix::Mapping fileMapping;
-	FlockManager flockManager;
+	protocols::fs::FileLockManager fileLocks;
 };
 
 struct OpenFile {
@@ -30,7 +27,7 @@ struct OpenFile {
 
 	RawFs *rawFs;
 	uint64_t offset;
-	Flock flock;
+	protocols::fs::FileLockHolder lockHolder;
 };
 
 } // namespace raw
@@ -7,6 +7,7 @@
 #include <async/recurring-event.hpp>
 #include <boost/intrusive/list.hpp>
 #include <helix/ipc.hpp>
+#include <helix/memory.hpp>
 #include <protocols/fs/server.hpp>
 #include <protocols/mbus/client.hpp>
 
@@ -31,6 +32,23 @@ struct PendingEvent {
 	struct timespec timestamp;
 };
 
+// Layout of the memory that mmap() returns for an event device. This allows clients
+// to consume input events without a read() per batch of events.
+// The header occupies the first page; it is followed by an array of capacity
+// input_event structs. The ring is written by the driver only: events are stored
+// at index (n % capacity) and head is advanced (with release semantics) after each
+// complete packet (i.e., up to and including the SYN_REPORT).
+// Clients remember the value of head that they consumed; after copying events out
+// of the ring, they must re-check that head did not advance by more than capacity
+// since then. Otherwise, events were overwritten (and the client should resync).
+struct EventRingHeader {
+	uint64_t head;
+	uint32_t capacity;
+	uint32_t reserved;
+	// Number of events that were dropped because the read() queue of a file overflowed.
+	uint64_t dropped;
+};
+
 // --------------------------------------------
 // EventDevice
 // --------------------------------------------
@@ -60,6 +78,9 @@ struct File {
 	ioctl(void *object, managarm::fs::CntRequest req,
 			helix::UniqueLane conversation);
 
+	static async::result<helix::BorrowedDescriptor>
+	accessMemory(void *object);
+
 	// ------------------------------------------------------------------------
 	// Public File API.
 	// ------------------------------------------------------------------------
@@ -107,7 +128,18 @@ public:
 
 	void notify();
 
+	// Number of events that were dropped since the queue of a file overflowed.
+	uint64_t droppedEvents() {
+		return _droppedEvents;
+	}
+
 private:
+	// Allocates the shared event ring on first use.
+	helix::BorrowedDescriptor _accessRing();
+
+	// Appends the staged events to the shared event ring (if it exists).
+	void _publishToRing(struct timespec timestamp);
+
 	// Supported event bits.
 	// The array sizes come from Linux' EV_CNT, KEY_CNT, REL_CNT etc. macros (divided by 8)
 	// and can be extended if more event constants are added.
@@ -130,6 +162,11 @@ private:
 	> _files;
 
 	std::vector<StagedEvent> _staged;
+
+	helix::UniqueDescriptor _ringMemory;
+	helix::Mapping _ringMapping;
+
+	uint64_t _droppedEvents = 0;
 };
 
 // --------------------------------------------
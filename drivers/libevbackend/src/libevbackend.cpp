@@ -55,7 +55,7 @@ async::detached issueReset() {
 			pmLane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -81,6 +81,24 @@ async::detached issueReset() {
 	throw std::runtime_error("Return from PM_RESET request");
 }
 
+// Maximal number of events that are queued per file before it overflows.
+constexpr size_t maxPendingEvents = 1024;
+
+// Size of the shared event ring, including the header page.
+constexpr size_t ringSize = 0x10000;
+constexpr size_t ringHeaderSize = 0x1000;
+
+input_event toInputEvent(int type, int code, int value, struct timespec timestamp) {
+	input_event uev;
+	memset(&uev, 0, sizeof(input_event));
+	uev.time.tv_sec = timestamp.tv_sec;
+	uev.time.tv_usec = timestamp.tv_nsec / 1000;
+	uev.type = type;
+	uev.code = code;
+	uev.value = value;
+	return uev;
+}
+
 } // anonymous namespace
 
 // ----------------------------------------------------------------------------
@@ -106,41 +124,41 @@ File::read(void *object, const char *, void *buffer, size_t max_size) {
 		if(clock_gettime(self->_clockId, &now))
 			throw std::runtime_error("clock_gettime() failed");
 
-		input_event uev;
-		memset(&uev, 0, sizeof(input_event));
-		uev.time.tv_sec = now.tv_sec;
-		uev.time.tv_usec = now.tv_nsec / 1000;
-		uev.type = EV_SYN;
-		uev.code = SYN_DROPPED;
+		auto uev = toInputEvent(EV_SYN, SYN_DROPPED, 0, now);
 		memcpy(reinterpret_cast<char *>(buffer), &uev, sizeof(input_event));
 
 		// Reset the overflow flag.
+		self->_device->_droppedEvents += self->_pending.size();
 		self->_pending.clear();
 		self->_overflow = false;
+		self->_statusPage.update(self->_currentSeq, 0);
 
 		co_return sizeof(input_event);
 	}else{
-		size_t written = 0;
-		while(!self->_pending.empty()
-				&& written + sizeof(input_event) <= max_size) {
-			auto evt = self->_pending.front();
-			self->_pending.pop_front();
-			if(self->_pending.empty())
-				self->_statusPage.update(self->_currentSeq, 0);
-
-			input_event uev;
-			memset(&uev, 0, sizeof(input_event));
-			uev.time.tv_sec = evt.timestamp.tv_sec;
-			uev.time.tv_usec = evt.timestamp.tv_nsec / 1000;
-			uev.type = evt.type;
-			uev.code = evt.code;
-			uev.value = evt.value;
-			memcpy(reinterpret_cast<char *>(buffer) + written, &uev, sizeof(input_event));
-			written += sizeof(input_event);
+		// Return as many events as possible but do not split packets,
+		// unless a single packet does not fit into the buffer.
+		auto limit = std::min(self->_pending.size(), max_size / sizeof(input_event));
+		size_t count = 0;
+		for(size_t i = 0; i < limit; i++) {
+			auto &evt = self->_pending[i];
+			if(evt.type == EV_SYN && evt.code == SYN_REPORT)
+				count = i + 1;
+		}
+		if(!count)
+			count = limit;
+
+		for(size_t i = 0; i < count; i++) {
+			auto &evt = self->_pending[i];
+			auto uev = toInputEvent(evt.type, evt.code, evt.value, evt.timestamp);
+			memcpy(reinterpret_cast<char *>(buffer) + i * sizeof(input_event),
+					&uev, sizeof(input_event));
 		}
+		self->_pending.erase(self->_pending.begin(), self->_pending.begin() + count);
+		if(self->_pending.empty())
+			self->_statusPage.update(self->_currentSeq, 0);
 
-		assert(written);
-		co_return written;
+		assert(count);
+		co_return count * sizeof(input_event);
 	}
 }
 
@@ -166,7 +184,7 @@ File::pollStatus(void *object) {
 
 	co_return protocols::fs::PollStatusResult{
 		self->_currentSeq,
-		self->_pending.empty() ? 0 : EPOLLIN
+		(self->_pending.empty() && !self->_overflow) ? 0 : EPOLLIN
 	};
 }
 
@@ -273,8 +291,15 @@ File::ioctl(void *object, managarm::fs::CntRequest req,
 }
 
 
+async::result<helix::BorrowedDescriptor>
+File::accessMemory(void *object) {
+	auto self = static_cast<File *>(object);
+	co_return self->_device->_accessRing();
+}
+
 constexpr auto fileOperations = protocols::fs::FileOperations{
 	.read = &File::read,
+	.accessMemory = &File::accessMemory,
 	.ioctl = &File::ioctl,
 	.pollWait = &File::pollWait,
 	.pollStatus = &File::pollStatus
@@ -422,20 +447,61 @@ void EventDevice::emitEvent(int type, int code, int value) {
 	_staged.push_back(StagedEvent{type, code, value});
 }
 
+helix::BorrowedDescriptor EventDevice::_accessRing() {
+	if(!_ringMemory) {
+		HelHandle handle;
+		HEL_CHECK(helAllocateMemory(ringSize, 0, nullptr, &handle));
+		_ringMemory = helix::UniqueDescriptor{handle};
+		_ringMapping = helix::Mapping{_ringMemory, 0, ringSize};
+
+		auto header = reinterpret_cast<EventRingHeader *>(_ringMapping.get());
+		header->capacity = (ringSize - ringHeaderSize) / sizeof(input_event);
+		__atomic_store_n(&header->dropped, _droppedEvents, __ATOMIC_RELAXED);
+	}
+	return _ringMemory;
+}
+
+void EventDevice::_publishToRing(struct timespec timestamp) {
+	if(!_ringMemory)
+		return;
+
+	auto header = reinterpret_cast<EventRingHeader *>(_ringMapping.get());
+	auto slots = reinterpret_cast<input_event *>(
+			reinterpret_cast<char *>(_ringMapping.get()) + ringHeaderSize);
+	auto head = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+	for(StagedEvent evt : _staged)
+		slots[head++ % header->capacity] = toInputEvent(evt.type, evt.code, evt.value, timestamp);
+	__atomic_store_n(&header->dropped, _droppedEvents, __ATOMIC_RELAXED);
+	__atomic_store_n(&header->head, head, __ATOMIC_RELEASE);
+}
+
 void EventDevice::notify() {
 	if(_staged.empty())
 		return;
 
+	struct timespec monotonic;
+	if(clock_gettime(CLOCK_MONOTONIC, &monotonic))
+		throw std::runtime_error("clock_gettime() failed");
+
 	for(auto &file : _files) {
-		if(file._overflow)
+		if(file._overflow) {
+			_droppedEvents += _staged.size();
 			continue;
+		}
 
-		struct timespec now;
-		if(clock_gettime(file._clockId, &now))
+		struct timespec now = monotonic;
+		if(file._clockId != CLOCK_MONOTONIC && clock_gettime(file._clockId, &now))
 			throw std::runtime_error("clock_gettime() failed");
 
-		if(file._pending.size() > 1024) {
+		if(file._pending.size() + _staged.size() > maxPendingEvents) {
+			if(logCodes)
+				std::cout << "drivers/libevbackend: Event queue of file overflowed" << std::endl;
+			_droppedEvents += _staged.size();
 			file._overflow = true;
+			// Wake up readers such that they see SYN_DROPPED.
+			file._currentSeq++;
+			file._statusPage.update(file._currentSeq, EPOLLIN);
+			file._statusBell.raise();
 			continue;
 		}
 
@@ -451,6 +517,8 @@ void EventDevice::notify() {
 		file._statusPage.update(file._currentSeq, EPOLLIN);
 		file._statusBell.raise();
 	}
+
+	_publishToRing(monotonic);
 	_staged.clear();
 }
 
@@ -4,5 +4,5 @@
 #include <core/virtio/core.hpp>
 
 namespace nic::virtio {
-std::shared_ptr<nic::Link> makeShared(std::unique_ptr<virtio_core::Transport>);
+async::result<std::shared_ptr<nic::Link>> makeShared(std::unique_ptr<virtio_core::Transport>);
 } // namespace nic::virtio
@@ -1,18 +1,36 @@
 #include <nic/virtio/virtio.hpp>
 
+#include <assert.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
 #include <arch/dma_pool.hpp>
+#include <async/recurring-event.hpp>
 #include <core/virtio/core.hpp>
+#include <fafnir/dsl.hpp>
+#include <protocols/kernlet/compiler.hpp>
 
 namespace {
 // Device feature bits.
 constexpr size_t legacyHeaderSize = 10;
 enum {
-	VIRTIO_NET_F_MAC = 5
+	VIRTIO_NET_F_CSUM = 0,
+	VIRTIO_NET_F_GUEST_CSUM = 1,
+	VIRTIO_NET_F_MAC = 5,
+	VIRTIO_NET_F_HOST_TSO4 = 11,
+	VIRTIO_NET_F_CTRL_VQ = 17,
+	VIRTIO_NET_F_MQ = 22
 };
 
 // Bits for VirtHeader::flags.
 enum {
-	VIRTIO_NET_HDR_F_NEEDS_CSUM = 1
+	VIRTIO_NET_HDR_F_NEEDS_CSUM = 1,
+	VIRTIO_NET_HDR_F_DATA_VALID = 2
 };
 
 // Values for VirtHeader::gsoType.
@@ -24,6 +42,28 @@ enum {
 	VIRTIO_NET_HDR_GSO_ECN = 0x80
 };
 
+// Classes and commands of the control virtq.
+enum {
+	VIRTIO_NET_OK = 0,
+	VIRTIO_NET_CTRL_MQ = 4,
+	VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET = 0
+};
+
+// Offsets into the device configuration.
+constexpr size_t configMaxVirtqueuePairs = 8;
+
+constexpr size_t frameSize = 1514;
+static_assert(frameSize <= nic::BufferPool::bufferSize);
+
+// Receive buffers are posted in batches of (up to) this size.
+constexpr size_t refillBatch = 32;
+// Upper bound on the number of receive buffers per queue.
+constexpr size_t maxRxBuffers = 256;
+// Receive buffers that are posted or still in use by netserver's stack.
+constexpr size_t rxPoolCapacity = 2 * maxRxBuffers;
+// Number of transmit completions that are reaped at once.
+constexpr size_t reapBatch = 32;
+
 struct VirtHeader {
 	uint8_t flags;
 	uint8_t gsoType;
@@ -34,18 +74,80 @@ struct VirtHeader {
 	uint16_t numBuffers;
 };
 
+struct ControlMessage {
+	uint8_t cls;
+	uint8_t command;
+	uint16_t virtqueuePairs;
+	uint8_t ack;
+};
+
 struct VirtioNic : nic::Link {
 	VirtioNic(std::unique_ptr<virtio_core::Transport> transport);
 
-	virtual async::result<void> receive(arch::dma_buffer_view) override;
-	virtual async::result<void> send(const arch::dma_buffer_view) override;
+	// Enables the additional queue pairs and posts the receive buffers.
+	async::result<void> initialize();
+
+	virtual async::result<nic::ReceivedFrame> receive(unsigned int queue) override;
+	virtual bool hasPendingFrames(unsigned int queue) override;
+	virtual nic::BufferPool *rxPool(unsigned int queue) override;
+	virtual async::result<void> send(arch::dma_buffer frame,
+			std::optional<nic::ChecksumOffload> csum,
+			std::optional<nic::SegmentationOffload> gso) override;
 
 	virtual ~VirtioNic() override = default;
 private:
+	struct QueuePair;
+
+	struct RxBuffer : virtio_core::Request {
+		RxBuffer(arch::dma_pool *pool, QueuePair *pair)
+		: pair{pair}, header{pool}, frame{&pair->rxPool, frameSize} { }
+
+		QueuePair *pair;
+		arch::dma_object<VirtHeader> header;
+		arch::dma_buffer frame;
+	};
+
+	struct TxBuffer : virtio_core::Request {
+		TxBuffer(arch::dma_pool *pool, arch::dma_buffer frame)
+		: header{pool}, frame{std::move(frame)} { }
+
+		arch::dma_object<VirtHeader> header;
+		arch::dma_buffer frame;
+	};
+
+	struct QueuePair {
+		QueuePair(VirtioNic *nic, arch::dma_pool *pool)
+		: nic{nic}, rxPool{pool, rxPoolCapacity} { }
+
+		VirtioNic *nic;
+		virtio_core::Queue *receiveVq;
+		virtio_core::Queue *transmitVq;
+
+		// Number of receive buffers that we keep posted to the device.
+		size_t rxTarget;
+		size_t rxBatch;
+		size_t rxPosted = 0;
+		// Buffers that the device filled but that were not received yet.
+		std::deque<RxBuffer *> rxCompleted;
+		async::recurring_event rxDoorbell;
+		// Frames are returned here once netserver is done with them.
+		nic::BufferPool rxPool;
+	};
+
+	// Lets the kernel drop frames that netserver does not handle before we are woken up.
+	async::result<void> classifyReceived_();
+	async::result<void> refill_(QueuePair *pair);
+	// Frees the buffers of completed transmissions without waiting for an IRQ.
+	void reap_(QueuePair *pair);
+	// Keeps the frames of each flow on the same queue to avoid reordering.
+	QueuePair *selectTxQueue_(arch::dma_buffer_view frame);
+
 	std::unique_ptr<virtio_core::Transport> transport_;
 	arch::contiguous_pool dmaPool_;
-	virtio_core::Queue *receiveVq_;
-	virtio_core::Queue *transmitVq_;
+	std::vector<std::unique_ptr<QueuePair>> pairs_;
+	virtio_core::Queue *controlVq_ = nullptr;
+	// Number of queue pairs that we want to use (if VIRTIO_NET_F_MQ is supported).
+	unsigned int numPairs_ = 1;
 };
 
 VirtioNic::VirtioNic(std::unique_ptr<virtio_core::Transport> transport)
@@ -64,55 +166,303 @@ VirtioNic::VirtioNic(std::unique_ptr<virtio_core::Transport> transport)
 		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_MAC);
 	}
 
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_CSUM)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_CSUM);
+		txChecksumOffload = true;
+
+		// TSO depends on checksum offloading.
+		if(transport_->checkDeviceFeature(VIRTIO_NET_F_HOST_TSO4)) {
+			transport_->acknowledgeDriverFeature(VIRTIO_NET_F_HOST_TSO4);
+			tcpSegmentationOffload = true;
+		}
+	}
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_GUEST_CSUM)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_GUEST_CSUM);
+		rxChecksumOffload = true;
+	}
+
+	// The number of queue pairs can only be changed through the control virtq.
+	unsigned int maxPairs = 1;
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_CTRL_VQ)
+			&& transport_->checkDeviceFeature(VIRTIO_NET_F_MQ)) {
+		maxPairs = transport_->loadConfig16(configMaxVirtqueuePairs);
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_CTRL_VQ);
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_MQ);
+		numPairs_ = std::clamp(maxPairs, 1U, nic::maxQueues);
+	}
+
 	transport_->finalizeFeatures();
-	transport_->claimQueues(2);
-	receiveVq_ = transport_->setupQueue(0);
-	transmitVq_ = transport_->setupQueue(1);
+
+	// The control virtq follows the last queue pair that the device supports.
+	if(maxPairs > 1) {
+		transport_->claimQueues(2 * maxPairs + 1);
+	}else{
+		transport_->claimQueues(2);
+	}
+	for(unsigned int i = 0; i < numPairs_; i++) {
+		auto pair = std::make_unique<QueuePair>(this, &dmaPool_);
+		pair->receiveVq = transport_->setupQueue(2 * i);
+		pair->transmitVq = transport_->setupQueue(2 * i + 1);
+
+		// Each receive buffer occupies two descriptors.
+		pair->rxTarget = std::min(pair->receiveVq->numDescriptors() / 2, maxRxBuffers);
+		pair->rxBatch = std::min(refillBatch, std::max(pair->rxTarget / 2, size_t{1}));
+		pairs_.push_back(std::move(pair));
+	}
+	if(maxPairs > 1)
+		controlVq_ = transport_->setupQueue(2 * maxPairs);
 
 	transport_->runDevice();
 }
 
-async::result<void> VirtioNic::receive(arch::dma_buffer_view frame) {
-	arch::dma_object<VirtHeader> header { &dmaPool_ };
+async::result<void> VirtioNic::initialize() {
+	if(numPairs_ > 1) {
+		arch::dma_object<ControlMessage> message { &dmaPool_ };
+		message->cls = VIRTIO_NET_CTRL_MQ;
+		message->command = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+		message->virtqueuePairs = numPairs_;
+		message->ack = ~VIRTIO_NET_OK;
 
-	virtio_core::Chain chain;
-	chain.append(co_await receiveVq_->obtainDescriptor());
-	chain.setupBuffer(virtio_core::deviceToHost,
-			header.view_buffer().subview(0, legacyHeaderSize));
-	chain.append(co_await receiveVq_->obtainDescriptor());
-	chain.setupBuffer(virtio_core::deviceToHost, frame);
+		// Legacy devices expect the header, data and ack in separate descriptors.
+		auto view = message.view_buffer();
+		virtio_core::Chain chain;
+		chain.append(co_await controlVq_->obtainDescriptor());
+		chain.setupBuffer(virtio_core::hostToDevice,
+				view.subview(offsetof(ControlMessage, cls), 2));
+		chain.append(co_await controlVq_->obtainDescriptor());
+		chain.setupBuffer(virtio_core::hostToDevice,
+				view.subview(offsetof(ControlMessage, virtqueuePairs), 2));
+		chain.append(co_await controlVq_->obtainDescriptor());
+		chain.setupBuffer(virtio_core::deviceToHost,
+				view.subview(offsetof(ControlMessage, ack), 1));
+		co_await controlVq_->submitDescriptor(chain.front());
 
-	co_await receiveVq_->submitDescriptor(chain.front());
+		if(message->ack != VIRTIO_NET_OK) {
+			// The device keeps using the first queue pair only.
+			std::cout << "virtio-driver: Failed to enable " << numPairs_
+					<< " queue pairs" << std::endl;
+			pairs_.resize(1);
+		}
+	}
+	numQueues = pairs_.size();
 
+	co_await classifyReceived_();
+
+	for(auto &pair : pairs_) {
+		while(pair->rxPosted < pair->rxTarget)
+			co_await refill_(pair.get());
+	}
+}
+
+async::result<void> VirtioNic::classifyReceived_() {
+#ifdef __x86_64__ // TODO: implement kernlet compilation for aarch64
+	co_await connectKernletCompiler();
+
+	// netserver only handles IPv4 and ARP and discards all other frames.
+	std::vector<uint8_t> kernlet_program;
+	fnr::emit_to(std::back_inserter(kernlet_program),
+		// Load the EtherType.
+		fnr::scope_push{} (
+			fnr::intrin{"__packet_read16", 1, 1} ( fnr::literal{12} )
+		),
+		fnr::check_if{},
+			fnr::intrin{"__equal32", 2, 1} (
+				fnr::scope_get{0},
+				fnr::literal{nic::ETHER_TYPE_IP4}
+			) + fnr::intrin{"__equal32", 2, 1} (
+				fnr::scope_get{0},
+				fnr::literal{nic::ETHER_TYPE_ARP}
+			),
+		fnr::then{},
+			fnr::scope_push{} ( fnr::literal{kHelRxDeliver} ),
+		fnr::else_then{},
+			fnr::scope_push{} ( fnr::literal{kHelRxDrop} ),
+		fnr::end{}
+	);
+
+	auto kernlet_object = co_await compile(kernlet_program.data(),
+			kernlet_program.size(), {});
+
+	HelHandle bound_handle;
+	HEL_CHECK(helBindKernlet(kernlet_object.getHandle(), nullptr, 0, &bound_handle));
+	helix::UniqueDescriptor bound{bound_handle};
+
+	// Wake up at least once per refill batch to recycle the dropped buffers.
+	size_t classified = 0;
+	for(auto &pair : pairs_) {
+		if(transport_->classifyReceived(pair->receiveVq, bound,
+				legacyHeaderSize, pair->rxBatch))
+			classified++;
+	}
+	if(classified)
+		std::cout << "virtio-driver: Received frames are classified by the kernel"
+				<< std::endl;
+#else
 	co_return;
+#endif
+}
+
+async::result<void> VirtioNic::refill_(QueuePair *pair) {
+	size_t n = std::min(pair->rxBatch, pair->rxTarget - pair->rxPosted);
+	if(!n)
+		co_return;
+
+	std::vector<virtio_core::Handle> descriptors(2 * n);
+	co_await pair->receiveVq->obtainDescriptors(descriptors);
+
+	std::vector<virtio_core::Handle> heads(n);
+	std::vector<virtio_core::Request *> requests(n);
+	for(size_t i = 0; i < n; i++) {
+		auto buffer = new RxBuffer{&dmaPool_, pair};
+		heads[i] = descriptors[2 * i];
+		heads[i].setupBuffer(virtio_core::deviceToHost,
+				buffer->header.view_buffer().subview(0, legacyHeaderSize));
+		heads[i].setupLink(descriptors[2 * i + 1]);
+		descriptors[2 * i + 1].setupBuffer(virtio_core::deviceToHost, buffer->frame);
+		requests[i] = buffer;
+	}
+
+	pair->receiveVq->postBatch(heads, requests,
+			[] (virtio_core::Request *base_request) {
+		auto buffer = static_cast<RxBuffer *>(base_request);
+		auto pair = buffer->pair;
+		pair->rxPosted--;
+
+		// Dropped frames go back to the pool; receive() refills the virtq.
+		auto verdict = pair->receiveVq->verdictOf(buffer->usedIndex);
+		if(verdict == kHelRxDrop) {
+			delete buffer;
+		}else{
+			auto target = pair;
+			auto &pairs = pair->nic->pairs_;
+			if(verdict >= kHelRxSteer && verdict - kHelRxSteer < pairs.size())
+				target = pairs[verdict - kHelRxSteer].get();
+			target->rxCompleted.push_back(buffer);
+			if(target != pair)
+				target->rxDoorbell.raise();
+		}
+		pair->rxDoorbell.raise();
+	});
+	pair->rxPosted += n;
 }
 
-async::result<void> VirtioNic::send(const arch::dma_buffer_view payload) {
-	if (payload.size() > 1514) {
+async::result<nic::ReceivedFrame> VirtioNic::receive(unsigned int queue) {
+	assert(queue < pairs_.size());
+	auto pair = pairs_[queue].get();
+
+	while(pair->rxCompleted.empty()) {
+		// If the kernel drops frames, the virtq runs dry unless we refill it here.
+		if(pair->rxTarget - pair->rxPosted >= pair->rxBatch) {
+			co_await refill_(pair);
+			continue;
+		}
+		co_await pair->rxDoorbell.async_wait();
+	}
+	auto buffer = pair->rxCompleted.front();
+	pair->rxCompleted.pop_front();
+
+	if(pair->rxTarget - pair->rxPosted >= pair->rxBatch)
+		co_await refill_(pair);
+
+	// Partially checksummed packets originate from the host itself and are
+	// trusted in the same way as packets with a valid checksum.
+	nic::ReceivedFrame frame { std::move(buffer->frame) };
+	if(rxChecksumOffload)
+		frame.checksumValidated = buffer->header->flags
+				& (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID);
+	delete buffer;
+	co_return frame;
+}
+
+bool VirtioNic::hasPendingFrames(unsigned int queue) {
+	assert(queue < pairs_.size());
+	return !pairs_[queue]->rxCompleted.empty();
+}
+
+nic::BufferPool *VirtioNic::rxPool(unsigned int queue) {
+	assert(queue < pairs_.size());
+	return &pairs_[queue]->rxPool;
+}
+
+void VirtioNic::reap_(QueuePair *pair) {
+	virtio_core::Completion completions[reapBatch];
+	size_t n;
+	do {
+		n = pair->transmitVq->harvest(completions);
+		for(size_t i = 0; i < n; i++)
+			completions[i].request->complete(completions[i].request);
+	} while(n == reapBatch);
+}
+
+VirtioNic::QueuePair *VirtioNic::selectTxQueue_(arch::dma_buffer_view frame) {
+	if(pairs_.size() == 1)
+		return pairs_.front().get();
+
+	// Hash the IPv4 addresses and the ports (if any).
+	auto data = reinterpret_cast<const uint8_t *>(frame.data());
+	if(frame.size() < 34 || data[12] != 0x08 || data[13] != 0x00)
+		return pairs_.front().get();
+	size_t end = std::min(frame.size(), 14 + (data[14] & 0xF) * 4 + size_t{4});
+
+	uint32_t hash = 2166136261;
+	auto mix = [&] (size_t from, size_t to) {
+		for(size_t i = from; i < to; i++)
+			hash = (hash ^ data[i]) * 16777619;
+	};
+	mix(26, 34);
+	mix(14 + (data[14] & 0xF) * 4, end);
+	return pairs_[hash % pairs_.size()].get();
+}
+
+async::result<void> VirtioNic::send(arch::dma_buffer frame,
+		std::optional<nic::ChecksumOffload> csum,
+		std::optional<nic::SegmentationOffload> gso) {
+	if (frame.size() > frameSize && !gso) {
 		throw std::runtime_error("data exceeds mtu");
 	}
 
-	arch::dma_object<VirtHeader> header { &dmaPool_ };
-	memset(header.data(), 0, sizeof(VirtHeader));
+	auto pair = selectTxQueue_(frame);
+	reap_(pair);
+
+	auto buffer = new TxBuffer{&dmaPool_, std::move(frame)};
+	memset(buffer->header.data(), 0, sizeof(VirtHeader));
+	if(csum) {
+		assert(txChecksumOffload);
+		buffer->header->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		buffer->header->csumStart = csum->start;
+		buffer->header->csumOffset = csum->offset;
+	}
+	if(gso) {
+		assert(tcpSegmentationOffload && csum);
+		buffer->header->gsoType = VIRTIO_NET_HDR_GSO_TCPV4;
+		buffer->header->gsoSize = gso->mss;
+		buffer->header->hdrLen = gso->headerLength;
+	}
 
+	// Super-packets can span multiple pages.
 	virtio_core::Chain chain;
-	chain.append(co_await transmitVq_->obtainDescriptor());
+	chain.append(co_await pair->transmitVq->obtainDescriptor());
 	chain.setupBuffer(virtio_core::hostToDevice,
-			header.view_buffer().subview(0, legacyHeaderSize));
-	chain.append(co_await transmitVq_->obtainDescriptor());
-	chain.setupBuffer(virtio_core::hostToDevice, payload);
+			buffer->header.view_buffer().subview(0, legacyHeaderSize));
+	co_await virtio_core::scatterGather(virtio_core::hostToDevice, chain,
+			pair->transmitVq, buffer->frame);
 
-	std::cout << "virtio-driver: sending frame" << std::endl;
-	co_await transmitVq_->submitDescriptor(chain.front());
-	std::cout << "virtio-driver: sent frame" << std::endl;
+	// The buffer is freed once the device returns it; we do not wait for that.
+	pair->transmitVq->postDescriptor(chain.front(), buffer,
+			[] (virtio_core::Request *base_request) {
+		delete static_cast<TxBuffer *>(base_request);
+	});
+	pair->transmitVq->notify();
 }
 } // namespace
 
 namespace nic::virtio {
 
-std::shared_ptr<nic::Link> makeShared(
+async::result<std::shared_ptr<nic::Link>> makeShared(
 		std::unique_ptr<virtio_core::Transport> transport) {
-	return std::make_shared<VirtioNic>(std::move(transport));
+	auto device = std::make_shared<VirtioNic>(std::move(transport));
+	co_await device->initialize();
+	co_return device;
 }
 
 } // namespace nic::virtio
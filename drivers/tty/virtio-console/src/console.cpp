@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <iostream>
 
 #include "console.hpp"
@@ -7,9 +8,12 @@
 #include <async/oneshot-event.hpp>
 #include <async/promise.hpp>
 #include <frg/std_compat.hpp>
+#include <protocols/fs/server.hpp>
 #include <protocols/mbus/client.hpp>
 #include <kerncfg.pb.h>
 
+#include "fs.bragi.hpp"
+
 async::result<helix::UniqueLane> enumerateKerncfgByteRing(const char *purpose) {
 	auto root = co_await mbus::Instance::global().getRoot();
 
@@ -65,27 +69,362 @@ getKerncfgByteRingPart(helix::BorrowedLane lane,
 namespace tty {
 namespace virtio_console {
 
+namespace {
+	// Buffers that are posted to the receive virtq of each port.
+	constexpr size_t numRxBuffers = 16;
+	constexpr size_t rxBufferSize = 16 * 1024;
+
+	// Written data is staged in these buffers; full buffers are posted as soon as possible.
+	constexpr size_t numTxBuffers = 8;
+	constexpr size_t txBufferSize = 32 * 1024;
+	// Maximal number of buffers per chain. Keeps some buffers available
+	// for writers while a chain is in flight.
+	constexpr size_t maxTxChain = numTxBuffers / 2;
+
+	// Control messages carry at most a port name after the header.
+	constexpr size_t numControlBuffers = 8;
+	constexpr size_t controlBufferSize = 4096;
+
+	unsigned int nextDeviceIndex = 0;
+}
+
+// --------------------------------------------------------
+// ReceiveRing
+// --------------------------------------------------------
+
+ReceiveRing::ReceiveRing(arch::dma_pool *pool, virtio_core::Queue *queue,
+		size_t bufferSize, size_t numBuffers)
+: queue_{queue} {
+	// Each buffer occupies a single descriptor.
+	numBuffers = std::min(numBuffers, queue->numDescriptors());
+	batch_ = std::max(numBuffers / 4, size_t{1});
+
+	for(size_t i = 0; i < numBuffers; i++) {
+		buffers_.push_back(std::make_unique<RxBuffer>(pool, this, bufferSize));
+		free_.push_back(buffers_.back().get());
+	}
+}
+
+async::result<RxBuffer *> ReceiveRing::front() {
+	while(completed_.empty())
+		co_await doorbell_.async_wait();
+	co_return completed_.front();
+}
+
+async::result<void> ReceiveRing::recycle() {
+	assert(!completed_.empty());
+	auto buffer = completed_.front();
+	completed_.pop_front();
+
+	buffer->consumed = 0;
+	free_.push_back(buffer);
+	if(free_.size() >= batch_)
+		co_await flush();
+}
+
+async::result<void> ReceiveRing::flush() {
+	if(free_.empty())
+		co_return;
+
+	// Take the buffers before suspending; concurrent recycle() calls may add more.
+	std::vector<virtio_core::Request *> requests{free_.begin(), free_.end()};
+	free_.clear();
+
+	std::vector<virtio_core::Handle> heads(requests.size());
+	co_await queue_->obtainDescriptors(heads);
+	for(size_t i = 0; i < requests.size(); i++) {
+		auto buffer = static_cast<RxBuffer *>(requests[i]);
+		heads[i].setupBuffer(virtio_core::deviceToHost, buffer->buffer);
+	}
+
+	queue_->postBatch(heads, requests, [] (virtio_core::Request *base_request) {
+		auto buffer = static_cast<RxBuffer *>(base_request);
+		auto ring = buffer->ring;
+		ring->completed_.push_back(buffer);
+		ring->doorbell_.raise();
+	});
+}
+
+// --------------------------------------------------------
+// File operations
+// --------------------------------------------------------
+
+namespace {
+
+struct OpenFile {
+	OpenFile(Port *port)
+	: port{port} { }
+
+	Port *port;
+};
+
+async::result<protocols::fs::ReadResult>
+read(void *object, const char *, void *buffer, size_t length) {
+	auto file = static_cast<OpenFile *>(object);
+	if(!length)
+		co_return size_t{0};
+	co_return co_await file->port->read(buffer, length);
+}
+
+async::result<frg::expected<protocols::fs::Error, size_t>>
+write(void *object, const char *, const void *buffer, size_t length) {
+	auto file = static_cast<OpenFile *>(object);
+	co_await file->port->write(buffer, length);
+	co_return length;
+}
+
+async::result<protocols::fs::SeekResult> seek(void *, int64_t) {
+	co_return protocols::fs::Error::seekOnPipe;
+}
+
+constexpr auto fileOperations = protocols::fs::FileOperations{
+	.seekAbs = &seek,
+	.seekRel = &seek,
+	.seekEof = &seek,
+	.read = &read,
+	.write = &write,
+};
+
+async::detached serveDevice(Port *port, helix::UniqueLane lane) {
+	while(true) {
+		auto [accept, recv_req] = co_await helix_ng::exchangeMsgs(lane,
+			helix_ng::accept(
+				helix_ng::recvInline())
+		);
+		HEL_CHECK(accept.error());
+		HEL_CHECK(recv_req.error());
+
+		auto conversation = accept.descriptor();
+
+		managarm::fs::CntRequest req;
+		req.ParseFromArray(recv_req.data(), recv_req.length());
+		if(req.req_type() == managarm::fs::CntReqType::DEV_OPEN) {
+			co_await port->open();
+
+			helix::UniqueLane local_lane, remote_lane;
+			std::tie(local_lane, remote_lane) = helix::createStream();
+			auto file = smarter::make_shared<OpenFile>(port);
+			async::detach(protocols::fs::servePassthrough(
+					std::move(local_lane), file, &fileOperations));
+
+			managarm::fs::SvrResponse resp;
+			resp.set_error(managarm::fs::Errors::SUCCESS);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp, push_node] = co_await helix_ng::exchangeMsgs(conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::pushDescriptor(remote_lane)
+			);
+			HEL_CHECK(send_resp.error());
+			HEL_CHECK(push_node.error());
+		}else{
+			throw std::runtime_error("virtio-console: Unexpected request type");
+		}
+	}
+}
+
+} // anonymous namespace
+
+// --------------------------------------------------------
+// Port
+// --------------------------------------------------------
+
+Port::Port(Device *device, unsigned int id, virtio_core::Queue *rxQueue,
+		virtio_core::Queue *txQueue)
+: device_{device}, id_{id},
+		rx_{&device->dmaPool_, rxQueue, rxBufferSize, numRxBuffers},
+		txQueue_{txQueue} {
+	for(size_t i = 0; i < numTxBuffers; i++) {
+		txBuffers_.push_back(std::make_unique<TxBuffer>(&device->dmaPool_, this, txBufferSize));
+		txFree_.push_back(txBuffers_.back().get());
+	}
+}
+
+async::detached Port::run(std::string devname) {
+	co_await rx_.flush();
+	transmit_();
+
+	auto root = co_await mbus::Instance::global().getRoot();
+
+	mbus::Properties descriptor{
+		{"generic.devtype", mbus::StringItem{"char"}},
+		{"generic.devname", mbus::StringItem{devname}}
+	};
+
+	auto handler = mbus::ObjectHandler{}
+	.withBind([this] () -> async::result<helix::UniqueDescriptor> {
+		helix::UniqueLane local_lane, remote_lane;
+		std::tie(local_lane, remote_lane) = helix::createStream();
+		serveDevice(this, std::move(local_lane));
+
+		co_return std::move(remote_lane);
+	});
+
+	co_await root.createObject(devname, descriptor, std::move(handler));
+}
+
+async::result<void> Port::open() {
+	// Tell the host that the port is in use so that it starts to forward data.
+	if(!device_->multiport_ || guestOpened_)
+		co_return;
+	guestOpened_ = true;
+	co_await device_->sendControl_(id_, VIRTIO_CONSOLE_PORT_OPEN, 1);
+}
+
+async::result<size_t> Port::read(void *buffer, size_t length) {
+	while(true) {
+		auto rxBuffer = co_await rx_.front();
+		assert(rxBuffer->consumed <= rxBuffer->written);
+		if(rxBuffer->consumed == rxBuffer->written) {
+			co_await rx_.recycle();
+			continue;
+		}
+
+		auto chunk = std::min(length, rxBuffer->written - rxBuffer->consumed);
+		memcpy(buffer, static_cast<char *>(rxBuffer->buffer.data()) + rxBuffer->consumed,
+				chunk);
+		rxBuffer->consumed += chunk;
+
+		// Complete the read even if less than length bytes were available.
+		if(rxBuffer->consumed == rxBuffer->written)
+			co_await rx_.recycle();
+		co_return chunk;
+	}
+}
+
+async::result<void> Port::write(const void *buffer, size_t length) {
+	auto p = static_cast<const char *>(buffer);
+	while(length) {
+		if(!txStaged_) {
+			// Another writer might stage a buffer while we wait.
+			if(txFree_.empty()) {
+				co_await txDoorbell_.async_wait();
+				continue;
+			}
+			txStaged_ = txFree_.front();
+			txFree_.pop_front();
+			txStaged_->fill = 0;
+		}
+
+		auto chunk = std::min(length, txStaged_->buffer.size() - txStaged_->fill);
+		memcpy(static_cast<char *>(txStaged_->buffer.data()) + txStaged_->fill, p, chunk);
+		txStaged_->fill += chunk;
+		p += chunk;
+		length -= chunk;
+
+		if(txStaged_->fill == txStaged_->buffer.size()) {
+			txReady_.push_back(txStaged_);
+			txStaged_ = nullptr;
+			txDoorbell_.raise();
+		}
+	}
+
+	txDoorbell_.raise();
+}
+
+async::detached Port::transmit_() {
+	while(true) {
+		// Partially filled buffers are only posted while the device is idle;
+		// otherwise, we wait for further writes to coalesce.
+		if(!txInFlight_ && txStaged_ && txStaged_->fill) {
+			txReady_.push_back(txStaged_);
+			txStaged_ = nullptr;
+		}
+
+		if(txReady_.empty()) {
+			co_await txDoorbell_.async_wait();
+			continue;
+		}
+
+		// Each chain covers up to maxTxChain buffers.
+		std::vector<TxBuffer *> buffers{txReady_.begin(), txReady_.end()};
+		txReady_.clear();
+		size_t numChains = (buffers.size() + maxTxChain - 1) / maxTxChain;
+
+		std::vector<virtio_core::Handle> descriptors(buffers.size());
+		co_await txQueue_->obtainDescriptors(descriptors);
+
+		std::vector<virtio_core::Handle> heads(numChains);
+		std::vector<virtio_core::Request *> requests(numChains);
+		for(size_t k = 0; k < numChains; k++) {
+			auto first = k * maxTxChain;
+			auto last = std::min(first + maxTxChain, buffers.size());
+
+			virtio_core::Chain chain;
+			for(size_t i = first; i < last; i++) {
+				chain.append(descriptors[i]);
+				chain.setupBuffer(virtio_core::hostToDevice,
+						buffers[i]->buffer.subview(0, buffers[i]->fill));
+			}
+			heads[k] = chain.front();
+
+			// The head buffer completes the whole chain.
+			buffers[first]->chained.assign(buffers.begin() + first + 1, buffers.begin() + last);
+			requests[k] = buffers[first];
+		}
+
+		txInFlight_ += numChains;
+		txQueue_->postBatch(heads, requests, [] (virtio_core::Request *base_request) {
+			auto head = static_cast<TxBuffer *>(base_request);
+			auto port = head->port;
+			port->txInFlight_--;
+			port->txFree_.push_back(head);
+			for(auto buffer : head->chained)
+				port->txFree_.push_back(buffer);
+			head->chained.clear();
+			port->txDoorbell_.raise();
+		});
+	}
+}
+
 // --------------------------------------------------------
 // Device
 // --------------------------------------------------------
 
 Device::Device(std::unique_ptr<virtio_core::Transport> transport)
-: transport_{std::move(transport)} { }
+: transport_{std::move(transport)}, index_{nextDeviceIndex++} { }
 
 async::detached Device::runDevice() {
+	if(transport_->checkDeviceFeature(VIRTIO_CONSOLE_F_MULTIPORT)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_CONSOLE_F_MULTIPORT);
+		multiport_ = true;
+	}
 	transport_->finalizeFeatures();
-	transport_->claimQueues(2);
-	rxQueue_ = transport_->setupQueue(0);
-	txQueue_ = transport_->setupQueue(1);
 
-	auto maxPorts = transport_->space().load(spec::regs::maxPorts);
-	std::cout << "virtio-console: Device supports " << maxPorts << " ports" << std::endl;
+	unsigned int numPorts = 1;
+	if(multiport_)
+		numPorts = std::max(transport_->space().load(spec::regs::maxPorts), uint32_t{1});
+	std::cout << "virtio-console: Device supports " << numPorts << " ports" << std::endl;
+
+	// Port 0 uses virtqs 0 and 1, the control virtqs follow, then all other ports.
+	transport_->claimQueues(multiport_ ? 2 * (numPorts + 1) : 2);
+	rxQueues_.push_back(transport_->setupQueue(0));
+	txQueues_.push_back(transport_->setupQueue(1));
+	if(multiport_) {
+		controlRxQueue_ = transport_->setupQueue(2);
+		controlTxQueue_ = transport_->setupQueue(3);
+		for(unsigned int i = 1; i < numPorts; i++) {
+			rxQueues_.push_back(transport_->setupQueue(2 * i + 2));
+			txQueues_.push_back(transport_->setupQueue(2 * i + 3));
+		}
+	}
+	ports_.resize(numPorts);
 
 	transport_->runDevice();
 
+	// With VIRTIO_CONSOLE_F_MULTIPORT, the device announces its ports on the control virtq.
+	if(multiport_) {
+		handleControl_();
+	}else{
+		addPort_(0);
+	}
+
 	auto dumpKerncfgRing = [this] (const char *name, size_t watermark) -> async::result<void> {
 		auto lane = co_await enumerateKerncfgByteRing(name);
 
+		// Kernel logs are written to the first port.
+		auto port = co_await waitForPort_(0);
+
 		uint64_t dequeue = 0;
 
 		arch::dma_buffer chunkBuffer{&dmaPool_, 1 << 16};
@@ -101,10 +440,7 @@ async::detached Device::runDevice() {
 
 			dequeue = newDequeue;
 
-			virtio_core::Chain chain;
-			chain.append(co_await txQueue_->obtainDescriptor());
-			chain.setupBuffer(virtio_core::hostToDevice, chunkBuffer.subview(0, size));
-			co_await txQueue_->submitDescriptor(chain.front());
+			co_await port->write(chunkBuffer.data(), size);
 		}
 	};
 
@@ -114,4 +450,106 @@ async::detached Device::runDevice() {
 	co_return;
 }
 
+Port *Device::addPort_(unsigned int id) {
+	assert(id < ports_.size() && !ports_[id]);
+	ports_[id] = std::make_unique<Port>(this, id, rxQueues_[id], txQueues_[id]);
+	auto port = ports_[id].get();
+
+	// Follow Linux' naming: hvcN for single-port devices, vportNpM otherwise.
+	std::string devname;
+	if(multiport_) {
+		devname = "vport" + std::to_string(index_) + "p" + std::to_string(id);
+	}else{
+		devname = "hvc" + std::to_string(index_);
+	}
+	port->run(std::move(devname));
+
+	portsChanged_.raise();
+	return port;
+}
+
+async::result<Port *> Device::waitForPort_(unsigned int id) {
+	while(id >= ports_.size() || !ports_[id])
+		co_await portsChanged_.async_wait();
+	co_return ports_[id].get();
+}
+
+async::detached Device::handleControl_() {
+	ReceiveRing rx{&dmaPool_, controlRxQueue_, controlBufferSize, numControlBuffers};
+	co_await rx.flush();
+
+	co_await sendControl_(0, VIRTIO_CONSOLE_DEVICE_READY, 1);
+
+	while(true) {
+		auto buffer = co_await rx.front();
+		if(buffer->written < sizeof(ControlMessage)) {
+			std::cout << "virtio-console: Ignoring truncated control message" << std::endl;
+			co_await rx.recycle();
+			continue;
+		}
+
+		ControlMessage message;
+		memcpy(&message, buffer->buffer.data(), sizeof(ControlMessage));
+
+		Port *port = nullptr;
+		if(message.id < ports_.size())
+			port = ports_[message.id].get();
+
+		switch(message.event) {
+		case VIRTIO_CONSOLE_DEVICE_ADD:
+			if(message.id >= ports_.size() || port) {
+				std::cout << "virtio-console: Device added invalid port "
+						<< message.id << std::endl;
+				co_await sendControl_(message.id, VIRTIO_CONSOLE_PORT_READY, 0);
+				break;
+			}
+			addPort_(message.id);
+			co_await sendControl_(message.id, VIRTIO_CONSOLE_PORT_READY, 1);
+			break;
+		case VIRTIO_CONSOLE_DEVICE_REMOVE:
+			// mbus does not support removal of objects; the port stays around.
+			std::cout << "virtio-console: Removal of port " << message.id
+					<< " is not supported" << std::endl;
+			break;
+		case VIRTIO_CONSOLE_CONSOLE_PORT:
+			if(port)
+				co_await port->open();
+			break;
+		case VIRTIO_CONSOLE_PORT_OPEN:
+			if(port)
+				port->setHostConnected(message.value);
+			break;
+		case VIRTIO_CONSOLE_PORT_NAME:
+			if(port) {
+				std::string name{static_cast<char *>(buffer->buffer.data()) + sizeof(ControlMessage),
+						buffer->written - sizeof(ControlMessage)};
+				name.erase(std::find(name.begin(), name.end(), '\0'), name.end());
+				std::cout << "virtio-console: Port " << message.id
+						<< " is named \"" << name << "\"" << std::endl;
+				port->setName(std::move(name));
+			}
+			break;
+		case VIRTIO_CONSOLE_RESIZE:
+			break;
+		default:
+			std::cout << "virtio-console: Unexpected control event "
+					<< message.event << std::endl;
+		}
+
+		co_await rx.recycle();
+	}
+}
+
+async::result<void> Device::sendControl_(uint32_t id, uint16_t event, uint16_t value) {
+	arch::dma_object<ControlMessage> message{&dmaPool_};
+	message->id = id;
+	message->event = event;
+	message->value = value;
+
+	virtio_core::Chain chain;
+	chain.append(co_await controlTxQueue_->obtainDescriptor());
+	chain.setupBuffer(virtio_core::hostToDevice, message.view_buffer());
+	co_await controlTxQueue_->submitDescriptor(chain.front());
+}
+
 } } // namespace tty::virtio_console
@@ -1,6 +1,10 @@
-#include <queue>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <arch/dma_pool.hpp>
+#include <async/recurring-event.hpp>
 #include <core/virtio/core.hpp>
 
 namespace tty {
@@ -17,21 +21,199 @@ namespace spec::regs {
 	inline constexpr arch::scalar_register<uint32_t> emergencyWrite{8};
 }
 
+enum {
+	VIRTIO_CONSOLE_F_SIZE = 0,
+	VIRTIO_CONSOLE_F_MULTIPORT = 1
+};
+
+// Values of ControlMessage::event.
+enum {
+	VIRTIO_CONSOLE_DEVICE_READY = 0,
+	VIRTIO_CONSOLE_DEVICE_ADD = 1,
+	VIRTIO_CONSOLE_DEVICE_REMOVE = 2,
+	VIRTIO_CONSOLE_PORT_READY = 3,
+	VIRTIO_CONSOLE_CONSOLE_PORT = 4,
+	VIRTIO_CONSOLE_RESIZE = 5,
+	VIRTIO_CONSOLE_PORT_OPEN = 6,
+	VIRTIO_CONSOLE_PORT_NAME = 7
+};
+
+struct ControlMessage {
+	uint32_t id;
+	uint16_t event;
+	uint16_t value;
+};
+static_assert(sizeof(ControlMessage) == 8);
+
+// --------------------------------------------------------
+// Receive buffers
+// --------------------------------------------------------
+
+struct ReceiveRing;
+
+struct RxBuffer : virtio_core::Request {
+	RxBuffer(arch::dma_pool *pool, ReceiveRing *ring, size_t size)
+	: ring{ring}, buffer{pool, size} { }
+
+	ReceiveRing *ring;
+	arch::dma_buffer buffer;
+	// Number of bytes that were already consumed by the driver.
+	size_t consumed = 0;
+};
+
+// Keeps a fixed set of buffers posted to a device-to-host virtq.
+// Buffers that were consumed are given back to the device in batches.
+struct ReceiveRing {
+	ReceiveRing(arch::dma_pool *pool, virtio_core::Queue *queue,
+			size_t bufferSize, size_t numBuffers);
+
+	ReceiveRing(const ReceiveRing &) = delete;
+
+	ReceiveRing &operator= (const ReceiveRing &) = delete;
+
+	bool empty() {
+		return completed_.empty();
+	}
+
+	// Waits until the device has filled a buffer and returns it (without removing it).
+	async::result<RxBuffer *> front();
+
+	// Removes the front buffer. Reposts buffers once a batch has accumulated.
+	async::result<void> recycle();
+
+	// Posts all buffers that are not owned by the device.
+	async::result<void> flush();
+
+private:
+	virtio_core::Queue *queue_;
+	std::vector<std::unique_ptr<RxBuffer>> buffers_;
+	// Number of buffers that are reposted at once.
+	size_t batch_;
+
+	std::deque<RxBuffer *> free_;
+	std::deque<RxBuffer *> completed_;
+	async::recurring_event doorbell_;
+};
+
+// --------------------------------------------------------
+// Port
+// --------------------------------------------------------
+
+struct Device;
+
+// A single console port; each port has its own pair of virtqs.
+// Written data is copied to transmit buffers. While the device is busy,
+// further writes are coalesced into the buffer that is currently being filled.
+struct Port {
+	Port(Device *device, unsigned int id, virtio_core::Queue *rxQueue,
+			virtio_core::Queue *txQueue);
+
+	Port(const Port &) = delete;
+
+	Port &operator= (const Port &) = delete;
+
+	unsigned int id() {
+		return id_;
+	}
+
+	// Name that the host assigned to the port (VIRTIO_CONSOLE_PORT_NAME).
+	const std::string &name() {
+		return name_;
+	}
+
+	void setName(std::string name) {
+		name_ = std::move(name);
+	}
+
+	// Whether a host application has opened the port (VIRTIO_CONSOLE_PORT_OPEN).
+	bool hostConnected() {
+		return hostConnected_;
+	}
+
+	void setHostConnected(bool connected) {
+		hostConnected_ = connected;
+	}
+
+	async::detached run(std::string devname);
+
+	// Called when the port is opened by the guest.
+	async::result<void> open();
+
+	// Reads at least one byte; returns whenever data is available.
+	async::result<size_t> read(void *buffer, size_t length);
+
+	// Completes once all data is copied to transmit buffers.
+	async::result<void> write(const void *buffer, size_t length);
+
+private:
+	struct TxBuffer : virtio_core::Request {
+		TxBuffer(arch::dma_pool *pool, Port *port, size_t size)
+		: port{port}, buffer{pool, size} { }
+
+		Port *port;
+		arch::dma_buffer buffer;
+		size_t fill = 0;
+		// Further buffers that are part of this buffer's chain.
+		std::vector<TxBuffer *> chained;
+	};
+
+	async::detached transmit_();
+
+	Device *device_;
+	unsigned int id_;
+	std::string name_;
+	bool hostConnected_ = false;
+	bool guestOpened_ = false;
+
+	ReceiveRing rx_;
+
+	virtio_core::Queue *txQueue_;
+	std::vector<std::unique_ptr<TxBuffer>> txBuffers_;
+	std::deque<TxBuffer *> txFree_;
+	// Buffers that are full and wait to be posted.
+	std::deque<TxBuffer *> txReady_;
+	// Buffer that is currently being filled (or nullptr).
+	TxBuffer *txStaged_ = nullptr;
+	size_t txInFlight_ = 0;
+	async::recurring_event txDoorbell_;
+};
 
 // --------------------------------------------------------
 // Device
 // --------------------------------------------------------
 
 struct Device {
+	friend struct Port;
+
 	Device(std::unique_ptr<virtio_core::Transport> transport);
 
 	async::detached runDevice();
 
 private:
+	// Creates the port and publishes it to mbus.
+	Port *addPort_(unsigned int id);
+
+	// Waits until the device has added the given port.
+	async::result<Port *> waitForPort_(unsigned int id);
+
+	async::detached handleControl_();
+
+	async::result<void> sendControl_(uint32_t id, uint16_t event, uint16_t value);
+
 	arch::contiguous_pool dmaPool_;
 	std::unique_ptr<virtio_core::Transport> transport_;
-	virtio_core::Queue *rxQueue_;
-	virtio_core::Queue *txQueue_;
+	// Index of the device in the names of its ports.
+	unsigned int index_;
+	bool multiport_ = false;
+
+	// Virtqs of all ports; port i uses rxQueues_[i] and txQueues_[i].
+	std::vector<virtio_core::Queue *> rxQueues_;
+	std::vector<virtio_core::Queue *> txQueues_;
+	virtio_core::Queue *controlRxQueue_ = nullptr;
+	virtio_core::Queue *controlTxQueue_ = nullptr;
+
+	std::vector<std::unique_ptr<Port>> ports_;
+	async::recurring_event portsChanged_;
 };
 
-} } // namespace console::virtio_console
+} } // namespace tty::virtio_console
@@ -1,5 +1,6 @@
 
 #include <algorithm>
+#include <array>
 #include <deque>
 #include <iostream>
 
@@ -11,6 +12,7 @@
 #include <arch/io_space.hpp>
 #include <async/result.hpp>
 #include <async/oneshot-event.hpp>
+#include <async/recurring-event.hpp>
 #include <boost/intrusive/list.hpp>
 #include <helix/ipc.hpp>
 #include <protocols/fs/server.hpp>
@@ -86,81 +88,39 @@ void completeRecvs() {
 	}
 }
 
-struct WriteRequest {
-	WriteRequest(const void *buffer, size_t length)
-	: buffer(buffer), length(length), progress(0) { }
+// Output is buffered in a ring; writers only wait if the ring is full.
+constexpr size_t txRingSize = 16 * 1024;
+static_assert(!(txRingSize & (txRingSize - 1)));
 
-	const void *buffer;
-	size_t length;
-	size_t progress;
-	async::oneshot_event event;
-	boost::intrusive::list_member_hook<> hook;
-};
-
-boost::intrusive::list<
-	WriteRequest,
-	boost::intrusive::member_hook<
-		WriteRequest,
-		boost::intrusive::list_member_hook<>,
-		&WriteRequest::hook
-	>
-> sendRequests;
+std::array<uint8_t, txRingSize> txRing;
+// Free-running indices into txRing.
+size_t txHead = 0;
+size_t txTail = 0;
+async::recurring_event txSpaceAvailable;
 
-// Size of the device's TX FIFO in bytes.
-constexpr size_t txFifoSize = 16;
+// Size of the device's TX FIFO in bytes (see detectFifo()).
+size_t txFifoSize = 1;
 
 bool txInFlight = false;
 
+// Refills the TX FIFO from the ring. The next TX empty IRQ continues the transmission.
 void flushSends() {
-	assert(!sendRequests.empty());
+	assert(txHead != txTail);
 	assert(!txInFlight);
 
 	if(logTx)
 		std::cout << "uart: Flushing TX" << std::endl;
 
-	boost::intrusive::list<
-		WriteRequest,
-		boost::intrusive::member_hook<
-			WriteRequest,
-			boost::intrusive::list_member_hook<>,
-			&WriteRequest::hook
-		>
-	> pending;
-
-	size_t fifoAvailable = txFifoSize;
-	while(!sendRequests.empty() && fifoAvailable) {
-		auto req = &sendRequests.front();
-		assert(req->progress < req->length);
-
-		size_t chunk = std::min(req->length - req->progress, fifoAvailable);
-		assert(chunk);
-		for(size_t i = 0; i < chunk; i++) {
-			auto p = reinterpret_cast<const std::byte *>(req->buffer);
-			base.store(uart_register::data, static_cast<uint8_t>(p[req->progress + i]));
-		}
-		req->progress += chunk;
-		fifoAvailable -= chunk;
-
-		// We only complete writes once we have written all bytes;
-		// this avoids unnecessary round trips between the UART driver and the application.
-		if(req->progress == req->length) {
-			sendRequests.pop_front();
-			pending.push_back(*req);
-		}else{
-			assert(!fifoAvailable); // In other words: we will exit the loop.
-		}
-	}
+	size_t chunk = std::min(txHead - txTail, txFifoSize);
+	for(size_t i = 0; i < chunk; i++)
+		base.store(uart_register::data, txRing[(txTail + i) & (txRingSize - 1)]);
+	txTail += chunk;
 
 	if(logTx)
 		std::cout << "uart: TX now in-flight" << std::endl;
 	txInFlight = true;
 
-	// Make sure that we set txInFlight before continuing asynchronous code.
-	while(!pending.empty()) {
-		auto req = &pending.front();
-		pending.pop_front();
-		req->event.raise();
-	}
+	txSpaceAvailable.raise();
 }
 
 async::detached handleIrqs() {
@@ -203,7 +163,7 @@ async::detached handleIrqs() {
 					if(logTx)
 						std::cout << "uart: TX not in-flight anymore" << std::endl;
 
-					if(!sendRequests.empty())
+					if(txHead != txTail)
 						flushSends();
 				}
 			}else if((reason & irq_ident_register::id) == IrqIds::modem) {
@@ -238,22 +198,29 @@ read(void *, const char *, void *buffer, size_t length) {
 
 async::result<frg::expected<protocols::fs::Error, size_t>>
 write(void *, const char *, const void *buffer, size_t length) {
-	if(!length)
-		co_return 0;
-
 	if(logTx)
 		std::cout << "uart: New TX request" << std::endl;
 
-	WriteRequest req{buffer, length};
-	sendRequests.push_back(req);
+	auto p = reinterpret_cast<const uint8_t *>(buffer);
+	size_t progress = 0;
+	while(progress < length) {
+		if(txHead - txTail == txRingSize) {
+			co_await txSpaceAvailable.async_wait();
+			continue;
+		}
 
-	if(!txInFlight)
-		flushSends();
+		size_t chunk = std::min(length - progress, txRingSize - (txHead - txTail));
+		for(size_t i = 0; i < chunk; i++)
+			txRing[(txHead + i) & (txRingSize - 1)] = p[progress + i];
+		txHead += chunk;
+		progress += chunk;
 
-	co_await req.event.wait();
+		if(!txInFlight)
+			flushSends();
+	}
 
 	if(logTx)
-		std::cout << "uart: TX request done" << std::endl;
+		std::cout << "uart: TX request buffered" << std::endl;
 	co_return length;
 }
 
@@ -327,6 +294,21 @@ async::detached runTerminal() {
 	co_await root.createObject("uart0", descriptor, std::move(handler));
 }
 
+// Determines the size of the TX FIFO from the FIFO status bits.
+void detectFifo() {
+	auto ident = base.load(uart_register::irqIdentification);
+	auto status = ident & irq_ident_register::fifoStatus;
+	if(status == FifoStatus::enabled) {
+		txFifoSize = (ident & irq_ident_register::fifo64) ? 64 : 16;
+	}else{
+		// The FIFO of the original 16550 is broken; 8250 and 16450 have no FIFO.
+		if(status == FifoStatus::unusable)
+			base.store(uart_register::fifoControl, fifo_control::fifoEnable(FifoCtrl::disable));
+		txFifoSize = 1;
+	}
+	std::cout << "uart: TX FIFO holds " << txFifoSize << " bytes" << std::endl;
+}
+
 int main() {
 	std::cout << "uart: Starting driver" << std::endl;
 
@@ -342,32 +324,38 @@ int main() {
 
 	base = arch::global_io.subspace(COM1);
 
-	// Perform general initialization.
+	// Set the baud rate. The FIFOs are configured while DLAB is set
+	// since the 16750 only accepts the 64 byte mode in that case.
+	base.store(uart_register::lineControl, line_control::dlab(true));
+	base.store(uart_register::baudLow, BaudRate::low9600);
+	base.store(uart_register::baudHigh, BaudRate::high9600);
+
 	base.store(uart_register::fifoControl,
 			fifo_control::fifoEnable(FifoCtrl::enable)
+			| fifo_control::clearRx(true)
+			| fifo_control::clearTx(true)
+			| fifo_control::enable64(true)
 			| fifo_control::fifoIrqLvl(FifoCtrl::triggerLvl14));
 
+	base.store(uart_register::lineControl,
+			line_control::dataBits(DataBits::charLen8)
+			| line_control::stopBit(StopBits::one)
+			| line_control::parityBits(Parity::none)
+			| line_control::dlab(false));
+
+	detectFifo();
+
 	// Wait for the FIFO to become empty.
 	while(!(base.load(uart_register::lineStatus) & line_status::txReady))
 		; // Busy spin for now.
 
-	// Enable IRQs.
+	// Enable IRQs. Character timeout IRQs are raised together with dataAvailable;
+	// they report data that stays below the FIFO's trigger level.
 	base.store(uart_register::irqEnable,
 			irq_enable::dataAvailable(IrqCtrl::enable)
 			| irq_enable::txEmpty(IrqCtrl::enable)
 			| irq_enable::lineStatus(IrqCtrl::enable));
 
-	// Set the baud rate.
-	base.store(uart_register::lineControl, line_control::dlab(true));
-	base.store(uart_register::baudLow, BaudRate::low9600);
-	base.store(uart_register::baudHigh, BaudRate::high9600);
-
-	base.store(uart_register::lineControl,
-			line_control::dataBits(DataBits::charLen8)
-			| line_control::stopBit(StopBits::one)
-			| line_control::parityBits(Parity::none)
-			| line_control::dlab(false));
-
 	runTerminal();
 	handleIrqs();
 	async::run_forever(helix::currentDispatcher);
@@ -46,6 +46,13 @@ enum class FifoCtrl {
 	triggerLvl14 = 3,
 };
 
+// Values of the FIFO status bits of the IRQ identification register.
+enum class FifoStatus {
+	none = 0,
+	unusable = 2,
+	enabled = 3
+};
+
 enum class IrqCtrl {
 	disable = 0,
 	enable = 1
@@ -79,6 +86,10 @@ namespace irq_enable {
 
 namespace fifo_control {
 	arch::field<uint8_t, FifoCtrl> fifoEnable(0, 1);
+	arch::field<uint8_t, bool> clearRx(1, 1);
+	arch::field<uint8_t, bool> clearTx(2, 1);
+	// 16750 only; can only be written while line_control::dlab is set.
+	arch::field<uint8_t, bool> enable64(5, 1);
 	arch::field<uint8_t, FifoCtrl> fifoIrqLvl(6, 2);
 }
 
@@ -97,4 +108,6 @@ namespace line_status {
 namespace irq_ident_register {
 	arch::field<uint8_t, bool> ignore(0, 1);
 	arch::field<uint8_t, IrqIds> id(1, 3);
+	arch::field<uint8_t, bool> fifo64(5, 1);
+	arch::field<uint8_t, FifoStatus> fifoStatus(6, 2);
 }
@@ -44,6 +44,24 @@ struct Element {
 	bool disabled;
 };
 
+// -----------------------------------------------------
+// Report extraction plan.
+// -----------------------------------------------------
+
+// Extracts the values of one field from a report. Steps are compiled once
+// from the fields such that reports do not need to walk the fields again.
+struct ReportStep {
+	FieldType type; // Either variable or array.
+	unsigned int bitOffset;
+	int bitSize;
+	bool isSigned;
+	int dataMin;
+	int dataMax;
+	int arraySize;
+	// Index of the (first) element that the field reports.
+	size_t element;
+};
+
 // -----------------------------------------------------
 // HidDevice.
 // -----------------------------------------------------
@@ -57,5 +75,16 @@ struct HidDevice {
 	std::vector<Element> elements;
 
 private:
+	// Builds _plan from fields and elements.
+	void _compilePlan();
+	// Translates a report into input events.
+	void _processReport(uint8_t *report, size_t size);
+
+	std::vector<ReportStep> _plan;
+	// Size of a report in bits.
+	unsigned int _reportBits = 0;
+	// Scratch space for array fields.
+	std::vector<bool> _arrayUsages;
+
 	std::shared_ptr<libevbackend::EventDevice> _eventDev;
 };
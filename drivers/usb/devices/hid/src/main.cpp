@@ -1,4 +1,4 @@
-
+#include <algorithm>
 #include <deque>
 #include <experimental/optional>
 #include <iostream>
@@ -21,6 +21,10 @@
 #include "hid.hpp"
 
 namespace {
+	// Number of interrupt IN transfers that are kept queued, such that
+	// no report is missed while the previous one is processed.
+	constexpr size_t numReportBuffers = 4;
+
 	constexpr bool logDescriptorParser = false;
 	constexpr bool logUnknownCodes = false;
 	constexpr bool logFields = false;
@@ -192,42 +196,54 @@ int32_t signExtend(uint32_t x, int bits) {
 	return (x ^ m) - m;
 }
 
-void interpret(const std::vector<Field> &fields, uint8_t *report, size_t size,
-		std::vector<std::pair<bool, int32_t>> &values) {
-	int k = 0; // Offset of the value that we're generating.
+uint32_t extractBits(uint8_t *report, size_t size, unsigned int bit_offset,
+		unsigned int bit_size) {
+	assert(bit_offset + bit_size <= size * 8);
+
+	unsigned int b = bit_offset / 8;
+	uint32_t word = uint32_t(report[b]);
+	if(b + 1 < size)
+		word |= uint32_t(report[b + 1]) << 8;
+	if(b + 2 < size)
+		word |= uint32_t(report[b + 2]) << 16;
+	if(b + 3 < size)
+		word |= uint32_t(report[b + 3]) << 24;
+
+	uint32_t mask = (uint32_t(1) << bit_size) - 1;
+	return (word >> (bit_offset % 8)) & mask;
+}
+
+struct LocalState {
+	std::vector<uint32_t> usage;
+	std::experimental::optional<uint32_t> usageMin;
+	std::experimental::optional<uint32_t> usageMax;
+};
 
+struct GlobalState {
+	std::experimental::optional<uint16_t> usagePage;
+	std::experimental::optional<std::pair<int32_t, uint32_t>> logicalMin;
+	std::experimental::optional<std::pair<int32_t, uint32_t>> logicalMax;
+	std::experimental::optional<unsigned int> reportSize;
+	std::experimental::optional<unsigned int> reportCount;
+	std::experimental::optional<int> physicalMin;
+	std::experimental::optional<int> physicalMax;
+};
+
+HidDevice::HidDevice() {
+	_eventDev = std::make_shared<libevbackend::EventDevice>();
+}
+
+void HidDevice::_compilePlan() {
 	unsigned int bit_offset = 0;
-	auto fetch = [&] (unsigned int bit_size, bool is_signed) -> int32_t {
-		assert(bit_offset + bit_size <= size * 8);
-
-		unsigned int b = bit_offset / 8;
-		assert(b < size);
-		uint32_t word = uint32_t(report[b]);
-		if(b + 1 < size)
-			word |= uint32_t(report[b + 1]) << 8;
-		if(b + 2 < size)
-			word |= uint32_t(report[b + 2]) << 16;
-		if(b + 3 < size)
-			word |= uint32_t(report[b + 3]) << 24;
-
-		uint32_t mask = (uint32_t(1) << bit_size) - 1;
-		uint32_t raw = (word >> (bit_offset % 8)) & mask;
-//			std::cout << "bit_offset: " << bit_offset << ", raw: " << raw << std::endl;
-		bit_offset += bit_size;
-
-		if(is_signed) {
-			return signExtend(raw, bit_size);
-		}else{
-			auto data = static_cast<int32_t>(raw);
-			assert(data >= 0);
-			return data;
-		}
+	size_t k = 0; // Index of the element that the current field reports.
+
+	auto reported = [&] (size_t i) {
+		return elements[i].inputType >= 0 && !elements[i].disabled;
 	};
 
 	for(const Field &f : fields) {
 		if(f.type == FieldType::padding) {
-			for(int i = 0; i < f.arraySize; i++)
-				fetch(f.bitSize, false);
+			bit_offset += f.bitSize * f.arraySize;
 			continue;
 		}
 
@@ -235,47 +251,80 @@ void interpret(const std::vector<Field> &fields, uint8_t *report, size_t size,
 
 		if(f.type == FieldType::array) {
 			assert(!f.isSigned);
-			for(int i = 0; i < f.dataMax - f.dataMin + 1; i++)
-				values[k + i] = {true, 0};
-			
-			for(int i = 0; i < f.arraySize; i++) {
-				auto data = fetch(f.bitSize, false);
-				if(!(data >= f.dataMin && data <= f.dataMax))
-					continue;
-
-				values[k + data - f.dataMin] = {true, 1};
-			}
-			k += f.dataMax - f.dataMin + 1;
+			size_t n = f.dataMax - f.dataMin + 1;
+			bool any = false;
+			for(size_t i = 0; i < n; i++)
+				any = any || reported(k + i);
+			if(any)
+				_plan.push_back({FieldType::array, bit_offset, f.bitSize, false,
+						f.dataMin, f.dataMax, f.arraySize, k});
+			_arrayUsages.resize(std::max(_arrayUsages.size(), n));
+			bit_offset += f.bitSize * f.arraySize;
+			k += n;
 		}else{
 			assert(f.type == FieldType::variable);
-			auto data = fetch(f.bitSize, f.isSigned);
-			if(data >= f.dataMin && data <= f.dataMax)
-				values[k] = {true, data};
+			if(reported(k))
+				_plan.push_back({FieldType::variable, bit_offset, f.bitSize, f.isSigned,
+						f.dataMin, f.dataMax, 1, k});
+			bit_offset += f.bitSize;
 			k++;
 		}
 	}
+	assert(k == elements.size());
 
-	assert(bit_offset == size * 8);
+	_reportBits = bit_offset;
 }
 
-struct LocalState {
-	std::vector<uint32_t> usage;
-	std::experimental::optional<uint32_t> usageMin;
-	std::experimental::optional<uint32_t> usageMax;
-};
+void HidDevice::_processReport(uint8_t *report, size_t size) {
+	if(size * 8 < _reportBits) {
+		std::cout << "usb-hid: Ignoring short report of " << size << " bytes" << std::endl;
+		return;
+	}
 
-struct GlobalState {
-	std::experimental::optional<uint16_t> usagePage;
-	std::experimental::optional<std::pair<int32_t, uint32_t>> logicalMin;
-	std::experimental::optional<std::pair<int32_t, uint32_t>> logicalMax;
-	std::experimental::optional<unsigned int> reportSize;
-	std::experimental::optional<unsigned int> reportCount;
-	std::experimental::optional<int> physicalMin;
-	std::experimental::optional<int> physicalMax;
-};
+	auto emit = [&] (size_t i, int32_t value) {
+		auto element = &elements[i];
+		if(logFieldValues)
+			std::cout << "usagePage: " << element->usagePage
+					<< ", usageId: 0x" << std::hex << element->usageId << std::dec
+					<< ", value: " << value << std::endl;
+		if(element->inputType < 0 || element->disabled)
+			return;
+		if(logInputCodes)
+			std::cout << "    inputType: " << element->inputType
+					<< ", inputCode: " << element->inputCode
+					<< ", value: " << value << std::endl;
 
-HidDevice::HidDevice() {
-	_eventDev = std::make_shared<libevbackend::EventDevice>();
+		_eventDev->emitEvent(element->inputType, element->inputCode, value);
+	};
+
+	for(const ReportStep &step : _plan) {
+		if(step.type == FieldType::array) {
+			size_t n = step.dataMax - step.dataMin + 1;
+			std::fill(_arrayUsages.begin(), _arrayUsages.begin() + n, false);
+			for(int i = 0; i < step.arraySize; i++) {
+				auto data = static_cast<int32_t>(extractBits(report, size,
+						step.bitOffset + i * step.bitSize, step.bitSize));
+				if(data >= step.dataMin && data <= step.dataMax)
+					_arrayUsages[data - step.dataMin] = true;
+			}
+			for(size_t i = 0; i < n; i++)
+				emit(step.element + i, _arrayUsages[i]);
+		}else{
+			auto raw = extractBits(report, size, step.bitOffset, step.bitSize);
+			int32_t data;
+			if(step.isSigned) {
+				data = signExtend(raw, step.bitSize);
+			}else{
+				data = static_cast<int32_t>(raw);
+				assert(data >= 0);
+			}
+			if(data >= step.dataMin && data <= step.dataMax)
+				emit(step.element, data);
+		}
+	}
+
+	_eventDev->emitEvent(EV_SYN, SYN_REPORT, 0);
+	_eventDev->notify();
 }
 
 void HidDevice::parseReportDescriptor(Device, uint8_t *p, uint8_t* limit) {
@@ -583,6 +632,8 @@ async::detached HidDevice::run(Device device, int config_num, int intf_num) {
 		_eventDev->enableEvent(element->inputType, element->inputCode);
 	}
 
+	_compilePlan();
+
 	if(logFields)
 		for(size_t i = 0; i < fields.size(); i++) {
 			std::cout << "Field " << i << ": [" << fields[i].arraySize
@@ -615,61 +666,38 @@ async::detached HidDevice::run(Device device, int config_num, int intf_num) {
 	// Read reports from the USB device.
 	std::cout << "usb-hid: Entering report loop" << std::endl;
 
-	std::vector<std::pair<bool, int32_t>> values;
-	values.resize(elements.size());
-	while(true) {
-//		std::cout << "usb-hid: Requesting new report" << std::endl;
-		arch::dma_buffer report{device.bufferPool(), in_endp_pktsize};
-		InterruptTransfer transfer{XferFlags::kXferToHost, report};
+	TransferQueue queue{endp, numReportBuffers};
+	std::vector<arch::dma_buffer> reports;
+	for(size_t i = 0; i < numReportBuffers; i++)
+		reports.emplace_back(device.bufferPool(), in_endp_pktsize);
+
+	// The queue invokes the callbacks in order, hence buffers are reused in order, too.
+	for(size_t n = 0; ; n++) {
+		auto report = &reports[n % numReportBuffers];
+		InterruptTransfer transfer{XferFlags::kXferToHost, *report};
 		transfer.allowShortPackets = true;
-		auto length = (co_await endp.transfer(transfer)).unwrap();
+		co_await queue.submit(transfer, [this, report, in_endp_pktsize] (auto outcome) {
+			assert(outcome);
+			auto length = outcome.value();
 
-		// Some devices (e.g. bochs) send empty packets instead of NAKs.
-		if(!length)
-			continue;
-		
-		if(logRawPackets) {
-			std::cout << "usb-hid: Report size: " << length
-					<< " (packet size is " << in_endp_pktsize << ")" << std::endl;
-			std::cout << "usb-hid: Packet:";
-			std::cout << std::hex;
-			for(size_t i = 0; i < 4; i++)
-				std::cout << " " << (int)reinterpret_cast<uint8_t *>(report.data())[i];
-			std::cout << std::dec << std::endl;
-		}
+			// Some devices (e.g. bochs) send empty packets instead of NAKs.
+			if(!length)
+				return;
 
-		std::fill(values.begin(), values.end(), std::pair<bool, int32_t>{false, 0});
-		interpret(fields, reinterpret_cast<uint8_t *>(report.data()),
-				length, values);
-	
-		if(logFieldValues) {
-			for(size_t i = 0; i < values.size(); i++)
-				if(values[i].first)
-					std::cout << "usagePage: " << elements[i].usagePage
-							<< ", usageId: 0x" << std::hex << elements[i].usageId << std::dec
-							<< ", value: " << values[i].second << std::endl;
-			std::cout << std::endl;
-		}
+			if(logRawPackets) {
+				std::cout << "usb-hid: Report size: " << length
+						<< " (packet size is " << in_endp_pktsize << ")" << std::endl;
+				std::cout << "usb-hid: Packet:";
+				std::cout << std::hex;
+				for(size_t i = 0; i < 4; i++)
+					std::cout << " " << (int)reinterpret_cast<uint8_t *>(report->data())[i];
+				std::cout << std::dec << std::endl;
+			}
 
-		if(logInputCodes)
-			std::cout << "Reporting input event" << std::endl;
-		for(size_t i = 0; i < values.size(); i++) {
-			auto element = &elements[i];
-			if(element->inputType < 0)
-				continue;
-			if(!values[i].first)
-				continue;
-			if(element->disabled)
-				continue;
 			if(logInputCodes)
-				std::cout << "    inputType: " << element->inputType
-						<< ", inputCode: " << element->inputCode
-						<< ", value: " << values[i].second << std::endl;
-
-			_eventDev->emitEvent(element->inputType, element->inputCode, values[i].second);
-		}
-		_eventDev->emitEvent(EV_SYN, SYN_REPORT, 0);
-		_eventDev->notify();
+				std::cout << "Reporting input event" << std::endl;
+			_processReport(reinterpret_cast<uint8_t *>(report->data()), length);
+		});
 	}
 }
 
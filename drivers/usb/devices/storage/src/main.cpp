@@ -24,6 +24,72 @@ namespace {
 	constexpr bool enableRead6 = false;
 }
 
+namespace scsi {
+
+uint8_t buildCommand(blockfs::BlockOp op, uint32_t flags, uint64_t sector,
+		size_t numSectors, uint8_t *cdb) {
+	uint8_t length;
+	if(op == blockfs::BlockOp::flush) {
+		scsi::SynchronizeCache10 command;
+		memset(&command, 0, sizeof(scsi::SynchronizeCache10));
+		command.opCode = 0x35; // Zero LBA and length: synchronize everything.
+
+		length = sizeof(scsi::SynchronizeCache10);
+		memcpy(cdb, &command, sizeof(scsi::SynchronizeCache10));
+	}else if(op == blockfs::BlockOp::read) {
+		if(enableRead6 && sector <= 0x1FFFFF && numSectors <= 0xFF) {
+			scsi::Read6 command;
+			memset(&command, 0, sizeof(scsi::Read6));
+			command.opCode = 0x08;
+			command.lba[0] = sector >> 16;
+			command.lba[1] = (sector >> 8) & 0xFF;
+			command.lba[2] = sector & 0xFF;
+			command.transferLength = numSectors;
+
+			length = sizeof(scsi::Read6);
+			memcpy(cdb, &command, sizeof(scsi::Read6));
+		}else if(sector <= 0xFFFFFFFF) {
+			scsi::Read10 command;
+			memset(&command, 0, sizeof(scsi::Read10));
+			command.opCode = 0x28;
+			command.lba[0] = sector >> 24;
+			command.lba[1] = (sector >> 16) & 0xFF;
+			command.lba[2] = (sector >> 8) & 0xFF;
+			command.lba[3] = sector & 0xFF;
+			command.transferLength[0] = numSectors >> 8;
+			command.transferLength[1] = numSectors & 0xFF;
+
+			length = sizeof(scsi::Read10);
+			memcpy(cdb, &command, sizeof(scsi::Read10));
+		}else{
+			throw std::logic_error("USB storage does not currently support high LBAs!");
+		}
+	}else{
+		if(sector <= 0xFFFFFFFF) {
+			scsi::Write10 command;
+			memset(&command, 0, sizeof(scsi::Write10));
+			command.opCode = 0x2A;
+			if(flags & blockfs::kBlockFua)
+				command.options |= scsi::kWriteFua;
+			command.lba[0] = sector >> 24;
+			command.lba[1] = (sector >> 16) & 0xFF;
+			command.lba[2] = (sector >> 8) & 0xFF;
+			command.lba[3] = sector & 0xFF;
+			command.transferLength[0] = numSectors >> 8;
+			command.transferLength[1] = numSectors & 0xFF;
+
+			length = sizeof(scsi::Write10);
+			memcpy(cdb, &command, sizeof(scsi::Write10));
+		}else{
+			throw std::logic_error("USB storage does not currently support high LBAs!");
+		}
+	}
+
+	return length;
+}
+
+} // namespace scsi
+
 async::detached StorageDevice::run(int config_num, int intf_num) {
 	auto descriptor = (co_await _usbDevice.configurationDescriptor()).unwrap();
 
@@ -32,6 +98,9 @@ async::detached StorageDevice::run(int config_num, int intf_num) {
 
 	walkConfiguration(descriptor, [&] (int type, size_t, void *, const auto &info) {
 		if(type == descriptor_type::endpoint) {
+			// UAS devices have additional endpoints in another alternative setting.
+			if(info.interfaceNumber.value() != intf_num || info.interfaceAlternative.value())
+				return;
 			if(info.endpointIn.value()) {
 				in_endp_number = info.endpointNumber.value();
 			}else if(!info.endpointIn.value()) {
@@ -61,9 +130,11 @@ async::detached StorageDevice::run(int config_num, int intf_num) {
 			auto req = &_queue.front();
 			_queue.pop_front();
 
+			bool isWrite = req->op == blockfs::BlockOp::write;
 			if(logRequests)
-				std::cout << "block-usb: Reading " << req->numSectors << " sectors" << std::endl;
-			assert(req->numSectors);
+				std::cout << "block-usb: " << (isWrite ? "Writing " : "Reading ")
+						<< req->numSectors << " sectors" << std::endl;
+			assert(req->op == blockfs::BlockOp::flush || req->numSectors);
 			assert(req->numSectors <= 0xFFFF);
 
 			CommandBlockWrapper cbw;
@@ -71,59 +142,15 @@ async::detached StorageDevice::run(int config_num, int intf_num) {
 			cbw.signature = Signatures::kSignCbw;
 			cbw.tag = 1;
 			cbw.transferLength = req->numSectors * 512;
-			if(!req->isWrite) {
+			if(req->op == blockfs::BlockOp::read) {
 				cbw.flags = 0x80; // Direction: Device-to-Host.
 			}else{
 				cbw.flags = 0; // Direction: Host-to-Device.
 			}
 			cbw.lun = 0;
 
-			if(!req->isWrite) {
-				if(enableRead6 && req->sector <= 0x1FFFFF && req->numSectors <= 0xFF) {
-					scsi::Read6 command;
-					memset(&command, 0, sizeof(scsi::Read6));
-					command.opCode = 0x08;
-					command.lba[0] = req->sector >> 16;
-					command.lba[1] = (req->sector >> 8) & 0xFF;
-					command.lba[2] = req->sector & 0xFF;
-					command.transferLength = req->numSectors;
-
-					cbw.cmdLength = sizeof(scsi::Read6);
-					memcpy(cbw.cmdData, &command, sizeof(scsi::Read6));
-				}else if(req->sector <= 0xFFFFFFFF) {
-					scsi::Read10 command;
-					memset(&command, 0, sizeof(scsi::Read10));
-					command.opCode = 0x28;
-					command.lba[0] = req->sector >> 24;
-					command.lba[1] = (req->sector >> 16) & 0xFF;
-					command.lba[2] = (req->sector >> 8) & 0xFF;
-					command.lba[3] = req->sector & 0xFF;
-					command.transferLength[0] = req->numSectors >> 8;
-					command.transferLength[1] = req->numSectors & 0xFF;
-
-					cbw.cmdLength = sizeof(scsi::Read10);
-					memcpy(cbw.cmdData, &command, sizeof(scsi::Read10));
-				}else{
-					throw std::logic_error("USB storage does not currently support high LBAs!");
-				}
-			}else{
-				if(req->sector <= 0xFFFFFFFF) {
-					scsi::Write10 command;
-					memset(&command, 0, sizeof(scsi::Write10));
-					command.opCode = 0x2A;
-					command.lba[0] = req->sector >> 24;
-					command.lba[1] = (req->sector >> 16) & 0xFF;
-					command.lba[2] = (req->sector >> 8) & 0xFF;
-					command.lba[3] = req->sector & 0xFF;
-					command.transferLength[0] = req->numSectors >> 8;
-					command.transferLength[1] = req->numSectors & 0xFF;
-
-					cbw.cmdLength = sizeof(scsi::Write10);
-					memcpy(cbw.cmdData, &command, sizeof(scsi::Write10));
-				}else{
-					throw std::logic_error("USB storage does not currently support high LBAs!");
-				}
-			}
+			cbw.cmdLength = scsi::buildCommand(req->op, req->flags, req->sector,
+					req->numSectors, cbw.cmdData);
 
 			// TODO: Respect USB device DMA requirements.
 
@@ -139,16 +166,20 @@ async::detached StorageDevice::run(int config_num, int intf_num) {
 
 			if(logSteps)
 				std::cout << "block-usb: Waiting for data" << std::endl;
-			if(!req->isWrite) {
-				BulkTransfer data_info{XferFlags::kXferToHost,
-						arch::dma_buffer_view{nullptr, req->buffer, req->numSectors * 512}};
-				// TODO: We want this to be lazy but that only works if can ensure that
-				// the next transaction is also posted to the queue.
-	//			data_info.lazyNotification = true;
-				(co_await endp_in.transfer(data_info)).unwrap();
-			}else{
-				(co_await endp_out.transfer(BulkTransfer{XferFlags::kXferToDevice,
-						arch::dma_buffer_view{nullptr, req->buffer, req->numSectors * 512}})).unwrap();
+			// Segments are multiples of 512 bytes (and thus of the packet size),
+			// hence the data stage can be split into one transfer per segment.
+			for(auto &segment : req->segments) {
+				arch::dma_buffer_view view{nullptr, segment.buffer, segment.numSectors * 512};
+				if(!isWrite) {
+					BulkTransfer data_info{XferFlags::kXferToHost, view};
+					// TODO: We want this to be lazy but that only works if can ensure that
+					// the next transaction is also posted to the queue.
+		//			data_info.lazyNotification = true;
+					(co_await endp_in.transfer(data_info)).unwrap();
+				}else{
+					(co_await endp_out.transfer(BulkTransfer{XferFlags::kXferToDevice,
+							view})).unwrap();
+				}
 			}
 
 			if(logSteps)
@@ -177,18 +208,51 @@ async::detached StorageDevice::run(int config_num, int intf_num) {
 
 async::result<void> StorageDevice::readSectors(uint64_t sector,
 		void *buffer, size_t numSectors) {
-	Request req{false, sector, buffer, numSectors};
-	_queue.push_back(req);
-	_doorbell.raise();
-	co_await req.event.wait();
+	blockfs::BlockSegment segment{buffer, numSectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::read;
+	request.sector = sector;
+	request.numSectors = numSectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
 }
 
 async::result<void> StorageDevice::writeSectors(uint64_t sector,
 		const void *buffer, size_t numSectors) {
-	Request req{true, sector, const_cast<void *>(buffer), numSectors};
-	_queue.push_back(req);
-	_doorbell.raise();
-	co_await req.event.wait();
+	blockfs::BlockSegment segment{const_cast<void *>(buffer), numSectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::write;
+	request.sector = sector;
+	request.numSectors = numSectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
+}
+
+async::result<void> StorageDevice::submit(const blockfs::BlockRequest &request) {
+	if(request.op == blockfs::BlockOp::flush) {
+		Request req{request.op, request.flags, 0, {}, 0};
+		_queue.push_back(req);
+		_doorbell.raise();
+		co_await req.event.wait();
+		co_return;
+	}
+
+	// TODO: Support discards through UNMAP (if the device supports it).
+	if(request.op == blockfs::BlockOp::discard)
+		co_return;
+
+	if(request.op == blockfs::BlockOp::writeZeroes) {
+		co_await BlockDevice::submit(request);
+		co_return;
+	}
+
+	blockfs::SplitRequest split{request, 512, limits};
+	for(auto &part : split.parts) {
+		Request req{part.op, part.flags, part.sector, part.segments, part.numSectors};
+		_queue.push_back(req);
+		_doorbell.raise();
+		co_await req.event.wait();
+	}
 }
 
 async::result<size_t> StorageDevice::getSize() {
@@ -205,6 +269,7 @@ async::detached bindDevice(mbus::Entity entity) {
 	std::experimental::optional<int> intf_class;
 	std::experimental::optional<int> intf_subclass;
 	std::experimental::optional<int> intf_protocol;
+	std::experimental::optional<int> uas_alternative;
 
 	if(logEnumeration)
 		std::cout << "block-usb: Getting configuration descriptor" << std::endl;
@@ -220,6 +285,13 @@ async::detached bindDevice(mbus::Entity entity) {
 			assert(!config_number);
 			config_number = info.configNumber.value();
 		}else if(type == descriptor_type::interface) {
+			auto desc = (InterfaceDescriptor *)p;
+			if(intf_number && info.interfaceNumber.value() == intf_number.value()) {
+				if(desc->interfaceClass == 0x08 && desc->interfaceSubClass == 0x06
+						&& desc->interfaceProtocoll == 0x62)
+					uas_alternative = info.interfaceAlternative.value();
+				return;
+			}
 			if(intf_number) {
 				std::cout << "block-usb: Ignoring interface "
 						<< info.interfaceNumber.value() << std::endl;
@@ -233,10 +305,11 @@ async::detached bindDevice(mbus::Entity entity) {
 			assert(!intf_class);
 			assert(!intf_subclass);
 			assert(!intf_protocol);
-			auto desc = (InterfaceDescriptor *)p;
 			intf_class = desc->interfaceClass;
 			intf_subclass = desc->interfaceSubClass;
 			intf_protocol = desc->interfaceProtocoll;
+			if(intf_protocol.value() == 0x62)
+				uas_alternative = info.interfaceAlternative.value();
 		}
 	});
 
@@ -247,12 +320,25 @@ async::detached bindDevice(mbus::Entity entity) {
 				<< std::dec << std::endl;
 	if(intf_class.value() != 0x08
 			|| intf_subclass.value() != 0x06
-			|| intf_protocol.value() != 0x50)
+			|| (intf_protocol.value() != 0x50 && !uas_alternative))
 		co_return;
 
 	if(logEnumeration)
 		std::cout << "block-usb: Detected USB device" << std::endl;
 
+	if(uas_alternative) {
+		auto uas_device = co_await UasStorageDevice::create(device, config_number.value(),
+				intf_number.value(), uas_alternative.value());
+		if(uas_device) {
+			std::cout << "block-usb: Using USB Attached SCSI" << std::endl;
+			blockfs::runDevice(uas_device);
+			co_return;
+		}
+		if(intf_protocol.value() != 0x50)
+			co_return;
+		std::cout << "block-usb: Falling back to bulk-only transport" << std::endl;
+	}
+
 	auto storage_device = new StorageDevice(device);
 	storage_device->run(config_number.value(), intf_number.value());
 	blockfs::runDevice(storage_device);
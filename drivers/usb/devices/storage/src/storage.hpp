@@ -3,6 +3,10 @@
 #include <async/oneshot-event.hpp>
 #include <async/result.hpp>
 #include <blockfs.hpp>
+#include <span>
+#include <vector>
+#include <arch/dma_structs.hpp>
+#include <protocols/usb/api.hpp>
 #include <boost/intrusive/list.hpp>
 
 enum Signatures {
@@ -59,6 +63,21 @@ struct Write10 {
 };
 static_assert(sizeof(Write10) == 10);
 
+// Bits of Write10::options.
+enum {
+	kWriteFua = 1 << 3
+};
+
+struct SynchronizeCache10 {
+	uint8_t opCode;
+	uint8_t options;
+	uint8_t lba[4];
+	uint8_t groupNumber;
+	uint8_t numBlocks[2];
+	uint8_t control;
+};
+static_assert(sizeof(SynchronizeCache10) == 10);
+
 struct Read12 {
 	uint8_t opCode;
 	uint8_t options;
@@ -93,12 +112,88 @@ struct Read32 {
 	uint8_t transferLength[4];
 };
 
+// Fills in the CDB for a read, write or flush; returns its length.
+uint8_t buildCommand(blockfs::BlockOp op, uint32_t flags, uint64_t sector,
+		size_t numSectors, uint8_t *cdb);
+
 } // namespace scsi
 
+namespace uas {
+
+enum IuId : uint8_t {
+	kIuCommand = 0x01,
+	kIuSense = 0x03,
+	kIuResponse = 0x04,
+	kIuTaskManagement = 0x05,
+	kIuReadReady = 0x06,
+	kIuWriteReady = 0x07
+};
+
+enum PipeId : uint8_t {
+	kPipeCommand = 1,
+	kPipeStatus = 2,
+	kPipeDataIn = 3,
+	kPipeDataOut = 4
+};
+
+// Class-specific descriptor that follows each endpoint of the UAS alternative setting.
+inline constexpr uint8_t pipeUsageDescriptor = 0x24;
+
+struct [[ gnu::packed ]] PipeUsage {
+	uint8_t length;
+	uint8_t descriptorType;
+	uint8_t pipeId;
+	uint8_t reserved;
+};
+static_assert(sizeof(PipeUsage) == 4);
+
+// Multi-byte fields of information units are big endian.
+struct [[ gnu::packed ]] CommandIu {
+	uint8_t iuId;
+	uint8_t reserved0;
+	uint8_t tag[2];
+	uint8_t taskAttribute;
+	uint8_t reserved1;
+	uint8_t additionalCdbLength;
+	uint8_t reserved2;
+	uint8_t lun[8];
+	uint8_t cdb[16];
+};
+static_assert(sizeof(CommandIu) == 32);
+
+struct [[ gnu::packed ]] SenseIu {
+	uint8_t iuId;
+	uint8_t reserved0;
+	uint8_t tag[2];
+	uint8_t statusQualifier[2];
+	uint8_t status;
+	uint8_t reserved1[7];
+	uint8_t senseLength[2];
+	uint8_t senseData[96];
+};
+static_assert(sizeof(SenseIu) == 112);
+
+struct [[ gnu::packed ]] ResponseIu {
+	uint8_t iuId;
+	uint8_t reserved0;
+	uint8_t tag[2];
+	uint8_t additionalInfo[3];
+	uint8_t responseCode;
+};
+static_assert(sizeof(ResponseIu) == 8);
+
+} // namespace uas
+
 struct StorageDevice : blockfs::BlockDevice {
 	//TODO(geert): hook up USB to sysfs too
 	StorageDevice(Device usb_device)
-	: blockfs::BlockDevice(512, -1), _usbDevice(std::move(usb_device)) { }
+	: blockfs::BlockDevice(512, -1), _usbDevice(std::move(usb_device)) {
+		// The bulk-only transport processes one command at a time.
+		// We use the same transfer size limit as Linux.
+		limits.queueDepth = 1;
+		limits.maxSegments = 64;
+		limits.maxSectors = 240;
+	}
 
 	async::detached run(int config_num, int intf_num);
 
@@ -108,16 +203,21 @@ struct StorageDevice : blockfs::BlockDevice {
 	async::result<void> writeSectors(uint64_t sector,
 			const void *buffer, size_t numSectors) override;
 
+	async::result<void> submit(const blockfs::BlockRequest &request) override;
+
 	async::result<size_t> getSize() override;
 
 private:
 	struct Request {
-		Request(bool isWrite, uint64_t sector, void *buffer, size_t numSectors)
-		: isWrite{isWrite}, sector{sector}, buffer{buffer}, numSectors{numSectors} { }
+		Request(blockfs::BlockOp op, uint32_t flags, uint64_t sector,
+				std::span<const blockfs::BlockSegment> segments, size_t numSectors)
+		: op{op}, flags{flags}, sector{sector}, segments{segments}, numSectors{numSectors} { }
 
-		bool isWrite;
+		blockfs::BlockOp op;
+		uint32_t flags;
 		uint64_t sector;
-		void *buffer;
+		// The data stage consists of one bulk transfer per segment.
+		std::span<const blockfs::BlockSegment> segments;
 		size_t numSectors;
 		async::oneshot_event event;
 		boost::intrusive::list_member_hook<> requestHook;
@@ -136,3 +236,48 @@ private:
 	> _queue;
 };
 
+// USB Attached SCSI. Each command is tagged with a stream ID; the status and
+// data stages of different commands are multiplexed by the host controller.
+struct UasStorageDevice : blockfs::BlockDevice {
+	// Switches the interface to the UAS alternative setting. Returns nullptr
+	// (after switching back) if the controller cannot provide bulk streams.
+	static async::result<UasStorageDevice *> create(Device usb_device, int config_num,
+			int intf_num, int alternative);
+
+	UasStorageDevice(Device usb_device, Endpoint command, Endpoint status,
+			Endpoint data_in, Endpoint data_out, size_t num_tags);
+
+	async::result<void> readSectors(uint64_t sector,
+			void *buffer, size_t numSectors) override;
+
+	async::result<void> writeSectors(uint64_t sector,
+			const void *buffer, size_t numSectors) override;
+
+	async::result<void> submit(const blockfs::BlockRequest &request) override;
+
+	async::result<size_t> getSize() override;
+
+private:
+	struct Command {
+		uint16_t tag;
+		arch::dma_object<uas::CommandIu> iu{nullptr};
+		arch::dma_object<uas::SenseIu> status{nullptr};
+		size_t statusLength = 0;
+		async::oneshot_event statusReceived;
+	};
+
+	async::detached _receiveStatus(Command *cmd);
+
+	async::result<void> _issue(const blockfs::BlockRequest &request);
+
+	Device _usbDevice;
+	Endpoint _commandPipe;
+	Endpoint _statusPipe;
+	Endpoint _dataInPipe;
+	Endpoint _dataOutPipe;
+
+	// Tags double as stream IDs and thus start at one.
+	std::vector<uint16_t> _freeTags;
+	async::recurring_event _tagFreed;
+};
+
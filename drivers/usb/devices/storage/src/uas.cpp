@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <iostream>
+#include <optional>
+
+#include <assert.h>
+#include <string.h>
+
+#include <async/result.hpp>
+#include <protocols/usb/usb.hpp>
+#include <protocols/usb/api.hpp>
+
+#include "storage.hpp"
+
+namespace {
+	constexpr bool logRequests = false;
+
+	// Each tag costs a transfer ring per stream pipe in the host controller.
+	constexpr size_t maxTags = 32;
+}
+
+async::result<UasStorageDevice *> UasStorageDevice::create(Device usb_device,
+		int config_num, int intf_num, int alternative) {
+	auto descriptor = (co_await usb_device.configurationDescriptor()).unwrap();
+
+	// Each endpoint is followed by a pipe usage descriptor that determines its role.
+	int pipes[5] = {-1, -1, -1, -1, -1};
+	std::optional<int> endp_number;
+	walkConfiguration(descriptor, [&] (int type, size_t, void *p, const auto &info) {
+		if(!info.interfaceNumber || info.interfaceNumber.value() != intf_num
+				|| info.interfaceAlternative.value() != alternative)
+			return;
+
+		if(type == descriptor_type::endpoint) {
+			endp_number = info.endpointNumber.value();
+		}else if(type == uas::pipeUsageDescriptor) {
+			auto usage = reinterpret_cast<uas::PipeUsage *>(p);
+			if(endp_number && usage->pipeId >= uas::kPipeCommand
+					&& usage->pipeId <= uas::kPipeDataOut)
+				pipes[usage->pipeId] = endp_number.value();
+		}
+	});
+
+	for(int i = uas::kPipeCommand; i <= uas::kPipeDataOut; i++) {
+		if(pipes[i] < 0) {
+			std::cout << "block-usb: UAS interface lacks pipe " << i << std::endl;
+			co_return nullptr;
+		}
+	}
+
+	auto config = (co_await usb_device.useConfiguration(config_num)).unwrap();
+	auto intf = (co_await config.useInterface(intf_num, alternative)).unwrap();
+	auto command = (co_await intf.getEndpoint(PipeType::out, pipes[uas::kPipeCommand])).unwrap();
+	auto status = (co_await intf.getEndpoint(PipeType::in, pipes[uas::kPipeStatus])).unwrap();
+	auto data_in = (co_await intf.getEndpoint(PipeType::in, pipes[uas::kPipeDataIn])).unwrap();
+	auto data_out = (co_await intf.getEndpoint(PipeType::out, pipes[uas::kPipeDataOut])).unwrap();
+
+	// Without streams, the device would have to announce its data stages
+	// through READ READY and WRITE READY IUs; we use bulk-only transport instead.
+	size_t num_tags = maxTags;
+	for(auto *endp : {&status, &data_in, &data_out}) {
+		auto num_streams = (co_await endp->allocateStreams(num_tags)).unwrap();
+		num_tags = std::min(num_tags, num_streams);
+		if(!num_tags)
+			break;
+	}
+
+	if(!num_tags) {
+		std::cout << "block-usb: Host controller does not support bulk streams" << std::endl;
+		(co_await config.useInterface(intf_num, 0)).unwrap();
+		co_return nullptr;
+	}
+
+	co_return new UasStorageDevice{std::move(usb_device), std::move(command), std::move(status),
+			std::move(data_in), std::move(data_out), num_tags};
+}
+
+UasStorageDevice::UasStorageDevice(Device usb_device, Endpoint command, Endpoint status,
+		Endpoint data_in, Endpoint data_out, size_t num_tags)
+: blockfs::BlockDevice(512, -1), _usbDevice{std::move(usb_device)},
+		_commandPipe{std::move(command)}, _statusPipe{std::move(status)},
+		_dataInPipe{std::move(data_in)}, _dataOutPipe{std::move(data_out)} {
+	limits.queueDepth = num_tags;
+	limits.maxSegments = 64;
+	// A transfer of 256 KiB fits into a single xhci transfer ring.
+	limits.maxSectors = 512;
+
+	for(size_t i = num_tags; i >= 1; i--)
+		_freeTags.push_back(i);
+}
+
+async::detached UasStorageDevice::_receiveStatus(Command *cmd) {
+	BulkTransfer transfer{XferFlags::kXferToHost, cmd->status.view_buffer()};
+	transfer.allowShortPackets = true;
+	transfer.streamId = cmd->tag;
+	cmd->statusLength = (co_await _statusPipe.transfer(transfer)).unwrap();
+	cmd->statusReceived.raise();
+}
+
+async::result<void> UasStorageDevice::_issue(const blockfs::BlockRequest &request) {
+	while(_freeTags.empty())
+		co_await _tagFreed.async_wait();
+
+	Command cmd;
+	cmd.tag = _freeTags.back();
+	_freeTags.pop_back();
+
+	bool isWrite = request.op == blockfs::BlockOp::write;
+	if(logRequests)
+		std::cout << "block-usb: " << (isWrite ? "Writing " : "Reading ")
+				<< request.numSectors << " sectors with tag " << cmd.tag << std::endl;
+	assert(request.op == blockfs::BlockOp::flush || request.numSectors);
+	assert(request.numSectors <= 0xFFFF);
+
+	memset(cmd.iu.data(), 0, sizeof(uas::CommandIu));
+	cmd.iu->iuId = uas::kIuCommand;
+	cmd.iu->tag[0] = cmd.tag >> 8;
+	cmd.iu->tag[1] = cmd.tag & 0xFF;
+	cmd.iu->taskAttribute = 0; // Simple.
+	scsi::buildCommand(request.op, request.flags, request.sector,
+			request.numSectors, cmd.iu->cdb);
+
+	// Post the status stage first; it completes once the device sends the sense IU.
+	_receiveStatus(&cmd);
+
+	(co_await _commandPipe.transfer(BulkTransfer{XferFlags::kXferToDevice,
+			cmd.iu.view_buffer()})).unwrap();
+
+	// The device switches between streams on its own, so the segments can
+	// be transferred one after another without blocking other commands.
+	for(auto &segment : request.segments) {
+		arch::dma_buffer_view view{nullptr, segment.buffer, segment.numSectors * 512};
+		if(!isWrite) {
+			BulkTransfer transfer{XferFlags::kXferToHost, view};
+			transfer.streamId = cmd.tag;
+			(co_await _dataInPipe.transfer(transfer)).unwrap();
+		}else{
+			BulkTransfer transfer{XferFlags::kXferToDevice, view};
+			transfer.streamId = cmd.tag;
+			(co_await _dataOutPipe.transfer(transfer)).unwrap();
+		}
+	}
+
+	co_await cmd.statusReceived.wait();
+
+	_freeTags.push_back(cmd.tag);
+	_tagFreed.raise();
+
+	uint16_t tag = (cmd.status->tag[0] << 8) | cmd.status->tag[1];
+	if(cmd.statusLength < sizeof(uas::ResponseIu) || tag != cmd.tag) {
+		std::cout << "block-usb: Malformed status IU for tag " << cmd.tag << std::endl;
+		throw std::runtime_error("block-usb: Giving up");
+	}
+	if(cmd.status->iuId == uas::kIuResponse) {
+		auto response = reinterpret_cast<uas::ResponseIu *>(cmd.status.data());
+		std::cout << "block-usb: Response code 0x" << std::hex
+				<< (unsigned int)response->responseCode << std::dec
+				<< " for tag " << cmd.tag << std::endl;
+		throw std::runtime_error("block-usb: Giving up");
+	}
+	assert(cmd.status->iuId == uas::kIuSense);
+	if(cmd.status->status) {
+		std::cout << "block-usb: Error status 0x"
+				<< std::hex << (unsigned int)cmd.status->status << std::dec
+				<<  " in sense IU" << std::endl;
+		throw std::runtime_error("block-usb: Giving up");
+	}
+}
+
+async::result<void> UasStorageDevice::readSectors(uint64_t sector,
+		void *buffer, size_t numSectors) {
+	blockfs::BlockSegment segment{buffer, numSectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::read;
+	request.sector = sector;
+	request.numSectors = numSectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
+}
+
+async::result<void> UasStorageDevice::writeSectors(uint64_t sector,
+		const void *buffer, size_t numSectors) {
+	blockfs::BlockSegment segment{const_cast<void *>(buffer), numSectors};
+	blockfs::BlockRequest request;
+	request.op = blockfs::BlockOp::write;
+	request.sector = sector;
+	request.numSectors = numSectors;
+	request.segments = {&segment, 1};
+	co_await submit(request);
+}
+
+async::result<void> UasStorageDevice::submit(const blockfs::BlockRequest &request) {
+	if(request.op == blockfs::BlockOp::flush) {
+		co_await _issue(request);
+		co_return;
+	}
+
+	// TODO: Support discards through UNMAP (if the device supports it).
+	if(request.op == blockfs::BlockOp::discard)
+		co_return;
+
+	if(request.op == blockfs::BlockOp::writeZeroes) {
+		co_await BlockDevice::submit(request);
+		co_return;
+	}
+
+	blockfs::SplitRequest split{request, 512, limits};
+	for(auto &part : split.parts)
+		co_await _issue(part);
+}
+
+async::result<size_t> UasStorageDevice::getSize() {
+	std::cout << "usb: UasStorageDevice::getSize() is a stub!" << std::endl;
+	co_return 0;
+}
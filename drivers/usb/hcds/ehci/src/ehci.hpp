@@ -121,8 +121,9 @@ public:
 	static Transaction *_buildControl(XferFlags dir,
 			arch::dma_object_view<SetupPacket> setup, arch::dma_buffer_view buffer,
 			size_t max_packet_size);
+	// All segments except for the last one must be a multiple of the packet size.
 	static Transaction *_buildInterruptOrBulk(XferFlags dir,
-			arch::dma_buffer_view buffer, size_t max_packet_size,
+			std::span<const arch::dma_buffer_view> segments, size_t max_packet_size,
 			bool lazy_notification);
 
 
@@ -657,7 +657,7 @@ Controller::transfer(int address, PipeType type, int pipe,
 	}
 
 	auto transaction = _buildInterruptOrBulk(info.flags,
-			info.buffer, endpoint->maxPacketSize, info.lazyNotification);
+			{&info.buffer, 1}, endpoint->maxPacketSize, info.lazyNotification);
 	auto future = transaction->promise.get_future();
 	_linkTransaction(endpoint->queueEntity, transaction);
 	co_return *(co_await future.get());
@@ -677,7 +677,7 @@ Controller::transfer(int address, PipeType type, int pipe,
 	}
 
 	auto transaction = _buildInterruptOrBulk(info.flags,
-			info.buffer, endpoint->maxPacketSize, info.lazyNotification);
+			info.segments(), endpoint->maxPacketSize, info.lazyNotification);
 	auto future = transaction->promise.get_future();
 	_linkTransaction(endpoint->queueEntity, transaction);
 	co_return *(co_await future.get());
@@ -737,24 +737,31 @@ auto Controller::_buildControl(XferFlags dir,
 }
 
 auto Controller::_buildInterruptOrBulk(XferFlags dir,
-		arch::dma_buffer_view buffer, size_t max_packet_size,
+		std::span<const arch::dma_buffer_view> segments, size_t max_packet_size,
 		bool lazy_notification) -> Transaction * {
 	assert((dir == kXferToDevice) || (dir == kXferToHost));
 
 	// Maximum size that can be transferred in a single qTD starting from a certain offset.
 	// Note that we need to make sure that we do not generate short packets.
-	auto td_size = [&] (size_t offset) {
+	auto td_size = [&] (arch::dma_buffer_view buffer, size_t offset) {
 		auto misalign = ((uintptr_t)buffer.data() + offset) & 0xFFF;
 		auto available = 0x5000 - misalign;
 		return available - available % max_packet_size;
 	};
 
-	// Compute the number of required qTDs.
-	size_t num_data = 1;
-	auto projected = td_size(0);
-	while(projected < buffer.size()) {
-		projected += td_size(projected);
-		num_data++;
+	// Compute the number of required qTDs. qTDs never span multiple segments.
+	size_t num_data = 0;
+	size_t full_size = 0;
+	for(size_t s = 0; s < segments.size(); s++) {
+		auto buffer = segments[s];
+		assert(s + 1 == segments.size() || !(buffer.size() % max_packet_size));
+
+		size_t projected = 0;
+		do {
+			projected += td_size(buffer, projected);
+			num_data++;
+		} while(projected < buffer.size());
+		full_size += buffer.size();
 	}
 
 	if(logPackets)
@@ -763,51 +770,55 @@ auto Controller::_buildInterruptOrBulk(XferFlags dir,
 	// Finally construct each qTD.
 	arch::dma_array<TransferDescriptor> transfers{&schedulePool, num_data};
 
-	size_t progress = 0;
-	for(size_t i = 0; i < num_data; i++) {
-		size_t chunk = std::min(td_size(progress), buffer.size() - progress);
-		assert(chunk);
-		if(i + 1 < num_data) {
-			transfers[i].nextTd.store(td_ptr::ptr(schedulePointer(&transfers[i + 1])));
-		}else{
-			transfers[i].nextTd.store(td_ptr::terminate(true));
-		}
-		transfers[i].altTd.store(td_ptr::terminate(true));
-		transfers[i].status.store(td_status::active(true)
-				| td_status::pidCode(dir == kXferToDevice ? 0x00 : 0x01)
-				| td_status::interruptOnComplete(i + 1 == num_data && !lazy_notification)
-				| td_status::totalBytes(chunk));
-
-		transfers[i].bufferPtr0.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
-				+ progress)));
-		transfers[i].extendedPtr0.store(0);
-
-		auto misalign = ((uintptr_t)buffer.data() + progress) & 0xFFF;
-		if(progress + 0x1000 - misalign < buffer.size()) {
-			transfers[i].bufferPtr1.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
-					+ progress + 0x1000 - misalign)));
-			transfers[i].extendedPtr1.store(0);
-		}
-		if(progress + 0x2000 - misalign < buffer.size()) {
-			transfers[i].bufferPtr2.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
-					+ progress + 0x2000 - misalign)));
-			transfers[i].extendedPtr2.store(0);
-		}
-		if(progress + 0x3000 - misalign < buffer.size()) {
-			transfers[i].bufferPtr3.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
-					+ progress + 0x3000 - misalign)));
-			transfers[i].extendedPtr3.store(0);
-		}
-		if(progress + 0x4000 - misalign < buffer.size()) {
-			transfers[i].bufferPtr4.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
-					+ progress + 0x4000 - misalign)));
-			transfers[i].extendedPtr4.store(0);
-		}
-		progress += chunk;
+	size_t i = 0;
+	for(auto buffer : segments) {
+		size_t progress = 0;
+		do {
+			size_t chunk = std::min(td_size(buffer, progress), buffer.size() - progress);
+			assert(chunk || buffer.size() == 0);
+			if(i + 1 < num_data) {
+				transfers[i].nextTd.store(td_ptr::ptr(schedulePointer(&transfers[i + 1])));
+			}else{
+				transfers[i].nextTd.store(td_ptr::terminate(true));
+			}
+			transfers[i].altTd.store(td_ptr::terminate(true));
+			transfers[i].status.store(td_status::active(true)
+					| td_status::pidCode(dir == kXferToDevice ? 0x00 : 0x01)
+					| td_status::interruptOnComplete(i + 1 == num_data && !lazy_notification)
+					| td_status::totalBytes(chunk));
+
+			transfers[i].bufferPtr0.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
+					+ progress)));
+			transfers[i].extendedPtr0.store(0);
+
+			auto misalign = ((uintptr_t)buffer.data() + progress) & 0xFFF;
+			if(progress + 0x1000 - misalign < buffer.size()) {
+				transfers[i].bufferPtr1.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
+						+ progress + 0x1000 - misalign)));
+				transfers[i].extendedPtr1.store(0);
+			}
+			if(progress + 0x2000 - misalign < buffer.size()) {
+				transfers[i].bufferPtr2.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
+						+ progress + 0x2000 - misalign)));
+				transfers[i].extendedPtr2.store(0);
+			}
+			if(progress + 0x3000 - misalign < buffer.size()) {
+				transfers[i].bufferPtr3.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
+						+ progress + 0x3000 - misalign)));
+				transfers[i].extendedPtr3.store(0);
+			}
+			if(progress + 0x4000 - misalign < buffer.size()) {
+				transfers[i].bufferPtr4.store(td_buffer::bufferPtr(physicalPointer((char *)buffer.data()
+						+ progress + 0x4000 - misalign)));
+				transfers[i].extendedPtr4.store(0);
+			}
+			progress += chunk;
+			i++;
+		} while(progress < buffer.size());
 	}
-	assert(progress == buffer.size());
+	assert(i == num_data);
 
-	return new Transaction{std::move(transfers), buffer.size()};
+	return new Transaction{std::move(transfers), full_size};
 }
 
 
@@ -872,6 +883,13 @@ void Controller::_linkTransaction(QueueEntity *queue, Transaction *transaction)
 			// TODO: We could ensure that the new TD pointer is part of the transaction.
 			std::cout << "ehci: AdvanceQueue to new transaction" << std::endl;
 		}
+	}else{
+		// Chain the transaction to the previous one, such that the controller
+		// does not need to wait for us before it moves on.
+		// If the controller already fetched the last qTD, _progressQueue() links it in.
+		auto &last = queue->transactions.back();
+		last.transfers[last.transfers.size() - 1].nextTd.store(
+				td_ptr::ptr(schedulePointer(&transaction->transfers[0])));
 	}
 
 	queue->transactions.push_back(*transaction);
@@ -886,59 +904,66 @@ void Controller::_progressSchedule() {
 }
 
 void Controller::_progressQueue(QueueEntity *entity) {
-	if(entity->transactions.empty())
-		return;
-
-	auto active = &entity->transactions.front();
-	while(active->numComplete < active->transfers.size()) {
-		auto transfer = &active->transfers[active->numComplete];
-		if((transfer->status.load() & td_status::active)
-				|| (transfer->status.load() & td_status::halted)
-				|| (transfer->status.load() & td_status::transactionError)
-				|| (transfer->status.load() & td_status::babbleDetected)
-				|| (transfer->status.load() & td_status::dataBufferError))
-			break;
-
-		auto lost = (transfer->status.load() & td_status::totalBytes);
-		assert(!lost); // TODO: Support short packets.
-
-		active->numComplete++;
-		active->lostSize += lost;
-	}
+	// Multiple chained transactions can complete between two IRQs.
+	while(!entity->transactions.empty()) {
+		auto active = &entity->transactions.front();
+		while(active->numComplete < active->transfers.size()) {
+			auto transfer = &active->transfers[active->numComplete];
+			if((transfer->status.load() & td_status::active)
+					|| (transfer->status.load() & td_status::halted)
+					|| (transfer->status.load() & td_status::transactionError)
+					|| (transfer->status.load() & td_status::babbleDetected)
+					|| (transfer->status.load() & td_status::dataBufferError))
+				break;
+
+			auto lost = (transfer->status.load() & td_status::totalBytes);
+			assert(!lost); // TODO: Support short packets.
+
+			active->numComplete++;
+			active->lostSize += lost;
+		}
 
-	auto current = active->numComplete;
-	if(current == active->transfers.size()) {
-		if(logSubmits)
-			std::cout << "ehci: Transfer complete!" << std::endl;
-		assert(active->fullSize >= active->lostSize);
-		active->promise.set_value(active->fullSize - active->lostSize);
-		active->voidPromise.set_value(UsbError{});
-
-		// Clean up the Queue.
-		entity->transactions.pop_front();
-		//delete active;
-		// TODO: _reclaim(active);
-
-		// Schedule the next transaction.
-		assert(entity->head->nextTd.load() & td_ptr::terminate);
-		if(!entity->transactions.empty()) {
+		auto current = active->numComplete;
+		if(current == active->transfers.size()) {
 			if(logSubmits)
-				std::cout << "ehci: Linking in _progressQueue" << std::endl;
-			auto front = &entity->transactions.front();
-			entity->head->nextTd.store(qh_nextTd::nextTd(schedulePointer(&front->transfers[0])));
+				std::cout << "ehci: Transfer complete!" << std::endl;
+			assert(active->fullSize >= active->lostSize);
+			active->promise.set_value(active->fullSize - active->lostSize);
+			active->voidPromise.set_value(UsbError{});
+
+			auto lastTd = schedulePointer(&active->transfers[active->transfers.size() - 1]);
+
+			// Clean up the Queue.
+			entity->transactions.pop_front();
+			//delete active;
+			// TODO: _reclaim(active);
+
+			// Schedule the next transaction if the controller stopped at the end of
+			// the previous one, i.e., if it fetched the qTD before it was chained.
+			if(!entity->transactions.empty()
+					&& (entity->head->nextTd.load() & td_ptr::terminate)
+					&& (entity->head->curTd.load() & qh_curTd::curTd) == lastTd) {
+				if(logSubmits)
+					std::cout << "ehci: Linking in _progressQueue" << std::endl;
+				auto front = &entity->transactions.front();
+				entity->head->nextTd.store(qh_nextTd::nextTd(schedulePointer(&front->transfers[0])));
+			}
+		}else if((active->transfers[current].status.load() & td_status::halted)
+				|| (active->transfers[current].status.load() & td_status::transactionError)
+				|| (active->transfers[current].status.load() & td_status::babbleDetected)
+				|| (active->transfers[current].status.load() & td_status::dataBufferError)) {
+			printf("Transfer error!\n");
+
+			_dump(entity);
+
+			// Clean up the Queue.
+			entity->transactions.pop_front();
+			//delete active;
+			// TODO: _reclaim(active);
+			return;
+		}else{
+			return;
 		}
-	}else if((active->transfers[current].status.load() & td_status::halted)
-			|| (active->transfers[current].status.load() & td_status::transactionError)
-			|| (active->transfers[current].status.load() & td_status::babbleDetected)
-			|| (active->transfers[current].status.load() & td_status::dataBufferError)) {
-		printf("Transfer error!\n");
-
-		_dump(entity);
-
-		// Clean up the Queue.
-		entity->transactions.pop_front();
-		//delete active;
-		// TODO: _reclaim(active);
 	}
 }
 
@@ -927,6 +927,7 @@ async::result<frg::expected<UsbError, size_t>>
 Controller::transfer(int address, PipeType type, int pipe,
 		BulkTransfer info) {
 	// TODO: Ensure pipe type matches transfer direction.
+	assert(info.scatter.empty()); // TODO: Support scatter-gather transfers.
 	auto device = &_activeDevices[address];
 	EndpointSlot *endpoint;
 	if(type == PipeType::in) {
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <algorithm>
 #include <deque>
 #include <optional>
 #include <functional>
@@ -23,6 +24,30 @@
 #include "spec.hpp"
 #include "xhci.hpp"
 
+// Maximal number of events that are processed per IRQ.
+// If the budget is exhausted, we ask the kernel to poll the IRQ.
+constexpr size_t irqEventBudget = 64;
+
+// Maximal number of interrupters (each with its own event ring and MSI).
+constexpr size_t maxInterrupters = 4;
+
+// Minimal interval between interrupts of an interrupter (in units of 250 ns),
+// i.e., events that arrive within 40 us are processed by a single IRQ.
+constexpr uint16_t interruptModeration = 160;
+
+// Poll interrupt endpoints every microframe instead of honoring bInterval.
+// This minimizes input latency at the expense of bus bandwidth.
+constexpr bool pollAtMaxRate = false;
+
+// Returns the flags for helAcknowledgeIrq() after processing the event ring.
+static uint32_t ackFlagsForEvents(size_t processed) {
+	if(processed == irqEventBudget)
+		return kHelAckAcknowledge | kHelAckPollNow;
+	if(processed)
+		return kHelAckAcknowledge | kHelAckPoll;
+	return kHelAckAcknowledge;
+}
+
 constexpr const char *completionCodeNames[256] = {
 	"Invalid",
 	"Success",
@@ -70,12 +95,12 @@ constexpr const char *completionCodeNames[256] = {
 std::vector<std::shared_ptr<Controller>> globalControllers;
 
 Controller::Controller(protocols::hw::Device hw_device, helix::Mapping mapping,
-		helix::UniqueDescriptor mmio, helix::UniqueIrq irq, bool useMsis)
+		helix::UniqueDescriptor mmio, helix::UniqueIrq irq, unsigned int numMsis)
 : _hw_device{std::move(hw_device)}, _mapping{std::move(mapping)},
 		_mmio{std::move(mmio)}, _irq{std::move(irq)},
 		_space{_mapping.get()}, _memoryPool{},
 		_dcbaa{&_memoryPool, 256}, _cmdRing{this},
-		_eventRing{this}, _useMsis{useMsis} {
+		_numMsis{numMsis} {
 	auto op_offset = _space.load(cap_regs::caplength);
 	auto runtime_offset = _space.load(cap_regs::rtsoff);
 	auto doorbell_offset = _space.load(cap_regs::dboff);
@@ -258,6 +283,11 @@ async::detached Controller::initialize() {
 	_maxDeviceSlots = _space.load(cap_regs::hcsparams1) & hcsparams1::maxDevSlots;
 	_operational.store(op_regs::config, config::enabledDeviceSlots(_maxDeviceSlots));
 
+	// The primary stream array holds 2^(MaxPSASize + 1) entries.
+	auto max_psa_size = _space.load(cap_regs::hccparams1) & hccparams1::maxPSASize;
+	_maxPrimaryStreams = max_psa_size ? (size_t{1} << (max_psa_size + 1)) : 0;
+	printf("xhci: max primary stream array size: %lu\n", _maxPrimaryStreams);
+
 	uint32_t hcsparams2 = static_cast<uint32_t>(_space.load(cap_regs::hcsparams2));
 	uint32_t max_scratchpad_bufs = ((((hcsparams2) >> 16) & 0x3e0) | (((hcsparams2) >> 27) & 0x1f));
 
@@ -304,11 +334,25 @@ async::detached Controller::initialize() {
 	for (int i = 1; i < max_intrs; i++)
 		_interrupters.push_back(std::make_unique<Interrupter>(i, this));
 
-	_interrupters[0]->setEventRing(&_eventRing);
-	_interrupters[0]->setEnable(true);
+	// Without MSI(-X), all interrupters share the same IRQ; one of them is enough.
+	size_t num_rings = 1;
+	if (_numMsis)
+		num_rings = std::min({maxInterrupters, size_t{_numMsis}, _interrupters.size()});
+	size_t num_segments = std::min(EventRing::maxSegments, static_cast<size_t>(max_erst));
+	printf("xhci: using %lu interrupter(s) with %lu event ring segment(s)\n",
+			num_rings, num_segments);
+
+	for (size_t i = 0; i < num_rings; i++) {
+		_eventRings.push_back(std::make_unique<EventRing>(this, i, num_segments));
+		_interrupters[i]->setModeration(interruptModeration);
+		_interrupters[i]->setEventRing(_eventRings[i].get());
+		_interrupters[i]->setEnable(true);
+	}
 
-	if (_useMsis) {
-		handleMsis();
+	if (_numMsis) {
+		handleMsis(0, std::move(_irq));
+		for (size_t i = 1; i < num_rings; i++)
+			handleMsis(i, co_await _hw_device.installMsi(i));
 	} else {
 		co_await _hw_device.enableBusIrq();
 		handleIrqs();
@@ -344,19 +388,19 @@ async::detached Controller::handleIrqs() {
 		}
 
 		_interrupters[0]->clearPending();
-		HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckAcknowledge, sequence));
 
-		_eventRing.processRing();
+		auto processed = _eventRings[0]->processRing(irqEventBudget);
+		HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), ackFlagsForEvents(processed), sequence));
 	}
 
 	printf("xhci: interrupt coroutine should not exit...\n");
 }
 
-async::detached Controller::handleMsis() {
+async::detached Controller::handleMsis(size_t interrupter, helix::UniqueIrq irq) {
 	uint64_t sequence = 0;
 
 	while(1) {
-		auto await = co_await helix_ng::awaitEvent(_irq, sequence);
+		auto await = co_await helix_ng::awaitEvent(irq, sequence);
 		HEL_CHECK(await.error());
 		sequence = await.sequence();
 
@@ -364,9 +408,8 @@ async::detached Controller::handleMsis() {
 		// but if we check it, and nack if it's unset, the driver nacks
 		// an IRQ from the device and essentially stalls the driver.
 
-		HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckAcknowledge, sequence));
-
-		_eventRing.processRing();
+		auto processed = _eventRings[interrupter]->processRing(irqEventBudget);
+		HEL_CHECK(helAcknowledgeIrq(irq.getHandle(), ackFlagsForEvents(processed), sequence));
 	}
 
 	printf("xhci: interrupt coroutine should not exit...\n");
@@ -432,18 +475,23 @@ void Controller::CommandRing::submit() {
 // Controller::EventRing
 // ------------------------------------------------------------------------
 
-Controller::EventRing::EventRing(Controller *controller)
-:_eventRing{&controller->_memoryPool}, _erst{&controller->_memoryPool, 1},
-	_dequeuePtr{0}, _controller{controller}, _ccs{1} {
-
-	for (size_t i = 0; i < eventRingSize; i++) {
-		_eventRing->ent[i] = {{0, 0, 0, 0}};
+Controller::EventRing::EventRing(Controller *controller, size_t interrupter, size_t numSegments)
+:_erst{&controller->_memoryPool, numSegments}, _interrupter{interrupter},
+	_segment{0}, _dequeuePtr{0}, _controller{controller}, _ccs{1} {
+	assert(numSegments >= 1 && numSegments <= maxSegments);
+
+	for (size_t s = 0; s < numSegments; s++) {
+		_segments.emplace_back(&controller->_memoryPool);
+		for (size_t i = 0; i < segmentSize; i++)
+			_segments[s]->ent[i] = {{0, 0, 0, 0}};
+
+		uintptr_t ptr;
+		HEL_CHECK(helPointerPhysical(_segments[s].data(), &ptr));
+		_erst[s].ringSegmentBaseLow = ptr & 0xFFFFFFFF;
+		_erst[s].ringSegmentBaseHi = ptr >> 32;
+		_erst[s].ringSegmentSize = segmentSize;
+		_erst[s].reserved = 0; // ResvZ in spec
 	}
-
-	_erst[0].ringSegmentBaseLow = getEventRingPtr() & 0xFFFFFFFF;
-	_erst[0].ringSegmentBaseHi = getEventRingPtr() >> 32;
-	_erst[0].ringSegmentSize = eventRingSize;
-	_erst[0].reserved = 0; // ResvZ in spec
 }
 
 uintptr_t Controller::EventRing::getErstPtr() {
@@ -454,24 +502,33 @@ uintptr_t Controller::EventRing::getErstPtr() {
 
 uintptr_t Controller::EventRing::getEventRingPtr() {
 	uintptr_t ptr;
-	HEL_CHECK(helPointerPhysical(_eventRing.data(), &ptr));
+	HEL_CHECK(helPointerPhysical(_segments[_segment].data(), &ptr));
 	return ptr + _dequeuePtr * sizeof(RawTrb);
 }
 
+size_t Controller::EventRing::getSegmentIndex() {
+	return _segment;
+}
+
 size_t Controller::EventRing::getErstSize() {
 	return _erst.size();
 }
 
-void Controller::EventRing::processRing() {
-	while((_eventRing->ent[_dequeuePtr].val[3] & 1) == _ccs) {
-		RawTrb raw_ev = _eventRing->ent[_dequeuePtr];
+size_t Controller::EventRing::processRing(size_t budget) {
+	size_t processed = 0;
+	while(processed < budget && (_segments[_segment]->ent[_dequeuePtr].val[3] & 1) == _ccs) {
+		RawTrb raw_ev = _segments[_segment]->ent[_dequeuePtr];
 
 		int old_ccs = _ccs;
 
 		_dequeuePtr++;
-		if (_dequeuePtr >= eventRingSize) {
-			_dequeuePtr = 0; // wrap around
-			_ccs = !_ccs; // invert cycle state
+		if (_dequeuePtr >= segmentSize) {
+			_dequeuePtr = 0;
+			_segment++;
+			if (_segment >= _segments.size()) {
+				_segment = 0; // wrap around
+				_ccs = !_ccs; // invert cycle state
+			}
 		}
 
 		if ((raw_ev.val[3] & 1) != old_ccs)
@@ -479,12 +536,13 @@ void Controller::EventRing::processRing() {
 
 		Controller::Event ev = Controller::Event::fromRawTrb(raw_ev);
 
-		_dequeuedEvents.push_back(ev);
 		processEvent(ev);
+		processed++;
 	}
 
-	_controller->_interrupters[0]->setEventRing(this, true);
+	_controller->_interrupters[_interrupter]->setEventRing(this, true);
 	_doorbell.raise();
+	return processed;
 }
 
 void Controller::EventRing::processEvent(Controller::Event ev) {
@@ -503,7 +561,11 @@ void Controller::EventRing::processEvent(Controller::Event ev) {
 		if (_controller->_ports[ev.portId - 1])
 			_controller->_ports[ev.portId - 1]->_doorbell.raise();
 	} else if (ev.type == TrbType::transferEvent) {
-		auto transferRing = _controller->_devices[ev.slotId]->_transferRings[ev.endpointId - 1].get();
+		auto transferRing = _controller->_devices[ev.slotId]->findRing(ev.endpointId, ev.trbPointer);
+		if (!transferRing) {
+			printf("xhci: transfer event for unknown TRB %016lx\n", ev.trbPointer);
+			return;
+		}
 		size_t commandIndex = (ev.trbPointer - transferRing->getPtr()) / sizeof(RawTrb);
 		assert(commandIndex < Controller::TransferRing::transferRingSize);
 		auto transferEv = transferRing->_transferEvents[commandIndex];
@@ -546,10 +608,16 @@ void Controller::Interrupter::setEventRing(EventRing *ring, bool clearEhb) {
 	}
 
 	_space.store(interrupter::erdpLow,
-		(ring->getEventRingPtr() & 0xFFFFFFF0) | ((clearEhb ? 1 : 0) << 3));
+		(ring->getEventRingPtr() & 0xFFFFFFF0) | ((clearEhb ? 1 : 0) << 3)
+			| (ring->getSegmentIndex() & 7));
 	_space.store(interrupter::erdpHi, ring->getEventRingPtr() >> 32);
 }
 
+void Controller::Interrupter::setModeration(uint16_t interval) {
+	// The upper half (IMODC) is the current counter; it is reset by writing zero.
+	_space.store(interrupter::imod, interval);
+}
+
 bool Controller::Interrupter::isPending() {
 	return _space.load(interrupter::iman) & iman::pending;
 }
@@ -807,6 +875,7 @@ async::detached Controller::Port::initPort() {
 	assert(targetPacketSize != -1);
 
 	_device = std::make_shared<Device>(_id, _controller);
+	_device->_legacySpeed = targetPacketSize == 8;
 	co_await _device->allocSlot(_proto->protocolSlotType, targetPacketSize);
 	_controller->_devices[_device->_slotId] = _device;
 
@@ -860,6 +929,8 @@ async::detached Controller::Port::initPort() {
 Controller::TransferRing::TransferRing(Controller *controller)
 :_transferRing{&controller->_memoryPool}, _dequeuePtr{0}, _enqueuePtr{0},
 	_pcs{true} {
+	// Cache the address since transfer events of streams are matched against many rings.
+	HEL_CHECK(helPointerPhysical(_transferRing.data(), &_physical));
 
 	for (uint32_t i = 0; i < transferRingSize; i++) {
 		_transferRing->ent[i] = {{0, 0, 0, 0}};
@@ -874,16 +945,16 @@ Controller::TransferRing::TransferRing(Controller *controller)
 }
 
 uintptr_t Controller::TransferRing::getPtr() {
-	uintptr_t ptr;
-	HEL_CHECK(helPointerPhysical(_transferRing.data(), &ptr));
-	return ptr;
+	return _physical;
 }
 
 void Controller::TransferRing::pushRawTransfer(RawTrb cmd, 
 		Controller::TransferRing::TransferEvent *ev) {
 
+	assert(_inFlight < capacity);
 	_transferRing->ent[_enqueuePtr] = cmd;
 	_transferEvents[_enqueuePtr] = ev;
+	_inFlight++;
 	if (_pcs) {
 		_transferRing->ent[_enqueuePtr].val[3] |= 1;
 	} else {
@@ -907,8 +978,24 @@ void Controller::TransferRing::updateLink() {
 	}};
 }
 
+async::result<void> Controller::TransferRing::reserve(size_t n) {
+	assert(n <= capacity);
+	while (_inFlight + n > capacity)
+		co_await _consumed.async_wait();
+}
+
 void Controller::TransferRing::updateDequeue(int current) {
-	_dequeuePtr = current;
+	// The link TRB at the end of the ring is not tracked.
+	constexpr size_t usable = transferRingSize - 1;
+	size_t next = (current + 1) % usable;
+	size_t consumed = (next + usable - _dequeuePtr) % usable;
+	if (consumed > _inFlight)
+		return; // Stale event (e.g., for a TRB that was already retired).
+
+	_dequeuePtr = next;
+	_inFlight -= consumed;
+	if (consumed)
+		_consumed.raise();
 }
 
 // ------------------------------------------------------------------------
@@ -937,42 +1024,79 @@ Controller::Device::configurationDescriptor() {
 	co_return std::string{(char *)descriptor.data(), descriptor.size()};
 }
 
-async::result<frg::expected<UsbError, Configuration>>
-Controller::Device::useConfiguration(int number) {
-	auto descriptor = FRG_CO_TRY(co_await configurationDescriptor());
+// Converts bInterval into the Interval field of the endpoint context (2^n * 125 us).
+static int computeInterval(EndpointType type, uint8_t interval, bool legacySpeed) {
+	if (type != EndpointType::interrupt || pollAtMaxRate)
+		return 0;
+
+	if (legacySpeed) {
+		// bInterval is given in frames (1 ms); round down to a power of two.
+		int n = 3;
+		while (n < 10 && (1 << (n + 1)) <= interval * 8)
+			n++;
+		return n;
+	}
 
-	struct EndpointInfo {
-		int pipe;
-		PipeType dir;
-		int packet_size;
-		EndpointType type;
-	};
+	// bInterval is the exponent (plus one) in microframes.
+	return std::clamp(int{interval}, 1, 16) - 1;
+}
 
-	std::vector<EndpointInfo> _eps = {};
+// Returns the endpoints of the given alternative setting of an interface (or of all interfaces).
+static std::vector<Controller::Device::EndpointInfo>
+parseEndpoints(std::string descriptor, std::optional<int> interface, int alternative,
+		bool legacySpeed) {
+	std::vector<Controller::Device::EndpointInfo> eps;
+	bool inAlternative = false;
 
 	walkConfiguration(descriptor, [&] (int type, size_t length, void *p, const auto &info) {
 		(void)length;
 
+		if(type == descriptor_type::interface) {
+			inAlternative = (!interface || info.interfaceNumber.value() == *interface)
+					&& info.interfaceAlternative.value() == alternative;
+			return;
+		}
+		if(!inAlternative)
+			return;
+
+		if(type == descriptor_type::endpointCompanion) {
+			assert(!eps.empty());
+			auto desc = (EndpointCompanionDescriptor *)p;
+			eps.back().maxBurst = desc->maxBurst;
+			if(eps.back().type == EndpointType::bulk)
+				eps.back().maxStreams = desc->attributes & 0x1F;
+			return;
+		}
 		if(type != descriptor_type::endpoint)
 			return;
 		auto desc = (EndpointDescriptor *)p;
 
-		// TODO: Pay attention to interface/alternative.
 		auto packet_size = desc->maxPacketSize & 0x7FF;
 		auto ep_type = info.endpointType.value();
 
 		int pipe = info.endpointNumber.value();
 		if (info.endpointIn.value()) {
-			_eps.push_back({pipe, PipeType::in, packet_size, ep_type});
+			eps.push_back({pipe, PipeType::in, packet_size, ep_type});
 		} else {
-			_eps.push_back({pipe, PipeType::out, packet_size, ep_type});
+			eps.push_back({pipe, PipeType::out, packet_size, ep_type});
 		}
+		eps.back().interval = computeInterval(ep_type, desc->interval, legacySpeed);
 	});
 
+	return eps;
+}
+
+async::result<frg::expected<UsbError, Configuration>>
+Controller::Device::useConfiguration(int number) {
+	auto descriptor = FRG_CO_TRY(co_await configurationDescriptor());
+
+	// Other alternative settings are configured by useInterface().
+	auto _eps = parseEndpoints(descriptor, std::nullopt, 0, _legacySpeed);
+
 	for (auto &ep : _eps) {
 		printf("xhci: setting up %s endpoint %d (max packet size: %d)\n", 
-			ep.dir == PipeType::in ? "in" : "out", ep.pipe, ep.packet_size);
-		co_await setupEndpoint(ep.pipe, ep.dir, ep.packet_size, ep.type);
+			ep.dir == PipeType::in ? "in" : "out", ep.pipe, ep.packetSize);
+		co_await setupEndpoint(ep);
 	}
 
 	RawTrb setup_stage = {{
@@ -1001,6 +1125,56 @@ Controller::Device::useConfiguration(int number) {
 	co_return Configuration{std::make_shared<Controller::ConfigurationState>(_controller, shared_from_this(), number)};
 }
 
+async::result<frg::expected<UsbError>>
+Controller::Device::useInterface(int number, int alternative) {
+	if (_alternatives[number] == alternative)
+		co_return {};
+
+	auto descriptor = FRG_CO_TRY(co_await configurationDescriptor());
+	auto oldEps = parseEndpoints(descriptor, number, _alternatives[number], _legacySpeed);
+	auto newEps = parseEndpoints(descriptor, number, alternative, _legacySpeed);
+
+	RawTrb setup_stage = {{
+			static_cast<uint32_t>((alternative << 16) | (request_type::setInterface << 8)
+				| setup_type::targetInterface), // SET_INTERFACE, host to device
+			static_cast<uint32_t>(number), 8,
+			(1 << 6) | (static_cast<uint32_t>(TrbType::setupStage) << 10)}};
+
+	RawTrb status_stage = {{
+			0, 0, 0,
+			(1 << 16) | (1 << 5) | (static_cast<uint32_t>(TrbType::statusStage) << 10)}};
+
+	TransferRing::TransferEvent ev;
+
+	pushRawTransfer(0, setup_stage);
+	pushRawTransfer(0, status_stage, &ev);
+	submit(1);
+
+	co_await ev.completion.wait();
+
+	if (ev.event.completionCode != 1) {
+		printf("xhci: failed to set alternative setting, completion code: '%s'\n",
+			completionCodeNames[ev.event.completionCode]);
+		co_return UsbError::stall;
+	}
+
+	_alternatives[number] = alternative;
+
+	// Endpoints that are also part of the new setting are reconfigured below.
+	for (auto &ep : oldEps) {
+		int endpointId = ep.pipe * 2 + (ep.dir == PipeType::in ? 1 : 0);
+		bool kept = std::any_of(newEps.begin(), newEps.end(), [&] (auto &n) {
+			return n.pipe == ep.pipe && n.dir == ep.dir;
+		});
+		if (!kept)
+			co_await dropEndpoint(endpointId);
+	}
+	for (auto &ep : newEps)
+		co_await setupEndpoint(ep);
+
+	co_return {};
+}
+
 async::result<frg::expected<UsbError>>
 Controller::Device::transfer(ControlTransfer info) {
 	RawTrb setup_stage = {{
@@ -1052,9 +1226,9 @@ Controller::Device::transfer(ControlTransfer info) {
 	co_return {};
 }
 
-void Controller::Device::submit(int endpoint) {
+void Controller::Device::submit(int endpoint, uint16_t stream) {
 	assert(_slotId != -1);
-	_controller->ringDoorbell(_slotId, endpoint, /* stream */ 0);
+	_controller->ringDoorbell(_slotId, endpoint, stream);
 }
 
 async::result<void> Controller::Device::allocSlot(int slotType, int packetSize) {
@@ -1071,6 +1245,8 @@ async::result<void> Controller::Device::allocSlot(int slotType, int packetSize)
 	assert(ev.event.completionCode == 1); // success
 
 	_slotId = ev.event.slotId;
+	// Spread the devices' transfer events across the interrupters.
+	_interrupter = _slotId % _controller->_eventRings.size();
 
 	printf("xhci: slot enabled successfully!\n");
 	printf("xhci: slot id for port %d is %d\n", _portId, _slotId);
@@ -1129,8 +1305,72 @@ async::result<void> Controller::Device::allocSlot(int slotType, int packetSize)
 	printf("xhci: device successfully addressed\n");
 }
 
-void Controller::Device::pushRawTransfer(int endpoint, RawTrb cmd, Controller::TransferRing::TransferEvent *ev) {
-	_transferRings[endpoint]->pushRawTransfer(cmd, ev);
+void Controller::Device::pushRawTransfer(int endpoint, RawTrb cmd,
+		Controller::TransferRing::TransferEvent *ev, uint16_t stream) {
+	// Set the interrupter target of the TRB.
+	cmd.val[2] = (cmd.val[2] & 0x3FFFFF) | (_interrupter << 22);
+
+	if (stream) {
+		assert(stream < _streamRings[endpoint].size());
+		_streamRings[endpoint][stream]->pushRawTransfer(cmd, ev);
+	} else {
+		_transferRings[endpoint]->pushRawTransfer(cmd, ev);
+	}
+}
+
+async::result<void> Controller::Device::pushNormalTransfer(int endpoint,
+		std::span<const arch::dma_buffer_view> segments,
+		TransferRing::TransferEvent *ev, uint16_t stream) {
+	// Each TRB covers (at most) one page.
+	auto forEachChunk = [&] (auto fn) {
+		for (size_t s = 0; s < segments.size(); s++) {
+			size_t progress = 0;
+			while (progress < segments[s].size()) {
+				auto ptr = (uintptr_t)segments[s].data() + progress;
+				auto chunk = std::min(segments[s].size() - progress, 0x1000 - (ptr & 0xFFF));
+				progress += chunk;
+				fn(ptr, chunk);
+			}
+		}
+	};
+
+	size_t numTrbs = 0;
+	forEachChunk([&] (uintptr_t, size_t) { numTrbs++; });
+
+	auto ring = stream ? _streamRings[endpoint][stream].get() : _transferRings[endpoint].get();
+	co_await ring->reserve(numTrbs);
+
+	size_t n = 0;
+	forEachChunk([&] (uintptr_t ptr, size_t chunk) {
+		bool is_last = ++n == numTrbs;
+
+		uintptr_t pptr;
+		HEL_CHECK(helPointerPhysical((void *)ptr, &pptr));
+
+		RawTrb transfer = {{
+			static_cast<uint32_t>(pptr & 0xFFFFFFFF),
+			static_cast<uint32_t>(pptr >> 32),
+			static_cast<uint32_t>(chunk),
+			(!is_last << 4) | (1 << 2) | (is_last << 5)
+				| (static_cast<uint32_t>(TrbType::normal) << 10)}};
+
+		pushRawTransfer(endpoint, transfer, is_last ? ev : nullptr, stream);
+	});
+}
+
+auto Controller::Device::findRing(int endpointId, uintptr_t trbPointer) -> TransferRing * {
+	auto &streams = _streamRings[endpointId - 1];
+	if (streams.empty())
+		return _transferRings[endpointId - 1].get();
+
+	for (auto &ring : streams) {
+		if (!ring)
+			continue;
+		auto base = ring->getPtr();
+		if (trbPointer >= base && trbPointer < base + TransferRing::transferRingSize * sizeof(RawTrb))
+			return ring.get();
+	}
+	return nullptr;
 }
 
 async::result<void> Controller::Device::readDescriptor(arch::dma_buffer_view dest, uint16_t desc) {
@@ -1180,37 +1420,78 @@ static inline uint32_t getHcdEndpointType(PipeType dir, EndpointType type) {
 	return 0;
 }
 
-async::result<void> Controller::Device::setupEndpoint(int endpoint, PipeType dir, size_t maxPacketSize, EndpointType type, bool drop) {
-	printf("xhci: doing endpoint stuff to %d\n", endpoint);
+async::result<void> Controller::Device::setupEndpoint(const EndpointInfo &info, size_t numStreams) {
+	printf("xhci: doing endpoint stuff to %d\n", info.pipe);
 	auto inputCtx = arch::dma_object<InputContext>{&_controller->_memoryPool};
 	memset(inputCtx.data(), 0, sizeof(InputContext));
 
-	int endpointId = endpoint * 2 + (dir == PipeType::in ? 1 : 0);
+	int endpointId = info.pipe * 2 + (info.dir == PipeType::in ? 1 : 0);
 
 	printf("xhci: epId is %d\n", endpointId);
 
+	// Reconfiguring requires dropping the old context in the same command.
+	if (_endpoints[endpointId - 1].configured)
+		inputCtx->icc.dropContextFlags = (1 << endpointId);
 	inputCtx->icc.addContextFlags = (1 << 0) | (1 << (endpointId));
 	inputCtx->slotContext = _devCtx->slotContext;
 
 	inputCtx->slotContext.val[0] |= (31 << 27);
 
-	_transferRings[endpointId - 1] = std::make_unique<TransferRing>(_controller);
-
-	// max burst size = 0
-	// tr dequeue = tr ring ptr
-	// dcs = 1
-	// interval = 0
-	// max p streams = 0
+	// max burst size = from companion descriptor
+	// interval = from bInterval
 	// mult = 0
 	// error count = 3
 	// average trb length = packet size * 2
-	auto tr_ptr = _transferRings[endpointId - 1]->getPtr();
-	printf("xhci: tr ptr = %016lx\n", tr_ptr);
-	assert(!(tr_ptr & 0xF));
-	inputCtx->endpointContext[endpointId - 1].val[1] = (3 << 1) | (getHcdEndpointType(dir, type) << 3) | (maxPacketSize << 16);
-	inputCtx->endpointContext[endpointId - 1].val[2] = (1 << 0) | (tr_ptr & 0xFFFFFFF0);
-	inputCtx->endpointContext[endpointId - 1].val[3] = (tr_ptr >> 32);
-	inputCtx->endpointContext[endpointId - 1].val[4] = maxPacketSize * 2;
+	auto &epCtx = inputCtx->endpointContext[endpointId - 1];
+	epCtx.val[1] = (3 << 1) | (getHcdEndpointType(info.dir, info.type) << 3)
+			| (info.maxBurst << 8) | (info.packetSize << 16);
+	epCtx.val[0] = info.interval << 16;
+	epCtx.val[4] = info.packetSize * 2;
+
+	if (numStreams) {
+		// The primary stream array must have a power of two size; stream 0 is reserved.
+		size_t arraySize = 2;
+		while (arraySize < numStreams + 1)
+			arraySize *= 2;
+		assert(arraySize <= _controller->_maxPrimaryStreams);
+
+		_transferRings[endpointId - 1] = nullptr;
+		_streamRings[endpointId - 1].clear();
+		_streamRings[endpointId - 1].resize(numStreams + 1);
+		_streamContexts[endpointId - 1] = arch::dma_array<StreamContext>{
+				&_controller->_memoryPool, arraySize};
+		auto &streamCtxs = _streamContexts[endpointId - 1];
+		for (size_t i = 0; i < arraySize; i++)
+			streamCtxs[i] = StreamContext{0, 0};
+		for (size_t i = 1; i <= numStreams; i++) {
+			auto &ring = _streamRings[endpointId - 1][i];
+			ring = std::make_unique<TransferRing>(_controller);
+			// stream context type = primary transfer ring, dcs = 1
+			streamCtxs[i].dequeue = ring->getPtr() | (1 << 1) | 1;
+		}
+
+		uintptr_t streams_ptr;
+		HEL_CHECK(helPointerPhysical(&streamCtxs[0], &streams_ptr));
+		assert(!(streams_ptr & 0xF));
+
+		// max p streams = log2(array size) - 1, linear stream array
+		// tr dequeue = stream context array, dcs = 0
+		epCtx.val[0] |= ((__builtin_ctzl(arraySize) - 1) << 10) | (1 << 15);
+		epCtx.val[2] = streams_ptr & 0xFFFFFFF0;
+		epCtx.val[3] = streams_ptr >> 32;
+	} else {
+		_streamRings[endpointId - 1].clear();
+		_transferRings[endpointId - 1] = std::make_unique<TransferRing>(_controller);
+
+		// tr dequeue = tr ring ptr
+		// dcs = 1
+		// max p streams = 0
+		auto tr_ptr = _transferRings[endpointId - 1]->getPtr();
+		printf("xhci: tr ptr = %016lx\n", tr_ptr);
+		assert(!(tr_ptr & 0xF));
+		epCtx.val[2] = (1 << 0) | (tr_ptr & 0xFFFFFFF0);
+		epCtx.val[3] = (tr_ptr >> 32);
+	}
 
 	uintptr_t in_ctx_ptr;
 	HEL_CHECK(helPointerPhysical(inputCtx.data(), &in_ctx_ptr));
@@ -1232,9 +1513,59 @@ async::result<void> Controller::Device::setupEndpoint(int endpoint, PipeType dir
 
 	assert(ev.event.completionCode == 1);
 
+	_endpoints[endpointId - 1] = info;
+	_endpoints[endpointId - 1].configured = true;
+
 	printf("xhci: configure endpoint finished\n");
 }
 
+async::result<void> Controller::Device::dropEndpoint(int endpointId) {
+	if (!_endpoints[endpointId - 1].configured)
+		co_return;
+
+	auto inputCtx = arch::dma_object<InputContext>{&_controller->_memoryPool};
+	memset(inputCtx.data(), 0, sizeof(InputContext));
+	inputCtx->icc.dropContextFlags = (1 << endpointId);
+	inputCtx->icc.addContextFlags = (1 << 0);
+	inputCtx->slotContext = _devCtx->slotContext;
+
+	uintptr_t in_ctx_ptr;
+	HEL_CHECK(helPointerPhysical(inputCtx.data(), &in_ctx_ptr));
+
+	RawTrb configure_endpoint = {{
+		static_cast<uint32_t>(in_ctx_ptr & 0xFFFFFFFF),
+		static_cast<uint32_t>(in_ctx_ptr >> 32), 0,
+		(_slotId << 24) |
+			(static_cast<uint32_t>(TrbType::configureEndpointCommand) << 10)}};
+	Controller::CommandRing::CommandEvent ev;
+	_controller->_cmdRing.pushRawCommand(configure_endpoint, &ev);
+	_controller->_cmdRing.submit();
+
+	co_await ev.completion.wait();
+
+	if (ev.event.completionCode != 1)
+		printf("xhci: failed to drop endpoint, completion code: '%s'\n",
+			completionCodeNames[ev.event.completionCode]);
+
+	_endpoints[endpointId - 1].configured = false;
+	_transferRings[endpointId - 1] = nullptr;
+	_streamRings[endpointId - 1].clear();
+}
+
+async::result<size_t> Controller::Device::allocateStreams(int endpointId, size_t count) {
+	auto info = _endpoints[endpointId - 1];
+	if (!info.configured || !info.maxStreams || _controller->_maxPrimaryStreams < 2)
+		co_return 0;
+
+	auto numStreams = std::min({count, size_t{1} << info.maxStreams,
+			_controller->_maxPrimaryStreams - 1});
+	if (!numStreams)
+		co_return 0;
+
+	co_await setupEndpoint(info, numStreams);
+	co_return numStreams;
+}
+
 // ------------------------------------------------------------------------
 // Controller::ConfigurationState
 // ------------------------------------------------------------------------
@@ -1246,7 +1577,7 @@ Controller::ConfigurationState::ConfigurationState(Controller *controller,
 
 async::result<frg::expected<UsbError, Interface>>
 Controller::ConfigurationState::useInterface(int number, int alternative) {
-	assert(!alternative);
+	FRG_CO_TRY(co_await _device->useInterface(number, alternative));
 	co_return Interface{std::make_shared<Controller::InterfaceState>(_controller, _device, number)};
 }
 
@@ -1285,27 +1616,7 @@ Controller::EndpointState::transfer(InterruptTransfer info) {
 
 	Controller::TransferRing::TransferEvent ev;
 
-	size_t progress = 0;
-	while(progress < info.buffer.size()) {
-		uintptr_t pptr, ptr = (uintptr_t)info.buffer.data() + progress;
-		HEL_CHECK(helPointerPhysical((void *)ptr, &pptr));
-
-		auto chunk = std::min(info.buffer.size() - progress, 0x1000 - (ptr & 0xFFF));
-
-		bool is_last = (progress + chunk) >= info.buffer.size();
-
-		RawTrb transfer = {{
-			static_cast<uint32_t>(pptr & 0xFFFFFFFF),
-			static_cast<uint32_t>(pptr >> 32),
-			static_cast<uint32_t>(chunk),
-			(!is_last << 4) | (1 << 2) | (is_last << 5)
-				| (static_cast<uint32_t>(TrbType::normal) << 10)}};
-
-		_device->pushRawTransfer(endpointId - 1, transfer, is_last ? &ev : nullptr);
-
-		progress += chunk;
-	}
-
+	co_await _device->pushNormalTransfer(endpointId - 1, {&info.buffer, 1}, &ev);
 	_device->submit(endpointId);
 
 	co_await ev.completion.wait();
@@ -1321,38 +1632,29 @@ Controller::EndpointState::transfer(BulkTransfer info) {
 
 	Controller::TransferRing::TransferEvent ev;
 
-	size_t progress = 0;
-	while(progress < info.buffer.size()) {
-		uintptr_t pptr, ptr = (uintptr_t)info.buffer.data() + progress;
-		HEL_CHECK(helPointerPhysical((void *)ptr, &pptr));
-
-		auto chunk = std::min(info.buffer.size() - progress, 0x1000 - (ptr & 0xFFF));
-
-		bool is_last = (progress + chunk) >= info.buffer.size();
-
-		RawTrb transfer = {{
-			static_cast<uint32_t>(pptr & 0xFFFFFFFF),
-			static_cast<uint32_t>(pptr >> 32),
-			static_cast<uint32_t>(chunk),
-			(!is_last << 4) | (1 << 2) | (is_last << 5)
-				| (static_cast<uint32_t>(TrbType::normal) << 10)}};
-
-		_device->pushRawTransfer(endpointId - 1, transfer, is_last ? &ev : nullptr);
-
-		progress += chunk;
-	}
-
-	_device->submit(endpointId);
+	// Concurrent transfers are appended to the ring without waiting for
+	// earlier ones to complete; the doorbell is rung once per transfer.
+	co_await _device->pushNormalTransfer(endpointId - 1, info.segments(), &ev, info.streamId);
+	_device->submit(endpointId, info.streamId);
 
 	co_await ev.completion.wait();
 
-	if (ev.event.completionCode != 1) {
+	// Short packets are reported with completion code 13.
+	bool success = ev.event.completionCode == 1
+			|| (info.allowShortPackets && ev.event.completionCode == 13);
+	if (!success) {
 		printf("xhci: completion code is %s instead of success\n", completionCodeNames[ev.event.completionCode]);
 	}
 
-	assert(ev.event.completionCode == 1); // success
+	assert(success);
 
-	co_return info.buffer.size() - ev.event.transferLen;
+	co_return info.size() - ev.event.transferLen;
+}
+
+async::result<frg::expected<UsbError, size_t>>
+Controller::EndpointState::allocateStreams(size_t count) {
+	int endpointId = _endpoint * 2 + (_type == PipeType::in ? 1 : 0);
+	co_return co_await _device->allocateStreams(endpointId, count);
 }
 
 // ------------------------------------------------------------------------
@@ -1379,7 +1681,7 @@ async::detached bindController(mbus::Entity entity) {
 	helix::Mapping mapping{bar, info.barInfo[0].offset, info.barInfo[0].length};
 
 	auto controller = std::make_shared<Controller>(std::move(device), std::move(mapping),
-			std::move(bar), std::move(irq), info.numMsis > 0);
+			std::move(bar), std::move(irq), info.numMsis);
 	controller->initialize();
 	globalControllers.push_back(std::move(controller));
 }
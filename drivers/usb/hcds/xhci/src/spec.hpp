@@ -46,6 +46,7 @@ namespace hcsparams2 {
 namespace hccparams1 {
 	arch::field<uint32_t, uint16_t> extCapPtr(16, 16);
 	arch::field<uint32_t, bool> contextSize(2, 1);
+	arch::field<uint32_t, uint8_t> maxPSASize(12, 4);
 }
 
 namespace usbcmd {
@@ -177,6 +178,12 @@ struct alignas(64) InputContext {
 };
 static_assert (sizeof(InputContext) == 34 * 32, "invalid InputContext size"); // 34 due to 64 byte alignment
 
+struct alignas(16) StreamContext {
+	uint64_t dequeue; // Also contains the stream context type and DCS.
+	uint64_t reserved;
+};
+static_assert (sizeof(StreamContext) == 16, "invalid StreamContext size");
+
 struct alignas(64) DeviceContext {
 	RawContext slotContext;
 	RawContext endpointContext[31];
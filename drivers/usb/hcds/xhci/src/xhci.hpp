@@ -1,4 +1,5 @@
 
+#include <map>
 #include <queue>
 
 #include <arch/mem_space.hpp>
@@ -19,11 +20,11 @@ struct Controller : std::enable_shared_from_this<Controller> {
 	Controller(protocols::hw::Device hw_device,
 			helix::Mapping mapping,
 			helix::UniqueDescriptor mmio,
-			helix::UniqueIrq irq, bool useMsis);
+			helix::UniqueIrq irq, unsigned int numMsis);
 
 	async::detached initialize();
 	async::detached handleIrqs();
-	async::detached handleMsis();
+	async::detached handleMsis(size_t interrupter, helix::UniqueIrq irq);
 
 private:
 	struct Event {
@@ -88,8 +89,10 @@ private:
 		bool _pcs; // producer cycle state
 	};
 
+	// An event ring consists of multiple segments, each described by an ERST entry.
 	struct EventRing {
-		constexpr static size_t eventRingSize = 128;
+		constexpr static size_t segmentSize = 256;
+		constexpr static size_t maxSegments = 4;
 
 		struct alignas(64) ErstEntry {
 			uint32_t ringSegmentBaseLow;
@@ -99,26 +102,31 @@ private:
 		};
 
 		struct alignas(64) EventRingEntries {
-			RawTrb ent[eventRingSize];
+			RawTrb ent[segmentSize];
 		};
 
 		static_assert(sizeof(ErstEntry) == 64, "invalid ErstEntry size");
 
-		EventRing(Controller *controller);
+		EventRing(Controller *controller, size_t interrupter, size_t numSegments);
 		uintptr_t getErstPtr();
 		uintptr_t getEventRingPtr();
 		size_t getErstSize();
+		// Index of the segment that contains the dequeue pointer (= ERDP.DESI).
+		size_t getSegmentIndex();
 
-		void processRing();
+		// Processes at most budget events; returns the number of processed events.
+		// The dequeue pointer is only written back once per call.
+		size_t processRing(size_t budget);
 
-		std::deque<Event> _dequeuedEvents;
 		async::recurring_event _doorbell;
 	private:
-		arch::dma_object<EventRingEntries> _eventRing;
+		std::vector<arch::dma_object<EventRingEntries>> _segments;
 		arch::dma_array<ErstEntry> _erst;
 
 		void processEvent(Event ev);
 
+		size_t _interrupter;
+		size_t _segment;
 		size_t _dequeuePtr;
 		Controller *_controller;
 
@@ -142,14 +150,26 @@ private:
 
 		void pushRawTransfer(RawTrb cmd, TransferEvent *ev = nullptr);
 
+		// Maximal number of TRBs that can be in flight on the ring.
+		constexpr static size_t capacity = transferRingSize - 2;
+
+		// Waits until n TRBs can be pushed to the ring. The TRBs must be
+		// pushed without suspending in between.
+		async::result<void> reserve(size_t n);
+
+		// Marks all TRBs up to (and including) index current as consumed.
 		void updateDequeue(int current);
 		void updateLink();
 
 		std::array<TransferEvent *, transferRingSize> _transferEvents;
 	private:
 		arch::dma_object<TransferRingEntries> _transferRing;
+		uintptr_t _physical;
 		size_t _dequeuePtr;
 		size_t _enqueuePtr;
+		// Number of TRBs that were pushed but not consumed yet.
+		size_t _inFlight = 0;
+		async::recurring_event _consumed;
 
 		bool _pcs; // producer cycle state
 	};
@@ -158,6 +178,8 @@ private:
 		Interrupter(int id, Controller *controller);
 		void setEnable(bool enable);
 		void setEventRing(EventRing *ring, bool clear_ehb = false);
+		// Sets the minimal interval between interrupts (in units of 250 ns).
+		void setModeration(uint16_t interval);
 		bool isPending();
 		void clearPending();
 	private:
@@ -205,6 +227,19 @@ private:
 	};
 
 	struct Device final : DeviceData, std::enable_shared_from_this<Device> {
+		struct EndpointInfo {
+			int pipe;
+			PipeType dir;
+			int packetSize;
+			EndpointType type;
+			// Taken from the SuperSpeed endpoint companion descriptor.
+			int maxBurst = 0;
+			int maxStreams = 0; // log2 of the number of streams.
+			// Interval field of the endpoint context.
+			int interval = 0;
+			bool configured = false;
+		};
+
 		Device(int portId, Controller *controller);
 
 		// Public API inherited from DeviceData.
@@ -214,23 +249,48 @@ private:
 		async::result<frg::expected<UsbError, Configuration>> useConfiguration(int number) override;
 		async::result<frg::expected<UsbError>> transfer(ControlTransfer info) override;
 
-		void submit(int endpoint);
-		void pushRawTransfer(int endpoint, RawTrb cmd, TransferRing::TransferEvent *ev = nullptr);
+		async::result<frg::expected<UsbError>> useInterface(int number, int alternative);
+
+		void submit(int endpoint, uint16_t stream = 0);
+		void pushRawTransfer(int endpoint, RawTrb cmd, TransferRing::TransferEvent *ev = nullptr,
+				uint16_t stream = 0);
+		// Queues a chain of normal TRBs that cover the segments; ev is attached to the last TRB.
+		// Waits for space on the ring first, so that transfers can be queued back-to-back.
+		async::result<void> pushNormalTransfer(int endpoint,
+				std::span<const arch::dma_buffer_view> segments,
+				TransferRing::TransferEvent *ev, uint16_t stream = 0);
 		async::result<void> allocSlot(int slotType, int packetSize);
 
 		async::result<void> readDescriptor(arch::dma_buffer_view dest, uint16_t desc);
 
+		// Returns the ring that contains the TRB (or the default ring if there are no streams).
+		TransferRing *findRing(int endpointId, uintptr_t trbPointer);
+
 		std::array<std::unique_ptr<TransferRing>, 31> _transferRings;
+		// Rings of the streams of each endpoint; index zero is reserved.
+		std::array<std::vector<std::unique_ptr<TransferRing>>, 31> _streamRings;
 
 		int _slotId;
+		// Interrupter that receives the transfer events of this device.
+		size_t _interrupter = 0;
+		// Low or full speed device; bInterval is given in frames.
+		bool _legacySpeed = false;
+
+		// Reconfigures the endpoint with streams; returns the number of streams.
+		async::result<size_t> allocateStreams(int endpointId, size_t count);
 
-		async::result<void> setupEndpoint(int endpoint, PipeType dir, size_t maxPacketSize, EndpointType type, bool drop = false);
+		async::result<void> setupEndpoint(const EndpointInfo &info, size_t numStreams = 0);
+		async::result<void> dropEndpoint(int endpointId);
 
 	private:
 		int _portId;
 		Controller *_controller;
 
 		arch::dma_object<DeviceContext> _devCtx;
+		std::array<EndpointInfo, 31> _endpoints;
+		std::array<arch::dma_array<StreamContext>, 31> _streamContexts;
+		// Currently selected alternative setting of each interface.
+		std::map<int, int> _alternatives;
 	};
 
 	struct SupportedProtocol {
@@ -288,6 +348,7 @@ private:
 		async::result<frg::expected<UsbError>> transfer(ControlTransfer info) override;
 		async::result<frg::expected<UsbError, size_t>> transfer(InterruptTransfer info) override;
 		async::result<frg::expected<UsbError, size_t>> transfer(BulkTransfer info) override;
+		async::result<frg::expected<UsbError, size_t>> allocateStreams(size_t count) override;
 
 	private:
 		std::shared_ptr<Device> _device;
@@ -321,12 +382,16 @@ private:
 	std::array<std::shared_ptr<Device>, 256> _devices;
 
 	CommandRing _cmdRing;
-	EventRing _eventRing;
+	// Event ring of each interrupter that we use. Interrupter 0 also receives
+	// command completion and port status change events.
+	std::vector<std::unique_ptr<EventRing>> _eventRings;
 
 	int _numPorts;
 	int _maxDeviceSlots;
+	// Maximum size of a primary stream array; zero if streams are not supported.
+	size_t _maxPrimaryStreams;
 
-	bool _useMsis;
+	unsigned int _numMsis;
 };
 
 
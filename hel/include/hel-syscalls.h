@@ -162,6 +162,12 @@ extern inline __attribute__ (( always_inline )) HelError helCreateVirtualizedSpa
 	return error;
 };
 
+extern inline __attribute__ (( always_inline )) HelError helGetDirtyLog(HelHandle handle,
+		uintptr_t address, size_t length, void *bitmap) {
+	return helSyscall4(kHelCallGetDirtyLog, (HelWord)handle, (HelWord)address,
+			(HelWord)length, (HelWord)bitmap);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helCreateVirtualizedCpu(HelHandle handle, HelHandle *out_handle) {
 	HelWord handle_word;
 	HelError error = helSyscall1_1(kHelCallCreateVirtualizedCpu, (HelWord)handle, &handle_word);
@@ -201,6 +207,14 @@ extern inline __attribute__ (( always_inline )) HelError helSubmitProtectMemory(
 			(HelWord)queue, (HelWord)context);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helSubmitPopulateMemory(HelHandle space,
+		void *pointer, size_t size,
+		HelHandle queue, uintptr_t context) {
+	return helSyscall4(kHelCallSubmitPopulateMemory, (HelWord)space,
+			(HelWord)pointer, (HelWord)size,
+			(HelWord)queue, (HelWord)context);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helUnmapMemory(HelHandle space,
 		void *pointer, size_t size) {
 	return helSyscall3(kHelCallUnmapMemory, (HelWord)space, (HelWord)pointer, (HelWord)size);
@@ -238,6 +252,20 @@ extern inline __attribute__ (( always_inline )) HelError helSubmitWriteMemory(He
 			(HelWord)queue, (HelWord)context);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helSubmitReadMemoryVector(
+		HelHandle handle, const struct HelRemoteRange *ranges, size_t count,
+		HelHandle queue, uintptr_t context) {
+	return helSyscall5(kHelCallSubmitReadMemoryVector, (HelWord)handle, (HelWord)ranges,
+			(HelWord)count, (HelWord)queue, (HelWord)context);
+};
+
+extern inline __attribute__ (( always_inline )) HelError helSubmitWriteMemoryVector(
+		HelHandle handle, const struct HelRemoteRange *ranges, size_t count,
+		HelHandle queue, uintptr_t context) {
+	return helSyscall5(kHelCallSubmitWriteMemoryVector, (HelWord)handle, (HelWord)ranges,
+			(HelWord)count, (HelWord)queue, (HelWord)context);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helMemoryInfo(HelHandle handle, 
 		size_t *size) {
 	HelWord handle_word;
@@ -268,6 +296,15 @@ extern inline __attribute__ (( always_inline )) HelError helLoadahead(HelHandle
 	return helSyscall3(kHelCallLoadahead, (HelWord)handle, (HelWord)offset, (HelWord)length);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helQueryWriteback(HelHandle handle,
+		uintptr_t offset, size_t length, size_t *count) {
+	HelWord count_word;
+	HelError error = helSyscall3_1(kHelCallQueryWriteback, (HelWord)handle, (HelWord)offset,
+			(HelWord)length, &count_word);
+	*count = (size_t)count_word;
+	return error;
+};
+
 extern inline __attribute__ (( always_inline )) HelError helCreateThread(HelHandle universe,
 		HelHandle address_space, HelAbi abi, void *ip, void *sp, uint32_t flags,
 		HelHandle *handle) {
@@ -292,6 +329,12 @@ extern inline __attribute__ (( always_inline )) HelError helSetPriority(HelHandl
 	return helSyscall2(kHelCallSetPriority, (HelWord)handle, (HelWord)priority);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helSetDeadline(HelHandle thread,
+		uint64_t runtime, uint64_t deadline, uint64_t period) {
+	return helSyscall4(kHelCallSetDeadline, (HelWord)thread, (HelWord)runtime,
+			(HelWord)deadline, (HelWord)period);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helSubmitObserve(HelHandle handle,
 		uint64_t in_seq, HelHandle queue, uintptr_t context) {
 	return helSyscall4(kHelCallSubmitObserve, (HelWord)handle, (HelWord)in_seq,
@@ -331,6 +374,14 @@ extern inline __attribute__ (( always_inline )) HelError helGetClock(uint64_t *c
 	return error;
 };
 
+extern inline __attribute__ (( always_inline )) HelError helMapClockPage(HelHandle space,
+		void **pointer) {
+	HelWord pointer_word;
+	HelError error = helSyscall1_1(kHelCallMapClockPage, (HelWord)space, &pointer_word);
+	*pointer = (void *)pointer_word;
+	return error;
+};
+
 extern inline __attribute__ (( always_inline )) HelError helSubmitAwaitClock(uint64_t counter,
 		HelHandle queue, uintptr_t context, uint64_t *async_id) {
 	HelWord async_word;
@@ -357,6 +408,13 @@ extern inline __attribute__ (( always_inline )) HelError helSubmitAsync(HelHandl
 			(HelWord)queue, (HelWord)context, (HelWord)flags);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helSubmitAsyncBatch(
+		struct HelBatchSubmission *submissions, size_t count, HelHandle queue,
+		uint32_t flags) {
+	return helSyscall4(kHelCallSubmitAsyncBatch, (HelWord)submissions, (HelWord)count,
+			(HelWord)queue, (HelWord)flags);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helShutdownLane(HelHandle handle) {
 	return helSyscall1(kHelCallShutdownLane, (HelWord)handle);
 };
@@ -371,6 +429,24 @@ extern inline __attribute__ (( always_inline )) HelError helFutexWake(int *point
 	return helSyscall1(kHelCallFutexWake, (HelWord)pointer);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helFutexWakeN(int *pointer,
+		unsigned int count) {
+	return helSyscall2(kHelCallFutexWakeN, (HelWord)pointer, (HelWord)count);
+};
+
+extern inline __attribute__ (( always_inline )) HelError helFutexRequeue(int *pointer,
+		int expected, unsigned int wakeCount, int *target, unsigned int requeueCount) {
+	return helSyscall5(kHelCallFutexRequeue, (HelWord)pointer, (HelWord)expected,
+			(HelWord)wakeCount, (HelWord)target, (HelWord)requeueCount);
+};
+
+extern inline __attribute__ (( always_inline )) HelError helFutexWakeOp(int *pointer,
+		unsigned int count, int *target, unsigned int targetCount,
+		const struct HelFutexOp *op) {
+	return helSyscall5(kHelCallFutexWakeOp, (HelWord)pointer, (HelWord)count,
+			(HelWord)target, (HelWord)targetCount, (HelWord)op);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helCreateOneshotEvent(HelHandle *handle) {
 	HelWord handle_word;
 	HelError error = helSyscall0_1(kHelCallCreateOneshotEvent, &handle_word);
@@ -389,6 +465,20 @@ extern inline __attribute__ (( always_inline )) HelError helRaiseEvent(HelHandle
 	return helSyscall1(kHelCallRaiseEvent, (HelWord)handle);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helAccessMemoryPressure(HelHandle *handle) {
+	HelWord handle_word;
+	HelError error = helSyscall0_1(kHelCallAccessMemoryPressure, &handle_word);
+	*handle = (HelHandle)handle_word;
+	return error;
+};
+
+extern inline __attribute__ (( always_inline )) HelError helGetMemoryPressure(int *level) {
+	HelWord level_word;
+	HelError error = helSyscall0_1(kHelCallGetMemoryPressure, &level_word);
+	*level = (int)level_word;
+	return error;
+};
+
 extern inline __attribute__ (( always_inline )) HelError helAccessIrq(int number, 
 		HelHandle *handle) {
 	HelWord handle_word;
@@ -403,12 +493,36 @@ extern inline __attribute__ (( always_inline )) HelError helAcknowledgeIrq(HelHa
 			(HelWord)sequence);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helSetIrqAffinity(HelHandle handle,
+		int cpu) {
+	return helSyscall2(kHelCallSetIrqAffinity, (HelWord)handle, (HelWord)cpu);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helSubmitAwaitEvent(HelHandle handle,
 		uint64_t sequence, HelHandle queue, uintptr_t context) {
 	return helSyscall4(kHelCallSubmitAwaitEvent, (HelWord)handle, (HelWord)sequence,
 			(HelWord)queue, (HelWord)context);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helCreateWaitSet(HelHandle *handle) {
+	HelWord handle_word;
+	HelError error = helSyscall0_1(kHelCallCreateWaitSet, &handle_word);
+	*handle = (HelHandle)handle_word;
+	return error;
+};
+
+extern inline __attribute__ (( always_inline )) HelError helAddToWaitSet(HelHandle waitSet,
+		HelHandle handle, uint64_t sequence, uintptr_t context) {
+	return helSyscall4(kHelCallAddToWaitSet, (HelWord)waitSet, (HelWord)handle,
+			(HelWord)sequence, (HelWord)context);
+};
+
+extern inline __attribute__ (( always_inline )) HelError helSubmitAwaitWaitSet(HelHandle waitSet,
+		HelHandle queue, uintptr_t context) {
+	return helSyscall3(kHelCallSubmitAwaitWaitSet, (HelWord)waitSet, (HelWord)queue,
+			(HelWord)context);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helAutomateIrq(HelHandle handle,
 		uint32_t flags, HelHandle kernlet) {
 	return helSyscall3(kHelCallAutomateIrq, (HelWord)handle, (HelWord)flags,
@@ -441,12 +555,33 @@ extern inline __attribute__ (( always_inline )) HelError helBindKernlet(HelHandl
 	return error;
 };
 
+extern inline __attribute__ (( always_inline )) HelError helClassifyIrqRx(HelHandle handle,
+		HelHandle kernlet, const struct HelRxRing *ring) {
+	return helSyscall3(kHelCallClassifyIrqRx, (HelWord)handle, (HelWord)kernlet,
+			(HelWord)ring);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helSetAffinity(HelHandle thread,
 		uint8_t *mask, size_t size) {
 	return helSyscall3(kHelCallSetAffinity, (HelWord)thread,
 			(HelWord)mask, (HelWord)size);
 };
 
+extern inline __attribute__ (( always_inline )) HelError helSetTimerSlack(HelHandle thread,
+		uint64_t slack) {
+	return helSyscall2(kHelCallSetTimerSlack, (HelWord)thread, (HelWord)slack);
+};
+
+extern inline __attribute__ (( always_inline )) HelError helGetCurrentCpu(int *cpu,
+		int *num_cpus) {
+	HelWord cpu_word;
+	HelWord num_word;
+	HelError error = helSyscall0_2(kHelCallGetCurrentCpu, &cpu_word, &num_word);
+	*cpu = (int)cpu_word;
+	*num_cpus = (int)num_word;
+	return error;
+};
+
 extern inline __attribute__ (( always_inline )) HelError helQueryRegisterInfo(int set,
 		struct HelRegisterInfo *info) {
 	return helSyscall2(kHelCallQueryRegisterInfo, (HelWord)set, (HelWord)info);
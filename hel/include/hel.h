@@ -16,7 +16,7 @@
 
 enum {
 	// largest system call number plus 1
-	kHelNumCalls = 103,
+	kHelNumCalls = 119,
 
 	kHelCallLog = 1,
 	kHelCallPanic = 10,
@@ -45,21 +45,27 @@ enum {
 	kHelCallAlterMemoryIndirection = 52,
 	kHelCallMapMemory = 44,
 	kHelCallSubmitProtectMemory = 99,
+	kHelCallSubmitPopulateMemory = 107,
 	kHelCallSubmitSynchronizeSpace = 53,
 	kHelCallUnmapMemory = 36,
 	kHelCallPointerPhysical = 43,
 	kHelCallSubmitReadMemory = 77,
 	kHelCallSubmitWriteMemory = 78,
+	kHelCallSubmitReadMemoryVector = 120,
+	kHelCallSubmitWriteMemoryVector = 121,
 	kHelCallMemoryInfo = 26,
 	kHelCallSubmitManageMemory = 46,
 	kHelCallUpdateMemory = 47,
 	kHelCallSubmitLockMemoryView = 48,
 	kHelCallLoadahead = 49,
+	kHelCallQueryWriteback = 117,
 	kHelCallCreateVirtualizedSpace = 50,
+	kHelCallGetDirtyLog = 112,
 
 	kHelCallCreateThread = 67,
 	kHelCallQueryThreadStats = 95,
 	kHelCallSetPriority = 85,
+	kHelCallSetDeadline = 122,
 	kHelCallYield = 34,
 	kHelCallSubmitObserve = 74,
 	kHelCallKillThread = 87,
@@ -70,6 +76,7 @@ enum {
 	kHelCallQueryRegisterInfo = 102,
 	kHelCallWriteFsBase = 41,
 	kHelCallGetClock = 42,
+	kHelCallMapClockPage = 108,
 	kHelCallSubmitAwaitClock = 80,
 	kHelCallCreateVirtualizedCpu = 37,
 	kHelCallRunVirtualizedCpu = 38,
@@ -77,17 +84,27 @@ enum {
 
 	kHelCallCreateStream = 68,
 	kHelCallSubmitAsync = 79,
+	kHelCallSubmitAsyncBatch = 105,
 	kHelCallShutdownLane = 91,
 
 	kHelCallFutexWait = 73,
 	kHelCallFutexWake = 71,
+	kHelCallFutexWakeN = 103,
+	kHelCallFutexRequeue = 115,
+	kHelCallFutexWakeOp = 116,
 
 	kHelCallCreateOneshotEvent = 96,
 	kHelCallCreateBitsetEvent = 97,
 	kHelCallRaiseEvent = 98,
+	kHelCallAccessMemoryPressure = 113,
+	kHelCallGetMemoryPressure = 114,
 	kHelCallAccessIrq = 14,
 	kHelCallAcknowledgeIrq = 81,
+	kHelCallSetIrqAffinity = 106,
 	kHelCallSubmitAwaitEvent = 82,
+	kHelCallCreateWaitSet = 109,
+	kHelCallAddToWaitSet = 110,
+	kHelCallSubmitAwaitWaitSet = 111,
 	kHelCallAutomateIrq = 94,
 
 	kHelCallAccessIo = 11,
@@ -97,6 +114,9 @@ enum {
 	kHelCallBindKernlet = 93,
 
 	kHelCallSetAffinity = 100,
+	kHelCallSetTimerSlack = 104,
+	kHelCallGetCurrentCpu = 118,
+	kHelCallClassifyIrqRx = 119,
 
 	kHelCallSuper = 0x80000000
 };
@@ -206,6 +226,14 @@ enum {
 	kHelActionPullDescriptor = 4
 };
 
+// Maximal message size of kHelActionRecvInline.
+// HelAction::length selects the size; zero selects kHelRecvInlineDefault.
+// Note that the completion must also fit into a chunk of the IPC queue.
+enum {
+	kHelRecvInlineDefault = 128,
+	kHelRecvInlineMax = 4096
+};
+
 enum {
 	kHelItemChain = 1,
 	kHelItemAncillary = 2,
@@ -217,6 +245,20 @@ struct HelSgItem {
 	size_t length;
 };
 
+//! Entry of helSubmitReadMemoryVector() and helSubmitWriteMemoryVector().
+struct HelRemoteRange {
+	//! Address that is accessed, relative to the descriptor.
+	uintptr_t address;
+	//! Buffer in the address space of the caller.
+	void *buffer;
+	size_t length;
+};
+
+enum {
+	//! Maximal number of ranges per helSubmitReadMemoryVector() (or write) call.
+	kHelMaxRemoteRanges = 1024
+};
+
 struct HelAction {
 	int type;
 	uint32_t flags;
@@ -226,6 +268,20 @@ struct HelAction {
 	HelHandle handle;
 };
 
+//! Entry of helSubmitAsyncBatch().
+struct HelBatchSubmission {
+	//! Handle to the lane that the actions are passed to.
+	HelHandle handle;
+	//! Pointer to array of message items.
+	const struct HelAction *actions;
+	//! Number of elements in @p actions.
+	size_t count;
+	//! Context of the completion that is posted to the queue.
+	uintptr_t context;
+	//! Set by the kernel to the error of this submission.
+	HelError error;
+};
+
 enum {
 	kHelDescMemory = 1,
 	kHelDescAddressSpace = 2,
@@ -242,6 +298,47 @@ struct HelDescriptorInfo {
 enum HelAllocFlags {
 	kHelAllocContinuous = 4,
 	kHelAllocOnDemand = 1,
+	//! Bits 8 to 15 of the flags of helAllocateMemory() specify the log2 of
+	//! the preferred chunk size (see helAllocateMemory()).
+	kHelAllocChunkOrderShift = 8,
+	kHelAllocChunkOrderMask = 0xFF00,
+};
+
+enum HelSliceFlags {
+	//! Map the slice as write-combining (PAT WC on x86, Normal-NC on AArch64).
+	//! Only supported for physical memory, e.g., from ::helAccessPhysical or PCI BARs.
+	//! Intended for framebuffers.
+	kHelSliceCacheWriteCombine = 1,
+};
+
+enum HelFutexOps {
+	kHelFutexOpSet = 0,
+	kHelFutexOpAdd = 1,
+	kHelFutexOpOr = 2,
+	kHelFutexOpAndNot = 3,
+	kHelFutexOpXor = 4,
+};
+
+enum HelFutexCmps {
+	kHelFutexCmpEq = 0,
+	kHelFutexCmpNe = 1,
+	kHelFutexCmpLt = 2,
+	kHelFutexCmpLe = 3,
+	kHelFutexCmpGt = 4,
+	kHelFutexCmpGe = 5,
+};
+
+//! Operation that helFutexWakeOp() applies to its target futex.
+struct HelFutexOp {
+	//! One of the kHelFutexOp* values.
+	int op;
+	//! Operand of @p op.
+	int opArg;
+	//! One of the kHelFutexCmp* values. Compares the previous value of the target futex
+	//! against @p cmpArg.
+	int cmp;
+	//! Operand of @p cmp.
+	int cmpArg;
 };
 
 struct HelAllocRestrictions {
@@ -262,7 +359,15 @@ enum HelMapFlags {
 	kHelMapProtRead = 256,
 	kHelMapProtWrite = 512,
 	kHelMapProtExecute = 1024,
-	kHelMapDontRequireBacking = 128
+	kHelMapDontRequireBacking = 128,
+	// Make all pages of the mapping present and map them before helMapMemory() returns.
+	kHelMapPopulate = 2048,
+	// Controls the window of fault-around, i.e., how many pages that are already present
+	// are mapped on each page fault. If the field is zero, the kernel's default is used.
+	// Otherwise, the window is (page size << (value - 1)) bytes; hence, 1 disables fault-around.
+	// The kernel limits the window to 2 MiB.
+	kHelMapFaultAroundShift = 16,
+	kHelMapFaultAroundMask = 0xF0000
 };
 
 enum HelThreadFlags {
@@ -510,6 +615,50 @@ struct HelEventResult {
 	uint64_t sequence;
 };
 
+enum {
+	//! Maximal number of events that are returned by ::helSubmitAwaitWaitSet.
+	kHelMaxWaitSetEvents = 16
+};
+
+struct HelWaitSetEvent {
+	HelError error;
+	uint32_t bitset;
+	uint64_t sequence;
+	//! Context that was passed to ::helAddToWaitSet.
+	uintptr_t context;
+};
+
+//! Result of ::helSubmitAwaitWaitSet.
+//! Only the first @p numEvents elements of @p events are written
+//! (the queue element is truncated accordingly).
+struct HelWaitSetResult {
+	HelError error;
+	uint32_t numEvents;
+	struct HelWaitSetEvent events[kHelMaxWaitSetEvents];
+};
+
+enum HelClockPageFlags {
+	//! The clock can be computed from the raw counter (the TSC on x86).
+	//! If this flag is not set, ::helGetClock must be used instead.
+	kHelClockPageCounterValid = 1
+};
+
+//! Layout of the clock page (see ::helMapClockPage).
+//!
+//! The kernel updates the page under a seqlock: readers retry if @p seqlock
+//! is odd or if it changed while the other fields were read.
+//! The value of ::helGetClock is
+//! refNanos + (((counter - refCounter) * mult) >> shift),
+//! where the multiplication is done in 128 bits.
+struct HelClockPage {
+	uint64_t seqlock;
+	uint32_t flags;
+	uint32_t shift;
+	uint64_t mult;
+	uint64_t refCounter;
+	uint64_t refNanos;
+};
+
 enum HelIrqFlags {
 	kHelIrqExclusive = 1,
 	kHelIrqManualAcknowledge = 2
@@ -520,14 +669,95 @@ enum HelAckFlags {
 	kHelAckNack = 3,
 	kHelAckKick = 1,
 	kHelAckClear = 0x100,
+	// Only valid with kHelAckAcknowledge: the IRQ was handled and the caller
+	// supports polled mode (see helAcknowledgeIrq()).
+	kHelAckPoll = 0x200,
+	// Like kHelAckPoll but the caller exhausted its budget and should be polled immediately.
+	kHelAckPollNow = 0x400,
+};
+
+enum HelMemoryPressure {
+	kHelMemoryPressureNone = 0,
+	// The kernel evicts cached pages to keep memory available.
+	kHelMemoryPressureLow = 1,
+	// Eviction does not keep up; servers should shrink their caches.
+	kHelMemoryPressureMedium = 2,
+	// Allocations are about to fail; servers should drop all caches that they can rebuild.
+	kHelMemoryPressureCritical = 3
 };
 
 union HelKernletData {
 	HelHandle handle;
 };
 
+enum {
+	// Split virtq; the used ring is classified, frames are located through the descriptor table.
+	kHelRxRingVirtqSplit = 1
+};
+
+enum {
+	// The device only interrupts once the used ring passes the index at eventOffset
+	// (i.e., VIRTIO_F_EVENT_IDX was negotiated). The kernel advances that index
+	// if it does not wake up the driver.
+	kHelRxRingEventIndex = 1
+};
+
+// Verdicts of RX classification kernlets, see helClassifyIrqRx().
+enum {
+	kHelRxDeliver = 0,
+	kHelRxDrop = 1,
+	// kHelRxSteer + n steers the frame to receive queue n.
+	kHelRxSteer = 2,
+
+	// Verdict entries store the verdict in the low bits and the used ring index
+	// of the classified entry in the high 16 bits.
+	kHelRxVerdictMask = 0xFFFF
+};
+
+struct HelRxRing {
+	int format;
+	uint32_t flags;
+	// Memory object that contains the ring (at most 64 KiB).
+	HelHandle memory;
+	// Number of descriptors (and used ring entries); a power of two.
+	uint32_t numDescriptors;
+	// Offsets of the descriptor table and the used ring within the memory object.
+	uintptr_t tableOffset;
+	uintptr_t usedOffset;
+	// Offset of the 16-bit event index, see kHelRxRingEventIndex.
+	uintptr_t eventOffset;
+	// Offset of an array of numDescriptors 32-bit verdict entries (one per used ring entry).
+	uintptr_t verdictOffset;
+	// Size of the device's per-frame header that precedes the Ethernet frame.
+	uint32_t headerSize;
+	// The IRQ wakes up its waiters once this many frames were dropped,
+	// even if no frame was delivered; this lets the driver recycle the buffers.
+	uint32_t wakeThreshold;
+};
+
+enum {
+	kHelNumWakeupLatencyBuckets = 16
+};
+
 struct HelThreadStats {
 	uint64_t userTime;
+	// Time that the thread was runnable but did not run (in nanoseconds).
+	uint64_t waitTime;
+	uint64_t numTimeslices;
+	uint64_t numVoluntarySwitches;
+	uint64_t numInvoluntarySwitches;
+	uint64_t numMigrations;
+	// Histogram of the time between wakeup and execution of the thread.
+	// Bucket 0 counts latencies below 1024 ns, bucket i counts latencies
+	// in [1024 << (i - 1), 1024 << i) ns. The last bucket also counts larger latencies.
+	uint64_t wakeupLatency[kHelNumWakeupLatencyBuckets];
+	// Number of times that the FPU/SIMD state was saved, restored on resume
+	// and restored lazily on the first use after a resume.
+	uint64_t numSimdSaves;
+	uint64_t numSimdRestores;
+	uint64_t numSimdTraps;
+	// Number of times that the thread exhausted its runtime in the deadline class.
+	uint64_t numDeadlineThrottles;
 };
 
 enum {
@@ -631,6 +861,12 @@ HEL_C_LINKAGE HelError helCancelAsync(HelHandle queueHandle, uint64_t asyncId);
 //! @param[in] size
 //!    	Size of the memory object in bytes.
 //!    	Must be aligned to the system's page size.
+//! @param[in] flags
+//!    	Combination of ::HelAllocFlags. The chunk order (see ::kHelAllocChunkOrderShift)
+//!    	requests that the memory is backed by physically contiguous chunks of the given size
+//!    	(at most 1 GiB), which allows the kernel to map it using huge pages.
+//!    	Chunks that cannot be allocated are backed by individual pages instead.
+//!    	An order of zero selects the default chunk size.
 //! @param[in] restrictions
 //!    	Specifies restrictions for the kernel's memory allocator.
 //!    	May be @p NULL if there are no restrictions.
@@ -703,6 +939,12 @@ HEL_C_LINKAGE HelError helCreateIndirectMemory(size_t numSlots, HelHandle *handl
 HEL_C_LINKAGE HelError helAlterMemoryIndirection(HelHandle indirectHandle, size_t slotIndex,
 		HelHandle memoryHandle, uintptr_t offset, size_t size);
 
+//! Creates a memory object that refers to a part of another memory object.
+//!
+//! @param[in] flags
+//!    	Combination of ::HelSliceFlags.
+//!    	::kHelSliceCacheWriteCombine fails with ::kHelErrUnsupportedOperation
+//!    	if the memory object is not physical memory.
 HEL_C_LINKAGE HelError helCreateSliceView(HelHandle bundle, uintptr_t offset, size_t size,
 		uint32_t flags, HelHandle *handle);
 
@@ -755,6 +997,25 @@ HEL_C_LINKAGE HelError helSubmitProtectMemory(HelHandle spaceHandle,
 		void *pointer, size_t size, uint32_t flags,
 		HelHandle queueHandle, uintptr_t context);
 
+//! Makes the pages of a range of mappings present and maps them.
+//!
+//! This is the asynchronous counterpart of @p kHelMapPopulate.
+//! Pages are fetched (which might require I/O) while the range is locked;
+//! they can be evicted again after this operation completes.
+//!
+//! This is an asynchronous operation.
+//! @param[in] spaceHandle
+//!     Handle to the address space containing @p pointer.
+//! @param[in] pointer
+//!     Pointer to the range that is populated.
+//!    	Must be aligned to the system's page size.
+//! @param[in] size
+//!    	Size of the range that is populated.
+//!    	Must be aligned to the system's page size.
+HEL_C_LINKAGE HelError helSubmitPopulateMemory(HelHandle spaceHandle,
+		void *pointer, size_t size,
+		HelHandle queueHandle, uintptr_t context);
+
 //! Notifies the kernel of dirty pages in a memory mapping.
 //!
 //! This system call returns after the kernel has scanned all specified pages
@@ -818,6 +1079,30 @@ HEL_C_LINKAGE HelError helSubmitWriteMemory(HelHandle handle, uintptr_t address,
 		size_t length, const void *buffer,
 		HelHandle queue, uintptr_t context);
 
+//! Load memory from multiple ranges of an address space.
+//!
+//! This is an asynchronous operation that completes with a ::HelLengthResult.
+//! The ranges are processed in order; processing stops at the first fault.
+//! As for process_vm_readv(), the operation only fails if no byte could be copied;
+//! otherwise, the result contains the number of copied bytes.
+//! @param[in] handle
+//!     Handle to the descriptor. This system call supports
+//!     address spaces (see ::helCreateAddressSpace) and threads.
+//! @param[in] ranges
+//!     Pointer to an array of (at most ::kHelMaxRemoteRanges) ranges.
+//! @param[in] count
+//!     Number of elements in @p ranges.
+HEL_C_LINKAGE HelError helSubmitReadMemoryVector(HelHandle handle,
+		const struct HelRemoteRange *ranges, size_t count,
+		HelHandle queue, uintptr_t context);
+
+//! Store memory to multiple ranges of an address space.
+//!
+//! Like ::helSubmitReadMemoryVector but copies from the buffers to the descriptor.
+HEL_C_LINKAGE HelError helSubmitWriteMemoryVector(HelHandle handle,
+		const struct HelRemoteRange *ranges, size_t count,
+		HelHandle queue, uintptr_t context);
+
 HEL_C_LINKAGE HelError helMemoryInfo(HelHandle handle,
 		size_t *size);
 
@@ -841,8 +1126,41 @@ HEL_C_LINKAGE HelError helSubmitLockMemoryView(HelHandle handle, uintptr_t offse
 //!     Length of the memory range that is preloaded.
 HEL_C_LINKAGE HelError helLoadahead(HelHandle handle, uintptr_t offset, size_t length);
 
+//! Counts the pages of a managed memory range that still need to be written back.
+//!
+//! These are pages that are dirty (including pages that were dirtied again
+//! during their writeback) and pages that were handed out by ::helSubmitManageMemory
+//! for writeback but not completed by ::helUpdateMemory yet.
+//! Once this returns zero, all modifications made before the call were written back.
+//! @param[in] handle
+//!     Handle to the backing memory object (see ::helCreateManagedMemory).
+//! @param[in] offset
+//!     Offset in bytes, relative to @p handle. Must be page-aligned.
+//! @param[in] length
+//!     Length of the memory range in bytes. Must be page-aligned.
+//! @param[out] count
+//!     Number of pages in the range that need writeback.
+HEL_C_LINKAGE HelError helQueryWriteback(HelHandle handle, uintptr_t offset, size_t length,
+		size_t *count);
+
 HEL_C_LINKAGE HelError helCreateVirtualizedSpace(HelHandle *handle);
 
+//! Retrieves and resets the dirty state of the pages of a virtualized space.
+//!
+//! Pages that were written by the guest since the last call are reported as dirty.
+//! Fetching and clearing the dirty state is atomic with respect to guest writes.
+//! @param[in] handle
+//!     Handle to the virtualized space.
+//! @param[in] address
+//!     Guest physical address of the range. Must be page aligned.
+//! @param[in] length
+//!     Length of the range. Must be a multiple of the page size.
+//! @param[out] bitmap
+//!     Bitmap that receives one bit per page (LSB first);
+//!     must be at least @p length / (8 * page size) bytes long (rounded up).
+HEL_C_LINKAGE HelError helGetDirtyLog(HelHandle handle, uintptr_t address, size_t length,
+		void *bitmap);
+
 //! @}
 //! @name Thread Management
 //! @{
@@ -880,6 +1198,30 @@ HEL_C_LINKAGE HelError helQueryThreadStats(HelHandle handle, struct HelThreadSta
 //!     New priority value of the thread.
 HEL_C_LINKAGE HelError helSetPriority(HelHandle handle, int priority);
 
+//! Move a thread to the deadline scheduling class (or back to the regular class).
+//!
+//! In each period, the thread is guaranteed to receive runtime nanoseconds of CPU time
+//! within deadline nanoseconds after the start of the period. Runnable threads
+//! in the deadline class preempt all other threads (regardless of their priority)
+//! and run in earliest-deadline-first order. Once a thread exhausts its runtime,
+//! it does not run again before its next period starts. This is intended for
+//! threads that service IRQs and need bounded wakeup latency.
+//!
+//! Fails with ::kHelErrIllegalState if the kernel cannot guarantee the
+//! requested bandwidth (runtime / period) in addition to that of all other
+//! threads in the deadline class.
+//! @param[in] thread
+//!     Handle to the thread. Currently, only ::kHelThisThread is supported.
+//! @param[in] runtime
+//!     Runtime per period in nanoseconds. Zero moves the thread back
+//!     to the regular class (all other arguments must be zero in this case).
+//! @param[in] deadline
+//!     Relative deadline in nanoseconds. Must be in [runtime, period].
+//! @param[in] period
+//!     Period in nanoseconds.
+HEL_C_LINKAGE HelError helSetDeadline(HelHandle thread, uint64_t runtime,
+		uint64_t deadline, uint64_t period);
+
 //! Yields the current thread.
 HEL_C_LINKAGE HelError helYield();
 
@@ -947,6 +1289,17 @@ HEL_C_LINKAGE HelError helWriteFsBase(void *pointer);
 //!     Current value of the system-wide clock in nanoseconds since boot.
 HEL_C_LINKAGE HelError helGetClock(uint64_t *counter);
 
+//! Map the clock page (see ::HelClockPage) into an address space.
+//!
+//! The clock page allows userspace to compute the value of ::helGetClock
+//! without entering the kernel. It is mapped read-only and cannot
+//! be made writable.
+//! @param[in] spaceHandle
+//!     Handle to the address space or ::kHelNullHandle for the current one.
+//! @param[out] pointer
+//!     Address of the clock page.
+HEL_C_LINKAGE HelError helMapClockPage(HelHandle spaceHandle, void **pointer);
+
 //! Wait until time passes.
 //!
 //! This is an asynchronous operation.
@@ -964,15 +1317,42 @@ HEL_C_LINKAGE HelError helRunVirtualizedCpu(HelHandle handle, struct HelVmexitRe
 HEL_C_LINKAGE HelError helGetRandomBytes(void *buffer, size_t wantedSize, size_t *actualSize);
 
 //! Set a thread's CPU affinity mask.
+//!
+//! The thread only runs on CPUs whose bit is set in the mask;
+//! the load balancer only moves the thread between these CPUs.
+//! If the thread currently runs on a CPU outside of the mask, it is migrated
+//! to the least loaded CPU within the mask.
 //! @param[in] handle
 //!     Handle to the thread.
 //! @param[in] mask
 //!     Pointer to a bit mask of CPUs to schedule on.
+//!     Must contain at least one existing CPU.
 //! @param[in] size
 //!     Size of bit mask.
 HEL_C_LINKAGE HelError helSetAffinity(HelHandle thread,
 		uint8_t *mask, size_t size);
 
+//! Set a thread's timer slack.
+//!
+//! Timeouts of the thread (i.e., helSubmitAwaitClock() and helFutexWait() deadlines)
+//! may elapse up to this many nanoseconds late; this allows the kernel to coalesce
+//! nearby deadlines. Defaults to 50 microseconds.
+//! @param[in] handle
+//!     Handle to the thread. Currently, only ::kHelThisThread is supported.
+//! @param[in] slack
+//!     Timer slack in nanoseconds.
+HEL_C_LINKAGE HelError helSetTimerSlack(HelHandle thread, uint64_t slack);
+
+//! Query the CPU that the calling thread runs on.
+//!
+//! The result is only a hint: the thread may be migrated at any time
+//! (unless its affinity mask contains only a single CPU).
+//! @param[out] cpu
+//!     Index of the current CPU.
+//! @param[out] num_cpus
+//!     Number of CPUs in the system.
+HEL_C_LINKAGE HelError helGetCurrentCpu(int *cpu, int *num_cpus);
+
 //! @}
 //! @name Message Passing
 //! @{
@@ -994,6 +1374,20 @@ HEL_C_LINKAGE HelError helCreateStream(HelHandle *lane1, HelHandle *lane2);
 HEL_C_LINKAGE HelError helSubmitAsync(HelHandle handle, const struct HelAction *actions,
 		size_t count, HelHandle queue, uintptr_t context, uint32_t flags);
 
+//! Pass messages on multiple lanes in a single call.
+//!
+//! Equivalent to calling helSubmitAsync() for each entry of @p submissions.
+//! The error of each submission is stored in its @p error field;
+//! a failing submission does not prevent the remaining ones from being submitted.
+//! @param[in,out] submissions
+//!     Pointer to array of submissions.
+//! @param[in] count
+//!     Number of elements in @p submissions.
+//! @param[in] queue
+//!     Queue that completions of all submissions are posted to.
+HEL_C_LINKAGE HelError helSubmitAsyncBatch(struct HelBatchSubmission *submissions,
+		size_t count, HelHandle queue, uint32_t flags);
+
 HEL_C_LINKAGE HelError helShutdownLane(HelHandle handle);
 
 //! @}
@@ -1015,6 +1409,51 @@ HEL_C_LINKAGE HelError helFutexWait(int *pointer, int expected, int64_t deadline
 //!     Pointer that identifies the futex.
 HEL_C_LINKAGE HelError helFutexWake(int *pointer);
 
+//! Wakes up a limited number of waiters of a futex.
+//! @param[in] pointer
+//!     Pointer that identifies the futex.
+//! @param[in] count
+//!     Maximal number of waiters to wake up (in FIFO order).
+HEL_C_LINKAGE HelError helFutexWakeN(int *pointer, unsigned int count);
+
+//! Wakes up waiters of a futex and moves further waiters to another futex.
+//!
+//! The moved waiters are not woken up; they are woken by a future wake of @p target.
+//! This allows condition variable broadcasts to avoid thundering herds on the mutex.
+//! @param[in] pointer
+//!     Pointer that identifies the futex.
+//! @param[in] expected
+//!     Expected value of the futex. If the futex does not match this value
+//!     (at the time the waiters are moved), this function fails with ::kHelErrIllegalState
+//!     and no waiters are woken or moved.
+//! @param[in] wakeCount
+//!     Maximal number of waiters to wake up (in FIFO order).
+//! @param[in] target
+//!     Pointer that identifies the futex that remaining waiters are moved to.
+//! @param[in] requeueCount
+//!     Maximal number of waiters to move to @p target (in FIFO order).
+HEL_C_LINKAGE HelError helFutexRequeue(int *pointer, int expected, unsigned int wakeCount,
+		int *target, unsigned int requeueCount);
+
+//! Atomically modifies a futex and wakes up waiters of two futexes.
+//!
+//! Applies @p op to @p target, wakes up to @p count waiters of @p pointer and,
+//! if the comparison in @p op holds for the previous value of @p target,
+//! also wakes up to @p targetCount waiters of @p target.
+//! All of this happens atomically with respect to other futex operations.
+//! @param[in] pointer
+//!     Pointer that identifies the futex.
+//! @param[in] count
+//!     Maximal number of waiters of @p pointer to wake up (in FIFO order).
+//! @param[in] target
+//!     Pointer that identifies the futex that is modified.
+//! @param[in] targetCount
+//!     Maximal number of waiters of @p target to wake up (in FIFO order).
+//! @param[in] op
+//!     Operation and comparison that are applied to @p target.
+HEL_C_LINKAGE HelError helFutexWakeOp(int *pointer, unsigned int count,
+		int *target, unsigned int targetCount, const struct HelFutexOp *op);
+
 //! @}
 //! @name Event Handling
 //! @{
@@ -1034,10 +1473,56 @@ HEL_C_LINKAGE HelError helCreateBitsetEvent(HelHandle *handle);
 //!     Handle to the event that will be raised.
 HEL_C_LINKAGE HelError helRaiseEvent(HelHandle handle);
 
+//! Access the system-wide memory pressure event.
+//!
+//! The event is a bitset event that can be awaited using helSubmitAwaitEvent()
+//! or helAddToWaitSet(). Whenever the memory pressure changes to a new level,
+//! the kernel raises bit (1 << level), where level is one of kHelMemoryPressure*.
+//! The kernel applies hysteresis, i.e., a level is only left once considerably
+//! more memory is available than what is required to enter it.
+//! Since multiple changes can be reported at once, use helGetMemoryPressure()
+//! to determine the current level.
+//! @param[out] handle
+//!     Handle to the event.
+HEL_C_LINKAGE HelError helAccessMemoryPressure(HelHandle *handle);
+
+//! Query the current memory pressure level.
+//! @param[out] level
+//!     One of kHelMemoryPressure*.
+HEL_C_LINKAGE HelError helGetMemoryPressure(int *level);
+
 HEL_C_LINKAGE HelError helAccessIrq(int number, HelHandle *handle);
 
+//! Acknowledge, NACK or kick an IRQ.
+//!
+//! If the IRQ is raised at a high rate, the kernel can switch it to polled mode:
+//! the IRQ stays masked after it is acknowledged and its sequence number is advanced
+//! periodically instead (as if the IRQ was raised by hardware).
+//! The kernel only does so if all users of the IRQ acknowledge with @p kHelAckPoll,
+//! i.e., if they found work during the last IRQ.
+//! Users that handle a bounded number of completions per IRQ should pass
+//! @p kHelAckPollNow if they exhausted their budget.
+//! Acknowledging without @p kHelAckPoll (or a NACK) during polled mode
+//! returns the IRQ to interrupt mode.
+//! @param[in] handle
+//!     Handle to the IRQ.
+//! @param[in] flags
+//!     One of @p kHelAckAcknowledge, @p kHelAckNack or @p kHelAckKick,
+//!     optionally combined with @p kHelAckClear (for kicks),
+//!     @p kHelAckPoll or @p kHelAckPollNow (for acknowledgements).
+//! @param[in] sequence
+//!     Sequence number of the IRQ that is acknowledged.
 HEL_C_LINKAGE HelError helAcknowledgeIrq(HelHandle handle, uint32_t flags, uint64_t sequence);
 
+//! Change the CPU that an IRQ is delivered to.
+//!
+//! Only IRQs that can be retargeted (e.g., MSIs) support this operation.
+//! @param[in] handle
+//!     Handle to the IRQ.
+//! @param[in] cpu
+//!     Index of the CPU that the IRQ will be delivered to.
+HEL_C_LINKAGE HelError helSetIrqAffinity(HelHandle handle, int cpu);
+
 //! Wait for an event.
 //!
 //! This is an asynchronous operation.
@@ -1050,6 +1535,40 @@ HEL_C_LINKAGE HelError helSubmitAwaitEvent(HelHandle handle, uint64_t sequence,
 
 HEL_C_LINKAGE HelError helAutomateIrq(HelHandle handle, uint32_t flags, HelHandle kernlet);
 
+//! Create a wait set.
+//!
+//! Wait sets allow a single asynchronous operation to wait for
+//! multiple IRQs and events.
+//! @param[out] handle
+//!     Handle to the new wait set.
+HEL_C_LINKAGE HelError helCreateWaitSet(HelHandle *handle);
+
+//! Register an IRQ or event with a wait set.
+//!
+//! The kernel reports a trigger of the IRQ or event once its sequence number
+//! exceeds @p sequence. After a trigger was reported, the kernel continues
+//! to watch the source, starting at the reported sequence number.
+//! Registrations cannot be removed; they end when the wait set is closed.
+//! @param[in] waitSetHandle
+//!     Handle to the wait set.
+//! @param[in] handle
+//!     Handle to the IRQ or event.
+//! @param[in] sequence
+//!     Previous sequence number.
+//! @param[in] context
+//!     Value that is returned in the @p context field of ::HelWaitSetEvent.
+HEL_C_LINKAGE HelError helAddToWaitSet(HelHandle waitSetHandle, HelHandle handle,
+		uint64_t sequence, uintptr_t context);
+
+//! Wait until at least one source of a wait set triggers.
+//!
+//! This is an asynchronous operation.
+//! It returns up to ::kHelMaxWaitSetEvents triggers in a ::HelWaitSetResult.
+//! @param[in] waitSetHandle
+//!     Handle to the wait set.
+HEL_C_LINKAGE HelError helSubmitAwaitWaitSet(HelHandle waitSetHandle,
+		HelHandle queue, uintptr_t context);
+
 //! @}
 //! @name Input/Output
 //! @{
@@ -1080,6 +1599,26 @@ HEL_C_LINKAGE HelError helEnableFullIo();
 HEL_C_LINKAGE HelError helBindKernlet(HelHandle handle,
 		const union HelKernletData *data, size_t numData, HelHandle *boundHandle);
 
+//! Classify the frames of a NIC receive ring before the driver is woken up.
+//!
+//! Each time the IRQ is raised, the kernel invokes the kernlet once for each
+//! entry that the device added to the ring. The kernlet inspects the start
+//! of the frame through the __packet_* intrinsics and returns a verdict
+//! (::kHelRxDeliver, ::kHelRxDrop or ::kHelRxSteer + n). The kernel stores the
+//! verdict in the ring's verdict array. If all new frames were dropped,
+//! the IRQ is acknowledged without waking up its waiters.
+//! Entries that were not classified yet (e.g., because the driver processes
+//! the ring while the IRQ is raised) must be treated as ::kHelRxDeliver.
+//! Multiple rings can share an IRQ; the IRQ must not be automated.
+//! @param[in] handle
+//!     Handle to the IRQ that signals progress of the ring.
+//! @param[in] kernlet
+//!     Handle to the bound classification kernlet.
+//! @param[in] ring
+//!     Description of the ring.
+HEL_C_LINKAGE HelError helClassifyIrqRx(HelHandle handle, HelHandle kernlet,
+		const struct HelRxRing *ring);
+
 //! @}
 
 extern inline __attribute__ (( always_inline )) const char *_helErrorString(HelError code) {
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <hel.h>
+#include <hel-syscalls.h>
+
+namespace helix {
+
+// Returns the kernel's clock page. The page is mapped on first use.
+const HelClockPage *clockPage();
+
+// Returns the same value as helGetClock().
+// Avoids the syscall if the kernel allows the counter to be read from userspace.
+inline uint64_t currentClock() {
+#ifdef __x86_64__
+	auto page = clockPage();
+	while(true) {
+		auto seq = __atomic_load_n(&page->seqlock, __ATOMIC_ACQUIRE);
+		if(seq & 1)
+			continue;
+
+		auto flags = __atomic_load_n(&page->flags, __ATOMIC_RELAXED);
+		auto shift = __atomic_load_n(&page->shift, __ATOMIC_RELAXED);
+		auto mult = __atomic_load_n(&page->mult, __ATOMIC_RELAXED);
+		auto refCounter = __atomic_load_n(&page->refCounter, __ATOMIC_RELAXED);
+		auto refNanos = __atomic_load_n(&page->refNanos, __ATOMIC_RELAXED);
+		uint64_t counter = __builtin_ia32_rdtsc();
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&page->seqlock, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if(!(flags & kHelClockPageCounterValid))
+			break;
+		return refNanos + static_cast<uint64_t>(
+				(static_cast<unsigned __int128>(counter - refCounter) * mult) >> shift);
+	}
+#endif
+
+	uint64_t nanos;
+	HEL_CHECK(helGetClock(&nanos));
+	return nanos;
+}
+
+} // namespace helix
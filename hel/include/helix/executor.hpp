@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <async/result.hpp>
+#include <helix/ipc.hpp>
+
+namespace helix {
+
+// Runs tasks on a fixed set of worker threads.
+//
+// Each worker owns its own Dispatcher (i.e., its own IPC queue). Since completions are
+// posted to the queue that an operation was submitted to, a coroutine that is resumed
+// by a completion keeps running on the worker that submitted the operation. In particular,
+// a coroutine that serves a lane stays on one worker once it has started.
+// Idle workers only steal tasks that did not start yet.
+struct Executor {
+	struct TaskNode {
+		virtual void run() = 0;
+
+	protected:
+		~TaskNode() = default;
+	};
+
+private:
+	struct WakeContext final : Context {
+		void complete(ElementHandle) override {
+			// Nothing to do; the worker re-checks its tasks after each completion.
+		}
+	};
+
+	struct Worker {
+		Executor *executor;
+		unsigned int index;
+		// Handle of the worker's IPC queue; used to wake the worker up.
+		HelHandle queueHandle = kHelNullHandle;
+
+		// Protects tasks and pinnedTasks.
+		std::mutex mutex;
+		// Tasks that can be stolen. The owner pops from the back, thieves from the front.
+		std::deque<TaskNode *> tasks;
+		// Tasks that must run on this worker.
+		std::deque<TaskNode *> pinnedTasks;
+
+		// Set while the worker blocks in Dispatcher::wait().
+		std::atomic<bool> sleeping{false};
+		WakeContext wakeContext;
+	};
+
+public:
+	// Creates numWorkers workers. Worker zero is the thread that constructs the executor;
+	// it starts processing tasks once it calls run(). The other workers start immediately.
+	explicit Executor(unsigned int numWorkers);
+
+	Executor(const Executor &) = delete;
+
+	Executor &operator= (const Executor &) = delete;
+
+	unsigned int numWorkers() {
+		return _workers.size();
+	}
+
+	// Returns the executor that the calling thread belongs to (or nullptr).
+	static Executor *current();
+
+	// Returns the index of the calling worker. Must be called from a worker.
+	static unsigned int currentWorker();
+
+	// Enqueues a task. On workers, the task is queued locally (and can be stolen
+	// by idle workers); otherwise, tasks are distributed round-robin.
+	void post(TaskNode *task);
+
+	// Enqueues a task that is only run by the given worker.
+	void postTo(unsigned int worker, TaskNode *task);
+
+	// Starts a sender (usually a coroutine) on one of the workers.
+	template<typename S>
+	void detach(S sender) {
+		post(new DetachTask<S>{std::move(sender)});
+	}
+
+	// Like detach() but always starts the sender on the given worker.
+	template<typename S>
+	void detachOn(unsigned int worker, S sender) {
+		postTo(worker, new DetachTask<S>{std::move(sender)});
+	}
+
+	// Processes tasks and completions on the calling thread (i.e., worker zero).
+	[[noreturn]] void run();
+
+	// ----------------------------------------------------------------------------------
+	// schedule(): continues the awaiting coroutine on some worker.
+	// ----------------------------------------------------------------------------------
+
+	template<typename Receiver>
+	struct ScheduleOperation final : private TaskNode {
+		ScheduleOperation(Executor *self, Receiver receiver)
+		: self_{self}, receiver_{std::move(receiver)} { }
+
+		ScheduleOperation(const ScheduleOperation &) = delete;
+
+		ScheduleOperation &operator= (const ScheduleOperation &) = delete;
+
+		void start() {
+			self_->post(this);
+		}
+
+	private:
+		void run() override {
+			async::execution::set_value(receiver_);
+		}
+
+		Executor *self_;
+		Receiver receiver_;
+	};
+
+	struct [[nodiscard]] ScheduleSender {
+		using value_type = void;
+
+		template<typename Receiver>
+		ScheduleOperation<Receiver> connect(Receiver receiver) {
+			return {self, std::move(receiver)};
+		}
+
+		async::sender_awaiter<ScheduleSender> operator co_await() {
+			return {*this};
+		}
+
+		Executor *self;
+	};
+
+	ScheduleSender schedule() {
+		return {this};
+	}
+
+private:
+	template<typename S>
+	struct DetachTask final : TaskNode {
+		DetachTask(S sender)
+		: sender{std::move(sender)} { }
+
+		void run() override {
+			async::detach(std::move(sender));
+			delete this;
+		}
+
+		S sender;
+	};
+
+	void _runWorker(Worker *self);
+	TaskNode *_takeTask(Worker *self);
+	void _wake(Worker *worker);
+	void _wakeIdle(Worker *except);
+
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::atomic<unsigned int> _nextWorker{0};
+};
+
+} // namespace helix
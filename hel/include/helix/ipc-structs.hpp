@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <string.h>
+#include <new>
 #include <type_traits>
 #include <frg/array.hpp>
 #include <frg/tuple.hpp>
@@ -410,7 +413,10 @@ struct RecvBuffer {
 	size_t size;
 };
 
-struct RecvInline { };
+struct RecvInline {
+	// Zero selects the kernel's default size.
+	size_t maxLength = 0;
+};
 
 struct PushDescriptor {
 	HelHandle handle;
@@ -418,6 +424,77 @@ struct PushDescriptor {
 
 struct PullDescriptor { };
 
+// Bump allocator for serialization buffers on top of caller-provided storage.
+// Memory is recycled once all allocations from the arena have been freed, hence
+// an arena that is reused for every exchange of a coroutine does not touch the heap
+// in steady state. Allocations that do not fit into the storage go to the heap.
+struct BufferArena {
+	BufferArena(void *storage, size_t size)
+	: _storage{static_cast<char *>(storage)}, _size{size} { }
+
+	BufferArena(const BufferArena &) = delete;
+	BufferArena &operator=(const BufferArena &) = delete;
+
+	void *allocate(size_t size) {
+		size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+		if(size > _size - _offset)
+			return operator new(size);
+		auto p = _storage + _offset;
+		_offset += size;
+		_numLive++;
+		return p;
+	}
+
+	void free(void *p) {
+		if(!p)
+			return;
+		auto cp = static_cast<char *>(p);
+		if(cp < _storage || cp >= _storage + _size) {
+			operator delete(p);
+			return;
+		}
+		FRG_ASSERT(_numLive);
+		if(!(--_numLive))
+			_offset = 0;
+	}
+
+private:
+	char *_storage;
+	size_t _size;
+	size_t _offset = 0;
+	size_t _numLive = 0;
+};
+
+template <size_t N>
+struct InlineArena : BufferArena {
+	InlineArena()
+	: BufferArena{_buffer, N} { }
+
+private:
+	alignas(max_align_t) char _buffer[N];
+};
+
+// Allocator (in the sense of frg::vector) that allocates from a BufferArena.
+struct ArenaAllocator {
+	ArenaAllocator(BufferArena &arena)
+	: _arena{&arena} { }
+
+	void *allocate(size_t size) {
+		return _arena->allocate(size);
+	}
+
+	void deallocate(void *p, size_t) {
+		_arena->free(p);
+	}
+
+	void free(void *p) {
+		_arena->free(p);
+	}
+
+private:
+	BufferArena *_arena;
+};
+
 template <typename Allocator>
 struct SendBragiHeadTail {
 	SendBragiHeadTail(Allocator allocator)
@@ -447,6 +524,12 @@ struct SendBragiHeadOnly {
 	frg::vector<uint8_t, Allocator> head;
 };
 
+// Stores the head inside the item itself; no allocation is required.
+template <size_t HeadSize>
+struct SendBragiInlineHead {
+	frg::array<uint8_t, HeadSize> head;
+};
+
 // --------------------------------------------------------------------
 // Construction functions
 // --------------------------------------------------------------------
@@ -489,8 +572,8 @@ inline auto recvBuffer(void *data, size_t length) {
 	return RecvBuffer{data, length};
 }
 
-inline auto recvInline() {
-	return RecvInline{};
+inline auto recvInline(size_t maxLength = 0) {
+	return RecvInline{maxLength};
 }
 
 inline auto pushDescriptor(BorrowedDescriptor desc) {
@@ -523,6 +606,17 @@ inline auto sendBragiHeadOnly(Message &msg, Allocator allocator = Allocator()) {
 	return item;
 }
 
+// Like the above but since the head has a fixed size, it is embedded into the item.
+template <typename Message>
+inline auto sendBragiHeadOnly(Message &msg) {
+	SendBragiInlineHead<Message::head_size> item{};
+	FRG_ASSERT(!msg.size_of_tail());
+
+	bragi::write_head_only(msg, item.head);
+
+	return item;
+}
+
 // --------------------------------------------------------------------
 // Item -> HelAction transformation
 // --------------------------------------------------------------------
@@ -617,10 +711,11 @@ inline auto createActionsArrayFor(bool chain, const RecvBuffer &item) {
 	return frg::array<HelAction, 1>{action};
 }
 
-inline auto createActionsArrayFor(bool chain, const RecvInline &) {
+inline auto createActionsArrayFor(bool chain, const RecvInline &item) {
 	HelAction action{};
 	action.type = kHelActionRecvInline;
 	action.flags = chain ? kHelItemChain : 0;
+	action.length = item.maxLength;
 
 	return frg::array<HelAction, 1>{action};
 }
@@ -670,6 +765,18 @@ inline auto createActionsArrayFor(bool chain, const SendBragiHeadOnly<Allocator>
 	return frg::array<HelAction, 1>{action};
 }
 
+template <size_t HeadSize>
+inline auto createActionsArrayFor(bool chain, const SendBragiInlineHead<HeadSize> &item) {
+	HelAction action{};
+
+	action.type = kHelActionSendFromBuffer;
+	action.flags = chain ? kHelItemChain : 0;
+	action.buffer = const_cast<uint8_t *>(item.head.data());
+	action.length = HeadSize;
+
+	return frg::array<HelAction, 1>{action};
+}
+
 // --------------------------------------------------------------------
 // Item -> Result type transformation
 // --------------------------------------------------------------------
@@ -730,6 +837,11 @@ inline auto resultTypeTuple(const SendBragiHeadOnly<Allocator> &) {
 	return frg::tuple<SendBufferResult>{};
 }
 
+template <size_t HeadSize>
+inline auto resultTypeTuple(const SendBragiInlineHead<HeadSize> &) {
+	return frg::tuple<SendBufferResult>{};
+}
+
 template <typename ...T>
 inline auto createResultsTuple(T &&...args) {
 	return frg::tuple_cat(resultTypeTuple(std::forward<T>(args))...);
@@ -793,4 +905,41 @@ private:
 	uint32_t sequence_;
 };
 
+struct AwaitWaitSetResult {
+	AwaitWaitSetResult() :valid_{false} {}
+
+	HelError error() {
+		FRG_ASSERT(valid_);
+		return error_;
+	}
+
+	size_t numEvents() {
+		FRG_ASSERT(valid_);
+		return numEvents_;
+	}
+
+	const HelWaitSetEvent &event(size_t i) {
+		FRG_ASSERT(valid_);
+		FRG_ASSERT(i < numEvents_);
+		return events_[i];
+	}
+
+	void parse(void *&ptr, ElementHandle) {
+		auto result = reinterpret_cast<HelWaitSetResult *>(ptr);
+		error_ = result->error;
+		numEvents_ = result->numEvents;
+		FRG_ASSERT(numEvents_ <= kHelMaxWaitSetEvents);
+		memcpy(events_, result->events, numEvents_ * sizeof(HelWaitSetEvent));
+		ptr = (char *)ptr + sizeof(HelWaitSetResult)
+				- (kHelMaxWaitSetEvents - numEvents_) * sizeof(HelWaitSetEvent);
+		valid_ = true;
+	}
+
+private:
+	bool valid_;
+	HelError error_;
+	size_t numEvents_;
+	HelWaitSetEvent events_[kHelMaxWaitSetEvents];
+};
+
 } // namespace helix_ng
@@ -154,6 +154,13 @@ struct CurrentDispatcherToken {
 
 inline constexpr CurrentDispatcherToken currentDispatcher;
 
+struct DispatcherStats {
+	// Number of waits that were satisfied while spinning.
+	uint64_t numSpinHits = 0;
+	// Number of times that the dispatcher blocked on the progress futex.
+	uint64_t numFutexSleeps = 0;
+};
+
 struct Dispatcher {
 	friend struct ElementHandle;
 
@@ -184,6 +191,16 @@ public:
 
 	Dispatcher &operator= (const Dispatcher &) = delete;
 
+	// In adaptive mode, the dispatcher polls the queue for a while before it blocks
+	// on the futex. The polling interval adapts to how often polling succeeds.
+	void setAdaptiveSpinning(bool enable) {
+		_adaptiveSpinning = enable;
+	}
+
+	DispatcherStats stats() {
+		return _stats;
+	}
+
 	HelHandle acquire() {
 		if(!_handle) {
 			HelQueueParameters params {
@@ -211,7 +228,20 @@ public:
 		return _handle;
 	}
 
+	// Blocks until a completion is available and dispatches it.
 	void wait() {
+		bool success = _dispatchOne(true);
+		assert(success);
+		(void)success;
+	}
+
+	// Like wait() but returns false instead of blocking if no completion is available.
+	bool poll() {
+		return _dispatchOne(false);
+	}
+
+private:
+	bool _dispatchOne(bool block) {
 		while(true) {
 			// TODO: Initialize all chunks when setting up the queue.
 			if(_retrieveIndex == _nextIndex) {
@@ -243,7 +273,8 @@ public:
 			}
 
 			bool done;
-			_waitProgressFutex(&done);
+			if(!_waitProgressFutex(&done, block))
+				return false;
 			if(done) {
 				_surrender(_numberOf(_retrieveIndex));
 
@@ -261,11 +292,10 @@ public:
 			_refCounts[_numberOf(_retrieveIndex)]++;
 			context->complete(ElementHandle{this, _numberOf(_retrieveIndex),
 					ptr + sizeof(HelElement)});
-			return;
+			return true;
 		}
 	}
 
-private:
 	void _surrender(int cn) {
 		assert(_refCounts[cn] > 0);
 		if(_refCounts[cn]-- > 1)
@@ -303,19 +333,56 @@ private:
 		}
 	}
 
-	void _waitProgressFutex(bool *done) {
+	static void _pause() {
+#if defined(__x86_64__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile ("yield");
+#endif
+	}
+
+	// Polls the progress futex for up to _spinIterations iterations.
+	// Returns true if the futex changed, i.e., if the kernel posted a completion.
+	bool _spinOnProgressFutex(int futex) {
+		for(unsigned int i = 0; i < _spinIterations; ++i) {
+			_pause();
+			if(__atomic_load_n(&_retrieveChunk()->progressFutex, __ATOMIC_RELAXED) != futex) {
+				_stats.numSpinHits++;
+				if(_spinIterations < maxSpinIterations)
+					_spinIterations *= 2;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Returns false if block is false and no progress was made.
+	bool _waitProgressFutex(bool *done, bool block) {
+		bool spun = false;
 		while(true) {
 			auto futex = __atomic_load_n(&_retrieveChunk()->progressFutex, __ATOMIC_ACQUIRE);
 			assert(!(futex & ~(kHelProgressMask | kHelProgressWaiters | kHelProgressDone)));
+
+			if(block && _adaptiveSpinning && !spun
+					&& _lastProgress == (futex & kHelProgressMask)
+					&& !(futex & kHelProgressDone)) {
+				spun = true;
+				if(_spinOnProgressFutex(futex))
+					continue;
+			}
+
 			do {
 				if(_lastProgress != (futex & kHelProgressMask)) {
 					*done = false;
-					return;
+					return true;
 				}else if(futex & kHelProgressDone) {
 					*done = true;
-					return;
+					return true;
 				}
 
+				if(!block)
+					return false;
+
 				if(futex & kHelProgressWaiters)
 					break; // Waiters bit is already set (in a previous iteration).
 			} while(!__atomic_compare_exchange_n(&_retrieveChunk()->progressFutex, &futex,
@@ -324,10 +391,17 @@ private:
 
 			HEL_CHECK(helFutexWait(&_retrieveChunk()->progressFutex,
 					_lastProgress | kHelProgressWaiters, -1));
+			_stats.numFutexSleeps++;
+			// Spinning did not help; spin for a shorter time next time.
+			if(spun && _spinIterations > minSpinIterations)
+				_spinIterations /= 2;
 		}
 	}
 
 private:
+	static constexpr unsigned int minSpinIterations = 16;
+	static constexpr unsigned int maxSpinIterations = 16384;
+
 	HelHandle _handle;
 	HelQueue *_queue;
 	HelChunk *_chunks[16];
@@ -344,6 +418,10 @@ private:
 
 	// Per-chunk reference counts.
 	int _refCounts[16];
+
+	bool _adaptiveSpinning = false;
+	unsigned int _spinIterations = 256;
+	DispatcherStats _stats;
 };
 
 inline void CurrentDispatcherToken::wait() {
@@ -385,6 +463,17 @@ private:
 	}
 };
 
+struct PopulateMemory : Operation {
+	HelError error() {
+		return result()->error;
+	}
+
+private:
+	HelSimpleResult *result() {
+		return reinterpret_cast<HelSimpleResult *>(OperationBase::element());
+	}
+};
+
 struct ManageMemory : Operation {
 	HelError error() {
 		return result()->error;
@@ -680,6 +769,16 @@ struct Submission : private Context {
 				reinterpret_cast<uintptr_t>(context())));
 	}
 
+	Submission(BorrowedDescriptor space, PopulateMemory *operation,
+			void *pointer, size_t length,
+			Dispatcher &dispatcher)
+	: _result(operation) {
+		HEL_CHECK(helSubmitPopulateMemory(space.getHandle(),
+				pointer, length,
+				dispatcher.acquire(),
+				reinterpret_cast<uintptr_t>(context())));
+	}
+
 	Submission(BorrowedDescriptor memory, ManageMemory *operation,
 			Dispatcher &dispatcher)
 	: _result(operation) {
@@ -784,10 +883,12 @@ inline Item<SendBuffer> action(SendBuffer *operation, const void *buffer, size_t
 	return {operation, action};
 }
 
-inline Item<RecvInline> action(RecvInline *operation, uint32_t flags = 0) {
+inline Item<RecvInline> action(RecvInline *operation, uint32_t flags = 0,
+		size_t maxLength = 0) {
 	HelAction action;
 	action.type = kHelActionRecvInline;
 	action.flags = flags;
+	action.length = maxLength;
 	return {operation, action};
 }
 
@@ -862,6 +963,12 @@ inline Submission submitProtectMemory(BorrowedDescriptor memory, ProtectMemory *
 	return {memory, operation, pointer, length, flags, dispatcher};
 }
 
+inline Submission submitPopulateMemory(BorrowedDescriptor space, PopulateMemory *operation,
+		void *pointer, size_t length,
+		Dispatcher &dispatcher) {
+	return {space, operation, pointer, length, dispatcher};
+}
+
 inline Submission submitManageMemory(BorrowedDescriptor memory, ManageMemory *operation,
 		Dispatcher &dispatcher) {
 	return {memory, operation, dispatcher};
@@ -1219,6 +1326,111 @@ inline auto writeMemory(BorrowedDescriptor descriptor,
 	return WriteMemorySender{descriptor, address, length, buffer};
 }
 
+// --------------------------------------------------------------------
+// Read/WriteMemoryVector
+// --------------------------------------------------------------------
+
+struct MemoryVectorResult {
+	HelError error() {
+		assert(valid_);
+		return error_;
+	}
+
+	// Number of bytes that were copied (before the first fault).
+	size_t actualLength() {
+		assert(valid_);
+		return length_;
+	}
+
+	void parse(void *&ptr, const ElementHandle &) {
+		auto result = reinterpret_cast<HelLengthResult *>(ptr);
+		error_ = result->error;
+		length_ = result->length;
+		ptr = (char *)ptr + sizeof(HelLengthResult);
+		valid_ = true;
+	}
+
+private:
+	bool valid_ = false;
+	HelError error_;
+	size_t length_;
+};
+
+template <typename Receiver>
+struct MemoryVectorOperation : private Context {
+	MemoryVectorOperation(BorrowedDescriptor descriptor,
+			const HelRemoteRange *ranges, size_t count, bool write, Receiver r)
+	: descriptor_{std::move(descriptor)}, ranges_{ranges}, count_{count},
+		write_{write}, r_{std::move(r)} { }
+
+	void start() {
+		auto context = static_cast<Context *>(this);
+		if(write_) {
+			HEL_CHECK(helSubmitWriteMemoryVector(descriptor_.getHandle(),
+					ranges_, count_,
+					Dispatcher::global().acquire(),
+					reinterpret_cast<uintptr_t>(context)));
+		}else{
+			HEL_CHECK(helSubmitReadMemoryVector(descriptor_.getHandle(),
+					ranges_, count_,
+					Dispatcher::global().acquire(),
+					reinterpret_cast<uintptr_t>(context)));
+		}
+	}
+
+	MemoryVectorOperation(const MemoryVectorOperation &) = delete;
+	MemoryVectorOperation &operator= (const MemoryVectorOperation &) = delete;
+
+private:
+	void complete(ElementHandle element) override {
+		MemoryVectorResult result;
+		void *ptr = element.data();
+		result.parse(ptr, element);
+		async::execution::set_value_noinline(r_, std::move(result));
+	}
+
+	BorrowedDescriptor descriptor_;
+	const HelRemoteRange *ranges_;
+	size_t count_;
+	bool write_;
+	Receiver r_;
+};
+
+struct [[nodiscard]] MemoryVectorSender {
+	using value_type = MemoryVectorResult;
+
+	MemoryVectorSender(BorrowedDescriptor descriptor,
+			const HelRemoteRange *ranges, size_t count, bool write)
+	: descriptor_{std::move(descriptor)}, ranges_{ranges}, count_{count}, write_{write} { }
+
+	template<typename Receiver>
+	MemoryVectorOperation<Receiver> connect(Receiver receiver) {
+		return {std::move(descriptor_), ranges_, count_, write_, std::move(receiver)};
+	}
+
+private:
+	BorrowedDescriptor descriptor_;
+	const HelRemoteRange *ranges_;
+	size_t count_;
+	bool write_;
+};
+
+inline async::sender_awaiter<MemoryVectorSender, MemoryVectorResult>
+operator co_await (MemoryVectorSender sender) {
+	return {std::move(sender)};
+}
+
+// The ranges must remain valid until the operation completes.
+inline auto readMemoryVector(BorrowedDescriptor descriptor,
+		const HelRemoteRange *ranges, size_t count) {
+	return MemoryVectorSender{descriptor, ranges, count, false};
+}
+
+inline auto writeMemoryVector(BorrowedDescriptor descriptor,
+		const HelRemoteRange *ranges, size_t count) {
+	return MemoryVectorSender{descriptor, ranges, count, true};
+}
+
 // --------------------------------------------------------------------
 // AwaitEvent
 // --------------------------------------------------------------------
@@ -1279,4 +1491,59 @@ inline auto awaitEvent(BorrowedDescriptor event, uint64_t sequence) {
 	};
 }
 
+// --------------------------------------------------------------------
+// AwaitWaitSet
+// --------------------------------------------------------------------
+
+template <typename Receiver>
+struct AwaitWaitSetOperation : private Context {
+	AwaitWaitSetOperation(BorrowedDescriptor waitSet, Receiver receiver)
+	: waitSet_{std::move(waitSet)}, receiver_{std::move(receiver)} { }
+
+	void start() {
+		auto context = static_cast<Context *>(this);
+
+		HEL_CHECK(helSubmitAwaitWaitSet(waitSet_.getHandle(),
+				Dispatcher::global().acquire(),
+				reinterpret_cast<uintptr_t>(context)));
+	}
+
+private:
+	void complete(ElementHandle element) override {
+		AwaitWaitSetResult result;
+		void *ptr = element.data();
+
+		result.parse(ptr, element);
+
+		async::execution::set_value(receiver_, std::move(result));
+	}
+
+	BorrowedDescriptor waitSet_;
+	Receiver receiver_;
+};
+
+struct [[nodiscard]] AwaitWaitSetSender {
+	using value_type = AwaitWaitSetResult;
+
+	AwaitWaitSetSender(BorrowedDescriptor waitSet)
+	: waitSet_{std::move(waitSet)} { }
+
+	template<typename Receiver>
+	AwaitWaitSetOperation<Receiver> connect(Receiver receiver) {
+		return {std::move(waitSet_), std::move(receiver)};
+	}
+
+private:
+	BorrowedDescriptor waitSet_;
+};
+
+inline async::sender_awaiter<AwaitWaitSetSender, AwaitWaitSetResult>
+operator co_await (AwaitWaitSetSender sender) {
+	return {std::move(sender)};
+}
+
+inline auto awaitWaitSet(BorrowedDescriptor waitSet) {
+	return AwaitWaitSetSender{std::move(waitSet)};
+}
+
 } // namespace helix_ng
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <helix/clock.hpp>
 #include <helix/ipc.hpp>
 #include <async/cancellation.hpp>
 #include <async/result.hpp>
@@ -25,8 +26,7 @@ struct TimeoutCallback {
 
 private:
 	async::detached _runTimer(uint64_t duration) {
-		uint64_t tick;
-		HEL_CHECK(helGetClock(&tick));
+		auto tick = helix::currentClock();
 
 		helix::AwaitClock await;
 		auto &&submit = helix::submitAwaitClock(&await, tick + duration,
@@ -76,8 +76,7 @@ private:
 };
 
 inline async::result<void> sleepFor(uint64_t duration) {
-	uint64_t tick;
-	HEL_CHECK(helGetClock(&tick));
+	auto tick = helix::currentClock();
 
 	helix::AwaitClock await;
 	auto &&submit = helix::submitAwaitClock(&await, tick + duration,
@@ -89,8 +88,8 @@ inline async::result<void> sleepFor(uint64_t duration) {
 // Returns true if the operation succeeded, or false if it timed out
 template<typename F> requires (std::is_invocable_r_v<bool, F>)
 async::result<bool> kindaBusyWait(uint64_t timeoutNs, F cond) {
-	uint64_t startNs, currNs;
-	HEL_CHECK(helGetClock(&startNs));
+	auto startNs = helix::currentClock();
+	uint64_t currNs;
 
 	do {
 		if (std::invoke(cond))
@@ -99,7 +98,7 @@ async::result<bool> kindaBusyWait(uint64_t timeoutNs, F cond) {
 		// Sleep for 5ms (TODO: make adaptive?)
 		co_await sleepFor(5'000'000);
 
-		HEL_CHECK(helGetClock(&currNs));
+		currNs = helix::currentClock();
 	} while (currNs < startNs + timeoutNs);
 
 	co_return std::invoke(cond);
@@ -108,14 +107,14 @@ async::result<bool> kindaBusyWait(uint64_t timeoutNs, F cond) {
 // Returns true if the operation succeeded, or false if it timed out
 template<typename F> requires (std::is_invocable_r_v<bool, F>)
 bool busyWaitUntil(uint64_t timeoutNs, F cond) {
-	uint64_t startNs, currNs;
-	HEL_CHECK(helGetClock(&startNs));
+	auto startNs = helix::currentClock();
+	uint64_t currNs;
 
 	do {
 		if (std::invoke(cond))
 			return true;
 
-		HEL_CHECK(helGetClock(&currNs));
+		currNs = helix::currentClock();
 	} while (currNs < startNs + timeoutNs);
 
 	return std::invoke(cond);
@@ -0,0 +1,158 @@
+#include <helix/executor.hpp>
+
+namespace helix {
+
+namespace {
+	thread_local Executor *currentExecutor = nullptr;
+	thread_local unsigned int currentWorkerIndex = 0;
+}
+
+Executor::Executor(unsigned int numWorkers) {
+	assert(numWorkers);
+	for(unsigned int i = 0; i < numWorkers; ++i) {
+		auto worker = std::make_unique<Worker>();
+		worker->executor = this;
+		worker->index = i;
+		_workers.push_back(std::move(worker));
+	}
+
+	// Worker zero runs on this thread.
+	_workers[0]->queueHandle = Dispatcher::global().acquire();
+	currentExecutor = this;
+	currentWorkerIndex = 0;
+
+	// Workers only become sleeping after they created their queues. Hence, _wake() never
+	// uses the queue handle of a worker that did not start yet.
+	for(unsigned int i = 1; i < numWorkers; ++i) {
+		std::thread{[this, worker = _workers[i].get()] {
+			currentExecutor = this;
+			currentWorkerIndex = worker->index;
+			worker->queueHandle = Dispatcher::global().acquire();
+			_runWorker(worker);
+		}}.detach();
+	}
+}
+
+Executor *Executor::current() {
+	return currentExecutor;
+}
+
+unsigned int Executor::currentWorker() {
+	assert(currentExecutor);
+	return currentWorkerIndex;
+}
+
+void Executor::post(TaskNode *task) {
+	Worker *target;
+	if(currentExecutor == this) {
+		target = _workers[currentWorkerIndex].get();
+	}else{
+		target = _workers[_nextWorker.fetch_add(1, std::memory_order_relaxed)
+				% _workers.size()].get();
+	}
+
+	{
+		std::lock_guard lock{target->mutex};
+		target->tasks.push_back(task);
+	}
+
+	if(currentExecutor == this && target->index == currentWorkerIndex) {
+		// We are busy; let an idle worker steal the task.
+		_wakeIdle(target);
+	}else{
+		_wake(target);
+	}
+}
+
+void Executor::postTo(unsigned int worker, TaskNode *task) {
+	assert(worker < _workers.size());
+	auto target = _workers[worker].get();
+
+	{
+		std::lock_guard lock{target->mutex};
+		target->pinnedTasks.push_back(task);
+	}
+
+	if(currentExecutor != this || target->index != currentWorkerIndex)
+		_wake(target);
+}
+
+void Executor::run() {
+	assert(currentExecutor == this && !currentWorkerIndex);
+	_runWorker(_workers[0].get());
+}
+
+void Executor::_runWorker(Worker *self) {
+	auto &dispatcher = Dispatcher::global();
+	while(true) {
+		// Dispatch completions first: they continue coroutines that already run on this worker.
+		while(dispatcher.poll())
+			;
+
+		if(auto task = _takeTask(self); task) {
+			task->run();
+			continue;
+		}
+
+		// Announce that we are going to sleep before re-checking for tasks.
+		// This pairs with the exchange in _wake().
+		self->sleeping.store(true, std::memory_order_seq_cst);
+		if(auto task = _takeTask(self); task) {
+			self->sleeping.store(false, std::memory_order_relaxed);
+			task->run();
+			continue;
+		}
+
+		dispatcher.wait();
+		self->sleeping.store(false, std::memory_order_relaxed);
+	}
+}
+
+Executor::TaskNode *Executor::_takeTask(Worker *self) {
+	{
+		std::lock_guard lock{self->mutex};
+		if(!self->pinnedTasks.empty()) {
+			auto task = self->pinnedTasks.front();
+			self->pinnedTasks.pop_front();
+			return task;
+		}
+		if(!self->tasks.empty()) {
+			auto task = self->tasks.back();
+			self->tasks.pop_back();
+			return task;
+		}
+	}
+
+	// Steal the oldest task of another worker.
+	for(size_t i = 1; i < _workers.size(); ++i) {
+		auto victim = _workers[(self->index + i) % _workers.size()].get();
+		std::lock_guard lock{victim->mutex};
+		if(!victim->tasks.empty()) {
+			auto task = victim->tasks.front();
+			victim->tasks.pop_front();
+			return task;
+		}
+	}
+
+	return nullptr;
+}
+
+void Executor::_wake(Worker *worker) {
+	if(!worker->sleeping.exchange(false, std::memory_order_seq_cst))
+		return;
+	HEL_CHECK(helSubmitAsyncNop(worker->queueHandle,
+			reinterpret_cast<uintptr_t>(static_cast<Context *>(&worker->wakeContext))));
+}
+
+void Executor::_wakeIdle(Worker *except) {
+	for(auto &worker : _workers) {
+		if(worker.get() == except)
+			continue;
+		if(!worker->sleeping.load(std::memory_order_relaxed))
+			continue;
+		_wake(worker.get());
+		return;
+	}
+}
+
+} // namespace helix
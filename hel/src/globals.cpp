@@ -3,10 +3,20 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <helix/clock.hpp>
 #include <helix/ipc.hpp>
 
 namespace helix {
 
+const HelClockPage *clockPage() {
+	static const HelClockPage *page = [] {
+		void *pointer;
+		HEL_CHECK(helMapClockPage(kHelNullHandle, &pointer));
+		return static_cast<const HelClockPage *>(pointer);
+	}();
+	return page;
+}
+
 Dispatcher &Dispatcher::global() {
 	thread_local static Dispatcher dispatcher;
 	return dispatcher;
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
+#include <algorithm>
 
 #include <frg/optional.hpp>
 
@@ -35,6 +36,27 @@ private:
 		return freeOrder;
 	}
 
+	// Determines the value of a parent entry from its two children.
+	// Two completely free buddies coalesce into a free chunk of the parent's order.
+	static int mergeChildren(int8_t *slice, AddressType base, int childOrder) {
+		if(slice[base] == childOrder && slice[base + 1] == childOrder)
+			return childOrder + 1;
+		return scanFreeChunks(slice, base, 2);
+	}
+
+	void countFreeChunksIn(int8_t *slice, int order, size_t base, size_t *counts, int numOrders) {
+		if(slice[base] == order) {
+			counts[std::min(order, numOrders - 1)]++;
+			return;
+		}
+		// The descendants of allocated entries are marked as free; do not descend.
+		if(slice[base] == -1 || !order)
+			return;
+		for(size_t i = 0; i < 2; ++i)
+			countFreeChunksIn(slice + (size_t(numRoots_) << (tableOrder_ - order)),
+					order - 1, 2 * base + i, counts, numOrders);
+	}
+
 	int traverseForSanityCheck(int8_t *slice, int order, size_t base) {
 		assert(slice[base] >= -1);
 		assert(slice[base] <= order);
@@ -184,7 +206,7 @@ public:
 		AddressType updateIndex = allocIndex;
 		while(currentOrder < tableOrder_) {
 			updateIndex /= 2;
-			auto freeOrder = scanFreeChunks(slice, 2 * updateIndex, 2);
+			auto freeOrder = mergeChildren(slice, 2 * updateIndex, currentOrder);
 			currentOrder++;
 			slice -= size_t(numRoots_) << (tableOrder_ - currentOrder);
 			slice[updateIndex] = freeOrder;
@@ -227,7 +249,7 @@ public:
 		// Update all superior elements.
 		while(currentOrder < tableOrder_) {
 			updateIndex /= 2;
-			auto freeOrder = scanFreeChunks(slice, 2 * updateIndex, 2);
+			auto freeOrder = mergeChildren(slice, 2 * updateIndex, currentOrder);
 			currentOrder++;
 			slice -= size_t(numRoots_) << (tableOrder_ - currentOrder);
 			slice[updateIndex] = freeOrder;
@@ -237,6 +259,31 @@ public:
 			sanityCheck();
 	}
 
+	// Returns true if the page at the given address is free.
+	bool isFree(AddressType address) {
+		assert(address >= _baseAddress);
+		AddressType index = (address - _baseAddress) >> _sizeShift;
+
+		int8_t *slice = buddyPointer_;
+		for(int order = tableOrder_; order >= 0; order--) {
+			auto entry = slice[index >> order];
+			if(entry == order)
+				return true;
+			// Either allocated at this order or all descendants are allocated.
+			if(entry == -1)
+				return false;
+			slice += size_t(numRoots_) << (tableOrder_ - order);
+		}
+		return false;
+	}
+
+	// Adds the number of free chunks of each order to counts[order].
+	// Chunks of order numOrders - 1 or higher are all counted in counts[numOrders - 1].
+	void countFreeChunks(size_t *counts, int numOrders) {
+		for(size_t i = 0; i < size_t(numRoots_); ++i)
+			countFreeChunksIn(buddyPointer_, tableOrder_, i, counts, numOrders);
+	}
+
 	void sanityCheck() {
 		for(size_t i = 0; i < size_t(numRoots_); ++i)
 			traverseForSanityCheck(buddyPointer_, tableOrder_, i);
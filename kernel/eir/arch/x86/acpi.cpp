@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <string.h>
+#include <eir-internal/arch/acpi.hpp>
+#include <eir-internal/debug.hpp>
+#include <eir-internal/generic.hpp>
+#include <acpispec/tables.h>
+
+namespace eir {
+
+namespace {
+
+// Note: firmware tables are not necessarily aligned; hence, all structs are packed.
+
+struct [[gnu::packed]] SratHeader {
+	uint32_t reserved1;
+	uint64_t reserved2;
+};
+
+struct [[gnu::packed]] SratGenericEntry {
+	uint8_t type;
+	uint8_t length;
+};
+
+struct [[gnu::packed]] SratLocalApicEntry {
+	SratGenericEntry generic;
+	uint8_t proximityLow;
+	uint8_t apicId;
+	uint32_t flags;
+	uint8_t sapicEid;
+	uint8_t proximityHigh[3];
+	uint32_t clockDomain;
+};
+
+struct [[gnu::packed]] SratMemoryEntry {
+	SratGenericEntry generic;
+	uint32_t proximity;
+	uint16_t reserved1;
+	uint32_t baseLow;
+	uint32_t baseHigh;
+	uint32_t lengthLow;
+	uint32_t lengthHigh;
+	uint32_t reserved2;
+	uint32_t flags;
+	uint64_t reserved3;
+};
+
+struct [[gnu::packed]] SratX2ApicEntry {
+	SratGenericEntry generic;
+	uint16_t reserved1;
+	uint32_t proximity;
+	uint32_t x2apicId;
+	uint32_t flags;
+	uint32_t clockDomain;
+	uint32_t reserved2;
+};
+
+constexpr uint32_t sratEnabled = 1;
+
+// Proximity domains can be sparse; we map them to dense node numbers.
+constexpr int maxDomains = 16;
+uint32_t knownDomains[maxDomains];
+int numKnownDomains = 0;
+
+int nodeOfDomain(uint32_t domain) {
+	for(int i = 0; i < numKnownDomains; i++) {
+		if(knownDomains[i] == domain)
+			return i;
+	}
+	if(numKnownDomains == maxDomains) {
+		eir::infoLogger() << "eir: Too many NUMA proximity domains, folding domain "
+				<< domain << " into node 0" << frg::endlog;
+		return 0;
+	}
+	knownDomains[numKnownDomains] = domain;
+	return numKnownDomains++;
+}
+
+template<typename T>
+T *accessPhysical(uint64_t physical) {
+	// eir runs with physical memory identity mapped (at least below 4 GiB).
+	if(physical > UINTPTR_MAX)
+		return nullptr;
+	return reinterpret_cast<T *>(static_cast<uintptr_t>(physical));
+}
+
+acpi_header_t *findTable(uint64_t rsdt, uint64_t acpiRevision, const char *signature) {
+	auto root = accessPhysical<acpi_header_t>(rsdt);
+	if(!root)
+		return nullptr;
+
+	size_t entrySize = (acpiRevision == 2) ? 8 : 4;
+	size_t numEntries = (root->length - sizeof(acpi_header_t)) / entrySize;
+	auto entries = reinterpret_cast<const uint8_t *>(root) + sizeof(acpi_header_t);
+	for(size_t i = 0; i < numEntries; i++) {
+		uint64_t physical = 0;
+		memcpy(&physical, entries + i * entrySize, entrySize);
+
+		auto table = accessPhysical<acpi_header_t>(physical);
+		if(table && !memcmp(table->signature, signature, 4))
+			return table;
+	}
+	return nullptr;
+}
+
+} // anonymous namespace
+
+void parseAcpiNumaInfo(uint64_t rsdt, uint64_t acpiRevision) {
+	if(!rsdt)
+		return;
+
+	auto srat = findTable(rsdt, acpiRevision, "SRAT");
+	if(!srat) {
+		eir::infoLogger() << "eir: No SRAT, assuming a single NUMA node" << frg::endlog;
+		return;
+	}
+
+	auto base = reinterpret_cast<const uint8_t *>(srat);
+	size_t offset = sizeof(acpi_header_t) + sizeof(SratHeader);
+	while(offset + sizeof(SratGenericEntry) <= srat->length) {
+		SratGenericEntry generic;
+		memcpy(&generic, base + offset, sizeof(SratGenericEntry));
+		if(!generic.length)
+			break;
+
+		if(generic.type == 0) {
+			SratLocalApicEntry entry;
+			memcpy(&entry, base + offset, sizeof(SratLocalApicEntry));
+			if(entry.flags & sratEnabled) {
+				uint32_t domain = entry.proximityLow
+						| (uint32_t(entry.proximityHigh[0]) << 8)
+						| (uint32_t(entry.proximityHigh[1]) << 16)
+						| (uint32_t(entry.proximityHigh[2]) << 24);
+				addCpuNode(entry.apicId, nodeOfDomain(domain));
+			}
+		}else if(generic.type == 1) {
+			SratMemoryEntry entry;
+			memcpy(&entry, base + offset, sizeof(SratMemoryEntry));
+			if(entry.flags & sratEnabled) {
+				auto address = (uint64_t(entry.baseHigh) << 32) | entry.baseLow;
+				auto length = (uint64_t(entry.lengthHigh) << 32) | entry.lengthLow;
+				auto node = nodeOfDomain(entry.proximity);
+				eir::infoLogger() << "eir: NUMA node " << node << " contains memory at 0x"
+						<< frg::hex_fmt{address} << ", length: 0x"
+						<< frg::hex_fmt{length} << frg::endlog;
+				addNumaRange(address, length, node);
+			}
+		}else if(generic.type == 2) {
+			SratX2ApicEntry entry;
+			memcpy(&entry, base + offset, sizeof(SratX2ApicEntry));
+			if(entry.flags & sratEnabled)
+				addCpuNode(entry.x2apicId, nodeOfDomain(entry.proximity));
+		}
+
+		offset += generic.length;
+	}
+}
+
+} // namespace eir
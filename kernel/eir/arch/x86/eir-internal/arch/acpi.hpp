@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace eir {
+
+// Parses the SRAT (if any) and reports the NUMA topology via addNumaRange()/addCpuNode().
+// Must be called before the initial memory regions are created.
+void parseAcpiNumaInfo(uint64_t rsdt, uint64_t acpiRevision);
+
+} // namespace eir
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <eir/interface.hpp>
 #include <eir-internal/arch.hpp>
+#include <eir-internal/arch/acpi.hpp>
 #include <eir-internal/generic.hpp>
 #include <eir-internal/debug.hpp>
 #include <acpispec/tables.h>
@@ -265,6 +266,8 @@ extern "C" void eirMultiboot2Main(uint32_t info, uint32_t magic){
 				<< ", length: 0x" << frg::hex_fmt{map->length} << frg::endlog;
 	}
 
+	parseAcpiNumaInfo(rsdt, acpiRevision);
+
 	for(Mb2MmapEntry* map = (Mb2MmapEntry*)mmap_start; map < (Mb2MmapEntry*)mmap_end; map++) {
 		if(map->type == 1)
 			createInitialRegions({map->base, map->length}, {reservedRegions, nReservedRegions});
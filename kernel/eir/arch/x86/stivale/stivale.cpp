@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <eir/interface.hpp>
 #include <eir-internal/arch.hpp>
+#include <eir-internal/arch/acpi.hpp>
 #include <eir-internal/generic.hpp>
 #include <eir-internal/debug.hpp>
 #include <acpispec/tables.h>
@@ -196,6 +197,15 @@ extern "C" void eirStivaleMain(Stivale2Struct *data) {
 
 	initProcessorEarly();
 
+	if(rsdp) {
+		acpi_xsdp_t *xsdpPtr = reinterpret_cast<acpi_xsdp_t *>(rsdp);
+		if(xsdpPtr->revision == 0) {
+			parseAcpiNumaInfo(xsdpPtr->rsdt, 1);
+		}else{
+			parseAcpiNumaInfo(xsdpPtr->xsdt, 2);
+		}
+	}
+
 	eir::infoLogger() << "Memory map:" << frg::endlog;
 	for (size_t i = 0; i < mmap.size(); i++) {
 		auto ent = mmap.data()[i];
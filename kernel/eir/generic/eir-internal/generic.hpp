@@ -25,6 +25,8 @@ struct Region {
 	address_t buddyTree;
 	address_t buddyOverhead;
 	address_t buddyMap;
+
+	int numaNode;
 };
 
 static constexpr size_t numRegions = 64;
@@ -35,6 +37,25 @@ uintptr_t bootReserve(size_t length, size_t alignment);
 uintptr_t allocPage();
 void allocLogRingBuffer();
 
+// NUMA information, as reported by the firmware.
+// Memory ranges must be reported before createInitialRegion() is called.
+struct NumaRange {
+	address_t base;
+	address_t size;
+	int node;
+};
+
+struct CpuNode {
+	uint64_t cpuId;
+	int node;
+};
+
+static constexpr size_t maxNumaRanges = 32;
+static constexpr size_t maxCpuNodes = 256;
+
+void addNumaRange(address_t base, address_t size, int node);
+void addCpuNode(uint64_t cpuId, int node);
+
 void setupRegionStructs();
 void createInitialRegion(address_t base, address_t size);
 
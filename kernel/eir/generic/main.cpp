@@ -29,7 +29,61 @@ Region *obtainRegion() {
 	__builtin_unreachable();
 }
 
+// ----------------------------------------------------------------------------
+// NUMA information.
+// ----------------------------------------------------------------------------
+
+NumaRange numaRanges[maxNumaRanges];
+size_t numNumaRanges = 0;
+CpuNode cpuNodes[maxCpuNodes];
+size_t numCpuNodes = 0;
+int numNumaNodes = 1;
+
+void addNumaRange(address_t base, address_t size, int node) {
+	if(numNumaRanges == maxNumaRanges) {
+		eir::infoLogger() << "eir: Ignoring NUMA memory range at 0x"
+				<< frg::hex_fmt{base} << " (too many ranges)" << frg::endlog;
+		return;
+	}
+	numaRanges[numNumaRanges++] = {base, size, node};
+	numNumaNodes = frg::max(numNumaNodes, node + 1);
+}
+
+void addCpuNode(uint64_t cpuId, int node) {
+	if(numCpuNodes == maxCpuNodes) {
+		eir::infoLogger() << "eir: Ignoring NUMA node of CPU " << cpuId
+				<< " (too many CPUs)" << frg::endlog;
+		return;
+	}
+	cpuNodes[numCpuNodes++] = {cpuId, node};
+	numNumaNodes = frg::max(numNumaNodes, node + 1);
+}
+
+int numaNodeOf(address_t address) {
+	for(size_t i = 0; i < numNumaRanges; ++i) {
+		if(address >= numaRanges[i].base
+				&& address - numaRanges[i].base < numaRanges[i].size)
+			return numaRanges[i].node;
+	}
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+
 void createInitialRegion(address_t base, address_t size) {
+	// Split regions that cross NUMA range boundaries, such that each region
+	// belongs to a single node.
+	for(size_t i = 0; i < numNumaRanges; ++i) {
+		address_t boundaries[2] = {numaRanges[i].base, numaRanges[i].base + numaRanges[i].size};
+		for(auto boundary : boundaries) {
+			if(boundary <= base || boundary >= base + size)
+				continue;
+			createInitialRegion(base, boundary - base);
+			createInitialRegion(boundary, base + size - boundary);
+			return;
+		}
+	}
+
 	auto limit = base + size;
 
 	address_t address = base;
@@ -71,6 +125,7 @@ void createInitialRegion(address_t base, address_t size) {
 	region->regionType = RegionType::allocatable;
 	region->address = address;
 	region->size = limit - address;
+	region->numaNode = numaNodeOf(address);
 }
 
 void createInitialRegions(InitialRegion region, frg::span<InitialRegion> reserved) {
@@ -417,9 +472,20 @@ EirInfo *generateInfo(const char *cmdline){
 		regionInfos[j].order = regions[i].order;
 		regionInfos[j].numRoots = regions[i].numRoots;
 		regionInfos[j].buddyTree = regions[i].buddyMap;
+		regionInfos[j].numaNode = regions[i].numaNode;
 		j++;
 	}
 
+	// Pass the NUMA topology to thor.
+	auto cpuNodeInfos = bootAlloc<EirCpuNode>(numCpuNodes);
+	for(size_t i = 0; i < numCpuNodes; ++i) {
+		cpuNodeInfos[i].cpuId = cpuNodes[i].cpuId;
+		cpuNodeInfos[i].numaNode = cpuNodes[i].node;
+	}
+	info_ptr->numNumaNodes = numNumaNodes;
+	info_ptr->numCpuNodes = numCpuNodes;
+	info_ptr->cpuNodeInfo = mapBootstrapData(cpuNodeInfos);
+
 	// Parse the kernel command line.
 	const char *l = cmdline;
 	while(true) {
@@ -17,6 +17,13 @@ struct EirRegion {
 	EirSize order; // TODO: This could be an int.
 	EirSize numRoots;
 	EirPtr buddyTree;
+	EirSize numaNode;
+};
+
+// Maps a CPU (identified by its local APIC ID on x86) to a NUMA node.
+struct EirCpuNode {
+	uint64_t cpuId;
+	EirSize numaNode;
 };
 
 struct EirModule {
@@ -54,4 +61,10 @@ struct EirInfo {
 
 	uint64_t acpiRsdt;
 	uint64_t acpiRevision;
+
+	// NUMA information. If the firmware does not provide any, numNumaNodes is 1
+	// and all memory and CPUs belong to node zero.
+	EirSize numNumaNodes;
+	EirSize numCpuNodes;
+	EirPtr cpuNodeInfo;
 };
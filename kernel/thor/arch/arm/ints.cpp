@@ -220,12 +220,18 @@ extern "C" void onPlatformIrq(IrqImageAccessor image) {
 		cpuInterface->eoi(cpu, irq);
 
 		if (irq == 0) {
+			auto &count = getCpuData()->numPingIpis;
+			count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
 			handlePreemption(image);
 		} else {
 			assert(irq == 1);
 			assert(!irqMutex().nesting());
 			disableUserAccess();
 
+			auto &count = getCpuData()->numShootdownIpis;
+			count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
 			for(int i = 0; i < maxAsid; i++)
 				getCpuData()->asidBindings[i].shootdown();
 
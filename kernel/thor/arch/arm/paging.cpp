@@ -3,6 +3,7 @@
 #include <arch/variable.hpp>
 #include <thor-internal/physical.hpp>
 #include <thor-internal/cpu-data.hpp>
+#include <thor-internal/memory-view.hpp>
 
 namespace thor {
 
@@ -48,6 +49,27 @@ void invalidateFullTlb() {
 void poisonPhysicalAccess(PhysicalAddr physical) { assert(!"Not implemented"); }
 void poisonPhysicalWriteAccess(PhysicalAddr physical) { assert(!"Not implemented"); }
 
+void zeroPageNonTemporal(void *page) {
+	auto p = reinterpret_cast<char *>(page);
+	for(size_t i = 0; i < kPageSize; i += 64) {
+		asm volatile ("stnp xzr, xzr, [%0]\n\t"
+				"stnp xzr, xzr, [%0, #16]\n\t"
+				"stnp xzr, xzr, [%0, #32]\n\t"
+				"stnp xzr, xzr, [%0, #48]"
+				: : "r"(p + i) : "memory");
+	}
+	// Order the stores before the page is published.
+	asm volatile ("dmb ishst" : : : "memory");
+}
+
+void copyMemory(void *dest, const void *src, size_t size) {
+	memcpy(dest, src, size);
+}
+
+void copyPage(void *dest, const void *src) {
+	memcpy(dest, src, kPageSize);
+}
+
 PageContext::PageContext()
 : _nextStamp{1}, _primaryBinding{nullptr} { }
 
@@ -493,6 +515,52 @@ static inline constexpr uint64_t kPagenGnRnE = (2 << 2);
 static inline constexpr uint64_t kPagenGnRE = (3 << 2);
 static inline constexpr uint64_t kPageUc = (4 << 2);
 static inline constexpr uint64_t kPageAddress = 0xFFFFFFFFF000;
+static inline constexpr uint64_t kPageBlockAddress = 0xFFFFFFE00000;
+static inline constexpr uint64_t kPageContiguous = (uint64_t(1) << 52);
+
+// Number of L3 entries that form a run with the contiguous hint (i.e., 64 KiB).
+static inline constexpr int kContiguousEntries = 16;
+static inline constexpr size_t kContiguousSize = kContiguousEntries * kPageSize;
+
+// Invalidates a page for all ASIDs on all CPUs.
+// Since ASIDs are assigned per CPU, this is what break-before-make sequences need.
+static void invalidatePageAllAsids(VirtualAddr address) {
+	asm volatile ("dsb ishst;\n\t\
+			tlbi vaae1is, %0;\n\t\
+			dsb ish; isb"
+			:
+			: "r"(tlbiValue(0, address))
+			: "memory");
+}
+
+// Attributes of user L3 pages and L2 blocks (without the address and descriptor type bits).
+static uint64_t clientLeafAttributes(bool user_page, uint32_t flags, CachingMode caching_mode) {
+	uint64_t attributes = kPageAccess | kPageRO | kPageNotGlobal;
+
+	if (flags & page_access::write)
+		attributes |= kPageShouldBeWritable;
+	if (!(flags & page_access::execute))
+		attributes |= kPageXN | kPagePXN;
+	if (user_page)
+		attributes |= kPageUser;
+	if (caching_mode == CachingMode::writeCombine)
+		attributes |= kPageUc | kPageOuterSh;
+	else if (caching_mode == CachingMode::uncached)
+		attributes |= kPagenGnRnE | kPageOuterSh;
+	else if (caching_mode == CachingMode::mmio)
+		attributes |= kPagenGnRE | kPageOuterSh;
+	else if (caching_mode == CachingMode::mmioNonPosted)
+		attributes |= kPagenGnRnE | kPageOuterSh;
+	else {
+		assert(caching_mode == CachingMode::null || caching_mode == CachingMode::writeBack);
+		attributes |= kPageWb | kPageInnerSh;
+	}
+	return attributes;
+}
+
+static bool isBlock(uint64_t entry) {
+	return (entry & kPageValid) && !(entry & kPageTable);
+}
 
 void KernelPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical,
 		uint32_t flags, CachingMode caching_mode) {
@@ -654,7 +722,8 @@ ClientPageSpace::~ClientPageSpace() {
 		PageAccessor accessor{ps};
 		auto tbl = reinterpret_cast<uint64_t *>(accessor.get());
 		for(int i = 0; i < 512; i++) {
-			if(tbl[i] & kPageValid)
+			// Blocks are owned by memory objects; only free L3 tables.
+			if((tbl[i] & kPageValid) && (tbl[i] & kPageTable))
 				physicalAllocator->free(tbl[i] & kPageAddress, kPageSize);
 		}
 	};
@@ -683,7 +752,7 @@ ClientPageSpace::~ClientPageSpace() {
 
 }
 
-void ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical, bool user_page,
+bool ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical, bool user_page,
 		uint32_t flags, CachingMode caching_mode) {
 	assert(!(pointer & (kPageSize - 1)));
 
@@ -734,6 +803,8 @@ void ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical, bo
 	}
 	tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
 
+	if (isBlock(tbl2[index2].load()))
+		_splitBlock(tbl2, index2, pointer);
 	if (tbl2[index2].load() & kPageValid) {
 		accessor3 = PageAccessor{tbl2[index2].load() & kPageAddress};
 	} else {
@@ -747,28 +818,18 @@ void ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical, bo
 	}
 	tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
 
-	uint64_t new_entry = physical | kPageValid | kPageL3Page | kPageAccess | kPageRO | kPageNotGlobal;
-
-	if (flags & page_access::write)
-		new_entry |= kPageShouldBeWritable;
-	if (!(flags & page_access::execute))
-		new_entry |= kPageXN | kPagePXN;
-	if (user_page)
-		new_entry |= kPageUser;
-	if (caching_mode == CachingMode::writeCombine)
-		new_entry |= kPageUc | kPageOuterSh;
-	else if (caching_mode == CachingMode::uncached)
-		new_entry |= kPagenGnRnE | kPageOuterSh;
-	else if (caching_mode == CachingMode::mmio)
-		new_entry |= kPagenGnRE | kPageOuterSh;
-	else if (caching_mode == CachingMode::mmioNonPosted)
-		new_entry |= kPagenGnRnE | kPageOuterSh;
-	else {
-		assert(caching_mode == CachingMode::null || caching_mode == CachingMode::writeBack);
-		new_entry |= kPageWb | kPageInnerSh;
-	}
+	// Overwriting one entry of a contiguous run would misprogram the run.
+	_breakContiguous(tbl3, index3, pointer);
 
+	uint64_t new_entry = physical | kPageValid | kPageL3Page
+			| clientLeafAttributes(user_page, flags, caching_mode);
 	tbl3[index3].store(new_entry);
+
+	// mapPresentPages() maps pages in ascending order; try to form a run once the last
+	// entry of a potential run is written.
+	if ((index3 % kContiguousEntries) == kContiguousEntries - 1)
+		_tryMakeContiguous(tbl3, index3, pointer);
+	return true;
 }
 
 PageStatus ClientPageSpace::unmapSingle4k(VirtualAddr pointer) {
@@ -809,6 +870,8 @@ PageStatus ClientPageSpace::unmapSingle4k(VirtualAddr pointer) {
 		return 0;
 	}
 
+	if (isBlock(tbl2[index2].load()))
+		_splitBlock(tbl2, index2, pointer);
 	if (tbl2[index2].load() & kPageValid) {
 		accessor3 = PageAccessor{tbl2[index2].load() & kPageAddress};
 		tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
@@ -816,6 +879,7 @@ PageStatus ClientPageSpace::unmapSingle4k(VirtualAddr pointer) {
 		return 0;
 	}
 
+	_breakContiguous(tbl3, index3, pointer);
 	auto bits = tbl3[index3].atomic_exchange(0);
 	if (!(bits & kPageValid))
 		return 0;
@@ -823,6 +887,8 @@ PageStatus ClientPageSpace::unmapSingle4k(VirtualAddr pointer) {
 	PageStatus ps = page_status::present;
 	if ((bits & kPageShouldBeWritable) && !(bits & kPageRO))
 		ps |= page_status::dirty;
+	if ((bits & kPageAddress) == getZeroPage())
+		ps |= page_status::zero;
 
 	return ps;
 }
@@ -865,6 +931,8 @@ PageStatus ClientPageSpace::cleanSingle4k(VirtualAddr pointer) {
 		return 0;
 	}
 
+	if (isBlock(tbl2[index2].load()))
+		_splitBlock(tbl2, index2, pointer);
 	if (tbl2[index2].load() & kPageValid) {
 		accessor3 = PageAccessor{tbl2[index2].load() & kPageAddress};
 		tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
@@ -872,6 +940,7 @@ PageStatus ClientPageSpace::cleanSingle4k(VirtualAddr pointer) {
 		return 0;
 	}
 
+	_breakContiguous(tbl3, index3, pointer);
 	auto bits = tbl3[index3].load();
 	if (!(bits & kPageValid))
 		return 0;
@@ -879,7 +948,7 @@ PageStatus ClientPageSpace::cleanSingle4k(VirtualAddr pointer) {
 	PageStatus ps = page_status::present;
 	if ((bits & kPageShouldBeWritable) && !(bits & kPageRO)) {
 		ps |= page_status::dirty;
-		tbl3[index3].atomic_exchange(bits & ~kPageRO);
+		tbl3[index3].atomic_exchange(bits | kPageRO);
 	}
 
 	// TODO: perform proper shootdown to update mapping (we updated the RO flag)
@@ -925,6 +994,8 @@ bool ClientPageSpace::isMapped(VirtualAddr pointer) {
 		return false;
 	}
 
+	if (isBlock(tbl2[index2].load()))
+		return true;
 	if (tbl2[index2].load() & kPageValid) {
 		accessor3 = PageAccessor{tbl2[index2].load() & kPageAddress};
 		tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
@@ -973,6 +1044,15 @@ bool ClientPageSpace::updatePageAccess(VirtualAddr pointer) {
 		return false;
 	}
 
+	if (isBlock(tbl2[index2].load())) {
+		auto bits = tbl2[index2].load();
+		if (!(bits & kPageRO) || !(bits & kPageShouldBeWritable))
+			return false;
+		tbl2[index2].store(bits & ~kPageRO);
+		// TODO: perform proper shootdown to update mapping
+		invalidatePage(reinterpret_cast<void *>(pointer));
+		return true;
+	}
 	if (tbl2[index2].load() & kPageValid) {
 		accessor3 = PageAccessor{tbl2[index2].load() & kPageAddress};
 		tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
@@ -987,8 +1067,16 @@ bool ClientPageSpace::updatePageAccess(VirtualAddr pointer) {
 	if (!(bits & kPageRO) || !(bits & kPageShouldBeWritable))
 		return false;
 
-	bits &= ~kPageRO;
-	tbl3[index3].store(bits);
+	if (bits & kPageContiguous) {
+		// All entries of a run must have the same attributes; the dirty state is
+		// therefore tracked per run. Relaxing permissions does not require break-before-make.
+		auto first = index3 & ~(kContiguousEntries - 1);
+		for (int i = 0; i < kContiguousEntries; i++)
+			tbl3[first + i].store(tbl3[first + i].load() & ~kPageRO);
+	} else {
+		bits &= ~kPageRO;
+		tbl3[index3].store(bits);
+	}
 
 	// TODO: perform proper shootdown to update mapping
 	invalidatePage(reinterpret_cast<void *>(pointer));
@@ -996,4 +1084,238 @@ bool ClientPageSpace::updatePageAccess(VirtualAddr pointer) {
 	return true;
 }
 
+
+bool ClientPageSpace::mapSingle2m(VirtualAddr pointer, PhysicalAddr physical, bool user_page,
+		uint32_t flags, CachingMode caching_mode) {
+	assert(!(pointer & (kHugePageSize - 1)));
+	assert(!(physical & (kHugePageSize - 1)));
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	PageAccessor accessor0;
+	PageAccessor accessor1;
+	PageAccessor accessor2;
+
+	arch::scalar_variable<uint64_t> *tbl0;
+	arch::scalar_variable<uint64_t> *tbl1;
+	arch::scalar_variable<uint64_t> *tbl2;
+
+	auto index0 = (int)((pointer >> 39) & 0x1FF);
+	auto index1 = (int)((pointer >> 30) & 0x1FF);
+	auto index2 = (int)((pointer >> 21) & 0x1FF);
+
+	accessor0 = PageAccessor{rootTable()};
+	tbl0 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor0.get());
+
+	if (tbl0[index0].load() & kPageValid) {
+		accessor1 = PageAccessor{tbl0[index0].load() & kPageAddress};
+	} else {
+		auto tbl_address = physicalAllocator->allocate(kPageSize);
+		assert(tbl_address != PhysicalAddr(-1) && "OOM");
+		accessor1 = PageAccessor{tbl_address};
+		memset(accessor1.get(), 0, kPageSize);
+
+		uint64_t new_entry = tbl_address | kPageValid | kPageTable;
+		tbl0[index0].store(new_entry);
+	}
+	tbl1 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor1.get());
+
+	if (tbl1[index1].load() & kPageValid) {
+		accessor2 = PageAccessor{tbl1[index1].load() & kPageAddress};
+	} else {
+		auto tbl_address = physicalAllocator->allocate(kPageSize);
+		assert(tbl_address != PhysicalAddr(-1) && "OOM");
+		accessor2 = PageAccessor{tbl_address};
+		memset(accessor2.get(), 0, kPageSize);
+
+		uint64_t new_entry = tbl_address | kPageValid | kPageTable;
+		tbl1[index1].store(new_entry);
+	}
+	tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+
+	// Do not replace existing L3 tables: other CPUs might still walk them
+	// until the next shootdown.
+	if (tbl2[index2].load() & kPageValid)
+		return false;
+
+	tbl2[index2].store(physical | kPageValid | clientLeafAttributes(user_page, flags, caching_mode));
+	return true;
+}
+
+PageStatus ClientPageSpace::unmapSingle2m(VirtualAddr pointer) {
+	assert(!(pointer & (kHugePageSize - 1)));
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	PageAccessor accessor0;
+	PageAccessor accessor1;
+	PageAccessor accessor2;
+
+	arch::scalar_variable<uint64_t> *tbl0;
+	arch::scalar_variable<uint64_t> *tbl1;
+	arch::scalar_variable<uint64_t> *tbl2;
+
+	auto index0 = (int)((pointer >> 39) & 0x1FF);
+	auto index1 = (int)((pointer >> 30) & 0x1FF);
+	auto index2 = (int)((pointer >> 21) & 0x1FF);
+
+	accessor0 = PageAccessor{rootTable()};
+	tbl0 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor0.get());
+
+	if (tbl0[index0].load() & kPageValid) {
+		accessor1 = PageAccessor{tbl0[index0].load() & kPageAddress};
+		tbl1 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor1.get());
+	} else {
+		return 0;
+	}
+
+	if (tbl1[index1].load() & kPageValid) {
+		accessor2 = PageAccessor{tbl1[index1].load() & kPageAddress};
+		tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+	} else {
+		return 0;
+	}
+
+	if (!isBlock(tbl2[index2].load()))
+		return 0;
+
+	auto bits = tbl2[index2].atomic_exchange(0);
+	PageStatus ps = page_status::present;
+	if ((bits & kPageShouldBeWritable) && !(bits & kPageRO))
+		ps |= page_status::dirty;
+	return ps;
+}
+
+PageStatus ClientPageSpace::cleanSingle2m(VirtualAddr pointer) {
+	assert(!(pointer & (kHugePageSize - 1)));
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	PageAccessor accessor0;
+	PageAccessor accessor1;
+	PageAccessor accessor2;
+
+	arch::scalar_variable<uint64_t> *tbl0;
+	arch::scalar_variable<uint64_t> *tbl1;
+	arch::scalar_variable<uint64_t> *tbl2;
+
+	auto index0 = (int)((pointer >> 39) & 0x1FF);
+	auto index1 = (int)((pointer >> 30) & 0x1FF);
+	auto index2 = (int)((pointer >> 21) & 0x1FF);
+
+	accessor0 = PageAccessor{rootTable()};
+	tbl0 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor0.get());
+
+	if (tbl0[index0].load() & kPageValid) {
+		accessor1 = PageAccessor{tbl0[index0].load() & kPageAddress};
+		tbl1 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor1.get());
+	} else {
+		return 0;
+	}
+
+	if (tbl1[index1].load() & kPageValid) {
+		accessor2 = PageAccessor{tbl1[index1].load() & kPageAddress};
+		tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+	} else {
+		return 0;
+	}
+
+	auto bits = tbl2[index2].load();
+	if (!isBlock(bits))
+		return 0;
+
+	PageStatus ps = page_status::present;
+	if ((bits & kPageShouldBeWritable) && !(bits & kPageRO)) {
+		ps |= page_status::dirty;
+		tbl2[index2].atomic_exchange(bits | kPageRO);
+	}
+
+	// TODO: perform proper shootdown to update mapping (we updated the RO flag)
+	invalidatePage(reinterpret_cast<void *>(pointer));
+	return ps;
+}
+
+bool ClientPageSpace::attachSharedTable(VirtualAddr, PhysicalAddr, bool) {
+	return false;
+}
+
+size_t ClientPageSpace::detachSharedTable(VirtualAddr, bool) {
+	// Since attachSharedTable() never succeeds, there is nothing to detach.
+	return 0;
+}
+
+void ClientPageSpace::_splitBlock(arch::scalar_variable<uint64_t> *tbl2, int index2,
+		VirtualAddr pointer) {
+	assert(isBlock(tbl2[index2].load()));
+
+	auto tbl_address = physicalAllocator->allocate(kPageSize);
+	assert(tbl_address != PhysicalAddr(-1) && "OOM");
+	PageAccessor accessor{tbl_address};
+	auto tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor.get());
+
+	// Break-before-make: changing the size of a translation requires that the old
+	// entry is invalidated on all CPUs before the new entry is written.
+	auto entry = tbl2[index2].atomic_exchange(0);
+	invalidatePageAllAsids(pointer & ~(kHugePageSize - 1));
+
+	// The block is naturally aligned, hence all 4 KiB pages can use the contiguous hint.
+	uint64_t attributes = (entry & ~(kPageBlockAddress | kPageValid))
+			| kPageValid | kPageL3Page | kPageContiguous;
+	for (int i = 0; i < 512; i++)
+		tbl3[i].store(((entry & kPageBlockAddress) + (uint64_t(i) << kPageShift)) | attributes);
+
+	// Make the L3 table visible before the table entry.
+	asm volatile ("dsb ishst" ::: "memory");
+	tbl2[index2].store(tbl_address | kPageValid | kPageTable);
+}
+
+void ClientPageSpace::_breakContiguous(arch::scalar_variable<uint64_t> *tbl3, int index3,
+		VirtualAddr pointer) {
+	if (!(tbl3[index3].load() & kPageContiguous))
+		return;
+
+	auto first = index3 & ~(kContiguousEntries - 1);
+	auto base = pointer & ~(kContiguousSize - 1);
+
+	// Break-before-make, see _splitBlock().
+	uint64_t entries[kContiguousEntries];
+	for (int i = 0; i < kContiguousEntries; i++)
+		entries[i] = tbl3[first + i].atomic_exchange(0);
+	for (int i = 0; i < kContiguousEntries; i++)
+		invalidatePageAllAsids(base + i * kPageSize);
+	for (int i = 0; i < kContiguousEntries; i++)
+		tbl3[first + i].store(entries[i] & ~kPageContiguous);
+}
+
+void ClientPageSpace::_tryMakeContiguous(arch::scalar_variable<uint64_t> *tbl3, int index3,
+		VirtualAddr pointer) {
+	auto first = index3 & ~(kContiguousEntries - 1);
+	auto base = pointer & ~(kContiguousSize - 1);
+
+	// All entries must map a naturally aligned, physically contiguous range
+	// with identical attributes.
+	auto entry = tbl3[first].load();
+	auto physical = entry & kPageAddress;
+	auto attributes = entry & ~kPageAddress;
+	if (!(entry & kPageValid) || (physical & (kContiguousSize - 1)))
+		return;
+	for (int i = 1; i < kContiguousEntries; i++) {
+		auto other = tbl3[first + i].load();
+		if ((other & kPageAddress) != physical + i * kPageSize
+				|| (other & ~kPageAddress) != attributes)
+			return;
+	}
+
+	// Setting the contiguous bit also requires break-before-make.
+	for (int i = 0; i < kContiguousEntries; i++)
+		tbl3[first + i].store(0);
+	for (int i = 0; i < kContiguousEntries; i++)
+		invalidatePageAllAsids(base + i * kPageSize);
+	for (int i = 0; i < kContiguousEntries; i++)
+		tbl3[first + i].store((physical + i * kPageSize) | attributes | kPageContiguous);
+}
+
 }
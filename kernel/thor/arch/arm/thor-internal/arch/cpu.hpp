@@ -241,6 +241,11 @@ struct Executor {
 	Word *result0() { return &general()->x[0]; }
 	Word *result1() { return &general()->x[1]; }
 
+	// The FPU state is always switched eagerly on AArch64.
+	uint64_t numSimdSaves() { return 0; }
+	uint64_t numSimdRestores() { return 0; }
+	uint64_t numSimdTraps() { return 0; }
+
 	Frame *general() {
 		return reinterpret_cast<Frame *>(_pointer);
 	}
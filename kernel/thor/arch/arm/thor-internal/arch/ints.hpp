@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <stdint.h>
 #include <frg/spinlock.hpp>
 #include <thor-internal/debug.hpp>
 
@@ -27,6 +29,15 @@ inline void halt() {
 
 void suspendSelf();
 
+// Idle CPUs always wait for the ping IPI.
+inline bool haveMonitoredIdle() {
+	return false;
+}
+
+inline void monitoredIdle(std::atomic<uint32_t> *, uint32_t, uint64_t) {
+	__builtin_trap();
+}
+
 void sendPingIpi(int id);
 void sendShootdownIpi();
 
@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <frg/list.hpp>
+#include <arch/variable.hpp>
 #include <smarter.hpp>
 #include <thor-internal/mm-rc.hpp>
 #include <thor-internal/types.hpp>
@@ -13,7 +14,9 @@ namespace thor {
 
 enum {
 	kPageSize = 0x1000,
-	kPageShift = 12
+	kPageShift = 12,
+	kHugePageSize = 0x200000,
+	kHugePageShift = 21
 };
 
 constexpr Word kPfAccess = 1;
@@ -110,6 +113,16 @@ void poisonPhysicalAccess(PhysicalAddr physical);
 // Deny write access to the physical mapping.
 void poisonPhysicalWriteAccess(PhysicalAddr physical);
 
+// Zeroes a page using non-temporal stores, i.e., without pulling it into the cache.
+// Used to zero pages ahead of time where the page is not accessed immediately afterwards.
+void zeroPageNonTemporal(void *page);
+
+// Copies memory between kernel buffers using the fastest method that the CPU supports.
+void copyMemory(void *dest, const void *src, size_t size);
+
+// Copies a full page (e.g., to break copy-on-write).
+void copyPage(void *dest, const void *src);
+
 struct PageSpace;
 struct PageBinding;
 
@@ -256,6 +269,10 @@ using PageStatus = uint32_t;
 namespace page_status {
 	static constexpr PageStatus present = 1;
 	static constexpr PageStatus dirty = 2;
+	// The PTE belongs to a page table that is shared with other spaces (see SharedPageTable).
+	static constexpr PageStatus shared = 4;
+	// The PTE mapped the shared zero page (see getZeroPage()).
+	static constexpr PageStatus zero = 8;
 };
 
 enum class CachingMode {
@@ -408,14 +425,33 @@ public:
 
 	ClientPageSpace &operator= (const ClientPageSpace &) = delete;
 
-	void mapSingle4k(VirtualAddr pointer, PhysicalAddr physical, bool user_access,
+	// Returns false if the PTE belongs to a shared page table (see SharedPageTable).
+	bool mapSingle4k(VirtualAddr pointer, PhysicalAddr physical, bool user_access,
 			uint32_t flags, CachingMode caching_mode);
 	PageStatus unmapSingle4k(VirtualAddr pointer);
 	PageStatus cleanSingle4k(VirtualAddr pointer);
 	bool isMapped(VirtualAddr pointer);
 	bool updatePageAccess(VirtualAddr pointer);
 
+	// 2 MiB pages are mapped using L2 block descriptors.
+	bool mapSingle2m(VirtualAddr pointer, PhysicalAddr physical, bool user_access,
+			uint32_t flags, CachingMode caching_mode);
+	PageStatus unmapSingle2m(VirtualAddr pointer);
+	PageStatus cleanSingle2m(VirtualAddr pointer);
+
+	// Shared page tables are not supported yet: contiguous runs (see _tryMakeContiguous())
+	// would need to be managed across all sharers. attachSharedTable() always fails.
+	bool attachSharedTable(VirtualAddr pointer, PhysicalAddr table, bool user_access);
+	size_t detachSharedTable(VirtualAddr pointer, bool copy);
+
 private:
+	// Replaces a block by an equivalent L3 table.
+	void _splitBlock(arch::scalar_variable<uint64_t> *tbl2, int index2, VirtualAddr pointer);
+	// Clears the contiguous hint of the run that contains tbl3[index3] (if any).
+	void _breakContiguous(arch::scalar_variable<uint64_t> *tbl3, int index3, VirtualAddr pointer);
+	// Sets the contiguous hint on the run that contains tbl3[index3] if possible.
+	void _tryMakeContiguous(arch::scalar_variable<uint64_t> *tbl3, int index3, VirtualAddr pointer);
+
 	frg::ticket_spinlock _mutex;
 };
 
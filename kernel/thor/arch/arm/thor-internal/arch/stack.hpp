@@ -9,4 +9,9 @@ inline void walkThisStack(F) {
 	// TODO
 }
 
+template <typename F>
+inline void walkStackFrom(uintptr_t, uintptr_t, uintptr_t, F) {
+	// TODO
+}
+
 } // namespace thor
@@ -5,6 +5,7 @@
 #include <thor-internal/kasan.hpp>
 #include <thor-internal/main.hpp>
 #include <thor-internal/physical.hpp>
+#include <thor-internal/profile.hpp>
 
 namespace thor {
 
@@ -109,6 +110,61 @@ Executor::~Executor() {
 	kernelAlloc->free(_pointer);
 }
 
+namespace {
+	// Number of resumes that restore the extended state eagerly after a #NM.
+	constexpr unsigned int simdHotResumes = 16;
+
+	void armSimdTrap() {
+		uint64_t cr0;
+		asm volatile ("mov %%cr0, %0" : "=r" (cr0));
+		cr0 |= 8; // Set CR0.TS.
+		asm volatile ("mov %0, %%cr0" : : "r" (cr0));
+	}
+}
+
+void restoreSimdRegisters(Executor *executor) {
+	if(getGlobalCpuFeatures()->haveXsave){
+		common::x86::xrstor((uint8_t*)executor->_fxState(), ~0);
+	}else{
+		asm volatile ("fxrstorq %0" : : "m" (*executor->_fxState()));
+	}
+}
+
+void saveSimdState(Executor *executor) {
+	// If the state is not loaded, the save area is already up-to-date
+	// (and touching the registers would fault since CR0.TS is set).
+	if(!executor->_simdLoaded)
+		return;
+
+	if(getGlobalCpuFeatures()->haveXsaveopt){
+		common::x86::xsaveopt((uint8_t*)executor->_fxState(), ~0);
+	}else if(getGlobalCpuFeatures()->haveXsave){
+		common::x86::xsave((uint8_t*)executor->_fxState(), ~0);
+	}else{
+		asm volatile ("fxsaveq %0" : : "m" (*executor->_fxState()));
+	}
+	executor->_numSimdSaves++;
+}
+
+void loadSimdState(Executor *executor) {
+	assert(!intsAreEnabled());
+	auto cpuData = getCpuData();
+
+	if(executor->_simdLoaded) {
+		assert(!cpuData->simdTrapArmed);
+		return;
+	}
+
+	if(cpuData->simdTrapArmed) {
+		asm volatile ("clts");
+		cpuData->simdTrapArmed = false;
+	}
+	restoreSimdRegisters(executor);
+	executor->_simdLoaded = true;
+	executor->_simdHotness = simdHotResumes;
+	executor->_numSimdTraps++;
+}
+
 void saveExecutor(Executor *executor, FaultImageAccessor accessor) {
 	executor->general()->rax = accessor._frame()->rax;
 	executor->general()->rbx = accessor._frame()->rbx;
@@ -135,11 +191,7 @@ void saveExecutor(Executor *executor, FaultImageAccessor accessor) {
 	executor->general()->clientFs = common::x86::rdmsr(common::x86::kMsrIndexFsBase);
 	executor->general()->clientGs = common::x86::rdmsr(common::x86::kMsrIndexKernelGsBase);
 
-	if(getGlobalCpuFeatures()->haveXsave){
-		common::x86::xsave((uint8_t*)executor->_fxState(), ~0);
-	} else {
-		asm volatile ("fxsaveq %0" : : "m" (*executor->_fxState()));
-	}
+	saveSimdState(executor);
 }
 
 void saveExecutor(Executor *executor, IrqImageAccessor accessor) {
@@ -169,11 +221,7 @@ void saveExecutor(Executor *executor, IrqImageAccessor accessor) {
 	executor->general()->clientGs = common::x86::rdmsr(common::x86::kMsrIndexKernelGsBase);
 
 
-	if(getGlobalCpuFeatures()->haveXsave){
-		common::x86::xsave((uint8_t*)executor->_fxState(), ~0);
-	}else{
-		asm volatile ("fxsaveq %0" : : "m" (*executor->_fxState()));
-	}
+	saveSimdState(executor);
 }
 
 void saveExecutor(Executor *executor, SyscallImageAccessor accessor) {
@@ -202,11 +250,7 @@ void saveExecutor(Executor *executor, SyscallImageAccessor accessor) {
 	executor->general()->clientFs = common::x86::rdmsr(common::x86::kMsrIndexFsBase);
 	executor->general()->clientGs = common::x86::rdmsr(common::x86::kMsrIndexKernelGsBase);
 
-	if(getGlobalCpuFeatures()->haveXsave){
-		common::x86::xsave((uint8_t*)executor->_fxState(), ~0);
-	}else{
-		asm volatile ("fxsaveq %0" : : "m" (*executor->_fxState()));
-	}
+	saveSimdState(executor);
 }
 
 void switchExecutor(smarter::borrowed_ptr<Thread> thread) {
@@ -254,10 +298,24 @@ extern "C" [[ noreturn ]] void _restoreExecutorRegisters(void *pointer);
 	common::x86::wrmsr(common::x86::kMsrIndexFsBase, executor->general()->clientFs);
 	common::x86::wrmsr(common::x86::kMsrIndexKernelGsBase, executor->general()->clientGs);
 
-	if(getGlobalCpuFeatures()->haveXsave){
-		common::x86::xrstor((uint8_t*)executor->_fxState(), ~0);
+	// Executors that used the extended state recently get it restored eagerly.
+	// For all others, we set CR0.TS and restore the state on the first #NM.
+	auto cpuData = getCpuData();
+	if(executor->_simdHotness) {
+		if(cpuData->simdTrapArmed) {
+			asm volatile ("clts");
+			cpuData->simdTrapArmed = false;
+		}
+		restoreSimdRegisters(executor);
+		executor->_simdLoaded = true;
+		executor->_simdHotness--;
+		executor->_numSimdRestores++;
 	}else{
-		asm volatile ("fxrstorq %0" : : "m" (*executor->_fxState()));
+		if(!cpuData->simdTrapArmed) {
+			armSimdTrap();
+			cpuData->simdTrapArmed = true;
+		}
+		executor->_simdLoaded = false;
 	}
 
 	uint16_t cs = executor->general()->cs;
@@ -399,6 +457,9 @@ bool handleUserAccessFault(uintptr_t address, bool write, FaultImageAccessor acc
 constinit bool cpuFeaturesKnown = false;
 constinit CpuFeatures globalCpuFeatures{};
 
+// Read by the user access routines in user-access.S.
+extern "C" constinit bool thorUseRepMovsb = false;
+
 initgraph::Stage *getCpuFeaturesKnownStage() {
 	static initgraph::Stage s{&globalInitEngine, "x86.cpu-features-known"};
 	return &s;
@@ -414,6 +475,11 @@ static initgraph::Task enumerateCpuFeaturesTask{&globalInitEngine, "x86.enumerat
 
 			auto xsaveCpuid = common::x86::cpuid(0xD);
 			globalCpuFeatures.xsaveRegionSize = xsaveCpuid[2];
+
+			if(common::x86::cpuid(0xD, 1)[0] & 1) {
+				infoLogger() << "\e[37mthor: CPUs support XSAVEOPT\e[39m" << frg::endlog;
+				globalCpuFeatures.haveXsaveopt = true;
+			}
 		}else{
 			infoLogger() << "\e[37mthor: CPUs do not support XSAVE!\e[39m" << frg::endlog;
 		}
@@ -434,6 +500,25 @@ static initgraph::Task enumerateCpuFeaturesTask{&globalInitEngine, "x86.enumerat
 			}
 		}
 
+		if(common::x86::cpuid(0x07)[1] & (uint32_t(1) << 9)) {
+			infoLogger() << "\e[37mthor: CPUs support ERMS\e[39m" << frg::endlog;
+			globalCpuFeatures.haveErms = true;
+			thorUseRepMovsb = true;
+		}
+		if(common::x86::cpuid(0x07)[3] & (uint32_t(1) << 4)) {
+			infoLogger() << "\e[37mthor: CPUs support FSRM\e[39m" << frg::endlog;
+			globalCpuFeatures.haveFsrm = true;
+		}
+
+		auto maxLeaf = common::x86::cpuid(0)[0];
+		if((common::x86::cpuid(0x01)[2] & (1 << 3)) && maxLeaf >= 6) {
+			infoLogger() << "\e[37mthor: CPUs support MONITOR/MWAIT\e[39m" << frg::endlog;
+			globalCpuFeatures.haveMwait = true;
+			globalCpuFeatures.mwaitSubstates = common::x86::cpuid(0x05)[3];
+			if(common::x86::cpuid(0x06)[0] & (1 << 2))
+				globalCpuFeatures.haveArat = true;
+		}
+
 		if(common::x86::cpuid(0x80000007)[3] & (1 << 8)) {
 			infoLogger() << "\e[37mthor: CPUs support invariant TSC\e[39m"
 					<< frg::endlog;
@@ -499,6 +584,8 @@ static initgraph::Task enumerateCpuFeaturesTask{&globalInitEngine, "x86.enumerat
 
 namespace {
 	frg::manual_box<frg::vector<CpuData *, KernelAlloc>> allCpuContexts;
+	// Protects allCpuContexts against concurrent pushes while APs are booting in parallel.
+	frg::ticket_spinlock allCpuContextsMutex;
 }
 
 CpuData *getCpuData(size_t k) {
@@ -563,9 +650,14 @@ static initgraph::Task initBootProcessorTask{&globalInitEngine, "x86.init-boot-p
 void initializeThisProcessor() {
 	auto cpuData = getCpuData();
 
-	// TODO: If we want to make bootSecondary() parallel, we have to lock here.
-	cpuData->cpuIndex = allCpuContexts->size();
-	allCpuContexts->push(cpuData);
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&allCpuContextsMutex);
+
+		cpuData->cpuIndex = allCpuContexts->size();
+		allCpuContexts->push(cpuData);
+	}
+	cpuData->numaNode = getNumaNodeOfCpu(cpuData->localApicId);
 
 	// Allocate per-CPU areas.
 	cpuData->irqStack = UniqueKernelStack::make();
@@ -697,8 +789,14 @@ void initializeThisProcessor() {
 	// Enable the PCID extension.
 	bool pcidBit = common::x86::cpuid(0x01)[2] & (uint32_t(1) << 17);
 	bool invpcidBit = common::x86::cpuid(0x07)[1] & (uint32_t(1) << 10);
-	if(pcidBit && invpcidBit) {
-		infoLogger() << "\e[37mthor: CPU supports PCIDs\e[39m" << frg::endlog;
+	if(pcidBit) {
+		if(invpcidBit) {
+			infoLogger() << "\e[37mthor: CPU supports PCIDs\e[39m" << frg::endlog;
+		}else{
+			// Without INVPCID, flushes of inactive PCIDs are deferred until they are reloaded.
+			infoLogger() << "\e[37mthor: CPU supports PCIDs but no INVPCID;"
+					" will defer flushes of inactive PCIDs\e[39m" << frg::endlog;
+		}
 
 		uint64_t cr4;
 		asm volatile ("mov %%cr4, %0" : "=r" (cr4));
@@ -706,9 +804,7 @@ void initializeThisProcessor() {
 		asm volatile ("mov %0, %%cr4" : : "r" (cr4));
 
 		cpuData->havePcids = true;
-	}else if(pcidBit) {
-		infoLogger() << "\e[37mthor: CPU supports PCIDs but no INVPCID;"
-				" will not use PCIDs!\e[39m" << frg::endlog;
+		cpuData->haveInvpcid = invpcidBit;
 	}else{
 		infoLogger() << "\e[37mthor: CPU does not support PCIDs!\e[39m" << frg::endlog;
 	}
@@ -770,6 +866,7 @@ void secondaryMain(StatusBlock *statusBlock) {
 	infoLogger() << "Hello world from CPU #" << getLocalApicId() << frg::endlog;
 
 	Scheduler::resume(cpuContext->wqFiber);
+	initializeProfileOnThisCpu();
 
 	auto scheduler = localScheduler();
 	scheduler->update();
@@ -777,77 +874,111 @@ void secondaryMain(StatusBlock *statusBlock) {
 	scheduler->commitReschedule();
 }
 
-void bootSecondary(unsigned int apic_id) {
-	if(disableSmp)
-		return;
+namespace {
+	// APs are booted in batches; each AP of a batch gets its own trampoline page.
+	// The pages must be below 1 MiB since the SIPI vector only encodes 8 bits of the page number.
+	// TODO: Allocate pages in low physical memory instead of hard-coding them.
+	constexpr uintptr_t trampolineBase = 0x10000;
+	constexpr size_t maxParallelAps = 64;
+	static_assert(trampolineBase + maxParallelAps * kPageSize <= 0x9F000);
+
+	// Size of the stack that the AP uses during initialization.
+	constexpr size_t apStackSize = 0x10000;
+
+	void waitForTargetStage(frg::span<StatusBlock *> statusBlocks, unsigned int stage) {
+		for(auto statusBlock : statusBlocks) {
+			while(__atomic_load_n(&statusBlock->targetStage, __ATOMIC_ACQUIRE) < stage)
+				pause();
+		}
+	}
 
-	// TODO: Allocate a page in low physical memory instead of hard-coding it.
-	uintptr_t pma = 0x10000;
+	void bootSecondaryBatch(frg::span<const unsigned int> apicIds) {
+		assert(apicIds.size() <= maxParallelAps);
 
-	// Copy the trampoline code into low physical memory.
-	auto image_size = (uintptr_t)_binary_kernel_thor_arch_x86_trampoline_bin_end
-			- (uintptr_t)_binary_kernel_thor_arch_x86_trampoline_bin_start;
-	assert(image_size <= kPageSize);
-	PageAccessor accessor{pma};
-	memcpy(accessor.get(), _binary_kernel_thor_arch_x86_trampoline_bin_start, image_size);
+		StatusBlock *statusBlocks[maxParallelAps];
+		auto copyTrampoline = [] (uintptr_t pma) {
+			auto image_size = (uintptr_t)_binary_kernel_thor_arch_x86_trampoline_bin_end
+					- (uintptr_t)_binary_kernel_thor_arch_x86_trampoline_bin_start;
+			assert(image_size <= kPageSize - sizeof(StatusBlock));
+			PageAccessor accessor{pma};
+			memcpy(accessor.get(), _binary_kernel_thor_arch_x86_trampoline_bin_start, image_size);
+			return accessor;
+		};
 
-	// Allocate a stack for the initialization code.
-	constexpr size_t stack_size = 0x10000;
-	void *stack_ptr = kernelAlloc->allocate(stack_size);
+		// Prepare the trampolines, stacks and CPU contexts of all APs up front.
+		for(size_t i = 0; i < apicIds.size(); ++i) {
+			auto pma = trampolineBase + i * kPageSize;
+			auto accessor = copyTrampoline(pma);
 
-	auto context = frg::construct<CpuData>(*kernelAlloc);
-	context->localApicId = apic_id;
+			void *stack_ptr = kernelAlloc->allocate(apStackSize);
 
-	// Participate in global TLB invalidation *before* paging is used by the target CPU.
-	{
-		auto irqLock = frg::guard(&irqMutex());
+			auto context = frg::construct<CpuData>(*kernelAlloc);
+			context->localApicId = apicIds[i];
 
-		context->globalBinding.bind();
-	}
+			// Participate in global TLB invalidation *before* paging is used by the target CPU.
+			{
+				auto irqLock = frg::guard(&irqMutex());
+
+				context->globalBinding.bind();
+			}
 
-	// Setup a status block to communicate information to the AP.
-	auto statusBlock = reinterpret_cast<StatusBlock *>(reinterpret_cast<char *>(accessor.get())
-			+ (kPageSize - sizeof(StatusBlock)));
-	infoLogger() << "status block accessed via: " << statusBlock << frg::endlog;
-
-	statusBlock->self = statusBlock;
-	statusBlock->targetStage = 0;
-	statusBlock->initiatorStage = 0;
-	statusBlock->pml4 = KernelPageSpace::global().rootTable();
-	statusBlock->stack = (uintptr_t)stack_ptr + stack_size;
-	statusBlock->main = &secondaryMain;
-	statusBlock->cpuContext = context;
-
-	// Send the IPI sequence that starts up the AP.
-	// On modern processors INIT lets the processor enter the wait-for-SIPI state.
-	// The BIOS is not involved in this process at all.
-	infoLogger() << "thor: Booting AP " << apic_id << "." << frg::endlog;
-	raiseInitAssertIpi(apic_id);
-	KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(10'000'000)); // Wait for 10ms.
-
-	// SIPI causes the processor to resume execution and resets CS:IP.
-	// Intel suggets to send two SIPIs (probably for redundancy reasons).
-	raiseStartupIpi(apic_id, pma);
-	KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(200'000)); // Wait for 200us.
-	raiseStartupIpi(apic_id, pma);
-	KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(200'000)); // Wait for 200us.
-
-	// Wait until the AP wakes up.
-	while(__atomic_load_n(&statusBlock->targetStage, __ATOMIC_ACQUIRE) < 1) {
-		pause();
+			// Setup a status block to communicate information to the AP.
+			auto statusBlock = reinterpret_cast<StatusBlock *>(
+					reinterpret_cast<char *>(accessor.get())
+					+ (kPageSize - sizeof(StatusBlock)));
+			statusBlock->self = statusBlock;
+			statusBlock->targetStage = 0;
+			statusBlock->initiatorStage = 0;
+			statusBlock->pml4 = KernelPageSpace::global().rootTable();
+			statusBlock->stack = (uintptr_t)stack_ptr + apStackSize;
+			statusBlock->main = &secondaryMain;
+			statusBlock->cpuContext = context;
+			statusBlocks[i] = statusBlock;
+		}
+
+		// Send the IPI sequence that starts up the APs.
+		// On modern processors INIT lets the processor enter the wait-for-SIPI state.
+		// The BIOS is not involved in this process at all.
+		// The delays are only required once per batch, not once per AP.
+		for(auto apicId : apicIds) {
+			infoLogger() << "thor: Booting AP " << apicId << "." << frg::endlog;
+			raiseInitAssertIpi(apicId);
+		}
+		KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(10'000'000)); // Wait for 10ms.
+
+		// SIPI causes the processor to resume execution and resets CS:IP.
+		// Intel suggets to send two SIPIs (probably for redundancy reasons).
+		for(int k = 0; k < 2; ++k) {
+			for(size_t i = 0; i < apicIds.size(); ++i)
+				raiseStartupIpi(apicIds[i], trampolineBase + i * kPageSize);
+			KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(200'000)); // Wait for 200us.
+		}
+
+		// Wait until the APs wake up.
+		waitForTargetStage({statusBlocks, apicIds.size()}, 1);
+		infoLogger() << "thor: " << apicIds.size() << " APs did wake up." << frg::endlog;
+
+		// We only let the APs proceed after all IPIs have been sent.
+		// This ensures that no AP executes boot code twice (e.g. in case
+		// it already wakes up after a single SIPI).
+		// From here on, the APs initialize themselves concurrently.
+		for(size_t i = 0; i < apicIds.size(); ++i)
+			__atomic_store_n(&statusBlocks[i]->initiatorStage, 1, __ATOMIC_RELEASE);
+
+		// Wait until all APs exit the boot code. The trampoline pages can be reused afterwards.
+		waitForTargetStage({statusBlocks, apicIds.size()}, 2);
+		infoLogger() << "thor: " << apicIds.size() << " APs finished booting." << frg::endlog;
 	}
-	infoLogger() << "thor: AP did wake up." << frg::endlog;
+}
 
-	// We only let the AP proceed after all IPIs have been sent.
-	// This ensures that the AP does not execute boot code twice (e.g. in case
-	// it already wakes up after a single SIPI).
-	__atomic_store_n(&statusBlock->initiatorStage, 1, __ATOMIC_RELEASE);
+void bootSecondaries(frg::span<const unsigned int> apicIds) {
+	if(disableSmp)
+		return;
 
-	// Wait until the AP exits the boot code.
-	while(__atomic_load_n(&statusBlock->targetStage, __ATOMIC_ACQUIRE) < 2) {
-		pause();
+	for(size_t i = 0; i < apicIds.size(); i += maxParallelAps) {
+		auto n = frg::min(apicIds.size() - i, maxParallelAps);
+		bootSecondaryBatch({apicIds.data() + i, n});
 	}
-	infoLogger() << "thor: AP finished booting." << frg::endlog;
 }
 
 Error getEntropyFromCpu(void *buffer, size_t size) {
@@ -4,6 +4,23 @@
 
 namespace thor::vmx {
 
+namespace {
+	// Opportunistically replace fully populated page tables by 2 MiB mappings.
+	constexpr bool enableLargePages = true;
+
+	constexpr uint64_t eptLargePage = uint64_t(1) << 7;
+	constexpr uint64_t eptAccessed = uint64_t(1) << 8;
+	constexpr uint64_t eptDirty = uint64_t(1) << 9;
+	constexpr uint64_t eptAddressMask = 0x000F'FFFF'FFFF'F000;
+
+	constexpr size_t eptLargePageSize = size_t(1) << 21;
+
+	size_t *eptTable(size_t entry) {
+		PageAccessor accessor{entry & eptAddressMask};
+		return reinterpret_cast<size_t*>(accessor.get());
+	}
+}
+
 Error EptSpace::map(uint64_t guestAddress, uint64_t hostAddress, int flags) {
 	auto irq_lock = frg::guard(&irqMutex());
 	auto lock = frg::guard(&_mutex);
@@ -59,6 +76,11 @@ Error EptSpace::map(uint64_t guestAddress, uint64_t hostAddress, int flags) {
 	}
 
 
+	if(pde[pdeIdx] & eptLargePage) {
+		if(auto e = _split(pde, pdeIdx); e != Error::success)
+			return e;
+	}
+
 	size_t* pte;
 	if(!(pde[pdeIdx] & (1 << EPT_READ))) {
 		auto pt_ptr = physicalAllocator->allocate(kPageSize);
@@ -79,121 +101,196 @@ Error EptSpace::map(uint64_t guestAddress, uint64_t hostAddress, int flags) {
 	size_t entry = (alloc << EPT_PHYSADDR) | pageFlags | (6 << EPT_MEMORY_TYPE) | (1 << EPT_IGNORE_PAT);
 	pte[pteIdx] = entry | flags;
 
+	if(enableLargePages)
+		_tryPromote(pde, pdeIdx);
+
 	return Error::success;
 }
 
 bool EptSpace::isMapped(VirtualAddr guestAddress) {
-	int pml4eIdx = (((guestAddress) >> 39) & 0x1ff);
-	int pdpteIdx = (((guestAddress) >> 30) & 0x1ff);
-	int pdeIdx   = (((guestAddress) >> 21) & 0x1ff);
-	int pteIdx   = (((guestAddress) >> 12) & 0x1ff);
-
-	PageAccessor spaceAccessor{spaceRoot};
-	size_t* pml4e = reinterpret_cast<size_t*>(spaceAccessor.get());
-
-	size_t* pdpte;
-	if(!(pml4e[pml4eIdx] & (1 << EPT_READ))) {
-		return false;
-	} else {
-		PageAccessor pdpteAccessor{(pml4e[pml4eIdx] >> EPT_PHYSADDR) << 12};
-		pdpte = reinterpret_cast<size_t*>(pdpteAccessor.get());
-	}
-
-	size_t* pde;
-	if(!(pdpte[pdpteIdx] & (1 << EPT_READ))) {
-		return false;
-	} else {
-		PageAccessor pdpteAccessor{(pdpte[pdpteIdx] >> EPT_PHYSADDR) << 12};
-		pde = reinterpret_cast<size_t*>(pdpteAccessor.get());
-	}
+	int pdeIdx = (((guestAddress) >> 21) & 0x1ff);
+	int pteIdx = (((guestAddress) >> 12) & 0x1ff);
 
-	size_t* pte;
-	if(!(pde[pdeIdx] & (1 << EPT_READ))) {
+	auto pde = _walkToPd(guestAddress);
+	if(!pde || !(pde[pdeIdx] & (1 << EPT_READ)))
 		return false;
-	} else {
-		PageAccessor pdpteAccessor{(pde[pdeIdx] >> EPT_PHYSADDR) << 12};
-		pte = reinterpret_cast<size_t*>(pdpteAccessor.get());
-	}
+	if(pde[pdeIdx] & eptLargePage)
+		return true;
 
-	return ((pte[pteIdx] & EPT_READ));
+	auto pte = eptTable(pde[pdeIdx]);
+	return pte[pteIdx] & (1 << EPT_READ);
 }
 
 uintptr_t EptSpace::translate(uintptr_t guestAddress) {
-	int pml4eIdx = (((guestAddress) >> 39) & 0x1ff);
-	int pdpteIdx = (((guestAddress) >> 30) & 0x1ff);
-	int pdeIdx   = (((guestAddress) >> 21) & 0x1ff);
-	int pteIdx   = (((guestAddress) >> 12) & 0x1ff);
-	int offset = (size_t)guestAddress & (0x1000 - 1);
+	int pdeIdx = (((guestAddress) >> 21) & 0x1ff);
+	int pteIdx = (((guestAddress) >> 12) & 0x1ff);
 
-	PageAccessor spaceAccessor{spaceRoot};
-	size_t* pml4e = reinterpret_cast<size_t*>(spaceAccessor.get());
+	auto pde = _walkToPd(guestAddress);
+	if(!pde || !(pde[pdeIdx] & (1 << EPT_READ)))
+		return -1;
+	if(pde[pdeIdx] & eptLargePage)
+		return (pde[pdeIdx] & eptAddressMask) + (guestAddress & (eptLargePageSize - 1));
 
-	size_t* pdpte;
-	if(!(pml4e[pml4eIdx] & (1 << EPT_READ))) {
+	auto pte = eptTable(pde[pdeIdx]);
+	if(!(pte[pteIdx] & (1 << EPT_READ)))
 		return -1;
-	} else {
-		PageAccessor pdpteAccessor{(pml4e[pml4eIdx] >> EPT_PHYSADDR) << 12};
-		pdpte = reinterpret_cast<size_t*>(pdpteAccessor.get());
+	return (pte[pteIdx] & eptAddressMask) + (guestAddress & (kPageSize - 1));
+}
+
+PageStatus EptSpace::unmap(uint64_t guestAddress) {
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+	int pdeIdx = (((guestAddress) >> 21) & 0x1ff);
+	int pteIdx = (((guestAddress) >> 12) & 0x1ff);
+
+	auto pde = _walkToPd(guestAddress);
+	if(!pde || !(pde[pdeIdx] & (1 << EPT_READ)))
+		return 0;
+	if(pde[pdeIdx] & eptLargePage) {
+		if(_split(pde, pdeIdx) != Error::success)
+			panicLogger() << "thor: Out of memory while splitting EPT large page" << frg::endlog;
 	}
 
-	size_t* pde;
-	if(!(pdpte[pdpteIdx] & (1 << EPT_READ))) {
-		return -1;
-	} else {
-		PageAccessor pdpteAccessor{(pdpte[pdpteIdx] >> EPT_PHYSADDR) << 12};
-		pde = reinterpret_cast<size_t*>(pdpteAccessor.get());
+	auto pte = eptTable(pde[pdeIdx]);
+	auto entry = __atomic_exchange_n(&pte[pteIdx], 0, __ATOMIC_RELAXED);
+	if(!(entry & (1 << EPT_READ)))
+		return 0;
+	PageStatus status = page_status::present;
+	if(entry & eptDirty) {
+		status |= page_status::dirty;
 	}
+	return status;
+}
 
-	size_t* pte;
-	if(!(pde[pdeIdx] & (1 << EPT_READ))) {
-		return -1;
-	} else {
-		PageAccessor pdpteAccessor{(pde[pdeIdx] >> EPT_PHYSADDR) << 12};
-		pte = reinterpret_cast<size_t*>(pdpteAccessor.get());
+Error EptSpace::fetchDirtyLog(uintptr_t guestAddress, size_t size, uint8_t *bitmap) {
+	assert(!(guestAddress & (kPageSize - 1)));
+	assert(!(size & (kPageSize - 1)));
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	memset(bitmap, 0, (size / kPageSize + 7) / 8);
+	bool anyCleared = false;
+	auto markDirty = [&] (size_t page) {
+		bitmap[page / 8] |= 1 << (page % 8);
+	};
+
+	size_t progress = 0;
+	while(progress < size) {
+		auto address = guestAddress + progress;
+		int pdeIdx = (((address) >> 21) & 0x1ff);
+		int pteIdx = (((address) >> 12) & 0x1ff);
+
+		auto pde = _walkToPd(address);
+		if(!pde || !(pde[pdeIdx] & (1 << EPT_READ))) {
+			// Skip to the next 2 MiB region.
+			progress += eptLargePageSize - (address & (eptLargePageSize - 1));
+			continue;
+		}
+
+		if(pde[pdeIdx] & eptLargePage) {
+			// The dirty bit covers the entire 2 MiB region.
+			size_t chunk = frg::min(eptLargePageSize - (address & (eptLargePageSize - 1)),
+					size - progress);
+			if(__atomic_fetch_and(&pde[pdeIdx], ~eptDirty, __ATOMIC_RELAXED) & eptDirty) {
+				for(size_t off = 0; off < chunk; off += kPageSize)
+					markDirty((progress + off) / kPageSize);
+				anyCleared = true;
+			}
+			progress += chunk;
+			continue;
+		}
+
+		auto pte = eptTable(pde[pdeIdx]);
+		if(__atomic_fetch_and(&pte[pteIdx], ~eptDirty, __ATOMIC_RELAXED) & eptDirty) {
+			markDirty(progress / kPageSize);
+			anyCleared = true;
+		}
+		progress += kPageSize;
 	}
 
-	return ((pte[pteIdx] >> EPT_PHYSADDR) << 12) + offset;
+	// The CPU caches dirty bits in the TLB; it only sets them again after invalidation.
+	if(anyCleared)
+		_invalidate();
+	return Error::success;
 }
 
-PageStatus EptSpace::unmap(uint64_t guestAddress) {
+size_t *EptSpace::_walkToPd(uint64_t guestAddress) {
 	int pml4eIdx = (((guestAddress) >> 39) & 0x1ff);
 	int pdpteIdx = (((guestAddress) >> 30) & 0x1ff);
-	int pdeIdx   = (((guestAddress) >> 21) & 0x1ff);
-	int pteIdx   = (((guestAddress) >> 12) & 0x1ff);
 
 	PageAccessor spaceAccessor{spaceRoot};
-	size_t* pml4e = reinterpret_cast<size_t*>(spaceAccessor.get());
+	auto pml4e = reinterpret_cast<size_t*>(spaceAccessor.get());
+	if(!(pml4e[pml4eIdx] & (1 << EPT_READ)))
+		return nullptr;
 
-	size_t* pdpte;
-	if(!(pml4e[pml4eIdx] & (1 << EPT_READ))) {
-		return 0;
-	} else {
-		PageAccessor pdpteAccessor{(pml4e[pml4eIdx] >> EPT_PHYSADDR) << 12};
-		pdpte = reinterpret_cast<size_t*>(pdpteAccessor.get());
-	}
+	auto pdpte = eptTable(pml4e[pml4eIdx]);
+	if(!(pdpte[pdpteIdx] & (1 << EPT_READ)))
+		return nullptr;
+	return eptTable(pdpte[pdpteIdx]);
+}
 
-	size_t* pde;
-	if(!(pdpte[pdpteIdx] & (1 << EPT_READ))) {
-		return 0;
-	} else {
-		PageAccessor pdpteAccessor{(pdpte[pdpteIdx] >> EPT_PHYSADDR) << 12};
-		pde = reinterpret_cast<size_t*>(pdpteAccessor.get());
+void EptSpace::_tryPromote(size_t *pde, int pdeIdx) {
+	auto pte = eptTable(pde[pdeIdx]);
+
+	// All 512 entries must map a naturally aligned, contiguous 2 MiB host range
+	// with identical permissions and memory type.
+	auto base = pte[0] & eptAddressMask;
+	auto attributes = pte[0] & ~(eptAddressMask | eptAccessed | eptDirty);
+	if(!(pte[0] & (1 << EPT_READ)) || (base & (eptLargePageSize - 1)))
+		return;
+	// Cheap check first since this runs on every map().
+	if((pte[511] & eptAddressMask) != base + 511 * kPageSize)
+		return;
+	for(int i = 1; i < 512; i++) {
+		if((pte[i] & eptAddressMask) != base + i * kPageSize)
+			return;
+		if((pte[i] & ~(eptAddressMask | eptAccessed | eptDirty)) != attributes)
+			return;
 	}
 
-	size_t* pte;
-	if(!(pde[pdeIdx] & (1 << EPT_READ))) {
-		return 0;
-	} else {
-		PageAccessor pdpteAccessor{(pde[pdeIdx] >> EPT_PHYSADDR) << 12};
-		pte = reinterpret_cast<size_t*>(pdpteAccessor.get());
-	}
+	auto table = pde[pdeIdx] & eptAddressMask;
+	__atomic_store_n(&pde[pdeIdx], base | attributes | eptLargePage, __ATOMIC_RELAXED);
+	_invalidate();
 
-	PageStatus status = page_status::present;
-	if(pte[pteIdx] & (1 << 9)) {
-		status |= page_status::dirty;
+	// Do not lose accessed/dirty bits that were set before the large page became visible.
+	uint64_t bits = 0;
+	for(int i = 0; i < 512; i++)
+		bits |= __atomic_load_n(&pte[i], __ATOMIC_RELAXED) & (eptAccessed | eptDirty);
+	__atomic_fetch_or(&pde[pdeIdx], bits, __ATOMIC_RELAXED);
+
+	physicalAllocator->free(table, kPageSize);
+}
+
+Error EptSpace::_split(size_t *pde, int pdeIdx) {
+	auto ptPhysical = physicalAllocator->allocate(kPageSize);
+	if(ptPhysical == static_cast<PhysicalAddr>(-1))
+		return Error::noMemory;
+	PageAccessor ptAccessor{ptPhysical};
+	auto pte = reinterpret_cast<size_t*>(ptAccessor.get());
+
+	auto entry = pde[pdeIdx];
+	auto base = entry & eptAddressMask;
+	auto attributes = entry & ~(eptAddressMask | eptLargePage | eptDirty);
+	for(int i = 0; i < 512; i++)
+		pte[i] = (base + i * kPageSize) | attributes;
+
+	size_t tableFlags = (1 << EPT_READ) | (1 << EPT_WRITE) | (1 << EPT_EXEC);
+	auto old = __atomic_exchange_n(&pde[pdeIdx], ptPhysical | tableFlags, __ATOMIC_RELAXED);
+	// Conservatively propagate the dirty bit to all 4 KiB pages.
+	if(old & eptDirty) {
+		for(int i = 0; i < 512; i++)
+			__atomic_fetch_or(&pte[i], eptDirty, __ATOMIC_RELAXED);
 	}
-	pte[pteIdx] = 0;
-	return status;
+	_invalidate();
+	return Error::success;
+}
+
+void EptSpace::_invalidate() {
+	EptPtr ptr = {spaceRoot, 0};
+	asm volatile (
+		"invept (%0), %1;"
+		: : "r"(&ptr), "r"((uint64_t)1) : "memory"
+	);
 }
 
 Error EptSpace::store(uintptr_t guestAddress, size_t size, const void* buffer) {
@@ -270,7 +367,8 @@ EptSpace::~EptSpace() {
 					PageAccessor pdeAccessor{(pdpte[j] >> EPT_PHYSADDR) << 12};
 					auto pde = reinterpret_cast<size_t*>(pdeAccessor.get());
 					for(int k = 0; k < 512; k++) {
-						if(pde[k] & (1 << EPT_READ)) {
+						// Large pages are backed by memory objects; there is no table to free.
+						if((pde[k] & (1 << EPT_READ)) && !(pde[k] & eptLargePage)) {
 							PageAccessor ptAccessor{(pde[k] >> EPT_PHYSADDR) << 12};
 							auto pte = reinterpret_cast<size_t*>(ptAccessor.get());
 							for(int l = 0; l < 512; l++) {
@@ -305,6 +305,16 @@ extern "C" void onPlatformFault(FaultImageAccessor image, int number) {
 	if(number == 14)
 		asm volatile ("mov %%cr2, %0" : "=r" (pfAddress));
 
+	// #NM is raised on the first use of the extended state after a lazy restore.
+	// Load the state with IRQs still disabled so that we cannot be preempted in between.
+	if(number == 7) {
+		if(*image.cs() != kSelClientUserCode)
+			panicLogger() << "thor: #NM in kernel mode at ip: "
+					<< (void *)*image.ip() << frg::endlog;
+		loadSimdState(&getCurrentThread()->_executor);
+		return;
+	}
+
 	enableInts();
 
 	uint16_t cs = *image.cs();
@@ -455,6 +465,12 @@ extern "C" void onPlatformShootdown(IrqImageAccessor image) {
 	assert(!irqMutex().nesting());
 	disableUserAccess();
 
+	auto &count = getCpuData()->numShootdownIpis;
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	// Clear the flag before inspecting the queues; see PageContext.
+	getCpuData()->pageContext.shootdownPending.exchange(false, std::memory_order_acq_rel);
+
 	for(int i = 0; i < maxPcidCount; i++)
 		getCpuData()->pcidBindings[i].shootdown();
 
@@ -477,6 +493,9 @@ extern "C" void onPlatformPing(IrqImageAccessor image) {
 	assert(!irqMutex().nesting());
 	disableUserAccess();
 
+	auto &count = getCpuData()->numPingIpis;
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
 	acknowledgeIpi();
 
 	handlePreemption(image);
@@ -508,13 +527,11 @@ extern "C" void onPlatformNmi(NmiImageAccessor image) {
 	bool explained = false;
 	auto pmcMechanism = cpuData->profileMechanism.load(std::memory_order_acquire);
 	if(pmcMechanism == ProfileMechanism::intelPmc && checkIntelPmcOverflow()) {
-		uintptr_t ip = *image.ip();
-		cpuData->localProfileRing->enqueue(&ip, sizeof(uintptr_t));
+		recordProfileSample(cpuData, *image.ip(), *image.bp(), *image.sp());
 		setIntelPmc();
 		explained = true;
 	}else if(pmcMechanism == ProfileMechanism::amdPmc && checkAmdPmcOverflow()) {
-		uintptr_t ip = *image.ip();
-		cpuData->localProfileRing->enqueue(&ip, sizeof(uintptr_t));
+		recordProfileSample(cpuData, *image.ip(), *image.bp(), *image.sp());
 		setAmdPmc();
 		explained = true;
 	}
@@ -539,11 +556,41 @@ extern "C" void onPlatformNmi(NmiImageAccessor image) {
 }
 
 extern "C" void enableIntsAndHaltForever();
+extern "C" void thorMonitorWait(uint32_t *word, uint32_t value, uint32_t hint);
 
 void suspendSelf() {
 	assert(!intsAreEnabled());
 	enableIntsAndHaltForever();
 }
 
+namespace {
+	// Minimal predicted idle durations (in ns) for MWAIT C2 and C3.
+	constexpr uint64_t mwaitC2Threshold = 50'000;
+	constexpr uint64_t mwaitC3Threshold = 500'000;
+}
+
+bool haveMonitoredIdle() {
+	return globalCpuFeatures.haveMwait;
+}
+
+void monitoredIdle(std::atomic<uint32_t> *word, uint32_t value, uint64_t predictedIdle) {
+	assert(!intsAreEnabled());
+
+	// Without ARAT, the local APIC timer may stop in C-states deeper than C1.
+	int cstate = 1;
+	if(globalCpuFeatures.haveArat) {
+		if(predictedIdle >= mwaitC3Threshold) {
+			cstate = 3;
+		}else if(predictedIdle >= mwaitC2Threshold) {
+			cstate = 2;
+		}
+	}
+	// Fall back to shallower C-states if the CPU does not support the selected one.
+	while(cstate > 1 && !((globalCpuFeatures.mwaitSubstates >> (4 * cstate)) & 0xF))
+		cstate--;
+
+	thorMonitorWait(reinterpret_cast<uint32_t *>(word), value, (cstate - 1) << 4);
+}
+
 } // namespace thor
 
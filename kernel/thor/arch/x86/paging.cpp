@@ -2,6 +2,7 @@
 #include <arch/variable.hpp>
 #include <frg/list.hpp>
 #include <thor-internal/cpu-data.hpp>
+#include <thor-internal/memory-view.hpp>
 #include <thor-internal/physical.hpp>
 #include <thor-internal/arch/paging.hpp>
 
@@ -62,6 +63,38 @@ void poisonPhysicalWriteAccess(PhysicalAddr physical) {
 	invalidatePage(reinterpret_cast<void *>(address));
 }
 
+void zeroPageNonTemporal(void *page) {
+	auto p = reinterpret_cast<uint64_t *>(page);
+	for(size_t i = 0; i < kPageSize / sizeof(uint64_t); i += 4) {
+		asm volatile ("movnti %1, %0" : "=m"(p[i]) : "r"(uint64_t{0}));
+		asm volatile ("movnti %1, %0" : "=m"(p[i + 1]) : "r"(uint64_t{0}));
+		asm volatile ("movnti %1, %0" : "=m"(p[i + 2]) : "r"(uint64_t{0}));
+		asm volatile ("movnti %1, %0" : "=m"(p[i + 3]) : "r"(uint64_t{0}));
+	}
+	// Non-temporal stores are weakly ordered; make them visible before the page is published.
+	asm volatile ("sfence" : : : "memory");
+}
+
+void copyMemory(void *dest, const void *src, size_t size) {
+	// Short copies are dominated by the startup cost of rep movsb, unless FSRM is available.
+	if(globalCpuFeatures.haveErms
+			&& (globalCpuFeatures.haveFsrm || size >= 128)) {
+		asm volatile ("rep movsb" : "+D"(dest), "+S"(src), "+c"(size) : : "memory");
+		return;
+	}
+	memcpy(dest, src, size);
+}
+
+void copyPage(void *dest, const void *src) {
+	if(globalCpuFeatures.haveErms) {
+		size_t size = kPageSize;
+		asm volatile ("rep movsb" : "+D"(dest), "+S"(src), "+c"(size) : : "memory");
+	}else{
+		size_t count = kPageSize / sizeof(uint64_t);
+		asm volatile ("rep movsq" : "+D"(dest), "+S"(src), "+c"(count) : : "memory");
+	}
+}
+
 } // namespace thor
 
 // --------------------------------------------------------
@@ -74,13 +107,64 @@ enum {
 	kPagePcd = 0x10,
 	kPageDirty = 0x40,
 	kPagePat = 0x80,
+	kPageHuge = 0x80, // Only in PDEs and PDPTEs.
 	kPageGlobal = 0x100,
+	kPageShared = 0x200, // Software-defined; only in PDEs (see SharedPageTable).
+	kPageHugePat = 0x1000, // Moved from bit 7 in PDEs and PDPTEs.
 	kPageXd = 0x8000000000000000,
-	kPageAddress = 0x000FFFFFFFFFF000
+	kPageAddress = 0x000FFFFFFFFFF000,
+	kPageHugeAddress = 0x000FFFFFFFE00000
 };
 
 namespace thor {
 
+namespace {
+	// If more pages than this need to be invalidated, we flush the entire PCID instead.
+	constexpr size_t fullFlushThreshold = 32;
+
+	std::atomic<uint64_t> globalNumShootdownIpis;
+	std::atomic<uint64_t> globalNumPagesFlushed;
+	std::atomic<uint64_t> globalNumFullFlushes;
+
+	// Sends a shootdown IPI to the given CPU unless one is already pending.
+	void requestShootdownIpi(int cpu) {
+		auto context = &getCpuData(cpu)->pageContext;
+		if(context->shootdownPending.exchange(true, std::memory_order_acq_rel))
+			return;
+		globalNumShootdownIpis.fetch_add(1, std::memory_order_relaxed);
+		sendShootdownIpi(cpu);
+	}
+
+	// Sends a shootdown IPI to all other CPUs unless they already have one pending.
+	// The broadcast excludes the sending CPU, so its flag must not be set here;
+	// callers flush the local TLB synchronously.
+	void requestGlobalShootdownIpi() {
+		// Stay on the CPU that sends the IPI.
+		auto irqLock = frg::guard(&irqMutex());
+
+		bool anyRequired = false;
+		for(int i = 0; i < getCpuCount(); i++) {
+			if(i == getCpuData()->cpuIndex)
+				continue;
+			auto context = &getCpuData(i)->pageContext;
+			if(!context->shootdownPending.exchange(true, std::memory_order_acq_rel))
+				anyRequired = true;
+		}
+		if(!anyRequired)
+			return;
+		globalNumShootdownIpis.fetch_add(1, std::memory_order_relaxed);
+		sendShootdownIpi();
+	}
+}
+
+ShootdownStats getShootdownStats() {
+	return {
+		.numIpis = globalNumShootdownIpis.load(std::memory_order_relaxed),
+		.numPagesFlushed = globalNumPagesFlushed.load(std::memory_order_relaxed),
+		.numFullFlushes = globalNumFullFlushes.load(std::memory_order_relaxed)
+	};
+}
+
 // --------------------------------------------------------
 
 PageContext::PageContext()
@@ -90,6 +174,52 @@ PageBinding::PageBinding()
 : _pcid{0}, _boundSpace{nullptr},
 		_primaryStamp{0}, _alreadyShotSequence{0} { }
 
+void PageBinding::invalidateAll() {
+	assert(!intsAreEnabled());
+
+	if(!getCpuData()->havePcids) {
+		assert(!_pcid);
+		invalidateFullTlb();
+	}else if(getCpuData()->haveInvpcid) {
+		invalidatePcid(_pcid);
+	}else if(isPrimary()) {
+		// Reload CR3 without setting bit 63; this flushes the current PCID.
+		auto cr3 = _boundSpace->rootTable() | _pcid;
+		asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+	}else{
+		// Without INVPCID, we cannot flush other PCIDs. Defer the flush to rebind().
+		_needsFlush = true;
+	}
+	globalNumFullFlushes.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PageBinding::invalidateRange(VirtualAddr address, size_t size) {
+	assert(!intsAreEnabled());
+
+	if(size > fullFlushThreshold * kPageSize) {
+		invalidateAll();
+		return;
+	}
+
+	if(!getCpuData()->havePcids) {
+		assert(!_pcid);
+		for(size_t pg = 0; pg < size; pg += kPageSize)
+			invalidatePage(reinterpret_cast<void *>(address + pg));
+	}else if(getCpuData()->haveInvpcid) {
+		for(size_t pg = 0; pg < size; pg += kPageSize)
+			invalidatePage(_pcid, reinterpret_cast<void *>(address + pg));
+	}else if(isPrimary()) {
+		// INVLPG only affects the current PCID (and global pages).
+		for(size_t pg = 0; pg < size; pg += kPageSize)
+			invalidatePage(reinterpret_cast<void *>(address + pg));
+	}else{
+		_needsFlush = true;
+		globalNumFullFlushes.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	globalNumPagesFlushed.fetch_add(size / kPageSize, std::memory_order_relaxed);
+}
+
 bool PageBinding::isPrimary() {
 	assert(!intsAreEnabled());
 	assert(getCpuData()->havePcids || !_pcid);
@@ -105,9 +235,10 @@ void PageBinding::rebind() {
 	auto context = &getCpuData()->pageContext;
 
 	auto cr3 = _boundSpace->rootTable() | _pcid;
-	if(getCpuData()->havePcids)
+	if(getCpuData()->havePcids && !_needsFlush)
 		cr3 |= PhysicalAddr(1) << 63; // Do not invalidate the PCID.
 	asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+	_needsFlush = false;
 
 	_primaryStamp = context->_nextStamp++;
 	context->_primaryBinding = this;
@@ -129,6 +260,7 @@ void PageBinding::rebind(smarter::shared_ptr<PageSpace> space) {
 
 		target_seq = space->_shootSequence;
 		space->_numBindings++;
+		space->_addBindingCpu(getCpuData()->cpuIndex);
 	}
 
 	_boundSpace = space;
@@ -137,6 +269,7 @@ void PageBinding::rebind(smarter::shared_ptr<PageSpace> space) {
 	// Switch CR3 and invalidate the PCID.
 	auto cr3 = space->rootTable() | _pcid;
 	asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+	_needsFlush = false;
 
 	_primaryStamp = context->_nextStamp++;
 	context->_primaryBinding = this;
@@ -175,6 +308,7 @@ void PageBinding::rebind(smarter::shared_ptr<PageSpace> space) {
 		}
 
 		unbound_space->_numBindings--;
+		unbound_space->_removeBindingCpu(getCpuData()->cpuIndex);
 		if(!unbound_space->_numBindings && unbound_space->_retireNode) {
 			unbound_space->_retireNode->complete();
 			unbound_space->_retireNode = nullptr;
@@ -201,7 +335,7 @@ void PageBinding::unbind() {
 	}else{
 		// If there was only a single binding, it would have been primary.
 		assert(getCpuData()->havePcids);
-		invalidatePcid(_pcid);
+		invalidateAll();
 	}
 
 	frg::intrusive_list<
@@ -238,6 +372,7 @@ void PageBinding::unbind() {
 		}
 
 		_boundSpace->_numBindings--;
+		_boundSpace->_removeBindingCpu(getCpuData()->cpuIndex);
 		if(!_boundSpace->_numBindings && _boundSpace->_retireNode) {
 			_boundSpace->_retireNode->complete();
 			_boundSpace->_retireNode = nullptr;
@@ -278,6 +413,24 @@ void PageBinding::shootdown() {
 	{
 		auto lock = frg::guard(&_boundSpace->_mutex);
 
+		// Coalesce all pending requests: if they cover too many pages in total,
+		// we flush the PCID once instead of invalidating each page individually.
+		size_t numPendingPages = 0;
+		if(!_boundSpace->_shootQueue.empty()) {
+			auto current = _boundSpace->_shootQueue.back();
+			while(current->_sequence > _alreadyShotSequence) {
+				if(current->_initiatorCpu != getCpuData())
+					numPendingPages += current->size / kPageSize;
+				current = current->_queueNode.previous;
+				if(!current)
+					break;
+			}
+		}
+
+		bool fullFlush = numPendingPages > fullFlushThreshold;
+		if(fullFlush)
+			invalidateAll();
+
 		if(!_boundSpace->_shootQueue.empty()) {
 			auto current = _boundSpace->_shootQueue.back();
 			while(current->_sequence > _alreadyShotSequence) {
@@ -285,14 +438,8 @@ void PageBinding::shootdown() {
 
 				if(current->_initiatorCpu != getCpuData()) {
 					// Perform the actual shootdown.
-					if(!getCpuData()->havePcids) {
-						assert(!_pcid);
-						for(size_t pg = 0; pg < current->size; pg += kPageSize)
-							invalidatePage(reinterpret_cast<void *>(current->address + pg));
-					}else{
-						for(size_t pg = 0; pg < current->size; pg += kPageSize)
-							invalidatePage(_pcid, reinterpret_cast<void *>(current->address + pg));
-					}
+					if(!fullFlush)
+						invalidateRange(current->address, current->size);
 
 					// Signal completion of the shootdown.
 					if(current->_bindingsToShoot.fetch_sub(1, std::memory_order_acq_rel) == 1) {
@@ -364,8 +511,12 @@ void GlobalPageBinding::shootdown() {
 
 				if(current->_initiatorCpu != getCpuData()) {
 					// Perform the actual shootdown.
+					// Note that we cannot use full flushes here since they
+					// would not affect global pages.
 					for(size_t pg = 0; pg < current->size; pg += kPageSize)
 						invalidatePage(reinterpret_cast<void *>(current->address + pg));
+					globalNumPagesFlushed.fetch_add(current->size / kPageSize,
+							std::memory_order_relaxed);
 
 					// Signal completion of the shootdown.
 					if(current->_bindingsToShoot.fetch_sub(1, std::memory_order_acq_rel) == 1) {
@@ -438,13 +589,16 @@ void PageSpace::retire(RetireNode *node) {
 		if(any_bindings) {
 			_retireNode = node;
 			_wantToRetire.store(true, std::memory_order_release);
+			_requestShootdownIpis();
+
+			// The current CPU also needs to drop its binding.
+			if(_bindingCpuMask & (uint64_t(1) << getCpuData()->cpuIndex))
+				requestShootdownIpi(getCpuData()->cpuIndex);
 		}
 	}
 
 	if(!any_bindings)
 		node->complete();
-
-	sendShootdownIpi();
 }
 
 bool PageSpace::submitShootdown(ShootNode *node) {
@@ -463,8 +617,7 @@ bool PageSpace::submitShootdown(ShootNode *node) {
 			if(bindings[0].boundSpace().get() == this) {
 				assert(unshot_bindings);
 
-				for(size_t pg = 0; pg < node->size; pg += kPageSize)
-					invalidatePage(reinterpret_cast<void *>(node->address + pg));
+				bindings[0].invalidateRange(node->address, node->size);
 				unshot_bindings--;
 			}
 		}else{
@@ -473,9 +626,7 @@ bool PageSpace::submitShootdown(ShootNode *node) {
 					continue;
 				assert(unshot_bindings);
 
-				for(size_t pg = 0; pg < node->size; pg += kPageSize)
-					invalidatePage(bindings[i].getPcid(),
-							reinterpret_cast<void *>(node->address + pg));
+				bindings[i].invalidateRange(node->address, node->size);
 				unshot_bindings--;
 			}
 		}
@@ -487,12 +638,46 @@ bool PageSpace::submitShootdown(ShootNode *node) {
 		node->_sequence = ++_shootSequence;
 		node->_bindingsToShoot = unshot_bindings;
 		_shootQueue.push_back(node);
+
+		_requestShootdownIpis();
 	}
 
-	sendShootdownIpi();
 	return false;
 }
 
+void PageSpace::_addBindingCpu(int cpu) {
+	if(cpu < 64) {
+		assert(!(_bindingCpuMask & (uint64_t(1) << cpu)));
+		_bindingCpuMask |= uint64_t(1) << cpu;
+	}else{
+		_numUntrackedBindings++;
+	}
+}
+
+void PageSpace::_removeBindingCpu(int cpu) {
+	if(cpu < 64) {
+		assert(_bindingCpuMask & (uint64_t(1) << cpu));
+		_bindingCpuMask &= ~(uint64_t(1) << cpu);
+	}else{
+		assert(_numUntrackedBindings);
+		_numUntrackedBindings--;
+	}
+}
+
+void PageSpace::_requestShootdownIpis() {
+	if(_numUntrackedBindings) {
+		requestGlobalShootdownIpi();
+		return;
+	}
+
+	auto mask = _bindingCpuMask & ~(uint64_t(1) << getCpuData()->cpuIndex);
+	while(mask) {
+		auto cpu = __builtin_ctzll(mask);
+		mask &= mask - 1;
+		requestShootdownIpi(cpu);
+	}
+}
+
 // --------------------------------------------------------
 // Kernel paging management.
 // --------------------------------------------------------
@@ -527,6 +712,7 @@ bool KernelPageSpace::submitShootdown(ShootNode *node) {
 		assert(unshotBindings);
 		for(size_t pg = 0; pg < node->size; pg += kPageSize)
 			invalidatePage(reinterpret_cast<void *>(node->address + pg));
+		globalNumPagesFlushed.fetch_add(node->size / kPageSize, std::memory_order_relaxed);
 		unshotBindings--;
 
 		if(!unshotBindings)
@@ -538,7 +724,7 @@ bool KernelPageSpace::submitShootdown(ShootNode *node) {
 		_shootQueue.push_back(node);
 	}
 
-	sendShootdownIpi();
+	requestGlobalShootdownIpi();
 	return false;
 }
 
@@ -701,7 +887,8 @@ ClientPageSpace::~ClientPageSpace() {
 		PageAccessor accessor{ps};
 		auto tbl = reinterpret_cast<uint64_t *>(accessor.get());
 		for(int i = 0; i < 512; i++) {
-			if(tbl[i] & kPagePresent)
+			// 2 MiB pages do not own a PT, shared PTs are owned by their SharedPageTable.
+			if((tbl[i] & kPagePresent) && !(tbl[i] & (kPageHuge | kPageShared)))
 				physicalAllocator->free(tbl[i] & kPageAddress, kPageSize);
 		}
 	};
@@ -730,7 +917,7 @@ ClientPageSpace::~ClientPageSpace() {
 	physicalAllocator->free(rootTable(), kPageSize);
 }
 
-void ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical,
+bool ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical,
 		bool user_page, uint32_t flags, CachingMode caching_mode) {
 	assert((pointer % 0x1000) == 0);
 	assert((physical % 0x1000) == 0);
@@ -794,6 +981,8 @@ void ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical,
 
 	// Make sure there is a PT.
 	tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+	if(tbl2[index2].load() & kPageHuge)
+		_splitHugePage(tbl2, index2);
 	if(tbl2[index2].load() & kPagePresent) {
 		accessor1 = PageAccessor{tbl2[index2].load() & 0x000FFFFFFFFFF000};
 	}else{
@@ -810,9 +999,13 @@ void ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical,
 	assert(user_page ? ((tbl2[index2].load() & kPageUser) != 0)
 			: ((tbl2[index2].load() & kPageUser) == 0));
 
+	// Other spaces that share the PT map the same pages, hence the PTE might
+	// already be present. In this case, we overwrite it with an equivalent PTE.
+	bool shared = tbl2[index2].load() & kPageShared;
+
 	// Setup the new PTE.
 	tbl1 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor1.get());
-	assert(!(tbl1[index1].load() & kPagePresent));
+	assert(shared || !(tbl1[index1].load() & kPagePresent));
 	uint64_t new_entry = physical | kPagePresent;
 	if(user_page)
 		new_entry |= kPageUser;
@@ -830,6 +1023,7 @@ void ClientPageSpace::mapSingle4k(VirtualAddr pointer, PhysicalAddr physical,
 		assert(caching_mode == CachingMode::null || caching_mode == CachingMode::writeBack);
 	}
 	tbl1[index1].store(new_entry);
+	return !shared;
 }
 
 PageStatus ClientPageSpace::unmapSingle4k(VirtualAddr pointer) {
@@ -870,6 +1064,8 @@ PageStatus ClientPageSpace::unmapSingle4k(VirtualAddr pointer) {
 	if(!(tbl2[index2].load() & kPagePresent))
 		return 0;
 	assert(tbl2[index2].load() & kPagePresent);
+	if(tbl2[index2].load() & kPageHuge)
+		_splitHugePage(tbl2, index2);
 	accessor1 = PageAccessor{tbl2[index2].load() & 0x000FFFFFFFFFF000};
 	auto tbl1 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor1.get());
 
@@ -881,6 +1077,10 @@ PageStatus ClientPageSpace::unmapSingle4k(VirtualAddr pointer) {
 	PageStatus status = page_status::present;
 	if(bits & kPageDirty)
 		status |= page_status::dirty;
+	if(tbl2[index2].load() & kPageShared)
+		status |= page_status::shared;
+	if((bits & kPageAddress) == getZeroPage())
+		status |= page_status::zero;
 	return status;
 }
 
@@ -922,6 +1122,8 @@ PageStatus ClientPageSpace::cleanSingle4k(VirtualAddr pointer) {
 	if(!(tbl2[index2].load() & kPagePresent))
 		return 0;
 	assert(tbl2[index2].load() & kPagePresent);
+	if(tbl2[index2].load() & kPageHuge)
+		_splitHugePage(tbl2, index2);
 	accessor1 = PageAccessor{tbl2[index2].load() & 0x000FFFFFFFFFF000};
 	auto tbl1 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor1.get());
 
@@ -976,12 +1178,330 @@ bool ClientPageSpace::isMapped(VirtualAddr pointer) {
 	// Find the PT.
 	if(!(tbl2[index2].load() & kPagePresent))
 		return false;
+	if(tbl2[index2].load() & kPageHuge)
+		return true;
 	accessor1 = PageAccessor{tbl2[index2].load() & 0x000FFFFFFFFFF000};
 	tbl1 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor1.get());
 
 	return tbl1[index1].load() & kPagePresent;
 }
 
+bool ClientPageSpace::mapSingle2m(VirtualAddr pointer, PhysicalAddr physical,
+		bool user_page, uint32_t flags, CachingMode caching_mode) {
+	assert(!(pointer & (kHugePageSize - 1)));
+	assert(!(physical & (kHugePageSize - 1)));
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	PageAccessor accessor4;
+	PageAccessor accessor3;
+	PageAccessor accessor2;
+
+	auto index4 = (int)((pointer >> 39) & 0x1FF);
+	auto index3 = (int)((pointer >> 30) & 0x1FF);
+	auto index2 = (int)((pointer >> 21) & 0x1FF);
+
+	// The PML4 does always exist.
+	accessor4 = PageAccessor{rootTable()};
+
+	// Make sure there is a PDPT.
+	auto tbl4 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor4.get());
+	if(tbl4[index4].load() & kPagePresent) {
+		accessor3 = PageAccessor{tbl4[index4].load() & 0x000FFFFFFFFFF000};
+	}else{
+		auto tbl_address = physicalAllocator->allocate(kPageSize);
+		assert(tbl_address != PhysicalAddr(-1) && "OOM");
+		accessor3 = PageAccessor{tbl_address};
+		memset(accessor3.get(), 0, kPageSize);
+
+		uint64_t new_entry = tbl_address | kPagePresent | kPageWrite;
+		if(user_page)
+			new_entry |= kPageUser;
+		tbl4[index4].store(new_entry);
+	}
+	assert(user_page ? ((tbl4[index4].load() & kPageUser) != 0)
+			: ((tbl4[index4].load() & kPageUser) == 0));
+
+	// Make sure there is a PD.
+	auto tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
+	if(tbl3[index3].load() & kPagePresent) {
+		accessor2 = PageAccessor{tbl3[index3].load() & 0x000FFFFFFFFFF000};
+	}else{
+		auto tbl_address = physicalAllocator->allocate(kPageSize);
+		assert(tbl_address != PhysicalAddr(-1) && "OOM");
+		accessor2 = PageAccessor{tbl_address};
+		memset(accessor2.get(), 0, kPageSize);
+
+		uint64_t new_entry = tbl_address | kPagePresent | kPageWrite;
+		if(user_page)
+			new_entry |= kPageUser;
+		tbl3[index3].store(new_entry);
+	}
+	assert(user_page ? ((tbl3[index3].load() & kPageUser) != 0)
+			: ((tbl3[index3].load() & kPageUser) == 0));
+
+	// We do not free existing PTs here: other CPUs might still cache them
+	// in their paging-structure caches until the next shootdown.
+	auto tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+	if(tbl2[index2].load() & kPagePresent)
+		return false;
+
+	uint64_t new_entry = physical | kPagePresent | kPageHuge;
+	if(user_page)
+		new_entry |= kPageUser;
+	if(flags & page_access::write)
+		new_entry |= kPageWrite;
+	if(!(flags & page_access::execute))
+		new_entry |= kPageXd;
+	if(caching_mode == CachingMode::writeThrough) {
+		new_entry |= kPagePwt;
+	}else if(caching_mode == CachingMode::writeCombine) {
+		new_entry |= kPageHugePat | kPagePwt;
+	}else if(caching_mode == CachingMode::uncached) {
+		new_entry |= kPagePwt | kPagePcd | kPageHugePat;
+	}else{
+		assert(caching_mode == CachingMode::null || caching_mode == CachingMode::writeBack);
+	}
+	tbl2[index2].store(new_entry);
+	return true;
+}
+
+PageStatus ClientPageSpace::unmapSingle2m(VirtualAddr pointer) {
+	assert(!(pointer & (kHugePageSize - 1)));
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	PageAccessor accessor4;
+	PageAccessor accessor3;
+	PageAccessor accessor2;
+
+	auto index4 = (int)((pointer >> 39) & 0x1FF);
+	auto index3 = (int)((pointer >> 30) & 0x1FF);
+	auto index2 = (int)((pointer >> 21) & 0x1FF);
+
+	// The PML4 is always present.
+	accessor4 = PageAccessor{rootTable()};
+	auto tbl4 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor4.get());
+
+	// Find the PDPT.
+	if(!(tbl4[index4].load() & kPagePresent))
+		return 0;
+	accessor3 = PageAccessor{tbl4[index4].load() & 0x000FFFFFFFFFF000};
+	auto tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
+
+	// Find the PD.
+	if(!(tbl3[index3].load() & kPagePresent))
+		return 0;
+	accessor2 = PageAccessor{tbl3[index3].load() & 0x000FFFFFFFFFF000};
+	auto tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+
+	auto entry = tbl2[index2].load();
+	if(!(entry & kPagePresent) || !(entry & kPageHuge))
+		return 0;
+
+	auto bits = tbl2[index2].atomic_exchange(0);
+	PageStatus status = page_status::present;
+	if(bits & kPageDirty)
+		status |= page_status::dirty;
+	return status;
+}
+
+PageStatus ClientPageSpace::cleanSingle2m(VirtualAddr pointer) {
+	assert(!(pointer & (kHugePageSize - 1)));
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	PageAccessor accessor4;
+	PageAccessor accessor3;
+	PageAccessor accessor2;
+
+	auto index4 = (int)((pointer >> 39) & 0x1FF);
+	auto index3 = (int)((pointer >> 30) & 0x1FF);
+	auto index2 = (int)((pointer >> 21) & 0x1FF);
+
+	// The PML4 is always present.
+	accessor4 = PageAccessor{rootTable()};
+	auto tbl4 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor4.get());
+
+	// Find the PDPT.
+	if(!(tbl4[index4].load() & kPagePresent))
+		return 0;
+	accessor3 = PageAccessor{tbl4[index4].load() & 0x000FFFFFFFFFF000};
+	auto tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
+
+	// Find the PD.
+	if(!(tbl3[index3].load() & kPagePresent))
+		return 0;
+	accessor2 = PageAccessor{tbl3[index3].load() & 0x000FFFFFFFFFF000};
+	auto tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+
+	auto bits = tbl2[index2].load();
+	if(!(bits & kPagePresent) || !(bits & kPageHuge))
+		return 0;
+	PageStatus status = page_status::present;
+	if(bits & kPageDirty) {
+		status |= page_status::dirty;
+		tbl2[index2].atomic_exchange(bits & ~kPageDirty);
+	}
+	return status;
+}
+
+bool ClientPageSpace::attachSharedTable(VirtualAddr pointer, PhysicalAddr table,
+		bool user_page) {
+	assert(!(pointer & (kHugePageSize - 1)));
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	PageAccessor accessor4;
+	PageAccessor accessor3;
+	PageAccessor accessor2;
+
+	auto index4 = (int)((pointer >> 39) & 0x1FF);
+	auto index3 = (int)((pointer >> 30) & 0x1FF);
+	auto index2 = (int)((pointer >> 21) & 0x1FF);
+
+	// The PML4 does always exist.
+	accessor4 = PageAccessor{rootTable()};
+
+	// Make sure there is a PDPT.
+	auto tbl4 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor4.get());
+	if(tbl4[index4].load() & kPagePresent) {
+		accessor3 = PageAccessor{tbl4[index4].load() & 0x000FFFFFFFFFF000};
+	}else{
+		auto tbl_address = physicalAllocator->allocate(kPageSize);
+		assert(tbl_address != PhysicalAddr(-1) && "OOM");
+		accessor3 = PageAccessor{tbl_address};
+		memset(accessor3.get(), 0, kPageSize);
+
+		uint64_t new_entry = tbl_address | kPagePresent | kPageWrite;
+		if(user_page)
+			new_entry |= kPageUser;
+		tbl4[index4].store(new_entry);
+	}
+	assert(user_page ? ((tbl4[index4].load() & kPageUser) != 0)
+			: ((tbl4[index4].load() & kPageUser) == 0));
+
+	// Make sure there is a PD.
+	auto tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
+	if(tbl3[index3].load() & kPagePresent) {
+		accessor2 = PageAccessor{tbl3[index3].load() & 0x000FFFFFFFFFF000};
+	}else{
+		auto tbl_address = physicalAllocator->allocate(kPageSize);
+		assert(tbl_address != PhysicalAddr(-1) && "OOM");
+		accessor2 = PageAccessor{tbl_address};
+		memset(accessor2.get(), 0, kPageSize);
+
+		uint64_t new_entry = tbl_address | kPagePresent | kPageWrite;
+		if(user_page)
+			new_entry |= kPageUser;
+		tbl3[index3].store(new_entry);
+	}
+	assert(user_page ? ((tbl3[index3].load() & kPageUser) != 0)
+			: ((tbl3[index3].load() & kPageUser) == 0));
+
+	// As in mapSingle2m(), we cannot free existing PTs here.
+	auto tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+	if(tbl2[index2].load() & kPagePresent)
+		return false;
+
+	// The PTEs determine the access permissions.
+	uint64_t new_entry = table | kPagePresent | kPageWrite | kPageShared;
+	if(user_page)
+		new_entry |= kPageUser;
+	tbl2[index2].store(new_entry);
+	return true;
+}
+
+size_t ClientPageSpace::detachSharedTable(VirtualAddr pointer, bool copy) {
+	assert(!(pointer & (kHugePageSize - 1)));
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	PageAccessor accessor4;
+	PageAccessor accessor3;
+	PageAccessor accessor2;
+
+	auto index4 = (int)((pointer >> 39) & 0x1FF);
+	auto index3 = (int)((pointer >> 30) & 0x1FF);
+	auto index2 = (int)((pointer >> 21) & 0x1FF);
+
+	// Shared PTs are only installed by attachSharedTable(), so all levels exist.
+	accessor4 = PageAccessor{rootTable()};
+	auto tbl4 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor4.get());
+	assert(tbl4[index4].load() & kPagePresent);
+	accessor3 = PageAccessor{tbl4[index4].load() & 0x000FFFFFFFFFF000};
+	auto tbl3 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor3.get());
+	assert(tbl3[index3].load() & kPagePresent);
+	accessor2 = PageAccessor{tbl3[index3].load() & 0x000FFFFFFFFFF000};
+	auto tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor2.get());
+
+	auto entry = tbl2[index2].load();
+	assert((entry & kPagePresent) && (entry & kPageShared));
+
+	if(!copy) {
+		tbl2[index2].atomic_exchange(0);
+		return 0;
+	}
+
+	auto tbl_address = physicalAllocator->allocate(kPageSize);
+	assert(tbl_address != PhysicalAddr(-1) && "OOM");
+	PageAccessor sharedAccessor{entry & kPageAddress};
+	PageAccessor privateAccessor{tbl_address};
+	auto sharedTbl = reinterpret_cast<arch::scalar_variable<uint64_t> *>(sharedAccessor.get());
+	auto privateTbl = reinterpret_cast<arch::scalar_variable<uint64_t> *>(privateAccessor.get());
+
+	// PTEs that other spaces add or remove concurrently may or may not be copied.
+	// This is fine: missing PTEs are faulted in again and evicted PTEs are also
+	// unmapped by our own eviction handler (since we observe the same view).
+	// Our own unmapSingle4k() calls are excluded by _mutex.
+	size_t numCopied = 0;
+	for(int i = 0; i < 512; i++) {
+		auto pte = sharedTbl[i].load();
+		if(!(pte & kPagePresent) || (pte & kPageAddress) == getZeroPage()) {
+			privateTbl[i].store(0);
+			continue;
+		}
+		privateTbl[i].store(pte);
+		numCopied++;
+	}
+
+	// Since the copy translates to the same physical pages (or to nothing), no shootdown
+	// is necessary for correctness (but the shared PT must survive until the next shootdown).
+	tbl2[index2].atomic_exchange((entry & ~(kPageAddress | kPageShared)) | tbl_address);
+	return numCopied;
+}
+
+void ClientPageSpace::_splitHugePage(arch::scalar_variable<uint64_t> *tbl2, int index2) {
+	auto entry = tbl2[index2].load();
+	assert((entry & kPagePresent) && (entry & kPageHuge));
+
+	auto tbl_address = physicalAllocator->allocate(kPageSize);
+	assert(tbl_address != PhysicalAddr(-1) && "OOM");
+	PageAccessor accessor{tbl_address};
+	auto tbl1 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(accessor.get());
+
+	// Keep all attribute bits (including accessed/dirty) but move the PAT bit.
+	uint64_t attributes = entry & ~(kPageHugeAddress | kPageHuge | kPageHugePat);
+	if(entry & kPageHugePat)
+		attributes |= kPagePat;
+	for(int i = 0; i < 512; i++)
+		tbl1[i].store((entry & kPageHugeAddress) + (uint64_t(i) << kPageShift) + attributes);
+
+	// The PT inherits the access permissions from the PTEs.
+	uint64_t new_entry = tbl_address | kPagePresent | kPageWrite;
+	if(entry & kPageUser)
+		new_entry |= kPageUser;
+
+	// Since the replacement translates to the same physical pages, no TLB shootdown
+	// is necessary at this point. Callers that change PTEs perform shootdown anyway.
+	tbl2[index2].atomic_exchange(new_entry);
+}
+
 bool ClientPageSpace::updatePageAccess(VirtualAddr) {
 	return false;
 }
@@ -1001,6 +1521,7 @@ void ClientPageSpace::Walk::walkTo(uintptr_t address) {
 	assert(!(_address & (kPageSize - 1)));
 
 	_address = address;
+	_huge = false;
 	_accessor4 = PageAccessor{};
 	_accessor3 = PageAccessor{};
 	_accessor2 = PageAccessor{};
@@ -1009,10 +1530,16 @@ void ClientPageSpace::Walk::walkTo(uintptr_t address) {
 
 PageFlags ClientPageSpace::Walk::peekFlags() {
 	_update();
-	assert(_accessor1);
 
-	auto tbl = reinterpret_cast<arch::scalar_variable<uint64_t> *>(_accessor1.get());
-	auto ent = tbl[(_address >> 12) & 0x1FF].load();
+	uint64_t ent;
+	if(_huge) {
+		auto tbl = reinterpret_cast<arch::scalar_variable<uint64_t> *>(_accessor2.get());
+		ent = tbl[(_address >> 21) & 0x1FF].load();
+	}else{
+		assert(_accessor1);
+		auto tbl = reinterpret_cast<arch::scalar_variable<uint64_t> *>(_accessor1.get());
+		ent = tbl[(_address >> 12) & 0x1FF].load();
+	}
 	assert(ent & kPagePresent);
 
 	PageFlags flags = 0;
@@ -1025,8 +1552,15 @@ PageFlags ClientPageSpace::Walk::peekFlags() {
 
 PhysicalAddr ClientPageSpace::Walk::peekPhysical() {
 	_update();
-	assert(_accessor1);
 
+	if(_huge) {
+		auto tbl = reinterpret_cast<arch::scalar_variable<uint64_t> *>(_accessor2.get());
+		auto ent = tbl[(_address >> 21) & 0x1FF].load();
+		assert(ent & kPagePresent);
+		return (ent & kPageHugeAddress) + (_address & (kHugePageSize - 1) & ~(kPageSize - 1));
+	}
+
+	assert(_accessor1);
 	auto tbl = reinterpret_cast<arch::scalar_variable<uint64_t> *>(_accessor1.get());
 	auto ent = tbl[(_address >> 12) & 0x1FF].load();
 	assert(ent & kPagePresent);
@@ -1057,6 +1591,10 @@ void ClientPageSpace::Walk::_update() {
 	auto tbl2 = reinterpret_cast<arch::scalar_variable<uint64_t> *>(_accessor2.get());
 	if(!(tbl2[index2].load() & kPagePresent))
 		return;
+	if(tbl2[index2].load() & kPageHuge) {
+		_huge = true;
+		return;
+	}
 	_accessor1 = PageAccessor{tbl2[index2].load() & 0x000FFFFFFFFFF000};
 }
 
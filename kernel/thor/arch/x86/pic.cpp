@@ -3,6 +3,7 @@
 #include <arch/mem_space.hpp>
 #include <arch/register.hpp>
 #include <thor-internal/arch/hpet.hpp>
+#include <thor-internal/clock-page.hpp>
 #include <thor-internal/debug.hpp>
 #include <thor-internal/fiber.hpp>
 #include <thor-internal/initgraph.hpp>
@@ -122,6 +123,7 @@ void GlobalApicContext::GlobalAlarmSlot::arm(uint64_t nanos) {
 		auto irq_lock = frg::guard(&irqMutex());
 		auto lock = frg::guard(&globalApicContext()->_mutex);
 		globalApicContext()->_globalDeadline = nanos;
+		globalApicContext()->_globalOwner = getCpuData();
 	}
 	LocalApicContext::_updateLocalTimer();
 }
@@ -156,17 +158,18 @@ void LocalApicContext::handleTimerIrq() {
 		self->_globalDeadline = 0;
 		globalApicContext()->_globalAlarmInstance.fireAlarm();
 
-		// Update the global deadline to avoid calling fireAlarm() on the next IRQ.
-		{
-			auto irq_lock = frg::guard(&irqMutex());
-			auto lock = frg::guard(&globalApicContext()->_mutex);
-			localApicContext()->_globalDeadline = globalApicContext()->_globalDeadline;
-		}
 	}
 
 	localApicContext()->_updateLocalTimer();
 }
 
+namespace {
+	// The TSC is converted to nanoseconds as (tsc * tscMult) >> tscShift.
+	// Userspace performs the same computation using the clock page.
+	constexpr uint32_t tscShift = 32;
+	uint64_t tscMult;
+}
+
 void LocalApicContext::_updateLocalTimer() {
 	uint64_t deadline = 0;
 	auto consider = [&] (uint64_t dc) {
@@ -177,10 +180,16 @@ void LocalApicContext::_updateLocalTimer() {
 	};
 
 	// Copy the global deadline so we can access it without locking.
+	// Only the CPU that armed the global alarm programs it into its local timer,
+	// such that other (potentially idle) CPUs are not woken up by it.
 	{
 		auto irq_lock = frg::guard(&irqMutex());
 		auto lock = frg::guard(&globalApicContext()->_mutex);
-		localApicContext()->_globalDeadline = globalApicContext()->_globalDeadline;
+		if(globalApicContext()->_globalOwner == getCpuData()) {
+			localApicContext()->_globalDeadline = globalApicContext()->_globalDeadline;
+		}else{
+			localApicContext()->_globalDeadline = 0;
+		}
 	}
 
 	consider(localApicContext()->_preemptionDeadline);
@@ -192,10 +201,11 @@ void LocalApicContext::_updateLocalTimer() {
 			return;
 		}
 
-		uint64_t ticks;
-		auto of = __builtin_mul_overflow(deadline, localApicContext()->tscTicksPerMilli, &ticks);
-		assert(!of);
-		ticks /= 1'000'000;
+		// Invert the conversion of TscClockSource (rounding up)
+		// such that the IRQ does not fire before the deadline.
+		assert(tscMult);
+		auto ticks = static_cast<uint64_t>(
+				((static_cast<unsigned __int128>(deadline) << tscShift) + tscMult - 1) / tscMult);
 		common::x86::wrmsr(0x6E0, ticks);
 		if(debugTimer)
 			infoLogger() << "thor [CPU " << getLocalApicId() << "]: Setting TSC deadline to "
@@ -340,7 +350,8 @@ uint64_t localTicks() {
 namespace {
 	struct TscClockSource final : ClockSource {
 		uint64_t currentNanos() override {
-			auto r = getRawTimestampCounter() * 1'000'000 / localApicContext()->tscTicksPerMilli;
+			auto r = (static_cast<unsigned __int128>(getRawTimestampCounter()) * tscMult)
+					>> tscShift;
 	//		infoLogger() << r << frg::endlog;
 			return r;
 		}
@@ -384,12 +395,18 @@ void calibrateApicTimer() {
 }
 
 static initgraph::Task assessTimersTask{&globalInitEngine, "x86.assess-timers",
-	initgraph::Requires{getHpetInitializedStage()},
+	// The boot CPU must have calibrated its TSC.
+	initgraph::Requires{getHpetInitializedStage(), getFibersAvailableStage()},
 	initgraph::Entails{getTaskingAvailableStage()},
 	[] {
 		if(getGlobalCpuFeatures()->haveInvariantTsc) {
+			// All CPUs use the calibration of the boot CPU, such that the clock
+			// is consistent across CPUs (and with userspace).
+			assert(localApicContext()->tscTicksPerMilli);
+			tscMult = (uint64_t{1'000'000} << tscShift) / localApicContext()->tscTicksPerMilli;
 			globalTscClockSource.initialize();
 			globalClockSource = globalTscClockSource.get();
+			publishClockPageCounter(tscMult, tscShift, 0, 0);
 		}else{
 			infoLogger() << "thor: No invariant TSC; using HPET as system clock source"
 					<< frg::endlog;
@@ -468,6 +485,21 @@ void sendShootdownIpi() {
 	}
 }
 
+void sendShootdownIpi(int id) {
+	auto apic = getCpuData(id)->localApicId;
+	if(picBase.isUsingX2apic()) {
+		picBase.store(lX2ApicIcr, x2apicIcrLowVector(0xF0) | x2apicIcrLowDelivMode(0)
+				| x2apicIcrLowLevel(true) | x2apicIcrLowShorthand(0) | x2apicIcrHighDestField(apic));
+	} else {
+		picBase.store(lApicIcrHigh, apicIcrHighDestField(apic));
+		picBase.store(lApicIcrLow, apicIcrLowVector(0xF0) | apicIcrLowDelivMode(0)
+				| apicIcrLowLevel(true) | apicIcrLowShorthand(0));
+		while(picBase.load(lApicIcrLow) & apicIcrLowDelivStatus) {
+			// Wait for IPI delivery.
+		}
+	}
+}
+
 void sendPingIpi(int id) {
 	auto apic = getCpuData(id)->localApicId;
 //	infoLogger() << "thor [CPU" << getLocalApicId() << "]: Sending ping" << frg::endlog;
@@ -517,23 +549,54 @@ extern frg::manual_box<IrqSlot> globalIrqSlots[64];
 extern IrqSpinlock globalIrqSlotsLock;
 
 namespace {
+	// Without interrupt remapping, MSIs can only target xAPIC IDs.
+	bool isMsiTarget(int cpu) {
+		return getCpuData(cpu)->localApicId < 256;
+	}
+
+	// Round-robin counter to spread MSIs over all CPUs.
+	std::atomic<unsigned int> nextMsiCpu{0};
+
 	struct ApicMsiPin final : MsiPin {
-		ApicMsiPin(frg::string<KernelAlloc> name, unsigned int vector)
-		: MsiPin{std::move(name)}, vector_{vector} { }
+		ApicMsiPin(frg::string<KernelAlloc> name, unsigned int vector, int cpu)
+		: MsiPin{std::move(name)}, vector_{vector}, cpu_{cpu} { }
+
+		int affinity() override {
+			return cpu_.load(std::memory_order_relaxed);
+		}
+
+		Error setAffinity(int cpu) override {
+			if(cpu < 0 || cpu >= getCpuCount() || !isMsiTarget(cpu))
+				return Error::illegalArgs;
+			cpu_.store(cpu, std::memory_order_relaxed);
+			reprogramOwner();
+			return Error::success;
+		}
 
 		IrqStrategy program(TriggerMode mode, Polarity) override {
 			assert(mode == TriggerMode::edge);
 			return IrqStrategy::justEoi;
 		}
 
+		// APIC-MSIs can only be masked at the device. If the device does not support
+		// masking, IrqPin::raise() has to deal with IRQs that are raised while masked.
+		// Since IrqPin calls unmask() after every IRQ, we only touch the device on changes.
 		void mask() override {
-			// TODO: Support this.
-			infoLogger() << "\e[31m" "thor: Masking of APIC-MSIs is not implemented" "\e[39m"
-					<< frg::endlog;
+			if(masked_)
+				return;
+			masked_ = maskAtOwner(true);
+			if(!masked_ && !warnedMask_) {
+				infoLogger() << "\e[31m" "thor: MSI " << name()
+						<< " cannot be masked" "\e[39m" << frg::endlog;
+				warnedMask_ = true;
+			}
 		}
 
 		void unmask() override {
-			// TODO: Implement this when mask() is implemented.
+			if(!masked_)
+				return;
+			maskAtOwner(false);
+			masked_ = false;
 		}
 
 		void sendEoi() override {
@@ -541,7 +604,9 @@ namespace {
 		}
 
 		uint64_t getMessageAddress() override {
-			return 0xFEE00000;
+			// Physical destination mode; bits 12 to 19 contain the destination APIC ID.
+			auto apicId = getCpuData(cpu_.load(std::memory_order_relaxed))->localApicId;
+			return 0xFEE00000 | (static_cast<uint64_t>(apicId) << 12);
 		}
 
 		uint32_t getMessageData() override {
@@ -550,10 +615,13 @@ namespace {
 
 	private:
 		unsigned int vector_;
+		std::atomic<int> cpu_;
+		bool masked_ = false;
+		bool warnedMask_ = false;
 	};
 }
 
-MsiPin *allocateApicMsi(frg::string<KernelAlloc> name) {
+MsiPin *allocateApicMsi(frg::string<KernelAlloc> name, int cpu) {
 	auto guard = frg::guard(&globalIrqSlotsLock);
 
 	int slotIndex = -1;
@@ -566,16 +634,28 @@ MsiPin *allocateApicMsi(frg::string<KernelAlloc> name) {
 	if(slotIndex == -1)
 		return nullptr;
 
+	// Spread the MSIs over all CPUs (instead of delivering all of them to the BSP).
+	if(cpu < 0 || cpu >= getCpuCount() || !isMsiTarget(cpu)) {
+		cpu = 0;
+		for(int i = 0; i < getCpuCount(); i++) {
+			int candidate = nextMsiCpu.fetch_add(1, std::memory_order_relaxed) % getCpuCount();
+			if(isMsiTarget(candidate)) {
+				cpu = candidate;
+				break;
+			}
+		}
+	}
+
 	// Create an IRQ pin for the MSI.
 	auto pin = frg::construct<ApicMsiPin>(*kernelAlloc,
-			std::move(name), 64 + slotIndex);
+			std::move(name), 64 + slotIndex, cpu);
 	pin->configure(IrqConfiguration{
 		.trigger = TriggerMode::edge,
 		.polarity = Polarity::high
 	});
 
 	infoLogger() << "thor: Allocating IRQ slot " << slotIndex
-			<< " to " << pin->name() << frg::endlog;
+			<< " to " << pin->name() << " on CPU " << cpu << frg::endlog;
 	globalIrqSlots[slotIndex]->link(pin);
 
 	return pin;
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <utility>
 
+#include <frg/span.hpp>
 #include <frg/tuple.hpp>
 #include <x86/gdt.hpp>
 #include <x86/idt.hpp>
@@ -283,6 +284,8 @@ struct NmiImageAccessor {
 	Word *ip() { return &_frame()->rip; }
 	Word *cs() { return &_frame()->cs; }
 	Word *rflags() { return &_frame()->rflags; }
+	Word *sp() { return &_frame()->rsp; }
+	Word *bp() { return &_frame()->rbp; }
 
 private:
 	// note: this struct is accessed from assembly.
@@ -373,6 +376,9 @@ struct Executor {
 	friend void saveExecutor(Executor *executor, SyscallImageAccessor accessor);
 	friend void workOnExecutor(Executor *executor);
 	friend void restoreExecutor(Executor *executor);
+	friend void restoreSimdRegisters(Executor *executor);
+	friend void saveSimdState(Executor *executor);
+	friend void loadSimdState(Executor *executor);
 
 	static size_t determineSize();
 	static size_t determineSimdSize();
@@ -406,6 +412,12 @@ struct Executor {
 	Word *result0() { return &general()->rdi; }
 	Word *result1() { return &general()->rsi; }
 
+	// Number of times that the extended (i.e., FPU and SIMD) state was saved,
+	// restored on resume and restored lazily on first use.
+	uint64_t numSimdSaves() { return _numSimdSaves; }
+	uint64_t numSimdRestores() { return _numSimdRestores; }
+	uint64_t numSimdTraps() { return _numSimdTraps; }
+
 private:
 	// note: this struct is accessed from assembly.
 	// do not change the field offsets!
@@ -497,8 +509,24 @@ private:
 	char *_pointer;
 	void *_syscallStack;
 	common::x86::Tss64 *_tss;
+
+	// Whether the extended state is loaded into the registers.
+	// Otherwise, the state in _fxState() is up-to-date and CR0.TS is set.
+	bool _simdLoaded = false;
+	// Number of resumes that still restore the extended state eagerly.
+	unsigned int _simdHotness = 0;
+
+	uint64_t _numSimdSaves = 0;
+	uint64_t _numSimdRestores = 0;
+	uint64_t _numSimdTraps = 0;
 };
 
+// Saves the extended state of the current executor if it is loaded.
+void saveSimdState(Executor *executor);
+// Loads the extended state of the current executor if it is not loaded yet.
+// Called on #NM and before the kernel itself switches the extended state.
+void loadSimdState(Executor *executor);
+
 void saveExecutor(Executor *executor, FaultImageAccessor accessor);
 void saveExecutor(Executor *executor, IrqImageAccessor accessor);
 void saveExecutor(Executor *executor, SyscallImageAccessor accessor);
@@ -518,11 +546,20 @@ struct CpuFeatures {
 	static constexpr uint32_t profileAmdSupported = 2;
 
 	bool haveXsave;
+	bool haveXsaveopt;
 	bool haveAvx;
 	bool haveZmm;
 	bool haveInvariantTsc;
 	bool haveTscDeadline;
 	bool haveVmx;
+	// Enhanced rep movsb/stosb and fast short rep movsb.
+	bool haveErms;
+	bool haveFsrm;
+	bool haveMwait;
+	// The local APIC timer keeps running in deep C-states.
+	bool haveArat;
+	// Number of MWAIT sub-states per C-state (CPUID leaf 5, EDX).
+	uint32_t mwaitSubstates;
 	uint32_t profileFlags;
 	size_t xsaveRegionSize;
 };
@@ -585,8 +622,11 @@ struct PlatformCpuData : public AssemblyCpuData {
 	GlobalPageBinding globalBinding;
 
 	bool havePcids = false;
+	bool haveInvpcid = false;
 	bool haveSmap = false;
 	bool haveVirtualization = false;
+	// Whether CR0.TS is set, i.e., whether the next use of the extended state traps.
+	bool simdTrapArmed = false;
 
 	LocalApicContext apicContext;
 
@@ -632,7 +672,8 @@ void doRunOnStack(void (*function) (void *, void *), void *sp, void *argument);
 void setupBootCpuContext();
 void initializeThisProcessor();
 
-void bootSecondary(unsigned int apic_id);
+// Boots the given APs in parallel and returns once all of them are initialized.
+void bootSecondaries(frg::span<const unsigned int> apicIds);
 
 template<typename F>
 void forkExecutor(F functor, Executor *executor) {
@@ -641,11 +682,7 @@ void forkExecutor(F functor, Executor *executor) {
 		(*fp)();
 	};
 
-	if(getGlobalCpuFeatures()->haveXsave) {
-		common::x86::xsave((uint8_t*)executor->_fxState(), ~0);
-	} else {
-		asm volatile ("fxsaveq %0" : : "m" (*executor->_fxState()));
-	}
+	saveSimdState(executor);
 
 	doForkExecutor(executor, delegate, &functor);
 }
@@ -44,8 +44,19 @@ struct EptSpace final : VirtualizedPageSpace {
 	PageStatus unmap(uint64_t guestAddress);
 	bool isMapped(VirtualAddr pointer);
 
+	Error fetchDirtyLog(uintptr_t guestAddress, size_t size, uint8_t *bitmap);
+
 private:
 	uintptr_t translate(uintptr_t guestAddress);
+
+	// Returns the page directory that covers guestAddress (or nullptr if there is none).
+	size_t *_walkToPd(uint64_t guestAddress);
+	// Replaces the page table at pde[pdeIdx] by a 2 MiB mapping if possible.
+	void _tryPromote(size_t *pde, int pdeIdx);
+	// Replaces the 2 MiB mapping at pde[pdeIdx] by an equivalent page table.
+	Error _split(size_t *pde, int pdeIdx);
+	void _invalidate();
+
 	PhysicalAddr spaceRoot;
 	frg::ticket_spinlock _mutex;
 };
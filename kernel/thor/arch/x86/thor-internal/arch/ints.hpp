@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <stdint.h>
 
 #include <frg/spinlock.hpp>
 
@@ -34,6 +35,14 @@ inline void halt() {
 
 void suspendSelf();
 
+// Whether monitoredIdle() can be used.
+bool haveMonitoredIdle();
+
+// Waits until *word no longer equals value or until an interrupt was handled.
+// Must be called with interrupts disabled; interrupts are disabled again on return.
+// predictedIdle (in ns) is used to select the C-state.
+void monitoredIdle(std::atomic<uint32_t> *word, uint32_t value, uint64_t predictedIdle);
+
 void sendPingIpi(int id);
 
 } // namespace thor
@@ -3,6 +3,7 @@
 #include <atomic>
 
 #include <frg/list.hpp>
+#include <arch/variable.hpp>
 #include <assert.h>
 #include <smarter.hpp>
 #include <thor-internal/mm-rc.hpp>
@@ -13,7 +14,9 @@ namespace thor {
 
 enum {
 	kPageSize = 0x1000,
-	kPageShift = 12
+	kPageShift = 12,
+	kHugePageSize = 0x200000,
+	kHugePageShift = 21
 };
 
 constexpr Word kPfAccess = 1;
@@ -106,6 +109,17 @@ void poisonPhysicalAccess(PhysicalAddr physical);
 // Deny write access to the physical mapping.
 void poisonPhysicalWriteAccess(PhysicalAddr physical);
 
+// Zeroes a page using non-temporal stores, i.e., without pulling it into the cache.
+// Used to zero pages ahead of time where the page is not accessed immediately afterwards.
+void zeroPageNonTemporal(void *page);
+
+// Copies memory between kernel buffers. Uses rep movsb on CPUs with fast string
+// operations (ERMS) and memcpy() otherwise.
+void copyMemory(void *dest, const void *src, size_t size);
+
+// Copies a full page (e.g., to break copy-on-write).
+void copyPage(void *dest, const void *src);
+
 struct PageSpace;
 struct PageBinding;
 
@@ -121,6 +135,11 @@ struct PageContext {
 
 	PageContext &operator= (const PageContext &) = delete;
 
+	// Set when a shootdown IPI was sent to this CPU but not processed yet.
+	// Further shootdown requests do not need to send another IPI in this case.
+	// Cleared by the IPI handler *before* it inspects the shootdown queues.
+	std::atomic<bool> shootdownPending{false};
+
 private:
 	// Timestamp for the LRU mechansim of PCIDs.
 	uint64_t _nextStamp;
@@ -163,9 +182,18 @@ struct PageBinding {
 
 	void shootdown();
 
+	// Invalidate TLB entries of this binding's PCID. Large ranges are flushed entirely.
+	// If the CPU does not support INVPCID and the binding is not primary,
+	// the flush is deferred until the binding becomes primary again.
+	void invalidateRange(VirtualAddr address, size_t size);
+	void invalidateAll();
+
 private:
 	int _pcid;
 
+	// Set if the PCID needs to be flushed on the next rebind().
+	bool _needsFlush = false;
+
 	// TODO: Once we can use libsmarter in the kernel, we should make this a shared_ptr
 	//       to the PageSpace that does *not* prevent the PageSpace from becoming
 	//       "activatable".
@@ -191,6 +219,14 @@ private:
 	uint64_t _alreadyShotSequence;
 };
 
+struct ShootdownStats {
+	uint64_t numIpis;
+	uint64_t numPagesFlushed;
+	uint64_t numFullFlushes;
+};
+
+ShootdownStats getShootdownStats();
+
 struct PageSpace {
 	static void activate(smarter::shared_ptr<PageSpace> space);
 
@@ -219,6 +255,11 @@ private:
 
 	unsigned int _numBindings;
 
+	// Bitmask of CPUs that have a binding to this space. Shootdown IPIs are only sent
+	// to these CPUs. CPUs with higher indices are tracked by _numUntrackedBindings.
+	uint64_t _bindingCpuMask = 0;
+	unsigned int _numUntrackedBindings = 0;
+
 	uint64_t _shootSequence;
 
 	frg::intrusive_list<
@@ -229,6 +270,12 @@ private:
 			&ShootNode::_queueNode
 		>
 	> _shootQueue;
+
+	void _addBindingCpu(int cpu);
+	void _removeBindingCpu(int cpu);
+	// Sends shootdown IPIs to all CPUs (other than the current one) that bind this space.
+	// Must be called with _mutex held.
+	void _requestShootdownIpis();
 };
 
 namespace page_mode {
@@ -254,6 +301,10 @@ using PageStatus = uint32_t;
 namespace page_status {
 	static constexpr PageStatus present = 1;
 	static constexpr PageStatus dirty = 2;
+	// The PTE belongs to a page table that is shared with other spaces (see SharedPageTable).
+	static constexpr PageStatus shared = 4;
+	// The PTE mapped the shared zero page (see getZeroPage()).
+	static constexpr PageStatus zero = 8;
 };
 
 enum class CachingMode {
@@ -334,6 +385,9 @@ public:
 
 		uintptr_t _address = 0;
 
+		// Set if the address is mapped by a 2 MiB page (instead of a PT).
+		bool _huge = false;
+
 		// Accessors for all levels of PTs.
 		PageAccessor _accessor4; // Coarsest level (PML4).
 		PageAccessor _accessor3;
@@ -349,14 +403,35 @@ public:
 
 	ClientPageSpace &operator= (const ClientPageSpace &) = delete;
 
-	void mapSingle4k(VirtualAddr pointer, PhysicalAddr physical, bool user_access,
+	// Returns false if the PTE belongs to a shared page table (see SharedPageTable).
+	bool mapSingle4k(VirtualAddr pointer, PhysicalAddr physical, bool user_access,
 			uint32_t flags, CachingMode caching_mode);
 	PageStatus unmapSingle4k(VirtualAddr pointer);
 	PageStatus cleanSingle4k(VirtualAddr pointer);
 	bool isMapped(VirtualAddr pointer);
 	bool updatePageAccess(VirtualAddr pointer);
 
+	// Maps a 2 MiB page. Returns false if the range is already covered by a page table
+	// (in this case, the caller should fall back to 4 KiB mappings).
+	bool mapSingle2m(VirtualAddr pointer, PhysicalAddr physical, bool user_access,
+			uint32_t flags, CachingMode caching_mode);
+	// Unmaps/cleans a 2 MiB page. Returns 0 if the range is not mapped by a 2 MiB page.
+	PageStatus unmapSingle2m(VirtualAddr pointer);
+	PageStatus cleanSingle2m(VirtualAddr pointer);
+
+	// Installs a page table that is shared with other spaces at a 2 MiB-aligned address.
+	// Returns false if the range is already covered by a PT or by a 2 MiB page.
+	bool attachSharedTable(VirtualAddr pointer, PhysicalAddr table, bool user_access);
+	// Removes a shared page table. If copy is true, it is replaced by a private PT with
+	// the same PTEs (except for PTEs of the shared zero page, which are faulted in again);
+	// otherwise, the range becomes unmapped. Returns the number of copied PTEs.
+	// The caller needs to perform shootdown before the shared PT can be freed.
+	size_t detachSharedTable(VirtualAddr pointer, bool copy);
+
 private:
+	// Replaces the 2 MiB page at the given PD entry by a page table with equivalent PTEs.
+	void _splitHugePage(arch::scalar_variable<uint64_t> *tbl2, int index2);
+
 	frg::ticket_spinlock _mutex;
 };
 
@@ -54,6 +54,8 @@ private:
 	static constexpr uint32_t x2apic_msr_base = 0x800;
 };
 
+struct CpuData;
+
 struct GlobalApicContext {
 	friend struct LocalApicContext;
 
@@ -74,6 +76,8 @@ private:
 	frg::ticket_spinlock _mutex;
 
 	uint64_t _globalDeadline;
+	// CPU whose local timer is used to deliver the global alarm.
+	CpuData *_globalOwner = nullptr;
 };
 
 struct LocalApicContext {
@@ -120,13 +124,15 @@ void raiseInitDeassertIpi(uint32_t dest_apic_id);
 void raiseStartupIpi(uint32_t dest_apic_id, uint32_t page);
 
 void sendShootdownIpi();
+void sendShootdownIpi(int id);
 void sendGlobalNmi();
 
 // --------------------------------------------------------
 // MSI management
 // --------------------------------------------------------
 
-MsiPin *allocateApicMsi(frg::string<KernelAlloc> name);
+// Delivers the MSI to the given CPU; spreads MSIs over all CPUs if cpu is negative.
+MsiPin *allocateApicMsi(frg::string<KernelAlloc> name, int cpu = -1);
 
 // --------------------------------------------------------
 // I/O APIC management
@@ -14,4 +14,20 @@ inline void walkThisStack(F functor) {
 	}
 }
 
+// Walks the frame pointer chain of interrupted code, starting at bp.
+// Only frames within [low, high) are followed, and each frame must be above
+// the previous one; this makes the walk safe even if bp does not point to a frame.
+// Stops once functor returns false.
+template <typename F>
+inline void walkStackFrom(uintptr_t bp, uintptr_t low, uintptr_t high, F functor) {
+	while (bp >= low && bp <= high - 2 * sizeof(uintptr_t) && !(bp & 7)) {
+		auto frame = reinterpret_cast<const uintptr_t *>(bp);
+		if (!functor(frame[1]))
+			break;
+		if (frame[0] <= bp)
+			break;
+		bp = frame[0];
+	}
+}
+
 } // namespace thor
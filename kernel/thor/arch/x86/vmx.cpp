@@ -163,7 +163,8 @@ namespace thor::vmx {
 
 		//Set up host state on vmexit.
 		uint32_t cr0Fixed = (uint32_t)common::x86::rdmsr(IA32_VMX_CR0_FIXED0_MSR);
-		vmwrite(HOST_CR0, cr0Fixed | cr0);
+		// Clear CR0.TS: vmexits happen while the thread's extended state is loaded.
+		vmwrite(HOST_CR0, (cr0Fixed | cr0) & ~uint64_t(8));
 		uint32_t cr4Fixed = (uint32_t)common::x86::rdmsr(IA32_VMX_CR4_FIXED0_MSR);
 		vmwrite(HOST_CR4, cr4Fixed | cr4);
 
@@ -308,6 +309,8 @@ namespace thor::vmx {
 			 * and set launched = false;
 			 */
 			asm volatile("cli");
+			// The host state below is the thread's own extended state; it must be loaded.
+			loadSimdState(&getCurrentThread()->_executor);
 			vmclear((PhysicalAddr)region);
 			vmptrld((PhysicalAddr)region);
 			if(getGlobalCpuFeatures()->haveXsave){
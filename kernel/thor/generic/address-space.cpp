@@ -4,7 +4,9 @@
 #include <thor-internal/coroutine.hpp>
 #include <thor-internal/physical.hpp>
 #include <thor-internal/fiber.hpp>
+#include <thor-internal/rcu.hpp>
 #include <frg/container_of.hpp>
+#include <frg/optional.hpp>
 #include <thor-internal/types.hpp>
 
 namespace thor {
@@ -33,6 +35,33 @@ namespace {
 				<< (physicalAllocator->numUsedPages() * 4) << " KiB, kernel usage: "
 				<< (kernelMemoryUsage / 1024) << " KiB" << frg::endlog;
 	}
+
+	// The shared zero page must never become writable.
+	PageFlags restrictPageFlags(PhysicalAddr physical, PageFlags flags) {
+		if(physical == getZeroPage())
+			return flags & ~page_access::write;
+		return flags;
+	}
+
+	// Returns the physical address of a 2 MiB page that backs the view at the given offset,
+	// or PhysicalAddr(-1) if the range is not physically contiguous (or not aligned).
+	frg::tuple<PhysicalAddr, CachingMode> peekHugeRange(MemoryView *view, uintptr_t offset) {
+		// Views that back memory by large chunks (e.g., AllocatedMemory) report the whole
+		// chunk at once; otherwise, this checks one page after another.
+		auto base = view->peekContiguousRange(offset);
+		if(base.get<0>() == PhysicalAddr(-1) || (base.get<0>() & (kHugePageSize - 1)))
+			return {PhysicalAddr(-1), CachingMode::null};
+
+		size_t progress = base.get<1>() & ~(kPageSize - 1);
+		while(progress < kHugePageSize) {
+			auto physicalRange = view->peekContiguousRange(offset + progress);
+			if(physicalRange.get<0>() != base.get<0>() + progress
+					|| physicalRange.get<2>() != base.get<2>())
+				return {PhysicalAddr(-1), CachingMode::null};
+			progress += frg::max(physicalRange.get<1>() & ~(kPageSize - 1), size_t{kPageSize});
+		}
+		return {base.get<0>(), base.get<2>()};
+	}
 }
 
 // --------------------------------------------------------
@@ -49,6 +78,17 @@ frg::expected<Error> VirtualOperations::mapPresentPages(VirtualAddr va, MemoryVi
 		return {};
 
 	for(size_t progress = 0; progress < size; progress += kPageSize) {
+		// Use 2 MiB pages if the backing memory is suitably aligned and contiguous.
+		if(!((va + progress) & (kHugePageSize - 1)) && size - progress >= kHugePageSize) {
+			auto hugeRange = peekHugeRange(view, offset + progress);
+			if(hugeRange.get<0>() != PhysicalAddr(-1)
+					&& mapSingle2m(va + progress, hugeRange.get<0>(),
+						flags, hugeRange.get<1>())) {
+				progress += kHugePageSize - kPageSize;
+				continue;
+			}
+		}
+
 		auto physicalRange = view->peekRange(offset + progress);
 
 		assert(!isMapped(va + progress));
@@ -57,7 +97,7 @@ frg::expected<Error> VirtualOperations::mapPresentPages(VirtualAddr va, MemoryVi
 		assert(!(physicalRange.get<0>() & (kPageSize - 1)));
 
 		mapSingle4k(va + progress, physicalRange.get<0>(),
-				flags, physicalRange.get<1>());
+				restrictPageFlags(physicalRange.get<0>(), flags), physicalRange.get<1>());
 	}
 	return {};
 }
@@ -78,7 +118,7 @@ frg::expected<Error> VirtualOperations::remapPresentPages(VirtualAddr va, Memory
 		if(physicalRange.get<0>() != PhysicalAddr(-1)) {
 			assert(!(physicalRange.get<0>() & (kPageSize - 1)));
 			mapSingle4k(va + progress, physicalRange.get<0>(),
-					flags, physicalRange.get<1>());
+					restrictPageFlags(physicalRange.get<0>(), flags), physicalRange.get<1>());
 		}
 
 		if(status & page_status::present) {
@@ -98,7 +138,8 @@ frg::expected<Error> VirtualOperations::faultPage(VirtualAddr va,
 	// TODO: detect spurious page faults.
 	PageStatus status = unmapSingle4k(va & ~(kPageSize - 1));
 	mapSingle4k(va & ~(kPageSize - 1), physicalRange.get<0>() & ~(kPageSize - 1),
-			flags, physicalRange.get<1>());
+			restrictPageFlags(physicalRange.get<0>() & ~(kPageSize - 1), flags),
+			physicalRange.get<1>());
 
 	if(status & page_status::present) {
 		if(status & page_status::dirty)
@@ -107,6 +148,51 @@ frg::expected<Error> VirtualOperations::faultPage(VirtualAddr va,
 	return {};
 }
 
+frg::expected<Error> VirtualOperations::mapMissingPages(VirtualAddr va, MemoryView *view,
+		uintptr_t offset, size_t size, PageFlags flags) {
+	assert(!(va & (kPageSize - 1)));
+	assert(!(offset & (kPageSize - 1)));
+	assert(!(size & (kPageSize - 1)));
+
+	if (!flags)
+		return {};
+
+	for(size_t progress = 0; progress < size; progress += kPageSize) {
+		// As in mapPresentPages(), try to use 2 MiB pages if nothing in the range is mapped yet.
+		if(!((va + progress) & (kHugePageSize - 1)) && size - progress >= kHugePageSize) {
+			bool anyMapped = false;
+			for(size_t p = 0; p < kHugePageSize; p += kPageSize) {
+				if(isMapped(va + progress + p)) {
+					anyMapped = true;
+					break;
+				}
+			}
+
+			if(!anyMapped) {
+				auto hugeRange = peekHugeRange(view, offset + progress);
+				if(hugeRange.get<0>() != PhysicalAddr(-1)
+						&& mapSingle2m(va + progress, hugeRange.get<0>(),
+							flags, hugeRange.get<1>())) {
+					progress += kHugePageSize - kPageSize;
+					continue;
+				}
+			}
+		}
+
+		if(isMapped(va + progress))
+			continue;
+
+		auto physicalRange = view->peekRange(offset + progress);
+		if(physicalRange.get<0>() == PhysicalAddr(-1))
+			continue;
+		assert(!(physicalRange.get<0>() & (kPageSize - 1)));
+
+		mapSingle4k(va + progress, physicalRange.get<0>(),
+				restrictPageFlags(physicalRange.get<0>(), flags), physicalRange.get<1>());
+	}
+	return {};
+}
+
 frg::expected<Error> VirtualOperations::cleanPages(VirtualAddr va, MemoryView *view,
 		uintptr_t offset, size_t size) {
 	assert(!(va & (kPageSize - 1)));
@@ -114,6 +200,16 @@ frg::expected<Error> VirtualOperations::cleanPages(VirtualAddr va, MemoryView *v
 	assert(!(size & (kPageSize - 1)));
 
 	for(size_t progress = 0; progress < size; progress += kPageSize) {
+		if(!((va + progress) & (kHugePageSize - 1)) && size - progress >= kHugePageSize) {
+			auto status = cleanSingle2m(va + progress);
+			if(status & page_status::present) {
+				if(status & page_status::dirty)
+					view->markDirty(offset + progress, kHugePageSize);
+				progress += kHugePageSize - kPageSize;
+				continue;
+			}
+		}
+
 		auto status = cleanSingle4k(va + progress);
 		if(!(status & page_status::present))
 			continue;
@@ -131,6 +227,16 @@ frg::expected<Error> VirtualOperations::unmapPages(VirtualAddr va,
 	assert(!(size & (kPageSize - 1)));
 
 	for(size_t progress = 0; progress < size; progress += kPageSize) {
+		if(!((va + progress) & (kHugePageSize - 1)) && size - progress >= kHugePageSize) {
+			auto status = unmapSingle2m(va + progress);
+			if(status & page_status::present) {
+				if(status & page_status::dirty)
+					view->markDirty(offset + progress, kHugePageSize);
+				progress += kHugePageSize - kPageSize;
+				continue;
+			}
+		}
+
 		auto status = unmapSingle4k(va + progress);
 		if(!(status & page_status::present))
 			continue;
@@ -141,6 +247,26 @@ frg::expected<Error> VirtualOperations::unmapPages(VirtualAddr va,
 	return {};
 }
 
+bool VirtualOperations::mapSingle2m(VirtualAddr, PhysicalAddr, uint32_t, CachingMode) {
+	return false;
+}
+
+PageStatus VirtualOperations::unmapSingle2m(VirtualAddr) {
+	return 0;
+}
+
+PageStatus VirtualOperations::cleanSingle2m(VirtualAddr) {
+	return 0;
+}
+
+bool VirtualOperations::attachSharedTable(VirtualAddr, PhysicalAddr) {
+	return false;
+}
+
+void VirtualOperations::detachSharedTable(VirtualAddr, bool) {
+	// attachSharedTable() never succeeds, so there is nothing to detach.
+}
+
 size_t VirtualOperations::getRss() {
 	// Derived classes should track RSS; the generic implementaton does not.
 	// TODO: As soon as all derived classes implement this, we should make it pure virtual.
@@ -329,18 +455,86 @@ CowChain::~CowChain() {
 		infoLogger() << "thor: Releasing CowChain" << frg::endlog;
 
 	for(auto it = _pages.begin(); it != _pages.end(); ++it) {
+		// Pages that were moved to another chain are replaced by PhysicalAddr(-1).
 		auto physical = it->load(std::memory_order_relaxed);
-		assert(physical != PhysicalAddr(-1));
+		if(physical == PhysicalAddr(-1))
+			continue;
 		physicalAllocator->free(physical, kPageSize);
 	}
 }
 
+// --------------------------------------------------------
+// VirtualRangeLock
+// --------------------------------------------------------
+
+bool VirtualRangeLock::_isBlocked(Node *node) {
+	for(auto holder : _holders) {
+		if(_conflicts(node, holder))
+			return true;
+	}
+	for(auto waiter : _waiters) {
+		if(waiter == node)
+			break;
+		if(_conflicts(node, waiter))
+			return true;
+	}
+	return false;
+}
+
+coroutine<void> VirtualRangeLock::lock(Node *node) {
+	bool granted = false;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		if(!_isBlocked(node)) {
+			_holders.push_back(node);
+			granted = true;
+		}else{
+			_waiters.push_back(node);
+		}
+	}
+
+	if(!granted)
+		co_await node->grantedEvent.wait();
+}
+
+void VirtualRangeLock::unlock(Node *node) {
+	Node *granted = nullptr;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		_holders.erase(_holders.iterator_to(node));
+
+		auto it = _waiters.begin();
+		while(it != _waiters.end()) {
+			auto waiter = *it;
+			++it;
+			if(_isBlocked(waiter))
+				continue;
+			_waiters.erase(_waiters.iterator_to(waiter));
+			_holders.push_back(waiter);
+			waiter->nextGranted = granted;
+			granted = waiter;
+		}
+	}
+
+	// Raise the events outside of the lock since they resume the waiters.
+	while(granted) {
+		auto next = granted->nextGranted;
+		granted->grantedEvent.raise();
+		granted = next;
+	}
+}
+
 // --------------------------------------------------------
 // VirtualSpace
 // --------------------------------------------------------
 
 VirtualSpace::VirtualSpace(VirtualOperations *ops)
-: _ops{ops} { }
+: _ops{ops}, _sharedTables{frg::hash<uint64_t>{}, *kernelAlloc},
+		_detachedTables{*kernelAlloc} { }
 
 void VirtualSpace::setupInitialHole(VirtualAddr address, size_t size) {
 	auto hole = frg::construct<Hole>(*kernelAlloc, address, size);
@@ -351,6 +545,10 @@ VirtualSpace::~VirtualSpace() {
 	if(logCleanup)
 		infoLogger() << "\e[31mthor: VirtualSpace is destructed\e[39m" << frg::endlog;
 
+	// retire() releases all shared PTs.
+	assert(_sharedTables.empty());
+	assert(_detachedTables.empty());
+
 	while(_holes.get_root()) {
 		auto hole = _holes.get_root();
 		_holes.remove(hole);
@@ -363,11 +561,16 @@ void VirtualSpace::retire() {
 		infoLogger() << "\e[31mthor: VirtualSpace is cleared\e[39m" << frg::endlog;
 
 	// TODO: Set some flag to make sure that no mappings are added/deleted.
+	// The change is never ended: speculative faults always fall back from now on.
+	_beginMappingChange(0, ~VirtualAddr(0));
+
 	auto mapping = _mappings.first();
 	while(mapping) {
 		assert(mapping->state == MappingState::active);
 		mapping->state = MappingState::zombie;
 
+		// Other spaces keep using the shared PTs, so we must not clear their PTEs.
+		_unshareTables(mapping->address, mapping->length);
 		auto unmapOutcome = _ops->unmapPages(mapping->address, mapping->view.get(),
 				mapping->viewOffset, mapping->length);
 		assert(unmapOutcome);
@@ -379,10 +582,16 @@ void VirtualSpace::retire() {
 	async::detach_with_allocator(*kernelAlloc, [] (smarter::shared_ptr<VirtualSpace> self)
 			-> coroutine<void> {
 		co_await self->_ops->retire();
+		self->_releaseDetachedTables();
 
 		while(self->_mappings.get_root()) {
 			auto mapping = self->_mappings.get_root();
-			self->_mappings.remove(mapping);
+			{
+				auto irqLock = frg::guard(&irqMutex());
+				auto spaceLock = frg::guard(&self->_snapshotMutex);
+
+				self->_mappings.remove(mapping);
+			}
 
 			assert(mapping->state == MappingState::zombie);
 			mapping->state = MappingState::retired;
@@ -392,6 +601,8 @@ void VirtualSpace::retire() {
 				co_await mapping->evictionDoneEvent.wait();
 			}
 			mapping->view->removeObserver(&mapping->observer);
+			// Speculative lookups might still access the mapping.
+			rcuSynchronize();
 			mapping->selfPtr.ctr()->decrement();
 		}
 	}(selfPtr.lock()));
@@ -410,6 +621,19 @@ VirtualSpace::map(smarter::borrowed_ptr<MemorySlice> slice,
 	frg::unique_lock consistencyLock{frg::adopt_lock, _consistencyMutex};
 	bool needsShootdown = false;
 
+	// Non-fixed mappings are allocated from holes, hence they do not need to lock
+	// any range: there cannot be faults in the new mapping before it is installed.
+	VirtualRangeLock::Node rangeNode{.exclusive = true};
+	frg::optional<VirtualRangeLock::Guard> rangeGuard;
+	if (flags & kMapFixed) {
+		auto [lockAddress, lockLength] = _extendToMappings(address, length);
+		rangeNode.address = lockAddress;
+		rangeNode.length = lockLength;
+		co_await _rangeLock.lock(&rangeNode);
+		rangeGuard.emplace(&_rangeLock, &rangeNode);
+	}
+	MappingChange change{this, rangeNode.address, rangeNode.length};
+
 	if (flags & kMapFixed) {
 		auto [start, end] = co_await _splitMappings(address, length);
 		assert(start || (!start && !end));
@@ -463,11 +687,19 @@ VirtualSpace::map(smarter::borrowed_ptr<MemorySlice> slice,
 
 		if(flags & kMapDontRequireBacking)
 			mappingFlags |= MappingFlags::dontRequireBacking;
+		if(flags & kMapForbidWrite) {
+			assert(!(mappingFlags & MappingFlags::protWrite));
+			mappingFlags |= MappingFlags::forbidWrite;
+		}
 
 		mapping = smarter::allocate_shared<Mapping>(Allocator{},
 				length, static_cast<MappingFlags>(mappingFlags),
 				slice.lock(), slice->offset() + offset);
 		mapping->selfPtr = mapping;
+		if(flags & kMapFaultAroundMask)
+			mapping->faultAroundOrder = frg::min(
+					((flags & kMapFaultAroundMask) >> kMapFaultAroundShift) - 1,
+					Mapping::maxFaultAroundOrder);
 
 		assert(!(flags & kMapPopulate));
 
@@ -490,13 +722,26 @@ VirtualSpace::map(smarter::borrowed_ptr<MemorySlice> slice,
 		if((mappingFlags & MappingFlags::permissionMask) & MappingFlags::protRead)
 			pageFlags |= page_access::read;
 
-		auto mapOutcome = _ops->mapPresentPages(mapping->address, mapping->view.get(),
-				mapping->viewOffset, mapping->length, pageFlags);
-		assert(mapOutcome);
+		// Windows that are shared with a neighboring mapping need private PTs now.
+		if(_unshareTables(actualAddress, length))
+			needsShootdown = true;
+
+		if(_shareTables(mapping.get(), pageFlags)) {
+			// Other spaces might have populated the shared PTs already.
+			auto mapOutcome = _ops->mapMissingPages(mapping->address, mapping->view.get(),
+					mapping->viewOffset, mapping->length, pageFlags);
+			assert(mapOutcome);
+		}else{
+			auto mapOutcome = _ops->mapPresentPages(mapping->address, mapping->view.get(),
+					mapping->viewOffset, mapping->length, pageFlags);
+			assert(mapOutcome);
+		}
 	}
 
-	if (needsShootdown)
+	if (needsShootdown) {
 		co_await _ops->shootdown(actualAddress, length);
+		_releaseDetachedTables();
+	}
 
 	// Only enable eviction after the peekRange() loop above.
 	// Since eviction is not yet enabled in that loop, we do not have
@@ -536,8 +781,21 @@ VirtualSpace::protect(VirtualAddr address, size_t length, uint32_t flags) {
 	co_await _consistencyMutex.async_lock();
 	frg::unique_lock consistencyLock{frg::adopt_lock, _consistencyMutex};
 
+	auto [lockAddress, lockLength] = _extendToMappings(address, length);
+	VirtualRangeLock::Node rangeNode{.address = lockAddress, .length = lockLength,
+			.exclusive = true};
+	co_await _rangeLock.lock(&rangeNode);
+	VirtualRangeLock::Guard rangeGuard{&_rangeLock, &rangeNode};
+	MappingChange change{this, lockAddress, lockLength};
+
 	auto [start, end] = co_await _splitMappings(address, length);
 	assert(start || (!start && !end));
+	if(mappingFlags & MappingFlags::protWrite) {
+		for(auto it = start; it != end; it = MappingTree::successor(it)) {
+			if(it->flags & MappingFlags::forbidWrite)
+				co_return Error::illegalArgs;
+		}
+	}
 	for (auto it = start; it != end;) {
 		auto mapping = it->selfPtr.lock();
 		it = MappingTree::successor(it);
@@ -558,6 +816,8 @@ VirtualSpace::protect(VirtualAddr address, size_t length, uint32_t flags) {
 			co_await mapping->evictionMutex.async_lock();
 			frg::unique_lock evictionLock{frg::adopt_lock, mapping->evictionMutex};
 
+			// The new flags must not affect other spaces.
+			_unshareTables(mapping->address, mapping->length);
 			auto remapOutcome = _ops->remapPresentPages(mapping->address, mapping->view.get(),
 					mapping->viewOffset, mapping->length, pageFlags);
 			assert(remapOutcome);
@@ -565,6 +825,7 @@ VirtualSpace::protect(VirtualAddr address, size_t length, uint32_t flags) {
 	}
 
 	co_await _ops->shootdown(address, length);
+	_releaseDetachedTables();
 	co_return {};
 }
 
@@ -572,25 +833,35 @@ coroutine<frg::expected<Error>> VirtualSpace::unmap(VirtualAddr address, size_t
 	co_await _consistencyMutex.async_lock();
 	frg::unique_lock consistencyLock{frg::adopt_lock, _consistencyMutex};
 
+	auto [lockAddress, lockLength] = _extendToMappings(address, length);
+	VirtualRangeLock::Node rangeNode{.address = lockAddress, .length = lockLength,
+			.exclusive = true};
+	co_await _rangeLock.lock(&rangeNode);
+	VirtualRangeLock::Guard rangeGuard{&_rangeLock, &rangeNode};
+	MappingChange change{this, lockAddress, lockLength};
+
 	auto [start, end] = co_await _splitMappings(address, length);
 	assert(start || (!start && !end));
 	auto needsShootdown = co_await _unmapMappings(address, length, start, end);
 
-	if (needsShootdown)
+	if (needsShootdown) {
 		co_await _ops->shootdown(address, length);
+		_releaseDetachedTables();
+	}
 
 	co_return {};
 }
 
 coroutine<frg::expected<Error>>
 VirtualSpace::synchronize(VirtualAddr address, size_t size) {
-	co_await _consistencyMutex.async_lock_shared();
-	frg::shared_lock consistencyLock{frg::adopt_lock, _consistencyMutex};
-
 	auto misalign = address & (kPageSize - 1);
 	auto alignedAddress = address & ~(kPageSize - 1);
 	auto alignedSize = (size + misalign + kPageSize - 1) & ~(kPageSize - 1);
 
+	VirtualRangeLock::Node rangeNode{.address = alignedAddress, .length = alignedSize};
+	co_await _rangeLock.lock(&rangeNode);
+	VirtualRangeLock::Guard rangeGuard{&_rangeLock, &rangeNode};
+
 	size_t overallProgress = 0;
 	while(overallProgress < alignedSize) {
 		smarter::shared_ptr<Mapping> mapping;
@@ -619,11 +890,81 @@ VirtualSpace::synchronize(VirtualAddr address, size_t size) {
 	co_return {};
 }
 
+coroutine<frg::expected<Error>>
+VirtualSpace::populate(VirtualAddr address, size_t length, smarter::shared_ptr<WorkQueue> wq) {
+	auto misalign = address & (kPageSize - 1);
+	auto alignedAddress = address & ~(kPageSize - 1);
+	auto alignedLength = (length + misalign + kPageSize - 1) & ~(kPageSize - 1);
+
+	VirtualRangeLock::Node rangeNode{.address = alignedAddress, .length = alignedLength};
+	co_await _rangeLock.lock(&rangeNode);
+	VirtualRangeLock::Guard rangeGuard{&_rangeLock, &rangeNode};
+
+	size_t overallProgress = 0;
+	while(overallProgress < alignedLength) {
+		smarter::shared_ptr<Mapping> mapping;
+		{
+			auto irqLock = frg::guard(&irqMutex());
+			auto spaceGuard = frg::guard(&_snapshotMutex);
+
+			mapping = _findMapping(alignedAddress + overallProgress);
+		}
+		if(!mapping)
+			co_return Error::fault;
+
+		auto mappingOffset = alignedAddress + overallProgress - mapping->address;
+		auto mappingChunk = frg::min(alignedLength - overallProgress,
+				mapping->length - mappingOffset);
+
+		// Same as in handleFault(), but we fetch writable pages for writable mappings.
+		FetchFlags fetchFlags = 0;
+		if(mapping->flags & MappingFlags::dontRequireBacking)
+			fetchFlags |= fetchDisallowBacking;
+		if(!(mapping->flags & MappingFlags::protWrite))
+			fetchFlags |= fetchReadOnly;
+
+		// Lock the range such that no page is evicted before we map it.
+		FRG_CO_TRY(co_await mapping->lockVirtualRange(mappingOffset, mappingChunk, wq));
+
+		// Let pagers fetch the whole range at once instead of page by page.
+		mapping->view->loadahead(mapping->viewOffset + mappingOffset, mappingChunk);
+
+		auto touchOutcome = co_await mapping->view->touchRange(mapping->viewOffset + mappingOffset,
+				mappingChunk, fetchFlags, wq);
+		if(!touchOutcome) {
+			mapping->unlockVirtualRange(mappingOffset, mappingChunk);
+			co_return touchOutcome.error();
+		}
+
+		{
+			co_await mapping->evictionMutex.async_lock();
+			frg::unique_lock evictionLock{frg::adopt_lock, mapping->evictionMutex};
+
+			auto mapOutcome = _ops->mapMissingPages(mapping->address + mappingOffset,
+					mapping->view.get(), mapping->viewOffset + mappingOffset, mappingChunk,
+					mapping->compilePageFlags());
+			assert(mapOutcome);
+		}
+
+		mapping->unlockVirtualRange(mappingOffset, mappingChunk);
+		overallProgress += mappingChunk;
+	}
+
+	co_return {};
+}
+
 coroutine<frg::expected<Error>>
 VirtualSpace::handleFault(VirtualAddr address, uint32_t faultFlags,
 		smarter::shared_ptr<WorkQueue> wq) {
-	co_await _consistencyMutex.async_lock_shared();
-	frg::shared_lock consistencyLock{frg::adopt_lock, _consistencyMutex};
+	if(auto outcome = co_await _handleFaultSpeculatively(address, faultFlags, wq); outcome)
+		co_return std::move(*outcome);
+
+	// Structural changes lock all mappings that they modify. Hence, locking the faulting
+	// page is sufficient to keep its mapping stable (including the fault-around window).
+	VirtualRangeLock::Node rangeNode{.address = address & ~(kPageSize - 1),
+			.length = kPageSize};
+	co_await _rangeLock.lock(&rangeNode);
+	VirtualRangeLock::Guard rangeGuard{&_rangeLock, &rangeNode};
 
 	smarter::shared_ptr<Mapping> mapping;
 	{
@@ -650,6 +991,8 @@ VirtualSpace::handleFault(VirtualAddr address, uint32_t faultFlags,
 		FetchFlags fetchFlags = 0;
 		if(mapping->flags & MappingFlags::dontRequireBacking)
 			fetchFlags |= fetchDisallowBacking;
+		if(!(faultFlags & VirtualSpace::kFaultWrite))
+			fetchFlags |= fetchReadOnly;
 
 		FRG_CO_TRY(co_await mapping->view->fetchRange(
 				mapping->viewOffset + offset, fetchFlags, wq));
@@ -673,6 +1016,19 @@ VirtualSpace::handleFault(VirtualAddr address, uint32_t faultFlags,
 			}
 		}
 
+		// Fault-around: map neighboring pages that are already present in the view.
+		// This does not fetch any pages, hence it does not need to wait for I/O.
+		if(mapping->faultAroundOrder) {
+			auto windowSize = kPageSize << mapping->faultAroundOrder;
+			auto windowStart = frg::max(address & ~(windowSize - 1), mapping->address);
+			auto windowEnd = frg::min((address & ~(windowSize - 1)) + windowSize,
+					mapping->address + mapping->length);
+			auto aroundOutcome = _ops->mapMissingPages(windowStart, mapping->view.get(),
+					mapping->viewOffset + (windowStart - mapping->address),
+					windowEnd - windowStart, mapping->compilePageFlags());
+			assert(aroundOutcome);
+		}
+
 		co_return {};
 	}
 }
@@ -695,7 +1051,8 @@ VirtualSpace::retrievePhysical(VirtualAddr address, smarter::shared_ptr<WorkQueu
 	auto offset = (address - mapping->address) & ~(kPageSize - 1);
 
 	while(true) {
-		FetchFlags fetchFlags = 0;
+		// The caller uses the physical address without locking the page (e.g., for DMA).
+		FetchFlags fetchFlags = fetchPin;
 		if(mapping->flags & MappingFlags::dontRequireBacking)
 			fetchFlags |= fetchDisallowBacking;
 
@@ -713,6 +1070,146 @@ VirtualSpace::retrievePhysical(VirtualAddr address, smarter::shared_ptr<WorkQueu
 	}
 }
 
+coroutine<frg::optional<frg::expected<Error>>>
+VirtualSpace::_handleFaultSpeculatively(VirtualAddr address, uint32_t faultFlags,
+		smarter::shared_ptr<WorkQueue> wq) {
+	auto seq = _mappingSeq.load(std::memory_order_acquire);
+	if(seq & 1)
+		co_return frg::null_opt;
+
+	smarter::shared_ptr<Mapping> mapping;
+	{
+		RcuReadGuard rcuGuard;
+
+		auto speculativeMapping = _findMappingSpeculatively(address);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(_mappingSeq.load(std::memory_order_relaxed) != seq)
+			co_return frg::null_opt;
+		// Let the locked path deal with faults outside of mappings.
+		if(!speculativeMapping || speculativeMapping->state != MappingState::active)
+			co_return frg::null_opt;
+		// This is safe since the tree's reference is only dropped after rcuSynchronize().
+		mapping = speculativeMapping->selfPtr.lock();
+	}
+
+	// Check access attributes. The flags are validated by re-checking _mappingSeq below.
+	if((faultFlags & VirtualSpace::kFaultWrite)
+			&& !((mapping->flags & MappingFlags::protWrite)))
+		co_return frg::null_opt;
+	if((faultFlags & VirtualSpace::kFaultExecute)
+			&& !((mapping->flags & MappingFlags::protExecute)))
+		co_return frg::null_opt;
+
+	auto offset = (address - mapping->address) & ~(kPageSize - 1);
+
+	FetchFlags fetchFlags = 0;
+	if(mapping->flags & MappingFlags::dontRequireBacking)
+		fetchFlags |= fetchDisallowBacking;
+	if(!(faultFlags & VirtualSpace::kFaultWrite))
+		fetchFlags |= fetchReadOnly;
+
+	auto fetchOutcome = co_await mapping->view->fetchRange(
+			mapping->viewOffset + offset, fetchFlags, wq);
+	if(!fetchOutcome)
+		co_return frg::null_opt;
+
+	co_await mapping->evictionMutex.async_lock();
+	frg::unique_lock evictionLock{frg::adopt_lock, mapping->evictionMutex};
+
+	// Structural changes take pagingMutex after incrementing _mappingSeq.
+	// Hence, they either wait for us or we observe the new sequence count.
+	auto irqLock = frg::guard(&irqMutex());
+	auto pagingLock = frg::guard(&mapping->pagingMutex);
+
+	if(_mappingSeq.load(std::memory_order_acquire) != seq)
+		co_return frg::null_opt;
+
+	auto remapOutcome = _ops->faultPage(address & ~(kPageSize - 1),
+			mapping->view.get(), mapping->viewOffset + offset,
+			mapping->compilePageFlags());
+	if(!remapOutcome)
+		co_return frg::null_opt;
+
+	// Fault-around, see handleFault().
+	if(mapping->faultAroundOrder) {
+		auto windowSize = kPageSize << mapping->faultAroundOrder;
+		auto windowStart = frg::max(address & ~(windowSize - 1), mapping->address);
+		auto windowEnd = frg::min((address & ~(windowSize - 1)) + windowSize,
+				mapping->address + mapping->length);
+		auto aroundOutcome = _ops->mapMissingPages(windowStart, mapping->view.get(),
+				mapping->viewOffset + (windowStart - mapping->address),
+				windowEnd - windowStart, mapping->compilePageFlags());
+		assert(aroundOutcome);
+	}
+
+	co_return frg::expected<Error>{};
+}
+
+Mapping *VirtualSpace::_findMappingSpeculatively(VirtualAddr address) {
+	// Concurrent rotations might send us on a longer path (or even in circles);
+	// give up after a bounded number of steps.
+	constexpr int maxSteps = 128;
+
+	auto current = _mappings.get_root();
+	for(int steps = 0; current && steps < maxSteps; ++steps) {
+		if(address < current->address) {
+			current = MappingTree::get_left(current);
+		}else if(address >= current->address + current->length) {
+			current = MappingTree::get_right(current);
+		}else{
+			return current;
+		}
+	}
+
+	return nullptr;
+}
+
+VirtualSpace::MappingChange::MappingChange(VirtualSpace *space,
+		VirtualAddr address, size_t length)
+: space_{space} {
+	space_->_beginMappingChange(address, length);
+}
+
+VirtualSpace::MappingChange::~MappingChange() {
+	space_->_endMappingChange();
+}
+
+void VirtualSpace::_beginMappingChange(VirtualAddr address, size_t length) {
+	// Writers are serialized by _consistencyMutex (or run on retirement).
+	auto seq = _mappingSeq.load(std::memory_order_relaxed);
+	assert(!(seq & 1));
+	_mappingSeq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if(!length)
+		return;
+
+	// Wait for speculative faults that might have missed the increment above.
+	auto irqLock = frg::guard(&irqMutex());
+	auto spaceLock = frg::guard(&_snapshotMutex);
+
+	Mapping *first = nullptr;
+	auto current = _mappings.get_root();
+	while(current) {
+		if(current->address + current->length > address) {
+			first = current;
+			current = MappingTree::get_left(current);
+		}else{
+			current = MappingTree::get_right(current);
+		}
+	}
+
+	for(auto it = first; it && it->address - address < length; it = MappingTree::successor(it)) {
+		auto pagingLock = frg::guard(&it->pagingMutex);
+	}
+}
+
+void VirtualSpace::_endMappingChange() {
+	auto seq = _mappingSeq.load(std::memory_order_relaxed);
+	assert(seq & 1);
+	_mappingSeq.store(seq + 1, std::memory_order_release);
+}
+
 smarter::shared_ptr<Mapping> VirtualSpace::_findMapping(VirtualAddr address) {
 	auto current = _mappings.get_root();
 	while(current) {
@@ -828,8 +1325,27 @@ void VirtualSpace::_splitHole(Hole *hole, VirtualAddr offset, size_t length) {
 	frg::destruct(*kernelAlloc, hole);
 }
 
+frg::tuple<VirtualAddr, size_t> VirtualSpace::_extendToMappings(VirtualAddr address,
+		size_t length) {
+	// _consistencyMutex is held here by the caller, hence the mappings cannot change
+	// until the caller has locked the returned range.
+	if(!length)
+		return {address, 0};
+
+	auto irqLock = frg::guard(&irqMutex());
+	auto spaceLock = frg::guard(&_snapshotMutex);
+
+	auto lockStart = address;
+	auto lockEnd = address + length;
+	if(auto mapping = _findMapping(address); mapping)
+		lockStart = frg::min(lockStart, mapping->address);
+	if(auto mapping = _findMapping(address + length - 1); mapping)
+		lockEnd = frg::max(lockEnd, mapping->address + mapping->length);
+	return {lockStart, lockEnd - lockStart};
+}
+
 coroutine<frg::tuple<Mapping *, Mapping *>> VirtualSpace::_splitMappings(uintptr_t address, size_t size) {
-	// _consistencyMutex is held here by the caller
+	// _consistencyMutex and the range lock are held here by the caller
 
 	auto left = _mappings.get_root();
 	while (left) {
@@ -932,6 +1448,8 @@ coroutine<frg::tuple<Mapping *, Mapping *>> VirtualSpace::_splitMappings(uintptr
 				co_await mapping->evictionDoneEvent.wait();
 			}
 			mapping->view->removeObserver(&mapping->observer);
+			// Speculative lookups might still access the mapping.
+			rcuSynchronize();
 			mapping->selfPtr.ctr()->decrement();
 
 			// If start pointed to the freshly-removed mapping,
@@ -961,12 +1479,20 @@ coroutine<bool> VirtualSpace::_unmapMappings(VirtualAddr address, size_t length,
 			assert(mapping->state == MappingState::active);
 			mapping->state = MappingState::zombie;
 
+			// Other spaces keep using the shared PTs, so we must not clear their PTEs.
+			_unshareTables(mapping->address, mapping->length);
+
 			// Mark pages as dirty and unmap without holding a lock.
 			auto unmapOutcome = _ops->unmapPages(mapping->address, mapping->view.get(),
 						mapping->viewOffset, mapping->length);
 			assert(unmapOutcome);
 
-			_mappings.remove(mapping.get());
+			{
+				auto irqLock = frg::guard(&irqMutex());
+				auto spaceLock = frg::guard(&_snapshotMutex);
+
+				_mappings.remove(mapping.get());
+			}
 
 			assert(mapping->state == MappingState::zombie);
 			mapping->state = MappingState::retired;
@@ -976,6 +1502,8 @@ coroutine<bool> VirtualSpace::_unmapMappings(VirtualAddr address, size_t length,
 				co_await mapping->evictionDoneEvent.wait();
 			}
 			mapping->view->removeObserver(&mapping->observer);
+			// Speculative lookups might still access the mapping.
+			rcuSynchronize();
 			mapping->selfPtr.ctr()->decrement();
 
 			// Finally, coalesce the hole in the hole tree.
@@ -1044,6 +1572,73 @@ coroutine<bool> VirtualSpace::_unmapMappings(VirtualAddr address, size_t length,
 	co_return needsShootdown;
 }
 
+bool VirtualSpace::_shareTables(Mapping *mapping, PageFlags pageFlags) {
+	// The PTEs must not depend on anything but the view range and the flags. In particular,
+	// writable mappings need their own PTEs (e.g., to track dirty pages).
+	if(!(pageFlags & page_access::read) || (pageFlags & page_access::write))
+		return false;
+
+	// Other mappings would need their own PTEs in the window.
+	auto pred = MappingTree::predecessor(mapping);
+	auto succ = MappingTree::successor(mapping);
+	VirtualAddr lowerLimit = pred ? pred->address + pred->length : 0;
+	VirtualAddr upperLimit = succ ? succ->address : ~VirtualAddr(0);
+
+	bool anyShared = false;
+	auto mappingEnd = mapping->address + mapping->length;
+	for(auto window = mapping->address & ~VirtualAddr(kHugePageSize - 1);
+			window < mappingEnd; window += kHugePageSize) {
+		if(window < lowerLimit || window + kHugePageSize > upperLimit)
+			continue;
+
+		auto begin = frg::max(window, mapping->address) - window;
+		auto end = frg::min(window + kHugePageSize, mappingEnd) - window;
+		auto sharedTable = acquireSharedPageTable(mapping->view.get(),
+				mapping->viewOffset + (window - mapping->address), begin, end, pageFlags);
+		if(!_ops->attachSharedTable(window, sharedTable->table)) {
+			// This space never used the PT, hence it can be released immediately.
+			detachSharedPageTable(sharedTable);
+			releaseSharedPageTable(sharedTable);
+			continue;
+		}
+		_sharedTables.insert(window, sharedTable);
+		anyShared = true;
+	}
+
+	return anyShared;
+}
+
+bool VirtualSpace::_unshareTables(VirtualAddr address, size_t length) {
+	if(_sharedTables.empty())
+		return false;
+
+	bool anyDetached = false;
+	auto limit = address + length;
+	for(auto window = address & ~VirtualAddr(kHugePageSize - 1);
+			window < limit; window += kHugePageSize) {
+		auto it = _sharedTables.get(window);
+		if(!it)
+			continue;
+		auto sharedTable = *it;
+
+		bool covered = address <= window + sharedTable->begin
+				&& limit >= window + sharedTable->end;
+		_ops->detachSharedTable(window, !covered);
+		detachSharedPageTable(sharedTable);
+		_sharedTables.remove(window);
+		_detachedTables.push_back(sharedTable);
+		anyDetached = true;
+	}
+
+	return anyDetached;
+}
+
+void VirtualSpace::_releaseDetachedTables() {
+	for(size_t i = 0; i < _detachedTables.size(); i++)
+		releaseSharedPageTable(_detachedTables[i]);
+	_detachedTables.clear();
+}
+
 coroutine<size_t> VirtualSpace::readPartialSpace(uintptr_t address,
 		void *buffer, size_t size, smarter::shared_ptr<WorkQueue> wq) {
 	// We do not take _consistencyMutex here since we are only interested in a snapshot.
@@ -1192,6 +1787,50 @@ coroutine<size_t> VirtualSpace::writePartialSpace(uintptr_t address,
 	co_return progress;
 }
 
+coroutine<frg::expected<Error, LockedPage>> VirtualSpace::lockPage(uintptr_t address,
+		MappingFlags requiredFlags, smarter::shared_ptr<WorkQueue> wq) {
+	// We do not take _consistencyMutex here since we are only interested in a snapshot.
+
+	smarter::shared_ptr<Mapping> mapping;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto spaceGuard = frg::guard(&_snapshotMutex);
+
+		mapping = _findMapping(address);
+	}
+	if(!mapping)
+		co_return Error::fault;
+	if((mapping->flags & requiredFlags) != requiredFlags)
+		co_return Error::fault;
+
+	auto offsetInMapping = (address - mapping->address) & ~(kPageSize - 1);
+	FRG_CO_TRY(co_await mapping->lockVirtualRange(offsetInMapping, kPageSize, wq));
+
+	FetchFlags fetchFlags = 0;
+	if(mapping->flags & MappingFlags::dontRequireBacking)
+		fetchFlags |= fetchDisallowBacking;
+
+	auto touchOutcome = co_await mapping->view->fetchRange(
+			mapping->viewOffset + offsetInMapping, fetchFlags, wq);
+	if(!touchOutcome) {
+		mapping->unlockVirtualRange(offsetInMapping, kPageSize);
+		co_return touchOutcome.error();
+	}
+
+	auto [physical, cacheMode] = mapping->resolveRange(offsetInMapping);
+	// Since we have locked the MemoryView, the physical address remains valid here.
+	assert(physical != PhysicalAddr(-1));
+
+	co_return LockedPage{std::move(mapping), offsetInMapping, physical};
+}
+
+void VirtualSpace::unlockPage(LockedPage &page) {
+	assert(page.mapping);
+	page.mapping->unlockVirtualRange(page.offsetInMapping, kPageSize);
+	page.mapping = nullptr;
+	page.physical = PhysicalAddr(-1);
+}
+
 // --------------------------------------------------------
 // AddressSpace
 // --------------------------------------------------------
@@ -0,0 +1,56 @@
+#include <assert.h>
+#include <string.h>
+#include <hel.h>
+#include <thor-internal/clock-page.hpp>
+#include <thor-internal/physical.hpp>
+
+namespace thor {
+
+namespace {
+	struct ClockPage {
+		HelClockPage *page;
+		smarter::shared_ptr<MemoryView> memory;
+	};
+
+	ClockPage &getClockPage() {
+		static frg::eternal<ClockPage> singleton = [] {
+			auto physical = physicalAllocator->allocate(kPageSize);
+			assert(physical != PhysicalAddr(-1) && "OOM");
+			PageAccessor accessor{physical};
+			memset(accessor.get(), 0, kPageSize);
+
+			// Until publishClockPageCounter() is called, kHelClockPageCounterValid
+			// is not set and userspace falls back to helGetClock().
+			return ClockPage{
+				.page = reinterpret_cast<HelClockPage *>(accessor.get()),
+				.memory = smarter::allocate_shared<HardwareMemory>(*kernelAlloc,
+						physical, kPageSize, CachingMode::null)
+			};
+		}();
+		return singleton.get();
+	}
+}
+
+void publishClockPageCounter(uint64_t mult, uint32_t shift,
+		uint64_t refCounter, uint64_t refNanos) {
+	auto page = getClockPage().page;
+
+	// There is only a single writer, hence no lock is required.
+	auto seq = __atomic_load_n(&page->seqlock, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->seqlock, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&page->shift, shift, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->mult, mult, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->refCounter, refCounter, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->refNanos, refNanos, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->flags, uint32_t{kHelClockPageCounterValid}, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&page->seqlock, seq + 2, __ATOMIC_RELEASE);
+}
+
+smarter::shared_ptr<MemoryView> getClockPageMemory() {
+	return getClockPage().memory;
+}
+
+} // namespace thor
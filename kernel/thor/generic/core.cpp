@@ -1,3 +1,5 @@
+#include <limits.h>
+
 #include <thor-internal/cpu-data.hpp>
 #include <thor-internal/debug.hpp>
 #include <thor-internal/fiber.hpp>
@@ -23,7 +25,7 @@ size_t kernelMemoryUsage = 0;
 
 void IrqSpinlock::lock() {
 	irqMutex().lock();
-	_spinlock.lock();
+	_spinlock.lock(reinterpret_cast<uintptr_t>(__builtin_return_address(0)));
 }
 
 void IrqSpinlock::unlock() {
@@ -226,15 +228,208 @@ constinit frg::manual_box<PhysicalChunkAllocator> physicalAllocator = {};
 
 constinit frg::manual_box<KernelVirtualAlloc> kernelVirtualAlloc = {};
 
-constinit frg::manual_box<
-	frg::slab_pool<
-		KernelVirtualAlloc,
-		IrqSpinlock
-	>
-> kernelHeap = {};
+constinit frg::manual_box<KernelSlabPool> kernelHeap = {};
 
 constinit frg::manual_box<KernelAlloc> kernelAlloc = {};
 
+// --------------------------------------------------------
+// KernelAlloc
+// --------------------------------------------------------
+
+namespace {
+	// KASAN and allocation tracing need to observe every allocation and free.
+#if defined(THOR_KASAN) || defined(KERNEL_LOG_ALLOCATIONS)
+	constexpr bool useSlabMagazines = false;
+#else
+	constexpr bool useSlabMagazines = true;
+#endif
+
+	// Log each time a coroutine frame exceeds the largest frame so far. Useful to find
+	// (and shrink) the coroutines whose frames do not fit into the cached size classes.
+	constexpr bool logLargestCoroutineFrames = false;
+
+	// Returns the SlabMagazine size class of an allocation or -1 if it is not cached.
+	int sizeClassOf(size_t size) {
+		if(!size || size > SlabMagazine::classSize(SlabMagazine::numClasses - 1))
+			return -1;
+		if(size <= SlabMagazine::classSize(0))
+			return 0;
+		int shift = sizeof(size_t) * CHAR_BIT - __builtin_clzl(size - 1);
+		return shift - SlabMagazine::minShift;
+	}
+}
+
+void *KernelAlloc::allocate(size_t size) {
+	auto sizeClass = sizeClassOf(size);
+	if(!useSlabMagazines || sizeClass < 0)
+		return _pool->allocate(size);
+
+	auto irqLock = frg::guard(&irqMutex());
+
+	auto magazine = &getCpuData()->slabMagazine;
+	auto &numObjects = magazine->numObjects[sizeClass];
+	if(numObjects) {
+		auto &numHits = magazine->numHits[sizeClass];
+		numHits.store(numHits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}else{
+		auto &numMisses = magazine->numMisses[sizeClass];
+		numMisses.store(numMisses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		_refillMagazine(magazine, sizeClass);
+		if(!numObjects)
+			return nullptr;
+	}
+	return magazine->objects[sizeClass][--numObjects];
+}
+
+void *KernelAlloc::reallocate(void *pointer, size_t size) {
+	// The slab pool determines the old size from its own metadata.
+	return _pool->realloc(pointer, size);
+}
+
+void KernelAlloc::free(void *pointer) {
+	// We do not know the size class here; return the object to the slab pool.
+	_pool->free(pointer);
+}
+
+void KernelAlloc::deallocate(void *pointer, size_t size) {
+	if(!pointer)
+		return;
+
+	auto sizeClass = sizeClassOf(size);
+	if(!useSlabMagazines || sizeClass < 0) {
+		_pool->deallocate(pointer, size);
+		return;
+	}
+
+	auto irqLock = frg::guard(&irqMutex());
+
+	auto magazine = &getCpuData()->slabMagazine;
+	if(magazine->numObjects[sizeClass] == SlabMagazine::capacity)
+		_drainMagazine(magazine, sizeClass, SlabMagazine::batchSize);
+	assert(magazine->numObjects[sizeClass] < SlabMagazine::capacity);
+	magazine->objects[sizeClass][magazine->numObjects[sizeClass]++] = pointer;
+}
+
+// Objects in the magazine are always allocated with the full size of their class,
+// such that they can be handed out for any allocation that falls into this class.
+void KernelAlloc::_refillMagazine(SlabMagazine *magazine, int sizeClass) {
+	auto &numObjects = magazine->numObjects[sizeClass];
+	while(numObjects < SlabMagazine::batchSize) {
+		auto pointer = _pool->allocate(SlabMagazine::classSize(sizeClass));
+		if(!pointer)
+			break;
+		magazine->objects[sizeClass][numObjects++] = pointer;
+	}
+}
+
+void KernelAlloc::_drainMagazine(SlabMagazine *magazine, int sizeClass, size_t n) {
+	auto &numObjects = magazine->numObjects[sizeClass];
+	assert(n <= numObjects);
+	for(size_t i = 0; i < n; i++)
+		_pool->free(magazine->objects[sizeClass][--numObjects]);
+}
+
+KernelHeapClassStats getKernelHeapClassStats(int sizeClass) {
+	assert(sizeClass >= 0 && sizeClass < SlabMagazine::numClasses);
+
+	KernelHeapClassStats stats{SlabMagazine::classSize(sizeClass), 0, 0};
+	for(int i = 0; i < getCpuCount(); i++) {
+		auto magazine = &getCpuData(i)->slabMagazine;
+		stats.numHits += magazine->numHits[sizeClass].load(std::memory_order_relaxed);
+		stats.numMisses += magazine->numMisses[sizeClass].load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+// --------------------------------------------------------
+// Coroutine frames
+// --------------------------------------------------------
+
+namespace {
+	std::atomic<size_t> largestCoroutineFrame{0};
+
+	int frameClassOf(size_t size) {
+		if(size > CoroutineFrameCache::classSize(CoroutineFrameCache::numClasses - 1))
+			return -1;
+		if(size <= CoroutineFrameCache::classSize(0))
+			return 0;
+		int shift = sizeof(size_t) * CHAR_BIT - __builtin_clzl(size - 1);
+		return shift - CoroutineFrameCache::minShift;
+	}
+}
+
+void *allocateCoroutineFrame(size_t size, void *callSite) {
+	auto largest = largestCoroutineFrame.load(std::memory_order_relaxed);
+	while(size > largest) {
+		if(largestCoroutineFrame.compare_exchange_weak(largest, size,
+				std::memory_order_relaxed)) {
+			if(logLargestCoroutineFrames)
+				infoLogger() << "thor: Largest coroutine frame so far: " << size
+						<< " bytes (called from " << callSite << ")" << frg::endlog;
+			break;
+		}
+	}
+
+	auto sizeClass = frameClassOf(size);
+	if(!useSlabMagazines || sizeClass < 0)
+		return kernelAlloc->allocate(size);
+
+	{
+		auto irqLock = frg::guard(&irqMutex());
+
+		auto cache = &getCpuData()->coroutineFrameCache;
+		auto &numFrames = cache->numFrames[sizeClass];
+		if(numFrames) {
+			auto &numHits = cache->numHits[sizeClass];
+			numHits.store(numHits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return cache->frames[sizeClass][--numFrames];
+		}
+		auto &numMisses = cache->numMisses[sizeClass];
+		numMisses.store(numMisses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	// Frames are allocated with the full size of their class such that they can be reused
+	// for any frame of that class.
+	return kernelAlloc->allocate(CoroutineFrameCache::classSize(sizeClass));
+}
+
+void freeCoroutineFrame(void *pointer, size_t size) {
+	auto sizeClass = frameClassOf(size);
+	if(!useSlabMagazines || sizeClass < 0) {
+		kernelAlloc->deallocate(pointer, size);
+		return;
+	}
+
+	{
+		auto irqLock = frg::guard(&irqMutex());
+
+		auto cache = &getCpuData()->coroutineFrameCache;
+		auto &numFrames = cache->numFrames[sizeClass];
+		if(numFrames < CoroutineFrameCache::capacity) {
+			cache->frames[sizeClass][numFrames++] = pointer;
+			return;
+		}
+	}
+
+	kernelAlloc->deallocate(pointer, CoroutineFrameCache::classSize(sizeClass));
+}
+
+KernelHeapClassStats getCoroutineFrameClassStats(int sizeClass) {
+	assert(sizeClass >= 0 && sizeClass < CoroutineFrameCache::numClasses);
+
+	KernelHeapClassStats stats{CoroutineFrameCache::classSize(sizeClass), 0, 0};
+	for(int i = 0; i < getCpuCount(); i++) {
+		auto cache = &getCpuData(i)->coroutineFrameCache;
+		stats.numHits += cache->numHits[sizeClass].load(std::memory_order_relaxed);
+		stats.numMisses += cache->numMisses[sizeClass].load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+size_t getLargestCoroutineFrame() {
+	return largestCoroutineFrame.load(std::memory_order_relaxed);
+}
+
 // --------------------------------------------------------
 // CpuData
 // --------------------------------------------------------
@@ -1,5 +1,9 @@
 #include <thor-internal/cpu-data.hpp>
 #include <thor-internal/debug.hpp>
+#include <thor-internal/fiber.hpp>
+#include <thor-internal/kernel-io.hpp>
+#include <thor-internal/main.hpp>
+#include <thor-internal/timer.hpp>
 #include <thor-internal/arch/stack.hpp>
 
 namespace thor {
@@ -25,8 +29,40 @@ namespace {
 			&LogHandler::hook
 		>
 	>> globalLogList;
+
+	// Maximal number of characters per LogRing record.
+	// Longer messages are split into multiple records.
+	constexpr size_t logRecordLength = 112;
+	constexpr size_t numLogRecords = 256;
+	constexpr uint64_t logDrainInterval = 1'000'000;
+
+	// Orders messages across all CPUs.
+	constinit std::atomic<uint64_t> globalLogSeq{0};
+
+	// Receives all log lines once the kernel-log I/O channel is connected.
+	constinit std::atomic<LogRingBuffer *> kernelLogRing{nullptr};
 } // anonymous namespace
 
+// Buffers the log messages of a single CPU until the drain fiber forwards them
+// to the log handlers. Records are only produced by the owning CPU (with IRQs disabled)
+// and only consumed while holding logMutex, hence head and tail need no further locking.
+struct LogRing {
+	struct Record {
+		// All records of the same message share the sequence number.
+		uint64_t seq;
+		uint32_t length;
+		// Set if the next record continues this message.
+		bool more;
+		char text[logRecordLength];
+	};
+
+	std::atomic<uint64_t> head{0};
+	std::atomic<uint64_t> tail{0};
+	// Number of messages that did not fit into the ring.
+	std::atomic<uint64_t> numDropped{0};
+	Record records[numLogRecords];
+};
+
 size_t currentLogSequence() {
 	return logHead;
 }
@@ -142,6 +178,155 @@ namespace {
 	};
 
 	constinit LogProcessor logProcessor;
+
+	// Called with IRQs disabled on the CPU that owns the ring.
+	void appendToRing(LogRing *ring, const char *msg) {
+		size_t length = strlen(msg);
+		size_t n = frg::max(size_t{1}, (length + logRecordLength - 1) / logRecordLength);
+
+		auto head = ring->head.load(std::memory_order_relaxed);
+		auto tail = ring->tail.load(std::memory_order_acquire);
+		if(head - tail + n > numLogRecords) {
+			ring->numDropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		auto seq = globalLogSeq.fetch_add(1, std::memory_order_relaxed);
+		for(size_t i = 0; i < n; ++i) {
+			auto record = &ring->records[(head + i) % numLogRecords];
+			auto chunk = frg::min(length - i * logRecordLength, logRecordLength);
+			record->seq = seq;
+			record->length = chunk;
+			record->more = (i + 1 < n);
+			memcpy(record->text, msg + i * logRecordLength, chunk);
+		}
+
+		// Publish all records of the message at once.
+		ring->head.store(head + n, std::memory_order_release);
+	}
+
+	// Forwards the oldest buffered message to the log handlers.
+	// Must be called with logMutex held. Returns false if all rings are empty.
+	// Note that a CPU can still be writing a message with a lower sequence number;
+	// hence, the order across CPUs is only approximate.
+	bool drainOneMessage() {
+		LogRing *oldest = nullptr;
+		uint64_t oldestSeq = 0;
+		for(int i = 0; i < getCpuCount(); ++i) {
+			auto ring = getCpuData(i)->logRing.load(std::memory_order_acquire);
+			if(!ring)
+				continue;
+			auto tail = ring->tail.load(std::memory_order_relaxed);
+			if(tail == ring->head.load(std::memory_order_acquire))
+				continue;
+			auto seq = ring->records[tail % numLogRecords].seq;
+			if(!oldest || seq < oldestSeq) {
+				oldest = ring;
+				oldestSeq = seq;
+			}
+		}
+		if(!oldest)
+			return false;
+
+		auto tail = oldest->tail.load(std::memory_order_relaxed);
+		while(true) {
+			auto record = &oldest->records[tail++ % numLogRecords];
+			for(uint32_t i = 0; i < record->length; ++i)
+				logProcessor.print(record->text[i]);
+			if(!record->more)
+				break;
+		}
+		logProcessor.print('\n');
+
+		oldest->tail.store(tail, std::memory_order_release);
+		return true;
+	}
+
+	void runLogDrain() {
+		size_t forwardedSequence = 0;
+		while(true) {
+			// Allocate rings for CPUs that came up since the last iteration.
+			for(int i = 0; i < getCpuCount(); ++i) {
+				auto cpuData = getCpuData(i);
+				if(cpuData->logRing.load(std::memory_order_relaxed))
+					continue;
+				cpuData->logRing.store(frg::construct<LogRing>(*kernelAlloc),
+						std::memory_order_release);
+			}
+
+			// Re-enable IRQs between messages since log handlers can be slow.
+			while(true) {
+				auto irqLock = frg::guard(&irqMutex());
+				auto lock = frg::guard(&logMutex);
+
+				if(!drainOneMessage())
+					break;
+			}
+
+			uint64_t numDropped = 0;
+			for(int i = 0; i < getCpuCount(); ++i) {
+				auto ring = getCpuData(i)->logRing.load(std::memory_order_acquire);
+				if(ring)
+					numDropped += ring->numDropped.exchange(0, std::memory_order_relaxed);
+			}
+			if(numDropped)
+				infoLogger() << "\e[31m" "thor: " << numDropped
+						<< " log messages were dropped" "\e[39m" << frg::endlog;
+
+			// Forward completed lines to the kernel-log I/O channel (if any).
+			// This is done outside of logMutex since LogRingBuffer wakes up its consumer.
+			if(auto ring = kernelLogRing.load(std::memory_order_acquire); ring) {
+				while(true) {
+					char text[logLineLength];
+					{
+						auto irqLock = frg::guard(&irqMutex());
+						auto lock = frg::guard(&logMutex);
+
+						if(forwardedSequence == logHead)
+							break;
+						if(logHead - forwardedSequence > 1024)
+							forwardedSequence = logHead - 1024;
+						memcpy(text, logQueue[forwardedSequence % 1024].text, logLineLength);
+					}
+					forwardedSequence++;
+
+					// Lines in logQueue are zero-padded (LogProcessor never fills them).
+					auto length = strnlen(text, logLineLength - 1);
+					text[length] = '\n';
+					ring->enqueue(text, length + 1);
+				}
+			}
+
+			KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(logDrainInterval));
+		}
+	}
+
+	initgraph::Task initLogDrain{&globalInitEngine, "generic.init-log-drain",
+		initgraph::Requires{getFibersAvailableStage()},
+		[] {
+			KernelFiber::run([] {
+				runLogDrain();
+			});
+		}
+	};
+
+	initgraph::Task initKernelLogSink{&globalInitEngine, "generic.init-kernel-log-sink",
+		initgraph::Requires{getFibersAvailableStage(),
+			getIoChannelsDiscoveredStage()},
+		[] {
+			auto channel = solicitIoChannel("kernel-log");
+			if(!channel)
+				return;
+
+			infoLogger() << "thor: Connecting kernel log to I/O channel" << frg::endlog;
+			void *memory = kernelAlloc->allocate(1 << 16);
+			auto ring = frg::construct<LogRingBuffer>(*kernelAlloc,
+					reinterpret_cast<uintptr_t>(memory), 1 << 16);
+			async::detach_with_allocator(*kernelAlloc,
+					dumpRingToChannel(ring, std::move(channel), logLineLength + 1));
+			kernelLogRing.store(ring, std::memory_order_release);
+		}
+	};
 } // anonymous namespace
 
 void panic() {
@@ -156,6 +341,13 @@ constinit frg::stack_buffer_logger<PanicSink> panicLogger;
 
 void InfoSink::operator() (const char *msg) {
 	auto irqLock = frg::guard(&irqMutex());
+
+	// Once the drain fiber runs, we only copy the message to the per-CPU ring.
+	if(auto ring = getCpuData()->logRing.load(std::memory_order_acquire); ring) {
+		appendToRing(ring, msg);
+		return;
+	}
+
 	auto lock = frg::guard(&logMutex);
 
 	logProcessor.print(msg);
@@ -176,6 +368,10 @@ void PanicSink::operator() (const char *msg) {
 	{
 		auto lock = frg::guard(&logMutex);
 
+		// Make sure that messages leading up to the panic are visible.
+		while(drainOneMessage())
+			;
+
 		logProcessor.print(msg);
 		logProcessor.print('\n');
 	}
@@ -76,6 +76,17 @@ void KernelFiber::run(UniqueKernelStack stack,
 	Scheduler::resume(fiber);
 }
 
+void KernelFiber::runOn(Scheduler *scheduler, UniqueKernelStack stack,
+		void (*function)(void *), void *argument) {
+	AbiParameters params;
+	params.ip = (uintptr_t)function;
+	params.argument = (uintptr_t)argument;
+
+	auto fiber = frg::construct<KernelFiber>(*kernelAlloc, std::move(stack), params);
+	Scheduler::associate(fiber, scheduler);
+	Scheduler::resume(fiber);
+}
+
 KernelFiber *KernelFiber::post(UniqueKernelStack stack,
 		void (*function)(void *), void *argument) {
 	AbiParameters params;
@@ -98,6 +109,8 @@ void KernelFiber::invoke() {
 
 	getCpuData()->executorContext = &_executorContext;
 	getCpuData()->activeFiber = this;
+	getCpuData()->profileThreadId = 0;
+	getCpuData()->profileUniverseId = 0;
 	restoreExecutor(&_executor);
 }
 
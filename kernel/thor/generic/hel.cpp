@@ -6,6 +6,7 @@
 #include <frg/container_of.hpp>
 #include <frg/dyn_array.hpp>
 #include <frg/small_vector.hpp>
+#include <thor-internal/clock-page.hpp>
 #include <thor-internal/event.hpp>
 #include <thor-internal/coroutine.hpp>
 #include <thor-internal/io.hpp>
@@ -17,6 +18,7 @@
 #include <thor-internal/stream.hpp>
 #include <thor-internal/thread.hpp>
 #include <thor-internal/timer.hpp>
+#include <thor-internal/wait-set.hpp>
 #ifdef __x86_64__
 #include <thor-internal/arch/debug.hpp>
 #include <thor-internal/arch/ept.hpp>
@@ -27,6 +29,10 @@
 using namespace thor;
 
 namespace {
+	// SendFromBuffer transfers of at least this size are copied directly from
+	// the sender's pages instead of bouncing through kernel buffers.
+	constexpr size_t zeroCopyThreshold = 64 * 1024;
+
 	// TODO: Replace this by a function that returns the type of special descriptor.
 	bool isSpecialMemoryView(HelHandle handle) {
 		return handle == kHelZeroMemory;
@@ -145,7 +151,7 @@ HelError helSubmitAsyncNop(HelHandle queueHandle, uintptr_t context) {
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irqLock = frg::guard(&irqMutex());
-		Universe::Guard universeGuard(thisUniverse->lock);
+		Universe::ReadGuard universeGuard;
 
 		auto queueWrapper = thisUniverse->getDescriptor(universeGuard, queueHandle);
 		if(!queueWrapper)
@@ -191,7 +197,7 @@ HelError helTransferDescriptor(HelHandle handle, HelHandle universe_handle,
 	smarter::shared_ptr<Universe> universe;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard lock(this_universe->lock);
+		Universe::ReadGuard lock;
 
 		auto descriptor_it = this_universe->getDescriptor(lock, handle);
 		if(!descriptor_it)
@@ -226,7 +232,7 @@ HelError helDescriptorInfo(HelHandle handle, HelDescriptorInfo *) {
 	auto this_universe = this_thread->getUniverse();
 
 	auto irq_lock = frg::guard(&irqMutex());
-	Universe::Guard universe_guard(this_universe->lock);
+	Universe::ReadGuard universe_guard;
 
 	auto wrapper = this_universe->getDescriptor(universe_guard, handle);
 	if(!wrapper)
@@ -247,7 +253,7 @@ HelError helGetCredentials(HelHandle handle, uint32_t flags, char *credentials)
 	smarter::shared_ptr<Thread> thread;
 	{
 		auto irqLock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(thisUniverse->lock);
+		Universe::ReadGuard universe_guard;
 
 		if(handle == kHelThisThread) {
 			thread = thisThread.lock();
@@ -276,7 +282,7 @@ HelError helCloseDescriptor(HelHandle universeHandle, HelHandle handle) {
 		universe = thisUniverse.lock();
 	}else{
 		auto irqLock = frg::guard(&irqMutex());
-		Universe::Guard universeLock(thisUniverse->lock);
+		Universe::ReadGuard universeLock;
 
 		auto universeIt = thisUniverse->getDescriptor(universeLock, universeHandle);
 		if(!universeIt)
@@ -333,7 +339,7 @@ HelError helCancelAsync(HelHandle handle, uint64_t async_id) {
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto queue_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!queue_wrapper)
@@ -355,6 +361,10 @@ HelError helAllocateMemory(size_t size, uint32_t flags,
 	if(size & (kPageSize - 1))
 		return kHelErrIllegalArgs;
 
+	unsigned int chunkOrder = (flags & kHelAllocChunkOrderMask) >> kHelAllocChunkOrderShift;
+	if(chunkOrder && (chunkOrder < kPageShift || chunkOrder > 30))
+		return kHelErrIllegalArgs;
+
 	auto thisThread = getCurrentThread();
 	auto thisUniverse = thisThread->getUniverse();
 
@@ -373,6 +383,10 @@ HelError helAllocateMemory(size_t size, uint32_t flags,
 	if(flags & kHelAllocContinuous) {
 		memory = smarter::allocate_shared<AllocatedMemory>(*kernelAlloc, size, effective.addressBits,
 				size, kPageSize);
+	}else if(chunkOrder > kPageShift) {
+		auto chunkSize = size_t{1} << chunkOrder;
+		memory = smarter::allocate_shared<AllocatedMemory>(*kernelAlloc, size, effective.addressBits,
+				chunkSize, chunkSize, true);
 	}else if(flags & kHelAllocOnDemand) {
 		memory = smarter::allocate_shared<AllocatedMemory>(*kernelAlloc, size, effective.addressBits);
 	}else{
@@ -399,7 +413,7 @@ HelError helResizeMemory(HelHandle handle, size_t newSize) {
 	smarter::shared_ptr<MemoryView> memory;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!wrapper)
@@ -462,7 +476,7 @@ HelError helCopyOnWrite(HelHandle memoryHandle,
 
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		if(memoryHandle >= 0) {
 			auto wrapper = this_universe->getDescriptor(universe_guard, memoryHandle);
@@ -533,7 +547,7 @@ HelError helAlterMemoryIndirection(HelHandle indirectHandle, size_t slot,
 	smarter::shared_ptr<MemoryView> memoryView;
 	{
 		auto irqLock = frg::guard(&irqMutex());
-		Universe::Guard universeLock(thisUniverse->lock);
+		Universe::ReadGuard universeLock;
 
 		auto indirectWrapper = thisUniverse->getDescriptor(universeLock, indirectHandle);
 		if(!indirectWrapper)
@@ -564,7 +578,8 @@ HelError helAlterMemoryIndirection(HelHandle indirectHandle, size_t slot,
 
 HelError helCreateSliceView(HelHandle memoryHandle,
 		uintptr_t offset, size_t size, uint32_t flags, HelHandle *handle) {
-	assert(!flags);
+	if(flags & ~kHelSliceCacheWriteCombine)
+		return kHelErrIllegalArgs;
 	assert((offset % kPageSize) == 0);
 	assert((size % kPageSize) == 0);
 
@@ -574,7 +589,7 @@ HelError helCreateSliceView(HelHandle memoryHandle,
 	smarter::shared_ptr<MemoryView> view;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto wrapper = this_universe->getDescriptor(universe_guard, memoryHandle);
 		if(!wrapper)
@@ -584,6 +599,15 @@ HelError helCreateSliceView(HelHandle memoryHandle,
 		view = wrapper->get<MemoryViewDescriptor>().memory;
 	}
 
+	if(flags & kHelSliceCacheWriteCombine) {
+		auto wcView = view->withCachingMode(CachingMode::writeCombine);
+		if(!wcView) {
+			assert(wcView.error() == Error::illegalObject);
+			return kHelErrUnsupportedOperation;
+		}
+		view = std::move(wcView.value());
+	}
+
 	auto slice = smarter::allocate_shared<MemorySlice>(*kernelAlloc,
 			std::move(view), offset, size);
 	{
@@ -604,7 +628,7 @@ HelError helForkMemory(HelHandle handle, HelHandle *forkedHandle) {
 	smarter::shared_ptr<MemoryView> view;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto viewWrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!viewWrapper)
@@ -671,6 +695,37 @@ HelError helCreateVirtualizedSpace(HelHandle *handle) {
 #endif
 }
 
+HelError helGetDirtyLog(HelHandle handle, uintptr_t address, size_t length, void *bitmap) {
+	auto thisThread = getCurrentThread();
+	auto thisUniverse = thisThread->getUniverse();
+
+	if((address & (kPageSize - 1)) || (length & (kPageSize - 1)))
+		return kHelErrIllegalArgs;
+
+	smarter::shared_ptr<VirtualizedPageSpace> space;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		Universe::Guard universeGuard(thisUniverse->lock);
+
+		auto wrapper = thisUniverse->getDescriptor(universeGuard, handle);
+		if(!wrapper)
+			return kHelErrNoDescriptor;
+		if(!wrapper->is<VirtualizedSpaceDescriptor>())
+			return kHelErrBadDescriptor;
+		space = wrapper->get<VirtualizedSpaceDescriptor>().space;
+	}
+
+	frg::vector<uint8_t, KernelAlloc> kernelBitmap{*kernelAlloc};
+	kernelBitmap.resize((length / kPageSize + 7) / 8);
+	if(auto e = space->fetchDirtyLog(address, length, kernelBitmap.data()); e != Error::success)
+		return translateError(e);
+
+	if(!writeUserArray(reinterpret_cast<uint8_t *>(bitmap),
+			kernelBitmap.data(), kernelBitmap.size()))
+		return kHelErrFault;
+	return kHelErrNone;
+}
+
 HelError helCreateVirtualizedCpu(HelHandle handle, HelHandle *out) {
 #ifdef __x86_64__
 	if(!getCpuData()->haveVirtualization) {
@@ -704,15 +759,22 @@ HelError helRunVirtualizedCpu(HelHandle handle, HelVmexitReason *exitInfo) {
 	}
 	auto this_thread = getCurrentThread();
 	auto this_universe = this_thread->getUniverse();
-	Universe::Guard universe_guard(this_universe->lock);
 
-	auto wrapper = this_universe->getDescriptor(universe_guard, handle);
-	if(!wrapper)
-		return kHelErrNoDescriptor;
-	if(!wrapper->is<VirtualizedCpuDescriptor>())
-		return kHelErrBadDescriptor;
-	auto cpu = wrapper->get<VirtualizedCpuDescriptor>();
-	auto info = cpu.vcpu->run();
+	smarter::shared_ptr<VirtualizedCpu> vcpu;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		Universe::ReadGuard universe_guard;
+
+		auto wrapper = this_universe->getDescriptor(universe_guard, handle);
+		if(!wrapper)
+			return kHelErrNoDescriptor;
+		if(!wrapper->is<VirtualizedCpuDescriptor>())
+			return kHelErrBadDescriptor;
+		vcpu = wrapper->get<VirtualizedCpuDescriptor>().vcpu;
+	}
+
+	// The guest can run for a long time; do not stay in the RCU read-side section.
+	auto info = vcpu->run();
 	if(!writeUserObject(exitInfo, info))
 		return kHelErrFault;
 
@@ -762,13 +824,17 @@ HelError helMapMemory(HelHandle memory_handle, HelHandle space_handle,
 	if(flags & kHelMapDontRequireBacking)
 		map_flags |= AddressSpace::kMapDontRequireBacking;
 
+	static_assert(static_cast<uint32_t>(kHelMapFaultAroundMask)
+			== static_cast<uint32_t>(AddressSpace::kMapFaultAroundMask));
+	map_flags |= flags & kHelMapFaultAroundMask;
+
 	smarter::shared_ptr<MemorySlice> slice;
 	smarter::shared_ptr<AddressSpace, BindableHandle> space;
 	smarter::shared_ptr<VirtualSpace> vspace;
 	bool isVspace = false;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto memory_wrapper = this_universe->getDescriptor(universe_guard, memory_handle);
 		if(!memory_wrapper)
@@ -822,6 +888,22 @@ HelError helMapMemory(HelHandle memory_handle, HelHandle space_handle,
 		return kHelErrBufferTooSmall;
 	}
 
+	if(flags & kHelMapPopulate) {
+		frg::expected<Error> populateOutcome;
+		if(!isVspace) {
+			populateOutcome = Thread::asyncBlockCurrent(space->populate(mapResult.value(),
+					length, this_thread->mainWorkQueue()->take()));
+		} else {
+			populateOutcome = Thread::asyncBlockCurrent(vspace->populate(mapResult.value(),
+					length, this_thread->mainWorkQueue()->take()));
+		}
+		// The mapping stays in place even if populating fails;
+		// the pages are then faulted in on demand (or the faults fail).
+		if(!populateOutcome && populateOutcome.error() != Error::fault)
+			infoLogger() << "thor: Failed to populate mapping at "
+					<< (void *)mapResult.value() << frg::endlog;
+	}
+
 	*actualPointer = (void *)mapResult.value();
 	return kHelErrNone;
 }
@@ -844,7 +926,7 @@ HelError helSubmitProtectMemory(HelHandle space_handle,
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		if(space_handle == kHelNullHandle) {
 			space = this_thread->getAddressSpace().lock();
@@ -874,10 +956,13 @@ HelError helSubmitProtectMemory(HelHandle space_handle,
 			uint32_t protectFlags, uintptr_t context,
 			enable_detached_coroutine = {}) -> void {
 		auto outcome = co_await space->protect(pointer, length, protectFlags);
-		// TODO: handle errors after propagating them through VirtualSpace::protect.
-		assert(outcome);
 
 		HelSimpleResult helResult{.error = kHelErrNone};
+		if(!outcome) {
+			// Mappings that forbid write access cannot be made writable.
+			assert(outcome.error() == Error::illegalArgs);
+			helResult.error = kHelErrIllegalArgs;
+		}
 		QueueSource ipcSource{&helResult, sizeof(HelSimpleResult), nullptr};
 		co_await queue->submit(&ipcSource, context);
 	}(std::move(space), std::move(queue), reinterpret_cast<VirtualAddr>(pointer),
@@ -886,6 +971,71 @@ HelError helSubmitProtectMemory(HelHandle space_handle,
 	return kHelErrNone;
 }
 
+HelError helSubmitPopulateMemory(HelHandle space_handle,
+		void *pointer, size_t length,
+		HelHandle queue_handle, uintptr_t context) {
+	if((uintptr_t)pointer % kPageSize != 0)
+		return kHelErrIllegalArgs;
+	if(length % kPageSize != 0)
+		return kHelErrIllegalArgs;
+
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	smarter::shared_ptr<AddressSpace, BindableHandle> space;
+	smarter::shared_ptr<IpcQueue> queue;
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::ReadGuard universe_guard;
+
+		if(space_handle == kHelNullHandle) {
+			space = this_thread->getAddressSpace().lock();
+		}else{
+			auto space_wrapper = this_universe->getDescriptor(universe_guard, space_handle);
+			if(!space_wrapper)
+				return kHelErrNoDescriptor;
+			if(!space_wrapper->is<AddressSpaceDescriptor>())
+				return kHelErrBadDescriptor;
+			space = space_wrapper->get<AddressSpaceDescriptor>().space;
+		}
+
+		auto queue_wrapper = this_universe->getDescriptor(universe_guard, queue_handle);
+		if(!queue_wrapper)
+			return kHelErrNoDescriptor;
+		if(!queue_wrapper->is<QueueDescriptor>())
+			return kHelErrBadDescriptor;
+		queue = queue_wrapper->get<QueueDescriptor>().queue;
+	}
+
+	if(!queue->validSize(ipcSourceSize(sizeof(HelSimpleResult))))
+		return kHelErrQueueTooSmall;
+
+	[](smarter::shared_ptr<AddressSpace, BindableHandle> space,
+			smarter::shared_ptr<IpcQueue> queue,
+			VirtualAddr pointer, size_t length,
+			uintptr_t context, smarter::shared_ptr<WorkQueue> wq,
+			enable_detached_coroutine = {}) -> void {
+		auto outcome = co_await space->populate(pointer, length, std::move(wq));
+
+		HelError error = kHelErrNone;
+		if(!outcome) {
+			if(outcome.error() == Error::noMemory) {
+				error = kHelErrNoMemory;
+			}else{
+				// Unmapped ranges as well as failing pagers.
+				error = kHelErrFault;
+			}
+		}
+
+		HelSimpleResult helResult{.error = error};
+		QueueSource ipcSource{&helResult, sizeof(HelSimpleResult), nullptr};
+		co_await queue->submit(&ipcSource, context);
+	}(std::move(space), std::move(queue), reinterpret_cast<VirtualAddr>(pointer),
+			length, context, this_thread->mainWorkQueue()->take());
+
+	return kHelErrNone;
+}
+
 HelError helUnmapMemory(HelHandle space_handle, void *pointer, size_t length) {
 	auto this_thread = getCurrentThread();
 	auto this_universe = this_thread->getUniverse();
@@ -893,7 +1043,7 @@ HelError helUnmapMemory(HelHandle space_handle, void *pointer, size_t length) {
 	smarter::shared_ptr<AddressSpace, BindableHandle> space;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		if(space_handle == kHelNullHandle) {
 			space = this_thread->getAddressSpace().lock();
@@ -925,7 +1075,7 @@ HelError helSubmitSynchronizeSpace(HelHandle spaceHandle, void *pointer, size_t
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irqLock = frg::guard(&irqMutex());
-		Universe::Guard universeGuard(thisUniverse->lock);
+		Universe::ReadGuard universeGuard;
 
 		if(spaceHandle == kHelNullHandle) {
 			space = thisThread->getAddressSpace().lock();
@@ -991,7 +1141,7 @@ HelError helSubmitReadMemory(HelHandle handle, uintptr_t address,
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universeGuard(thisUniverse->lock);
+		Universe::ReadGuard universeGuard;
 
 		auto wrapper = thisUniverse->getDescriptor(universeGuard, handle);
 		if(!wrapper)
@@ -1148,7 +1298,7 @@ HelError helSubmitWriteMemory(HelHandle handle, uintptr_t address,
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irqLock = frg::guard(&irqMutex());
-		Universe::Guard universeGuard(thisUniverse->lock);
+		Universe::ReadGuard universeGuard;
 
 		auto wrapper = thisUniverse->getDescriptor(universeGuard, handle);
 		if(!wrapper)
@@ -1296,6 +1446,129 @@ HelError helSubmitWriteMemory(HelHandle handle, uintptr_t address,
 	return kHelErrNone;
 }
 
+namespace {
+
+// Implements helSubmitReadMemoryVector() and helSubmitWriteMemoryVector().
+HelError submitMemoryVector(HelHandle handle, const HelRemoteRange *ranges,
+		size_t count, bool write, HelHandle queueHandle, uintptr_t context) {
+	auto thisThread = getCurrentThread();
+	auto thisUniverse = thisThread->getUniverse();
+
+	if(count > kHelMaxRemoteRanges)
+		return kHelErrIllegalArgs;
+
+	frg::vector<HelRemoteRange, KernelAlloc> rangeVector{*kernelAlloc};
+	rangeVector.resize(count);
+	if(!readUserArray(ranges, rangeVector.data(), count))
+		return kHelErrFault;
+	// Make sure that the pointer arithmetic below does not overflow.
+	for(size_t i = 0; i < count; i++) {
+		uintptr_t limit;
+		if(__builtin_add_overflow(reinterpret_cast<uintptr_t>(rangeVector[i].buffer),
+					rangeVector[i].length, &limit)
+				|| __builtin_add_overflow(rangeVector[i].address,
+					rangeVector[i].length, &limit))
+			return kHelErrIllegalArgs;
+	}
+
+	smarter::shared_ptr<AddressSpace, BindableHandle> space;
+	smarter::shared_ptr<IpcQueue> queue;
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::ReadGuard universeGuard;
+
+		auto wrapper = thisUniverse->getDescriptor(universeGuard, handle);
+		if(!wrapper)
+			return kHelErrNoDescriptor;
+		if(wrapper->is<AddressSpaceDescriptor>()) {
+			space = wrapper->get<AddressSpaceDescriptor>().space;
+		}else if(wrapper->is<ThreadDescriptor>()) {
+			space = wrapper->get<ThreadDescriptor>().thread->getAddressSpace().lock();
+		}else{
+			return kHelErrBadDescriptor;
+		}
+
+		auto queueWrapper = thisUniverse->getDescriptor(universeGuard, queueHandle);
+		if(!queueWrapper)
+			return kHelErrNoDescriptor;
+		if(!queueWrapper->is<QueueDescriptor>())
+			return kHelErrBadDescriptor;
+		queue = queueWrapper->get<QueueDescriptor>().queue;
+	}
+
+	// All ranges are processed by a single coroutine, i.e., the caller pays for
+	// a single submission and a single completion regardless of the number of ranges.
+	[] (smarter::shared_ptr<Thread> submitThread,
+			smarter::shared_ptr<AddressSpace, BindableHandle> space,
+			frg::vector<HelRemoteRange, KernelAlloc> ranges, bool write,
+			smarter::shared_ptr<IpcQueue> queue, uintptr_t context,
+			enable_detached_coroutine = {}) -> void {
+		Error error = Error::success;
+		size_t progress = 0;
+		char temp[128];
+		for(size_t i = 0; i < ranges.size() && error == Error::success; i++) {
+			auto &range = ranges[i];
+			for(size_t offset = 0; offset < range.length; ) {
+				auto chunk = frg::min(range.length - offset, size_t{128});
+				auto local = reinterpret_cast<char *>(range.buffer) + offset;
+
+				if(write) {
+					// Enter the submitter's work-queue so that we can access memory directly.
+					co_await submitThread->mainWorkQueue()->schedule();
+					if(!readUserMemory(temp, local, chunk)) {
+						error = Error::fault;
+						break;
+					}
+
+					auto outcome = co_await space->writeSpace(range.address + offset,
+							temp, chunk, submitThread->mainWorkQueue()->take());
+					if(!outcome) {
+						error = Error::fault;
+						break;
+					}
+				}else{
+					auto outcome = co_await space->readSpace(range.address + offset,
+							temp, chunk, submitThread->mainWorkQueue()->take());
+					if(!outcome) {
+						error = Error::fault;
+						break;
+					}
+
+					co_await submitThread->mainWorkQueue()->schedule();
+					if(!writeUserMemory(local, temp, chunk)) {
+						error = Error::fault;
+						break;
+					}
+				}
+				offset += chunk;
+				progress += chunk;
+			}
+		}
+
+		HelLengthResult helResult{
+			.error = progress ? kHelErrNone : translateError(error),
+			.length = progress
+		};
+		QueueSource ipcSource{&helResult, sizeof(HelLengthResult), nullptr};
+		co_await queue->submit(&ipcSource, context);
+	}(thisThread.lock(), std::move(space), std::move(rangeVector), write,
+			std::move(queue), context);
+
+	return kHelErrNone;
+}
+
+} // anonymous namespace
+
+HelError helSubmitReadMemoryVector(HelHandle handle, const HelRemoteRange *ranges,
+		size_t count, HelHandle queueHandle, uintptr_t context) {
+	return submitMemoryVector(handle, ranges, count, false, queueHandle, context);
+}
+
+HelError helSubmitWriteMemoryVector(HelHandle handle, const HelRemoteRange *ranges,
+		size_t count, HelHandle queueHandle, uintptr_t context) {
+	return submitMemoryVector(handle, ranges, count, true, queueHandle, context);
+}
+
 HelError helMemoryInfo(HelHandle handle, size_t *size) {
 	auto this_thread = getCurrentThread();
 	auto this_universe = this_thread->getUniverse();
@@ -1303,7 +1576,7 @@ HelError helMemoryInfo(HelHandle handle, size_t *size) {
 	smarter::shared_ptr<MemoryView> memory;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!wrapper)
@@ -1325,7 +1598,7 @@ HelError helSubmitManageMemory(HelHandle handle, HelHandle queue_handle, uintptr
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto memory_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!memory_wrapper)
@@ -1379,7 +1652,7 @@ HelError helUpdateMemory(HelHandle handle, int type,
 	smarter::shared_ptr<MemoryView> memory;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto memory_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!memory_wrapper)
@@ -1417,7 +1690,7 @@ HelError helSubmitLockMemoryView(HelHandle handle, uintptr_t offset, size_t size
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto memory_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!memory_wrapper)
@@ -1493,7 +1766,7 @@ HelError helLoadahead(HelHandle handle, uintptr_t offset, size_t length) {
 	smarter::shared_ptr<MemoryView> memory;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto memory_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!memory_wrapper)
@@ -1503,13 +1776,40 @@ HelError helLoadahead(HelHandle handle, uintptr_t offset, size_t length) {
 		memory = memory_wrapper->get<MemoryViewDescriptor>().memory;
 	}
 
-/*	auto handle_load = smarter::allocate_shared<AsyncInitiateLoad>(*kernelAlloc,
-			NullCompleter(), offset, length);
+	memory->loadahead(offset, length);
+
+	return kHelErrNone;
+}
+
+HelError helQueryWriteback(HelHandle handle, uintptr_t offset, size_t length, size_t *count) {
+	if(offset % kPageSize || length % kPageSize)
+		return kHelErrIllegalArgs;
+
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	smarter::shared_ptr<MemoryView> memory;
 	{
-		// TODO: protect memory object with a guard
-		memory->submitInitiateLoad(std::move(handle_load));
-	}*/
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::ReadGuard universe_guard;
+
+		auto memory_wrapper = this_universe->getDescriptor(universe_guard, handle);
+		if(!memory_wrapper)
+			return kHelErrNoDescriptor;
+		if(!memory_wrapper->is<MemoryViewDescriptor>())
+			return kHelErrBadDescriptor;
+		memory = memory_wrapper->get<MemoryViewDescriptor>().memory;
+	}
+
+	auto result = memory->countWriteback(offset, length);
+	if(!result) {
+		if(result.error() == Error::illegalObject)
+			return kHelErrUnsupportedOperation;
+		assert(result.error() == Error::illegalArgs);
+		return kHelErrIllegalArgs;
+	}
 
+	*count = result.value();
 	return kHelErrNone;
 }
 
@@ -1528,7 +1828,7 @@ HelError helCreateThread(HelHandle universe_handle, HelHandle space_handle,
 	smarter::shared_ptr<AddressSpace, BindableHandle> space;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		if(universe_handle == kHelNullHandle) {
 			universe = this_thread->getUniverse().lock();
@@ -1588,7 +1888,7 @@ HelError helQueryThreadStats(HelHandle handle, HelThreadStats *user_stats) {
 		thread = this_thread.lock();
 	}else{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto thread_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!thread_wrapper)
@@ -1601,6 +1901,18 @@ HelError helQueryThreadStats(HelHandle handle, HelThreadStats *user_stats) {
 	HelThreadStats stats;
 	memset(&stats, 0, sizeof(HelThreadStats));
 	stats.userTime = thread->runTime();
+	stats.waitTime = thread->waitTime();
+	stats.numTimeslices = thread->numTimeslices();
+	stats.numVoluntarySwitches = thread->numVoluntarySwitches();
+	stats.numInvoluntarySwitches = thread->numInvoluntarySwitches();
+	stats.numMigrations = thread->numMigrations();
+	static_assert(kHelNumWakeupLatencyBuckets == numWakeupLatencyBuckets);
+	for(int i = 0; i < numWakeupLatencyBuckets; i++)
+		stats.wakeupLatency[i] = thread->wakeupLatencyBucket(i);
+	stats.numSimdSaves = thread->_executor.numSimdSaves();
+	stats.numSimdRestores = thread->_executor.numSimdRestores();
+	stats.numSimdTraps = thread->_executor.numSimdTraps();
+	stats.numDeadlineThrottles = thread->numThrottles();
 
 	if(!writeUserObject(user_stats, stats))
 		return kHelErrFault;
@@ -1617,7 +1929,7 @@ HelError helSetPriority(HelHandle handle, int priority) {
 		thread = this_thread.lock();
 	}else{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto thread_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!thread_wrapper)
@@ -1632,6 +1944,23 @@ HelError helSetPriority(HelHandle handle, int priority) {
 	return kHelErrNone;
 }
 
+HelError helSetDeadline(HelHandle thread, uint64_t runtime, uint64_t deadline, uint64_t period) {
+	// Scheduler::setDeadline() can only change the current entity.
+	if(thread != kHelThisThread)
+		return kHelErrIllegalArgs;
+
+	if(!runtime) {
+		if(deadline || period)
+			return kHelErrIllegalArgs;
+	}else if(runtime > deadline || deadline > period) {
+		return kHelErrIllegalArgs;
+	}
+
+	if(!Scheduler::setDeadline(getCurrentThread().get(), runtime, deadline, period))
+		return kHelErrIllegalState;
+	return kHelErrNone;
+}
+
 HelError helYield() {
 	Thread::deferCurrent();
 
@@ -1647,7 +1976,7 @@ HelError helSubmitObserve(HelHandle handle, uint64_t inSeq,
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irqLock = frg::guard(&irqMutex());
-		Universe::Guard universeGuard(thisUniverse->lock);
+		Universe::ReadGuard universeGuard;
 
 		auto threadWrapper = thisUniverse->getDescriptor(universeGuard, handle);
 		if(!threadWrapper)
@@ -1706,7 +2035,7 @@ HelError helKillThread(HelHandle handle) {
 	smarter::shared_ptr<Thread> thread;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto thread_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!thread_wrapper)
@@ -1728,7 +2057,7 @@ HelError helInterruptThread(HelHandle handle) {
 	smarter::shared_ptr<Thread> thread;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto thread_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!thread_wrapper)
@@ -1750,7 +2079,7 @@ HelError helResume(HelHandle handle) {
 	smarter::shared_ptr<Thread> thread;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto thread_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!thread_wrapper)
@@ -1778,7 +2107,7 @@ HelError helLoadRegisters(HelHandle handle, int set, void *image) {
 	VirtualizedCpuDescriptor vcpu;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto thread_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!thread_wrapper)
@@ -1890,7 +2219,7 @@ HelError helStoreRegisters(HelHandle handle, int set, const void *image) {
 		thread = this_thread.lock();
 	}else{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto thread_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!thread_wrapper)
@@ -2012,29 +2341,64 @@ HelError helGetClock(uint64_t *counter) {
 	return kHelErrNone;
 }
 
-HelError helSubmitAwaitClock(uint64_t counter, HelHandle queue_handle, uintptr_t context,
-		uint64_t *async_id) {
-	struct Closure final : CancelNode, PrecisionTimerNode, IpcNode {
-		static void issue(uint64_t nanos, smarter::shared_ptr<IpcQueue> queue,
-				uintptr_t context, uint64_t *async_id) {
-			auto closure = frg::construct<Closure>(*kernelAlloc, nanos,
-					std::move(queue), context);
-			closure->queue->registerNode(closure);
-			*async_id = closure->asyncId();
-			generalTimerEngine()->installTimer(closure);
-		}
+HelError helMapClockPage(HelHandle spaceHandle, void **pointer) {
+	auto thisThread = getCurrentThread();
+	auto thisUniverse = thisThread->getUniverse();
 
-		static void elapsed(Worklet *worklet) {
-			auto closure = frg::container_of(worklet, &Closure::worklet);
-			if(closure->wasCancelled())
-				closure->result.error = kHelErrCancelled;
-			closure->queue->unregisterNode(closure);
-			closure->queue->submit(closure);
-		}
+	smarter::shared_ptr<AddressSpace, BindableHandle> space;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		Universe::ReadGuard universeGuard;
 
-		explicit Closure(uint64_t nanos, smarter::shared_ptr<IpcQueue> the_queue,
-				uintptr_t context)
-		: queue{std::move(the_queue)},
+		if(spaceHandle == kHelNullHandle) {
+			space = thisThread->getAddressSpace().lock();
+		}else{
+			auto spaceWrapper = thisUniverse->getDescriptor(universeGuard, spaceHandle);
+			if(!spaceWrapper)
+				return kHelErrNoDescriptor;
+			if(!spaceWrapper->is<AddressSpaceDescriptor>())
+				return kHelErrBadDescriptor;
+			space = spaceWrapper->get<AddressSpaceDescriptor>().space;
+		}
+	}
+
+	auto slice = smarter::allocate_shared<MemorySlice>(*kernelAlloc,
+			getClockPageMemory(), 0, kPageSize);
+	auto mapResult = Thread::asyncBlockCurrent(space->map(slice, 0, 0, kPageSize,
+			AddressSpace::kMapPreferTop | AddressSpace::kMapProtRead
+			| AddressSpace::kMapForbidWrite));
+	if(!mapResult) {
+		assert(mapResult.error() == Error::bufferTooSmall);
+		return kHelErrBufferTooSmall;
+	}
+
+	*pointer = reinterpret_cast<void *>(mapResult.value());
+	return kHelErrNone;
+}
+
+HelError helSubmitAwaitClock(uint64_t counter, HelHandle queue_handle, uintptr_t context,
+		uint64_t *async_id) {
+	struct Closure final : CancelNode, PrecisionTimerNode, IpcNode {
+		static void issue(uint64_t nanos, smarter::shared_ptr<IpcQueue> queue,
+				uintptr_t context, uint64_t *async_id) {
+			auto closure = frg::construct<Closure>(*kernelAlloc, nanos,
+					std::move(queue), context);
+			closure->queue->registerNode(closure);
+			*async_id = closure->asyncId();
+			generalTimerEngine()->installTimer(closure);
+		}
+
+		static void elapsed(Worklet *worklet) {
+			auto closure = frg::container_of(worklet, &Closure::worklet);
+			if(closure->wasCancelled())
+				closure->result.error = kHelErrCancelled;
+			closure->queue->unregisterNode(closure);
+			closure->queue->submit(closure);
+		}
+
+		explicit Closure(uint64_t nanos, smarter::shared_ptr<IpcQueue> the_queue,
+				uintptr_t context)
+		: queue{std::move(the_queue)},
 				source{&result, sizeof(HelSimpleResult), nullptr},
 				result{translateError(Error::success), 0} {
 			setupContext(context);
@@ -2042,6 +2406,7 @@ HelError helSubmitAwaitClock(uint64_t counter, HelHandle queue_handle, uintptr_t
 
 			worklet.setup(&Closure::elapsed, getCurrentThread()->mainWorkQueue());
 			PrecisionTimerNode::setup(nanos, cancelEvent, &worklet);
+			PrecisionTimerNode::setSlack(getCurrentThread()->timerSlack());
 		}
 
 		void handleCancellation() override {
@@ -2065,7 +2430,7 @@ HelError helSubmitAwaitClock(uint64_t counter, HelHandle queue_handle, uintptr_t
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto queue_wrapper = this_universe->getDescriptor(universe_guard, queue_handle);
 		if(!queue_wrapper)
@@ -2101,38 +2466,44 @@ HelError helCreateStream(HelHandle *lane1_handle, HelHandle *lane2_handle) {
 	return kHelErrNone;
 }
 
-HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count,
-		HelHandle queueHandle, uintptr_t context, uint32_t flags) {
-	if(flags)
-		return kHelErrIllegalArgs;
-	if(!count)
-		return kHelErrIllegalArgs;
+namespace {
 
-	auto thisThread = getCurrentThread();
-	auto thisUniverse = thisThread->getUniverse();
+// Looks up the lane and queue descriptors for helSubmitAsync() and helSubmitAsyncBatch().
+HelError lookupLaneAndQueue(HelHandle handle, HelHandle queueHandle,
+		LaneHandle &lane, smarter::shared_ptr<IpcQueue> *queue) {
+	auto thisUniverse = getCurrentThread()->getUniverse();
 
-	LaneHandle lane;
-	smarter::shared_ptr<IpcQueue> queue;
-	{
-		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(thisUniverse->lock);
+	auto irq_lock = frg::guard(&irqMutex());
+	Universe::ReadGuard universe_guard;
 
-		auto wrapper = thisUniverse->getDescriptor(universe_guard, handle);
-		if(!wrapper)
-			return kHelErrNoDescriptor;
-		if(wrapper->is<LaneDescriptor>()) {
-			lane = wrapper->get<LaneDescriptor>().handle;
-		}else{
-			return kHelErrBadDescriptor;
-		}
+	auto wrapper = thisUniverse->getDescriptor(universe_guard, handle);
+	if(!wrapper)
+		return kHelErrNoDescriptor;
+	if(wrapper->is<LaneDescriptor>()) {
+		lane = wrapper->get<LaneDescriptor>().handle;
+	}else{
+		return kHelErrBadDescriptor;
+	}
 
+	if(queue) {
 		auto queueWrapper = thisUniverse->getDescriptor(universe_guard, queueHandle);
 		if(!queueWrapper)
 			return kHelErrNoDescriptor;
 		if(!queueWrapper->is<QueueDescriptor>())
 			return kHelErrBadDescriptor;
-		queue = queueWrapper->get<QueueDescriptor>().queue;
+		*queue = queueWrapper->get<QueueDescriptor>().queue;
 	}
+	return kHelErrNone;
+}
+
+// Submits a chain of actions to a lane. Shared by helSubmitAsync() and helSubmitAsyncBatch().
+HelError submitActions(LaneHandle lane, const HelAction *actions, size_t count,
+		smarter::shared_ptr<IpcQueue> queue, uintptr_t context) {
+	if(!count)
+		return kHelErrIllegalArgs;
+
+	auto thisThread = getCurrentThread();
+	auto thisUniverse = thisThread->getUniverse();
 
 	struct Item {
 		HelAction recipe;
@@ -2149,7 +2520,168 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 		};
 	};
 
-	frg::dyn_array<Item, KernelAlloc> items{count, *kernelAlloc};
+	struct Closure final : StreamPacket, IpcNode {
+		static void transmitted(Closure *closure) {
+			QueueSource *tail = nullptr;
+			auto link = [&] (QueueSource *source) {
+				if(tail)
+					tail->link = source;
+				tail = source;
+			};
+
+			for(size_t i = 0; i < closure->count; i++) {
+				auto item = &closure->items[i];
+				HelAction *recipe = &item->recipe;
+				auto node = &item->transmit;
+
+				if(recipe->type == kHelActionDismiss) {
+					item->helSimpleResult = {translateError(node->error()), 0};
+					item->mainSource.setup(&item->helSimpleResult, sizeof(HelSimpleResult));
+					link(&item->mainSource);
+				}else if(recipe->type == kHelActionOffer) {
+					HelHandle handle = kHelNullHandle;
+
+					if(node->error() == Error::success
+							&& (recipe->flags & kHelItemWantLane)) {
+						auto universe = closure->weakUniverse.lock();
+						assert(universe);
+
+						auto irq_lock = frg::guard(&irqMutex());
+						Universe::Guard lock(universe->lock);
+
+						handle = universe->attachDescriptor(lock,
+								LaneDescriptor{node->lane()});
+					}
+
+					item->helHandleResult = {translateError(node->error()), 0, handle};
+					item->mainSource.setup(&item->helSimpleResult, sizeof(HelHandleResult));
+					link(&item->mainSource);
+				}else if(recipe->type == kHelActionAccept) {
+					// TODO: This condition should be replaced. Just test if lane is valid.
+					HelHandle handle = kHelNullHandle;
+					if(node->error() == Error::success) {
+						auto universe = closure->weakUniverse.lock();
+						assert(universe);
+
+						auto irq_lock = frg::guard(&irqMutex());
+						Universe::Guard lock(universe->lock);
+
+						handle = universe->attachDescriptor(lock,
+								LaneDescriptor{node->lane()});
+					}
+
+					item->helHandleResult = {translateError(node->error()), 0, handle};
+					item->mainSource.setup(&item->helHandleResult, sizeof(HelHandleResult));
+					link(&item->mainSource);
+				}else if(recipe->type == kHelActionImbueCredentials) {
+					item->helSimpleResult = {translateError(node->error()), 0};
+					item->mainSource.setup(&item->helSimpleResult, sizeof(HelSimpleResult));
+					link(&item->mainSource);
+				}else if(recipe->type == kHelActionExtractCredentials) {
+					item->helCredentialsResult = {.error = translateError(node->error())};
+					memcpy(item->helCredentialsResult.credentials,
+							node->credentials().data(), 16);
+					item->mainSource.setup(&item->helCredentialsResult,
+							sizeof(HelCredentialsResult));
+					link(&item->mainSource);
+				}else if(recipe->type == kHelActionSendFromBuffer
+						|| recipe->type == kHelActionSendFromBufferSg) {
+					item->helSimpleResult = {translateError(node->error()), 0};
+					item->mainSource.setup(&item->helSimpleResult, sizeof(HelSimpleResult));
+					link(&item->mainSource);
+				}else if(recipe->type == kHelActionRecvInline) {
+					item->helInlineResult = {translateError(node->error()),
+							0, node->_transmitBuffer.size()};
+					item->mainSource.setup(&item->helInlineResult, sizeof(HelInlineResultNoFlex));
+					item->dataSource.setup(node->_transmitBuffer.data(),
+							node->_transmitBuffer.size());
+					link(&item->mainSource);
+					link(&item->dataSource);
+				}else if(recipe->type == kHelActionRecvToBuffer) {
+					item->helLengthResult = {translateError(node->error()),
+							0, node->actualLength()};
+					item->mainSource.setup(&item->helLengthResult, sizeof(HelLengthResult));
+					link(&item->mainSource);
+				}else if(recipe->type == kHelActionPushDescriptor) {
+					item->helSimpleResult = {translateError(node->error()), 0};
+					item->mainSource.setup(&item->helSimpleResult, sizeof(HelSimpleResult));
+					link(&item->mainSource);
+				}else if(recipe->type == kHelActionPullDescriptor) {
+					// TODO: This condition should be replaced. Just test if lane is valid.
+					HelHandle handle = kHelNullHandle;
+					if(node->error() == Error::success) {
+						auto universe = closure->weakUniverse.lock();
+						assert(universe);
+
+						auto irq_lock = frg::guard(&irqMutex());
+						Universe::Guard lock(universe->lock);
+
+						handle = universe->attachDescriptor(lock, node->descriptor());
+					}
+
+					item->helHandleResult = {translateError(node->error()), 0, handle};
+					item->mainSource.setup(&item->helHandleResult, sizeof(HelHandleResult));
+					link(&item->mainSource);
+				}else{
+					// This cannot happen since we validate recipes at submit time.
+					__builtin_trap();
+				}
+			}
+
+			closure->setupSource(&closure->items[0].mainSource);
+			closure->ipcQueue->submit(closure);
+		}
+
+		// The closure and its items live in a single block that is obtained from
+		// (and returned to) the IpcQueue's closure cache.
+		static Closure *create(IpcQueue *queue, size_t count) {
+			auto size = itemsOffset() + count * sizeof(Item);
+			auto closure = new (queue->allocateClosure(size)) Closure;
+			closure->count = count;
+			closure->blockSize = size;
+			closure->items = reinterpret_cast<Item *>(
+					reinterpret_cast<char *>(closure) + itemsOffset());
+			for(size_t i = 0; i < count; i++)
+				new (&closure->items[i]) Item{};
+			return closure;
+		}
+
+		static void destroy(Closure *closure) {
+			// The closure may hold the last reference to the queue.
+			auto queue = std::move(closure->ipcQueue);
+			auto size = closure->blockSize;
+			for(size_t i = 0; i < closure->count; i++)
+				closure->items[i].~Item();
+			closure->~Closure();
+			queue->freeClosure(closure, size);
+		}
+
+		static constexpr size_t itemsOffset() {
+			return (sizeof(Closure) + alignof(Item) - 1) & ~(alignof(Item) - 1);
+		}
+
+		void completePacket() override {
+			transmitted(this);
+		}
+
+		void complete() override {
+			destroy(this);
+		}
+
+		size_t count;
+		size_t blockSize;
+		smarter::weak_ptr<Universe> weakUniverse;
+		smarter::shared_ptr<IpcQueue> ipcQueue;
+		Item *items;
+	};
+
+	auto closure = Closure::create(queue.get(), count);
+	auto items = closure->items;
+	auto fail = [&] (HelError error) {
+		closure->ipcQueue = queue;
+		Closure::destroy(closure);
+		return error;
+	};
 
 	// Identifies the root chain on the stack below.
 	constexpr size_t noIndex = static_cast<size_t>(-1);
@@ -2195,7 +2727,7 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 					frg::unique_memory<KernelAlloc> buffer(*kernelAlloc, recipe->length);
 					if(!readUserMemory(reinterpret_cast<char *>(buffer.data()),
 							reinterpret_cast<char *>(recipe->buffer), recipe->length))
-						return kHelErrFault;
+						return fail(kHelErrFault);
 
 					node->_tag = kTagSendKernelBuffer;
 					node->_inBuffer = std::move(buffer);
@@ -2222,7 +2754,7 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 					readUserObject(sglist + j, item);
 					if(!readUserMemory(reinterpret_cast<char *>(buffer.data()) + offset,
 							reinterpret_cast<char *>(item.buffer), item.length))
-						return kHelErrFault;
+						return fail(kHelErrFault);
 					offset += item.length;
 				}
 
@@ -2231,13 +2763,19 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 				ipcSize += ipcSourceSize(sizeof(HelSimpleResult));
 				break;
 			}
-			case kHelActionRecvInline:
-				// TODO: For now, we hardcode a size of 128 bytes.
+			case kHelActionRecvInline: {
+				size_t maxLength = recipe->length;
+				if(!maxLength)
+					maxLength = kHelRecvInlineDefault;
+				if(maxLength > kHelRecvInlineMax)
+					return fail(kHelErrIllegalArgs);
+
 				node->_tag = kTagRecvKernelBuffer;
-				node->_maxLength = 128;
+				node->_maxLength = maxLength;
 				ipcSize += ipcSourceSize(sizeof(HelLengthResult));
-				ipcSize += ipcSourceSize(128);
+				ipcSize += ipcSourceSize(maxLength);
 				break;
+			}
 			case kHelActionRecvToBuffer:
 				node->_tag = kTagRecvFlow;
 				node->_maxLength = recipe->length;
@@ -2248,11 +2786,11 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 				AnyDescriptor operand;
 				{
 					auto irq_lock = frg::guard(&irqMutex());
-					Universe::Guard universe_guard(thisUniverse->lock);
+					Universe::ReadGuard universe_guard;
 
 					auto wrapper = thisUniverse->getDescriptor(universe_guard, recipe->handle);
 					if(!wrapper)
-						return kHelErrNoDescriptor;
+						return fail(kHelErrNoDescriptor);
 					operand = *wrapper;
 				}
 
@@ -2266,12 +2804,12 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 				ipcSize += ipcSourceSize(sizeof(HelHandleResult));
 				break;
 			default:
-				return kHelErrIllegalArgs;
+				return fail(kHelErrIllegalArgs);
 		}
 
 		// Items at the root must be chained.
 		if(linkStack.empty())
-			return kHelErrIllegalArgs;
+			return fail(kHelErrIllegalArgs);
 
 		items[i].link = linkStack.back();
 
@@ -2283,144 +2821,14 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 
 	// All chains must terminate properly.
 	if(!linkStack.empty())
-		return kHelErrIllegalArgs;
+		return fail(kHelErrIllegalArgs);
 
 	if(!queue->validSize(ipcSize))
-		return kHelErrQueueTooSmall;
+		return fail(kHelErrQueueTooSmall);
 
 	// From this point on, the function must not fail, since we now link our items
 	// into intrusive linked lists.
 
-	struct Closure final : StreamPacket, IpcNode {
-		static void transmitted(Closure *closure) {
-			QueueSource *tail = nullptr;
-			auto link = [&] (QueueSource *source) {
-				if(tail)
-					tail->link = source;
-				tail = source;
-			};
-
-			for(size_t i = 0; i < closure->count; i++) {
-				auto item = &closure->items[i];
-				HelAction *recipe = &item->recipe;
-				auto node = &item->transmit;
-
-				if(recipe->type == kHelActionDismiss) {
-					item->helSimpleResult = {translateError(node->error()), 0};
-					item->mainSource.setup(&item->helSimpleResult, sizeof(HelSimpleResult));
-					link(&item->mainSource);
-				}else if(recipe->type == kHelActionOffer) {
-					HelHandle handle = kHelNullHandle;
-
-					if(node->error() == Error::success
-							&& (recipe->flags & kHelItemWantLane)) {
-						auto universe = closure->weakUniverse.lock();
-						assert(universe);
-
-						auto irq_lock = frg::guard(&irqMutex());
-						Universe::Guard lock(universe->lock);
-
-						handle = universe->attachDescriptor(lock,
-								LaneDescriptor{node->lane()});
-					}
-
-					item->helHandleResult = {translateError(node->error()), 0, handle};
-					item->mainSource.setup(&item->helSimpleResult, sizeof(HelHandleResult));
-					link(&item->mainSource);
-				}else if(recipe->type == kHelActionAccept) {
-					// TODO: This condition should be replaced. Just test if lane is valid.
-					HelHandle handle = kHelNullHandle;
-					if(node->error() == Error::success) {
-						auto universe = closure->weakUniverse.lock();
-						assert(universe);
-
-						auto irq_lock = frg::guard(&irqMutex());
-						Universe::Guard lock(universe->lock);
-
-						handle = universe->attachDescriptor(lock,
-								LaneDescriptor{node->lane()});
-					}
-
-					item->helHandleResult = {translateError(node->error()), 0, handle};
-					item->mainSource.setup(&item->helHandleResult, sizeof(HelHandleResult));
-					link(&item->mainSource);
-				}else if(recipe->type == kHelActionImbueCredentials) {
-					item->helSimpleResult = {translateError(node->error()), 0};
-					item->mainSource.setup(&item->helSimpleResult, sizeof(HelSimpleResult));
-					link(&item->mainSource);
-				}else if(recipe->type == kHelActionExtractCredentials) {
-					item->helCredentialsResult = {.error = translateError(node->error())};
-					memcpy(item->helCredentialsResult.credentials,
-							node->credentials().data(), 16);
-					item->mainSource.setup(&item->helCredentialsResult,
-							sizeof(HelCredentialsResult));
-					link(&item->mainSource);
-				}else if(recipe->type == kHelActionSendFromBuffer
-						|| recipe->type == kHelActionSendFromBufferSg) {
-					item->helSimpleResult = {translateError(node->error()), 0};
-					item->mainSource.setup(&item->helSimpleResult, sizeof(HelSimpleResult));
-					link(&item->mainSource);
-				}else if(recipe->type == kHelActionRecvInline) {
-					item->helInlineResult = {translateError(node->error()),
-							0, node->_transmitBuffer.size()};
-					item->mainSource.setup(&item->helInlineResult, sizeof(HelInlineResultNoFlex));
-					item->dataSource.setup(node->_transmitBuffer.data(),
-							node->_transmitBuffer.size());
-					link(&item->mainSource);
-					link(&item->dataSource);
-				}else if(recipe->type == kHelActionRecvToBuffer) {
-					item->helLengthResult = {translateError(node->error()),
-							0, node->actualLength()};
-					item->mainSource.setup(&item->helLengthResult, sizeof(HelLengthResult));
-					link(&item->mainSource);
-				}else if(recipe->type == kHelActionPushDescriptor) {
-					item->helSimpleResult = {translateError(node->error()), 0};
-					item->mainSource.setup(&item->helSimpleResult, sizeof(HelSimpleResult));
-					link(&item->mainSource);
-				}else if(recipe->type == kHelActionPullDescriptor) {
-					// TODO: This condition should be replaced. Just test if lane is valid.
-					HelHandle handle = kHelNullHandle;
-					if(node->error() == Error::success) {
-						auto universe = closure->weakUniverse.lock();
-						assert(universe);
-
-						auto irq_lock = frg::guard(&irqMutex());
-						Universe::Guard lock(universe->lock);
-
-						handle = universe->attachDescriptor(lock, node->descriptor());
-					}
-
-					item->helHandleResult = {translateError(node->error()), 0, handle};
-					item->mainSource.setup(&item->helHandleResult, sizeof(HelHandleResult));
-					link(&item->mainSource);
-				}else{
-					// This cannot happen since we validate recipes at submit time.
-					__builtin_trap();
-				}
-			}
-
-			closure->setupSource(&closure->items[0].mainSource);
-			closure->ipcQueue->submit(closure);
-		}
-
-		Closure(frg::dyn_array<Item, KernelAlloc> items_)
-		: items{std::move(items_)} { }
-
-		void completePacket() override {
-			transmitted(this);
-		}
-
-		void complete() override {
-			frg::destruct(*kernelAlloc, this);
-		}
-
-		size_t count;
-		smarter::weak_ptr<Universe> weakUniverse;
-		smarter::shared_ptr<IpcQueue> ipcQueue;
-		frg::dyn_array<Item, KernelAlloc> items;
-	} *closure = frg::construct<Closure>(*kernelAlloc, std::move(items));
-
-	closure->count = count;
 	closure->weakUniverse = thisUniverse.lock();
 	closure->ipcQueue = std::move(queue);
 
@@ -2453,6 +2861,14 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 
 		// The size of this array must be a power of two.
 		frg::array<frg::unique_memory<KernelAlloc>, 2> xferBuffers;
+		// For large transfers, we send pages of the sender instead of xferBuffers.
+		// Each page stays locked until the receiver acks the corresponding packet.
+		frg::array<LockedPage, 2> lockedPages;
+		auto releaseLockedPage = [&] (size_t seq) {
+			auto &lp = lockedPages[seq & (lockedPages.size() - 1)];
+			if(lp.mapping)
+				VirtualSpace::unlockPage(lp);
+		};
 
 		size_t i = 0;
 		size_t seenFlows = 0; // Iterates through flows.
@@ -2518,6 +2934,7 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 						assert(ackPacket);
 						if(ackPacket->fault)
 							anyRemoteFault = true;
+						releaseLockedPage(numAcked);
 						++numAcked;
 					}
 
@@ -2541,6 +2958,7 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 						while(numSent != numAcked) {
 							auto ackPacket = co_await node->flowQueue.async_get();
 							assert(ackPacket);
+							releaseLockedPage(numAcked);
 							++numAcked;
 						}
 
@@ -2550,16 +2968,39 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 
 					// Prepare a buffer an send it.
 					assert(numSent - numAcked < xferBuffers.size());
-					auto &xb = xferBuffers[numSent & (xferBuffers.size() - 1)];
-					if(!xb.size())
-						xb = frg::unique_memory<KernelAlloc>{*kernelAlloc, 4096};
+					void *chunkData;
+					size_t chunkSize;
+					bool outcome;
+					if(recipe->length >= zeroCopyThreshold) {
+						// Lock the page and let the receiver copy out of it directly.
+						auto address = reinterpret_cast<uintptr_t>(recipe->buffer) + progress;
+						auto misalign = address & (kPageSize - 1);
+						chunkSize = frg::min(recipe->length - progress, kPageSize - misalign);
+
+						auto lockOutcome = co_await thread->getAddressSpace()->lockPage(address,
+								MappingFlags::protRead, thread->mainWorkQueue()->take());
+						outcome = static_cast<bool>(lockOutcome);
+						if(outcome) {
+							auto &lp = lockedPages[numSent & (lockedPages.size() - 1)];
+							assert(!lp.mapping);
+							lp = std::move(lockOutcome.value());
+							PageAccessor accessor{lp.physical};
+							chunkData = reinterpret_cast<std::byte *>(accessor.get()) + misalign;
+						}
+					}else{
+						auto &xb = xferBuffers[numSent & (xferBuffers.size() - 1)];
+						if(!xb.size())
+							xb = frg::unique_memory<KernelAlloc>{*kernelAlloc, 4096};
+
+						chunkData = xb.data();
+						chunkSize = frg::min(recipe->length - progress, xb.size());
 
-					auto chunkSize = frg::min(recipe->length - progress, xb.size());
+						co_await thread->mainWorkQueue()->enter();
+						outcome = readUserMemory(xb.data(),
+								reinterpret_cast<std::byte *>(recipe->buffer) + progress, chunkSize);
+					}
 					assert(chunkSize);
 
-					co_await thread->mainWorkQueue()->enter();
-					auto outcome = readUserMemory(xb.data(),
-							reinterpret_cast<std::byte *>(recipe->buffer) + progress, chunkSize);
 					if(!outcome) {
 						// Send the packet (may deallocate the peer!).
 						peer->flowQueue.put({ .terminate = true, .fault = true });
@@ -2570,6 +3011,7 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 						while(numSent != numAcked) {
 							auto ackPacket = co_await node->flowQueue.async_get();
 							assert(ackPacket);
+							releaseLockedPage(numAcked);
 							++numAcked;
 						}
 
@@ -2580,7 +3022,7 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 					lastTransferSent = (progress + chunkSize == recipe->length);
 					// Send the packet (may deallocate the peer!).
 					peer->flowQueue.put({
-						.data = xb.data(),
+						.data = chunkData,
 						.size = chunkSize,
 						.terminate = lastTransferSent
 					});
@@ -2670,10 +3112,66 @@ HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count
 		}
 	};
 
-	if(numFlows)
-		handleFlow(closure, numFlows, thisThread.lock());
+	if(numFlows)
+		handleFlow(closure, numFlows, thisThread.lock());
+
+	Stream::transmit(lane, rootChain);
+
+	return kHelErrNone;
+}
+
+} // anonymous namespace
+
+HelError helSubmitAsync(HelHandle handle, const HelAction *actions, size_t count,
+		HelHandle queueHandle, uintptr_t context, uint32_t flags) {
+	if(flags)
+		return kHelErrIllegalArgs;
+	if(!count)
+		return kHelErrIllegalArgs;
+
+	LaneHandle lane;
+	smarter::shared_ptr<IpcQueue> queue;
+	if(auto error = lookupLaneAndQueue(handle, queueHandle, lane, &queue); error)
+		return error;
+
+	return submitActions(std::move(lane), actions, count, std::move(queue), context);
+}
+
+HelError helSubmitAsyncBatch(HelBatchSubmission *submissions, size_t count,
+		HelHandle queueHandle, uint32_t flags) {
+	if(flags)
+		return kHelErrIllegalArgs;
+
+	smarter::shared_ptr<IpcQueue> queue;
+	{
+		auto thisUniverse = getCurrentThread()->getUniverse();
+
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::ReadGuard universe_guard;
+
+		auto queueWrapper = thisUniverse->getDescriptor(universe_guard, queueHandle);
+		if(!queueWrapper)
+			return kHelErrNoDescriptor;
+		if(!queueWrapper->is<QueueDescriptor>())
+			return kHelErrBadDescriptor;
+		queue = queueWrapper->get<QueueDescriptor>().queue;
+	}
+
+	// Errors are reported per submission; a failing submission does not affect the others.
+	for(size_t i = 0; i < count; i++) {
+		HelBatchSubmission submission;
+		if(!readUserObject(submissions + i, submission))
+			return kHelErrFault;
+
+		LaneHandle lane;
+		auto error = lookupLaneAndQueue(submission.handle, kHelNullHandle, lane, nullptr);
+		if(!error)
+			error = submitActions(std::move(lane), submission.actions, submission.count,
+					queue, submission.context);
 
-	Stream::transmit(lane, rootChain);
+		if(!writeUserObject(&submissions[i].error, error))
+			return kHelErrFault;
+	}
 
 	return kHelErrNone;
 }
@@ -2685,7 +3183,7 @@ HelError helShutdownLane(HelHandle handle) {
 	LaneHandle lane;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!wrapper)
@@ -2726,7 +3224,8 @@ HelError helFutexWait(int *pointer, int expected, int64_t deadline) {
 							cancellation);
 				},
 				[&] (async::cancellation_token cancellation) {
-					return generalTimerEngine()->sleep(deadline, cancellation);
+					return generalTimerEngine()->sleep(deadline, cancellation,
+							thisThread->timerSlack());
 				}
 			)
 		);
@@ -2747,6 +3246,95 @@ HelError helFutexWake(int *pointer) {
 	return kHelErrNone;
 }
 
+HelError helFutexWakeN(int *pointer, unsigned int count) {
+	auto thisThread = getCurrentThread();
+	auto space = thisThread->getAddressSpace();
+
+	auto identityOrError = space->resolveGlobalFutex(reinterpret_cast<uintptr_t>(pointer));
+	if(!identityOrError)
+		return kHelErrFault;
+	getGlobalFutexRealm()->wake(identityOrError.value(), count);
+
+	return kHelErrNone;
+}
+
+HelError helFutexRequeue(int *pointer, int expected, unsigned int wakeCount,
+		int *target, unsigned int requeueCount) {
+	auto thisThread = getCurrentThread();
+	auto space = thisThread->getAddressSpace();
+
+	auto targetOrError = space->resolveGlobalFutex(reinterpret_cast<uintptr_t>(target));
+	if(!targetOrError)
+		return kHelErrFault;
+
+	auto futexOrError = Thread::asyncBlockCurrent(
+			space->grabGlobalFutex(reinterpret_cast<uintptr_t>(pointer),
+					thisThread->mainWorkQueue()->take()));
+	if(!futexOrError)
+		return kHelErrFault;
+
+	auto outcome = getGlobalFutexRealm()->requeue(std::move(futexOrError.value()), expected,
+			wakeCount, targetOrError.value(), requeueCount);
+	if(!outcome) {
+		assert(outcome.error() == Error::futexRace);
+		return kHelErrIllegalState;
+	}
+
+	return kHelErrNone;
+}
+
+HelError helFutexWakeOp(int *pointer, unsigned int count,
+		int *target, unsigned int targetCount, const HelFutexOp *opPtr) {
+	auto thisThread = getCurrentThread();
+	auto space = thisThread->getAddressSpace();
+
+	HelFutexOp op;
+	if(!readUserObject(opPtr, op))
+		return kHelErrFault;
+	if(op.op < kHelFutexOpSet || op.op > kHelFutexOpXor
+			|| op.cmp < kHelFutexCmpEq || op.cmp > kHelFutexCmpGe)
+		return kHelErrIllegalArgs;
+
+	auto identityOrError = space->resolveGlobalFutex(reinterpret_cast<uintptr_t>(pointer));
+	if(!identityOrError)
+		return kHelErrFault;
+
+	auto targetOrError = Thread::asyncBlockCurrent(
+			space->grabGlobalFutex(reinterpret_cast<uintptr_t>(target),
+					thisThread->mainWorkQueue()->take()));
+	if(!targetOrError)
+		return kHelErrFault;
+
+	getGlobalFutexRealm()->wakeOp(identityOrError.value(), count,
+			std::move(targetOrError.value()), targetCount, [&] (GlobalFutex &futex) -> bool {
+		auto arg = static_cast<unsigned int>(op.opArg);
+		auto old = static_cast<int>(futex.fetchUpdate([&] (unsigned int word) -> unsigned int {
+			switch(op.op) {
+			case kHelFutexOpSet: return arg;
+			case kHelFutexOpAdd: return word + arg;
+			case kHelFutexOpOr: return word | arg;
+			case kHelFutexOpAndNot: return word & ~arg;
+			default:
+				assert(op.op == kHelFutexOpXor);
+				return word ^ arg;
+			}
+		}));
+
+		switch(op.cmp) {
+		case kHelFutexCmpEq: return old == op.cmpArg;
+		case kHelFutexCmpNe: return old != op.cmpArg;
+		case kHelFutexCmpLt: return old < op.cmpArg;
+		case kHelFutexCmpLe: return old <= op.cmpArg;
+		case kHelFutexCmpGt: return old > op.cmpArg;
+		default:
+			assert(op.cmp == kHelFutexCmpGe);
+			return old >= op.cmpArg;
+		}
+	});
+
+	return kHelErrNone;
+}
+
 HelError helCreateOneshotEvent(HelHandle *handle) {
 	auto this_thread = getCurrentThread();
 	auto this_universe = this_thread->getUniverse();
@@ -2788,7 +3376,7 @@ HelError helRaiseEvent(HelHandle handle) {
 	AnyDescriptor descriptor;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!wrapper)
@@ -2806,6 +3394,26 @@ HelError helRaiseEvent(HelHandle handle) {
 	return kHelErrNone;
 }
 
+HelError helAccessMemoryPressure(HelHandle *handle) {
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::Guard universe_guard(this_universe->lock);
+
+		*handle = this_universe->attachDescriptor(universe_guard,
+				BitsetEventDescriptor(getMemoryPressureEvent()));
+	}
+
+	return kHelErrNone;
+}
+
+HelError helGetMemoryPressure(int *level) {
+	*level = static_cast<int>(getMemoryPressure());
+	return kHelErrNone;
+}
+
 HelError helAccessIrq(int number, HelHandle *handle) {
 #ifdef __x86_64__
 	auto this_thread = getCurrentThread();
@@ -2830,7 +3438,8 @@ HelError helAccessIrq(int number, HelHandle *handle) {
 }
 
 HelError helAcknowledgeIrq(HelHandle handle, uint32_t flags, uint64_t sequence) {
-	if(flags & ~(kHelAckAcknowledge | kHelAckNack | kHelAckKick | kHelAckClear))
+	if(flags & ~(kHelAckAcknowledge | kHelAckNack | kHelAckKick | kHelAckClear
+			| kHelAckPoll | kHelAckPollNow))
 		return kHelErrIllegalArgs;
 
 	auto this_thread = getCurrentThread();
@@ -2839,11 +3448,20 @@ HelError helAcknowledgeIrq(HelHandle handle, uint32_t flags, uint64_t sequence)
 	auto mode = flags & (kHelAckAcknowledge | kHelAckNack | kHelAckKick);
 	if(mode != kHelAckAcknowledge && mode != kHelAckNack && mode != kHelAckKick)
 		return kHelErrIllegalArgs;
+	if((flags & (kHelAckPoll | kHelAckPollNow)) && mode != kHelAckAcknowledge)
+		return kHelErrIllegalArgs;
+
+	auto hint = IrqPollHint::none;
+	if(flags & kHelAckPollNow) {
+		hint = IrqPollHint::pollNow;
+	}else if(flags & kHelAckPoll) {
+		hint = IrqPollHint::poll;
+	}
 
 	smarter::shared_ptr<IrqObject> irq;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto irq_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!irq_wrapper)
@@ -2855,7 +3473,7 @@ HelError helAcknowledgeIrq(HelHandle handle, uint32_t flags, uint64_t sequence)
 
 	Error error;
 	if(mode == kHelAckAcknowledge) {
-		error = IrqPin::ackSink(irq.get(), sequence);
+		error = IrqPin::ackSink(irq.get(), sequence, hint);
 	}else if(mode == kHelAckNack) {
 		error = IrqPin::nackSink(irq.get(), sequence);
 	}else{
@@ -2871,6 +3489,38 @@ HelError helAcknowledgeIrq(HelHandle handle, uint32_t flags, uint64_t sequence)
 	}
 }
 
+HelError helSetIrqAffinity(HelHandle handle, int cpu) {
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	smarter::shared_ptr<IrqObject> irq;
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::ReadGuard universe_guard;
+
+		auto irq_wrapper = this_universe->getDescriptor(universe_guard, handle);
+		if(!irq_wrapper)
+			return kHelErrNoDescriptor;
+		if(!irq_wrapper->is<IrqDescriptor>())
+			return kHelErrBadDescriptor;
+		irq = irq_wrapper->get<IrqDescriptor>().irq;
+	}
+
+	auto pin = irq->getPin();
+	if(!pin)
+		return kHelErrIllegalState;
+
+	auto error = pin->setAffinity(cpu);
+	if(error == Error::illegalArgs) {
+		return kHelErrIllegalArgs;
+	}else if(error == Error::noHardwareSupport) {
+		return kHelErrUnsupportedOperation;
+	}else{
+		assert(error == Error::success);
+		return kHelErrNone;
+	}
+}
+
 HelError helSubmitAwaitEvent(HelHandle handle, uint64_t sequence,
 		HelHandle queue_handle, uintptr_t context) {
 	struct IrqClosure final : IpcNode {
@@ -2965,7 +3615,7 @@ HelError helSubmitAwaitEvent(HelHandle handle, uint64_t sequence,
 	smarter::shared_ptr<IpcQueue> queue;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!wrapper)
@@ -3012,7 +3662,7 @@ HelError helAutomateIrq(HelHandle handle, uint32_t flags, HelHandle kernlet_hand
 	smarter::shared_ptr<BoundKernlet> kernlet;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto irq_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!irq_wrapper)
@@ -3034,6 +3684,227 @@ HelError helAutomateIrq(HelHandle handle, uint32_t flags, HelHandle kernlet_hand
 	return kHelErrNone;
 }
 
+HelError helClassifyIrqRx(HelHandle handle, HelHandle kernlet_handle, const HelRxRing *ring_ptr) {
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	HelRxRing ring;
+	if(!readUserObject(ring_ptr, ring))
+		return kHelErrFault;
+	if(ring.format != kHelRxRingVirtqSplit)
+		return kHelErrIllegalArgs;
+	if(!ring.numDescriptors || ring.numDescriptors > 0x8000
+			|| (ring.numDescriptors & (ring.numDescriptors - 1)))
+		return kHelErrIllegalArgs;
+
+	smarter::shared_ptr<IrqObject> irq;
+	smarter::shared_ptr<BoundKernlet> kernlet;
+	smarter::shared_ptr<MemoryView> memory;
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::ReadGuard universe_guard;
+
+		auto irq_wrapper = this_universe->getDescriptor(universe_guard, handle);
+		if(!irq_wrapper)
+			return kHelErrNoDescriptor;
+		if(!irq_wrapper->is<IrqDescriptor>())
+			return kHelErrBadDescriptor;
+		irq = irq_wrapper->get<IrqDescriptor>().irq;
+
+		auto kernlet_wrapper = this_universe->getDescriptor(universe_guard, kernlet_handle);
+		if(!kernlet_wrapper)
+			return kHelErrNoDescriptor;
+		if(!kernlet_wrapper->is<BoundKernletDescriptor>())
+			return kHelErrBadDescriptor;
+		kernlet = kernlet_wrapper->get<BoundKernletDescriptor>().boundKernlet;
+
+		auto memory_wrapper = this_universe->getDescriptor(universe_guard, ring.memory);
+		if(!memory_wrapper)
+			return kHelErrNoDescriptor;
+		if(!memory_wrapper->is<MemoryViewDescriptor>())
+			return kHelErrBadDescriptor;
+		memory = memory_wrapper->get<MemoryViewDescriptor>().memory;
+	}
+
+	// All structures of the ring need to fit into the memory object.
+	size_t length = memory->getLength();
+	size_t n = ring.numDescriptors;
+	if(length > 0x10000
+			|| ring.tableOffset > length || length - ring.tableOffset < 16 * n
+			|| ring.usedOffset > length || length - ring.usedOffset < 4 + 8 * n
+			|| ring.verdictOffset > length || length - ring.verdictOffset < 4 * n
+			|| (ring.usedOffset & 3) || (ring.verdictOffset & 3))
+		return kHelErrIllegalArgs;
+	if(ring.flags & ~uint32_t(kHelRxRingEventIndex))
+		return kHelErrIllegalArgs;
+	bool eventIndex = ring.flags & kHelRxRingEventIndex;
+	if(eventIndex && (ring.eventOffset >= length - 1 || (ring.eventOffset & 1)))
+		return kHelErrIllegalArgs;
+
+	for(size_t off = 0; off < length; off += kPageSize) {
+		if(memory->peekRange(off).get<0>() == PhysicalAddr(-1))
+			return kHelErrIllegalArgs;
+	}
+
+	// Like memory view bindings of kernlets, the memory is mapped permanently.
+	auto window = reinterpret_cast<char *>(KernelVirtualMemory::global().allocate(0x10000));
+	for(size_t off = 0; off < length; off += kPageSize) {
+		auto range = memory->peekRange(off);
+		KernelPageSpace::global().mapSingle4k(reinterpret_cast<uintptr_t>(window + off),
+				range.get<0>(), page_access::write, range.get<1>());
+	}
+
+	auto classifier = smarter::allocate_shared<RxClassifier>(*kernelAlloc,
+			std::move(kernlet), window, n, ring.tableOffset, ring.usedOffset,
+			ring.verdictOffset, ring.headerSize, ring.wakeThreshold,
+			eventIndex ? reinterpret_cast<uint16_t *>(window + ring.eventOffset) : nullptr);
+	if(!irq->addRxClassifier(std::move(classifier)))
+		return kHelErrIllegalState;
+
+	return kHelErrNone;
+}
+
+HelError helCreateWaitSet(HelHandle *handle) {
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	auto waitSet = smarter::allocate_shared<WaitSet>(*kernelAlloc);
+	waitSet->selfPtr = waitSet;
+
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::Guard universe_guard(this_universe->lock);
+
+		*handle = this_universe->attachDescriptor(universe_guard,
+				WaitSetDescriptor(std::move(waitSet)));
+	}
+
+	return kHelErrNone;
+}
+
+HelError helAddToWaitSet(HelHandle waitSetHandle, HelHandle handle,
+		uint64_t sequence, uintptr_t context) {
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	smarter::shared_ptr<WaitSet> waitSet;
+	AnyDescriptor descriptor;
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::ReadGuard universe_guard;
+
+		auto waitSetWrapper = this_universe->getDescriptor(universe_guard, waitSetHandle);
+		if(!waitSetWrapper)
+			return kHelErrNoDescriptor;
+		if(!waitSetWrapper->is<WaitSetDescriptor>())
+			return kHelErrBadDescriptor;
+		waitSet = waitSetWrapper->get<WaitSetDescriptor>().waitSet;
+
+		auto wrapper = this_universe->getDescriptor(universe_guard, handle);
+		if(!wrapper)
+			return kHelErrNoDescriptor;
+		descriptor = *wrapper;
+	}
+
+	if(descriptor.is<IrqDescriptor>()) {
+		waitSet->addIrq(descriptor.get<IrqDescriptor>().irq, sequence, context);
+	}else if(descriptor.is<OneshotEventDescriptor>()) {
+		if(sequence > 1)
+			return kHelErrIllegalArgs;
+		waitSet->addEvent(descriptor.get<OneshotEventDescriptor>().event, sequence, context);
+	}else if(descriptor.is<BitsetEventDescriptor>()) {
+		waitSet->addEvent(descriptor.get<BitsetEventDescriptor>().event, sequence, context);
+	}else{
+		return kHelErrBadDescriptor;
+	}
+
+	return kHelErrNone;
+}
+
+HelError helSubmitAwaitWaitSet(HelHandle waitSetHandle,
+		HelHandle queue_handle, uintptr_t context) {
+	struct Closure final : IpcNode {
+		static void awaited(Worklet *worklet) {
+			auto closure = frg::container_of(worklet, &Closure::worklet);
+			auto n = closure->node.numEvents();
+			closure->result.error = kHelErrNone;
+			closure->result.numEvents = n;
+			for(size_t i = 0; i < n; i++) {
+				auto &event = closure->node.event(i);
+				closure->result.events[i].error = translateError(event.error);
+				closure->result.events[i].bitset = event.bitset;
+				closure->result.events[i].sequence = event.sequence;
+				closure->result.events[i].context = event.context;
+			}
+			// Only transfer the events that were actually written.
+			closure->source.setup(&closure->result, sizeof(HelWaitSetResult)
+					- (kHelMaxWaitSetEvents - n) * sizeof(HelWaitSetEvent));
+			closure->waitSet = nullptr;
+			closure->_queue->submit(closure);
+		}
+
+	public:
+		explicit Closure(smarter::shared_ptr<WaitSet> the_wait_set,
+				smarter::shared_ptr<IpcQueue> the_queue, uintptr_t context)
+		: waitSet{std::move(the_wait_set)}, _queue{std::move(the_queue)},
+				source{&result, sizeof(HelWaitSetResult), nullptr} {
+			memset(&result, 0, sizeof(HelWaitSetResult));
+			setupContext(context);
+			setupSource(&source);
+			worklet.setup(&Closure::awaited, getCurrentThread()->mainWorkQueue());
+			node.setup(&worklet);
+		}
+
+		void complete() override {
+			frg::destruct(*kernelAlloc, this);
+		}
+
+		// Keeps the wait set alive while the operation is pending.
+		smarter::shared_ptr<WaitSet> waitSet;
+		Worklet worklet;
+		AwaitWaitSetNode node;
+
+	private:
+		smarter::shared_ptr<IpcQueue> _queue;
+		QueueSource source;
+		HelWaitSetResult result;
+	};
+	static_assert(kHelMaxWaitSetEvents == maxWaitSetEvents);
+
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	smarter::shared_ptr<WaitSet> waitSet;
+	smarter::shared_ptr<IpcQueue> queue;
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::ReadGuard universe_guard;
+
+		auto waitSetWrapper = this_universe->getDescriptor(universe_guard, waitSetHandle);
+		if(!waitSetWrapper)
+			return kHelErrNoDescriptor;
+		if(!waitSetWrapper->is<WaitSetDescriptor>())
+			return kHelErrBadDescriptor;
+		waitSet = waitSetWrapper->get<WaitSetDescriptor>().waitSet;
+
+		auto queue_wrapper = this_universe->getDescriptor(universe_guard, queue_handle);
+		if(!queue_wrapper)
+			return kHelErrNoDescriptor;
+		if(!queue_wrapper->is<QueueDescriptor>())
+			return kHelErrBadDescriptor;
+		queue = queue_wrapper->get<QueueDescriptor>().queue;
+	}
+
+	if(!queue->validSize(ipcSourceSize(sizeof(HelWaitSetResult))))
+		return kHelErrQueueTooSmall;
+
+	auto closure = frg::construct<Closure>(*kernelAlloc,
+			waitSet, std::move(queue), context);
+	waitSet->submitAwait(&closure->node);
+
+	return kHelErrNone;
+}
+
 HelError helAccessIo(uintptr_t *port_array, size_t num_ports,
 		HelHandle *handle) {
 	auto this_thread = getCurrentThread();
@@ -3066,7 +3937,7 @@ HelError helEnableIo(HelHandle handle) {
 	smarter::shared_ptr<IoSpace> io_space;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!wrapper)
@@ -3105,7 +3976,7 @@ HelError helBindKernlet(HelHandle handle, const HelKernletData *data, size_t num
 	smarter::shared_ptr<KernletObject> kernlet;
 	{
 		auto irq_lock = frg::guard(&irqMutex());
-		Universe::Guard universe_guard(this_universe->lock);
+		Universe::ReadGuard universe_guard;
 
 		auto kernlet_wrapper = this_universe->getDescriptor(universe_guard, handle);
 		if(!kernlet_wrapper)
@@ -3133,7 +4004,7 @@ HelError helBindKernlet(HelHandle handle, const HelKernletData *data, size_t num
 			smarter::shared_ptr<MemoryView> memory;
 			{
 				auto irq_lock = frg::guard(&irqMutex());
-				Universe::Guard universe_guard(this_universe->lock);
+				Universe::ReadGuard universe_guard;
 
 				auto wrapper = this_universe->getDescriptor(universe_guard, d.handle);
 				if(!wrapper)
@@ -3160,7 +4031,7 @@ HelError helBindKernlet(HelHandle handle, const HelKernletData *data, size_t num
 			smarter::shared_ptr<BitsetEvent> event;
 			{
 				auto irq_lock = frg::guard(&irqMutex());
-				Universe::Guard universe_guard(this_universe->lock);
+				Universe::ReadGuard universe_guard;
 
 				auto wrapper = this_universe->getDescriptor(universe_guard, d.handle);
 				if(!wrapper)
@@ -3195,15 +4066,16 @@ HelError helSetAffinity(HelHandle thread, uint8_t *mask, size_t size) {
 	if (!readUserArray(mask, buf.data(), size))
 		return kHelErrFault;
 
-	size_t n = 0;
-	for (auto i : buf) {
-		n += __builtin_popcount(i);
+	// The mask must contain at least one CPU that actually exists.
+	bool anyCpu = false;
+	for (size_t i = 0; i < static_cast<size_t>(getCpuCount()) && i / 8 < size; i++) {
+		if (buf[i / 8] & (1 << (i % 8))) {
+			anyCpu = true;
+			break;
+		}
 	}
-
-	// TODO: support allowing to run on multiple CPUs
-	if (n != 1) {
+	if (!anyCpu)
 		return kHelErrIllegalArgs;
-	}
 
 	auto this_thread = getCurrentThread();
 
@@ -3213,6 +4085,20 @@ HelError helSetAffinity(HelHandle thread, uint8_t *mask, size_t size) {
 	return kHelErrNone;
 }
 
+HelError helSetTimerSlack(HelHandle thread, uint64_t slack) {
+	if(thread != kHelThisThread)
+		return kHelErrIllegalArgs;
+
+	getCurrentThread()->setTimerSlack(slack);
+	return kHelErrNone;
+}
+
+HelError helGetCurrentCpu(int *cpu, int *num_cpus) {
+	*cpu = getCpuData()->cpuIndex;
+	*num_cpus = getCpuCount();
+	return kHelErrNone;
+}
+
 HelError helQueryRegisterInfo(int set, HelRegisterInfo *info) {
 	HelRegisterInfo outInfo;
 
@@ -7,6 +7,16 @@
 
 namespace thor {
 
+namespace {
+	// Maximal number of elements that are published to user-space at once.
+	// This bounds the latency of the first element of a batch.
+	constexpr size_t maxBatchSize = 64;
+
+	// Closure sizes are rounded up to this granularity, such that closures of
+	// slightly different action chains can share cached blocks.
+	constexpr size_t closureGranularity = 128;
+}
+
 // ----------------------------------------------------------------------------
 // IpcQueue
 // ----------------------------------------------------------------------------
@@ -46,14 +56,49 @@ void IpcQueue::submit(IpcNode *node) {
 	_doorbell.raise();
 }
 
+void *IpcQueue::allocateClosure(size_t size) {
+	size = (size + closureGranularity - 1) & ~(closureGranularity - 1);
+
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_closureMutex);
+
+		for(size_t i = 0; i < _numCachedClosures; i++) {
+			if(_closureCache[i].size != size)
+				continue;
+			auto pointer = _closureCache[i].pointer;
+			_closureCache[i] = _closureCache[--_numCachedClosures];
+			return pointer;
+		}
+	}
+
+	return kernelAlloc->allocate(size);
+}
+
+void IpcQueue::freeClosure(void *pointer, size_t size) {
+	size = (size + closureGranularity - 1) & ~(closureGranularity - 1);
+
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_closureMutex);
+
+		if(_numCachedClosures < numCachedClosures) {
+			_closureCache[_numCachedClosures++] = {pointer, size};
+			return;
+		}
+	}
+
+	kernelAlloc->free(pointer);
+}
+
 coroutine<void> IpcQueue::_runQueue() {
 	auto head = _memory->accessImmediate<QueueStruct>(0);
 
 	while(true) {
 		co_await _doorbell.async_wait_if([&] () -> bool {
-			return !_anyNodes.load(std::memory_order_relaxed);
+			return _stagedNodes.empty() && !_anyNodes.load(std::memory_order_relaxed);
 		});
-		if(!_anyNodes.load(std::memory_order_relaxed))
+		if(_stagedNodes.empty() && !_anyNodes.load(std::memory_order_relaxed))
 			continue;
 
 		// Wait until the futex advances past _currentIndex.
@@ -96,35 +141,44 @@ coroutine<void> IpcQueue::_runQueue() {
 
 		// This inner loop runs until the chunk is exhausted.
 		while(true) {
-			co_await _doorbell.async_wait_if([&] () -> bool {
-				return !_anyNodes.load(std::memory_order_relaxed);
-			});
-			if(!_anyNodes.load(std::memory_order_relaxed))
-				continue;
+			if(_stagedNodes.empty()) {
+				co_await _doorbell.async_wait_if([&] () -> bool {
+					return !_anyNodes.load(std::memory_order_relaxed);
+				});
 
-			// Check if there is enough space in the current chunk.
-			IpcNode *node;
-			uintptr_t progress;
-			{
 				auto irqLock = frg::guard(&irqMutex());
 				auto lock = frg::guard(&_mutex);
 
-				assert(!_nodeQueue.empty());
-				node = _nodeQueue.front();
-				progress = _currentProgress;
+				_stagedNodes.splice(_stagedNodes.end(), _nodeQueue);
+				_anyNodes.store(false, std::memory_order_relaxed);
 			}
+			if(_stagedNodes.empty())
+				continue;
 
-			// Compute the overall length of the element.
-			size_t length = 0;
-			for(auto sgSource = _nodeQueue.front()->_source; sgSource; sgSource = sgSource->link)
-				length += (sgSource->size + 7) & ~size_t(7);
-			assert(length <= _chunkSize);
+			// Emit as many staged elements as fit into the current chunk.
+			// We only update (and potentially wake) the progress futex once per batch.
+			// If only a single node is staged, this behaves exactly like unbatched submission.
+			NodeList emitted;
+			size_t numEmitted = 0;
+			uintptr_t progress = _currentProgress;
+			bool retireChunk = false;
+			while(!_stagedNodes.empty() && numEmitted < maxBatchSize) {
+				auto node = _stagedNodes.front();
+
+				// Compute the overall length of the element.
+				size_t length = 0;
+				for(auto sgSource = node->_source; sgSource; sgSource = sgSource->link)
+					length += (sgSource->size + 7) & ~size_t(7);
+				assert(length <= _chunkSize);
+
+				// Check if we need to retire the current chunk.
+				if(progress + length > _chunkSize) {
+					retireChunk = true;
+					break;
+				}
 
-			// Check if we need to retire the current chunk.
-			bool emitElement = true;
-			if(progress + length <= _chunkSize) {
 				// Emit the next element to the current chunk.
-				auto elementOffset = offsetof(ChunkStruct, buffer) + _currentProgress;
+				auto elementOffset = offsetof(ChunkStruct, buffer) + progress;
 				assert(!(elementOffset & 0x7));
 
 				ElementStruct element;
@@ -140,17 +194,17 @@ coroutine<void> IpcQueue::_runQueue() {
 							sgSource->pointer, sgSource->size);
 					sgOffset += (sgSource->size + 7) & ~size_t(7);
 				}
-			}else{
-				emitElement = false;
+
+				progress += sizeof(ElementStruct) + length;
+				_stagedNodes.pop_front();
+				emitted.push_back(node);
+				numEmitted++;
 			}
 
 			// Update the progress futex.
-			unsigned int newProgressWord;
-			if(emitElement) {
-				newProgressWord = progress + sizeof(ElementStruct) + length;
-			}else{
-				newProgressWord = progress | kProgressDone;
-			}
+			unsigned int newProgressWord = progress;
+			if(retireChunk)
+				newProgressWord |= kProgressDone;
 
 			auto progressFutexWord = __atomic_exchange_n(&chunkHead->progressFutex,
 					newProgressWord, __ATOMIC_RELEASE);
@@ -162,29 +216,24 @@ coroutine<void> IpcQueue::_runQueue() {
 			}
 
 			// Update our internal state and retire the chunk.
-			if(!emitElement) {
-				auto irqLock = frg::guard(&irqMutex());
-				auto lock = frg::guard(&_mutex);
-
-				_currentIndex = ((_currentIndex + 1) & kHeadMask);
-				_currentProgress = 0;
-				break;
-			}
-
-			// Update our internal state and retire the node.
 			{
 				auto irqLock = frg::guard(&irqMutex());
 				auto lock = frg::guard(&_mutex);
 
-				_currentProgress += sizeof(ElementStruct) + length;
-				_nodeQueue.pop_front();
-
-				assert(_anyNodes.load(std::memory_order_relaxed));
-				if(_nodeQueue.empty())
-					_anyNodes.store(false, std::memory_order_relaxed);
+				if(retireChunk) {
+					_currentIndex = ((_currentIndex + 1) & kHeadMask);
+					_currentProgress = 0;
+				}else{
+					_currentProgress = progress;
+				}
 			}
 
-			node->complete();
+			// Retire the emitted nodes.
+			while(!emitted.empty())
+				emitted.pop_front()->complete();
+
+			if(retireChunk)
+				break;
 		}
 	}
 }
@@ -8,6 +8,13 @@ namespace thor {
 
 namespace {
 	constexpr bool logService = false;
+	constexpr bool logPoll = false;
+
+	// A pin enters polled mode if it is raised this often within pollRateWindow.
+	constexpr unsigned int pollEnterRate = 16;
+	constexpr uint64_t pollRateWindow = 1'000'000;
+	// Delay between two polls (unless a sink exhausted its budget).
+	constexpr uint64_t pollInterval = 50'000;
 }
 
 // --------------------------------------------------------
@@ -56,7 +63,7 @@ void IrqPin::attachSink(IrqPin *pin, IrqSink *sink) {
 	sink->_pin = pin;
 }
 
-Error IrqPin::ackSink(IrqSink *sink, uint64_t sequence) {
+Error IrqPin::ackSink(IrqSink *sink, uint64_t sequence, IrqPollHint hint) {
 	auto pin = sink->getPin();
 	assert(pin);
 
@@ -69,6 +76,7 @@ Error IrqPin::ackSink(IrqSink *sink, uint64_t sequence) {
 	if(sink->_status != IrqStatus::indefinite)
 		return Error::illegalArgs;
 	sink->_status = IrqStatus::acked;
+	sink->_pollHint = hint;
 	pin->_acknowledge();
 	return Error::success;
 }
@@ -162,6 +170,47 @@ IrqPin::IrqPin(frg::string<KernelAlloc> name)
 			}
 		}
 	}(this);
+
+	[] (IrqPin *self, enable_detached_coroutine = {}) -> void {
+		while(true) {
+			auto wantPoll = [&] () -> bool {
+				return (self->_maskState & maskedForPoll) && !self->_inService;
+			};
+
+			co_await self->_pollEvent.async_wait_if([&] () -> bool {
+				auto irqLock = frg::guard(&irqMutex());
+				auto lock = frg::guard(&self->_mutex);
+
+				return !wantPoll();
+			});
+
+			// As above, _pollEvent may be raised with locks held.
+			co_await WorkQueue::generalQueue()->schedule();
+
+			bool pollNow;
+			{
+				auto irqLock = frg::guard(&irqMutex());
+				auto lock = frg::guard(&self->_mutex);
+
+				if(!wantPoll())
+					continue;
+				pollNow = self->_pollNow;
+			}
+
+			if(!pollNow)
+				co_await generalTimerEngine()->sleepFor(pollInterval);
+
+			{
+				auto irqLock = frg::guard(&irqMutex());
+				auto lock = frg::guard(&self->_mutex);
+
+				if(!wantPoll())
+					continue;
+				self->_doService(true);
+				self->_updateMask();
+			}
+		}
+	}(this);
 }
 
 void IrqPin::configure(IrqConfiguration desired) {
@@ -180,6 +229,7 @@ void IrqPin::configure(IrqConfiguration desired) {
 		_inService = false;
 		_dueSinks = 0;
 		_maskState = 0;
+		_pollMode = false;
 	}else{
 		assert(_activeCfg.compatible(desired));
 	}
@@ -197,6 +247,15 @@ void IrqPin::raise() {
 				|| _strategy == IrqStrategy::maskThenEoi);
 	}
 
+	// The sinks are polled anyway; we only need to remember that the IRQ was raised
+	// such that polled mode is not left before the sinks had a chance to see the IRQ.
+	// Note that not all pins can be masked (e.g., MSIs without per-vector masking).
+	if(_maskState & maskedForPoll) {
+		_pollAbsorbed = true;
+		sendEoi();
+		return;
+	}
+
 	// If the IRQ is already masked, we're encountering a hardware race.
 	if(_maskState) {
 		++_maskedRaiseCtr;
@@ -230,6 +289,13 @@ void IrqPin::raise() {
 		return;
 	}
 
+	auto now = systemClockSource()->currentNanos();
+	if(now - _rateWindowStart > pollRateWindow) {
+		_rateWindowStart = now;
+		_rateCount = 0;
+	}
+	++_rateCount;
+
 	// This can only happen for justEoi IRQs.
 	// Otherwise, the IRQ is masked and the previous if would have triggered.
 	if(_inService) {
@@ -289,6 +355,10 @@ void IrqPin::_kick(bool doClear) {
 // This function is called at the end of IRQ handling.
 // It unmasks IRQs that use maskThenEoi and checks for asynchronous NACK.
 void IrqPin::_dispatch() {
+	// For polls, a NACK only means that the sinks did not find any work.
+	if(_pollService)
+		_dispatchAcks = true;
+
 	if(_dispatchAcks) {
 		if(_unstallExponent > 0)
 			--_unstallExponent;
@@ -304,13 +374,18 @@ void IrqPin::_dispatch() {
 
 		_inService = false;
 		_maskState &= ~maskedForService;
+		_updatePoll();
 
 		// Avoid losing IRQs that were ignored in raise() as 'already active'.
 		if(_raiseBuffered) {
 			_raiseBuffered = false;
 			_maskState &= ~maskedWhileBuffered;
 
-			_doService();
+			if(_maskState & maskedForPoll) {
+				_pollAbsorbed = true;
+			}else{
+				_doService();
+			}
 		}
 	}else{
 		// Note that _inService returns true for NAKed IRQs.
@@ -358,7 +433,48 @@ void IrqPin::dumpHardwareState() {
 	infoLogger() << "thor: No dump available for IRQ pin " << name() << frg::endlog;
 }
 
-void IrqPin::_doService() {
+// Called whenever the IRQ goes out of service after an ACK.
+// Decides whether the pin is polled or whether it waits for the next IRQ.
+void IrqPin::_updatePoll() {
+	// Only poll if all sinks found work (and thus support polled mode).
+	bool sinksWantPoll = !_sinkList.empty();
+	bool sinksWantPollNow = false;
+	for(auto it = _sinkList.begin(); it != _sinkList.end(); ++it) {
+		if((*it)->_pollHint == IrqPollHint::none)
+			sinksWantPoll = false;
+		if((*it)->_pollHint == IrqPollHint::pollNow)
+			sinksWantPollNow = true;
+	}
+
+	if(sinksWantPoll && (_pollMode || sinksWantPollNow || _rateCount >= pollEnterRate)) {
+		if(logPoll && !_pollMode)
+			infoLogger() << "thor: IRQ " << _name << " enters polled mode" << frg::endlog;
+		_pollMode = true;
+		_pollNow = sinksWantPollNow;
+	}else if(_pollMode && _pollAbsorbed) {
+		// The IRQ was raised after the poll started; poll once more to not lose the IRQ.
+		_pollNow = true;
+	}else{
+		if(logPoll && _pollMode)
+			infoLogger() << "thor: IRQ " << _name << " leaves polled mode" << frg::endlog;
+		_pollMode = false;
+		_maskState &= ~maskedForPoll;
+		return;
+	}
+
+	_maskState |= maskedForPoll;
+	_pollEvent.raise();
+}
+
+int IrqPin::affinity() {
+	return -1;
+}
+
+Error IrqPin::setAffinity(int) {
+	return Error::noHardwareSupport;
+}
+
+void IrqPin::_doService(bool isPoll) {
 	assert(!_inService);
 	assert(!_raiseBuffered);
 
@@ -374,6 +490,9 @@ void IrqPin::_doService() {
 	_dueSinks = 0;
 	_dispatchAcks = false;
 	_dispatchKicks = false;
+	_pollService = isPoll;
+	if(isPoll)
+		_pollAbsorbed = false;
 
 	_raiseClock = systemClockSource()->currentNanos();
 	_warnedAfterPending = false;
@@ -387,6 +506,7 @@ void IrqPin::_doService() {
 	for(auto it = _sinkList.begin(); it != _sinkList.end(); ++it) {
 		auto lock = frg::guard(&(*it)->_mutex);
 		++((*it)->_currentSequence);
+		(*it)->_pollHint = IrqPollHint::none;
 		auto status = (*it)->raise();
 		(*it)->_status = status;
 
@@ -400,7 +520,8 @@ void IrqPin::_doService() {
 	}
 
 	if(!numAsynchronous) {
-		if(anyAck) {
+		// See _dispatch(): polls are never NACKed.
+		if(anyAck || isPoll) {
 			if(logService)
 				infoLogger() << "\e[37m" "thor: IRQ pin " << name()
 						<< " is acked (asynchronously)" "\e[39m" << frg::endlog;
@@ -410,6 +531,7 @@ void IrqPin::_doService() {
 
 			_inService = false;
 			_maskState &= ~maskedForService;
+			_updatePoll();
 		}else{
 			infoLogger() << "\e[31mthor: IRQ " << _name
 					<< " was nacked (synchronously)!\e[39m" << frg::endlog;
@@ -460,7 +582,34 @@ void IrqObject::automate(smarter::shared_ptr<BoundKernlet> kernlet) {
 	_automationKernlet = std::move(kernlet);
 }
 
+bool IrqObject::addRxClassifier(smarter::shared_ptr<RxClassifier> classifier) {
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(sinkMutex());
+
+	if(_automationKernlet)
+		return false;
+	_rxClassifiers.push_back(std::move(classifier));
+	return true;
+}
+
 IrqStatus IrqObject::raise() {
+	// Only wake up the driver if at least one ring has frames that were not dropped
+	// or if the IRQ was not raised due to received frames.
+	if(!_rxClassifiers.empty() && !_automationKernlet) {
+		bool anySuppressed = false;
+		bool anyWake = false;
+		for(auto &classifier : _rxClassifiers) {
+			auto outcome = classifier->classify();
+			if(outcome == RxClassifier::Outcome::suppress) {
+				anySuppressed = true;
+			}else if(outcome == RxClassifier::Outcome::wake) {
+				anyWake = true;
+			}
+		}
+		if(anySuppressed && !anyWake)
+			return IrqStatus::acked;
+	}
+
 	while(!_waitQueue.empty()) {
 		auto node = _waitQueue.pop_front();
 		node->_error = Error::success;
@@ -3,9 +3,14 @@
 #include <thor-internal/universe.hpp>
 #include <thor-internal/coroutine.hpp>
 #include <thor-internal/fiber.hpp>
+#include <thor-internal/irq.hpp>
 #include <thor-internal/kerncfg.hpp>
+#include <thor-internal/kernel-stack.hpp>
+#include <thor-internal/memory-view.hpp>
 #include <thor-internal/ostrace.hpp>
+#include <thor-internal/physical.hpp>
 #include <thor-internal/profile.hpp>
+#include <thor-internal/shared-page-table.hpp>
 #include <thor-internal/stream.hpp>
 #include <thor-internal/timer.hpp>
 
@@ -19,9 +24,27 @@ namespace thor {
 extern frg::manual_box<LaneHandle> mbusClient;
 extern frg::manual_box<frg::string<KernelAlloc>> kernelCommandLine;
 extern frg::manual_box<LogRingBuffer> allocLog;
+extern frg::manual_box<IrqSlot> globalIrqSlots[numIrqSlots];
 
 namespace {
 
+void addIrqStats(managarm::kerncfg::SvrResponse<KernelAlloc> &resp) {
+	resp.set_num_cpus(getCpuCount());
+	for(int i = 0; i < numIrqSlots; i++) {
+		auto pin = globalIrqSlots[i]->pin();
+		if(!pin)
+			continue;
+
+		managarm::kerncfg::IrqStats<KernelAlloc> irqStats(*kernelAlloc);
+		irqStats.set_slot(i);
+		irqStats.set_name(pin->name());
+		irqStats.set_affinity(pin->affinity());
+		for(int k = 0; k < getCpuCount(); k++)
+			irqStats.add_per_cpu(getCpuData(k)->irqCounts[i].load(std::memory_order_relaxed));
+		resp.add_irqs(std::move(irqStats));
+	}
+}
+
 coroutine<Error> handleReq(LaneHandle boundLane) {
 	auto [acceptError, lane] = co_await AcceptSender{boundLane};
 	if(acceptError != Error::success)
@@ -47,6 +70,157 @@ coroutine<Error> handleReq(LaneHandle boundLane) {
 		memcpy(cmdlineBuffer.data(), kernelCommandLine->data(), kernelCommandLine->size());
 		auto cmdlineError = co_await SendBufferSender{lane, std::move(cmdlineBuffer)};
 		assert(cmdlineError == Error::success && "Unexpected mbus transaction");
+	}else if(req.req_type() == managarm::kerncfg::CntReqType::GET_HEAP_STATS) {
+		managarm::kerncfg::SvrResponse<KernelAlloc> resp(*kernelAlloc);
+		resp.set_error(managarm::kerncfg::Error::SUCCESS);
+		for(int i = 0; i < SlabMagazine::numClasses; i++) {
+			auto stats = getKernelHeapClassStats(i);
+
+			managarm::kerncfg::HeapClassStats<KernelAlloc> classStats(*kernelAlloc);
+			classStats.set_size(stats.size);
+			classStats.set_hits(stats.numHits);
+			classStats.set_misses(stats.numMisses);
+			resp.add_heap_classes(std::move(classStats));
+		}
+		for(int i = 0; i < CoroutineFrameCache::numClasses; i++) {
+			auto stats = getCoroutineFrameClassStats(i);
+
+			managarm::kerncfg::HeapClassStats<KernelAlloc> classStats(*kernelAlloc);
+			classStats.set_size(stats.size);
+			classStats.set_hits(stats.numHits);
+			classStats.set_misses(stats.numMisses);
+			resp.add_coroutine_frame_classes(std::move(classStats));
+		}
+		resp.set_largest_coroutine_frame(getLargestCoroutineFrame());
+
+		frg::string<KernelAlloc> ser(*kernelAlloc);
+		resp.SerializeToString(&ser);
+		frg::unique_memory<KernelAlloc> respBuffer{*kernelAlloc, ser.size()};
+		memcpy(respBuffer.data(), ser.data(), ser.size());
+		auto respError = co_await SendBufferSender{lane, std::move(respBuffer)};
+		assert(respError == Error::success && "Unexpected mbus transaction");
+	}else if(req.req_type() == managarm::kerncfg::CntReqType::GET_MEMORY_STATS) {
+		managarm::kerncfg::SvrResponse<KernelAlloc> resp(*kernelAlloc);
+		resp.set_error(managarm::kerncfg::Error::SUCCESS);
+		for(int i = 0; i < physicalAllocator->numNodes(); i++) {
+			managarm::kerncfg::NumaNodeStats<KernelAlloc> nodeStats(*kernelAlloc);
+			nodeStats.set_node(i);
+			nodeStats.set_total_pages(physicalAllocator->numTotalPages(i));
+			nodeStats.set_used_pages(physicalAllocator->numUsedPages(i));
+			nodeStats.set_free_pages(physicalAllocator->numFreePages(i));
+			nodeStats.set_zeroed_pages(physicalAllocator->numZeroedPages(i));
+			resp.add_numa_nodes(std::move(nodeStats));
+		}
+
+		auto reclaimStats = getReclaimStats();
+		resp.set_active_cache_pages(reclaimStats.numActivePages);
+		resp.set_inactive_cache_pages(reclaimStats.numInactivePages);
+		resp.set_reclaimed_pages(reclaimStats.numReclaimed);
+		resp.set_refaulted_pages(reclaimStats.numRefaults);
+		resp.set_anon_pages(reclaimStats.numAnonPages);
+		resp.set_compressed_pages(reclaimStats.numCompressedPages);
+		resp.set_compressed_bytes(reclaimStats.compressedBytes);
+		resp.set_compressions(reclaimStats.numCompressions);
+		resp.set_decompressions(reclaimStats.numDecompressions);
+		resp.set_incompressible_pages(reclaimStats.numIncompressible);
+
+		auto stackStats = getKernelStackStats();
+		resp.set_kernel_stacks_mapped(stackStats.numMapped);
+		resp.set_kernel_stacks_unmapped(stackStats.numUnmapped);
+		resp.set_kernel_stacks_reused(stackStats.numReused);
+
+		resp.set_zeroed_page_hits(physicalAllocator->numZeroedHits());
+		resp.set_zeroed_page_misses(physicalAllocator->numZeroedMisses());
+
+		auto fragmentationStats = physicalAllocator->getFragmentationStats();
+		for(int o = 0; o < numFreeChunkOrders; o++)
+			resp.add_free_chunks(fragmentationStats.numFreeChunks[o]);
+		resp.set_compactions(fragmentationStats.numCompactions);
+		resp.set_failed_compactions(fragmentationStats.numFailedCompactions);
+		resp.set_migrated_pages(fragmentationStats.numMigratedPages);
+
+		auto sharedTableStats = getSharedPageTableStats();
+		resp.set_shared_page_tables(sharedTableStats.numTables);
+		resp.set_shared_page_table_refs(sharedTableStats.numReferences);
+
+		frg::string<KernelAlloc> ser(*kernelAlloc);
+		resp.SerializeToString(&ser);
+		frg::unique_memory<KernelAlloc> respBuffer{*kernelAlloc, ser.size()};
+		memcpy(respBuffer.data(), ser.data(), ser.size());
+		auto respError = co_await SendBufferSender{lane, std::move(respBuffer)};
+		assert(respError == Error::success && "Unexpected mbus transaction");
+	}else if(req.req_type() == managarm::kerncfg::CntReqType::GET_IRQ_STATS) {
+		managarm::kerncfg::SvrResponse<KernelAlloc> resp(*kernelAlloc);
+		resp.set_error(managarm::kerncfg::Error::SUCCESS);
+		addIrqStats(resp);
+
+		frg::string<KernelAlloc> ser(*kernelAlloc);
+		resp.SerializeToString(&ser);
+		frg::unique_memory<KernelAlloc> respBuffer{*kernelAlloc, ser.size()};
+		memcpy(respBuffer.data(), ser.data(), ser.size());
+		auto respError = co_await SendBufferSender{lane, std::move(respBuffer)};
+		assert(respError == Error::success && "Unexpected mbus transaction");
+	}else if(req.req_type() == managarm::kerncfg::CntReqType::GET_CPU_STATS) {
+		managarm::kerncfg::SvrResponse<KernelAlloc> resp(*kernelAlloc);
+		resp.set_error(managarm::kerncfg::Error::SUCCESS);
+		resp.set_clock(systemClockSource()->currentNanos());
+		addIrqStats(resp);
+		for(int k = 0; k < getCpuCount(); k++) {
+			auto cpuData = getCpuData(k);
+
+			uint64_t numIrqs = 0;
+			for(int i = 0; i < numIrqSlots; i++)
+				numIrqs += cpuData->irqCounts[i].load(std::memory_order_relaxed);
+
+			managarm::kerncfg::CpuStats<KernelAlloc> cpuStats(*kernelAlloc);
+			cpuStats.set_cpu(k);
+			cpuStats.set_run_queue(cpuData->scheduler.loadHint());
+			cpuStats.set_idle_time(cpuData->scheduler.idleTime());
+			cpuStats.set_context_switches(cpuData->scheduler.numContextSwitches());
+			cpuStats.set_ping_ipis(cpuData->numPingIpis.load(std::memory_order_relaxed));
+			cpuStats.set_shootdown_ipis(cpuData->numShootdownIpis.load(std::memory_order_relaxed));
+			cpuStats.set_irqs(numIrqs);
+			resp.add_cpus(std::move(cpuStats));
+		}
+
+		frg::string<KernelAlloc> ser(*kernelAlloc);
+		resp.SerializeToString(&ser);
+		frg::unique_memory<KernelAlloc> respBuffer{*kernelAlloc, ser.size()};
+		memcpy(respBuffer.data(), ser.data(), ser.size());
+		auto respError = co_await SendBufferSender{lane, std::move(respBuffer)};
+		assert(respError == Error::success && "Unexpected mbus transaction");
+	}else if(req.req_type() == managarm::kerncfg::CntReqType::GET_LOCK_STATS) {
+		managarm::kerncfg::SvrResponse<KernelAlloc> resp(*kernelAlloc);
+		resp.set_error(managarm::kerncfg::Error::SUCCESS);
+		resp.set_lock_stats_enabled(lockStatsEnabled);
+		for(int i = 0; i < numLockClasses; i++) {
+			auto cls = static_cast<LockClass>(i);
+			auto stats = getLockStats(cls);
+
+			managarm::kerncfg::LockClassStats<KernelAlloc> classStats(*kernelAlloc);
+			classStats.set_name(frg::string<KernelAlloc>(*kernelAlloc, lockClassName(cls)));
+			classStats.set_acquired(stats->numAcquired.load(std::memory_order_relaxed));
+			classStats.set_contended(stats->numContended.load(std::memory_order_relaxed));
+			classStats.set_total_spin(stats->totalSpin.load(std::memory_order_relaxed));
+			classStats.set_max_spin(stats->maxSpin.load(std::memory_order_relaxed));
+			for(auto &site : stats->sites) {
+				auto ip = site.ip.load(std::memory_order_relaxed);
+				if(!ip)
+					continue;
+				managarm::kerncfg::LockSiteStats<KernelAlloc> siteStats(*kernelAlloc);
+				siteStats.set_ip(ip);
+				siteStats.set_contended(site.numContended.load(std::memory_order_relaxed));
+				classStats.add_sites(std::move(siteStats));
+			}
+			resp.add_lock_classes(std::move(classStats));
+		}
+
+		frg::string<KernelAlloc> ser(*kernelAlloc);
+		resp.SerializeToString(&ser);
+		frg::unique_memory<KernelAlloc> respBuffer{*kernelAlloc, ser.size()};
+		memcpy(respBuffer.data(), ser.data(), ser.size());
+		auto respError = co_await SendBufferSender{lane, std::move(respBuffer)};
+		assert(respError == Error::success && "Unexpected mbus transaction");
 	}else{
 		managarm::kerncfg::SvrResponse<KernelAlloc> resp(*kernelAlloc);
 		resp.set_error(managarm::kerncfg::Error::ILLEGAL_REQUEST);
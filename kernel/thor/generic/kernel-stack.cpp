@@ -1,12 +1,39 @@
 #include <thor-internal/arch/paging.hpp>
+#include <thor-internal/cpu-data.hpp>
 #include <thor-internal/debug.hpp>
+#include <thor-internal/kasan.hpp>
 #include <thor-internal/kernel_heap.hpp>
 #include <thor-internal/kernel-stack.hpp>
 #include <thor-internal/physical.hpp>
 
 namespace thor {
 
+namespace {
+	std::atomic<uint64_t> numStacksMapped{0};
+	std::atomic<uint64_t> numStacksUnmapped{0};
+	std::atomic<uint64_t> numStacksReused{0};
+}
+
+KernelStackStats getKernelStackStats() {
+	return {
+		.numMapped = numStacksMapped.load(std::memory_order_relaxed),
+		.numUnmapped = numStacksUnmapped.load(std::memory_order_relaxed),
+		.numReused = numStacksReused.load(std::memory_order_relaxed)
+	};
+}
+
 UniqueKernelStack UniqueKernelStack::make() {
+	{
+		auto irqLock = frg::guard(&irqMutex());
+
+		auto cache = &getCpuData()->kernelStackCache;
+		if(cache->numStacks) {
+			numStacksReused.fetch_add(1, std::memory_order_relaxed);
+			return UniqueKernelStack(cache->stacks[--cache->numStacks]);
+		}
+	}
+
+	numStacksMapped.fetch_add(1, std::memory_order_relaxed);
 	size_t guardedSize = kSize + kPageSize;
 	auto pointer = KernelVirtualMemory::global().allocate(guardedSize);
 
@@ -25,6 +52,20 @@ UniqueKernelStack::~UniqueKernelStack() {
 	if(!_base)
 		return;
 
+	{
+		auto irqLock = frg::guard(&irqMutex());
+
+		auto cache = &getCpuData()->kernelStackCache;
+		if(cache->numStacks < KernelStackCache::capacity) {
+			// The next user of the stack must not see stale KASAN state.
+			cleanKasanShadow(_base - kSize, kSize);
+			cache->stacks[cache->numStacks++] = _base;
+			return;
+		}
+	}
+
+	numStacksUnmapped.fetch_add(1, std::memory_order_relaxed);
+
 	size_t guardedSize = kSize + kPageSize;
 	auto address = reinterpret_cast<uintptr_t>(_base - guardedSize);
 	for(size_t offset = 0; offset < kSize; offset += kPageSize) {
@@ -7,8 +7,10 @@
 #include <arch/mem_space.hpp>
 #include <frg/string.hpp>
 #include <elf.h>
+#include <hel.h>
 #include <thor-internal/universe.hpp>
 #include <thor-internal/coroutine.hpp>
+#include <thor-internal/cpu-data.hpp>
 #include <thor-internal/fiber.hpp>
 #include <thor-internal/kernlet.hpp>
 #include <thor-internal/physical.hpp>
@@ -22,6 +24,31 @@ namespace thor {
 namespace {
 	constexpr bool logBinding = false;
 	constexpr bool logIo = false;
+
+	// Number of bytes at the start of each frame that RX classification kernlets can inspect.
+	constexpr size_t maxInspectedBytes = 128;
+
+	// Layout of split virtqs (see the virtio specification).
+	constexpr size_t virtqDescriptorSize = 16;
+	constexpr uint16_t virtqDescriptorNext = 1;
+
+	struct KernletPacket {
+		const uint8_t *data;
+		// Number of bytes of the frame that are in data.
+		size_t available;
+		// Length of the entire frame.
+		size_t length;
+	};
+
+	// Loads a byte of the frame that is currently classified; reads beyond the end
+	// of the inspected bytes return zero.
+	uint32_t loadPacketByte(uint32_t offset) {
+		auto packet = static_cast<const KernletPacket *>(getCpuData()->kernletPacket);
+		assert(packet);
+		if(offset >= packet->available)
+			return 0;
+		return packet->data[offset];
+	}
 }
 
 extern frg::manual_box<LaneHandle> mbusClient;
@@ -106,6 +133,130 @@ int BoundKernlet::invokeIrqAutomation() {
 	return entry(_instance);
 }
 
+int BoundKernlet::invokeRxClassification(const void *frame, size_t available, size_t length) {
+	assert(!intsAreEnabled());
+	KernletPacket packet{static_cast<const uint8_t *>(frame), available, length};
+	auto cpuData = getCpuData();
+	cpuData->kernletPacket = &packet;
+	auto entry = reinterpret_cast<int (*)(const void *)>(_object->_entry);
+	auto result = entry(_instance);
+	cpuData->kernletPacket = nullptr;
+	return result;
+}
+
+// ------------------------------------------------------------------------
+// RxClassifier class.
+// ------------------------------------------------------------------------
+
+RxClassifier::RxClassifier(smarter::shared_ptr<BoundKernlet> kernlet, char *window,
+		size_t numDescriptors, size_t tableOffset, size_t usedOffset,
+		size_t verdictOffset, size_t headerSize, unsigned int wakeThreshold,
+		uint16_t *eventIndex)
+: _kernlet{std::move(kernlet)}, _window{window}, _numDescriptors{numDescriptors},
+		_tableOffset{tableOffset}, _usedOffset{usedOffset},
+		_verdicts{reinterpret_cast<uint32_t *>(window + verdictOffset)},
+		_headerSize{headerSize}, _wakeThreshold{wakeThreshold}, _eventIndex{eventIndex} {
+	// Buffers that were returned before the classifier was installed are not classified.
+	_progress = __atomic_load_n(reinterpret_cast<uint16_t *>(_window + _usedOffset + 2),
+			__ATOMIC_ACQUIRE);
+}
+
+RxClassifier::Outcome RxClassifier::classify() {
+	auto used = _window + _usedOffset;
+	auto head = __atomic_load_n(reinterpret_cast<uint16_t *>(used + 2), __ATOMIC_ACQUIRE);
+	if(head == _progress)
+		return Outcome::idle;
+
+	// If we fell behind by more than one ring, the oldest entries were already overwritten.
+	if(static_cast<uint16_t>(head - _progress) > _numDescriptors)
+		_progress = head - _numDescriptors;
+
+	bool deliver = false;
+	while(true) {
+		if(_progress == head) {
+			if(deliver || !_eventIndex)
+				break;
+
+			// The driver will not ask for the next interrupt, hence we need to do it.
+			// The device might have returned more buffers before it saw the index.
+			__atomic_store_n(_eventIndex, _progress, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			head = __atomic_load_n(reinterpret_cast<uint16_t *>(used + 2), __ATOMIC_ACQUIRE);
+			if(_progress == head)
+				break;
+			continue;
+		}
+
+		auto slot = _progress & (_numDescriptors - 1);
+		uint32_t id;
+		uint32_t written;
+		memcpy(&id, used + 4 + slot * 8, sizeof(uint32_t));
+		memcpy(&written, used + 4 + slot * 8 + 4, sizeof(uint32_t));
+
+		auto verdict = classifyFrame_(id, written);
+		if(verdict == kHelRxDrop) {
+			_pendingDrops++;
+		}else{
+			deliver = true;
+		}
+		__atomic_store_n(&_verdicts[slot], (uint32_t{_progress} << 16) | verdict,
+				__ATOMIC_RELEASE);
+		_progress++;
+	}
+
+	if(deliver || _pendingDrops >= _wakeThreshold) {
+		_pendingDrops = 0;
+		return Outcome::wake;
+	}
+	return Outcome::suppress;
+}
+
+int RxClassifier::classifyFrame_(uint32_t id, uint32_t written) {
+	// Malformed entries are left to the driver.
+	if(id >= _numDescriptors || written <= _headerSize)
+		return kHelRxDeliver;
+	size_t length = written - _headerSize;
+
+	// Find the descriptor that contains the start of the frame.
+	auto table = _window + _tableOffset;
+	size_t skip = _headerSize;
+	uint64_t address;
+	uint32_t size;
+	for(size_t n = 0; ; n++) {
+		uint16_t flags;
+		uint16_t next;
+		auto descriptor = table + id * virtqDescriptorSize;
+		memcpy(&address, descriptor, sizeof(uint64_t));
+		memcpy(&size, descriptor + 8, sizeof(uint32_t));
+		memcpy(&flags, descriptor + 12, sizeof(uint16_t));
+		memcpy(&next, descriptor + 14, sizeof(uint16_t));
+		if(skip < size)
+			break;
+		skip -= size;
+		if(!(flags & virtqDescriptorNext) || next >= _numDescriptors || n == _numDescriptors)
+			return kHelRxDeliver;
+		id = next;
+	}
+
+	// Copy the start of the frame (up to the end of its first page).
+	// Note that we trust the driver here: only holders of the device's IRQ can
+	// install classifiers and these drivers can already program DMA to arbitrary memory.
+	PhysicalAddr physical = address + skip;
+	if(physical >= 0x4000'0000'0000)
+		return kHelRxDeliver;
+	size_t misalign = physical & (kPageSize - 1);
+	auto available = frg::min(frg::min(length, size - skip),
+			frg::min(maxInspectedBytes, kPageSize - misalign));
+	uint8_t bytes[maxInspectedBytes];
+	PageAccessor accessor{physical - misalign};
+	memcpy(bytes, reinterpret_cast<const uint8_t *>(accessor.get()) + misalign, available);
+
+	auto verdict = _kernlet->invokeRxClassification(bytes, available, length);
+	if(verdict < 0 || verdict > kHelRxVerdictMask)
+		return kHelRxDeliver;
+	return verdict;
+}
+
 // ------------------------------------------------------------------------
 // kernletctl interface to user space.
 // ------------------------------------------------------------------------
@@ -279,6 +430,32 @@ smarter::shared_ptr<KernletObject> processElfDso(const char *buffer,
 				event->trigger(bits);
 			};
 
+		// Intrinsics of RX classification kernlets. Multi-byte loads are big-endian
+		// (i.e., in network byte order). Fafnir has no comparisons, hence __equal32.
+		uint32_t (*abi_packet_length)() =
+			[] () -> uint32_t {
+				auto packet = static_cast<const KernletPacket *>(getCpuData()->kernletPacket);
+				assert(packet);
+				return packet->length;
+			};
+		uint32_t (*abi_packet_read8)(uint32_t) =
+			[] (uint32_t offset) -> uint32_t {
+				return loadPacketByte(offset);
+			};
+		uint32_t (*abi_packet_read16)(uint32_t) =
+			[] (uint32_t offset) -> uint32_t {
+				return (loadPacketByte(offset) << 8) | loadPacketByte(offset + 1);
+			};
+		uint32_t (*abi_packet_read32)(uint32_t) =
+			[] (uint32_t offset) -> uint32_t {
+				return (loadPacketByte(offset) << 24) | (loadPacketByte(offset + 1) << 16)
+						| (loadPacketByte(offset + 2) << 8) | loadPacketByte(offset + 3);
+			};
+		uint32_t (*abi_equal32)(uint32_t, uint32_t) =
+			[] (uint32_t a, uint32_t b) -> uint32_t {
+				return a == b;
+			};
+
 #ifdef __x86_64__
 		if(name == "__pio_read16")
 			return reinterpret_cast<void *>(abi_pio_read16);
@@ -295,6 +472,16 @@ smarter::shared_ptr<KernletObject> processElfDso(const char *buffer,
 			return reinterpret_cast<void *>(abi_mmio_write32);
 		else if(name == "__trigger_bitset")
 			return reinterpret_cast<void *>(abi_trigger_bitset);
+		else if(name == "__packet_length")
+			return reinterpret_cast<void *>(abi_packet_length);
+		else if(name == "__packet_read8")
+			return reinterpret_cast<void *>(abi_packet_read8);
+		else if(name == "__packet_read16")
+			return reinterpret_cast<void *>(abi_packet_read16);
+		else if(name == "__packet_read32")
+			return reinterpret_cast<void *>(abi_packet_read32);
+		else if(name == "__equal32")
+			return reinterpret_cast<void *>(abi_equal32);
 		panicLogger() << "Could not resolve external " << name.data() << frg::endlog;
 		__builtin_unreachable();
 	};
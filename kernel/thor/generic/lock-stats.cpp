@@ -0,0 +1,63 @@
+#include <thor-internal/arch/cpu.hpp>
+#include <thor-internal/kernel-locks.hpp>
+
+namespace thor {
+
+constinit LockStats globalLockStats[numLockClasses];
+
+const char *lockClassName(LockClass cls) {
+	switch(cls) {
+	case LockClass::universe: return "universe";
+	case LockClass::futexRealm: return "futex-realm";
+	case LockClass::scheduler: return "scheduler";
+	case LockClass::physicalAllocator: return "physical-allocator";
+	case LockClass::irqSpinlock: return "irq-spinlock";
+	default: return "unknown";
+	}
+}
+
+namespace {
+	void recordSite(LockStats *stats, uintptr_t ip) {
+		auto site = &stats->sites[(ip >> 4) % LockStats::numSites];
+		if(site->ip.load(std::memory_order_relaxed) != ip) {
+			// Races with other CPUs only lose samples; this is fine for statistics.
+			site->ip.store(ip, std::memory_order_relaxed);
+			site->numContended.store(1, std::memory_order_relaxed);
+			return;
+		}
+		site->numContended.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+// This function is never inlined into TrackedSpinlock::lock() (it is defined in a separate
+// translation unit), hence its return address identifies the caller of lock().
+void spinOnTicket(std::atomic<uint32_t> *servingTicket, uint32_t ticket,
+		LockStats *stats, uintptr_t site) {
+	uint64_t start = 0;
+	if(lockStatsEnabled)
+		start = getRawTimestampCounter();
+
+	while(servingTicket->load(std::memory_order_acquire) != ticket) {
+#ifdef __x86_64__
+		pause();
+#elif defined(__aarch64__)
+		asm volatile ("yield");
+#endif
+	}
+
+	if(!lockStatsEnabled)
+		return;
+	assert(stats);
+
+	auto spin = getRawTimestampCounter() - start;
+	stats->numContended.fetch_add(1, std::memory_order_relaxed);
+	stats->totalSpin.fetch_add(spin, std::memory_order_relaxed);
+	auto max = stats->maxSpin.load(std::memory_order_relaxed);
+	while(spin > max && !stats->maxSpin.compare_exchange_weak(max, spin,
+			std::memory_order_relaxed));
+	if(!site)
+		site = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+	recordSite(stats, site);
+}
+
+} // namespace thor
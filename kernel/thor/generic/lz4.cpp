@@ -0,0 +1,334 @@
+#include <string.h>
+
+#include <thor-internal/cpu-data.hpp>
+#include <thor-internal/debug.hpp>
+#include <thor-internal/fiber.hpp>
+#include <thor-internal/lz4.hpp>
+
+namespace thor {
+
+namespace {
+	constexpr uint32_t frameMagic = 0x184D2204;
+
+	// Bits of the FLG byte of the frame descriptor.
+	constexpr uint8_t flagIndependentBlocks = 1 << 5;
+	constexpr uint8_t flagBlockChecksum = 1 << 4;
+	constexpr uint8_t flagContentSize = 1 << 3;
+	constexpr uint8_t flagDictId = 1 << 0;
+
+	// Set in the block size field if the block is stored uncompressed.
+	constexpr uint32_t uncompressedBit = uint32_t{1} << 31;
+
+	uint32_t readLe32(const uint8_t *p) {
+		return uint32_t{p[0]} | (uint32_t{p[1]} << 8)
+				| (uint32_t{p[2]} << 16) | (uint32_t{p[3]} << 24);
+	}
+
+	constexpr size_t minMatch = 4;
+	// The format requires that the last 5 bytes are literals and that
+	// the last match starts at least 12 bytes before the end of the block.
+	constexpr size_t lastLiterals = 5;
+	constexpr size_t matchLimit = 12;
+	// Small enough to keep the hash table on the stack.
+	constexpr int hashBits = 10;
+}
+
+ptrdiff_t lz4DecompressBlock(const void *src, size_t srcSize, void *dest, size_t destCapacity) {
+	auto ip = static_cast<const uint8_t *>(src);
+	auto iend = ip + srcSize;
+	auto op = static_cast<uint8_t *>(dest);
+	auto ostart = op;
+	auto oend = op + destCapacity;
+
+	// Reads an extended length (a sequence of bytes that ends with a byte != 255).
+	auto readLength = [&] (size_t &length) -> bool {
+		uint8_t b;
+		do {
+			if(ip == iend)
+				return false;
+			b = *ip++;
+			length += b;
+		} while(b == 255);
+		return true;
+	};
+
+	while(true) {
+		if(ip == iend)
+			return -1;
+		auto token = *ip++;
+
+		size_t literals = token >> 4;
+		if(literals == 15 && !readLength(literals))
+			return -1;
+		if(literals > static_cast<size_t>(iend - ip)
+				|| literals > static_cast<size_t>(oend - op))
+			return -1;
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence only consists of literals.
+		if(ip == iend)
+			break;
+
+		if(iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (size_t{ip[1]} << 8);
+		ip += 2;
+		if(!offset || offset > static_cast<size_t>(op - ostart))
+			return -1;
+
+		size_t length = token & 15;
+		if(length == 15 && !readLength(length))
+			return -1;
+		length += 4;
+		if(length > static_cast<size_t>(oend - op))
+			return -1;
+
+		auto match = op - offset;
+		if(offset >= length) {
+			memcpy(op, match, length);
+			op += length;
+		}else{
+			// Overlapping matches repeat the last offset bytes.
+			for(size_t i = 0; i < length; i++)
+				*op++ = *match++;
+		}
+	}
+
+	return op - ostart;
+}
+
+ptrdiff_t lz4CompressBlock(const void *src, size_t srcSize, void *dest, size_t destCapacity) {
+	assert(srcSize <= 0x10000);
+	auto ip = static_cast<const uint8_t *>(src);
+	auto istart = ip;
+	auto iend = ip + srcSize;
+	auto anchor = ip;
+	auto op = static_cast<uint8_t *>(dest);
+	auto ostart = op;
+	auto oend = op + destCapacity;
+
+	// Writes the part of a length that does not fit into the token.
+	auto writeLength = [&] (size_t length) -> bool {
+		while(length >= 255) {
+			if(op == oend)
+				return false;
+			*op++ = 255;
+			length -= 255;
+		}
+		if(op == oend)
+			return false;
+		*op++ = length;
+		return true;
+	};
+
+	// Emits the literals in [anchor, ip), followed by a match (unless matchLength is zero).
+	auto emitSequence = [&] (size_t offset, size_t matchLength) -> bool {
+		size_t literals = ip - anchor;
+		if(op == oend)
+			return false;
+		auto token = op++;
+		*token = (literals >= 15 ? 15 : literals) << 4;
+		if(literals >= 15 && !writeLength(literals - 15))
+			return false;
+		if(literals > static_cast<size_t>(oend - op))
+			return false;
+		memcpy(op, anchor, literals);
+		op += literals;
+		if(!matchLength)
+			return true;
+
+		if(oend - op < 2)
+			return false;
+		*op++ = offset;
+		*op++ = offset >> 8;
+		size_t length = matchLength - minMatch;
+		*token |= length >= 15 ? 15 : length;
+		if(length >= 15 && !writeLength(length - 15))
+			return false;
+		return true;
+	};
+
+	auto read32 = [] (const uint8_t *p) -> uint32_t {
+		uint32_t v;
+		memcpy(&v, p, sizeof(uint32_t));
+		return v;
+	};
+	auto hash = [] (uint32_t v) -> uint32_t {
+		return (v * UINT32_C(2654435761)) >> (32 - hashBits);
+	};
+
+	if(srcSize >= matchLimit) {
+		// Positions (relative to istart) of the last occurrence of each hash.
+		// Entries that were never written point to istart; this is harmless since
+		// all candidates are verified.
+		uint16_t table[size_t{1} << hashBits] = {};
+		auto mflimit = iend - matchLimit;
+		auto matchEnd = iend - lastLiterals;
+
+		while(ip <= mflimit) {
+			auto h = hash(read32(ip));
+			auto candidate = istart + table[h];
+			table[h] = ip - istart;
+			if(candidate >= ip || read32(candidate) != read32(ip)) {
+				// Skip faster through data that does not compress.
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			// Extend the match backwards into the pending literals.
+			while(ip > anchor && candidate > istart && ip[-1] == candidate[-1]) {
+				ip--;
+				candidate--;
+			}
+			size_t length = minMatch;
+			while(ip + length < matchEnd && ip[length] == candidate[length])
+				length++;
+
+			if(!emitSequence(ip - candidate, length))
+				return -1;
+			ip += length;
+			anchor = ip;
+		}
+	}
+
+	// The last sequence only consists of literals.
+	ip = iend;
+	if(!emitSequence(0, 0))
+		return -1;
+	return op - ostart;
+}
+
+bool Lz4FrameDecompressor::isFrame(const void *data, size_t size) {
+	return size >= 4 && readLe32(static_cast<const uint8_t *>(data)) == frameMagic;
+}
+
+Lz4FrameDecompressor::Lz4FrameDecompressor(const void *frame, size_t blockSize)
+: frame_{static_cast<const uint8_t *>(frame)}, blockSize_{blockSize} { }
+
+Lz4FrameDecompressor *Lz4FrameDecompressor::create(const void *frame, size_t size) {
+	auto p = static_cast<const uint8_t *>(frame);
+	auto end = p + size;
+	assert(isFrame(frame, size));
+
+	if(size < 7)
+		panicLogger() << "thor: LZ4 frame is truncated" << frg::endlog;
+	auto flags = p[4];
+	auto bd = p[5];
+	if((flags >> 6) != 1)
+		panicLogger() << "thor: Unsupported LZ4 frame version " << (flags >> 6) << frg::endlog;
+	if(!(flags & flagIndependentBlocks))
+		panicLogger() << "thor: LZ4 frame uses linked blocks;"
+				" these cannot be decompressed in parallel" << frg::endlog;
+	if(flags & flagDictId)
+		panicLogger() << "thor: LZ4 frames with dictionaries are not supported" << frg::endlog;
+
+	auto blockSizeId = (bd >> 4) & 7;
+	if(blockSizeId < 4)
+		panicLogger() << "thor: Invalid LZ4 block size ID " << blockSizeId << frg::endlog;
+	size_t blockSize = size_t{1} << (8 + 2 * blockSizeId);
+
+	// Skip the magic, FLG, BD, the optional content size and the header checksum.
+	p += 6;
+	if(flags & flagContentSize)
+		p += 8;
+	p += 1;
+
+	auto self = frg::construct<Lz4FrameDecompressor>(*kernelAlloc, frame, blockSize);
+	while(true) {
+		if(end - p < 4)
+			panicLogger() << "thor: LZ4 frame is truncated" << frg::endlog;
+		auto word = readLe32(p);
+		p += 4;
+		if(!word)
+			break; // End mark. We do not verify the content checksum.
+
+		size_t blockSrcSize = word & ~uncompressedBit;
+		if(blockSrcSize > blockSize || blockSrcSize > static_cast<size_t>(end - p))
+			panicLogger() << "thor: LZ4 block exceeds the frame" << frg::endlog;
+		self->blocks_.push_back(Block{static_cast<size_t>(p - self->frame_), blockSrcSize,
+				static_cast<bool>(word & uncompressedBit)});
+		p += blockSrcSize;
+		if(flags & flagBlockChecksum)
+			p += 4;
+	}
+
+	self->outSizes_.resize(self->blocks_.size());
+	self->done_.resize(self->blocks_.size());
+	for(size_t i = 0; i < self->blocks_.size(); i++)
+		self->done_[i] = 0;
+	return self;
+}
+
+void Lz4FrameDecompressor::start(void *dest) {
+	dest_ = static_cast<uint8_t *>(dest);
+
+	auto numWorkers = frg::min(static_cast<size_t>(getCpuCount()), blocks_.size());
+	refCount_.fetch_add(numWorkers, std::memory_order_relaxed);
+	for(size_t i = 0; i < numWorkers; i++)
+		KernelFiber::runOn(&getCpuData(i)->scheduler, [this] {
+			runWorker_();
+			unref_();
+		});
+}
+
+void Lz4FrameDecompressor::runWorker_() {
+	while(true) {
+		// Claim blocks in order such that the available prefix grows quickly.
+		auto i = nextBlock_.fetch_add(1, std::memory_order_relaxed);
+		if(i >= blocks_.size())
+			return;
+		auto &block = blocks_[i];
+		auto src = frame_ + block.srcOffset;
+		auto out = dest_ + i * blockSize_;
+
+		size_t outSize;
+		if(block.uncompressed) {
+			memcpy(out, src, block.srcSize);
+			outSize = block.srcSize;
+		}else{
+			auto result = lz4DecompressBlock(src, block.srcSize, out, blockSize_);
+			if(result < 0)
+				panicLogger() << "thor: LZ4 block " << i << " is malformed" << frg::endlog;
+			outSize = result;
+		}
+		if(i + 1 < blocks_.size() && outSize != blockSize_)
+			panicLogger() << "thor: LZ4 block " << i << " is smaller than the block size"
+					<< frg::endlog;
+
+		outSizes_[i] = outSize;
+		__atomic_store_n(&done_[i], 1, __ATOMIC_RELEASE);
+		doneEvent_.raise();
+	}
+}
+
+size_t Lz4FrameDecompressor::waitFor(size_t n) {
+	auto advance = [&] {
+		while(numDonePrefix_ < blocks_.size()
+				&& __atomic_load_n(&done_[numDonePrefix_], __ATOMIC_ACQUIRE)) {
+			availablePrefix_ += outSizes_[numDonePrefix_];
+			numDonePrefix_++;
+		}
+		return availablePrefix_ >= n || numDonePrefix_ == blocks_.size();
+	};
+
+	// async_wait_if() evaluates the condition under the event's lock, i.e., we cannot
+	// miss a raise() that happens after the check.
+	while(!advance())
+		KernelFiber::asyncBlockCurrent(doneEvent_.async_wait_if([&] () -> bool {
+			return !advance();
+		}));
+	return availablePrefix_;
+}
+
+void Lz4FrameDecompressor::release() {
+	unref_();
+}
+
+void Lz4FrameDecompressor::unref_() {
+	if(refCount_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		frg::destruct(*kernelAlloc, this);
+}
+
+} // namespace thor
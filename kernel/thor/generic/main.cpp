@@ -10,6 +10,7 @@
 #include <thor-internal/irq.hpp>
 #include <thor-internal/kerncfg.hpp>
 #include <thor-internal/kernlet.hpp>
+#include <thor-internal/lz4.hpp>
 #include <thor-internal/main.hpp>
 #include <thor-internal/module.hpp>
 #include <thor-internal/pci/pci.hpp>
@@ -84,9 +85,13 @@ extern "C" void thorInitialize() {
 	auto region = reinterpret_cast<EirRegion *>(thorBootInfoPtr->regionInfo);
 	for(size_t i = 0; i < thorBootInfoPtr->numRegions; i++)
 		physicalAllocator->bootstrapRegion(region[i].address, region[i].order,
-				region[i].numRoots, reinterpret_cast<int8_t *>(region[i].buddyTree));
+				region[i].numRoots, reinterpret_cast<int8_t *>(region[i].buddyTree),
+				region[i].numaNode);
 	infoLogger() << "thor: Number of available pages: "
 			<< physicalAllocator->numFreePages() << frg::endlog;
+	if(physicalAllocator->numNodes() > 1)
+		infoLogger() << "thor: Memory is distributed across "
+				<< physicalAllocator->numNodes() << " NUMA nodes" << frg::endlog;
 
 	kernelVirtualAlloc.initialize();
 	kernelHeap.initialize(*kernelVirtualAlloc);
@@ -155,11 +160,34 @@ extern "C" void thorMain() {
 		{
 			assert(modules[0].physicalBase % kPageSize == 0);
 			assert(modules[0].length <= 0x2000000);
-			auto base = static_cast<const char *>(KernelVirtualMemory::global().allocate(0x2000000));
+			auto image = static_cast<const char *>(KernelVirtualMemory::global().allocate(0x2000000));
 			for(size_t pg = 0; pg < modules[0].length; pg += kPageSize)
-				KernelPageSpace::global().mapSingle4k(reinterpret_cast<VirtualAddr>(base) + pg,
+				KernelPageSpace::global().mapSingle4k(reinterpret_cast<VirtualAddr>(image) + pg,
 						modules[0].physicalBase + pg, 0, CachingMode::null);
 
+			// Compressed images are decompressed on all CPUs while we parse them.
+			const char *base = image;
+			size_t available = modules[0].length;
+			Lz4FrameDecompressor *decompressor = nullptr;
+			void *decompressed = nullptr;
+			if(Lz4FrameDecompressor::isFrame(image, modules[0].length)) {
+				decompressor = Lz4FrameDecompressor::create(image, modules[0].length);
+				infoLogger() << "thor: Decompressing initrd (" << modules[0].length / 1024
+						<< " KiB, " << decompressor->numBlocks() << " LZ4 blocks)" << frg::endlog;
+				decompressed = kernelAlloc->allocate(decompressor->maxSize());
+				decompressor->start(decompressed);
+				base = static_cast<const char *>(decompressed);
+				available = 0;
+			}
+
+			// Makes sure that the image is available up to (excluding) the given pointer.
+			auto ensureAvailable = [&] (const char *end) {
+				if(decompressor && static_cast<size_t>(end - base) > available)
+					available = decompressor->waitFor(end - base);
+				if(static_cast<size_t>(end - base) > available)
+					panicLogger() << "thor: initrd is truncated" << frg::endlog;
+			};
+
 			struct Header {
 				char magic[6];
 				char inode[8];
@@ -201,11 +229,18 @@ extern "C" void thorMain() {
 				return v;
 			};
 
+			// Regular files whose data is page-aligned in an uncompressed image are backed
+			// by the image's pages directly (gen-initrd.py aligns all files). We zero the
+			// rest of their last pages (which contains the following CPIO headers) once
+			// all headers are parsed, such that mappings see zeros past EOF.
+			frg::vector<frg::tuple<size_t, size_t>, KernelAlloc> inPlaceTails{*kernelAlloc};
+			size_t numInPlace = 0;
+			size_t numCopied = 0;
+
 			auto p = base;
-			auto limit = base + modules[0].length;
 			while(true) {
 				Header header;
-				assert(p + sizeof(Header) <= limit);
+				ensureAvailable(p + sizeof(Header));
 				memcpy(&header, p, sizeof(Header));
 
 				auto magic = parseHex(header.magic, 6);
@@ -215,8 +250,13 @@ extern "C" void thorMain() {
 				auto name_size = parseHex(header.nameSize, 8);
 				auto file_size = parseHex(header.fileSize, 8);
 				auto data = p + ((sizeof(Header) + name_size + 3) & ~uint32_t{3});
+				ensureAvailable(data + file_size);
 
-				frg::string_view path{p + sizeof(Header), name_size - 1};
+				// Names may be padded with additional NULs to align the file data.
+				auto name_start = p + sizeof(Header);
+				frg::string_view path{name_start,
+						static_cast<size_t>(std::find(name_start, name_start + name_size, '\0')
+							- name_start)};
 				if(path == "TRAILER!!!")
 					break;
 
@@ -248,13 +288,29 @@ extern "C" void thorMain() {
 	//				if(logInitialization)
 						infoLogger() << "thor: initrd file " << path << frg::endlog;
 
-					auto memory = smarter::allocate_shared<AllocatedMemory>(*kernelAlloc,
-							(file_size + (kPageSize - 1)) & ~size_t{kPageSize - 1});
-					memory->selfPtr = memory;
-					auto copyOutcome = KernelFiber::asyncBlockCurrent(memory->copyTo(0,
-							data, file_size,
-							thisFiber()->associatedWorkQueue()->take()));
-					assert(copyOutcome);
+					auto offset = static_cast<size_t>(data - base);
+					auto alignedSize = (file_size + (kPageSize - 1)) & ~size_t{kPageSize - 1};
+					smarter::shared_ptr<MemoryView> memory;
+					if(!decompressor && file_size && !(offset & (kPageSize - 1))) {
+						memory = smarter::shared_ptr<MemoryView>{
+								smarter::allocate_shared<HardwareMemory>(*kernelAlloc,
+									modules[0].physicalBase + offset, alignedSize,
+									CachingMode::null)};
+						if(file_size != alignedSize)
+							inPlaceTails.push(frg::tuple<size_t, size_t>{offset + file_size,
+									alignedSize - file_size});
+						numInPlace++;
+					}else{
+						auto copy = smarter::allocate_shared<AllocatedMemory>(*kernelAlloc,
+								alignedSize);
+						copy->selfPtr = copy;
+						auto copyOutcome = KernelFiber::asyncBlockCurrent(copy->copyTo(0,
+								data, file_size,
+								thisFiber()->associatedWorkQueue()->take()));
+						assert(copyOutcome);
+						memory = smarter::shared_ptr<MemoryView>{std::move(copy)};
+						numCopied++;
+					}
 
 					auto name = frg::string<KernelAlloc>{*kernelAlloc,
 							path.sub_string(it - path.data(), end - it)};
@@ -264,6 +320,20 @@ extern "C" void thorMain() {
 
 				p = data + ((file_size + 3) & ~uint32_t{3});
 			}
+
+			for(size_t i = 0; i < inPlaceTails.size(); i++) {
+				auto [tailOffset, tailSize] = inPlaceTails[i];
+				memset(const_cast<char *>(image) + tailOffset, 0, tailSize);
+			}
+			infoLogger() << "thor: " << numInPlace << " initrd files are mapped in place, "
+					<< numCopied << " files were copied" << frg::endlog;
+
+			if(decompressor) {
+				// All files were copied out of the decompressed image.
+				decompressor->waitFor(decompressor->maxSize());
+				decompressor->release();
+				kernelAlloc->free(decompressed);
+			}
 		}
 
 		if(logInitialization)
@@ -454,6 +524,9 @@ void handleIrq(IrqImageAccessor image, int number) {
 	if(logEveryIrq)
 		infoLogger() << "thor: IRQ slot #" << number << frg::endlog;
 
+	auto &count = cpuData->irqCounts[number];
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
 	globalIrqSlots[number]->raise();
 
 	// Inject IRQ timing entropy into the PRNG accumulator.
@@ -618,6 +691,10 @@ void handleSyscall(SyscallImageAccessor image) {
 		*image.error() = helSubmitProtectMemory((HelHandle)arg0,
 				(void *)arg1, (size_t)arg2, (uint32_t)arg3, (HelHandle)arg4, (uintptr_t)arg5);
 	} break;
+	case kHelCallSubmitPopulateMemory: {
+		*image.error() = helSubmitPopulateMemory((HelHandle)arg0,
+				(void *)arg1, (size_t)arg2, (HelHandle)arg3, (uintptr_t)arg4);
+	} break;
 	case kHelCallUnmapMemory: {
 		*image.error() = helUnmapMemory((HelHandle)arg0, (void *)arg1, (size_t)arg2);
 	} break;
@@ -640,6 +717,16 @@ void handleSyscall(SyscallImageAccessor image) {
 				(size_t)arg2, (const void *)arg3,
 				(HelHandle)arg4, (uintptr_t)arg5);
 	} break;
+	case kHelCallSubmitReadMemoryVector: {
+		*image.error() = helSubmitReadMemoryVector((HelHandle)arg0,
+				(const HelRemoteRange *)arg1, (size_t)arg2,
+				(HelHandle)arg3, (uintptr_t)arg4);
+	} break;
+	case kHelCallSubmitWriteMemoryVector: {
+		*image.error() = helSubmitWriteMemoryVector((HelHandle)arg0,
+				(const HelRemoteRange *)arg1, (size_t)arg2,
+				(HelHandle)arg3, (uintptr_t)arg4);
+	} break;
 	case kHelCallMemoryInfo: {
 		size_t size;
 		*image.error() = helMemoryInfo((HelHandle)arg0, &size);
@@ -660,11 +747,21 @@ void handleSyscall(SyscallImageAccessor image) {
 	case kHelCallLoadahead: {
 		*image.error() = helLoadahead((HelHandle)arg0, (uintptr_t)arg1, (size_t)arg2);
 	} break;
+	case kHelCallQueryWriteback: {
+		size_t count;
+		*image.error() = helQueryWriteback((HelHandle)arg0, (uintptr_t)arg1, (size_t)arg2,
+				&count);
+		*image.out0() = count;
+	} break;
 	case kHelCallCreateVirtualizedSpace: {
 		HelHandle handle;
 		*image.error() = helCreateVirtualizedSpace(&handle);
 		*image.out0() = handle;
 	} break;
+	case kHelCallGetDirtyLog: {
+		*image.error() = helGetDirtyLog((HelHandle)arg0, (uintptr_t)arg1, (size_t)arg2,
+				(void *)arg3);
+	} break;
 	case kHelCallCreateVirtualizedCpu: {
 		HelHandle handle;
 		*image.error() = helCreateVirtualizedCpu((HelHandle)arg0, &handle);
@@ -695,6 +792,10 @@ void handleSyscall(SyscallImageAccessor image) {
 	case kHelCallSetPriority: {
 		*image.error() = helSetPriority((HelHandle)arg0, (int)arg1);
 	} break;
+	case kHelCallSetDeadline: {
+		*image.error() = helSetDeadline((HelHandle)arg0, (uint64_t)arg1,
+				(uint64_t)arg2, (uint64_t)arg3);
+	} break;
 	case kHelCallYield: {
 		*image.error() = helYield();
 	} break;
@@ -725,6 +826,11 @@ void handleSyscall(SyscallImageAccessor image) {
 		*image.error() = helGetClock(&counter);
 		*image.out0() = counter;
 	} break;
+	case kHelCallMapClockPage: {
+		void *pointer;
+		*image.error() = helMapClockPage((HelHandle)arg0, &pointer);
+		*image.out0() = (Word)pointer;
+	} break;
 	case kHelCallSubmitAwaitClock: {
 		uint64_t async_id;
 		*image.error() = helSubmitAwaitClock((uint64_t)arg0,
@@ -743,6 +849,10 @@ void handleSyscall(SyscallImageAccessor image) {
 		*image.error() = helSubmitAsync((HelHandle)arg0, (HelAction *)arg1,
 				(size_t)arg2, (HelHandle)arg3, (uintptr_t)arg4, (uint32_t)arg5);
 	} break;
+	case kHelCallSubmitAsyncBatch: {
+		*image.error() = helSubmitAsyncBatch((HelBatchSubmission *)arg0,
+				(size_t)arg1, (HelHandle)arg2, (uint32_t)arg3);
+	} break;
 	case kHelCallShutdownLane: {
 		*image.error() = helShutdownLane((HelHandle)arg0);
 	} break;
@@ -753,6 +863,17 @@ void handleSyscall(SyscallImageAccessor image) {
 	case kHelCallFutexWake: {
 		*image.error() = helFutexWake((int *)arg0);
 	} break;
+	case kHelCallFutexWakeN: {
+		*image.error() = helFutexWakeN((int *)arg0, (unsigned int)arg1);
+	} break;
+	case kHelCallFutexRequeue: {
+		*image.error() = helFutexRequeue((int *)arg0, (int)arg1, (unsigned int)arg2,
+				(int *)arg3, (unsigned int)arg4);
+	} break;
+	case kHelCallFutexWakeOp: {
+		*image.error() = helFutexWakeOp((int *)arg0, (unsigned int)arg1,
+				(int *)arg2, (unsigned int)arg3, (const HelFutexOp *)arg4);
+	} break;
 
 	case kHelCallCreateOneshotEvent: {
 		HelHandle handle;
@@ -767,6 +888,16 @@ void handleSyscall(SyscallImageAccessor image) {
 	case kHelCallRaiseEvent: {
 		*image.error() = helRaiseEvent((HelHandle)arg0);
 	} break;
+	case kHelCallAccessMemoryPressure: {
+		HelHandle handle;
+		*image.error() = helAccessMemoryPressure(&handle);
+		*image.out0() = handle;
+	} break;
+	case kHelCallGetMemoryPressure: {
+		int level;
+		*image.error() = helGetMemoryPressure(&level);
+		*image.out0() = level;
+	} break;
 	case kHelCallAccessIrq: {
 		HelHandle handle;
 		*image.error() = helAccessIrq((int)arg0, &handle);
@@ -775,6 +906,9 @@ void handleSyscall(SyscallImageAccessor image) {
 	case kHelCallAcknowledgeIrq: {
 		*image.error() = helAcknowledgeIrq((HelHandle)arg0, (uint32_t)arg1, (uint64_t)arg2);
 	} break;
+	case kHelCallSetIrqAffinity: {
+		*image.error() = helSetIrqAffinity((HelHandle)arg0, (int)arg1);
+	} break;
 	case kHelCallSubmitAwaitEvent: {
 		*image.error() = helSubmitAwaitEvent((HelHandle)arg0, (uint64_t)arg1,
 				(HelHandle)arg2, (uintptr_t)arg3);
@@ -782,6 +916,23 @@ void handleSyscall(SyscallImageAccessor image) {
 	case kHelCallAutomateIrq: {
 		*image.error() = helAutomateIrq((HelHandle)arg0, (uint32_t)arg1, (HelHandle)arg2);
 	} break;
+	case kHelCallClassifyIrqRx: {
+		*image.error() = helClassifyIrqRx((HelHandle)arg0, (HelHandle)arg1,
+				(const HelRxRing *)arg2);
+	} break;
+	case kHelCallCreateWaitSet: {
+		HelHandle handle;
+		*image.error() = helCreateWaitSet(&handle);
+		*image.out0() = handle;
+	} break;
+	case kHelCallAddToWaitSet: {
+		*image.error() = helAddToWaitSet((HelHandle)arg0, (HelHandle)arg1,
+				(uint64_t)arg2, (uintptr_t)arg3);
+	} break;
+	case kHelCallSubmitAwaitWaitSet: {
+		*image.error() = helSubmitAwaitWaitSet((HelHandle)arg0, (HelHandle)arg1,
+				(uintptr_t)arg2);
+	} break;
 
 	case kHelCallAccessIo: {
 		HelHandle handle;
@@ -805,6 +956,16 @@ void handleSyscall(SyscallImageAccessor image) {
 	case kHelCallSetAffinity: {
 		*image.error() = helSetAffinity((HelHandle)arg0, (uint8_t *)arg1, (size_t)arg2);
 	} break;
+	case kHelCallSetTimerSlack: {
+		*image.error() = helSetTimerSlack((HelHandle)arg0, (uint64_t)arg1);
+	} break;
+	case kHelCallGetCurrentCpu: {
+		int cpu;
+		int num_cpus;
+		*image.error() = helGetCurrentCpu(&cpu, &num_cpus);
+		*image.out0() = cpu;
+		*image.out1() = num_cpus;
+	} break;
 
 	case kHelCallQueryRegisterInfo: {
 		*image.error() = helQueryRegisterInfo((int)arg0, (HelRegisterInfo *)arg1);
@@ -1,5 +1,9 @@
+#include <string.h>
+
 #include <thor-internal/coroutine.hpp>
+#include <thor-internal/event.hpp>
 #include <thor-internal/fiber.hpp>
+#include <thor-internal/lz4.hpp>
 #include <thor-internal/main.hpp>
 #include <thor-internal/memory-view.hpp>
 #include <thor-internal/physical.hpp>
@@ -10,6 +14,8 @@ namespace thor {
 namespace {
 	constexpr bool logUsage = false;
 	constexpr bool logUncaching = false;
+	constexpr bool logCompaction = false;
+	constexpr bool logPressure = false;
 
 	// The following flags are debugging options to debug the correctness of various components.
 	constexpr bool tortureUncaching = false;
@@ -20,6 +26,16 @@ namespace {
 // Reclaim implementation.
 // --------------------------------------------------------
 
+// Pages are kept on two lists: newly cached pages enter the inactive list and are only
+// promoted to the active list if they are referenced again while they are inactive.
+// Eviction only takes pages from the inactive list; this makes sure that a single large
+// sequential scan cannot push frequently used pages out of the cache.
+//
+// Anonymous pages (of CopyOnWriteMemory) are kept on a separate FIFO list. Since mapped
+// anonymous pages do not fault again, we cannot observe references to them; pages that
+// are decompressed re-enter at the tail. Anonymous pages are more expensive to reclaim
+// than cache pages, hence they are only compressed for every anonReclaimRatio-th
+// reclaimed page (or when there are no cache pages).
 struct MemoryReclaimer {
 	void addPage(CachePage *page) {
 		auto irqLock = frg::guard(&irqMutex());
@@ -27,9 +43,16 @@ struct MemoryReclaimer {
 
 		assert(!(page->flags & CachePage::reclaimRegistered));
 
-		_lruList.push_back(page);
+		// Pages that are faulted in again shortly after being evicted were evicted too early.
+		// Put them onto the active list directly.
+		if(page->flags & CachePage::reclaimEvicted) {
+			page->flags &= ~(CachePage::reclaimEvicted | CachePage::reclaimReferenced);
+			_numRefaults++;
+			_pushActive(page);
+		}else{
+			_pushInactive(page);
+		}
 		page->flags |= CachePage::reclaimRegistered;
-		_cachedSize += kPageSize;
 	}
 
 	void removePage(CachePage *page) {
@@ -46,9 +69,11 @@ struct MemoryReclaimer {
 
 			page->flags &= ~(CachePage::reclaimPosted | CachePage::reclaimInflight);
 		}else{
-			auto it = _lruList.iterator_to(page);
-			_lruList.erase(it);
-			_cachedSize -= kPageSize;
+			// Remember that the page was active; re-adding it then only takes one
+			// reference to promote it again.
+			if(page->flags & CachePage::reclaimActive)
+				page->flags |= CachePage::reclaimReferenced;
+			_unlink(page);
 		}
 		page->flags &= ~CachePage::reclaimRegistered;
 	}
@@ -65,14 +90,32 @@ struct MemoryReclaimer {
 				page->bundle->_reclaimList.erase(it);
 			}
 
-			page->flags &= ~(CachePage::reclaimPosted | CachePage::reclaimInflight);
-			_cachedSize += kPageSize;
+			// The page was referenced while it was about to be evicted.
+			page->flags &= ~(CachePage::reclaimPosted | CachePage::reclaimInflight
+					| CachePage::reclaimReferenced);
+			_numActivated++;
+			_pushActive(page);
+		}else if(page->flags & CachePage::reclaimActive) {
+			page->flags |= CachePage::reclaimReferenced;
+		}else if(page->flags & CachePage::reclaimReferenced) {
+			_unlink(page);
+			page->flags &= ~CachePage::reclaimReferenced;
+			_numActivated++;
+			_pushActive(page);
 		}else{
-			auto it = _lruList.iterator_to(page);
-			_lruList.erase(it);
+			page->flags |= CachePage::reclaimReferenced;
 		}
+	}
+
+	// Called when an evicted page transitions to the missing state. Used to detect refaults.
+	void notifyEvicted(CachePage *page) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
 
-		_lruList.push_back(page);
+		assert(!(page->flags & CachePage::reclaimRegistered));
+
+		page->flags |= CachePage::reclaimEvicted;
+		_numReclaimed++;
 	}
 
 	auto awaitReclaim(CacheBundle *bundle, async::cancellation_token ct = {}) {
@@ -104,15 +147,129 @@ struct MemoryReclaimer {
 		return page;
 	}
 
+	// Calls fn on all pages that are currently registered (i.e., present and unlocked).
+	// fn is called with the reclaimer's lock held.
+	template<typename F>
+	void forEachPage(F fn) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		for(auto it = _activeList.begin(); it != _activeList.end(); ++it)
+			fn(*it);
+		for(auto it = _inactiveList.begin(); it != _inactiveList.end(); ++it)
+			fn(*it);
+	}
+
+	void addAnonPage(CachePage *page) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		assert(!(page->flags & CachePage::reclaimRegistered));
+
+		_anonList.push_back(page);
+		_numAnon++;
+		page->flags |= CachePage::reclaimRegistered;
+	}
+
+	void removeAnonPage(CachePage *page) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		assert(page->flags & CachePage::reclaimRegistered);
+
+		// Inflight pages were already taken off the list by the reclaim fiber.
+		if(!(page->flags & CachePage::reclaimInflight)) {
+			auto it = _anonList.iterator_to(page);
+			_anonList.erase(it);
+			_numAnon--;
+		}
+		page->flags &= ~(CachePage::reclaimRegistered | CachePage::reclaimInflight);
+	}
+
+	// Called by the owner of an inflight anonymous page before it compresses the page.
+	// Unregisters the page. Returns false if the page was removed in the meantime.
+	bool claimAnonPage(CachePage *page) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		if((page->flags & (CachePage::reclaimRegistered | CachePage::reclaimInflight))
+				!= (CachePage::reclaimRegistered | CachePage::reclaimInflight))
+			return false;
+		page->flags &= ~(CachePage::reclaimRegistered | CachePage::reclaimInflight);
+		return true;
+	}
+
+	void notifyCompressed(size_t size) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		_numCompressedPages++;
+		_compressedBytes += size;
+		_numCompressions++;
+	}
+
+	void notifyIncompressible() {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		_numIncompressible++;
+	}
+
+	// Called when compressed data is freed. decompressed is false if the page is discarded.
+	void notifyDecompressed(size_t size, bool decompressed) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		assert(_numCompressedPages);
+		assert(_compressedBytes >= size);
+		_numCompressedPages--;
+		_compressedBytes -= size;
+		if(decompressed)
+			_numDecompressions++;
+	}
+
+	// Called when compressed data is duplicated (by fork()).
+	void notifyDuplicated(size_t size) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		_numCompressedPages++;
+		_compressedBytes += size;
+	}
+
+	ReclaimStats getStats() {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		return {
+			.numActivePages = _numActive,
+			.numInactivePages = _numInactive,
+			.numReclaimed = _numReclaimed,
+			.numRefaults = _numRefaults,
+			.numActivated = _numActivated,
+			.numDeactivated = _numDeactivated,
+			.numAnonPages = _numAnon,
+			.numCompressedPages = _numCompressedPages,
+			.compressedBytes = _compressedBytes,
+			.numCompressions = _numCompressions,
+			.numDecompressions = _numDecompressions,
+			.numIncompressible = _numIncompressible
+		};
+	}
+
 	void runReclaimFiber() {
-		auto checkReclaim = [this] () -> bool {
+		// If an anonymous page is selected, its owner and index are returned in
+		// anonOwner and anonIndex; the caller compresses the page.
+		auto checkReclaim = [this] (smarter::shared_ptr<CopyOnWriteMemory> &anonOwner,
+				uint64_t &anonIndex) -> bool {
 			if(disableUncaching)
 				return false;
 
 			auto irqLock = frg::guard(&irqMutex());
 			auto lock = frg::guard(&_mutex);
 
-			if(_lruList.empty())
+			bool haveCache = !_activeList.empty() || !_inactiveList.empty();
+			if(!haveCache && _anonList.empty())
 				return false;
 
 			if(!tortureUncaching) {
@@ -128,14 +285,68 @@ struct MemoryReclaimer {
 				}
 			}
 
-			auto page = _lruList.pop_front();
+			if(!_anonList.empty()
+					&& (!haveCache || !(++_numReclaimDecisions % anonReclaimRatio))) {
+				auto page = _anonList.pop_front();
+				_numAnon--;
+				assert(page->flags & CachePage::reclaimRegistered);
+				assert(!(page->flags & CachePage::reclaimInflight));
+				page->flags |= CachePage::reclaimInflight;
+
+				// Owners unregister their pages (which takes our lock) before they are
+				// destructed, hence the object is still alive. If its reference count
+				// already dropped to zero, the destructor will remove the page.
+				anonOwner = static_cast<CopyOnWriteMemory *>(page->bundle)->selfPtr.lock();
+				anonIndex = page->identity;
+				return true;
+			}
+
+			// Keep the active list at most as large as the inactive list.
+			// Referenced active pages get another round on the active list.
+			for(size_t n = 0; n < maxScanPerPage && _numActive > _numInactive; n++) {
+				auto page = _activeList.pop_front();
+				_numActive--;
+				assert(page->flags & CachePage::reclaimActive);
+				page->flags &= ~CachePage::reclaimActive;
+
+				if(page->flags & CachePage::reclaimReferenced) {
+					page->flags &= ~CachePage::reclaimReferenced;
+					_pushActive(page);
+				}else{
+					_numDeactivated++;
+					_pushInactive(page);
+				}
+			}
+
+			// Find an unreferenced inactive page. Referenced pages are promoted instead.
+			CachePage *page = nullptr;
+			for(size_t n = 0; n < maxScanPerPage && !_inactiveList.empty(); n++) {
+				auto candidate = _inactiveList.pop_front();
+				_numInactive--;
+
+				if(candidate->flags & CachePage::reclaimReferenced) {
+					candidate->flags &= ~CachePage::reclaimReferenced;
+					_numActivated++;
+					_pushActive(candidate);
+					continue;
+				}
+				page = candidate;
+				break;
+			}
+			if(!page) {
+				// All scanned pages were referenced; take the oldest active page.
+				if(_activeList.empty())
+					return false;
+				page = _activeList.pop_front();
+				_numActive--;
+				page->flags &= ~(CachePage::reclaimActive | CachePage::reclaimReferenced);
+			}
 
 			assert(page->flags & CachePage::reclaimRegistered);
 			assert(!(page->flags & CachePage::reclaimPosted));
 			assert(!(page->flags & CachePage::reclaimInflight));
 
 			page->flags |= CachePage::reclaimPosted;
-			_cachedSize -= kPageSize;
 
 			page->bundle->_reclaimList.push_back(page);
 			page->bundle->_reclaimEvent.raise();
@@ -148,12 +359,27 @@ struct MemoryReclaimer {
 				if(logUncaching) {
 					auto irqLock = frg::guard(&irqMutex());
 					auto lock = frg::guard(&_mutex);
-					infoLogger() << "thor: " << (_cachedSize / 1024)
-							<< " KiB of cached pages" << frg::endlog;
+					infoLogger() << "thor: " << ((_numActive + _numInactive) * kPageSize / 1024)
+							<< " KiB of cached pages (" << (_numActive * kPageSize / 1024)
+							<< " KiB active), " << _numReclaimed << " pages reclaimed, "
+							<< _numRefaults << " refaults" << frg::endlog;
+					infoLogger() << "thor: " << (_numCompressedPages * kPageSize / 1024)
+							<< " KiB of anonymous memory compressed into "
+							<< (_compressedBytes / 1024) << " KiB, "
+							<< _numDecompressions << " decompressions" << frg::endlog;
 				}
 
-				while(checkReclaim())
-					;
+				smarter::shared_ptr<CopyOnWriteMemory> anonOwner;
+				uint64_t anonIndex;
+				while(checkReclaim(anonOwner, anonIndex)) {
+					if(!anonOwner)
+						continue;
+					// Compressing blocks this fiber until the page is evicted from all
+					// mappings. This limits the rate at which we compress pages.
+					KernelFiber::asyncBlockCurrent(anonOwner->compressPage(anonIndex,
+							thisFiber()->associatedWorkQueue()->take()));
+					anonOwner = nullptr;
+				}
 				if(tortureUncaching) {
 					KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(10'000'000));
 				}else{
@@ -164,22 +390,74 @@ struct MemoryReclaimer {
 	}
 
 private:
+	// Bounds the number of list rotations per evicted page.
+	static constexpr size_t maxScanPerPage = 32;
+	// At most one out of this many reclaimed pages is an anonymous page
+	// (if cache pages are available).
+	static constexpr uint64_t anonReclaimRatio = 4;
+
+	void _pushActive(CachePage *page) {
+		page->flags |= CachePage::reclaimActive;
+		_activeList.push_back(page);
+		_numActive++;
+	}
+
+	void _pushInactive(CachePage *page) {
+		_inactiveList.push_back(page);
+		_numInactive++;
+	}
+
+	void _unlink(CachePage *page) {
+		if(page->flags & CachePage::reclaimActive) {
+			auto it = _activeList.iterator_to(page);
+			_activeList.erase(it);
+			_numActive--;
+			page->flags &= ~CachePage::reclaimActive;
+		}else{
+			auto it = _inactiveList.iterator_to(page);
+			_inactiveList.erase(it);
+			_numInactive--;
+		}
+	}
+
 	frg::ticket_spinlock _mutex;
 
-	frg::intrusive_list<
+	using LruList = frg::intrusive_list<
 		CachePage,
 		frg::locate_member<
 			CachePage,
 			frg::default_list_hook<CachePage>,
 			&CachePage::listHook
 		>
-	> _lruList;
-
-	size_t _cachedSize = 0;
+	>;
+
+	LruList _activeList;
+	LruList _inactiveList;
+	LruList _anonList;
+
+	size_t _numActive = 0;
+	size_t _numInactive = 0;
+
+	uint64_t _numReclaimed = 0;
+	uint64_t _numRefaults = 0;
+	uint64_t _numActivated = 0;
+	uint64_t _numDeactivated = 0;
+
+	size_t _numAnon = 0;
+	size_t _numCompressedPages = 0;
+	size_t _compressedBytes = 0;
+	uint64_t _numCompressions = 0;
+	uint64_t _numDecompressions = 0;
+	uint64_t _numIncompressible = 0;
+	uint64_t _numReclaimDecisions = 0;
 };
 
 static frg::manual_box<MemoryReclaimer> globalReclaimer;
 
+ReclaimStats getReclaimStats() {
+	return globalReclaimer->getStats();
+}
+
 static initgraph::Task initReclaim{&globalInitEngine, "generic.init-reclaim",
 	initgraph::Requires{getFibersAvailableStage()},
 	[] {
@@ -188,6 +466,242 @@ static initgraph::Task initReclaim{&globalInitEngine, "generic.init-reclaim",
 	}
 };
 
+// --------------------------------------------------------
+// Compaction.
+// --------------------------------------------------------
+
+// Compaction frees aligned chunks of physical memory by migrating the pages that occupy them.
+// Only unlocked cache pages of ManagedSpaces are movable: they are tracked by the reclaimer
+// and all of their mappings can be evicted. Other pages have no reverse mapping.
+
+namespace {
+	// Background compaction tries to keep chunks of this order (i.e., 2 MiB) available.
+	constexpr int backgroundCompactionOrder = 9;
+	// Higher orders are unlikely to succeed and are not worth the migration cost.
+	constexpr int maxCompactionOrder = 10;
+	// Maximal number of chunks that are examined per compaction run.
+	constexpr size_t maxCandidateChunks = 32;
+	// Background compaction only runs if this many pages are free.
+	constexpr size_t minFreePagesForBackground = 4 << backgroundCompactionOrder;
+
+	struct MovablePage {
+		ManagedSpace *space;
+		size_t index;
+		PhysicalAddr physical;
+	};
+
+	// Tries to free an aligned chunk of the given order. Blocks the current fiber.
+	bool compactPhysicalMemory(int order) {
+		auto chunkSize = size_t{kPageSize} << order;
+		auto chunkPages = size_t{1} << order;
+
+		frg::vector<MovablePage, KernelAlloc> movable{*kernelAlloc};
+		globalReclaimer->forEachPage([&] (CachePage *page) {
+			auto pit = frg::container_of(page, &ManagedSpace::ManagedPage::cachePage);
+			// This read races with concurrent updates; migratePage() re-checks the address.
+			auto physical = __atomic_load_n(&pit->physical, __ATOMIC_RELAXED);
+			movable.push_back({static_cast<ManagedSpace *>(page->bundle),
+					page->identity, physical});
+		});
+
+		// Find a chunk that only consists of free and movable pages.
+		auto victim = PhysicalAddr(-1);
+		frg::vector<PhysicalAddr, KernelAlloc> examined{*kernelAlloc};
+		for(size_t i = 0; i < movable.size(); i++) {
+			if(examined.size() == maxCandidateChunks)
+				break;
+			auto base = movable[i].physical & ~PhysicalAddr(chunkSize - 1);
+
+			bool seen = false;
+			for(auto other : examined)
+				if(other == base)
+					seen = true;
+			if(seen)
+				continue;
+			examined.push_back(base);
+
+			size_t numMovable = 0;
+			for(auto &other : movable)
+				if((other.physical & ~PhysicalAddr(chunkSize - 1)) == base)
+					numMovable++;
+			size_t numFree = 0;
+			for(size_t off = 0; off < chunkSize; off += kPageSize)
+				if(physicalAllocator->isFree(base + off))
+					numFree++;
+			if(numMovable + numFree == chunkPages) {
+				victim = base;
+				break;
+			}
+		}
+
+		if(victim == PhysicalAddr(-1)) {
+			if(logCompaction)
+				infoLogger() << "thor: No compaction candidate for order " << order
+						<< " among " << movable.size() << " movable pages" << frg::endlog;
+			physicalAllocator->accountCompaction(false, 0);
+			return false;
+		}
+
+		// Destination pages must not come from the victim chunk itself.
+		// Pages of the victim chunk are held until the migration is done.
+		frg::vector<PhysicalAddr, KernelAlloc> held{*kernelAlloc};
+		auto allocateOutside = [&] () -> PhysicalAddr {
+			while(true) {
+				auto physical = physicalAllocator->allocate(kPageSize);
+				if(physical == PhysicalAddr(-1))
+					return physical;
+				if(physical < victim || physical >= victim + chunkSize)
+					return physical;
+				held.push_back(physical);
+			}
+		};
+
+		size_t numMigrated = 0;
+		for(auto &page : movable) {
+			if((page.physical & ~PhysicalAddr(chunkSize - 1)) != victim)
+				continue;
+			auto newPhysical = allocateOutside();
+			if(newPhysical == PhysicalAddr(-1))
+				break;
+			if(!KernelFiber::asyncBlockCurrent(page.space->migratePage(page.index,
+					page.physical, newPhysical))) {
+				physicalAllocator->free(newPhysical, kPageSize);
+				continue;
+			}
+			physicalAllocator->free(page.physical, kPageSize);
+			numMigrated++;
+		}
+
+		for(auto physical : held)
+			physicalAllocator->free(physical, kPageSize);
+		// Make sure that the freed pages are returned to the buddy allocator.
+		physicalAllocator->drainLocalMagazine();
+
+		bool success = true;
+		for(size_t off = 0; off < chunkSize; off += kPageSize) {
+			if(!physicalAllocator->isFree(victim + off)) {
+				success = false;
+				break;
+			}
+		}
+
+		if(logCompaction)
+			infoLogger() << "thor: Compaction of order " << order << " at 0x"
+					<< frg::hex_fmt{victim} << " migrated " << numMigrated << " pages"
+					<< (success ? "" : " but failed") << frg::endlog;
+		physicalAllocator->accountCompaction(success, numMigrated);
+		return success;
+	}
+
+	bool needsBackgroundCompaction() {
+		auto stats = physicalAllocator->getFragmentationStats();
+		size_t numFreePages = 0;
+		for(int o = 0; o < numFreeChunkOrders; o++) {
+			if(o >= backgroundCompactionOrder && stats.numFreeChunks[o])
+				return false;
+			numFreePages += stats.numFreeChunks[o] << o;
+		}
+		return numFreePages >= minFreePagesForBackground;
+	}
+
+	void runCompactionFiber() {
+		KernelFiber::run([] {
+			uint64_t ticks = 0;
+			while(true) {
+				KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(100'000'000));
+				ticks++;
+
+				// Failed allocations cannot block; they only post a request.
+				auto order = physicalAllocator->takeCompactionRequest();
+				if(order > maxCompactionOrder)
+					order = -1;
+				if(order < 0 && !(ticks % 100) && needsBackgroundCompaction())
+					order = backgroundCompactionOrder;
+				if(order < 0)
+					continue;
+				compactPhysicalMemory(order);
+			}
+		});
+	}
+}
+
+static initgraph::Task initCompaction{&globalInitEngine, "generic.init-compaction",
+	initgraph::Requires{&initReclaim},
+	[] {
+		runCompactionFiber();
+	}
+};
+
+// --------------------------------------------------------
+// Memory pressure.
+// --------------------------------------------------------
+
+// The pressure level is derived from the fraction of free physical memory.
+// The low level coincides with the reclaimer's watermark, i.e., cached pages are
+// already being evicted. A level is only left once the free memory exceeds its
+// watermark by a margin; this avoids flapping notifications around a watermark.
+
+namespace {
+	// Watermarks in 1/64 of the total memory; entering a level requires less free memory.
+	constexpr size_t pressureWatermarks[] = {
+		16, // Low.
+		6, // Medium.
+		3 // Critical.
+	};
+	// Leaving a level requires a quarter more free memory than entering it.
+	constexpr size_t pressureHysteresis = 4;
+
+	std::atomic<int> currentPressure{static_cast<int>(MemoryPressure::none)};
+	frg::manual_box<smarter::shared_ptr<BitsetEvent>> pressureEvent;
+
+	void updateMemoryPressure() {
+		auto total = physicalAllocator->numTotalPages();
+		auto free = physicalAllocator->numFreePages();
+
+		int current = currentPressure.load(std::memory_order_relaxed);
+		int level = 0;
+		for(int i = 0; i < 3; i++) {
+			auto watermark = total * pressureWatermarks[i] / 64;
+			// Levels up to the current one are kept until the hysteresis margin is exceeded.
+			if(i < current)
+				watermark += watermark / pressureHysteresis;
+			if(free < watermark)
+				level = i + 1;
+		}
+		if(level == current)
+			return;
+
+		if(logPressure)
+			infoLogger() << "thor: Memory pressure changes from level " << current
+					<< " to " << level << " (" << free << " of " << total
+					<< " pages are free)" << frg::endlog;
+		currentPressure.store(level, std::memory_order_relaxed);
+		(*pressureEvent)->trigger(1 << level);
+	}
+}
+
+MemoryPressure getMemoryPressure() {
+	return static_cast<MemoryPressure>(currentPressure.load(std::memory_order_relaxed));
+}
+
+smarter::shared_ptr<BitsetEvent> getMemoryPressureEvent() {
+	return *pressureEvent;
+}
+
+static initgraph::Task initPressure{&globalInitEngine, "generic.init-memory-pressure",
+	initgraph::Requires{getFibersAvailableStage()},
+	[] {
+		pressureEvent.initialize(smarter::allocate_shared<BitsetEvent>(*kernelAlloc));
+
+		KernelFiber::run([] {
+			while(true) {
+				updateMemoryPressure();
+				KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(100'000'000));
+			}
+		});
+	}
+};
+
 // --------------------------------------------------------
 // MemoryView.
 // --------------------------------------------------------
@@ -246,7 +760,7 @@ coroutine<frg::expected<Error>> MemoryView::copyTo(uintptr_t offset,
 							size_t chunk = frg::min(kPageSize - misalign, nd.size - nd.progress);
 
 							PageAccessor accessor{nd.physical};
-							memcpy(reinterpret_cast<uint8_t *>(accessor.get()) + misalign,
+							copyMemory(reinterpret_cast<uint8_t *>(accessor.get()) + misalign,
 									reinterpret_cast<const uint8_t *>(nd.pointer) + nd.progress,
 									chunk);
 							nd.progress += chunk;
@@ -309,7 +823,7 @@ coroutine<frg::expected<Error>> MemoryView::copyFrom(uintptr_t offset,
 							size_t chunk = frg::min(kPageSize - misalign, nd.size - nd.progress);
 
 							PageAccessor accessor{nd.physical};
-							memcpy(reinterpret_cast<uint8_t *>(nd.pointer) + nd.progress,
+							copyMemory(reinterpret_cast<uint8_t *>(nd.pointer) + nd.progress,
 									reinterpret_cast<uint8_t *>(accessor.get()) + misalign, chunk);
 							nd.progress += chunk;
 						})
@@ -324,6 +838,11 @@ coroutine<frg::expected<Error>> MemoryView::copyFrom(uintptr_t offset,
 	co_return {};
 }
 
+PhysicalRange MemoryView::peekContiguousRange(uintptr_t offset) {
+	auto [physical, cachingMode] = peekRange(offset);
+	return PhysicalRange{physical, kPageSize, cachingMode};
+}
+
 bool MemoryView::asyncLockRange(uintptr_t offset, size_t size,
 		smarter::shared_ptr<WorkQueue>, LockRangeNode *node) {
 	node->result = lockRange(offset, size);
@@ -335,8 +854,9 @@ MemoryView::touchRange(uintptr_t offset, size_t size,
 		FetchFlags flags, smarter::shared_ptr<WorkQueue> wq) {
 	size_t progress = 0;
 	while(progress < size) {
-		FRG_CO_TRY(co_await fetchRange(offset + progress, flags, wq));
-		progress += kPageSize;
+		auto range = FRG_CO_TRY(co_await fetchRange(offset + progress, flags, wq));
+		// Skip over the whole range if the view backs it contiguously (e.g., huge chunks).
+		progress += frg::max(range.get<1>() & ~(kPageSize - 1), size_t{kPageSize});
 	}
 	co_return {};
 }
@@ -345,15 +865,28 @@ Error MemoryView::updateRange(ManageRequest, size_t, size_t) {
 	return Error::illegalObject;
 }
 
+frg::expected<Error, size_t> MemoryView::countWriteback(size_t, size_t) {
+	return Error::illegalObject;
+}
+
 void MemoryView::submitManage(ManageNode *) {
 	panicLogger() << "MemoryView does not support management!" << frg::endlog;
 }
 
+void MemoryView::loadahead(uintptr_t, size_t) {
+	// Views that are not backed by a pager are always present; ignore the hint.
+}
+
 Error MemoryView::setIndirection(size_t, smarter::shared_ptr<MemoryView>,
 		uintptr_t, size_t) {
 	return Error::illegalObject;
 }
 
+frg::expected<Error, smarter::shared_ptr<MemoryView>>
+MemoryView::withCachingMode(CachingMode) {
+	return Error::illegalObject;
+}
+
 // --------------------------------------------------------
 // getZeroMemory()
 // --------------------------------------------------------
@@ -436,6 +969,17 @@ smarter::shared_ptr<MemoryView> getZeroMemory() {
 	return singleton.get();
 }
 
+PhysicalAddr getZeroPage() {
+	static PhysicalAddr zeroPage = [] {
+		auto physical = physicalAllocator->allocate(kPageSize);
+		assert(physical != PhysicalAddr(-1) && "OOM");
+		PageAccessor accessor{physical};
+		memset(accessor.get(), 0, kPageSize);
+		return physical;
+	}();
+	return zeroPage;
+}
+
 // --------------------------------------------------------
 // ImmediateMemory
 // --------------------------------------------------------
@@ -445,12 +989,9 @@ ImmediateMemory::ImmediateMemory(size_t length)
 	auto numPages = (length + kPageSize - 1) >> kPageShift;
 	_physicalPages.resize(numPages);
 	for(size_t i = 0; i < numPages; ++i) {
-		auto physical = physicalAllocator->allocate(kPageSize, 64);
+		auto physical = physicalAllocator->allocateZeroed(kPageSize, 64);
 		assert(physical != PhysicalAddr(-1) && "OOM when allocating ImmediateMemory");
 
-		PageAccessor accessor{physical};
-		memset(accessor.get(), 0, kPageSize);
-
 		_physicalPages[i] = physical;
 	}
 }
@@ -470,12 +1011,9 @@ void ImmediateMemory::resize(size_t newSize, async::any_receiver<void> receiver)
 		assert(newNumPages >= currentNumPages);
 		_physicalPages.resize(newNumPages);
 		for(size_t i = currentNumPages; i < newNumPages; ++i) {
-			auto physical = physicalAllocator->allocate(kPageSize, 64);
+			auto physical = physicalAllocator->allocateZeroed(kPageSize, 64);
 			assert(physical != PhysicalAddr(-1) && "OOM when allocating ImmediateMemory");
 
-			PageAccessor accessor{physical};
-			memset(accessor.get(), 0, kPageSize);
-
 			_physicalPages[i] = physical;
 		}
 	}
@@ -586,6 +1124,13 @@ void HardwareMemory::markDirty(uintptr_t, size_t) {
 	// We never evict memory, there is no need to track dirty pages.
 }
 
+frg::expected<Error, smarter::shared_ptr<MemoryView>>
+HardwareMemory::withCachingMode(CachingMode mode) {
+	// The new view aliases the same physical range; it only differs in its page attributes.
+	return smarter::shared_ptr<MemoryView>{smarter::allocate_shared<HardwareMemory>(
+			*kernelAlloc, _base, _length, mode)};
+}
+
 size_t HardwareMemory::getLength() {
 	return _length;
 }
@@ -595,25 +1140,29 @@ size_t HardwareMemory::getLength() {
 // --------------------------------------------------------
 
 AllocatedMemory::AllocatedMemory(size_t desiredLngth,
-		int addressBits, size_t desiredChunkSize, size_t chunkAlign)
-: _physicalChunks{*kernelAlloc},
-		_addressBits{addressBits}, _chunkAlign{chunkAlign} {
+		int addressBits, size_t desiredChunkSize, size_t chunkAlign, bool chunkFallback)
+: _physicalChunks{*kernelAlloc}, _fallbackPages{*kernelAlloc},
+		_addressBits{addressBits}, _chunkAlign{chunkAlign}, _chunkFallback{chunkFallback} {
 	static_assert(sizeof(unsigned long) == sizeof(uint64_t), "Fix use of __builtin_clzl");
 	_chunkSize = size_t(1) << (64 - __builtin_clzl(desiredChunkSize - 1));
 	if(_chunkSize != desiredChunkSize)
 		infoLogger() << "\e[31mPhysical allocation of size " << (void *)desiredChunkSize
 				<< " rounded up to power of 2\e[39m" << frg::endlog;
 
+	// With chunk fallback, the last chunk can extend beyond the length.
 	size_t length = (desiredLngth + (_chunkSize - 1)) & ~(_chunkSize - 1);
-	if(length != desiredLngth)
+	if(length != desiredLngth && !_chunkFallback)
 		infoLogger() << "\e[31mMemory length " << (void *)desiredLngth
 				<< " rounded up to chunk size " << (void *)_chunkSize
 				<< "\e[39m" << frg::endlog;
+	_length = _chunkFallback ? desiredLngth : length;
 
 	assert(_chunkSize % kPageSize == 0);
 	assert(_chunkAlign % kPageSize == 0);
 	assert(_chunkSize % _chunkAlign == 0);
 	_physicalChunks.resize(length / _chunkSize, PhysicalAddr(-1));
+	if(_chunkFallback)
+		_fallbackPages.resize(length / _chunkSize, nullptr);
 }
 
 AllocatedMemory::~AllocatedMemory() {
@@ -626,6 +1175,15 @@ AllocatedMemory::~AllocatedMemory() {
 		if(_physicalChunks[i] != PhysicalAddr(-1))
 			physicalAllocator->free(_physicalChunks[i], _chunkSize);
 	}
+	for(size_t i = 0; i < _fallbackPages.size(); ++i) {
+		if(!_fallbackPages[i])
+			continue;
+		for(size_t k = 0; k < _chunkSize / kPageSize; ++k) {
+			if(_fallbackPages[i][k] != PhysicalAddr(-1))
+				physicalAllocator->free(_fallbackPages[i][k], kPageSize);
+		}
+		kernelAlloc->free(_fallbackPages[i]);
+	}
 	if(logUsage)
 		infoLogger() << "thor:     ("
 				<< (physicalAllocator->numUsedPages() * 4) << " KiB in use)" << frg::endlog;
@@ -636,10 +1194,21 @@ void AllocatedMemory::resize(size_t newSize, async::any_receiver<void> receiver)
 		auto irq_lock = frg::guard(&irqMutex());
 		auto lock = frg::guard(&_mutex);
 
-		assert(!(newSize % _chunkSize));
-		size_t num_chunks = newSize / _chunkSize;
-		assert(num_chunks >= _physicalChunks.size());
-		_physicalChunks.resize(num_chunks, PhysicalAddr(-1));
+		if(_chunkFallback) {
+			// Chunks that were backed by pages keep that backing; the remaining part of
+			// the (formerly) last chunk is populated by pages, too.
+			size_t num_chunks = (newSize + (_chunkSize - 1)) / _chunkSize;
+			assert(newSize >= _length);
+			_physicalChunks.resize(num_chunks, PhysicalAddr(-1));
+			_fallbackPages.resize(num_chunks, nullptr);
+			_length = newSize;
+		}else{
+			assert(!(newSize % _chunkSize));
+			size_t num_chunks = newSize / _chunkSize;
+			assert(num_chunks >= _physicalChunks.size());
+			_physicalChunks.resize(num_chunks, PhysicalAddr(-1));
+			_length = newSize;
+		}
 	}
 	receiver.set_value();
 }
@@ -669,14 +1238,91 @@ frg::tuple<PhysicalAddr, CachingMode> AllocatedMemory::peekRange(uintptr_t offse
 	auto disp = offset & (_chunkSize - 1);
 	assert(index < _physicalChunks.size());
 
-	if(_physicalChunks[index] == PhysicalAddr(-1))
+	if(_physicalChunks[index] == PhysicalAddr(-1)) {
+		if(_chunkFallback && _fallbackPages[index])
+			return frg::tuple<PhysicalAddr, CachingMode>{_fallbackPages[index][disp >> kPageShift],
+					CachingMode::null};
 		return frg::tuple<PhysicalAddr, CachingMode>{PhysicalAddr(-1), CachingMode::null};
+	}
 	return frg::tuple<PhysicalAddr, CachingMode>{_physicalChunks[index] + disp,
 			CachingMode::null};
 }
 
+PhysicalRange AllocatedMemory::peekContiguousRange(uintptr_t offset) {
+	assert(offset % kPageSize == 0);
+
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	auto index = offset / _chunkSize;
+	auto disp = offset & (_chunkSize - 1);
+	assert(index < _physicalChunks.size());
+
+	if(_physicalChunks[index] == PhysicalAddr(-1)) {
+		if(_chunkFallback && _fallbackPages[index])
+			return PhysicalRange{_fallbackPages[index][disp >> kPageShift], kPageSize,
+					CachingMode::null};
+		return PhysicalRange{PhysicalAddr(-1), kPageSize, CachingMode::null};
+	}
+	return PhysicalRange{_physicalChunks[index] + disp, _chunkSize - disp, CachingMode::null};
+}
+
 coroutine<frg::expected<Error, PhysicalRange>>
 AllocatedMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<WorkQueue>) {
+	if(_chunkFallback) {
+		auto index = offset / _chunkSize;
+		auto disp = offset & (_chunkSize - 1);
+
+		// Try to allocate a full chunk first. Since this can be slow for large chunks,
+		// we do not hold the lock during the allocation.
+		PhysicalAddr physical = PhysicalAddr(-1);
+		bool wantChunk;
+		{
+			auto irq_lock = frg::guard(&irqMutex());
+			auto lock = frg::guard(&_mutex);
+
+			assert(index < _physicalChunks.size());
+			if(_physicalChunks[index] != PhysicalAddr(-1))
+				co_return PhysicalRange{_physicalChunks[index] + disp, _chunkSize - disp,
+						CachingMode::null};
+			wantChunk = !_fallbackPages[index] && (index + 1) * _chunkSize <= _length;
+		}
+		if(wantChunk)
+			physical = physicalAllocator->allocateZeroed(_chunkSize, _addressBits);
+
+		auto irq_lock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		if(physical != PhysicalAddr(-1)) {
+			assert(!(physical & (_chunkAlign - 1)));
+			if(_physicalChunks[index] == PhysicalAddr(-1) && !_fallbackPages[index]) {
+				_physicalChunks[index] = physical;
+			}else{
+				physicalAllocator->free(physical, _chunkSize);
+			}
+		}
+		if(_physicalChunks[index] != PhysicalAddr(-1))
+			co_return PhysicalRange{_physicalChunks[index] + disp, _chunkSize - disp,
+					CachingMode::null};
+
+		// Fall back to individual pages.
+		if(!_fallbackPages[index]) {
+			auto numPages = _chunkSize / kPageSize;
+			auto pages = static_cast<PhysicalAddr *>(
+					kernelAlloc->allocate(numPages * sizeof(PhysicalAddr)));
+			for(size_t k = 0; k < numPages; ++k)
+				pages[k] = PhysicalAddr(-1);
+			_fallbackPages[index] = pages;
+		}
+		auto &page = _fallbackPages[index][disp >> kPageShift];
+		if(page == PhysicalAddr(-1)) {
+			page = physicalAllocator->allocateZeroed(kPageSize, _addressBits);
+			assert(page != PhysicalAddr(-1) && "OOM");
+		}
+		co_return PhysicalRange{page + (disp & (kPageSize - 1)),
+				kPageSize - (disp & (kPageSize - 1)), CachingMode::null};
+	}
+
 	auto irq_lock = frg::guard(&irqMutex());
 	auto lock = frg::guard(&_mutex);
 
@@ -685,14 +1331,10 @@ AllocatedMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<Wo
 	assert(index < _physicalChunks.size());
 
 	if(_physicalChunks[index] == PhysicalAddr(-1)) {
-		auto physical = physicalAllocator->allocate(_chunkSize, _addressBits);
+		auto physical = physicalAllocator->allocateZeroed(_chunkSize, _addressBits);
 		assert(physical != PhysicalAddr(-1) && "OOM");
 		assert(!(physical & (_chunkAlign - 1)));
 
-		for(size_t pg_progress = 0; pg_progress < _chunkSize; pg_progress += kPageSize) {
-			PageAccessor accessor{physical + pg_progress};
-			memset(accessor.get(), 0, kPageSize);
-		}
 		_physicalChunks[index] = physical;
 	}
 
@@ -704,11 +1346,48 @@ void AllocatedMemory::markDirty(uintptr_t, size_t) {
 	// Do nothing for now.
 }
 
+void AllocatedMemory::loadahead(uintptr_t offset, size_t size) {
+	size_t firstIndex = offset / _chunkSize;
+	size_t endIndex = (offset + size + (_chunkSize - 1)) / _chunkSize;
+
+	for(size_t index = firstIndex; index < endIndex; index++) {
+		// As in fetchRange(), we do not hold the lock during the allocation.
+		{
+			auto irq_lock = frg::guard(&irqMutex());
+			auto lock = frg::guard(&_mutex);
+
+			if(index >= _physicalChunks.size())
+				return;
+			if(_physicalChunks[index] != PhysicalAddr(-1))
+				continue;
+			// Chunks that fall back to pages (or that exceed the length) are populated on fault.
+			if(_chunkFallback && (_fallbackPages[index] || (index + 1) * _chunkSize > _length))
+				continue;
+		}
+
+		// This is only a hint; leave the chunk to fetchRange() if we are out of memory.
+		auto physical = physicalAllocator->allocateZeroed(_chunkSize, _addressBits);
+		if(physical == PhysicalAddr(-1))
+			return;
+		assert(!(physical & (_chunkAlign - 1)));
+
+		auto irq_lock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		if(_physicalChunks[index] == PhysicalAddr(-1)
+				&& !(_chunkFallback && _fallbackPages[index])) {
+			_physicalChunks[index] = physical;
+		}else{
+			physicalAllocator->free(physical, _chunkSize);
+		}
+	}
+}
+
 size_t AllocatedMemory::getLength() {
 	auto irq_lock = frg::guard(&irqMutex());
 	auto lock = frg::guard(&_mutex);
 
-	return _physicalChunks.size() * _chunkSize;
+	return _length;
 }
 
 coroutine<frg::expected<Error, PhysicalAddr>> AllocatedMemory::takeGlobalFutex(uintptr_t offset,
@@ -769,6 +1448,7 @@ ManagedSpace::ManagedSpace(size_t length, bool readahead)
 
 				pit->loadState = kStateMissing;
 				pit->physical = PhysicalAddr(-1);
+				globalReclaimer->notifyEvicted(&pit->cachePage);
 			}
 
 			if(logUncaching)
@@ -830,6 +1510,45 @@ void ManagedSpace::unlockPages(uintptr_t offset, size_t size) {
 	}
 }
 
+coroutine<bool> ManagedSpace::migratePage(size_t index,
+		PhysicalAddr oldPhysical, PhysicalAddr newPhysical) {
+	ManagedPage *pit;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&mutex);
+
+		pit = pages.find(index);
+		if(!pit || pit->loadState != kStatePresent || pit->lockCount
+				|| pit->physical != oldPhysical)
+			co_return false;
+		// Pages that are handed to the eviction coroutine are not Present anymore;
+		// hence, the page cannot be inflight here.
+		pit->loadState = kStateEvicting;
+		globalReclaimer->removePage(&pit->cachePage);
+	}
+
+	// Remove all mappings such that the old page cannot be written anymore.
+	co_await _evictQueue.evictRange(index << kPageShift, kPageSize);
+
+	auto irqLock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&mutex);
+
+	// Faults and lockPages() move the page back to Present; the page stays where it is.
+	if(pit->loadState != kStateEvicting)
+		co_return false;
+	assert(!pit->lockCount);
+	assert(pit->physical == oldPhysical);
+
+	PageAccessor newAccessor{newPhysical};
+	PageAccessor oldAccessor{oldPhysical};
+	copyPage(newAccessor.get(), oldAccessor.get());
+
+	__atomic_store_n(&pit->physical, newPhysical, __ATOMIC_RELAXED);
+	pit->loadState = kStatePresent;
+	globalReclaimer->addPage(&pit->cachePage);
+	co_return true;
+}
+
 void ManagedSpace::submitManagement(ManageNode *node) {
 	ManageList pending;
 	{
@@ -869,6 +1588,85 @@ void ManagedSpace::submitMonitor(MonitorNode *node) {
 
 }
 
+void ManagedSpace::loadahead(uintptr_t offset, size_t size) {
+	ManageList pending;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&mutex);
+
+		auto index = offset >> kPageShift;
+		if(index >= numPages)
+			return;
+		auto count = frg::min((size + kPageSize - 1) >> kPageShift, numPages - index);
+		if(!count)
+			return;
+
+		// Explicit hints are honored in full; the window that is used for
+		// subsequent sequential accesses is bounded by maxReadahead.
+		_issueReadahead(index, count);
+		_raWindow = frg::min(count, maxReadahead);
+		_progressManagement(pending);
+	}
+
+	while(!pending.empty()) {
+		auto node = pending.pop_front();
+		node->complete();
+	}
+}
+
+void ManagedSpace::_readaheadOnMiss(size_t index) {
+	size_t window;
+	if(index == _raNextIndex && _raWindow) {
+		// Sequential access that overtook the readahead window.
+		window = frg::min(_raWindow * 2, maxReadahead);
+	}else if(_raWindow && index >= _raNextIndex - _raWindow && index < _raNextIndex) {
+		// Miss within the current window (e.g., the page was evicted).
+		window = _raWindow;
+	}else{
+		// Random access. Only read ahead if this looks like the start of a sequential scan.
+		auto prev = index ? pages.find(index - 1) : nullptr;
+		if(!index || (prev && prev->loadState != kStateMissing)) {
+			window = initialReadahead;
+		}else{
+			window = 1;
+		}
+	}
+
+	_issueReadahead(index, frg::min(window, numPages - index));
+	_raWindow = window;
+}
+
+void ManagedSpace::_readaheadOnHit(size_t index) {
+	if(index != _raMarkerIndex)
+		return;
+	_raMarkerIndex = size_t(-1);
+	if(_raNextIndex >= numPages)
+		return;
+
+	auto window = frg::min(_raWindow * 2, maxReadahead);
+	_issueReadahead(_raNextIndex, frg::min(window, numPages - _raNextIndex));
+	_raWindow = window;
+}
+
+void ManagedSpace::_issueReadahead(size_t index, size_t count) {
+	assert(index + count <= numPages);
+	for(size_t i = 0; i < count; ++i) {
+		auto [pit, wasInserted] = pages.find_or_insert(index + i, this, index + i);
+		assert(pit);
+		if(pit->loadState == kStateMissing) {
+			pit->loadState = kStateWantInitialization;
+			_initializationList.push_back(&pit->cachePage);
+		}
+	}
+
+	_raNextIndex = index + count;
+	if(count >= initialReadahead) {
+		_raMarkerIndex = index + count / 2;
+	}else{
+		_raMarkerIndex = size_t(-1);
+	}
+}
+
 void ManagedSpace::_progressManagement(ManageList &pending) {
 	// For now, we prefer writeback to initialization.
 	// "Proper" priorization should probably be done in the userspace driver
@@ -1030,11 +1828,9 @@ BackingMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<Work
 	assert(pit);
 
 	if(pit->physical == PhysicalAddr(-1)) {
-		PhysicalAddr physical = physicalAllocator->allocate(kPageSize);
+		PhysicalAddr physical = physicalAllocator->allocateZeroed(kPageSize);
 		assert(physical != PhysicalAddr(-1) && "OOM");
 
-		PageAccessor accessor{physical};
-		memset(accessor.get(), 0, kPageSize);
 		pit->physical = physical;
 	}
 
@@ -1114,6 +1910,29 @@ Error BackingMemory::updateRange(ManageRequest type, size_t offset, size_t lengt
 	return Error::success;
 }
 
+frg::expected<Error, size_t> BackingMemory::countWriteback(size_t offset, size_t length) {
+	assert((offset % kPageSize) == 0);
+	assert((length % kPageSize) == 0);
+
+	auto irqLock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_managed->mutex);
+
+	if((offset + length) / kPageSize > _managed->numPages)
+		return Error::illegalArgs;
+
+	size_t count = 0;
+	for(size_t pg = 0; pg < length; pg += kPageSize) {
+		auto pit = _managed->pages.find((offset + pg) / kPageSize);
+		if(!pit)
+			continue;
+		if(pit->loadState == ManagedSpace::kStateWantWriteback
+				|| pit->loadState == ManagedSpace::kStateWriteback
+				|| pit->loadState == ManagedSpace::kStateAnotherWriteback)
+			count++;
+	}
+	return count;
+}
+
 // --------------------------------------------------------
 // FrontalMemory
 // --------------------------------------------------------
@@ -1175,6 +1994,7 @@ FrontalMemory::fetchRange(uintptr_t offset, FetchFlags flags, smarter::shared_pt
 	ManageList pendingManagement;
 	MonitorList pendingMonitors;
 	MonitorNode fetchMonitor;
+	PhysicalAddr fastPhysical = PhysicalAddr(-1);
 	{
 		auto irq_lock = frg::guard(&irqMutex());
 		auto lock = frg::guard(&_managed->mutex);
@@ -1201,45 +2021,39 @@ FrontalMemory::fetchRange(uintptr_t offset, FetchFlags flags, smarter::shared_pt
 				globalReclaimer->addPage(&pit->cachePage);
 			}
 
-			co_return PhysicalRange{physical + misalign, kPageSize - misalign, CachingMode::null};
+			// Start loading the next readahead window if we hit the marker.
+			if(_managed->readahead && index == _managed->_raMarkerIndex) {
+				_managed->_readaheadOnHit(index);
+				_managed->_progressManagement(pendingManagement);
+			}
+			fastPhysical = physical;
 		}else{
 			assert(pit->loadState == ManagedSpace::kStateMissing
 					|| pit->loadState == ManagedSpace::kStateWantInitialization
 					|| pit->loadState == ManagedSpace::kStateInitialization);
-		}
-
-		if(flags & fetchDisallowBacking) {
-			infoLogger() << "\e[31m" "thor: Backing of page is disallowed" "\e[39m"
-					<< frg::endlog;
-			co_return Error::fault;
-		}
 
-		// We have to take the slow-path, i.e., perform the fetch asynchronously.
-		if(pit->loadState == ManagedSpace::kStateMissing) {
-			pit->loadState = ManagedSpace::kStateWantInitialization;
-			_managed->_initializationList.push_back(&pit->cachePage);
-		}
+			if(flags & fetchDisallowBacking) {
+				infoLogger() << "\e[31m" "thor: Backing of page is disallowed" "\e[39m"
+						<< frg::endlog;
+				co_return Error::fault;
+			}
 
-		// Perform readahead.
-		if(_managed->readahead)
-			for(size_t i = 1; i < 4; ++i) {
-				if(!(index + i < _managed->numPages))
-					break;
-				auto [pit, wasInserted] = _managed->pages.find_or_insert(
-						index + i, _managed.get(), index + i);
-				assert(pit);
-				if(pit->loadState == ManagedSpace::kStateMissing) {
-					pit->loadState = ManagedSpace::kStateWantInitialization;
-					_managed->_initializationList.push_back(&pit->cachePage);
-				}
+			// We have to take the slow-path, i.e., perform the fetch asynchronously.
+			// If readahead is enabled, the window includes the current page.
+			if(_managed->readahead) {
+				_managed->_readaheadOnMiss(index);
+			}else if(pit->loadState == ManagedSpace::kStateMissing) {
+				pit->loadState = ManagedSpace::kStateWantInitialization;
+				_managed->_initializationList.push_back(&pit->cachePage);
 			}
 
-		_managed->_progressManagement(pendingManagement);
+			_managed->_progressManagement(pendingManagement);
 
-		fetchMonitor.setup(ManageRequest::initialize, offset, kPageSize);
-		fetchMonitor.progress = 0;
-		_managed->_monitorQueue.push_back(&fetchMonitor);
-		_managed->_progressMonitors(pendingMonitors);
+			fetchMonitor.setup(ManageRequest::initialize, offset, kPageSize);
+			fetchMonitor.progress = 0;
+			_managed->_monitorQueue.push_back(&fetchMonitor);
+			_managed->_progressMonitors(pendingMonitors);
+		}
 	}
 
 	while(!pendingManagement.empty()) {
@@ -1251,6 +2065,9 @@ FrontalMemory::fetchRange(uintptr_t offset, FetchFlags flags, smarter::shared_pt
 		node->event.raise();
 	}
 
+	if(fastPhysical != PhysicalAddr(-1))
+		co_return PhysicalRange{fastPhysical + misalign, kPageSize - misalign, CachingMode::null};
+
 	co_await fetchMonitor.event.wait();
 	assert(fetchMonitor.error() == Error::success);
 
@@ -1269,6 +2086,10 @@ FrontalMemory::fetchRange(uintptr_t offset, FetchFlags flags, smarter::shared_pt
 	co_return PhysicalRange{physical + misalign, kPageSize - misalign, CachingMode::null};
 }
 
+void FrontalMemory::loadahead(uintptr_t offset, size_t size) {
+	_managed->loadahead(offset, size);
+}
+
 void FrontalMemory::markDirty(uintptr_t offset, size_t size) {
 	assert(!(offset % kPageSize));
 	assert(!(size % kPageSize));
@@ -1447,6 +2268,7 @@ CopyOnWriteMemory::CopyOnWriteMemory(smarter::shared_ptr<MemoryView> view,
 		smarter::shared_ptr<CowChain> chain)
 : MemoryView{&_evictQueue}, _view{std::move(view)},
 		_viewOffset{offset}, _length{length}, _copyChain{std::move(chain)},
+		_viewIsZero{_view.get() == getZeroMemory().get()},
 		_ownedPages{*kernelAlloc} {
 	assert(length);
 	assert(!(offset & (kPageSize - 1)));
@@ -1455,8 +2277,18 @@ CopyOnWriteMemory::CopyOnWriteMemory(smarter::shared_ptr<MemoryView> view,
 
 CopyOnWriteMemory::~CopyOnWriteMemory() {
 	for(auto it = _ownedPages.begin(); it != _ownedPages.end(); ++it) {
+		if(it->state == CowState::zero)
+			continue;
+		if(it->state == CowState::compressed) {
+			kernelAlloc->free(it->compressedData);
+			globalReclaimer->notifyDecompressed(it->compressedSize, false);
+			continue;
+		}
+		// compressPage() holds a reference, hence no page is evicting.
 		assert(it->state == CowState::hasCopy);
 		assert(it->physical != PhysicalAddr(-1));
+		if(it->tracked)
+			globalReclaimer->removeAnonPage(&it->cachePage);
 		physicalAllocator->free(it->physical, kPageSize);
 	}
 }
@@ -1497,28 +2329,47 @@ void CopyOnWriteMemory::fork(async::any_receiver<frg::tuple<Error, smarter::shar
 		for(size_t pg = 0; pg < _length; pg += kPageSize) {
 			auto osIt = _ownedPages.find(pg >> kPageShift);
 
-			if(!osIt)
+			// Zero pages stay with the original mapping. The forked mapping
+			// reads them from the root view, which is also zero.
+			if(!osIt || osIt->state == CowState::zero)
 				continue;
-			assert(osIt->state == CowState::hasCopy);
+
+			// Duplicating the compressed data is cheaper than decompressing the page.
+			if(osIt->state == CowState::compressed) {
+				auto data = kernelAlloc->allocate(osIt->compressedSize);
+				memcpy(data, osIt->compressedData, osIt->compressedSize);
+				globalReclaimer->notifyDuplicated(osIt->compressedSize);
+
+				auto fsIt = forked->_ownedPages.insert(pg >> kPageShift);
+				fsIt->state = CowState::compressed;
+				fsIt->compressedData = data;
+				fsIt->compressedSize = osIt->compressedSize;
+				continue;
+			}
+			assert(osIt->state == CowState::hasCopy || osIt->state == CowState::evicting);
 
 			// The page is locked. We *need* to keep it in the old address space.
-			if(osIt->lockCount /*|| disableCow */) {
+			// Pages that are being compressed also stay (compressPage() expects that).
+			if(osIt->lockCount || osIt->state == CowState::evicting /*|| disableCow */) {
 				// Allocate a new physical page for a copy.
 				auto copyPhysical = physicalAllocator->allocate(kPageSize);
 				assert(copyPhysical != PhysicalAddr(-1) && "OOM");
 
-				// As the page is locked anyway, we can just copy it synchronously.
+				// As the page is locked (or unmapped) anyway, we can just copy it synchronously.
 				PageAccessor lockedAccessor{osIt->physical};
 				PageAccessor copyAccessor{copyPhysical};
-				memcpy(copyAccessor.get(), lockedAccessor.get(), kPageSize);
+				copyPage(copyAccessor.get(), lockedAccessor.get());
 
 				// Update the chains.
 				auto fsIt = forked->_ownedPages.insert(pg >> kPageShift);
 				fsIt->state = CowState::hasCopy;
 				fsIt->physical = copyPhysical;
+				forked->_updateTracking(pg >> kPageShift, fsIt);
 			}else{
 				auto physical = osIt->physical;
 				assert(physical != PhysicalAddr(-1));
+				if(osIt->tracked)
+					globalReclaimer->removeAnonPage(&osIt->cachePage);
 
 				// Update the chains.
 				auto pageOffset = _viewOffset + pg;
@@ -1539,6 +2390,98 @@ void CopyOnWriteMemory::fork(async::any_receiver<frg::tuple<Error, smarter::shar
 	}(this, std::move(forked), receiver));
 }
 
+void CopyOnWriteMemory::_collapseChains() {
+	// Since all references to a CowChain are either held by CopyOnWriteMemory objects
+	// (protected by their _mutex) or by the next chain (protected by its _mutex),
+	// a reference count of one means that nobody else can reach the chain.
+	// Temporary references (e.g., of concurrent faults) prevent the collapse.
+
+	// Drop empty chains that are not shared.
+	while(_copyChain && _copyChain.ctr()->check_count() == 1) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_copyChain->_mutex);
+		if(_copyChain->_pages.begin() != _copyChain->_pages.end())
+			break;
+		auto superChain = std::move(_copyChain->_superChain);
+		lock.unlock();
+		_copyChain = std::move(superChain);
+	}
+
+	// Merge super chains that are only referenced by their child chain.
+	// Note that we hold a reference while walking; this prevents concurrent collapses
+	// of the chain that we are currently looking at.
+	auto chain = _copyChain;
+	while(chain) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&chain->_mutex);
+
+		auto superChain = chain->_superChain.get();
+		if(!superChain)
+			break;
+		if(chain->_superChain.ctr()->check_count() != 1) {
+			auto next = chain->_superChain;
+			lock.unlock();
+			irqLock.unlock();
+			chain = std::move(next);
+			continue;
+		}
+
+		{
+			auto superLock = frg::guard(&superChain->_mutex);
+
+			// Pages in the child chain shadow the pages in the super chain.
+			// Shadowed pages are freed by the super chain's destructor;
+			// moved pages are replaced by PhysicalAddr(-1).
+			for(auto it = superChain->_pages.begin(); it != superChain->_pages.end(); ++it) {
+				auto index = it.key();
+				if(chain->_pages.find(index))
+					continue;
+				auto physical = it->exchange(PhysicalAddr(-1), std::memory_order_relaxed);
+				assert(physical != PhysicalAddr(-1));
+				auto newIt = chain->_pages.insert(index, PhysicalAddr(-1));
+				newIt->store(physical, std::memory_order_relaxed);
+			}
+		}
+
+		// Releasing the reference destructs the super chain.
+		auto superSuperChain = std::move(superChain->_superChain);
+		chain->_superChain = std::move(superSuperChain);
+	}
+}
+
+bool CopyOnWriteMemory::_chainHasPage(uintptr_t pageOffset) {
+	auto chain = _copyChain;
+	while(chain) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&chain->_mutex);
+
+		if(chain->_pages.find(pageOffset >> kPageShift))
+			return true;
+
+		auto superChain = chain->_superChain;
+		lock.unlock();
+		irqLock.unlock();
+		chain = std::move(superChain);
+	}
+	return false;
+}
+
+PhysicalAddr CopyOnWriteMemory::_migrateFromChain(uintptr_t pageOffset) {
+	if(!_copyChain || _copyChain.ctr()->check_count() != 1)
+		return PhysicalAddr(-1);
+
+	auto irqLock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_copyChain->_mutex);
+
+	auto it = _copyChain->_pages.find(pageOffset >> kPageShift);
+	if(!it)
+		return PhysicalAddr(-1);
+	auto physical = it->load(std::memory_order_relaxed);
+	assert(physical != PhysicalAddr(-1));
+	_copyChain->_pages.erase(pageOffset >> kPageShift);
+	return physical;
+}
+
 Error CopyOnWriteMemory::lockRange(uintptr_t, size_t) {
 	panicLogger() << "CopyOnWriteMemory does not support synchronous lockRange()"
 			<< frg::endlog;
@@ -1560,6 +2503,9 @@ bool CopyOnWriteMemory::asyncLockRange(uintptr_t offset, size_t size,
 			uintptr_t viewOffset;
 			CowPage *cowIt;
 			bool waitForCopy = false;
+			PhysicalAddr migrated = PhysicalAddr(-1);
+			void *compressedData = nullptr;
+			size_t compressedSize = 0;
 			{
 				// If the page is present in our private chain, we just return it.
 				auto irqLock = frg::guard(&irqMutex());
@@ -1567,17 +2513,32 @@ bool CopyOnWriteMemory::asyncLockRange(uintptr_t offset, size_t size,
 
 				cowIt = self->_ownedPages.find(offset >> kPageShift);
 				if(cowIt) {
-					if(cowIt->state == CowState::hasCopy) {
+					if(cowIt->state == CowState::hasCopy || cowIt->state == CowState::evicting) {
 						assert(cowIt->physical != PhysicalAddr(-1));
 
+						// This cancels the compression of evicting pages.
+						cowIt->state = CowState::hasCopy;
 						cowIt->lockCount++;
+						self->_updateTracking(offset >> kPageShift, cowIt);
 						progress += kPageSize;
 						continue;
+					}else if(cowIt->state == CowState::compressed) {
+						compressedData = cowIt->compressedData;
+						compressedSize = cowIt->compressedSize;
+						cowIt->compressedData = nullptr;
+						cowIt->state = CowState::inProgress;
+					}else if(cowIt->state == CowState::zero) {
+						// Locked pages need a private copy; no chain has the page.
+						view = self->_view;
+						viewOffset = self->_viewOffset;
+						cowIt->state = CowState::inProgress;
 					}else{
 						assert(cowIt->state == CowState::inProgress);
 						waitForCopy = true;
 					}
 				}else{
+					self->_collapseChains();
+					migrated = self->_migrateFromChain(self->_viewOffset + offset);
 					chain = self->_copyChain;
 					view = self->_view;
 					viewOffset = self->_viewOffset;
@@ -1596,53 +2557,62 @@ bool CopyOnWriteMemory::asyncLockRange(uintptr_t offset, size_t size,
 						auto irqLock = frg::guard(&irqMutex());
 						auto lock = frg::guard(&self->_mutex);
 
-						if(cowIt->state == CowState::inProgress)
-							return true;
-						assert(cowIt->state == CowState::hasCopy);
-						return false;
+						return cowIt->state == CowState::inProgress;
 					});
 					co_await wq->schedule();
 				} while(stillWaiting);
 
+				// The page might have been compressed again in the meantime; retry.
+				continue;
+			}
+
+			if(compressedData) {
+				auto physical = _decompressPage(compressedData, compressedSize);
 				{
 					auto irqLock = frg::guard(&irqMutex());
 					auto lock = frg::guard(&self->_mutex);
 
-					assert(cowIt->state == CowState::hasCopy);
+					assert(cowIt->state == CowState::inProgress);
+					cowIt->state = CowState::hasCopy;
+					cowIt->physical = physical;
 					cowIt->lockCount++;
 				}
+				self->_copyEvent.raise();
 				progress += kPageSize;
 				continue;
 			}
 
-			PhysicalAddr physical = physicalAllocator->allocate(kPageSize);
-			assert(physical != PhysicalAddr(-1) && "OOM");
-			PageAccessor accessor{physical};
+			PhysicalAddr physical = migrated;
+			if(physical == PhysicalAddr(-1)) {
+				physical = physicalAllocator->allocate(kPageSize);
+				assert(physical != PhysicalAddr(-1) && "OOM");
+				PageAccessor accessor{physical};
 
-			// Try to copy from a descendant CoW chain.
-			auto pageOffset = viewOffset + offset;
-			while(chain) {
-				auto irqLock = frg::guard(&irqMutex());
-				auto lock = frg::guard(&chain->_mutex);
-
-				if(auto it = chain->_pages.find(pageOffset >> kPageShift); it) {
-					// We can just copy synchronously here -- the descendant is not evicted.
-					auto srcPhysical = it->load(std::memory_order_relaxed);
-					assert(srcPhysical != PhysicalAddr(-1));
-					auto srcAccessor = PageAccessor{srcPhysical};
-					memcpy(accessor.get(), srcAccessor.get(), kPageSize);
-					break;
-				}
+				// Try to copy from a descendant CoW chain.
+				auto pageOffset = viewOffset + offset;
+				while(chain) {
+					auto irqLock = frg::guard(&irqMutex());
+					auto lock = frg::guard(&chain->_mutex);
+
+					if(auto it = chain->_pages.find(pageOffset >> kPageShift); it) {
+						// We can just copy synchronously here -- the descendant is not evicted.
+						auto srcPhysical = it->load(std::memory_order_relaxed);
+						assert(srcPhysical != PhysicalAddr(-1));
+						auto srcAccessor = PageAccessor{srcPhysical};
+						copyPage(accessor.get(), srcAccessor.get());
+						break;
+					}
 
-				chain = chain->_superChain;
-			}
+					chain = chain->_superChain;
+				}
 
-			// Copy from the root view.
-			if(!chain) {
-				// TODO: Handle errors here -- we need to drop the lock again.
-				auto copyOutcome = co_await view->copyFrom(pageOffset & ~(kPageSize - 1),
-						accessor.get(), kPageSize, wq);
-				assert(copyOutcome);
+				// Copy from the root view.
+				if(!chain) {
+					// TODO: Handle errors here -- we need to drop the lock again.
+					auto copyOutcome = co_await view->copyFrom(pageOffset & ~(kPageSize - 1),
+							accessor.get(), kPageSize, wq);
+					assert(copyOutcome);
+				}
 			}
 
 			// To make CoW unobservable, we first need to evict the page here.
@@ -1678,6 +2648,7 @@ void CopyOnWriteMemory::unlockRange(uintptr_t offset, size_t size) {
 		assert(it->state == CowState::hasCopy);
 		assert(it->lockCount > 0);
 		it->lockCount--;
+		_updateTracking((offset + pg) >> kPageShift, it);
 	}
 }
 
@@ -1686,47 +2657,89 @@ frg::tuple<PhysicalAddr, CachingMode> CopyOnWriteMemory::peekRange(uintptr_t off
 	auto lock = frg::guard(&_mutex);
 
 	if(auto it = _ownedPages.find(offset >> kPageShift); it) {
-		assert(it->state == CowState::hasCopy);
-		return frg::tuple<PhysicalAddr, CachingMode>{it->physical, CachingMode::null};
+		if(it->state == CowState::zero)
+			return frg::tuple<PhysicalAddr, CachingMode>{getZeroPage(), CachingMode::null};
+		if(it->state == CowState::evicting) {
+			// Cancel the compression -- the page is still needed.
+			it->state = CowState::hasCopy;
+			_updateTracking(offset >> kPageShift, it);
+		}
+		if(it->state == CowState::hasCopy)
+			return frg::tuple<PhysicalAddr, CachingMode>{it->physical, CachingMode::null};
 	}
 
 	return frg::tuple<PhysicalAddr, CachingMode>{PhysicalAddr(-1), CachingMode::null};
 }
 
 coroutine<frg::expected<Error, PhysicalRange>>
-CopyOnWriteMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<WorkQueue> wq) {
+CopyOnWriteMemory::fetchRange(uintptr_t offset, FetchFlags flags, smarter::shared_ptr<WorkQueue> wq) {
 	smarter::shared_ptr<CowChain> chain;
 	smarter::shared_ptr<MemoryView> view;
 	uintptr_t viewOffset;
 	CowPage *cowIt;
-	bool waitForCopy = false;
-	{
-		// If the page is present in our private chain, we just return it.
-		auto irqLock = frg::guard(&irqMutex());
-		auto lock = frg::guard(&_mutex);
-
-		cowIt = _ownedPages.find(offset >> kPageShift);
-		if(cowIt) {
-			if(cowIt->state == CowState::hasCopy) {
-				assert(cowIt->physical != PhysicalAddr(-1));
+	PhysicalAddr migrated = PhysicalAddr(-1);
+	void *compressedData = nullptr;
+	size_t compressedSize = 0;
+	while(true) {
+		bool waitForCopy = false;
+		{
+			// If the page is present in our private chain, we just return it.
+			auto irqLock = frg::guard(&irqMutex());
+			auto lock = frg::guard(&_mutex);
 
-				co_return PhysicalRange{cowIt->physical, kPageSize, CachingMode::null};
+			cowIt = _ownedPages.find(offset >> kPageShift);
+			if(cowIt) {
+				if(cowIt->state == CowState::hasCopy || cowIt->state == CowState::evicting) {
+					assert(cowIt->physical != PhysicalAddr(-1));
+
+					// This cancels the compression of evicting pages.
+					cowIt->state = CowState::hasCopy;
+					if(flags & fetchPin)
+						cowIt->pinned = true;
+					_updateTracking(offset >> kPageShift, cowIt);
+					co_return PhysicalRange{cowIt->physical, kPageSize, CachingMode::null};
+				}else if(cowIt->state == CowState::zero) {
+					if(flags & fetchReadOnly)
+						co_return PhysicalRange{getZeroPage(), kPageSize, CachingMode::null};
+
+					// First write to a zero page; no chain has the page.
+					view = _view;
+					viewOffset = _viewOffset;
+					cowIt->state = CowState::inProgress;
+				}else if(cowIt->state == CowState::compressed) {
+					compressedData = cowIt->compressedData;
+					compressedSize = cowIt->compressedSize;
+					cowIt->compressedData = nullptr;
+					cowIt->state = CowState::inProgress;
+				}else{
+					assert(cowIt->state == CowState::inProgress);
+					waitForCopy = true;
+				}
 			}else{
-				assert(cowIt->state == CowState::inProgress);
-				waitForCopy = true;
-			}
-		}else{
-			chain = _copyChain;
-			view = _view;
-			viewOffset = _viewOffset;
+				_collapseChains();
+
+				// Read faults on untouched anonymous memory are served by the zero page.
+				if((flags & fetchReadOnly) && _viewIsZero
+						&& !_chainHasPage(_viewOffset + offset)) {
+					cowIt = _ownedPages.insert(offset >> kPageShift);
+					cowIt->state = CowState::zero;
+					co_return PhysicalRange{getZeroPage(), kPageSize, CachingMode::null};
+				}
 
-			// Otherwise we need to copy from the chain or from the root view.
-			cowIt = _ownedPages.insert(offset >> kPageShift);
-			cowIt->state = CowState::inProgress;
+				migrated = _migrateFromChain(_viewOffset + offset);
+				chain = _copyChain;
+				view = _view;
+				viewOffset = _viewOffset;
+
+				// Otherwise we need to copy from the chain or from the root view.
+				cowIt = _ownedPages.insert(offset >> kPageShift);
+				cowIt->state = CowState::inProgress;
+			}
 		}
-	}
 
-	if(waitForCopy) {
+		if(!waitForCopy)
+			break;
+
 		bool stillWaiting;
 		do {
 			stillWaiting = co_await _copyEvent.async_wait_if([&] () -> bool {
@@ -1734,43 +2747,61 @@ CopyOnWriteMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<
 				auto irqLock = frg::guard(&irqMutex());
 				auto lock = frg::guard(&_mutex);
 
-				if(cowIt->state == CowState::inProgress)
-					return true;
-				assert(cowIt->state == CowState::hasCopy);
-				return false;
+				return cowIt->state == CowState::inProgress;
 			});
 			co_await wq->schedule();
 		} while(stillWaiting);
 
-		co_return PhysicalRange{cowIt->physical, kPageSize, CachingMode::null};
+		// The page might have been compressed again in the meantime; retry.
 	}
 
-	PhysicalAddr physical = physicalAllocator->allocate(kPageSize);
-	assert(physical != PhysicalAddr(-1) && "OOM");
-	PageAccessor accessor{physical};
-
-	// Try to copy from a descendant CoW chain.
-	auto pageOffset = viewOffset + offset;
-	while(chain) {
-		auto irqLock = frg::guard(&irqMutex());
-		auto lock = frg::guard(&chain->_mutex);
+	// Compressed pages are not mapped anywhere, hence we do not need to evict them.
+	if(compressedData) {
+		auto physical = _decompressPage(compressedData, compressedSize);
+		{
+			auto irqLock = frg::guard(&irqMutex());
+			auto lock = frg::guard(&_mutex);
 
-		if(auto it = chain->_pages.find(pageOffset >> kPageShift); it) {
-			// We can just copy synchronously here -- the descendant is not evicted.
-			auto srcPhysical = it->load(std::memory_order_relaxed);
-			assert(srcPhysical != PhysicalAddr(-1));
-			auto srcAccessor = PageAccessor{srcPhysical};
-			memcpy(accessor.get(), srcAccessor.get(), kPageSize);
-			break;
+			assert(cowIt->state == CowState::inProgress);
+			cowIt->state = CowState::hasCopy;
+			cowIt->physical = physical;
+			if(flags & fetchPin)
+				cowIt->pinned = true;
+			_updateTracking(offset >> kPageShift, cowIt);
 		}
-
-		chain = chain->_superChain;
+		_copyEvent.raise();
+		co_return PhysicalRange{physical, kPageSize, CachingMode::null};
 	}
 
-	// Copy from the root view.
-	if(!chain) {
-		FRG_CO_TRY(co_await view->copyFrom(pageOffset & ~(kPageSize - 1),
-				accessor.get(), kPageSize, wq));
+	PhysicalAddr physical = migrated;
+	if(physical == PhysicalAddr(-1)) {
+		physical = physicalAllocator->allocate(kPageSize);
+		assert(physical != PhysicalAddr(-1) && "OOM");
+		PageAccessor accessor{physical};
+
+		// Try to copy from a descendant CoW chain.
+		auto pageOffset = viewOffset + offset;
+		while(chain) {
+			auto irqLock = frg::guard(&irqMutex());
+			auto lock = frg::guard(&chain->_mutex);
+
+			if(auto it = chain->_pages.find(pageOffset >> kPageShift); it) {
+				// We can just copy synchronously here -- the descendant is not evicted.
+				auto srcPhysical = it->load(std::memory_order_relaxed);
+				assert(srcPhysical != PhysicalAddr(-1));
+				auto srcAccessor = PageAccessor{srcPhysical};
+				copyPage(accessor.get(), srcAccessor.get());
+				break;
+			}
+
+			chain = chain->_superChain;
+		}
+
+		// Copy from the root view.
+		if(!chain) {
+			FRG_CO_TRY(co_await view->copyFrom(pageOffset & ~(kPageSize - 1),
+					accessor.get(), kPageSize, wq));
+		}
 	}
 
 	// To make CoW unobservable, we first need to evict the page here.
@@ -1784,9 +2815,12 @@ CopyOnWriteMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<
 		assert(cowIt->state == CowState::inProgress);
 		cowIt->state = CowState::hasCopy;
 		cowIt->physical = physical;
+		if(flags & fetchPin)
+			cowIt->pinned = true;
+		_updateTracking(offset >> kPageShift, cowIt);
 	}
 	_copyEvent.raise();
-	co_return PhysicalRange{cowIt->physical, kPageSize, CachingMode::null};
+	co_return PhysicalRange{physical, kPageSize, CachingMode::null};
 }
 
 void CopyOnWriteMemory::markDirty(uintptr_t, size_t) {
@@ -1808,6 +2842,115 @@ void CopyOnWriteMemory::retireGlobalFutex(uintptr_t offset) {
 	unlockRange(offset & ~(kPageSize - 1), kPageSize);
 }
 
+namespace {
+	// Pages that do not compress to this size are not worth compressing.
+	// Note that the kernel heap rounds the buffers up to its size classes.
+	constexpr size_t maxCompressedSize = kPageSize / 2;
+}
+
+void CopyOnWriteMemory::_updateTracking(uint64_t index, CowPage *page) {
+	bool wantTracking = page->state == CowState::hasCopy && !page->lockCount && !page->pinned;
+	if(wantTracking == page->tracked)
+		return;
+
+	if(wantTracking) {
+		page->cachePage.bundle = this;
+		page->cachePage.identity = index;
+		globalReclaimer->addAnonPage(&page->cachePage);
+	}else{
+		globalReclaimer->removeAnonPage(&page->cachePage);
+	}
+	page->tracked = wantTracking;
+}
+
+PhysicalAddr CopyOnWriteMemory::_decompressPage(void *data, size_t size) {
+	auto physical = physicalAllocator->allocate(kPageSize);
+	assert(physical != PhysicalAddr(-1) && "OOM");
+
+	PageAccessor accessor{physical};
+	auto outSize = lz4DecompressBlock(data, size, accessor.get(), kPageSize);
+	assert(outSize == static_cast<ptrdiff_t>(kPageSize));
+	(void)outSize;
+
+	kernelAlloc->free(data);
+	globalReclaimer->notifyDecompressed(size, true);
+	return physical;
+}
+
+coroutine<void> CopyOnWriteMemory::compressPage(uint64_t index,
+		smarter::shared_ptr<WorkQueue> wq) {
+	PhysicalAddr physical;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		// The page might have been locked, pinned or moved to a CowChain (by fork())
+		// since the reclaimer selected it.
+		auto it = _ownedPages.find(index);
+		if(!it || !it->tracked || !globalReclaimer->claimAnonPage(&it->cachePage))
+			co_return;
+		assert(it->state == CowState::hasCopy);
+		assert(!it->lockCount && !it->pinned);
+		it->tracked = false;
+		it->state = CowState::evicting;
+		physical = it->physical;
+	}
+
+	co_await _evictQueue.evictRange(index << kPageShift, kPageSize);
+
+	// Do the compression on the reclaimer's WQ.
+	co_await wq->schedule();
+
+	// The page is not mapped anymore. If it is accessed concurrently, the access moves it
+	// back to hasCopy and we discard the (possibly inconsistent) data below.
+	void *data = nullptr;
+	size_t size = 0;
+	{
+		auto scratch = kernelAlloc->allocate(maxCompressedSize);
+		PageAccessor accessor{physical};
+		auto result = lz4CompressBlock(accessor.get(), kPageSize, scratch, maxCompressedSize);
+		if(result >= 0) {
+			size = result;
+			data = kernelAlloc->allocate(size);
+			memcpy(data, scratch, size);
+		}
+		kernelAlloc->free(scratch);
+	}
+
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		// Evicting pages are never erased (fork() keeps them).
+		auto it = _ownedPages.find(index);
+		assert(it);
+		if(it->state != CowState::evicting) {
+			if(data)
+				kernelAlloc->free(data);
+			co_return;
+		}
+
+		if(!data) {
+			// Move the page to the end of the list.
+			it->state = CowState::hasCopy;
+			_updateTracking(index, it);
+			globalReclaimer->notifyIncompressible();
+			co_return;
+		}
+
+		it->state = CowState::compressed;
+		it->physical = PhysicalAddr(-1);
+		it->compressedData = data;
+		it->compressedSize = size;
+		globalReclaimer->notifyCompressed(size);
+	}
+
+	if(logUncaching)
+		infoLogger() << "\e[33mCompressing anonymous page into " << size
+				<< " bytes\e[39m" << frg::endlog;
+	physicalAllocator->free(physical, kPageSize);
+}
+
 // --------------------------------------------------------------------------------------
 
 namespace {
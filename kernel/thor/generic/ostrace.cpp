@@ -2,13 +2,18 @@
 #include <bragi/helpers-frigg.hpp>
 #include <frg/small_vector.hpp>
 #include <frg/span.hpp>
+#include <frg/vector.hpp>
+#include <thor-internal/cpu-data.hpp>
 #include <thor-internal/fiber.hpp>
 #include <thor-internal/kernel-io.hpp>
 #include <thor-internal/main.hpp>
+#include <thor-internal/memory-view.hpp>
 #include <thor-internal/ostrace.hpp>
+#include <thor-internal/physical.hpp>
 #include <thor-internal/stream.hpp>
 #include <thor-internal/timer.hpp>
 #include <mbus.frigg_pb.hpp>
+#include <ostrace.frigg_bragi.hpp>
 
 // --------------------------------------------------------------------------------------
 // Core ostrace implementation.
@@ -22,6 +27,17 @@ bool wantOsTrace = false;
 
 constinit std::atomic<bool> osTraceInUse{false};
 
+// Events are written to per-CPU rings of fixed-size records. The rings can be mapped
+// by userspace (see GetRingsReq). A fiber periodically drains the rings into the
+// global (bragi-based) ring buffer that also contains the announcement records.
+struct OsTraceRing {
+	int cpuIndex;
+	protocols::ostrace::RingHeader *header;
+	smarter::shared_ptr<MemoryView> memory;
+	// Sequence number of the next record that the drain fiber reads.
+	uint64_t drainSeq = 0;
+};
+
 initgraph::Stage *getOsTraceAvailableStage() {
 	static initgraph::Stage s{&globalInitEngine, "generic.ostrace-available"};
 	return &s;
@@ -29,9 +45,21 @@ initgraph::Stage *getOsTraceAvailableStage() {
 
 namespace {
 
+constexpr bool logRings = false;
+
+// Size of each per-CPU ring (including the header).
+constexpr size_t ringSize = 1 << 17;
+// Maximal number of records per EventBatchRecord.
+constexpr size_t recordsPerBatch = 16;
+constexpr uint64_t drainInterval = 10'000'000;
+
 std::atomic<uint64_t> nextId{1};
 frg::manual_box<LogRingBuffer> globalOsTraceRing;
 
+// Protects allRings. Rings are never freed, so they can be accessed without the lock.
+frg::ticket_spinlock allRingsMutex;
+frg::manual_box<frg::vector<OsTraceRing *, KernelAlloc>> allRings;
+
 initgraph::Task initOsTraceCore{&globalInitEngine, "generic.init-ostrace-core",
 	initgraph::Entails{getOsTraceAvailableStage()},
 	[] {
@@ -40,6 +68,7 @@ initgraph::Task initOsTraceCore{&globalInitEngine, "generic.init-ostrace-core",
 
 		void *osTraceMemory = kernelAlloc->allocate(1 << 20);
 		globalOsTraceRing.initialize(reinterpret_cast<uintptr_t>(osTraceMemory), 1 << 20);
+		allRings.initialize(*kernelAlloc);
 
 		osTraceInUse.store(true);
 	}
@@ -63,6 +92,100 @@ void commitOsTrace(R record) {
 	globalOsTraceRing->enqueue(ser.data(), ser.size(), !intsAreEnabled());
 }
 
+// Called with IRQs disabled.
+OsTraceRing *createLocalRing(CpuData *cpuData) {
+	auto physical = physicalAllocator->allocate(ringSize);
+	if(physical == PhysicalAddr(-1))
+		return nullptr;
+
+	// The physical memory is contiguous, hence it is also contiguous in the direct mapping.
+	PageAccessor accessor{physical};
+	memset(accessor.get(), 0, ringSize);
+
+	auto header = reinterpret_cast<protocols::ostrace::RingHeader *>(accessor.get());
+	header->magic = protocols::ostrace::ringMagic;
+	header->cpu = cpuData->cpuIndex;
+	header->numSlots = ringSize / sizeof(protocols::ostrace::RingRecord) - 1;
+
+	auto ring = frg::construct<OsTraceRing>(*kernelAlloc);
+	ring->cpuIndex = cpuData->cpuIndex;
+	ring->header = header;
+	ring->memory = smarter::allocate_shared<HardwareMemory>(*kernelAlloc,
+			physical, ringSize, CachingMode::null);
+
+	{
+		auto lock = frg::guard(&allRingsMutex);
+		allRings->push(ring);
+	}
+
+	if(logRings)
+		infoLogger() << "thor: Allocated ostrace ring for CPU " << cpuData->cpuIndex
+				<< frg::endlog;
+
+	cpuData->osTraceRing = ring;
+	return ring;
+}
+
+OsTraceRing *getRing(size_t n) {
+	auto irqLock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&allRingsMutex);
+
+	if(n >= allRings->size())
+		return nullptr;
+	return (*allRings)[n];
+}
+
+// Moves all records that were not drained yet into the global ring buffer.
+void drainRing(OsTraceRing *ring) {
+	using protocols::ostrace::RingRecord;
+
+	auto header = ring->header;
+	auto head = protocols::ostrace::loadRingHead(header);
+	while(ring->drainSeq != head) {
+		uint64_t lost = 0;
+		if(head - ring->drainSeq > header->numSlots) {
+			lost = head - header->numSlots - ring->drainSeq;
+			ring->drainSeq = head - header->numSlots;
+		}
+
+		auto n = frg::min(head - ring->drainSeq, uint64_t{recordsPerBatch});
+		frg::vector<uint8_t, KernelAlloc> records{*kernelAlloc};
+		records.resize(n * sizeof(RingRecord));
+
+		size_t k = 0;
+		for(uint64_t seq = ring->drainSeq; seq != ring->drainSeq + n; ++seq) {
+			RingRecord record;
+			if(!protocols::ostrace::readRingRecord(header, seq, record)) {
+				++lost;
+				continue;
+			}
+			memcpy(records.data() + k * sizeof(RingRecord), &record, sizeof(RingRecord));
+			++k;
+		}
+		records.resize(k * sizeof(RingRecord));
+		ring->drainSeq += n;
+
+		managarm::ostrace::EventBatchRecord<KernelAlloc> batch{*kernelAlloc};
+		batch.set_cpu(ring->cpuIndex);
+		batch.set_lost(lost);
+		batch.set_records(std::move(records));
+		commitOsTrace(std::move(batch));
+	}
+}
+
+coroutine<void> drainRings() {
+	while(true) {
+		co_await generalTimerEngine()->sleepFor(drainInterval);
+
+		for(size_t i = 0; ; ++i) {
+			auto ring = getRing(i);
+			if(!ring)
+				break;
+			drainRing(ring);
+		}
+	}
+}
+
 } // anonymous namespace
 
 OsTraceEventId announceOsTraceEvent(frg::string_view name) {
@@ -76,10 +199,51 @@ OsTraceEventId announceOsTraceEvent(frg::string_view name) {
 	return static_cast<OsTraceEventId>(id);
 }
 
-void emitOsTrace(managarm::ostrace::EventRecord<KernelAlloc> record) {
-	record.set_ts(systemClockSource()->currentNanos());
+OsTraceItemId announceOsTraceItem(frg::string_view name) {
+	auto id = nextId.fetch_add(1, std::memory_order_relaxed);
 
+	managarm::ostrace::AnnounceItemRecord<KernelAlloc> record{*kernelAlloc};
+	record.set_id(id);
+	record.set_name(frg::string<KernelAlloc>{*kernelAlloc, name});
 	commitOsTrace(std::move(record));
+
+	return static_cast<OsTraceItemId>(id);
+}
+
+void emitOsTrace(protocols::ostrace::RingRecord &record) {
+	using protocols::ostrace::RingRecord;
+
+	if(!osTraceInUse.load(std::memory_order_relaxed))
+		return;
+
+	// Disabling IRQs makes us the only writer of the local ring.
+	auto irqLock = frg::guard(&irqMutex());
+
+	auto cpuData = getCpuData();
+	auto ring = cpuData->osTraceRing;
+	if(!ring) [[unlikely]] {
+		ring = createLocalRing(cpuData);
+		if(!ring)
+			return;
+	}
+
+	auto header = ring->header;
+	auto seq = header->head;
+	auto slot = &protocols::ostrace::ringSlots(header)[seq % header->numSlots];
+
+	// Invalidate the slot *before* writing to it.
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	record.seq = seq + 1;
+	record.ts = systemClockSource()->currentNanos();
+	memcpy(&slot->ts, &record.ts,
+			offsetof(RingRecord, ctrs) - offsetof(RingRecord, ts)
+			+ record.numCtrs * sizeof(protocols::ostrace::RingCounter));
+
+	// Commit the record *after* writing to it.
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&header->head, seq + 1, __ATOMIC_RELEASE);
 }
 
 LogRingBuffer *getGlobalOsTraceRing() {
@@ -226,11 +390,15 @@ coroutine<Error> handleReq(LaneHandle boundLane) {
 			co_return Error::protocolViolation;
 		auto &req = maybeReq.value();
 
-		managarm::ostrace::EventRecord<KernelAlloc> record{*kernelAlloc};
-		record.set_id(req.id());
-		for(size_t i = 0; i < req.ctrs_size(); ++i)
-			record.add_ctrs(std::move(req.ctrs(i)));
-		emitOsTrace(std::move(record));
+		protocols::ostrace::RingRecord record;
+		record.id = req.id();
+		record.numCtrs = frg::min(req.ctrs_size(), size_t{protocols::ostrace::maxRingCounters});
+		record.flags = 0;
+		if(req.ctrs_size() > protocols::ostrace::maxRingCounters)
+			record.flags |= protocols::ostrace::recordTruncated;
+		for(size_t i = 0; i < record.numCtrs; ++i)
+			record.ctrs[i] = {req.ctrs(i).id(), req.ctrs(i).value()};
+		emitOsTrace(record);
 
 		managarm::ostrace::Response<KernelAlloc> resp(*kernelAlloc);
 		resp.set_error(managarm::ostrace::Error::SUCCESS);
@@ -301,6 +469,50 @@ coroutine<Error> handleReq(LaneHandle boundLane) {
 			co_return Error::protocolViolation;
 		}
 	} break;
+	case bragi::message_id<managarm::ostrace::GetRingsReq>: {
+		auto maybeReq = bragi::parse_head_tail<managarm::ostrace::GetRingsReq>(
+				headSpan, tailSpan, *kernelAlloc);
+		if(!maybeReq)
+			co_return Error::protocolViolation;
+
+		// Rings are only allocated once a CPU emits its first event.
+		frg::vector<OsTraceRing *, KernelAlloc> rings{*kernelAlloc};
+		if(osTraceInUse.load(std::memory_order_relaxed)) {
+			for(size_t i = 0; ; ++i) {
+				auto ring = getRing(i);
+				if(!ring)
+					break;
+				rings.push(ring);
+			}
+		}
+
+		managarm::ostrace::Response<KernelAlloc> resp(*kernelAlloc);
+		if(wantOsTrace) {
+			resp.set_error(managarm::ostrace::Error::SUCCESS);
+		}else{
+			resp.set_error(managarm::ostrace::Error::OSTRACE_GLOBALLY_DISABLED);
+		}
+		resp.set_num_rings(rings.size());
+
+		frg::string<KernelAlloc> ser(*kernelAlloc);
+		resp.SerializeToString(&ser);
+		frg::unique_memory<KernelAlloc> respBuffer{*kernelAlloc, ser.size()};
+		memcpy(respBuffer.data(), ser.data(), ser.size());
+		auto respError = co_await SendBufferSender{lane, std::move(respBuffer)};
+		if(respError != Error::success) {
+			assert(isRemoteIpcError(respError));
+			co_return Error::protocolViolation;
+		}
+
+		for(auto ring : rings) {
+			auto pushError = co_await PushDescriptorSender{lane,
+					MemoryViewDescriptor{ring->memory}};
+			if(pushError != Error::success) {
+				assert(isRemoteIpcError(pushError));
+				co_return Error::protocolViolation;
+			}
+		}
+	} break;
 	default:
 		managarm::ostrace::Response<KernelAlloc> resp(*kernelAlloc);
 		resp.set_error(managarm::ostrace::Error::ILLEGAL_REQUEST);
@@ -332,11 +544,15 @@ initgraph::Task initOsTraceMbus{&globalInitEngine, "generic.init-ostrace-sinks",
 			// Only dump to an I/O channel if ostrace is supported (otherwise, the ring buffer
 			// does not even exist).
 			if(wantOsTrace) {
+				async::detach_with_allocator(*kernelAlloc, drainRings());
+
 				auto channel = solicitIoChannel("ostrace");
 				if(channel) {
 					infoLogger() << "thor: Connecting ostrace to I/O channel" << frg::endlog;
+					// The packet size needs to fit a full EventBatchRecord.
 					async::detach_with_allocator(*kernelAlloc,
-							dumpRingToChannel(globalOsTraceRing.get(), std::move(channel), 256));
+							dumpRingToChannel(globalOsTraceRing.get(), std::move(channel),
+									recordsPerBatch * sizeof(protocols::ostrace::RingRecord) + 256));
 				}
 			}
 		});
@@ -1,13 +1,29 @@
 #include <assert.h>
+#include <string.h>
+#include <eir/interface.hpp>
 #include <thor-internal/arch/paging.hpp>
 #include <thor-internal/cpu-data.hpp>
 #include <thor-internal/debug.hpp>
 #include <thor-internal/physical.hpp>
 
+extern "C" EirInfo *thorBootInfoPtr;
+
 namespace thor {
 
 static bool logPhysicalAllocs = false;
 
+int getNumaNodeOfCpu(uint64_t cpuId) {
+	auto cpuNodes = reinterpret_cast<EirCpuNode *>(thorBootInfoPtr->cpuNodeInfo);
+	for(size_t i = 0; i < thorBootInfoPtr->numCpuNodes; i++) {
+		if(cpuNodes[i].cpuId != cpuId)
+			continue;
+		if(cpuNodes[i].numaNode >= static_cast<EirSize>(maxNumaNodes))
+			return 0;
+		return cpuNodes[i].numaNode;
+	}
+	return 0;
+}
+
 // --------------------------------------------------------
 // SkeletalRegion
 // --------------------------------------------------------
@@ -35,34 +51,36 @@ PhysicalChunkAllocator::PhysicalChunkAllocator() {
 }
 
 void PhysicalChunkAllocator::bootstrapRegion(PhysicalAddr address,
-		int order, size_t numRoots, int8_t *buddyTree) {
+		int order, size_t numRoots, int8_t *buddyTree, int node) {
 	if(_numRegions >= 8) {
 		infoLogger() << "thor: Ignoring memory region (can only handle 8 regions)"
 				<< frg::endlog;
 		return;
 	}
+	if(node < 0 || node >= maxNumaNodes) {
+		infoLogger() << "thor: Memory region has NUMA node " << node
+				<< ", treating it as node 0" << frg::endlog;
+		node = 0;
+	}
 
 	int n = _numRegions++;
 	_allRegions[n].physicalBase = address;
 	_allRegions[n].regionSize = numRoots << (order + kPageShift);
 	_allRegions[n].buddyAccessor = BuddyAccessor{address, kPageShift,
 			buddyTree, numRoots, order};
+	_allRegions[n].node = node;
+	_numNodes = frg::max(_numNodes, node + 1);
 
 	auto currentTotal = _totalPages.load(std::memory_order_relaxed);
 	auto currentFree = _freePages.load(std::memory_order_relaxed);
 	_totalPages.store(currentTotal + (numRoots << order), std::memory_order_relaxed);
 	_freePages.store(currentFree + (numRoots << order), std::memory_order_relaxed);
+	_nodes[node].totalPages.fetch_add(numRoots << order, std::memory_order_relaxed);
+	_nodes[node].freePages.fetch_add(numRoots << order, std::memory_order_relaxed);
 }
 
 PhysicalAddr PhysicalChunkAllocator::allocate(size_t size, int addressBits) {
 	auto irq_lock = frg::guard(&irqMutex());
-	auto lock = frg::guard(&_mutex);
-
-	auto currentFree = _freePages.load(std::memory_order_relaxed);
-	auto currentUsed = _usedPages.load(std::memory_order_relaxed);
-	assert(currentFree > size / kPageSize);
-	_freePages.store(currentFree - size / kPageSize, std::memory_order_relaxed);
-	_usedPages.store(currentUsed + size / kPageSize, std::memory_order_relaxed);
 
 	// TODO: This could be solved better.
 	int target = 0;
@@ -73,29 +91,258 @@ PhysicalAddr PhysicalChunkAllocator::allocate(size_t size, int addressBits) {
 	if(logPhysicalAllocs)
 		infoLogger() << "thor: Allocating physical memory of order "
 					<< (target + kPageShift) << frg::endlog;
-	for(int i = 0; i < _numRegions; i++) {
-		if(target > _allRegions[i].buddyAccessor.tableOrder())
-			continue;
 
-		auto physical = _allRegions[i].buddyAccessor.allocate(target, addressBits);
-		if(physical == BuddyAccessor::illegalAddress)
-			continue;
-	//	infoLogger() << "Allocate " << (void *)physical << frg::endlog;
-		assert(!(physical % (size_t(kPageSize) << target)));
+	// The magazine does not track physical addresses, hence restricted allocations
+	// always have to go through the buddy allocator.
+	if(target < PhysicalMagazine::numOrders && addressBits >= 64) {
+		auto magazine = &getCpuData()->physicalMagazine;
+		if(!magazine->numChunks[target] && !_refillMagazine(magazine, target)) {
+			// Pre-zeroed pages are only a cache; give them up before failing.
+			{
+				auto lock = frg::guard(&_mutex);
+				if(!_drainZeroedPools()) {
+					_requestCompaction(target);
+					return static_cast<PhysicalAddr>(-1);
+				}
+			}
+			if(!_refillMagazine(magazine, target)) {
+				_requestCompaction(target);
+				return static_cast<PhysicalAddr>(-1);
+			}
+		}
+
+		assert(magazine->numChunks[target]);
+		auto physical = magazine->chunks[target][--magazine->numChunks[target]];
+		_accountAllocation(physical, size);
 		return physical;
 	}
 
-	return static_cast<PhysicalAddr>(-1);
+	auto lock = frg::guard(&_mutex);
+
+	auto node = getCpuData()->numaNode;
+	auto physical = _allocateFromBuddy(target, addressBits, node);
+	if(physical == static_cast<PhysicalAddr>(-1)) {
+		// Chunks that are cached by the local magazine might make the allocation succeed.
+		lock.unlock();
+		drainLocalMagazine();
+		lock.lock();
+
+		physical = _allocateFromBuddy(target, addressBits, node);
+		if(physical == static_cast<PhysicalAddr>(-1)) {
+			if(!_drainZeroedPools()) {
+				_requestCompaction(target);
+				return physical;
+			}
+			physical = _allocateFromBuddy(target, addressBits, node);
+			if(physical == static_cast<PhysicalAddr>(-1)) {
+				_requestCompaction(target);
+				return physical;
+			}
+		}
+	}
+
+	_accountAllocation(physical, size);
+	return physical;
+}
+
+PhysicalAddr PhysicalChunkAllocator::allocateZeroed(size_t size, int addressBits) {
+	// Like the magazine, the zeroed pool does not track physical addresses.
+	if(size == kPageSize && addressBits >= 64) {
+		auto irq_lock = frg::guard(&irqMutex());
+		auto node = &_nodes[getCpuData()->numaNode];
+
+		auto physical = static_cast<PhysicalAddr>(-1);
+		{
+			auto lock = frg::guard(&node->zeroedMutex);
+			auto n = node->numZeroed.load(std::memory_order_relaxed);
+			if(n) {
+				physical = node->zeroedPages[n - 1];
+				node->numZeroed.store(n - 1, std::memory_order_relaxed);
+			}
+		}
+
+		if(physical != static_cast<PhysicalAddr>(-1)) {
+			_zeroedHits.fetch_add(1, std::memory_order_relaxed);
+			return physical;
+		}
+		_zeroedMisses.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	auto physical = allocate(size, addressBits);
+	if(physical == static_cast<PhysicalAddr>(-1))
+		return physical;
+
+	for(size_t progress = 0; progress < size; progress += kPageSize) {
+		PageAccessor accessor{physical + progress};
+		memset(accessor.get(), 0, kPageSize);
+	}
+	return physical;
 }
 
 void PhysicalChunkAllocator::free(PhysicalAddr address, size_t size) {
 	auto irq_lock = frg::guard(&irqMutex());
-	auto lock = frg::guard(&_mutex);
-	
+
 	int target = 0;
 	while(size > (size_t(kPageSize) << target))
 		target++;
 
+	assert(_usedPages.load(std::memory_order_relaxed) >= size / kPageSize);
+	_accountFree(address, size);
+
+	// Only cache chunks of the local node; otherwise, remote memory would
+	// accumulate in the magazine and be handed out to local allocations.
+	if(target < PhysicalMagazine::numOrders && _nodeOf(address) == getCpuData()->numaNode) {
+		auto magazine = &getCpuData()->physicalMagazine;
+		if(magazine->numChunks[target] == PhysicalMagazine::capacity)
+			_drainMagazine(magazine, target, PhysicalMagazine::batchSize);
+
+		assert(magazine->numChunks[target] < PhysicalMagazine::capacity);
+		magazine->chunks[target][magazine->numChunks[target]++] = address;
+		return;
+	}
+
+	auto lock = frg::guard(&_mutex);
+	_freeToBuddy(address, target);
+}
+
+bool PhysicalChunkAllocator::refillZeroedPool(size_t n) {
+	auto irq_lock = frg::guard(&irqMutex());
+
+	auto nodeIndex = getCpuData()->numaNode;
+	auto node = &_nodes[nodeIndex];
+	for(size_t i = 0; i < n; i++) {
+		if(node->numZeroed.load(std::memory_order_relaxed) >= zeroedPoolCapacity)
+			return false;
+		// Do not tie up memory in the pool if the node is about to run out of memory.
+		if(node->freePages.load(std::memory_order_relaxed) < 4 * zeroedPoolCapacity)
+			return false;
+
+		auto physical = allocate(kPageSize);
+		if(physical == static_cast<PhysicalAddr>(-1))
+			return false;
+		if(_nodeOf(physical) != nodeIndex) {
+			free(physical, kPageSize);
+			return false;
+		}
+
+		// The page is usually not accessed until much later; avoid polluting the cache.
+		PageAccessor accessor{physical};
+		zeroPageNonTemporal(accessor.get());
+
+		auto lock = frg::guard(&node->zeroedMutex);
+		auto k = node->numZeroed.load(std::memory_order_relaxed);
+		if(k == zeroedPoolCapacity) {
+			lock.unlock();
+			free(physical, kPageSize);
+			return false;
+		}
+		node->zeroedPages[k] = physical;
+		node->numZeroed.store(k + 1, std::memory_order_relaxed);
+	}
+
+	return true;
+}
+
+void PhysicalChunkAllocator::drainLocalMagazine() {
+	auto irq_lock = frg::guard(&irqMutex());
+
+	auto magazine = &getCpuData()->physicalMagazine;
+	for(int target = 0; target < PhysicalMagazine::numOrders; target++)
+		_drainMagazine(magazine, target, magazine->numChunks[target]);
+}
+
+PhysicalAddr PhysicalChunkAllocator::_allocateFromBuddy(int target, int addressBits, int node) {
+	// First, try regions of the requested node, then fall back to all other regions.
+	for(int pass = 0; pass < 2; pass++) {
+		for(int i = 0; i < _numRegions; i++) {
+			bool isLocal = _allRegions[i].node == node;
+			if(isLocal != (pass == 0))
+				continue;
+			if(target > _allRegions[i].buddyAccessor.tableOrder())
+				continue;
+
+			auto physical = _allRegions[i].buddyAccessor.allocate(target, addressBits);
+			if(physical == BuddyAccessor::illegalAddress)
+				continue;
+		//	infoLogger() << "Allocate " << (void *)physical << frg::endlog;
+			assert(!(physical % (size_t(kPageSize) << target)));
+			return physical;
+		}
+	}
+
+	return static_cast<PhysicalAddr>(-1);
+}
+
+bool PhysicalChunkAllocator::isFree(PhysicalAddr physical) {
+	auto irq_lock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&_mutex);
+
+	for(int i = 0; i < _numRegions; i++) {
+		if(physical < _allRegions[i].physicalBase)
+			continue;
+		if(physical - _allRegions[i].physicalBase >= _allRegions[i].regionSize)
+			continue;
+		return _allRegions[i].buddyAccessor.isFree(physical);
+	}
+	return false;
+}
+
+FragmentationStats PhysicalChunkAllocator::getFragmentationStats() {
+	FragmentationStats stats{};
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		for(int i = 0; i < _numRegions; i++)
+			_allRegions[i].buddyAccessor.countFreeChunks(stats.numFreeChunks, numFreeChunkOrders);
+	}
+	stats.numCompactions = _numCompactions.load(std::memory_order_relaxed);
+	stats.numFailedCompactions = _numFailedCompactions.load(std::memory_order_relaxed);
+	stats.numMigratedPages = _numMigratedPages.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void PhysicalChunkAllocator::_requestCompaction(int target) {
+	if(target < minCompactionOrder)
+		return;
+	auto current = _compactionRequest.load(std::memory_order_relaxed);
+	while(current < target) {
+		if(_compactionRequest.compare_exchange_weak(current, target, std::memory_order_relaxed))
+			break;
+	}
+}
+
+int PhysicalChunkAllocator::_nodeOf(PhysicalAddr address) {
+	for(int i = 0; i < _numRegions; i++) {
+		if(address < _allRegions[i].physicalBase)
+			continue;
+		if(address - _allRegions[i].physicalBase >= _allRegions[i].regionSize)
+			continue;
+		return _allRegions[i].node;
+	}
+
+	assert(!"Physical page is not part of any region");
+	return 0;
+}
+
+void PhysicalChunkAllocator::_accountAllocation(PhysicalAddr address, size_t size) {
+	auto node = &_nodes[_nodeOf(address)];
+	_freePages.fetch_sub(size / kPageSize, std::memory_order_relaxed);
+	_usedPages.fetch_add(size / kPageSize, std::memory_order_relaxed);
+	node->freePages.fetch_sub(size / kPageSize, std::memory_order_relaxed);
+	node->usedPages.fetch_add(size / kPageSize, std::memory_order_relaxed);
+}
+
+void PhysicalChunkAllocator::_accountFree(PhysicalAddr address, size_t size) {
+	auto node = &_nodes[_nodeOf(address)];
+	_freePages.fetch_add(size / kPageSize, std::memory_order_relaxed);
+	_usedPages.fetch_sub(size / kPageSize, std::memory_order_relaxed);
+	node->freePages.fetch_add(size / kPageSize, std::memory_order_relaxed);
+	node->usedPages.fetch_sub(size / kPageSize, std::memory_order_relaxed);
+}
+
+void PhysicalChunkAllocator::_freeToBuddy(PhysicalAddr address, int target) {
+	auto size = size_t(kPageSize) << target;
 	for(int i = 0; i < _numRegions; i++) {
 		if(address < _allRegions[i].physicalBase)
 			continue;
@@ -103,15 +350,56 @@ void PhysicalChunkAllocator::free(PhysicalAddr address, size_t size) {
 			continue;
 
 		_allRegions[i].buddyAccessor.free(address, target);
-		auto currentFree = _freePages.load(std::memory_order_relaxed);
-		auto currentUsed = _usedPages.load(std::memory_order_relaxed);
-		assert(currentUsed > size / kPageSize);
-		_freePages.store(currentFree + size / kPageSize, std::memory_order_relaxed);
-		_usedPages.store(currentUsed - size / kPageSize, std::memory_order_relaxed);
 		return;
 	}
 
 	assert(!"Physical page is not part of any region");
 }
 
+bool PhysicalChunkAllocator::_refillMagazine(PhysicalMagazine *magazine, int target) {
+	auto lock = frg::guard(&_mutex);
+
+	while(magazine->numChunks[target] < PhysicalMagazine::batchSize) {
+		auto physical = _allocateFromBuddy(target, 64, getCpuData()->numaNode);
+		if(physical == static_cast<PhysicalAddr>(-1))
+			break;
+		magazine->chunks[target][magazine->numChunks[target]++] = physical;
+	}
+
+	return magazine->numChunks[target];
+}
+
+void PhysicalChunkAllocator::_drainMagazine(PhysicalMagazine *magazine, int target, size_t n) {
+	assert(n <= magazine->numChunks[target]);
+	if(!n)
+		return;
+
+	auto lock = frg::guard(&_mutex);
+
+	// Return the oldest chunks first; recently freed chunks are more likely to be cache-hot.
+	for(size_t i = 0; i < n; i++)
+		_freeToBuddy(magazine->chunks[target][i], target);
+	for(size_t i = n; i < magazine->numChunks[target]; i++)
+		magazine->chunks[target][i - n] = magazine->chunks[target][i];
+	magazine->numChunks[target] -= n;
+}
+
+bool PhysicalChunkAllocator::_drainZeroedPools() {
+	bool drained = false;
+	for(int i = 0; i < _numNodes; i++) {
+		auto node = &_nodes[i];
+		auto lock = frg::guard(&node->zeroedMutex);
+
+		auto n = node->numZeroed.load(std::memory_order_relaxed);
+		for(size_t k = 0; k < n; k++) {
+			_accountFree(node->zeroedPages[k], kPageSize);
+			_freeToBuddy(node->zeroedPages[k], 0);
+		}
+		node->numZeroed.store(0, std::memory_order_relaxed);
+		if(n)
+			drained = true;
+	}
+	return drained;
+}
+
 } // namespace thor
@@ -15,6 +15,9 @@ bool wantKernelProfile = false;
 namespace {
 	frg::manual_box<LogRingBuffer> globalProfileRing;
 
+	// Set by initializeProfile() once the hardware support was checked.
+	std::atomic<bool> profileAvailable{false};
+
 	initgraph::Task initProfilingSinks{&globalInitEngine, "generic.init-profiling-sinks",
 		initgraph::Requires{getFibersAvailableStage(),
 			getIoChannelsDiscoveredStage()},
@@ -30,6 +33,44 @@ namespace {
 			}
 		}
 	};
+
+#ifdef __x86_64__
+	// Programs the PMC of the current CPU and starts a fiber (that runs on this CPU)
+	// to dump the per-CPU profiling data to the global ring buffer.
+	void startLocalProfile() {
+		KernelFiber::run([=] {
+			getCpuData()->localProfileRing = frg::construct<SingleContextRecordRing>(*kernelAlloc);
+
+			if(getGlobalCpuFeatures()->profileFlags & CpuFeatures::profileIntelSupported) {
+				initializeIntelPmc();
+				getCpuData()->profileMechanism.store(ProfileMechanism::intelPmc,
+						std::memory_order_release);
+				setIntelPmc();
+			}else{
+				assert(getGlobalCpuFeatures()->profileFlags & CpuFeatures::profileAmdSupported);
+				getCpuData()->profileMechanism.store(ProfileMechanism::amdPmc,
+						std::memory_order_release);
+				setAmdPmc();
+			}
+
+			uint64_t deqPtr = 0;
+			while(true) {
+				char buffer[256];
+				auto [success, recordPtr, newPtr, size] = getCpuData()->localProfileRing->dequeueAt(
+						deqPtr, buffer, 256);
+				deqPtr = newPtr;
+				if(!success) {
+					KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(1'000'000));
+					continue;
+				}
+				assert(size);
+				assert(size < 256);
+
+				globalProfileRing->enqueue(buffer, size);
+			}
+		});
+	}
+#endif
 }
 
 void initializeProfile() {
@@ -47,39 +88,16 @@ void initializeProfile() {
 	void *profileMemory = kernelAlloc->allocate(1 << 20);
 	globalProfileRing.initialize(reinterpret_cast<uintptr_t>(profileMemory), 1 << 20);
 
-	// Dump the per-CPU profiling data to the global ring buffer.
-	// TODO: Start one such fiber per CPU.
-	KernelFiber::run([=] {
-		getCpuData()->localProfileRing = frg::construct<SingleContextRecordRing>(*kernelAlloc);
-
-		if(getGlobalCpuFeatures()->profileFlags & CpuFeatures::profileIntelSupported) {
-			initializeIntelPmc();
-			getCpuData()->profileMechanism.store(ProfileMechanism::intelPmc,
-					std::memory_order_release);
-			setIntelPmc();
-		}else{
-			assert(getGlobalCpuFeatures()->profileFlags & CpuFeatures::profileAmdSupported);
-			getCpuData()->profileMechanism.store(ProfileMechanism::amdPmc,
-					std::memory_order_release);
-			setAmdPmc();
-		}
-
-		uint64_t deqPtr = 0;
-		while(true) {
-			char buffer[128];
-			auto [success, recordPtr, newPtr, size] = getCpuData()->localProfileRing->dequeueAt(
-					deqPtr, buffer, 128);
-			deqPtr = newPtr;
-			if(!success) {
-				KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(1'000'000));
-				continue;
-			}
-			assert(size);
-			assert(size < 128);
+	profileAvailable.store(true, std::memory_order_release);
+	startLocalProfile();
+#endif
+}
 
-			globalProfileRing->enqueue(buffer, size);
-		}
-	});
+void initializeProfileOnThisCpu() {
+#ifdef __x86_64__
+	if(!profileAvailable.load(std::memory_order_acquire))
+		return;
+	startLocalProfile();
 #endif
 }
 
@@ -0,0 +1,48 @@
+#include <thor-internal/cpu-data.hpp>
+#include <thor-internal/rcu.hpp>
+
+namespace thor {
+
+// Each CPU owns a sequence counter that is odd while the CPU is inside a read-side section.
+// Readers and writers both use seq_cst fences: either the writer observes the odd counter
+// (and waits for it to change), or the reader observes the writer's unlinking store.
+
+RcuReadGuard::RcuReadGuard() {
+	irqMutex().lock();
+
+	auto cpuData = getCpuData();
+	if(!cpuData->rcuNesting++) {
+		auto seq = cpuData->rcuSeq.load(std::memory_order_relaxed);
+		assert(!(seq & 1));
+		cpuData->rcuSeq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+}
+
+RcuReadGuard::~RcuReadGuard() {
+	auto cpuData = getCpuData();
+	assert(cpuData->rcuNesting);
+	if(!--cpuData->rcuNesting) {
+		auto seq = cpuData->rcuSeq.load(std::memory_order_relaxed);
+		cpuData->rcuSeq.store(seq + 1, std::memory_order_release);
+	}
+
+	irqMutex().unlock();
+}
+
+void rcuSynchronize() {
+	assert(!getCpuData()->rcuNesting);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	for(int i = 0; i < getCpuCount(); i++) {
+		auto cpuData = getCpuData(i);
+		auto seq = cpuData->rcuSeq.load(std::memory_order_acquire);
+		if(!(seq & 1))
+			continue;
+		// Read-side sections are short since they cannot block.
+		while(cpuData->rcuSeq.load(std::memory_order_acquire) == seq)
+			;
+	}
+}
+
+} // namespace thor
@@ -3,6 +3,7 @@
 #include <thor-internal/arch/ints.hpp>
 #include <thor-internal/arch/cpu.hpp>
 #include <thor-internal/cpu-data.hpp>
+#include <thor-internal/physical.hpp>
 #include <thor-internal/schedule.hpp>
 #include <thor-internal/timer.hpp>
 
@@ -13,12 +14,50 @@ namespace {
 	constexpr bool logNextBest = false;
 	constexpr bool logUpdates = false;
 	constexpr bool logIdle = false;
+	constexpr bool logBalancing = false;
 
 	constexpr bool disablePreemption = false;
 
 	// Minimum length of a preemption time slice in ns.
 	constexpr int64_t sliceGranularity = 10'000'000;
 
+	constexpr bool disableBalancing = false;
+
+	// Synchronous IPC (e.g., a client that sends a request and waits for the reply)
+	// wakes up a thread and then blocks immediately. If the woken thread runs on the
+	// same CPU, we switch to it directly instead of picking the most unfair entity.
+	constexpr bool disableHandoff = false;
+
+	// Number of pages that an idle CPU zeroes before it halts.
+	// IRQs are disabled while zeroing, so this bounds the wakeup latency.
+	constexpr size_t idleZeroBatch = 16;
+
+	// Interval in ns at which busy CPUs try to push work to other CPUs.
+	constexpr uint64_t balanceInterval = 50'000'000;
+
+	// Maximal number of waiting entities that are inspected per migration.
+	constexpr size_t maxBalanceScan = 8;
+
+	// Values of Scheduler::_idleWord.
+	constexpr uint32_t idleRunning = 0;
+	constexpr uint32_t idleMonitoring = 1;
+	constexpr uint32_t idleWoken = 2;
+
+	// Bandwidth (runtime / period) of deadline entities in 12.20 fixed point.
+	constexpr int bandwidthShift = 20;
+	// Share of each CPU that deadline entities may reserve; the rest is left to
+	// regular entities such that a misbehaving driver cannot starve the system.
+	constexpr uint64_t maxDeadlineBandwidth = (uint64_t{95} << bandwidthShift) / 100;
+
+	uint64_t deadlineBandwidth(uint64_t runtime, uint64_t period) {
+		return static_cast<uint64_t>((static_cast<unsigned __int128>(runtime) << bandwidthShift)
+				/ period);
+	}
+
+	// Protects totalDeadlineBandwidth (admission control is global, not per CPU).
+	frg::ticket_spinlock deadlineMutex;
+	uint64_t totalDeadlineBandwidth = 0;
+
 	struct IdleTask final : ScheduleEntity {
 		IdleTask()
 		: ScheduleEntity{ScheduleType::idle} { }
@@ -27,6 +66,9 @@ namespace {
 			runOnStack([] (Continuation) {
 				if(logIdle)
 					infoLogger() << "System is idle" << frg::endlog;
+				physicalAllocator->refillZeroedPool(idleZeroBatch);
+				if(haveMonitoredIdle())
+					localScheduler()->runIdleLoop();
 				suspendSelf();
 				__builtin_trap();
 			}, getCpuData()->idleStack.base());
@@ -34,6 +76,7 @@ namespace {
 		}
 
 		void handlePreemption(IrqImageAccessor image) override {
+			localScheduler()->leaveIdle();
 			localScheduler()->update();
 			if(localScheduler()->maybeReschedule()) {
 				runOnStack([] (Continuation cont, IrqImageAccessor image) {
@@ -52,12 +95,21 @@ namespace {
 int ScheduleEntity::orderPriority(const ScheduleEntity *a, const ScheduleEntity *b) {
 	assert(a->type() == ScheduleType::regular);
 	assert(b->type() == ScheduleType::regular);
+	// The deadline class takes precedence over all priorities.
+	if(a->isDeadline() != b->isDeadline())
+		return a->isDeadline() ? -1 : 1;
+	if(a->isDeadline())
+		return 0;
 	return b->priority - a->priority; // Prefer larger priority.
 }
 
 bool ScheduleEntity::scheduleBefore(const ScheduleEntity *a, const ScheduleEntity *b) {
 	assert(a->type() == ScheduleType::regular);
 	assert(b->type() == ScheduleType::regular);
+	if(a->isDeadline()) {
+		assert(b->isDeadline());
+		return a->_dlAbsDeadline < b->_dlAbsDeadline; // Prefer earlier deadlines.
+	}
 	return a->baseUnfairness - a->refProgress
 			> b->baseUnfairness - b->refProgress; // Prefer greater unfairness.
 }
@@ -68,6 +120,17 @@ ScheduleEntity::ScheduleEntity(ScheduleType type)
 
 ScheduleEntity::~ScheduleEntity() {
 	assert(state == ScheduleState::null);
+
+	if(isDeadline()) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&deadlineMutex);
+
+		totalDeadlineBandwidth -= deadlineBandwidth(_dlRuntime, _dlPeriod);
+	}
+}
+
+bool ScheduleEntity::isMigratableTo(CpuData *) {
+	return false;
 }
 
 void Scheduler::associate(ScheduleEntity *entity, Scheduler *scheduler) {
@@ -108,6 +171,51 @@ void Scheduler::setPriority(ScheduleEntity *entity, int priority) {
 	entity->priority = priority;
 }
 
+bool Scheduler::setDeadline(ScheduleEntity *entity,
+		uint64_t runtime, uint64_t deadline, uint64_t period) {
+	assert(entity->type() == ScheduleType::regular);
+	assert(!period || (runtime && runtime <= deadline && deadline <= period));
+
+	auto irqLock = frg::guard(&irqMutex());
+
+	auto self = entity->_scheduler;
+	assert(self);
+
+	// Otherwise, we would have to remove-reinsert into the queue.
+	assert(entity == self->_current);
+
+	uint64_t oldBandwidth = 0;
+	if(entity->isDeadline())
+		oldBandwidth = deadlineBandwidth(entity->_dlRuntime, entity->_dlPeriod);
+	uint64_t newBandwidth = 0;
+	if(period)
+		newBandwidth = deadlineBandwidth(runtime, period);
+
+	{
+		auto lock = frg::guard(&deadlineMutex);
+
+		if(newBandwidth > maxDeadlineBandwidth)
+			return false;
+		auto total = totalDeadlineBandwidth - oldBandwidth + newBandwidth;
+		if(total > getCpuCount() * maxDeadlineBandwidth)
+			return false;
+		totalDeadlineBandwidth = total;
+	}
+
+	// The new parameters take effect immediately, i.e., a new period starts now.
+	auto now = systemClockSource()->currentNanos();
+	entity->_dlRuntime = runtime;
+	entity->_dlDeadline = deadline;
+	entity->_dlPeriod = period;
+	entity->_dlAbsDeadline = now + deadline;
+	entity->_dlBudget = runtime;
+	entity->_dlChargeClock = now;
+	entity->_dlThrottled = false;
+
+	self->renewSchedule();
+	return true;
+}
+
 void Scheduler::resume(ScheduleEntity *entity) {
 	assert(entity->type() == ScheduleType::regular);
 
@@ -117,24 +225,17 @@ void Scheduler::resume(ScheduleEntity *entity) {
 	auto self = entity->_scheduler;
 	assert(self);
 	assert(entity != self->_current);
-	bool wasEmpty;
-	{
-		auto irqLock = frg::guard(&irqMutex());
-		auto lock = frg::guard(&self->_mutex);
+	entity->_runnableClock = systemClockSource()->currentNanos();
+	entity->_wokenUp = true;
 
-		entity->state = ScheduleState::pending;
-
-		wasEmpty = self->_pendingList.empty();
-		self->_pendingList.push_back(entity);
+	if(!disableHandoff) {
+		auto irqLock = frg::guard(&irqMutex());
+		if(self == localScheduler() && self->_current
+				&& self->_current->type() == ScheduleType::regular)
+			self->_handoff = entity;
 	}
 
-	if(wasEmpty) {
-		if(self == &getCpuData()->scheduler) {
-			sendPingIpi(self->_cpuContext->cpuIndex);
-		}else{
-			sendPingIpi(self->_cpuContext->cpuIndex);
-		}
-	}
+	self->_pushPending(entity);
 }
 
 void Scheduler::suspendCurrent() {
@@ -148,9 +249,14 @@ void Scheduler::suspendCurrent() {
 
 	// Update the unfairness on suspend.
 	self->_updateEntityStats(entity);
+	// An exhausted budget is handled by the CBS wakeup rule once the entity resumes.
+	if(entity->isDeadline())
+		self->_chargeDeadline(entity, systemClockSource()->currentNanos());
 	entity->state = ScheduleState::attached;
+	entity->_numVoluntarySwitches++;
 
 	self->_current = nullptr;
+	self->_handoffPending = self->_handoff != nullptr;
 }
 
 Scheduler::Scheduler(CpuData *cpuContext)
@@ -201,6 +307,9 @@ void Scheduler::update() {
 		_systemProgress += deltaTime * fixedInverse(n);
 
 	_updateCurrentEntity();
+	if(_current->isDeadline())
+		_chargeDeadline(_current, now);
+	_replenishThrottled();
 
 	// Finally, process all pending entities.
 	frg::intrusive_list<
@@ -212,6 +321,10 @@ void Scheduler::update() {
 		>
 	> pendingSnapshot;
 	{
+		// Clear the flag *before* taking the snapshot. Entities that are pushed afterwards
+		// either become part of the snapshot or their pusher sends another wakeup.
+		_wakeupPending.store(false, std::memory_order_seq_cst);
+
 		auto irqLock = frg::guard(&irqMutex());
 		auto lock = frg::guard(&_mutex);
 
@@ -226,9 +339,24 @@ void Scheduler::update() {
 		entity->_refClock = _refClock;
 		entity->state = ScheduleState::active;
 
+		if(entity->isDeadline() && !_admitWakeup(entity)) {
+			_throttle(entity);
+			continue;
+		}
+
 		_waitQueue.push(entity);
 		_numWaiting++;
 	}
+
+	if(!disableBalancing) {
+		if(_balanceRequested.exchange(false, std::memory_order_relaxed)
+				|| _refClock - _balanceClock >= balanceInterval) {
+			_balanceClock = _refClock;
+			_balance();
+		}
+	}
+
+	_updateLoadHint();
 }
 
 bool Scheduler::maybeReschedule() {
@@ -236,6 +364,10 @@ bool Scheduler::maybeReschedule() {
 	assert(_current);
 
 	auto wantToSchedule = [this] () -> bool {
+		// Throttled entities must stop running, even if nothing else is runnable.
+		if(_current->_dlThrottled)
+			return true;
+
 		// If there are no waiters, we keep the current entity.
 		// Otherwise, if the current entity is not active anymore, we always switch.
 		if(_waitQueue.empty())
@@ -253,6 +385,10 @@ bool Scheduler::maybeReschedule() {
 			return false;
 		}
 
+		// Deadline entities run in EDF order.
+		if(_current->isDeadline())
+			return ScheduleEntity::scheduleBefore(_waitQueue.top(), _current);
+
 		// Switch based on unfairness.
 		auto diff = _liveUnfairness(_current) + sliceGranularity * 256
 				- _liveUnfairness(_waitQueue.top());
@@ -283,15 +419,51 @@ void Scheduler::forceReschedule() {
 	_scheduled = nullptr;
 	_sliceClock = _refClock;
 
-	if(!preemptionIsArmed())
+	if(_current != _lastInvoked) {
+		_lastInvoked = _current;
+		_numContextSwitches.store(_numContextSwitches.load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+	}
+	if(_current->type() == ScheduleType::idle && !_idleSince.load(std::memory_order_relaxed))
+		_idleSince.store(systemClockSource()->currentNanos(), std::memory_order_relaxed);
+
+	if(_haveDeadlineTimers()) {
+		_updateDeadlinePreemption();
+	}else if(!preemptionIsArmed()) {
 		_updatePreemption();
+	}else if(_waitQueue.empty()) {
+		// Go tickless if there is nothing else to run.
+		disarmPreemption();
+	}
 
 	currentRunnable()->invoke();
 }
 
 void Scheduler::renewSchedule() {
-	if(!preemptionIsArmed())
+	if(_haveDeadlineTimers()) {
+		_updateDeadlinePreemption();
+	}else if(!preemptionIsArmed()) {
 		_updatePreemption();
+	}else if(_waitQueue.empty()) {
+		disarmPreemption();
+	}
+}
+
+uint64_t Scheduler::idleTime() {
+	uint64_t seq, total, since;
+	do {
+		seq = _idleSeq.load(std::memory_order_acquire);
+		total = _idleTime.load(std::memory_order_relaxed);
+		since = _idleSince.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while((seq & 1) || _idleSeq.load(std::memory_order_relaxed) != seq);
+
+	if(since) {
+		auto now = systemClockSource()->currentNanos();
+		if(now > since)
+			total += now - since;
+	}
+	return total;
 }
 
 ScheduleEntity *Scheduler::currentRunnable() {
@@ -299,16 +471,69 @@ ScheduleEntity *Scheduler::currentRunnable() {
 	return _current;
 }
 
+void Scheduler::runIdleLoop() {
+	assert(!intsAreEnabled());
+	assert(_current->type() == ScheduleType::idle);
+
+	while(true) {
+		_idleClock = systemClockSource()->currentNanos();
+		// Sequential consistency orders this store before the reads of _pendingList
+		// in update(); this pairs with the CAS in _pushPending().
+		_idleWord.state.store(idleMonitoring, std::memory_order_seq_cst);
+		monitoredIdle(&_idleWord.state, idleMonitoring, _predictedIdle);
+
+		// We get here if another CPU wrote the idle word or if an IRQ was handled
+		// without switching away from the idle task.
+		leaveIdle();
+		update();
+		if(maybeReschedule())
+			commitReschedule();
+		renewSchedule();
+	}
+}
+
+void Scheduler::leaveIdle() {
+	_idleWord.state.store(idleRunning, std::memory_order_seq_cst);
+
+	if(!_idleClock)
+		return;
+	auto now = systemClockSource()->currentNanos();
+	if(now > _idleClock)
+		_predictedIdle = (_predictedIdle * 7 + (now - _idleClock)) / 8;
+	_idleClock = 0;
+}
+
 void Scheduler::_unschedule() {
 	assert(_current);
 
 	// Decrease the unfairness at the end of the time slice.
 	_updateEntityStats(_current);
+	if(_current->isDeadline())
+		_chargeDeadline(_current, systemClockSource()->currentNanos());
+
+	if(auto since = _idleSince.load(std::memory_order_relaxed); since) {
+		auto now = systemClockSource()->currentNanos();
+		auto seq = _idleSeq.load(std::memory_order_relaxed);
+		_idleSeq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		if(now > since)
+			_idleTime.store(_idleTime.load(std::memory_order_relaxed) + (now - since),
+					std::memory_order_relaxed);
+		_idleSince.store(0, std::memory_order_relaxed);
+		_idleSeq.store(seq + 2, std::memory_order_release);
+	}
 
 	if(_current->type() == ScheduleType::regular
 			|| _current->state == ScheduleState::active) {
-		_waitQueue.push(_current);
-		_numWaiting++;
+		_current->_runnableClock = _refClock;
+		_current->_wokenUp = false;
+		_current->_numInvoluntarySwitches++;
+		if(_current->_dlThrottled) {
+			_throttle(_current);
+		}else{
+			_waitQueue.push(_current);
+			_numWaiting++;
+		}
 	}
 
 	_current = nullptr;
@@ -319,20 +544,43 @@ void Scheduler::_schedule() {
 	assert(!_scheduled);
 
 	if(_waitQueue.empty()) {
+		_handoff = nullptr;
+		_handoffPending = false;
 		if(logScheduling)
 			infoLogger() << "No entities to schedule" << frg::endlog;
 		_scheduled = &globalIdleTask.get();
+		_updateLoadHint();
+		if(!disableBalancing)
+			_requestWork();
 		return;
 	}
 
-	auto entity = _waitQueue.top();
-	_waitQueue.pop();
+	// The entity that the blocking entity woke up takes over the rest of the time slice,
+	// unless a higher priority entity is waiting. The handoff hint is only valid until
+	// the next scheduling decision. Deadline entities are always picked in EDF order.
+	ScheduleEntity *entity = nullptr;
+	if(_handoffPending && _handoff && _handoff->_scheduler == this
+			&& _handoff->state == ScheduleState::active && !_handoff->_dlThrottled
+			&& !_waitQueue.top()->isDeadline()
+			&& ScheduleEntity::orderPriority(_handoff, _waitQueue.top()) <= 0) {
+		entity = _handoff;
+		_waitQueue.remove(entity);
+		_numHandoffs.fetch_add(1, std::memory_order_relaxed);
+	}else{
+		entity = _waitQueue.top();
+		_waitQueue.pop();
+	}
 	_numWaiting--;
+	_handoff = nullptr;
+	_handoffPending = false;
 
 	// Increase the unfairness at the start of the time slice.
 	assert(entity->state == ScheduleState::active);
 	_updateWaitingEntity(entity);
 	_updateEntityStats(entity);
+	_accountWait(entity);
+	if(entity->isDeadline())
+		entity->_dlChargeClock = systemClockSource()->currentNanos();
 
 	if(logScheduling) {
 //		infoLogger() << "System progress: " << (_systemProgress / 256) / (1000 * 1000)
@@ -349,6 +597,130 @@ void Scheduler::_schedule() {
 				<< " ms" << frg::endlog;
 
 	_scheduled = entity;
+	_updateLoadHint();
+}
+
+void Scheduler::_pushPending(ScheduleEntity *entity) {
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		entity->state = ScheduleState::pending;
+		_pendingList.push_back(entity);
+	}
+
+	// If a wakeup is already in flight, the target will see our entity when it handles
+	// that wakeup. Hence, bursts of resume() calls only cause a single IPI.
+	if(_wakeupPending.exchange(true, std::memory_order_seq_cst)) {
+		_numWakeupsBatched.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	// If the CPU waits in monitoredIdle(), the write to the idle word wakes it up.
+	auto expected = idleMonitoring;
+	if(!_idleWord.state.compare_exchange_strong(expected, idleWoken,
+			std::memory_order_seq_cst))
+		sendPingIpi(_cpuContext->cpuIndex);
+}
+
+size_t Scheduler::_localLoad() {
+	auto n = _numWaiting;
+	if(_current && _current->type() == ScheduleType::regular)
+		n++;
+	if(_scheduled && _scheduled->type() == ScheduleType::regular)
+		n++;
+	return n;
+}
+
+void Scheduler::_updateLoadHint() {
+	_loadHint.store(_localLoad(), std::memory_order_relaxed);
+}
+
+void Scheduler::_requestWork() {
+	Scheduler *busiest = nullptr;
+	size_t busiestLoad = 1; // CPUs with a single entity have nothing to give away.
+	for(int i = 0; i < getCpuCount(); i++) {
+		auto other = &getCpuData(i)->scheduler;
+		if(other == this)
+			continue;
+		auto load = other->_loadHint.load(std::memory_order_relaxed);
+		if(load > busiestLoad) {
+			busiest = other;
+			busiestLoad = load;
+		}
+	}
+	if(!busiest)
+		return;
+
+	if(logBalancing)
+		infoLogger() << "thor: CPU " << _cpuContext->cpuIndex
+				<< " requests work from CPU " << busiest->_cpuContext->cpuIndex
+				<< " (load: " << busiestLoad << ")" << frg::endlog;
+	if(!busiest->_balanceRequested.exchange(true, std::memory_order_relaxed))
+		sendPingIpi(busiest->_cpuContext->cpuIndex);
+}
+
+void Scheduler::_balance() {
+	assert(!intsAreEnabled());
+
+	while(!_waitQueue.empty()) {
+		// Find the least loaded CPU.
+		Scheduler *target = nullptr;
+		size_t targetLoad = _localLoad();
+		for(int i = 0; i < getCpuCount(); i++) {
+			auto other = &getCpuData(i)->scheduler;
+			if(other == this)
+				continue;
+			auto load = other->_loadHint.load(std::memory_order_relaxed);
+			if(load < targetLoad) {
+				target = other;
+				targetLoad = load;
+			}
+		}
+
+		// Only migrate if this actually improves the balance.
+		if(!target || _localLoad() < targetLoad + 2)
+			return;
+
+		// Find a waiting entity that is allowed to run on the target CPU.
+		// Entities are taken from the top of the queue, i.e., we move the entity that
+		// would run next here; the target is (comparably) idle and will run it soon.
+		ScheduleEntity *inspected[maxBalanceScan];
+		size_t numInspected = 0;
+		ScheduleEntity *victim = nullptr;
+		while(!_waitQueue.empty() && numInspected < maxBalanceScan) {
+			auto entity = _waitQueue.top();
+			_waitQueue.pop();
+			if(entity->isMigratableTo(target->_cpuContext)) {
+				victim = entity;
+				break;
+			}
+			inspected[numInspected++] = entity;
+		}
+		for(size_t i = 0; i < numInspected; i++)
+			_waitQueue.push(inspected[i]);
+
+		if(!victim)
+			return;
+		_numWaiting--;
+		if(victim == _handoff)
+			_handoff = nullptr;
+
+		// Fold the waiting time on this CPU into the unfairness.
+		// The target updates refProgress once it processes its pending list.
+		_updateWaitingEntity(victim);
+		victim->_numMigrations++;
+		victim->_scheduler = target;
+
+		if(logBalancing)
+			infoLogger() << "thor: Migrating entity from CPU " << _cpuContext->cpuIndex
+					<< " to CPU " << target->_cpuContext->cpuIndex << frg::endlog;
+		_numDonated.fetch_add(1, std::memory_order_relaxed);
+		target->_numStolen.fetch_add(1, std::memory_order_relaxed);
+		target->_loadHint.fetch_add(1, std::memory_order_relaxed);
+		target->_pushPending(victim);
+		_updateLoadHint();
+	}
 }
 
 // Returns true if preemption should be done immediately.
@@ -376,6 +748,143 @@ void Scheduler::_updatePreemption() {
 	armPreemption(sliceGranularity);
 }
 
+bool Scheduler::_haveDeadlineTimers() {
+	if(disablePreemption)
+		return false;
+	return (_current && _current->isDeadline()) || !_throttledList.empty()
+			|| (!_waitQueue.empty() && _waitQueue.top()->isDeadline());
+}
+
+void Scheduler::_updateDeadlinePreemption() {
+	assert(_current);
+	auto now = systemClockSource()->currentNanos();
+
+	uint64_t target = UINT64_MAX;
+	auto consider = [&] (uint64_t clock) {
+		if(clock < target)
+			target = clock;
+	};
+
+	// Enforce the budget of the current entity.
+	if(_current->isDeadline()) {
+		if(_current->_dlThrottled || _current->_dlBudget <= 0) {
+			consider(now);
+		}else{
+			consider(_current->_dlChargeClock + _current->_dlBudget);
+		}
+	}
+
+	// Replenish throttled entities at the start of their next period.
+	for(auto it = _throttledList.begin(); it != _throttledList.end(); ++it)
+		consider((*it)->_dlReplenishClock);
+
+	if(!_waitQueue.empty() && _current->type() == ScheduleType::regular) {
+		auto po = ScheduleEntity::orderPriority(_current, _waitQueue.top());
+		if(po > 0) {
+			// A deadline entity is waiting for a regular one; we would usually
+			// have rescheduled already (but see setDeadline()).
+			consider(now);
+		}else if(!po && !_current->isDeadline()) {
+			// Time slices of regular entities work as in _updatePreemption().
+			if(now - _sliceClock >= static_cast<uint64_t>(sliceGranularity))
+				_sliceClock = now;
+			consider(_sliceClock + sliceGranularity);
+		}
+	}
+
+	if(target == UINT64_MAX) {
+		disarmPreemption();
+		return;
+	}
+	armPreemption(target > now ? target - now : 1);
+}
+
+void Scheduler::_chargeDeadline(ScheduleEntity *entity, uint64_t now) {
+	assert(entity->isDeadline());
+
+	if(now > entity->_dlChargeClock)
+		entity->_dlBudget -= now - entity->_dlChargeClock;
+	entity->_dlChargeClock = now;
+	if(entity->_dlBudget <= 0)
+		entity->_dlThrottled = true;
+}
+
+bool Scheduler::_admitWakeup(ScheduleEntity *entity) {
+	assert(entity->isDeadline());
+
+	// CBS wakeup rule: the entity can keep its deadline if its remaining budget does not
+	// exceed its bandwidth over the remaining time. Otherwise, a new period starts now.
+	// This prevents entities from saving up budget while they are blocked.
+	entity->_dlThrottled = false;
+	if(_refClock >= entity->_dlAbsDeadline
+			|| static_cast<__int128>(entity->_dlBudget) * entity->_dlDeadline
+				> static_cast<__int128>(entity->_dlRuntime)
+					* (entity->_dlAbsDeadline - _refClock)) {
+		entity->_dlAbsDeadline = _refClock + entity->_dlDeadline;
+		entity->_dlBudget = entity->_dlRuntime;
+		return true;
+	}
+	return entity->_dlBudget > 0;
+}
+
+void Scheduler::_throttle(ScheduleEntity *entity) {
+	assert(entity->isDeadline());
+	assert(entity->state == ScheduleState::active);
+
+	entity->_dlThrottled = true;
+	entity->_dlReplenishClock = entity->_dlAbsDeadline - entity->_dlDeadline
+			+ entity->_dlPeriod;
+	entity->_numThrottles++;
+	if(entity == _handoff)
+		_handoff = nullptr;
+	_throttledList.push_back(entity);
+}
+
+void Scheduler::_replenishThrottled() {
+	if(_throttledList.empty())
+		return;
+
+	frg::intrusive_list<
+		ScheduleEntity,
+		frg::locate_member<
+			ScheduleEntity,
+			frg::default_list_hook<ScheduleEntity>,
+			&ScheduleEntity::listHook
+		>
+	> throttledSnapshot;
+	throttledSnapshot.splice(throttledSnapshot.end(), _throttledList);
+	while(!throttledSnapshot.empty()) {
+		auto entity = throttledSnapshot.pop_front();
+		if(_refClock < entity->_dlReplenishClock) {
+			_throttledList.push_back(entity);
+			continue;
+		}
+
+		// Overruns (e.g., due to non-preemptible kernel code) are paid back
+		// from the next period's budget.
+		entity->_dlAbsDeadline += entity->_dlPeriod;
+		entity->_dlBudget = frg::min(entity->_dlBudget, int64_t{0})
+				+ static_cast<int64_t>(entity->_dlRuntime);
+		if(entity->_dlBudget <= 0) {
+			entity->_dlReplenishClock += entity->_dlPeriod;
+			_throttledList.push_back(entity);
+			continue;
+		}
+		// If we replenish late, do not let the entity run with a deadline in the past.
+		if(entity->_dlAbsDeadline <= _refClock) {
+			entity->_dlAbsDeadline = _refClock + entity->_dlDeadline;
+			entity->_dlBudget = entity->_dlRuntime;
+		}
+		entity->_dlThrottled = false;
+
+		// Throttled entities do not accumulate unfairness.
+		entity->refProgress = _systemProgress;
+		entity->_refClock = _refClock;
+		_waitQueue.push(entity);
+		_numWaiting++;
+	}
+}
+
 void Scheduler::_updateCurrentEntity() {
 	assert(_current);
 	if(_current->type() == ScheduleType::idle)
@@ -404,6 +913,29 @@ void Scheduler::_updateWaitingEntity(ScheduleEntity *entity) {
 	entity->refProgress = _systemProgress;
 }
 
+void Scheduler::_accountWait(ScheduleEntity *entity) {
+	assert(entity->type() == ScheduleType::regular);
+
+	// resume() may read the clock on another CPU; clamp small negative differences.
+	auto now = systemClockSource()->currentNanos();
+	uint64_t wait = 0;
+	if(now > entity->_runnableClock)
+		wait = now - entity->_runnableClock;
+
+	entity->_waitTime += wait;
+	entity->_numTimeslices++;
+
+	if(entity->_wokenUp) {
+		int bucket = 0;
+		if(wait >= 1024)
+			bucket = 64 - __builtin_clzll(wait >> 10);
+		if(bucket >= numWakeupLatencyBuckets)
+			bucket = numWakeupLatencyBuckets - 1;
+		entity->_wakeupLatency[bucket]++;
+		entity->_wokenUp = false;
+	}
+}
+
 void Scheduler::_updateEntityStats(ScheduleEntity *entity) {
 	if(entity->type() == ScheduleType::idle)
 		return;
@@ -187,39 +187,101 @@ coroutine<ImageInfo> loadModuleImage(smarter::shared_ptr<AddressSpace, BindableH
 		
 		if(phdr.p_type == PT_LOAD) {
 			assert(phdr.p_memsz > 0);
-			
+			assert(phdr.p_filesz <= phdr.p_memsz);
+
 			// align virtual address and length to page size
 			uintptr_t virt_address = phdr.p_vaddr;
 			virt_address -= virt_address % kPageSize;
+			uintptr_t misalign = phdr.p_vaddr - virt_address;
 
 			size_t virt_length = (phdr.p_vaddr + phdr.p_memsz) - virt_address;
 			if((virt_length % kPageSize) != 0)
 				virt_length += kPageSize - virt_length % kPageSize;
-			
-			auto memory = smarter::allocate_shared<AllocatedMemory>(*kernelAlloc, virt_length);
-			memory->selfPtr = memory;
-			co_await copyBetweenViews(memory.get(), phdr.p_vaddr - virt_address,
-					image.get(), phdr.p_offset, phdr.p_filesz,
-					WorkQueue::generalQueue()->take());
-
-			auto view = smarter::allocate_shared<MemorySlice>(*kernelAlloc,
-					std::move(memory), 0, virt_length);
 
+			AddressSpace::MapFlags protFlags = 0;
 			if((phdr.p_flags & (PF_R | PF_W | PF_X)) == (PF_R | PF_W)) {
+				protFlags = AddressSpace::kMapProtRead | AddressSpace::kMapProtWrite;
+			}else if((phdr.p_flags & (PF_R | PF_W | PF_X)) == (PF_R | PF_X)) {
+				protFlags = AddressSpace::kMapProtRead | AddressSpace::kMapProtExecute;
+			}else{
+				panicLogger() << "Illegal combination of segment permissions"
+						<< frg::endlog;
+			}
+
+			// Pages can only be shared with the image if the segment has the same
+			// alignment in the file and in memory. Otherwise, fall back to copying.
+			if(phdr.p_offset % kPageSize != misalign) {
+				auto memory = smarter::allocate_shared<AllocatedMemory>(*kernelAlloc, virt_length);
+				memory->selfPtr = memory;
+				co_await copyBetweenViews(memory.get(), misalign,
+						image.get(), phdr.p_offset, phdr.p_filesz,
+						WorkQueue::generalQueue()->take());
+
+				auto view = smarter::allocate_shared<MemorySlice>(*kernelAlloc,
+						std::move(memory), 0, virt_length);
 				auto mapResult = co_await space->map(std::move(view),
 						base + virt_address, 0, virt_length,
-						AddressSpace::kMapFixed | AddressSpace::kMapProtRead
-							| AddressSpace::kMapProtWrite);
+						AddressSpace::kMapFixed | protFlags);
 				assert(mapResult);
-			}else if((phdr.p_flags & (PF_R | PF_W | PF_X)) == (PF_R | PF_X)) {
+				continue;
+			}
+
+			// Page-aligned part of the segment that is backed by the image.
+			uintptr_t file_offset = phdr.p_offset - misalign;
+			size_t file_length = misalign + phdr.p_filesz;
+			if((file_length % kPageSize) != 0)
+				file_length += kPageSize - file_length % kPageSize;
+			assert(file_offset + file_length <= image->getLength());
+
+			if(!(protFlags & AddressSpace::kMapProtWrite) && phdr.p_filesz == phdr.p_memsz) {
+				// Read-only segments are mapped straight out of the image, such that all
+				// instances of a server share the same pages. kMapForbidWrite prevents
+				// protect() from making the image writable.
+				auto view = smarter::allocate_shared<MemorySlice>(*kernelAlloc,
+						image, file_offset, file_length);
 				auto mapResult = co_await space->map(std::move(view),
-						base + virt_address, 0, virt_length,
-						AddressSpace::kMapFixed | AddressSpace::kMapProtRead
-							| AddressSpace::kMapProtExecute);
+						base + virt_address, 0, file_length,
+						AddressSpace::kMapFixed | AddressSpace::kMapForbidWrite | protFlags);
+				assert(mapResult);
+				continue;
+			}
+
+			if(file_length) {
+				auto memory = smarter::allocate_shared<CopyOnWriteMemory>(*kernelAlloc,
+						image, file_offset, file_length);
+				memory->selfPtr = memory;
+
+				// The end of the last page belongs to the BSS (or to the next segment
+				// in the file); it has to read as zero.
+				size_t tail = file_length - (misalign + phdr.p_filesz);
+				if(tail) {
+					frg::unique_memory<KernelAlloc> zeros{*kernelAlloc, tail};
+					memset(zeros.data(), 0, tail);
+					auto zeroOutcome = co_await memory->copyTo(misalign + phdr.p_filesz,
+							zeros.data(), tail, WorkQueue::generalQueue()->take());
+					assert(zeroOutcome);
+				}
+
+				auto view = smarter::allocate_shared<MemorySlice>(*kernelAlloc,
+						std::move(memory), 0, file_length);
+				auto mapResult = co_await space->map(std::move(view),
+						base + virt_address, 0, file_length,
+						AddressSpace::kMapFixed | protFlags);
+				assert(mapResult);
+			}
+
+			// The remaining pages of the BSS are backed by the zero page until written.
+			if(virt_length > file_length) {
+				auto memory = smarter::allocate_shared<CopyOnWriteMemory>(*kernelAlloc,
+						getZeroMemory(), 0, virt_length - file_length);
+				memory->selfPtr = memory;
+
+				auto view = smarter::allocate_shared<MemorySlice>(*kernelAlloc,
+						std::move(memory), 0, virt_length - file_length);
+				auto mapResult = co_await space->map(std::move(view),
+						base + virt_address + file_length, 0, virt_length - file_length,
+						AddressSpace::kMapFixed | protFlags);
 				assert(mapResult);
-			}else{
-				panicLogger() << "Illegal combination of segment permissions"
-						<< frg::endlog;
 			}
 		}else if(phdr.p_type == PT_INTERP) {
 			info.interpreter.resize(phdr.p_filesz);
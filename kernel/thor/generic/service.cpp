@@ -9,6 +9,7 @@
 #include <thor-internal/gdbserver.hpp>
 #include <thor-internal/module.hpp>
 #include <thor-internal/stream.hpp>
+#include <protocols/fs/defs.hpp>
 #include <protocols/posix/data.hpp>
 
 namespace thor {
@@ -270,6 +271,54 @@ namespace initrd {
 					// TODO: improve error handling here.
 					assert(respError == Error::success);
 				}
+			}else if(req.req_type() == managarm::fs::CntReqType::PT_READ_ENTRIES_BATCH) {
+				if(req.flags() & protocols::fs::kReadEntriesResume)
+					file->index = req.offset();
+
+				size_t size = frg::min(static_cast<size_t>(req.size()), size_t{0x10000});
+				frg::unique_memory<KernelAlloc> dataBuffer{*kernelAlloc, size};
+				size_t length = 0;
+				while(file->index < file->node->numEntries()) {
+					auto entry = file->node->getEntry(file->index);
+					uint8_t type = protocols::fs::kDirentRegular;
+					if(entry.node->type == MfsType::directory)
+						type = protocols::fs::kDirentDirectory;
+
+					auto n = protocols::fs::appendDirentRecord(
+							reinterpret_cast<char *>(dataBuffer.data()) + length, size - length,
+							0, type, entry.name.data(), entry.name.size(), nullptr);
+					if(!n)
+						break;
+					length += n;
+					file->index++;
+				}
+
+				managarm::fs::SvrResponse<KernelAlloc> resp(*kernelAlloc);
+				if(length) {
+					resp.set_error(managarm::fs::Errors::SUCCESS);
+					resp.set_size(length);
+					resp.set_offset(file->index);
+				}else if(file->index < file->node->numEntries()) {
+					resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+				}else{
+					resp.set_error(managarm::fs::Errors::END_OF_FILE);
+				}
+
+				frg::string<KernelAlloc> ser(*kernelAlloc);
+				resp.SerializeToString(&ser);
+				frg::unique_memory<KernelAlloc> respBuffer{*kernelAlloc, ser.size()};
+				memcpy(respBuffer.data(), ser.data(), ser.size());
+				auto respError = co_await SendBufferSender{conversation, std::move(respBuffer)};
+				// TODO: improve error handling here.
+				assert(respError == Error::success);
+
+				if(length) {
+					frg::unique_memory<KernelAlloc> sendBuffer{*kernelAlloc, length};
+					memcpy(sendBuffer.data(), dataBuffer.data(), length);
+					auto dataError = co_await SendBufferSender{conversation, std::move(sendBuffer)};
+					// TODO: improve error handling here.
+					assert(dataError == Error::success);
+				}
 			}else{
 				infoLogger() << "\e[31m" "thor: Illegal request type " << (int32_t)req.req_type()
 						<< " for kernel provided directory file" "\e[39m" << frg::endlog;
@@ -677,12 +726,10 @@ namespace posix {
 				launchGdbServer(_thread, _name, WorkQueue::generalQueue()->take());
 				break;
 			}else if(interrupt == kIntrSuperCall + 10) { // ANON_ALLOCATE.
-				// TODO: Use some always-zero memory for private anonymous mappings.
+				// Read faults are served by the shared zero page (see CopyOnWriteMemory).
 				auto size = *_thread->_executor.arg0();
-				auto fileMemory = smarter::allocate_shared<AllocatedMemory>(*kernelAlloc, size);
-				fileMemory->selfPtr = fileMemory;
 				auto cowMemory = smarter::allocate_shared<CopyOnWriteMemory>(*kernelAlloc,
-						std::move(fileMemory), 0, size);
+						getZeroMemory(), 0, size);
 				cowMemory->selfPtr = cowMemory;
 				auto slice = smarter::allocate_shared<MemorySlice>(*kernelAlloc,
 						std::move(cowMemory), 0, size);
@@ -720,6 +767,7 @@ namespace posix {
 					mbusHandle,
 					nullptr,
 					reinterpret_cast<HelHandle *>(clientFileTable),
+					nullptr,
 					nullptr
 				};
 
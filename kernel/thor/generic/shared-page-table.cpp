@@ -0,0 +1,117 @@
+#include <string.h>
+
+#include <frg/hash_map.hpp>
+#include <thor-internal/cpu-data.hpp>
+#include <thor-internal/kernel_heap.hpp>
+#include <thor-internal/physical.hpp>
+#include <thor-internal/shared-page-table.hpp>
+
+namespace thor {
+
+namespace {
+	struct SharedTableKey {
+		struct Hash {
+			size_t operator() (const SharedTableKey &key) const {
+				auto h = [] (uintptr_t x) -> uintptr_t {
+					static_assert(sizeof(uintptr_t) == 8);
+					x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+					x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+					x = x ^ (x >> 31);
+					return x;
+				};
+
+				return 3 * h(reinterpret_cast<uintptr_t>(key.view)) + h(key.offset | key.flags)
+						+ h((key.begin << 32) | key.end);
+			}
+		};
+
+		bool operator== (const SharedTableKey &) const = default;
+
+		MemoryView *view;
+		uintptr_t offset;
+		size_t begin;
+		size_t end;
+		PageFlags flags;
+	};
+
+	frg::ticket_spinlock registryMutex;
+
+	frg::eternal<
+		frg::hash_map<
+			SharedTableKey,
+			SharedPageTable *,
+			SharedTableKey::Hash,
+			Allocator
+		>
+	> registry{SharedTableKey::Hash{}};
+
+	size_t numTables = 0;
+	size_t numReferences = 0;
+}
+
+SharedPageTable *acquireSharedPageTable(MemoryView *view, uintptr_t offset,
+		size_t begin, size_t end, PageFlags flags) {
+	assert(!(offset & (kPageSize - 1)));
+	assert(begin < end && end <= kHugePageSize);
+	SharedTableKey key{view, offset, begin, end, flags};
+
+	auto irqLock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&registryMutex);
+
+	numReferences++;
+	if(auto it = registry->get(key); it) {
+		(*it)->numAttached++;
+		(*it)->refCount++;
+		return *it;
+	}
+
+	auto table = physicalAllocator->allocate(kPageSize);
+	assert(table != PhysicalAddr(-1) && "OOM");
+	PageAccessor accessor{table};
+	memset(accessor.get(), 0, kPageSize);
+
+	auto sharedTable = frg::construct<SharedPageTable>(*kernelAlloc,
+			SharedPageTable{view, offset, begin, end, flags, table, 1, 1});
+	registry->insert(key, sharedTable);
+	numTables++;
+	return sharedTable;
+}
+
+void detachSharedPageTable(SharedPageTable *sharedTable) {
+	auto irqLock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&registryMutex);
+
+	assert(numReferences);
+	numReferences--;
+	assert(sharedTable->numAttached);
+	if(--sharedTable->numAttached)
+		return;
+	// The view might be evicted (or even destructed) from now on.
+	registry->remove(SharedTableKey{sharedTable->view, sharedTable->offset,
+			sharedTable->begin, sharedTable->end, sharedTable->flags});
+	numTables--;
+}
+
+void releaseSharedPageTable(SharedPageTable *sharedTable) {
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&registryMutex);
+
+		assert(sharedTable->refCount > sharedTable->numAttached);
+		if(--sharedTable->refCount)
+			return;
+	}
+
+	// The PTEs do not own the pages that they map, so we can simply free the PT.
+	physicalAllocator->free(sharedTable->table, kPageSize);
+	frg::destruct(*kernelAlloc, sharedTable);
+}
+
+SharedPageTableStats getSharedPageTableStats() {
+	auto irqLock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&registryMutex);
+
+	return {numTables, numReferences};
+}
+
+} // namespace thor
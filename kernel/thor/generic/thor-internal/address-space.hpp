@@ -5,8 +5,11 @@
 #include <async/oneshot-event.hpp>
 #include <frg/container_of.hpp>
 #include <frg/expected.hpp>
+#include <frg/hash_map.hpp>
+#include <frg/vector.hpp>
 #include <thor-internal/coroutine.hpp>
 #include <thor-internal/memory-view.hpp>
+#include <thor-internal/shared-page-table.hpp>
 
 namespace thor {
 
@@ -23,6 +26,22 @@ struct VirtualOperations {
 	virtual PageStatus cleanSingle4k(VirtualAddr pointer) = 0;
 	virtual bool isMapped(VirtualAddr pointer) = 0;
 
+	// Optional support for 2 MiB pages. mapSingle2m() returns false if the page
+	// cannot be mapped as a whole; unmapSingle2m() and cleanSingle2m() return 0 if the
+	// address is not mapped by a 2 MiB page. Operations on 4 KiB pages split 2 MiB pages.
+	virtual bool mapSingle2m(VirtualAddr pointer, PhysicalAddr physical,
+			uint32_t flags, CachingMode cachingMode);
+	virtual PageStatus unmapSingle2m(VirtualAddr pointer);
+	virtual PageStatus cleanSingle2m(VirtualAddr pointer);
+
+	// Optional support for page tables that are shared between spaces (see SharedPageTable).
+	// attachSharedTable() returns false if the 2 MiB range at pointer is already mapped.
+	// detachSharedTable() removes the PT again; if copy is true, it is replaced by a private
+	// copy, otherwise the range becomes unmapped. 4 KiB operations on the range modify
+	// the shared PT; they return page_status::shared for PTEs in shared PTs.
+	virtual bool attachSharedTable(VirtualAddr pointer, PhysicalAddr table);
+	virtual void detachSharedTable(VirtualAddr pointer, bool copy);
+
 	// ----------------------------------------------------------------------------------
 
 	// The following API is based on MemoryView and will replace the legacy API above.
@@ -37,6 +56,11 @@ struct VirtualOperations {
 	virtual frg::expected<Error> faultPage(VirtualAddr va, MemoryView *view, uintptr_t offset,
 			PageFlags flags);
 
+	// Like mapPresentPages() but skips pages that are already mapped.
+	// Used to map the neighbors of a faulting page (i.e., for fault-around).
+	virtual frg::expected<Error> mapMissingPages(VirtualAddr va, MemoryView *view,
+			uintptr_t offset, size_t size, PageFlags flags);
+
 	virtual frg::expected<Error> cleanPages(VirtualAddr va, MemoryView *view,
 			uintptr_t offset, size_t size);
 
@@ -179,7 +203,9 @@ enum MappingFlags : uint32_t {
 	protWrite = 0x20,
 	protExecute = 0x40,
 
-	dontRequireBacking = 0x100
+	dontRequireBacking = 0x100,
+	// The mapping can never become writable (see VirtualSpace::protect()).
+	forbidWrite = 0x200
 };
 
 struct TouchVirtualResult {
@@ -299,6 +325,12 @@ public:
 	MappingState state = MappingState::null;
 	MemoryObserver observer;
 
+	// On page faults, pages that are already present within an aligned window
+	// of (kPageSize << faultAroundOrder) bytes are mapped as well.
+	static constexpr unsigned int defaultFaultAroundOrder = 4;
+	static constexpr unsigned int maxFaultAroundOrder = 9;
+	unsigned int faultAroundOrder = defaultFaultAroundOrder;
+
 	// This (asynchronous) mutex can be used to temporarily disable eviction.
 	// By disabling eviction, we can safely map pages returned from peekRange()
 	// before they can be evicted.
@@ -313,6 +345,7 @@ public:
 	// This mutex is held whenever we modify parts of the page space that belong
 	// to this mapping (using VirtualOperation::mapSingle4k and similar). This is
 	// necessary since we sometimes need to read pages before writing them.
+	// Speculative faults hold it while they commit their page table changes.
 	frg::ticket_spinlock pagingMutex;
 };
 
@@ -348,6 +381,74 @@ using MappingTree = frg::rbtree<
 	MappingLess
 >;
 
+// Reader-writer lock that protects ranges of virtual addresses.
+// Shared holders of overlapping ranges can coexist, while exclusive holders exclude all
+// holders of overlapping ranges. Conflicting requests are granted in FIFO order.
+struct VirtualRangeLock {
+	struct Node {
+		VirtualAddr address = 0;
+		size_t length = 0;
+		bool exclusive = false;
+
+		async::oneshot_event grantedEvent;
+		frg::default_list_hook<Node> hook;
+		// Used by unlock() to raise grantedEvent outside of the lock.
+		Node *nextGranted = nullptr;
+	};
+
+	// Unlocks the range when it goes out of scope.
+	struct [[nodiscard]] Guard {
+		Guard(VirtualRangeLock *lock, Node *node)
+		: lock_{lock}, node_{node} { }
+
+		Guard(const Guard &) = delete;
+		Guard &operator= (const Guard &) = delete;
+
+		~Guard() {
+			lock_->unlock(node_);
+		}
+
+	private:
+		VirtualRangeLock *lock_;
+		Node *node_;
+	};
+
+	coroutine<void> lock(Node *node);
+	void unlock(Node *node);
+
+private:
+	using NodeList = frg::intrusive_list<
+		Node,
+		frg::locate_member<
+			Node,
+			frg::default_list_hook<Node>,
+			&Node::hook
+		>
+	>;
+
+	static bool _conflicts(Node *a, Node *b) {
+		if(!a->exclusive && !b->exclusive)
+			return false;
+		return a->address < b->address + b->length
+				&& b->address < a->address + a->length;
+	}
+
+	// Whether the node conflicts with a holder or with a waiter in front of it.
+	bool _isBlocked(Node *node);
+
+	frg::ticket_spinlock _mutex;
+	NodeList _holders;
+	NodeList _waiters;
+};
+
+// A single page of a VirtualSpace that is locked into memory.
+// Returned by VirtualSpace::lockPage(); must be released by VirtualSpace::unlockPage().
+struct LockedPage {
+	smarter::shared_ptr<Mapping> mapping;
+	uintptr_t offsetInMapping = 0;
+	PhysicalAddr physical = PhysicalAddr(-1);
+};
+
 struct VirtualSpace {
 	friend struct Mapping;
 
@@ -362,8 +463,13 @@ public:
 		kMapProtExecute = 0x20,
 		kMapPopulate = 0x200,
 		kMapDontRequireBacking = 0x400,
+		kMapForbidWrite = 0x800,
 	};
 
+	// If non-zero, this field of the MapFlags contains faultAroundOrder + 1 (see Mapping).
+	static constexpr int kMapFaultAroundShift = 16;
+	static constexpr MapFlags kMapFaultAroundMask = 0xF << kMapFaultAroundShift;
+
 	enum FaultFlags : uint32_t {
 		kFaultWrite = (1 << 1),
 		kFaultExecute = (1 << 2)
@@ -387,6 +493,10 @@ public:
 	coroutine<frg::expected<Error>>
 	synchronize(VirtualAddr address, size_t length);
 
+	// Makes all pages in the range present and maps them.
+	coroutine<frg::expected<Error>>
+	populate(VirtualAddr address, size_t length, smarter::shared_ptr<WorkQueue> wq);
+
 	coroutine<frg::expected<Error>>
 	unmap(VirtualAddr address, size_t length);
 
@@ -435,12 +545,19 @@ public:
 		);
 	}
 
+	// Locks the page that contains the given address and returns its physical address.
+	// This allows IPC to copy directly from/to memory of a different address space.
+	coroutine<frg::expected<Error, LockedPage>> lockPage(uintptr_t address,
+			MappingFlags requiredFlags, smarter::shared_ptr<WorkQueue> wq);
+
+	static void unlockPage(LockedPage &page);
+
 	// ----------------------------------------------------------------------------------
 	// GlobalFutex support.
 	// ----------------------------------------------------------------------------------
 
 	frg::expected<Error, FutexIdentity> resolveGlobalFutex(uintptr_t address) {
-		// We do not take _consistencyMutex here since we are only interested in a snapshot.
+		// We do not take _rangeLock here since we are only interested in a snapshot.
 
 		smarter::shared_ptr<Mapping> mapping;
 		{
@@ -455,12 +572,12 @@ public:
 		auto offset = address - mapping->address;
 		auto [futexSpace, futexOffset] = FRG_TRY(mapping->view->resolveGlobalFutex(
 				mapping->viewOffset + offset));
-		return FutexIdentity{reinterpret_cast<uintptr_t>(futexSpace.get()), offset};
+		return FutexIdentity{reinterpret_cast<uintptr_t>(futexSpace.get()), futexOffset};
 	}
 
 	coroutine<frg::expected<Error, GlobalFutex>> grabGlobalFutex(uintptr_t address,
 			smarter::shared_ptr<WorkQueue> wq) {
-		// We do not take _consistencyMutex here since we are only interested in a snapshot.
+		// We do not take _rangeLock here since we are only interested in a snapshot.
 
 		smarter::shared_ptr<Mapping> mapping;
 		{
@@ -492,9 +609,41 @@ private:
 
 	smarter::shared_ptr<Mapping> _findMapping(VirtualAddr address);
 
+	// Like _findMapping() but without taking _snapshotMutex. Must be called inside
+	// an RCU read-side section; the result is only valid if _mappingSeq did not change.
+	Mapping *_findMappingSpeculatively(VirtualAddr address);
+
+	// Fault path that does not take any locks of the VirtualSpace. Returns frg::null_opt
+	// if the fault raced with a structural change and must be retried by handleFault().
+	coroutine<frg::optional<frg::expected<Error>>> _handleFaultSpeculatively(
+			VirtualAddr address, uint32_t faultFlags, smarter::shared_ptr<WorkQueue> wq);
+
+	// Marks a structural change of the mappings in [address, address + length),
+	// i.e., changes of _mappings, of Mapping::flags or of the page tables of existing mappings.
+	// On construction, waits until all speculative faults within the range either
+	// committed or are going to observe the change.
+	struct MappingChange {
+		MappingChange(VirtualSpace *space, VirtualAddr address, size_t length);
+
+		MappingChange(const MappingChange &) = delete;
+		MappingChange &operator= (const MappingChange &) = delete;
+
+		~MappingChange();
+
+	private:
+		VirtualSpace *space_;
+	};
+
+	void _beginMappingChange(VirtualAddr address, size_t length);
+	void _endMappingChange();
+
 	// Splits some memory range from a hole mapping.
 	void _splitHole(Hole *hole, VirtualAddr offset, VirtualAddr length);
 
+	// Extends [address, address + length) to cover all mappings that intersect
+	// the boundaries of the range, i.e., all mappings that _splitMappings() might replace.
+	frg::tuple<VirtualAddr, size_t> _extendToMappings(VirtualAddr address, size_t length);
+
 	// Potentially splits mappings into two parts at (address) and (address + size).
 	// Returns the start and end mappings that are within the specified range.
 	coroutine<frg::tuple<Mapping *, Mapping *>> _splitMappings(uintptr_t address, size_t size);
@@ -504,21 +653,57 @@ private:
 	// Returns whether shootdown needs to be performed (any of the mappings got unmapped).
 	coroutine<bool> _unmapMappings(VirtualAddr address, size_t length, Mapping *start, Mapping *end);
 
+	// Installs shared PTs (see SharedPageTable) for all 2 MiB windows of a read-only mapping
+	// that do not overlap with other mappings. The mapping must already be inserted into
+	// _mappings; must be called with _snapshotMutex held. Returns true if any PT is shared.
+	bool _shareTables(Mapping *mapping, PageFlags pageFlags);
+
+	// Removes shared PTs from all windows that intersect [address, address + length).
+	// If the range covers the entire shared part of a window, the PT is simply detached;
+	// otherwise, the window receives a private copy of the PT. Returns true if any PT
+	// was removed; in this case, the caller needs to call _releaseDetachedTables()
+	// after performing shootdown.
+	bool _unshareTables(VirtualAddr address, size_t length);
+
+	void _releaseDetachedTables();
+
 	VirtualOperations *_ops;
 
 	// Since changing memory mappings requires TLB shootdown, most mapping-related operations
-	// of VirtualSpace are async. Thus, we use an async mutex to serialize these operations.
-	async::shared_mutex _consistencyMutex;
+	// of VirtualSpace are async. Structural changes to _holes and _mappings (i.e., map(),
+	// protect() and unmap()) are serialized by this async mutex.
+	async::mutex _consistencyMutex;
 
-	// To avoid taking _consistencyMutex for operations that only need to look at the current
+	// Faults (and similar operations that work on existing mappings) take shared locks
+	// on the affected addresses. Structural changes take exclusive locks on all mappings
+	// that they modify. Thus, faults only wait for structural changes that affect
+	// their mapping; faults in distinct mappings (and mmap() of new areas) run in parallel.
+	VirtualRangeLock _rangeLock;
+
+	// To avoid taking _rangeLock for operations that only need to look at the current
 	// state of the VirtualSpace (and that can run concurrently with mapping-related that
 	// perform TLB shootdown), we have another mutex that only protects _holes and _mappings.
 	// We make sure that we "commit" changes to _holes and _mappings before changing page
 	// tables and/or doing TLB shootdown.
 	frg::ticket_spinlock _snapshotMutex;
 
+	// Sequence count that is odd during structural changes (see MappingChange).
+	// Speculative faults commit only if the count did not change since their lookup.
+	std::atomic<uint64_t> _mappingSeq{0};
+
 	HoleTree _holes;
 	MappingTree _mappings;
+
+	// Windows that use shared PTs, indexed by their (2 MiB-aligned) address,
+	// and shared PTs that still need to be released after the next shootdown.
+	// Protected by _consistencyMutex.
+	frg::hash_map<
+		VirtualAddr,
+		SharedPageTable *,
+		frg::hash<uint64_t>,
+		KernelAlloc
+	> _sharedTables;
+	frg::vector<SharedPageTable *, KernelAlloc> _detachedTables;
 };
 
 struct AddressSpace final : VirtualSpace, smarter::crtp_counter<AddressSpace, BindableHandle> {
@@ -541,11 +726,21 @@ struct AddressSpace final : VirtualSpace, smarter::crtp_counter<AddressSpace, Bi
 
 		void mapSingle4k(VirtualAddr pointer, PhysicalAddr physical,
 				uint32_t flags, CachingMode cachingMode) override {
-			space_->pageSpace_.mapSingle4k(pointer, physical, true, flags, cachingMode);
+			// Pages in shared PTs do not count towards the RSS of any space.
+			if(!space_->pageSpace_.mapSingle4k(pointer, physical, true, flags, cachingMode))
+				return;
+
+			// The shared zero page does not count towards the RSS.
+			if(physical != getZeroPage())
+				rss_.fetch_add(kPageSize, std::memory_order_relaxed);
 		}
 
 		PageStatus unmapSingle4k(VirtualAddr pointer) override {
-			return space_->pageSpace_.unmapSingle4k(pointer);
+			auto status = space_->pageSpace_.unmapSingle4k(pointer);
+			if((status & page_status::present)
+					&& !(status & (page_status::shared | page_status::zero)))
+				rss_.fetch_sub(kPageSize, std::memory_order_relaxed);
+			return status;
 		}
 
 		PageStatus cleanSingle4k(VirtualAddr pointer) override {
@@ -556,8 +751,42 @@ struct AddressSpace final : VirtualSpace, smarter::crtp_counter<AddressSpace, Bi
 			return space_->pageSpace_.isMapped(pointer);
 		}
 
+		bool mapSingle2m(VirtualAddr pointer, PhysicalAddr physical,
+				uint32_t flags, CachingMode cachingMode) override {
+			if(!space_->pageSpace_.mapSingle2m(pointer, physical, true, flags, cachingMode))
+				return false;
+			rss_.fetch_add(kHugePageSize, std::memory_order_relaxed);
+			return true;
+		}
+
+		PageStatus unmapSingle2m(VirtualAddr pointer) override {
+			auto status = space_->pageSpace_.unmapSingle2m(pointer);
+			if(status & page_status::present)
+				rss_.fetch_sub(kHugePageSize, std::memory_order_relaxed);
+			return status;
+		}
+
+		PageStatus cleanSingle2m(VirtualAddr pointer) override {
+			return space_->pageSpace_.cleanSingle2m(pointer);
+		}
+
+		bool attachSharedTable(VirtualAddr pointer, PhysicalAddr table) override {
+			return space_->pageSpace_.attachSharedTable(pointer, table, true);
+		}
+
+		void detachSharedTable(VirtualAddr pointer, bool copy) override {
+			// Pages in the private copy count towards our RSS.
+			auto numCopied = space_->pageSpace_.detachSharedTable(pointer, copy);
+			rss_.fetch_add(numCopied * kPageSize, std::memory_order_relaxed);
+		}
+
+		size_t getRss() override {
+			return rss_.load(std::memory_order_relaxed);
+		}
+
 	private:
 		AddressSpace *space_;
+		std::atomic<size_t> rss_{0};
 	};
 
 public:
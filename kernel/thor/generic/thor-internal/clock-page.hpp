@@ -0,0 +1,18 @@
+#pragma once
+
+#include <thor-internal/memory-view.hpp>
+
+namespace thor {
+
+// Publishes the parameters that userspace needs to compute the value of
+// systemClockSource()->currentNanos() from the raw counter, i.e.,
+// refNanos + (((counter - refCounter) * mult) >> shift).
+// Must only be called if userspace can read the same counter (e.g., an invariant TSC).
+void publishClockPageCounter(uint64_t mult, uint32_t shift,
+		uint64_t refCounter, uint64_t refNanos);
+
+// Returns the memory object that contains the HelClockPage.
+// Userspace must only map it read-only.
+smarter::shared_ptr<MemoryView> getClockPageMemory();
+
+} // namespace thor
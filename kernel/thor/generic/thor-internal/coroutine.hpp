@@ -2,6 +2,7 @@
 
 #include <async/basic.hpp>
 #include <thor-internal/debug.hpp>
+#include <thor-internal/kernel_heap.hpp>
 
 template<typename T>
 struct coroutine_continuation {
@@ -57,11 +58,11 @@ struct coroutine {
 		friend struct coroutine_operation;
 
 		void *operator new(size_t size) {
-			return thor::kernelAlloc->allocate(size);
+			return thor::allocateCoroutineFrame(size, __builtin_return_address(0));
 		}
 
 		void operator delete(void *p, size_t size) {
-			return thor::kernelAlloc->deallocate(p, size);
+			return thor::freeCoroutineFrame(p, size);
 		}
 
 		coroutine get_return_object() {
@@ -174,11 +175,11 @@ struct coroutine<void> {
 		friend struct coroutine_operation;
 
 		void *operator new(size_t size) {
-			return thor::kernelAlloc->allocate(size);
+			return thor::allocateCoroutineFrame(size, __builtin_return_address(0));
 		}
 
 		void operator delete(void *p, size_t size) {
-			return thor::kernelAlloc->deallocate(p, size);
+			return thor::freeCoroutineFrame(p, size);
 		}
 
 		coroutine get_return_object() {
@@ -365,11 +366,11 @@ struct enable_detached_coroutine { };
 
 struct detached_coroutine_promise {
 	void *operator new(size_t size) {
-		return thor::kernelAlloc->allocate(size);
+		return thor::allocateCoroutineFrame(size, __builtin_return_address(0));
 	}
 
 	void operator delete(void *p, size_t size) {
-		return thor::kernelAlloc->deallocate(p, size);
+		return thor::freeCoroutineFrame(p, size);
 	}
 
 	void get_return_object() {
@@ -1,14 +1,20 @@
 #pragma once
 
 #include <thor-internal/arch/cpu.hpp>
+#include <thor-internal/arch/system.hpp>
 #include <thor-internal/executor-context.hpp>
 #include <thor-internal/kernel-locks.hpp>
+#include <thor-internal/kernel_heap.hpp>
+#include <thor-internal/physical.hpp>
 #include <thor-internal/schedule.hpp>
+#include <thor-internal/timer.hpp>
 
 namespace thor {
 
 // Forward defined for pointers that are part of CpuData.
 struct KernelFiber;
+struct LogRing;
+struct OsTraceRing;
 struct SingleContextRecordRing;
 struct WorkQueue;
 
@@ -32,6 +38,7 @@ struct CpuData : public PlatformCpuData {
 	bool haveVirtualization;
 
 	int cpuIndex;
+	int numaNode = 0;
 
 	ExecutorContext *executorContext = nullptr;
 	KernelFiber *activeFiber;
@@ -39,10 +46,35 @@ struct CpuData : public PlatformCpuData {
 	smarter::shared_ptr<WorkQueue> generalWorkQueue;
 	std::atomic<uint64_t> heartbeat;
 
+	PhysicalMagazine physicalMagazine;
+	SlabMagazine slabMagazine;
+	CoroutineFrameCache coroutineFrameCache;
+	KernelStackCache kernelStackCache;
+	TimerWheel timerWheel;
+
+	// See rcu.cpp.
+	unsigned int rcuNesting = 0;
+	std::atomic<uint64_t> rcuSeq{0};
+
 	unsigned int irqEntropySeq = 0;
+	// Frame that the RX classification kernlet on this CPU inspects; see kernlet.cpp.
+	const void *kernletPacket = nullptr;
+	// Number of IRQs per slot that were handled on this CPU. Only written by this CPU.
+	std::atomic<uint64_t> irqCounts[numIrqSlots]{};
+	// Number of ping (i.e., reschedule) and TLB shootdown IPIs that this CPU received.
+	// Only written by this CPU.
+	std::atomic<uint64_t> numPingIpis{0};
+	std::atomic<uint64_t> numShootdownIpis{0};
 	std::atomic<ProfileMechanism> profileMechanism{};
 	// TODO: This should be a unique_ptr instead.
 	SingleContextRecordRing *localProfileRing = nullptr;
+	// IDs of the thread that was last invoked on this CPU; attached to profiling samples.
+	uint64_t profileThreadId = 0;
+	uint64_t profileUniverseId = 0;
+	// Allocated on the first emitOsTrace() on this CPU; see ostrace.cpp.
+	OsTraceRing *osTraceRing = nullptr;
+	// Allocated by the log drain fiber; see debug.cpp.
+	std::atomic<LogRing *> logRing{nullptr};
 };
 
 CpuData *getCpuData(size_t k);
@@ -124,7 +124,22 @@ public:
 		return post(std::move(stack), frame, target);
 	}
 
+	// Like run() but the fiber runs on the given scheduler (i.e., on another CPU).
+	template<typename F>
+	static void runOn(Scheduler *scheduler, F functor) {
+		auto frame = [] (void *argument) {
+			auto object = reinterpret_cast<F *>(argument);
+			(*object)();
+			exitCurrent();
+		};
+		auto stack = UniqueKernelStack::make();
+		auto target = stack.embed<F>(functor);
+		runOn(scheduler, std::move(stack), frame, target);
+	}
+
 	static void run(UniqueKernelStack stack, void (*function)(void *), void *argument);
+	static void runOn(Scheduler *scheduler, UniqueKernelStack stack,
+			void (*function)(void *), void *argument);
 	static KernelFiber *post(UniqueKernelStack stack, void (*function)(void *), void *argument);
 
 	explicit KernelFiber(UniqueKernelStack stack, AbiParameters abi);
@@ -54,12 +54,14 @@ concept Futex = requires(F f) {
 
 struct FutexRealm {
 private:
+	struct Bucket;
+
 	// Represents a single waiter.
 	struct Node {
 		friend struct FutexRealm;
 
 		Node(FutexRealm *realm, FutexIdentity id)
-		: realm_{realm}, id_{id}, cobs_{this} { }
+		: realm_{realm}, id_{id}, bucket_{realm->_getBucket(id)}, cobs_{this} { }
 
 	protected:
 		virtual void complete() = 0;
@@ -70,10 +72,10 @@ private:
 		void cancel_() {
 			{
 				auto irqLock = frg::guard(&irqMutex());
-				auto lock = frg::guard(&realm_->_mutex);
+				auto bucket = lockBucket_();
 
 				if(!result_) {
-					auto sit = realm_->_slots.get(id_);
+					auto sit = bucket->slots.get(id_);
 					// Invariant: If the slot exists then its queue is not empty.
 					assert(!sit->queue.empty());
 
@@ -82,17 +84,36 @@ private:
 					result_ = Error::cancelled;
 
 					if(sit->queue.empty())
-						realm_->_slots.remove(id_);
+						bucket->slots.remove(id_);
 				}else{
 					assert(!queueHook_.in_list);
 				}
+
+				bucket->mutex.unlock();
 			}
 
 			complete();
 		}
 
+		// requeue() can move the node to another bucket while we wait for the lock.
+		// Hence, re-check the bucket after locking. Returns the locked bucket.
+		Bucket *lockBucket_() {
+			auto bucket = bucket_.load(std::memory_order_relaxed);
+			while(true) {
+				bucket->mutex.lock();
+				auto current = bucket_.load(std::memory_order_relaxed);
+				if(current == bucket)
+					return bucket;
+				bucket->mutex.unlock();
+				bucket = current;
+			}
+		}
+
 		FutexRealm *realm_;
+		// id_ and bucket_ are only changed by requeue() while holding the locks of both
+		// the old and the new bucket.
 		FutexIdentity id_;
+		std::atomic<Bucket *> bucket_;
 		frg::optional<Error> result_; // Set after completion.
 		async::cancellation_observer<frg::bound_mem_fn<&Node::cancel_>> cobs_;
 		frg::default_list_hook<Node> queueHook_;
@@ -109,12 +130,45 @@ private:
 		> queue;
 	};
 
+	using Mutex = TrackedSpinlock<LockClass::futexRealm>;
+
+	// Each bucket protects a disjoint subset of futexes (determined by their hash).
+	// Buckets are cache-line aligned to avoid false sharing between their locks.
+	struct alignas(64) Bucket {
+		Bucket()
+		: slots{FutexIdentity::Hash{}, *kernelAlloc} { }
+
+		Mutex mutex;
+
+		frg::hash_map<
+			FutexIdentity,
+			Slot,
+			FutexIdentity::Hash,
+			KernelAlloc
+		> slots;
+	};
+
+	static constexpr size_t numBuckets = 32;
+
+	Bucket *_getBucket(FutexIdentity id) {
+		// The hash_map inside the bucket uses the low bits of the same hash,
+		// hence we select the bucket based on the high bits.
+		auto h = FutexIdentity::Hash{}(id);
+		return &_buckets[(h >> 32) % numBuckets];
+	}
+
 public:
-	FutexRealm()
-	: _slots{FutexIdentity::Hash{}, *kernelAlloc} { }
+	FutexRealm() = default;
 
 	bool empty() {
-		return _slots.empty();
+		for(size_t i = 0; i < numBuckets; i++) {
+			auto irqLock = frg::guard(&irqMutex());
+			auto lock = frg::guard(&_buckets[i].mutex);
+
+			if(!_buckets[i].slots.empty())
+				return false;
+		}
+		return true;
 	}
 
 	// ----------------------------------------------------------------------------------
@@ -139,8 +193,10 @@ public:
 			F f = std::move(f_);
 
 			auto fastPath = [&] {
+				// The node is not visible to requeue() yet, hence bucket_ cannot change.
+				auto bucket = bucket_.load(std::memory_order_relaxed);
 				auto irqLock = frg::guard(&irqMutex());
-				auto lock = frg::guard(&realm_->_mutex);
+				auto lock = frg::guard(&bucket->mutex);
 
 				if(f.read() != expected_) {
 					result_ = Error::futexRace;
@@ -152,10 +208,10 @@ public:
 					return true;
 				}
 
-				auto sit = realm_->_slots.get(id_);
+				auto sit = bucket->slots.get(id_);
 				if(!sit) {
-					realm_->_slots.insert(id_, Slot());
-					sit = realm_->_slots.get(id_);
+					bucket->slots.insert(id_, Slot());
+					sit = bucket->slots.get(id_);
 				}
 
 				assert(!queueHook_.in_list);
@@ -210,60 +266,178 @@ public:
 
 	// ----------------------------------------------------------------------------------
 
-	void wake(FutexIdentity id) {
-		frg::intrusive_list<
-			Node,
-			frg::locate_member<
-				Node,
-				frg::default_list_hook<Node>,
-				&Node::queueHook_
-			>
-		> pending;
+	// Wakes up to count waiters of the futex (in FIFO order).
+	// Returns the number of waiters that were woken.
+	size_t wake(FutexIdentity id, size_t count = static_cast<size_t>(-1)) {
+		NodeList pending;
+		size_t numWoken;
 		{
+			auto bucket = _getBucket(id);
 			auto irqLock = frg::guard(&irqMutex());
-			auto lock = frg::guard(&_mutex);
-
-			auto sit = _slots.get(id);
-			if(!sit)
-				return;
-			// Invariant: If the slot exists then its queue is not empty.
-			assert(!sit->queue.empty());
-
-			// TODO: Enable users to only wake a certain number of waiters.
-			while(!sit->queue.empty()) {
-				auto node = sit->queue.front();
-				assert(!node->result_);
-				sit->queue.pop_front();
-
-				if(node->cobs_.try_reset()) {
-					node->result_ = Error::success;
-					pending.push_back(node);
+			auto lock = frg::guard(&bucket->mutex);
+
+			numWoken = _dequeueWaiters(bucket, id, count, pending);
+		}
+
+		_completeWaiters(pending);
+		return numWoken;
+	}
+
+	// Wakes up to wakeCount waiters of the futex and moves up to requeueCount of the
+	// remaining waiters to the target futex (both in FIFO order), without waking them.
+	// Fails with Error::futexRace if the futex does not match expected.
+	// Returns the number of waiters that were woken or moved.
+	template<Futex F>
+	frg::expected<Error, size_t> requeue(F f, unsigned int expected, size_t wakeCount,
+			FutexIdentity target, size_t requeueCount) {
+		auto id = f.getIdentity();
+		NodeList pending;
+		size_t numWoken = 0;
+		size_t numMoved = 0;
+		bool race = false;
+		{
+			auto bucket = _getBucket(id);
+			auto targetBucket = _getBucket(target);
+			auto irqLock = frg::guard(&irqMutex());
+			_lockBuckets(bucket, targetBucket);
+
+			if(f.read() != expected) {
+				race = true;
+			}else{
+				numWoken = _dequeueWaiters(bucket, id, wakeCount, pending);
+
+				if(auto sit = bucket->slots.get(id); sit && id != target) {
+					auto tit = targetBucket->slots.get(target);
+					if(!tit) {
+						targetBucket->slots.insert(target, Slot());
+						tit = targetBucket->slots.get(target);
+						// Inserting into targetBucket cannot invalidate sit if the buckets differ,
+						// but it can if they are the same.
+						sit = bucket->slots.get(id);
+					}
+
+					while(!sit->queue.empty() && numMoved < requeueCount) {
+						auto node = sit->queue.pop_front();
+						assert(!node->result_);
+						node->id_ = target;
+						node->bucket_.store(targetBucket, std::memory_order_relaxed);
+						tit->queue.push_back(node);
+						numMoved++;
+					}
+
+					if(sit->queue.empty())
+						bucket->slots.remove(id);
+					// Re-lookup since removing from the same bucket can invalidate tit.
+					tit = targetBucket->slots.get(target);
+					if(tit->queue.empty())
+						targetBucket->slots.remove(target);
 				}
 			}
 
-			if(sit->queue.empty())
-				_slots.remove(id);
+			_unlockBuckets(bucket, targetBucket);
+		}
+
+		f.retire();
+		_completeWaiters(pending);
+		if(race)
+			return Error::futexRace;
+		return numWoken + numMoved;
+	}
+
+	// Atomically applies op to the target futex (op receives the futex and returns true
+	// if waiters of the target should be woken), wakes up to count waiters of the futex
+	// and, depending on the result of op, up to targetCount waiters of the target.
+	// Returns the number of waiters that were woken.
+	template<Futex F, typename Op>
+	size_t wakeOp(FutexIdentity id, size_t count, F target, size_t targetCount, Op op) {
+		auto targetId = target.getIdentity();
+		NodeList pending;
+		size_t numWoken = 0;
+		{
+			auto bucket = _getBucket(id);
+			auto targetBucket = _getBucket(targetId);
+			auto irqLock = frg::guard(&irqMutex());
+			_lockBuckets(bucket, targetBucket);
+
+			bool wakeTarget = op(target);
+			numWoken += _dequeueWaiters(bucket, id, count, pending);
+			if(wakeTarget)
+				numWoken += _dequeueWaiters(targetBucket, targetId, targetCount, pending);
+
+			_unlockBuckets(bucket, targetBucket);
+		}
+
+		target.retire();
+		_completeWaiters(pending);
+		return numWoken;
+	}
+
+private:
+	using NodeList = frg::intrusive_list<
+		Node,
+		frg::locate_member<
+			Node,
+			frg::default_list_hook<Node>,
+			&Node::queueHook_
+		>
+	>;
+
+	// Locks two (possibly identical) buckets in address order to avoid deadlocks.
+	void _lockBuckets(Bucket *a, Bucket *b) {
+		if(a == b) {
+			a->mutex.lock();
+		}else if(a < b) {
+			a->mutex.lock();
+			b->mutex.lock();
+		}else{
+			b->mutex.lock();
+			a->mutex.lock();
+		}
+	}
+
+	void _unlockBuckets(Bucket *a, Bucket *b) {
+		a->mutex.unlock();
+		if(a != b)
+			b->mutex.unlock();
+	}
+
+	// Removes up to count waiters of the futex from the bucket and moves them to pending.
+	// Must be called with the bucket's mutex held.
+	size_t _dequeueWaiters(Bucket *bucket, FutexIdentity id, size_t count, NodeList &pending) {
+		auto sit = bucket->slots.get(id);
+		if(!sit)
+			return 0;
+		// Invariant: If the slot exists then its queue is not empty.
+		assert(!sit->queue.empty());
+
+		size_t numWoken = 0;
+		while(!sit->queue.empty() && numWoken < count) {
+			auto node = sit->queue.front();
+			assert(!node->result_);
+			sit->queue.pop_front();
+
+			// Nodes that are concurrently cancelled do not count towards the limit.
+			if(node->cobs_.try_reset()) {
+				node->result_ = Error::success;
+				pending.push_back(node);
+				numWoken++;
+			}
 		}
 
+		if(sit->queue.empty())
+			bucket->slots.remove(id);
+		return numWoken;
+	}
+
+	// Must be called without holding any bucket mutex.
+	void _completeWaiters(NodeList &pending) {
 		while(!pending.empty()) {
 			auto node = pending.pop_front();
 			node->complete();
 		}
 	}
 
-private:
-	using Mutex = frg::ticket_spinlock;
-
-	// TODO: use a scalable hash table with fine-grained locks to
-	// improve the scalability of the futex algorithm.
-	Mutex _mutex;
-
-	frg::hash_map<
-		FutexIdentity,
-		Slot,
-		FutexIdentity::Hash,
-		KernelAlloc
-	> _slots;
+	Bucket _buckets[numBuckets];
 };
 
 } // namespace thor
@@ -6,9 +6,15 @@
 #include <assert.h>
 
 namespace thor {
+
+// Defined by the architecture code. Usable before any clock source is set up.
+uint64_t getRawTimestampCounter();
+
 namespace initgraph {
 
 inline constexpr bool printDotAnnotations = false;
+// Print start and end timestamps (in raw timestamp counter ticks) of each node.
+inline constexpr bool printTraceAnnotations = false;
 
 struct Node;
 struct Edge;
@@ -92,6 +98,15 @@ private:
 	bool wanted_ = false;
 
 	unsigned int nUnsatisfied = 0;
+
+	// Timestamps around activate(), in raw timestamp counter ticks.
+	uint64_t startTs_ = 0;
+	uint64_t endTs_ = 0;
+
+	// Predecessor that finished last, i.e., the one that made this node runnable.
+	// Following these pointers from the last node yields the critical path.
+	Node *criticalPred_ = nullptr;
+	Node *criticalSucc_ = nullptr;
 };
 
 struct Engine {
@@ -144,6 +159,9 @@ struct Engine {
 				pending_.push_back(node);
 		}
 
+		// Node that finished last during this call.
+		Node *last = nullptr;
+
 		// Now, run pending nodes until no such nodes remain.
 		while(!pending_.empty()) {
 			auto current = pending_.pop_front();
@@ -154,9 +172,19 @@ struct Engine {
 				infoLogger() << "thor: Running task " << current->displayName_
 						<< frg::endlog;
 
+			current->startTs_ = getRawTimestampCounter();
 			current->activate();
+			current->endTs_ = getRawTimestampCounter();
 			current->done_ = true;
 
+			if(printTraceAnnotations)
+				infoLogger() << "thor, initgraph.trace: n" << current
+						<< " \"" << current->displayName_ << "\" "
+						<< current->startTs_ << " " << current->endTs_ << frg::endlog;
+
+			if(!last || current->endTs_ >= last->endTs_)
+				last = current;
+
 			if(current->type_ == NodeType::stage)
 				infoLogger() << "thor: Reached stage " << current->displayName_
 						<< frg::endlog;
@@ -166,6 +194,7 @@ struct Engine {
 
 				assert(successor->nUnsatisfied);
 				--successor->nUnsatisfied;
+				successor->criticalPred_ = current;
 				if(successor->wanted_ && !successor->done_ && !successor->nUnsatisfied)
 					pending_.push_back(successor);
 			}
@@ -186,9 +215,34 @@ struct Engine {
 		if(nUnreached)
 			panicLogger() << "thor: There are " << nUnreached << " initialization nodes"
 					" that could not be reached (circular dependencies?)" << frg::endlog;
+
+		if(last)
+			dumpCriticalPath_(last);
 	}
 
 private:
+	// Prints the chain of nodes that finished last before the given node.
+	// Since nodes run one after another, the chain consists of the nodes whose latency
+	// directly delays the given node; all other nodes could overlap with the chain.
+	void dumpCriticalPath_(Node *last) {
+		// Reverse the chain such that we can print it in execution order.
+		Node *first = last;
+		last->criticalSucc_ = nullptr;
+		while(first->criticalPred_) {
+			first->criticalPred_->criticalSucc_ = first;
+			first = first->criticalPred_;
+		}
+
+		infoLogger() << "thor: Critical path to " << last->displayName_
+				<< " (" << (last->endTs_ - first->startTs_) << " ticks):" << frg::endlog;
+		for(auto node = first; node; node = node->criticalSucc_) {
+			if(node->type_ != NodeType::task)
+				continue;
+			infoLogger() << "thor:     " << node->displayName_
+					<< ": " << (node->endTs_ - node->startTs_) << " ticks" << frg::endlog;
+		}
+	}
+
 	frg::intrusive_list<
 		Node,
 		frg::locate_member<
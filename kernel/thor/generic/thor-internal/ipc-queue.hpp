@@ -109,6 +109,12 @@ public:
 
 	void submit(IpcNode *node);
 
+	// Memory for the closures of asynchronous operations that complete on this queue
+	// (see helSubmitAsync()). Freed blocks are cached, such that steady-state IPC
+	// reuses the same blocks instead of going through the kernel heap.
+	void *allocateClosure(size_t size);
+	void freeClosure(void *pointer, size_t size);
+
 	// ----------------------------------------------------------------------------------
 	// Sender boilerplate for submit()
 	// ----------------------------------------------------------------------------------
@@ -195,6 +201,23 @@ private:
 	// Stores whether any nodes are in the queue.
 	// Written only when _mutex is held (but read outside of _mutex).
 	std::atomic<bool> _anyNodes;
+
+	// Nodes that were taken from _nodeQueue but that are not emitted yet.
+	// Only accessed by _runQueue(), hence not protected by _mutex.
+	NodeList _stagedNodes;
+
+	static constexpr size_t numCachedClosures = 8;
+
+	struct CachedClosure {
+		void *pointer;
+		size_t size;
+	};
+
+	// Protects the closure cache.
+	Mutex _closureMutex;
+
+	CachedClosure _closureCache[numCachedClosures];
+	size_t _numCachedClosures = 0;
 };
 
 } // namespace thor
@@ -95,6 +95,16 @@ enum class IrqStatus {
 	nacked
 };
 
+// Hints that sinks pass along with an ACK to control polled mode (see IrqPin).
+enum class IrqPollHint {
+	// The sink did not find work or it does not support polled mode.
+	none,
+	// The sink found work and it can be polled instead of waiting for the next IRQ.
+	poll,
+	// Like poll, but the sink exhausted its budget; poll again without delay.
+	pollNow
+};
+
 struct IrqSink {
 	friend struct IrqPin;
 
@@ -138,6 +148,7 @@ private:
 private:
 	uint64_t _currentSequence;
 	IrqStatus _status = IrqStatus::standBy;
+	IrqPollHint _pollHint = IrqPollHint::none;
 };
 
 enum class IrqStrategy {
@@ -148,15 +159,22 @@ enum class IrqStrategy {
 
 // Represents a (not necessarily physical) "pin" of an interrupt controller.
 // This class handles the IRQ configuration and acknowledgement.
+//
+// If IRQs are raised at a high rate and all sinks support it, the pin switches to
+// polled mode: after the sinks ACK, the pin stays masked and the sinks are raised again
+// from a timer (or immediately if a sink exhausted its budget). The pin returns to
+// interrupt mode once a poll does not find any work.
 struct IrqPin {
 private:
 	static constexpr int maskedForService = 1;
 	static constexpr int maskedWhileBuffered = 2;
 	static constexpr int maskedForNack = 4;
+	static constexpr int maskedForPoll = 8;
 
 public:
 	static void attachSink(IrqPin *pin, IrqSink *sink);
-	static Error ackSink(IrqSink *sink, uint64_t sequence);
+	static Error ackSink(IrqSink *sink, uint64_t sequence,
+			IrqPollHint hint = IrqPollHint::none);
 	static Error nackSink(IrqSink *sink, uint64_t sequence);
 	static Error kickSink(IrqSink *sink, bool wantClear);
 
@@ -181,12 +199,20 @@ private:
 	void _nack();
 	void _kick(bool doClear);
 	void _dispatch();
+	void _updatePoll();
 
 public:
 	void warnIfPending();
 
 	virtual void dumpHardwareState();
 
+	// Index of the CPU that this IRQ is delivered to; -1 if there is no fixed CPU.
+	virtual int affinity();
+
+	// Changes the CPU that this IRQ is delivered to.
+	// Returns Error::noHardwareSupport if this pin cannot be retargeted.
+	virtual Error setAffinity(int cpu);
+
 protected:
 	virtual IrqStrategy program(TriggerMode mode, Polarity polarity) = 0;
 
@@ -199,7 +225,7 @@ protected:
 	~IrqPin() = default;
 
 private:
-	void _doService();
+	void _doService(bool isPoll = false);
 	void _updateMask();
 
 	frg::string<KernelAlloc> _name;
@@ -232,6 +258,20 @@ private:
 	int _unstallExponent = 0;
 	async::recurring_event _unstallEvent;
 
+	// Number of raises since _rateWindowStart; used to decide whether to enter polled mode.
+	uint64_t _rateWindowStart = 0;
+	unsigned int _rateCount = 0;
+
+	// State of polled mode.
+	bool _pollMode = false;
+	// Whether the current service was started by the poll timer (and not by hardware).
+	bool _pollService = false;
+	// Whether the next poll should happen without delay.
+	bool _pollNow = false;
+	// Whether the hardware raised the IRQ while it was masked for polling.
+	bool _pollAbsorbed = false;
+	async::recurring_event _pollEvent;
+
 	// TODO: This list should change rarely. Use a RCU list.
 	frg::intrusive_list<
 		IrqSink,
@@ -243,6 +283,21 @@ private:
 	> _sinkList;
 };
 
+struct MsiPin;
+
+// Implemented by devices that own an MsiPin (e.g., PCI devices).
+struct MsiOwner {
+	// Writes the MSI's message address and data to the device.
+	virtual void programMsi(MsiPin *msi, size_t index) = 0;
+
+	// Masks or unmasks the MSI at the device. Returns false if the device
+	// does not support per-vector masking.
+	virtual bool maskMsi(size_t index, bool masked) = 0;
+
+protected:
+	~MsiOwner() = default;
+};
+
 struct MsiPin : IrqPin {
 	MsiPin(frg::string<KernelAlloc> name)
 	: IrqPin{std::move(name)} { }
@@ -250,8 +305,31 @@ struct MsiPin : IrqPin {
 	virtual uint64_t getMessageAddress() = 0;
 	virtual uint32_t getMessageData() = 0;
 
+	// Sets the device that needs to be reprogrammed when the message changes.
+	void setOwner(MsiOwner *owner, size_t index) {
+		_owner = owner;
+		_ownerIndex = index;
+	}
+
 protected:
 	~MsiPin() = default;
+
+	// Called by implementations after the message address or data changed.
+	void reprogramOwner() {
+		if(_owner)
+			_owner->programMsi(this, _ownerIndex);
+	}
+
+	// Can be used by implementations of mask() and unmask().
+	bool maskAtOwner(bool masked) {
+		if(!_owner)
+			return false;
+		return _owner->maskMsi(_ownerIndex, masked);
+	}
+
+private:
+	MsiOwner *_owner = nullptr;
+	size_t _ownerIndex = 0;
 };
 
 // ----------------------------------------------------------------------------
@@ -262,6 +340,10 @@ struct IrqObject : IrqSink {
 
 	void automate(smarter::shared_ptr<BoundKernlet> kernlet);
 
+	// Classifiers run before the waiters are woken up; see helClassifyIrqRx().
+	// Returns false if the IRQ is automated.
+	bool addRxClassifier(smarter::shared_ptr<RxClassifier> classifier);
+
 	IrqStatus raise() override;
 
 	void submitAwait(AwaitIrqNode *node, uint64_t sequence);
@@ -321,6 +403,9 @@ struct IrqObject : IrqSink {
 private:
 	smarter::shared_ptr<BoundKernlet> _automationKernlet;
 
+	// Protected by the sinkMutex.
+	frg::vector<smarter::shared_ptr<RxClassifier>, KernelAlloc> _rxClassifiers{*kernelAlloc};
+
 	// Protected by the sinkMutex.
 	frg::intrusive_list<
 		AwaitIrqNode,
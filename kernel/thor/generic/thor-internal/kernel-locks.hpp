@@ -7,6 +7,92 @@
 
 namespace thor {
 
+#ifdef THOR_LOCK_STATS
+inline constexpr bool lockStatsEnabled = true;
+#else
+inline constexpr bool lockStatsEnabled = false;
+#endif
+
+// Classes of locks for which TrackedSpinlock collects statistics.
+enum class LockClass {
+	universe,
+	futexRealm,
+	scheduler,
+	physicalAllocator,
+	irqSpinlock,
+	numClasses
+};
+
+inline constexpr int numLockClasses = static_cast<int>(LockClass::numClasses);
+
+struct LockStats {
+	struct Site {
+		std::atomic<uintptr_t> ip{0};
+		std::atomic<uint64_t> numContended{0};
+	};
+
+	// Contended call sites are stored in a small direct-mapped table.
+	// On collisions, the older site is evicted.
+	static constexpr int numSites = 8;
+
+	std::atomic<uint64_t> numAcquired{0};
+	std::atomic<uint64_t> numContended{0};
+	// Spin time is measured in units of getRawTimestampCounter().
+	std::atomic<uint64_t> totalSpin{0};
+	std::atomic<uint64_t> maxSpin{0};
+	Site sites[numSites];
+};
+
+extern LockStats globalLockStats[numLockClasses];
+
+inline LockStats *getLockStats(LockClass cls) {
+	return &globalLockStats[static_cast<int>(cls)];
+}
+
+const char *lockClassName(LockClass cls);
+
+// Slow path of TrackedSpinlock::lock(). Spins until ticket is served.
+// If site is zero, the caller of this function is recorded as the call site.
+void spinOnTicket(std::atomic<uint32_t> *servingTicket, uint32_t ticket,
+		LockStats *stats, uintptr_t site);
+
+// Ticket spinlock that collects per-LockClass contention statistics
+// if the kernel is built with THOR_LOCK_STATS.
+// Otherwise, it behaves exactly like frg::ticket_spinlock.
+template<LockClass C>
+struct TrackedSpinlock {
+	constexpr TrackedSpinlock() = default;
+
+	TrackedSpinlock(const TrackedSpinlock &) = delete;
+
+	TrackedSpinlock &operator= (const TrackedSpinlock &) = delete;
+
+	// Wrappers that are not inlined into their callers (e.g., IrqSpinlock)
+	// pass their own return address as site.
+	void lock(uintptr_t site = 0) {
+		auto ticket = _nextTicket.fetch_add(1, std::memory_order_relaxed);
+		if(_servingTicket.load(std::memory_order_acquire) != ticket) [[unlikely]]
+			spinOnTicket(&_servingTicket, ticket,
+					lockStatsEnabled ? getLockStats(C) : nullptr, site);
+		if constexpr (lockStatsEnabled)
+			getLockStats(C)->numAcquired.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void unlock() {
+		auto current = _servingTicket.load(std::memory_order_relaxed);
+		_servingTicket.store(current + 1, std::memory_order_release);
+	}
+
+	bool is_locked() {
+		return _servingTicket.load(std::memory_order_relaxed)
+				!= _nextTicket.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint32_t> _servingTicket{0};
+	std::atomic<uint32_t> _nextTicket{0};
+};
+
 struct IrqMutex {
 private:
 	static constexpr unsigned int enableBit = 0x8000'0000;
@@ -10,6 +10,25 @@ struct StackBase {
 	void *sp;
 };
 
+// Per-CPU cache of kernel stacks that are still mapped (including their guard page).
+// UniqueKernelStack::make() takes stacks from this cache before allocating new ones.
+struct KernelStackCache {
+	static constexpr size_t capacity = 16;
+
+	char *stacks[capacity];
+	size_t numStacks = 0;
+};
+
+struct KernelStackStats {
+	// Number of stacks that were mapped and unmapped.
+	uint64_t numMapped;
+	uint64_t numUnmapped;
+	// Number of stacks that were served from a per-CPU cache.
+	uint64_t numReused;
+};
+
+KernelStackStats getKernelStackStats();
+
 struct UniqueKernelStack {
 	static constexpr size_t kSize = 0xF000;
 
@@ -1,11 +1,13 @@
 #pragma once
 
 #include <assert.h>
+#include <atomic>
 #include <frg/slab.hpp>
 #include <frg/spinlock.hpp>
 #include <frg/manual_box.hpp>
 #include <physical-buddy.hpp>
 #include <thor-internal/arch/stack.hpp>
+#include <thor-internal/kernel-locks.hpp>
 
 namespace thor {
 
@@ -16,7 +18,7 @@ struct IrqSpinlock {
 	void unlock();
 
 private:
-	frg::ticket_spinlock _spinlock;
+	TrackedSpinlock<LockClass::irqSpinlock> _spinlock;
 };
 
 struct KernelVirtualMemory {
@@ -66,16 +68,91 @@ public:
 	void output_trace(void *buffer, size_t size);
 };
 
-using KernelAlloc = frg::slab_allocator<KernelVirtualAlloc, IrqSpinlock>;
+using KernelSlabPool = frg::slab_pool<KernelVirtualAlloc, IrqSpinlock>;
+
+// Per-CPU cache of slab objects for small size classes.
+// Avoids taking the slab pool's global lock on most allocations.
+struct SlabMagazine {
+	static constexpr int minShift = 5;
+	static constexpr int numClasses = 6; // Size classes from 32 bytes up to 1 KiB.
+	static constexpr size_t capacity = 32;
+	static constexpr size_t batchSize = 16;
+
+	static constexpr size_t classSize(int sizeClass) {
+		return size_t{1} << (minShift + sizeClass);
+	}
+
+	void *objects[numClasses][capacity];
+	size_t numObjects[numClasses] = {};
+
+	// Written only by the owning CPU; read by getKernelHeapClassStats().
+	std::atomic<uint64_t> numHits[numClasses] = {};
+	std::atomic<uint64_t> numMisses[numClasses] = {};
+};
+
+struct KernelHeapClassStats {
+	size_t size;
+	uint64_t numHits;
+	uint64_t numMisses;
+};
+
+// Sums up the SlabMagazine statistics of all CPUs.
+KernelHeapClassStats getKernelHeapClassStats(int sizeClass);
+
+// Per-CPU cache of coroutine frames, see coroutine.hpp.
+// Async paths (e.g., page faults and IPC) allocate a frame for each coroutine call;
+// keeping the frames in their own cache prevents other small objects from evicting them
+// and also covers frames that are too large for the SlabMagazine.
+struct CoroutineFrameCache {
+	static constexpr int minShift = 7;
+	static constexpr int numClasses = 6; // Size classes from 128 bytes up to 4 KiB.
+	static constexpr size_t capacity = 8;
+
+	static constexpr size_t classSize(int sizeClass) {
+		return size_t{1} << (minShift + sizeClass);
+	}
+
+	void *frames[numClasses][capacity];
+	size_t numFrames[numClasses] = {};
+
+	// Written only by the owning CPU; read by getCoroutineFrameClassStats().
+	std::atomic<uint64_t> numHits[numClasses] = {};
+	std::atomic<uint64_t> numMisses[numClasses] = {};
+};
+
+// Sums up the CoroutineFrameCache statistics of all CPUs.
+KernelHeapClassStats getCoroutineFrameClassStats(int sizeClass);
+
+// Size of the largest coroutine frame that was allocated so far.
+size_t getLargestCoroutineFrame();
+
+// Allocation functions of coroutine promises. callSite is only used for diagnostics.
+void *allocateCoroutineFrame(size_t size, void *callSite);
+void freeCoroutineFrame(void *pointer, size_t size);
+
+// Allocator that is used for (almost) all kernel allocations.
+// Small allocations are served from the current CPU's SlabMagazine;
+// everything else goes directly to the slab pool.
+class KernelAlloc {
+public:
+	KernelAlloc(KernelSlabPool *pool)
+	: _pool{pool} { }
+
+	void *allocate(size_t size);
+	void *reallocate(void *pointer, size_t size);
+	void free(void *pointer);
+	void deallocate(void *pointer, size_t size);
+
+private:
+	void _refillMagazine(SlabMagazine *magazine, int sizeClass);
+	void _drainMagazine(SlabMagazine *magazine, int sizeClass, size_t n);
+
+	KernelSlabPool *_pool;
+};
 
 extern constinit frg::manual_box<KernelVirtualAlloc> kernelVirtualAlloc;
 
-extern constinit frg::manual_box<
-	frg::slab_pool<
-		KernelVirtualAlloc,
-		IrqSpinlock
-	>
-> kernelHeap;
+extern constinit frg::manual_box<KernelSlabPool> kernelHeap;
 
 extern constinit frg::manual_box<KernelAlloc> kernelAlloc;
 
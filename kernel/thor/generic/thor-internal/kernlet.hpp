@@ -54,11 +54,55 @@ struct BoundKernlet {
 
 	int invokeIrqAutomation();
 
+	// Invokes the kernlet with the first available bytes of a frame of the given length.
+	// The frame is accessible through the __packet_* intrinsics. Must be called with IRQs disabled.
+	int invokeRxClassification(const void *frame, size_t available, size_t length);
+
 private:
 	smarter::shared_ptr<KernletObject> _object;
 	char *_instance;
 };
 
+// Classifies the frames that a NIC returns on a split virtq, see helClassifyIrqRx().
+// classify() runs in IRQ context when the IRQ that signals progress of the virtq
+// is raised, i.e., before the driver is woken up.
+struct RxClassifier {
+	enum class Outcome {
+		// The device did not return new buffers.
+		idle,
+		// All new frames were dropped; the driver does not need to run.
+		suppress,
+		wake
+	};
+
+	RxClassifier(smarter::shared_ptr<BoundKernlet> kernlet, char *window,
+			size_t numDescriptors, size_t tableOffset, size_t usedOffset,
+			size_t verdictOffset, size_t headerSize, unsigned int wakeThreshold,
+			uint16_t *eventIndex);
+
+	// Classifies all buffers that the device returned since the last call.
+	Outcome classify();
+
+private:
+	int classifyFrame_(uint32_t id, uint32_t written);
+
+	smarter::shared_ptr<BoundKernlet> _kernlet;
+	char *_window;
+	size_t _numDescriptors;
+	size_t _tableOffset;
+	size_t _usedOffset;
+	uint32_t *_verdicts;
+	size_t _headerSize;
+	unsigned int _wakeThreshold;
+	// Index at which the device interrupts next (or nullptr if it always interrupts).
+	uint16_t *_eventIndex;
+
+	// Used ring index up to which buffers were classified.
+	uint16_t _progress;
+	// Number of dropped frames since the waiters were woken up last.
+	unsigned int _pendingDrops = 0;
+};
+
 void initializeKernletCtl();
 
 } // namespace thor
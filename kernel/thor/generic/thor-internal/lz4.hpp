@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include <async/recurring-event.hpp>
+#include <frg/vector.hpp>
+#include <thor-internal/kernel_heap.hpp>
+
+namespace thor {
+
+// Decompresses a single LZ4 block into dest.
+// Returns the size of the decompressed data or -1 if the block is malformed.
+ptrdiff_t lz4DecompressBlock(const void *src, size_t srcSize, void *dest, size_t destCapacity);
+
+// Compresses src (which must not exceed 64 KiB) into a single LZ4 block.
+// This is a fast greedy compressor that is intended for small buffers (e.g., pages).
+// Returns the size of the block or -1 if it does not fit into destCapacity.
+ptrdiff_t lz4CompressBlock(const void *src, size_t srcSize, void *dest, size_t destCapacity);
+
+// Decompresses an LZ4 frame (with independent blocks) on all CPUs.
+// Since all blocks but the last one decompress to the maximal block size,
+// the blocks can be decompressed in parallel and in any order. A single consumer
+// fiber can use the data as soon as a prefix of it is decompressed.
+struct Lz4FrameDecompressor {
+	static bool isFrame(const void *data, size_t size);
+
+	// Parses the frame's headers. The frame must stay accessible until
+	// all blocks are decompressed.
+	static Lz4FrameDecompressor *create(const void *frame, size_t size);
+
+	Lz4FrameDecompressor(const void *frame, size_t blockSize);
+
+	Lz4FrameDecompressor(const Lz4FrameDecompressor &) = delete;
+
+	Lz4FrameDecompressor &operator= (const Lz4FrameDecompressor &) = delete;
+
+	// Upper bound on the size of the decompressed data.
+	size_t maxSize() {
+		return blocks_.size() * blockSize_;
+	}
+
+	size_t numBlocks() {
+		return blocks_.size();
+	}
+
+	// Starts one worker fiber per CPU that decompress the frame into dest
+	// (which must be at least maxSize() bytes large).
+	void start(void *dest);
+
+	// Blocks the current fiber until at least n bytes are decompressed
+	// (or until the entire frame is decompressed). Returns the number of available bytes.
+	size_t waitFor(size_t n);
+
+	// Drops the consumer's reference; the object is freed once all workers exited.
+	void release();
+
+private:
+	struct Block {
+		size_t srcOffset;
+		size_t srcSize;
+		bool uncompressed;
+	};
+
+	void runWorker_();
+	void unref_();
+
+	const uint8_t *frame_;
+	size_t blockSize_;
+	frg::vector<Block, KernelAlloc> blocks_{*kernelAlloc};
+
+	uint8_t *dest_ = nullptr;
+	// Per block: decompressed size (written before the block is marked as done).
+	frg::vector<size_t, KernelAlloc> outSizes_{*kernelAlloc};
+	// Per block: non-zero once the block is decompressed.
+	frg::vector<uint8_t, KernelAlloc> done_{*kernelAlloc};
+	std::atomic<size_t> nextBlock_{0};
+	async::recurring_event doneEvent_;
+
+	// Only accessed by the consumer.
+	size_t numDonePrefix_ = 0;
+	size_t availablePrefix_ = 0;
+
+	// Held by the consumer and by each worker.
+	std::atomic<int> refCount_{1};
+};
+
+} // namespace thor
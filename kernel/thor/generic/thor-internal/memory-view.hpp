@@ -38,6 +38,12 @@ struct CachePage {
 	static constexpr uint32_t reclaimPosted = 0x02;
 	// Page has been evicted (neither in the LRU, nor in the bundle list).
 	static constexpr uint32_t reclaimInflight = 0x04;
+	// Page is on the active list (otherwise, it is on the inactive list).
+	static constexpr uint32_t reclaimActive = 0x08;
+	// Page was referenced since it was last scanned.
+	static constexpr uint32_t reclaimReferenced = 0x10;
+	// Page was reclaimed; used to detect refaults.
+	static constexpr uint32_t reclaimEvicted = 0x20;
 
 	// CacheBundle that owns this page.
 	CacheBundle *bundle = nullptr;
@@ -69,6 +75,47 @@ private:
 	async::recurring_event _reclaimEvent;
 };
 
+struct ReclaimStats {
+	size_t numActivePages;
+	size_t numInactivePages;
+	// Number of pages that were evicted.
+	uint64_t numReclaimed;
+	// Number of evicted pages that were loaded again.
+	uint64_t numRefaults;
+	// Number of promotions to the active list.
+	uint64_t numActivated;
+	// Number of demotions to the inactive list.
+	uint64_t numDeactivated;
+	// Anonymous pages that are candidates for compression.
+	size_t numAnonPages;
+	// Pages that are currently stored in compressed form and the size of their data.
+	// The compression ratio is numCompressedPages * kPageSize / compressedBytes.
+	size_t numCompressedPages;
+	size_t compressedBytes;
+	// Number of pages that were compressed and decompressed (i.e., faulted in again).
+	uint64_t numCompressions;
+	uint64_t numDecompressions;
+	// Number of pages that were not compressed since they did not compress well.
+	uint64_t numIncompressible;
+};
+
+ReclaimStats getReclaimStats();
+
+struct BitsetEvent;
+
+// Memory pressure levels; these correspond to kHelMemoryPressure* in hel.h.
+enum class MemoryPressure {
+	none,
+	low,
+	medium,
+	critical
+};
+
+MemoryPressure getMemoryPressure();
+
+// Triggers bit (1 << level) whenever the memory pressure changes to that level.
+smarter::shared_ptr<BitsetEvent> getMemoryPressureEvent();
+
 struct GlobalFutexSpace {
 protected:
 	~GlobalFutexSpace() = default;
@@ -170,6 +217,12 @@ public:
 
 using FetchFlags = uint32_t;
 inline constexpr FetchFlags fetchDisallowBacking = 1;
+// The caller only needs read access (e.g., on read faults).
+// Views may return the shared zero page (see getZeroPage()) instead of allocating memory.
+inline constexpr FetchFlags fetchReadOnly = 2;
+// The caller keeps using the physical address without locking the page
+// (e.g., helPointerPhysical()). Views must not compress or move the page afterwards.
+inline constexpr FetchFlags fetchPin = 4;
 
 struct RangeToEvict {
 	uintptr_t offset;
@@ -303,6 +356,11 @@ public:
 	// Result stays valid until the range is evicted.
 	virtual frg::tuple<PhysicalAddr, CachingMode> peekRange(uintptr_t offset) = 0;
 
+	// Like peekRange() but also returns the length of the range starting at offset
+	// that is contiguous in physical memory (and has the same caching mode).
+	// The default implementation only considers a single page.
+	virtual PhysicalRange peekContiguousRange(uintptr_t offset);
+
 	// Makes a range of memory available for peekRange().
 	virtual coroutine<frg::expected<Error>>
 	touchRange(uintptr_t offset, size_t size, FetchFlags flags, smarter::shared_ptr<WorkQueue> wq);
@@ -321,9 +379,20 @@ public:
 	// Called (e.g. by user space) to update a range after loading or writeback.
 	virtual Error updateRange(ManageRequest type, size_t offset, size_t length);
 
+	// Returns the number of pages in the range that are dirty or under writeback.
+	virtual frg::expected<Error, size_t> countWriteback(size_t offset, size_t length);
+
+	// Hints that a range will be accessed soon. Views may start loading it in the background.
+	virtual void loadahead(uintptr_t offset, size_t size);
+
 	virtual Error setIndirection(size_t slot, smarter::shared_ptr<MemoryView> view,
 			uintptr_t offset, size_t size);
 
+	// Returns a view of the same memory that is mapped with the given caching mode.
+	// Only supported by views of device memory (i.e., HardwareMemory).
+	virtual frg::expected<Error, smarter::shared_ptr<MemoryView>>
+	withCachingMode(CachingMode mode);
+
 	// ----------------------------------------------------------------------------------
 	// Memory eviction.
 	// ----------------------------------------------------------------------------------
@@ -637,7 +706,7 @@ inline auto copyBetweenViews(MemoryView *destView, uintptr_t destOffset,
 
 							PageAccessor destAccessor{destPhysical};
 							PageAccessor srcAccessor{srcPhysical};
-							memcpy((uint8_t *)destAccessor.get() + destMisalign,
+							copyMemory((uint8_t *)destAccessor.get() + destMisalign,
 									(uint8_t *)srcAccessor.get() + srcMisalign, chunk);
 
 							nd.progress += chunk;
@@ -694,6 +763,9 @@ private:
 
 smarter::shared_ptr<MemoryView> getZeroMemory();
 
+// Returns a physical page that is always zero. It must only be mapped read-only.
+PhysicalAddr getZeroPage();
+
 // Memory that is allocated by the kernel and never swapped out.
 // In contrast to most other memory objects, it can be accessed synchronously.
 struct ImmediateMemory final : MemoryView, GlobalFutexSpace {
@@ -751,7 +823,7 @@ struct ImmediateMemory final : MemoryView, GlobalFutexSpace {
 			auto index = (offset + progress) >> kPageShift;
 			assert(index < _physicalPages.size());
 			PageAccessor accessor{_physicalPages[index]};
-			memcpy(reinterpret_cast<std::byte *>(accessor.get()) + misalign,
+			copyMemory(reinterpret_cast<std::byte *>(accessor.get()) + misalign,
 					reinterpret_cast<std::byte *>(pointer) + progress, chunk);
 			progress += chunk;
 		}
@@ -783,6 +855,8 @@ struct HardwareMemory final : MemoryView {
 			fetchRange(uintptr_t offset, FetchFlags flags,
 			smarter::shared_ptr<WorkQueue> wq) override;
 	void markDirty(uintptr_t offset, size_t size) override;
+	frg::expected<Error, smarter::shared_ptr<MemoryView>>
+			withCachingMode(CachingMode mode) override;
 
 private:
 	PhysicalAddr _base;
@@ -791,8 +865,11 @@ private:
 };
 
 struct AllocatedMemory final : MemoryView, GlobalFutexSpace {
+	// If chunkFallback is set, chunkSize is only a preference: chunks that cannot be
+	// allocated (or that exceed the length of the memory) are backed by individual pages.
 	AllocatedMemory(size_t length, int addressBits = 64,
-			size_t chunkSize = kPageSize, size_t chunkAlign = kPageSize);
+			size_t chunkSize = kPageSize, size_t chunkAlign = kPageSize,
+			bool chunkFallback = false);
 	AllocatedMemory(const AllocatedMemory &) = delete;
 	~AllocatedMemory();
 
@@ -805,10 +882,13 @@ struct AllocatedMemory final : MemoryView, GlobalFutexSpace {
 	Error lockRange(uintptr_t offset, size_t size) override;
 	void unlockRange(uintptr_t offset, size_t size) override;
 	frg::tuple<PhysicalAddr, CachingMode> peekRange(uintptr_t offset) override;
+	PhysicalRange peekContiguousRange(uintptr_t offset) override;
 	coroutine<frg::expected<Error, PhysicalRange>>
 			fetchRange(uintptr_t offset, FetchFlags flags,
 			smarter::shared_ptr<WorkQueue> wq) override;
 	void markDirty(uintptr_t offset, size_t size) override;
+	// Allocates all chunks of the range up front (instead of on the first fault).
+	void loadahead(uintptr_t offset, size_t size) override;
 
 	coroutine<frg::expected<Error, PhysicalAddr>> takeGlobalFutex(uintptr_t offset,
 			smarter::shared_ptr<WorkQueue> wq) override;
@@ -821,8 +901,13 @@ private:
 	frg::ticket_spinlock _mutex;
 
 	frg::vector<PhysicalAddr, KernelAlloc> _physicalChunks;
+	// Only used if _chunkFallback is set. For each chunk that is backed by individual pages,
+	// points to an array of chunkSize / kPageSize pages (or nullptr otherwise).
+	frg::vector<PhysicalAddr *, KernelAlloc> _fallbackPages;
 	int _addressBits;
 	size_t _chunkSize, _chunkAlign;
+	bool _chunkFallback;
+	size_t _length;
 };
 
 struct ManagedSpace : CacheBundle {
@@ -885,11 +970,27 @@ struct ManagedSpace : CacheBundle {
 	Error lockPages(uintptr_t offset, size_t size);
 	void unlockPages(uintptr_t offset, size_t size);
 
+	// Moves the contents of a present, unlocked page to newPhysical.
+	// Fails if the page changed state or does not reside at oldPhysical anymore.
+	// On success, the caller owns oldPhysical; otherwise, it still owns newPhysical.
+	coroutine<bool> migratePage(size_t index, PhysicalAddr oldPhysical, PhysicalAddr newPhysical);
+
 	void submitManagement(ManageNode *node);
 	void submitMonitor(MonitorNode *node);
+	void loadahead(uintptr_t offset, size_t size);
 	void _progressManagement(ManageList &pending);
 	void _progressMonitors(MonitorList &pending);
 
+	// Readahead window sizes in pages.
+	static constexpr size_t initialReadahead = 4;
+	static constexpr size_t maxReadahead = 64;
+
+	// Called with the mutex held when a fetch misses or hits the readahead marker.
+	void _readaheadOnMiss(size_t index);
+	void _readaheadOnHit(size_t index);
+	// Requests initialization of a window of pages and places the async marker within it.
+	void _issueReadahead(size_t index, size_t count);
+
 	smarter::borrowed_ptr<ManagedSpace> selfPtr;
 
 	frg::ticket_spinlock mutex;
@@ -899,6 +1000,13 @@ struct ManagedSpace : CacheBundle {
 	size_t numPages;
 	bool readahead;
 
+	// Readahead state (protected by mutex).
+	// The window grows on sequential misses (and marker hits) and collapses on random misses.
+	// When a fetch hits _raMarkerIndex, the next window is requested without blocking.
+	size_t _raWindow = 0;
+	size_t _raNextIndex = 0;
+	size_t _raMarkerIndex = size_t(-1);
+
 	EvictionQueue _evictQueue;
 
 	frg::intrusive_list<
@@ -947,6 +1055,7 @@ public:
 	void markDirty(uintptr_t offset, size_t size) override;
 	void submitManage(ManageNode *handle) override;
 	Error updateRange(ManageRequest type, size_t offset, size_t length) override;
+	frg::expected<Error, size_t> countWriteback(size_t offset, size_t length) override;
 
 private:
 	smarter::shared_ptr<ManagedSpace> _managed;
@@ -971,6 +1080,7 @@ public:
 			fetchRange(uintptr_t offset, FetchFlags flags,
 			smarter::shared_ptr<WorkQueue> wq) override;
 	void markDirty(uintptr_t offset, size_t size) override;
+	void loadahead(uintptr_t offset, size_t size) override;
 
 	coroutine<frg::expected<Error, PhysicalAddr>> takeGlobalFutex(uintptr_t offset,
 			smarter::shared_ptr<WorkQueue> wq) override;
@@ -1036,7 +1146,11 @@ struct CowChain {
 	frg::rcu_radixtree<std::atomic<PhysicalAddr>, KernelAlloc> _pages;
 };
 
-struct CopyOnWriteMemory final : MemoryView, GlobalFutexSpace /*, MemoryObserver */ {
+// Pages that are owned by CopyOnWriteMemory (i.e., private anonymous memory) can be
+// compressed by the MemoryReclaimer: it evicts the page from all mappings, compresses
+// it with LZ4 into a buffer on the kernel heap and frees the physical page.
+// Faults decompress the page again. Locked and pinned pages are never compressed.
+struct CopyOnWriteMemory final : MemoryView, GlobalFutexSpace, CacheBundle {
 public:
 	CopyOnWriteMemory(smarter::shared_ptr<MemoryView> view,
 			uintptr_t offset, size_t length,
@@ -1065,28 +1179,69 @@ public:
 			smarter::shared_ptr<WorkQueue> wq) override;
 	void retireGlobalFutex(uintptr_t offset) override;
 
+	// Called by the MemoryReclaimer (on its fiber) to compress the page at the given index.
+	// Does nothing if the page was locked, pinned or faulted in the meantime.
+	coroutine<void> compressPage(uint64_t index, smarter::shared_ptr<WorkQueue> wq);
+
 public:
 	// Contract: set by the code that constructs this object.
-	smarter::borrowed_ptr<CopyOnWriteMemory> selfPtr;
+	// This is a weak_ptr since the reclaimer needs to take references to the object.
+	smarter::weak_ptr<CopyOnWriteMemory> selfPtr;
 private:
 	enum class CowState {
 		null,
 		inProgress,
-		hasCopy
+		hasCopy,
+		// The page is known to be zero; it is backed by getZeroPage() for reads.
+		zero,
+		// The page is still present but it is being compressed. Accesses cancel
+		// the compression by moving the page back to hasCopy.
+		evicting,
+		// The page's contents are only available in compressed form.
+		compressed
 	};
 
 	struct CowPage {
 		PhysicalAddr physical = -1;
 		CowState state = CowState::null;
 		unsigned int lockCount = 0;
+		// Set once the physical address was handed out (see fetchPin).
+		bool pinned = false;
+		// Whether the page is registered with the reclaimer.
+		bool tracked = false;
+		// Only valid in the compressed state.
+		void *compressedData = nullptr;
+		size_t compressedSize = 0;
+		CachePage cachePage;
 	};
 
+	// (Un)registers the page with the reclaimer, depending on whether it can be compressed.
+	// Must be called with _mutex held whenever the state, lockCount or pinned change.
+	void _updateTracking(uint64_t index, CowPage *page);
+
+	// Decompresses data into a new physical page and frees data.
+	static PhysicalAddr _decompressPage(void *data, size_t size);
+
+	// Merges CowChains that are only reachable through this object.
+	// Must be called with _mutex held.
+	void _collapseChains();
+
+	// If our CowChain is not shared, takes the page out of the chain (instead of copying it).
+	// Must be called with _mutex held. Returns PhysicalAddr(-1) if that is not possible.
+	PhysicalAddr _migrateFromChain(uintptr_t pageOffset);
+
+	// Returns true if any CowChain contains the page.
+	// Must be called with _mutex held.
+	bool _chainHasPage(uintptr_t pageOffset);
+
 	frg::ticket_spinlock _mutex;
 
 	smarter::shared_ptr<MemoryView> _view;
 	uintptr_t _viewOffset;
 	size_t _length;
 	smarter::shared_ptr<CowChain> _copyChain;
+	// True if _view is the global ZeroMemory.
+	bool _viewIsZero;
 	frg::rcu_radixtree<CowPage, KernelAlloc> _ownedPages;
 	async::recurring_event _copyEvent;
 	EvictionQueue _evictQueue;
@@ -1140,6 +1295,20 @@ struct GlobalFutex {
 		return __atomic_load_n(accessPtr, __ATOMIC_RELAXED);
 	}
 
+	// Atomically replaces the futex word by fn(old) and returns the old value.
+	template<typename Fn>
+	unsigned int fetchUpdate(Fn fn) {
+		PageAccessor accessor{physical_};
+		auto offsetOfWord = offset_ & (kPageSize - 1);
+		auto accessPtr = reinterpret_cast<unsigned int *>(
+				reinterpret_cast<std::byte *>(accessor.get()) + offsetOfWord);
+		auto old = __atomic_load_n(accessPtr, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(accessPtr, &old, fn(old), false,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			;
+		return old;
+	}
+
 	void retire() {
 		space_->retireGlobalFutex(offset_);
 		space_ = nullptr;
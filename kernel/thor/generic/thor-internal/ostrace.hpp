@@ -4,7 +4,7 @@
 
 #include <thor-internal/main.hpp>
 #include <thor-internal/ring-buffer.hpp>
-#include <ostrace.frigg_bragi.hpp>
+#include <protocols/ostrace/ring.hpp>
 
 namespace thor {
 
@@ -12,30 +12,48 @@ extern bool wantOsTrace;
 extern std::atomic<bool> osTraceInUse;
 
 enum class OsTraceEventId : uint64_t { };
+enum class OsTraceItemId : uint64_t { };
 
 LogRingBuffer *getGlobalOsTraceRing();
 
 OsTraceEventId announceOsTraceEvent(frg::string_view name);
-void emitOsTrace(managarm::ostrace::EventRecord<KernelAlloc> record);
+OsTraceItemId announceOsTraceItem(frg::string_view name);
+
+// Writes the record to the ring of the current CPU. Sets the sequence number and timestamp.
+// This function can be called from any context (including IRQ handlers).
+void emitOsTrace(protocols::ostrace::RingRecord &record);
 
 initgraph::Stage *getOsTraceAvailableStage();
 
 struct OsTraceEvent {
 	OsTraceEvent(OsTraceEventId id) {
 		live_ = osTraceInUse.load(std::memory_order_relaxed);
-		if(live_)
-			rec_.set_id(static_cast<uint64_t>(id));
+		if(live_) {
+			rec_.id = static_cast<uint64_t>(id);
+			rec_.numCtrs = 0;
+			rec_.flags = 0;
+		}
+	}
+
+	void withCounter(OsTraceItemId id, int64_t value) {
+		if(!live_)
+			return;
+		if(rec_.numCtrs == protocols::ostrace::maxRingCounters) {
+			rec_.flags |= protocols::ostrace::recordTruncated;
+			return;
+		}
+		rec_.ctrs[rec_.numCtrs++] = {static_cast<uint64_t>(id), value};
 	}
 
 	void emit() {
 		if(!live_)
 			return;
-		emitOsTrace(std::move(rec_));
+		emitOsTrace(rec_);
 	}
 
 private:
 	bool live_; // Whether we emit an event at all.
-	managarm::ostrace::EventRecord<KernelAlloc> rec_{*kernelAlloc};
+	protocols::ostrace::RingRecord rec_;
 };
 
 } // namespace thor
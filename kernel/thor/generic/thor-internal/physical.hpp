@@ -5,6 +5,7 @@
 #include <frg/spinlock.hpp>
 #include <frg/manual_box.hpp>
 #include <physical-buddy.hpp>
+#include <thor-internal/kernel-locks.hpp>
 #include <thor-internal/types.hpp>
 
 namespace thor {
@@ -25,17 +26,80 @@ public:
 	void *access(PhysicalAddr physical);
 };
 
+// Per-CPU cache of free physical chunks of small orders.
+// Chunks are moved to/from the buddy allocator in batches such that
+// most allocations and frees do not need to take the global lock.
+// Must only be accessed by the owning CPU with IRQs disabled.
+struct PhysicalMagazine {
+	static constexpr int numOrders = 4;
+	static constexpr size_t capacity = 64;
+	static constexpr size_t batchSize = 32;
+
+	PhysicalAddr chunks[numOrders][capacity];
+	size_t numChunks[numOrders] = {};
+};
+
+static constexpr int maxNumaNodes = 8;
+
+// Number of orders that are reported in fragmentation statistics.
+// Order 0 corresponds to single pages; the last order also includes all larger chunks.
+static constexpr int numFreeChunkOrders = 12;
+
+struct FragmentationStats {
+	// Number of free chunks of each order.
+	size_t numFreeChunks[numFreeChunkOrders];
+	uint64_t numCompactions;
+	// Number of compaction runs that did not produce a free chunk of the requested order.
+	uint64_t numFailedCompactions;
+	uint64_t numMigratedPages;
+};
+
+// Returns the NUMA node of the CPU with the given ID (i.e., the local APIC ID on x86).
+int getNumaNodeOfCpu(uint64_t cpuId);
+
 class PhysicalChunkAllocator {
-	typedef frg::ticket_spinlock Mutex;
+	typedef TrackedSpinlock<LockClass::physicalAllocator> Mutex;
 public:
 	PhysicalChunkAllocator();
 	
 	void bootstrapRegion(PhysicalAddr address,
-			int order, size_t numRoots, int8_t *buddyTree);
+			int order, size_t numRoots, int8_t *buddyTree, int node = 0);
 
+	// Prefers memory from the current CPU's NUMA node but falls back to other nodes.
 	PhysicalAddr allocate(size_t size, int addressBits = 64);
+	// Like allocate() but returns zeroed memory.
+	// Single pages are taken from the pre-zeroed pool of the local node if possible.
+	PhysicalAddr allocateZeroed(size_t size, int addressBits = 64);
 	void free(PhysicalAddr address, size_t size);
 
+	// Zeroes up to n pages and adds them to the zeroed pool of the current CPU's node.
+	// Called by idle CPUs. Returns false if the pool does not need more pages.
+	bool refillZeroedPool(size_t n);
+
+	// Returns all chunks of the current CPU's magazine to the buddy allocator.
+	void drainLocalMagazine();
+
+	// Whether the page is free in the buddy allocator.
+	// Pages in magazines or in the zeroed pools are not free.
+	bool isFree(PhysicalAddr physical);
+
+	FragmentationStats getFragmentationStats();
+
+	// Allocations of at least this order request compaction if they fail.
+	static constexpr int minCompactionOrder = 1;
+
+	// Returns the largest order of failed allocations since the last call (or -1).
+	int takeCompactionRequest() {
+		return _compactionRequest.exchange(-1, std::memory_order_relaxed);
+	}
+
+	void accountCompaction(bool success, size_t numMigrated) {
+		_numCompactions.fetch_add(1, std::memory_order_relaxed);
+		if(!success)
+			_numFailedCompactions.fetch_add(1, std::memory_order_relaxed);
+		_numMigratedPages.fetch_add(numMigrated, std::memory_order_relaxed);
+	}
+
 	size_t numTotalPages() {
 		return _totalPages.load(std::memory_order_relaxed);
 	}
@@ -46,21 +110,85 @@ public:
 		return _freePages.load(std::memory_order_relaxed);
 	}
 
+	int numNodes() {
+		return _numNodes;
+	}
+	size_t numTotalPages(int node) {
+		return _nodes[node].totalPages.load(std::memory_order_relaxed);
+	}
+	size_t numUsedPages(int node) {
+		return _nodes[node].usedPages.load(std::memory_order_relaxed);
+	}
+	size_t numFreePages(int node) {
+		return _nodes[node].freePages.load(std::memory_order_relaxed);
+	}
+	size_t numZeroedPages(int node) {
+		return _nodes[node].numZeroed.load(std::memory_order_relaxed);
+	}
+
+	// Number of allocateZeroed() calls that could (not) be served from the zeroed pool.
+	uint64_t numZeroedHits() {
+		return _zeroedHits.load(std::memory_order_relaxed);
+	}
+	uint64_t numZeroedMisses() {
+		return _zeroedMisses.load(std::memory_order_relaxed);
+	}
+
 private:
+	PhysicalAddr _allocateFromBuddy(int target, int addressBits, int node);
+	void _freeToBuddy(PhysicalAddr address, int target);
+	int _nodeOf(PhysicalAddr address);
+	void _requestCompaction(int target);
+	void _accountAllocation(PhysicalAddr address, size_t size);
+	void _accountFree(PhysicalAddr address, size_t size);
+
+	// Moves chunks from the buddy allocator into the magazine. Returns false on OOM.
+	bool _refillMagazine(PhysicalMagazine *magazine, int target);
+	// Moves up to n chunks from the magazine back to the buddy allocator.
+	void _drainMagazine(PhysicalMagazine *magazine, int target, size_t n);
+	// Returns all pages of the zeroed pools to the buddy allocator. Requires _mutex.
+	// Returns false if the pools were empty.
+	bool _drainZeroedPools();
+
 	Mutex _mutex;
 
 	struct Region {
 		PhysicalAddr physicalBase;
 		PhysicalAddr regionSize;
 		BuddyAccessor buddyAccessor;
+		int node;
 	};
 
 	Region _allRegions[8];
 	int _numRegions = 0;
 
+	static constexpr size_t zeroedPoolCapacity = 512;
+
+	struct Node {
+		std::atomic<size_t> totalPages{0};
+		std::atomic<size_t> usedPages{0};
+		std::atomic<size_t> freePages{0};
+
+		// Pages in the zeroed pool count as used pages.
+		frg::ticket_spinlock zeroedMutex;
+		PhysicalAddr zeroedPages[zeroedPoolCapacity];
+		std::atomic<size_t> numZeroed{0};
+	};
+
+	Node _nodes[maxNumaNodes];
+	int _numNodes = 1;
+
 	std::atomic<size_t> _totalPages{0};
 	std::atomic<size_t> _usedPages{0};
 	std::atomic<size_t> _freePages{0};
+
+	std::atomic<uint64_t> _zeroedHits{0};
+	std::atomic<uint64_t> _zeroedMisses{0};
+
+	std::atomic<int> _compactionRequest{-1};
+	std::atomic<uint64_t> _numCompactions{0};
+	std::atomic<uint64_t> _numFailedCompactions{0};
+	std::atomic<uint64_t> _numMigratedPages{0};
 };
 
 extern constinit frg::manual_box<PhysicalChunkAllocator> physicalAllocator;
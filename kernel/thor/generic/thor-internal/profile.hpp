@@ -1,12 +1,66 @@
 #pragma once
 
+#include <thor-internal/arch/stack.hpp>
+#include <thor-internal/kernel-stack.hpp>
 #include <thor-internal/ring-buffer.hpp>
 
 namespace thor {
 
 extern bool wantKernelProfile;
 
+// Maximal number of return addresses that are recorded per sample.
+inline constexpr unsigned int maxProfileFrames = 16;
+
+// Record format of the kernel-profile ring buffer.
+// Each sample is followed by numFrames return addresses (innermost first).
+// This needs to be kept in sync with tools/analyze-profile.py.
+struct ProfileSample {
+	uint64_t ip;
+	uint64_t threadId; // Zero for kernel fibers.
+	uint64_t universeId;
+	uint32_t cpu;
+	uint32_t numFrames;
+};
+
+static_assert(sizeof(ProfileSample) == 32);
+
+// Called from the PMC overflow handler; must be NMI-safe.
+// bp and sp are the frame and stack pointer of the interrupted code.
+inline void recordProfileSample(CpuData *cpuData, uintptr_t ip,
+		[[maybe_unused]] uintptr_t bp, [[maybe_unused]] uintptr_t sp) {
+	struct {
+		ProfileSample sample;
+		uint64_t frames[maxProfileFrames];
+	} record;
+	record.sample = ProfileSample{
+		.ip = ip,
+		.threadId = cpuData->profileThreadId,
+		.universeId = cpuData->profileUniverseId,
+		.cpu = static_cast<uint32_t>(cpuData->cpuIndex),
+		.numFrames = 0
+	};
+
+#ifdef THOR_HAS_FRAME_POINTERS
+	// Only unwind kernel code. Frames must be on the interrupted stack, i.e.,
+	// within one kernel stack size above sp.
+	constexpr uintptr_t higherHalf = uintptr_t{1} << 63;
+	if(ip & higherHalf) {
+		walkStackFrom(bp, sp, sp + UniqueKernelStack::kSize, [&] (uintptr_t ret) {
+			if(!(ret & higherHalf))
+				return false;
+			record.frames[record.sample.numFrames++] = ret;
+			return record.sample.numFrames < maxProfileFrames;
+		});
+	}
+#endif
+
+	cpuData->localProfileRing->enqueue(&record,
+			sizeof(ProfileSample) + record.sample.numFrames * sizeof(uint64_t));
+}
+
 void initializeProfile();
+// Starts profiling on an AP once it is up (if profiling is enabled at all).
+void initializeProfileOnThisCpu();
 LogRingBuffer *getGlobalProfileRing();
 
 } // namespace thor
@@ -0,0 +1,24 @@
+#pragma once
+
+namespace thor {
+
+// Read-side critical section of thor's RCU mechanism.
+// Writers unlink objects from RCU-protected data structures and call rcuSynchronize()
+// before destructing them; hence, pointers that are obtained inside a read-side section
+// stay valid until the section ends. Read-side sections disable IRQs and must not block.
+// They can be nested.
+struct RcuReadGuard {
+	RcuReadGuard();
+
+	RcuReadGuard(const RcuReadGuard &) = delete;
+
+	~RcuReadGuard();
+
+	RcuReadGuard &operator= (const RcuReadGuard &) = delete;
+};
+
+// Waits until all read-side sections that were active on entry have ended.
+// Must not be called from within a read-side section.
+void rcuSynchronize();
+
+} // namespace thor
@@ -2,10 +2,12 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <atomic>
 
 #include <frg/list.hpp>
 #include <frg/pairing_heap.hpp>
 #include <frg/spinlock.hpp>
+#include <thor-internal/kernel-locks.hpp>
 
 namespace thor {
 
@@ -29,6 +31,11 @@ enum class ScheduleState {
 // For now, store it as 55.8 0 signed integer nanoseconds.
 using Progress = int64_t;
 
+// Wakeup latencies are counted in power-of-two buckets. Bucket 0 counts latencies
+// below 1024 ns, bucket i counts latencies in [1024 << (i - 1), 1024 << i) ns.
+// The last bucket also counts all larger latencies.
+inline constexpr int numWakeupLatencyBuckets = 16;
+
 struct ScheduleEntity {
 	friend struct Scheduler;
 
@@ -53,10 +60,54 @@ public:
 
 	virtual void handlePreemption(IrqImageAccessor image) = 0;
 
+	// Called by the load balancer to determine whether the entity can be moved
+	// to another CPU. This is only called while the entity is waiting
+	// (i.e., not while it runs). Entities are pinned to their CPU by default.
+	virtual bool isMigratableTo(CpuData *cpu);
+
 	uint64_t runTime() {
 		return _runTime;
 	}
 
+	// Number of times that the load balancer moved this entity to another CPU.
+	uint64_t numMigrations() {
+		return _numMigrations;
+	}
+
+	// Total time (in ns) that the entity was runnable but did not run.
+	uint64_t waitTime() {
+		return _waitTime;
+	}
+
+	// Number of times that the entity was scheduled.
+	uint64_t numTimeslices() {
+		return _numTimeslices;
+	}
+
+	// Switches away from the entity because it blocked (voluntary)
+	// or because it was preempted (involuntary).
+	uint64_t numVoluntarySwitches() {
+		return _numVoluntarySwitches;
+	}
+	uint64_t numInvoluntarySwitches() {
+		return _numInvoluntarySwitches;
+	}
+
+	// Histogram of the time from resume() until the entity runs.
+	uint64_t wakeupLatencyBucket(int i) {
+		return _wakeupLatency[i];
+	}
+
+	// True if the entity uses the deadline class (see Scheduler::setDeadline()).
+	bool isDeadline() const {
+		return _dlPeriod;
+	}
+
+	// Number of times that the entity exhausted its runtime budget.
+	uint64_t numThrottles() {
+		return _numThrottles;
+	}
+
 private:
 	const ScheduleType type_;
 
@@ -71,6 +122,18 @@ private:
 
 	uint64_t _refClock;
 	uint64_t _runTime;
+	uint64_t _numMigrations = 0;
+
+	// Clock at which the entity last became runnable.
+	uint64_t _runnableClock = 0;
+	// True if the entity became runnable through resume() (and not through preemption).
+	bool _wokenUp = false;
+
+	uint64_t _waitTime = 0;
+	uint64_t _numTimeslices = 0;
+	uint64_t _numVoluntarySwitches = 0;
+	uint64_t _numInvoluntarySwitches = 0;
+	uint64_t _wakeupLatency[numWakeupLatencyBuckets] = {};
 
 	// Scheduler::_systemProgress value at some slice T.
 	// Invariant: This entity's state did not change since T.
@@ -78,6 +141,21 @@ private:
 
 	// Unfairness value at slice T.
 	Progress baseUnfairness;
+
+	// Parameters of the deadline class (in ns); _dlPeriod is zero for other entities.
+	uint64_t _dlRuntime = 0;
+	uint64_t _dlDeadline = 0;
+	uint64_t _dlPeriod = 0;
+	// Absolute deadline and remaining budget of the current period.
+	uint64_t _dlAbsDeadline = 0;
+	int64_t _dlBudget = 0;
+	// Clock at which the budget was last charged (while the entity runs).
+	uint64_t _dlChargeClock = 0;
+	// Set if the budget is exhausted. Throttled entities are not runnable
+	// until their budget is replenished at _dlReplenishClock.
+	bool _dlThrottled = false;
+	uint64_t _dlReplenishClock = 0;
+	uint64_t _numThrottles = 0;
 };
 
 struct ScheduleGreater {
@@ -98,6 +176,17 @@ struct Scheduler {
 
 	static void setPriority(ScheduleEntity *entity, int priority);
 
+	// Moves the entity to the deadline class: in each period, the entity receives
+	// runtime ns of CPU time before its (relative) deadline. Runnable deadline entities
+	// always preempt regular entities (regardless of their priority); among each other,
+	// they run in EDF order. Once an entity exhausts its runtime, it is throttled until
+	// its next period. A period of zero moves the entity back to the regular class.
+	// Returns false if admission control rejects the parameters, i.e., if the total
+	// bandwidth of all deadline entities would exceed the reserved share of the CPUs.
+	// Like setPriority(), this can only be called on the current entity.
+	static bool setDeadline(ScheduleEntity *entity,
+			uint64_t runtime, uint64_t deadline, uint64_t period);
+
 	static void resume(ScheduleEntity *entity);
 	static void suspendCurrent();
 
@@ -122,18 +211,93 @@ public:
 
 	ScheduleEntity *currentRunnable();
 
+	// Called by the idle task if haveMonitoredIdle() is true.
+	// Waits on the idle word until this CPU has work.
+	[[noreturn]] void runIdleLoop();
+
+	// Must be called before the idle task updates the scheduler (e.g., on IRQs).
+	void leaveIdle();
+
+	// Number of entities that this scheduler received from/handed to other schedulers.
+	uint64_t numStolen() {
+		return _numStolen.load(std::memory_order_relaxed);
+	}
+	uint64_t numDonated() {
+		return _numDonated.load(std::memory_order_relaxed);
+	}
+
+	// Number of times that a blocking entity handed the CPU to an entity that it woke up.
+	uint64_t numHandoffs() {
+		return _numHandoffs.load(std::memory_order_relaxed);
+	}
+
+	// Number of remote wakeups that were merged into an already pending wakeup.
+	uint64_t numWakeupsBatched() {
+		return _numWakeupsBatched.load(std::memory_order_relaxed);
+	}
+
+	// Approximate number of runnable entities on this CPU.
+	size_t loadHint() {
+		return _loadHint.load(std::memory_order_relaxed);
+	}
+
+	// Number of times that this CPU switched to a different entity.
+	uint64_t numContextSwitches() {
+		return _numContextSwitches.load(std::memory_order_relaxed);
+	}
+
+	// Total time (in ns) that this CPU ran the idle task. May be called from any CPU.
+	uint64_t idleTime();
+
 private:
 	void _unschedule();
 	void _schedule();
 
+	// Adds an entity to the scheduler's pending list and pings the CPU if necessary.
+	void _pushPending(ScheduleEntity *entity);
+
+	// ----------------------------------------------------------------------------------
+	// Load balancing.
+	// ----------------------------------------------------------------------------------
+
+	// Number of runnable entities on this CPU (including the current one).
+	// Only updated by the owning CPU; other CPUs only read it as a hint.
+	size_t _localLoad();
+	void _updateLoadHint();
+
+	// Called by an idle CPU to ask the busiest CPU to hand over work.
+	void _requestWork();
+	// Moves waiting entities to less loaded CPUs.
+	void _balance();
+
 private:
 	void _updatePreemption();
 
 	void _updateCurrentEntity();
 	void _updateWaitingEntity(ScheduleEntity *entity);
 
+	// ----------------------------------------------------------------------------------
+	// Deadline class.
+	// ----------------------------------------------------------------------------------
+
+	// True if the preemption timer needs to enforce a budget or replenish an entity.
+	bool _haveDeadlineTimers();
+	// Arms the preemption timer for the earliest deadline event (or for the end of the slice).
+	void _updateDeadlinePreemption();
+	// Charges the time since the last charge to the budget of a running deadline entity.
+	void _chargeDeadline(ScheduleEntity *entity, uint64_t now);
+	// Applies the CBS wakeup rule. Returns false if the entity needs to be throttled.
+	bool _admitWakeup(ScheduleEntity *entity);
+	void _throttle(ScheduleEntity *entity);
+	// Moves throttled entities whose next period started to the wait queue.
+	void _replenishThrottled();
+
 	void _updateEntityStats(ScheduleEntity *entity);
 
+	// Updates the wait time and the wakeup latency histogram of an entity that is
+	// about to be scheduled.
+	void _accountWait(ScheduleEntity *entity);
+
 	CpuData *_cpuContext;
 
 	ScheduleEntity *_current;
@@ -151,6 +315,16 @@ private:
 
 	size_t _numWaiting = 0;
 
+	// Deadline entities that exhausted their budget. They are not part of _numWaiting.
+	frg::intrusive_list<
+		ScheduleEntity,
+		frg::locate_member<
+			ScheduleEntity,
+			frg::default_list_hook<ScheduleEntity>,
+			&ScheduleEntity::listHook
+		>
+	> _throttledList;
+
 	// The last tick at which the scheduler's state (i.e. progress) was updated.
 	// In our model this is the time point at which slice T started.
 	uint64_t _refClock = 0;
@@ -162,12 +336,71 @@ private:
 	// This allows us to easily track u_p(T) for all waiting processes.
 	Progress _systemProgress = 0;
 
+	// Clock at which _balance() was last run.
+	uint64_t _balanceClock = 0;
+
+	std::atomic<size_t> _loadHint{0};
+	// Set by other CPUs to request that _balance() runs on the next update().
+	std::atomic<bool> _balanceRequested{false};
+
+	std::atomic<uint64_t> _numStolen{0};
+	std::atomic<uint64_t> _numDonated{0};
+	std::atomic<uint64_t> _numHandoffs{0};
+
+	// ----------------------------------------------------------------------------------
+	// Monitored idle.
+	// ----------------------------------------------------------------------------------
+
+	// While the idle task waits in monitoredIdle(), other CPUs wake it up by writing
+	// the idle word instead of sending an IPI. Keep the word on its own cache line
+	// to avoid spurious wakeups.
+	struct alignas(64) IdleWord {
+		std::atomic<uint32_t> state{0};
+	};
+
+	IdleWord _idleWord;
+
+	// Start of the current idle period (or zero).
+	uint64_t _idleClock = 0;
+	// Exponential moving average of the idle durations in ns.
+	uint64_t _predictedIdle = 0;
+
+	// ----------------------------------------------------------------------------------
+	// Statistics.
+	// ----------------------------------------------------------------------------------
+
+	// Entity that commitReschedule() invoked most recently (only compared, never accessed).
+	ScheduleEntity *_lastInvoked = nullptr;
+	std::atomic<uint64_t> _numContextSwitches{0};
+
+	// Idle time of all completed idle periods and start of the current one (or zero).
+	// Other CPUs read both under the _idleSeq seqlock; there is only one writer.
+	std::atomic<uint64_t> _idleSeq{0};
+	std::atomic<uint64_t> _idleTime{0};
+	std::atomic<uint64_t> _idleSince{0};
+
+	// ----------------------------------------------------------------------------------
+	// Direct handoff.
+	// ----------------------------------------------------------------------------------
+
+	// Entity that the current entity woke up most recently on this CPU.
+	// Cleared whenever the scheduler makes a decision or migrates the entity.
+	ScheduleEntity *_handoff = nullptr;
+	// Set if the current entity blocked while _handoff was set.
+	bool _handoffPending = false;
+
 	// ----------------------------------------------------------------------------------
 	// Management of pending entities.
 	// ----------------------------------------------------------------------------------
 
 	// Note that _mutex *only* protects _pendingList and nothing more!
-	frg::ticket_spinlock _mutex;
+	TrackedSpinlock<LockClass::scheduler> _mutex;
+
+	// Set by _pushPending() when it wakes up this CPU; cleared by update() before it
+	// processes _pendingList. While it is set, no further wakeups are sent.
+	std::atomic<bool> _wakeupPending{false};
+	// Number of resume() calls that did not need to send a wakeup.
+	std::atomic<uint64_t> _numWakeupsBatched{0};
 
 	frg::intrusive_list<
 		ScheduleEntity,
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <thor-internal/arch/paging.hpp>
+#include <thor-internal/types.hpp>
+
+namespace thor {
+
+struct MemoryView;
+
+// A page table (covering a 2 MiB window) that is shared by all address spaces which map
+// the same range of a MemoryView read-only at the same offset into a 2 MiB window
+// (and that do not map anything else into the window).
+// For example, all processes map the text of ld.so and libc from the same views,
+// hence they can also share the PTs of these mappings. This saves PT memory and
+// avoids that every process faults in the same pages again.
+//
+// Since the PTEs only depend on the view range and the page flags, the sharers
+// populate the PT on behalf of each other. Eviction clears the PTEs in place (all sharers
+// observe the view and each of them performs its own shootdown). All other changes
+// (protect, unmap) first replace the shared PT by a private copy (or detach it).
+struct SharedPageTable {
+	MemoryView *view;
+	// View offset that corresponds to the start of the window (this can wrap around).
+	uintptr_t offset;
+	// Part of the window that is mapped, relative to the start of the window.
+	size_t begin;
+	size_t end;
+	PageFlags flags;
+
+	PhysicalAddr table;
+
+	// Both counts are protected by the mutex of the registry.
+	// Number of address spaces that have this PT installed.
+	unsigned int numAttached;
+	// Number of address spaces that have this PT installed or that did not perform
+	// shootdown since they removed it.
+	unsigned int refCount;
+};
+
+// Returns the shared PT for the given range of the view (creating an empty PT if necessary)
+// and takes a reference to it. The caller must hold a reference to the view and it must
+// observe the view (such that eviction clears the PTEs) until it calls detach.
+SharedPageTable *acquireSharedPageTable(MemoryView *view, uintptr_t offset,
+		size_t begin, size_t end, PageFlags flags);
+
+// Called once the caller removed the PT from its page space. When the PT is not installed
+// anywhere anymore, nobody keeps its PTEs up-to-date; hence, it cannot be acquired again.
+void detachSharedPageTable(SharedPageTable *sharedTable);
+
+// Drops a reference; the PT is freed once the last reference is dropped.
+// Since CPUs can cache the PT in their paging-structure caches, the caller must have
+// performed TLB shootdown after it removed the PT from its page space.
+void releaseSharedPageTable(SharedPageTable *sharedTable);
+
+struct SharedPageTableStats {
+	// Number of shared PTs and the total number of address spaces that use them.
+	// numReferences - numTables is the number of PTs saved by sharing.
+	size_t numTables;
+	size_t numReferences;
+};
+
+SharedPageTableStats getSharedPageTableStats();
+
+} // namespace thor
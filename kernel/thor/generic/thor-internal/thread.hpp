@@ -205,6 +205,10 @@ public:
 		return _credentials;
 	}
 
+	uint64_t id() {
+		return _id;
+	}
+
 	WorkQueue *mainWorkQueue() {
 		return &_mainWorkQueue;
 	}
@@ -273,16 +277,32 @@ public:
 
 	void handlePreemption(IrqImageAccessor accessor) override;
 
+	bool isMigratableTo(CpuData *cpu) override;
+
 private:
 	void _uninvoke();
 	void _kill();
 
+	// Whether the affinity mask allows this thread to run on the given CPU.
+	bool _isAllowedOn(size_t cpuIndex);
+
 public:
+	// An empty mask allows the thread to run on all CPUs.
 	void setAffinityMask(frg::vector<uint8_t, KernelAlloc> &&mask) {
 		auto lock = frg::guard(&_mutex);
 		_affinityMask = std::move(mask);
 	}
 
+	// Slack that is applied to timeouts of this thread (e.g., helSubmitAwaitClock()
+	// and futex deadlines). Only accessed by the thread itself.
+	uint64_t timerSlack() {
+		return _timerSlack;
+	}
+
+	void setTimerSlack(uint64_t slack) {
+		_timerSlack = slack;
+	}
+
 	// TODO: Tidy this up.
 	smarter::borrowed_ptr<Thread> self;
 
@@ -316,6 +336,7 @@ private:
 		kRunTerminated
 	};
 
+	uint64_t _id;
 	char _credentials[16];
 
 	AssociatedWorkQueue _mainWorkQueue;
@@ -364,6 +385,9 @@ private:
 
 	ObserveQueue _observeQueue;
 	frg::vector<uint8_t, KernelAlloc> _affinityMask;
+
+	// Same default as Linux.
+	uint64_t _timerSlack = 50'000;
 };
 
 } // namespace thor
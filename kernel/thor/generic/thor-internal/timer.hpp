@@ -6,6 +6,7 @@
 #include <async/cancellation.hpp>
 #include <frg/container_of.hpp>
 #include <frg/intrusive.hpp>
+#include <frg/list.hpp>
 #include <frg/pairing_heap.hpp>
 #include <frg/spinlock.hpp>
 #include <thor-internal/cancel.hpp>
@@ -14,6 +15,7 @@
 namespace thor {
 
 struct PrecisionTimerEngine;
+struct TimerWheel;
 
 struct ClockSource {
 	virtual uint64_t currentNanos() = 0;
@@ -57,6 +59,9 @@ private:
 
 enum class TimerState {
 	none,
+	// Timer is in a TimerWheel.
+	wheel,
+	// Timer is in the PrecisionTimerEngine's heap.
 	queued,
 	elapsed,
 	retired
@@ -75,6 +80,7 @@ struct PrecisionTimerNode {
 
 	friend struct CompareTimer;
 	friend struct PrecisionTimerEngine;
+	friend struct TimerWheel;
 
 	PrecisionTimerNode()
 	: _engine{nullptr}, _cancelCb{this} { }
@@ -90,20 +96,41 @@ struct PrecisionTimerNode {
 		_elapsed = elapsed;
 	}
 
+	// The timer may elapse up to slack nanoseconds after its deadline.
+	// This allows the engine to coalesce nearby deadlines into a single alarm.
+	void setSlack(uint64_t slack) {
+		_slack = slack;
+	}
+
 	bool wasCancelled() {
 		return _wasCancelled;
 	}
 
 	frg::pairing_heap_hook<PrecisionTimerNode> hook;
+	frg::default_list_hook<PrecisionTimerNode> wheelHook;
 
 private:
+	// Latest point in time at which the timer elapses.
+	uint64_t _expiry() const {
+		uint64_t expiry;
+		if(__builtin_add_overflow(_deadline, _slack, &expiry))
+			return UINT64_MAX;
+		return expiry;
+	}
+
 	uint64_t _deadline;
+	uint64_t _slack = 0;
 	async::cancellation_token _cancelToken;
 	Worklet *_elapsed;
 
 	// TODO: If we allow timer engines to be destructed, this needs to be refcounted.
 	PrecisionTimerEngine *_engine;
 
+	// Set before the timer is inserted into a wheel; never reset afterwards.
+	TimerWheel *_wheel = nullptr;
+	uint8_t _wheelLevel;
+	uint8_t _wheelSlot;
+
 	TimerState _state = TimerState::none;
 	bool _wasCancelled = false;
 	async::cancellation_observer<CancelFunctor> _cancelCb;
@@ -111,10 +138,53 @@ private:
 
 struct CompareTimer {
 	bool operator() (const PrecisionTimerNode *a, const PrecisionTimerNode *b) const {
-		return a->_deadline > b->_deadline;
+		return a->_expiry() > b->_expiry();
 	}
 };
 
+// Per-CPU hierarchical timing wheel that holds timers with distant deadlines.
+// Insertion and removal are O(1) and only take the per-CPU lock.
+// Once the tick of a timer is reached, it is moved to the PrecisionTimerEngine's heap;
+// hence, the granularity of the wheel does not affect the precision of timers.
+struct TimerWheel {
+	friend struct PrecisionTimerEngine;
+
+	// Each tick is 2^20 ns (~1 ms). Slots at level k span 64^k ticks.
+	static constexpr int granularityShift = 20;
+	static constexpr int slotShift = 6;
+	static constexpr int numSlots = 1 << slotShift;
+	static constexpr int numLevels = 4;
+
+private:
+	using TimerList = frg::intrusive_list<
+		PrecisionTimerNode,
+		frg::locate_member<
+			PrecisionTimerNode,
+			frg::default_list_hook<PrecisionTimerNode>,
+			&PrecisionTimerNode::wheelHook
+		>
+	>;
+
+	// Inserts a timer whose tick is after _base.
+	// Returns the tick at which the timer's slot is processed.
+	uint64_t _insert(PrecisionTimerNode *timer);
+	void _remove(PrecisionTimerNode *timer);
+
+	// Returns the next tick at which a slot needs to be processed (or UINT64_MAX).
+	uint64_t _nextTick();
+
+	// Advances _base up to the given tick. Timers whose tick is reached are moved to reached.
+	void _advance(uint64_t tick, TimerList &reached);
+
+	frg::ticket_spinlock _mutex;
+
+	// All slots up to (and including) this tick have been processed.
+	uint64_t _base = 0;
+	size_t _numTimers = 0;
+	uint64_t _occupied[numLevels] = {};
+	TimerList _slots[numLevels][numSlots];
+};
+
 struct PrecisionTimerEngine final : private AlarmSink {
 	friend struct PrecisionTimerNode;
 
@@ -145,14 +215,17 @@ public:
 		PrecisionTimerEngine *self;
 		uint64_t deadline;
 		async::cancellation_token cancellation;
+		uint64_t slack;
 	};
 
-	SleepSender sleep(uint64_t deadline, async::cancellation_token cancellation = {}) {
-		return {this, deadline, cancellation};
+	SleepSender sleep(uint64_t deadline, async::cancellation_token cancellation = {},
+			uint64_t slack = 0) {
+		return {this, deadline, cancellation, slack};
 	}
 
-	SleepSender sleepFor(uint64_t nanos, async::cancellation_token cancellation = {}) {
-		return {this, systemClockSource()->currentNanos() + nanos, cancellation};
+	SleepSender sleepFor(uint64_t nanos, async::cancellation_token cancellation = {},
+			uint64_t slack = 0) {
+		return {this, systemClockSource()->currentNanos() + nanos, cancellation, slack};
 	}
 
 	template<typename R>
@@ -169,7 +242,8 @@ public:
 				auto op = frg::container_of(base, &SleepOperation::worklet_);
 				async::execution::set_value(op->receiver_);
 			}, WorkQueue::generalQueue());
-			node_.setup(s_.deadline, &worklet_);
+			node_.setup(s_.deadline, s_.cancellation, &worklet_);
+			node_.setSlack(s_.slack);
 			s_.self->installTimer(&node_);
 		}
 
@@ -188,18 +262,35 @@ public:
 	// ----------------------------------------------------------------------------------
 
 private:
+	// Timers that expire further in the future than this are put into the per-CPU wheels.
+	static constexpr uint64_t wheelThreshold = uint64_t{16} << TimerWheel::granularityShift;
+
 	void cancelTimer(PrecisionTimerNode *timer);
 
 	void firedAlarm();
 
 private:
+	void _installIntoWheel(PrecisionTimerNode *timer, uint64_t current);
+	void _collectWheels(uint64_t current);
 	void _progress();
+	void _arm(uint64_t deadline);
 
 	ClockSource *_clock;
 	AlarmTracker *_alarm;
 
 	Mutex _mutex;
 
+	// Serializes _collectWheels(). Taken before the wheel mutexes (which are taken before _mutex).
+	Mutex _collectMutex;
+
+	// Lower bound on the time at which any wheel needs to be processed.
+	// Only decreased with _mutex held (or reset in _collectWheels()); may be read without locks.
+	std::atomic<uint64_t> _wheelDeadline{UINT64_MAX};
+
+	// Deadline that the alarm is currently armed for (protected by _mutex).
+	// Avoids reprogramming the alarm if the earliest expiry did not change.
+	uint64_t _armedDeadline = 0;
+
 	frg::pairing_heap<
 		PrecisionTimerNode,
 		frg::locate_member<
@@ -3,7 +3,9 @@
 #include <frg/variant.hpp>
 #include <assert.h>
 #include <smarter.hpp>
+#include <thor-internal/kernel-locks.hpp>
 #include <thor-internal/mm-rc.hpp>
+#include <thor-internal/rcu.hpp>
 #include <thor-internal/virtualization.hpp>
 
 namespace thor {
@@ -166,6 +168,7 @@ struct LaneDescriptor {
 struct IrqObject;
 struct OneshotEvent;
 struct BitsetEvent;
+struct WaitSet;
 
 struct OneshotEventDescriptor {
 	OneshotEventDescriptor(smarter::shared_ptr<OneshotEvent> event)
@@ -181,6 +184,13 @@ struct BitsetEventDescriptor {
 	smarter::shared_ptr<BitsetEvent> event;
 };
 
+struct WaitSetDescriptor {
+	WaitSetDescriptor(smarter::shared_ptr<WaitSet> waitSet)
+	: waitSet{std::move(waitSet)} { }
+
+	smarter::shared_ptr<WaitSet> waitSet;
+};
+
 struct IrqDescriptor {
 	IrqDescriptor(smarter::shared_ptr<IrqObject> irq)
 	: irq{std::move(irq)} { }
@@ -231,6 +241,7 @@ typedef frg::variant<
 	IrqDescriptor,
 	OneshotEventDescriptor,
 	BitsetEventDescriptor,
+	WaitSetDescriptor,
 	IoDescriptor,
 	KernletObjectDescriptor,
 	BoundKernletDescriptor
@@ -240,29 +251,71 @@ typedef frg::variant<
 // Universe.
 // --------------------------------------------------------
 
+// Descriptors are stored in an open addressing hash table that supports lock-free lookups.
+// Lookups only require a ReadGuard (i.e., an RCU read-side section);
+// attachDescriptor() and detachDescriptor() require the lock.
 struct Universe {
 public:
-	typedef frg::ticket_spinlock Lock;
-	typedef frg::unique_lock<frg::ticket_spinlock> Guard;
+	typedef TrackedSpinlock<LockClass::universe> Lock;
+	typedef frg::unique_lock<Lock> Guard;
+	typedef RcuReadGuard ReadGuard;
 
 	Universe();
 	~Universe();
 
+	uint64_t id() {
+		return _id;
+	}
+
 	Handle attachDescriptor(Guard &guard, AnyDescriptor descriptor);
 
+	// The returned pointer is valid as long as the guard is held.
 	AnyDescriptor *getDescriptor(Guard &guard, Handle handle);
+	AnyDescriptor *getDescriptor(ReadGuard &guard, Handle handle);
 
 	frg::optional<AnyDescriptor> detachDescriptor(Guard &guard, Handle handle);
 
 	Lock lock;
 
 private:
-	frg::hash_map<
-		Handle,
-		AnyDescriptor,
-		frg::hash<Handle>,
-		KernelAlloc
-	> _descriptorMap;
+	static constexpr Handle emptySlot = 0;
+	static constexpr Handle deletedSlot = -1;
+
+	struct DescriptorNode {
+		DescriptorNode(AnyDescriptor descriptor)
+		: descriptor{std::move(descriptor)} { }
+
+		AnyDescriptor descriptor;
+	};
+
+	struct Slot {
+		std::atomic<Handle> handle{emptySlot};
+		std::atomic<DescriptorNode *> node{nullptr};
+	};
+
+	struct Table {
+		Table(size_t capacity)
+		: capacity{capacity} { }
+
+		Slot *slots() {
+			return reinterpret_cast<Slot *>(this + 1);
+		}
+
+		size_t capacity;
+	};
+
+	static Table *_allocateTable(size_t capacity);
+	static void _freeTable(Table *table);
+
+	AnyDescriptor *_find(Handle handle);
+	void _rehash(size_t capacity);
+
+	uint64_t _id;
+
+	std::atomic<Table *> _table;
+	// Number of non-empty slots (including deleted ones) and of live descriptors.
+	size_t _numUsed = 0;
+	size_t _numLive = 0;
 
 	Handle _nextHandle;
 };
@@ -42,6 +42,8 @@ namespace thor {
 
 		virtual Error map(uint64_t guestAddress, uint64_t hostAddress, int flags) = 0;
 		virtual PageStatus unmap(uint64_t guestAddress) = 0;
+		// Sets one bit per dirty page in bitmap and clears the dirty state of all pages.
+		virtual Error fetchDirtyLog(uintptr_t guestAddress, size_t size, uint8_t *bitmap) = 0;
 		VirtualizedPageSpace() : VirtualSpace{&ops_}, ops_{this} {}
 
 		struct Operations final : VirtualOperations {
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <frg/list.hpp>
+#include <smarter.hpp>
+#include <thor-internal/error.hpp>
+#include <thor-internal/event.hpp>
+#include <thor-internal/irq.hpp>
+#include <thor-internal/work-queue.hpp>
+
+namespace thor {
+
+// Maximal number of triggers that are reported by a single await on a WaitSet.
+inline constexpr size_t maxWaitSetEvents = 16;
+
+struct WaitSetEvent {
+	Error error;
+	uintptr_t context;
+	uint64_t sequence;
+	uint32_t bitset;
+};
+
+struct AwaitWaitSetNode {
+	friend struct WaitSet;
+
+	void setup(Worklet *awaited) {
+		_awaited = awaited;
+	}
+
+	size_t numEvents() { return _numEvents; }
+	const WaitSetEvent &event(size_t i) { return _events[i]; }
+
+private:
+	Worklet *_awaited;
+
+	size_t _numEvents = 0;
+	WaitSetEvent _events[maxWaitSetEvents];
+
+	frg::default_list_hook<AwaitWaitSetNode> _queueNode;
+};
+
+// Collects the triggers of multiple IRQs and events, such that a single await
+// retrieves a batch of them.
+// The WaitSet awaits each registered source on its own. After a trigger was reported,
+// the source is awaited again, starting at the reported sequence number. Hence, triggers
+// that happen before the next await on the WaitSet are coalesced but never lost.
+// Registrations cannot be removed; they end when the WaitSet is destructed
+// (or after a OneshotEvent was reported as triggered).
+struct WaitSet {
+	WaitSet() = default;
+
+	WaitSet(const WaitSet &) = delete;
+
+	~WaitSet();
+
+	WaitSet &operator= (const WaitSet &) = delete;
+
+	void addIrq(smarter::shared_ptr<IrqObject> irq, uint64_t sequence, uintptr_t context);
+	void addEvent(smarter::shared_ptr<OneshotEvent> event, uint64_t sequence, uintptr_t context);
+	void addEvent(smarter::shared_ptr<BitsetEvent> event, uint64_t sequence, uintptr_t context);
+
+	void submitAwait(AwaitWaitSetNode *node);
+
+	// Contract: set by the code that constructs this object.
+	smarter::borrowed_ptr<WaitSet> selfPtr;
+
+private:
+	enum class SourceType {
+		irq,
+		oneshotEvent,
+		bitsetEvent
+	};
+
+	struct Entry {
+		SourceType type;
+		smarter::weak_ptr<WaitSet> set;
+		smarter::shared_ptr<IrqObject> irq;
+		smarter::shared_ptr<OneshotEvent> oneshotEvent;
+		smarter::shared_ptr<BitsetEvent> bitsetEvent;
+
+		// Sequence number that is passed to the next await on the source.
+		uint64_t sequence;
+		// Result of the last await on the source.
+		WaitSetEvent result;
+
+		Worklet worklet;
+		AwaitIrqNode irqNode;
+		AwaitEventNode eventNode;
+		frg::default_list_hook<Entry> readyHook;
+	};
+
+	using EntryList = frg::intrusive_list<
+		Entry,
+		frg::locate_member<
+			Entry,
+			frg::default_list_hook<Entry>,
+			&Entry::readyHook
+		>
+	>;
+
+	// Submits an await on the entry's source.
+	static void _arm(Entry *entry);
+	static void _triggered(Worklet *worklet);
+
+	void _pushReady(Entry *entry);
+
+	// Moves ready entries into the node. Entries that need to be re-armed are moved to
+	// the rearm list, entries that are finished are moved to the retire list.
+	// Must be called with _mutex held.
+	void _fill(AwaitWaitSetNode *node, EntryList &rearm, EntryList &retire);
+
+	// Re-arms or destructs entries that were taken out of the ready list.
+	// Must be called without holding _mutex.
+	static void _process(EntryList &rearm, EntryList &retire);
+
+	frg::ticket_spinlock _mutex;
+
+	EntryList _readyList;
+
+	frg::intrusive_list<
+		AwaitWaitSetNode,
+		frg::locate_member<
+			AwaitWaitSetNode,
+			frg::default_list_hook<AwaitWaitSetNode>,
+			&AwaitWaitSetNode::_queueNode
+		>
+	> _waitQueue;
+};
+
+} // namespace thor
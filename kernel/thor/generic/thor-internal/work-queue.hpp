@@ -23,6 +23,8 @@ private:
 	smarter::shared_ptr<WorkQueue> _workQueue;
 	void (*_run)(Worklet *);
 	frg::default_list_hook<Worklet> _hook;
+	// Link in WorkQueue::_remoteHead.
+	Worklet *_remoteNext = nullptr;
 };
 
 struct WorkQueue {
@@ -32,7 +34,7 @@ struct WorkQueue {
 	static bool enter(Worklet *worklet);
 
 	WorkQueue(ExecutorContext *executorContext = illegalExecutorContext())
-	: _executorContext{executorContext}, _localPosted{false}, _lockedPosted{false} { }
+	: _executorContext{executorContext}, _localPosted{false}, _remoteHead{nullptr} { }
 
 	bool check();
 
@@ -140,6 +142,8 @@ protected:
 	~WorkQueue() = default;
 
 private:
+	void _postRemote(Worklet *worklet);
+
 	ExecutorContext *_executorContext;
 
 	frg::intrusive_list<
@@ -155,23 +159,15 @@ private:
 
 	std::atomic<bool> _inRun{false};
 
-	frg::ticket_spinlock _mutex;
-
-	// Writes to this flag are totally ordered since they only happen within _mutex.
-	// Each 0-1 transition of this flag causes wakeup() to be called.
+	// Lock-free LIFO of Worklets posted from other executors (linked via _remoteNext).
+	// Producers push with a CAS; run() takes the whole chain with a single exchange
+	// and reverses it to restore FIFO order.
+	// Writes to this pointer are totally ordered since they are atomic RMW operations.
+	// Each null to non-null transition causes wakeup() to be called.
 	// wakeup() is responsible to ensure that (i) check() (and eventually run()) will be called,
-	// and (ii) that the call to check() synchronizes with the 0-1 transition of _lockedPosted.
+	// and (ii) that the call to check() synchronizes with the transition of _remoteHead.
 	// (In the case of threads, this is guaranteed by the blocking mechanics.)
-	std::atomic<bool> _lockedPosted;
-
-	frg::intrusive_list<
-		Worklet,
-		frg::locate_member<
-			Worklet,
-			frg::default_list_hook<Worklet>,
-			&Worklet::_hook
-		>
-	> _lockedQueue;
+	std::atomic<Worklet *> _remoteHead;
 };
 
 inline void Worklet::setup(void (*run)(Worklet *), WorkQueue *wq) {
@@ -28,6 +28,27 @@ void Thread::migrateCurrent() {
 	auto lock = frg::guard(&this_thread->_mutex);
 
 	assert(this_thread->_runState == kRunActive);
+
+	// Staying on the current CPU is always cheaper than migrating.
+	if(this_thread->_isAllowedOn(getCpuData()->cpuIndex))
+		return;
+
+	// Otherwise, move to the least loaded CPU within the affinity mask.
+	Scheduler *new_scheduler = nullptr;
+	size_t newLoad = 0;
+	for(int i = 0; i < getCpuCount(); i++) {
+		if(!this_thread->_isAllowedOn(i))
+			continue;
+		auto scheduler = &getCpuData(i)->scheduler;
+		auto load = scheduler->loadHint();
+		if(!new_scheduler || load < newLoad) {
+			new_scheduler = scheduler;
+			newLoad = load;
+		}
+	}
+	// helSetAffinity() ensures that the mask contains at least one CPU.
+	assert(new_scheduler);
+
 	getCpuData()->scheduler.update();
 	Scheduler::suspendCurrent();
 	this_thread->_runState = kRunDeferred;
@@ -35,20 +56,6 @@ void Thread::migrateCurrent() {
 
 	Scheduler::unassociate(this_thread);
 
-	size_t n = -1;
-	for (int i = 0; i < getCpuCount(); i++) {
-		bool bit = 0;
-		if ((static_cast<size_t>(i) + 7) / 8 < this_thread->_affinityMask.size())
-			bit = this_thread->_affinityMask[(i + 7) / 8] & (1 << (i % 8));
-
-		if (bit) {
-			n = i;
-			break;
-		}
-	}
-
-	auto new_scheduler = &getCpuData(n)->scheduler;
-
 	Scheduler::associate(this_thread, new_scheduler);
 	Scheduler::resume(this_thread);
 	localScheduler()->forceReschedule();
@@ -382,9 +389,9 @@ Thread::Thread(smarter::shared_ptr<Universe> universe,
 		_universe{std::move(universe)}, _addressSpace{std::move(address_space)},
 		_affinityMask{*kernelAlloc} {
 	// TODO: Generate real UUIDs instead of ascending numbers.
-	uint64_t id = globalThreadId.fetch_add(1, std::memory_order_relaxed) + 1;
+	_id = globalThreadId.fetch_add(1, std::memory_order_relaxed) + 1;
 	memset(_credentials, 0, 16);
-	memcpy(_credentials + 8, &id, sizeof(uint64_t));
+	memcpy(_credentials + 8, &_id, sizeof(uint64_t));
 }
 
 Thread::~Thread() {
@@ -474,10 +481,27 @@ void Thread::invoke() {
 	_userContext.migrate(getCpuData());
 	AddressSpace::activate(_addressSpace);
 	getCpuData()->executorContext = &_executorContext;
+	getCpuData()->profileThreadId = _id;
+	getCpuData()->profileUniverseId = _universe ? _universe->id() : 0;
 	switchExecutor(self);
 	restoreExecutor(&_executor);
 }
 
+bool Thread::isMigratableTo(CpuData *cpu) {
+	// The affinity mask is only changed by the thread itself, i.e., it is stable
+	// while the thread is waiting to be scheduled.
+	return _isAllowedOn(cpu->cpuIndex);
+}
+
+bool Thread::_isAllowedOn(size_t cpuIndex) {
+	if(_affinityMask.empty())
+		return true;
+
+	if(cpuIndex / 8 >= _affinityMask.size())
+		return false;
+	return _affinityMask[cpuIndex / 8] & (1 << (cpuIndex % 8));
+}
+
 void Thread::handlePreemption(IrqImageAccessor image) {
 	assert(!intsAreEnabled());
 	assert(getCurrentThread().get() == this);
@@ -15,20 +15,117 @@ PrecisionTimerEngine::PrecisionTimerEngine(ClockSource *clock, AlarmTracker *ala
 	_alarm->setSink(this);
 }
 
+// --------------------------------------------------------
+// TimerWheel
+// --------------------------------------------------------
+
+uint64_t TimerWheel::_insert(PrecisionTimerNode *timer) {
+	auto tick = timer->_deadline >> granularityShift;
+	assert(tick > _base);
+
+	// Find the finest level at which the timer is within the next numSlots - 1 slots.
+	int level = 0;
+	while(level < numLevels - 1
+			&& (tick >> (level * slotShift)) - (_base >> (level * slotShift)) >= numSlots)
+		level++;
+	auto shift = level * slotShift;
+	auto distance = (tick >> shift) - (_base >> shift);
+	assert(distance);
+	// Timers beyond the range of the wheel are re-inserted when their slot is processed.
+	if(distance >= numSlots)
+		distance = numSlots - 1;
+
+	auto slotTick = (_base >> shift) + distance;
+	auto slot = slotTick & (numSlots - 1);
+	_slots[level][slot].push_back(timer);
+	_occupied[level] |= uint64_t{1} << slot;
+	_numTimers++;
+	timer->_wheelLevel = level;
+	timer->_wheelSlot = slot;
+	return slotTick << shift;
+}
+
+void TimerWheel::_remove(PrecisionTimerNode *timer) {
+	auto &list = _slots[timer->_wheelLevel][timer->_wheelSlot];
+	list.erase(list.iterator_to(timer));
+	if(list.empty())
+		_occupied[timer->_wheelLevel] &= ~(uint64_t{1} << timer->_wheelSlot);
+	_numTimers--;
+}
+
+uint64_t TimerWheel::_nextTick() {
+	uint64_t next = UINT64_MAX;
+	for(int level = 0; level < numLevels; level++) {
+		auto occupied = _occupied[level];
+		if(!occupied)
+			continue;
+		auto shift = level * slotShift;
+		auto current = _base >> shift;
+
+		// The current slot is always empty; find the first occupied slot after it.
+		auto start = (current + 1) & (numSlots - 1);
+		auto rotated = (occupied >> start) | (start ? occupied << (numSlots - start) : 0);
+		auto distance = __builtin_ctzll(rotated) + 1;
+		next = frg::min(next, (current + distance) << shift);
+	}
+	return next;
+}
+
+void TimerWheel::_advance(uint64_t tick, TimerList &reached) {
+	while(true) {
+		auto next = _numTimers ? _nextTick() : UINT64_MAX;
+		if(next > tick) {
+			if(tick > _base)
+				_base = tick;
+			return;
+		}
+		_base = next;
+
+		// Process coarse levels first; their timers are re-inserted at finer levels.
+		for(int level = numLevels - 1; level >= 0; level--) {
+			auto slot = (_base >> (level * slotShift)) & (numSlots - 1);
+			if(!(_occupied[level] & (uint64_t{1} << slot)))
+				continue;
+
+			TimerList pending;
+			pending.splice(pending.end(), _slots[level][slot]);
+			_occupied[level] &= ~(uint64_t{1} << slot);
+			while(!pending.empty()) {
+				auto timer = pending.pop_front();
+				_numTimers--;
+				if((timer->_deadline >> granularityShift) <= _base) {
+					reached.push_back(timer);
+				}else{
+					_insert(timer);
+				}
+			}
+		}
+	}
+}
+
+// --------------------------------------------------------
+// PrecisionTimerEngine
+// --------------------------------------------------------
+
 void PrecisionTimerEngine::installTimer(PrecisionTimerNode *timer) {
 	assert(!timer->_engine);
 	timer->_engine = this;
 
 	auto irq_lock = frg::guard(&irqMutex());
-	auto lock = frg::guard(&_mutex);
-	assert(timer->_state == TimerState::none);
 
-	if(logTimers) {
-		auto current = _clock->currentNanos();
+	auto current = _clock->currentNanos();
+	if(logTimers)
 		infoLogger() << "thor: Setting timer at " << timer->_deadline
 				<< " (counter is " << current << ")" << frg::endlog;
+
+	if(timer->_deadline > current + wheelThreshold) {
+		_installIntoWheel(timer, current);
+		return;
 	}
 
+	auto lock = frg::guard(&_mutex);
+	assert(timer->_state == TimerState::none);
+
 //	infoLogger() << "thor: Active timers: " << _activeTimers << frg::endlog;
 
 	if(!timer->_cancelCb.try_set(timer->_cancelToken)) {
@@ -45,8 +142,85 @@ void PrecisionTimerEngine::installTimer(PrecisionTimerNode *timer) {
 	_progress();
 }
 
+void PrecisionTimerEngine::_installIntoWheel(PrecisionTimerNode *timer, uint64_t current) {
+	auto wheel = &getCpuData()->timerWheel;
+	timer->_wheel = wheel;
+
+	auto wheelLock = frg::guard(&wheel->_mutex);
+	assert(timer->_state == TimerState::none);
+
+	if(!timer->_cancelCb.try_set(timer->_cancelToken)) {
+		timer->_wasCancelled = true;
+		timer->_state = TimerState::retired;
+		WorkQueue::post(timer->_elapsed);
+		return;
+	}
+
+	if(!wheel->_numTimers)
+		wheel->_base = frg::max(wheel->_base, current >> TimerWheel::granularityShift);
+	auto slotNanos = wheel->_insert(timer) << TimerWheel::granularityShift;
+	timer->_state = TimerState::wheel;
+
+	// Only take the global lock if we need to re-arm the alarm.
+	if(slotNanos < _wheelDeadline.load(std::memory_order_relaxed)) {
+		auto lock = frg::guard(&_mutex);
+		if(slotNanos < _wheelDeadline.load(std::memory_order_relaxed)) {
+			_wheelDeadline.store(slotNanos, std::memory_order_relaxed);
+			_progress();
+		}
+	}
+}
+
+// Moves all timers whose tick is reached from the per-CPU wheels to the heap.
+void PrecisionTimerEngine::_collectWheels(uint64_t current) {
+	auto collectLock = frg::guard(&_collectMutex);
+	auto currentTick = current >> TimerWheel::granularityShift;
+
+	{
+		auto lock = frg::guard(&_mutex);
+		_wheelDeadline.store(UINT64_MAX, std::memory_order_relaxed);
+	}
+
+	for(int i = 0; i < getCpuCount(); i++) {
+		auto wheel = &getCpuData(i)->timerWheel;
+		auto wheelLock = frg::guard(&wheel->_mutex);
+
+		TimerWheel::TimerList reached;
+		wheel->_advance(currentTick, reached);
+
+		auto lock = frg::guard(&_mutex);
+		while(!reached.empty()) {
+			auto timer = reached.pop_front();
+			assert(timer->_state == TimerState::wheel);
+			_timerQueue.push(timer);
+			_activeTimers++;
+			timer->_state = TimerState::queued;
+		}
+
+		auto next = wheel->_nextTick();
+		if(next != UINT64_MAX) {
+			auto nextNanos = next << TimerWheel::granularityShift;
+			if(nextNanos < _wheelDeadline.load(std::memory_order_relaxed))
+				_wheelDeadline.store(nextNanos, std::memory_order_relaxed);
+		}
+	}
+}
+
 void PrecisionTimerEngine::cancelTimer(PrecisionTimerNode *timer) {
 	auto irq_lock = frg::guard(&irqMutex());
+
+	// Timers that are still in a wheel can be cancelled without taking the global lock.
+	if(auto wheel = timer->_wheel; wheel) {
+		auto wheelLock = frg::guard(&wheel->_mutex);
+		if(timer->_state == TimerState::wheel) {
+			wheel->_remove(timer);
+			timer->_wasCancelled = true;
+			timer->_state = TimerState::retired;
+			WorkQueue::post(timer->_elapsed);
+			return;
+		}
+	}
+
 	auto lock = frg::guard(&_mutex);
 
 	if(timer->_state == TimerState::queued) {
@@ -63,8 +237,14 @@ void PrecisionTimerEngine::cancelTimer(PrecisionTimerNode *timer) {
 
 void PrecisionTimerEngine::firedAlarm() {
 	auto irq_lock = frg::guard(&irqMutex());
-	auto lock = frg::guard(&_mutex);
 
+	auto current = _clock->currentNanos();
+	if(_wheelDeadline.load(std::memory_order_relaxed) <= current)
+		_collectWheels(current);
+
+	auto lock = frg::guard(&_mutex);
+	// The alarm is no longer armed after it fired.
+	_armedDeadline = 0;
 	_progress();
 }
 
@@ -78,10 +258,14 @@ void PrecisionTimerEngine::_progress() {
 			infoLogger() << "thor: Processing timers until " << current << frg::endlog;
 		while(true) {
 			if(_timerQueue.empty()) {
-				_alarm->arm(0);
+				// If the wheel deadline is already in the past, the alarm fires immediately.
+				auto wheelDeadline = _wheelDeadline.load(std::memory_order_relaxed);
+				_arm(wheelDeadline != UINT64_MAX ? wheelDeadline : 0);
 				return;
 			}
 
+			// Timers are ordered by their expiry; this fires all timers whose deadline passed
+			// up to the first one that can still be deferred.
 			if(_timerQueue.top()->_deadline > current)
 				break;
 
@@ -102,9 +286,17 @@ void PrecisionTimerEngine::_progress() {
 
 		// Setup the comparator and iterate if there was a race.
 		assert(!_timerQueue.empty());
-		_alarm->arm(_timerQueue.top()->_deadline);
+		_arm(frg::min(_timerQueue.top()->_expiry(),
+				_wheelDeadline.load(std::memory_order_relaxed)));
 		current = _clock->currentNanos();
-	} while(_timerQueue.top()->_deadline <= current);
+	} while(_timerQueue.top()->_expiry() <= current);
+}
+
+void PrecisionTimerEngine::_arm(uint64_t deadline) {
+	if(deadline == _armedDeadline)
+		return;
+	_armedDeadline = deadline;
+	_alarm->arm(deadline);
 }
 
 ClockSource *systemClockSource() {
@@ -4,34 +4,167 @@ namespace thor {
 
 namespace {
 	constexpr bool logCleanup = false;
+
+	constexpr size_t initialTableCapacity = 16;
+
+	std::atomic<uint64_t> globalUniverseId;
 }
 
 Universe::Universe()
-: _descriptorMap{frg::hash<Handle>{}, *kernelAlloc}, _nextHandle{1} { }
+: _id{globalUniverseId.fetch_add(1, std::memory_order_relaxed) + 1},
+		_table{_allocateTable(initialTableCapacity)}, _nextHandle{1} { }
 
 Universe::~Universe() {
 	if(logCleanup)
 		infoLogger() << "\e[31mthor: Universe is deallocated\e[39m" << frg::endlog;
+
+	// There are no concurrent readers anymore.
+	auto table = _table.load(std::memory_order_relaxed);
+	for(size_t i = 0; i < table->capacity; i++) {
+		auto node = table->slots()[i].node.load(std::memory_order_relaxed);
+		if(node)
+			frg::destruct(*kernelAlloc, node);
+	}
+	_freeTable(table);
 }
 
 Handle Universe::attachDescriptor(Guard &guard, AnyDescriptor descriptor) {
 	assert(guard.protects(&lock));
 
+	// Keep the load factor (including deleted slots) below 1/2 such that probing terminates.
+	auto table = _table.load(std::memory_order_relaxed);
+	if(2 * (_numUsed + 1) > table->capacity) {
+		auto capacity = initialTableCapacity;
+		while(capacity < 4 * (_numLive + 1))
+			capacity *= 2;
+		_rehash(capacity);
+		table = _table.load(std::memory_order_relaxed);
+	}
+
 	Handle handle = _nextHandle++;
-	_descriptorMap.insert(handle, std::move(descriptor));
+	auto node = frg::construct<DescriptorNode>(*kernelAlloc, std::move(descriptor));
+
+	// Handles are never reused, so we can take the first empty or deleted slot.
+	auto mask = table->capacity - 1;
+	for(size_t i = handle & mask; ; i = (i + 1) & mask) {
+		auto &slot = table->slots()[i];
+		auto current = slot.handle.load(std::memory_order_relaxed);
+		if(current != emptySlot && current != deletedSlot)
+			continue;
+		if(current == emptySlot)
+			_numUsed++;
+		// Publish the node before the handle; the release on node orders it after
+		// the deletedSlot store of a previous occupant (see _find()).
+		slot.node.store(node, std::memory_order_release);
+		slot.handle.store(handle, std::memory_order_release);
+		break;
+	}
+	_numLive++;
 	return handle;
 }
 
 AnyDescriptor *Universe::getDescriptor(Guard &guard, Handle handle) {
 	assert(guard.protects(&lock));
 
-	return _descriptorMap.get(handle);
+	return _find(handle);
+}
+
+AnyDescriptor *Universe::getDescriptor(ReadGuard &, Handle handle) {
+	return _find(handle);
 }
 
 frg::optional<AnyDescriptor> Universe::detachDescriptor(Guard &guard, Handle handle) {
 	assert(guard.protects(&lock));
 
-	return _descriptorMap.remove(handle);
+	if(handle <= 0)
+		return frg::null_opt;
+
+	auto table = _table.load(std::memory_order_relaxed);
+	auto mask = table->capacity - 1;
+	for(size_t i = handle & mask; ; i = (i + 1) & mask) {
+		auto &slot = table->slots()[i];
+		auto current = slot.handle.load(std::memory_order_relaxed);
+		if(current == emptySlot)
+			return frg::null_opt;
+		if(current != handle)
+			continue;
+
+		auto node = slot.node.load(std::memory_order_relaxed);
+		slot.node.store(nullptr, std::memory_order_release);
+		slot.handle.store(deletedSlot, std::memory_order_release);
+		_numLive--;
+
+		// Wait for readers that might still access the node.
+		rcuSynchronize();
+
+		AnyDescriptor descriptor = std::move(node->descriptor);
+		frg::destruct(*kernelAlloc, node);
+		return descriptor;
+	}
+}
+
+// Lookups can run concurrently to attachDescriptor() and detachDescriptor().
+AnyDescriptor *Universe::_find(Handle handle) {
+	if(handle <= 0)
+		return nullptr;
+
+	auto table = _table.load(std::memory_order_acquire);
+	auto mask = table->capacity - 1;
+	for(size_t i = handle & mask; ; i = (i + 1) & mask) {
+		auto &slot = table->slots()[i];
+		auto current = slot.handle.load(std::memory_order_acquire);
+		if(current == emptySlot)
+			return nullptr;
+		if(current != handle)
+			continue;
+
+		auto node = slot.node.load(std::memory_order_acquire);
+		// If the slot was reused for a different handle, the node belongs to that handle.
+		if(!node || slot.handle.load(std::memory_order_relaxed) != handle)
+			return nullptr;
+		return &node->descriptor;
+	}
+}
+
+void Universe::_rehash(size_t capacity) {
+	auto oldTable = _table.load(std::memory_order_relaxed);
+	auto newTable = _allocateTable(capacity);
+
+	auto mask = capacity - 1;
+	for(size_t i = 0; i < oldTable->capacity; i++) {
+		auto &oldSlot = oldTable->slots()[i];
+		auto handle = oldSlot.handle.load(std::memory_order_relaxed);
+		if(handle == emptySlot || handle == deletedSlot)
+			continue;
+
+		for(size_t j = handle & mask; ; j = (j + 1) & mask) {
+			auto &slot = newTable->slots()[j];
+			if(slot.handle.load(std::memory_order_relaxed) != emptySlot)
+				continue;
+			slot.node.store(oldSlot.node.load(std::memory_order_relaxed),
+					std::memory_order_relaxed);
+			slot.handle.store(handle, std::memory_order_relaxed);
+			break;
+		}
+	}
+	_numUsed = _numLive;
+
+	_table.store(newTable, std::memory_order_release);
+	rcuSynchronize();
+	_freeTable(oldTable);
+}
+
+Universe::Table *Universe::_allocateTable(size_t capacity) {
+	assert(!(capacity & (capacity - 1)));
+	auto memory = kernelAlloc->allocate(sizeof(Table) + capacity * sizeof(Slot));
+	auto table = new (memory) Table{capacity};
+	for(size_t i = 0; i < capacity; i++)
+		new (&table->slots()[i]) Slot{};
+	return table;
+}
+
+void Universe::_freeTable(Table *table) {
+	kernelAlloc->free(table);
 }
 
 } // namespace thor
@@ -0,0 +1,148 @@
+#include <thor-internal/cpu-data.hpp>
+#include <thor-internal/kernel_heap.hpp>
+#include <thor-internal/wait-set.hpp>
+
+namespace thor {
+
+WaitSet::~WaitSet() {
+	// Waiters keep the WaitSet alive.
+	assert(_waitQueue.empty());
+
+	// Entries that are still armed destruct themselves once their source triggers.
+	while(!_readyList.empty())
+		frg::destruct(*kernelAlloc, _readyList.pop_front());
+}
+
+void WaitSet::addIrq(smarter::shared_ptr<IrqObject> irq, uint64_t sequence,
+		uintptr_t context) {
+	auto entry = frg::construct<Entry>(*kernelAlloc);
+	entry->type = SourceType::irq;
+	entry->set = selfPtr.lock();
+	entry->irq = std::move(irq);
+	entry->sequence = sequence;
+	entry->result.context = context;
+	_arm(entry);
+}
+
+void WaitSet::addEvent(smarter::shared_ptr<OneshotEvent> event, uint64_t sequence,
+		uintptr_t context) {
+	auto entry = frg::construct<Entry>(*kernelAlloc);
+	entry->type = SourceType::oneshotEvent;
+	entry->set = selfPtr.lock();
+	entry->oneshotEvent = std::move(event);
+	entry->sequence = sequence;
+	entry->result.context = context;
+	_arm(entry);
+}
+
+void WaitSet::addEvent(smarter::shared_ptr<BitsetEvent> event, uint64_t sequence,
+		uintptr_t context) {
+	auto entry = frg::construct<Entry>(*kernelAlloc);
+	entry->type = SourceType::bitsetEvent;
+	entry->set = selfPtr.lock();
+	entry->bitsetEvent = std::move(event);
+	entry->sequence = sequence;
+	entry->result.context = context;
+	_arm(entry);
+}
+
+void WaitSet::submitAwait(AwaitWaitSetNode *node) {
+	EntryList rearm;
+	EntryList retire;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		if(_readyList.empty()) {
+			_waitQueue.push_back(node);
+			return;
+		}
+
+		_fill(node, rearm, retire);
+	}
+
+	WorkQueue::post(node->_awaited);
+	_process(rearm, retire);
+}
+
+void WaitSet::_arm(Entry *entry) {
+	// The entry's work is short; it only moves the entry to the ready list.
+	entry->worklet.setup(&WaitSet::_triggered, WorkQueue::generalQueue());
+	if(entry->type == SourceType::irq) {
+		entry->irqNode.setup(&entry->worklet);
+		entry->irq->submitAwait(&entry->irqNode, entry->sequence);
+	}else if(entry->type == SourceType::oneshotEvent) {
+		entry->eventNode.setup(&entry->worklet);
+		entry->oneshotEvent->submitAwait(&entry->eventNode, entry->sequence);
+	}else{
+		assert(entry->type == SourceType::bitsetEvent);
+		entry->eventNode.setup(&entry->worklet);
+		entry->bitsetEvent->submitAwait(&entry->eventNode, entry->sequence);
+	}
+}
+
+void WaitSet::_triggered(Worklet *worklet) {
+	auto entry = frg::container_of(worklet, &Entry::worklet);
+	if(entry->type == SourceType::irq) {
+		entry->result.error = entry->irqNode.error();
+		entry->result.sequence = entry->irqNode.sequence();
+		entry->result.bitset = 0;
+	}else{
+		entry->result.error = entry->eventNode.error();
+		entry->result.sequence = entry->eventNode.sequence();
+		entry->result.bitset = entry->eventNode.bitset();
+	}
+
+	auto set = entry->set.lock();
+	if(!set) {
+		frg::destruct(*kernelAlloc, entry);
+		return;
+	}
+	set->_pushReady(entry);
+}
+
+void WaitSet::_pushReady(Entry *entry) {
+	AwaitWaitSetNode *node = nullptr;
+	EntryList rearm;
+	EntryList retire;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		_readyList.push_back(entry);
+		if(_waitQueue.empty())
+			return;
+
+		node = _waitQueue.pop_front();
+		_fill(node, rearm, retire);
+	}
+
+	WorkQueue::post(node->_awaited);
+	_process(rearm, retire);
+}
+
+void WaitSet::_fill(AwaitWaitSetNode *node, EntryList &rearm, EntryList &retire) {
+	node->_numEvents = 0;
+	while(!_readyList.empty() && node->_numEvents < maxWaitSetEvents) {
+		auto entry = _readyList.pop_front();
+		node->_events[node->_numEvents++] = entry->result;
+
+		// A triggered OneshotEvent never triggers again (and rejects further sequences).
+		if(entry->result.error != Error::success
+				|| (entry->type == SourceType::oneshotEvent && entry->result.sequence > 1)) {
+			retire.push_back(entry);
+		}else{
+			entry->sequence = entry->result.sequence;
+			rearm.push_back(entry);
+		}
+	}
+}
+
+void WaitSet::_process(EntryList &rearm, EntryList &retire) {
+	while(!rearm.empty())
+		_arm(rearm.pop_front());
+	while(!retire.empty())
+		frg::destruct(*kernelAlloc, retire.pop_front());
+}
+
+} // namespace thor
@@ -20,12 +20,8 @@ void WorkQueue::post(Worklet *worklet) {
 		wq->_localQueue.push_back(worklet);
 		wq->_localPosted.store(true, std::memory_order_relaxed);
 	}else{
-		auto irqLock = frg::guard(&irqMutex());
-		auto lock = frg::guard(&wq->_mutex);
-
-		invokeWakeup = wq->_lockedQueue.empty();
-		wq->_lockedQueue.push_back(worklet);
-		wq->_lockedPosted.store(true, std::memory_order_relaxed);
+		wq->_postRemote(worklet);
+		return;
 	}
 
 	if(invokeWakeup)
@@ -50,13 +46,8 @@ bool WorkQueue::enter(Worklet *worklet) {
 		wq->_localQueue.push_back(worklet);
 		wq->_localPosted.store(true, std::memory_order_relaxed);
 	}else{
-		// Same logic as in post().
-		auto irqLock = frg::guard(&irqMutex());
-		auto lock = frg::guard(&wq->_mutex);
-
-		invokeWakeup = wq->_lockedQueue.empty();
-		wq->_lockedQueue.push_back(worklet);
-		wq->_lockedPosted.store(true, std::memory_order_relaxed);
+		wq->_postRemote(worklet);
+		return false;
 	}
 
 	if(invokeWakeup)
@@ -64,11 +55,24 @@ bool WorkQueue::enter(Worklet *worklet) {
 	return false;
 }
 
+void WorkQueue::_postRemote(Worklet *worklet) {
+	// Release ordering publishes the Worklet to run().
+	auto head = _remoteHead.load(std::memory_order_relaxed);
+	do {
+		worklet->_remoteNext = head;
+	} while(!_remoteHead.compare_exchange_weak(head, worklet,
+			std::memory_order_release, std::memory_order_relaxed));
+
+	// Only the push that makes the queue non-empty needs to wake up the WQ.
+	if(!head)
+		wakeup();
+}
+
 bool WorkQueue::check() {
 	// _localPosted is only accessed from the thread/fiber that runs the WQ.
-	// For _lockedPosted, see the comment in the header file.
+	// For _remoteHead, see the comment in the header file.
 	return _localPosted.load(std::memory_order_relaxed)
-			|| _lockedPosted.load(std::memory_order_relaxed);
+			|| _remoteHead.load(std::memory_order_relaxed);
 }
 
 void WorkQueue::run() {
@@ -91,12 +95,23 @@ void WorkQueue::run() {
 
 		pending.splice(pending.end(), _localQueue);
 		_localPosted.store(false, std::memory_order_relaxed);
+	}
 
-		if(_lockedPosted.load(std::memory_order_relaxed)) {
-			auto lock = frg::guard(&_mutex);
+	// Take all remote Worklets at once; they are in LIFO order.
+	if(_remoteHead.load(std::memory_order_relaxed)) {
+		auto chain = _remoteHead.exchange(nullptr, std::memory_order_acquire);
 
-			pending.splice(pending.end(), _lockedQueue);
-			_lockedPosted.store(false, std::memory_order_relaxed);
+		Worklet *reversed = nullptr;
+		while(chain) {
+			auto next = chain->_remoteNext;
+			chain->_remoteNext = reversed;
+			reversed = chain;
+			chain = next;
+		}
+		while(reversed) {
+			auto next = reversed->_remoteNext;
+			pending.push_back(reversed);
+			reversed = next;
 		}
 	}
 
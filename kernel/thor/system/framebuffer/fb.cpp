@@ -33,6 +33,9 @@ struct FbDisplay final : TextDisplay {
 		_window = reinterpret_cast<uint32_t *>(ptr);
 	}
 
+	// Allocates the shadow of the screen's cells; requires the kernel heap.
+	void enableShadow();
+
 	int getWidth() override;
 	int getHeight() override;
 	
@@ -41,14 +44,49 @@ struct FbDisplay final : TextDisplay {
 	void setBlanks(unsigned int x, unsigned int y, int count, int bg) override;
 
 private:
+	// What is currently displayed in a cell. Used to skip cells that do not change,
+	// e.g., when BootScreen redraws all lines after the log scrolls.
+	struct Cell {
+		char c;
+		int8_t fg;
+		int8_t bg;
+
+		bool operator== (const Cell &) const = default;
+	};
+
+	// Each font row (i.e., one byte of fontBitmap) rasterized for one fg/bg pair.
+	struct RowCache {
+		int fg;
+		int bg;
+		uint32_t rows[256][fontWidth];
+	};
+
+	const RowCache *_getRows(int fg, int bg);
+	void _drawCell(unsigned int x, unsigned int y, Cell cell);
 	void _clearScreen(uint32_t rgb_color);
 
 	volatile uint32_t *_window;
 	unsigned int _width;
 	unsigned int _height;
 	size_t _pitch;
+
+	Cell *_shadow = nullptr;
+
+	// Boot logs usually use only a few colors.
+	static constexpr int numRowCaches = 4;
+	RowCache _rowCaches[numRowCaches];
+	int _numValidCaches = 0;
+	int _nextCache = 0;
 };
 
+void FbDisplay::enableShadow() {
+	auto n = getWidth() * getHeight();
+	_shadow = reinterpret_cast<Cell *>(kernelAlloc->allocate(n * sizeof(Cell)));
+	// Characters below 32 are never stored, i.e., all cells are redrawn once.
+	for(int i = 0; i < n; i++)
+		_shadow[i] = Cell{0, 0, 0};
+}
+
 int FbDisplay::getWidth() {
 	return _width / fontWidth;
 }
@@ -59,22 +97,68 @@ int FbDisplay::getHeight() {
 
 void FbDisplay::setChars(unsigned int x, unsigned int y,
 		const char *c, int count, int fg, int bg) {
-	renderChars((void *)_window, _pitch, x, y, c, count, fg, bg,
-			std::integral_constant<int, fontWidth>{},
-			std::integral_constant<int, fontHeight>{});
+	for(int k = 0; k < count; k++) {
+		char dc = (c[k] >= 32 && c[k] <= 127) ? c[k] : 127;
+		// The foreground color of blanks is irrelevant.
+		_drawCell(x + k, y, Cell{dc, static_cast<int8_t>(dc == ' ' ? 0 : fg),
+				static_cast<int8_t>(bg)});
+	}
 }
 
 void FbDisplay::setBlanks(unsigned int x, unsigned int y, int count, int bg) {
-	auto bg_rgb = (bg < 0) ? defaultBg : rgbColor[bg]; 
+	for(int k = 0; k < count; k++)
+		_drawCell(x + k, y, Cell{' ', 0, static_cast<int8_t>(bg)});
+}
 
-	auto dest_line = _window + y * fontHeight * _pitch + x * fontWidth;
+const FbDisplay::RowCache *FbDisplay::_getRows(int fg, int bg) {
+	for(int i = 0; i < _numValidCaches; i++) {
+		if(_rowCaches[i].fg == fg && _rowCaches[i].bg == bg)
+			return &_rowCaches[i];
+	}
+
+	auto cache = &_rowCaches[_nextCache];
+	_nextCache = (_nextCache + 1) % numRowCaches;
+	if(_numValidCaches < numRowCaches)
+		_numValidCaches++;
+
+	auto fg_rgb = rgbColor[fg];
+	auto bg_rgb = (bg < 0) ? defaultBg : rgbColor[bg];
+	cache->fg = fg;
+	cache->bg = bg;
+	for(int bits = 0; bits < 256; bits++) {
+		for(size_t j = 0; j < fontWidth; j++)
+			cache->rows[bits][j] = (bits & (1 << ((fontWidth - 1) - j))) ? fg_rgb : bg_rgb;
+	}
+	return cache;
+}
+
+void FbDisplay::_drawCell(unsigned int x, unsigned int y, Cell cell) {
+	if(_shadow) {
+		auto &current = _shadow[y * getWidth() + x];
+		if(current == cell)
+			return;
+		current = cell;
+	}
+
+	auto cache = _getRows(cell.fg, cell.bg);
+	auto glyph = &fontBitmap[(cell.c - 32) * fontHeight];
+
+	// Copy entire rows of the glyph with 64-bit stores;
+	// this is much faster than per-pixel stores to write-combining memory.
+	auto dest = _window + y * fontHeight * _pitch + x * fontWidth;
+	bool wide = !(reinterpret_cast<uintptr_t>(dest) & 7) && !(_pitch & 1);
 	for(size_t i = 0; i < fontHeight; i++) {
-		auto dest = dest_line;
-		for(int k = 0; k < count; k++) {
+		auto row = cache->rows[glyph[i]];
+		if(wide) {
+			auto wide_dest = reinterpret_cast<volatile uint64_t *>(dest);
+			auto wide_row = reinterpret_cast<const uint64_t *>(row);
+			for(size_t j = 0; j < fontWidth / 2; j++)
+				wide_dest[j] = wide_row[j];
+		}else{
 			for(size_t j = 0; j < fontWidth; j++)
-				*dest++ = bg_rgb;
+				dest[j] = row[j];
 		}
-		dest_line += _pitch;
+		dest += _pitch;
 	}
 }
 
@@ -128,6 +212,7 @@ void transitionBootFb() {
 
 	// Transition to the kernel mapping window.
 	bootDisplay->setWindow(window);
+	bootDisplay->enableShadow();
 
 	assert(!(bootInfo->address & (kPageSize - 1)));
 	bootInfo->memory = smarter::allocate_shared<HardwareMemory>(*kernelAlloc,
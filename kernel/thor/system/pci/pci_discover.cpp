@@ -1,7 +1,9 @@
 #include <algorithm>
+#include <atomic>
 #include <frg/algorithm.hpp>
 #include <hw.frigg_bragi.hpp>
 #include <mbus.frigg_pb.hpp>
+#include <thor-internal/cpu-data.hpp>
 #include <thor-internal/fiber.hpp>
 #include <thor-internal/io.hpp>
 #include <thor-internal/kernel_heap.hpp>
@@ -11,6 +13,8 @@
 #include <thor-internal/pci/pci.hpp>
 #include <thor-internal/stream.hpp>
 #include <arch/mem_space.hpp>
+#include <async/mutex.hpp>
+#include <async/oneshot-event.hpp>
 
 #include <bragi/helpers-all.hpp>
 #include <bragi/helpers-frigg.hpp>
@@ -56,6 +60,17 @@ initgraph::Stage *getDevicesEnumeratedStage() {
 }
 
 namespace {
+	frg::string<KernelAlloc> msiName(PciDevice *device, unsigned int index) {
+		return frg::string<KernelAlloc>{*kernelAlloc, "pci-msi."}
+				+ frg::to_allocated_string(*kernelAlloc, device->bus)
+				+ frg::string<KernelAlloc>{*kernelAlloc, "-"}
+				+ frg::to_allocated_string(*kernelAlloc, device->slot)
+				+ frg::string<KernelAlloc>{*kernelAlloc, "-"}
+				+ frg::to_allocated_string(*kernelAlloc, device->function)
+				+ frg::string<KernelAlloc>{*kernelAlloc, "."}
+				+ frg::to_allocated_string(*kernelAlloc, index);
+	}
+
 	coroutine<bool> handleReq(LaneHandle lane, smarter::shared_ptr<PciDevice> device) {
 		auto [acceptError, conversation] = co_await AcceptSender{lane};
 		if(acceptError == Error::endOfLane)
@@ -215,14 +230,7 @@ namespace {
 
 			// Allocate the MSI.
 			auto interrupt = device->parentBus->msiController->allocateMsiPin(
-					frg::string<KernelAlloc>{*kernelAlloc, "pci-msi."}
-					+ frg::to_allocated_string(*kernelAlloc, device->bus)
-					+ frg::string<KernelAlloc>{*kernelAlloc, "-"}
-					+ frg::to_allocated_string(*kernelAlloc, device->slot)
-					+ frg::string<KernelAlloc>{*kernelAlloc, "-"}
-					+ frg::to_allocated_string(*kernelAlloc, device->function)
-					+ frg::string<KernelAlloc>{*kernelAlloc, "."}
-					+ frg::to_allocated_string(*kernelAlloc, req->index()));
+					msiName(device.get(), req->index()), -1);
 			if(!interrupt) {
 				infoLogger() << "thor: Could not allocate interrupt vector for MSI" << frg::endlog;
 
@@ -238,14 +246,7 @@ namespace {
 
 			// Obtain an IRQ object for the interrupt.
 			auto object = smarter::allocate_shared<GenericIrqObject>(*kernelAlloc,
-					frg::string<KernelAlloc>{*kernelAlloc, "pci-msi."}
-					+ frg::to_allocated_string(*kernelAlloc, device->bus)
-					+ frg::string<KernelAlloc>{*kernelAlloc, "-"}
-					+ frg::to_allocated_string(*kernelAlloc, device->slot)
-					+ frg::string<KernelAlloc>{*kernelAlloc, "-"}
-					+ frg::to_allocated_string(*kernelAlloc, device->function)
-					+ frg::string<KernelAlloc>{*kernelAlloc, "."}
-					+ frg::to_allocated_string(*kernelAlloc, req->index()));
+					msiName(device.get(), req->index()));
 			IrqPin::attachSink(interrupt, object.get());
 
 			device->setupMsi(interrupt, req->index());
@@ -262,6 +263,88 @@ namespace {
 			auto descError = co_await PushDescriptorSender{conversation, IrqDescriptor{object}};
 			// TODO: improve error handling here.
 			assert(descError == Error::success);
+		}else if(preamble.id() == bragi::message_id<managarm::hw::InstallMsiRangeRequest>) {
+			auto req = bragi::parse_head_only<managarm::hw::InstallMsiRangeRequest>(
+					reqBuffer, *kernelAlloc);
+			if (!req) {
+				infoLogger() << "thor: Closing lane due to illegal HW request." << frg::endlog;
+				co_return true;
+			}
+
+			if ((device->msiIndex < 0 && device->msixIndex < 0)
+					|| !device->parentBus->msiController
+					|| !req->count()
+					|| req->index() >= device->numMsis
+					|| req->count() > device->numMsis - req->index()) {
+				managarm::hw::SvrResponse<KernelAlloc> resp{*kernelAlloc};
+				resp.set_error(managarm::hw::Errors::ILLEGAL_ARGUMENTS);
+
+				auto [headError, tailError] = co_await sendResponse(conversation, std::move(resp));
+				// TODO: improve error handling here.
+				assert(headError == Error::success);
+				assert(tailError == Error::success);
+				co_return true;
+			}
+
+			// Allocate as many vectors as possible; vector i goes to CPU (cpu + i) mod #CPUs.
+			frg::vector<smarter::shared_ptr<GenericIrqObject>, KernelAlloc> objects{*kernelAlloc};
+			int firstCpu = req->cpu() < 0 ? 0 : req->cpu();
+			for (uint32_t i = 0; i < req->count(); ++i) {
+				auto index = req->index() + i;
+				auto interrupt = device->parentBus->msiController->allocateMsiPin(
+						msiName(device.get(), index), (firstCpu + i) % getCpuCount());
+				if (!interrupt) {
+					infoLogger() << "thor: Could only allocate " << i << " of "
+							<< req->count() << " MSIs" << frg::endlog;
+					break;
+				}
+
+				auto object = smarter::allocate_shared<GenericIrqObject>(*kernelAlloc,
+						msiName(device.get(), index));
+				IrqPin::attachSink(interrupt, object.get());
+				device->setupMsi(interrupt, index);
+				objects.push(std::move(object));
+			}
+
+			managarm::hw::SvrResponse<KernelAlloc> resp{*kernelAlloc};
+			if (objects.empty()) {
+				resp.set_error(managarm::hw::Errors::RESOURCE_EXHAUSTION);
+			}else{
+				resp.set_error(managarm::hw::Errors::SUCCESS);
+				resp.set_num_msis(objects.size());
+			}
+
+			auto [headError, tailError] = co_await sendResponse(conversation, std::move(resp));
+			// TODO: improve error handling here.
+			assert(headError == Error::success);
+			assert(tailError == Error::success);
+
+			for (auto &object : objects) {
+				auto descError = co_await PushDescriptorSender{conversation, IrqDescriptor{object}};
+				// TODO: improve error handling here.
+				assert(descError == Error::success);
+			}
+		}else if(preamble.id() == bragi::message_id<managarm::hw::SetMsiMaskRequest>) {
+			auto req = bragi::parse_head_only<managarm::hw::SetMsiMaskRequest>(
+					reqBuffer, *kernelAlloc);
+			if (!req) {
+				infoLogger() << "thor: Closing lane due to illegal HW request." << frg::endlog;
+				co_return true;
+			}
+
+			managarm::hw::SvrResponse<KernelAlloc> resp{*kernelAlloc};
+			if (req->index() >= device->numMsis) {
+				resp.set_error(managarm::hw::Errors::OUT_OF_BOUNDS);
+			}else if (!device->setDriverMask(req->index(), req->masked())) {
+				resp.set_error(managarm::hw::Errors::ILLEGAL_ARGUMENTS);
+			}else{
+				resp.set_error(managarm::hw::Errors::SUCCESS);
+			}
+
+			auto [headError, tailError] = co_await sendResponse(conversation, std::move(resp));
+			// TODO: improve error handling here.
+			assert(headError == Error::success);
+			assert(tailError == Error::success);
 		}else if(preamble.id() == bragi::message_id<managarm::hw::ClaimDeviceRequest>) {
 			auto req = bragi::parse_head_only<managarm::hw::ClaimDeviceRequest>(reqBuffer, *kernelAlloc);
 
@@ -732,16 +815,59 @@ void PciDevice::enableIrq() {
 			kPciCommand, command & ~uint16_t{0x400});
 }
 
+void PciDevice::prepareMsis() {
+	if (msisPrepared_ || msixIndex < 0)
+		return;
+	msisPrepared_ = true;
+
+	auto io = parentBus->io;
+	auto offset = caps[msixIndex].offset;
+
+	// Map the MSI-X table. This is done after the BARs were allocated.
+	auto tableInfo = io->readConfigWord(parentBus, slot, function, offset + 4);
+	auto tableBar = tableInfo & 0x7;
+	auto tableOffset = tableInfo & 0xFFFF'FFF8;
+	assert(tableBar < 6);
+
+	auto bar = bars[tableBar];
+	assert(bar.type == PciBar::kBarMemory);
+	auto mappingDisp = (bar.address + tableOffset) & (kPageSize - 1);
+	auto mappingSize = (mappingDisp + numMsis * 16 + kPageSize - 1)
+			& ~(kPageSize - 1);
+
+	auto window = KernelVirtualMemory::global().allocate(0x10000);
+	for(uintptr_t page = 0; page < mappingSize; page += kPageSize)
+		KernelPageSpace::global().mapSingle4k(
+				reinterpret_cast<uintptr_t>(window) + page,
+				(bar.address + tableOffset + page) & ~(kPageSize - 1),
+				page_access::write, CachingMode::null);
+	msixMapping = reinterpret_cast<std::byte *>(window) + mappingDisp;
+
+	// Mask all MSIs.
+	msixMaskState.resize(numMsis);
+	for(unsigned int i = 0; i < numMsis; ++i) {
+		auto space = arch::mem_space{msixMapping}.subspace(i * 16);
+		space.store(msixVectorControl,
+				space.load(msixVectorControl) | 1);
+	}
+}
+
 void PciDevice::setupMsi(MsiPin *msi, size_t index) {
 	auto io = parentBus->io;
 
+	prepareMsis();
+
+	msi->setOwner(this, index);
+
 	if (msixIndex >= 0) {
 		// Setup the MSI-X table.
 		auto space = arch::mem_space{msixMapping}.subspace(index * 16);
 		space.store(msixMessageAddress, msi->getMessageAddress());
 		space.store(msixMessageData, msi->getMessageData());
-		space.store(msixVectorControl,
-				space.load(msixVectorControl) & ~uint32_t{1});
+		// Keep the vector masked if the driver masked it.
+		if (!__atomic_load_n(&msixMaskState[index], __ATOMIC_RELAXED))
+			space.store(msixVectorControl,
+					space.load(msixVectorControl) & ~uint32_t{1});
 	} else {
 		assert(msiIndex >= 0);
 
@@ -752,13 +878,36 @@ void PciDevice::setupMsi(MsiPin *msi, size_t index) {
 		auto msgControl = io->readConfigHalf(parentBus,
 				slot, function, offset + 2);
 
-		bool is64Capable = msgControl & (1 << 7);
-
 		msgControl &= ~0x0071; // Disable MSI by default, enable only 1 message
 
 		io->writeConfigHalf(parentBus,
 				slot, function, offset + 2, msgControl);
 
+		programMsi(msi, index);
+	}
+}
+
+void PciDevice::programMsi(MsiPin *msi, size_t index) {
+	auto io = parentBus->io;
+
+	if (msixIndex >= 0) {
+		// Mask the vector while the message is inconsistent.
+		auto space = arch::mem_space{msixMapping}.subspace(index * 16);
+		auto control = space.load(msixVectorControl);
+		space.store(msixVectorControl, control | uint32_t{1});
+		space.store(msixMessageAddress, msi->getMessageAddress());
+		space.store(msixMessageData, msi->getMessageData());
+		space.store(msixVectorControl, control);
+	} else {
+		assert(msiIndex >= 0);
+		assert(!index);
+		auto offset = caps[msiIndex].offset;
+
+		auto msgControl = io->readConfigHalf(parentBus,
+				slot, function, offset + 2);
+
+		bool is64Capable = msgControl & (1 << 7);
+
 		io->writeConfigWord(parentBus,
 				slot, function, offset + 4, msi->getMessageAddress() & 0xFFFFFFFF);
 
@@ -777,9 +926,53 @@ void PciDevice::setupMsi(MsiPin *msi, size_t index) {
 	}
 }
 
+namespace {
+	constexpr uint8_t irqMaskBit = 1;
+	constexpr uint8_t driverMaskBit = 2;
+}
+
+bool PciDevice::maskMsi(size_t index, bool masked) {
+	// TODO: Support the optional per-vector masking of plain MSIs.
+	if (msixIndex < 0)
+		return false;
+
+	return updateMsixMask_(index, irqMaskBit, masked);
+}
+
+bool PciDevice::setDriverMask(size_t index, bool masked) {
+	if (msixIndex < 0)
+		return false;
+
+	prepareMsis();
+
+	return updateMsixMask_(index, driverMaskBit, masked);
+}
+
+// Both the IRQ path and the driver mask vectors; update the bits atomically.
+bool PciDevice::updateMsixMask_(size_t index, uint8_t bit, bool masked) {
+	uint8_t state;
+	if (masked) {
+		state = __atomic_or_fetch(&msixMaskState[index], bit, __ATOMIC_RELAXED);
+	} else {
+		state = __atomic_and_fetch(&msixMaskState[index],
+				static_cast<uint8_t>(~bit), __ATOMIC_RELAXED);
+	}
+
+	auto space = arch::mem_space{msixMapping}.subspace(index * 16);
+	auto control = space.load(msixVectorControl);
+	if (state) {
+		space.store(msixVectorControl, control | uint32_t{1});
+	} else {
+		space.store(msixVectorControl, control & ~uint32_t{1});
+	}
+	return true;
+}
+
 void PciDevice::enableMsi() {
 	auto io = parentBus->io;
 
+	prepareMsis();
+
 	enableIrq();
 
 	if (msixIndex >= 0) {
@@ -828,6 +1021,16 @@ size_t computeBarLength(uintptr_t mask) {
 
 frg::manual_box<frg::vector<PciBus *, KernelAlloc>> enumerationQueue;
 
+namespace {
+	// Serializes the parts of the enumeration that are not safe to run concurrently:
+	// updates of allDevices and the creation of IRQ routers (which evaluates AML).
+	async::mutex enumerationMutex;
+
+	// Raised once the hierarchies below all root buses are enumerated.
+	async::oneshot_event rootsEnumerated;
+	std::atomic<size_t> rootsPending{0};
+}
+
 void readEntityBars(PciEntity *entity, int nBars) {
 	auto bars = entity->getBars();
 	auto bus = entity->parentBus;
@@ -1140,41 +1343,14 @@ void checkPciFunction(PciBus *bus, uint32_t slot, uint32_t function,
 			}
 		}
 
-		// Setup MSI-X.
+		// The MSI-X table is only mapped once a driver uses MSIs (see prepareMsis()).
 		if(device->msixIndex >= 0) {
 			auto offset = device->caps[device->msixIndex].offset;
 
 			auto msgControl = io->readConfigHalf(bus, slot, function, offset + 2);
-			device->numMsis = (msgControl & 0x7F) + 1;
+			device->numMsis = (msgControl & 0x7FF) + 1;
 			infoLogger() << "            " << device->numMsis
 					<< " MSI-X vectors available" << frg::endlog;
-
-			// Map the MSI-X BAR.
-			auto tableInfo = io->readConfigWord(bus, slot, function, offset + 4);
-			auto tableBar = tableInfo & 0x7;
-			auto tableOffset = tableInfo & 0xFFFF'FFF8;
-			assert(tableBar < 6);
-
-			auto bar = device->bars[tableBar];
-			assert(bar.type == PciBar::kBarMemory);
-			auto mappingDisp = (bar.address + tableOffset) & (kPageSize - 1);
-			auto mappingSize = (mappingDisp + device->numMsis * 16 + kPageSize - 1)
-					& ~(kPageSize - 1);
-
-			auto window = KernelVirtualMemory::global().allocate(0x10000);
-			for(uintptr_t page = 0; page < mappingSize; page += kPageSize)
-				KernelPageSpace::global().mapSingle4k(
-						reinterpret_cast<uintptr_t>(window) + page,
-						(bar.address + tableOffset + page) & ~(kPageSize - 1),
-						page_access::write, CachingMode::null);
-			device->msixMapping = reinterpret_cast<std::byte *>(window) + mappingDisp;
-
-			// Mask all MSIs.
-			for(unsigned int i = 0; i < device->numMsis; ++i) {
-				auto space = arch::mem_space{device->msixMapping}.subspace(i * 16);
-				space.store(msixVectorControl,
-						space.load(msixVectorControl) | 1);
-			}
 		} else if (device->msiIndex >= 0) {
 			auto offset = device->caps[device->msiIndex].offset;
 
@@ -1188,7 +1364,9 @@ void checkPciFunction(PciBus *bus, uint32_t slot, uint32_t function,
 			io->writeConfigHalf(bus, slot, function, offset + 2, msgControl);
 		}
 
+		KernelFiber::asyncBlockCurrent(enumerationMutex.async_lock());
 		allDevices->push_back(device);
+		enumerationMutex.unlock();
 		bus->childDevices.push_back(device.get());
 	} else if ((header_type & 0x7F) == 1) {
 		auto bridge = frg::construct<PciBridge>(*kernelAlloc, bus, bus->segId, bus->busId, slot, function);
@@ -1204,7 +1382,9 @@ void checkPciFunction(PciBus *bus, uint32_t slot, uint32_t function,
 			bridge->downstreamId = downstreamId;
 			bridge->subordinateId = io->readConfigByte(bus, slot, function, kPciBridgeSubordinate);
 
+			KernelFiber::asyncBlockCurrent(enumerationMutex.async_lock());
 			auto downstreamBus = bus->makeDownstreamBus(bridge, downstreamId);
+			enumerationMutex.unlock();
 			bridge->associatedBus = downstreamBus;
 			enumerateDownstream(downstreamBus);
 		} else {
@@ -1796,13 +1976,49 @@ uint32_t findHighestId(PciBus *bus) {
 	return id;
 }
 
+// Enumerates all buses below a root bus (in breadth first order).
+void enumerateHierarchy(PciBus *root) {
+	frg::vector<PciBus *, KernelAlloc> queue{*kernelAlloc};
+	queue.push_back(root);
+	for(size_t i = 0; i < queue.size(); i++)
+		checkPciBus(queue[i], [&] (PciBus *bus) {
+			queue.push_back(bus);
+		});
+}
+
 void enumerateAll() {
 	if (!allDevices)
 		allDevices.initialize(*kernelAlloc);
 
-	for(size_t i = 0; i < enumerationQueue->size(); i++) {
-		auto bus = (*enumerationQueue)[i];
-		checkPciBus(bus, addToEnumerationQueue);
+	// The hierarchies below different root buses are independent;
+	// enumerate them in parallel on different CPUs.
+	auto numRoots = enumerationQueue->size();
+	rootsPending.store(numRoots, std::memory_order_relaxed);
+	for(size_t i = 0; i < numRoots; i++) {
+		auto root = (*enumerationQueue)[i];
+		auto scheduler = &getCpuData(i % getCpuCount())->scheduler;
+		KernelFiber::runOn(scheduler, [root] {
+			enumerateHierarchy(root);
+			if(rootsPending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				rootsEnumerated.raise();
+		});
+	}
+	if(numRoots)
+		KernelFiber::asyncBlockCurrent(rootsEnumerated.wait());
+
+	// Restore a deterministic order of allDevices (by segment, bus, slot and function).
+	auto before = [] (PciDevice *a, PciDevice *b) {
+		if(a->seg != b->seg)
+			return a->seg < b->seg;
+		if(a->bus != b->bus)
+			return a->bus < b->bus;
+		if(a->slot != b->slot)
+			return a->slot < b->slot;
+		return a->function < b->function;
+	};
+	for(size_t i = 1; i < allDevices->size(); i++) {
+		for(size_t j = i; j > 0 && before((*allDevices)[j].get(), (*allDevices)[j - 1].get()); j--)
+			std::swap((*allDevices)[j], (*allDevices)[j - 1]);
 	}
 
 	// Configure unconfigured bridges
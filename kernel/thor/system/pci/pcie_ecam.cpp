@@ -6,15 +6,24 @@ namespace thor::pci {
 
 EcamPcieConfigIo::EcamPcieConfigIo(uintptr_t mmioBase, uint16_t seg,
 		uint8_t busStart, uint8_t busEnd)
-: mmioBase_{mmioBase}, busMappings_{frg::hash<uint32_t>{}, *kernelAlloc},
-		seg_{seg}, busStart_{busStart}, busEnd_{busEnd} { }
+: mmioBase_{mmioBase}, busMappings_{*kernelAlloc},
+		seg_{seg}, busStart_{busStart}, busEnd_{busEnd} {
+	busMappings_.resize(busEnd - busStart + 1);
+	for (auto &mapping : busMappings_)
+		mapping = nullptr;
+}
 
 arch::mem_space EcamPcieConfigIo::spaceForBus_(uint32_t bus) {
 	assert(bus >= busStart_ && bus <= busEnd_);
 
-	if (auto mapping = busMappings_.get(bus); mapping) {
-		return arch::mem_space{*mapping};
-	}
+	auto slot = &busMappings_[bus - busStart_];
+	if (auto mapping = __atomic_load_n(slot, __ATOMIC_ACQUIRE); mapping)
+		return arch::mem_space{mapping};
+
+	// Buses may be enumerated concurrently; only map each bus once.
+	auto lock = frg::guard(&mappingMutex_);
+	if (auto mapping = *slot; mapping)
+		return arch::mem_space{mapping};
 
 	constexpr uintptr_t size = 1 << 20;
 	uintptr_t offset = uintptr_t(bus - busStart_) << 20;
@@ -27,7 +36,7 @@ arch::mem_space EcamPcieConfigIo::spaceForBus_(uint32_t bus) {
 				page_access::write, CachingMode::mmio);
 	}
 
-	busMappings_.insert(bus, ptr);
+	__atomic_store_n(slot, ptr, __ATOMIC_RELEASE);
 
 	return arch::mem_space{ptr};
 }
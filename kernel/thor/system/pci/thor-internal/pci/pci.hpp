@@ -274,7 +274,7 @@ struct PciBridge final : PciEntity {
 	uint32_t subordinateId;
 };
 
-struct PciDevice final : PciEntity {
+struct PciDevice final : PciEntity, MsiOwner {
 
 	PciDevice(PciBus *parentBus_, uint32_t seg, uint32_t bus, uint32_t slot, uint32_t function,
 			uint16_t vendor, uint16_t device_id, uint8_t revision,
@@ -290,9 +290,25 @@ struct PciDevice final : PciEntity {
 
 	void enableIrq();
 
+	// Maps and masks the MSI-X table on first use (no-op for plain MSI).
+	void prepareMsis();
 	void setupMsi(MsiPin *msi, size_t index);
 	void enableMsi();
 
+	// Called when the MSI is retargeted (e.g., by helSetIrqAffinity()).
+	void programMsi(MsiPin *msi, size_t index) override;
+	bool maskMsi(size_t index, bool masked) override;
+
+	// Masks an MSI-X vector on behalf of the driver (independently of IRQ handling).
+	// Returns false if the device does not support per-vector masking.
+	bool setDriverMask(size_t index, bool masked);
+
+private:
+	bool updateMsixMask_(size_t index, uint8_t bit, bool masked);
+
+	bool msisPrepared_ = false;
+
+public:
 	// mbus object ID of the device
 	int64_t mbusId;
 
@@ -322,6 +338,9 @@ struct PciDevice final : PciEntity {
 	unsigned int numMsis = 0;
 	int msixIndex = -1;
 	void *msixMapping = nullptr;
+	// Per MSI-X vector: bit 0 is set if IRQ handling masked the vector,
+	// bit 1 is set if the driver masked it. The vector is masked if any bit is set.
+	frg::vector<uint8_t, KernelAlloc> msixMaskState{*kernelAlloc};
 	int msiIndex = -1;
 
 	// Device attachments.
@@ -435,7 +454,9 @@ protected:
 };
 
 struct PciMsiController {
-	virtual MsiPin *allocateMsiPin(frg::string<KernelAlloc> name) = 0;
+	// Allocates an MSI that is delivered to the given CPU (or to a CPU of the
+	// controller's choice if cpu is negative or cannot be targeted).
+	virtual MsiPin *allocateMsiPin(frg::string<KernelAlloc> name, int cpu) = 0;
 
 protected:
 	~PciMsiController() = default;
@@ -2,7 +2,8 @@
 
 #include <thor-internal/pci/pci.hpp>
 #include <arch/mem_space.hpp>
-#include <frg/hash_map.hpp>
+#include <frg/vector.hpp>
+#include <thor-internal/kernel_heap.hpp>
 
 namespace thor::pci {
 
@@ -30,12 +31,10 @@ private:
 
 	uintptr_t mmioBase_;
 
-	frg::hash_map<
-		uint32_t,
-		void *,
-		frg::hash<uint32_t>,
-		KernelAlloc
-	> busMappings_;
+	// Mapping of each bus (or nullptr if the bus was not accessed yet).
+	// Read without locking; mappingMutex_ protects the creation of mappings.
+	frg::vector<void *, KernelAlloc> busMappings_;
+	IrqSpinlock mappingMutex_;
 
 	uint16_t seg_;
 	uint8_t busStart_;
@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 #include <unordered_set>
 #include <queue>
@@ -25,6 +26,14 @@
 struct Group;
 struct Observer;
 
+// Incremented whenever an entity is attached. Observers receive the sequence number
+// with each event; enumeration snapshots report the number of the last attach they reflect.
+uint64_t currentSeq = 0;
+
+// Upper bound on the size of an ENUMERATE response. Entities that do not fit are sent
+// as ATTACH events instead (clients receive the response into a buffer of this size).
+constexpr size_t maxSnapshotSize = 64 * 1024;
+
 struct Entity {
 	explicit Entity(int64_t id, std::weak_ptr<Group> parent,
 			std::unordered_map<std::string, std::string> properties)
@@ -63,15 +72,16 @@ struct Group final : Entity {
 		return _children;
 	}
 
-	void linkObserver(std::shared_ptr<Observer> observer) {
-		_observers.insert(std::move(observer));
-	}
+	void linkObserver(std::shared_ptr<Observer> observer);
 
 	void processAttach(std::shared_ptr<Entity> entity);
 
 private:
 	std::unordered_set<std::shared_ptr<Entity>> _children;
-	std::unordered_set<std::shared_ptr<Observer>> _observers;
+	// Observers, indexed by one of the terms of their filter (see indexKey()).
+	std::unordered_map<std::string, std::vector<std::shared_ptr<Observer>>> _indexedObservers;
+	// Observers without terms that match all entities.
+	std::vector<std::shared_ptr<Observer>> _unindexedObservers;
 };
 
 struct Object final : Entity {
@@ -148,61 +158,198 @@ private:
 	std::vector<AnyFilter> _operands;
 };
 
+// --------------------------------------------------------
+// Property index
+// --------------------------------------------------------
+
+// Key of a (property, value) pair in the indices.
+static std::string indexKey(const std::string &property, const std::string &value) {
+	std::string key;
+	key.reserve(property.size() + value.size() + 1);
+	key += property;
+	key += '\0';
+	key += value;
+	return key;
+}
+
+// Maps (property, value) pairs to all entities that carry them. Entities are
+// never removed, hence each vector is sorted by ID.
+std::unordered_map<std::string, std::vector<std::shared_ptr<Entity>>> entityIndex;
+
+static void indexEntity(std::shared_ptr<Entity> entity) {
+	for(auto &kv : entity->getProperties())
+		entityIndex[indexKey(kv.first, kv.second)].push_back(entity);
+}
+
+// Filters only consist of (nested) conjunctions of equality tests. Hence, each filter
+// is compiled to a list of (property, value) pairs that must all be present.
+struct CompiledFilter {
+	explicit CompiledFilter(const AnyFilter &filter) {
+		_compile(filter);
+	}
+
+	const std::vector<std::pair<std::string, std::string>> &getTerms() const {
+		return _terms;
+	}
+
+	// True if the filter requires different values for the same property.
+	bool isUnsatisfiable() const {
+		return _unsatisfiable;
+	}
+
+	bool matches(const Entity *entity) const {
+		if(_unsatisfiable)
+			return false;
+		auto &properties = entity->getProperties();
+		return std::all_of(_terms.begin(), _terms.end(), [&] (const auto &term) {
+			auto it = properties.find(term.first);
+			return it != properties.end() && it->second == term.second;
+		});
+	}
+
+private:
+	void _compile(const AnyFilter &filter) {
+		if(auto real = std::get_if<EqualsFilter>(&filter); real) {
+			auto it = std::find_if(_terms.begin(), _terms.end(), [&] (const auto &term) {
+				return term.first == real->getProperty();
+			});
+			if(it == _terms.end()) {
+				_terms.emplace_back(real->getProperty(), real->getValue());
+			}else if(it->second != real->getValue()) {
+				_unsatisfiable = true;
+			}
+		}else if(auto real = std::get_if<Conjunction>(&filter); real) {
+			for(auto &operand : real->getOperands())
+				_compile(operand);
+		}else{
+			throw std::runtime_error("Unexpected filter");
+		}
+	}
+
+	std::vector<std::pair<std::string, std::string>> _terms;
+	bool _unsatisfiable = false;
+};
+
 struct Observer {
 	explicit Observer(AnyFilter filter, helix::UniqueLane lane)
-	: _filter(std::move(filter)), _lane(std::move(lane)) { }
+	: _filter(filter), _lane(std::move(lane)) {
+		// Index the observer by its most selective term.
+		size_t best = SIZE_MAX;
+		for(auto &term : _filter.getTerms()) {
+			auto it = entityIndex.find(indexKey(term.first, term.second));
+			size_t n = (it != entityIndex.end()) ? it->second.size() : 0;
+			if(n < best) {
+				best = n;
+				_key = indexKey(term.first, term.second);
+			}
+		}
+	}
+
+	const CompiledFilter &getFilter() const {
+		return _filter;
+	}
+
+	// Key of the term that the observer is indexed by. Empty if the filter has no terms.
+	const std::optional<std::string> &getKey() const {
+		return _key;
+	}
+
+	// Returns all descendants of root that currently match the filter.
+	std::vector<std::shared_ptr<Entity>> collect(std::shared_ptr<Entity> root);
 
-	async::detached traverse(std::shared_ptr<Entity> root);
+	void traverse(std::shared_ptr<Entity> root);
+
+	// Sends ATTACH events for entities that are already part of the bus.
+	async::detached sendAttaches(std::vector<std::shared_ptr<Entity>> entities, uint64_t seq);
 
 	async::detached onAttach(std::shared_ptr<Entity> entity);
 
 private:
-	AnyFilter _filter;
+	CompiledFilter _filter;
+	std::optional<std::string> _key;
 	helix::UniqueLane _lane;
 };
 
-static bool matchesFilter(const Entity *entity, const AnyFilter &filter) {
-	if(auto real = std::get_if<EqualsFilter>(&filter); real) {
-		auto &properties = entity->getProperties();
-		auto it = properties.find(real->getProperty());
-		if(it == properties.end())
-			return false;
-		return it->second == real->getValue();
-	}else if(auto real = std::get_if<Conjunction>(&filter); real) {
-		auto &operands = real->getOperands();
-		return std::all_of(operands.begin(), operands.end(), [&] (const AnyFilter &operand) {
-			return matchesFilter(entity, operand);
-		});
+void Group::linkObserver(std::shared_ptr<Observer> observer) {
+	if(observer->getFilter().isUnsatisfiable())
+		return;
+	if(auto &key = observer->getKey(); key) {
+		_indexedObservers[*key].push_back(std::move(observer));
 	}else{
-		throw std::runtime_error("Unexpected filter");
+		_unindexedObservers.push_back(std::move(observer));
 	}
 }
-	
+
 void Group::processAttach(std::shared_ptr<Entity> entity) {
-	for(auto &observer_ptr : _observers)
+	for(auto &observer_ptr : _unindexedObservers)
 		observer_ptr->onAttach(entity);
+
+	// Each observer is indexed by exactly one term, so it is notified at most once.
+	for(auto &kv : entity->getProperties()) {
+		auto it = _indexedObservers.find(indexKey(kv.first, kv.second));
+		if(it == _indexedObservers.end())
+			continue;
+		for(auto &observer_ptr : it->second)
+			observer_ptr->onAttach(entity);
+	}
+}
+
+static bool isDescendant(const Entity *entity, const Entity *ancestor) {
+	std::shared_ptr<Group> current;
+	while(entity != ancestor) {
+		current = entity->getParent();
+		if(!current)
+			return false;
+		entity = current.get();
+	}
+	return true;
 }
 
-async::detached Observer::traverse(std::shared_ptr<Entity> root) {
-	std::queue<std::shared_ptr<Entity>> entities;
-	entities.push(root);
-	while(!entities.empty()) {
-		std::shared_ptr<Entity> entity = entities.front();
-		entities.pop();
-		if(const Entity &er = *entity; typeid(er) == typeid(Group)) {
-			auto group = std::static_pointer_cast<Group>(entity);
-			for(auto child : group->getChildren())
-				entities.push(std::move(child));
+std::vector<std::shared_ptr<Entity>> Observer::collect(std::shared_ptr<Entity> root) {
+	// Only consider the entities that carry the indexed term.
+	std::vector<std::shared_ptr<Entity>> candidates;
+	if(_key) {
+		if(auto it = entityIndex.find(*_key); it != entityIndex.end())
+			candidates = it->second;
+	}else{
+		std::queue<std::shared_ptr<Entity>> entities;
+		entities.push(root);
+		while(!entities.empty()) {
+			std::shared_ptr<Entity> entity = entities.front();
+			entities.pop();
+			if(const Entity &er = *entity; typeid(er) == typeid(Group)) {
+				auto group = std::static_pointer_cast<Group>(entity);
+				for(auto child : group->getChildren())
+					entities.push(std::move(child));
+			}
+			candidates.push_back(std::move(entity));
 		}
+	}
 
-		if(!matchesFilter(entity.get(), _filter)) 
+	std::vector<std::shared_ptr<Entity>> matches;
+	for(auto &entity : candidates) {
+		if(!_filter.matches(entity.get()))
 			continue;
-		
+		if(!isDescendant(entity.get(), root.get()))
+			continue;
+		matches.push_back(std::move(entity));
+	}
+	return matches;
+}
+
+void Observer::traverse(std::shared_ptr<Entity> root) {
+	sendAttaches(collect(std::move(root)), currentSeq);
+}
+
+async::detached Observer::sendAttaches(std::vector<std::shared_ptr<Entity>> entities,
+		uint64_t seq) {
+	for(auto &entity : entities) {
 		helix::SendBuffer send_req;
 
 		managarm::mbus::SvrRequest req;
 		req.set_req_type(managarm::mbus::SvrReqType::ATTACH);
 		req.set_id(entity->getId());
+		req.set_seq(seq);
 		for(auto kv : entity->getProperties()) {
 			auto entry = req.add_properties();
 			entry->set_name(kv.first);
@@ -218,7 +365,7 @@ async::detached Observer::traverse(std::shared_ptr<Entity> root) {
 }
 
 async::detached Observer::onAttach(std::shared_ptr<Entity> entity) {
-	if(!matchesFilter(entity.get(), _filter)) 
+	if(!_filter.matches(entity.get()))
 		co_return;
 	
 	helix::SendBuffer send_req;
@@ -226,6 +373,7 @@ async::detached Observer::onAttach(std::shared_ptr<Entity> entity) {
 	managarm::mbus::SvrRequest req;
 	req.set_req_type(managarm::mbus::SvrReqType::ATTACH);
 	req.set_id(entity->getId());
+	req.set_seq(currentSeq);
 	for(auto kv : entity->getProperties()) {
 		auto entry = req.add_properties();
 		entry->set_name(kv.first);
@@ -353,6 +501,8 @@ async::detached serve(helix::UniqueLane lane) {
 			auto child = std::make_shared<Object>(nextEntityId++,
 					group, std::move(properties), std::move(local_lane));
 			allEntities.insert({ child->getId(), child });
+			indexEntity(child);
+			currentSeq++;
 
 			group->addChild(child);
 
@@ -406,6 +556,68 @@ async::detached serve(helix::UniqueLane lane) {
 			managarm::mbus::SvrResponse resp;
 			resp.set_error(managarm::mbus::Error::SUCCESS);
 
+			auto ser = resp.SerializeAsString();
+			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+					helix::action(&send_lane, remote_lane));
+			co_await transmit.async_wait();
+			HEL_CHECK(send_resp.error());
+			HEL_CHECK(send_lane.error());
+		}else if(req.req_type() == managarm::mbus::CntReqType::ENUMERATE) {
+			helix::SendBuffer send_resp;
+			helix::PushDescriptor send_lane;
+
+			auto parent = getEntityById(req.id());
+			if(!parent) {
+				managarm::mbus::SvrResponse resp;
+				resp.set_error(managarm::mbus::Error::NO_SUCH_ENTITY);
+
+				auto ser = resp.SerializeAsString();
+				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+						helix::action(&send_resp, ser.data(), ser.size()));
+				co_await transmit.async_wait();
+				HEL_CHECK(send_resp.error());
+				continue;
+			}
+
+			if(const Entity &pr = *parent; typeid(pr) != typeid(Group))
+				throw std::runtime_error("Observers can only be attached to groups");
+			auto group = std::static_pointer_cast<Group>(parent);
+
+			// Like LINK_OBSERVER, but the current matches are returned in the response
+			// itself. No attach can happen between collect() and linkObserver().
+			helix::UniqueLane local_lane, remote_lane;
+			std::tie(local_lane, remote_lane) = helix::createStream();
+			auto observer = std::make_shared<Observer>(decodeFilter(req.filter()),
+					std::move(local_lane));
+			auto matches = observer->collect(parent);
+			group->linkObserver(observer);
+
+			managarm::mbus::SvrResponse resp;
+			resp.set_error(managarm::mbus::Error::SUCCESS);
+			resp.set_seq(currentSeq);
+
+			size_t n = 0;
+			for(; n < matches.size(); n++) {
+				managarm::mbus::EntityRecord record;
+				record.set_id(matches[n]->getId());
+				for(auto kv : matches[n]->getProperties()) {
+					auto entry = record.add_properties();
+					entry->set_name(kv.first);
+					entry->mutable_item()->mutable_string_item()->set_value(kv.second);
+				}
+
+				// Account for the tag and length prefix of the record.
+				if(resp.ByteSizeLong() + record.ByteSizeLong() + 16 > maxSnapshotSize)
+					break;
+				*resp.add_entities() = std::move(record);
+			}
+
+			if(n < matches.size()) {
+				matches.erase(matches.begin(), matches.begin() + n);
+				observer->sendAttaches(std::move(matches), currentSeq);
+			}
+
 			auto ser = resp.SerializeAsString();
 			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
 					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
@@ -462,6 +674,7 @@ int main() {
 	auto root = std::make_shared<Group>(nextEntityId++, std::weak_ptr<Group>(),
 			std::unordered_map<std::string, std::string>());
 	allEntities.insert({ root->getId(), root });
+	indexEntity(root);
 
 	unsigned long xpipe;
 	if(peekauxval(AT_XPIPE, &xpipe))
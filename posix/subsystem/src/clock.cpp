@@ -1,5 +1,6 @@
 
 #include <async/oneshot-event.hpp>
+#include <helix/clock.hpp>
 #include <helix/memory.hpp>
 #include <protocols/clock/defs.hpp>
 #include <protocols/mbus/client.hpp>
@@ -86,8 +87,7 @@ struct timespec getRealtime() {
 	assert(__atomic_load_n(&page->seqlock, __ATOMIC_RELAXED) == seqlock);
 
 	// Calculate the current time.
-	uint64_t now;
-	HEL_CHECK(helGetClock(&now));
+	auto now = helix::currentClock();
 
 	int64_t realtime = base + (now - ref);
 
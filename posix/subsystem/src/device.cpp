@@ -110,6 +110,10 @@ constexpr bool logStatusSeqlock = false;
 struct DeviceFile : File {
 private:
 	async::result<frg::expected<Error, off_t>> seek(off_t offset, VfsSeek whence) override {
+		if(whence == VfsSeek::relative)
+			co_return co_await _file.seekRelative(offset);
+		if(whence == VfsSeek::eof)
+			co_return co_await _file.seekEof(offset);
 		assert(whence == VfsSeek::absolute);
 		co_await _file.seekAbsolute(offset);
 		co_return offset;
@@ -264,6 +268,14 @@ FutureMaybe<SharedFilePtr> openExternalDevice(helix::BorrowedLane lane,
 	co_return File::constructHandle(std::move(file));
 }
 
+smarter::shared_ptr<File, FileHandle> createPassthroughFile(helix::UniqueLane lane) {
+	auto link = SpecialLink::makeSpecialLink(VfsType::regular, 0777);
+	auto file = smarter::make_shared<DeviceFile>(helix::UniqueLane{},
+			std::move(lane), nullptr, std::move(link), helix::Mapping{});
+	file->setupWeakFile(file);
+	return File::constructHandle(std::move(file));
+}
+
 FutureMaybe<std::shared_ptr<FsLink>> mountExternalDevice(helix::BorrowedLane lane) {
 	managarm::fs::CntRequest req;
 	req.set_req_type(managarm::fs::CntReqType::DEV_MOUNT);
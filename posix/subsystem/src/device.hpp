@@ -93,3 +93,6 @@ FutureMaybe<smarter::shared_ptr<File, FileHandle>> openExternalDevice(helix::Bor
 		SemanticFlags semantic_flags);
 
 FutureMaybe<std::shared_ptr<FsLink>> mountExternalDevice(helix::BorrowedLane lane);
+
+// Wraps a passthrough lane that a server handed out (e.g., for a PRIME buffer) into a file.
+smarter::shared_ptr<File, FileHandle> createPassthroughFile(helix::UniqueLane lane);
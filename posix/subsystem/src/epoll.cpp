@@ -140,6 +140,24 @@ private:
 		}
 	}
 
+	// Watches the item for events that happen after the given sequence.
+	// Once such an event happens, the item becomes pending.
+	static void _startPolling(smarter::shared_ptr<Item> item, uint64_t sequence) {
+		assert(!(item->state & statePolling));
+		item->state |= statePolling;
+
+		item->cancelPoll.reset();
+		item->pollOperation.construct_with([&] {
+			return async::execution::connect(
+				item->file->pollWait(item->process, sequence,
+						item->eventMask | EPOLLERR | EPOLLHUP, item->cancelPoll),
+				Receiver{item}
+			);
+		});
+		if(async::execution::start_inline(*item->pollOperation))
+			_awaitPoll(item.get());
+	}
+
 public:
 	~OpenFile() {
 		// Nothing to do here.
@@ -212,6 +230,14 @@ public:
 
 		_fileMap.erase(it);
 		item->state &= ~stateActive;
+
+		// Remove the item from the pending queue right away, such that waiters do not
+		// need to skip it and we do not keep it alive until the next wait.
+		if(item->state & statePending) {
+			_pendingQueue.erase(_pendingQueue.iterator_to(*item));
+			item->state &= ~statePending;
+			item.ctr()->decrement();
+		}
 		return Error::success;
 	}
 
@@ -275,29 +301,27 @@ public:
 				auto status = std::get<1>(result) & (item->eventMask | EPOLLERR | EPOLLHUP);
 				if(!status) {
 					item->state &= ~statePending;
-					if(!(item->state & statePolling)) {
-						item->state |= statePolling;
-
-						// Once an item is not pending anymore, we continue watching it.
-						item->cancelPoll.reset();
-						item->pollOperation.construct_with([&] {
-							return async::execution::connect(
-								item->file->pollWait(item->process, std::get<0>(result),
-										item->eventMask | EPOLLERR | EPOLLHUP, item->cancelPoll),
-								Receiver{item}
-							);
-						});
-						if(async::execution::start_inline(*item->pollOperation))
-							_awaitPoll(item.get());
-					}
+					// Once an item is not pending anymore, we continue watching it.
+					if(!(item->state & statePolling))
+						_startPolling(item, std::get<0>(result));
 					continue;
 				}
 
-				// We have to increment the sequence again as concurrent waiters
-				// might have seen an empty _pendingQueue.
-				// TODO: Edge-triggered watches should not be requeued here.
-				item.ctr()->increment();
-				repoll_queue.push_back(*item);
+				if(item->eventMask & EPOLLONESHOT) {
+					// The item is disabled until it is re-armed by modifyItem().
+					item->state &= ~statePending;
+				}else if(item->eventMask & EPOLLET) {
+					// Edge-triggered items are only reported again after the next edge.
+					item->state &= ~statePending;
+					if(!(item->state & statePolling))
+						_startPolling(item, std::get<0>(result));
+				}else{
+					// Level-triggered items stay pending until the event disappears.
+					// We have to increment the sequence again as concurrent waiters
+					// might have seen an empty _pendingQueue.
+					item.ctr()->increment();
+					repoll_queue.push_back(*item);
+				}
 
 				assert(k < max_events);
 				memset(events + k, 0, sizeof(struct epoll_event));
@@ -5,6 +5,7 @@
 
 #include <async/recurring-event.hpp>
 #include <helix/ipc.hpp>
+#include <helix/memory.hpp>
 #include "fs.hpp"
 #include "eventfd.hpp"
 #include "process.hpp"
@@ -14,10 +15,26 @@ namespace eventfd {
 
 namespace {
 
+constexpr uint64_t maxCounter = 0xFFFFFFFFFFFFFFFE;
+
+// Layout of the page that is returned by accessMemory(). Clients that map the page
+// can update the counter with atomic operations; they wait on (and wake) the futex word,
+// which is incremented on every change of the counter.
+struct SharedState {
+	uint64_t counter;
+	int futex;
+};
+
 struct OpenFile : File {
 	OpenFile(unsigned int initval, bool nonBlock)
 	: File{StructName::get("eventfd")}, _currentSeq{1}, _readableSeq{0},
-		_writeableSeq{0}, _counter{initval}, _nonBlock{nonBlock} { }
+		_writeableSeq{0}, _nonBlock{nonBlock} {
+		HelHandle handle;
+		HEL_CHECK(helAllocateMemory(helix::Mapping::pageSize, 0, nullptr, &handle));
+		_memory = helix::UniqueDescriptor{handle};
+		_mapping = helix::Mapping{_memory, 0, helix::Mapping::pageSize};
+		_state()->counter = initval;
+	}
 
 	~OpenFile() {
 	}
@@ -35,9 +52,10 @@ struct OpenFile : File {
 			co_return Error::illegalArguments;
 
 		while (1) {
-			if (_counter) {
-				memcpy(data, &_counter, 8);
-				_counter = 0;
+			auto value = __atomic_exchange_n(&_state()->counter, 0, __ATOMIC_ACQ_REL);
+			if (value) {
+				memcpy(data, &value, 8);
+				_notify();
 				_writeableSeq = ++_currentSeq;
 				_doorbell.raise();
 				co_return 8;
@@ -52,21 +70,30 @@ struct OpenFile : File {
 
 	async::result<frg::expected<Error, size_t>>
 	writeAll(Process *process, const void *data, size_t length) override {
-		assert(length >= 8); // TODO: return Error::illegalArguments to user instead
+		if (length < 8)
+			co_return Error::illegalArguments;
 
 		uint64_t num;
 		memcpy(&num, data, 8);
 
-		assert(num != 0xFFFFFFFFFFFFFFFF); // TODO: return Error::wouldBlock to user instead
+		if (num > maxCounter)
+			co_return Error::illegalArguments;
 
-		if (num && num + _counter <= _counter) {
-			if (_nonBlock)
-				assert(!"return Error::wouldBlock from eventfd::OpenFile::writeAll");
-			else
+		auto counter = &_state()->counter;
+		auto value = __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+		while (true) {
+			if (num > maxCounter - value) {
+				if (_nonBlock)
+					co_return Error::wouldBlock;
 				co_await _doorbell.async_wait(); // wait for read
+				value = __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+				continue;
+			}
+			if (__atomic_compare_exchange_n(counter, &value, value + num,
+					false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				break;
 		}
-
-		_counter += num;
+		_notify();
 
 		_readableSeq = ++_currentSeq;
 		_doorbell.raise();
@@ -94,20 +121,35 @@ struct OpenFile : File {
 
 	async::result<frg::expected<Error, PollStatusResult>>
 	pollStatus(Process *) override {
+		auto value = __atomic_load_n(&_state()->counter, __ATOMIC_ACQUIRE);
 		int events = 0;
-		if (_counter > 0)
+		if (value > 0)
 			events |= EPOLLIN;
-		if (_counter < 0xFFFFFFFFFFFFFFFF)
+		if (value < maxCounter)
 			events |= EPOLLOUT;
 
 		co_return PollStatusResult(_currentSeq, events);
 	}
 
+	FutureMaybe<helix::UniqueDescriptor> accessMemory() override {
+		co_return _memory.dup();
+	}
+
 	helix::BorrowedDescriptor getPassthroughLane() override {
 		return _passthrough;
 	}
 
 private:
+	SharedState *_state() {
+		return reinterpret_cast<SharedState *>(_mapping.get());
+	}
+
+	// Wakes up clients that wait on the shared page.
+	void _notify() {
+		__atomic_fetch_add(&_state()->futex, 1, __ATOMIC_RELEASE);
+		HEL_CHECK(helFutexWake(&_state()->futex));
+	}
+
 	helix::UniqueLane _passthrough;
 	async::recurring_event _doorbell;
 
@@ -115,7 +157,8 @@ private:
 	uint64_t _readableSeq;
 	uint64_t _writeableSeq;
 
-	uint64_t _counter;
+	helix::UniqueDescriptor _memory;
+	helix::Mapping _mapping;
 	bool _nonBlock;
 };
 
@@ -4,6 +4,8 @@
 #include <string.h>
 #include <sys/auxv.h>
 #include <iostream>
+#include <list>
+#include <unordered_map>
 
 #include "common.hpp"
 #include "vfs.hpp"
@@ -12,10 +14,29 @@
 
 constexpr size_t kPageSize = 0x1000;
 
-// This struct is parsed before knowing the type of executable (PIE vs. non-PIE)
-// and also before knowing the ELF's base address.
-struct ImagePreamble {
+// Page-aligned PT_LOAD segment of an ELF file, relative to the ELF's base address.
+struct ElfSegment {
+	uintptr_t mapAddress;
+	size_t mapLength;
+	bool writable;
+	// For read-only segments: offset of the segment into the file.
+	uintptr_t fileOffset;
+	// For writable segments: memory that holds the initial segment contents.
+	// Processes map this copy-on-write, so it is never modified.
+	helix::UniqueDescriptor image;
+};
+
+// Everything that is needed to map an ELF file. This is parsed before knowing
+// the ELF's base address and can be reused by multiple execve() calls.
+struct ElfLoadPlan {
 	bool isPie = false;
+	uintptr_t entry = 0;
+	uintptr_t phdrAddress = 0;
+	bool hasPhdr = false;
+	size_t phdrEntrySize = 0;
+	size_t phdrCount = 0;
+	helix::UniqueDescriptor fileMemory;
+	std::vector<ElfSegment> segments;
 };
 
 // This struct contains the image meta data with correct base address applied.
@@ -29,46 +50,39 @@ struct ImageInfo {
 	size_t phdrCount;
 };
 
-async::result<frg::expected<Error, ImagePreamble>>
-parseElfPreamble(SharedFilePtr file) {
-	ImagePreamble preamble;
+namespace {
 
-	// Read the elf file header and verify the signature.
-	Elf64_Ehdr ehdr;
-	FRG_CO_TRY(co_await file->seek(0, VfsSeek::absolute));
-	FRG_CO_TRY(co_await file->readExactly(nullptr, &ehdr, sizeof(Elf64_Ehdr)));
+constexpr bool logPlanCache = false;
 
-	if(!(ehdr.e_ident[0] == 0x7F
-			&& ehdr.e_ident[1] == 'E'
-			&& ehdr.e_ident[2] == 'L'
-			&& ehdr.e_ident[3] == 'F'))
-		co_return Error::badExecutable;
-	if(ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN)
-		co_return Error::badExecutable;
+// Number of ELF files whose load plans we keep around.
+constexpr size_t planCacheSize = 64;
 
-	// Right now we treat every ET_DYN object as PIE and unconditionally apply
-	// a non-zero base address.
-	if(ehdr.e_type == ET_DYN)
-		preamble.isPie = true;
+struct PlanCacheEntry {
+	FsNode *node;
+	// Used to detect that the node was destructed (and its address reused).
+	std::weak_ptr<FsNode> weakNode;
+	uint64_t fileSize;
+	uint64_t mtimeSecs, mtimeNanos;
+	std::shared_ptr<ElfLoadPlan> plan;
+};
 
-	co_return preamble;
-}
+std::list<PlanCacheEntry> planCacheLru;
+std::unordered_map<FsNode *, std::list<PlanCacheEntry>::iterator> planCacheMap;
 
-async::result<frg::expected<Error, ImageInfo>>
-loadElfImage(SharedFilePtr file, VmContext *vmContext, uintptr_t base) {
-	assert(!(base & (kPageSize - 1))); // Callers need to ensure this.
-	ImageInfo info;
+} // anonymous namespace
+
+async::result<frg::expected<Error, std::shared_ptr<ElfLoadPlan>>>
+buildElfLoadPlan(SharedFilePtr file) {
+	auto plan = std::make_shared<ElfLoadPlan>();
 
 	// Get a handle to the file's memory.
-	auto fileMemory = co_await file->accessMemory();
+	plan->fileMemory = co_await file->accessMemory();
 
 	// Read the elf file header and verify the signature.
 	Elf64_Ehdr ehdr;
 	FRG_CO_TRY(co_await file->seek(0, VfsSeek::absolute));
 	FRG_CO_TRY(co_await file->readExactly(nullptr, &ehdr, sizeof(Elf64_Ehdr)));
 
-	// Verify the ELF file again, since loadElfPreamble() is not necessarily called
-	// on every object that we load.
 	if(!(ehdr.e_ident[0] == 0x7F
 			&& ehdr.e_ident[1] == 'E'
 			&& ehdr.e_ident[2] == 'L'
@@ -77,11 +91,16 @@ loadElfImage(SharedFilePtr file, VmContext *vmContext, uintptr_t base) {
 	if(ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN)
 		co_return Error::badExecutable;
 
-	info.entryIp = (char *)base + ehdr.e_entry;
-	info.phdrEntrySize = ehdr.e_phentsize;
-	info.phdrCount = ehdr.e_phnum;
+	// Right now we treat every ET_DYN object as PIE and unconditionally apply
+	// a non-zero base address.
+	if(ehdr.e_type == ET_DYN)
+		plan->isPie = true;
 
-	// Read the elf program headers and load them into the address space.
+	plan->entry = ehdr.e_entry;
+	plan->phdrEntrySize = ehdr.e_phentsize;
+	plan->phdrCount = ehdr.e_phnum;
+
+	// Read the elf program headers.
 	std::vector<char> phdrBuffer;
 	phdrBuffer.resize(ehdr.e_phnum * ehdr.e_phentsize);
 	FRG_CO_TRY(co_await file->seek(ehdr.e_phoff, VfsSeek::absolute));
@@ -96,8 +115,9 @@ loadElfImage(SharedFilePtr file, VmContext *vmContext, uintptr_t base) {
 				continue;
 
 			size_t misalign = phdr->p_vaddr & (kPageSize - 1);
-			uintptr_t mapAddress = base + phdr->p_vaddr - misalign;
-			size_t mapLength = (phdr->p_memsz + misalign + kPageSize - 1) & ~(kPageSize - 1);
+			ElfSegment segment;
+			segment.mapAddress = phdr->p_vaddr - misalign;
+			segment.mapLength = (phdr->p_memsz + misalign + kPageSize - 1) & ~(kPageSize - 1);
 
 			// Check if we can share the segment.
 			if(!(phdr->p_flags & PF_W)) {
@@ -113,48 +133,50 @@ loadElfImage(SharedFilePtr file, VmContext *vmContext, uintptr_t base) {
 							<< std::endl;
 					co_return Error::badExecutable;
 				}
-
-				// Map the segment with correct permissions into the process.
-				if((phdr->p_flags & (PF_R | PF_W | PF_X)) == (PF_R | PF_X)) {
-					HEL_CHECK(helLoadahead(fileMemory.getHandle(), phdr->p_offset, mapLength));
-
-					co_await vmContext->mapFile(mapAddress,
-							fileMemory.dup(), file,
-							phdr->p_offset, mapLength, true,
-							kHelMapProtRead | kHelMapProtExecute);
-				}else{
+				if((phdr->p_flags & (PF_R | PF_W | PF_X)) != (PF_R | PF_X)) {
 					std::cout << "posix: Illegal combination of segment permissions" << std::endl;
 					co_return Error::badExecutable;
 				}
+
+				HEL_CHECK(helLoadahead(plan->fileMemory.getHandle(),
+						phdr->p_offset, segment.mapLength));
+				segment.writable = false;
+				segment.fileOffset = phdr->p_offset;
 			}else{
-				// Map the segment with write permission into this address space.
+				if((phdr->p_flags & (PF_R | PF_W | PF_X)) != (PF_R | PF_W)) {
+					std::cout << "posix: Illegal combination of segment permissions" << std::endl;
+					co_return Error::badExecutable;
+				}
+
+				// Read the segment contents from the file into its image.
 				HelHandle segmentHandle;
-				HEL_CHECK(helAllocateMemory(mapLength, 0, nullptr, &segmentHandle));
+				HEL_CHECK(helAllocateMemory(segment.mapLength, 0, nullptr, &segmentHandle));
+				segment.image = helix::UniqueDescriptor{segmentHandle};
 
 				void *window;
 				HEL_CHECK(helMapMemory(segmentHandle, kHelNullHandle, nullptr,
-						0, mapLength, kHelMapProtRead | kHelMapProtWrite, &window));
-
-				// Map the segment with correct permissions into the process.
-				if((phdr->p_flags & (PF_R | PF_W | PF_X)) == (PF_R | PF_W)) {
-					co_await vmContext->mapFile(mapAddress,
-							helix::UniqueDescriptor{segmentHandle}, file,
-							0, mapLength, true,
-							kHelMapProtRead | kHelMapProtWrite);
-				}else{
-					std::cout << "posix: Illegal combination of segment permissions" << std::endl;
-					co_return Error::badExecutable;
-				}
+						0, segment.mapLength, kHelMapProtRead | kHelMapProtWrite, &window));
 
-				// Read the segment contents from the file.
-				memset(window, 0, mapLength);
-				FRG_CO_TRY(co_await file->seek(phdr->p_offset, VfsSeek::absolute));
-				FRG_CO_TRY(co_await file->readExactly(nullptr,
-						(char *)window + misalign, phdr->p_filesz));
-				HEL_CHECK(helUnmapMemory(kHelNullHandle, window, mapLength));
+				memset(window, 0, segment.mapLength);
+				auto seekResult = co_await file->seek(phdr->p_offset, VfsSeek::absolute);
+				if(!seekResult) {
+					HEL_CHECK(helUnmapMemory(kHelNullHandle, window, segment.mapLength));
+					co_return seekResult.error();
+				}
+				auto readResult = co_await file->readExactly(nullptr,
+						(char *)window + misalign, phdr->p_filesz);
+				HEL_CHECK(helUnmapMemory(kHelNullHandle, window, segment.mapLength));
+				if(!readResult)
+					co_return readResult.error();
+
+				segment.writable = true;
+				segment.fileOffset = 0;
 			}
+
+			plan->segments.push_back(std::move(segment));
 		}else if(phdr->p_type == PT_PHDR) {
-			info.phdrPtr = (char *)base + phdr->p_vaddr;
+			plan->phdrAddress = phdr->p_vaddr;
+			plan->hasPhdr = true;
 		}else if(phdr->p_type == PT_DYNAMIC || phdr->p_type == PT_INTERP
 				|| phdr->p_type == PT_TLS
 				|| phdr->p_type == PT_GNU_EH_FRAME || phdr->p_type == PT_GNU_STACK
@@ -166,6 +188,76 @@ loadElfImage(SharedFilePtr file, VmContext *vmContext, uintptr_t base) {
 		}
 	}
 
+	co_return plan;
+}
+
+// Returns the load plan of an ELF file, re-using a cached plan if the file did not change.
+async::result<frg::expected<Error, std::shared_ptr<ElfLoadPlan>>>
+getElfLoadPlan(SharedFilePtr file) {
+	auto link = file->associatedLink();
+	if(!link)
+		co_return co_await buildElfLoadPlan(std::move(file));
+	auto node = link->getTarget();
+	auto stats = FRG_CO_TRY(co_await node->getStats());
+
+	auto it = planCacheMap.find(node.get());
+	if(it != planCacheMap.end()) {
+		auto entry = it->second;
+		if(entry->weakNode.lock() == node
+				&& entry->fileSize == stats.fileSize
+				&& entry->mtimeSecs == stats.mtimeSecs
+				&& entry->mtimeNanos == stats.mtimeNanos) {
+			if(logPlanCache)
+				std::cout << "posix: Re-using ELF load plan" << std::endl;
+			planCacheLru.splice(planCacheLru.begin(), planCacheLru, entry);
+			co_return entry->plan;
+		}
+		planCacheLru.erase(entry);
+		planCacheMap.erase(it);
+	}
+
+	auto plan = FRG_CO_TRY(co_await buildElfLoadPlan(std::move(file)));
+
+	// Another execve() might have filled the cache while we were building the plan.
+	if(planCacheMap.find(node.get()) != planCacheMap.end())
+		co_return plan;
+
+	if(planCacheMap.size() >= planCacheSize) {
+		planCacheMap.erase(planCacheLru.back().node);
+		planCacheLru.pop_back();
+	}
+	planCacheLru.push_front(PlanCacheEntry{node.get(), node, stats.fileSize,
+			stats.mtimeSecs, stats.mtimeNanos, plan});
+	planCacheMap.insert({node.get(), planCacheLru.begin()});
+
+	co_return plan;
+}
+
+async::result<ImageInfo>
+loadElfImage(const ElfLoadPlan &plan, SharedFilePtr file, VmContext *vmContext, uintptr_t base) {
+	assert(!(base & (kPageSize - 1))); // Callers need to ensure this.
+	ImageInfo info;
+	info.entryIp = (char *)base + plan.entry;
+	info.phdrEntrySize = plan.phdrEntrySize;
+	info.phdrCount = plan.phdrCount;
+	if(plan.hasPhdr)
+		info.phdrPtr = (char *)base + plan.phdrAddress;
+
+	for(const auto &segment : plan.segments) {
+		// Map the segment with correct permissions into the process.
+		if(!segment.writable) {
+			co_await vmContext->mapFile(base + segment.mapAddress,
+					plan.fileMemory.dup(), file,
+					segment.fileOffset, segment.mapLength, true,
+					kHelMapProtRead | kHelMapProtExecute);
+		}else{
+			co_await vmContext->mapFile(base + segment.mapAddress,
+					segment.image.dup(), file,
+					0, segment.mapLength, true,
+					kHelMapProtRead | kHelMapProtWrite);
+		}
+	}
+
 	co_return info;
 }
 
@@ -250,19 +342,20 @@ execute(ViewPath root, ViewPath workdir,
 		nRecursions++;
 	}
 
-	auto execPreamble = FRG_CO_TRY(co_await parseElfPreamble(execFile));
+	auto execPlan = FRG_CO_TRY(co_await getElfLoadPlan(execFile));
 	ImageInfo execInfo;
-	if(execPreamble.isPie) {
+	if(execPlan->isPie) {
 		// Unconditionally apply a non-zero base address to PIE objects.
-		execInfo = FRG_CO_TRY(co_await loadElfImage(execFile, vmContext.get(), 0x200000));
+		execInfo = co_await loadElfImage(*execPlan, execFile, vmContext.get(), 0x200000);
 	}else{
-		execInfo = FRG_CO_TRY(co_await loadElfImage(execFile, vmContext.get(), 0));
+		execInfo = co_await loadElfImage(*execPlan, execFile, vmContext.get(), 0);
 	}
 
 	// TODO: Should we really look up the dynamic linker in the current working dir?
 	auto ldsoFile = FRG_CO_TRY(co_await open(root, workdir, "/lib/ld-init.so", self));
 	assert(ldsoFile); // If open() succeeds, it must return a non-null file.
-	auto ldsoInfo = FRG_CO_TRY(co_await loadElfImage(ldsoFile, vmContext.get(), 0x40000000));
+	auto ldsoPlan = FRG_CO_TRY(co_await getElfLoadPlan(ldsoFile));
+	auto ldsoInfo = co_await loadElfImage(*ldsoPlan, ldsoFile, vmContext.get(), 0x40000000);
 
 	constexpr size_t stackSize = 0x200000;
 
@@ -37,8 +37,23 @@ private:
 	std::map<std::tuple<uint64_t, std::string, uint64_t>, std::weak_ptr<FsLink>> _activePeripheralLinks;
 };
 
+// Attributes are cached for a short time to avoid one IPC per stat().
+// Writes go directly from the client to the FS server, so we cannot invalidate
+// the cache on every modification; the TTL bounds how long stale sizes and timestamps are visible.
+constexpr uint64_t statsCacheTtl = 100'000'000; // In nanoseconds.
+
+// Incremented whenever the stats of any node are invalidated. Requests that return the stats of
+// nodes that are not known in advance (i.e., NODE_TRAVERSE_LINKS) use this to detect races.
+uint64_t globalStatsSeq = 0;
+
 struct Node : FsNode {
 	async::result<frg::expected<Error, FileStats>> getStats() override {
+		uint64_t now;
+		HEL_CHECK(helGetClock(&now));
+		if(_statsValid && now < _statsDeadline)
+			co_return _cachedStats;
+		auto seq = _statsSeq;
+
 		helix::Offer offer;
 		helix::SendBuffer send_req;
 		helix::RecvInline recv_resp;
@@ -74,6 +89,12 @@ struct Node : FsNode {
 		stats.ctimeSecs = resp.ctime_secs();
 		stats.ctimeNanos = resp.ctime_nanos();
 
+		// Do not cache the result if the node was modified while the request was in flight.
+		if(seq == _statsSeq) {
+			_cachedStats = stats;
+			_statsDeadline = now + statsCacheTtl;
+			_statsValid = true;
+		}
 		co_return stats;
 	}
 
@@ -81,6 +102,7 @@ struct Node : FsNode {
 		managarm::fs::CntRequest req;
 		req.set_req_type(managarm::fs::CntReqType::NODE_CHMOD);
 		req.set_mode(mode);
+		invalidateStats();
 
 		auto ser = req.SerializeAsString();
 		auto [offer, send_req, recv_resp] = co_await helix_ng::exchangeMsgs(
@@ -108,6 +130,7 @@ struct Node : FsNode {
 		req.set_atime_nsec(atime_nsec);
 		req.set_mtime_sec(mtime_sec);
 		req.set_mtime_nsec(mtime_nsec);
+		invalidateStats();
 
 		auto ser = req.SerializeAsString();
 		auto [offer, send_req, recv_resp] = co_await helix_ng::exchangeMsgs(
@@ -153,27 +176,133 @@ public:
 		return _self;
 	}
 
+	// Must be called when posix modifies the node.
+	void invalidateStats() {
+		_statsValid = false;
+		_statsSeq++;
+		globalStatsSeq++;
+	}
+
+	// Caches stats that were returned by another request than NODE_GET_STATS.
+	// seq is the value of globalStatsSeq before that request was sent.
+	void primeStats(uint64_t seq, const managarm::fs::NodeStats &msg) {
+		if(seq != globalStatsSeq)
+			return;
+		uint64_t now;
+		HEL_CHECK(helGetClock(&now));
+
+		FileStats stats{};
+		stats.inodeNumber = getInode();
+		stats.fileSize = msg.file_size();
+		stats.numLinks = msg.num_links();
+		stats.mode = msg.mode();
+		stats.uid = msg.uid();
+		stats.gid = msg.gid();
+		stats.atimeSecs = msg.atime_secs();
+		stats.atimeNanos = msg.atime_nanos();
+		stats.mtimeSecs = msg.mtime_secs();
+		stats.mtimeNanos = msg.mtime_nanos();
+		stats.ctimeSecs = msg.ctime_secs();
+		stats.ctimeNanos = msg.ctime_nanos();
+
+		_cachedStats = stats;
+		_statsDeadline = now + statsCacheTtl;
+		_statsValid = true;
+	}
+
 private:
 	std::weak_ptr<Node> _self;
 	uint64_t _inode;
 	helix::UniqueLane _lane;
+
+	bool _statsValid = false;
+	uint64_t _statsSeq = 0;
+	uint64_t _statsDeadline = 0;
+	FileStats _cachedStats;
 };
 
 struct OpenFile final : File {
 private:
 	async::result<frg::expected<Error, off_t>> seek(off_t offset, VfsSeek whence) override {
+		if(whence == VfsSeek::relative)
+			co_return co_await _file.seekRelative(offset);
+		if(whence == VfsSeek::eof)
+			co_return co_await _file.seekEof(offset);
 		assert(whence == VfsSeek::absolute);
 		co_await _file.seekAbsolute(offset);
 		co_return offset;
 	}
 
+	// Regular files are accessed through their page cache: the server only moves the
+	// file position (PT_ADVANCE) and we copy the data from/to the file's memory.
+	// This avoids sending the data itself over IPC.
+	async::result<bool> _accessPageCache() {
+		if(!_usePageCache)
+			co_return false;
+		if(!_memory) {
+			auto memory = co_await _file.accessMemory();
+			if(!_memory)
+				_memory = std::move(memory);
+		}
+		co_return true;
+	}
+
 	// TODO: Ensure that the process is null? Pass credentials of the thread in the request?
 	async::result<frg::expected<Error, size_t>>
 	readSome(Process *, void *data, size_t max_length) override {
+		if(co_await _accessPageCache()) {
+			auto result = co_await _file.advance(max_length, false);
+			if(result) {
+				auto [offset, length] = result.value();
+				if(!length)
+					co_return 0;
+				auto readMemory = co_await helix_ng::readMemory(_memory,
+						offset, length, data);
+				HEL_CHECK(readMemory.error());
+				co_return length;
+			}
+			// The server does not support PT_ADVANCE; fall back to READ.
+			assert(result.error() == protocols::fs::Error::illegalOperationTarget);
+			_usePageCache = false;
+		}
+
 		size_t length = co_await _file.readSome(data, max_length);
 		co_return length;
 	}
 
+	async::result<frg::expected<Error, size_t>>
+	writeAll(Process *, const void *data, size_t length) override {
+		if(!length)
+			co_return 0;
+		static_cast<Node *>(associatedLink()->getTarget().get())->invalidateStats();
+
+		if(co_await _accessPageCache()) {
+			auto result = co_await _file.advance(length, true);
+			if(result) {
+				auto [offset, reserved] = result.value();
+				assert(reserved == length);
+				auto writeMemory = co_await helix_ng::writeMemory(_memory,
+						offset, length, data);
+				HEL_CHECK(writeMemory.error());
+				co_return length;
+			}
+			if(result.error() == protocols::fs::Error::noSpaceLeft)
+				co_return Error::noSpaceLeft;
+			assert(result.error() == protocols::fs::Error::illegalOperationTarget);
+			_usePageCache = false;
+		}
+
+		size_t progress = 0;
+		while(progress < length) {
+			auto chunk = co_await _file.writeSome(
+					reinterpret_cast<const char *>(data) + progress, length - progress);
+			if(!chunk)
+				break;
+			progress += chunk;
+		}
+		co_return progress;
+	}
+
 	async::result<frg::expected<Error, PollWaitResult>>
 	pollWait(Process *, uint64_t sequence, int mask,
 			async::cancellation_token cancellation) override {
@@ -204,8 +333,16 @@ private:
 public:
 	OpenFile(helix::UniqueLane control, helix::UniqueLane lane,
 			std::shared_ptr<MountView> mount, std::shared_ptr<FsLink> link)
-	: File{StructName::get("externfs.file"), std::move(mount), std::move(link)},
-			_control{std::move(control)}, _file{std::move(lane)} { }
+	: File{StructName::get("externfs.file"), mount, link, defaultOpsFor(link)},
+			_control{std::move(control)}, _file{std::move(lane)},
+			_usePageCache{(defaultOpsFor(link) & File::defaultMemoryCopy) != 0} { }
+
+	// Directories are opened as OpenFiles, too, but only regular files have memory.
+	static DefaultOps defaultOpsFor(const std::shared_ptr<FsLink> &link) {
+		if(link && link->getTarget()->getType() == VfsType::regular)
+			return File::defaultMemoryCopy;
+		return 0;
+	}
 
 	~OpenFile() {
 		// It's not necessary to do any cleanup here.
@@ -220,6 +357,7 @@ public:
 		managarm::fs::CntRequest req;
 		req.set_req_type(managarm::fs::CntReqType::PT_TRUNCATE);
 		req.set_size(size);
+		static_cast<Node *>(associatedLink()->getTarget().get())->invalidateStats();
 
 		auto ser = req.SerializeAsString();
 		auto [offer, send_req, recv_resp]
@@ -239,9 +377,37 @@ public:
 		co_return {};
 	}
 
+	async::result<frg::expected<Error>> sync(bool data_only) override {
+		managarm::fs::CntRequest req;
+		req.set_req_type(managarm::fs::CntReqType::PT_FSYNC);
+		req.set_flags(data_only ? 1 : 0);
+
+		auto ser = req.SerializeAsString();
+		auto [offer, send_req, recv_resp]
+				= co_await helix_ng::exchangeMsgs(getPassthroughLane(),
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvInline()
+			)
+		);
+		HEL_CHECK(offer.error());
+		HEL_CHECK(send_req.error());
+		HEL_CHECK(recv_resp.error());
+
+		managarm::fs::SvrResponse resp;
+		resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+		if(resp.error() != managarm::fs::Errors::SUCCESS)
+			co_return Error::illegalOperationTarget;
+		co_return {};
+	}
+
 private:
 	helix::UniqueLane _control;
 	protocols::fs::File _file;
+
+	// Memory object of the file's page cache; obtained on first use.
+	bool _usePageCache;
+	helix::UniqueDescriptor _memory;
 };
 
 struct RegularNode final : Node {
@@ -442,10 +608,24 @@ private:
 
 	async::result<frg::expected<Error, std::pair<std::shared_ptr<FsLink>, size_t>>>
 	traverseLinks(std::deque<std::string> path) override {
+		// Serve the first component from the link cache if possible.
+		// PathResolver calls us again for the remaining components.
+		std::shared_ptr<FsLink> cached;
+		if(lookupCachedLink(this, path.front(), cached)) {
+			if(!cached)
+				co_return Error::noSuchFile;
+			co_return std::make_pair(std::move(cached), size_t{1});
+		}
+
+		auto sequence = linkCacheSequence();
+		auto statsSeq = globalStatsSeq;
 		managarm::fs::CntRequest req;
 		req.set_req_type(managarm::fs::CntReqType::NODE_TRAVERSE_LINKS);
 		for (auto &i : path)
 			req.add_path_segments(i);
+		// The caller usually stat()s the result (and open() checks its mode),
+		// so fetch the stats in the same round trip.
+		req.set_want_stats(1);
 
 		auto ser = req.SerializeAsString();
 		auto [offer, send_req, recv_resp, pull_desc] = co_await helix_ng::exchangeMsgs(
@@ -467,6 +647,9 @@ private:
 		resp.ParseFromArray(recv_resp.data(), recv_resp.length());
 
 		if (resp.error() == managarm::fs::Errors::FILE_NOT_FOUND) {
+			// We only know which component is missing if there is only one.
+			if(path.size() == 1)
+				cacheLink(sequence, std::shared_ptr<Node>{weakNode()}, path.front(), nullptr);
 			co_return Error::noSuchFile;
 		} else if (resp.error() == managarm::fs::Errors::NOT_DIRECTORY) {
 			co_return Error::notDirectory;
@@ -480,6 +663,9 @@ private:
 		assert(resp.links_traversed());
 		assert(resp.links_traversed() <= path.size());
 
+		// Servers that do not implement getStats (or old servers) do not return stats.
+		bool haveStats = resp.node_stats().size() == resp.ids().size();
+
 		std::shared_ptr<Node> parentNode{weakNode()};
 		for (size_t i = 0; i < resp.ids().size(); i++) {
 			auto [pull_node] = co_await helix_ng::exchangeMsgs(
@@ -493,6 +679,9 @@ private:
 					|| resp.file_type() == managarm::fs::FileType::DIRECTORY) {
 				auto child = _sb->internalizeStructural(parentNode.get(), path[i],
 						resp.ids()[i], pull_node.descriptor());
+				cacheLink(sequence, parentNode, path[i], child->treeLink());
+				if(haveStats)
+					child->primeStats(statsSeq, resp.node_stats()[i]);
 				if (i != resp.ids().size() - 1)
 					parentNode = child;
 				else
@@ -500,7 +689,10 @@ private:
 			}else{
 				auto child = _sb->internalizePeripheralNode(resp.file_type(), resp.ids()[i],
 						pull_node.descriptor());
+				if(haveStats)
+					child->primeStats(statsSeq, resp.node_stats()[i]);
 				link = _sb->internalizePeripheralLink(parentNode.get(), path[i], std::move(child));
+				cacheLink(sequence, parentNode, path[i], link);
 			}
 		}
 
@@ -526,6 +718,10 @@ private:
 		HEL_CHECK(sendReq.error());
 		HEL_CHECK(recvResp.error());
 
+		// The directory changed; cached lookups and attributes might be stale.
+		invalidateCachedLink(this, name);
+		invalidateStats();
+
 		managarm::fs::SvrResponse resp;
 		resp.ParseFromArray(recvResp.data(), recvResp.length());
 		if(resp.error() == managarm::fs::Errors::SUCCESS) {
@@ -563,6 +759,10 @@ private:
 		HEL_CHECK(sendTarget.error());
 		HEL_CHECK(recvResp.error());
 
+		// The directory changed; cached lookups and attributes might be stale.
+		invalidateCachedLink(this, name);
+		invalidateStats();
+
 		managarm::fs::SvrResponse resp;
 		resp.ParseFromArray(recvResp.data(), recvResp.length());
 		if(resp.error() == managarm::fs::Errors::SUCCESS) {
@@ -591,6 +791,11 @@ private:
 		helix::RecvInline recv_resp;
 		helix::PullDescriptor pull_node;
 
+		std::shared_ptr<FsLink> cached;
+		if(lookupCachedLink(this, name, cached))
+			co_return cached;
+
+		auto sequence = linkCacheSequence();
 		managarm::fs::CntRequest req;
 		req.set_req_type(managarm::fs::CntReqType::NODE_GET_LINK);
 		req.set_path(name);
@@ -611,16 +816,20 @@ private:
 		if(resp.error() == managarm::fs::Errors::SUCCESS) {
 			HEL_CHECK(pull_node.error());
 
+			std::shared_ptr<FsLink> link;
 			if(resp.file_type() == managarm::fs::FileType::DIRECTORY) {
 				auto child = _sb->internalizeStructural(this, name,
 						resp.id(), pull_node.descriptor());
-				co_return child->treeLink();
+				link = child->treeLink();
 			}else{
 				auto child = _sb->internalizePeripheralNode(resp.file_type(), resp.id(),
 						pull_node.descriptor());
-				co_return _sb->internalizePeripheralLink(this, name, std::move(child));
+				link = _sb->internalizePeripheralLink(this, name, std::move(child));
 			}
+			cacheLink(sequence, std::shared_ptr<Node>{weakNode()}, name, link);
+			co_return link;
 		}else if(resp.error() == managarm::fs::Errors::FILE_NOT_FOUND) {
+			cacheLink(sequence, std::shared_ptr<Node>{weakNode()}, name, nullptr);
 			co_return nullptr;
 		}else{
 			assert(resp.error() == managarm::fs::Errors::NOT_DIRECTORY);
@@ -651,6 +860,11 @@ private:
 		HEL_CHECK(send_req.error());
 		HEL_CHECK(recv_resp.error());
 
+		// The directory changed; cached lookups and attributes might be stale.
+		invalidateCachedLink(this, name);
+		invalidateStats();
+		static_cast<Node *>(target.get())->invalidateStats();
+
 		managarm::fs::SvrResponse resp;
 		resp.ParseFromArray(recv_resp.data(), recv_resp.length());
 		if(resp.error() == managarm::fs::Errors::SUCCESS) {
@@ -689,6 +903,14 @@ private:
 		HEL_CHECK(send_req.error());
 		HEL_CHECK(recv_resp.error());
 
+		// The link count of the target changes.
+		std::shared_ptr<FsLink> cached;
+		if(lookupCachedLink(this, name, cached) && cached)
+			static_cast<Node *>(cached->getTarget().get())->invalidateStats();
+		// The directory changed; cached lookups and attributes might be stale.
+		invalidateCachedLink(this, name);
+		invalidateStats();
+
 		managarm::fs::SvrResponse resp;
 		resp.ParseFromArray(recv_resp.data(), recv_resp.length());
 		if(resp.error() == managarm::fs::Errors::FILE_NOT_FOUND)
@@ -714,6 +936,10 @@ private:
 		HEL_CHECK(send_req.error());
 		HEL_CHECK(recv_resp.error());
 
+		// The directory changed; cached lookups and attributes might be stale.
+		invalidateCachedLink(this, name);
+		invalidateStats();
+
 		managarm::fs::SvrResponse resp;
 		resp.ParseFromArray(recv_resp.data(), recv_resp.length());
 		assert(resp.error() == managarm::fs::Errors::SUCCESS);
@@ -845,6 +1071,12 @@ async::result<frg::expected<Error, std::shared_ptr<FsLink>>>
 	HEL_CHECK(send_tail.error());
 	HEL_CHECK(recv_resp.error());
 
+	invalidateCachedLink(source_node, source->getName());
+	invalidateCachedLink(target_node, name);
+	source_node->invalidateStats();
+	target_node->invalidateStats();
+	shared_node->invalidateStats();
+
 	managarm::fs::SvrResponse resp;
 	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
 	if(resp.error() == managarm::fs::Errors::SUCCESS) {
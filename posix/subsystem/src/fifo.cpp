@@ -2,12 +2,12 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <iostream>
-#include <deque>
 #include <map>
 
 #include <async/recurring-event.hpp>
 #include <helix/ipc.hpp>
 #include "fifo.hpp"
+#include "ring-buffer.hpp"
 
 #include <experimental/coroutine>
 
@@ -17,12 +17,11 @@ namespace {
 
 constexpr bool logFifos = false;
 
-struct Packet {
-	// The actual octet data that the packet consists of.
-	std::vector<char> buffer;
+// Capacity of a pipe; this matches Linux' default.
+constexpr size_t pipeCapacity = 64 * 1024;
 
-	size_t offset = 0;
-};
+// Writes of up to PIPE_BUF bytes are not interleaved with other writes.
+constexpr size_t pipeAtomicSize = 4096;
 
 struct Channel {
 	Channel()
@@ -35,14 +34,15 @@ struct Channel {
 	uint64_t noWriterSeq = 0;
 	uint64_t noReaderSeq = 0;
 	uint64_t inSeq = 0;
+	uint64_t outSeq = 1;
 	int writerCount;
 	int readerCount;
 
 	async::recurring_event readerPresent;
 	async::recurring_event writerPresent;
 
-	// The actual queue of this pipe.
-	std::deque<Packet> packetQueue;
+	// The data that is buffered in this pipe.
+	RingBuffer buffer{pipeCapacity};
 };
 
 struct ReaderFile : File {
@@ -80,7 +80,7 @@ public:
 		if(!maxLength)
 			co_return 0;
 
-		while(_channel->packetQueue.empty() && _channel->writerCount) {
+		while(!_channel->buffer.size() && _channel->writerCount) {
 			if(nonBlock_) {
 				if(logFifos)
 					std::cout << "posix: FIFO pipe would block" << std::endl;
@@ -89,19 +89,17 @@ public:
 			co_await _channel->statusBell.async_wait();
 		}
 
-		if(_channel->packetQueue.empty()) {
+		if(!_channel->buffer.size()) {
 			assert(!_channel->writerCount);
 			co_return 0;
 		}
 
-		// TODO: Truncate packets (for SOCK_DGRAM) here.
-		auto packet = &_channel->packetQueue.front();
-		size_t chunk = std::min(packet->buffer.size() - packet->offset, maxLength);
+		size_t chunk = _channel->buffer.read(data, maxLength);
 		assert(chunk); // Otherwise we return above since !maxLength.
-		memcpy(data, packet->buffer.data() + packet->offset, chunk);
-		packet->offset += chunk;
-		if(packet->offset == packet->buffer.size())
-			_channel->packetQueue.pop_front();
+
+		// Wake up writers that wait for space.
+		_channel->outSeq = ++_channel->currentSeq;
+		_channel->statusBell.raise();
 		co_return chunk;
 	}
 
@@ -132,7 +130,7 @@ public:
 		int events = 0;
 		if(!_channel->writerCount)
 			events |= EPOLLHUP;
-		if(!_channel->packetQueue.empty())
+		if(_channel->buffer.size())
 			events |= EPOLLIN;
 
 		co_return PollStatusResult(_channel->currentSeq, events);
@@ -200,16 +198,31 @@ public:
 	}
 
 	async::result<frg::expected<Error, size_t>>
-	writeAll(Process *process, const void *data, size_t maxLength) override {
-		Packet packet;
-		packet.buffer.resize(maxLength);
-		memcpy(packet.buffer.data(), data, maxLength);
-		packet.offset = 0;
-
-		_channel->packetQueue.push_back(std::move(packet));
-		_channel->inSeq = ++_channel->currentSeq;
-		_channel->statusBell.raise();
-		co_return maxLength;
+	writeAll(Process *, const void *data, size_t maxLength) override {
+		size_t progress = 0;
+		while(progress < maxLength) {
+			if(!_channel->readerCount) {
+				if(progress)
+					co_return progress;
+				co_return Error::brokenPipe;
+			}
+
+			// Small writes must be performed in one piece.
+			auto remaining = maxLength - progress;
+			auto space = _channel->buffer.space();
+			if(!space || (remaining <= pipeAtomicSize && space < remaining)) {
+				co_await _channel->statusBell.async_wait();
+				continue;
+			}
+
+			auto chunk = std::min(remaining, space);
+			_channel->buffer.write(static_cast<const char *>(data) + progress, chunk);
+			progress += chunk;
+
+			_channel->inSeq = ++_channel->currentSeq;
+			_channel->statusBell.raise();
+		}
+		co_return progress;
 	}
 
 	async::result<frg::expected<Error, PollWaitResult>>
@@ -224,7 +237,9 @@ public:
 		if(cancellation.is_cancellation_requested())
 			std::cout << "\e[33mposix: fifo::poll() cancellation is untested\e[39m" << std::endl;
 
-		int edges = EPOLLOUT;
+		int edges = 0;
+		if(_channel->outSeq > pastSeq && _channel->buffer.space() >= pipeAtomicSize)
+			edges |= EPOLLOUT;
 		if(_channel->noReaderSeq > pastSeq)
 			edges |= EPOLLERR;
 
@@ -233,7 +248,9 @@ public:
 
 	async::result<frg::expected<Error, PollStatusResult>>
 	pollStatus(Process *) override {
-		int events = EPOLLOUT;
+		int events = 0;
+		if(_channel->buffer.space() >= pipeAtomicSize)
+			events |= EPOLLOUT;
 		if(!_channel->readerCount)
 			events |= EPOLLERR;
 
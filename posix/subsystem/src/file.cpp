@@ -5,6 +5,7 @@
 
 #include <sys/socket.h>
 #include <helix/ipc.hpp>
+#include <helix/memory.hpp>
 #include "file.hpp"
 #include "process.hpp"
 #include "fs.bragi.hpp"
@@ -85,6 +86,8 @@ async::result<frg::expected<protocols::fs::Error, size_t>> File::ptWrite(void *o
 		switch(result.error()) {
 		case Error::noSpaceLeft:
 			co_return protocols::fs::Error::noSpaceLeft;
+		case Error::brokenPipe:
+			co_return protocols::fs::Error::brokenPipe;
 		default:
 			assert(!"Unexpected error from writeAll()");
 			__builtin_unreachable();
@@ -166,6 +169,23 @@ async::result<frg::expected<protocols::fs::Error, size_t>> File::ptPeername(void
 	return self->peername(addr_ptr, max_addr_length);
 }
 
+async::result<protocols::fs::Error> File::ptFlock(void *object, int flags) {
+	auto self = static_cast<File *>(object);
+	if(!self->_link)
+		co_return protocols::fs::Error::illegalOperationTarget;
+	co_return co_await self->_link->getTarget()->fileLocks().flock(&self->_lockHolder, flags);
+}
+
+async::result<frg::expected<protocols::fs::Error, protocols::fs::RangeLock>>
+File::ptLockRange(void *object, protocols::fs::RangeLockCommand command, bool ofd,
+		protocols::fs::RangeLock lock) {
+	auto self = static_cast<File *>(object);
+	if(!self->_link)
+		co_return protocols::fs::Error::illegalOperationTarget;
+	co_return co_await self->_link->getTarget()->fileLocks().lockRange(&self->_lockHolder,
+			command, ofd, lock);
+}
+
 async::result<frg::expected<protocols::fs::Error, int>> File::ptGetSeals(void *object) {
 	auto self = static_cast<File *>(object);
 	co_return co_await self->getSeals();
@@ -266,6 +286,96 @@ async::result<frg::expected<Error, size_t>> File::writeAll(Process *, const void
 	throw std::runtime_error("posix: Object has no File::writeAll()");
 }
 
+async::result<frg::expected<Error, size_t>>
+File::copyTo(Process *process, File *dest, size_t length) {
+	// Upper bound on the amount of data that a single call copies.
+	constexpr size_t maxCopySize = size_t(16) << 20;
+	constexpr size_t bounceSize = 0x10000;
+
+	length = std::min(length, maxCopySize);
+	if(!length)
+		co_return 0;
+
+	if(_defaultOps & defaultMemoryCopy) {
+		// Write directly from a mapping of the file's memory.
+		auto offset = FRG_CO_TRY(co_await seek(0, VfsSeek::relative));
+		auto end = FRG_CO_TRY(co_await seek(0, VfsSeek::eof));
+		if(offset >= end) {
+			FRG_CO_TRY(co_await seek(offset, VfsSeek::absolute));
+			co_return 0;
+		}
+		auto chunk = std::min(length, size_t(end - offset));
+
+		auto memory = co_await accessMemory();
+		auto misalign = offset & (helix::Mapping::pageSize - 1);
+		helix::Mapping window{memory, offset - misalign,
+				(misalign + chunk + helix::Mapping::pageSize - 1)
+					& ~(helix::Mapping::pageSize - 1),
+				kHelMapProtRead};
+		auto result = co_await dest->writeAll(process,
+				reinterpret_cast<char *>(window.get()) + misalign, chunk);
+		size_t progress = result ? result.value() : 0;
+		FRG_CO_TRY(co_await seek(offset + progress, VfsSeek::absolute));
+		if(!result)
+			co_return result.error();
+		co_return progress;
+	}
+
+	// Bounce the data through a buffer in the server.
+	std::vector<char> buffer(std::min(length, bounceSize));
+	size_t progress = 0;
+	while(progress < length) {
+		auto readResult = co_await readSome(process, buffer.data(),
+				std::min(length - progress, buffer.size()));
+		if(!readResult) {
+			if(progress)
+				break;
+			co_return readResult.error();
+		}
+		if(!readResult.value())
+			break;
+
+		auto writeResult = co_await dest->writeAll(process, buffer.data(), readResult.value());
+		if(!writeResult) {
+			if(progress)
+				break;
+			co_return writeResult.error();
+		}
+		progress += writeResult.value();
+		if(writeResult.value() < readResult.value())
+			break;
+	}
+	co_return progress;
+}
+
+async::result<frg::expected<Error>> File::advise(off_t offset, size_t length, int advice) {
+	if(offset < 0)
+		co_return Error::illegalArguments;
+	if(advice != POSIX_FADV_WILLNEED || !(_defaultOps & defaultMemoryCopy))
+		co_return {};
+
+	// Determine the size of the file without disturbing the file offset.
+	auto current = FRG_CO_TRY(co_await seek(0, VfsSeek::relative));
+	auto end = FRG_CO_TRY(co_await seek(0, VfsSeek::eof));
+	FRG_CO_TRY(co_await seek(current, VfsSeek::absolute));
+	if(offset >= end)
+		co_return {};
+	if(!length || length > size_t(end - offset))
+		length = end - offset;
+
+	// Let the kernel (and the fs server for extern files) start loading the pages.
+	auto memory = co_await accessMemory();
+	auto misalign = offset & (helix::Mapping::pageSize - 1);
+	HEL_CHECK(helLoadahead(memory.getHandle(), offset - misalign,
+			(misalign + length + helix::Mapping::pageSize - 1)
+				& ~(helix::Mapping::pageSize - 1)));
+	co_return {};
+}
+
+async::result<frg::expected<Error>> File::sync(bool) {
+	co_return {};
+}
+
 async::result<ReadEntriesResult> File::readEntries() {
 	throw std::runtime_error("posix: Object has no File::readEntries()");
 }
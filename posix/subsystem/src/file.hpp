@@ -8,6 +8,7 @@
 #include <boost/intrusive/rbtree.hpp>
 #include <frg/expected.hpp>
 #include <hel.h>
+#include <protocols/fs/file-locks.hpp>
 #include <protocols/fs/server.hpp>
 #include "common.hpp"
 
@@ -58,7 +59,10 @@ enum class Error {
 	noSpaceLeft,
 
 	// Corresponds with EISDIR
-	isDirectory
+	isDirectory,
+
+	// Corresponds with EBADF
+	badFd
 };
 
 // TODO: Rename this enum as is not part of the VFS.
@@ -95,6 +99,8 @@ public:
 	using DefaultOps = uint32_t;
 	static inline constexpr DefaultOps defaultIsTerminal = 1 << 1;
 	static inline constexpr DefaultOps defaultPipeLikeSeek = 1 << 2;
+	// The file's contents can be mapped through accessMemory() (i.e., it is a regular file).
+	static inline constexpr DefaultOps defaultMemoryCopy = 1 << 3;
 
 	// ------------------------------------------------------------------------
 	// File protocol adapters.
@@ -145,6 +151,13 @@ public:
 	ptIoctl(void *object, managarm::fs::CntRequest req,
 			helix::UniqueLane conversation);
 
+	static async::result<protocols::fs::Error>
+	ptFlock(void *object, int flags);
+
+	static async::result<frg::expected<protocols::fs::Error, protocols::fs::RangeLock>>
+	ptLockRange(void *object, protocols::fs::RangeLockCommand command, bool ofd,
+			protocols::fs::RangeLock lock);
+
 	static async::result<int>
 	ptGetFileFlags(void *object);
 
@@ -182,6 +195,8 @@ public:
 		.truncate = &ptTruncate,
 		.fallocate = &ptAllocate,
 		.ioctl = &ptIoctl,
+		.flock = &ptFlock,
+		.lockRange = &ptLockRange,
 		.getOption = &ptGetOption,
 		.setOption = &ptSetOption,
 		.bind = &ptBind,
@@ -273,6 +288,20 @@ public:
 	virtual async::result<frg::expected<Error, size_t>>
 	writeAll(Process *process, const void *data, size_t length);
 
+	// Copies up to length bytes from the current offset of this file to the current
+	// offset of dest and advances both offsets. Used by copy_file_range() and sendfile();
+	// the data never passes through the client.
+	virtual async::result<frg::expected<Error, size_t>>
+	copyTo(Process *process, File *dest, size_t length);
+
+	// Handles posix_fadvise(). Advice is only a hint; the default implementation
+	// starts readahead for POSIX_FADV_WILLNEED on files that can be mapped.
+	virtual async::result<frg::expected<Error>> advise(off_t offset, size_t length, int advice);
+
+	// Handles fsync() and fdatasync(). The default implementation does nothing,
+	// which is correct for files that are not backed by storage.
+	virtual async::result<frg::expected<Error>> sync(bool data_only);
+
 	virtual FutureMaybe<ReadEntriesResult> readEntries();
 
 	virtual async::result<protocols::fs::RecvResult>
@@ -346,6 +375,9 @@ private:
 	DefaultOps _defaultOps;
 
 	bool _isOpen;
+
+	// Declared after _link such that our locks are released before the node can go away.
+	protocols::fs::FileLockHolder _lockHolder;
 };
 
 struct DummyFile final : File {
@@ -174,6 +174,11 @@ public:
 	virtual bool hasTraverseLinks();
 	virtual async::result<frg::expected<Error, std::pair<std::shared_ptr<FsLink>, size_t>>> traverseLinks(std::deque<std::string> path);
 
+	// flock() and fcntl() locks of the node.
+	protocols::fs::FileLockManager &fileLocks() {
+		return _fileLocks;
+	}
+
 protected:
 	void notifyObservers(uint32_t inotifyEvents, const std::string &name, uint32_t cookie);
 
@@ -183,6 +188,8 @@ private:
 
 	// Observers, for example for inotify.
 	std::unordered_map<FsObserver *, std::shared_ptr<FsObserver>> _observers;
+
+	protocols::fs::FileLockManager _fileLocks;
 };
 
 // ----------------------------------------------------------------------------
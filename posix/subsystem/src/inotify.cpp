@@ -2,6 +2,7 @@
 #include <sys/epoll.h>
 #include <sys/inotify.h>
 #include <iostream>
+#include <unordered_map>
 
 #include <async/recurring-event.hpp>
 #include <helix/ipc.hpp>
@@ -34,9 +35,7 @@ public:
 				inotifyEvents |= IN_DELETE;
 			if(!(inotifyEvents & mask))
 				return;
-			file->_queue.push_back(Packet{descriptor, inotifyEvents & mask, name, cookie});
-			file->_inSeq = ++file->_currentSeq;
-			file->_statusBell.raise();
+			file->postEvent(Packet{descriptor, inotifyEvents & mask, name, cookie});
 		}
 
 		OpenFile *file;
@@ -59,26 +58,60 @@ public:
 		std::cout << "\e[31m" "posix: Destruction of inotify leaks watches" "\e[39m" << std::endl;
 	}
 
+	// Size of the name field of an event; it is NUL-terminated and padded such that
+	// the next event is aligned.
+	static size_t nameLength(const Packet &packet) {
+		if(packet.name.empty())
+			return 0;
+		return (packet.name.size() + alignof(inotify_event)) & ~(alignof(inotify_event) - 1);
+	}
+
+	void postEvent(Packet packet) {
+		// Like Linux, merge identical events as long as the previous one was not read.
+		if(!_queue.empty()) {
+			auto &last = _queue.back();
+			if(last.descriptor == packet.descriptor && last.events == packet.events
+					&& last.cookie == packet.cookie && last.name == packet.name)
+				return;
+		}
+
+		_queue.push_back(std::move(packet));
+		_inSeq = ++_currentSeq;
+		_statusBell.raise();
+	}
+
 	async::result<frg::expected<Error, size_t>>
 	readSome(Process *, void *data, size_t maxLength) override {
-		// TODO: As an optimization, we could return multiple events at the same time.
-		Packet packet = std::move(_queue.front());
-		_queue.pop_front();
-
-		if(maxLength < sizeof(inotify_event) + packet.name.size() + 1)
-			co_return Error::illegalArguments;
-
-		inotify_event e;
-		memset(&e, 0, sizeof(inotify_event));
-		e.wd = packet.descriptor;
-		e.mask = packet.events;
-		e.cookie = packet.cookie;
-		e.len = packet.name.size();
-
-		memcpy(data, &e, sizeof(inotify_event));
-		memcpy(reinterpret_cast<char *>(data) + sizeof(inotify_event),
-				packet.name.c_str(), packet.name.size() + 1);
-		co_return sizeof(inotify_event) + packet.name.size() + 1;
+		while(_queue.empty())
+			co_await _statusBell.async_wait();
+
+		// Return as many events as fit into the buffer.
+		size_t progress = 0;
+		while(!_queue.empty()) {
+			auto &packet = _queue.front();
+			auto length = nameLength(packet);
+			if(maxLength - progress < sizeof(inotify_event) + length) {
+				if(!progress)
+					co_return Error::illegalArguments;
+				break;
+			}
+
+			inotify_event e;
+			memset(&e, 0, sizeof(inotify_event));
+			e.wd = packet.descriptor;
+			e.mask = packet.events;
+			e.cookie = packet.cookie;
+			e.len = length;
+
+			auto out = reinterpret_cast<char *>(data) + progress;
+			memcpy(out, &e, sizeof(inotify_event));
+			memset(out + sizeof(inotify_event), 0, length);
+			memcpy(out + sizeof(inotify_event), packet.name.data(), packet.name.size());
+			progress += sizeof(inotify_event) + length;
+
+			_queue.pop_front();
+		}
+		co_return progress;
 	}
 
 	async::result<frg::expected<Error, PollWaitResult>>
@@ -113,19 +146,42 @@ public:
 	}
 
 	int addWatch(std::shared_ptr<FsNode> node, uint32_t mask) {
-		// TODO: Coalesce watch descriptors for the same inode.
-		if(mask & ~(IN_DELETE))
+		if(mask & ~(IN_DELETE | IN_MASK_ADD))
 			std::cout << "posix: inotify mask " << mask << " is partially ignored" << std::endl;
+
+		// Watches on the same inode share a descriptor (and a single observer).
+		if(auto it = _watches.find(node.get()); it != _watches.end()) {
+			auto &entry = it->second;
+			if(entry.node.lock() == node) {
+				if(mask & IN_MASK_ADD) {
+					entry.watch->mask |= mask & ~IN_MASK_ADD;
+				}else{
+					entry.watch->mask = mask;
+				}
+				return entry.watch->descriptor;
+			}
+			_watches.erase(it);
+		}
+
 		auto descriptor = _nextDescriptor++;
-		auto watch = std::make_shared<Watch>(this, descriptor, mask);
+		auto watch = std::make_shared<Watch>(this, descriptor, mask & ~IN_MASK_ADD);
 		node->addObserver(watch);
+		_watches.insert({node.get(), WatchEntry{node, std::move(watch)}});
 		return descriptor;
 	}
 
 private:
+	struct WatchEntry {
+		// Used to detect that the node was destructed (and its address reused).
+		std::weak_ptr<FsNode> node;
+		std::shared_ptr<Watch> watch;
+	};
+
 	helix::UniqueLane _passthrough;
 	std::deque<Packet> _queue;
 
+	std::unordered_map<FsNode *, WatchEntry> _watches;
+
 	// TODO: Use a proper ID allocator to allocate watch descriptor IDs.
 	int _nextDescriptor = 1;
 
@@ -11,11 +11,16 @@
 #include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 
 #include <async/algorithm.hpp>
 #include <async/oneshot-event.hpp>
+#include <async/queue.hpp>
+#include <async/recurring-event.hpp>
 #include <protocols/mbus/client.hpp>
 #include <helix/timer.hpp>
 
@@ -43,6 +48,7 @@
 #include "memfd.hpp"
 #include "procfs.hpp"
 #include "pts.hpp"
+#include "requests.hpp"
 #include "signalfd.hpp"
 #include "subsystem/block.hpp"
 #include "subsystem/drm.hpp"
@@ -69,6 +75,8 @@ namespace {
 	constexpr bool debugFaults = false;
 }
 
+// Protects globalCredentialsMap. Shared between all serve workers.
+std::mutex globalCredentialsMutex;
 std::map<
 	std::array<char, 16>,
 	std::shared_ptr<Process>
@@ -77,6 +85,7 @@ std::map<
 std::shared_ptr<Process> findProcessWithCredentials(const char *credentials) {
 	std::array<char, 16> creds;
 	memcpy(creds.data(), credentials, 16);
+	std::lock_guard lock{globalCredentialsMutex};
 	return globalCredentialsMap.at(creds);
 }
 
@@ -219,7 +228,8 @@ async::result<void> observeThread(std::shared_ptr<Process> self,
 				self->fileContext()->clientMbusLane(),
 				self->clientThreadPage(),
 				static_cast<HelHandle *>(self->clientFileTable()),
-				self->clientClkTrackerPage()
+				self->clientClkTrackerPage(),
+				self->clientClockPage()
 			};
 
 			if(logRequests)
@@ -257,6 +267,32 @@ async::result<void> observeThread(std::shared_ptr<Process> self,
 
 			HEL_CHECK(helResume(thread.getHandle()));
 			HEL_CHECK(helResume(new_thread));
+		}else if(observe.observation() == kHelObserveSuperCall + 14) {
+			if(logRequests)
+				std::cout << "posix: vfork supercall" << std::endl;
+			auto child = Process::vfork(self);
+			auto vforkDone = child->vforkDone();
+
+			auto new_thread = child->threadDescriptor().getHandle();
+			uintptr_t pcrs[2], gprs[kHelNumGprs], thrs[2];
+			HEL_CHECK(helLoadRegisters(thread.getHandle(), kHelRegsProgram, &pcrs));
+			HEL_CHECK(helLoadRegisters(thread.getHandle(), kHelRegsGeneral, &gprs));
+			HEL_CHECK(helLoadRegisters(thread.getHandle(), kHelRegsThread, &thrs));
+
+			HEL_CHECK(helStoreRegisters(new_thread, kHelRegsProgram, &pcrs));
+			HEL_CHECK(helStoreRegisters(new_thread, kHelRegsThread, &thrs));
+
+			gprs[kHelRegError] = kHelErrNone;
+			gprs[kHelRegOut0] = 0;
+			HEL_CHECK(helStoreRegisters(new_thread, kHelRegsGeneral, &gprs));
+			HEL_CHECK(helResume(new_thread));
+
+			// The child runs on our stack; only resume once it execve()s or exits.
+			co_await vforkDone->wait();
+
+			gprs[kHelRegOut0] = child->pid();
+			HEL_CHECK(helStoreRegisters(thread.getHandle(), kHelRegsGeneral, &gprs));
+			HEL_CHECK(helResume(thread.getHandle()));
 		}else if(observe.observation() == kHelObserveSuperCall + 9) {
 			if(logRequests)
 				std::cout << "posix: clone supercall" << std::endl;
@@ -380,6 +416,8 @@ async::result<void> observeThread(std::shared_ptr<Process> self,
 			if(self->checkOrRequestSignalRaise()) {
 				auto active = co_await self->signalContext()->fetchSignal(
 						~self->signalMask(), true);
+				// Clear the bits that the thread used to decide to issue this supercall.
+				self->publishPendingSignals();
 				if(active) {
 					co_await self->signalContext()->raiseContext(active, self.get(), killed);
 				}
@@ -666,6 +704,14 @@ async::result<void> serveSignals(std::shared_ptr<Process> self,
 		auto result = co_await self->signalContext()->pollSignal(sequence,
 				UINT64_C(-1), cancellation);
 		sequence = std::get<0>(result);
+
+		// Do not interrupt the thread for signals that it blocks; instead, it checks
+		// the pending signals when it unblocks them. Since both sides first store
+		// (the pending set or the mask) and then load the other value (with seq_cst),
+		// at least one of them sees the other's update.
+		self->publishPendingSignals();
+		if(!(std::get<1>(result) & ~self->signalMask()))
+			continue;
 		//std::cout << "Calling helInterruptThread on " << self->pid() << std::endl;
 		HEL_CHECK(helInterruptThread(thread.getHandle()));
 	}
@@ -675,19 +721,48 @@ async::result<void> serveSignals(std::shared_ptr<Process> self,
 	generation->signalsDone.raise();
 }
 
-async::result<void> serveRequests(std::shared_ptr<Process> self,
-		std::shared_ptr<Generation> generation) {
-	async::cancellation_token cancellation = generation->cancelServe;
+// A request that was accepted on the posix lane but that is not handled yet.
+struct PendingRequest {
+	// Null for the element that marks the end of the queue.
+	helix::UniqueDescriptor conversation;
+	helix_ng::RecvInlineResult head;
+};
 
-	async::cancellation_callback cancel_callback{cancellation, [&] {
-		HEL_CHECK(helShutdownLane(self->posixLane().getHandle()));
-	}};
+// Requests that acceptRequests() passes to serveRequests().
+struct RequestQueue {
+	struct stl_allocator {
+		void *allocate(size_t size) {
+			return operator new(size);
+		}
+
+		void deallocate(void *p, size_t) {
+			return operator delete(p);
+		}
+	};
+
+	async::queue<PendingRequest, stl_allocator> queue;
+	// Raised when serveRequests() takes a request from the queue.
+	async::recurring_event spaceBell;
+	size_t numPending = 0;
+};
+
+// Bounds the number of accepted requests; each of them pins a chunk of the IPC queue.
+constexpr size_t maxPendingRequests = 4;
+
+// Keeps an accept operation posted on the posix lane while serveRequests() handles a request.
+// Requests that arrive in the meantime (e.g., from other threads) are handled back-to-back
+// instead of paying for another round trip through the dispatcher each.
+async::result<void> acceptRequests(std::shared_ptr<Process> self,
+		std::shared_ptr<Generation> generation, std::shared_ptr<RequestQueue> rq) {
+	while(!generation->inTermination) {
+		while(rq->numPending >= maxPendingRequests)
+			co_await rq->spaceBell.async_wait();
 
-	while(true) {
 		auto [accept, recv_head] = co_await helix_ng::exchangeMsgs(
 				self->posixLane(),
 				helix_ng::accept(
-					helix_ng::recvInline()
+					// Large enough for the heads of all requests (e.g., long paths).
+					helix_ng::recvInline(1024)
 				)
 			);
 
@@ -695,13 +770,48 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 			break;
 		HEL_CHECK(accept.error());
 
+		rq->numPending++;
+		rq->queue.put(PendingRequest{accept.descriptor(), std::move(recv_head)});
+	}
+
+	rq->queue.put(PendingRequest{});
+}
+
+async::result<void> serveRequests(std::shared_ptr<Process> self,
+		std::shared_ptr<Generation> generation, std::shared_ptr<RequestQueue> rq) {
+	async::cancellation_token cancellation = generation->cancelServe;
+
+	async::cancellation_callback cancel_callback{cancellation, [&] {
+		HEL_CHECK(helShutdownLane(self->posixLane().getHandle()));
+	}};
+
+	// Receives the tails of requests. Reused across requests such that
+	// steady-state requests do not allocate a new buffer.
+	std::vector<std::byte> tailBuffer;
+
+	bool queueDone = false;
+	while(true) {
+		auto pending = std::move(*(co_await rq->queue.async_get()));
+		rq->numPending--;
+		rq->spaceBell.raise();
+		if(!pending.conversation) {
+			queueDone = true;
+			break;
+		}
+		auto &recv_head = pending.head;
+
+		// Drop requests that were accepted before the thread was killed (by execve()
+		// or termination); their process image is gone.
+		if(generation->inTermination)
+			continue;
+
 		if(recv_head.error() == kHelErrBufferTooSmall) {
 			std::cout << "posix: Rejecting request due to RecvInline overflow" << std::endl;
 			continue;
 		}
 		HEL_CHECK(recv_head.error());
 
-		auto conversation = accept.descriptor();
+		auto conversation = std::move(pending.conversation);
 
 		auto sendErrorResponse = [&conversation]<typename Message = managarm::posix::SvrResponse>(managarm::posix::Errors err) -> async::result<void> {
 			Message resp;
@@ -709,7 +819,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -719,6 +829,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 		assert(!preamble.error());
 		recv_head.reset();
 
+		requests::RequestTimer requestTimer{self.get(), preamble.id()};
+
 		managarm::posix::CntRequest req;
 		if (preamble.id() == managarm::posix::CntRequest::message_id) {
 			auto o = bragi::parse_head_only<managarm::posix::CntRequest>(recv_head);
@@ -727,7 +839,11 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 				break;
 			}
 
-			req = *o;
+			req = std::move(*o);
+			requestTimer.setCntType(req.request_type());
+
+			if(co_await requests::dispatchCntRequest({self, conversation, req}))
+				continue;
 		}
 
 		if(preamble.id() == bragi::message_id<managarm::posix::GetTidRequest>) {
@@ -745,7 +861,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [sendResp] = co_await helix_ng::exchangeMsgs(
 				conversation,
-				helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+				helix_ng::sendBragiHeadOnly(resp)
 			);
 			HEL_CHECK(sendResp.error());
 		}else if(req.request_type() == managarm::posix::CntReqType::GET_PID) {
@@ -780,7 +896,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -801,7 +917,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -841,7 +957,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -881,7 +997,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -902,7 +1018,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -1061,8 +1177,12 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 							{}, nullptr,
 							0, req->size(), true, nativeFlags);
 				}else{
+					// Large shared mappings are backed by 2 MiB chunks (see memfd.cpp).
+					uint32_t allocFlags = 0;
+					if(req->size() >= 0x200000)
+						allocFlags |= 21 << kHelAllocChunkOrderShift;
 					HelHandle handle;
-					HEL_CHECK(helAllocateMemory(req->size(), 0, nullptr, &handle));
+					HEL_CHECK(helAllocateMemory(req->size(), allocFlags, nullptr, &handle));
 
 					address = co_await self->vmContext()->mapFile(hint,
 							helix::UniqueDescriptor{handle}, nullptr,
@@ -1071,11 +1191,33 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 			}else{
 				auto file = self->fileContext()->getFile(req->fd());
 				assert(file && "Illegal FD for VM_MAP");
+
+				// Files with write seals (i.e., memfds) cannot be mapped shared and writable.
+				// Shared read-only mappings of such files can never become writable.
+				bool mayWrite = true;
+				if(!copyOnWrite) {
+					auto seals = co_await file->getSeals();
+					if(seals && (seals.value() & (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE))) {
+						if(nativeFlags & kHelMapProtWrite) {
+							co_await sendErrorResponse(managarm::posix::Errors::INSUFFICIENT_PERMISSION);
+							continue;
+						}
+						mayWrite = false;
+					}
+				}
+
 				auto memory = co_await file->accessMemory();
 				assert(memory);
 				address = co_await self->vmContext()->mapFile(hint,
 						std::move(memory), std::move(file),
-						req->rel_offset(), req->size(), copyOnWrite, nativeFlags);
+						req->rel_offset(), req->size(), copyOnWrite, nativeFlags, mayWrite);
+			}
+
+			// Like Linux, we do not fail the mmap() if populating the mapping fails.
+			if(req->flags() & MAP_POPULATE) {
+				auto error = co_await self->vmContext()->populate(address, req->size());
+				if(error != kHelErrNone && logRequests)
+					std::cout << "posix: Failed to populate mapping at " << address << std::endl;
 			}
 
 			managarm::posix::SvrResponse resp;
@@ -1084,7 +1226,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [sendResp] = co_await helix_ng::exchangeMsgs(
 				conversation,
-				helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+				helix_ng::sendBragiHeadOnly(resp)
 			);
 			HEL_CHECK(sendResp.error());
 		}else if(req.request_type() == managarm::posix::CntReqType::VM_REMAP) {
@@ -1129,8 +1271,18 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 			if(req.mode() & PROT_EXEC)
 				native_flags |= kHelMapProtExecute;
 
-			co_await self->vmContext()->protectFile(
+			auto error = co_await self->vmContext()->protectFile(
 					reinterpret_cast<void *>(req.address()), req.size(), native_flags);
+			if(error == Error::accessDenied) {
+				resp.set_error(managarm::posix::Errors::ACCESS_DENIED);
+				auto ser = resp.SerializeAsString();
+				auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+						helix::action(&send_resp, ser.data(), ser.size()));
+				co_await transmit.async_wait();
+				HEL_CHECK(send_resp.error());
+				continue;
+			}
+			assert(error == Error::success);
 
 			resp.set_error(managarm::posix::Errors::SUCCESS);
 			auto ser = resp.SerializeAsString();
@@ -1138,6 +1290,172 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 					helix::action(&send_resp, ser.data(), ser.size()));
 			co_await transmit.async_wait();
 			HEL_CHECK(send_resp.error());
+		}else if(preamble.id() == bragi::message_id<managarm::posix::VmAdviseRequest>) {
+			auto req = bragi::parse_head_only<managarm::posix::VmAdviseRequest>(recv_head);
+			if (!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
+			}
+			if(logRequests)
+				std::cout << "posix: VM_ADVISE address: " << (void *)req->address()
+						<< ", size: " << (void *)(size_t)req->size()
+						<< ", advice: " << req->advice() << std::endl;
+
+			if(req->address() & 0xFFF) {
+				co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+				continue;
+			}
+
+			managarm::posix::SvrResponse resp;
+			if(req->advice() == MADV_WILLNEED) {
+				auto error = co_await self->vmContext()->populate(
+						reinterpret_cast<void *>(req->address()), req->size());
+				if(error == kHelErrNone) {
+					resp.set_error(managarm::posix::Errors::SUCCESS);
+				}else{
+					resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+				}
+			}else if(req->advice() == MADV_DONTNEED) {
+				if(self->vmContext()->discard(
+						reinterpret_cast<void *>(req->address()), req->size())) {
+					resp.set_error(managarm::posix::Errors::SUCCESS);
+				}else{
+					resp.set_error(managarm::posix::Errors::NO_SUCH_RESOURCE);
+				}
+			}else if(req->advice() == MADV_NORMAL || req->advice() == MADV_RANDOM
+					|| req->advice() == MADV_SEQUENTIAL) {
+				// These are pure hints that we do not act upon; the kernel's
+				// fault-around already covers sequential access.
+				resp.set_error(managarm::posix::Errors::SUCCESS);
+			}else{
+				// Other advice changes semantics; do not pretend to support it.
+				resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+			}
+
+			auto [sendResp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBragiHeadOnly(resp)
+			);
+			HEL_CHECK(sendResp.error());
+		}else if(preamble.id() == bragi::message_id<managarm::posix::FileAdviseRequest>) {
+			auto req = bragi::parse_head_only<managarm::posix::FileAdviseRequest>(recv_head);
+			if (!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
+			}
+			if(logRequests)
+				std::cout << "posix: FILE_ADVISE fd: " << req->fd()
+						<< ", offset: " << req->offset() << ", size: " << req->size()
+						<< ", advice: " << req->advice() << std::endl;
+
+			auto file = self->fileContext()->getFile(req->fd());
+			if(!file) {
+				co_await sendErrorResponse(managarm::posix::Errors::NO_SUCH_FD);
+				continue;
+			}
+
+			managarm::posix::SvrResponse resp;
+			auto result = co_await file->advise(req->offset(), req->size(), req->advice());
+			if(result) {
+				resp.set_error(managarm::posix::Errors::SUCCESS);
+			}else if(result.error() == Error::seekOnPipe) {
+				resp.set_error(managarm::posix::Errors::ILLEGAL_OPERATION_TARGET);
+			}else{
+				resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+			}
+
+			auto [sendResp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBragiHeadOnly(resp)
+			);
+			HEL_CHECK(sendResp.error());
+		}else if(preamble.id() == bragi::message_id<managarm::posix::FsyncRequest>) {
+			auto req = bragi::parse_head_only<managarm::posix::FsyncRequest>(recv_head);
+			if (!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
+			}
+			if(logRequests)
+				std::cout << "posix: FSYNC fd: " << req->fd()
+						<< ", data only: " << (int)req->data_only() << std::endl;
+
+			auto file = self->fileContext()->getFile(req->fd());
+			if(!file) {
+				co_await sendErrorResponse(managarm::posix::Errors::NO_SUCH_FD);
+				continue;
+			}
+
+			managarm::posix::SvrResponse resp;
+			auto result = co_await file->sync(req->data_only());
+			if(result) {
+				resp.set_error(managarm::posix::Errors::SUCCESS);
+			}else{
+				resp.set_error(managarm::posix::Errors::ILLEGAL_OPERATION_TARGET);
+			}
+
+			auto [sendResp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBragiHeadOnly(resp)
+			);
+			HEL_CHECK(sendResp.error());
+		}else if(preamble.id() == bragi::message_id<managarm::posix::CopyFileRangeRequest>) {
+			auto req = bragi::parse_head_only<managarm::posix::CopyFileRangeRequest>(recv_head);
+			if (!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
+			}
+			if(logRequests)
+				std::cout << "posix: COPY_FILE_RANGE " << req->fd_in() << " -> " << req->fd_out()
+						<< ", size: " << req->size() << std::endl;
+
+			auto inFile = self->fileContext()->getFile(req->fd_in());
+			auto outFile = self->fileContext()->getFile(req->fd_out());
+			if(!inFile || !outFile) {
+				co_await sendErrorResponse(managarm::posix::Errors::NO_SUCH_FD);
+				continue;
+			}
+
+			// Performs the copy at the given offsets; the files' own offsets are preserved.
+			auto copy = [&] () -> async::result<frg::expected<Error, size_t>> {
+				std::optional<off_t> savedIn, savedOut;
+				if(req->off_in() >= 0) {
+					savedIn = FRG_CO_TRY(co_await inFile->seek(0, VfsSeek::relative));
+					FRG_CO_TRY(co_await inFile->seek(req->off_in(), VfsSeek::absolute));
+				}
+				if(req->off_out() >= 0) {
+					savedOut = FRG_CO_TRY(co_await outFile->seek(0, VfsSeek::relative));
+					FRG_CO_TRY(co_await outFile->seek(req->off_out(), VfsSeek::absolute));
+				}
+
+				auto result = co_await inFile->copyTo(self.get(), outFile.get(), req->size());
+
+				if(savedIn)
+					FRG_CO_TRY(co_await inFile->seek(*savedIn, VfsSeek::absolute));
+				if(savedOut)
+					FRG_CO_TRY(co_await outFile->seek(*savedOut, VfsSeek::absolute));
+				co_return result;
+			};
+			auto result = co_await copy();
+
+			managarm::posix::SvrResponse resp;
+			if(result) {
+				resp.set_error(managarm::posix::Errors::SUCCESS);
+				resp.set_size(result.value());
+			}else if(result.error() == Error::wouldBlock) {
+				resp.set_error(managarm::posix::Errors::WOULD_BLOCK);
+			}else if(result.error() == Error::brokenPipe) {
+				resp.set_error(managarm::posix::Errors::BROKEN_PIPE);
+			}else if(result.error() == Error::illegalOperationTarget) {
+				resp.set_error(managarm::posix::Errors::ILLEGAL_OPERATION_TARGET);
+			}else{
+				resp.set_error(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+			}
+
+			auto [sendResp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBragiHeadOnly(resp)
+			);
+			HEL_CHECK(sendResp.error());
 		}else if(req.request_type() == managarm::posix::CntReqType::VM_UNMAP) {
 			if(logRequests)
 				std::cout << "posix: VM_UNMAP address: " << (void *)req.address()
@@ -1156,7 +1474,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 			co_await transmit.async_wait();
 			HEL_CHECK(send_resp.error());
 		}else if(preamble.id() == managarm::posix::MountRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -1232,7 +1551,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 						conversation,
-						helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+						helix_ng::sendBragiHeadOnly(resp)
 					);
 
 			HEL_CHECK(send_resp.error());
@@ -1469,7 +1788,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 				HEL_CHECK(send_resp.error());
 			}
 		}else if(preamble.id() == managarm::posix::MkfifoAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -1539,7 +1859,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			co_await sendErrorResponse(managarm::posix::Errors::SUCCESS);
 		}else if(preamble.id() == managarm::posix::LinkAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -1642,7 +1963,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			co_await sendErrorResponse(managarm::posix::Errors::SUCCESS);
 		}else if(preamble.id() == managarm::posix::SymlinkAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -1710,11 +2032,12 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [sendResp] = co_await helix_ng::exchangeMsgs(
 				conversation,
-				helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+				helix_ng::sendBragiHeadOnly(resp)
 			);
 			HEL_CHECK(sendResp.error());
 		}else if(preamble.id() == managarm::posix::RenameAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -1815,7 +2138,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			co_await sendErrorResponse(managarm::posix::Errors::SUCCESS);
 		}else if(preamble.id() == managarm::posix::FstatAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -1934,12 +2258,13 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
 		}else if(preamble.id() == managarm::posix::FchmodAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -2009,7 +2334,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			co_await sendErrorResponse(managarm::posix::Errors::SUCCESS);
 		}else if(preamble.id() == managarm::posix::UtimensAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -2143,7 +2469,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 				HEL_CHECK(send_resp.error());
 			}
 		}else if(preamble.id() == bragi::message_id<managarm::posix::OpenAtRequest>) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recvTail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -2322,7 +2649,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [sendResp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 			HEL_CHECK(sendResp.error());
 		}else if(preamble.id() == bragi::message_id<managarm::posix::CloseRequest>) {
@@ -2341,7 +2668,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [sendResp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 			HEL_CHECK(sendResp.error());
 		}else if(req.request_type() == managarm::posix::CntReqType::DUP) {
@@ -2461,7 +2788,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [sendResp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 			HEL_CHECK(sendResp.error());
 		}else if(req.request_type() == managarm::posix::CntReqType::TTY_NAME) {
@@ -2503,7 +2830,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 			HEL_CHECK(send_resp.error());
 			HEL_CHECK(send_path.error());
 		}else if(preamble.id() == managarm::posix::UnlinkAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -2588,7 +2916,8 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			co_await sendErrorResponse(managarm::posix::Errors::SUCCESS);
 		}else if(preamble.id() == managarm::posix::RmdirRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -2891,7 +3220,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -2930,7 +3259,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -2966,7 +3295,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -3070,257 +3399,298 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 					helix::action(&send_resp, ser.data(), ser.size()));
 			co_await transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_CREATE) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_CREATE" << std::endl;
+		}else if(preamble.id() == managarm::posix::InotifyCreateRequest::message_id) {
+			auto req = bragi::parse_head_only<managarm::posix::InotifyCreateRequest>(recv_head);
 
-			helix::SendBuffer send_resp;
+			if (!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
+			}
 
-			assert(!(req.flags() & ~(managarm::posix::OpenFlags::OF_CLOEXEC)));
+			if(logRequests)
+				std::cout << "posix: INOTIFY_CREATE" << std::endl;
+
+			assert(!(req->flags() & ~(managarm::posix::OpenFlags::OF_CLOEXEC)));
 
-			auto file = epoll::createFile();
+			auto file = inotify::createFile();
 			auto fd = self->fileContext()->attachFile(file,
-					req.flags() & managarm::posix::OpenFlags::OF_CLOEXEC);
+					req->flags() & managarm::posix::OpenFlags::OF_CLOEXEC);
 
 			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
 			resp.set_fd(fd);
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_ADD) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_ADD" << std::endl;
-
-			helix::SendBuffer send_resp;
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+					conversation,
+					helix_ng::sendBragiHeadOnly(resp)
+				);
 
-			auto epfile = self->fileContext()->getFile(req.fd());
-			auto file = self->fileContext()->getFile(req.newfd());
-			if(!file || !epfile) {
-				co_await sendErrorResponse(managarm::posix::Errors::BAD_FD);
-				continue;
-			}
+			HEL_CHECK(send_resp.error());
+		}else if(preamble.id() == managarm::posix::AttachPassthroughRequest::message_id) {
+			auto req = bragi::parse_head_only<managarm::posix::AttachPassthroughRequest>(recv_head);
 
-			auto locked = file->weakFile().lock();
-			assert(locked);
-			Error ret = epoll::addItem(epfile.get(), self.get(),
-					std::move(locked), req.newfd(), req.flags(), req.cookie());
-			if(ret == Error::alreadyExists) {
-				co_await sendErrorResponse(managarm::posix::Errors::ALREADY_EXISTS);
-				continue;
+			if (!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
 			}
-			assert(ret == Error::success);
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_MODIFY) {
 			if(logRequests)
-				std::cout << "posix: EPOLL_MODIFY" << std::endl;
-
-			helix::SendBuffer send_resp;
+				std::cout << "posix: ATTACH_PASSTHROUGH" << std::endl;
 
-			auto epfile = self->fileContext()->getFile(req.fd());
-			auto file = self->fileContext()->getFile(req.newfd());
-			assert(epfile && "Illegal FD for EPOLL_MODIFY");
-			assert(file && "Illegal FD for EPOLL_MODIFY item");
+			auto [pull_lane] = co_await helix_ng::exchangeMsgs(
+					conversation,
+					helix_ng::pullDescriptor()
+				);
+			HEL_CHECK(pull_lane.error());
 
-			Error ret = epoll::modifyItem(epfile.get(), file.get(), req.newfd(),
-					req.flags(), req.cookie());
-			if(ret == Error::noSuchFile) {
-				co_await sendErrorResponse(managarm::posix::Errors::FILE_NOT_FOUND);
+			if(req->flags() & ~(managarm::posix::OpenFlags::OF_CLOEXEC)) {
+				co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
 				continue;
 			}
-			assert(ret == Error::success);
+
+			auto file = createPassthroughFile(pull_lane.descriptor());
+			auto fd = self->fileContext()->attachFile(file,
+					req->flags() & managarm::posix::OpenFlags::OF_CLOEXEC);
 
 			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
+			resp.set_fd(fd);
+
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+					conversation,
+					helix_ng::sendBragiHeadOnly(resp)
+				);
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_DELETE) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_DELETE" << std::endl;
+		}else if(preamble.id() == managarm::posix::SpawnRequest::message_id) {
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
+			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
+					conversation,
+					helix_ng::recvBuffer(tail.data(), tail.size())
+				);
+			HEL_CHECK(recv_tail.error());
 
-			helix::SendBuffer send_resp;
+			auto req = bragi::parse_head_tail<managarm::posix::SpawnRequest>(recv_head, tail);
 
-			auto epfile = self->fileContext()->getFile(req.fd());
-			auto file = self->fileContext()->getFile(req.newfd());
-			if(!epfile || !file) {
-				std::cout << "posix: Illegal FD for EPOLL_DELETE" << std::endl;
-				co_await sendErrorResponse(managarm::posix::Errors::BAD_FD);
-				continue;
+			if (!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
 			}
 
-			Error ret = epoll::deleteItem(epfile.get(), file.get(), req.newfd(), req.flags());
-			if(ret == Error::noSuchFile) {
-				co_await sendErrorResponse(managarm::posix::Errors::FILE_NOT_FOUND);
+			if(logRequests || logPaths)
+				std::cout << "posix: SPAWN " << req->path() << std::endl;
+
+			auto numActions = req->action_types().size();
+			if((req->flags() & ~(managarm::posix::SpawnFlags::SF_SETSID
+						| managarm::posix::SpawnFlags::SF_SETSIGMASK))
+					|| req->action_fds().size() != numActions
+					|| req->action_new_fds().size() != numActions
+					|| req->action_flags().size() != numActions
+					|| req->action_paths().size() != numActions) {
+				co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
 				continue;
 			}
-			assert(ret == Error::success);
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::EPOLL_WAIT) {
-			if(logRequests)
-				std::cout << "posix: EPOLL_WAIT request" << std::endl;
 
-			helix::SendBuffer send_resp;
-			helix::SendBuffer send_data;
-			uint64_t former = self->signalMask();
+			SpawnAttributes attributes;
+			attributes.setSid = req->flags() & managarm::posix::SpawnFlags::SF_SETSID;
+			if(req->flags() & managarm::posix::SpawnFlags::SF_SETSIGMASK)
+				attributes.signalMask = req->sigmask();
+
+			bool validActions = true;
+			bool supportedActions = true;
+			for(size_t i = 0; i < numActions; i++) {
+				SpawnAction action;
+				action.fd = req->action_fds()[i];
+				action.newFd = req->action_new_fds()[i];
+				action.path = req->action_paths()[i];
+
+				auto type = req->action_types()[i];
+				if(type == managarm::posix::SpawnActionType::SA_CLOSE) {
+					action.type = SpawnAction::Type::close;
+				}else if(type == managarm::posix::SpawnActionType::SA_DUP2) {
+					action.type = SpawnAction::Type::dup2;
+				}else if(type == managarm::posix::SpawnActionType::SA_OPEN) {
+					action.type = SpawnAction::Type::open;
+
+					// Creating files is left to the fork() + execve() fallback.
+					auto flags = req->action_flags()[i];
+					if(flags & (managarm::posix::OpenFlags::OF_CREATE
+							| managarm::posix::OpenFlags::OF_EXCLUSIVE
+							| managarm::posix::OpenFlags::OF_TRUNC)) {
+						supportedActions = false;
+						break;
+					}
+					if(flags & ~(managarm::posix::OpenFlags::OF_NONBLOCK
+							| managarm::posix::OpenFlags::OF_RDONLY
+							| managarm::posix::OpenFlags::OF_WRONLY
+							| managarm::posix::OpenFlags::OF_RDWR)) {
+						validActions = false;
+						break;
+					}
 
-			auto epfile = self->fileContext()->getFile(req.fd());
-			if(!epfile) {
-				co_await sendErrorResponse(managarm::posix::Errors::BAD_FD);
+					if(flags & managarm::posix::OpenFlags::OF_NONBLOCK)
+						action.semanticFlags |= semanticNonBlock;
+					if(flags & managarm::posix::OpenFlags::OF_RDONLY)
+						action.semanticFlags |= semanticRead;
+					else if(flags & managarm::posix::OpenFlags::OF_WRONLY)
+						action.semanticFlags |= semanticWrite;
+					else if(flags & managarm::posix::OpenFlags::OF_RDWR)
+						action.semanticFlags |= semanticRead | semanticWrite;
+				}else if(type == managarm::posix::SpawnActionType::SA_CHDIR) {
+					action.type = SpawnAction::Type::chdir;
+				}else{
+					validActions = false;
+					break;
+				}
+				attributes.actions.push_back(std::move(action));
+			}
+			if(!supportedActions) {
+				co_await sendErrorResponse(managarm::posix::Errors::NOT_SUPPORTED);
 				continue;
 			}
-			if(req.sigmask_needed()) {
-				self->setSignalMask(req.sigmask());
+			if(!validActions) {
+				co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+				continue;
 			}
 
-			struct epoll_event events[16];
-			size_t k;
-			if(req.timeout() < 0) {
-				k = co_await epoll::wait(epfile.get(), events,
-						std::min(req.size(), uint32_t(16)));
-			}else if(!req.timeout()) {
-				// Do not bother to set up a timer for zero timeouts.
-				async::cancellation_event cancel_wait;
-				cancel_wait.cancel();
-				k = co_await epoll::wait(epfile.get(), events,
-						std::min(req.size(), uint32_t(16)), cancel_wait);
-			}else{
-				assert(req.timeout() > 0);
-				async::cancellation_event cancel_wait;
-				helix::TimeoutCancellation timer{static_cast<uint64_t>(req.timeout()), cancel_wait};
-				k = co_await epoll::wait(epfile.get(), events, 16, cancel_wait);
-				co_await timer.retire();
-			}
-			if(req.sigmask_needed()) {
-				self->setSignalMask(former);
+			auto spawnResult = co_await Process::spawn(self, req->path(),
+					req->args(), req->env(), std::move(attributes));
+			if(!spawnResult) {
+				auto error = spawnResult.error();
+				if(error == Error::noSuchFile) {
+					co_await sendErrorResponse(managarm::posix::Errors::FILE_NOT_FOUND);
+				}else if(error == Error::notDirectory) {
+					co_await sendErrorResponse(managarm::posix::Errors::NOT_A_DIRECTORY);
+				}else if(error == Error::badFd) {
+					co_await sendErrorResponse(managarm::posix::Errors::BAD_FD);
+				}else if(error == Error::badExecutable) {
+					co_await sendErrorResponse(managarm::posix::Errors::BAD_EXECUTABLE);
+				}else if(error == Error::noBackingDevice) {
+					co_await sendErrorResponse(managarm::posix::Errors::NO_BACKING_DEVICE);
+				}else{
+					std::cout << "posix: Unexpected failure from spawn()" << std::endl;
+					co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+				}
+				continue;
 			}
 
 			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
+			resp.set_pid(spawnResult.value()->pid());
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
-					helix::action(&send_data, events, k * sizeof(struct epoll_event)));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::TIMERFD_CREATE) {
-			if(logRequests)
-				std::cout << "posix: TIMERFD_CREATE" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			assert(!(req.flags() & ~(TFD_CLOEXEC | TFD_NONBLOCK)));
-
-			auto file = timerfd::createFile(req.flags() & TFD_NONBLOCK);
-			auto fd = self->fileContext()->attachFile(file, req.flags() & TFD_CLOEXEC);
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+					conversation,
+					helix_ng::sendBragiHeadOnly(resp)
+				);
 			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::TIMERFD_SETTIME) {
-			if(logRequests)
-				std::cout << "posix: TIMERFD_SETTIME" << std::endl;
-
-			helix::SendBuffer send_resp;
+		}else if(preamble.id() == managarm::posix::ProcessVmTransferRequest::message_id) {
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
+			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
+					conversation,
+					helix_ng::recvBuffer(tail.data(), tail.size())
+				);
+			HEL_CHECK(recv_tail.error());
 
-			auto file = self->fileContext()->getFile(req.fd());
-			assert(file && "Illegal FD for TIMERFD_SETTIME");
-			timerfd::setTime(file.get(),
-					{static_cast<time_t>(req.time_secs()), static_cast<long>(req.time_nanos())},
-					{static_cast<time_t>(req.interval_secs()), static_cast<long>(req.interval_nanos())});
+			auto req = bragi::parse_head_tail<managarm::posix::ProcessVmTransferRequest>(
+					recv_head, tail);
 
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
+			if (!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
+			}
 
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.request_type() == managarm::posix::CntReqType::SIGNALFD_CREATE) {
 			if(logRequests)
-				std::cout << "posix: SIGNALFD_CREATE" << std::endl;
-
-			helix::SendBuffer send_resp;
-
-			if(req.flags() & ~(managarm::posix::OpenFlags::OF_CLOEXEC
-					| managarm::posix::OpenFlags::OF_NONBLOCK)) {
+				std::cout << "posix: PROCESS_VM_TRANSFER on PID " << req->pid()
+						<< (req->write() ? " (write)" : " (read)") << std::endl;
+
+			auto &localAddresses = req->local_addresses();
+			auto &localLengths = req->local_lengths();
+			auto &remoteAddresses = req->remote_addresses();
+			auto &remoteLengths = req->remote_lengths();
+			if(localAddresses.size() != localLengths.size()
+					|| remoteAddresses.size() != remoteLengths.size()
+					|| localAddresses.size() > kHelMaxRemoteRanges
+					|| remoteAddresses.size() > kHelMaxRemoteRanges) {
 				co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
 				continue;
 			}
 
-			auto file = createSignalFile(req.sigset(),
-					req.flags() & managarm::posix::OpenFlags::OF_NONBLOCK);
-			auto fd = self->fileContext()->attachFile(file,
-					req.flags() & managarm::posix::OpenFlags::OF_CLOEXEC);
-
-			managarm::posix::SvrResponse resp;
-			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(preamble.id() == managarm::posix::InotifyCreateRequest::message_id) {
-			auto req = bragi::parse_head_only<managarm::posix::InotifyCreateRequest>(recv_head);
-
-			if (!req) {
-				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
-				break;
+			auto target = Process::findProcess(req->pid());
+			// Keep both address spaces alive, even if the target terminates meanwhile.
+			auto targetVm = target ? target->vmContext() : nullptr;
+			auto selfVm = self->vmContext();
+			if(!targetVm) {
+				co_await sendErrorResponse(managarm::posix::Errors::NO_SUCH_RESOURCE);
+				continue;
+			}
+			if(self->euid() && self->euid() != target->uid()) {
+				co_await sendErrorResponse(managarm::posix::Errors::INSUFFICIENT_PERMISSION);
+				continue;
 			}
 
-			if(logRequests)
-				std::cout << "posix: INOTIFY_CREATE" << std::endl;
+			size_t localTotal = 0;
+			for(auto length : localLengths)
+				localTotal += length;
+			size_t remoteTotal = 0;
+			for(auto length : remoteLengths)
+				remoteTotal += length;
+			std::vector<char> buffer(std::min(localTotal, remoteTotal));
+
+			// Maps the ranges to consecutive parts of buffer (until buffer is exhausted).
+			auto buildRanges = [&] (const std::vector<uint64_t> &addresses,
+					const std::vector<uint64_t> &lengths, size_t limit) {
+				std::vector<HelRemoteRange> ranges;
+				size_t offset = 0;
+				for(size_t i = 0; i < addresses.size() && offset < limit; i++) {
+					auto length = std::min(static_cast<size_t>(lengths[i]), limit - offset);
+					if(!length)
+						continue;
+					ranges.push_back(HelRemoteRange{addresses[i], buffer.data() + offset, length});
+					offset += length;
+				}
+				return ranges;
+			};
 
-			assert(!(req->flags() & ~(managarm::posix::OpenFlags::OF_CLOEXEC)));
+			// Both directions take one submission per address space, regardless of
+			// the number of ranges.
+			auto sourceSpace = req->write() ? selfVm->getSpace() : targetVm->getSpace();
+			auto destSpace = req->write() ? targetVm->getSpace() : selfVm->getSpace();
+			auto sourceRanges = req->write()
+					? buildRanges(localAddresses, localLengths, buffer.size())
+					: buildRanges(remoteAddresses, remoteLengths, buffer.size());
+			auto loadResult = co_await helix_ng::readMemoryVector(sourceSpace,
+					sourceRanges.data(), sourceRanges.size());
+			if(loadResult.error() == kHelErrFault) {
+				co_await sendErrorResponse(managarm::posix::Errors::FAULT);
+				continue;
+			}
+			HEL_CHECK(loadResult.error());
 
-			auto file = inotify::createFile();
-			auto fd = self->fileContext()->attachFile(file,
-					req->flags() & managarm::posix::OpenFlags::OF_CLOEXEC);
+			auto destRanges = req->write()
+					? buildRanges(remoteAddresses, remoteLengths, loadResult.actualLength())
+					: buildRanges(localAddresses, localLengths, loadResult.actualLength());
+			auto storeResult = co_await helix_ng::writeMemoryVector(destSpace,
+					destRanges.data(), destRanges.size());
+			if(storeResult.error() == kHelErrFault) {
+				co_await sendErrorResponse(managarm::posix::Errors::FAULT);
+				continue;
+			}
+			HEL_CHECK(storeResult.error());
 
 			managarm::posix::SvrResponse resp;
 			resp.set_error(managarm::posix::Errors::SUCCESS);
-			resp.set_fd(fd);
+			resp.set_size(storeResult.actualLength());
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
-
 			HEL_CHECK(send_resp.error());
 		}else if(preamble.id() == managarm::posix::InotifyAddRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -3370,7 +3740,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -3403,12 +3773,13 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
 		}else if(preamble.id() == managarm::posix::MknodAtRequest::message_id) {
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -3542,7 +3913,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -3574,7 +3945,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -3645,7 +4016,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
@@ -3676,13 +4047,14 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 
 			HEL_CHECK(send_resp.error());
 		}else if(preamble.id() == managarm::posix::MemFdCreateRequest::message_id) {
 			managarm::posix::SvrResponse resp;
-			std::vector<std::byte> tail(preamble.tail_size());
+			auto &tail = tailBuffer;
+			tail.resize(preamble.tail_size());
 			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 					conversation,
 					helix_ng::recvBuffer(tail.data(), tail.size())
@@ -3699,13 +4071,22 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 			if(logRequests)
 				std::cout << "posix: MEMFD_CREATE " << req->name() << std::endl;
 
-			if(req->flags() & ~(MFD_CLOEXEC | MFD_ALLOW_SEALING)) {
+			unsigned int hugeShift = (req->flags() >> MFD_HUGE_SHIFT) & MFD_HUGE_MASK;
+			if(req->flags() & ~(MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB
+					| (MFD_HUGE_MASK << MFD_HUGE_SHIFT))) {
+				co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+				continue;
+			}
+			// We only support the default huge page size.
+			if(hugeShift && (!(req->flags() & MFD_HUGETLB)
+					|| hugeShift != MemoryFile::hugePageShift)) {
 				co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
 				continue;
 			}
 
 			auto link = SpecialLink::makeSpecialLink(VfsType::regular, 0777);
-			auto memFile = smarter::make_shared<MemoryFile>(nullptr, link, (req->flags() & MFD_ALLOW_SEALING) == true);
+			auto memFile = smarter::make_shared<MemoryFile>(nullptr, link,
+					req->flags() & MFD_ALLOW_SEALING, req->flags() & MFD_HUGETLB);
 			MemoryFile::serve(memFile);
 			auto file = File::constructHandle(std::move(memFile));
 
@@ -3722,7 +4103,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto [sendResp] = co_await helix_ng::exchangeMsgs(
 					conversation,
-					helix_ng::sendBragiHeadOnly(resp, frg::stl_allocator{})
+					helix_ng::sendBragiHeadOnly(resp)
 				);
 			HEL_CHECK(sendResp.error());
 		}else{
@@ -3740,6 +4121,15 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 		}
 	}
 
+	// acceptRequests() must be done before we report that all requests are handled.
+	while(!queueDone) {
+		auto pending = std::move(*(co_await rq->queue.async_get()));
+		rq->numPending--;
+		rq->spaceBell.raise();
+		if(!pending.conversation)
+			queueDone = true;
+	}
+
 	if(logCleanup)
 		std::cout << "\e[33mposix: Exiting serveRequests()\e[39m" << std::endl;
 	generation->requestsDone.raise();
@@ -3750,13 +4140,18 @@ async::result<void> serve(std::shared_ptr<Process> self, std::shared_ptr<Generat
 
 	std::array<char, 16> creds;
 	HEL_CHECK(helGetCredentials(thread.getHandle(), 0, creds.data()));
-	auto res = globalCredentialsMap.insert({creds, self});
-	assert(res.second);
+	{
+		std::lock_guard lock{globalCredentialsMutex};
+		auto res = globalCredentialsMap.insert({creds, self});
+		assert(res.second);
+	}
 
+	auto rq = std::make_shared<RequestQueue>();
 	co_await async::when_all(
 		observeThread(self, generation),
 		serveSignals(self, generation),
-		serveRequests(self, generation)
+		acceptRequests(self, generation, rq),
+		serveRequests(self, generation, rq)
 	);
 }
 
@@ -3800,6 +4195,204 @@ struct CmdlineNode final : public procfs::RegularNode {
 	}
 };
 
+// Summary of the kernel's spinlock statistics (similar to Linux' /proc/lock_stat).
+struct LockStatNode final : public procfs::RegularNode {
+	async::result<std::string> show() override {
+		helix::Offer offer;
+		helix::SendBuffer send_req;
+		helix::RecvBuffer recv_resp;
+
+		managarm::kerncfg::CntRequest req;
+		req.set_req_type(managarm::kerncfg::CntReqType::GET_LOCK_STATS);
+
+		// The response does not fit into an inline buffer.
+		std::vector<char> buffer(16384);
+		auto ser = req.SerializeAsString();
+		auto &&transmit = helix::submitAsync(kerncfgLane, helix::Dispatcher::global(),
+				helix::action(&offer, kHelItemAncillary),
+				helix::action(&send_req, ser.data(), ser.size(), kHelItemChain),
+				helix::action(&recv_resp, buffer.data(), buffer.size()));
+		co_await transmit.async_wait();
+		HEL_CHECK(offer.error());
+		HEL_CHECK(send_req.error());
+		HEL_CHECK(recv_resp.error());
+
+		managarm::kerncfg::SvrResponse resp;
+		resp.ParseFromArray(buffer.data(), recv_resp.actualLength());
+		assert(resp.error() == managarm::kerncfg::Error::SUCCESS);
+
+		std::stringstream stream;
+		if(!resp.lock_stats_enabled()) {
+			stream << "lock statistics are disabled (build thor with kernel_lock_stats)\n";
+			co_return stream.str();
+		}
+
+		// Print the classes with the most spin time first.
+		std::vector<managarm::kerncfg::LockClassStats> classes{resp.lock_classes().begin(),
+				resp.lock_classes().end()};
+		std::sort(classes.begin(), classes.end(), [] (const auto &a, const auto &b) {
+			return a.total_spin() > b.total_spin();
+		});
+
+		stream << std::left << std::setw(20) << "class"
+				<< std::right << std::setw(14) << "acquired"
+				<< std::setw(14) << "contended"
+				<< std::setw(18) << "total-spin"
+				<< std::setw(14) << "max-spin"
+				<< std::setw(14) << "avg-spin" << "\n";
+		for(auto &cls : classes) {
+			stream << std::left << std::setw(20) << cls.name()
+					<< std::right << std::setw(14) << cls.acquired()
+					<< std::setw(14) << cls.contended()
+					<< std::setw(18) << cls.total_spin()
+					<< std::setw(14) << cls.max_spin()
+					<< std::setw(14) << (cls.contended() ? cls.total_spin() / cls.contended() : 0)
+					<< "\n";
+
+			std::vector<managarm::kerncfg::LockSiteStats> sites{cls.sites().begin(),
+					cls.sites().end()};
+			std::sort(sites.begin(), sites.end(), [] (const auto &a, const auto &b) {
+				return a.contended() > b.contended();
+			});
+			for(auto &site : sites)
+				stream << "    0x" << std::hex << site.ip() << std::dec
+						<< " contended " << site.contended() << "\n";
+		}
+		co_return stream.str();
+	}
+
+	async::result<void> store(std::string) override {
+		throw std::runtime_error("Cannot store to /proc/lock_stat");
+	}
+};
+
+// Returns the per-CPU scheduler, IPI and IRQ counters.
+async::result<managarm::kerncfg::SvrResponse> getCpuStats() {
+	helix::Offer offer;
+	helix::SendBuffer send_req;
+	helix::RecvBuffer recv_resp;
+
+	managarm::kerncfg::CntRequest req;
+	req.set_req_type(managarm::kerncfg::CntReqType::GET_CPU_STATS);
+
+	// The response does not fit into an inline buffer.
+	std::vector<char> buffer(65536);
+	auto ser = req.SerializeAsString();
+	auto &&transmit = helix::submitAsync(kerncfgLane, helix::Dispatcher::global(),
+			helix::action(&offer, kHelItemAncillary),
+			helix::action(&send_req, ser.data(), ser.size(), kHelItemChain),
+			helix::action(&recv_resp, buffer.data(), buffer.size()));
+	co_await transmit.async_wait();
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::kerncfg::SvrResponse resp;
+	resp.ParseFromArray(buffer.data(), recv_resp.actualLength());
+	assert(resp.error() == managarm::kerncfg::Error::SUCCESS);
+	co_return resp;
+}
+
+// Per-CPU IRQ and IPI counters (similar to Linux' /proc/interrupts).
+struct InterruptsNode final : public procfs::RegularNode {
+	async::result<std::string> show() override {
+		auto resp = co_await getCpuStats();
+
+		std::stringstream stream;
+		stream << "     ";
+		for(uint64_t i = 0; i < resp.num_cpus(); i++)
+			stream << std::setw(11) << ("CPU" + std::to_string(i));
+		stream << "\n";
+		for(auto &irq : resp.irqs()) {
+			stream << std::setw(4) << irq.slot() << ":";
+			for(auto count : irq.per_cpu())
+				stream << std::setw(11) << count;
+			stream << "  " << irq.name();
+			if(irq.affinity() >= 0)
+				stream << " (CPU" << irq.affinity() << ")";
+			stream << "\n";
+		}
+
+		// Same labels as on Linux.
+		stream << std::setw(4) << "RES" << ":";
+		for(auto &cpu : resp.cpus())
+			stream << std::setw(11) << cpu.ping_ipis();
+		stream << "  Rescheduling interrupts\n";
+		stream << std::setw(4) << "TLB" << ":";
+		for(auto &cpu : resp.cpus())
+			stream << std::setw(11) << cpu.shootdown_ipis();
+		stream << "  TLB shootdowns\n";
+		co_return stream.str();
+	}
+
+	async::result<void> store(std::string) override {
+		throw std::runtime_error("Cannot store to /proc/interrupts");
+	}
+};
+
+// Per-CPU time and system-wide scheduler counters (similar to Linux' /proc/stat).
+// thor only distinguishes idle and non-idle time; non-idle time is reported as user time.
+struct StatNode final : public procfs::RegularNode {
+	async::result<std::string> show() override {
+		auto resp = co_await getCpuStats();
+
+		// Times are reported in units of USER_HZ (i.e., 1/100 s).
+		constexpr uint64_t nanosPerTick = 10'000'000;
+		auto printTimes = [&] (std::stringstream &stream, uint64_t busy, uint64_t idle) {
+			stream << " " << busy / nanosPerTick << " 0 0 " << idle / nanosPerTick
+					<< " 0 0 0 0 0 0\n";
+		};
+
+		std::stringstream cpuLines;
+		uint64_t totalBusy = 0;
+		uint64_t totalIdle = 0;
+		uint64_t contextSwitches = 0;
+		uint64_t running = 0;
+		for(auto &cpu : resp.cpus()) {
+			auto idle = std::min(cpu.idle_time(), resp.clock());
+			auto busy = resp.clock() - idle;
+			cpuLines << "cpu" << cpu.cpu();
+			printTimes(cpuLines, busy, idle);
+
+			totalBusy += busy;
+			totalIdle += idle;
+			contextSwitches += cpu.context_switches();
+			running += cpu.run_queue();
+		}
+
+		// Linux lists the IRQ counts by IRQ number; we use the IRQ slot.
+		std::vector<uint64_t> irqCounts;
+		uint64_t totalIrqs = 0;
+		for(auto &irq : resp.irqs()) {
+			if(irq.slot() >= irqCounts.size())
+				irqCounts.resize(irq.slot() + 1);
+			for(auto count : irq.per_cpu())
+				irqCounts[irq.slot()] += count;
+			totalIrqs += irqCounts[irq.slot()];
+		}
+
+		auto realtime = clk::getRealtime();
+
+		std::stringstream stream;
+		stream << "cpu ";
+		printTimes(stream, totalBusy, totalIdle);
+		stream << cpuLines.str();
+		stream << "intr " << totalIrqs;
+		for(auto count : irqCounts)
+			stream << " " << count;
+		stream << "\n";
+		stream << "ctxt " << contextSwitches << "\n";
+		stream << "btime " << (realtime.tv_sec - resp.clock() / 1'000'000'000) << "\n";
+		stream << "procs_running " << running << "\n";
+		stream << "procs_blocked 0\n";
+		co_return stream.str();
+	}
+
+	async::result<void> store(std::string) override {
+		throw std::runtime_error("Cannot store to /proc/stat");
+	}
+};
+
 async::result<void> enumerateKerncfg() {
 	auto root = co_await mbus::Instance::global().getRoot();
 
@@ -3820,6 +4413,13 @@ async::result<void> enumerateKerncfg() {
 
 	auto procfs_root = std::static_pointer_cast<procfs::DirectoryNode>(getProcfs()->getTarget());
 	procfs_root->directMkregular("cmdline", std::make_shared<CmdlineNode>());
+	procfs_root->directMkregular("lock_stat", std::make_shared<LockStatNode>());
+	procfs_root->directMkregular("interrupts", std::make_shared<InterruptsNode>());
+	procfs_root->directMkregular("stat", std::make_shared<StatNode>());
+
+	auto managarm_link = procfs_root->directMkdir("managarm");
+	auto managarm_dir = static_cast<procfs::DirectoryNode *>(managarm_link->getTarget().get());
+	managarm_dir->directMkregular("syscall_stats", std::make_shared<procfs::SyscallStatsNode>());
 }
 
 // --------------------------------------------------------
@@ -3830,6 +4430,7 @@ async::detached runInit() {
 	co_await enumerateKerncfg();
 	co_await clk::enumerateTracker();
 	async::detach(net::enumerateNetserver());
+	async::detach(requests::setupTracing());
 	co_await populateRootView();
 	co_await Process::init("sbin/posix-init");
 }
@@ -3839,6 +4440,7 @@ int main() {
 
 //	HEL_CHECK(helSetPriority(kHelThisThread, 1));
 
+	initServeWorkers();
 	drvcore::initialize();
 
 	charRegistry.install(createHeloutDevice());
@@ -3856,5 +4458,5 @@ int main() {
 
 	runInit();
 
-	async::run_forever(helix::currentDispatcher);
+	runServeWorkers();
 }
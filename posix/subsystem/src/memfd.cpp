@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "memfd.hpp"
 
 void MemoryFile::handleClose() {
@@ -18,7 +20,17 @@ MemoryFile::seek(off_t delta, VfsSeek whence) {
 }
 
 async::result<frg::expected<protocols::fs::Error>> MemoryFile::truncate(size_t size) {
+	if(_hugeTlb && (size & (hugePageSize - 1)))
+		co_return protocols::fs::Error::illegalArguments;
+	if(size < _fileSize && (_seals & F_SEAL_SHRINK))
+		co_return protocols::fs::Error::insufficientPermissions;
+	if(size > _fileSize && (_seals & F_SEAL_GROW))
+		co_return protocols::fs::Error::insufficientPermissions;
+
+	auto oldSize = _fileSize;
 	_resizeFile(size);
+	if(_hugeTlb && size > oldSize)
+		_populate(oldSize, size - oldSize);
 	co_return {};
 }
 
@@ -26,15 +38,17 @@ async::result<frg::expected<protocols::fs::Error>>
 MemoryFile::allocate(int64_t offset, size_t size) {
 	assert(!offset);
 
-	if(_seals & F_SEAL_WRITE)
+	if(_seals & (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE))
 		co_return protocols::fs::Error::insufficientPermissions;
 	/* check if the file size is enough */
-	if(offset + size <= _fileSize)
-		co_return {};
-	/* if the file size isn't enough */
-	if(_seals & F_SEAL_GROW)
-		co_return protocols::fs::Error::insufficientPermissions;
-	_resizeFile(offset + size);
+	if(offset + size > _fileSize) {
+		/* if the file size isn't enough */
+		if(_seals & F_SEAL_GROW)
+			co_return protocols::fs::Error::insufficientPermissions;
+		_resizeFile(offset + size);
+	}
+	// Unlike ftruncate(), fallocate() guarantees that the memory is allocated.
+	_populate(offset, size);
 	co_return {};
 }
 
@@ -46,15 +60,20 @@ MemoryFile::accessMemory() {
 void MemoryFile::_resizeFile(size_t new_size) {
 	_fileSize = new_size;
 
-	size_t aligned_size = (new_size + 0xFFF) & ~size_t(0xFFF);
+	size_t alignment = _hugeTlb ? hugePageSize : 0x1000;
+	size_t aligned_size = (new_size + (alignment - 1)) & ~(alignment - 1);
 	if(aligned_size <= _areaSize)
 		return;
 
 	if(_memory) {
 		HEL_CHECK(helResizeMemory(_memory.getHandle(), aligned_size));
 	}else{
+		// Back large files by 2 MiB chunks such that they can be mapped using huge pages.
+		uint32_t flags = 0;
+		if(_hugeTlb || aligned_size >= hugePageSize)
+			flags |= hugePageShift << kHelAllocChunkOrderShift;
 		HelHandle handle;
-		HEL_CHECK(helAllocateMemory(aligned_size, 0, nullptr, &handle));
+		HEL_CHECK(helAllocateMemory(aligned_size, flags, nullptr, &handle));
 		_memory = helix::UniqueDescriptor{handle};
 	}
 
@@ -62,6 +81,14 @@ void MemoryFile::_resizeFile(size_t new_size) {
 	_areaSize = aligned_size;
 }
 
+void MemoryFile::_populate(size_t offset, size_t size) {
+	auto begin = offset & ~size_t(0xFFF);
+	auto end = std::min((offset + size + 0xFFF) & ~size_t(0xFFF), _areaSize);
+	if(begin >= end)
+		return;
+	HEL_CHECK(helLoadahead(_memory.getHandle(), begin, end - begin));
+}
+
 async::result<frg::expected<protocols::fs::Error, int>>
 MemoryFile::getSeals() {
 	co_return int{_seals};
@@ -72,6 +99,8 @@ MemoryFile::addSeals(int seals) {
 	if(_seals & F_SEAL_SEAL) {
 		co_return protocols::fs::Error::insufficientPermissions;
 	}
+	if(seals & ~(F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_FUTURE_WRITE))
+		co_return protocols::fs::Error::illegalArguments;
 
 	_seals |= seals;
 	co_return int{_seals};
@@ -4,7 +4,24 @@
 
 #include "file.hpp"
 
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 4U
+#endif
+
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT 26
+#define MFD_HUGE_MASK 0x3FU
+#endif
+
 struct MemoryFile final : File {
+	// Size of the huge pages that back MFD_HUGETLB files.
+	static constexpr size_t hugePageShift = 21;
+	static constexpr size_t hugePageSize = size_t{1} << hugePageShift;
+
 public:
 	static void serve(smarter::shared_ptr<MemoryFile> file) {
 		helix::UniqueLane lane;
@@ -13,8 +30,13 @@ public:
 				file, &fileOperations, file->_cancelServe));
 	}
 
-	MemoryFile(std::shared_ptr<MountView> mount, std::shared_ptr<FsLink> link, bool allowSealing)
-	: File{StructName::get("memfd-file"), mount, link}, _offset{0} {
+	// Files with hugeTlb set are always backed by huge chunks. Like on hugetlbfs,
+	// their size must be a multiple of the huge page size and ftruncate() allocates
+	// the memory up front (such that faults do not need to allocate and zero chunks).
+	MemoryFile(std::shared_ptr<MountView> mount, std::shared_ptr<FsLink> link, bool allowSealing,
+			bool hugeTlb = false)
+	: File{StructName::get("memfd-file"), mount, link, File::defaultMemoryCopy}, _offset{0},
+			_hugeTlb{hugeTlb} {
 		if(!allowSealing) {
 			_seals = F_SEAL_SEAL;
 		}
@@ -38,11 +60,13 @@ public:
 
 private:
 	void _resizeFile(size_t new_size);
+	void _populate(size_t offset, size_t size);
 
 	helix::UniqueLane _passthrough;
 	async::cancellation_event _cancelServe;
 
 	uint64_t _offset;
+	bool _hugeTlb;
 
 	helix::UniqueDescriptor _memory;
 	helix::Mapping _mapping;
@@ -3,8 +3,10 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <algorithm>
 #include <iostream>
 #include <map>
+#include <string_view>
 
 #include <async/recurring-event.hpp>
 #include <helix/ipc.hpp>
@@ -32,10 +34,90 @@ struct Packet {
 	// Sender process information.
 	int senderPid;
 
+	// Only valid for uevents (see classifyUevent()).
+	bool hasSubsystem = false;
+	uint32_t subsystemHash = 0;
+	uint32_t devtypeHash = 0;
+
 	// The actual octet data that the packet consists of.
-	std::vector<char> buffer;
+	// Multicast packets share the buffer among all receivers.
+	std::shared_ptr<const std::vector<char>> buffer;
+};
+
+// A filter that is attached to a socket (see posix::nlUeventFilterSubsystem).
+struct UeventFilter {
+	uint32_t subsystemHash;
+	// Zero matches all devtypes.
+	uint32_t devtypeHash;
 };
 
+// MurmurHash2 with a seed of zero. This is the hash that libudev uses for its filters.
+uint32_t hashString(const char *s, size_t length) {
+	constexpr uint32_t m = 0x5bd1e995;
+	auto data = reinterpret_cast<const unsigned char *>(s);
+	uint32_t h = length;
+	while(length >= 4) {
+		uint32_t k;
+		memcpy(&k, data, 4);
+		k *= m;
+		k ^= k >> 24;
+		k *= m;
+		h *= m;
+		h ^= k;
+		data += 4;
+		length -= 4;
+	}
+	switch(length) {
+	case 3: h ^= data[2] << 16; [[fallthrough]];
+	case 2: h ^= data[1] << 8; [[fallthrough]];
+	case 1: h ^= data[0]; h *= m;
+	}
+	h ^= h >> 13;
+	h *= m;
+	h ^= h >> 15;
+	return h;
+}
+
+// Determines the subsystem and devtype of a uevent, such that sockets can filter it
+// without parsing it again. Supports kernel uevents ("action@devpath\0KEY=VALUE\0...")
+// and messages that udevd re-broadcasts (which have a libudev header).
+void classifyUevent(Packet &packet) {
+	auto &buffer = *packet.buffer;
+
+	auto readBe32 = [&] (size_t offset) -> uint32_t {
+		auto p = reinterpret_cast<const unsigned char *>(buffer.data() + offset);
+		return (uint32_t{p[0]} << 24) | (uint32_t{p[1]} << 16)
+				| (uint32_t{p[2]} << 8) | uint32_t{p[3]};
+	};
+
+	// See struct udev_monitor_netlink_header in libudev.
+	if(buffer.size() >= 32 && !memcmp(buffer.data(), "libudev", 8)) {
+		if(readBe32(8) != 0xFEEDCAFE)
+			return;
+		packet.hasSubsystem = true;
+		packet.subsystemHash = readBe32(24);
+		packet.devtypeHash = readBe32(28);
+		return;
+	}
+
+	std::string_view view{buffer.data(), buffer.size()};
+	size_t pos = view.find('\0');
+	while(pos != std::string_view::npos && pos + 1 < view.size()) {
+		auto end = view.find('\0', pos + 1);
+		auto entry = view.substr(pos + 1,
+				(end == std::string_view::npos ? view.size() : end) - pos - 1);
+		if(entry.starts_with("SUBSYSTEM=")) {
+			auto value = entry.substr(10);
+			packet.hasSubsystem = true;
+			packet.subsystemHash = hashString(value.data(), value.size());
+		}else if(entry.starts_with("DEVTYPE=")) {
+			auto value = entry.substr(8);
+			packet.devtypeHash = hashString(value.data(), value.size());
+		}
+		pos = end;
+	}
+}
+
 struct OpenFile : File {
 public:
 	static void serve(smarter::shared_ptr<OpenFile> file) {
@@ -57,7 +139,24 @@ public:
 		_statusBell.raise();
 	}
 
+	// Applies the uevent filters of this socket to a multicast packet.
+	bool accepts(const Packet &packet) {
+		if(_filters.empty() || !packet.hasSubsystem)
+			return true;
+		for(auto &filter : _filters) {
+			if(filter.subsystemHash != packet.subsystemHash)
+				continue;
+			if(filter.devtypeHash && filter.devtypeHash != packet.devtypeHash)
+				continue;
+			return true;
+		}
+		return false;
+	}
+
 	void handleClose() override {
+		_setGroups(0);
+		if(_socketPort)
+			globalPortMap.erase(_socketPort);
 		_isClosed = true;
 		_statusBell.raise();
 		_cancelServe.cancel();
@@ -80,9 +179,9 @@ public:
 		
 		// TODO: Truncate packets (for SOCK_DGRAM) here.
 		auto packet = &_recvQueue.front();
-		auto size = packet->buffer.size();
+		auto size = packet->buffer->size();
 		assert(max_length >= size);
-		memcpy(data, packet->buffer.data(), size);
+		memcpy(data, packet->buffer->data(), size);
 		_recvQueue.pop_front();
 		co_return size;
 	}
@@ -110,9 +209,13 @@ public:
 		using namespace protocols::fs;
 		if(logSockets)
 			std::cout << "posix: Recv from socket \e[1;34m" << structName() << "\e[0m" << std::endl;
-		assert(!flags);
-		// assert(!(flags & ~(MSG_DONTWAIT | MSG_CMSG_CLOEXEC)));
-		assert(max_addr_length >= sizeof(struct sockaddr_nl));
+		// MSG_DONTWAIT is used by PT_RECVMMSG to drain the queue in a single request.
+		// The protocol cannot report the untruncated length, so MSG_TRUNC is not supported.
+		if(flags & ~(MSG_DONTWAIT | MSG_CMSG_CLOEXEC | MSG_PEEK)) {
+			std::cout << "posix: Unsupported flags 0x" << std::hex << flags << std::dec
+					<< " in netlink recvMsg()" << std::endl;
+			co_return RecvResult { protocols::fs::Error::illegalArguments };
+		}
 
 		if(_recvQueue.empty() && ((flags & MSG_DONTWAIT) || nonBlock_)) {
 			if(logSockets)
@@ -123,19 +226,17 @@ public:
 		while(_recvQueue.empty())
 			co_await _statusBell.async_wait();
 		
-		// TODO: Truncate packets (for SOCK_DGRAM) here.
 		auto packet = &_recvQueue.front();
 		
-		auto size = packet->buffer.size();
-		assert(max_length >= size);
-		memcpy(data, packet->buffer.data(), size);
+		auto size = std::min(packet->buffer->size(), max_length);
+		memcpy(data, packet->buffer->data(), size);
 
 		struct sockaddr_nl sa;
 		memset(&sa, 0, sizeof(struct sockaddr_nl));
 		sa.nl_family = AF_NETLINK;
 		sa.nl_pid = packet->senderPort;
 		sa.nl_groups = packet->group ? (1 << (packet->group - 1)) : 0;
-		memcpy(addr_ptr, &sa, sizeof(struct sockaddr_nl));
+		memcpy(addr_ptr, &sa, std::min(sizeof(struct sockaddr_nl), max_addr_length));
 		
 		CtrlBuilder ctrl{max_ctrl_length};
 
@@ -149,7 +250,8 @@ public:
 			ctrl.write<struct ucred>(creds);
 		}
 
-		_recvQueue.pop_front();
+		if(!(flags & MSG_PEEK))
+			_recvQueue.pop_front();
 		co_return RecvResult { RecvData { size, sizeof(struct sockaddr_nl), ctrl.buffer() } };
 	}
 	
@@ -160,8 +262,41 @@ public:
 			std::vector<smarter::shared_ptr<File, FileHandle>> files) override;
 	
 	async::result<void> setOption(int option, int value) override {
-		assert(option == SO_PASSCRED);
-		_passCreds = value;
+		switch(option) {
+		case SO_PASSCRED:
+			_passCreds = value;
+			break;
+		case posix::nlAddMembership:
+		case posix::nlDropMembership:
+			if(value < 1 || value > 32) {
+				std::cout << "posix: Ignoring membership of netlink group "
+						<< value << std::endl;
+				break;
+			}
+			if(option == posix::nlAddMembership)
+				_setGroups(_groups | (uint32_t{1} << (value - 1)));
+			else
+				_setGroups(_groups & ~(uint32_t{1} << (value - 1)));
+			break;
+		case posix::nlUeventFilterSubsystem:
+			_filters.push_back({static_cast<uint32_t>(value), 0});
+			break;
+		case posix::nlUeventFilterDevtype:
+			if(_filters.empty()) {
+				std::cout << "posix: Ignoring netlink devtype filter"
+						" without subsystem filter" << std::endl;
+				break;
+			}
+			_filters.back().devtypeHash = static_cast<uint32_t>(value);
+			break;
+		case posix::nlUeventFilterReset:
+			_filters.clear();
+			break;
+		default:
+			std::cout << "posix: Unsupported option " << option
+					<< " on netlink socket" << std::endl;
+			assert(!"Unsupported netlink socket option");
+		}
 		co_return;
 	};
 	
@@ -235,6 +370,9 @@ private:
 		assert(res.second);
 	}
 
+	// Updates the multicast subscriptions of this socket.
+	void _setGroups(uint32_t groups);
+
 	int _protocol;
 	helix::UniqueLane _passthrough;
 	async::cancellation_event _cancelServe;
@@ -250,6 +388,10 @@ private:
 	// The actual receive queue of the socket.
 	std::deque<Packet> _recvQueue;
 
+	// Bit i is set if the socket is subscribed to group i + 1.
+	uint32_t _groups = 0;
+	std::vector<UeventFilter> _filters;
+
 	// Socket options.
 	bool _passCreds;
 	bool nonBlock_;
@@ -258,13 +400,20 @@ private:
 struct Group {
 	friend struct OpenFile;
 
-	// Sends a copy of the given message to this group.
-	void carbonCopy(const Packet &packet);
+	// Sends a copy of the given message to all members of this group (except for the sender).
+	void carbonCopy(const Packet &packet, OpenFile *sender = nullptr);
 
 private:
 	std::vector<OpenFile *> _subscriptions;
 };
 
+Group *getGroup(int protocol, int grp_idx) {
+	auto it = globalGroupMap.find({protocol, grp_idx});
+	if(it == globalGroupMap.end())
+		return nullptr;
+	return it->second.get();
+}
+
 // ----------------------------------------------------------------------------
 // OpenFile implementation.
 // ----------------------------------------------------------------------------
@@ -276,9 +425,13 @@ OpenFile::sendMsg(Process *process, uint32_t flags, const void *data, size_t max
 		std::vector<smarter::shared_ptr<File, FileHandle>> files) {
 	if(logSockets)
 		std::cout << "posix: Send to socket \e[1;34m" << structName() << "\e[0m" << std::endl;
-	assert(!flags);
-	assert(addr_length == sizeof(struct sockaddr_nl));
-	assert(files.empty());
+	if(flags & ~MSG_DONTWAIT) {
+		std::cout << "posix: Unsupported flags 0x" << std::hex << flags << std::dec
+				<< " in netlink sendMsg()" << std::endl;
+		co_return protocols::fs::Error::illegalArguments;
+	}
+	if(addr_length != sizeof(struct sockaddr_nl) || !files.empty())
+		co_return protocols::fs::Error::illegalArguments;
 
 	struct sockaddr_nl sa;
 	memcpy(&sa, addr_ptr, sizeof(struct sockaddr_nl));
@@ -287,25 +440,28 @@ OpenFile::sendMsg(Process *process, uint32_t flags, const void *data, size_t max
 	if(sa.nl_groups) {
 		// Linux allows multicast only to a single group at a time.
 		grp_idx = __builtin_ffs(sa.nl_groups);
-		assert(sa.nl_groups == (1 << (grp_idx - 1)));
+		if(sa.nl_groups != (1u << (grp_idx - 1)))
+			co_return protocols::fs::Error::illegalArguments;
 	}
 
-	// TODO: Associate port otherwise.
-	assert(_socketPort);
+	// Like Linux, bind the socket implicitly.
+	if(!_socketPort)
+		_associatePort();
 
 	Packet packet;
 	packet.senderPid = process->pid();
 	packet.senderPort = _socketPort;
 	packet.group = grp_idx;
-	packet.buffer.resize(max_length);
-	memcpy(packet.buffer.data(), data, max_length);
+	packet.buffer = std::make_shared<const std::vector<char>>(
+			static_cast<const char *>(data), static_cast<const char *>(data) + max_length);
+	if(grp_idx && _protocol == NETLINK_KOBJECT_UEVENT)
+		classifyUevent(packet);
 
 	// Carbon-copy to the message to a group.
 	if(grp_idx) {
-		auto it = globalGroupMap.find({_protocol, grp_idx});
-		assert(it != globalGroupMap.end());
-		auto group = it->second.get();
-		group->carbonCopy(packet);
+		auto group = getGroup(_protocol, grp_idx);
+		assert(group);
+		group->carbonCopy(packet, this);
 	}
 
 	// Netlink delivers the message per unicast.
@@ -326,38 +482,55 @@ OpenFile::sendMsg(Process *process, uint32_t flags, const void *data, size_t max
 async::result<protocols::fs::Error> OpenFile::bind(Process *,
 		const void *addr_ptr, size_t addr_length) {
 	struct sockaddr_nl sa;
+	memset(&sa, 0, sizeof(struct sockaddr_nl));
 	assert(addr_length <= sizeof(struct sockaddr_nl));
 	memcpy(&sa, addr_ptr, addr_length);
 
 	assert(!sa.nl_pid);
-	_associatePort();
+	if(!_socketPort)
+		_associatePort();
 
-	if(sa.nl_groups) {
-		for(int i = 0; i < 32; i++) {
-			if(!(sa.nl_groups & (1 << i)))
-				continue;
-			std::cout << "posix: Join netlink group "
-					<< _protocol << "." << (i + 1) << std::endl;
+	// Like on Linux, bind() replaces the set of groups.
+	_setGroups(sa.nl_groups);
+
+	co_return protocols::fs::Error::none;
+}
 
-			auto it = globalGroupMap.find({_protocol, i + 1});
-			assert(it != globalGroupMap.end());
-			auto group = it->second.get();
-			group->_subscriptions.push_back(this);
+void OpenFile::_setGroups(uint32_t groups) {
+	for(int i = 0; i < 32; i++) {
+		uint32_t bit = uint32_t{1} << i;
+		if((groups & bit) == (_groups & bit))
+			continue;
+
+		auto group = getGroup(_protocol, i + 1);
+		if(!group) {
+			std::cout << "posix: Netlink group " << _protocol << "." << (i + 1)
+					<< " does not exist" << std::endl;
+			groups &= ~bit;
+			continue;
 		}
-	}
 
-	// Do nothing for now.
-	co_return protocols::fs::Error::none;
+		auto &subs = group->_subscriptions;
+		if(groups & bit) {
+			if(logSockets)
+				std::cout << "posix: Join netlink group "
+						<< _protocol << "." << (i + 1) << std::endl;
+			subs.push_back(this);
+		}else{
+			subs.erase(std::find(subs.begin(), subs.end(), this));
+		}
+	}
+	_groups = groups;
 }
 
 async::result<size_t> OpenFile::sockname(void *addr_ptr, size_t max_addr_length) {
 	assert(_socketPort);
 
-	// TODO: Fill in nl_groups.
 	struct sockaddr_nl sa;
 	memset(&sa, 0, sizeof(struct sockaddr_nl));
 	sa.nl_family = AF_NETLINK;
 	sa.nl_pid = _socketPort;
+	sa.nl_groups = _groups;
 	memcpy(addr_ptr, &sa, std::min(sizeof(struct sockaddr_nl), max_addr_length));
 	
 	co_return sizeof(struct sockaddr_nl);
@@ -367,9 +540,13 @@ async::result<size_t> OpenFile::sockname(void *addr_ptr, size_t max_addr_length)
 // Group implementation.
 // ----------------------------------------------------------------------------
 
-void Group::carbonCopy(const Packet &packet) {
-	for(auto socket : _subscriptions)
+void Group::carbonCopy(const Packet &packet, OpenFile *sender) {
+	// Only the buffer's reference count is touched for sockets that accept the packet.
+	for(auto socket : _subscriptions) {
+		if(socket == sender || !socket->accepts(packet))
+			continue;
 		socket->deliver(packet);
+	}
 }
 
 // ----------------------------------------------------------------------------
@@ -389,12 +566,12 @@ void broadcast(int proto_idx, int grp_idx, std::string buffer) {
 	packet.senderPid = 0;
 	packet.senderPort = 0;
 	packet.group = grp_idx;
-	packet.buffer.resize(buffer.size());
-	memcpy(packet.buffer.data(), buffer.data(), buffer.size());
+	packet.buffer = std::make_shared<const std::vector<char>>(buffer.begin(), buffer.end());
+	if(proto_idx == NETLINK_KOBJECT_UEVENT)
+		classifyUevent(packet);
 
-	auto it = globalGroupMap.find({proto_idx, grp_idx});
-	assert(it != globalGroupMap.end());
-	auto group = it->second.get();
+	auto group = getGroup(proto_idx, grp_idx);
+	assert(group);
 	group->carbonCopy(packet);
 }
 
@@ -1,6 +1,11 @@
 
 #include <signal.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include <helix/executor.hpp>
 
 #include "common.hpp"
 #include "clock.hpp"
@@ -14,12 +19,56 @@ static bool logCleanup = false;
 
 async::result<void> serve(std::shared_ptr<Process> self, std::shared_ptr<Generation> generation);
 
+namespace {
+
+helix::Executor *serveExecutor;
+
+// Starts serving a process on its home worker.
+void detachServe(std::shared_ptr<Process> process, std::shared_ptr<Generation> generation) {
+	assert(serveExecutor);
+	unsigned int worker = process->pid() % serveExecutor->numWorkers();
+	if(helix::Executor::current() == serveExecutor
+			&& helix::Executor::currentWorker() == worker) {
+		// Start synchronously, such that the process is registered before we return.
+		async::detach(serve(std::move(process), std::move(generation)));
+	}else{
+		serveExecutor->detachOn(worker, serve(std::move(process), std::move(generation)));
+	}
+}
+
+// Drops a reference to a VmContext on some worker. If this is the last reference,
+// the address space is torn down there instead of on the caller's path.
+async::result<void> releaseVmContext(std::shared_ptr<VmContext> context) {
+	context = nullptr;
+	co_return;
+}
+
+} // anonymous namespace
+
+void initServeWorkers() {
+	assert(!serveExecutor);
+	serveExecutor = new helix::Executor{numServeWorkers};
+}
+
+void runServeWorkers() {
+	serveExecutor->run();
+}
+
 // ----------------------------------------------------------------------------
 // VmContext.
 // ----------------------------------------------------------------------------
 
+namespace {
+	std::atomic<uint64_t> vmSequenceCounter{0};
+}
+
+void VmContext::bumpSequence_() {
+	_sequence = vmSequenceCounter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
 std::shared_ptr<VmContext> VmContext::create() {
 	auto context = std::make_shared<VmContext>();
+	context->bumpSequence_();
 
 	HelHandle space;
 	HEL_CHECK(helCreateSpace(&space));
@@ -30,27 +79,39 @@ std::shared_ptr<VmContext> VmContext::create() {
 
 std::shared_ptr<VmContext> VmContext::clone(std::shared_ptr<VmContext> original) {
 	auto context = std::make_shared<VmContext>();
+	context->bumpSequence_();
 
 	HelHandle space;
 	HEL_CHECK(helCreateSpace(&space));
 	context->_space = helix::UniqueDescriptor(space);
 
+	// Areas that were split from the same mapping share their copy view.
+	// Fork each copy view only once such that this remains true for the clone.
+	std::unordered_map<helix::UniqueDescriptor *,
+			std::shared_ptr<helix::UniqueDescriptor>> forkedViews;
+
 	for(const auto &entry : original->_areaTree) {
 		const auto &[address, area] = entry;
 
-		helix::UniqueDescriptor copyView;
-		if(area.copyOnWrite) {
-			HelHandle copyHandle;
-			HEL_CHECK(helForkMemory(area.copyView.getHandle(), &copyHandle));
-			copyView = helix::UniqueDescriptor{copyHandle};
+		std::shared_ptr<helix::UniqueDescriptor> copyView;
+		if(area.copyView) {
+			auto it = forkedViews.find(area.copyView.get());
+			if(it != forkedViews.end()) {
+				copyView = it->second;
+			}else{
+				HelHandle copyHandle;
+				HEL_CHECK(helForkMemory(area.copyView->getHandle(), &copyHandle));
+				copyView = std::make_shared<helix::UniqueDescriptor>(copyHandle);
+				forkedViews.insert({area.copyView.get(), copyView});
+			}
 
 			void *pointer;
-			HEL_CHECK(helMapMemory(copyView.getHandle(), context->_space.getHandle(),
+			HEL_CHECK(helMapMemory(copyView->getHandle(), context->_space.getHandle(),
 					reinterpret_cast<void *>(address),
-					0, area.areaSize, area.nativeFlags, &pointer));
+					area.copyOffset, area.areaSize, area.nativeFlags, &pointer));
 		}else{
 			void *pointer;
-			HEL_CHECK(helMapMemory(area.fileView.getHandle(), context->_space.getHandle(),
+			HEL_CHECK(helMapMemory(area.fileView->getHandle(), context->_space.getHandle(),
 					reinterpret_cast<void *>(address),
 					area.offset, area.areaSize, area.nativeFlags, &pointer));
 		}
@@ -59,11 +120,13 @@ std::shared_ptr<VmContext> VmContext::clone(std::shared_ptr<VmContext> original)
 		copy.copyOnWrite = area.copyOnWrite;
 		copy.areaSize = area.areaSize;
 		copy.nativeFlags = area.nativeFlags;
-		copy.fileView = area.fileView.dup();
+		copy.fileView = area.fileView;
 		copy.copyView = std::move(copyView);
+		copy.copyOffset = area.copyOffset;
 		copy.file = area.file;
 		copy.offset = area.offset;
-		context->_areaTree.emplace(address, std::move(copy));
+		copy.mayWrite = area.mayWrite;
+		context->_areaTree.emplace_hint(context->_areaTree.end(), address, std::move(copy));
 	}
 
 	return context;
@@ -72,6 +135,10 @@ std::shared_ptr<VmContext> VmContext::clone(std::shared_ptr<VmContext> original)
 VmContext::~VmContext() {
 	if(logCleanup)
 		std::cout << "\e[33mposix: VmContext is destructed\e[39m" << std::endl;
+
+	// Drop the space before the areas' descriptors. The kernel then retires all
+	// mappings at once instead of unmapping the area views one by one.
+	_space = {};
 }
 
 auto VmContext::splitAreaOn_(uintptr_t addr, size_t size) ->
@@ -95,12 +162,14 @@ auto VmContext::splitAreaOn_(uintptr_t addr, size_t size) ->
 			right.copyOnWrite = area.copyOnWrite;
 			right.areaSize = area.areaSize - (addr - base);
 			right.nativeFlags = area.nativeFlags;
-			right.fileView = area.fileView.dup();
-			right.copyView = area.copyView.dup();
+			right.fileView = area.fileView;
+			right.copyView = area.copyView;
+			right.copyOffset = area.copyOffset + (addr - base);
 			right.file = area.file;
 			right.offset = area.offset + (addr - base);
+			right.mayWrite = area.mayWrite;
 
-			_areaTree.emplace(addr, std::move(right));
+			_areaTree.emplace_hint(std::next(it), addr, std::move(right));
 
 			area.areaSize = (addr - base);
 		}
@@ -114,17 +183,49 @@ auto VmContext::splitAreaOn_(uintptr_t addr, size_t size) ->
 	};
 }
 
+bool VmContext::mergeWithNext_(std::map<uintptr_t, Area>::iterator it) {
+	assert(it != _areaTree.end());
+	auto next = std::next(it);
+	if(next == _areaTree.end())
+		return false;
+
+	auto &[base, area] = *it;
+	auto &[nextBase, nextArea] = *next;
+	if(base + area.areaSize != nextBase
+			|| area.copyOnWrite != nextArea.copyOnWrite
+			|| area.nativeFlags != nextArea.nativeFlags
+			|| area.fileView != nextArea.fileView
+			|| area.copyView != nextArea.copyView
+			|| area.file != nextArea.file
+			|| area.offset + static_cast<intptr_t>(area.areaSize) != nextArea.offset
+			|| area.copyOffset + area.areaSize != nextArea.copyOffset)
+		return false;
+
+	area.areaSize += nextArea.areaSize;
+	_areaTree.erase(next);
+	return true;
+}
+
 async::result<void *>
 VmContext::mapFile(uintptr_t hint, helix::UniqueDescriptor memory,
 		smarter::shared_ptr<File, FileHandle> file,
-		intptr_t offset, size_t size, bool copyOnWrite, uint32_t nativeFlags) {
+		intptr_t offset, size_t size, bool copyOnWrite, uint32_t nativeFlags,
+		bool mayWrite) {
+	assert(mayWrite || !(nativeFlags & kHelMapProtWrite));
 	size_t alignedSize = (size + 0xFFF) & ~size_t(0xFFF);
 
 	// Perform the actual mapping.
 	// POSIX specifies that non-page-size mappings are rounded up and filled with zeros.
 	helix::UniqueDescriptor copyView;
 	void *pointer;
-	if(copyOnWrite) {
+	if(copyOnWrite && memory && !(nativeFlags & kHelMapProtWrite)) {
+		// Read-only private file mappings (e.g., program text) map the file directly;
+		// the private copy is only created once the mapping becomes writable.
+		// This lets all processes that map the same file share the kernel's page tables.
+		HEL_CHECK(helMapMemory(memory.getHandle(), _space.getHandle(),
+				reinterpret_cast<void *>(hint),
+				offset, alignedSize, nativeFlags, &pointer));
+	}else if(copyOnWrite) {
 		HelHandle handle;
 		if(memory) {
 			HEL_CHECK(helCopyOnWrite(memory.getHandle(), offset, alignedSize, &handle));
@@ -145,6 +246,7 @@ VmContext::mapFile(uintptr_t hint, helix::UniqueDescriptor memory,
 	//		<< " (size: " << (void *)size << ")" << std::endl;
 
 	auto address = reinterpret_cast<uintptr_t>(pointer);
+	bumpSequence_();
 
 	auto [startIt, endIt] = splitAreaOn_(address, alignedSize);
 
@@ -161,10 +263,12 @@ VmContext::mapFile(uintptr_t hint, helix::UniqueDescriptor memory,
 	area.copyOnWrite = copyOnWrite;
 	area.areaSize = alignedSize;
 	area.nativeFlags = nativeFlags;
-	area.fileView = std::move(memory);
-	area.copyView = std::move(copyView);
+	area.fileView = std::make_shared<helix::UniqueDescriptor>(std::move(memory));
+	if(copyView)
+		area.copyView = std::make_shared<helix::UniqueDescriptor>(std::move(copyView));
 	area.file = std::move(file);
 	area.offset = offset;
+	area.mayWrite = mayWrite;
 	_areaTree.emplace(address, std::move(area));
 
 	co_return pointer;
@@ -194,6 +298,7 @@ async::result<void *> VmContext::remapFile(void *oldPointer,
 
 	// Unmap the old area.
 	HEL_CHECK(helUnmapMemory(_space.getHandle(), oldPointer, alignedOldSize));
+	bumpSequence_();
 
 	// Construct the new area from the old one.
 	Area area;
@@ -204,6 +309,7 @@ async::result<void *> VmContext::remapFile(void *oldPointer,
 	area.copyView = std::move(it->second.copyView);
 	area.file = std::move(it->second.file);
 	area.offset = it->second.offset;
+	area.mayWrite = it->second.mayWrite;
 	_areaTree.erase(it);
 
 	// Perform some sanity checking.
@@ -219,17 +325,55 @@ async::result<void *> VmContext::remapFile(void *oldPointer,
 	co_return pointer;
 }
 
-async::result<void> VmContext::protectFile(void *pointer, size_t size, uint32_t protectionFlags) {
+async::result<Error> VmContext::protectFile(void *pointer, size_t size, uint32_t protectionFlags) {
 	size_t alignedSize = (size + 0xFFF) & ~size_t(0xFFF);
 	auto address = reinterpret_cast<uintptr_t>(pointer);
 
+	if(protectionFlags & kHelMapProtWrite) {
+		auto it = _areaTree.upper_bound(address);
+		if(it != _areaTree.begin())
+			it = std::prev(it);
+		for(; it != _areaTree.end() && it->first < address + alignedSize; ++it) {
+			if(it->first + it->second.areaSize <= address)
+				continue;
+			if(!it->second.mayWrite)
+				co_return Error::accessDenied;
+		}
+	}
+
+	auto [startIt, endIt] = splitAreaOn_(address, alignedSize);
+
+	// Private areas that still map the file directly need their copy before they become writable.
+	if(protectionFlags & kHelMapProtWrite) {
+		for(auto it = startIt; it != endIt; ++it) {
+			auto &[addr, area] = *it;
+			if(addr < address || addr + area.areaSize > address + alignedSize)
+				continue;
+			if(!area.copyOnWrite || area.copyView)
+				continue;
+
+			HelHandle handle;
+			HEL_CHECK(helCopyOnWrite(area.fileView->getHandle(), area.offset,
+					area.areaSize, &handle));
+			helix::UniqueDescriptor copyView{handle};
+
+			void *window;
+			HEL_CHECK(helMapMemory(copyView.getHandle(), _space.getHandle(),
+					reinterpret_cast<void *>(addr),
+					0, area.areaSize, area.nativeFlags, &window));
+			assert(reinterpret_cast<uintptr_t>(window) == addr);
+
+			area.copyView = std::make_shared<helix::UniqueDescriptor>(std::move(copyView));
+			area.copyOffset = 0;
+		}
+	}
+
 	helix::ProtectMemory protect;
 	auto &&submit = helix::submitProtectMemory(_space, &protect,
 			pointer, alignedSize, protectionFlags, helix::Dispatcher::global());
 	co_await submit.async_wait();
 	HEL_CHECK(protect.error());
-
-	auto [startIt, endIt] = splitAreaOn_(address, alignedSize);
+	bumpSequence_();
 
 	for (auto it = startIt; it != endIt; ++it) {
 		auto &[addr, area] = *it;
@@ -238,6 +382,77 @@ async::result<void> VmContext::protectFile(void *pointer, size_t size, uint32_t
 			area.nativeFlags |= protectionFlags;
 		}
 	}
+
+	// Undo splits that are no longer necessary (e.g., if the protection is changed back).
+	// This keeps the number of areas low for programs that frequently call mprotect().
+	auto it = startIt;
+	if(it != _areaTree.begin())
+		it = std::prev(it);
+	while(it != _areaTree.end() && it->first <= address + alignedSize) {
+		if(!mergeWithNext_(it))
+			++it;
+	}
+	co_return Error::success;
+}
+
+async::result<HelError> VmContext::populate(void *pointer, size_t size) {
+	size_t alignedSize = (size + 0xFFF) & ~size_t(0xFFF);
+
+	helix::PopulateMemory populate;
+	auto &&submit = helix::submitPopulateMemory(_space, &populate,
+			pointer, alignedSize, helix::Dispatcher::global());
+	co_await submit.async_wait();
+	co_return populate.error();
+}
+
+bool VmContext::discard(void *pointer, size_t size) {
+	size_t alignedSize = (size + 0xFFF) & ~size_t(0xFFF);
+	auto address = reinterpret_cast<uintptr_t>(pointer);
+
+	// The range must be mapped entirely.
+	auto check = _areaTree.upper_bound(address);
+	if(check == _areaTree.begin())
+		return false;
+	check = std::prev(check);
+	for(uintptr_t addr = address; addr < address + alignedSize; ++check) {
+		if(check == _areaTree.end() || check->first > addr
+				|| check->first + check->second.areaSize <= addr)
+			return false;
+		addr = check->first + check->second.areaSize;
+	}
+
+	auto [startIt, endIt] = splitAreaOn_(address, alignedSize);
+
+	for(auto it = startIt; it != endIt; ++it) {
+		auto &[addr, area] = *it;
+		if(addr < address || addr + area.areaSize > address + alignedSize)
+			continue;
+		// Areas without a copy (see mapFile()) do not have modified pages.
+		if(!area.copyView)
+			continue;
+
+		// Replace the private copy by a fresh one; this drops all modified pages.
+		HelHandle handle;
+		if(*area.fileView) {
+			HEL_CHECK(helCopyOnWrite(area.fileView->getHandle(), area.offset,
+					area.areaSize, &handle));
+		}else{
+			HEL_CHECK(helCopyOnWrite(kHelZeroMemory, area.offset, area.areaSize, &handle));
+		}
+		helix::UniqueDescriptor copyView{handle};
+
+		void *window;
+		HEL_CHECK(helMapMemory(copyView.getHandle(), _space.getHandle(),
+				reinterpret_cast<void *>(addr),
+				0, area.areaSize, area.nativeFlags, &window));
+		assert(reinterpret_cast<uintptr_t>(window) == addr);
+
+		area.copyView = std::make_shared<helix::UniqueDescriptor>(std::move(copyView));
+		area.copyOffset = 0;
+	}
+	bumpSequence_();
+
+	return true;
 }
 
 void VmContext::unmapFile(void *pointer, size_t size) {
@@ -245,6 +460,7 @@ void VmContext::unmapFile(void *pointer, size_t size) {
 	auto address = reinterpret_cast<uintptr_t>(pointer);
 
 	HEL_CHECK(helUnmapMemory(_space.getHandle(), pointer, alignedSize));
+	bumpSequence_();
 
 	auto [startIt, endIt] = splitAreaOn_(address, alignedSize);
 
@@ -300,6 +516,11 @@ void FsContext::changeWorkingDirectory(ViewPath workdir) {
 // FileContext.
 // ----------------------------------------------------------------------------
 
+namespace {
+	// Number of handles that fit into the file table window that is shared with the client.
+	constexpr size_t fileTableWindowSize = 0x1000 / sizeof(HelHandle);
+}
+
 static HelHandle posixMbusClient = [] {
 	posix::ManagarmProcessData data;
 
@@ -308,6 +529,45 @@ static HelHandle posixMbusClient = [] {
 	return data.mbusLane;
 }();
 
+int FileTable::lowestFree() const {
+	for(size_t i = 0; i < _full.size(); i++) {
+		if(_full[i] == ~uint64_t{0})
+			continue;
+		size_t w = i * 64 + __builtin_ctzll(~_full[i]);
+		if(w >= _used.size())
+			break;
+		return w * 64 + __builtin_ctzll(~_used[w]);
+	}
+	return _used.size() * 64;
+}
+
+void FileTable::set(int fd, FileDescriptor desc) {
+	assert(fd >= 0);
+	if(static_cast<size_t>(fd) >= _entries.size())
+		_grow(fd + 1);
+	_entries[fd] = std::move(desc);
+
+	auto &word = _used[fd / 64];
+	word |= uint64_t{1} << (fd % 64);
+	if(word == ~uint64_t{0})
+		_full[fd / 4096] |= uint64_t{1} << ((fd / 64) % 64);
+}
+
+void FileTable::erase(int fd) {
+	assert(contains(fd));
+	_entries[fd] = {};
+	_used[fd / 64] &= ~(uint64_t{1} << (fd % 64));
+	_full[fd / 4096] &= ~(uint64_t{1} << ((fd / 64) % 64));
+}
+
+void FileTable::_grow(size_t minSize) {
+	// Grow in units of whole _used words.
+	size_t words = std::max<size_t>(_used.size() * 2, (minSize + 63) / 64);
+	_entries.resize(words * 64);
+	_used.resize(words, 0);
+	_full.resize((words + 63) / 64, 0);
+}
+
 std::shared_ptr<FileContext> FileContext::create() {
 	auto context = std::make_shared<FileContext>();
 
@@ -344,10 +604,9 @@ std::shared_ptr<FileContext> FileContext::clone(std::shared_ptr<FileContext> ori
 	context->_fileTableMemory = helix::UniqueDescriptor(memory);
 	context->_fileTableWindow = reinterpret_cast<HelHandle *>(window);
 
-	for(auto entry : original->_fileTable) {
-		//std::cout << "Clone FD " << entry.first << std::endl;
-		context->attachFile(entry.first, entry.second.file, entry.second.closeOnExec);
-	}
+	original->_fileTable.forEach([&] (int fd, FileDescriptor &desc) {
+		context->attachFile(fd, desc.file, desc.closeOnExec);
+	});
 
 	HEL_CHECK(helTransferDescriptor(posixMbusClient,
 			context->_universe.getHandle(), &context->_clientMbusLane));
@@ -366,17 +625,14 @@ int FileContext::attachFile(smarter::shared_ptr<File, FileHandle> file,
 	HEL_CHECK(helTransferDescriptor(file->getPassthroughLane().getHandle(),
 			_universe.getHandle(), &handle));
 
-	for(int fd = 0; ; fd++) {
-		if(_fileTable.find(fd) != _fileTable.end())
-			continue;
-
-		if(logFileAttach)
-			std::cout << "posix: Attaching FD " << fd << std::endl;
+	auto fd = _fileTable.lowestFree();
+	assert(static_cast<size_t>(fd) < fileTableWindowSize);
+	if(logFileAttach)
+		std::cout << "posix: Attaching FD " << fd << std::endl;
 
-		_fileTable.insert({fd, {std::move(file), close_on_exec}});
-		_fileTableWindow[fd] = handle;
-		return fd;
-	}
+	_fileTable.set(fd, {std::move(file), close_on_exec});
+	_fileTableWindow[fd] = handle;
+	return fd;
 }
 
 void FileContext::attachFile(int fd, smarter::shared_ptr<File, FileHandle> file,
@@ -388,43 +644,38 @@ void FileContext::attachFile(int fd, smarter::shared_ptr<File, FileHandle> file,
 	if(logFileAttach)
 		std::cout << "posix: Attaching fixed FD " << fd << std::endl;
 
-	auto it = _fileTable.find(fd);
-	if(it != _fileTable.end()) {
-		it->second = {std::move(file), close_on_exec};
-	}else{
-		_fileTable.insert({fd, {std::move(file), close_on_exec}});
-	}
+	assert(fd >= 0 && static_cast<size_t>(fd) < fileTableWindowSize);
+	_fileTable.set(fd, {std::move(file), close_on_exec});
 	_fileTableWindow[fd] = handle;
 }
 
 std::optional<FileDescriptor> FileContext::getDescriptor(int fd) {
-	auto file = _fileTable.find(fd);
-	if(file == _fileTable.end())
+	auto desc = _fileTable.find(fd);
+	if(!desc)
 		return std::nullopt;
-	return file->second;
+	return *desc;
 }
 
 Error FileContext::setDescriptor(int fd, bool close_on_exec) {
-	auto it = _fileTable.find(fd);
-	if(it == _fileTable.end()) {
+	auto desc = _fileTable.find(fd);
+	if(!desc) {
 		return Error::noSuchFile;
 	}
-	it->second.closeOnExec = close_on_exec;
+	desc->closeOnExec = close_on_exec;
 	return Error::success;
 }
 
 smarter::shared_ptr<File, FileHandle> FileContext::getFile(int fd) {
-	auto file = _fileTable.find(fd);
-	if(file == _fileTable.end())
+	auto desc = _fileTable.find(fd);
+	if(!desc)
 		return smarter::shared_ptr<File, FileHandle>{};
-	return file->second.file;
+	return desc->file;
 }
 
 void FileContext::closeFile(int fd) {
 	if(logFileAttach)
 		std::cout << "posix: Closing FD " << fd << std::endl;
-	auto it = _fileTable.find(fd);
-	if(it == _fileTable.end()) {
+	if(!_fileTable.contains(fd)) {
 		std::cout << "\e[31m" "posix: Trying to close non-existant FD "
 				<< fd << "\e[39m" << std::endl;
 		return;
@@ -433,21 +684,19 @@ void FileContext::closeFile(int fd) {
 	HEL_CHECK(helCloseDescriptor(_universe.getHandle(), _fileTableWindow[fd]));
 
 	_fileTableWindow[fd] = 0;
-	_fileTable.erase(it);
+	_fileTable.erase(fd);
 }
 
 void FileContext::closeOnExec() {
-	auto it = _fileTable.begin();
-	while(it != _fileTable.end()) {
-		if(it->second.closeOnExec) {
-			HEL_CHECK(helCloseDescriptor(_universe.getHandle(), _fileTableWindow[it->first]));
+	_fileTable.forEach([&] (int fd, FileDescriptor &desc) {
+		if(!desc.closeOnExec)
+			return;
+		HEL_CHECK(helCloseDescriptor(_universe.getHandle(), _fileTableWindow[fd]));
 
-			_fileTableWindow[it->first] = 0;
-			it = _fileTable.erase(it);
-		}else{
-			it++;
-		}
-	}
+		_fileTableWindow[fd] = 0;
+		// forEach() has already read the bitmap word, so erasing is safe.
+		_fileTable.erase(fd);
+	});
 }
 
 // ----------------------------------------------------------------------------
@@ -752,17 +1001,25 @@ Generation::~Generation() {
 // ----------------------------------------------------------------------------
 
 // PID 1 is reserved for the init process, therefore we start at 2.
-ProcessId nextPid = 2;
+std::atomic<ProcessId> nextPid = 2;
+
+// See ThreadPage::randomGeneration.
+std::atomic<uint64_t> nextRandomGeneration = 1;
+
+// Protects globalPidMap. Shared between all serve workers.
+std::mutex globalPidMutex;
 std::map<ProcessId, PidHull *> globalPidMap;
 
 PidHull::PidHull(pid_t pid)
 : pid_{pid} {
+	std::lock_guard lock{globalPidMutex};
 	auto [it, success] = globalPidMap.insert({pid_, this});
 	assert(success);
 	(void)it;
 }
 
 PidHull::~PidHull() {
+	std::lock_guard lock{globalPidMutex};
 	auto it = globalPidMap.find(pid_);
 	assert(it != globalPidMap.end());
 	globalPidMap.erase(it);
@@ -795,6 +1052,7 @@ std::shared_ptr<TerminalSession> PidHull::getTerminalSession() {
 }
 
 std::shared_ptr<Process> Process::findProcess(ProcessId pid) {
+	std::lock_guard lock{globalPidMutex};
 	auto it = globalPidMap.find(pid);
 	if(it == globalPidMap.end())
 		return nullptr;
@@ -833,6 +1091,11 @@ bool Process::checkOrRequestSignalRaise() {
 	return false;
 }
 
+void Process::publishPendingSignals() {
+	auto activeSet = std::get<1>(_signalContext->checkSignal());
+	__atomic_store_n(&accessThreadPage()->pendingSignals, activeSet, __ATOMIC_SEQ_CST);
+}
+
 async::result<std::shared_ptr<Process>> Process::init(std::string path) {
 	auto hull = std::make_shared<PidHull>(1);
 	auto process = std::make_shared<Process>(std::move(hull), nullptr);
@@ -848,9 +1111,11 @@ async::result<std::shared_ptr<Process>> Process::init(std::string path) {
 	HEL_CHECK(helAllocateMemory(0x1000, 0, nullptr, &thread_memory));
 	process->_threadPageMemory = helix::UniqueDescriptor{thread_memory};
 	process->_threadPageMapping = helix::Mapping{process->_threadPageMemory, 0, 0x1000};
+	process->accessThreadPage()->randomGeneration
+			= nextRandomGeneration.fetch_add(1, std::memory_order_relaxed);
 
 	// The initial signal mask allows all signals.
-	process->_signalMask = 0;
+	process->setSignalMask(0);
 
 	auto [server_lane, client_lane] = helix::createStream();
 	HEL_CHECK(helTransferDescriptor(client_lane.getHandle(),
@@ -869,6 +1134,8 @@ async::result<std::shared_ptr<Process>> Process::init(std::string path) {
 			process->_vmContext->getSpace().getHandle(),
 			nullptr, 0, 0x1000, kHelMapProtRead,
 			&process->_clientClkTrackerPage));
+	HEL_CHECK(helMapClockPage(process->_vmContext->getSpace().getHandle(),
+			&process->_clientClockPage));
 
 	process->_uid = 0;
 	process->_euid = 0;
@@ -899,16 +1166,32 @@ async::result<std::shared_ptr<Process>> Process::init(std::string path) {
 	auto generation = std::make_shared<Generation>();
 	process->_currentGeneration = generation;
 	helResume(process->_threadDescriptor.getHandle());
-	async::detach(serve(process, std::move(generation)));
+	detachServe(process, std::move(generation));
 
 	co_return process;
 }
 
 std::shared_ptr<Process> Process::fork(std::shared_ptr<Process> original) {
-	auto hull = std::make_shared<PidHull>(nextPid++);
+	return fork_(std::move(original), false);
+}
+
+std::shared_ptr<Process> Process::vfork(std::shared_ptr<Process> original) {
+	return fork_(std::move(original), true);
+}
+
+std::shared_ptr<Process> Process::fork_(std::shared_ptr<Process> original, bool borrowVm) {
+	auto hull = std::make_shared<PidHull>(nextPid.fetch_add(1, std::memory_order_relaxed));
 	auto process = std::make_shared<Process>(std::move(hull), original.get());
 	process->_path = original->path();
-	process->_vmContext = VmContext::clone(original->_vmContext);
+	if(borrowVm) {
+		// The child runs in the parent's address space until it calls execve() or exits.
+		// This avoids copying the area tree (and forking all copy views) when the child
+		// is going to replace its image anyway.
+		process->_vmContext = original->_vmContext;
+		process->_vforkDone = std::make_shared<async::oneshot_event>();
+	}else{
+		process->_vmContext = VmContext::clone(original->_vmContext);
+	}
 	process->_fsContext = FsContext::clone(original->_fsContext);
 	process->_fileContext = FileContext::clone(original->_fileContext);
 	process->_signalContext = SignalContext::clone(original->_signalContext);
@@ -919,9 +1202,11 @@ std::shared_ptr<Process> Process::fork(std::shared_ptr<Process> original) {
 	HEL_CHECK(helAllocateMemory(0x1000, 0, nullptr, &thread_memory));
 	process->_threadPageMemory = helix::UniqueDescriptor{thread_memory};
 	process->_threadPageMapping = helix::Mapping{process->_threadPageMemory, 0, 0x1000};
+	process->accessThreadPage()->randomGeneration
+			= nextRandomGeneration.fetch_add(1, std::memory_order_relaxed);
 
 	// Signal masks are copied on fork().
-	process->_signalMask = original->_signalMask;
+	process->setSignalMask(original->signalMask());
 
 	auto [server_lane, client_lane] = helix::createStream();
 	HEL_CHECK(helTransferDescriptor(client_lane.getHandle(),
@@ -936,10 +1221,18 @@ std::shared_ptr<Process> Process::fork(std::shared_ptr<Process> original) {
 			process->_vmContext->getSpace().getHandle(),
 			nullptr, 0, 0x1000, kHelMapProtRead,
 			&process->_clientFileTable));
-	HEL_CHECK(helMapMemory(clk::trackerPageMemory().getHandle(),
-			process->_vmContext->getSpace().getHandle(),
-			nullptr, 0, 0x1000, kHelMapProtRead,
-			&process->_clientClkTrackerPage));
+	if(borrowVm) {
+		// The parent's mappings of these pages are already visible to the child.
+		process->_clientClkTrackerPage = original->_clientClkTrackerPage;
+		process->_clientClockPage = original->_clientClockPage;
+	}else{
+		HEL_CHECK(helMapMemory(clk::trackerPageMemory().getHandle(),
+				process->_vmContext->getSpace().getHandle(),
+				nullptr, 0, 0x1000, kHelMapProtRead,
+				&process->_clientClkTrackerPage));
+		HEL_CHECK(helMapClockPage(process->_vmContext->getSpace().getHandle(),
+				&process->_clientClockPage));
+	}
 
 	process->_clientAuxBegin = original->_clientAuxBegin;
 	process->_clientAuxEnd = original->_clientAuxEnd;
@@ -963,13 +1256,13 @@ std::shared_ptr<Process> Process::fork(std::shared_ptr<Process> original) {
 
 	auto generation = std::make_shared<Generation>();
 	process->_currentGeneration = generation;
-	async::detach(serve(process, std::move(generation)));
+	detachServe(process, std::move(generation));
 
 	return process;
 }
 
 std::shared_ptr<Process> Process::clone(std::shared_ptr<Process> original, void *ip, void *sp) {
-	auto hull = std::make_shared<PidHull>(nextPid++);
+	auto hull = std::make_shared<PidHull>(nextPid.fetch_add(1, std::memory_order_relaxed));
 	auto process = std::make_shared<Process>(std::move(hull), original.get());
 	process->_path = original->path();
 	process->_vmContext = original->_vmContext;
@@ -984,9 +1277,11 @@ std::shared_ptr<Process> Process::clone(std::shared_ptr<Process> original, void
 	HEL_CHECK(helAllocateMemory(0x1000, 0, nullptr, &thread_memory));
 	process->_threadPageMemory = helix::UniqueDescriptor{thread_memory};
 	process->_threadPageMapping = helix::Mapping{process->_threadPageMemory, 0, 0x1000};
+	process->accessThreadPage()->randomGeneration
+			= nextRandomGeneration.fetch_add(1, std::memory_order_relaxed);
 
 	// Signal masks are copied on clone().
-	process->_signalMask = original->_signalMask;
+	process->setSignalMask(original->signalMask());
 
 	auto [server_lane, client_lane] = helix::createStream();
 	HEL_CHECK(helTransferDescriptor(client_lane.getHandle(),
@@ -1000,6 +1295,7 @@ std::shared_ptr<Process> Process::clone(std::shared_ptr<Process> original, void
 
 	process->_clientFileTable = original->_clientFileTable;
 	process->_clientClkTrackerPage = original->_clientClkTrackerPage;
+	process->_clientClockPage = original->_clientClockPage;
 
 	process->_clientAuxBegin = original->_clientAuxBegin;
 	process->_clientAuxEnd = original->_clientAuxEnd;
@@ -1020,11 +1316,131 @@ std::shared_ptr<Process> Process::clone(std::shared_ptr<Process> original, void
 
 	auto generation = std::make_shared<Generation>();
 	process->_currentGeneration = generation;
-	async::detach(serve(process, std::move(generation)));
+	detachServe(process, std::move(generation));
 
 	return process;
 }
 
+async::result<frg::expected<Error, std::shared_ptr<Process>>> Process::spawn(
+		std::shared_ptr<Process> original, std::string path,
+		std::vector<std::string> args, std::vector<std::string> env,
+		SpawnAttributes attributes) {
+	// Apply the file actions to the child's contexts first. Until the child is registered
+	// below, failing only needs to drop these contexts.
+	auto fsContext = FsContext::clone(original->_fsContext);
+	auto fileContext = FileContext::clone(original->_fileContext);
+	for(auto &action : attributes.actions) {
+		if(action.type == SpawnAction::Type::close) {
+			if(!fileContext->getFile(action.fd))
+				co_return Error::badFd;
+			fileContext->closeFile(action.fd);
+		}else if(action.type == SpawnAction::Type::dup2) {
+			auto file = fileContext->getFile(action.fd);
+			if(!file || action.newFd < 0
+					|| static_cast<size_t>(action.newFd) >= fileTableWindowSize)
+				co_return Error::badFd;
+			// As specified by POSIX, dup2() to the same FD clears FD_CLOEXEC.
+			fileContext->attachFile(action.newFd, std::move(file));
+		}else if(action.type == SpawnAction::Type::open) {
+			if(action.newFd < 0 || static_cast<size_t>(action.newFd) >= fileTableWindowSize)
+				co_return Error::badFd;
+			auto file = FRG_CO_TRY(co_await open(fsContext->getRoot(),
+					fsContext->getWorkingDirectory(), action.path, original.get(),
+					0, action.semanticFlags));
+			if(!file)
+				co_return Error::noSuchFile;
+			if(fileContext->getFile(action.newFd))
+				fileContext->closeFile(action.newFd);
+			fileContext->attachFile(action.newFd, std::move(file));
+		}else{
+			assert(action.type == SpawnAction::Type::chdir);
+			auto pathResult = co_await resolve(fsContext->getRoot(),
+					fsContext->getWorkingDirectory(), action.path, original.get());
+			if(!pathResult) {
+				if(pathResult.error() == protocols::fs::Error::notDirectory)
+					co_return Error::notDirectory;
+				co_return Error::noSuchFile;
+			}
+			fsContext->changeWorkingDirectory(pathResult.value());
+		}
+	}
+
+	// Build the child's address space directly. In contrast to fork() + execve(),
+	// the parent's VmContext is never copied.
+	auto vmContext = VmContext::create();
+	auto execResult = FRG_CO_TRY(co_await execute(fsContext->getRoot(),
+			fsContext->getWorkingDirectory(),
+			path, std::move(args), std::move(env), vmContext,
+			fileContext->getUniverse(),
+			fileContext->clientMbusLane(), original.get()));
+	fileContext->closeOnExec();
+
+	auto hull = std::make_shared<PidHull>(nextPid.fetch_add(1, std::memory_order_relaxed));
+	auto process = std::make_shared<Process>(std::move(hull), original.get());
+	process->_path = std::move(path);
+	process->_vmContext = std::move(vmContext);
+	process->_fsContext = std::move(fsContext);
+	process->_fileContext = std::move(fileContext);
+	process->_signalContext = SignalContext::clone(original->_signalContext);
+	process->_signalContext->resetHandlers();
+
+	original->_pgPointer->reassociateProcess(process.get());
+	if(attributes.setSid)
+		TerminalSession::initializeNewSession(process.get());
+
+	HelHandle thread_memory;
+	HEL_CHECK(helAllocateMemory(0x1000, 0, nullptr, &thread_memory));
+	process->_threadPageMemory = helix::UniqueDescriptor{thread_memory};
+	process->_threadPageMapping = helix::Mapping{process->_threadPageMemory, 0, 0x1000};
+	process->accessThreadPage()->randomGeneration
+			= nextRandomGeneration.fetch_add(1, std::memory_order_relaxed);
+
+	// Unless the caller overrides it, the signal mask is inherited as with fork().
+	process->setSignalMask(attributes.signalMask.value_or(original->signalMask()));
+
+	auto [server_lane, client_lane] = helix::createStream();
+	HEL_CHECK(helTransferDescriptor(client_lane.getHandle(),
+			process->_fileContext->getUniverse().getHandle(), &process->_clientPosixLane));
+	client_lane.release();
+
+	HEL_CHECK(helMapMemory(process->_threadPageMemory.getHandle(),
+			process->_vmContext->getSpace().getHandle(),
+			nullptr, 0, 0x1000, kHelMapProtRead | kHelMapProtWrite,
+			&process->_clientThreadPage));
+	HEL_CHECK(helMapMemory(process->_fileContext->fileTableMemory().getHandle(),
+			process->_vmContext->getSpace().getHandle(),
+			nullptr, 0, 0x1000, kHelMapProtRead,
+			&process->_clientFileTable));
+	HEL_CHECK(helMapMemory(clk::trackerPageMemory().getHandle(),
+			process->_vmContext->getSpace().getHandle(),
+			nullptr, 0, 0x1000, kHelMapProtRead,
+			&process->_clientClkTrackerPage));
+	HEL_CHECK(helMapClockPage(process->_vmContext->getSpace().getHandle(),
+			&process->_clientClockPage));
+
+	process->_threadDescriptor = std::move(execResult.thread);
+	process->_posixLane = std::move(server_lane);
+	process->_clientAuxBegin = execResult.auxBegin;
+	process->_clientAuxEnd = execResult.auxEnd;
+	process->_uid = original->_uid;
+	process->_euid = original->_euid;
+	process->_gid = original->_gid;
+	process->_egid = original->_egid;
+	original->_children.push_back(process);
+	process->_hull->initializeProcess(process.get());
+	process->_didExecute = true;
+
+	auto procfs_root = std::static_pointer_cast<procfs::DirectoryNode>(getProcfs()->getTarget());
+	process->_procfs_dir = procfs_root->createProcDirectory(std::to_string(process->_hull->getPid()), process.get());
+
+	auto generation = std::make_shared<Generation>();
+	process->_currentGeneration = generation;
+	helResume(process->_threadDescriptor.getHandle());
+	detachServe(process, std::move(generation));
+
+	co_return process;
+}
+
 async::result<Error> Process::exec(std::shared_ptr<Process> process,
 		std::string path, std::vector<std::string> args, std::vector<std::string> env) {
 	auto exec_vm_context = VmContext::create();
@@ -1046,6 +1462,7 @@ async::result<Error> Process::exec(std::shared_ptr<Process> process,
 
 	void *exec_thread_page;
 	void *exec_clk_tracker_page;
+	void *exec_clock_page;
 	void *exec_client_table;
 	HEL_CHECK(helMapMemory(process->_threadPageMemory.getHandle(),
 			exec_vm_context->getSpace().getHandle(),
@@ -1055,6 +1472,8 @@ async::result<Error> Process::exec(std::shared_ptr<Process> process,
 			exec_vm_context->getSpace().getHandle(),
 			nullptr, 0, 0x1000, kHelMapProtRead,
 			&exec_clk_tracker_page));
+	HEL_CHECK(helMapClockPage(exec_vm_context->getSpace().getHandle(),
+			&exec_clock_page));
 	HEL_CHECK(helMapMemory(process->_fileContext->fileTableMemory().getHandle(),
 			exec_vm_context->getSpace().getHandle(),
 			nullptr, 0, 0x1000, kHelMapProtRead,
@@ -1072,17 +1491,19 @@ async::result<Error> Process::exec(std::shared_ptr<Process> process,
 	// Perform pre-exec() work.
 	// From here on, we can now release resources of the old process image.
 	process->_fileContext->closeOnExec();
+	process->releaseVforkParent_();
 
 	// "Commit" the exec() operation.
 	process->_path = std::move(path);
 	process->_posixLane = std::move(server_lane);
 	process->_threadDescriptor = std::move(execResult.thread);
-	process->_vmContext = std::move(exec_vm_context);
+	auto previousVmContext = std::exchange(process->_vmContext, std::move(exec_vm_context));
 	process->_signalContext->resetHandlers();
 	process->_clientThreadPage = exec_thread_page;
 	process->_clientPosixLane = exec_posix_lane;
 	process->_clientFileTable = exec_client_table;
 	process->_clientClkTrackerPage = exec_clk_tracker_page;
+	process->_clientClockPage = exec_clock_page;
 	process->_clientAuxBegin = execResult.auxBegin;
 	process->_clientAuxEnd = execResult.auxEnd;
 	process->_didExecute = true;
@@ -1090,11 +1511,26 @@ async::result<Error> Process::exec(std::shared_ptr<Process> process,
 	auto generation = std::make_shared<Generation>();
 	process->_currentGeneration = generation;
 	helResume(process->_threadDescriptor.getHandle());
-	async::detach(serve(process, std::move(generation)));
+	detachServe(process, std::move(generation));
+
+	// As in terminate(), the old image is torn down off the critical path.
+	serveExecutor->detach(releaseVmContext(std::move(previousVmContext)));
 
 	co_return Error::success;
 }
 
+void Process::releaseVforkParent_() {
+	if(!_vforkDone)
+		return;
+
+	// Remove the child's private pages from the borrowed address space.
+	HEL_CHECK(helUnmapMemory(_vmContext->getSpace().getHandle(), _clientThreadPage, 0x1000));
+	HEL_CHECK(helUnmapMemory(_vmContext->getSpace().getHandle(), _clientFileTable, 0x1000));
+
+	_vforkDone->raise();
+	_vforkDone = nullptr;
+}
+
 void Process::retire(Process *process) {
 	assert(process->_parent);
 	process->_parent->_childrenUsage.userTime += process->_generationUsage.userTime;
@@ -1117,9 +1553,13 @@ async::result<void> Process::terminate(TerminationState state) {
 	HEL_CHECK(helQueryThreadStats(_threadDescriptor.getHandle(), &stats));
 	_generationUsage.userTime += stats.userTime;
 
+	releaseVforkParent_();
+
+	// Tearing down large address spaces takes a while; do not delay the parent's wait().
+	auto vmContext = std::move(_vmContext);
+
 	_posixLane = {};
 	_threadDescriptor = {};
-	_vmContext = nullptr;
 	_fsContext = nullptr;
 	_fileContext = nullptr;
 	//_signalContext = nullptr; // TODO: Migrate the notifications to PID 1.
@@ -1141,6 +1581,8 @@ async::result<void> Process::terminate(TerminationState state) {
 	UserSignal info;
 	info.pid = pid();
 	parent->signalContext()->issueSignal(SIGCHLD, info);
+
+	serveExecutor->detach(releaseVmContext(std::move(vmContext)));
 }
 
 async::result<int> Process::wait(int pid, bool nonBlocking, TerminationState *state) {
@@ -1,13 +1,17 @@
 #pragma once
 
+#include <stdint.h>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include <async/result.hpp>
 #include <async/oneshot-event.hpp>
 #include <async/recurring-event.hpp>
 #include <boost/intrusive/list.hpp>
+#include <protocols/posix/data.hpp>
 
 #include "vfs.hpp"
 #include "procfs.hpp"
@@ -33,25 +37,48 @@ struct VmContext {
 	}
 
 	// TODO: Pass abstract instead of hel flags to this function?
+	// If mayWrite is false, the mapping can never become writable (see protectFile()).
 	async::result<void *> mapFile(uintptr_t hint, helix::UniqueDescriptor memory,
 			smarter::shared_ptr<File, FileHandle> file,
-			intptr_t offset, size_t size, bool copyOnWrite, uint32_t nativeFlags);
+			intptr_t offset, size_t size, bool copyOnWrite, uint32_t nativeFlags,
+			bool mayWrite = true);
 
 	async::result<void *> remapFile(void *old_pointer, size_t old_size, size_t new_size);
 
-	async::result<void> protectFile(void *pointer, size_t size, uint32_t protectionFlags);
+	// Fails with accessDenied if the range should become writable but contains
+	// areas that were mapped with mayWrite = false.
+	async::result<Error> protectFile(void *pointer, size_t size, uint32_t protectionFlags);
+
+	// Faults in all pages of the range (for MAP_POPULATE and MADV_WILLNEED).
+	async::result<HelError> populate(void *pointer, size_t size);
+
+	// Implements MADV_DONTNEED: private pages of the range are dropped and read back
+	// from the underlying file (or as zeros) on the next access. Shared pages are kept.
+	bool discard(void *pointer, size_t size);
 
 	void unmapFile(void *pointer, size_t size);
 
+	// Changes whenever areas are added, removed or modified. Values are unique across
+	// all VmContexts, such that they can be used to validate cached data (e.g., by procfs).
+	uint64_t sequence() {
+		return _sequence;
+	}
+
 private:
 	struct Area {
 		bool copyOnWrite;
 		size_t areaSize;
 		uint32_t nativeFlags;
-		helix::UniqueDescriptor fileView;
-		helix::UniqueDescriptor copyView;
+		// Views are shared between all areas that result from splitting the same mapping.
+		std::shared_ptr<helix::UniqueDescriptor> fileView;
+		// Private areas that were never writable do not have a copy yet and map fileView.
+		std::shared_ptr<helix::UniqueDescriptor> copyView;
+		// Offset of the area into copyView.
+		uintptr_t copyOffset = 0;
 		smarter::shared_ptr<File, FileHandle> file;
 		intptr_t offset;
+		// Cleared for shared mappings of files with write seals (like VM_MAYWRITE on Linux).
+		bool mayWrite = true;
 	};
 
 	std::pair<
@@ -59,8 +86,16 @@ private:
 		std::map<uintptr_t, Area>::iterator
 	> splitAreaOn_(uintptr_t addr, size_t size);
 
+	// Merges the area at it with its successor if both originate from the same mapping
+	// and agree in their attributes. Returns true if the areas were merged.
+	bool mergeWithNext_(std::map<uintptr_t, Area>::iterator it);
+
+	void bumpSequence_();
+
 	helix::UniqueDescriptor _space;
 
+	uint64_t _sequence = 0;
+
 	std::map<uintptr_t, Area> _areaTree;
 
 public:
@@ -153,6 +188,53 @@ struct FileDescriptor {
 	bool closeOnExec;
 };
 
+// Maps file descriptors to FileDescriptor objects.
+// Entries are stored in a dense array indexed by FD. Two levels of bitmaps
+// track which FDs are in use; this allows finding the lowest free FD by bit scans.
+struct FileTable {
+	// Returns the lowest FD that is not in use.
+	int lowestFree() const;
+
+	bool contains(int fd) const {
+		return fd >= 0 && static_cast<size_t>(fd) < _entries.size()
+				&& (_used[fd / 64] & (uint64_t{1} << (fd % 64)));
+	}
+
+	FileDescriptor *find(int fd) {
+		if(!contains(fd))
+			return nullptr;
+		return &_entries[fd];
+	}
+
+	// Inserts or replaces the entry for the given FD.
+	void set(int fd, FileDescriptor desc);
+
+	void erase(int fd);
+
+	// Calls f(fd, desc) for all FDs in ascending order.
+	template<typename F>
+	void forEach(F f) {
+		for(size_t w = 0; w < _used.size(); w++) {
+			auto word = _used[w];
+			while(word) {
+				int b = __builtin_ctzll(word);
+				word &= word - 1;
+				int fd = w * 64 + b;
+				f(fd, _entries[fd]);
+			}
+		}
+	}
+
+private:
+	void _grow(size_t minSize);
+
+	std::vector<FileDescriptor> _entries;
+	// Bit i is set if FD i is in use.
+	std::vector<uint64_t> _used;
+	// Bit i is set if _used[i] is all ones.
+	std::vector<uint64_t> _full;
+};
+
 struct FileContext {
 public:
 	static std::shared_ptr<FileContext> create();
@@ -189,8 +271,7 @@ public:
 private:
 	helix::UniqueDescriptor _universe;
 
-	// TODO: replace this by a tree that remembers gaps between keys.
-	std::unordered_map<int, FileDescriptor> _fileTable;
+	FileTable _fileTable;
 
 	helix::UniqueDescriptor _fileTableMemory;
 
@@ -327,8 +408,74 @@ struct Generation {
 	async::oneshot_event requestsDone;
 };
 
-struct ThreadPage {
-	int globalSignalFlag;
+// File actions and attributes of posix_spawn().
+struct SpawnAction {
+	enum class Type {
+		close,
+		dup2,
+		open,
+		chdir
+	};
+
+	Type type;
+	int fd = -1;
+	int newFd = -1;
+	SemanticFlags semanticFlags = 0;
+	std::string path;
+};
+
+struct SpawnAttributes {
+	bool setSid = false;
+	std::optional<uint64_t> signalMask;
+	// Applied in order.
+	std::vector<SpawnAction> actions;
+};
+
+using ThreadPage = posix::ThreadPage;
+
+// Number and total time of the requests of a process (see requests::RequestTimer).
+// The table is only allocated once the process issues a request.
+struct ProcessRequestStats {
+	// Keys below 128 are CntReqTypes, the remaining keys are bragi message IDs plus 128.
+	static constexpr size_t numKeys = 256;
+
+	struct Entry {
+		std::atomic<uint64_t> count{0};
+		std::atomic<uint64_t> nanos{0};
+	};
+
+	ProcessRequestStats() = default;
+
+	ProcessRequestStats(const ProcessRequestStats &) = delete;
+
+	~ProcessRequestStats() {
+		delete[] _entries.load(std::memory_order_relaxed);
+	}
+
+	ProcessRequestStats &operator= (const ProcessRequestStats &) = delete;
+
+	void record(size_t key, uint64_t nanos) {
+		assert(key < numKeys);
+		auto entries = _entries.load(std::memory_order_acquire);
+		if(!entries) {
+			auto fresh = new Entry[numKeys];
+			if(_entries.compare_exchange_strong(entries, fresh, std::memory_order_acq_rel)) {
+				entries = fresh;
+			}else{
+				delete[] fresh;
+			}
+		}
+		entries[key].count.fetch_add(1, std::memory_order_relaxed);
+		entries[key].nanos.fetch_add(nanos, std::memory_order_relaxed);
+	}
+
+	// Returns nullptr if the process did not issue any requests yet.
+	const Entry *entries() {
+		return _entries.load(std::memory_order_acquire);
+	}
+
+private:
+	std::atomic<Entry *> _entries{nullptr};
 };
 
 // --------------------------------------------------------------------------------------
@@ -377,9 +524,22 @@ struct Process : std::enable_shared_from_this<Process> {
 	static std::shared_ptr<Process> fork(std::shared_ptr<Process> parent);
 	static std::shared_ptr<Process> clone(std::shared_ptr<Process> parent, void *ip, void *sp);
 
+	// Like fork() but the child shares the parent's VmContext.
+	// The parent must not run until vforkDone() is raised, i.e., until
+	// the child calls execve() or terminates.
+	static std::shared_ptr<Process> vfork(std::shared_ptr<Process> parent);
+
 	static async::result<Error> exec(std::shared_ptr<Process> process,
 			std::string path, std::vector<std::string> args, std::vector<std::string> env);
 
+	// Creates a child that executes the given program, i.e., the equivalent of fork()
+	// followed by execve() but without copying the parent's VmContext.
+	// Errors are reported before the child becomes visible.
+	static async::result<frg::expected<Error, std::shared_ptr<Process>>> spawn(
+			std::shared_ptr<Process> parent, std::string path,
+			std::vector<std::string> args, std::vector<std::string> env,
+			SpawnAttributes attributes);
+
 	// Called when the PID is released (by waitpid()).
 	static void retire(Process *process);
 
@@ -498,18 +658,23 @@ public:
 	std::shared_ptr<ProcessGroup> pgPointer() { return _pgPointer; }
 	SignalContext *signalContext() { return _signalContext.get(); }
 
+	// The mask lives in the thread page (see ThreadPage::signalMask).
 	void setSignalMask(uint64_t mask) {
-		_signalMask = mask;
+		__atomic_store_n(&accessThreadPage()->signalMask, mask, __ATOMIC_SEQ_CST);
 	}
 
 	uint64_t signalMask() {
-		return _signalMask;
+		return __atomic_load_n(&accessThreadPage()->signalMask, __ATOMIC_SEQ_CST);
 	}
 
+	// Stores the signals that are currently pending to ThreadPage::pendingSignals.
+	void publishPendingSignals();
+
 	HelHandle clientPosixLane() { return _clientPosixLane; }
 	void *clientThreadPage() { return _clientThreadPage; }
 	void *clientFileTable() { return _clientFileTable; }
 	void *clientClkTrackerPage() { return _clientClkTrackerPage; }
+	void *clientClockPage() { return _clientClockPage; }
 	void *clientAuxBegin() { return _clientAuxBegin; }
 	void *clientAuxEnd() { return _clientAuxEnd; }
 
@@ -566,7 +731,21 @@ public:
 		_enteredSignalSeq++;
 	}
 
+	// Returns the event that is raised once a vfork() child stops borrowing
+	// its parent's address space (or nullptr if this process was not vfork()ed).
+	std::shared_ptr<async::oneshot_event> vforkDone() {
+		return _vforkDone;
+	}
+
+	ProcessRequestStats &requestStats() {
+		return _requestStats;
+	}
+
 private:
+	static std::shared_ptr<Process> fork_(std::shared_ptr<Process> parent, bool borrowVm);
+
+	void releaseVforkParent_();
+
 	Process *_parent;
 
 	std::shared_ptr<PidHull> _hull;
@@ -584,6 +763,10 @@ private:
 	std::shared_ptr<FileContext> _fileContext;
 	std::shared_ptr<SignalContext> _signalContext;
 	std::shared_ptr<procfs::Link> _procfs_dir;
+	// Non-null while a vfork() child borrows the parent's VmContext.
+	std::shared_ptr<async::oneshot_event> _vforkDone;
+
+	ProcessRequestStats _requestStats;
 
 	std::shared_ptr<ProcessGroup> _pgPointer;
 	boost::intrusive::list_member_hook<> _pgHook;
@@ -595,11 +778,11 @@ private:
 	void *_clientThreadPage;
 	void *_clientFileTable;
 	void *_clientClkTrackerPage;
+	void *_clientClockPage;
 	// Pointers to the aux vector in the client.
 	void *_clientAuxBegin = nullptr;
 	void *_clientAuxEnd = nullptr;
 
-	uint64_t _signalMask;
 	std::vector<std::shared_ptr<Process>> _children;
 
 	// The following intrusive queue stores notifications for wait().
@@ -635,6 +818,21 @@ private:
 
 std::shared_ptr<Process> findProcessWithCredentials(const char *credentials);
 
+// Processes are served by a helix::Executor. Each process is assigned to a home worker
+// (based on its PID); all of its coroutines run on that worker.
+// Only the PID allocator, the PID map and the credentials map are safe to be accessed
+// from multiple workers. Processes on different workers share most other state, for
+// example open files, VFS nodes and their caches, pipes and sockets, epoll and inotify
+// instances, process groups and signal delivery. All of that still assumes a single thread.
+// TODO: Make that state safe for concurrent access (or shard it) before raising this.
+constexpr unsigned int numServeWorkers = 1;
+
+// Must be called from main() before any process is created.
+void initServeWorkers();
+
+// Runs the calling thread as worker zero.
+[[noreturn]] void runServeWorkers();
+
 // --------------------------------------------------------------------------------------
 // Process groups and sessions.
 // --------------------------------------------------------------------------------------
@@ -7,6 +7,7 @@
 #include "device.hpp"
 #include "procfs.hpp"
 #include "process.hpp"
+#include "requests.hpp"
 
 namespace procfs {
 
@@ -50,6 +51,16 @@ void RegularFile::handleClose() {
 }
 
 async::result<frg::expected<Error, off_t>> RegularFile::seek(off_t offset, VfsSeek whence) {
+	if(whence == VfsSeek::absolute) {
+		if(offset < 0)
+			co_return Error::illegalArguments;
+		// Like Linux' seq_file: rewinding regenerates the contents, such that
+		// monitoring tools can keep the file open and re-read it.
+		if(!offset)
+			_cached = false;
+		_offset = offset;
+		co_return _offset;
+	}
 	assert(whence == VfsSeek::relative && !offset);
 	co_return _offset;
 }
@@ -59,13 +70,13 @@ RegularFile::readSome(Process *, void *data, size_t max_length) {
 	assert(max_length > 0);
 
 	if(!_cached) {
-		assert(!_offset);
 		auto node = static_cast<RegularNode *>(associatedLink()->getTarget().get());
 		_buffer = co_await node->show();
 		_cached = true;
 	}
 
-	assert(_offset <= _buffer.size());
+	if(_offset >= _buffer.size())
+		co_return 0;
 	size_t chunk = std::min(_buffer.size() - _offset, max_length);
 	memcpy(data, _buffer.data() + _offset, chunk);
 	_offset += chunk;
@@ -253,6 +264,8 @@ std::shared_ptr<Link> DirectoryNode::createProcDirectory(std::string name,
 
 	proc_dir->directMknode("exe", std::make_shared<ExeLink>(process));
 	proc_dir->directMkregular("maps", std::make_shared<MapNode>(process));
+	proc_dir->directMkregular("schedstat", std::make_shared<SchedstatNode>(process));
+	proc_dir->directMkregular("syscall_stats", std::make_shared<ProcessSyscallStatsNode>(process));
 
 	return link;
 }
@@ -330,6 +343,15 @@ async::result<frg::expected<Error, FileStats>> ExeLink::getStats() {
 
 async::result<std::string> MapNode::show() {
 	auto vmContext = _process->vmContext();
+	if(!vmContext)
+		co_return std::string{};
+
+	// Monitoring tools tend to read this file periodically even if nothing changed.
+	// Note that renames of backing files do not invalidate the cached paths.
+	auto sequence = vmContext->sequence();
+	if(sequence == _cachedSequence)
+		co_return _cachedMaps;
+
 	std::stringstream stream;
 	for (auto area : *vmContext) {
 		stream << std::hex << area.baseAddress();
@@ -363,7 +385,10 @@ async::result<std::string> MapNode::show() {
 		}
 		stream << "\n";
 	}
-	co_return stream.str();
+
+	_cachedSequence = sequence;
+	_cachedMaps = stream.str();
+	co_return _cachedMaps;
 }
 
 async::result<void> MapNode::store(std::string) {
@@ -371,6 +396,61 @@ async::result<void> MapNode::store(std::string) {
 	throw std::runtime_error("Can't store to a /proc/maps file!");
 }
 
+async::result<std::string> SchedstatNode::show() {
+	HelThreadStats stats;
+	memset(&stats, 0, sizeof(HelThreadStats));
+	if(_process->threadDescriptor().getHandle() != kHelNullHandle)
+		HEL_CHECK(helQueryThreadStats(_process->threadDescriptor().getHandle(), &stats));
+
+	// The first line matches Linux: run time, wait time (both in ns) and the number
+	// of timeslices. The remaining lines are specific to managarm.
+	std::stringstream stream;
+	stream << stats.userTime << " " << stats.waitTime << " " << stats.numTimeslices << "\n";
+	stream << "voluntary_switches " << stats.numVoluntarySwitches << "\n";
+	stream << "involuntary_switches " << stats.numInvoluntarySwitches << "\n";
+	stream << "migrations " << stats.numMigrations << "\n";
+	// One count per power-of-two bucket, starting at latencies below 1024 ns.
+	stream << "wakeup_latency";
+	for(int i = 0; i < kHelNumWakeupLatencyBuckets; i++)
+		stream << " " << stats.wakeupLatency[i];
+	stream << "\n";
+	co_return stream.str();
+}
+
+async::result<void> SchedstatNode::store(std::string) {
+	// TODO: proper error reporting.
+	throw std::runtime_error("Can't store to a /proc/schedstat file!");
+}
+
+async::result<std::string> ProcessSyscallStatsNode::show() {
+	std::stringstream stream;
+	auto entries = _process->requestStats().entries();
+	if(entries) {
+		for(size_t i = 0; i < ProcessRequestStats::numKeys; i++) {
+			auto count = entries[i].count.load(std::memory_order_relaxed);
+			if(!count)
+				continue;
+			stream << requests::requestName(i) << " " << count
+					<< " " << entries[i].nanos.load(std::memory_order_relaxed) << "\n";
+		}
+	}
+	co_return stream.str();
+}
+
+async::result<void> ProcessSyscallStatsNode::store(std::string) {
+	// TODO: proper error reporting.
+	throw std::runtime_error("Can't store to a /proc/syscall_stats file!");
+}
+
+async::result<std::string> SyscallStatsNode::show() {
+	co_return requests::formatRequestStats();
+}
+
+async::result<void> SyscallStatsNode::store(std::string) {
+	// TODO: proper error reporting.
+	throw std::runtime_error("Can't store to /proc/managarm/syscall_stats!");
+}
+
 } // namespace procfs
 
 std::shared_ptr<FsLink> getProcfs() {
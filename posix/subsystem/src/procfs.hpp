@@ -178,6 +178,39 @@ struct MapNode final : RegularNode {
 	async::result<void> store(std::string) override;
 private:
 	Process *_process;
+
+	// The last output of show() and the VmContext::sequence() that it corresponds to.
+	uint64_t _cachedSequence = 0;
+	std::string _cachedMaps;
+};
+
+struct SchedstatNode final : RegularNode {
+	SchedstatNode(Process *process)
+	: _process(process)
+	{ }
+
+	async::result<std::string> show() override;
+	async::result<void> store(std::string) override;
+private:
+	Process *_process;
+};
+
+// Per-process request statistics (one line per request type: name, count and total time).
+struct ProcessSyscallStatsNode final : RegularNode {
+	ProcessSyscallStatsNode(Process *process)
+	: _process(process)
+	{ }
+
+	async::result<std::string> show() override;
+	async::result<void> store(std::string) override;
+private:
+	Process *_process;
+};
+
+// System-wide request statistics, see requests::formatRequestStats().
+struct SyscallStatsNode final : RegularNode {
+	async::result<std::string> show() override;
+	async::result<void> store(std::string) override;
 };
 
 } // namespace procfs
@@ -1,13 +1,13 @@
 #include <asm/ioctls.h>
 #include <termios.h>
 #include <sys/epoll.h>
-#include <sstream>
 
 #include <async/recurring-event.hpp>
 
 #include "file.hpp"
 #include "process.hpp"
 #include "pts.hpp"
+#include "ring-buffer.hpp"
 #include "fs.bragi.hpp"
 
 namespace pts {
@@ -28,12 +28,8 @@ extern std::shared_ptr<RootLink> globalRootLink;
 
 //-----------------------------------------------------------------------------
 
-struct Packet {
-	// The actual octet data that the packet consists of.
-	std::vector<char> buffer;
-
-	size_t offset = 0;
-};
+// Amount of data that can be buffered in each direction.
+constexpr size_t ttyBufferSize = 64 * 1024;
 
 struct Channel {
 	Channel(int pts_index)
@@ -78,9 +74,20 @@ struct Channel {
 	uint64_t masterInSeq;
 	uint64_t slaveInSeq;
 
-	// The actual queue of this pipe.
-	std::deque<Packet> masterQueue;
-	std::deque<Packet> slaveQueue;
+	// Data that is written by the slave and read by the master (and vice versa).
+	RingBuffer masterBuffer{ttyBufferSize};
+	RingBuffer slaveBuffer{ttyBufferSize};
+
+	// Wakes up readers after data was appended to a buffer.
+	void publishMaster() {
+		masterInSeq = ++currentSeq;
+		statusBell.raise();
+	}
+
+	void publishSlave() {
+		slaveInSeq = ++currentSeq;
+		statusBell.raise();
+	}
 };
 
 //-----------------------------------------------------------------------------
@@ -458,19 +465,16 @@ MasterFile::readSome(Process *, void *data, size_t maxLength) {
 	if(!maxLength)
 		co_return 0;
 
-	if (_channel->masterQueue.empty() && _nonBlocking)
+	if (!_channel->masterBuffer.size() && _nonBlocking)
 		co_return Error::wouldBlock;
 
-	while(_channel->masterQueue.empty())
+	while(!_channel->masterBuffer.size())
 		co_await _channel->statusBell.async_wait();
 
-	auto packet = &_channel->masterQueue.front();
-	size_t chunk = std::min(packet->buffer.size() - packet->offset, maxLength);
+	// Drain as much as possible; writers that wait for space are woken up below.
+	auto chunk = _channel->masterBuffer.read(data, maxLength);
 	assert(chunk); // Otherwise, we return above due to !maxLength.
-	memcpy(data, packet->buffer.data() + packet->offset, chunk);
-	packet->offset += chunk;
-	if(packet->offset == packet->buffer.size())
-		_channel->masterQueue.pop_front();
+	_channel->statusBell.raise();
 	co_return chunk;
 }
 
@@ -479,30 +483,43 @@ MasterFile::writeAll(Process *, const void *data, size_t length) {
 	if(logReadWrite)
 		std::cout << "posix: Write to tty " << structName() << std::endl;
 
-	Packet packet;
-	packet.buffer.reserve(length);
-	packet.offset = 0;
-
 	auto s = reinterpret_cast<const char *>(data);
-	for(size_t i = 0; i < length; i++) {
-		if(_channel->activeSettings.c_lflag & ISIG) {
-			if(s[i] == static_cast<char>(_channel->activeSettings.c_cc[VINTR])) {
-				UserSignal info;
-				_channel->cts.issueSignalToForegroundGroup(SIGINT, info);
-				continue;
+	size_t progress = 0;
+	bool emitted = false;
+	while(progress < length) {
+		// Copy everything up to the next special character in one go.
+		size_t span = length - progress;
+		const void *intr = nullptr;
+		if(_channel->activeSettings.c_lflag & ISIG)
+			intr = memchr(s + progress, _channel->activeSettings.c_cc[VINTR], span);
+		if(intr)
+			span = reinterpret_cast<const char *>(intr) - (s + progress);
+
+		if(!span) {
+			UserSignal info;
+			_channel->cts.issueSignalToForegroundGroup(SIGINT, info);
+			progress++;
+			continue;
+		}
+
+		if(!_channel->slaveBuffer.space()) {
+			if(emitted) {
+				_channel->publishSlave();
+				emitted = false;
 			}
+			while(!_channel->slaveBuffer.space())
+				co_await _channel->statusBell.async_wait();
 		}
 
-		// Not a special character. Emit to the slave.
-		packet.buffer.push_back(s[i]);
+		span = std::min(span, _channel->slaveBuffer.space());
+		_channel->slaveBuffer.write(s + progress, span);
+		progress += span;
+		emitted = true;
 	}
 
 	// Check whether all data was discarded above.
-	if(packet.buffer.size()) {
-		_channel->slaveQueue.push_back(std::move(packet));
-		_channel->slaveInSeq = ++_channel->currentSeq;
-		_channel->statusBell.raise();
-	}
+	if(emitted)
+		_channel->publishSlave();
 	co_return length;
 }
 
@@ -528,7 +545,7 @@ async::result<frg::expected<Error, PollStatusResult>>
 MasterFile::pollStatus(Process *) {
 	// For now making pts files always writable is sufficient.
 	int events = EPOLLOUT;
-	if(!_channel->masterQueue.empty())
+	if(_channel->masterBuffer.size())
 		events |= EPOLLIN;
 
 	co_return PollStatusResult{_channel->currentSeq, events};
@@ -612,16 +629,12 @@ SlaveFile::readSome(Process *, void *data, size_t maxLength) {
 	if(!maxLength)
 		co_return 0;
 
-	while(_channel->slaveQueue.empty())
+	while(!_channel->slaveBuffer.size())
 		co_await _channel->statusBell.async_wait();
 
-	auto packet = &_channel->slaveQueue.front();
-	auto chunk = std::min(packet->buffer.size() - packet->offset, maxLength);
+	auto chunk = _channel->slaveBuffer.read(data, maxLength);
 	assert(chunk); // Otherwise, we return above due to !maxLength.
-	memcpy(data, packet->buffer.data() + packet->offset, chunk);
-	packet->offset += chunk;
-	if(packet->offset == packet->buffer.size())
-		_channel->slaveQueue.pop_front();
+	_channel->statusBell.raise();
 	co_return chunk;
 }
 
@@ -634,31 +647,41 @@ SlaveFile::writeAll(Process *, const void *data, size_t length) {
 	if(!length)
 		co_return {};
 
-	// Perform output processing.
-	std::stringstream ss;
-	for(size_t i = 0; i < length; i++) {
-		char c;
-		memcpy(&c, reinterpret_cast<const char *>(data) + i, 1);
-		if((_channel->activeSettings.c_oflag & ONLCR) && c == '\n') {
-//			std::cout << "Mapping NL -> CR,NL" << std::endl;
-			ss << "\r\n";
+	// Perform output processing. Runs of characters without newlines are copied as a whole.
+	auto s = reinterpret_cast<const char *>(data);
+	size_t progress = 0;
+	bool emitted = false;
+	while(progress < length) {
+		size_t span = length - progress;
+		const void *nl = nullptr;
+		if(_channel->activeSettings.c_oflag & ONLCR)
+			nl = memchr(s + progress, '\n', span);
+		if(nl)
+			span = reinterpret_cast<const char *>(nl) - (s + progress);
+
+		// Map NL -> CR,NL; both characters are written at once.
+		size_t needed = span ? 1 : 2;
+		if(_channel->masterBuffer.space() < needed) {
+			if(emitted) {
+				_channel->publishMaster();
+				emitted = false;
+			}
+			while(_channel->masterBuffer.space() < needed)
+				co_await _channel->statusBell.async_wait();
+		}
+
+		if(span) {
+			span = std::min(span, _channel->masterBuffer.space());
+			_channel->masterBuffer.write(s + progress, span);
+			progress += span;
 		}else{
-//			std::cout << "c: " << (int)c << std::endl;
-			ss << c;
+			_channel->masterBuffer.write("\r\n", 2);
+			progress++;
 		}
+		emitted = true;
 	}
 
-	// TODO: This is very inefficient.
-	auto str = ss.str();
-
-	Packet packet;
-	packet.buffer.resize(str.size());
-	memcpy(packet.buffer.data(), str.data(), str.size());
-	packet.offset = 0;
-
-	_channel->masterQueue.push_back(std::move(packet));
-	_channel->masterInSeq = ++_channel->currentSeq;
-	_channel->statusBell.raise();
+	_channel->publishMaster();
 	co_return length;
 }
 
@@ -683,7 +706,7 @@ async::result<frg::expected<Error, PollStatusResult>>
 SlaveFile::pollStatus(Process *) {
 	// For now making pts files always writable is sufficient.
 	int events = EPOLLOUT;
-	if(!_channel->slaveQueue.empty())
+	if(_channel->slaveBuffer.size())
 		events |= EPOLLIN;
 
 	co_return PollStatusResult{_channel->currentSeq, events};
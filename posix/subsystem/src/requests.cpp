@@ -0,0 +1,404 @@
+#include <sys/timerfd.h>
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <sstream>
+
+#include <helix/timer.hpp>
+#include <protocols/ostrace/ostrace.hpp>
+
+#include "epoll.hpp"
+#include "requests.hpp"
+#include "signalfd.hpp"
+#include "timerfd.hpp"
+
+namespace requests {
+
+namespace {
+
+constexpr bool logRequests = false;
+constexpr bool logRequestStats = false;
+
+using Handler = async::result<void> (*)(RequestContext &ctx);
+
+// Latencies are binned by their binary logarithm (in nanoseconds).
+constexpr int numLatencyBuckets = 40;
+
+// Requests are served by multiple workers; hence, all counters are atomic.
+struct RequestStats {
+	const char *name = nullptr;
+	std::atomic<uint64_t> count{0};
+	std::atomic<uint64_t> nanos{0};
+	std::array<std::atomic<uint64_t>, numLatencyBuckets> latencies{};
+};
+
+constexpr size_t numCntReqTypes = 128;
+constexpr size_t numKeys = ProcessRequestStats::numKeys;
+static_assert(numKeys == 2 * numCntReqTypes);
+
+std::array<Handler, numCntReqTypes> cntHandlers;
+// Indexed by the same keys as ProcessRequestStats.
+std::array<RequestStats, numKeys> requestStats;
+
+std::atomic<uint64_t> numDispatched{0};
+
+protocols::ostrace::Context ostContext;
+protocols::ostrace::EventId ostRequestEvent;
+protocols::ostrace::ItemId ostKeyItem;
+protocols::ostrace::ItemId ostTimeItem;
+// Set once the items above are valid.
+std::atomic<bool> tracingReady{false};
+
+async::result<void> sendErrorResponse(RequestContext &ctx, managarm::posix::Errors err) {
+	managarm::posix::SvrResponse resp;
+	resp.set_error(err);
+
+	auto [send_resp] = co_await helix_ng::exchangeMsgs(
+			ctx.conversation,
+			helix_ng::sendBragiHeadOnly(resp)
+		);
+	HEL_CHECK(send_resp.error());
+}
+
+async::result<void> sendResponse(RequestContext &ctx, managarm::posix::SvrResponse &resp) {
+	auto ser = resp.SerializeAsString();
+	auto [send_resp] = co_await helix_ng::exchangeMsgs(
+			ctx.conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size())
+		);
+	HEL_CHECK(send_resp.error());
+}
+
+// ----------------------------------------------------------------------------
+// Handlers.
+// ----------------------------------------------------------------------------
+
+async::result<void> handleEpollCreate(RequestContext &ctx) {
+	auto &req = ctx.req;
+	if(logRequests)
+		std::cout << "posix: EPOLL_CREATE" << std::endl;
+
+	assert(!(req.flags() & ~(managarm::posix::OpenFlags::OF_CLOEXEC)));
+
+	auto file = epoll::createFile();
+	auto fd = ctx.self->fileContext()->attachFile(file,
+			req.flags() & managarm::posix::OpenFlags::OF_CLOEXEC);
+
+	managarm::posix::SvrResponse resp;
+	resp.set_error(managarm::posix::Errors::SUCCESS);
+	resp.set_fd(fd);
+	co_await sendResponse(ctx, resp);
+}
+
+async::result<void> handleEpollAdd(RequestContext &ctx) {
+	auto &req = ctx.req;
+	if(logRequests)
+		std::cout << "posix: EPOLL_ADD" << std::endl;
+
+	auto epfile = ctx.self->fileContext()->getFile(req.fd());
+	auto file = ctx.self->fileContext()->getFile(req.newfd());
+	if(!file || !epfile) {
+		co_await sendErrorResponse(ctx, managarm::posix::Errors::BAD_FD);
+		co_return;
+	}
+
+	auto locked = file->weakFile().lock();
+	assert(locked);
+	Error ret = epoll::addItem(epfile.get(), ctx.self.get(),
+			std::move(locked), req.newfd(), req.flags(), req.cookie());
+	if(ret == Error::alreadyExists) {
+		co_await sendErrorResponse(ctx, managarm::posix::Errors::ALREADY_EXISTS);
+		co_return;
+	}
+	assert(ret == Error::success);
+
+	managarm::posix::SvrResponse resp;
+	resp.set_error(managarm::posix::Errors::SUCCESS);
+	co_await sendResponse(ctx, resp);
+}
+
+async::result<void> handleEpollModify(RequestContext &ctx) {
+	auto &req = ctx.req;
+	if(logRequests)
+		std::cout << "posix: EPOLL_MODIFY" << std::endl;
+
+	auto epfile = ctx.self->fileContext()->getFile(req.fd());
+	auto file = ctx.self->fileContext()->getFile(req.newfd());
+	assert(epfile && "Illegal FD for EPOLL_MODIFY");
+	assert(file && "Illegal FD for EPOLL_MODIFY item");
+
+	Error ret = epoll::modifyItem(epfile.get(), file.get(), req.newfd(),
+			req.flags(), req.cookie());
+	if(ret == Error::noSuchFile) {
+		co_await sendErrorResponse(ctx, managarm::posix::Errors::FILE_NOT_FOUND);
+		co_return;
+	}
+	assert(ret == Error::success);
+
+	managarm::posix::SvrResponse resp;
+	resp.set_error(managarm::posix::Errors::SUCCESS);
+	co_await sendResponse(ctx, resp);
+}
+
+async::result<void> handleEpollDelete(RequestContext &ctx) {
+	auto &req = ctx.req;
+	if(logRequests)
+		std::cout << "posix: EPOLL_DELETE" << std::endl;
+
+	auto epfile = ctx.self->fileContext()->getFile(req.fd());
+	auto file = ctx.self->fileContext()->getFile(req.newfd());
+	if(!epfile || !file) {
+		std::cout << "posix: Illegal FD for EPOLL_DELETE" << std::endl;
+		co_await sendErrorResponse(ctx, managarm::posix::Errors::BAD_FD);
+		co_return;
+	}
+
+	Error ret = epoll::deleteItem(epfile.get(), file.get(), req.newfd(), req.flags());
+	if(ret == Error::noSuchFile) {
+		co_await sendErrorResponse(ctx, managarm::posix::Errors::FILE_NOT_FOUND);
+		co_return;
+	}
+	assert(ret == Error::success);
+
+	managarm::posix::SvrResponse resp;
+	resp.set_error(managarm::posix::Errors::SUCCESS);
+	co_await sendResponse(ctx, resp);
+}
+
+async::result<void> handleEpollWait(RequestContext &ctx) {
+	auto &req = ctx.req;
+	if(logRequests)
+		std::cout << "posix: EPOLL_WAIT request" << std::endl;
+
+	uint64_t former = ctx.self->signalMask();
+
+	auto epfile = ctx.self->fileContext()->getFile(req.fd());
+	if(!epfile) {
+		co_await sendErrorResponse(ctx, managarm::posix::Errors::BAD_FD);
+		co_return;
+	}
+	if(req.sigmask_needed()) {
+		ctx.self->setSignalMask(req.sigmask());
+	}
+
+	struct epoll_event events[16];
+	size_t k;
+	if(req.timeout() < 0) {
+		k = co_await epoll::wait(epfile.get(), events,
+				std::min(req.size(), uint32_t(16)));
+	}else if(!req.timeout()) {
+		// Do not bother to set up a timer for zero timeouts.
+		async::cancellation_event cancel_wait;
+		cancel_wait.cancel();
+		k = co_await epoll::wait(epfile.get(), events,
+				std::min(req.size(), uint32_t(16)), cancel_wait);
+	}else{
+		assert(req.timeout() > 0);
+		async::cancellation_event cancel_wait;
+		helix::TimeoutCancellation timer{static_cast<uint64_t>(req.timeout()), cancel_wait};
+		k = co_await epoll::wait(epfile.get(), events, 16, cancel_wait);
+		co_await timer.retire();
+	}
+	if(req.sigmask_needed()) {
+		ctx.self->setSignalMask(former);
+	}
+
+	managarm::posix::SvrResponse resp;
+	resp.set_error(managarm::posix::Errors::SUCCESS);
+
+	auto ser = resp.SerializeAsString();
+	auto [send_resp, send_data] = co_await helix_ng::exchangeMsgs(
+			ctx.conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::sendBuffer(events, k * sizeof(struct epoll_event))
+		);
+	HEL_CHECK(send_resp.error());
+	HEL_CHECK(send_data.error());
+}
+
+async::result<void> handleTimerfdCreate(RequestContext &ctx) {
+	auto &req = ctx.req;
+	if(logRequests)
+		std::cout << "posix: TIMERFD_CREATE" << std::endl;
+
+	assert(!(req.flags() & ~(TFD_CLOEXEC | TFD_NONBLOCK)));
+
+	auto file = timerfd::createFile(req.flags() & TFD_NONBLOCK);
+	auto fd = ctx.self->fileContext()->attachFile(file, req.flags() & TFD_CLOEXEC);
+
+	managarm::posix::SvrResponse resp;
+	resp.set_error(managarm::posix::Errors::SUCCESS);
+	resp.set_fd(fd);
+	co_await sendResponse(ctx, resp);
+}
+
+async::result<void> handleTimerfdSettime(RequestContext &ctx) {
+	auto &req = ctx.req;
+	if(logRequests)
+		std::cout << "posix: TIMERFD_SETTIME" << std::endl;
+
+	auto file = ctx.self->fileContext()->getFile(req.fd());
+	assert(file && "Illegal FD for TIMERFD_SETTIME");
+	timerfd::setTime(file.get(),
+			{static_cast<time_t>(req.time_secs()), static_cast<long>(req.time_nanos())},
+			{static_cast<time_t>(req.interval_secs()), static_cast<long>(req.interval_nanos())});
+
+	managarm::posix::SvrResponse resp;
+	resp.set_error(managarm::posix::Errors::SUCCESS);
+	co_await sendResponse(ctx, resp);
+}
+
+async::result<void> handleSignalfdCreate(RequestContext &ctx) {
+	auto &req = ctx.req;
+	if(logRequests)
+		std::cout << "posix: SIGNALFD_CREATE" << std::endl;
+
+	if(req.flags() & ~(managarm::posix::OpenFlags::OF_CLOEXEC
+			| managarm::posix::OpenFlags::OF_NONBLOCK)) {
+		co_await sendErrorResponse(ctx, managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+		co_return;
+	}
+
+	auto file = createSignalFile(req.sigset(),
+			req.flags() & managarm::posix::OpenFlags::OF_NONBLOCK);
+	auto fd = ctx.self->fileContext()->attachFile(file,
+			req.flags() & managarm::posix::OpenFlags::OF_CLOEXEC);
+
+	managarm::posix::SvrResponse resp;
+	resp.set_error(managarm::posix::Errors::SUCCESS);
+	resp.set_fd(fd);
+	co_await sendResponse(ctx, resp);
+}
+
+// ----------------------------------------------------------------------------
+// Dispatch table.
+// ----------------------------------------------------------------------------
+
+void registerCntHandler(uint32_t type, const char *name, Handler handler) {
+	assert(type < numCntReqTypes);
+	assert(!cntHandlers[type]);
+	cntHandlers[type] = handler;
+	requestStats[type].name = name;
+}
+
+struct TableInitializer {
+	TableInitializer() {
+		registerCntHandler(managarm::posix::CntReqType::EPOLL_CREATE,
+				"EPOLL_CREATE", &handleEpollCreate);
+		registerCntHandler(managarm::posix::CntReqType::EPOLL_ADD,
+				"EPOLL_ADD", &handleEpollAdd);
+		registerCntHandler(managarm::posix::CntReqType::EPOLL_MODIFY,
+				"EPOLL_MODIFY", &handleEpollModify);
+		registerCntHandler(managarm::posix::CntReqType::EPOLL_DELETE,
+				"EPOLL_DELETE", &handleEpollDelete);
+		registerCntHandler(managarm::posix::CntReqType::EPOLL_WAIT,
+				"EPOLL_WAIT", &handleEpollWait);
+		registerCntHandler(managarm::posix::CntReqType::TIMERFD_CREATE,
+				"TIMERFD_CREATE", &handleTimerfdCreate);
+		registerCntHandler(managarm::posix::CntReqType::TIMERFD_SETTIME,
+				"TIMERFD_SETTIME", &handleTimerfdSettime);
+		registerCntHandler(managarm::posix::CntReqType::SIGNALFD_CREATE,
+				"SIGNALFD_CREATE", &handleSignalfdCreate);
+	}
+} tableInitializer;
+
+int latencyBucket(uint64_t nanos) {
+	int b = 0;
+	while(nanos > 1 && b < numLatencyBuckets - 1) {
+		nanos >>= 1;
+		b++;
+	}
+	return b;
+}
+
+async::detached emitRequestEvent(size_t key, uint64_t nanos) {
+	protocols::ostrace::Event oste{&ostContext, ostRequestEvent};
+	oste.withCounter(ostKeyItem, static_cast<int64_t>(key));
+	oste.withCounter(ostTimeItem, static_cast<int64_t>(nanos));
+	co_await oste.emit();
+}
+
+} // anonymous namespace
+
+RequestTimer::RequestTimer(Process *process, uint32_t messageId)
+: _process{process}, _key{numKeys} {
+	if(messageId < numKeys - numCntReqTypes)
+		_key = numCntReqTypes + messageId;
+	HEL_CHECK(helGetClock(&_start));
+}
+
+RequestTimer::~RequestTimer() {
+	if(_key >= numKeys)
+		return;
+
+	uint64_t end;
+	HEL_CHECK(helGetClock(&end));
+	auto nanos = end - _start;
+
+	auto &stats = requestStats[_key];
+	stats.count.fetch_add(1, std::memory_order_relaxed);
+	stats.nanos.fetch_add(nanos, std::memory_order_relaxed);
+	stats.latencies[latencyBucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+	_process->requestStats().record(_key, nanos);
+
+	if(tracingReady.load(std::memory_order_acquire) && ostContext.isActive())
+		emitRequestEvent(_key, nanos);
+
+	if(logRequestStats && !(numDispatched.fetch_add(1, std::memory_order_relaxed) % 65536))
+		dumpRequestStats();
+}
+
+void RequestTimer::setCntType(uint32_t type) {
+	_key = type < numCntReqTypes ? type : numKeys;
+}
+
+async::result<void> setupTracing() {
+	ostContext = co_await protocols::ostrace::createContext();
+	ostRequestEvent = co_await ostContext.announceEvent("posix.request");
+	ostKeyItem = co_await ostContext.announceItem("requestKey");
+	ostTimeItem = co_await ostContext.announceItem("time");
+	tracingReady.store(true, std::memory_order_release);
+}
+
+std::string requestName(size_t key) {
+	assert(key < numKeys);
+	if(requestStats[key].name)
+		return requestStats[key].name;
+	if(key < numCntReqTypes)
+		return "cnt:" + std::to_string(key);
+	return "msg:" + std::to_string(key - numCntReqTypes);
+}
+
+async::result<bool> dispatchCntRequest(RequestContext ctx) {
+	auto type = ctx.req.request_type();
+	if(type >= numCntReqTypes || !cntHandlers[type])
+		co_return false;
+
+	// The caller's RequestTimer accounts the time of the handler.
+	co_await cntHandlers[type](ctx);
+	co_return true;
+}
+
+std::string formatRequestStats() {
+	// Each line contains the name, the number of requests, their total time (in ns)
+	// and one count per power-of-two latency bucket (starting at < 2 ns).
+	std::stringstream stream;
+	for(size_t i = 0; i < numKeys; i++) {
+		auto &stats = requestStats[i];
+		auto count = stats.count.load(std::memory_order_relaxed);
+		if(!count)
+			continue;
+		stream << requestName(i) << " " << count
+				<< " " << stats.nanos.load(std::memory_order_relaxed);
+		for(int b = 0; b < numLatencyBuckets; b++)
+			stream << " " << stats.latencies[b].load(std::memory_order_relaxed);
+		stream << "\n";
+	}
+	return stream.str();
+}
+
+void dumpRequestStats() {
+	std::cout << "posix: Request statistics:\n" << formatRequestStats() << std::flush;
+}
+
+} // namespace requests
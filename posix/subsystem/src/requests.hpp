@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+
+#include <async/result.hpp>
+#include <helix/ipc.hpp>
+#include <posix.bragi.hpp>
+
+#include "process.hpp"
+
+namespace requests {
+
+struct RequestContext {
+	std::shared_ptr<Process> self;
+	helix::UniqueDescriptor &conversation;
+	managarm::posix::CntRequest &req;
+};
+
+// Serves a CntRequest through the dispatch table.
+// Returns false if there is no handler for the request type;
+// in that case, the caller is responsible for serving the request.
+async::result<bool> dispatchCntRequest(RequestContext ctx);
+
+// Measures the time that the server spends on a request. On destruction, the request
+// is accounted to the global statistics, to the process' statistics and to ostrace.
+struct RequestTimer {
+	RequestTimer(Process *process, uint32_t messageId);
+
+	RequestTimer(const RequestTimer &) = delete;
+
+	~RequestTimer();
+
+	RequestTimer &operator= (const RequestTimer &) = delete;
+
+	// Legacy CntRequests are accounted by their request type instead of their message ID.
+	void setCntType(uint32_t type);
+
+private:
+	Process *_process;
+	size_t _key;
+	uint64_t _start;
+};
+
+// Connects to ostrace. Until this completes, no trace events are emitted.
+async::result<void> setupTracing();
+
+// Returns a human-readable name of a key of ProcessRequestStats.
+std::string requestName(size_t key);
+
+// Formats the number of requests, their total time and a latency histogram for each
+// request type (one line per type). Used by /proc/managarm/syscall_stats.
+std::string formatRequestStats();
+
+// Prints formatRequestStats() to the log.
+void dumpRequestStats();
+
+} // namespace requests
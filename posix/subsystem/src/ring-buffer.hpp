@@ -0,0 +1,55 @@
+#pragma once
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+
+// Fixed-capacity byte queue (used by pipes and terminals). The storage is only
+// allocated once data is written, since many instances never carry any data.
+struct RingBuffer {
+	explicit RingBuffer(size_t capacity)
+	: _capacity{capacity} { }
+
+	size_t capacity() {
+		return _capacity;
+	}
+
+	size_t size() {
+		return _size;
+	}
+
+	size_t space() {
+		return _capacity - _size;
+	}
+
+	void write(const void *data, size_t length) {
+		assert(length <= space());
+		if(!_storage)
+			_storage = std::make_unique<char[]>(_capacity);
+
+		auto tail = (_head + _size) % _capacity;
+		auto chunk = std::min(length, _capacity - tail);
+		memcpy(_storage.get() + tail, data, chunk);
+		memcpy(_storage.get(), static_cast<const char *>(data) + chunk, length - chunk);
+		_size += length;
+	}
+
+	size_t read(void *data, size_t maxLength) {
+		auto length = std::min(maxLength, _size);
+		auto chunk = std::min(length, _capacity - _head);
+		memcpy(data, _storage.get() + _head, chunk);
+		memcpy(static_cast<char *>(data) + chunk, _storage.get(), length - chunk);
+		_head = (_head + length) % _capacity;
+		_size -= length;
+		if(!_size)
+			_head = 0;
+		return length;
+	}
+
+private:
+	size_t _capacity;
+	std::unique_ptr<char[]> _storage;
+	size_t _head = 0;
+	size_t _size = 0;
+};
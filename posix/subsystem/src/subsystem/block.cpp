@@ -1,6 +1,7 @@
 
 #include <string.h>
 #include <iostream>
+#include <sstream>
 
 #include <protocols/mbus/client.hpp>
 
@@ -10,6 +11,7 @@
 #include "../vfs.hpp"
 #include "../drvcore.hpp"
 #include "pci.hpp"
+#include "fs.bragi.hpp"
 
 namespace block_subsystem {
 
@@ -28,6 +30,23 @@ struct Subsystem {
 	}
 } subsystem;
 
+struct StatAttribute : sysfs::Attribute {
+	StatAttribute(std::string name)
+	: sysfs::Attribute{std::move(name), false} { }
+
+	async::result<std::string> show(sysfs::Object *object) override;
+};
+
+struct LatencyHistogramAttribute : sysfs::Attribute {
+	LatencyHistogramAttribute(std::string name)
+	: sysfs::Attribute{std::move(name), false} { }
+
+	async::result<std::string> show(sysfs::Object *object) override;
+};
+
+StatAttribute statAttr{"stat"};
+LatencyHistogramAttribute latencyHistogramAttr{"latency_histogram"};
+
 struct Device final : UnixDevice, drvcore::BlockDevice {
 	Device(VfsType type, std::string name, helix::UniqueLane lane,
 			std::shared_ptr<drvcore::Device> parent)
@@ -54,11 +73,60 @@ struct Device final : UnixDevice, drvcore::BlockDevice {
 		ue.set("SUBSYSTEM", "block");
 	}
 
+	async::result<managarm::fs::SvrResponse> getStats() {
+		managarm::fs::CntRequest req;
+		req.set_req_type(managarm::fs::CntReqType::DEV_GET_STATS);
+
+		auto ser = req.SerializeAsString();
+		auto [offer, send_req, recv_resp] = co_await helix_ng::exchangeMsgs(_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvInline())
+		);
+		HEL_CHECK(offer.error());
+		HEL_CHECK(send_req.error());
+		HEL_CHECK(recv_resp.error());
+
+		managarm::fs::SvrResponse resp;
+		resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+		assert(resp.error() == managarm::fs::Errors::SUCCESS);
+		co_return resp;
+	}
+
 private:
 	std::string _name;
 	helix::UniqueLane _lane;
 };
 
+async::result<std::string> StatAttribute::show(sysfs::Object *object) {
+	auto device = static_cast<Device *>(object);
+	auto resp = co_await device->getStats();
+
+	// Linux pads each field to a width of 8.
+	std::stringstream ss;
+	for(auto field : resp.block_stats()) {
+		ss.width(8);
+		ss << field << ' ';
+	}
+	auto str = ss.str();
+	if(!str.empty())
+		str.back() = '\n';
+	co_return str;
+}
+
+// There is no Linux equivalent; each line contains the upper bound (in ns)
+// of a bucket of the histogram and the number of requests in the bucket.
+async::result<std::string> LatencyHistogramAttribute::show(sysfs::Object *object) {
+	auto device = static_cast<Device *>(object);
+	auto resp = co_await device->getStats();
+
+	auto &histogram = resp.latency_histogram();
+	std::stringstream ss;
+	for(size_t i = 0; i + 1 < histogram.size(); i += 2)
+		ss << histogram[i] << ' ' << histogram[i + 1] << '\n';
+	co_return ss.str();
+}
+
 } // anonymous namepsace
 
 async::detached run() {
@@ -113,6 +181,9 @@ async::detached run() {
 		device->assignId({8, minorAllocator.allocate()});
 		blockRegistry.install(device);
 		drvcore::installDevice(device);
+		// TODO: Call realizeAttribute *before* installing the device.
+		device->realizeAttribute(&statAttr);
+		device->realizeAttribute(&latencyHistogramAttr);
 	});
 
 	co_await root.linkObserver(std::move(filter), std::move(handler));
@@ -88,7 +88,6 @@ public:
 	OpenFile(bool non_block)
 	: File{StructName::get("timerfd")}, _nonBlock{non_block},
 			_activeTimer{nullptr}, _expirations{0}, _theSeq{0} {
-		(void)_nonBlock;
 	}
 
 	~OpenFile() {
@@ -102,8 +101,14 @@ public:
 
 	async::result<frg::expected<Error, size_t>>
 	readSome(Process *, void *data, size_t max_length) override {
-		assert(max_length == sizeof(uint64_t));
-		assert(_expirations);
+		if(max_length < sizeof(uint64_t))
+			co_return Error::illegalArguments;
+
+		while(!_expirations) {
+			if(_nonBlock)
+				co_return Error::wouldBlock;
+			co_await _seqBell.async_wait();
+		}
 
 		memcpy(data, &_expirations, sizeof(uint64_t));
 		_expirations = 0;
@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <unistd.h>
-#include <set>
+#include <list>
+#include <unordered_map>
 
 #include <helix/memory.hpp>
 #include <protocols/fs/client.hpp>
@@ -217,19 +218,41 @@ private:
 	std::shared_ptr<FsNode> _target;
 };
 
-struct LinkCompare {
-	struct is_transparent { };
+// The links of a directory. Lookups go through a hash table while iteration
+// (for readdir()) uses a list, as list iterators stay valid on insertion.
+struct DirectoryEntries {
+	using iterator = std::list<std::shared_ptr<Link>>::iterator;
 
-	bool operator() (const std::shared_ptr<Link> &link, const std::string &name) const {
-		return link->getName() < name;
+	iterator begin() {
+		return _list.begin();
 	}
-bool operator() (const std::string &name, const std::shared_ptr<Link> &link) const {
-	return name < link->getName();
-}
 
-bool operator() (const std::shared_ptr<Link> &a, const std::shared_ptr<Link> &b) const {
-	return a->getName() < b->getName();
-}
+	iterator end() {
+		return _list.end();
+	}
+
+	iterator find(const std::string &name) {
+		auto it = _index.find(name);
+		if(it == _index.end())
+			return _list.end();
+		return it->second;
+	}
+
+	void insert(std::shared_ptr<Link> link) {
+		auto name = link->getName();
+		assert(_index.find(name) == _index.end());
+		_list.push_back(std::move(link));
+		_index.insert({std::move(name), std::prev(_list.end())});
+	}
+
+	void erase(iterator it) {
+		_index.erase((*it)->getName());
+		_list.erase(it);
+	}
+
+private:
+	std::list<std::shared_ptr<Link>> _list;
+	std::unordered_map<std::string, iterator> _index;
 };
 
 struct DirectoryNode;
@@ -252,7 +275,7 @@ private:
 	helix::UniqueLane _passthrough;
 	async::cancellation_event _cancelServe;
 
-	std::set<std::shared_ptr<Link>, LinkCompare>::iterator _iter;
+	DirectoryEntries::iterator _iter;
 };
 
 struct DirectoryNode final : Node, std::enable_shared_from_this<DirectoryNode> {
@@ -336,7 +359,7 @@ public:
 private:
 	// TODO: This creates a circular reference -- fix this.
 	std::shared_ptr<Link> _treeLink;
-	std::set<std::shared_ptr<Link>, LinkCompare> _entries;
+	DirectoryEntries _entries;
 };
 
 // TODO: Remove this class in favor of MemoryNode.
@@ -376,7 +399,8 @@ public:
 	}
 
 	MemoryFile(std::shared_ptr<MountView> mount, std::shared_ptr<FsLink> link)
-	: File{StructName::get("tmpfs.regular"), std::move(mount), std::move(link)}, _offset{0} { }
+	: File{StructName::get("tmpfs.regular"), std::move(mount), std::move(link),
+			File::defaultMemoryCopy}, _offset{0} { }
 
 	void handleClose() override;
 
@@ -408,6 +432,9 @@ private:
 struct MemoryNode final : Node {
 	friend struct MemoryFile;
 
+	// Upper bound on the slack that geometric growth adds to a file's memory.
+	static constexpr size_t maxAreaGrowth = size_t(64) << 20;
+
 	MemoryNode(Superblock *superblock);
 
 	VfsType getType() override {
@@ -444,22 +471,32 @@ struct MemoryNode final : Node {
 
 private:
 	void _resizeFile(size_t new_size) {
+		// Data beyond EOF must read as zeros if the file grows again.
+		if(new_size < _fileSize)
+			memset(reinterpret_cast<char *>(_mapping.get()) + new_size, 0, _fileSize - new_size);
 		_fileSize = new_size;
 
 		size_t aligned_size = (new_size + 0xFFF) & ~size_t(0xFFF);
 		if(aligned_size <= _areaSize)
 			return;
 
+		// Grow geometrically such that appending to a file does not
+		// resize (and remap) the memory on every write.
+		size_t area_size = std::max(aligned_size,
+				std::min(2 * _areaSize, _areaSize + maxAreaGrowth));
+
+		// The memory is allocated on demand, such that holes in sparse files
+		// (and the slack due to geometric growth) are not backed by physical pages.
 		if(_memory) {
-			HEL_CHECK(helResizeMemory(_memory.getHandle(), aligned_size));
+			HEL_CHECK(helResizeMemory(_memory.getHandle(), area_size));
 		}else{
 			HelHandle handle;
-			HEL_CHECK(helAllocateMemory(aligned_size, 0, nullptr, &handle));
+			HEL_CHECK(helAllocateMemory(area_size, kHelAllocOnDemand, nullptr, &handle));
 			_memory = helix::UniqueDescriptor{handle};
 		}
 
-		_mapping = helix::Mapping{_memory, 0, aligned_size};
-		_areaSize = aligned_size;
+		_mapping = helix::Mapping{_memory, 0, area_size};
+		_areaSize = area_size;
 	}
 
 	helix::UniqueDescriptor _memory;
@@ -491,7 +528,7 @@ struct Superblock final : FsSuperblock {
 
 		// Unlink an existing link if such a link exists.
 		if(auto dest_it = dest_dir->_entries.find(dest_name);
-				dest_it != dest_dir->_entries.end())
+				dest_it != dest_dir->_entries.end() && dest_it != it)
 			dest_dir->_entries.erase(dest_it);
 
 		auto new_link = std::make_shared<Link>(dest_dir->shared_from_this(),
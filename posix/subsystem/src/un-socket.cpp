@@ -18,6 +18,10 @@ namespace un_socket {
 
 static constexpr bool logSockets = false;
 
+// Limits for the per-socket pool of packet buffers.
+static constexpr size_t bufferPoolSize = 8;
+static constexpr size_t maxPooledBufferSize = 64 * 1024;
+
 struct OpenFile;
 
 // This map associates bound sockets with FS nodes.
@@ -125,6 +129,7 @@ public:
 		auto size = packet->buffer.size();
 		assert(max_length >= size);
 		memcpy(data, packet->buffer.data(), size);
+		recycleBuffer_(std::move(packet->buffer));
 		_recvQueue.pop_front();
 		co_return size;
 	}
@@ -139,7 +144,7 @@ public:
 
 		Packet packet;
 		packet.senderPid = process->pid();
-		packet.buffer.resize(length);
+		packet.buffer = _remote->allocateBuffer_(length);
 		memcpy(packet.buffer.data(), data, length);
 		packet.offset = 0;
 
@@ -202,8 +207,10 @@ public:
 		memcpy(data, packet->buffer.data() + packet->offset, chunk);
 		packet->offset += chunk;
 
-		if(packet->offset == packet->buffer.size())
+		if(packet->offset == packet->buffer.size()) {
+			recycleBuffer_(std::move(packet->buffer));
 			_recvQueue.pop_front();
+		}
 		co_return protocols::fs::RecvResult { protocols::fs::RecvData { chunk, 0, ctrl.buffer() } };
 	}
 
@@ -225,7 +232,7 @@ public:
 
 		Packet packet;
 		packet.senderPid = process->pid();
-		packet.buffer.resize(max_length);
+		packet.buffer = _remote->allocateBuffer_(max_length);
 		memcpy(packet.buffer.data(), data, max_length);
 		packet.files = std::move(files);
 		packet.offset = 0;
@@ -511,6 +518,25 @@ private:
 		return outSize;
 	}
 
+	// Returns a buffer for a packet that is queued on this socket.
+	// Buffers of consumed packets are re-used to avoid an allocation per message.
+	std::vector<char> allocateBuffer_(size_t size) {
+		std::vector<char> buffer;
+		if(!_bufferPool.empty()) {
+			buffer = std::move(_bufferPool.back());
+			_bufferPool.pop_back();
+		}
+		buffer.resize(size);
+		return buffer;
+	}
+
+	void recycleBuffer_(std::vector<char> buffer) {
+		if(_bufferPool.size() >= bufferPoolSize || buffer.capacity() > maxPooledBufferSize)
+			return;
+		buffer.clear();
+		_bufferPool.push_back(std::move(buffer));
+	}
+
 public:
 	async::result<frg::expected<protocols::fs::Error, size_t>>
 	peername(void *addrPtr, size_t maxAddrLength) override {
@@ -542,6 +568,8 @@ private:
 
 	// The actual receive queue of the socket.
 	std::deque<Packet> _recvQueue;
+	// Buffers of consumed packets; see allocateBuffer_().
+	std::vector<std::vector<char>> _bufferPool;
 
 	int _ownerPid;
 
@@ -4,6 +4,10 @@
 #include <unistd.h>
 #include <experimental/coroutine>
 #include <future>
+#include <list>
+#include <unordered_map>
+
+#include <protocols/fs/defs.hpp>
 
 #include "common.hpp"
 #include "fs.bragi.hpp"
@@ -16,6 +20,96 @@ HelHandle __mlibc_getPassthrough(int fd);
 
 static bool debugResolve = false;
 
+// --------------------------------------------------------
+// Link cache.
+// --------------------------------------------------------
+
+namespace {
+
+constexpr size_t linkCacheSize = 4096;
+
+struct LinkCacheKey {
+	FsNode *directory;
+	std::string name;
+
+	bool operator== (const LinkCacheKey &) const = default;
+};
+
+struct LinkCacheKeyHash {
+	size_t operator() (const LinkCacheKey &key) const {
+		return std::hash<FsNode *>{}(key.directory) ^ std::hash<std::string>{}(key.name);
+	}
+};
+
+struct LinkCacheEntry {
+	LinkCacheKey key;
+	// Used to detect that the directory was destructed (and its address reused).
+	std::weak_ptr<FsNode> directory;
+	std::shared_ptr<FsLink> link;
+};
+
+// Most recently used entries are at the front.
+std::list<LinkCacheEntry> linkCacheLru;
+std::unordered_map<LinkCacheKey, std::list<LinkCacheEntry>::iterator,
+		LinkCacheKeyHash> linkCacheMap;
+uint64_t linkCacheSeq = 0;
+
+} // anonymous namespace
+
+bool lookupCachedLink(FsNode *directory, const std::string &name, std::shared_ptr<FsLink> &link) {
+	auto it = linkCacheMap.find(LinkCacheKey{directory, name});
+	if(it == linkCacheMap.end())
+		return false;
+
+	auto entry = it->second;
+	if(entry->directory.lock().get() != directory) {
+		linkCacheMap.erase(it);
+		linkCacheLru.erase(entry);
+		return false;
+	}
+
+	linkCacheLru.splice(linkCacheLru.begin(), linkCacheLru, entry);
+	link = entry->link;
+	return true;
+}
+
+uint64_t linkCacheSequence() {
+	return linkCacheSeq;
+}
+
+void cacheLink(uint64_t sequence, std::shared_ptr<FsNode> directory,
+		std::string name, std::shared_ptr<FsLink> link) {
+	if(sequence != linkCacheSeq)
+		return;
+
+	LinkCacheKey key{directory.get(), std::move(name)};
+	if(auto it = linkCacheMap.find(key); it != linkCacheMap.end()) {
+		auto entry = it->second;
+		entry->directory = directory;
+		entry->link = std::move(link);
+		linkCacheLru.splice(linkCacheLru.begin(), linkCacheLru, entry);
+		return;
+	}
+
+	if(linkCacheMap.size() >= linkCacheSize) {
+		linkCacheMap.erase(linkCacheLru.back().key);
+		linkCacheLru.pop_back();
+	}
+
+	linkCacheLru.push_front(LinkCacheEntry{key, directory, std::move(link)});
+	linkCacheMap.insert({std::move(key), linkCacheLru.begin()});
+}
+
+void invalidateCachedLink(FsNode *directory, const std::string &name) {
+	linkCacheSeq++;
+
+	auto it = linkCacheMap.find(LinkCacheKey{directory, name});
+	if(it == linkCacheMap.end())
+		return;
+	linkCacheLru.erase(it->second);
+	linkCacheMap.erase(it);
+}
+
 // --------------------------------------------------------
 // MountView implementation.
 // --------------------------------------------------------
@@ -91,16 +185,19 @@ async::result<void> populateRootView() {
 		assert(dir_fd != -1);
 
 		auto lane = helix::BorrowedLane{__mlibc_getPassthrough(dir_fd)};
+		std::vector<char> buffer(16 * 1024);
 		while(true) {
 			managarm::fs::CntRequest req;
-			req.set_req_type(managarm::fs::CntReqType::PT_READ_ENTRIES);
+			req.set_req_type(managarm::fs::CntReqType::PT_READ_ENTRIES_BATCH);
+			req.set_size(buffer.size());
 
 			auto ser = req.SerializeAsString();
-			auto [offer, send_req, recv_resp] = co_await helix_ng::exchangeMsgs(
+			auto [offer, send_req, recv_resp, recv_data] = co_await helix_ng::exchangeMsgs(
 				lane,
 				helix_ng::offer(
 					helix_ng::sendBuffer(ser.data(), ser.size()),
-					helix_ng::recvInline()
+					helix_ng::recvInline(),
+					helix_ng::recvBuffer(buffer.data(), buffer.size())
 				)
 			);
 			HEL_CHECK(offer.error());
@@ -112,21 +209,31 @@ async::result<void> populateRootView() {
 			if(resp.error() == managarm::fs::Errors::END_OF_FILE)
 				break;
 			assert(resp.error() == managarm::fs::Errors::SUCCESS);
+			HEL_CHECK(recv_data.error());
+
+			size_t offset = 0;
+			while(offset < recv_data.actualLength()) {
+				protocols::fs::DirentRecord record;
+				memcpy(&record, buffer.data() + offset, sizeof(protocols::fs::DirentRecord));
+				std::string name{buffer.data() + offset + sizeof(protocols::fs::DirentRecord),
+						record.nameLength};
+				offset += record.recordLength;
+
+				//std::cout << "posix: Importing " << item.second + "/" + name << std::endl;
+
+				if(record.type == protocols::fs::kDirentDirectory) {
+					// TODO: Check for errors from mkdir().
+					auto link = std::get<std::shared_ptr<FsLink>>(
+							co_await item.first->mkdir(name));
+					stack.push_back({link->getTarget(), item.second + "/" + name});
+				}else{
+					assert(record.type == protocols::fs::kDirentRegular);
 
-			//std::cout << "posix: Importing " << item.second + "/" + resp.path() << std::endl;
-
-			if(resp.file_type() == managarm::fs::FileType::DIRECTORY) {
-				// TODO: Check for errors from mkdir().
-				auto link = std::get<std::shared_ptr<FsLink>>(
-						co_await item.first->mkdir(resp.path()));
-				stack.push_back({link->getTarget(), item.second + "/" + resp.path()});
-			}else{
-				assert(resp.file_type() == managarm::fs::FileType::REGULAR);
-
-				auto file_path = "/" + item.second + "/" + resp.path();
-				auto node = tmp_fs::createMemoryNode(std::move(file_path));
-				auto result = co_await item.first->link(resp.path(), node);
-				assert(result);
+					auto file_path = "/" + item.second + "/" + name;
+					auto node = tmp_fs::createMemoryNode(std::move(file_path));
+					auto result = co_await item.first->link(name, node);
+					assert(result);
+				}
 			}
 		}
 	}
@@ -104,6 +104,29 @@ private:
 	ViewPath _currentPath;
 };
 
+// --------------------------------------------------------
+// Link cache.
+// --------------------------------------------------------
+
+// Caches the results of FsNode::getLink() for file systems where lookups are expensive
+// (i.e., extern_fs). The cache is keyed by directory node and name and is shared by
+// all processes and mount views; mount points are still resolved by PathResolver.
+// Negative entries (nullptr links) record names that do not exist.
+// File systems that use the cache must call invalidateCachedLink() when they modify a directory.
+
+// Returns true on a hit. On hits, link is set to the cached link (or to nullptr).
+bool lookupCachedLink(FsNode *directory, const std::string &name, std::shared_ptr<FsLink> &link);
+
+// Returns a sequence number that must be passed to cacheLink().
+uint64_t linkCacheSequence();
+
+// Inserts an entry unless an invalidation happened since sequence was obtained.
+// This prevents lookups that race with modifications from inserting stale entries.
+void cacheLink(uint64_t sequence, std::shared_ptr<FsNode> directory,
+		std::string name, std::shared_ptr<FsLink> link);
+
+void invalidateCachedLink(FsNode *directory, const std::string &name);
+
 async::result<void> populateRootView();
 
 ViewPath rootPath();
@@ -3,7 +3,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <span>
 #include <unordered_map>
+#include <vector>
 
 #include <async/result.hpp>
 #include <async/cancellation.hpp>
@@ -17,6 +19,26 @@
 namespace protocols {
 namespace fs {
 
+// Segment of PT_PREADV / PT_PWRITEV. pwritev() does not modify the buffer.
+struct IoSegment {
+	int64_t offset;
+	void *buffer;
+	size_t length;
+};
+
+// Message of PT_RECVMMSG / PT_SENDMMSG. sendMmsg() does not modify the buffers.
+struct MessageSegment {
+	void *buffer;
+	size_t length;
+	void *address;
+	size_t addressLength;
+};
+
+struct ReceivedMessage {
+	size_t length;
+	size_t addressLength;
+};
+
 namespace _detail {
 
 struct File {
@@ -27,10 +49,34 @@ struct File {
 	}
 
 	async::result<void> seekAbsolute(int64_t offset);
+	// Return the new file position.
+	async::result<int64_t> seekRelative(int64_t offset);
+	async::result<int64_t> seekEof(int64_t offset);
+
+	// Advances the file position without transferring data (see PT_ADVANCE).
+	// Returns the previous position and the number of bytes that the caller may
+	// read from (or write to) the memory returned by accessMemory().
+	async::result<frg::expected<Error, std::pair<int64_t, size_t>>>
+	advance(size_t length, bool write);
 
 	async::result<size_t> readSome(void *data, size_t max_length);
 	async::result<size_t> writeSome(const void *data, size_t max_length);
 
+	// Reads or writes all segments in a single request. The server processes the
+	// segments concurrently. Returns the number of bytes transferred per segment.
+	async::result<frg::expected<Error, std::vector<size_t>>>
+	preadv(std::span<const IoSegment> segments);
+	async::result<frg::expected<Error, std::vector<size_t>>>
+	pwritev(std::span<const IoSegment> segments);
+
+	// Receives (sends) up to messages.size() messages in a single request.
+	// Returns the results of the messages that were transferred; the request
+	// only fails if no message could be transferred.
+	async::result<frg::expected<Error, std::vector<ReceivedMessage>>>
+	recvMmsg(std::span<const MessageSegment> messages, uint32_t flags);
+	async::result<frg::expected<Error, std::vector<size_t>>>
+	sendMmsg(std::span<const MessageSegment> messages, uint32_t flags);
+
 	async::result<frg::expected<Error, PollWaitResult>>
 	pollWait(uint64_t sequence, int mask, async::cancellation_token cancellation = {});
 
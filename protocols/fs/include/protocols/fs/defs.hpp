@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 namespace protocols::fs {
 
@@ -11,4 +13,81 @@ struct StatusPage {
 	int status;
 };
 
+// Flags of PT_READ_ENTRIES_BATCH.
+enum : uint32_t {
+	// Ask the server to append DirentStats to each record.
+	// Servers that cannot provide stats ignore this flag.
+	kReadEntriesWithStats = 1,
+	// Continue at the cookie (i.e., the offset) of the request instead of the file position.
+	kReadEntriesResume = 2
+};
+
+// Values of DirentRecord::type (the same as the DT_* constants of getdents64()).
+enum : uint8_t {
+	kDirentUnknown = 0,
+	kDirentDirectory = 4,
+	kDirentRegular = 8,
+	kDirentSymlink = 10
+};
+
+// Record in the buffer of PT_READ_ENTRIES_BATCH. Records are 8-byte aligned.
+struct DirentRecord {
+	uint64_t inode;
+	// Size of the record including the name, the stats and padding.
+	uint16_t recordLength;
+	uint16_t nameLength;
+	uint8_t type;
+	// Non-zero if DirentStats follows the (8-byte aligned) name.
+	uint8_t hasStats;
+	uint16_t reserved;
+	// Followed by the name (not null-terminated).
+};
+static_assert(sizeof(DirentRecord) == 16);
+
+struct DirentStats {
+	uint64_t fileSize;
+	uint32_t mode;
+	uint32_t linkCount;
+	int64_t uid;
+	int64_t gid;
+	int64_t atimeSecs;
+	int64_t atimeNanos;
+	int64_t mtimeSecs;
+	int64_t mtimeNanos;
+	int64_t ctimeSecs;
+	int64_t ctimeNanos;
+};
+
+inline constexpr size_t direntRecordSize(size_t name_length, bool with_stats) {
+	auto size = (sizeof(DirentRecord) + name_length + 7) & ~size_t(7);
+	if(with_stats)
+		size += sizeof(DirentStats);
+	return size;
+}
+
+// Buffers of PT_READ_ENTRIES_BATCH need to be able to hold at least one record of this size.
+inline constexpr size_t maxDirentRecordSize = direntRecordSize(255, true);
+
+// Appends a record to the buffer. Returns the size of the record or zero if it does not fit.
+inline size_t appendDirentRecord(void *buffer, size_t space, uint64_t inode, uint8_t type,
+		const char *name, size_t name_length, const DirentStats *stats) {
+	auto size = direntRecordSize(name_length, stats);
+	if(size > space)
+		return 0;
+
+	auto p = static_cast<char *>(buffer);
+	memset(p, 0, size);
+	DirentRecord record{};
+	record.inode = inode;
+	record.recordLength = size;
+	record.nameLength = name_length;
+	record.type = type;
+	record.hasStats = stats != nullptr;
+	memcpy(p, &record, sizeof(DirentRecord));
+	memcpy(p + sizeof(DirentRecord), name, name_length);
+	if(stats)
+		memcpy(p + size - sizeof(DirentStats), stats, sizeof(DirentStats));
+	return size;
+}
+
 } // namespace protocols::fs
@@ -1,38 +1,104 @@
 #pragma once
 
+#include <stdint.h>
+#include <list>
+#include <vector>
+
+#include <async/oneshot-event.hpp>
 #include <protocols/fs/server.hpp>
-#include <boost/intrusive/list.hpp>
-#include <async/recurring-event.hpp>
 
 namespace protocols::fs {
 
-	enum FLockState {
-		LOCKED_EXCLUSIVE = 0,
-		LOCKED_SHARED = 1
-	};
+	struct FileLockManager;
+
+	// Lock state of an open file description. Locks that were acquired through
+	// the description are released when it is destructed.
+	//
+	// Process-associated (fcntl()) locks should be released once the process closes
+	// *any* file descriptor of the inode; since servers do not see file descriptors,
+	// we only release them when the description that acquired them is closed.
+	struct FileLockHolder {
+		friend struct FileLockManager;
 
-	struct FlockManager;
+		FileLockHolder() = default;
 
-	typedef boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink> > auto_unlink_hook;
-	struct Flock : public boost::intrusive::list_base_hook<> {
-		friend struct FlockManager;
-		Flock(FLockState t, FlockManager* m) : manager(m), type(t) {}
-		Flock() : manager(nullptr), type(FLockState::LOCKED_EXCLUSIVE) {}
-		~Flock();
+		FileLockHolder(const FileLockHolder &) = delete;
 
-private:
-		FlockManager* manager = nullptr;
-		FLockState type;
+		FileLockHolder &operator= (const FileLockHolder &) = delete;
 
+		~FileLockHolder();
+
+	private:
+		// Manager of the inode that this description refers to (set on first use).
+		FileLockManager *manager = nullptr;
 	};
 
-	struct FlockManager {
-		friend struct Flock;
-		async::result<protocols::fs::Error> lock(Flock* newFlock, int flags);
-private:
-		boost::intrusive::list<Flock> flocks;
-		async::recurring_event flockNotify;
-		static bool validateFlockFlags(int flags);
+	// Advisory locks of a single inode. flock() locks and byte-range locks
+	// are tracked separately (and do not conflict with each other), like on Linux.
+	//
+	// Blocking requests are queued in FIFO order: a request only overtakes earlier
+	// waiters if it does not conflict with them. When locks are released, the manager
+	// grants all waiters that do not conflict anymore (instead of waking up all waiters
+	// and letting them retry).
+	struct FileLockManager {
+		friend struct FileLockHolder;
+
+		FileLockManager() = default;
+
+		FileLockManager(const FileLockManager &) = delete;
+
+		FileLockManager &operator= (const FileLockManager &) = delete;
+
+		// Implements flock(); flags are managarm::fs::FlockFlags.
+		async::result<protocols::fs::Error> flock(FileLockHolder *holder, int flags);
+
+		// Implements the F_GETLK, F_SETLK and F_SETLKW fcntl() commands (and their OFD
+		// variants). For get, returns the first conflicting lock (or a lock of type
+		// RangeLockType::unlock if there is none). Otherwise, returns the lock.
+		async::result<frg::expected<protocols::fs::Error, RangeLock>>
+		lockRange(FileLockHolder *holder, RangeLockCommand command, bool ofd, RangeLock lock);
+
+	private:
+		struct Entry {
+			// Description through which the lock was acquired.
+			FileLockHolder *holder;
+			// Owning process of process-associated locks; -1 for OFD and flock() locks.
+			int pid;
+			bool exclusive;
+			// Covers [start, end); end is UINT64_MAX for locks that extend to EOF.
+			uint64_t start;
+			uint64_t end;
+		};
+
+		struct Waiter {
+			Entry request;
+			async::oneshot_event granted;
+		};
+
+		struct Table {
+			std::vector<Entry> entries;
+			std::list<Waiter *> waiters;
+		};
+
+		static bool sameOwner(const Entry &a, const Entry &b);
+		static bool conflicts(const Entry &a, const Entry &b);
+		static const Entry *findConflict(const Table &table, const Entry &request);
+
+		// Replaces the caller's locks in the range of request.
+		// Unlocks the range if unlock is set.
+		static void apply(Table &table, const Entry &request, bool unlock);
+
+		// Grants all waiters that do not conflict with held locks (or earlier waiters).
+		static void grantWaiters(Table &table);
+
+		// Acquires the lock, waiting for conflicting locks to be released unless
+		// nonblock is set.
+		async::result<protocols::fs::Error> acquire(Table &table, Entry request, bool nonblock);
+
+		void release(FileLockHolder *holder);
+
+		Table flocks_;
+		Table ranges_;
 	};
 
 }
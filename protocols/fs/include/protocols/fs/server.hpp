@@ -41,6 +41,43 @@ struct FileStats {
 
 using SeekResult = std::variant<Error, int64_t>;
 
+enum class RangeLockCommand {
+	get,
+	set,
+	setWait
+};
+
+enum class RangeLockType {
+	read,
+	write,
+	unlock
+};
+
+// Byte-range lock of fcntl(). Clients resolve l_whence (and negative lengths),
+// i.e., start is always relative to the beginning of the file.
+struct RangeLock {
+	RangeLockType type;
+	uint64_t start;
+	// Zero for locks that extend to the end of the file (and beyond).
+	uint64_t length;
+	// Process that owns the lock; -1 for OFD locks.
+	int pid;
+};
+
+struct AdvanceResult {
+	// File position before the call.
+	int64_t offset;
+	// Number of bytes that the file position was advanced by.
+	size_t length;
+};
+
+struct ReadEntriesBatchResult {
+	// Number of bytes of DirentRecords that were written to the buffer.
+	size_t length;
+	// Position after the last returned entry; can be passed back with kReadEntriesResume.
+	int64_t cookie;
+};
+
 using GetLinkResult = std::tuple<std::shared_ptr<void>, int64_t, FileType>;
 
 using OpenResult = std::pair<helix::UniqueLane, helix::UniqueLane>;
@@ -80,6 +117,18 @@ struct FileOperations {
 		readEntries = f;
 		return *this;
 	}
+	constexpr FileOperations &withReadEntriesBatch(
+			async::result<frg::expected<Error, ReadEntriesBatchResult>> (*f)(void *object,
+			void *buffer, size_t size, bool with_stats)) {
+		readEntriesBatch = f;
+		return *this;
+	}
+	constexpr FileOperations &withAdvance(
+			async::result<frg::expected<Error, AdvanceResult>> (*f)(void *object,
+			size_t length, bool write)) {
+		advance = f;
+		return *this;
+	}
 	constexpr FileOperations &withAccessMemory(async::result<helix::BorrowedDescriptor>(*f)(void *object)) {
 		accessMemory = f;
 		return *this;
@@ -104,6 +153,17 @@ struct FileOperations {
 		flock = f;
 		return *this;
 	}
+	constexpr FileOperations &withLockRange(
+			async::result<frg::expected<Error, RangeLock>> (*f)(void *object,
+			RangeLockCommand command, bool ofd, RangeLock lock)) {
+		lockRange = f;
+		return *this;
+	}
+	constexpr FileOperations &withFsync(async::result<frg::expected<protocols::fs::Error>> (*f)(void *object,
+			bool data_only)) {
+		fsync = f;
+		return *this;
+	}
 	constexpr FileOperations &withGetOption(async::result<int> (*f)(void *object,
 			int option)) {
 		getOption = f;
@@ -149,13 +209,30 @@ struct FileOperations {
 			void *buffer, size_t length);
 	async::result<frg::expected<protocols::fs::Error, size_t>> (*write)(void *object, const char *credentials,
 			const void *buffer, size_t length);
+	// Like write() but at the given offset; does not change the file position.
+	async::result<frg::expected<protocols::fs::Error, size_t>> (*pwrite)(void *object, int64_t offset,
+			const char *credentials, const void *buffer, size_t length);
 	async::result<ReadEntriesResult> (*readEntries)(void *object);
+	// Fills buffer with DirentRecords, starting at the current position. If this is not
+	// provided, PT_READ_ENTRIES_BATCH falls back to readEntries() (without types and stats).
+	async::result<frg::expected<Error, ReadEntriesBatchResult>>
+	(*readEntriesBatch)(void *object, void *buffer, size_t size, bool with_stats);
+	// Advances the file position by up to length bytes without transferring data;
+	// the caller accesses the range through accessMemory(). Reads stop at the end of
+	// the file, writes extend the file to cover the whole range.
+	async::result<frg::expected<Error, AdvanceResult>>
+	(*advance)(void *object, size_t length, bool write);
 	async::result<helix::BorrowedDescriptor>(*accessMemory)(void *object);
 	async::result<frg::expected<protocols::fs::Error>> (*truncate)(void *object, size_t size);
 	async::result<frg::expected<protocols::fs::Error>> (*fallocate)(void *object, int64_t offset, size_t size);
 	async::result<void> (*ioctl)(void *object, managarm::fs::CntRequest req,
 			helix::UniqueLane conversation);
 	async::result<protocols::fs::Error> (*flock)(void *object, int flags);
+	// Implements fcntl() byte-range locks. ofd selects open file description locks.
+	async::result<frg::expected<Error, RangeLock>> (*lockRange)(void *object,
+			RangeLockCommand command, bool ofd, RangeLock lock);
+	// Writes the file's data (and unless data_only is set, its metadata) to stable storage.
+	async::result<frg::expected<protocols::fs::Error>> (*fsync)(void *object, bool data_only);
 	async::result<int> (*getOption)(void *object, int option);
 	async::result<void> (*setOption)(void *object, int option, int value);
 	async::result<frg::expected<Error, PollWaitResult>>
@@ -1,4 +1,5 @@
 
+#include <algorithm>
 #include <iostream>
 
 #include "fs.bragi.hpp"
@@ -36,6 +37,78 @@ async::result<void> File::seekAbsolute(int64_t offset) {
 	assert(resp.error() == managarm::fs::Errors::SUCCESS);
 }
 
+namespace {
+
+async::result<int64_t> seekTo(helix::BorrowedDescriptor lane,
+		managarm::fs::CntReqType type, int64_t offset) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(type);
+	req.set_rel_offset(offset);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	assert(resp.error() == managarm::fs::Errors::SUCCESS);
+	co_return resp.offset();
+}
+
+} // anonymous namespace
+
+async::result<int64_t> File::seekRelative(int64_t offset) {
+	return seekTo(_lane, managarm::fs::CntReqType::SEEK_REL, offset);
+}
+
+async::result<int64_t> File::seekEof(int64_t offset) {
+	return seekTo(_lane, managarm::fs::CntReqType::SEEK_EOF, offset);
+}
+
+async::result<frg::expected<Error, std::pair<int64_t, size_t>>>
+File::advance(size_t length, bool write) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_ADVANCE);
+	req.set_size(length);
+	req.set_flags(write ? 1 : 0);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	if(resp.error() == managarm::fs::Errors::NO_SPACE_LEFT)
+		co_return Error::noSpaceLeft;
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return Error::illegalOperationTarget;
+	co_return std::pair<int64_t, size_t>{resp.offset(), resp.size()};
+}
+
 async::result<size_t> File::readSome(void *data, size_t max_length) {
 	managarm::fs::CntRequest req;
 	req.set_req_type(managarm::fs::CntReqType::READ);
@@ -103,6 +176,215 @@ async::result<size_t> File::writeSome(const void *data, size_t maxLength) {
 	co_return resp.size();
 }
 
+namespace {
+
+Error vectorError(managarm::fs::Errors error) {
+	switch(error) {
+	case managarm::fs::Errors::WOULD_BLOCK: return Error::wouldBlock;
+	case managarm::fs::Errors::NO_SPACE_LEFT: return Error::noSpaceLeft;
+	case managarm::fs::Errors::ILLEGAL_OPERATION_TARGET: return Error::illegalOperationTarget;
+	default: return Error::illegalArguments;
+	}
+}
+
+} // anonymous namespace
+
+async::result<frg::expected<Error, std::vector<size_t>>>
+File::preadv(std::span<const IoSegment> segments) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_PREADV);
+	size_t total = 0;
+	for(auto &segment : segments) {
+		req.add_iov_offsets(segment.offset);
+		req.add_iov_lengths(segment.length);
+		total += segment.length;
+	}
+
+	auto ser = req.SerializeAsString();
+	std::vector<char> data(total);
+
+	auto [offer, send_req, imbue_creds, recv_resp, recv_data] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::imbueCredentials(),
+				helix_ng::recvInline(),
+				helix_ng::recvBuffer(data.data(), data.size())
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(imbue_creds.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	recv_resp.reset();
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return vectorError(resp.error());
+	HEL_CHECK(recv_data.error());
+	assert(resp.iov_results().size() == segments.size());
+
+	std::vector<size_t> results;
+	size_t position = 0;
+	for(size_t i = 0; i < segments.size(); i++) {
+		memcpy(segments[i].buffer, data.data() + position, resp.iov_results()[i]);
+		results.push_back(resp.iov_results()[i]);
+		position += segments[i].length;
+	}
+	co_return results;
+}
+
+async::result<frg::expected<Error, std::vector<size_t>>>
+File::pwritev(std::span<const IoSegment> segments) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_PWRITEV);
+	std::vector<char> data;
+	for(auto &segment : segments) {
+		req.add_iov_offsets(segment.offset);
+		req.add_iov_lengths(segment.length);
+		auto p = static_cast<const char *>(segment.buffer);
+		data.insert(data.end(), p, p + segment.length);
+	}
+
+	auto ser = req.SerializeAsString();
+
+	auto [offer, send_req, imbue_creds, send_data, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::imbueCredentials(),
+				helix_ng::sendBuffer(data.data(), data.size()),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(imbue_creds.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	recv_resp.reset();
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return vectorError(resp.error());
+	assert(resp.iov_results().size() == segments.size());
+
+	co_return std::vector<size_t>(resp.iov_results().begin(), resp.iov_results().end());
+}
+
+async::result<frg::expected<Error, std::vector<ReceivedMessage>>>
+File::recvMmsg(std::span<const MessageSegment> messages, uint32_t flags) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_RECVMMSG);
+	req.set_flags(flags);
+	// The server uses the same address size for all messages.
+	size_t total = 0;
+	size_t addrSize = 0;
+	for(auto &message : messages) {
+		req.add_msg_lengths(message.length);
+		total += message.length;
+		addrSize = std::max(addrSize, message.addressLength);
+	}
+	req.set_addr_size(addrSize);
+
+	auto ser = req.SerializeAsString();
+	std::vector<char> data(total);
+	std::vector<char> addrs(messages.size() * addrSize);
+
+	auto [offer, send_req, imbue_creds, recv_resp, recv_addrs, recv_data] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::imbueCredentials(),
+				helix_ng::recvInline(),
+				helix_ng::recvBuffer(addrs.data(), addrs.size()),
+				helix_ng::recvBuffer(data.data(), data.size())
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(imbue_creds.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	recv_resp.reset();
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return vectorError(resp.error());
+	HEL_CHECK(recv_addrs.error());
+	HEL_CHECK(recv_data.error());
+	assert(resp.msg_lengths().size() <= messages.size());
+	assert(resp.msg_addr_sizes().size() == resp.msg_lengths().size());
+
+	// The data of all messages is packed.
+	std::vector<ReceivedMessage> results;
+	size_t position = 0;
+	for(size_t i = 0; i < resp.msg_lengths().size(); i++) {
+		auto &message = messages[i];
+		ReceivedMessage result{resp.msg_lengths()[i], resp.msg_addr_sizes()[i]};
+		memcpy(message.buffer, data.data() + position, result.length);
+		memcpy(message.address, addrs.data() + i * addrSize,
+				std::min(result.addressLength, message.addressLength));
+		results.push_back(result);
+		position += result.length;
+	}
+	co_return results;
+}
+
+async::result<frg::expected<Error, std::vector<size_t>>>
+File::sendMmsg(std::span<const MessageSegment> messages, uint32_t flags) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_SENDMMSG);
+	req.set_flags(flags);
+	std::vector<char> data;
+	std::vector<char> addrs;
+	for(auto &message : messages) {
+		req.add_msg_lengths(message.length);
+		req.add_msg_addr_sizes(message.addressLength);
+		auto p = static_cast<const char *>(message.buffer);
+		data.insert(data.end(), p, p + message.length);
+		auto a = static_cast<const char *>(message.address);
+		addrs.insert(addrs.end(), a, a + message.addressLength);
+	}
+
+	auto ser = req.SerializeAsString();
+
+	auto [offer, send_req, send_data, imbue_creds, send_addrs, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::sendBuffer(data.data(), data.size()),
+				helix_ng::imbueCredentials(),
+				helix_ng::sendBuffer(addrs.data(), addrs.size()),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(send_data.error());
+	HEL_CHECK(imbue_creds.error());
+	HEL_CHECK(send_addrs.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	recv_resp.reset();
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return vectorError(resp.error());
+	assert(resp.msg_lengths().size() <= messages.size());
+
+	co_return std::vector<size_t>(resp.msg_lengths().begin(), resp.msg_lengths().end());
+}
+
 async::result<frg::expected<Error, PollWaitResult>> File::pollWait(uint64_t sequence, int mask,
 		async::cancellation_token cancellation) {
 	HelHandle cancel_handle;
@@ -1,85 +1,215 @@
+#include <assert.h>
 #include <protocols/fs/file-locks.hpp>
 #include <protocols/fs/server.hpp>
-#include <iostream>
+#include <algorithm>
 #include <fs.bragi.hpp>
 
 namespace protocols::fs {
-	Flock::~Flock() {
-		if(manager != nullptr) {
-			if(this->is_linked()) {
-				auto iter = boost::intrusive::list<Flock>::s_iterator_to(*this);
-				manager->flocks.erase(iter);
-				if(manager->flocks.size() == 0) {
-					manager->flockNotify.raise();
-				}
+	FileLockHolder::~FileLockHolder() {
+		if(manager)
+			manager->release(this);
+	}
+
+	bool FileLockManager::sameOwner(const Entry &a, const Entry &b) {
+		if(a.pid == -1 || b.pid == -1)
+			return a.pid == b.pid && a.holder == b.holder;
+		return a.pid == b.pid;
+	}
+
+	bool FileLockManager::conflicts(const Entry &a, const Entry &b) {
+		if(sameOwner(a, b))
+			return false;
+		if(a.end <= b.start || b.end <= a.start)
+			return false;
+		return a.exclusive || b.exclusive;
+	}
+
+	auto FileLockManager::findConflict(const Table &table, const Entry &request)
+			-> const Entry * {
+		for(auto &entry : table.entries)
+			if(conflicts(entry, request))
+				return &entry;
+		return nullptr;
+	}
+
+	void FileLockManager::apply(Table &table, const Entry &request, bool unlock) {
+		std::vector<Entry> result;
+		result.reserve(table.entries.size() + 2);
+		for(auto &entry : table.entries) {
+			if(!sameOwner(entry, request)
+					|| entry.end <= request.start || request.end <= entry.start) {
+				result.push_back(entry);
+				continue;
+			}
+
+			// Keep the parts of the entry outside of the request.
+			if(entry.start < request.start) {
+				auto head = entry;
+				head.end = request.start;
+				result.push_back(head);
+			}
+			if(entry.end > request.end) {
+				auto tail = entry;
+				tail.start = request.end;
+				result.push_back(tail);
 			}
 		}
-	}
 
-	async::result<protocols::fs::Error> FlockManager::lock(Flock* newFlock, int flags) {
-		bool nonblock  = flags & managarm::fs::FlockFlags::LOCK_NB;
-		bool shared    = flags & managarm::fs::FlockFlags::LOCK_SH;
-		if(shared) {
-			newFlock->type = protocols::fs::FLockState::LOCKED_SHARED;
+		if(!unlock) {
+			// Merge adjacent locks of the same type (that were acquired through
+			// the same description, such that release() still works).
+			auto merged = request;
+			std::erase_if(result, [&] (const Entry &entry) {
+				if(!sameOwner(entry, merged) || entry.holder != merged.holder
+						|| entry.exclusive != merged.exclusive)
+					return false;
+				if(entry.end < merged.start || merged.end < entry.start)
+					return false;
+				merged.start = std::min(merged.start, entry.start);
+				merged.end = std::max(merged.end, entry.end);
+				return true;
+			});
+			result.push_back(merged);
 		}
 
-		if(flags & managarm::fs::FlockFlags::LOCK_UN) {
-			if(newFlock->is_linked()) {
-				flocks.clear();
-				flockNotify.raise();
+		table.entries = std::move(result);
+	}
+
+	void FileLockManager::grantWaiters(Table &table) {
+		// Granting a lock can also release locks (e.g., if the request downgrades
+		// an exclusive lock), hence we iterate until no more waiters can be granted.
+		bool progress = true;
+		while(progress) {
+			progress = false;
+
+			std::vector<const Entry *> blocked;
+			for(auto it = table.waiters.begin(); it != table.waiters.end(); ) {
+				auto waiter = *it;
+				bool conflict = findConflict(table, waiter->request);
+				for(auto earlier : blocked) {
+					if(conflicts(*earlier, waiter->request)) {
+						conflict = true;
+						break;
+					}
+				}
+
+				if(conflict) {
+					blocked.push_back(&waiter->request);
+					++it;
+					continue;
+				}
+
+				apply(table, waiter->request, false);
+				it = table.waiters.erase(it);
+				waiter->granted.raise();
+				progress = true;
 			}
-			co_return protocols::fs::Error::none;
 		}
+	}
 
-		for(auto it = flocks.begin(); it != flocks.end();){
-			if((*it).type == protocols::fs::FLockState::LOCKED_EXCLUSIVE) {
-				if(nonblock) {
-					co_return protocols::fs::Error::wouldBlock;
-				}
-				co_await flockNotify.async_wait();
-
-				flocks.push_back(*newFlock);
-				newFlock->manager = this;
-				co_return protocols::fs::Error::none;
-			} else {
-				if(!shared) {
-					if(nonblock) {
-						co_return protocols::fs::Error::wouldBlock;
-					}
-					co_await flockNotify.async_wait();
-
-					flocks.push_back(*newFlock);
-					newFlock->manager = this;
-					co_return protocols::fs::Error::none;
-				} else {
-					flocks.push_back(*newFlock);
-					newFlock->manager = this;
-					co_return protocols::fs::Error::none;
+	async::result<protocols::fs::Error>
+	FileLockManager::acquire(Table &table, Entry request, bool nonblock) {
+		// Non-blocking requests only fail due to held locks (as required by POSIX).
+		// Blocking requests also queue up behind conflicting waiters.
+		bool conflict = findConflict(table, request);
+		if(conflict && nonblock)
+			co_return protocols::fs::Error::wouldBlock;
+		if(!conflict && !nonblock) {
+			for(auto waiter : table.waiters) {
+				if(conflicts(waiter->request, request)) {
+					conflict = true;
+					break;
 				}
 			}
 		}
-		flocks.push_back(*newFlock);
-		newFlock->manager = this;
+
+		if(!conflict) {
+			apply(table, request, false);
+			// We might have downgraded our own lock.
+			grantWaiters(table);
+			co_return protocols::fs::Error::none;
+		}
+
+		// TODO: Detect deadlocks (EDEADLK) and support cancellation by signals.
+		Waiter waiter{request, {}};
+		table.waiters.push_back(&waiter);
+		co_await waiter.granted.wait();
 		co_return protocols::fs::Error::none;
 	}
 
- 	bool FlockManager::validateFlockFlags(int flags) {
-		if(flags & managarm::fs::FlockFlags::LOCK_SH) {
-			if(flags & managarm::fs::FlockFlags::LOCK_EX) {
-				return false;
-			} else if(flags & managarm::fs::FlockFlags::LOCK_UN) {
-				return false;
-			}
-		} else if(flags & managarm::fs::FlockFlags::LOCK_EX) {
-			if(flags & managarm::fs::FlockFlags::LOCK_SH) {
-				return false;
-			} else if(flags & managarm::fs::FlockFlags::LOCK_UN) {
-				return false;
-			}
-		} else if(flags > 0b1111) {
-			return false;
+	void FileLockManager::release(FileLockHolder *holder) {
+		auto owned = [&] (const Entry &entry) {
+			return entry.holder == holder;
+		};
+		if(std::erase_if(flocks_.entries, owned))
+			grantWaiters(flocks_);
+		if(std::erase_if(ranges_.entries, owned))
+			grantWaiters(ranges_);
+		holder->manager = nullptr;
+	}
+
+	async::result<protocols::fs::Error> FileLockManager::flock(FileLockHolder *holder, int flags) {
+		bool nonblock = flags & managarm::fs::FlockFlags::LOCK_NB;
+		int op = flags & ~managarm::fs::FlockFlags::LOCK_NB;
+		if(op != managarm::fs::FlockFlags::LOCK_SH
+				&& op != managarm::fs::FlockFlags::LOCK_EX
+				&& op != managarm::fs::FlockFlags::LOCK_UN)
+			co_return protocols::fs::Error::illegalArguments;
+
+		assert(!holder->manager || holder->manager == this);
+		holder->manager = this;
+
+		Entry request{holder, -1, op == managarm::fs::FlockFlags::LOCK_EX, 0, UINT64_MAX};
+
+		// Like Linux, conversions are not atomic: we drop the old lock first.
+		// Otherwise, two holders of shared locks that both upgrade would deadlock.
+		apply(flocks_, request, true);
+		grantWaiters(flocks_);
+		if(op == managarm::fs::FlockFlags::LOCK_UN)
+			co_return protocols::fs::Error::none;
+
+		co_return co_await acquire(flocks_, request, nonblock);
+	}
+
+	async::result<frg::expected<protocols::fs::Error, RangeLock>>
+	FileLockManager::lockRange(FileLockHolder *holder, RangeLockCommand command,
+			bool ofd, RangeLock lock) {
+		if(lock.start > static_cast<uint64_t>(INT64_MAX)
+				|| lock.length > static_cast<uint64_t>(INT64_MAX) - lock.start)
+			co_return protocols::fs::Error::illegalArguments;
+		if(!ofd && lock.pid <= 0)
+			co_return protocols::fs::Error::illegalArguments;
+
+		assert(!holder->manager || holder->manager == this);
+		holder->manager = this;
+
+		Entry request{holder, ofd ? -1 : lock.pid, lock.type == RangeLockType::write,
+				lock.start, lock.length ? lock.start + lock.length : UINT64_MAX};
+
+		if(command == RangeLockCommand::get) {
+			if(lock.type == RangeLockType::unlock)
+				co_return protocols::fs::Error::illegalArguments;
+
+			auto conflict = findConflict(ranges_, request);
+			if(!conflict)
+				co_return RangeLock{RangeLockType::unlock, lock.start, lock.length, lock.pid};
+			co_return RangeLock{
+				conflict->exclusive ? RangeLockType::write : RangeLockType::read,
+				conflict->start,
+				conflict->end == UINT64_MAX ? 0 : conflict->end - conflict->start,
+				conflict->pid
+			};
+		}
+
+		if(lock.type == RangeLockType::unlock) {
+			apply(ranges_, request, true);
+			grantWaiters(ranges_);
+			co_return lock;
 		}
 
-		return true;
+		auto error = co_await acquire(ranges_, request, command != RangeLockCommand::setWait);
+		if(error != protocols::fs::Error::none)
+			co_return error;
+		co_return lock;
 	}
 }
@@ -1,10 +1,14 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <vector>
 
+#include <async/oneshot-event.hpp>
 #include <helix/ipc.hpp>
 
 #include <protocols/fs/server.hpp>
@@ -15,6 +19,77 @@ namespace fs {
 
 namespace {
 
+// Upper bound on the buffer of PT_READ_ENTRIES_BATCH.
+constexpr size_t maxReadEntriesBatch = size_t{64} << 10;
+
+// Limits of PT_PREADV, PT_PWRITEV, PT_RECVMMSG and PT_SENDMMSG
+// (the same as IOV_MAX and UIO_MAXIOV on Linux).
+constexpr size_t maxIoSegments = 1024;
+constexpr size_t maxIoVectorSize = size_t{16} << 20;
+
+// Buffer for the payload of READ and WRITE requests. Small payloads are stored
+// inline, i.e., inside the coroutine frame, which is allocated anyway.
+// Unlike std::vector or std::string, the buffer is not zero-initialized.
+struct PayloadBuffer {
+	static constexpr size_t inlineSize = 256;
+
+	explicit PayloadBuffer(size_t size)
+	: _size{size} {
+		if(size > inlineSize)
+			_heap.reset(new char[size]);
+	}
+
+	PayloadBuffer(const PayloadBuffer &) = delete;
+	PayloadBuffer &operator= (const PayloadBuffer &) = delete;
+
+	char *data() {
+		if(_heap)
+			return _heap.get();
+		return _inline;
+	}
+
+	size_t size() {
+		return _size;
+	}
+
+private:
+	size_t _size;
+	std::unique_ptr<char[]> _heap;
+	char _inline[inlineSize];
+};
+
+// Runs fn(i) for all i < n concurrently and waits until all of them complete.
+template<typename F>
+async::result<void> forEachConcurrently(size_t n, F fn) {
+	size_t pending = n;
+	async::oneshot_event done;
+	auto run = [&] (size_t i) -> async::detached {
+		co_await fn(i);
+		if(!--pending)
+			done.raise();
+	};
+	for(size_t i = 0; i < n; i++)
+		run(i);
+	if(pending)
+		co_await done.wait();
+}
+
+managarm::fs::NodeStats encodeNodeStats(const FileStats &stats) {
+	managarm::fs::NodeStats msg;
+	msg.set_file_size(stats.fileSize);
+	msg.set_num_links(stats.linkCount);
+	msg.set_mode(stats.mode);
+	msg.set_uid(stats.uid);
+	msg.set_gid(stats.gid);
+	msg.set_atime_secs(stats.accessTime.tv_sec);
+	msg.set_atime_nanos(stats.accessTime.tv_nsec);
+	msg.set_mtime_secs(stats.dataModifyTime.tv_sec);
+	msg.set_mtime_nanos(stats.dataModifyTime.tv_nsec);
+	msg.set_ctime_secs(stats.anyChangeTime.tv_sec);
+	msg.set_ctime_nanos(stats.anyChangeTime.tv_nsec);
+	return msg;
+}
+
 async::detached handlePassthrough(smarter::shared_ptr<void> file,
 		const FileOperations *file_ops,
 		managarm::fs::CntRequest req, helix::UniqueLane conversation) {
@@ -123,8 +198,7 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 			co_return;
 		}
 
-		std::string data;
-		data.resize(req.size());
+		PayloadBuffer data{req.size()};
 		auto res = co_await file_ops->read(file.get(), extract_creds.credentials(),
 				data.data(), req.size());
 
@@ -181,8 +255,7 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 			co_return;
 		}
 
-		std::string data;
-		data.resize(req.size());
+		PayloadBuffer data{req.size()};
 		auto res = co_await file_ops->pread(file.get(), req.offset(), extract_creds.credentials(),
 				data.data(), req.size());
 
@@ -220,8 +293,7 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 			HEL_CHECK(send_data.error());
 		}
 	}else if(req.req_type() == managarm::fs::CntReqType::WRITE) {
-		std::vector<uint8_t> buffer;
-		buffer.resize(req.size());
+		PayloadBuffer buffer{req.size()};
 
 		auto [extract_creds, recv_buffer] = co_await helix_ng::exchangeMsgs(
 			conversation,
@@ -274,6 +346,127 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 			);
 			HEL_CHECK(send_resp.error());
 		}
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_PREADV
+			|| req.req_type() == managarm::fs::CntReqType::PT_PWRITEV) {
+		bool isWrite = req.req_type() == managarm::fs::CntReqType::PT_PWRITEV;
+		auto sendError = [&] (managarm::fs::Errors error) -> async::result<void> {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(error);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+		};
+
+		// Segments are stored back-to-back in the payload.
+		auto numSegments = req.iov_offsets().size();
+		std::vector<size_t> positions;
+		size_t total = 0;
+		bool valid = numSegments == req.iov_lengths().size() && numSegments <= maxIoSegments;
+		for(size_t i = 0; valid && i < numSegments; i++) {
+			positions.push_back(total);
+			total += req.iov_lengths()[i];
+			if(total > maxIoVectorSize)
+				valid = false;
+		}
+
+		PayloadBuffer data{valid ? total : 0};
+		// The credentials are only valid as long as the result of exchangeMsgs().
+		char credentials[16];
+		if(isWrite) {
+			auto [extract_creds, recv_buffer] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::extractCredentials(),
+				helix_ng::recvBuffer(data.data(), data.size())
+			);
+			HEL_CHECK(extract_creds.error());
+			if(valid) {
+				HEL_CHECK(recv_buffer.error());
+				valid = recv_buffer.actualLength() == total;
+			}
+			memcpy(credentials, extract_creds.credentials(), sizeof(credentials));
+		}else{
+			auto [extract_creds] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::extractCredentials()
+			);
+			HEL_CHECK(extract_creds.error());
+			memcpy(credentials, extract_creds.credentials(), sizeof(credentials));
+		}
+
+		if(isWrite ? !file_ops->pwrite : !file_ops->pread) {
+			co_await sendError(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+			co_return;
+		}
+		if(!valid) {
+			co_await sendError(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			co_return;
+		}
+
+		// Segments are independent; issue all of them at the same time.
+		std::vector<size_t> results(numSegments, 0);
+		std::optional<Error> error;
+		co_await forEachConcurrently(numSegments, [&] (size_t i) -> async::result<void> {
+			auto offset = req.iov_offsets()[i];
+			auto length = req.iov_lengths()[i];
+			if(!length)
+				co_return;
+
+			if(isWrite) {
+				auto res = co_await file_ops->pwrite(file.get(), offset, credentials,
+						data.data() + positions[i], length);
+				if(res) {
+					results[i] = res.value();
+				}else{
+					error = res.error();
+				}
+			}else{
+				auto res = co_await file_ops->pread(file.get(), offset, credentials,
+						data.data() + positions[i], length);
+				if(auto e = std::get_if<Error>(&res); e) {
+					error = *e;
+				}else{
+					results[i] = std::get<size_t>(res);
+				}
+			}
+		});
+
+		if(error) {
+			if(*error == Error::wouldBlock) {
+				co_await sendError(managarm::fs::Errors::WOULD_BLOCK);
+			}else if(*error == Error::noSpaceLeft) {
+				co_await sendError(managarm::fs::Errors::NO_SPACE_LEFT);
+			}else{
+				co_await sendError(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			}
+			co_return;
+		}
+
+		managarm::fs::SvrResponse resp;
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+		for(auto result : results)
+			resp.add_iov_results(result);
+
+		auto ser = resp.SerializeAsString();
+		if(isWrite) {
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+		}else{
+			// Short reads leave holes in the payload; clients use iov_results.
+			auto [send_resp, send_data] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::sendBuffer(data.data(), total)
+			);
+			HEL_CHECK(send_resp.error());
+			HEL_CHECK(send_data.error());
+		}
 	}else if(req.req_type() == managarm::fs::CntReqType::FLOCK) {
 		if(!file_ops->flock) {
 			managarm::fs::SvrResponse resp;
@@ -304,6 +497,82 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 			helix_ng::sendBuffer(ser.data(), ser.size())
 		);
 		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_LOCK_RANGE) {
+		auto sendResp = [&] (managarm::fs::SvrResponse &resp) -> async::result<void> {
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+		};
+
+		managarm::fs::SvrResponse resp;
+		if(!file_ops->lockRange) {
+			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+			co_await sendResp(resp);
+			co_return;
+		}
+
+		RangeLockCommand command;
+		if(req.lock_command() == managarm::fs::LockCommand::LC_GET) {
+			command = RangeLockCommand::get;
+		}else if(req.lock_command() == managarm::fs::LockCommand::LC_SET) {
+			command = RangeLockCommand::set;
+		}else if(req.lock_command() == managarm::fs::LockCommand::LC_SET_WAIT) {
+			command = RangeLockCommand::setWait;
+		}else{
+			resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			co_await sendResp(resp);
+			co_return;
+		}
+
+		RangeLock lock;
+		if(req.lock_type() == managarm::fs::LockType::LT_READ) {
+			lock.type = RangeLockType::read;
+		}else if(req.lock_type() == managarm::fs::LockType::LT_WRITE) {
+			lock.type = RangeLockType::write;
+		}else if(req.lock_type() == managarm::fs::LockType::LT_UNLOCK) {
+			lock.type = RangeLockType::unlock;
+		}else{
+			resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			co_await sendResp(resp);
+			co_return;
+		}
+		lock.start = req.lock_start();
+		lock.length = req.lock_length();
+		lock.pid = req.lock_ofd() ? -1 : req.lock_pid();
+
+		auto result = co_await file_ops->lockRange(file.get(), command,
+				req.lock_ofd(), lock);
+		if(!result) {
+			if(result.error() == protocols::fs::Error::wouldBlock) {
+				resp.set_error(managarm::fs::Errors::WOULD_BLOCK);
+			}else{
+				resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			}
+			co_await sendResp(resp);
+			co_return;
+		}
+
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+		if(command == RangeLockCommand::get) {
+			switch(result.value().type) {
+			case RangeLockType::read:
+				resp.set_lock_type(managarm::fs::LockType::LT_READ);
+				break;
+			case RangeLockType::write:
+				resp.set_lock_type(managarm::fs::LockType::LT_WRITE);
+				break;
+			case RangeLockType::unlock:
+				resp.set_lock_type(managarm::fs::LockType::LT_UNLOCK);
+				break;
+			}
+			resp.set_lock_start(result.value().start);
+			resp.set_lock_length(result.value().length);
+			resp.set_lock_pid(result.value().pid);
+		}
+		co_await sendResp(resp);
 	}else if(req.req_type() == managarm::fs::CntReqType::PT_READ_ENTRIES) {
 		if(!file_ops->readEntries) {
 			managarm::fs::SvrResponse resp;
@@ -332,6 +601,81 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 			conversation,
 			helix_ng::sendBuffer(ser.data(), ser.size()));
 		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_READ_ENTRIES_BATCH) {
+		auto sendError = [&] (managarm::fs::Errors error) -> async::result<void> {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(error);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+		};
+
+		if(!file_ops->readEntriesBatch && !file_ops->readEntries) {
+			co_await sendError(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+			co_return;
+		}
+		if(req.size() < 0 || static_cast<size_t>(req.size()) < maxDirentRecordSize) {
+			co_await sendError(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			co_return;
+		}
+
+		if(req.flags() & kReadEntriesResume) {
+			if(!file_ops->seekAbs) {
+				co_await sendError(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+				co_return;
+			}
+			co_await file_ops->seekAbs(file.get(), req.offset());
+		}
+
+		PayloadBuffer data{std::min(static_cast<size_t>(req.size()), maxReadEntriesBatch)};
+		ReadEntriesBatchResult result{0, -1};
+		if(file_ops->readEntriesBatch) {
+			auto batch = co_await file_ops->readEntriesBatch(file.get(),
+					data.data(), data.size(), req.flags() & kReadEntriesWithStats);
+			if(!batch) {
+				co_await sendError(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+				co_return;
+			}
+			result = batch.value();
+		}else{
+			// readEntries() consumes the entry, so only ask for one if any entry fits.
+			while(data.size() - result.length >= maxDirentRecordSize) {
+				auto entry = co_await file_ops->readEntries(file.get());
+				if(!entry)
+					break;
+				result.length += appendDirentRecord(data.data() + result.length,
+						data.size() - result.length, 0, kDirentUnknown,
+						entry->data(), entry->size(), nullptr);
+			}
+			if(file_ops->seekRel) {
+				auto offset = co_await file_ops->seekRel(file.get(), 0);
+				if(auto p = std::get_if<int64_t>(&offset); p)
+					result.cookie = *p;
+			}
+		}
+
+		if(!result.length) {
+			co_await sendError(managarm::fs::Errors::END_OF_FILE);
+			co_return;
+		}
+
+		managarm::fs::SvrResponse resp;
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+		resp.set_size(result.length);
+		resp.set_offset(result.cookie);
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp, send_data] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::sendBuffer(data.data(), result.length)
+		);
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(send_data.error());
 	}else if(req.req_type() == managarm::fs::CntReqType::MMAP) {
 		if(!file_ops->accessMemory) {
 			managarm::fs::SvrResponse resp;
@@ -359,6 +703,29 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 		);
 		HEL_CHECK(send_resp.error());
 		HEL_CHECK(push_memory.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_ADVANCE) {
+		managarm::fs::SvrResponse resp;
+		if(!file_ops->advance || !file_ops->accessMemory) {
+			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+		}else{
+			auto result = co_await file_ops->advance(file.get(), req.size(), req.flags() & 1);
+			if(result) {
+				resp.set_error(managarm::fs::Errors::SUCCESS);
+				resp.set_offset(result.value().offset);
+				resp.set_size(result.value().length);
+			}else if(result.error() == Error::noSpaceLeft) {
+				resp.set_error(managarm::fs::Errors::NO_SPACE_LEFT);
+			}else{
+				resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+			}
+		}
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size())
+		);
+		HEL_CHECK(send_resp.error());
 	}else if(req.req_type() == managarm::fs::CntReqType::PT_TRUNCATE) {
 		if(!file_ops->truncate) {
 			managarm::fs::SvrResponse resp;
@@ -381,6 +748,26 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
 		}
 
+		auto ser = resp.SerializeAsString();
+		auto [send_resp] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size())
+		);
+		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_FSYNC) {
+		managarm::fs::SvrResponse resp;
+		if(!file_ops->fsync) {
+			// Files without an fsync() handler do not have data that could be written back.
+			resp.set_error(managarm::fs::Errors::SUCCESS);
+		}else{
+			auto result = co_await file_ops->fsync(file.get(), req.flags() & 1);
+			if(result) {
+				resp.set_error(managarm::fs::Errors::SUCCESS);
+			}else{
+				resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+			}
+		}
+
 		auto ser = resp.SerializeAsString();
 		auto [send_resp] = co_await helix_ng::exchangeMsgs(
 			conversation,
@@ -906,6 +1293,167 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 		resp.set_error(managarm::fs::Errors::SUCCESS);
 		resp.set_size(res.value());
 
+		auto ser = resp.SerializeAsString();
+		auto [send_resp] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size())
+		);
+		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_RECVMMSG) {
+		auto sendError = [&] (managarm::fs::Errors error) -> async::result<void> {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(error);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+		};
+
+		auto [extract_creds] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::extractCredentials()
+		);
+		HEL_CHECK(extract_creds.error());
+
+		if(!file_ops->recvMsg) {
+			co_await sendError(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+			co_return;
+		}
+
+		auto numMessages = req.msg_lengths().size();
+		size_t total = 0;
+		bool valid = numMessages && numMessages <= maxIoSegments
+				&& req.addr_size() <= maxIoVectorSize / maxIoSegments;
+		for(size_t i = 0; valid && i < numMessages; i++) {
+			total += req.msg_lengths()[i];
+			if(total > maxIoVectorSize)
+				valid = false;
+		}
+		if(!valid) {
+			co_await sendError(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			co_return;
+		}
+
+		// Like Linux, only MSG_WAITFORONE makes the messages after the first
+		// one non-blocking. Data is packed, addresses use fixed-size slots.
+		bool waitForOne = req.flags() & MSG_WAITFORONE;
+		uint32_t flags = req.flags() & ~MSG_WAITFORONE;
+		PayloadBuffer data{total};
+		std::vector<char> addrs(numMessages * req.addr_size());
+		managarm::fs::SvrResponse resp;
+		size_t position = 0;
+		for(size_t i = 0; i < numMessages; i++) {
+			auto result = co_await file_ops->recvMsg(file.get(),
+				extract_creds.credentials(),
+				(i && waitForOne) ? (flags | MSG_DONTWAIT) : flags,
+				data.data() + position, req.msg_lengths()[i],
+				addrs.data() + i * req.addr_size(), req.addr_size(), 0);
+			if(auto error = std::get_if<Error>(&result); error) {
+				if(!i) {
+					co_await sendError(static_cast<managarm::fs::Errors>(*error));
+					co_return;
+				}
+				break;
+			}
+
+			auto &message = std::get<RecvData>(result);
+			resp.add_msg_lengths(message.dataLength);
+			resp.add_msg_addr_sizes(std::min(message.addressLength, req.addr_size()));
+			position += message.dataLength;
+		}
+
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+		auto ser = resp.SerializeAsString();
+		auto [send_resp, send_addrs, send_data]
+				= co_await helix_ng::exchangeMsgs(conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::sendBuffer(addrs.data(),
+				resp.msg_lengths().size() * req.addr_size()),
+			helix_ng::sendBuffer(data.data(), position)
+		);
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(send_addrs.error());
+		HEL_CHECK(send_data.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_SENDMMSG) {
+		auto sendError = [&] (managarm::fs::Errors error) -> async::result<void> {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(error);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+		};
+
+		auto numMessages = req.msg_lengths().size();
+		size_t total = 0;
+		size_t totalAddrs = 0;
+		bool valid = numMessages && numMessages <= maxIoSegments
+				&& numMessages == req.msg_addr_sizes().size();
+		for(size_t i = 0; valid && i < numMessages; i++) {
+			total += req.msg_lengths()[i];
+			totalAddrs += req.msg_addr_sizes()[i];
+			if(total > maxIoVectorSize || totalAddrs > maxIoVectorSize)
+				valid = false;
+		}
+
+		PayloadBuffer data{valid ? total : 0};
+		std::vector<char> addrs(valid ? totalAddrs : 0);
+		auto [recv_data, extract_creds, recv_addrs] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::recvBuffer(data.data(), data.size()),
+			helix_ng::extractCredentials(),
+			helix_ng::recvBuffer(addrs.data(), addrs.size())
+		);
+		HEL_CHECK(extract_creds.error());
+		if(valid) {
+			HEL_CHECK(recv_data.error());
+			HEL_CHECK(recv_addrs.error());
+			valid = recv_data.actualLength() == total
+					&& recv_addrs.actualLength() == totalAddrs;
+		}
+
+		if(!file_ops->sendMsg) {
+			co_await sendError(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+			co_return;
+		}
+		if(!valid) {
+			co_await sendError(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			co_return;
+		}
+
+		// Stop at the first error; it is only reported if no message was sent.
+		managarm::fs::SvrResponse resp;
+		size_t position = 0;
+		size_t addrPosition = 0;
+		for(size_t i = 0; i < numMessages; i++) {
+			auto length = req.msg_lengths()[i];
+			auto addrLength = req.msg_addr_sizes()[i];
+			auto res = co_await file_ops->sendMsg(file.get(),
+					extract_creds.credentials(), req.flags(),
+					data.data() + position, length,
+					addrs.data() + addrPosition, addrLength, {});
+			if(!res) {
+				if(!i) {
+					co_await sendError(static_cast<managarm::fs::Errors>(res.error()));
+					co_return;
+				}
+				break;
+			}
+
+			resp.add_msg_lengths(res.value());
+			position += length;
+			addrPosition += addrLength;
+		}
+
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+		resp.set_size(resp.msg_lengths().size());
+
 		auto ser = resp.SerializeAsString();
 		auto [send_resp] = co_await helix_ng::exchangeMsgs(
 			conversation,
@@ -1003,7 +1551,7 @@ async::result<void> servePassthrough(helix::UniqueLane lane,
 		auto [accept, recv_req] = co_await helix_ng::exchangeMsgs(
 			lane,
 			helix_ng::accept(
-				helix_ng::recvInline())
+				helix_ng::recvInline(1024))
 		);
 
 		// TODO: Handle end-of-lane correctly. Why does it even happen here?
@@ -1195,6 +1743,17 @@ async::detached serveNode(helix::UniqueLane lane, std::shared_ptr<void> node,
 				resp.add_ids(id);
 			}
 
+			// Saves the client one NODE_GET_STATS round trip per resolved node.
+			if(req.want_stats() && node_ops->getStats) {
+				auto &resolved = nodes;
+				std::vector<FileStats> stats(resolved.size());
+				co_await forEachConcurrently(resolved.size(), [&] (size_t i) -> async::result<void> {
+					stats[i] = co_await node_ops->getStats(resolved[i].first);
+				});
+				for(auto &s : stats)
+					resp.add_node_stats(encodeNodeStats(s));
+			}
+
 			auto ser = resp.SerializeAsString();
 			auto [send_resp, push_desc] = co_await helix_ng::exchangeMsgs(
 				conversation,
@@ -47,6 +47,14 @@ struct Device {
 	async::result<helix::UniqueDescriptor> accessBar(int index);
 	async::result<helix::UniqueDescriptor> accessIrq();
 	async::result<helix::UniqueDescriptor> installMsi(int index);
+	// Like installMsi() but delivers the MSI to a specific CPU.
+	async::result<helix::UniqueDescriptor> installMsi(int index, int cpu);
+	// Installs up to count MSIs starting at index; MSI i is delivered to
+	// CPU (cpu + i) mod #CPUs. Returns one IRQ per installed MSI (at least one).
+	async::result<std::vector<helix::UniqueDescriptor>>
+	installMsiRange(int index, int count, int cpu = 0);
+	// Masks or unmasks a single MSI-X vector; independent of IRQ acknowledgement.
+	async::result<void> setMsiMask(int index, bool masked);
 
 	async::result<void> claimDevice();
 	async::result<void> enableBusIrq();
@@ -24,7 +24,7 @@ async::result<PciInfo> Device::getPciInfo() {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -92,7 +92,7 @@ async::result<helix::UniqueDescriptor> Device::accessBar(int index) {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -130,7 +130,7 @@ async::result<helix::UniqueDescriptor> Device::accessIrq() {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -168,7 +168,7 @@ async::result<helix::UniqueDescriptor> Device::installMsi(int index) {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -198,6 +198,95 @@ async::result<helix::UniqueDescriptor> Device::installMsi(int index) {
 	co_return pull_msi.descriptor();
 }
 
+async::result<helix::UniqueDescriptor> Device::installMsi(int index, int cpu) {
+	auto msi = co_await installMsi(index);
+	HEL_CHECK(helSetIrqAffinity(msi.getHandle(), cpu));
+	co_return std::move(msi);
+}
+
+async::result<std::vector<helix::UniqueDescriptor>>
+Device::installMsiRange(int index, int count, int cpu) {
+	managarm::hw::InstallMsiRangeRequest req;
+	req.set_index(index);
+	req.set_count(count);
+	req.set_cpu(cpu);
+
+	auto [offer, send_req, recv_head] = co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::want_lane,
+				helix_ng::sendBragiHeadOnly(req),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_head.error());
+
+	auto preamble = bragi::read_preamble(recv_head);
+	assert(!preamble.error());
+	recv_head.reset();
+
+	std::vector<std::byte> tailBuffer(preamble.tail_size());
+	auto [recv_tail] = co_await helix_ng::exchangeMsgs(
+			offer.descriptor(),
+			helix_ng::recvBuffer(tailBuffer.data(), tailBuffer.size())
+		);
+
+	HEL_CHECK(recv_tail.error());
+
+	auto resp = *bragi::parse_head_tail<managarm::hw::SvrResponse>(recv_head, tailBuffer);
+
+	assert(resp.error() == managarm::hw::Errors::SUCCESS);
+
+	std::vector<helix::UniqueDescriptor> msis;
+	for(unsigned int i = 0; i < resp.num_msis(); i++) {
+		auto [pull_msi] = co_await helix_ng::exchangeMsgs(
+				offer.descriptor(),
+				helix_ng::pullDescriptor()
+			);
+		HEL_CHECK(pull_msi.error());
+		msis.push_back(pull_msi.descriptor());
+	}
+	co_return std::move(msis);
+}
+
+async::result<void> Device::setMsiMask(int index, bool masked) {
+	managarm::hw::SetMsiMaskRequest req;
+	req.set_index(index);
+	req.set_masked(masked);
+
+	auto [offer, send_req, recv_head] = co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::want_lane,
+				helix_ng::sendBragiHeadOnly(req),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_head.error());
+
+	auto preamble = bragi::read_preamble(recv_head);
+	assert(!preamble.error());
+	recv_head.reset();
+
+	std::vector<std::byte> tailBuffer(preamble.tail_size());
+	auto [recv_tail] = co_await helix_ng::exchangeMsgs(
+			offer.descriptor(),
+			helix_ng::recvBuffer(tailBuffer.data(), tailBuffer.size())
+		);
+
+	HEL_CHECK(recv_tail.error());
+
+	auto resp = *bragi::parse_head_tail<managarm::hw::SvrResponse>(recv_head, tailBuffer);
+
+	assert(resp.error() == managarm::hw::Errors::SUCCESS);
+}
+
 async::result<void> Device::claimDevice() {
 	managarm::hw::ClaimDeviceRequest req;
 
@@ -205,7 +294,7 @@ async::result<void> Device::claimDevice() {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -238,7 +327,7 @@ async::result<void> Device::enableBusIrq() {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -271,7 +360,7 @@ async::result<void> Device::enableMsi() {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -304,7 +393,7 @@ async::result<void> Device::enableBusmaster() {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -339,7 +428,7 @@ async::result<uint32_t> Device::loadPciSpace(size_t offset, unsigned int size) {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -377,7 +466,7 @@ async::result<void> Device::storePciSpace(size_t offset, unsigned int size, uint
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -413,7 +502,7 @@ async::result<uint32_t> Device::loadPciCapability(unsigned int index, size_t off
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -448,7 +537,7 @@ async::result<FbInfo> Device::getFbInfo() {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -491,7 +580,7 @@ async::result<helix::UniqueDescriptor> Device::accessFbMemory() {
 			_lane,
 			helix_ng::offer(
 				helix_ng::want_lane,
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
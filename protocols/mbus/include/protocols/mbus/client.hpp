@@ -114,6 +114,7 @@ namespace _detail {
 
 	struct Entity;
 	struct Observer;
+	struct Snapshot;
 
 	struct ObjectHandler {
 		ObjectHandler &withBind(std::function<async::result<helix::UniqueDescriptor>()> f) {
@@ -154,6 +155,12 @@ namespace _detail {
 		async::result<Observer> linkObserver(const AnyFilter &filter,
 				ObserverHandler handler) const;
 
+		// links an observer to this group and returns all currently matching
+		// entities (with their properties) in a single round trip.
+		// handler is only invoked for entities that are not part of the snapshot.
+		async::result<Snapshot> enumerate(const AnyFilter &filter,
+				ObserverHandler handler) const;
+
 		// bind to the device.
 		async::result<helix::UniqueDescriptor> bind() const;
 
@@ -183,6 +190,12 @@ namespace _detail {
 		Properties _properties;
 	};
 
+	struct Snapshot {
+		// Number of attaches on the bus that are reflected in the snapshot.
+		uint64_t seq;
+		std::vector<AttachEvent> entities;
+	};
+
 	struct Observer {
 	};
 }
@@ -201,6 +214,8 @@ using _detail::ObserverHandler;
 using _detail::Instance;
 using _detail::Entity;
 using _detail::Observer;
+using _detail::AttachEvent;
+using _detail::Snapshot;
 
 void recreateInstance();
 
@@ -178,7 +178,7 @@ async::result<Entity> Entity::createObject(std::string name,
 }
 
 async::detached handleObserver(std::shared_ptr<Connection> connection,
-		ObserverHandler handler, helix::UniqueLane lane) {
+		ObserverHandler handler, helix::UniqueLane lane, uint64_t seq = 0) {
 	while(true) {
 		helix::RecvBuffer recv_req;
 
@@ -191,6 +191,10 @@ async::detached handleObserver(std::shared_ptr<Connection> connection,
 		managarm::mbus::SvrRequest req;
 		req.ParseFromArray(buffer, recv_req.actualLength());
 		if(req.req_type() == managarm::mbus::SvrReqType::ATTACH) {
+			// Entities that did not fit into a snapshot carry its sequence number.
+			assert(req.seq() >= seq);
+			seq = req.seq();
+
 			Properties properties;
 			for(auto &kv : req.properties())
 				properties.insert({ kv.name(), StringItem{kv.item().string_item().value()} });
@@ -250,6 +254,52 @@ async::result<Observer> Entity::linkObserver(const AnyFilter &filter,
 	co_return Observer();
 }
 
+async::result<Snapshot> Entity::enumerate(const AnyFilter &filter,
+		ObserverHandler handler) const {
+	helix::Offer offer;
+	helix::SendBuffer send_req;
+	helix::RecvBuffer recv_resp;
+	helix::PullDescriptor pull_lane;
+
+	managarm::mbus::CntRequest req;
+	req.set_req_type(managarm::mbus::CntReqType::ENUMERATE);
+	req.set_id(_id);
+	encodeFilter(filter, req.mutable_filter());
+
+	// Must match the maxSnapshotSize of the mbus server.
+	std::vector<uint8_t> buffer(64 * 1024);
+
+	auto ser = req.SerializeAsString();
+	auto &&transmit = helix::submitAsync(_connection->lane, helix::Dispatcher::global(),
+			helix::action(&offer, kHelItemAncillary),
+			helix::action(&send_req, ser.data(), ser.size(), kHelItemChain),
+			helix::action(&recv_resp, buffer.data(), buffer.size(), kHelItemChain),
+			helix::action(&pull_lane));
+	co_await transmit.async_wait();
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+	HEL_CHECK(pull_lane.error());
+
+	managarm::mbus::SvrResponse resp;
+	resp.ParseFromArray(buffer.data(), recv_resp.actualLength());
+	assert(resp.error() == managarm::mbus::Error::SUCCESS);
+
+	Snapshot snapshot{resp.seq(), {}};
+	snapshot.entities.reserve(resp.entities_size());
+	for(auto &record : resp.entities()) {
+		Properties properties;
+		for(auto &kv : record.properties())
+			properties.insert({ kv.name(), StringItem{kv.item().string_item().value()} });
+		snapshot.entities.emplace_back(Entity{_connection, record.id()}, std::move(properties));
+	}
+
+	handleObserver(_connection, handler, helix::UniqueLane(pull_lane.descriptor()),
+			snapshot.seq);
+
+	co_return snapshot;
+}
+
 async::result<helix::UniqueDescriptor> Entity::bind() const {
 	helix::Offer offer;
 	helix::SendBuffer send_req;
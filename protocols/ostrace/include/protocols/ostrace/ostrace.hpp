@@ -1,9 +1,12 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include <async/result.hpp>
 #include <helix/ipc.hpp>
+#include <helix/memory.hpp>
+#include <protocols/ostrace/ring.hpp>
 #include <ostrace.bragi.hpp>
 
 namespace protocols::ostrace {
@@ -11,6 +14,23 @@ namespace protocols::ostrace {
 enum class EventId : uint64_t { };
 enum class ItemId : uint64_t { };
 
+// Read-only mapping of one of the kernel's per-CPU event rings.
+struct Ring {
+	Ring(helix::UniqueDescriptor memory, size_t size);
+
+	const RingHeader *header() {
+		return reinterpret_cast<const RingHeader *>(mapping_.get());
+	}
+
+	// Copies all records in [seq, head) that are still present in the ring.
+	// Returns the new value of seq; records that were overwritten are counted in lost.
+	uint64_t readRecords(uint64_t seq, std::vector<RingRecord> &records, uint64_t &lost);
+
+private:
+	helix::UniqueDescriptor memory_;
+	helix::Mapping mapping_;
+};
+
 struct Context {
 	Context();
 	Context(helix::UniqueLane lane, bool enabled);
@@ -27,6 +47,9 @@ struct Context {
 	async::result<EventId> announceEvent(std::string_view name);
 	async::result<ItemId> announceItem(std::string_view name);
 
+	// Maps the per-CPU rings that the kernel has allocated so far.
+	async::result<std::vector<Ring>> mapRings();
+
 private:
 	helix::UniqueLane lane_;
 	bool enabled_;
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Binary layout of the per-CPU event rings that thor shares with userspace.
+// This header is also included by the kernel; it must not depend on any library.
+
+namespace protocols::ostrace {
+
+inline constexpr uint32_t ringMagic = 0x5254534f; // "OSTR".
+
+inline constexpr unsigned int maxRingCounters = 6;
+
+// Set in RingRecord::flags if the event had more than maxRingCounters counters.
+inline constexpr uint32_t recordTruncated = 1;
+
+struct RingCounter {
+	uint64_t id;
+	int64_t value;
+};
+
+struct RingRecord {
+	// Sequence number of the record plus one. Zero while the record is being written.
+	uint64_t seq;
+	uint64_t ts; // Timestamp in nanoseconds.
+	uint64_t id;
+	uint32_t numCtrs;
+	uint32_t flags;
+	RingCounter ctrs[maxRingCounters];
+};
+static_assert(sizeof(RingRecord) == 128);
+
+// The header occupies the first RingRecord-sized slot of the ring memory.
+// The remaining memory consists of numSlots RingRecords.
+struct RingHeader {
+	uint32_t magic;
+	uint32_t cpu;
+	uint64_t numSlots;
+	// Sequence number of the next record that will be written.
+	// Only the kernel writes to this field.
+	uint64_t head;
+	uint8_t padding[104];
+};
+static_assert(sizeof(RingHeader) == sizeof(RingRecord));
+
+inline RingRecord *ringSlots(RingHeader *header) {
+	return reinterpret_cast<RingRecord *>(header + 1);
+}
+
+inline const RingRecord *ringSlots(const RingHeader *header) {
+	return reinterpret_cast<const RingRecord *>(header + 1);
+}
+
+inline uint64_t loadRingHead(const RingHeader *header) {
+	return __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+}
+
+// Copies the record with sequence number seq out of the ring.
+// Returns false if the record was already overwritten (or is not written yet).
+inline bool readRingRecord(const RingHeader *header, uint64_t seq, RingRecord &out) {
+	auto slot = &ringSlots(header)[seq % header->numSlots];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+		return false;
+	memcpy(&out, slot, sizeof(RingRecord));
+	// Re-check the sequence number to detect concurrent writers (seqlock style).
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1)
+		return false;
+	return out.seq == seq + 1;
+}
+
+} // namespace protocols::ostrace
@@ -7,6 +7,27 @@
 
 namespace protocols::ostrace {
 
+Ring::Ring(helix::UniqueDescriptor memory, size_t size)
+: memory_{std::move(memory)}, mapping_{memory_, 0, size, kHelMapProtRead} { }
+
+uint64_t Ring::readRecords(uint64_t seq, std::vector<RingRecord> &records, uint64_t &lost) {
+	auto head = loadRingHead(header());
+	if(head - seq > header()->numSlots) {
+		lost += head - header()->numSlots - seq;
+		seq = head - header()->numSlots;
+	}
+
+	for(; seq != head; ++seq) {
+		RingRecord record;
+		if(!readRingRecord(header(), seq, record)) {
+			++lost;
+			continue;
+		}
+		records.push_back(record);
+	}
+	return seq;
+}
+
 Context::Context()
 : enabled_{false} { }
 
@@ -21,7 +42,7 @@ async::result<EventId> Context::announceEvent(std::string_view name) {
 		co_await helix_ng::exchangeMsgs(
 			lane_,
 			helix_ng::offer(
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -47,7 +68,7 @@ async::result<ItemId> Context::announceItem(std::string_view name) {
 		co_await helix_ng::exchangeMsgs(
 			lane_,
 			helix_ng::offer(
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
@@ -65,6 +86,49 @@ async::result<ItemId> Context::announceItem(std::string_view name) {
 	co_return ItemId{resp.id()};
 }
 
+async::result<std::vector<Ring>> Context::mapRings() {
+	managarm::ostrace::GetRingsReq req;
+
+	auto [offer, sendReq, recvResp] =
+		co_await helix_ng::exchangeMsgs(
+			lane_,
+			helix_ng::offer(
+				helix_ng::want_lane,
+				helix_ng::sendBragiHeadOnly(req),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(sendReq.error());
+	HEL_CHECK(recvResp.error());
+
+	auto maybeResp = bragi::parse_head_only<managarm::ostrace::Response>(recvResp);
+	recvResp.reset();
+	assert(maybeResp);
+	auto &resp = maybeResp.value();
+
+	std::vector<Ring> rings;
+	if(resp.error() == managarm::ostrace::Error::OSTRACE_GLOBALLY_DISABLED)
+		co_return rings;
+	assert(resp.error() == managarm::ostrace::Error::SUCCESS);
+
+	for(uint32_t i = 0; i < resp.num_rings(); ++i) {
+		auto [pullMemory] = co_await helix_ng::exchangeMsgs(
+			offer.descriptor(),
+			helix_ng::pullDescriptor()
+		);
+		HEL_CHECK(pullMemory.error());
+
+		auto memory = pullMemory.descriptor();
+		size_t size;
+		HEL_CHECK(helMemoryInfo(memory.getHandle(), &size));
+		rings.emplace_back(std::move(memory), size);
+	}
+
+	co_return rings;
+}
+
 Event::Event(Context *ctx, EventId id)
 : ctx_{ctx} {
 	live_ = ctx->isActive();
@@ -89,7 +153,7 @@ async::result<void> Event::emit() {
 		co_await helix_ng::exchangeMsgs(
 			ctx_->getLane(),
 			helix_ng::offer(
-				helix_ng::sendBragiHeadOnly(req_, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req_),
 				helix_ng::recvInline()
 			)
 		);
@@ -137,7 +201,7 @@ async::result<Context> createContext() {
 		co_await helix_ng::exchangeMsgs(
 			lane,
 			helix_ng::offer(
-				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::sendBragiHeadOnly(req),
 				helix_ng::recvInline()
 			)
 		);
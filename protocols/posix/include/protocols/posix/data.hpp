@@ -1,19 +1,57 @@
 #pragma once
 
+#include <stdint.h>
 #include <hel.h>
 
 namespace posix {
 
+// Page that is shared between each thread and posix (see ManagarmProcessData::threadPage).
+struct ThreadPage {
+	int globalSignalFlag;
+	uint32_t reserved;
+	// Signals that are blocked by the thread. The thread updates the mask directly
+	// (i.e., sigprocmask() does not need a SIG_MASK supercall); posix reads it whenever
+	// it decides whether a signal can be delivered.
+	uint64_t signalMask;
+	// Signals that were pending when posix last looked at the SignalContext.
+	// If the thread unblocks any of these signals, it has to issue a SIG_MASK supercall
+	// (with mode zero) to have them delivered.
+	uint64_t pendingSignals;
+	// Unique among all thread pages that posix ever handed out. Since fork() gives the
+	// child a new thread page, user space compares this value to detect that it runs
+	// in a new process (e.g., to reseed its CSPRNG, see random.hpp).
+	uint64_t randomGeneration;
+};
+
 struct ManagarmProcessData {
 	HelHandle posixLane;
 	HelHandle mbusLane;
 	void *threadPage;
 	HelHandle *fileTable;
 	void *clockTrackerPage;
+	// Kernel clock page (see helMapClockPage()).
+	void *clockPage;
 };
 
 struct ManagarmServerData {
 	HelHandle controlLane;
 };
 
+// Options of netlink sockets (for PT_SET_OPTION), in addition to SO_PASSCRED.
+// setsockopt(SOL_NETLINK, NETLINK_{ADD,DROP}_MEMBERSHIP) maps to the membership options.
+// The uevent filters replace the BPF filters that libudev attaches to its monitors:
+// if a socket has filters, it only receives multicast uevents whose subsystem
+// (and devtype, if the filter has one) match one of the filters.
+enum NetlinkOption : int {
+	// Value: the group to join or to leave.
+	nlAddMembership = 0x10001,
+	nlDropMembership = 0x10002,
+	// Value: libudev's hash (MurmurHash2) of the subsystem. Adds a filter.
+	nlUeventFilterSubsystem = 0x10003,
+	// Value: libudev's hash of the devtype. Restricts the most recently added filter.
+	nlUeventFilterDevtype = 0x10004,
+	// Removes all filters.
+	nlUeventFilterReset = 0x10005
+};
+
 } // namespace posix
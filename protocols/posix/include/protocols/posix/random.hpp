@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <hel.h>
+#include <hel-syscalls.h>
+
+#include "data.hpp"
+
+namespace posix {
+
+// ChaCha20-based CSPRNG that implements getrandom() in user space without a syscall
+// (or a posix request) per call. Each thread keeps its own RandomState (e.g., in TLS).
+//
+// The key is seeded by helGetRandomBytes(). It is reseeded after reseedInterval bytes
+// and whenever ThreadPage::randomGeneration changes, i.e., after fork() (the child
+// must never repeat the parent's output). Refills use fast key erasure: every refill
+// replaces the key, so a leaked state does not reveal earlier output.
+//
+// getRandom() is not async-signal-safe with respect to the same RandomState.
+struct RandomState {
+	static constexpr size_t numBlocks = 8;
+	static constexpr uint64_t reseedInterval = UINT64_C(1) << 20;
+
+	uint32_t key[8];
+	// Zero if the state was never seeded (thread pages start at generation 1).
+	uint64_t generation = 0;
+	// Number of bytes returned since the last reseed.
+	uint64_t output = 0;
+	// The first 32 bytes of each refill become the next key.
+	uint8_t buffer[numBlocks * 64 - 32];
+	// Unused bytes at the end of buffer.
+	size_t available = 0;
+};
+
+namespace random_detail {
+
+inline uint32_t rotl(uint32_t x, int n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+inline void quarterRound(uint32_t *x, int a, int b, int c, int d) {
+	x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+	x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+	x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+	x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+}
+
+// Computes the ChaCha20 block for the given key and block counter (with a zero nonce).
+inline void chachaBlock(const uint32_t *key, uint64_t counter, uint8_t *out) {
+	uint32_t input[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), 0, 0
+	};
+
+	uint32_t x[16];
+	memcpy(x, input, sizeof(x));
+	for(int i = 0; i < 10; i++) {
+		quarterRound(x, 0, 4, 8, 12);
+		quarterRound(x, 1, 5, 9, 13);
+		quarterRound(x, 2, 6, 10, 14);
+		quarterRound(x, 3, 7, 11, 15);
+		quarterRound(x, 0, 5, 10, 15);
+		quarterRound(x, 1, 6, 11, 12);
+		quarterRound(x, 2, 7, 8, 13);
+		quarterRound(x, 3, 4, 9, 14);
+	}
+
+	for(int i = 0; i < 16; i++) {
+		uint32_t v = x[i] + input[i];
+		out[4 * i] = v;
+		out[4 * i + 1] = v >> 8;
+		out[4 * i + 2] = v >> 16;
+		out[4 * i + 3] = v >> 24;
+	}
+	memset(x, 0, sizeof(x));
+}
+
+inline void reseed(RandomState &state, uint64_t generation) {
+	uint8_t seed[32];
+	size_t progress = 0;
+	while(progress < sizeof(seed)) {
+		size_t chunk;
+		HEL_CHECK(helGetRandomBytes(seed + progress, sizeof(seed) - progress, &chunk));
+		progress += chunk;
+	}
+	memcpy(state.key, seed, sizeof(seed));
+	memset(seed, 0, sizeof(seed));
+
+	// Drop buffered bytes; after fork(), the parent might return them, too.
+	memset(state.buffer, 0, sizeof(state.buffer));
+	state.available = 0;
+	state.generation = generation;
+	state.output = 0;
+}
+
+inline void refill(RandomState &state) {
+	uint8_t blocks[RandomState::numBlocks * 64];
+	for(size_t i = 0; i < RandomState::numBlocks; i++)
+		chachaBlock(state.key, i, blocks + i * 64);
+
+	memcpy(state.key, blocks, sizeof(state.key));
+	memcpy(state.buffer, blocks + sizeof(state.key), sizeof(state.buffer));
+	memset(blocks, 0, sizeof(blocks));
+	state.available = sizeof(state.buffer);
+}
+
+} // namespace random_detail
+
+// Fills buffer with random bytes. page is the calling thread's ThreadPage.
+inline void getRandom(RandomState &state, const ThreadPage *page, void *buffer, size_t size) {
+	auto generation = __atomic_load_n(&page->randomGeneration, __ATOMIC_RELAXED);
+	if(generation != state.generation || state.output >= RandomState::reseedInterval)
+		random_detail::reseed(state, generation);
+
+	auto p = static_cast<uint8_t *>(buffer);
+	while(size) {
+		if(!state.available)
+			random_detail::refill(state);
+
+		auto offset = sizeof(state.buffer) - state.available;
+		auto chunk = size < state.available ? size : state.available;
+		memcpy(p, state.buffer + offset, chunk);
+		// Do not keep bytes that were already returned.
+		memset(state.buffer + offset, 0, chunk);
+		state.available -= chunk;
+		state.output += chunk;
+		p += chunk;
+		size -= chunk;
+	}
+}
+
+} // namespace posix
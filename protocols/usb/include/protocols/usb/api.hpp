@@ -1,8 +1,14 @@
 #pragma once
 
+#include <deque>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <span>
+#include <vector>
 
 #include <arch/dma_structs.hpp>
+#include <async/recurring-event.hpp>
 #include <async/result.hpp>
 #include <frg/expected.hpp>
 
@@ -42,12 +48,36 @@ struct InterruptTransfer {
 struct BulkTransfer {
 	BulkTransfer(XferFlags flags, arch::dma_buffer_view buffer)
 	: flags{flags}, buffer{buffer},
-			allowShortPackets{false}, lazyNotification{false} { }
+			allowShortPackets{false}, lazyNotification{false}, streamId{0} { }
+
+	// Scatter-gather transfer: the buffers are transferred back-to-back,
+	// i.e., the device sees a single transfer.
+	BulkTransfer(XferFlags flags, std::vector<arch::dma_buffer_view> scatter)
+	: flags{flags}, scatter{std::move(scatter)},
+			allowShortPackets{false}, lazyNotification{false}, streamId{0} { }
+
+	// Returns the buffers that make up the transfer.
+	std::span<const arch::dma_buffer_view> segments() const {
+		if(!scatter.empty())
+			return scatter;
+		return {&buffer, 1};
+	}
+
+	size_t size() const {
+		size_t n = 0;
+		for(auto &segment : segments())
+			n += segment.size();
+		return n;
+	}
 
 	XferFlags flags;
+	// Unused for scatter-gather transfers.
 	arch::dma_buffer_view buffer;
+	std::vector<arch::dma_buffer_view> scatter;
 	bool allowShortPackets;
 	bool lazyNotification;
+	// Stream that the transfer is queued on. Zero if the endpoint does not use streams.
+	uint16_t streamId;
 };
 
 enum class PipeType {
@@ -66,6 +96,10 @@ public:
 	virtual async::result<frg::expected<UsbError>> transfer(ControlTransfer info) = 0;
 	virtual async::result<frg::expected<UsbError, size_t>> transfer(InterruptTransfer info) = 0;
 	virtual async::result<frg::expected<UsbError, size_t>> transfer(BulkTransfer info) = 0;
+
+	// Allocates streams 1 to n of a bulk endpoint and returns n. Returns zero
+	// if either the host controller or the endpoint does not support streams.
+	virtual async::result<frg::expected<UsbError, size_t>> allocateStreams(size_t count);
 };
 
 
@@ -75,11 +109,61 @@ struct Endpoint {
 	async::result<frg::expected<UsbError>> transfer(ControlTransfer info) const;
 	async::result<frg::expected<UsbError, size_t>> transfer(InterruptTransfer info) const;
 	async::result<frg::expected<UsbError, size_t>> transfer(BulkTransfer info) const;
+	async::result<frg::expected<UsbError, size_t>> allocateStreams(size_t count) const;
 
 private:
 	std::shared_ptr<EndpointData> _state;
 };
 
+// ----------------------------------------------------------------------------
+// TransferQueue
+// ----------------------------------------------------------------------------
+
+// Keeps multiple transfers in flight on an endpoint, such that the host
+// controller can process them back-to-back. Callbacks are invoked in the order
+// in which the transfers were submitted.
+// The queue must be drained before it is destructed.
+struct TransferQueue {
+	using Callback = std::function<void(frg::expected<UsbError, size_t>)>;
+
+	TransferQueue(Endpoint endpoint, size_t maxInFlight);
+
+	TransferQueue(const TransferQueue &) = delete;
+	TransferQueue &operator=(const TransferQueue &) = delete;
+
+	// Suspends while maxInFlight transfers are outstanding. The buffers
+	// of the transfer must remain valid until its callback is invoked.
+	async::result<void> submit(BulkTransfer info, Callback callback);
+	async::result<void> submit(InterruptTransfer info, Callback callback);
+
+	// Waits until all callbacks have been invoked.
+	async::result<void> drain();
+
+	size_t inFlight() const {
+		return _pending.size();
+	}
+
+private:
+	struct Pending {
+		Callback callback;
+		std::optional<frg::expected<UsbError, size_t>> outcome;
+	};
+
+	// Waits for a free slot and appends a new pending transfer.
+	async::result<std::shared_ptr<Pending>> _enqueue(Callback callback);
+
+	template<typename Transfer>
+	async::detached _run(std::shared_ptr<Pending> pending, Transfer info);
+
+	// Invokes the callbacks of all transfers at the front of the queue that completed.
+	void _retire();
+
+	Endpoint _endpoint;
+	size_t _maxInFlight;
+	std::deque<std::shared_ptr<Pending>> _pending;
+	async::recurring_event _progress;
+};
+
 // ----------------------------------------------------------------------------
 // InterfaceData
 // ----------------------------------------------------------------------------
@@ -47,6 +47,8 @@ namespace request_type {
 		setDescriptor = 0x07,
 		getConfig = 0x08,
 		setConfig = 0x09,
+		getInterface = 0x0A,
+		setInterface = 0x0B,
 
 		// TODO: Move non-standard features to some other location.
 		getReport = 0x01
@@ -60,6 +62,7 @@ namespace descriptor_type {
 		string = 0x03,
 		interface = 0x04,
 		endpoint = 0x05,
+		endpointCompanion = 0x30,
 
 		// TODO: Put non-standard descriptors somewhere else.
 		hid = 0x21,
@@ -115,6 +118,13 @@ struct [[ gnu::packed ]] EndpointDescriptor : public DescriptorBase {
 	uint8_t interval;
 };
 
+// Follows the endpoint descriptor on SuperSpeed devices.
+struct [[ gnu::packed ]] EndpointCompanionDescriptor : public DescriptorBase {
+	uint8_t maxBurst;
+	uint8_t attributes; // For bulk endpoints, bits 0-4 are log2 of the number of streams.
+	uint16_t bytesPerInterval;
+};
+
 enum class EndpointType {
 	control = 0,
 	isochronous,
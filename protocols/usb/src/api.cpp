@@ -1,4 +1,6 @@
 
+#include <assert.h>
+
 #include "protocols/usb/api.hpp"
 
 // ----------------------------------------------------------------------------
@@ -56,6 +58,10 @@ Interface::getEndpoint(PipeType type, int number) const {
 // Endpoint.
 // ----------------------------------------------------------------------------
 
+async::result<frg::expected<UsbError, size_t>> EndpointData::allocateStreams(size_t) {
+	co_return size_t{0};
+}
+
 Endpoint::Endpoint(std::shared_ptr<EndpointData> state)
 : _state(std::move(state)) { }
 
@@ -67,3 +73,61 @@ async::result<frg::expected<UsbError, size_t>> Endpoint::transfer(BulkTransfer i
 	return _state->transfer(info);
 }
 
+async::result<frg::expected<UsbError, size_t>> Endpoint::allocateStreams(size_t count) const {
+	return _state->allocateStreams(count);
+}
+
+// ----------------------------------------------------------------------------
+// TransferQueue.
+// ----------------------------------------------------------------------------
+
+TransferQueue::TransferQueue(Endpoint endpoint, size_t maxInFlight)
+: _endpoint{std::move(endpoint)}, _maxInFlight{maxInFlight} {
+	assert(maxInFlight);
+}
+
+async::result<std::shared_ptr<TransferQueue::Pending>>
+TransferQueue::_enqueue(Callback callback) {
+	while(_pending.size() >= _maxInFlight)
+		co_await _progress.async_wait();
+
+	auto pending = std::make_shared<Pending>();
+	pending->callback = std::move(callback);
+	_pending.push_back(pending);
+	co_return pending;
+}
+
+template<typename Transfer>
+async::detached TransferQueue::_run(std::shared_ptr<Pending> pending, Transfer info) {
+	pending->outcome = co_await _endpoint.transfer(std::move(info));
+	_retire();
+}
+
+async::result<void> TransferQueue::submit(BulkTransfer info, Callback callback) {
+	auto pending = co_await _enqueue(std::move(callback));
+	_run(std::move(pending), std::move(info));
+}
+
+async::result<void> TransferQueue::submit(InterruptTransfer info, Callback callback) {
+	auto pending = co_await _enqueue(std::move(callback));
+	_run(std::move(pending), std::move(info));
+}
+
+async::result<void> TransferQueue::drain() {
+	while(!_pending.empty())
+		co_await _progress.async_wait();
+}
+
+void TransferQueue::_retire() {
+	// Transfers on the same endpoint complete in order, but the completions
+	// may be observed out of order (e.g., if responses travel over IPC).
+	bool progress = false;
+	while(!_pending.empty() && _pending.front()->outcome) {
+		auto front = std::move(_pending.front());
+		_pending.pop_front();
+		front->callback(std::move(*front->outcome));
+		progress = true;
+	}
+	if(progress)
+		_progress.raise();
+}
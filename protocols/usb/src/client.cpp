@@ -1,6 +1,8 @@
 
+#include <algorithm>
 #include <memory>
 #include <iostream>
+#include <vector>
 
 #include <string.h>
 
@@ -60,6 +62,7 @@ struct EndpointState final : EndpointData {
 	async::result<frg::expected<UsbError>> transfer(ControlTransfer info) override;
 	async::result<frg::expected<UsbError, size_t>> transfer(InterruptTransfer info) override;
 	async::result<frg::expected<UsbError, size_t>> transfer(BulkTransfer info) override;
+	async::result<frg::expected<UsbError, size_t>> allocateStreams(size_t count) override;
 
 private:
 	helix::UniqueLane _lane;
@@ -275,9 +278,23 @@ async::result<frg::expected<UsbError, size_t>> EndpointState::transfer(Interrupt
 }
 
 async::result<frg::expected<UsbError, size_t>> EndpointState::transfer(BulkTransfer info) {
+	// The server receives a single buffer; gather scatter-gather transfers here.
+	std::vector<char> linear;
+	if(info.segments().size() > 1)
+		linear.resize(info.size());
+
 	if(info.flags == kXferToDevice) {
 		assert(info.flags == kXferToDevice);
 		assert(!info.allowShortPackets);
+
+		if(!linear.empty()) {
+			size_t offset = 0;
+			for(auto &segment : info.segments()) {
+				memcpy(linear.data() + offset, segment.data(), segment.size());
+				offset += segment.size();
+			}
+			info.buffer = arch::dma_buffer_view{nullptr, linear.data(), linear.size()};
+		}
 	
 		helix::Offer offer;
 		helix::SendBuffer send_req;
@@ -288,6 +305,7 @@ async::result<frg::expected<UsbError, size_t>> EndpointState::transfer(BulkTrans
 		req.set_req_type(managarm::usb::CntReqType::BULK_TRANSFER_TO_DEVICE);
 		req.set_length(info.buffer.size());
 		req.set_lazy_notification(info.lazyNotification);
+		req.set_stream_id(info.streamId);
 		
 		auto ser = req.SerializeAsString();
 		auto &&transmit = helix::submitAsync(_lane, helix::Dispatcher::global(),
@@ -315,16 +333,19 @@ async::result<frg::expected<UsbError, size_t>> EndpointState::transfer(BulkTrans
 
 		managarm::usb::CntRequest req;
 		req.set_req_type(managarm::usb::CntReqType::BULK_TRANSFER_TO_HOST);
-		req.set_length(info.buffer.size());
+		req.set_length(info.size());
 		req.set_allow_short(info.allowShortPackets);
 		req.set_lazy_notification(info.lazyNotification);
+		req.set_stream_id(info.streamId);
 		
 		auto ser = req.SerializeAsString();
 		auto &&transmit = helix::submitAsync(_lane, helix::Dispatcher::global(),
 				helix::action(&offer, kHelItemAncillary),
 				helix::action(&send_req, ser.data(), ser.size(), kHelItemChain),
 				helix::action(&recv_resp, kHelItemChain),
-				helix::action(&recv_data, info.buffer.data(), info.buffer.size()));
+				linear.empty()
+					? helix::action(&recv_data, info.buffer.data(), info.buffer.size())
+					: helix::action(&recv_data, linear.data(), linear.size()));
 		co_await transmit.async_wait();
 		HEL_CHECK(offer.error());
 		HEL_CHECK(send_req.error());
@@ -334,10 +355,45 @@ async::result<frg::expected<UsbError, size_t>> EndpointState::transfer(BulkTrans
 		managarm::usb::SvrResponse resp;
 		resp.ParseFromArray(recv_resp.data(), recv_resp.length());
 		assert(resp.error() == managarm::usb::Errors::SUCCESS);
+
+		if(!linear.empty()) {
+			size_t offset = 0;
+			for(auto &segment : info.segments()) {
+				if(offset >= recv_data.actualLength())
+					break;
+				auto chunk = std::min(segment.size(), recv_data.actualLength() - offset);
+				memcpy(segment.data(), linear.data() + offset, chunk);
+				offset += chunk;
+			}
+		}
 		co_return recv_data.actualLength();
 	}
 }
 
+async::result<frg::expected<UsbError, size_t>> EndpointState::allocateStreams(size_t count) {
+	helix::Offer offer;
+	helix::SendBuffer send_req;
+	helix::RecvInline recv_resp;
+
+	managarm::usb::CntRequest req;
+	req.set_req_type(managarm::usb::CntReqType::ALLOCATE_STREAMS);
+	req.set_number(count);
+
+	auto ser = req.SerializeAsString();
+	auto &&transmit = helix::submitAsync(_lane, helix::Dispatcher::global(),
+			helix::action(&offer, kHelItemAncillary),
+			helix::action(&send_req, ser.data(), ser.size(), kHelItemChain),
+			helix::action(&recv_resp));
+	co_await transmit.async_wait();
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::usb::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	assert(resp.error() == managarm::usb::Errors::SUCCESS);
+	co_return resp.size();
+}
 
 } // anonymous namespace
 
@@ -8,6 +8,117 @@
 namespace protocols {
 namespace usb {
 
+namespace {
+
+// Requests are handled concurrently such that drivers can keep
+// multiple transfers (e.g., on different streams) in flight.
+async::detached handleEndpointRequest(Endpoint endpoint, helix::UniqueDescriptor conversation,
+		managarm::usb::CntRequest req) {
+	if(req.req_type() == managarm::usb::CntReqType::INTERRUPT_TRANSFER_TO_HOST) {
+		helix::SendBuffer send_resp;
+		helix::SendBuffer send_data;
+
+		// FIXME: Fill in the correct DMA pool.
+		arch::dma_buffer buffer{nullptr, static_cast<size_t>(req.length())};
+		InterruptTransfer transfer{XferFlags::kXferToHost, buffer};
+		transfer.allowShortPackets = req.allow_short();
+		transfer.lazyNotification = req.lazy_notification();
+		auto outcome = co_await endpoint.transfer(transfer);
+		assert(outcome);
+		auto length = outcome.value();
+
+		managarm::usb::SvrResponse resp;
+		resp.set_error(managarm::usb::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+				helix::action(&send_data, buffer.data(), length));
+		co_await transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(send_data.error());
+	}else if(req.req_type() == managarm::usb::CntReqType::BULK_TRANSFER_TO_DEVICE) {
+		helix::RecvBuffer recv_buffer;
+		helix::SendBuffer send_resp;
+
+		// FIXME: Fill in the correct DMA pool.
+		arch::dma_buffer buffer{nullptr, static_cast<size_t>(req.length())};
+		auto &&payload = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&recv_buffer, buffer.data(), buffer.size()));
+		co_await payload.async_wait();
+		HEL_CHECK(recv_buffer.error());
+
+		BulkTransfer transfer{XferFlags::kXferToDevice, buffer};
+		transfer.lazyNotification = req.lazy_notification();
+		transfer.streamId = req.stream_id();
+		auto outcome = co_await endpoint.transfer(transfer);
+		assert(outcome);
+		auto length = outcome.value();
+
+		managarm::usb::SvrResponse resp;
+		resp.set_error(managarm::usb::Errors::SUCCESS);
+		resp.set_size(length);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		co_await transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::usb::CntReqType::BULK_TRANSFER_TO_HOST) {
+		helix::SendBuffer send_resp;
+		helix::SendBuffer send_data;
+
+		// FIXME: Fill in the correct DMA pool.
+		arch::dma_buffer buffer{nullptr, static_cast<size_t>(req.length())};
+		BulkTransfer transfer{XferFlags::kXferToHost, buffer};
+		transfer.allowShortPackets = req.allow_short();
+		transfer.lazyNotification = req.lazy_notification();
+		transfer.streamId = req.stream_id();
+		auto outcome = co_await endpoint.transfer(transfer);
+		assert(outcome);
+		auto length = outcome.value();
+
+		managarm::usb::SvrResponse resp;
+		resp.set_error(managarm::usb::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
+				helix::action(&send_data, buffer.data(), length));
+		co_await transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(send_data.error());
+	}else if(req.req_type() == managarm::usb::CntReqType::ALLOCATE_STREAMS) {
+		helix::SendBuffer send_resp;
+
+		auto outcome = co_await endpoint.allocateStreams(req.number());
+		assert(outcome);
+
+		managarm::usb::SvrResponse resp;
+		resp.set_error(managarm::usb::Errors::SUCCESS);
+		resp.set_size(outcome.value());
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		co_await transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}else{
+		helix::SendBuffer send_resp;
+
+		managarm::usb::SvrResponse resp;
+		resp.set_error(managarm::usb::Errors::ILLEGAL_REQUEST);
+
+		auto ser = resp.SerializeAsString();
+		auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
+				helix::action(&send_resp, ser.data(), ser.size()));
+		co_await transmit.async_wait();
+		HEL_CHECK(send_resp.error());
+	}
+}
+
+} // anonymous namespace
+
 async::detached serveEndpoint(Endpoint endpoint, helix::UniqueLane lane) {
 	while(true) {
 		helix::Accept accept;
@@ -28,90 +139,7 @@ async::detached serveEndpoint(Endpoint endpoint, helix::UniqueLane lane) {
 		managarm::usb::CntRequest req;
 		req.ParseFromArray(recv_req.data(), recv_req.length());
 
-		if(req.req_type() == managarm::usb::CntReqType::INTERRUPT_TRANSFER_TO_HOST) {
-			helix::SendBuffer send_resp;
-			helix::SendBuffer send_data;
-
-			// FIXME: Fill in the correct DMA pool.
-			arch::dma_buffer buffer{nullptr, static_cast<size_t>(req.length())};
-			InterruptTransfer transfer{XferFlags::kXferToHost, buffer};
-			transfer.allowShortPackets = req.allow_short();
-			transfer.lazyNotification = req.lazy_notification();
-			auto outcome = co_await endpoint.transfer(transfer);
-			assert(outcome);
-			auto length = outcome.value();
-
-			managarm::usb::SvrResponse resp;
-			resp.set_error(managarm::usb::Errors::SUCCESS);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
-					helix::action(&send_data, buffer.data(), length));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-			HEL_CHECK(send_data.error());
-		}else if(req.req_type() == managarm::usb::CntReqType::BULK_TRANSFER_TO_DEVICE) {
-			helix::RecvBuffer recv_buffer;
-			helix::SendBuffer send_resp;
-
-			// FIXME: Fill in the correct DMA pool.
-			arch::dma_buffer buffer{nullptr, static_cast<size_t>(req.length())};
-			auto &&payload = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&recv_buffer, buffer.data(), buffer.size()));
-			co_await payload.async_wait();
-			HEL_CHECK(recv_buffer.error());
-
-			BulkTransfer transfer{XferFlags::kXferToDevice, buffer};
-			transfer.lazyNotification = req.lazy_notification();
-			auto outcome = co_await endpoint.transfer(transfer);
-			assert(outcome);
-			auto length = outcome.value();
-
-			managarm::usb::SvrResponse resp;
-			resp.set_error(managarm::usb::Errors::SUCCESS);
-			resp.set_size(length);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}else if(req.req_type() == managarm::usb::CntReqType::BULK_TRANSFER_TO_HOST) {
-			helix::SendBuffer send_resp;
-			helix::SendBuffer send_data;
-
-			// FIXME: Fill in the correct DMA pool.
-			arch::dma_buffer buffer{nullptr, static_cast<size_t>(req.length())};
-			BulkTransfer transfer{XferFlags::kXferToHost, buffer};
-			transfer.allowShortPackets = req.allow_short();
-			transfer.lazyNotification = req.lazy_notification();
-			auto outcome = co_await endpoint.transfer(transfer);
-			assert(outcome);
-			auto length = outcome.value();
-
-			managarm::usb::SvrResponse resp;
-			resp.set_error(managarm::usb::Errors::SUCCESS);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size(), kHelItemChain),
-					helix::action(&send_data, buffer.data(), length));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-			HEL_CHECK(send_data.error());
-		}else{
-			helix::SendBuffer send_resp;
-
-			managarm::usb::SvrResponse resp;
-			resp.set_error(managarm::usb::Errors::ILLEGAL_REQUEST);
-
-			auto ser = resp.SerializeAsString();
-			auto &&transmit = helix::submitAsync(conversation, helix::Dispatcher::global(),
-					helix::action(&send_resp, ser.data(), ser.size()));
-			co_await transmit.async_wait();
-			HEL_CHECK(send_resp.error());
-		}
+		handleEndpointRequest(endpoint, std::move(conversation), std::move(req));
 	}
 }
 
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <arch/dma_pool.hpp>
+#include <cstdint>
+#include <unordered_set>
+
+namespace nic {
+
+//! Recycles fixed-size DMA buffers for frames. Buffers are obtained by
+//! splitting pages of the backing pool; they are never returned to it.
+//! Allocations that do not fit into a buffer (or that exceed the capacity
+//! of the pool) are forwarded to the backing pool.
+//! Pools are not thread-safe; each one must only be used by one worker.
+struct BufferPool final : arch::dma_pool {
+	static constexpr size_t bufferSize = 2048;
+	static constexpr size_t pageSize = 4096;
+
+	struct Stats {
+		uint64_t allocations = 0;
+		//! Pages that were taken from the backing pool and split
+		uint64_t pages = 0;
+		//! Allocations that were larger than bufferSize
+		uint64_t oversized = 0;
+		//! Allocations that were forwarded since all buffers were in use
+		uint64_t exhausted = 0;
+	};
+
+	//! capacity is the maximal number of buffers
+	BufferPool(arch::dma_pool *backing, size_t capacity);
+
+	BufferPool(const BufferPool &) = delete;
+	BufferPool &operator=(const BufferPool &) = delete;
+
+	void *allocate(size_t size, size_t count, size_t align) override;
+	void deallocate(void *pointer, size_t size, size_t count, size_t align) override;
+
+	const Stats &stats() const {
+		return stats_;
+	}
+
+	//! Number of buffers that are currently handed out
+	size_t inUse() const {
+		return inUse_;
+	}
+
+private:
+	struct FreeBuffer {
+		FreeBuffer *next;
+	};
+
+	arch::dma_pool *backing_;
+	size_t maxPages_;
+	// Pages that were split into buffers.
+	std::unordered_set<uintptr_t> pages_;
+	FreeBuffer *freeList_ = nullptr;
+	size_t inUse_ = 0;
+	Stats stats_;
+};
+
+} // namespace nic
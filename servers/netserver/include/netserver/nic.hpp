@@ -3,6 +3,8 @@
 #include <arch/dma_pool.hpp>
 #include <async/result.hpp>
 #include <cstdint>
+#include <optional>
+#include <netserver/buffer-pool.hpp>
 
 namespace nic {
 struct MacAddress {
@@ -34,7 +36,35 @@ enum EtherType : uint16_t {
 	ETHER_TYPE_ARP = 0x0806,
 };
 
-// TODO(arsen): Expose interface for csum offloading, constructing frames, and
+//! Asks the device to compute the one's complement checksum from start to the
+//! end of the frame and to store it at start + offset. The checksum field
+//! must contain the (uncomplemented) sum of the pseudo header.
+struct ChecksumOffload {
+	size_t start;
+	size_t offset;
+};
+
+//! Asks the device to split a TCP/IPv4 super-packet into segments carrying
+//! mss bytes of payload each; requires checksum offloading. headerLength
+//! covers all headers in front of the TCP payload.
+struct SegmentationOffload {
+	size_t mss;
+	size_t headerLength;
+};
+
+struct ReceivedFrame {
+	arch::dma_buffer buffer;
+	//! The device verified the TCP/UDP checksum of the frame
+	bool checksumValidated = false;
+};
+
+//! Upper bound on the number of queues that netserver runs a worker for
+inline constexpr unsigned int maxQueues = 4;
+
+//! Number of buffers in the pool that allocateFrame() uses
+inline constexpr size_t txPoolCapacity = 512;
+
+// TODO(arsen): Expose interface for constructing frames, and
 // other features of NICs
 struct Link {
 	struct AllocatedBuffer {
@@ -42,22 +72,44 @@ struct Link {
 		arch::dma_buffer_view payload;
 	};
 	inline Link(unsigned int mtu, arch::dma_pool *dmaPool)
-		: mtu(mtu), dmaPool_(dmaPool) {}
+		: mtu(mtu), dmaPool_(dmaPool), txPool_(dmaPool, txPoolCapacity) {}
 	virtual ~Link() = default;
-	//! Receives an entire frame from the network
-	virtual async::result<void> receive(arch::dma_buffer_view) = 0;
-	//! Sends an entire ethernet frame
-	virtual async::result<void> send(const arch::dma_buffer_view) = 0;
+	//! Receives an entire frame from one of the receive queues
+	virtual async::result<ReceivedFrame> receive(unsigned int queue) = 0;
+	//! Whether receive() can return a frame without waiting for the device
+	virtual bool hasPendingFrames(unsigned int) {
+		return false;
+	}
+	//! Sends an entire ethernet frame; csum (gso) may only be passed if
+	//! txChecksumOffload (tcpSegmentationOffload) is set. May return before
+	//! the frame is sent.
+	virtual async::result<void> send(arch::dma_buffer frame,
+		std::optional<ChecksumOffload> csum = std::nullopt,
+		std::optional<SegmentationOffload> gso = std::nullopt) = 0;
 	arch::dma_pool *dmaPool();
+	//! Allocates frames from txPool()
 	AllocatedBuffer allocateFrame(MacAddress to, EtherType type,
 		size_t payloadSize);
+	BufferPool &txPool();
+	//! Pool of the receive buffers of a queue, if the driver recycles them
+	virtual BufferPool *rxPool(unsigned int) {
+		return nullptr;
+	}
 
 	MacAddress deviceMac();
 	unsigned int mtu;
+	//! Number of receive queues (at most maxQueues), set by the driver
+	unsigned int numQueues = 1;
+	//! Capabilities of the device, set by the driver
+	bool txChecksumOffload = false;
+	bool rxChecksumOffload = false;
+	bool tcpSegmentationOffload = false;
 protected:
 	arch::dma_pool *dmaPool_;
+	BufferPool txPool_;
 	MacAddress mac_;
 };
 
-async::detached runDevice(std::shared_ptr<Link> dev);
+//! Starts one receive worker per queue of the device
+void runDevice(std::shared_ptr<Link> dev);
 } // namespace nic
@@ -0,0 +1,56 @@
+#include <netserver/buffer-pool.hpp>
+
+#include <iostream>
+
+namespace nic {
+
+BufferPool::BufferPool(arch::dma_pool *backing, size_t capacity)
+: backing_{backing}, maxPages_{(capacity * bufferSize + pageSize - 1) / pageSize} { }
+
+void *BufferPool::allocate(size_t size, size_t count, size_t align) {
+	stats_.allocations++;
+	if(size * count > bufferSize || align > bufferSize) {
+		stats_.oversized++;
+		return backing_->allocate(size, count, align);
+	}
+
+	if(!freeList_) {
+		if(pages_.size() == maxPages_) {
+			if(!stats_.exhausted)
+				std::cout << "netserver: Buffer pool is exhausted, falling back to"
+						" the generic DMA pool" << std::endl;
+			stats_.exhausted++;
+			return backing_->allocate(size, count, align);
+		}
+
+		// Buffers are aligned to their size and thus never cross a page boundary.
+		auto page = reinterpret_cast<char *>(backing_->allocate(pageSize, 1, pageSize));
+		pages_.insert(reinterpret_cast<uintptr_t>(page));
+		stats_.pages++;
+		for(size_t offset = pageSize; offset; offset -= bufferSize) {
+			auto buffer = reinterpret_cast<FreeBuffer *>(page + offset - bufferSize);
+			buffer->next = freeList_;
+			freeList_ = buffer;
+		}
+	}
+
+	auto buffer = freeList_;
+	freeList_ = buffer->next;
+	inUse_++;
+	return buffer;
+}
+
+void BufferPool::deallocate(void *pointer, size_t size, size_t count, size_t align) {
+	auto page = reinterpret_cast<uintptr_t>(pointer) & ~(pageSize - 1);
+	if(!pages_.contains(page)) {
+		backing_->deallocate(pointer, size, count, align);
+		return;
+	}
+
+	auto buffer = reinterpret_cast<FreeBuffer *>(pointer);
+	buffer->next = freeList_;
+	freeList_ = buffer;
+	inUse_--;
+}
+
+} // namespace nic
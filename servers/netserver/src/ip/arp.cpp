@@ -3,6 +3,7 @@
 #include <helix/ipc.hpp>
 #include <helix/timer.hpp>
 #include <arch/bit.hpp>
+#include <cassert>
 #include <cstring>
 #include <iomanip>
 #include "ip4.hpp"
@@ -135,59 +136,96 @@ Neighbours::Entry &Neighbours::getEntry(uint32_t ip) {
 	uint64_t time;
 	HEL_CHECK(helGetClock(&time));
 	if (auto f = table_.find(ip); f != table_.end()) {
-		if (time + staleTimeMs * 1'000'000 <= f->second.mtime_ns) {
-			f->second.state = State::stale;
+		auto &entry = f->second;
+		if (entry.state == State::reachable
+				&& time >= entry.mtime_ns + staleTimeMs * 1'000'000) {
+			entry.state = State::stale;
 		}
-		return f->second;
+		return entry;
 	}
-	auto &entry = table_.emplace(std::piecewise_construct,
+	return table_.emplace(std::piecewise_construct,
 		std::make_tuple(ip), std::make_tuple()).first->second;
-	entry.mtime_ns = time;
-	return entry;
 }
 
 void Neighbours::updateTable(uint32_t ip, nic::MacAddress mac) {
 	auto &entry = getEntry(ip);
+	HEL_CHECK(helGetClock(&entry.mtime_ns));
 	entry.mac = mac;
 	entry.state = State::reachable;
 	entry.change.raise();
+
+	auto pending = std::move(entry.pending);
+	entry.pending.clear();
+	for (auto &packet : pending)
+		packet(mac);
 }
 
 namespace {
+// Sends broadcast requests if the entry is incomplete and unicast requests
+// to the known address otherwise.
 async::detached entryProber(uint32_t ip, Neighbours::Entry &e, uint32_t sender) {
-	e.state = Neighbours::State::probe;
-	for (int i = 0; i < 3; i++) {
-		co_await sendArp(1, sender, {}, ip);
-		std::cout << "netserver: sent arp req" << std::endl;
+	auto probeState = e.state;
+	nic::MacAddress target;
+	if (probeState == Neighbours::State::probe)
+		target = e.mac;
+
+	for (int i = 0; i < Neighbours::maxProbes; i++) {
+		co_await sendArp(1, sender, target, ip);
 
 		async::cancellation_event ev;
 		helix::TimeoutCancellation timer { 1'000'000'000, ev };
 		co_await e.change.async_wait(ev);
 		co_await timer.retire();
 
-		if (e.state != Neighbours::State::probe) {
+		if (e.state != probeState) {
 			co_return;
 		}
 	}
+	std::cout << "netserver: Neighbour " << std::hex << ip << std::dec
+		<< " is unreachable" << std::endl;
 	e.state = Neighbours::State::failed;
+	e.pending.clear();
 	e.change.raise();
 }
 } // namespace
 
-async::result<std::optional<nic::MacAddress>> Neighbours::tryResolve(uint32_t ip,
-		uint32_t sender) {
+std::optional<nic::MacAddress> Neighbours::lookup(uint32_t ip, uint32_t sender) {
+	uint64_t time;
+	HEL_CHECK(helGetClock(&time));
 	auto &entry = getEntry(ip);
-	if (entry.state == State::reachable) {
-		co_return entry.mac;
-	}
-	if (entry.state != State::probe) {
+	switch (entry.state) {
+	case State::reachable:
+		if (time < entry.mtime_ns + refreshTimeMs * 1'000'000)
+			return entry.mac;
+		[[fallthrough]];
+	case State::stale:
+		// Keep using the address while we confirm it.
+		entry.state = State::probe;
 		entryProber(ip, entry, sender);
+		return entry.mac;
+	case State::probe:
+		return entry.mac;
+	case State::none:
+	case State::failed:
+		entry.state = State::incomplete;
+		entryProber(ip, entry, sender);
+		return std::nullopt;
+	case State::incomplete:
+		return std::nullopt;
 	}
-	co_await entry.change.async_wait();
-	if (entry.state != State::reachable) {
-		co_return std::nullopt;
-	}
-	co_return entry.mac;
+	__builtin_unreachable();
+}
+
+void Neighbours::enqueue(uint32_t ip, PendingPacket packet) {
+	auto &entry = getEntry(ip);
+	assert(entry.state == State::incomplete);
+	if (entry.pending.size() == maxPending)
+		entry.pending.pop_front();
+	entry.pending.push_back(std::move(packet));
+}
+
+void Neighbours::announce(uint32_t ip) {
+	async::detach(sendArp(1, ip, {}, ip));
 }
 
 Neighbours &neigh4() {
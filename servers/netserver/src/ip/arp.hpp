@@ -2,31 +2,57 @@
 
 #include <async/recurring-event.hpp>
 #include <netserver/nic.hpp>
-#include <map>
+#include <deque>
+#include <functional>
 #include <optional>
+#include <unordered_map>
 
+// Neighbour unreachability detection similar to RFC 4861, section 7.3.
 struct Neighbours {
+	// Confirmed entries become stale after this time.
 	static constexpr uint64_t staleTimeMs = 30'000;
+	// Reachable entries that are used after this time are confirmed by
+	// unicast requests before they become stale.
+	static constexpr uint64_t refreshTimeMs = 25'000;
+	static constexpr int maxProbes = 3;
+	// Packets that are queued per unresolved neighbour; older ones are dropped.
+	static constexpr size_t maxPending = 8;
+
 	enum class State {
 		none,
-		probe,
+		// Resolving the address by broadcast requests.
+		incomplete,
 		failed,
 		reachable,
-		stale
+		stale,
+		// Confirming a known address by unicast requests.
+		probe
 	};
+
+	// Transmits a packet once the neighbour is resolved.
+	using PendingPacket = std::function<void(nic::MacAddress)>;
+
 	struct Entry {
-		uint64_t mtime_ns;
+		// Time of the last confirmation.
+		uint64_t mtime_ns = 0;
 		nic::MacAddress mac;
 		async::recurring_event change;
 		State state = State::none;
+		std::deque<PendingPacket> pending;
 	};
-	async::result<std::optional<nic::MacAddress>> tryResolve(uint32_t addr,
-		uint32_t sender);
+
+	// Returns the address if it is known, otherwise starts to resolve it.
+	std::optional<nic::MacAddress> lookup(uint32_t addr, uint32_t sender);
+	// Queues a packet to a neighbour that lookup() could not resolve.
+	void enqueue(uint32_t addr, PendingPacket packet);
+	// Sends a gratuitous ARP request so that neighbours update their caches.
+	void announce(uint32_t addr);
+
 	void feedArp(nic::MacAddress destination, arch::dma_buffer_view arpData);
 	void updateTable(uint32_t proto, nic::MacAddress hardware);
 private:
 	Entry &getEntry(uint32_t addr);
-	std::map<uint32_t, Entry> table_;
+	std::unordered_map<uint32_t, Entry> table_;
 };
 
 Neighbours &neigh4();
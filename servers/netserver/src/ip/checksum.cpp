@@ -1,5 +1,6 @@
 #include "checksum.hpp"
 
+#include <cstring>
 #include <arch/bit.hpp>
 
 void Checksum::update(uint16_t word)  {
@@ -11,21 +12,46 @@ void Checksum::update(uint16_t word)  {
 
 void Checksum::update(const void *data, size_t size) {
 	using namespace arch;
+	// The one's complement sum does not depend on the byte order (RFC 1071),
+	// hence we sum native 32-bit words into a 64-bit accumulator (which cannot
+	// overflow for any realistic size) and only swap the folded result.
+	// The independent accumulators allow the compiler to vectorize the loop.
 	auto iter = static_cast<const unsigned char*>(data);
-	if (size % 2 != 0) {
-		size--;
-		update(iter[size] << 8);
+	uint64_t sums[4] = {0, 0, 0, 0};
+	for (; size >= 16; iter += 16, size -= 16) {
+		uint32_t words[4];
+		std::memcpy(words, iter, sizeof(words));
+		for (int i = 0; i < 4; i++)
+			sums[i] += words[i];
 	}
-	auto end = iter + size;
-	for (; iter < end; iter += 2) {
-		update(iter[0] << 8 | iter[1]);
+	uint64_t sum = sums[0] + sums[1] + sums[2] + sums[3];
+	for (; size >= 4; iter += 4, size -= 4) {
+		uint32_t word;
+		std::memcpy(&word, iter, sizeof(word));
+		sum += word;
 	}
+	// Pads an odd trailing byte with zero, as required by RFC 791.
+	if (size) {
+		uint32_t word = 0;
+		std::memcpy(&word, iter, size);
+		sum += word;
+	}
+
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	update(convert_endian<endian::big, endian::native>(static_cast<uint16_t>(sum)));
 }
 
 void Checksum::update(arch::dma_buffer_view view) {
 	update(view.data(), view.size());
 }
 
+uint16_t Checksum::partial() {
+	return state_;
+}
+
 uint16_t Checksum::finalize() {
 	auto state_ = this->state_;
 	return ~state_;
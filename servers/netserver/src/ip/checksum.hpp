@@ -7,6 +7,9 @@ struct Checksum {
 	void update(uint16_t word);
 	void update(const void *mem, size_t size);
 	void update(arch::dma_buffer_view area);
+	// Returns the sum without complementing it; NICs that offload the
+	// checksum expect the sum of the pseudo header in the checksum field.
+	uint16_t partial();
 	uint16_t finalize();
 
 private:
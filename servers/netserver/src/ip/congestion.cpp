@@ -0,0 +1,160 @@
+#include "congestion.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+CongestionControl::CongestionControl(size_t mss)
+: mss_{mss}, ssthresh_{SIZE_MAX} {
+	// Initial window of RFC 5681.
+	if(mss > 2190) {
+		cwnd_ = 2 * mss;
+	}else if(mss > 1095) {
+		cwnd_ = 3 * mss;
+	}else{
+		cwnd_ = 4 * mss;
+	}
+}
+
+void CongestionControl::onAck(size_t acked, uint64_t now, uint64_t srtt) {
+	if(cwnd_ < ssthresh_) {
+		// Slow start, with appropriate byte counting (L = 1 * SMSS).
+		cwnd_ += std::min(acked, mss_);
+	}else{
+		increase_(acked, now, srtt);
+	}
+}
+
+void CongestionControl::onEnterRecovery(size_t flight, uint64_t now) {
+	ssthresh_ = reduce_(flight, now);
+	cwnd_ = ssthresh_ + 3 * mss_;
+}
+
+void CongestionControl::onRecoveryDupAck() {
+	cwnd_ += mss_;
+}
+
+void CongestionControl::onPartialAck(size_t acked) {
+	// Deflate by the acknowledged data, then account for the retransmitted segment.
+	cwnd_ -= std::min(acked, cwnd_);
+	if(acked >= mss_)
+		cwnd_ += mss_;
+	cwnd_ = std::max(cwnd_, mss_);
+}
+
+void CongestionControl::onExitRecovery() {
+	cwnd_ = ssthresh_;
+}
+
+void CongestionControl::onTimeout(size_t flight, uint64_t now) {
+	ssthresh_ = reduce_(flight, now);
+	cwnd_ = mss_;
+}
+
+namespace {
+
+struct NewReno final : CongestionControl {
+	using CongestionControl::CongestionControl;
+
+	const char *name() override {
+		return "newreno";
+	}
+
+protected:
+	size_t reduce_(size_t flight, uint64_t) override {
+		return std::max(flight / 2, 2 * mss_);
+	}
+
+	void increase_(size_t acked, uint64_t, uint64_t) override {
+		// Grow by one SMSS per RTT.
+		bytesAcked_ += acked;
+		if(bytesAcked_ >= cwnd_) {
+			bytesAcked_ -= cwnd_;
+			cwnd_ += mss_;
+		}
+	}
+
+private:
+	size_t bytesAcked_ = 0;
+};
+
+// CUBIC as in RFC 9438. Windows are computed in segments.
+struct Cubic final : CongestionControl {
+	static constexpr double c = 0.4;
+	static constexpr double beta = 0.7;
+	// Additive increase of the Reno-friendly estimate.
+	static constexpr double alpha = 3 * (1 - beta) / (1 + beta);
+
+	using CongestionControl::CongestionControl;
+
+	const char *name() override {
+		return "cubic";
+	}
+
+protected:
+	size_t reduce_(size_t, uint64_t) override {
+		double segments = static_cast<double>(cwnd_) / mss_;
+
+		// Fast convergence: release bandwidth if the window shrinks.
+		if(segments < wMax_) {
+			wMax_ = segments * (1 + beta) / 2;
+		}else{
+			wMax_ = segments;
+		}
+		epochStart_ = 0;
+
+		return std::max(static_cast<size_t>(cwnd_ * beta), 2 * mss_);
+	}
+
+	void increase_(size_t acked, uint64_t now, uint64_t srtt) override {
+		double segments = static_cast<double>(cwnd_) / mss_;
+		double ackedSegments = static_cast<double>(acked) / mss_;
+
+		if(!epochStart_) {
+			epochStart_ = now;
+			if(segments < wMax_) {
+				k_ = std::cbrt((wMax_ - segments) / c);
+				origin_ = wMax_;
+			}else{
+				k_ = 0;
+				origin_ = segments;
+			}
+			wEst_ = segments;
+		}
+
+		// Target window one RTT into the future.
+		double t = static_cast<double>(now - epochStart_ + srtt) / 1'000'000'000;
+		double target = c * std::pow(t - k_, 3) + origin_;
+		target = std::clamp(target, segments, 1.5 * segments);
+
+		wEst_ += alpha * ackedSegments / segments;
+
+		if(wEst_ > target) {
+			// Reno-friendly region.
+			segments = std::max(segments, wEst_);
+		}else{
+			segments += (target - segments) / segments * ackedSegments;
+		}
+		cwnd_ = std::max(cwnd_, static_cast<size_t>(segments * mss_));
+	}
+
+private:
+	// Window before the last reduction.
+	double wMax_ = 0;
+	uint64_t epochStart_ = 0;
+	// Time (in s) until the window reaches origin_ again.
+	double k_ = 0;
+	double origin_ = 0;
+	double wEst_ = 0;
+};
+
+} // anonymous namespace
+
+std::unique_ptr<CongestionControl> makeCongestionControl(CongestionAlgorithm algorithm,
+		size_t mss) {
+	switch(algorithm) {
+	case CongestionAlgorithm::cubic:
+		return std::make_unique<Cubic>(mss);
+	default:
+		return std::make_unique<NewReno>(mss);
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
+enum class CongestionAlgorithm {
+	newReno,
+	cubic
+};
+
+// Decides how many bytes a TCP connection may have in flight (RFC 5681).
+// The common base implements slow start and the window inflation of fast
+// recovery (RFC 6582); algorithms differ in congestion avoidance and in
+// how they reduce the window on loss.
+// All times are in ns.
+struct CongestionControl {
+	CongestionControl(size_t mss);
+
+	virtual ~CongestionControl() = default;
+
+	virtual const char *name() = 0;
+
+	// Size of the congestion window in bytes.
+	size_t cwnd() {
+		return cwnd_;
+	}
+
+	size_t ssthresh() {
+		return ssthresh_;
+	}
+
+	// Called when an ACK acknowledges new data outside of fast recovery.
+	void onAck(size_t acked, uint64_t now, uint64_t srtt);
+
+	// Called on the third duplicate ACK; flight is the number of unacknowledged bytes.
+	void onEnterRecovery(size_t flight, uint64_t now);
+	// Called for each further duplicate ACK during fast recovery.
+	void onRecoveryDupAck();
+	// Called for ACKs that acknowledge some but not all data sent before the loss.
+	void onPartialAck(size_t acked);
+	// Called once all data sent before the loss is acknowledged.
+	void onExitRecovery();
+
+	// Called when the retransmission timer expires.
+	void onTimeout(size_t flight, uint64_t now);
+
+protected:
+	// Returns the slow start threshold after a loss.
+	virtual size_t reduce_(size_t flight, uint64_t now) = 0;
+	// Grows cwnd_ in congestion avoidance.
+	virtual void increase_(size_t acked, uint64_t now, uint64_t srtt) = 0;
+
+	size_t mss_;
+	size_t cwnd_;
+	size_t ssthresh_;
+};
+
+std::unique_ptr<CongestionControl> makeCongestionControl(CongestionAlgorithm algorithm,
+		size_t mss);
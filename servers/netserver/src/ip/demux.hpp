@@ -0,0 +1,87 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <smarter.hpp>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Sockets that are bound to a local port, either to a specific address
+// or to INADDR_ANY (= wildcard). Both kinds of bindings never share a port.
+template<typename Socket>
+struct BindTable {
+	// Returns false if the endpoint conflicts with an existing binding.
+	bool tryInsert(uint32_t addr, uint16_t port, smarter::shared_ptr<Socket> socket) {
+		if (wildcard_.contains(port))
+			return false;
+
+		if (addr == INADDR_ANY) {
+			if (specific_.contains(port))
+				return false;
+			wildcard_.emplace(port, std::move(socket));
+			return true;
+		}
+
+		auto &bucket = specific_[port];
+		for (auto &entry : bucket) {
+			if (entry.first == addr)
+				return false;
+		}
+		bucket.emplace_back(addr, std::move(socket));
+		return true;
+	}
+
+	bool erase(uint32_t addr, uint16_t port) {
+		if (addr == INADDR_ANY)
+			return wildcard_.erase(port) != 0;
+
+		auto it = specific_.find(port);
+		if (it == specific_.end())
+			return false;
+		auto &bucket = it->second;
+		for (auto entry = bucket.begin(); entry != bucket.end(); ++entry) {
+			if (entry->first == addr) {
+				bucket.erase(entry);
+				if (bucket.empty())
+					specific_.erase(it);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Finds the socket that receives packets sent to addr:port.
+	Socket *lookup(uint32_t addr, uint16_t port) {
+		if (auto it = wildcard_.find(port); it != wildcard_.end())
+			return it->second.get();
+
+		auto it = specific_.find(port);
+		if (it == specific_.end())
+			return nullptr;
+		for (auto &entry : it->second) {
+			if (entry.first == addr)
+				return entry.second.get();
+		}
+		return nullptr;
+	}
+
+private:
+	// Usually, a port is only bound to a few addresses.
+	std::unordered_map<uint16_t,
+		std::vector<std::pair<uint32_t, smarter::shared_ptr<Socket>>>> specific_;
+	std::unordered_map<uint16_t, smarter::shared_ptr<Socket>> wildcard_;
+};
+
+// Mixes the 4-tuple of a flow into a hash (using the finalizer of MurmurHash3).
+inline size_t hashFlow(uint32_t localAddr, uint32_t remoteAddr,
+		uint16_t localPort, uint16_t remotePort) {
+	uint64_t h = (uint64_t{remoteAddr} << 32) | localAddr;
+	h ^= ((uint64_t{remotePort} << 16) | localPort) * 0x9E3779B97F4A7C15;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCD;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53;
+	h ^= h >> 33;
+	return h;
+}
@@ -3,14 +3,17 @@
 #include "arp.hpp"
 #include "checksum.hpp"
 #include <async/recurring-event.hpp>
+#include <cassert>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <algorithm>
+#include <bit>
 #include <cstring>
 #include <iostream>
 #include <iomanip>
 #include <protocols/fs/server.hpp>
 #include <queue>
+#include <vector>
 
 using namespace protocols::fs;
 
@@ -26,32 +29,85 @@ Ip4 &ip4() {
 	return inst;
 }
 
-bool Ip4Router::addRoute(Route r) {
-	return routes.emplace(std::move(r)).second;
+namespace {
+// Bit i of ip, counting from the most significant bit.
+inline unsigned int prefixBit(uint32_t ip, unsigned int i) {
+	return (ip >> (31 - i)) & 1;
 }
 
-std::optional<Route> Ip4Router::resolveRoute(uint32_t ip) {
-	for (auto i = routes.begin(); i != routes.end(); i++) {
-		const auto &r = *i;
-		if (r.network.sameNet(ip)) {
-			if (r.link.expired()) {
-				i = routes.erase(i);
-				continue;
-			}
-			return { r };
+// Length of the common prefix of a and b.
+inline uint8_t commonPrefix(uint32_t a, uint32_t b) {
+	return std::countl_zero(a ^ b);
+}
+} // namespace
+
+Ip4Router::Node &Ip4Router::findOrInsert_(CidrAddress net) {
+	auto slot = &root_;
+	while (true) {
+		auto node = slot->get();
+		if (!node) {
+			*slot = std::make_unique<Node>(net);
+			return **slot;
 		}
+
+		auto common = std::min({commonPrefix(node->prefix.ip, net.ip),
+			node->prefix.prefix, net.prefix});
+		if (common == node->prefix.prefix) {
+			if (common == net.prefix)
+				return *node;
+			slot = &node->children[prefixBit(net.ip, common)];
+			continue;
+		}
+
+		// Split the edge to node at the end of the common prefix.
+		CidrAddress innerPrefix { net.ip, common };
+		innerPrefix.ip &= innerPrefix.mask();
+		auto inner = std::make_unique<Node>(innerPrefix);
+		inner->children[prefixBit(node->prefix.ip, common)] = std::move(*slot);
+		*slot = std::move(inner);
+		if (common == net.prefix)
+			return **slot;
+		slot = &(*slot)->children[prefixBit(net.ip, common)];
 	}
-	return {};
 }
 
-bool operator<(const CidrAddress &lhs, const CidrAddress &) {
-	return std::tie(lhs.prefix, lhs.ip) < std::tie(lhs.prefix, lhs.ip);
-}
+bool Ip4Router::addRoute(Route r) {
+	r.network.ip &= r.network.mask();
+	auto &routes = findOrInsert_(r.network).routes;
 
-bool operator<(const Route &lhs, const Route &rhs) {
 	// bigger MTU is better, and hence sorts lower
-	return std::tie(lhs.network, lhs.metric, rhs.mtu) <
-		std::tie(rhs.network, rhs.metric, lhs.mtu);
+	auto better = [] (const Route &lhs, const Route &rhs) {
+		return std::tie(lhs.metric, rhs.mtu) < std::tie(rhs.metric, lhs.mtu);
+	};
+	auto it = std::lower_bound(routes.begin(), routes.end(), r, better);
+	if (it != routes.end() && !better(r, *it))
+		return false;
+	routes.insert(it, std::move(r));
+	invalidate();
+	return true;
+}
+
+std::optional<Route> Ip4Router::resolveRoute(uint32_t ip) {
+	// Deeper nodes have longer prefixes and thus take precedence.
+	Route *best = nullptr;
+	auto node = root_.get();
+	while (node && node->prefix.sameNet(ip)) {
+		if (std::erase_if(node->routes,
+				[] (const Route &r) { return r.link.expired(); }))
+			invalidate();
+		if (!node->routes.empty())
+			best = &node->routes.front();
+		if (node->prefix.prefix == 32)
+			break;
+		node = node->children[prefixBit(ip, node->prefix.prefix)].get();
+	}
+	if (!best)
+		return {};
+	return { *best };
+}
+
+bool operator<(const CidrAddress &lhs, const CidrAddress &rhs) {
+	return std::tie(lhs.prefix, lhs.ip) < std::tie(rhs.prefix, rhs.ip);
 }
 
 bool Ip4Packet::parse(arch::dma_buffer owner, arch::dma_buffer_view frame) {
@@ -236,6 +292,19 @@ Ip4::targetByRemote(uint32_t remote) {
 	co_return Ip4TargetInfo { remote, source, *oroute, std::move(target) };
 }
 
+async::result<std::optional<Ip4TargetInfo>>
+Ip4::targetByRemote(uint32_t remote, Ip4TargetCache &cache) {
+	auto generation = ip4Router().generation();
+	if (cache.target && cache.target->remote == remote
+			&& cache.generation == generation) {
+		co_return cache.target;
+	}
+
+	cache.target = co_await targetByRemote(remote);
+	cache.generation = generation;
+	co_return cache.target;
+}
+
 bool Ip4::hasIp(uint32_t addr) {
 	return std::any_of(ips.cbegin(), ips.cend(),
 		[addr] (auto &x) {
@@ -244,22 +313,28 @@ bool Ip4::hasIp(uint32_t addr) {
 }
 
 async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
-		void *data, size_t len, uint16_t proto) {
-	using arch::convert_endian;
-	using arch::endian;
-
+		void *data, size_t len, uint16_t proto, std::optional<size_t> csumOffset,
+		size_t gsoSize) {
 	// TODO(arsen): fragmentation
 	// calculate header size
 	size_t header_size = sizeof(Ip4Packet::Header);
 	size_t packet_size = len + header_size;
+	// Super-packets are split into segments that fit into the MTU.
+	bool segmented = gsoSize && packet_size > ti.link->mtu;
+	if (segmented) {
+		assert(proto == static_cast<uint16_t>(IpProto::tcp));
+		if (packet_size > 0xFFFF) {
+			co_return protocols::fs::Error::messageSize;
+		}
+	}
 	// TODO(arsen): options
-	if (ti.route.mtu != 0 && ti.route.mtu < packet_size) {
+	if (!segmented && ti.route.mtu != 0 && ti.route.mtu < packet_size) {
 		std::cout << "netserver: cant fragment 1" << std::endl;
 		co_return protocols::fs::Error::messageSize;
 	}
 
 	auto &target = ti.link;
-	if (target->mtu < packet_size) {
+	if (!segmented && target->mtu < packet_size) {
 		std::cout << "netserver: cant fragment 2" << std::endl;
 		co_return protocols::fs::Error::messageSize;
 	}
@@ -269,11 +344,59 @@ async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
 		macTarget = ti.remote;
 	}
 
-	auto mac = co_await neigh4().tryResolve(macTarget, ti.source);
+	auto mac = neigh4().lookup(macTarget, ti.source);
 	if (!mac) {
-		co_return protocols::fs::Error::hostUnreachable;
+		// Do not block the sender; the packet is sent once the neighbour
+		// is resolved (or dropped if that fails).
+		auto bytes = static_cast<const char *>(data);
+		neigh4().enqueue(macTarget, [this, ti, proto, csumOffset, gsoSize,
+				packet = std::vector<char>(bytes, bytes + len)] (nic::MacAddress mac) mutable {
+			async::detach(sendResolved_(std::move(ti), mac, proto, std::move(packet),
+				csumOffset, gsoSize));
+		});
+		co_return protocols::fs::Error::none;
 	}
 
+	co_await dispatch_(ti, *mac, proto, data, len, csumOffset, gsoSize);
+	co_return protocols::fs::Error::none;
+}
+
+async::result<void> Ip4::dispatch_(Ip4TargetInfo &ti, nic::MacAddress mac,
+		uint16_t proto, const void *data, size_t len,
+		std::optional<size_t> csumOffset, size_t gsoSize) {
+	bool segmented = gsoSize && len + sizeof(Ip4Packet::Header) > ti.link->mtu;
+	if (!segmented) {
+		co_await transmit_(ti, mac, proto, data, len, nullptr, 0,
+			csumOffset, std::nullopt);
+	} else if (ti.link->tcpSegmentationOffload) {
+		assert(csumOffset);
+		auto bytes = static_cast<const uint8_t *>(data);
+		size_t tcpHeaderLength = (bytes[12] >> 4) * 4;
+		co_await transmit_(ti, mac, proto, data, len, nullptr, 0, csumOffset,
+			nic::SegmentationOffload{gsoSize, tcpHeaderLength});
+	} else {
+		co_await segmentTcp_(ti, mac, static_cast<const char *>(data), len, gsoSize);
+	}
+}
+
+async::result<void> Ip4::sendResolved_(Ip4TargetInfo ti, nic::MacAddress mac,
+		uint16_t proto, std::vector<char> packet,
+		std::optional<size_t> csumOffset, size_t gsoSize) {
+	co_await dispatch_(ti, mac, proto, packet.data(), packet.size(),
+		csumOffset, gsoSize);
+}
+
+async::result<void> Ip4::transmit_(Ip4TargetInfo &ti, nic::MacAddress mac,
+		uint16_t proto, const void *head, size_t headLen,
+		const void *body, size_t bodyLen, std::optional<size_t> csumOffset,
+		std::optional<nic::SegmentationOffload> gso) {
+	using arch::convert_endian;
+	using arch::endian;
+
+	size_t header_size = sizeof(Ip4Packet::Header);
+	size_t packet_size = header_size + headLen + bodyLen;
+	auto &target = ti.link;
+
 	Ip4Packet::Header hdr;
 	// TODO(arsen): options
 	hdr.ihl = 0x45;
@@ -295,23 +418,106 @@ async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
 	chk.update(reinterpret_cast<void *>(&hdr), sizeof(hdr));
 	hdr.checksum = convert_endian<endian::big>(chk.finalize());
 
-	auto fb = target->allocateFrame(*mac, nic::ETHER_TYPE_IP4, packet_size);
+	auto fb = target->allocateFrame(mac, nic::ETHER_TYPE_IP4, packet_size);
 
 	std::memcpy(fb.payload.data(), &hdr, sizeof(hdr));
-	std::memcpy(fb.payload.subview(header_size).byte_data(), data, len);
+	std::memcpy(fb.payload.subview(header_size).byte_data(), head, headLen);
+	if (bodyLen) {
+		std::memcpy(fb.payload.subview(header_size + headLen).byte_data(),
+			body, bodyLen);
+	}
 
-	co_await target->send(std::move(fb.frame));
-	co_return protocols::fs::Error::none;
+	size_t start = fb.payload.byte_data() - fb.frame.byte_data() + header_size;
+	std::optional<nic::ChecksumOffload> offload;
+	if (csumOffset) {
+		assert(target->txChecksumOffload);
+		offload = nic::ChecksumOffload{start, *csumOffset};
+	}
+	if (gso) {
+		assert(target->tcpSegmentationOffload);
+		// The device expects the length of all headers.
+		gso->headerLength += start;
+	}
+
+	co_await target->send(std::move(fb.frame), offload, gso);
+}
+
+async::result<void> Ip4::segmentTcp_(Ip4TargetInfo &ti, nic::MacAddress mac,
+		const char *data, size_t len, size_t gsoSize) {
+	auto load32 = [] (const char *p) -> uint32_t {
+		auto q = reinterpret_cast<const uint8_t *>(p);
+		return (uint32_t{q[0]} << 24) | (uint32_t{q[1]} << 16)
+			| (uint32_t{q[2]} << 8) | q[3];
+	};
+
+	// Offsets and flags of the TCP header.
+	constexpr size_t seqOffset = 4;
+	constexpr size_t flagsOffset = 13;
+	constexpr size_t checksumOffset = 16;
+	constexpr uint8_t finFlag = 1;
+	constexpr uint8_t pshFlag = 8;
+
+	size_t tcpHeaderLength = (static_cast<uint8_t>(data[12]) >> 4) * 4;
+	uint32_t seq = load32(data + seqOffset);
+	uint8_t flags = data[flagsOffset];
+	bool offload = ti.link->txChecksumOffload;
+
+	std::vector<char> head{data, data + tcpHeaderLength};
+	for (size_t offset = tcpHeaderLength; offset < len; offset += gsoSize) {
+		auto body = data + offset;
+		size_t chunk = std::min(gsoSize, len - offset);
+
+		uint32_t segmentSeq = seq + (offset - tcpHeaderLength);
+		for (int i = 0; i < 4; i++) {
+			head[seqOffset + i] = segmentSeq >> (24 - 8 * i);
+		}
+		// FIN and PSH only belong to the last segment.
+		if (offset + chunk < len) {
+			head[flagsOffset] = flags & ~(finFlag | pshFlag);
+		} else {
+			head[flagsOffset] = flags;
+		}
+
+		// The pseudo header is summed in native 16-bit words.
+		size_t segmentLength = tcpHeaderLength + chunk;
+		Checksum chk;
+		chk.update(ti.source >> 16);
+		chk.update(ti.source & 0xFFFF);
+		chk.update(ti.remote >> 16);
+		chk.update(ti.remote & 0xFFFF);
+		chk.update(static_cast<uint16_t>(IpProto::tcp));
+		chk.update(static_cast<uint16_t>(segmentLength));
+		head[checksumOffset] = 0;
+		head[checksumOffset + 1] = 0;
+		uint16_t sum;
+		if (offload) {
+			sum = chk.partial();
+		} else {
+			chk.update(head.data(), tcpHeaderLength);
+			chk.update(body, chunk);
+			sum = chk.finalize();
+		}
+		head[checksumOffset] = sum >> 8;
+		head[checksumOffset + 1] = sum & 0xFF;
+
+		co_await transmit_(ti, mac, static_cast<uint16_t>(IpProto::tcp),
+			head.data(), tcpHeaderLength, body, chunk,
+			offload ? std::optional<size_t>{checksumOffset} : std::nullopt,
+			std::nullopt);
+	}
 }
 
 void Ip4::feedPacket(nic::MacAddress, nic::MacAddress,
-		arch::dma_buffer owner, arch::dma_buffer_view frame) {
+		arch::dma_buffer owner, arch::dma_buffer_view frame,
+		bool checksumValidated, unsigned int queue) {
 	Ip4Packet hdr;
 	if (!hdr.parse(std::move(owner), frame)) {
 		std::cout << "netserver: runt, or otherwise invalid, ip4 frame received"
 			<< std::endl;
 		return;
 	}
+	hdr.checksumValidated = checksumValidated;
+	hdr.rxQueue = queue;
 	auto proto = hdr.header.protocol;
 
 	auto begin = sockets.lower_bound(proto);
@@ -335,8 +541,15 @@ void Ip4::feedPacket(nic::MacAddress, nic::MacAddress,
 	}
 }
 
+void Ip4::flushReceived() {
+	tcp.flushGro();
+}
+
 void Ip4::setLink(CidrAddress addr, std::weak_ptr<nic::Link> l) {
 	ips.emplace(addr, std::move(l));
+	neigh4().announce(addr.ip);
+	// Source addresses of cached targets may change.
+	ip4Router().invalidate();
 }
 
 std::shared_ptr<nic::Link> Ip4::getLink(uint32_t addr) {
@@ -7,10 +7,10 @@
 #include <smarter.hpp>
 #include <netserver/nic.hpp>
 #include <protocols/fs/common.hpp>
-#include <set>
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <vector>
 
 #include "udp4.hpp"
 #include "tcp4.hpp"
@@ -51,15 +51,37 @@ struct Ip4Router {
 		uint32_t gateway = 0;
 		unsigned int metric = 0;
 		uint32_t source = 0;
-
-		friend bool operator<(const Route &, const Route &);
 	};
 
 	// false if insertion fails
 	bool addRoute(Route r);
+	// Returns the best route of the longest matching prefix.
 	std::optional<Route> resolveRoute(uint32_t ip);
+
+	// Changes whenever routing decisions may differ from earlier ones.
+	uint64_t generation() {
+		return generation_;
+	}
+	void invalidate() {
+		generation_++;
+	}
 private:
-	std::set<Route> routes;
+	// Node of a path-compressed binary trie; children extend the prefix of
+	// their parent by at least one bit.
+	struct Node {
+		Node(CidrAddress prefix)
+			: prefix(prefix) {}
+
+		CidrAddress prefix;
+		// Routes to exactly this prefix, best route first.
+		std::vector<Route> routes;
+		std::unique_ptr<Node> children[2];
+	};
+
+	Node &findOrInsert_(CidrAddress net);
+
+	std::unique_ptr<Node> root_;
+	uint64_t generation_ = 1;
 };
 
 class Ip4Packet {
@@ -96,6 +118,10 @@ public:
 	} header;
 	static_assert(sizeof(header) == 20, "bad header size");
 	arch::dma_buffer_view data;
+	// The NIC already verified the checksum of the transport protocol.
+	bool checksumValidated = false;
+	// Receive queue of the NIC that received the packet.
+	unsigned int rxQueue = 0;
 
 	inline arch::dma_buffer_view payload() const {
 		return data.subview(header.ihl * 4);
@@ -116,12 +142,20 @@ struct Ip4TargetInfo {
 	std::shared_ptr<nic::Link> link;
 };
 
+// Remembers the result of targetByRemote() for a socket until the routes
+// or the local addresses change.
+struct Ip4TargetCache {
+	std::optional<Ip4TargetInfo> target;
+	uint64_t generation = 0;
+};
+
 struct Ip4Socket;
 struct Ip4 {
 	managarm::fs::Errors serveSocket(helix::UniqueLane lane, int type, int proto, int flags);
 	// frame is a view into the owner buffer, stripping away eth bits
 	void feedPacket(nic::MacAddress dest, nic::MacAddress src,
-		arch::dma_buffer owner, arch::dma_buffer_view frame);
+		arch::dma_buffer owner, arch::dma_buffer_view frame,
+		bool checksumValidated, unsigned int queue);
 
 	bool hasIp(uint32_t ip);
 	std::shared_ptr<nic::Link> getLink(uint32_t ip);
@@ -129,10 +163,37 @@ struct Ip4 {
 	std::optional<uint32_t> findLinkIp(uint32_t ipOnNet, nic::Link *link);
 
 	async::result<std::optional<Ip4TargetInfo>> targetByRemote(uint32_t);
+	async::result<std::optional<Ip4TargetInfo>> targetByRemote(uint32_t,
+		Ip4TargetCache &cache);
+	// If csumOffset is given, the NIC fills in the checksum of the transport
+	// protocol at that offset into data. A non-zero gsoSize marks data as a
+	// TCP super-packet that is split into segments carrying gsoSize bytes
+	// (by the NIC if it supports TSO); its checksum is only used with TSO.
 	async::result<protocols::fs::Error> sendFrame(Ip4TargetInfo,
 		void*, size_t,
-		uint16_t);
+		uint16_t, std::optional<size_t> csumOffset = std::nullopt,
+		size_t gsoSize = 0);
+	// Processes the segments that GRO held back; called at the end of each
+	// batch of received frames.
+	void flushReceived();
 private:
+	// Transmits a packet (that passed the checks of sendFrame()) to mac.
+	async::result<void> dispatch_(Ip4TargetInfo &ti, nic::MacAddress mac,
+		uint16_t proto, const void *data, size_t len,
+		std::optional<size_t> csumOffset, size_t gsoSize);
+	// Transmits a packet that waited for neighbour resolution.
+	async::result<void> sendResolved_(Ip4TargetInfo ti, nic::MacAddress mac,
+		uint16_t proto, std::vector<char> packet,
+		std::optional<size_t> csumOffset, size_t gsoSize);
+	// Prepends the IP header to head and body and passes the frame to the link.
+	async::result<void> transmit_(Ip4TargetInfo &ti, nic::MacAddress mac,
+		uint16_t proto, const void *head, size_t headLen,
+		const void *body, size_t bodyLen, std::optional<size_t> csumOffset,
+		std::optional<nic::SegmentationOffload> gso);
+	// Software GSO: splits a TCP super-packet into segments.
+	async::result<void> segmentTcp_(Ip4TargetInfo &ti, nic::MacAddress mac,
+		const char *data, size_t len, size_t gsoSize);
+
 	std::multimap<int, smarter::shared_ptr<Ip4Socket>> sockets;
 	std::map<CidrAddress, std::weak_ptr<nic::Link>> ips;
 
@@ -3,10 +3,14 @@
 #include <async/result.hpp>
 #include <arch/bit.hpp>
 #include <arch/variable.hpp>
+#include <helix/timer.hpp>
 #include <protocols/fs/server.hpp>
+#include <algorithm>
+#include <cstddef>
 #include <cstring>
 #include <deque>
 #include <iomanip>
+#include <optional>
 #include <random>
 #include <fcntl.h>
 #include <sys/epoll.h>
@@ -15,12 +19,59 @@
 #include <netinet/ip.h>
 
 #include "checksum.hpp"
+#include "congestion.hpp"
 #include "ip4.hpp"
 #include "tcp4.hpp"
 
 namespace {
 
 constexpr bool debugTcp = false;
+// Prints the congestion window and RTT estimates whenever the connection detects a loss.
+constexpr bool logCongestion = false;
+
+constexpr CongestionAlgorithm congestionAlgorithm = CongestionAlgorithm::newReno;
+
+// TODO: Perform path MTU discovery.
+constexpr size_t tcpMss = 1000;
+
+// Parameters of the retransmission timer (RFC 6298), in ns.
+constexpr uint64_t initialRto = 1'000'000'000;
+constexpr uint64_t minRto = 1'000'000'000;
+constexpr uint64_t maxRto = 60'000'000'000;
+constexpr uint64_t clockGranularity = 1'000'000;
+
+// Number of duplicate ACKs that trigger a fast retransmit.
+constexpr unsigned int dupAckThreshold = 3;
+
+// Sizes of the socket buffers, as powers of two. Unless the user sets SO_RCVBUF
+// or SO_SNDBUF, the buffers grow automatically up to the maximal size.
+constexpr int defaultBufferShift = 16;
+constexpr int minBufferShift = 12;
+constexpr int maxBufferShift = 22;
+// Our window scale can announce windows of the maximal buffer size (RFC 7323).
+constexpr uint8_t localWindowScale = maxBufferShift - 16;
+// Interval of receive buffer auto-tuning if we do not know the RTT yet.
+constexpr uint64_t defaultTuneInterval = 100'000'000;
+
+// Lengths of the options that we send.
+constexpr size_t timestampOptionLength = 12;
+constexpr size_t synOptionsLength = 20;
+constexpr size_t maxOptionsLength = 40;
+// Number of SACK blocks that fit into the option space along with a timestamp.
+constexpr size_t maxSackBlocks = 3;
+
+// Blocking reads of at least this size are filled directly from received
+// segments, bypassing the receive buffer.
+constexpr size_t directReadThreshold = 4096;
+
+// Upper bound on the payload of super-packets (GSO and GRO), such that
+// the IP length field does not overflow.
+constexpr size_t maxSuperPacketPayload = 0xFFFF - 20 - 60;
+
+// Compares sequence numbers modulo 2^32.
+bool snBefore(uint32_t a, uint32_t b) {
+	return static_cast<int32_t>(a - b) < 0;
+}
 
 struct stl_allocator {
 	void *allocate(size_t size) {
@@ -62,6 +113,23 @@ struct RingBuffer {
 		return enqPtr_ - deqPtr_;
 	}
 
+	size_t capacity() {
+		return size_t{1} << shift_;
+	}
+
+	// Changes the capacity to 2^shift bytes, keeping the enqueued data.
+	void resize(int shift) {
+		auto available = availableToDequeue();
+		assert(available <= (size_t{1} << shift));
+		auto storage = reinterpret_cast<char *>(operator new (size_t{1} << shift));
+		dequeueLookahead(0, storage, available);
+		operator delete(storage_);
+		storage_ = storage;
+		shift_ = shift;
+		deqPtr_ = 0;
+		enqPtr_ = available;
+	}
+
 	void enqueue(void *data, size_t size) {
 		assert(size <= spaceForEnqueue());
 		size_t ringSize = size_t{1} << shift_;
@@ -99,6 +167,19 @@ private:
 	uint64_t deqPtr_ = 0;
 };
 
+// Smallest power of two (within the buffer size limits) that is at least size.
+int bufferShiftFor(size_t size) {
+	int shift = minBufferShift;
+	while(shift < maxBufferShift && (size_t{1} << shift) < size)
+		shift++;
+	return shift;
+}
+
+// Clock of the timestamp option, in ms.
+uint32_t timestampClock() {
+	return helix::currentClock() / 1'000'000;
+}
+
 // TODO: Use a CSPRNG, see also UDP.
 static std::mt19937 globalPrng;
 
@@ -107,7 +188,10 @@ static std::mt19937 globalPrng;
 struct TcpHeader {
 	static constexpr arch::field<uint16_t, bool> finFlag{0, 1};
 	static constexpr arch::field<uint16_t, bool> synFlag{1, 1};
+	static constexpr arch::field<uint16_t, bool> rstFlag{2, 1};
+	static constexpr arch::field<uint16_t, bool> pshFlag{3, 1};
 	static constexpr arch::field<uint16_t, bool> ackFlag{4, 1};
+	static constexpr arch::field<uint16_t, bool> urgFlag{5, 1};
 	static constexpr arch::field<uint16_t, unsigned int> headerWords{12, 4};
 
 	arch::scalar_storage<uint16_t, arch::big_endian> srcPort;
@@ -122,12 +206,80 @@ struct TcpHeader {
 
 static_assert(sizeof(TcpHeader) == 20);
 
+namespace {
+
+// Fills in the checksum of a segment, or prepares it for offloading to the NIC.
+// Returns the offset of the checksum if the NIC needs to complete it.
+std::optional<size_t> fillChecksum(nic::Link *link, const PseudoHeader &pseudo,
+		std::vector<char> &buf) {
+	auto header = reinterpret_cast<TcpHeader *>(buf.data());
+	Checksum csum;
+	csum.update(&pseudo, sizeof(PseudoHeader));
+	if (link->txChecksumOffload) {
+		header->checksum = csum.partial();
+		return offsetof(TcpHeader, checksum);
+	}
+	csum.update(buf.data(), buf.size());
+	header->checksum = csum.finalize();
+	return std::nullopt;
+}
+
+} // namespace
+
+struct TcpOptions {
+	// Option kinds.
+	enum : uint8_t {
+		kindEnd = 0,
+		kindNop = 1,
+		kindMss = 2,
+		kindWindowScale = 3,
+		kindSackPermitted = 4,
+		kindSack = 5,
+		kindTimestamp = 8
+	};
+
+	std::optional<uint16_t> mss;
+	std::optional<uint8_t> windowScale;
+	bool sackPermitted = false;
+	// TSval and TSecr.
+	std::optional<std::pair<uint32_t, uint32_t>> timestamp;
+	std::vector<std::pair<uint32_t, uint32_t>> sackBlocks;
+};
+
 struct TcpPacket {
 	arch::dma_buffer_view payload() {
 		auto words = header.flags.load() & TcpHeader::headerWords;
 		return packet->payload().subview(words * 4);
 	}
 
+	// Size of the payload, including the segments that GRO merged into this packet.
+	size_t payloadSize() {
+		size_t size = payload().size();
+		for (auto &segment : merged)
+			size += segment.payload().size();
+		return size;
+	}
+
+	// Calls fn(data, size) on the bytes [offset, offset + size) of the payload,
+	// including the segments that GRO merged into this packet.
+	template<typename F>
+	void walkPayload(size_t offset, size_t size, F fn) {
+		auto visit = [&] (arch::dma_buffer_view view) {
+			if (offset >= view.size()) {
+				offset -= view.size();
+				return;
+			}
+			size_t n = std::min(view.size() - offset, size);
+			if (n)
+				fn(static_cast<char *>(view.data()) + offset, n);
+			offset = 0;
+			size -= n;
+		};
+		visit(payload());
+		for (auto &segment : merged)
+			visit(segment.payload());
+	}
+
 	bool parse(smarter::shared_ptr<const Ip4Packet> packet) {
 		auto ipPayload = packet->payload();
 		if (ipPayload.size() < sizeof(TcpHeader))
@@ -140,7 +292,11 @@ struct TcpPacket {
 		if (ipPayload.size() < words * 4)
 			return false;
 
-		if (header.checksum.load()) {
+		if (!parseOptions_(reinterpret_cast<const uint8_t *>(ipPayload.data())
+				+ sizeof(TcpHeader), words * 4 - sizeof(TcpHeader)))
+			return false;
+
+		if (header.checksum.load() && !packet->checksumValidated) {
 			PseudoHeader pseudo {
 				.src = packet->header.source,
 				.dst = packet->header.destination,
@@ -160,7 +316,50 @@ struct TcpPacket {
 	}
 
 	TcpHeader header;
+	TcpOptions options;
 	smarter::shared_ptr<const Ip4Packet> packet;
+	// In-order segments of the same flow that directly follow this one.
+	std::vector<TcpPacket> merged;
+
+private:
+	bool parseOptions_(const uint8_t *p, size_t size) {
+		auto load32 = [] (const uint8_t *q) -> uint32_t {
+			return (uint32_t{q[0]} << 24) | (uint32_t{q[1]} << 16)
+					| (uint32_t{q[2]} << 8) | q[3];
+		};
+
+		size_t i = 0;
+		while (i < size) {
+			auto kind = p[i];
+			if (kind == TcpOptions::kindEnd)
+				break;
+			if (kind == TcpOptions::kindNop) {
+				i++;
+				continue;
+			}
+
+			if (i + 2 > size || p[i + 1] < 2 || i + p[i + 1] > size)
+				return false;
+			auto length = p[i + 1];
+			auto data = p + i + 2;
+
+			// Unknown or malformed options are ignored.
+			if (kind == TcpOptions::kindMss && length == 4) {
+				options.mss = (data[0] << 8) | data[1];
+			} else if (kind == TcpOptions::kindWindowScale && length == 3) {
+				options.windowScale = std::min(data[0], uint8_t{14});
+			} else if (kind == TcpOptions::kindSackPermitted && length == 2) {
+				options.sackPermitted = true;
+			} else if (kind == TcpOptions::kindSack && length >= 10 && !((length - 2) % 8)) {
+				for (size_t j = 0; j < size_t(length - 2); j += 8)
+					options.sackBlocks.push_back({load32(data + j), load32(data + j + 4)});
+			} else if (kind == TcpOptions::kindTimestamp && length == 10) {
+				options.timestamp = std::pair{load32(data), load32(data + 4)};
+			}
+			i += length;
+		}
+		return true;
+	}
 };
 
 namespace {
@@ -183,9 +382,13 @@ protocols::fs::Error checkAddress(const void *addrPtr, size_t addrLength, TcpEnd
 
 struct Tcp4Socket {
 	Tcp4Socket(Tcp4 *parent, bool nonBlock)
-	: parent_(parent), nonBlock_{nonBlock}, recvRing_{14}, sendRing_{14} {}
+	: parent_(parent), nonBlock_{nonBlock},
+			recvRing_{defaultBufferShift}, sendRing_{defaultBufferShift},
+			cc_{makeCongestionControl(congestionAlgorithm, tcpMss)} {}
 
 	~Tcp4Socket() {
+		if (flow_)
+			parent_->unregisterFlow(*flow_);
 		parent_->unbind(localEp_);
 	}
 
@@ -193,6 +396,7 @@ struct Tcp4Socket {
 		auto s = smarter::make_shared<Tcp4Socket>(parent, nonBlock);
 		s->holder_ = s;
 		async::detach(s->flushOutPackets_());
+		async::detach(s->runRetransmitTimer_());
 		return s;
 	}
 
@@ -254,6 +458,14 @@ struct Tcp4Socket {
 			co_return protocols::fs::Error::addressNotAvailable;
 		}
 
+		// Obtain a new random sequence number.
+		// It is kept if the SYN needs to be retransmitted.
+		auto randomSn = globalPrng();
+		self->localSettledSn_ = randomSn;
+		self->localFlushedSn_ = randomSn;
+		self->localSentSn_ = randomSn;
+		self->recoverSn_ = randomSn;
+
 		// Connect to the remote.
 		self->connectState_ = ConnectState::sendSyn;
 		self->remoteEp_ = connectEp;
@@ -299,7 +511,22 @@ struct Tcp4Socket {
 					break;
 				if(self->nonBlock_)
 					co_return protocols::fs::Error::wouldBlock;
+
+				// Let receiveData_() copy into our buffer while we wait.
+				DirectRead direct{p, size};
+				bool useDirect = !(flags & MSG_PEEK) && size >= directReadThreshold
+						&& !self->directRead_;
+				if(useDirect)
+					self->directRead_ = &direct;
 				co_await self->inEvent_.async_wait();
+				if(useDirect) {
+					self->directRead_ = nullptr;
+					progress = direct.progress;
+					if(progress) {
+						self->tuneRecvBuffer_(progress);
+						self->flushEvent_.raise();
+					}
+				}
 				continue;
 			}
 			size_t chunk = std::min(available, size - progress);
@@ -308,6 +535,7 @@ struct Tcp4Socket {
 			if(flags & MSG_PEEK)
 				break;
 			self->recvRing_.dequeueAdvance(chunk);
+			self->tuneRecvBuffer_(chunk);
 			self->flushEvent_.raise();
 		}
 
@@ -410,9 +638,43 @@ struct Tcp4Socket {
 		co_return 0;
 	}
 
+	static async::result<int> getOption(void *object, int option) {
+		auto self = static_cast<Tcp4Socket *>(object);
+		if(option == SO_RCVBUF)
+			co_return self->recvRing_.capacity();
+		if(option == SO_SNDBUF)
+			co_return self->sendRing_.capacity();
+		std::cout << "netserver: Unsupported TCP socket option " << option << std::endl;
+		co_return 0;
+	}
+
+	// Setting a buffer size disables the auto-tuning of that buffer.
+	// Sizes are rounded up to powers of two.
+	static async::result<void> setOption(void *object, int option, int value) {
+		auto self = static_cast<Tcp4Socket *>(object);
+		size_t size = std::max(value, 0);
+		if(option == SO_RCVBUF) {
+			// We cannot take back a window that we already announced.
+			auto required = self->recvRing_.availableToDequeue() + self->announcedWindow_;
+			self->recvRing_.resize(bufferShiftFor(std::max(size, required)));
+			self->recvBufferLocked_ = true;
+			self->flushEvent_.raise();
+		}else if(option == SO_SNDBUF) {
+			auto required = self->sendRing_.availableToDequeue();
+			self->sendRing_.resize(bufferShiftFor(std::max(size, required)));
+			self->sendBufferLocked_ = true;
+			self->settleEvent_.raise();
+		}else{
+			std::cout << "netserver: Unsupported TCP socket option " << option << std::endl;
+		}
+		co_return;
+	}
+
 	constexpr static protocols::fs::FileOperations ops {
 		.read = &read,
 		.write = &write,
+		.getOption = &getOption,
+		.setOption = &setOption,
 		.pollWait = &pollWait,
 		.pollStatus = &pollStatus,
 		.bind = &bind,
@@ -440,8 +702,45 @@ struct Tcp4Socket {
 
 private:
 	async::result<void> flushOutPackets_();
+	async::result<void> runRetransmitTimer_();
 
 	void handleInPacket_(TcpPacket packet);
+	void handleAck_(TcpPacket &packet);
+	void handleTimeout_();
+
+	// (Re)starts the retransmission timer.
+	void armTimer_() {
+		rtoDeadline_ = helix::currentClock() + rto_;
+		timerEvent_.raise();
+	}
+
+	void sampleRtt_(uint64_t rtt);
+	void logCongestion_(const char *event);
+
+	// Payload size of full segments.
+	size_t dataMss_() {
+		return mss_ - (tsEnabled_ ? timestampOptionLength : 0);
+	}
+
+	// Window that we can announce with our window scale.
+	size_t announceableWindow_() {
+		auto window = std::min(recvRing_.spaceForEnqueue() >> recvWindowScale_, size_t{0xFFFF});
+		return window << recvWindowScale_;
+	}
+
+	void receiveData_(TcpPacket &packet);
+	void drainOutOfOrder_();
+	std::vector<std::pair<uint32_t, uint32_t>> buildSackBlocks_();
+	size_t writeOptions_(char *p, bool syn,
+			const std::vector<std::pair<uint32_t, uint32_t>> &sackBlocks);
+
+	void updateScoreboard_(const std::vector<std::pair<uint32_t, uint32_t>> &blocks);
+	// Returns the first range that is neither acknowledged nor SACKed, starting
+	// at from. Only ranges below SACKed data are considered as lost.
+	std::optional<std::pair<uint32_t, uint32_t>> nextHole_(uint32_t from);
+
+	void tuneRecvBuffer_(size_t copied);
+	void tuneSendBuffer_();
 
 private:
 	friend struct Tcp4;
@@ -457,6 +756,8 @@ private:
 	bool nonBlock_;
 	TcpEndpoint remoteEp_;
 	TcpEndpoint localEp_;
+	std::optional<TcpFlow> flow_;
+	Ip4TargetCache targetCache_;
 	smarter::weak_ptr<Tcp4Socket> holder_;
 
 	ConnectState connectState_ = ConnectState::none;
@@ -466,6 +767,9 @@ private:
 	uint32_t localSettledSn_ = 0;
 	// Out-SN that has already been flushed to the IP layer (>= localSettledSn_).
 	uint32_t localFlushedSn_ = 0;
+	// Highest Out-SN that was ever flushed (>= localFlushedSn_).
+	// It is ahead of localFlushedSn_ after a retransmission timeout.
+	uint32_t localSentSn_ = 0;
 	// Out-SN of the end of the remote window (>= localSettledSn_).
 	uint32_t localWindowSn_ = 0;
 	// In-SN that we already acknowledged.
@@ -478,9 +782,71 @@ private:
 	RingBuffer recvRing_;
 	RingBuffer sendRing_;
 
+	// RTT estimation and retransmission timer (RFC 6298).
+	bool haveRtt_ = false;
+	uint64_t srtt_ = 0;
+	uint64_t rttVar_ = 0;
+	uint64_t rto_ = initialRto;
+	// We time one segment at a time; the measurement ends once rttSn_ is acknowledged.
+	bool rttTiming_ = false;
+	uint32_t rttSn_ = 0;
+	uint64_t rttStart_ = 0;
+	// Expiration time of the retransmission timer, zero if the timer is not running.
+	uint64_t rtoDeadline_ = 0;
+
+	// Fast retransmit and recovery (RFC 5681, RFC 6582).
+	std::unique_ptr<CongestionControl> cc_;
+	unsigned int dupAcks_ = 0;
+	bool inRecovery_ = false;
+	// Out-SN that ends fast recovery once it is acknowledged.
+	uint32_t recoverSn_ = 0;
+	// Whether the next lost segment should be retransmitted.
+	bool retransmitPending_ = false;
+
+	// Options that were negotiated during the handshake (RFC 7323, RFC 2018).
+	size_t mss_ = tcpMss;
+	// Shift of the windows that the remote announces.
+	uint8_t sendWindowScale_ = 0;
+	// Shift of the windows that we announce.
+	uint8_t recvWindowScale_ = 0;
+	bool tsEnabled_ = false;
+	// TSval that we echo to the remote.
+	uint32_t tsRecent_ = 0;
+	bool sackEnabled_ = false;
+
+	// Received segments beyond remoteKnownSn_, sorted by their sequence numbers.
+	struct OutOfOrderSegment {
+		uint32_t sn;
+		std::vector<char> data;
+	};
+	std::deque<OutOfOrderSegment> outOfOrder_;
+	// Blocked reader whose buffer receiveData_() fills if recvRing_ is empty.
+	struct DirectRead {
+		char *buffer;
+		size_t size;
+		size_t progress = 0;
+	};
+	DirectRead *directRead_ = nullptr;
+	// The SACK block of the most recent out-of-order segment comes first.
+	uint32_t lastOutOfOrderSn_ = 0;
+	// Whether we need to send an ACK even if remoteKnownSn_ did not change.
+	bool ackNow_ = false;
+
+	// Ranges [start, end) that the remote SACKed, sorted and disjoint.
+	std::vector<std::pair<uint32_t, uint32_t>> sacked_;
+	// Retransmissions during fast recovery continue at this Out-SN.
+	uint32_t highRetransmitSn_ = 0;
+
+	// State of the buffer auto-tuning.
+	bool recvBufferLocked_ = false;
+	bool sendBufferLocked_ = false;
+	size_t copiedSinceTune_ = 0;
+	uint64_t lastTune_ = 0;
+
 	async::recurring_event inEvent_;
 	async::recurring_event flushEvent_;
 	async::recurring_event settleEvent_;
+	async::recurring_event timerEvent_;
 
 	// The following sequence numbers are *not* TCP sequence numbers,
 	// they implement the poll() function.
@@ -504,33 +870,41 @@ async::result<void> Tcp4Socket::flushOutPackets_() {
 				continue;
 			}
 
-			// Obtain a new random sequence number.
-			auto randomSn = globalPrng();
-			localSettledSn_ = randomSn;
-			localFlushedSn_ = randomSn;
-
 			// Construct and transmit the initial SYN packet.
-			auto targetInfo = co_await ip4().targetByRemote(remoteEp_.ipAddress);
+			auto targetInfo = co_await ip4().targetByRemote(remoteEp_.ipAddress, targetCache_);
 			if (!targetInfo) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Destination unreachable" << std::endl;
 				co_return;
 			}
 
+			// Now that the local address is known, replies can be demultiplexed by flow.
+			if (!flow_) {
+				flow_ = TcpFlow{
+					.localAddress = targetInfo->source,
+					.remoteAddress = remoteEp_.ipAddress,
+					.localPort = localEp_.port,
+					.remotePort = remoteEp_.port
+				};
+				parent_->registerFlow(*flow_, holder_.lock());
+			}
+
 			std::vector<char> buf;
-			buf.resize(sizeof(TcpHeader));
+			buf.resize(sizeof(TcpHeader) + synOptionsLength);
 
+			// Windows in SYNs are never scaled.
 			auto header = new (buf.data()) TcpHeader {
 				.srcPort = localEp_.port,
 				.destPort = remoteEp_.port,
 				.seqNumber = localFlushedSn_,
 				.ackNumber = 0,
-				.window = 0,
+				.window = std::min(recvRing_.spaceForEnqueue(), size_t{0xFFFF}),
 				.checksum = 0,
 				.urgentPointer = 0
 			};
-			header->flags.store(TcpHeader::headerWords(sizeof(TcpHeader) / 4)
+			header->flags.store(TcpHeader::headerWords(buf.size() / 4)
 					| TcpHeader::synFlag(true));
+			writeOptions_(buf.data() + sizeof(TcpHeader), true, {});
 
 			// Fill in the checksum.
 			PseudoHeader pseudo {
@@ -538,17 +912,22 @@ async::result<void> Tcp4Socket::flushOutPackets_() {
 				.dst = remoteEp_.ipAddress,
 				.len = buf.size()
 			};
-			Checksum csum;
-			csum.update(&pseudo, sizeof(PseudoHeader));
-			csum.update(buf.data(), buf.size());
-			header->checksum = csum.finalize();
+			auto csumOffset = fillChecksum(targetInfo->link.get(), pseudo, buf);
 
+			// Karn's algorithm: only time the SYN if it is not a retransmission.
+			if(localFlushedSn_ == localSentSn_) {
+				rttTiming_ = true;
+				rttSn_ = localFlushedSn_ + 1;
+				rttStart_ = helix::currentClock();
+			}
 			++localFlushedSn_;
+			localSentSn_ = localFlushedSn_;
+			armTimer_();
 
 			if(debugTcp)
 				std::cout << "netserver: Sending TCP SYN" << std::endl;
 			auto error = co_await ip4().sendFrame(std::move(*targetInfo),
-				buf.data(), buf.size(), static_cast<uint16_t>(IpProto::tcp));
+				buf.data(), buf.size(), static_cast<uint16_t>(IpProto::tcp), csumOffset);
 			if (error != protocols::fs::Error::none) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Could not send TCP packet" << std::endl;
@@ -557,52 +936,92 @@ async::result<void> Tcp4Socket::flushOutPackets_() {
 		}else{
 			assert(connectState_ == ConnectState::connected);
 			size_t flushPointer = localFlushedSn_ - localSettledSn_;
-			size_t windowPointer = localWindowSn_ - localSettledSn_;
+			size_t sentPointer = localSentSn_ - localSettledSn_;
+			// We send as much as both the remote window and the congestion window allow.
+			size_t windowPointer = std::min(size_t{localWindowSn_ - localSettledSn_},
+					cc_->cwnd());
 
 			size_t bytesAvailable = sendRing_.availableToDequeue();
-			assert(bytesAvailable >= flushPointer);
+			assert(bytesAvailable >= sentPointer);
 
 			// Check whether we need to send a packet.
-			// TODO: Add retransmission here.
+			// Fast retransmits ignore the windows (RFC 5681).
+			bool wantRetransmit = retransmitPending_ && sentPointer;
 			bool wantData = (bytesAvailable > flushPointer && windowPointer > flushPointer);
-			bool wantAck = (remoteAckedSn_ != remoteKnownSn_);
-			bool wantWindowUpdate = (announcedWindow_ < recvRing_.spaceForEnqueue());
+			bool wantAck = (remoteAckedSn_ != remoteKnownSn_) || ackNow_;
+			bool wantWindowUpdate = (announcedWindow_ < announceableWindow_());
+			retransmitPending_ = false;
+
+			// With SACK information, retransmit the next hole instead of the first segment.
+			uint32_t retransmitSn = localSettledSn_;
+			size_t retransmitSize = sentPointer;
+			if(wantRetransmit && !sacked_.empty()) {
+				auto hole = nextHole_(highRetransmitSn_);
+				if(hole) {
+					retransmitSn = hole->first;
+					retransmitSize = hole->second - hole->first;
+				}else{
+					wantRetransmit = false;
+				}
+			}
 
-			if(!wantData && !wantAck && !wantWindowUpdate) {
+			if(!wantRetransmit && !wantData && !wantAck && !wantWindowUpdate) {
 				co_await flushEvent_.async_wait();
 				continue;
 			}
 
 			// Construct and transmit the TCP packet.
-			auto targetInfo = co_await ip4().targetByRemote(remoteEp_.ipAddress);
+			auto targetInfo = co_await ip4().targetByRemote(remoteEp_.ipAddress, targetCache_);
 			if (!targetInfo) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Destination unreachable" << std::endl;
 				co_return;
 			}
 
-			auto chunk = std::min({
-				bytesAvailable - flushPointer,
-				windowPointer - flushPointer,
-				size_t{1000} // TODO: Perform path MTU discovery.
-			});
+			uint32_t sn = localFlushedSn_;
+			size_t offset = flushPointer;
+			size_t chunk = 0;
+			if(wantRetransmit) {
+				sn = retransmitSn;
+				offset = retransmitSn - localSettledSn_;
+				chunk = std::min(retransmitSize, dataMss_());
+				highRetransmitSn_ = sn + chunk;
+				rttTiming_ = false;
+			}else if(wantData) {
+				// Large chunks are sent as super-packets that the IP layer
+				// or the NIC splits into segments of dataMss_() bytes.
+				chunk = std::min({
+					bytesAvailable - flushPointer,
+					windowPointer - flushPointer,
+					maxSuperPacketPayload / dataMss_() * dataMss_()
+				});
+			}
+			size_t gsoSize = (chunk > dataMss_()) ? dataMss_() : 0;
+
+			std::vector<std::pair<uint32_t, uint32_t>> sackBlocks;
+			if(sackEnabled_)
+				sackBlocks = buildSackBlocks_();
 
 			std::vector<char> buf;
-			buf.resize(sizeof(TcpHeader) + chunk);
+			buf.resize(sizeof(TcpHeader) + maxOptionsLength);
+			auto headerLength = sizeof(TcpHeader)
+					+ writeOptions_(buf.data() + sizeof(TcpHeader), false, sackBlocks);
+			buf.resize(headerLength + chunk);
 
+			auto window = announceableWindow_();
 			auto header = new (buf.data()) TcpHeader {
 				.srcPort = localEp_.port,
 				.destPort = remoteEp_.port,
-				.seqNumber = localFlushedSn_,
+				.seqNumber = sn,
 				.ackNumber = remoteKnownSn_,
-				.window = std::min(recvRing_.spaceForEnqueue(), size_t{0xFFFF}),
+				.window = static_cast<uint16_t>(window >> recvWindowScale_),
 				.checksum = 0,
 				.urgentPointer = 0
 			};
-			header->flags.store(TcpHeader::headerWords(sizeof(TcpHeader) / 4)
+			header->flags.store(TcpHeader::headerWords(headerLength / 4)
 					| TcpHeader::ackFlag(true));
 
-			sendRing_.dequeueLookahead(flushPointer, buf.data() + sizeof(TcpHeader), chunk);
+			sendRing_.dequeueLookahead(offset, buf.data() + headerLength, chunk);
 
 			// Fill in the checksum.
 			PseudoHeader pseudo {
@@ -610,20 +1029,34 @@ async::result<void> Tcp4Socket::flushOutPackets_() {
 				.dst = remoteEp_.ipAddress,
 				.len = buf.size()
 			};
-			Checksum csum;
-			csum.update(&pseudo, sizeof(PseudoHeader));
-			csum.update(buf.data(), buf.size());
-			header->checksum = csum.finalize();
-
-			localFlushedSn_ += chunk;
+			// Software GSO computes the checksums of the individual segments.
+			std::optional<size_t> csumOffset;
+			if(!gsoSize || targetInfo->link->tcpSegmentationOffload)
+				csumOffset = fillChecksum(targetInfo->link.get(), pseudo, buf);
+
+			if(!wantRetransmit) {
+				// Time new data unless a measurement is already ongoing.
+				if(chunk && localFlushedSn_ == localSentSn_ && !rttTiming_) {
+					rttTiming_ = true;
+					rttSn_ = localFlushedSn_ + chunk;
+					rttStart_ = helix::currentClock();
+				}
+				localFlushedSn_ += chunk;
+				if(snBefore(localSentSn_, localFlushedSn_))
+					localSentSn_ = localFlushedSn_;
+			}
+			if(chunk && !rtoDeadline_)
+				armTimer_();
 			remoteAckedSn_ = remoteKnownSn_;
-			announcedWindow_ = recvRing_.spaceForEnqueue();
+			announcedWindow_ = window;
+			ackNow_ = false;
 
 			if(debugTcp)
-				std::cout << "netserver: Sending TCP data (" << chunk << " bytes)" << std::endl;
+				std::cout << "netserver: Sending TCP data (" << chunk << " bytes"
+						<< (wantRetransmit ? ", retransmission)" : ")") << std::endl;
 			auto error = co_await ip4().sendFrame(std::move(*targetInfo),
 				buf.data(), buf.size(),
-				static_cast<uint16_t>(IpProto::tcp));
+				static_cast<uint16_t>(IpProto::tcp), csumOffset, gsoSize);
 			if (error != protocols::fs::Error::none) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Could not send TCP packet" << std::endl;
@@ -635,7 +1068,7 @@ async::result<void> Tcp4Socket::flushOutPackets_() {
 
 void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 	if(connectState_ == ConnectState::sendSyn) {
-		if(localSettledSn_ == localFlushedSn_) {
+		if(localSettledSn_ == localSentSn_) {
 			std::cout << "netserver: Rejecting packet before SYN is sent [sendSyn]"
 					<< std::endl;
 			return;
@@ -657,7 +1090,29 @@ void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 			return;
 		}
 
+		if(rttTiming_)
+			sampleRtt_(helix::currentClock() - rttStart_);
+		rttTiming_ = false;
+		rtoDeadline_ = 0;
+
+		// Window scaling is only used if both sides ask for it.
+		auto &options = packet.options;
+		if(options.mss)
+			mss_ = std::clamp(size_t{*options.mss}, size_t{64}, tcpMss);
+		if(options.windowScale) {
+			sendWindowScale_ = *options.windowScale;
+			recvWindowScale_ = localWindowScale;
+		}
+		if(options.timestamp) {
+			tsEnabled_ = true;
+			tsRecent_ = options.timestamp->first;
+		}
+		sackEnabled_ = options.sackPermitted;
+		cc_ = makeCongestionControl(congestionAlgorithm, dataMss_());
+
 		++localSettledSn_;
+		localFlushedSn_ = localSettledSn_;
+		recoverSn_ = localSettledSn_;
 		localWindowSn_ = localSettledSn_ + packet.header.window.load();
 		remoteAckedSn_ = packet.header.seqNumber.load();
 		remoteKnownSn_ = packet.header.seqNumber.load() + 1; // SYN counts as one byte.
@@ -665,57 +1120,471 @@ void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 		flushEvent_.raise();
 		settleEvent_.raise();
 	}else if(connectState_ == ConnectState::connected) {
-		if(packet.header.seqNumber.load() == remoteKnownSn_) {
-			bool gotUpdate = false;
-
-			auto payload = packet.payload();
-			size_t chunk = std::min(payload.size(), recvRing_.spaceForEnqueue());
-			if(chunk) {
-				recvRing_.enqueue(payload.data(), chunk);
-				remoteKnownSn_ += chunk;
-				if(announcedWindow_ < chunk) {
-					announcedWindow_ = 0;
-				}else{
-					announcedWindow_ -= chunk;
-				}
+		// Remember the timestamp to echo (RFC 7323, section 4.3).
+		auto seq = packet.header.seqNumber.load();
+		if(tsEnabled_ && packet.options.timestamp && !snBefore(remoteAckedSn_, seq)
+				&& !snBefore(packet.options.timestamp->first, tsRecent_))
+			tsRecent_ = packet.options.timestamp->first;
 
-				inSeq_ = ++currentSeq_;
-				gotUpdate = true;
-			}
+		receiveData_(packet);
 
-			if(packet.header.flags.load() & TcpHeader::finFlag) {
-				++remoteKnownSn_; // FIN counts as one byte.
-				remoteClosed_ = true;
+		if(packet.header.flags.load() & TcpHeader::ackFlag)
+			handleAck_(packet);
+	}
+}
 
-				hupSeq_ = ++currentSeq_;
-				gotUpdate = true;
-			}
+void Tcp4Socket::receiveData_(TcpPacket &packet) {
+	auto seq = packet.header.seqNumber.load();
+	auto payloadSize = packet.payloadSize();
+	bool fin = packet.header.flags.load() & TcpHeader::finFlag;
+	if(!payloadSize && !fin)
+		return;
 
-			if(gotUpdate) {
-				inEvent_.raise();
-				flushEvent_.raise();
-				pollEvent_.raise();
-			}
+	if(snBefore(remoteKnownSn_, seq)) {
+		// Keep out-of-order data that fits into the window; the ACK that we send
+		// immediately tells the remote about the hole. FINs are only processed in order.
+		if(!payloadSize || seq - remoteKnownSn_ + payloadSize > recvRing_.spaceForEnqueue()) {
+			ackNow_ = true;
+			flushEvent_.raise();
+			return;
+		}
+
+		auto it = outOfOrder_.end();
+		while(it != outOfOrder_.begin() && snBefore(seq, std::prev(it)->sn))
+			--it;
+		if(it == outOfOrder_.begin() || std::prev(it)->sn != seq
+				|| std::prev(it)->data.size() < payloadSize) {
+			std::vector<char> data;
+			data.reserve(payloadSize);
+			packet.walkPayload(0, payloadSize, [&] (char *p, size_t n) {
+				data.insert(data.end(), p, p + n);
+			});
+			outOfOrder_.insert(it, OutOfOrderSegment{seq, std::move(data)});
+		}
+		lastOutOfOrderSn_ = seq;
+		ackNow_ = true;
+		flushEvent_.raise();
+		return;
+	}
+
+	// Skip the part of the segment that we already received.
+	size_t skip = remoteKnownSn_ - seq;
+	if(skip > payloadSize || (skip == payloadSize && !fin)) {
+		ackNow_ = true;
+		flushEvent_.raise();
+		return;
+	}
+
+	bool gotUpdate = false;
+
+	// Data only bypasses the ring if that does not reorder it.
+	size_t direct = 0;
+	if(directRead_ && !recvRing_.availableToDequeue()) {
+		direct = std::min(payloadSize - skip, directRead_->size - directRead_->progress);
+		packet.walkPayload(skip, direct, [&] (char *p, size_t n) {
+			memcpy(directRead_->buffer + directRead_->progress, p, n);
+			directRead_->progress += n;
+		});
+	}
+
+	size_t chunk = direct + std::min(payloadSize - skip - direct, recvRing_.spaceForEnqueue());
+	if(chunk) {
+		packet.walkPayload(skip + direct, chunk - direct, [&] (char *p, size_t n) {
+			recvRing_.enqueue(p, n);
+		});
+		remoteKnownSn_ += chunk;
+		announcedWindow_ -= std::min(size_t{announcedWindow_}, chunk);
+
+		// Segments that fill a hole are acknowledged immediately (RFC 5681).
+		if(!outOfOrder_.empty()) {
+			drainOutOfOrder_();
+			ackNow_ = true;
+		}
+
+		inSeq_ = ++currentSeq_;
+		gotUpdate = true;
+	}
+
+	if(fin && skip + chunk == payloadSize) {
+		++remoteKnownSn_; // FIN counts as one byte.
+		remoteClosed_ = true;
+
+		hupSeq_ = ++currentSeq_;
+		gotUpdate = true;
+	}
+
+	if(gotUpdate) {
+		inEvent_.raise();
+		flushEvent_.raise();
+		pollEvent_.raise();
+	}
+}
+
+void Tcp4Socket::drainOutOfOrder_() {
+	while(!outOfOrder_.empty()) {
+		auto &segment = outOfOrder_.front();
+		if(snBefore(remoteKnownSn_, segment.sn))
+			break;
+
+		size_t skip = remoteKnownSn_ - segment.sn;
+		if(skip < segment.data.size()) {
+			size_t chunk = std::min(segment.data.size() - skip, recvRing_.spaceForEnqueue());
+			recvRing_.enqueue(segment.data.data() + skip, chunk);
+			remoteKnownSn_ += chunk;
+			announcedWindow_ -= std::min(size_t{announcedWindow_}, chunk);
+			if(skip + chunk < segment.data.size())
+				break;
+		}
+		outOfOrder_.pop_front();
+	}
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> Tcp4Socket::buildSackBlocks_() {
+	std::vector<std::pair<uint32_t, uint32_t>> blocks;
+	for(auto &segment : outOfOrder_) {
+		uint32_t end = segment.sn + segment.data.size();
+		if(!blocks.empty() && !snBefore(blocks.back().second, segment.sn)) {
+			if(snBefore(blocks.back().second, end))
+				blocks.back().second = end;
+		}else{
+			blocks.push_back({segment.sn, end});
+		}
+	}
+
+	// The first block must contain the most recently received segment (RFC 2018).
+	auto it = std::find_if(blocks.begin(), blocks.end(), [&] (auto &block) {
+		return !snBefore(lastOutOfOrderSn_, block.first)
+				&& snBefore(lastOutOfOrderSn_, block.second);
+	});
+	if(it != blocks.end())
+		std::rotate(blocks.begin(), it, it + 1);
+
+	size_t limit = tsEnabled_ ? maxSackBlocks : maxSackBlocks + 1;
+	if(blocks.size() > limit)
+		blocks.resize(limit);
+	return blocks;
+}
+
+size_t Tcp4Socket::writeOptions_(char *p, bool syn,
+		const std::vector<std::pair<uint32_t, uint32_t>> &sackBlocks) {
+	size_t n = 0;
+	auto store32 = [&] (uint32_t v) {
+		p[n++] = v >> 24;
+		p[n++] = v >> 16;
+		p[n++] = v >> 8;
+		p[n++] = v;
+	};
+
+	if(syn) {
+		// Same layout as Linux, such that the options are word-aligned.
+		p[n++] = TcpOptions::kindMss;
+		p[n++] = 4;
+		p[n++] = tcpMss >> 8;
+		p[n++] = tcpMss & 0xFF;
+		p[n++] = TcpOptions::kindSackPermitted;
+		p[n++] = 2;
+		p[n++] = TcpOptions::kindTimestamp;
+		p[n++] = 10;
+		store32(timestampClock());
+		store32(0);
+		p[n++] = TcpOptions::kindNop;
+		p[n++] = TcpOptions::kindWindowScale;
+		p[n++] = 3;
+		p[n++] = localWindowScale;
+		assert(n == synOptionsLength);
+		return n;
+	}
+
+	if(tsEnabled_) {
+		p[n++] = TcpOptions::kindNop;
+		p[n++] = TcpOptions::kindNop;
+		p[n++] = TcpOptions::kindTimestamp;
+		p[n++] = 10;
+		store32(timestampClock());
+		store32(tsRecent_);
+	}
+
+	if(!sackBlocks.empty()) {
+		p[n++] = TcpOptions::kindNop;
+		p[n++] = TcpOptions::kindNop;
+		p[n++] = TcpOptions::kindSack;
+		p[n++] = 2 + 8 * sackBlocks.size();
+		for(auto [start, end] : sackBlocks) {
+			store32(start);
+			store32(end);
+		}
+	}
+	assert(n <= maxOptionsLength);
+	return n;
+}
+
+void Tcp4Socket::updateScoreboard_(const std::vector<std::pair<uint32_t, uint32_t>> &blocks) {
+	for(auto [start, end] : blocks) {
+		// Ignore D-SACKs (RFC 2883) and blocks outside of the outstanding data.
+		if(!snBefore(start, end) || !snBefore(localSettledSn_, start)
+				|| snBefore(localSentSn_, end))
+			continue;
+		sacked_.push_back({start, end});
+	}
+
+	std::sort(sacked_.begin(), sacked_.end(), [] (auto &a, auto &b) {
+		return snBefore(a.first, b.first);
+	});
+	std::vector<std::pair<uint32_t, uint32_t>> merged;
+	for(auto range : sacked_) {
+		// Drop what the cumulative ACK covers.
+		if(!snBefore(localSettledSn_, range.second))
+			continue;
+		if(snBefore(range.first, localSettledSn_))
+			range.first = localSettledSn_;
+
+		if(!merged.empty() && !snBefore(merged.back().second, range.first)) {
+			if(snBefore(merged.back().second, range.second))
+				merged.back().second = range.second;
+		}else{
+			merged.push_back(range);
 		}
+	}
+	sacked_ = std::move(merged);
+}
+
+std::optional<std::pair<uint32_t, uint32_t>> Tcp4Socket::nextHole_(uint32_t from) {
+	auto position = snBefore(from, localSettledSn_) ? localSettledSn_ : from;
+	for(auto [start, end] : sacked_) {
+		if(snBefore(position, start))
+			return std::pair{position, start};
+		if(snBefore(position, end))
+			position = end;
+	}
+	return std::nullopt;
+}
+
+void Tcp4Socket::tuneRecvBuffer_(size_t copied) {
+	if(recvBufferLocked_)
+		return;
+
+	copiedSinceTune_ += copied;
+	auto now = helix::currentClock();
+	if(now - lastTune_ < (haveRtt_ ? srtt_ : defaultTuneInterval))
+		return;
+
+	// Similar to Linux' dynamic right-sizing, the buffer should hold
+	// twice the amount of data that the application consumes per RTT.
+	auto shift = bufferShiftFor(2 * copiedSinceTune_);
+	if((size_t{1} << shift) > recvRing_.capacity()) {
+		recvRing_.resize(shift);
+		flushEvent_.raise();
+	}
+	copiedSinceTune_ = 0;
+	lastTune_ = now;
+}
+
+void Tcp4Socket::tuneSendBuffer_() {
+	if(sendBufferLocked_)
+		return;
+
+	// Buffer enough data to fill the windows.
+	size_t inFlight = std::min(cc_->cwnd(), size_t{localWindowSn_ - localSettledSn_});
+	auto shift = bufferShiftFor(2 * inFlight);
+	if((size_t{1} << shift) > sendRing_.capacity())
+		sendRing_.resize(shift);
+}
 
-		if(packet.header.flags.load() & TcpHeader::ackFlag) {
-			size_t validWindow = localFlushedSn_ - localSettledSn_;
-			size_t ackPointer = packet.header.ackNumber.load() - localSettledSn_;
-			if(ackPointer <= validWindow) {
-				localSettledSn_ += ackPointer;
-				localWindowSn_ = localSettledSn_ + packet.header.window.load();
-				sendRing_.dequeueAdvance(ackPointer);
-				outSeq_ = ++currentSeq_;
-				settleEvent_.raise();
-				pollEvent_.raise();
-			}else{
-				std::cout << "netserver: Rejecting ack-number outside of valid window"
-						<< std::endl;
+void Tcp4Socket::handleAck_(TcpPacket &packet) {
+	// ACKs may cover data that we sent before a retransmission timeout.
+	size_t validWindow = localSentSn_ - localSettledSn_;
+	size_t ackPointer = packet.header.ackNumber.load() - localSettledSn_;
+	if(ackPointer > validWindow) {
+		std::cout << "netserver: Rejecting ack-number outside of valid window"
+				<< std::endl;
+		return;
+	}
+
+	auto windowSn = localSettledSn_ + ackPointer
+			+ (uint32_t{packet.header.window.load()} << sendWindowScale_);
+	if(sackEnabled_)
+		updateScoreboard_(packet.options.sackBlocks);
+
+	if(!ackPointer) {
+		// Duplicate ACKs carry no data and do not change the window (RFC 5681).
+		auto flags = packet.header.flags.load();
+		bool duplicate = validWindow && !packet.payloadSize()
+				&& !(flags & TcpHeader::synFlag) && !(flags & TcpHeader::finFlag)
+				&& windowSn == localWindowSn_;
+		localWindowSn_ = windowSn;
+
+		if(duplicate) {
+			++dupAcks_;
+			if(inRecovery_) {
+				cc_->onRecoveryDupAck();
+				// New SACK information can reveal further holes.
+				if(!sacked_.empty() && nextHole_(highRetransmitSn_))
+					retransmitPending_ = true;
+			}else if(dupAcks_ == dupAckThreshold && snBefore(recoverSn_, localSettledSn_)) {
+				// Fast retransmit. Only the first loss in a window of data starts a recovery.
+				cc_->onEnterRecovery(validWindow, helix::currentClock());
+				inRecovery_ = true;
+				recoverSn_ = localSentSn_;
+				highRetransmitSn_ = localSettledSn_;
+				retransmitPending_ = true;
+				logCongestion_("fast retransmit");
 			}
 		}
+
+		settleEvent_.raise();
+		flushEvent_.raise();
+		return;
+	}
+
+	auto now = helix::currentClock();
+	auto ackSn = localSettledSn_ + ackPointer;
+	if(tsEnabled_ && packet.options.timestamp && packet.options.timestamp->second) {
+		// Echoed timestamps identify the transmission, so retransmissions can be timed, too.
+		uint32_t elapsed = timestampClock() - packet.options.timestamp->second;
+		sampleRtt_(uint64_t{elapsed} * 1'000'000);
+		rttTiming_ = false;
+	}else if(rttTiming_ && !snBefore(ackSn, rttSn_)) {
+		sampleRtt_(now - rttStart_);
+		rttTiming_ = false;
+	}
+
+	localSettledSn_ = ackSn;
+	if(snBefore(localFlushedSn_, localSettledSn_))
+		localFlushedSn_ = localSettledSn_;
+	localWindowSn_ = windowSn;
+	sendRing_.dequeueAdvance(ackPointer);
+	dupAcks_ = 0;
+	if(sackEnabled_)
+		updateScoreboard_({});
+
+	if(inRecovery_) {
+		if(snBefore(localSettledSn_, recoverSn_)) {
+			// Partial ACK: the next segment was lost as well (RFC 6582).
+			cc_->onPartialAck(ackPointer);
+			retransmitPending_ = true;
+		}else{
+			cc_->onExitRecovery();
+			inRecovery_ = false;
+			logCongestion_("recovered");
+		}
+	}else{
+		cc_->onAck(ackPointer, now, srtt_);
+	}
+	tuneSendBuffer_();
+
+	// Restart the timer for the remaining data (RFC 6298, 5.2 and 5.3).
+	if(localSettledSn_ == localSentSn_) {
+		rtoDeadline_ = 0;
+	}else{
+		armTimer_();
+	}
+
+	outSeq_ = ++currentSeq_;
+	settleEvent_.raise();
+	flushEvent_.raise();
+	pollEvent_.raise();
+}
+
+async::result<void> Tcp4Socket::runRetransmitTimer_() {
+	while(true) {
+		if(!rtoDeadline_) {
+			co_await timerEvent_.async_wait();
+			continue;
+		}
+
+		// The deadline might have moved while we slept.
+		auto now = helix::currentClock();
+		if(now < rtoDeadline_) {
+			co_await helix::sleepFor(rtoDeadline_ - now);
+			continue;
+		}
+
+		handleTimeout_();
+	}
+}
+
+void Tcp4Socket::handleTimeout_() {
+	if(connectState_ == ConnectState::connected)
+		cc_->onTimeout(localSentSn_ - localSettledSn_, helix::currentClock());
+
+	// Resend everything starting at the first unacknowledged byte
+	// and back off the timer (RFC 6298, 5.4 - 5.6).
+	localFlushedSn_ = localSettledSn_;
+	rto_ = std::min(rto_ * 2, maxRto);
+	rttTiming_ = false;
+	dupAcks_ = 0;
+	inRecovery_ = false;
+	recoverSn_ = localSentSn_;
+	retransmitPending_ = false;
+	// Receivers may discard SACKed data, so we resend it as well (RFC 2018, section 8).
+	sacked_.clear();
+	armTimer_();
+	logCongestion_("timeout");
+
+	flushEvent_.raise();
+}
+
+void Tcp4Socket::sampleRtt_(uint64_t rtt) {
+	if(!haveRtt_) {
+		srtt_ = rtt;
+		rttVar_ = rtt / 2;
+		haveRtt_ = true;
+	}else{
+		auto delta = (srtt_ > rtt) ? srtt_ - rtt : rtt - srtt_;
+		rttVar_ = (3 * rttVar_ + delta) / 4;
+		srtt_ = (7 * srtt_ + rtt) / 8;
 	}
+	rto_ = std::clamp(srtt_ + std::max(clockGranularity, 4 * rttVar_), minRto, maxRto);
+}
+
+void Tcp4Socket::logCongestion_(const char *event) {
+	if(!logCongestion)
+		return;
+	std::cout << "netserver: TCP " << event << " on port " << localEp_.port
+			<< " (" << cc_->name() << "), cwnd: " << cc_->cwnd()
+			<< ", ssthresh: " << cc_->ssthresh()
+			<< ", srtt: " << srtt_ / 1000 << " us, rttvar: " << rttVar_ / 1000
+			<< " us, rto: " << rto_ / 1000 << " us" << std::endl;
+}
+
+Tcp4::Tcp4() = default;
+
+Tcp4::~Tcp4() = default;
+
+namespace {
+
+bool sameFlow(TcpPacket &a, TcpPacket &b) {
+	return a.packet->header.source == b.packet->header.source
+			&& a.packet->header.destination == b.packet->header.destination
+			&& a.header.srcPort.load() == b.header.srcPort.load()
+			&& a.header.destPort.load() == b.header.destPort.load();
+}
+
+// Segments that only carry data (and an ACK) can be merged by GRO.
+bool groCandidate(TcpPacket &packet) {
+	auto flags = packet.header.flags.load();
+	return (flags & TcpHeader::ackFlag) && !(flags & TcpHeader::synFlag)
+			&& !(flags & TcpHeader::finFlag) && !(flags & TcpHeader::rstFlag)
+			&& !(flags & TcpHeader::urgFlag)
+			&& packet.options.sackBlocks.empty() && packet.payload().size();
 }
 
+// Whether next directly follows head and carries the same header information.
+bool groMergeable(TcpPacket &head, TcpPacket &next) {
+	auto headFlags = head.header.flags.load();
+	auto nextFlags = next.header.flags.load();
+	uint32_t endSn = head.header.seqNumber.load() + head.payloadSize();
+	return endSn == next.header.seqNumber.load()
+			&& head.header.ackNumber.load() == next.header.ackNumber.load()
+			&& head.header.window.load() == next.header.window.load()
+			&& (headFlags & TcpHeader::headerWords) == (nextFlags & TcpHeader::headerWords)
+			&& !(headFlags & TcpHeader::pshFlag)
+			&& head.options.timestamp == next.options.timestamp
+			&& head.payloadSize() + next.payload().size() <= maxSuperPacketPayload;
+}
+
+} // anonymous namespace
+
 void Tcp4::feedDatagram(smarter::shared_ptr<const Ip4Packet> packet) {
 	TcpPacket tcp;
 	if (!tcp.parse(std::move(packet))) {
@@ -727,33 +1596,82 @@ void Tcp4::feedDatagram(smarter::shared_ptr<const Ip4Packet> packet) {
 		std::cout << "netserver: Received TCP packet at port " << tcp.header.destPort.load()
 				<< " (" << tcp.payload().size() << " bytes)" << std::endl;
 
-	auto it = binds.lower_bound({ 0, tcp.header.destPort.load() });
-	for (; it != binds.end() && it->first.port == tcp.header.destPort.load(); it++) {
-		auto existingEp = it->first;
-		if (existingEp.ipAddress == tcp.packet->header.destination
-				|| existingEp.ipAddress == INADDR_ANY) {
-			it->second->handleInPacket_(std::move(tcp));
-			break;
+	auto it = std::find_if(groPending_.begin(), groPending_.end(), [&] (auto &pending) {
+		return sameFlow(pending, tcp);
+	});
+	bool candidate = groCandidate(tcp);
+	if (it != groPending_.end()) {
+		if (candidate && groMergeable(*it, tcp)) {
+			it->merged.push_back(std::move(tcp));
+			return;
 		}
+
+		// Keep the order of the flow's segments.
+		auto head = std::move(*it);
+		groPending_.erase(it);
+		dispatch_(std::move(head));
+	}
+
+	if (candidate) {
+		groPending_.push_back(std::move(tcp));
+	} else {
+		dispatch_(std::move(tcp));
 	}
 }
 
-bool Tcp4::tryBind(smarter::shared_ptr<Tcp4Socket> socket, TcpEndpoint wantedEp) {
-	auto it = binds.lower_bound(wantedEp);
-	for (; it != binds.end() && it->first.port == wantedEp.port; it++) {
-		auto existingEp = it->first;
-		if (existingEp.ipAddress == INADDR_ANY || wantedEp.ipAddress == INADDR_ANY
-				|| existingEp.ipAddress == wantedEp.ipAddress) {
-			return false;
-		}
+void Tcp4::flushGro() {
+	auto pending = std::move(groPending_);
+	groPending_.clear();
+	for (auto &tcp : pending)
+		dispatch_(std::move(tcp));
+}
+
+void Tcp4::dispatch_(TcpPacket tcp) {
+	TcpFlow flow {
+		.localAddress = tcp.packet->header.destination,
+		.remoteAddress = tcp.packet->header.source,
+		.localPort = tcp.header.destPort.load(),
+		.remotePort = tcp.header.srcPort.load()
+	};
+
+	// Established flows take precedence over the sockets bound to the port.
+	auto &cache = lastFlow_[tcp.packet->rxQueue % nic::maxQueues];
+	Tcp4Socket *socket = nullptr;
+	if (cache.socket && cache.flow == flow) {
+		socket = cache.socket;
+	} else if (auto it = flows_.find(flow); it != flows_.end()) {
+		socket = it->second.get();
+		cache = {flow, socket};
+	} else {
+		socket = binds_.lookup(flow.localAddress, flow.localPort);
 	}
-	socket->localEp_ = wantedEp;
-	binds.emplace(wantedEp, std::move(socket));
+
+	if (socket)
+		socket->handleInPacket_(std::move(tcp));
+}
+
+bool Tcp4::tryBind(smarter::shared_ptr<Tcp4Socket> socket, TcpEndpoint wantedEp) {
+	auto raw = socket.get();
+	if (!binds_.tryInsert(wantedEp.ipAddress, wantedEp.port, std::move(socket)))
+		return false;
+	raw->localEp_ = wantedEp;
 	return true;
 }
 
 bool Tcp4::unbind(TcpEndpoint e) {
-	return binds.erase(e) != 0;
+	return binds_.erase(e.ipAddress, e.port);
+}
+
+void Tcp4::registerFlow(TcpFlow flow, smarter::shared_ptr<Tcp4Socket> socket) {
+	flows_.emplace(flow, std::move(socket));
+}
+
+void Tcp4::unregisterFlow(TcpFlow flow) {
+	flows_.erase(flow);
+	for (auto &entry : lastFlow_) {
+		if (entry.socket && entry.flow == flow)
+			entry = {};
+	}
 }
 
 void Tcp4::serveSocket(int flags, helix::UniqueLane lane) {
@@ -1,8 +1,13 @@
 #pragma once
 
 #include <helix/ipc.hpp>
+#include <netserver/nic.hpp>
 #include <smarter.hpp>
-#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "demux.hpp"
 
 class Ip4Packet;
 
@@ -15,14 +20,51 @@ struct TcpEndpoint {
 	uint16_t port = 0;
 };
 
+// Identifies a connection; all values are in native byte order.
+struct TcpFlow {
+	friend bool operator==(const TcpFlow &, const TcpFlow &) = default;
+
+	uint32_t localAddress = 0;
+	uint32_t remoteAddress = 0;
+	uint16_t localPort = 0;
+	uint16_t remotePort = 0;
+};
+
+struct TcpFlowHash {
+	size_t operator()(const TcpFlow &f) const {
+		return hashFlow(f.localAddress, f.remoteAddress, f.localPort, f.remotePort);
+	}
+};
+
 struct Tcp4Socket;
+struct TcpPacket;
 
 struct Tcp4 {
+	Tcp4();
+	~Tcp4();
+
 	void feedDatagram(smarter::shared_ptr<const Ip4Packet>);
+	// Processes the segments that GRO held back.
+	void flushGro();
 	bool tryBind(smarter::shared_ptr<Tcp4Socket> socket, TcpEndpoint ipAddress);
 	bool unbind(TcpEndpoint remote);
+	// Connections are registered once their local address is known.
+	void registerFlow(TcpFlow flow, smarter::shared_ptr<Tcp4Socket> socket);
+	void unregisterFlow(TcpFlow flow);
 	void serveSocket(int flags, helix::UniqueLane lane);
 
 private:
-	std::map<TcpEndpoint, smarter::shared_ptr<Tcp4Socket>> binds;
+	void dispatch_(TcpPacket tcp);
+
+	BindTable<Tcp4Socket> binds_;
+	std::unordered_map<TcpFlow, smarter::shared_ptr<Tcp4Socket>, TcpFlowHash> flows_;
+	// Consecutive packets on a receive queue usually belong to the same flow.
+	struct FlowCacheEntry {
+		TcpFlow flow;
+		Tcp4Socket *socket = nullptr;
+	};
+	FlowCacheEntry lastFlow_[nic::maxQueues];
+	// Generic receive offload: in-order segments of a flow are merged until
+	// the end of the current batch of received frames.
+	std::vector<TcpPacket> groPending_;
 };
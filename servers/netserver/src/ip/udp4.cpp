@@ -8,8 +8,10 @@
 #include <async/queue.hpp>
 #include <arch/bit.hpp>
 #include <protocols/fs/server.hpp>
+#include <cstddef>
 #include <cstring>
 #include <iomanip>
+#include <optional>
 #include <random>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -79,7 +81,7 @@ struct Udp {
 		if (payload.size() < header.len) {
 			return false;
 		}
-		if (header.chk != 0) {
+		if (header.chk != 0 && !packet->checksumValidated) {
 			PseudoHeader phdr;
 			phdr.src = packet->header.source;
 			phdr.dst = packet->header.destination;
@@ -222,7 +224,15 @@ struct Udp4Socket {
 		using arch::convert_endian;
 		using arch::endian;
 		auto self = static_cast<Udp4Socket *>(obj);
-		auto element = co_await self->queue_.async_get();
+		// Batched receives (PT_RECVMMSG) pass MSG_DONTWAIT for all but the first datagram.
+		frg::optional<Udp> element;
+		if (flags & MSG_DONTWAIT) {
+			element = self->queue_.maybe_get();
+			if (!element)
+				co_return protocols::fs::Error::wouldBlock;
+		} else {
+			element = co_await self->queue_.async_get();
+		}
 		auto packet = element->payload();
 		auto copy_size = std::min(packet.size(), len);
 		std::memcpy(data, packet.data(), copy_size);
@@ -290,7 +300,7 @@ struct Udp4Socket {
 		source.ensureEndian();
 		target.ensureEndian();
 
-		auto ti = co_await ip4().targetByRemote(targetIpNe);
+		auto ti = co_await ip4().targetByRemote(targetIpNe, self->targetCache_);
 		if (!ti) {
 			co_return protocols::fs::Error::netUnreachable;
 		}
@@ -302,9 +312,16 @@ struct Udp4Socket {
 			.len = header.len
 		};
 		chk.update(&psh, sizeof(psh));
-		chk.update(&header, sizeof(header));
-		chk.update(data, len);
-		header.chk = convert_endian<endian::big>(chk.finalize());
+		std::optional<size_t> csumOffset;
+		if (ti->link->txChecksumOffload) {
+			// The NIC sums up the header and the data.
+			header.chk = convert_endian<endian::big>(chk.partial());
+			csumOffset = offsetof(Udp::Header, chk);
+		} else {
+			chk.update(&header, sizeof(header));
+			chk.update(data, len);
+			header.chk = convert_endian<endian::big>(chk.finalize());
+		}
 
 		std::cout << "netserver:" << std::endl << std::hex
 			<< std::setw(8) << psh.src << std::endl
@@ -316,7 +333,7 @@ struct Udp4Socket {
 			<< std::setw(8) << header.len << std::endl
 			<< std::setw(8) << header.chk << std::endl << std::dec;
 
-		if (header.chk == 0) {
+		if (!csumOffset && header.chk == 0) {
 			header.chk = ~header.chk;
 		}
 
@@ -325,7 +342,7 @@ struct Udp4Socket {
 
 		auto error = co_await ip4().sendFrame(std::move(*ti),
 			buf.data(), buf.size(),
-			static_cast<uint16_t>(IpProto::udp));
+			static_cast<uint16_t>(IpProto::udp), csumOffset);
 		if (error != protocols::fs::Error::none) {
 			co_return error;
 		}
@@ -351,11 +368,6 @@ struct Udp4Socket {
 		auto number = dist(rng);
 		auto range_size = dist.b() - dist.a();
 		auto shared_from_this = holder_.lock();
-		// TODO(arsen): optimize to not call lower_bound every time?
-		// I believe that such a thing is not needed right now: nearly
-		// (read: absolutely) every case is is an immediate miss: we are
-		// using next to nothing in this region, or any other region for
-		// that manner
 		for (int i = 0; i < range_size; i++) {
 			uint16_t port = dist.a() + ((number + i) % range_size);
 			if (parent_->tryBind(shared_from_this, { addr, port })) {
@@ -371,6 +383,7 @@ private:
 	async::queue<Udp, stl_allocator> queue_;
 	Endpoint remote_;
 	Endpoint local_;
+	Ip4TargetCache targetCache_;
 	Udp4 *parent_;
 	smarter::weak_ptr<Udp4Socket> holder_;
 };
@@ -384,33 +397,23 @@ void Udp4::feedDatagram(smarter::shared_ptr<const Ip4Packet> packet) {
 
 	std::cout << "received udp datagram to port " << udp.header.dst << std::endl;
 
-	auto i = binds.lower_bound({ 0, udp.header.dst });
-	for (; i != binds.end() && i->first.port == udp.header.dst; i++) {
-		auto ep = i->first;
-		if (ep.addr == udp.packet->header.destination
-			|| ep.addr == INADDR_ANY) {
-			i->second->queue_.emplace(std::move(udp));
-			break;
-		}
+	auto socket = binds_.lookup(udp.packet->header.destination, udp.header.dst);
+	if (socket) {
+		socket->queue_.emplace(std::move(udp));
 	}
 }
 
 bool Udp4::tryBind(smarter::shared_ptr<Udp4Socket> socket, Endpoint addr) {
-	auto i = binds.lower_bound(addr);
-	for (; i != binds.end() && i->first.port == addr.port; i++) {
-		auto ep = i->first;
-		if (ep.addr == INADDR_ANY || addr.addr == INADDR_ANY
-			|| ep.addr == addr.addr) {
-			return false;
-		}
+	auto raw = socket.get();
+	if (!binds_.tryInsert(addr.addr, addr.port, std::move(socket))) {
+		return false;
 	}
-	socket->local_ = addr;
-	binds.emplace(addr, std::move(socket));
+	raw->local_ = addr;
 	return true;
 }
 
 bool Udp4::unbind(Endpoint e) {
-	return binds.erase(e) != 0;
+	return binds_.erase(e.addr, e.port);
 }
 
 void Udp4::serveSocket(helix::UniqueLane lane) {
@@ -2,7 +2,8 @@
 
 #include <helix/ipc.hpp>
 #include <smarter.hpp>
-#include <map>
+
+#include "demux.hpp"
 
 class Ip4Packet;
 
@@ -23,5 +24,5 @@ struct Udp4 {
 	bool unbind(Endpoint remote);
 	void serveSocket(helix::UniqueLane lane);
 private:
-	std::map<Endpoint, smarter::shared_ptr<Udp4Socket>> binds;
+	BindTable<Udp4Socket> binds_;
 };
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <memory>
+#include <netserver/nic.hpp>
+
+namespace nic {
+//! Creates a software link that delivers each frame that is sent over it
+//! to its own receive queue without copying it.
+std::shared_ptr<Link> makeLoopback();
+} // namespace nic
@@ -19,20 +19,23 @@
 #include <sys/socket.h>
 #include "fs.bragi.hpp"
 
+#include "ip/arp.hpp"
 #include "ip/ip4.hpp"
+#include "loopback.hpp"
 
 #include <netserver/nic.hpp>
 #include <nic/virtio/virtio.hpp>
 
 // Maps mbus IDs to device objects
 std::unordered_map<int64_t, std::shared_ptr<nic::Link>> baseDeviceMap;
+std::shared_ptr<nic::Link> loopbackDevice;
 
 async::result<void> doBind(mbus::Entity base_entity, virtio_core::DiscoverMode discover_mode) {
 	protocols::hw::Device hwDevice(co_await base_entity.bind());
 	co_await hwDevice.enableBusmaster();
 	auto transport = co_await virtio_core::discover(std::move(hwDevice), discover_mode);
 
-	auto device = nic::virtio::makeShared(std::move(transport));
+	auto device = co_await nic::virtio::makeShared(std::move(transport));
 	if (baseDeviceMap.empty()) {
 		// default via 10.0.2.2 src 10.10.2.15
 		Ip4Router::Route wan { { 0, 0 }, device };
@@ -40,8 +43,10 @@ async::result<void> doBind(mbus::Entity base_entity, virtio_core::DiscoverMode d
 		wan.source = 0x0a0a020f;
 		ip4Router().addRoute(std::move(wan));
 
-		// 10.0.2.0/24
-		ip4Router().addRoute({ { 0x0a000200, 24 }, device });
+		// 10.0.2.0/24 src 10.10.2.15
+		Ip4Router::Route lan { { 0x0a000200, 24 }, device };
+		lan.source = 0x0a0a020f;
+		ip4Router().addRoute(std::move(lan));
 		// inet 10.10.2.15/24
 		ip4().setLink({ 0x0a0a020f, 24 }, device);
 	}
@@ -165,6 +170,21 @@ async::detached advertise() {
 	co_await root.createObject("netserver", descriptor, std::move(handler));
 }
 
+void setupLoopback() {
+	auto device = nic::makeLoopback();
+
+	// 127.0.0.0/8 src 127.0.0.1
+	Ip4Router::Route route { { 0x7f000000, 8 }, device };
+	route.source = 0x7f000001;
+	ip4Router().addRoute(std::move(route));
+	// inet 127.0.0.1/8
+	ip4().setLink({ 0x7f000001, 8 }, device);
+	neigh4().updateTable(0x7f000001, device->deviceMac());
+
+	loopbackDevice = device;
+	nic::runDevice(device);
+}
+
 static constexpr protocols::svrctl::ControlOperations controlOps = {
 	.bind = bindDevice
 };
@@ -178,6 +198,7 @@ int main() {
 
 //	HEL_CHECK(helSetPriority(kHelThisThread, 3));
 
+	setupLoopback();
 	async::detach(protocols::svrctl::serveControl(&controlOps));
 	advertise();
 	async::run_forever(helix::currentDispatcher);
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cstring>
 #include <arch/bit.hpp>
+#include <helix/ipc.hpp>
 #include "ip/ip4.hpp"
 #include "ip/arp.hpp"
 
@@ -32,12 +33,16 @@ arch::dma_pool *Link::dmaPool() {
 	return dmaPool_;
 }
 
+BufferPool &Link::txPool() {
+	return txPool_;
+}
+
 Link::AllocatedBuffer Link::allocateFrame(MacAddress to, EtherType type,
 		size_t payloadSize) {
 	// default implementation assume an Ethernet II frame
 	using namespace arch;
 	Link::AllocatedBuffer buf {
-		dma_buffer { dmaPool(), 14 + payloadSize }, {}
+		dma_buffer { &txPool_, 14 + payloadSize }, {}
 	};
 
 	uint16_t et = static_cast<uint16_t>(type);
@@ -51,11 +56,20 @@ Link::AllocatedBuffer Link::allocateFrame(MacAddress to, EtherType type,
 	return buf;
 }
 
-async::detached runDevice(std::shared_ptr<nic::Link> dev) {
+namespace {
+// Number of frames that a queue processes before it lets other work run,
+// similar to the budget of Linux' NAPI.
+constexpr int rxBudget = 64;
+
+// Processes the frames of one queue to completion. All queues share the stack
+// and run on the same thread; flows stay on one queue since the driver steers
+// them by hashing their addresses and ports.
+async::detached runQueue(std::shared_ptr<nic::Link> dev, unsigned int queue) {
 	using namespace arch;
+	int processed = 0;
 	while(true) {
-		dma_buffer frameBuffer { dev->dmaPool(), 1514 };
-		co_await dev->receive(frameBuffer);
+		auto frame = co_await dev->receive(queue);
+		auto &frameBuffer = frame.buffer;
 		auto capsule = frameBuffer.subview(14);
 		auto data = reinterpret_cast<uint8_t*>(frameBuffer.data());
 		uint16_t ethertype = data[12] << 8 | data[13];
@@ -65,7 +79,7 @@ async::detached runDevice(std::shared_ptr<nic::Link> dev) {
 		switch (ethertype) {
 		case ETHER_TYPE_IP4:
 			ip4().feedPacket(dstsrc[0], dstsrc[1],
-				std::move(frameBuffer), capsule);
+				std::move(frameBuffer), capsule, frame.checksumValidated, queue);
 			break;
 		case ETHER_TYPE_ARP:
 			neigh4().feedArp(dstsrc[0], capsule);
@@ -73,6 +87,24 @@ async::detached runDevice(std::shared_ptr<nic::Link> dev) {
 		default:
 			break;
 		}
+
+		// GRO merges segments until the end of each batch.
+		if (!dev->hasPendingFrames(queue)) {
+			ip4().flushReceived();
+			processed = 0;
+		} else if (++processed == rxBudget) {
+			// Let other queues and the socket servers run before we continue.
+			ip4().flushReceived();
+			processed = 0;
+			auto result = co_await helix_ng::asyncNop();
+			HEL_CHECK(result.error());
+		}
 	}
 }
+} // namespace
+
+void runDevice(std::shared_ptr<nic::Link> dev) {
+	for (unsigned int i = 0; i < dev->numQueues; i++)
+		runQueue(dev, i);
+}
 } // namespace nic
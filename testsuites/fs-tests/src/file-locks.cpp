@@ -0,0 +1,203 @@
+#include <cassert>
+#include <memory>
+#include <optional>
+
+#include <async/result.hpp>
+#include <protocols/fs/file-locks.hpp>
+
+#include "testsuite.hpp"
+
+using protocols::fs::Error;
+using protocols::fs::FileLockHolder;
+using protocols::fs::FileLockManager;
+using protocols::fs::RangeLock;
+using protocols::fs::RangeLockCommand;
+using protocols::fs::RangeLockType;
+
+using LockResult = frg::expected<Error, RangeLock>;
+
+namespace {
+
+// FileLockManager completes requests inline, i.e., result is set as soon as
+// the request is granted (and before lockRange() returns if it does not wait).
+async::detached track(async::result<LockResult> request, std::optional<LockResult> *result) {
+	*result = co_await std::move(request);
+}
+
+void submit(FileLockManager &manager, FileLockHolder &holder, std::optional<LockResult> *result,
+		RangeLockCommand command, RangeLockType type, uint64_t start, uint64_t length,
+		int pid = -1) {
+	track(manager.lockRange(&holder, command, pid == -1, RangeLock{type, start, length, pid}),
+			result);
+}
+
+LockResult lock(FileLockManager &manager, FileLockHolder &holder,
+		RangeLockCommand command, RangeLockType type, uint64_t start, uint64_t length,
+		int pid = -1) {
+	std::optional<LockResult> result;
+	submit(manager, holder, &result, command, type, start, length, pid);
+	assert(result);
+	return *result;
+}
+
+// Returns the lock that conflicts with a write lock of the given range.
+RangeLock conflict(FileLockManager &manager, FileLockHolder &holder,
+		uint64_t start, uint64_t length) {
+	auto result = lock(manager, holder, RangeLockCommand::get, RangeLockType::write,
+			start, length);
+	assert(result);
+	return result.value();
+}
+
+bool isGranted(const std::optional<LockResult> &result) {
+	return result && *result;
+}
+
+bool wouldBlock(const LockResult &result) {
+	return !result && result.error() == Error::wouldBlock;
+}
+
+} // anonymous namespace
+
+DEFINE_TEST(ofd_overlap, ([] {
+	FileLockManager manager;
+	FileLockHolder fd1, fd2;
+
+	assert(lock(manager, fd1, RangeLockCommand::set, RangeLockType::write, 0, 100));
+
+	// Disjoint ranges do not conflict; this lock extends to EOF.
+	assert(lock(manager, fd2, RangeLockCommand::set, RangeLockType::write, 100, 0));
+
+	auto held = conflict(manager, fd2, 50, 10);
+	assert(held.type == RangeLockType::write);
+	assert(held.start == 0 && held.length == 100);
+	assert(held.pid == -1);
+
+	assert(wouldBlock(lock(manager, fd2, RangeLockCommand::set, RangeLockType::read, 50, 10)));
+	assert(wouldBlock(lock(manager, fd1, RangeLockCommand::set, RangeLockType::read, 1000, 1)));
+
+	// Read locks only conflict with write locks.
+	FileLockManager shared;
+	FileLockHolder fd3, fd4;
+	assert(lock(shared, fd3, RangeLockCommand::set, RangeLockType::read, 0, 10));
+	assert(lock(shared, fd4, RangeLockCommand::set, RangeLockType::read, 5, 10));
+	assert(wouldBlock(lock(shared, fd4, RangeLockCommand::set, RangeLockType::write, 0, 1)));
+
+	// Locks of the same description never conflict; the new type replaces the old one.
+	assert(lock(manager, fd1, RangeLockCommand::set, RangeLockType::read, 0, 100));
+	held = conflict(manager, fd2, 0, 1);
+	assert(held.type == RangeLockType::read);
+}))
+
+DEFINE_TEST(process_locks, ([] {
+	FileLockManager manager;
+	FileLockHolder fd1, fd2, fd3;
+
+	// Process-associated locks are owned by the process, not by the description.
+	assert(lock(manager, fd1, RangeLockCommand::set, RangeLockType::write, 0, 10, 42));
+	assert(lock(manager, fd2, RangeLockCommand::set, RangeLockType::write, 5, 10, 42));
+	assert(wouldBlock(lock(manager, fd3, RangeLockCommand::set, RangeLockType::read, 0, 1, 43)));
+
+	// They also conflict with OFD locks.
+	assert(wouldBlock(lock(manager, fd3, RangeLockCommand::set, RangeLockType::read, 0, 1)));
+	auto held = conflict(manager, fd3, 12, 1);
+	assert(held.pid == 42);
+
+	auto result = lock(manager, fd3, RangeLockCommand::set, RangeLockType::read, 0, 1, 0);
+	assert(!result && result.error() == Error::illegalArguments);
+}))
+
+DEFINE_TEST(split_and_merge, ([] {
+	FileLockManager manager;
+	FileLockHolder fd1, fd2;
+
+	// Unlocking the middle of a lock splits it.
+	assert(lock(manager, fd1, RangeLockCommand::set, RangeLockType::write, 0, 100));
+	assert(lock(manager, fd1, RangeLockCommand::set, RangeLockType::unlock, 40, 20));
+	assert(lock(manager, fd2, RangeLockCommand::set, RangeLockType::write, 40, 20));
+	assert(wouldBlock(lock(manager, fd2, RangeLockCommand::set, RangeLockType::write, 39, 1)));
+	assert(wouldBlock(lock(manager, fd2, RangeLockCommand::set, RangeLockType::write, 60, 1)));
+
+	auto head = conflict(manager, fd2, 0, 1);
+	assert(head.start == 0 && head.length == 40);
+	auto tail = conflict(manager, fd2, 99, 1);
+	assert(tail.start == 60 && tail.length == 40);
+
+	// Changing the type of part of a lock also splits it.
+	assert(lock(manager, fd1, RangeLockCommand::set, RangeLockType::read, 10, 10));
+	head = conflict(manager, fd2, 0, 1);
+	assert(head.type == RangeLockType::write && head.start == 0 && head.length == 10);
+	auto middle = conflict(manager, fd2, 15, 1);
+	assert(middle.type == RangeLockType::read && middle.start == 10 && middle.length == 10);
+
+	// Adjacent locks of the same type are merged.
+	FileLockManager other;
+	FileLockHolder fd3, fd4;
+	assert(lock(other, fd3, RangeLockCommand::set, RangeLockType::read, 0, 10));
+	assert(lock(other, fd3, RangeLockCommand::set, RangeLockType::read, 10, 10));
+	assert(lock(other, fd3, RangeLockCommand::set, RangeLockType::read, 30, 10));
+	auto merged = conflict(other, fd4, 5, 1);
+	assert(merged.start == 0 && merged.length == 20);
+	assert(lock(other, fd3, RangeLockCommand::set, RangeLockType::read, 15, 20));
+	merged = conflict(other, fd4, 5, 1);
+	assert(merged.start == 0 && merged.length == 40);
+
+	// Locks that extend to EOF are reported with a length of zero.
+	assert(lock(other, fd3, RangeLockCommand::set, RangeLockType::read, 40, 0));
+	merged = conflict(other, fd4, 5, 1);
+	assert(merged.start == 0 && merged.length == 0);
+}))
+
+DEFINE_TEST(fifo_wakeup, ([] {
+	FileLockManager manager;
+	FileLockHolder fd1, fd2, fd3, fd4, fd5;
+
+	assert(lock(manager, fd1, RangeLockCommand::set, RangeLockType::write, 0, 100));
+
+	std::optional<LockResult> second, third, fourth;
+	submit(manager, fd2, &second, RangeLockCommand::setWait, RangeLockType::write, 0, 150);
+	submit(manager, fd3, &third, RangeLockCommand::setWait, RangeLockType::read, 50, 10);
+	assert(!second && !third);
+
+	// Blocking requests queue up behind conflicting waiters, even if they do not
+	// conflict with held locks. Non-blocking requests only check held locks.
+	submit(manager, fd4, &fourth, RangeLockCommand::setWait, RangeLockType::write, 120, 10);
+	assert(!fourth);
+	assert(lock(manager, fd5, RangeLockCommand::set, RangeLockType::write, 130, 10));
+
+	// Waiters are not granted while they conflict with a held lock or an earlier waiter.
+	assert(lock(manager, fd1, RangeLockCommand::set, RangeLockType::unlock, 0, 100));
+	assert(!second && !third && !fourth);
+
+	assert(lock(manager, fd5, RangeLockCommand::set, RangeLockType::unlock, 130, 10));
+	assert(isGranted(second));
+	assert(!third && !fourth);
+
+	// Releasing a lock grants all waiters that do not conflict anymore at once.
+	assert(lock(manager, fd2, RangeLockCommand::set, RangeLockType::unlock, 0, 150));
+	assert(isGranted(third));
+	assert(isGranted(fourth));
+
+	auto held = conflict(manager, fd1, 55, 1);
+	assert(held.type == RangeLockType::read && held.start == 50 && held.length == 10);
+	held = conflict(manager, fd1, 125, 1);
+	assert(held.type == RangeLockType::write && held.start == 120 && held.length == 10);
+}))
+
+DEFINE_TEST(release_on_close, ([] {
+	FileLockManager manager;
+	FileLockHolder fd2;
+
+	auto fd1 = std::make_unique<FileLockHolder>();
+	assert(lock(manager, *fd1, RangeLockCommand::set, RangeLockType::write, 0, 0));
+
+	std::optional<LockResult> waiting;
+	submit(manager, fd2, &waiting, RangeLockCommand::setWait, RangeLockType::read, 10, 10);
+	assert(!waiting);
+
+	// Closing the description releases its locks and grants the waiter.
+	fd1.reset();
+	assert(isGranted(waiting));
+	auto result = lock(manager, fd2, RangeLockCommand::get, RangeLockType::write, 0, 100);
+	assert(result && result.value().type == RangeLockType::unlock);
+}))
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+// Helpers to write the JSON reports of the benchmark suites.
+// A report has the form {"environment": {...}, "benchmarks": [...]};
+// tools/bench-results.py stores and compares such reports.
+namespace bench {
+
+// Maximal number of raw samples that are included per benchmark.
+inline constexpr size_t maxReportedSamples = 1000;
+
+inline std::string jsonString(const std::string &s) {
+	std::string out = "\"";
+	for(char c : s) {
+		if(c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}else if(c == '\n') {
+			out += "\\n";
+		}else if(static_cast<unsigned char>(c) >= 0x20) {
+			out += c;
+		}
+	}
+	out += '"';
+	return out;
+}
+
+// Formats the samples as a JSON array. Large sample sets are reduced to evenly
+// spaced quantiles; this preserves the distribution for rank-based tests.
+template<typename T>
+std::string jsonSamples(std::vector<T> samples) {
+	if(samples.size() > maxReportedSamples) {
+		std::sort(samples.begin(), samples.end());
+		std::vector<T> reduced;
+		for(size_t i = 0; i < maxReportedSamples; ++i)
+			reduced.push_back(samples[i * samples.size() / maxReportedSamples]);
+		samples = std::move(reduced);
+	}
+
+	std::stringstream json;
+	json.precision(17);
+	json << "[";
+	for(size_t i = 0; i < samples.size(); ++i) {
+		if(i)
+			json << ", ";
+		json << samples[i];
+	}
+	json << "]";
+	return json.str();
+}
+
+inline std::string cpuModel() {
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	if(__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) && eax >= 0x80000004) {
+		unsigned int brand[12];
+		for(unsigned int i = 0; i < 3; ++i)
+			__get_cpuid(0x80000002 + i, &brand[i * 4], &brand[i * 4 + 1],
+					&brand[i * 4 + 2], &brand[i * 4 + 3]);
+		std::string model{reinterpret_cast<const char *>(brand), sizeof(brand)};
+		model = model.substr(0, model.find('\0'));
+		auto begin = model.find_first_not_of(' ');
+		auto end = model.find_last_not_of(' ');
+		if(begin != std::string::npos)
+			return model.substr(begin, end - begin + 1);
+	}
+#endif
+	return "unknown";
+}
+
+inline std::string kernelCmdline() {
+	std::ifstream file{"/proc/cmdline"};
+	std::string cmdline;
+	std::getline(file, cmdline);
+	return cmdline;
+}
+
+// Writes the report of the given suite; results are JSON objects.
+inline void writeJsonReport(std::ostream &os, const std::string &suite,
+		const std::vector<std::string> &results) {
+	os << "{\"suite\": " << jsonString(suite)
+			<< ", \"environment\": {\"cpu_model\": " << jsonString(cpuModel())
+			<< ", \"num_cpus\": " << sysconf(_SC_NPROCESSORS_ONLN)
+			<< ", \"kernel_cmdline\": " << jsonString(kernelCmdline()) << "}"
+			<< ", \"benchmarks\": [";
+	for(size_t i = 0; i < results.size(); ++i) {
+		if(i)
+			os << ", ";
+		os << results[i];
+	}
+	os << "]}" << std::endl;
+}
+
+} // namespace bench
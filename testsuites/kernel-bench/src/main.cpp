@@ -1,14 +1,48 @@
 #include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <async/result.hpp>
 #include <async/algorithm.hpp>
 #include <helix/ipc.hpp>
+#include <helix/memory.hpp>
+
+#include <bench/report.hpp>
 
 namespace {
 
+// JSON objects of all benchmarks that ran so far; written out at the end of main().
+std::vector<std::string> jsonResults;
+
+std::string formatSize(size_t size) {
+	if(size < 1024)
+		return std::to_string(size) + " B";
+	if(size < 1024 * 1024)
+		return std::to_string(size / 1024) + " KiB";
+	return std::to_string(size / (1024 * 1024)) + " MiB";
+}
+
+// Restricts the current thread to a single CPU. Returns false if the CPU does not exist.
+bool pinToCpu(int cpu) {
+	std::vector<uint8_t> mask(cpu / 8 + 1);
+	mask[cpu / 8] = 1 << (cpu % 8);
+	return helSetAffinity(kHelThisThread, mask.data(), mask.size()) == kHelErrNone;
+}
+
 struct IterationsPerSecondBenchmark {
 	using clock = std::chrono::high_resolution_clock;
 
+	IterationsPerSecondBenchmark(std::string name)
+	: name_{std::move(name)} {
+		std::cout << name_ << std::endl;
+	}
+
 	void launchRepetition() {
 		ref_ = clock::now();
 	}
@@ -37,17 +71,88 @@ struct IterationsPerSecondBenchmark {
 
 		std::cout << "    avg: " << static_cast<uint64_t>(avg)
 				<< ", std: " << static_cast<uint64_t>(sqrt(var)) << std::endl;
+
+		std::stringstream json;
+		json << "{\"name\": " << bench::jsonString(name_)
+				<< ", \"unit\": \"iterations/s\""
+				<< ", \"avg\": " << static_cast<uint64_t>(avg)
+				<< ", \"std\": " << static_cast<uint64_t>(sqrt(var))
+				<< ", \"samples\": " << bench::jsonSamples(results_) << "}";
+		jsonResults.push_back(json.str());
 	}
 
 private:
-	std::vector<double> results_;
+	std::string name_;
+	std::vector<uint64_t> results_;
 	std::chrono::time_point<clock> ref_;
 };
 
-void doNopBenchmark() {
-	std::cout << "syscall ops" << std::endl;
+// Measures the latency of individual operations and reports percentiles.
+struct LatencyBenchmark {
+	using clock = std::chrono::steady_clock;
+
+	static constexpr size_t defaultSamples = 10'000;
+
+	LatencyBenchmark(std::string name, size_t numSamples = defaultSamples)
+	: name_{std::move(name)}, numSamples_{numSamples} {
+		std::cout << name_ << std::endl;
+		samples_.reserve(numSamples_);
+	}
+
+	bool isDone() {
+		return samples_.size() >= numSamples_;
+	}
+
+	void start() {
+		ref_ = clock::now();
+	}
+
+	void stop() {
+		record(clock::now() - ref_);
+	}
 
-	IterationsPerSecondBenchmark bench;
+	void record(clock::duration elapsed) {
+		samples_.push_back(duration_cast<std::chrono::nanoseconds>(elapsed).count());
+	}
+
+	void finalizeStatistics() {
+		if(samples_.empty()) {
+			std::cout << "    no samples" << std::endl;
+			return;
+		}
+		std::sort(samples_.begin(), samples_.end());
+
+		auto percentile = [&] (size_t perMille) {
+			return samples_[std::min(samples_.size() - 1, samples_.size() * perMille / 1000)];
+		};
+
+		std::cout << "    p50: " << percentile(500) << " ns"
+				<< ", p99: " << percentile(990) << " ns"
+				<< ", p999: " << percentile(999) << " ns"
+				<< " (" << samples_.size() << " samples)" << std::endl;
+
+		std::stringstream json;
+		json << "{\"name\": " << bench::jsonString(name_)
+				<< ", \"unit\": \"ns\""
+				<< ", \"samples\": " << samples_.size()
+				<< ", \"min\": " << samples_.front()
+				<< ", \"p50\": " << percentile(500)
+				<< ", \"p99\": " << percentile(990)
+				<< ", \"p999\": " << percentile(999)
+				<< ", \"max\": " << samples_.back()
+				<< ", \"samples\": " << bench::jsonSamples(samples_) << "}";
+		jsonResults.push_back(json.str());
+	}
+
+private:
+	std::string name_;
+	size_t numSamples_;
+	std::vector<uint64_t> samples_;
+	clock::time_point ref_;
+};
+
+void doNopBenchmark() {
+	IterationsPerSecondBenchmark bench{"syscall ops"};
 	for(int k = 0; k < 5; ++k) {
 		uint64_t n = 0;
 		bench.launchRepetition();
@@ -63,9 +168,7 @@ void doNopBenchmark() {
 }
 
 async::result<void> doAsyncNopBenchmark() {
-	std::cout << "ipc ops" << std::endl;
-
-	IterationsPerSecondBenchmark bench;
+	IterationsPerSecondBenchmark bench{"ipc ops"};
 	for(int k = 0; k < 5; ++k) {
 		uint64_t n = 0;
 		bench.launchRepetition();
@@ -82,9 +185,7 @@ async::result<void> doAsyncNopBenchmark() {
 }
 
 void doFutexBenchmark() {
-	std::cout << "futex waits" << std::endl;
-
-	IterationsPerSecondBenchmark bench;
+	IterationsPerSecondBenchmark bench{"futex waits"};
 	for(int k = 0; k < 5; ++k) {
 		uint64_t n = 0;
 		bench.launchRepetition();
@@ -100,10 +201,45 @@ void doFutexBenchmark() {
 	bench.finalizeStatistics();
 }
 
-void doAllocateBenchmark(size_t size) {
-	std::cout << "allocate memory, size = " << (size / (1024 * 1024)) << " MiB" << std::endl;
+// Measures how handle lookups scale if multiple threads share a universe.
+void doHandleLookupBenchmark(int numThreads) {
+	HelHandle handle;
+	HEL_CHECK(helAllocateMemory(0x1000, 0, nullptr, &handle));
+
+	IterationsPerSecondBenchmark bench{"handle lookups, threads = " + std::to_string(numThreads)};
+	for(int k = 0; k < 5; ++k) {
+		std::atomic<uint64_t> n{0};
+		std::atomic<bool> done{false};
+		std::vector<std::thread> threads;
+		for(int j = 0; j < numThreads; ++j) {
+			threads.emplace_back([&] {
+				uint64_t local = 0;
+				while(!done.load(std::memory_order_relaxed)) {
+					for(int i = 0; i < 100; ++i) {
+						size_t size;
+						HEL_CHECK(helMemoryInfo(handle, &size));
+						++local;
+					}
+				}
+				n.fetch_add(local, std::memory_order_relaxed);
+			});
+		}
+
+		bench.launchRepetition();
+		while(!bench.isRepetitionDone())
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		done.store(true, std::memory_order_relaxed);
+		for(auto &thread : threads)
+			thread.join();
+		bench.announceIterations(n.load(std::memory_order_relaxed));
+	}
+	bench.finalizeStatistics();
 
-	IterationsPerSecondBenchmark bench;
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, handle));
+}
+
+void doAllocateBenchmark(size_t size) {
+	IterationsPerSecondBenchmark bench{"allocate memory, size = " + formatSize(size)};
 	for(int k = 0; k < 5; ++k) {
 		uint64_t n = 0;
 		bench.launchRepetition();
@@ -119,9 +255,7 @@ void doAllocateBenchmark(size_t size) {
 }
 
 void doMapBenchmark(size_t size) {
-	std::cout << "memory mapping, size = " << (size / (1024 * 1024)) << " MiB" << std::endl;
-
-	IterationsPerSecondBenchmark bench;
+	IterationsPerSecondBenchmark bench{"memory mapping, size = " + formatSize(size)};
 	for(int k = 0; k < 5; ++k) {
 		uint64_t n = 0;
 		bench.launchRepetition();
@@ -141,8 +275,6 @@ void doMapBenchmark(size_t size) {
 }
 
 void doMapPopulatedBenchmark(size_t size) {
-	std::cout << "populated mapping, size = " << (size / (1024 * 1024)) << " MiB" << std::endl;
-
 	HelHandle handle;
 	HEL_CHECK(helAllocateMemory(size, 0, nullptr, &handle));
 	void *window;
@@ -156,7 +288,7 @@ void doMapPopulatedBenchmark(size_t size) {
 
 	HEL_CHECK(helUnmapMemory(kHelNullHandle, window, size));
 
-	IterationsPerSecondBenchmark bench;
+	IterationsPerSecondBenchmark bench{"populated mapping, size = " + formatSize(size)};
 	for(int k = 0; k < 5; ++k) {
 		uint64_t n = 0;
 		bench.launchRepetition();
@@ -175,9 +307,7 @@ void doMapPopulatedBenchmark(size_t size) {
 }
 
 void doPageFaultBenchmark(size_t size) {
-	std::cout << "page faults (mapping size = " << (size / (1024 * 1024)) << " MiB)" << std::endl;
-
-	IterationsPerSecondBenchmark bench;
+	IterationsPerSecondBenchmark bench{"page faults (mapping size = " + formatSize(size) + ")"};
 	for(int k = 0; k < 5; ++k) {
 		uint64_t n = 0;
 		bench.launchRepetition();
@@ -203,20 +333,39 @@ void doPageFaultBenchmark(size_t size) {
 	bench.finalizeStatistics();
 }
 
+// Measures the throughput of the kernel's copy routines (user buffer <-> memory object).
+async::result<void> doMemoryCopyBenchmark(size_t size, bool write) {
+	HelHandle handle;
+	HEL_CHECK(helAllocateMemory(size, 0, nullptr, &handle));
+	helix::UniqueDescriptor memory{handle};
+	std::vector<std::byte> buffer(size);
+
+	IterationsPerSecondBenchmark bench{std::string{write ? "write" : "read"}
+			+ " memory, size = " + formatSize(size)};
+	for(int k = 0; k < 5; ++k) {
+		uint64_t n = 0;
+		bench.launchRepetition();
+		while(!bench.isRepetitionDone()) {
+			if(write) {
+				auto result = co_await helix_ng::writeMemory(memory, 0, size, buffer.data());
+				HEL_CHECK(result.error());
+			}else{
+				auto result = co_await helix_ng::readMemory(memory, 0, size, buffer.data());
+				HEL_CHECK(result.error());
+			}
+			++n;
+		}
+		bench.announceIterations(n);
+	}
+	bench.finalizeStatistics();
+}
+
 async::result<void> doSendRecvBufferBenchmark(size_t size) {
 	auto [lane1, lane2] = helix::createStream();
 	std::vector<std::byte> sBuf(size);
 	std::vector<std::byte> rBuf(size);
 
-	if(size < 1024) {
-		std::cout << "size = " << size << std::endl;
-	}else if(size < 1024 * 1024) {
-		std::cout << "size = " << (size / 1024) << " KiB" << std::endl;
-	}else{
-		std::cout << "size = " << (size / (1024 * 1024)) << " MiB" << std::endl;
-	}
-
-	IterationsPerSecondBenchmark bench;
+	IterationsPerSecondBenchmark bench{"send/recv buffer, size = " + formatSize(size)};
 	for(int k = 0; k < 5; ++k) {
 		uint64_t n = 0;
 		bench.launchRepetition();
@@ -245,16 +394,381 @@ async::result<void> doSendRecvBufferBenchmark(size_t size) {
 	bench.finalizeStatistics();
 }
 
+// Completion context that counts outstanding submissions.
+struct CountingContext final : helix::Context {
+	void complete(helix::ElementHandle) override {
+		--pending;
+	}
+
+	size_t pending = 0;
+};
+
+void doBatchSubmitBenchmark(size_t batchSize) {
+	std::vector<HelHandle> senders(batchSize);
+	std::vector<HelHandle> receivers(batchSize);
+	for(size_t i = 0; i < batchSize; ++i)
+		HEL_CHECK(helCreateStream(&senders[i], &receivers[i]));
+
+	char sendByte = 0;
+	HelAction sendAction{.type = kHelActionSendFromBuffer, .flags = 0,
+			.buffer = &sendByte, .length = 1, .handle = kHelNullHandle};
+	HelAction recvAction{.type = kHelActionRecvInline, .flags = 0,
+			.buffer = nullptr, .length = 0, .handle = kHelNullHandle};
+
+	CountingContext context;
+	auto contextWord = reinterpret_cast<uintptr_t>(static_cast<helix::Context *>(&context));
+	std::vector<HelBatchSubmission> submissions(2 * batchSize);
+	for(size_t i = 0; i < batchSize; ++i) {
+		submissions[i] = {senders[i], &sendAction, 1, contextWord, kHelErrNone};
+		submissions[batchSize + i] = {receivers[i], &recvAction, 1, contextWord, kHelErrNone};
+	}
+
+	auto &dispatcher = helix::Dispatcher::global();
+	IterationsPerSecondBenchmark bench{"batched submissions, batch size = " + std::to_string(batchSize)};
+	for(int k = 0; k < 5; ++k) {
+		uint64_t n = 0;
+		bench.launchRepetition();
+		while(!bench.isRepetitionDone()) {
+			context.pending = submissions.size();
+			HEL_CHECK(helSubmitAsyncBatch(submissions.data(), submissions.size(),
+					dispatcher.acquire(), 0));
+			for(auto &submission : submissions)
+				HEL_CHECK(submission.error);
+			while(context.pending)
+				dispatcher.wait();
+			n += batchSize;
+		}
+		bench.announceIterations(n);
+	}
+	bench.finalizeStatistics();
+
+	for(size_t i = 0; i < batchSize; ++i) {
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, senders[i]));
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, receivers[i]));
+	}
+}
+
+// Round trip of an offer/accept pair that carries a one-byte request and reply.
+async::result<void> doOfferAcceptLatencyBenchmark() {
+	auto lanes = helix::createStream();
+	char request = 0;
+	char reply = 0;
+
+	LatencyBenchmark bench{"stream offer/accept round trip"};
+	while(!bench.isDone()) {
+		bench.start();
+		co_await async::when_all(
+			[&] () -> async::result<void> {
+				auto [offer, send, recv] = co_await helix_ng::exchangeMsgs(lanes.first,
+					helix_ng::offer(
+						helix_ng::sendBuffer(&request, 1),
+						helix_ng::recvInline()
+					)
+				);
+				HEL_CHECK(offer.error());
+				HEL_CHECK(send.error());
+				HEL_CHECK(recv.error());
+			}(),
+			[&] () -> async::result<void> {
+				auto [accept, recv] = co_await helix_ng::exchangeMsgs(lanes.second,
+					helix_ng::accept(
+						helix_ng::recvInline()
+					)
+				);
+				HEL_CHECK(accept.error());
+				HEL_CHECK(recv.error());
+
+				auto conversation = accept.descriptor();
+				auto [send] = co_await helix_ng::exchangeMsgs(conversation,
+					helix_ng::sendBuffer(&reply, 1)
+				);
+				HEL_CHECK(send.error());
+			}()
+		);
+		bench.stop();
+	}
+	bench.finalizeStatistics();
+}
+
+async::result<void> doSendRecvLatencyBenchmark(size_t size) {
+	auto lanes = helix::createStream();
+	std::vector<std::byte> sBuf(size);
+	std::vector<std::byte> rBuf(size);
+
+	LatencyBenchmark bench{"send/recv buffer latency, size = " + formatSize(size)};
+	while(!bench.isDone()) {
+		bench.start();
+		co_await async::when_all(
+			async::transform(
+				helix_ng::exchangeMsgs(lanes.first, helix_ng::sendBuffer(sBuf.data(), size)
+			), [&] (auto result) {
+				auto [send] = std::move(result);
+				HEL_CHECK(send.error());
+			}),
+			async::transform(
+				helix_ng::exchangeMsgs(lanes.second, helix_ng::recvBuffer(rBuf.data(), size)
+			), [&] (auto result) {
+				auto [recv] = std::move(result);
+				HEL_CHECK(recv.error());
+				assert(recv.actualLength() == size);
+			})
+		);
+		bench.stop();
+	}
+	bench.finalizeStatistics();
+}
+
+// Futex round trip between two threads that are pinned to different CPUs.
+void doFutexPingPongBenchmark() {
+	// Pin to CPU 1 first to check whether it exists.
+	if(!pinToCpu(1)) {
+		std::cout << "futex ping-pong across CPUs: skipped (only one CPU)" << std::endl;
+		return;
+	}
+	pinToCpu(0);
+
+	// 0: idle, 1: ping (for the partner), 2: pong (for us), 3: exit.
+	int futex = 0;
+
+	std::thread partner{[&] {
+		if(!pinToCpu(1))
+			std::cout << "kernel-bench: Failed to pin partner thread" << std::endl;
+		while(true) {
+			int v;
+			while((v = __atomic_load_n(&futex, __ATOMIC_ACQUIRE)) != 1 && v != 3)
+				HEL_CHECK(helFutexWait(&futex, v, -1));
+			if(v == 3)
+				return;
+			__atomic_store_n(&futex, 2, __ATOMIC_RELEASE);
+			HEL_CHECK(helFutexWake(&futex));
+		}
+	}};
+
+	LatencyBenchmark bench{"futex ping-pong across CPUs"};
+	while(!bench.isDone()) {
+		bench.start();
+		__atomic_store_n(&futex, 1, __ATOMIC_RELEASE);
+		HEL_CHECK(helFutexWake(&futex));
+		int v;
+		while((v = __atomic_load_n(&futex, __ATOMIC_ACQUIRE)) != 2)
+			HEL_CHECK(helFutexWait(&futex, v, -1));
+		bench.stop();
+	}
+	bench.finalizeStatistics();
+
+	__atomic_store_n(&futex, 3, __ATOMIC_RELEASE);
+	HEL_CHECK(helFutexWake(&futex));
+	partner.join();
+
+	// Allow all CPUs again.
+	std::vector<uint8_t> mask(32, 0xFF);
+	HEL_CHECK(helSetAffinity(kHelThisThread, mask.data(), mask.size()));
+}
+
+// Maps a memory object, accesses each page once and records the latency of each access.
+void measurePageFaults(LatencyBenchmark &bench, HelHandle memory, size_t size, bool write) {
+	void *window;
+	HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr, 0, size,
+			kHelMapProtRead | (write ? kHelMapProtWrite : 0), &window));
+
+	auto p = reinterpret_cast<volatile std::byte *>(window);
+	for(size_t progress = 0; progress < size; progress += 0x1000) {
+		bench.start();
+		if(write) {
+			p[progress] = static_cast<std::byte>(0);
+		}else{
+			(void)p[progress];
+		}
+		bench.stop();
+	}
+
+	HEL_CHECK(helUnmapMemory(kHelNullHandle, window, size));
+}
+
+void doAnonymousFaultLatencyBenchmark(size_t size) {
+	LatencyBenchmark bench{"page fault latency, anonymous"};
+	while(!bench.isDone()) {
+		HelHandle handle;
+		HEL_CHECK(helAllocateMemory(size, 0, nullptr, &handle));
+		measurePageFaults(bench, handle, size, true);
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, handle));
+	}
+	bench.finalizeStatistics();
+}
+
+void doCowFaultLatencyBenchmark(size_t size) {
+	HelHandle source;
+	HEL_CHECK(helAllocateMemory(size, 0, nullptr, &source));
+	{
+		// Make sure that all pages of the source are present.
+		helix::Mapping mapping{helix::BorrowedDescriptor{source}, 0, size};
+		memset(mapping.get(), 1, size);
+	}
+
+	LatencyBenchmark bench{"page fault latency, copy-on-write"};
+	while(!bench.isDone()) {
+		HelHandle handle;
+		HEL_CHECK(helCopyOnWrite(source, 0, size, &handle));
+		measurePageFaults(bench, handle, size, true);
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, handle));
+	}
+	bench.finalizeStatistics();
+
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, source));
+}
+
+// Answers all initialization requests of a managed memory object until all pages are present.
+async::result<void> serveManagedMemory(helix::BorrowedDescriptor backing, size_t size) {
+	helix::Mapping mapping{backing, 0, size};
+	auto p = reinterpret_cast<volatile std::byte *>(mapping.get());
+
+	size_t progress = 0;
+	while(progress < size) {
+		helix::ManageMemory manage;
+		auto &&submit = helix::submitManageMemory(backing, &manage,
+				helix::Dispatcher::global());
+		co_await submit.async_wait();
+		HEL_CHECK(manage.error());
+		assert(manage.type() == kHelManageInitialize);
+
+		// Pages are initialized to zero; touching them is enough.
+		for(size_t off = 0; off < manage.length(); off += 0x1000)
+			p[manage.offset() + off] = static_cast<std::byte>(0);
+		HEL_CHECK(helUpdateMemory(backing.getHandle(), kHelManageInitialize,
+				manage.offset(), manage.length()));
+		progress += manage.length();
+	}
+}
+
+void doManagedFaultLatencyBenchmark(size_t size) {
+	LatencyBenchmark bench{"page fault latency, managed"};
+	while(!bench.isDone()) {
+		HelHandle backing, frontal;
+		HEL_CHECK(helCreateManagedMemory(size, 0, &backing, &frontal));
+
+		// The manager must run on a different thread since faults block the current one.
+		std::thread manager{[&] {
+			async::run(serveManagedMemory(helix::BorrowedDescriptor{backing}, size),
+					helix::currentDispatcher);
+		}};
+		measurePageFaults(bench, frontal, size, false);
+		manager.join();
+
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, frontal));
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, backing));
+	}
+	bench.finalizeStatistics();
+}
+
+void doMapUnmapLatencyBenchmark(size_t size) {
+	HelHandle handle;
+	HEL_CHECK(helAllocateMemory(size, 0, nullptr, &handle));
+	{
+		helix::Mapping mapping{helix::BorrowedDescriptor{handle}, 0, size};
+		memset(mapping.get(), 0, size);
+	}
+
+	LatencyBenchmark bench{"map/unmap cycle latency, size = " + formatSize(size)};
+	while(!bench.isDone()) {
+		bench.start();
+		void *window;
+		HEL_CHECK(helMapMemory(handle, kHelNullHandle, nullptr, 0, size,
+				kHelMapProtRead | kHelMapProtWrite, &window));
+		HEL_CHECK(helUnmapMemory(kHelNullHandle, window, size));
+		bench.stop();
+	}
+	bench.finalizeStatistics();
+
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, handle));
+}
+
+// Latency from raising an event on one CPU until a waiter on another CPU runs.
+// Userspace cannot trigger hardware IRQs on demand; IRQ objects complete their
+// awaitEvent operations through the same path as the oneshot event that is used here.
+async::result<void> doEventLatencyBenchmark() {
+	if(!pinToCpu(1)) {
+		std::cout << "event-to-user latency: skipped (only one CPU)" << std::endl;
+		co_return;
+	}
+	pinToCpu(0);
+
+	// Handle of the event that the raiser should raise; kHelNullHandle if there is none.
+	std::atomic<HelHandle> pending{kHelNullHandle};
+	std::atomic<bool> done{false};
+	std::atomic<LatencyBenchmark::clock::rep> raiseTime{0};
+
+	std::thread raiser{[&] {
+		if(!pinToCpu(1))
+			std::cout << "kernel-bench: Failed to pin raiser thread" << std::endl;
+		while(!done.load(std::memory_order_acquire)) {
+			auto handle = pending.load(std::memory_order_acquire);
+			if(handle == kHelNullHandle)
+				continue;
+			raiseTime.store(LatencyBenchmark::clock::now().time_since_epoch().count(),
+					std::memory_order_relaxed);
+			HEL_CHECK(helRaiseEvent(handle));
+			pending.store(kHelNullHandle, std::memory_order_release);
+		}
+	}};
+
+	LatencyBenchmark bench{"event-to-user latency across CPUs"};
+	while(!bench.isDone()) {
+		HelHandle handle;
+		HEL_CHECK(helCreateOneshotEvent(&handle));
+		helix::UniqueDescriptor event{handle};
+
+		helix::AwaitEvent await;
+		auto &&submit = helix::submitAwaitEvent(event, &await, 0,
+				helix::Dispatcher::global());
+		pending.store(handle, std::memory_order_release);
+		co_await submit.async_wait();
+		auto now = LatencyBenchmark::clock::now();
+		HEL_CHECK(await.error());
+
+		// Wait until the raiser is done with the handle before closing it.
+		while(pending.load(std::memory_order_acquire) != kHelNullHandle)
+			;
+		bench.record(now - LatencyBenchmark::clock::time_point{LatencyBenchmark::clock::duration{
+				raiseTime.load(std::memory_order_relaxed)}});
+	}
+	bench.finalizeStatistics();
+
+	done.store(true, std::memory_order_release);
+	raiser.join();
+
+	std::vector<uint8_t> mask(32, 0xFF);
+	HEL_CHECK(helSetAffinity(kHelThisThread, mask.data(), mask.size()));
+}
+
 } // anonymous namespace
 
-int main() {
+// Usage: kernel-bench [--json <path>]
+// The JSON report is written to <path> if given and to stdout otherwise.
+int main(int argc, char **argv) {
+	const char *jsonPath = nullptr;
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "--json") && i + 1 < argc) {
+			jsonPath = argv[++i];
+		}else{
+			std::cout << "usage: kernel-bench [--json <path>]" << std::endl;
+			return 1;
+		}
+	}
+
 	doNopBenchmark();
 	doFutexBenchmark();
 	async::run(doAsyncNopBenchmark(), helix::currentDispatcher);
+	doHandleLookupBenchmark(1);
+	doHandleLookupBenchmark(2);
+	doHandleLookupBenchmark(4);
 	doAllocateBenchmark(1 << 20);
 	doMapBenchmark(1 << 20);
 	doMapPopulatedBenchmark(1 << 20);
 	doPageFaultBenchmark(1 << 20);
+	for(size_t size : {size_t{4096}, size_t{64 * 1024}, size_t{1024 * 1024}}) {
+		async::run(doMemoryCopyBenchmark(size, false), helix::currentDispatcher);
+		async::run(doMemoryCopyBenchmark(size, true), helix::currentDispatcher);
+	}
 	async::run(doSendRecvBufferBenchmark(1), helix::currentDispatcher);
 	async::run(doSendRecvBufferBenchmark(32), helix::currentDispatcher);
 	async::run(doSendRecvBufferBenchmark(128), helix::currentDispatcher);
@@ -262,4 +776,25 @@ int main() {
 	async::run(doSendRecvBufferBenchmark(16 * 1024), helix::currentDispatcher);
 	async::run(doSendRecvBufferBenchmark(64 * 1024), helix::currentDispatcher);
 	async::run(doSendRecvBufferBenchmark(1024 * 1024), helix::currentDispatcher);
+	doBatchSubmitBenchmark(1);
+	doBatchSubmitBenchmark(8);
+	doBatchSubmitBenchmark(32);
+
+	async::run(doOfferAcceptLatencyBenchmark(), helix::currentDispatcher);
+	async::run(doSendRecvLatencyBenchmark(128), helix::currentDispatcher);
+	async::run(doSendRecvLatencyBenchmark(4096), helix::currentDispatcher);
+	async::run(doSendRecvLatencyBenchmark(64 * 1024), helix::currentDispatcher);
+	doFutexPingPongBenchmark();
+	doAnonymousFaultLatencyBenchmark(1 << 20);
+	doCowFaultLatencyBenchmark(1 << 20);
+	doManagedFaultLatencyBenchmark(1 << 20);
+	doMapUnmapLatencyBenchmark(1 << 20);
+	async::run(doEventLatencyBenchmark(), helix::currentDispatcher);
+
+	if(jsonPath) {
+		std::ofstream file{jsonPath};
+		bench::writeJsonReport(file, "kernel-bench", jsonResults);
+	}else{
+		bench::writeJsonReport(std::cout, "kernel-bench", jsonResults);
+	}
 }
@@ -0,0 +1,457 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <bench/report.hpp>
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+// Duration of each repetition of the throughput benchmarks.
+constexpr auto repetitionTime = std::chrono::seconds(1);
+constexpr int numRepetitions = 5;
+constexpr size_t numLatencySamples = 10'000;
+
+// JSON objects of all benchmarks that ran so far; written out at the end of main().
+std::vector<std::string> jsonResults;
+
+[[noreturn]] void fail(const char *what) {
+	std::cout << "net-bench: " << what << " failed: " << strerror(errno) << std::endl;
+	exit(1);
+}
+
+// Reports the average and the standard deviation of a rate over the repetitions.
+struct RateBenchmark {
+	RateBenchmark(std::string name, std::string unit)
+	: name_{std::move(name)}, unit_{std::move(unit)} {
+		std::cout << name_ << std::endl;
+	}
+
+	void announce(double rate) {
+		std::cout << "    " << static_cast<uint64_t>(rate) << " " << unit_ << std::endl;
+		results_.push_back(rate);
+	}
+
+	void finalizeStatistics() {
+		double avg = 0;
+		for(double n : results_)
+			avg += n;
+		avg /= results_.size();
+
+		double var = 0;
+		for(double n : results_)
+			var += (n - avg) * (n - avg);
+		var /= results_.size();
+
+		std::cout << "    avg: " << static_cast<uint64_t>(avg)
+				<< ", std: " << static_cast<uint64_t>(sqrt(var)) << std::endl;
+
+		std::stringstream json;
+		json << "{\"name\": " << bench::jsonString(name_)
+				<< ", \"unit\": " << bench::jsonString(unit_)
+				<< ", \"avg\": " << static_cast<uint64_t>(avg)
+				<< ", \"std\": " << static_cast<uint64_t>(sqrt(var))
+				<< ", \"samples\": " << bench::jsonSamples(results_) << "}";
+		jsonResults.push_back(json.str());
+	}
+
+private:
+	std::string name_;
+	std::string unit_;
+	std::vector<double> results_;
+};
+
+// Measures round-trip times and reports percentiles.
+struct LatencyBenchmark {
+	LatencyBenchmark(std::string name)
+	: name_{std::move(name)} {
+		std::cout << name_ << std::endl;
+		samples_.reserve(numLatencySamples);
+	}
+
+	bool isDone() {
+		return samples_.size() >= numLatencySamples;
+	}
+
+	void record(clock::duration elapsed) {
+		samples_.push_back(duration_cast<std::chrono::nanoseconds>(elapsed).count());
+	}
+
+	void finalizeStatistics() {
+		std::sort(samples_.begin(), samples_.end());
+
+		auto percentile = [&] (size_t perMille) {
+			return samples_[std::min(samples_.size() - 1, samples_.size() * perMille / 1000)];
+		};
+
+		std::cout << "    p50: " << percentile(500) << " ns"
+				<< ", p99: " << percentile(990) << " ns"
+				<< ", p999: " << percentile(999) << " ns"
+				<< " (" << samples_.size() << " samples)" << std::endl;
+
+		std::stringstream json;
+		json << "{\"name\": " << bench::jsonString(name_)
+				<< ", \"unit\": \"ns\""
+				<< ", \"samples\": " << samples_.size()
+				<< ", \"min\": " << samples_.front()
+				<< ", \"p50\": " << percentile(500)
+				<< ", \"p99\": " << percentile(990)
+				<< ", \"p999\": " << percentile(999)
+				<< ", \"max\": " << samples_.back()
+				<< ", \"samples\": " << bench::jsonSamples(samples_) << "}";
+		jsonResults.push_back(json.str());
+	}
+
+private:
+	std::string name_;
+	std::vector<uint64_t> samples_;
+};
+
+void skip(const std::string &name, const char *reason) {
+	std::cout << name << std::endl << "    skipped: " << reason << std::endl;
+	jsonResults.push_back("{\"name\": " + bench::jsonString(name)
+			+ ", \"skipped\": " + bench::jsonString(reason) + "}");
+}
+
+sockaddr_in makeAddress(uint32_t ip, uint16_t port) {
+	sockaddr_in sa{};
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(ip);
+	return sa;
+}
+
+int makeUdpSocket(const sockaddr_in &local) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0)
+		fail("socket()");
+	if(bind(fd, reinterpret_cast<const sockaddr *>(&local), sizeof(local)))
+		fail("bind()");
+	return fd;
+}
+
+bool readAll(int fd, char *buffer, size_t size) {
+	size_t progress = 0;
+	while(progress < size) {
+		auto n = read(fd, buffer + progress, size - progress);
+		if(n <= 0)
+			return false;
+		progress += n;
+	}
+	return true;
+}
+
+bool writeAll(int fd, const char *buffer, size_t size) {
+	size_t progress = 0;
+	while(progress < size) {
+		auto n = write(fd, buffer + progress, size - progress);
+		if(n <= 0)
+			return false;
+		progress += n;
+	}
+	return true;
+}
+
+// --------------------------------------------------------
+// UDP benchmarks (over the loopback interface)
+// --------------------------------------------------------
+
+constexpr uint16_t udpSinkPort = 5201;
+constexpr uint16_t udpSourcePort = 5202;
+
+void doUdpPpsBenchmark(size_t size) {
+	auto sinkAddress = makeAddress(INADDR_LOOPBACK, udpSinkPort);
+	int sink = makeUdpSocket(sinkAddress);
+	int source = makeUdpSocket(makeAddress(INADDR_LOOPBACK, udpSourcePort));
+
+	// Empty datagrams end a repetition.
+	std::vector<char> buffer(size, 'x');
+	RateBenchmark sent{"udp send, size = " + std::to_string(size), "datagrams/s"};
+	RateBenchmark received{"udp receive, size = " + std::to_string(size), "datagrams/s"};
+	for(int k = 0; k < numRepetitions; ++k) {
+		std::atomic<uint64_t> numReceived{0};
+		std::atomic<bool> stopped{false};
+		std::thread receiver{[&] {
+			std::vector<char> in(size);
+			uint64_t n = 0;
+			while(true) {
+				auto len = recv(sink, in.data(), in.size(), 0);
+				if(len < 0)
+					fail("recv()");
+				if(!len)
+					break;
+				++n;
+			}
+			numReceived.store(n, std::memory_order_relaxed);
+			stopped.store(true, std::memory_order_release);
+		}};
+
+		uint64_t numSent = 0;
+		auto start = clock::now();
+		while(clock::now() - start < repetitionTime) {
+			if(sendto(source, buffer.data(), buffer.size(), 0,
+					reinterpret_cast<const sockaddr *>(&sinkAddress), sizeof(sinkAddress)) < 0)
+				fail("sendto()");
+			++numSent;
+		}
+		auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+		// The end marker may be dropped like any other datagram.
+		while(!stopped.load(std::memory_order_acquire)) {
+			sendto(source, nullptr, 0, 0,
+					reinterpret_cast<const sockaddr *>(&sinkAddress), sizeof(sinkAddress));
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		receiver.join();
+
+		sent.announce(numSent / elapsed);
+		received.announce(numReceived.load(std::memory_order_relaxed) / elapsed);
+	}
+	sent.finalizeStatistics();
+	received.finalizeStatistics();
+
+	close(sink);
+	close(source);
+}
+
+void doUdpLatencyBenchmark() {
+	auto echoAddress = makeAddress(INADDR_LOOPBACK, udpSinkPort);
+	int echo = makeUdpSocket(echoAddress);
+	int client = makeUdpSocket(makeAddress(INADDR_LOOPBACK, udpSourcePort));
+
+	std::thread echoer{[&] {
+		char in[64];
+		while(true) {
+			sockaddr_in peer;
+			socklen_t peerLength = sizeof(peer);
+			auto len = recvfrom(echo, in, sizeof(in), 0,
+					reinterpret_cast<sockaddr *>(&peer), &peerLength);
+			if(len < 0)
+				fail("recvfrom()");
+			if(!len)
+				break;
+			if(sendto(echo, in, len, 0, reinterpret_cast<sockaddr *>(&peer), peerLength) < 0)
+				fail("sendto()");
+		}
+	}};
+
+	LatencyBenchmark bench{"udp round trip, size = 32"};
+	char buffer[32] = {};
+	while(!bench.isDone()) {
+		auto start = clock::now();
+		if(sendto(client, buffer, sizeof(buffer), 0,
+				reinterpret_cast<const sockaddr *>(&echoAddress), sizeof(echoAddress)) < 0)
+			fail("sendto()");
+		if(recv(client, buffer, sizeof(buffer), 0) < 0)
+			fail("recv()");
+		bench.record(clock::now() - start);
+	}
+	bench.finalizeStatistics();
+
+	sendto(client, nullptr, 0, 0,
+			reinterpret_cast<const sockaddr *>(&echoAddress), sizeof(echoAddress));
+	echoer.join();
+	close(echo);
+	close(client);
+}
+
+// --------------------------------------------------------
+// TCP benchmarks (against an echo server)
+// --------------------------------------------------------
+
+constexpr uint16_t tcpEchoPort = 5203;
+constexpr size_t streamChunk = 64 * 1024;
+
+// Echoes all connections until the listening socket is shut down.
+void runEchoServer(int listener) {
+	while(true) {
+		int fd = accept(listener, nullptr, nullptr);
+		if(fd < 0)
+			return;
+		std::thread{[fd] {
+			std::vector<char> buffer(streamChunk);
+			while(true) {
+				auto n = read(fd, buffer.data(), buffer.size());
+				if(n <= 0 || !writeAll(fd, buffer.data(), n))
+					break;
+			}
+			close(fd);
+		}}.detach();
+	}
+}
+
+int connectTo(const sockaddr_in &peer) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0)
+		fail("socket()");
+	if(connect(fd, reinterpret_cast<const sockaddr *>(&peer), sizeof(peer)))
+		fail("connect()");
+	return fd;
+}
+
+void doTcpStreamBenchmark(const sockaddr_in &peer) {
+	RateBenchmark bench{"tcp stream", "bytes/s"};
+	for(int k = 0; k < numRepetitions; ++k) {
+		int fd = connectTo(peer);
+
+		std::atomic<bool> done{false};
+		uint64_t numSent = 0;
+		std::thread writer{[&] {
+			std::vector<char> buffer(streamChunk, 'x');
+			while(!done.load(std::memory_order_relaxed)) {
+				if(!writeAll(fd, buffer.data(), buffer.size()))
+					fail("write()");
+				numSent += buffer.size();
+			}
+			shutdown(fd, SHUT_WR);
+		}};
+
+		// Count the echoed bytes, i.e., data that made it through both directions.
+		std::vector<char> buffer(streamChunk);
+		uint64_t numReceived = 0;
+		auto start = clock::now();
+		while(clock::now() - start < repetitionTime) {
+			auto n = read(fd, buffer.data(), buffer.size());
+			if(n <= 0)
+				fail("read()");
+			numReceived += n;
+		}
+		auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		done.store(true, std::memory_order_relaxed);
+
+		while(read(fd, buffer.data(), buffer.size()) > 0)
+			;
+		writer.join();
+		close(fd);
+
+		bench.announce(numReceived / elapsed);
+	}
+	bench.finalizeStatistics();
+}
+
+void doTcpConnectBenchmark(const sockaddr_in &peer) {
+	RateBenchmark bench{"tcp connect", "connections/s"};
+	for(int k = 0; k < numRepetitions; ++k) {
+		uint64_t n = 0;
+		auto start = clock::now();
+		while(clock::now() - start < repetitionTime) {
+			close(connectTo(peer));
+			++n;
+		}
+		auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		bench.announce(n / elapsed);
+	}
+	bench.finalizeStatistics();
+}
+
+void doTcpLatencyBenchmark(const sockaddr_in &peer) {
+	int fd = connectTo(peer);
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	LatencyBenchmark bench{"tcp round trip, size = 32"};
+	char buffer[32] = {};
+	while(!bench.isDone()) {
+		auto start = clock::now();
+		if(!writeAll(fd, buffer, sizeof(buffer)) || !readAll(fd, buffer, sizeof(buffer)))
+			fail("echo");
+		bench.record(clock::now() - start);
+	}
+	bench.finalizeStatistics();
+	close(fd);
+}
+
+std::optional<sockaddr_in> parsePeer(const char *str) {
+	std::string s{str};
+	auto colon = s.find(':');
+	if(colon == std::string::npos)
+		return std::nullopt;
+	sockaddr_in sa{};
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(atoi(s.c_str() + colon + 1));
+	if(inet_pton(AF_INET, s.substr(0, colon).c_str(), &sa.sin_addr) != 1)
+		return std::nullopt;
+	return sa;
+}
+
+} // anonymous namespace
+
+// Usage: net-bench [--json <path>] [--tcp-peer <ip>:<port>]
+// UDP benchmarks run over the loopback interface. TCP benchmarks need an echo
+// server; a local one is started if listen() is supported, otherwise the one
+// given by --tcp-peer is used. The JSON report is written to <path> if given
+// and to stdout otherwise.
+int main(int argc, char **argv) {
+	const char *jsonPath = nullptr;
+	std::optional<sockaddr_in> tcpPeer;
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "--json") && i + 1 < argc) {
+			jsonPath = argv[++i];
+		}else if(!strcmp(argv[i], "--tcp-peer") && i + 1 < argc
+				&& (tcpPeer = parsePeer(argv[i + 1]))) {
+			++i;
+		}else{
+			std::cout << "usage: net-bench [--json <path>] [--tcp-peer <ip>:<port>]"
+					<< std::endl;
+			return 1;
+		}
+	}
+
+	doUdpPpsBenchmark(64);
+	doUdpPpsBenchmark(1400);
+	doUdpLatencyBenchmark();
+
+	int listener = -1;
+	std::thread echoServer;
+	if(!tcpPeer) {
+		auto local = makeAddress(INADDR_LOOPBACK, tcpEchoPort);
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		if(listener >= 0
+				&& !bind(listener, reinterpret_cast<sockaddr *>(&local), sizeof(local))
+				&& !listen(listener, 128)) {
+			echoServer = std::thread{runEchoServer, listener};
+			tcpPeer = local;
+		}
+	}
+
+	if(tcpPeer) {
+		doTcpStreamBenchmark(*tcpPeer);
+		doTcpConnectBenchmark(*tcpPeer);
+		doTcpLatencyBenchmark(*tcpPeer);
+	}else{
+		for(auto name : {"tcp stream", "tcp connect", "tcp round trip, size = 32"})
+			skip(name, "no echo server (listen() failed and no --tcp-peer given)");
+	}
+
+	if(echoServer.joinable()) {
+		shutdown(listener, SHUT_RDWR);
+		echoServer.join();
+	}
+	if(listener >= 0)
+		close(listener);
+
+	if(jsonPath) {
+		std::ofstream os{jsonPath};
+		bench::writeJsonReport(os, "net-bench", jsonResults);
+	}else{
+		bench::writeJsonReport(std::cout, "net-bench", jsonResults);
+	}
+}
@@ -0,0 +1,31 @@
+#include <cassert>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "testsuite.hpp"
+
+DEFINE_TEST(flock_conflict, ([] {
+	int fd1 = open("/tmp/posix-tests-flock", O_RDWR | O_CREAT, 0644);
+	assert(fd1 != -1);
+	int fd2 = open("/tmp/posix-tests-flock", O_RDWR);
+	assert(fd2 != -1);
+
+	int e = flock(fd1, LOCK_EX);
+	assert(!e);
+	e = flock(fd2, LOCK_SH | LOCK_NB);
+	assert(e == -1 && errno == EWOULDBLOCK);
+
+	// Unlocking through one description must not drop the locks of others.
+	e = flock(fd1, LOCK_UN);
+	assert(!e);
+	e = flock(fd2, LOCK_SH | LOCK_NB);
+	assert(!e);
+	e = flock(fd1, LOCK_EX | LOCK_NB);
+	assert(e == -1 && errno == EWOULDBLOCK);
+
+	close(fd1);
+	close(fd2);
+	unlink("/tmp/posix-tests-flock");
+}))
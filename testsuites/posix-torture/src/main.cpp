@@ -1,4 +1,6 @@
 #include <iostream>
+#include <stdlib.h>
+#include <string.h>
 #include <vector>
 
 #include "testsuite.hpp"
@@ -12,7 +14,49 @@ void abstract_test_case::register_case(abstract_test_case *tcp) {
 	test_case_ptrs().push_back(tcp);
 }
 
-int main() {
+int main(int argc, char **argv) {
+	// Used by the fork()/vfork() + execve() tests.
+	if(argc > 1 && !strcmp(argv[1], "--exit-immediately"))
+		return 0;
+
+	// --scaling [--processes] [--workers N] [--duration MS] [--min-efficiency F]
+	//     [--json PATH] [TEST].
+	bool scaling = false;
+	scaling_options options;
+	for(int i = 1; i < argc; i++) {
+		auto has_value = [&] {
+			if(i + 1 >= argc) {
+				std::cout << "posix-torture: " << argv[i] << " requires a value" << std::endl;
+				exit(1);
+			}
+			return true;
+		};
+
+		if(!strcmp(argv[i], "--scaling")) {
+			scaling = true;
+		}else if(!strcmp(argv[i], "--processes")) {
+			options.use_processes = true;
+		}else if(!strcmp(argv[i], "--workers") && has_value()) {
+			options.max_workers = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "--duration") && has_value()) {
+			options.duration = std::chrono::milliseconds{atoi(argv[++i])};
+		}else if(!strcmp(argv[i], "--min-efficiency") && has_value()) {
+			options.min_efficiency = atof(argv[++i]);
+		}else if(!strcmp(argv[i], "--json") && has_value()) {
+			options.json_path = argv[++i];
+		}else if(argv[i][0] != '-') {
+			options.filter = argv[i];
+		}else{
+			std::cout << "posix-torture: Unknown option " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+
+	if(scaling) {
+		run_scaling(options);
+		return 0;
+	}
+
 	for(int s = 10; s < 24; s++) {
 		int n = 1 << s;
 		for(abstract_test_case *tcp : test_case_ptrs()) {
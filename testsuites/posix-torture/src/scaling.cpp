@@ -0,0 +1,269 @@
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <bench/report.hpp>
+
+#include "testsuite.hpp"
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+// Log-linear latency histogram: 8 sub-buckets per power of two (i.e., < 12.5% error).
+// It has a fixed size such that it can live in memory that is shared with child processes.
+constexpr int sub_bucket_shift = 3;
+constexpr int num_buckets = 64 << sub_bucket_shift;
+
+int bucket_of(uint64_t ns) {
+	if(ns < (1 << sub_bucket_shift))
+		return ns;
+	int e = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (e - sub_bucket_shift)) & ((1 << sub_bucket_shift) - 1);
+	return ((e - sub_bucket_shift + 1) << sub_bucket_shift) + sub;
+}
+
+uint64_t lower_bound_of(int bucket) {
+	if(bucket < (1 << sub_bucket_shift))
+		return bucket;
+	int e = (bucket >> sub_bucket_shift) + sub_bucket_shift - 1;
+	uint64_t sub = bucket & ((1 << sub_bucket_shift) - 1);
+	return ((1 << sub_bucket_shift) + sub) << (e - sub_bucket_shift);
+}
+
+struct worker_result {
+	uint64_t ops;
+	uint64_t histogram[num_buckets];
+};
+
+// Lives in a MAP_SHARED mapping (followed by one worker_result per worker).
+struct shared_state {
+	std::atomic<int> num_ready{0};
+	std::atomic<bool> go{false};
+	clock::time_point deadline;
+	worker_result *results;
+};
+
+struct run_stats {
+	double ops_per_second;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+	// Throughput estimates of the individual workers (ops * num_workers / elapsed).
+	std::vector<double> throughput_samples;
+	// Evenly spaced quantiles of the latency histogram.
+	std::vector<uint64_t> latency_samples;
+};
+
+// JSON objects of all runs; only written if --json is given.
+std::vector<std::string> json_results;
+
+[[noreturn]] void fail(const char *what) {
+	std::cout << "posix-torture: " << what << " failed: " << strerror(errno) << std::endl;
+	exit(1);
+}
+
+void pin_to_cpu(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	// Not fatal: the scheduler may still spread the workers.
+	if(sched_setaffinity(0, sizeof(set), &set))
+		std::cout << "posix-torture: sched_setaffinity() failed: "
+				<< strerror(errno) << std::endl;
+}
+
+void run_worker(abstract_test_case *tcp, shared_state *state, int index, int cpu) {
+	auto result = &state->results[index];
+	pin_to_cpu(cpu);
+
+	state->num_ready.fetch_add(1, std::memory_order_acq_rel);
+	while(!state->go.load(std::memory_order_acquire))
+		sched_yield();
+
+	auto deadline = state->deadline;
+	while(true) {
+		auto before = clock::now();
+		if(before >= deadline)
+			break;
+		tcp->run();
+		auto elapsed = clock::now() - before;
+
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+		result->histogram[bucket_of(ns)]++;
+		result->ops++;
+	}
+}
+
+run_stats run_scaled(abstract_test_case *tcp, const scaling_options &options,
+		int num_workers, int num_cpus) {
+	size_t size = sizeof(shared_state) + num_workers * sizeof(worker_result);
+	auto window = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(window == MAP_FAILED)
+		fail("mmap()");
+	auto state = new (window) shared_state;
+	state->results = new (state + 1) worker_result[num_workers]{};
+
+	std::vector<std::thread> threads;
+	std::vector<pid_t> pids;
+	for(int i = 0; i < num_workers; i++) {
+		if(options.use_processes) {
+			auto pid = fork();
+			if(pid < 0)
+				fail("fork()");
+			if(!pid) {
+				run_worker(tcp, state, i, i % num_cpus);
+				_exit(0);
+			}
+			pids.push_back(pid);
+		}else{
+			threads.emplace_back(run_worker, tcp, state, i, i % num_cpus);
+		}
+	}
+
+	while(state->num_ready.load(std::memory_order_acquire) < num_workers)
+		sched_yield();
+	auto start = clock::now();
+	state->deadline = start + options.duration;
+	state->go.store(true, std::memory_order_release);
+
+	for(auto &thread : threads)
+		thread.join();
+	for(auto pid : pids) {
+		int status;
+		if(waitpid(pid, &status, 0) < 0)
+			fail("waitpid()");
+		if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+			std::cout << "posix-torture: Worker process of " << tcp->name()
+					<< " did not exit cleanly" << std::endl;
+			exit(1);
+		}
+	}
+	// Workers may overrun the deadline by one operation; measure the actual time.
+	auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+	uint64_t ops = 0;
+	uint64_t histogram[num_buckets]{};
+	for(int i = 0; i < num_workers; i++) {
+		ops += state->results[i].ops;
+		for(int b = 0; b < num_buckets; b++)
+			histogram[b] += state->results[i].histogram[b];
+	}
+
+	auto percentile = [&] (uint64_t per_mille) {
+		uint64_t rank = std::min(ops * per_mille / 1000, ops - 1);
+		uint64_t seen = 0;
+		for(int b = 0; b < num_buckets; b++) {
+			seen += histogram[b];
+			if(seen > rank)
+				return lower_bound_of(b);
+		}
+		return uint64_t{0};
+	};
+
+	run_stats stats;
+	stats.ops_per_second = ops / elapsed;
+	stats.p50 = percentile(500);
+	stats.p99 = percentile(990);
+	stats.p999 = percentile(999);
+	stats.max = percentile(1000);
+	for(int i = 0; i < num_workers; i++)
+		stats.throughput_samples.push_back(state->results[i].ops * num_workers / elapsed);
+	for(size_t i = 0; i < bench::maxReportedSamples; i++)
+		stats.latency_samples.push_back(percentile(i * 1000 / bench::maxReportedSamples));
+
+	munmap(window, size);
+	return stats;
+}
+
+} // anonymous namespace
+
+void run_scaling(const scaling_options &options) {
+	int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_cpus < 1)
+		num_cpus = 1;
+	int max_workers = options.max_workers ? options.max_workers : num_cpus;
+
+	// 1, 2, 4, ... and finally max_workers.
+	std::vector<int> worker_counts;
+	for(int n = 1; n < max_workers; n *= 2)
+		worker_counts.push_back(n);
+	worker_counts.push_back(max_workers);
+
+	std::cout << "posix-torture: Scaling with up to " << max_workers
+			<< (options.use_processes ? " processes" : " threads")
+			<< " on " << num_cpus << " CPUs" << std::endl;
+
+	for(abstract_test_case *tcp : test_case_ptrs()) {
+		if(options.filter && strcmp(tcp->name(), options.filter))
+			continue;
+		std::cout << tcp->name() << std::endl;
+
+		double base_rate = 0;
+		for(int n : worker_counts) {
+			auto stats = run_scaled(tcp, options, n, num_cpus);
+			if(n == 1)
+				base_rate = stats.ops_per_second;
+			if(!base_rate) {
+				std::cout << "    No operation completed within the time limit" << std::endl;
+				break;
+			}
+
+			// Fraction of the ideal (linear) throughput.
+			double efficiency = stats.ops_per_second / (base_rate * n);
+
+			std::cout << "    " << std::setw(3) << n << " workers: "
+					<< static_cast<uint64_t>(stats.ops_per_second) << " ops/s"
+					<< ", p50: " << stats.p50 << " ns"
+					<< ", p99: " << stats.p99 << " ns"
+					<< ", p999: " << stats.p999 << " ns"
+					<< ", max: " << stats.max << " ns"
+					<< ", efficiency: " << std::fixed << std::setprecision(2)
+					<< efficiency << std::defaultfloat;
+			if(n > 1 && efficiency < options.min_efficiency)
+				std::cout << " (sub-linear)";
+			std::cout << std::endl;
+
+			std::string name = std::string{tcp->name()} + ", workers = " + std::to_string(n);
+			std::stringstream json;
+			json << "{\"name\": " << bench::jsonString(name)
+					<< ", \"unit\": \"ops/s\""
+					<< ", \"avg\": " << static_cast<uint64_t>(stats.ops_per_second)
+					<< ", \"efficiency\": " << efficiency
+					<< ", \"samples\": " << bench::jsonSamples(stats.throughput_samples) << "}";
+			json_results.push_back(json.str());
+			json.str("");
+			json << "{\"name\": " << bench::jsonString(name + ", latency")
+					<< ", \"unit\": \"ns\""
+					<< ", \"p50\": " << stats.p50
+					<< ", \"p99\": " << stats.p99
+					<< ", \"p999\": " << stats.p999
+					<< ", \"max\": " << stats.max
+					<< ", \"samples\": " << bench::jsonSamples(stats.latency_samples) << "}";
+			json_results.push_back(json.str());
+		}
+	}
+
+	if(options.json_path) {
+		std::ofstream file{options.json_path};
+		bench::writeJsonReport(file, "posix-torture", json_results);
+	}
+}
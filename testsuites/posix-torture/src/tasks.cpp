@@ -16,3 +16,35 @@ DEFINE_TEST(fork_exit_waitpid, ([] {
 		assert(res > 0);
 	}
 }))
+
+// Re-executes posix-torture; main() exits immediately when it sees this argument.
+static void exec_self() {
+	execl("/proc/self/exe", "posix-torture", "--exit-immediately", nullptr);
+	_exit(127);
+}
+
+DEFINE_TEST(fork_exec_waitpid, ([] {
+	int pid = fork();
+	assert(pid >= 0);
+	if(!pid) {
+		exec_self();
+	}else{
+		int status;
+		auto res = waitpid(pid, &status, 0);
+		assert(res > 0);
+		assert(WIFEXITED(status) && !WEXITSTATUS(status));
+	}
+}))
+
+DEFINE_TEST(vfork_exec_waitpid, ([] {
+	int pid = vfork();
+	assert(pid >= 0);
+	if(!pid) {
+		exec_self();
+	}else{
+		int status;
+		auto res = waitpid(pid, &status, 0);
+		assert(res > 0);
+		assert(WIFEXITED(status) && !WEXITSTATUS(status));
+	}
+}))
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <chrono>
 #include <utility>
+#include <vector>
 
 #define DEFINE_TEST(s, f) \
 	static test_case test_ ## s{#s, f};
@@ -43,3 +45,23 @@ struct test_case : abstract_test_case {
 private:
 	F functor_;
 };
+
+std::vector<abstract_test_case *> &test_case_ptrs();
+
+struct scaling_options {
+	// Maximal number of concurrent workers; zero means one per CPU.
+	int max_workers = 0;
+	// Fork worker processes instead of spawning threads.
+	bool use_processes = false;
+	// Only run the test case of the given name (if non-null).
+	const char *filter = nullptr;
+	std::chrono::milliseconds duration{1000};
+	// Runs whose throughput is below this fraction of linear scaling are flagged.
+	double min_efficiency = 0.75;
+	// Path of the JSON report (if non-null).
+	const char *json_path = nullptr;
+};
+
+// Runs each test case with an increasing number of workers;
+// reports the throughput and latency percentiles for each run.
+void run_scaling(const scaling_options &options);
@@ -2,86 +2,277 @@
 
 import argparse
 import bisect
+import json
+import os
 import struct
 import subprocess
 
 parser = argparse.ArgumentParser()
 parser.add_argument('profile_path', type=str)
+parser.add_argument('--kernel', type=str,
+	default='pkg-builds/managarm-kernel/kernel/thor/thor',
+	help="path to the (unstripped) kernel binary")
 parser.add_argument('--aggregate-by',
 	choices=['symbol', 'source'], default='symbol',
 	help="aggregate samples by source line of code or by symbol inside the binary")
 parser.add_argument('--line', action='store_true')
 parser.add_argument('--isn', action='store_true')
+parser.add_argument('--cpu', type=int,
+	help="only consider samples from the given CPU")
+parser.add_argument('--universe', type=int,
+	help="only consider samples that were taken while the given universe was active")
+parser.add_argument('--thread', type=int,
+	help="only consider samples that were taken while the given thread was active")
+parser.add_argument('--by-universe', action='store_true',
+	help="print the number of samples per universe and thread")
+parser.add_argument('--collapsed', type=str,
+	help="write stacks in the collapsed format of flamegraph.pl (and speedscope) to the given file")
+parser.add_argument('--cache-dir', type=str,
+	default=os.path.join(os.environ.get('XDG_CACHE_HOME', os.path.expanduser('~/.cache')),
+		'managarm', 'symbols'),
+	help="directory of the symbol cache (one file per build ID)")
 
 args = parser.parse_args()
 
-profile = dict()
+# ----------------------------------------------------------------------------
+# ELF parsing.
+# ----------------------------------------------------------------------------
+
+SHT_SYMTAB = 2
+SHT_NOTE = 7
+STT_FUNC = 2
+NT_GNU_BUILD_ID = 3
+
+class Elf:
+	def __init__(self, path):
+		with open(path, 'rb') as f:
+			self.data = f.read()
+		if self.data[:4] != b'\x7fELF' or self.data[4] != 2:
+			raise RuntimeError("{} is not a 64-bit ELF file".format(path))
+
+		(shoff,) = struct.unpack_from('<Q', self.data, 0x28)
+		shentsize, shnum = struct.unpack_from('<HH', self.data, 0x3A)
+		self.sections = []
+		for i in range(shnum):
+			self.sections.append(struct.unpack_from('<IIQQQQIIQQ', self.data, shoff + i * shentsize))
+
+	def build_id(self):
+		for (_, sh_type, _, _, offset, size, _, _, _, _) in self.sections:
+			if sh_type != SHT_NOTE:
+				continue
+			pos = offset
+			while pos + 12 <= offset + size:
+				namesz, descsz, n_type = struct.unpack_from('<III', self.data, pos)
+				name_pos = pos + 12
+				desc_pos = name_pos + ((namesz + 3) & ~3)
+				if n_type == NT_GNU_BUILD_ID and self.data[name_pos:name_pos + namesz] == b'GNU\0':
+					return self.data[desc_pos:desc_pos + descsz].hex()
+				pos = desc_pos + ((descsz + 3) & ~3)
+		return None
+
+	# Returns a sorted list of (address, size, name) of all functions.
+	def functions(self):
+		result = []
+		for (_, sh_type, _, _, offset, size, link, _, _, entsize) in self.sections:
+			if sh_type != SHT_SYMTAB:
+				continue
+			strtab_offset = self.sections[link][4]
+			for pos in range(offset, offset + size, entsize):
+				st_name, st_info, _, _, st_value, st_size = struct.unpack_from('<IBBHQQ',
+					self.data, pos)
+				if (st_info & 0xF) != STT_FUNC or not st_value:
+					continue
+				end = self.data.index(b'\0', strtab_offset + st_name)
+				name = self.data[strtab_offset + st_name:end].decode('ascii', 'replace')
+				result.append((st_value, st_size, name))
+		result.sort()
+		return result
+
+# ----------------------------------------------------------------------------
+# Symbolization.
+# ----------------------------------------------------------------------------
+
+# Resolves addresses to lists of (function, location) frames (innermost first,
+# including inlined functions). Results are cached on disk per build ID,
+# hence each address is only resolved once across runs.
+class Symbolizer:
+	def __init__(self, path):
+		self.path = path
+		elf = Elf(path)
+
+		self.functions = elf.functions()
+		self.starts = [f[0] for f in self.functions]
+
+		self.cache_path = None
+		self.cache = dict()
+		self.dirty = False
+		build_id = elf.build_id()
+		if build_id:
+			self.cache_path = os.path.join(args.cache_dir, build_id + '.json')
+			if os.path.exists(self.cache_path):
+				with open(self.cache_path) as f:
+					self.cache = {int(k, 16): v for k, v in json.load(f).items()}
+
+	def symbol(self, addr):
+		idx = bisect.bisect_right(self.starts, addr)
+		if idx == 0:
+			return None
+		start, size, name = self.functions[idx - 1]
+		if size and addr >= start + size:
+			return None
+		return name
+
+	# Resolves all addresses that are not cached yet with a single addr2line process.
+	def resolve(self, addrs):
+		missing = sorted(a for a in set(addrs) if a not in self.cache)
+		if not missing:
+			return
+		out = subprocess.run(['addr2line', '-aifC', '-e', self.path],
+			input=''.join(hex(a) + '\n' for a in missing),
+			capture_output=True, encoding='ascii', errors='replace', check=True).stdout
+
+		frames = None
+		lines = out.splitlines()
+		i = 0
+		while i < len(lines):
+			if lines[i].startswith('0x'):
+				frames = []
+				self.cache[int(lines[i], 16)] = frames
+				i += 1
+				continue
+			frames.append([lines[i], lines[i + 1] if i + 1 < len(lines) else '??:0'])
+			i += 2
+		self.dirty = True
+
+	def frames(self, addr):
+		return self.cache.get(addr, [['??', '??:0']])
+
+	def save(self):
+		if not self.dirty or not self.cache_path:
+			return
+		os.makedirs(os.path.dirname(self.cache_path), exist_ok=True)
+		tmp_path = self.cache_path + '.tmp'
+		with open(tmp_path, 'w') as f:
+			json.dump({hex(k): v for k, v in self.cache.items()}, f)
+		os.replace(tmp_path, self.cache_path)
+
+# ----------------------------------------------------------------------------
+# Sample parsing.
+# ----------------------------------------------------------------------------
 
-if args.aggregate_by == 'symbol':
-	nm = subprocess.check_output(
-		[
-			'nm', '-nC',
-			'pkg-builds/managarm-kernel/kernel/thor/thor'
-		],
-		encoding='ascii');
-
-	sym_table = []
-	for line in nm.splitlines():
-		start, attr, symbol = line.split(' ', 2)
-		sym_table.append((int(start, 16), symbol))
-	sym_index = [e[0] for e in sym_table]
-else:
-	addr2line = subprocess.Popen(
-		[
-			'addr2line', '-sfC',
-			'-e', 'pkg-builds/managarm-kernel/kernel/thor/thor'
-		],
-		encoding='ascii',
-		stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+# Must match thor's ProfileSample struct.
+sample_format = struct.Struct('QQQII')
+
+def is_kernel(ip):
+	return ip >= (1 << 63)
+
+samples = []
+with open(args.profile_path, 'rb') as f:
+	data = f.read()
+pos = 0
+while pos + sample_format.size <= len(data):
+	ip, thread, universe, cpu, num_frames = sample_format.unpack_from(data, pos)
+	pos += sample_format.size
+	if pos + 8 * num_frames > len(data):
+		break
+	frames = struct.unpack_from('<{}Q'.format(num_frames), data, pos)
+	pos += 8 * num_frames
+
+	if args.cpu is not None and cpu != args.cpu:
+		continue
+	if args.universe is not None and universe != args.universe:
+		continue
+	if args.thread is not None and thread != args.thread:
+		continue
+	samples.append((ip, frames, thread, universe))
+
+symbolizer = Symbolizer(args.kernel)
+
+# Return addresses point behind the call; use the call instruction for lookups.
+def stack_addrs(ip, frames):
+	return [ip] + [ret - 1 for ret in frames]
+
+if args.aggregate_by == 'source' or args.collapsed:
+	addrs = []
+	for ip, frames, _, _ in samples:
+		if is_kernel(ip):
+			addrs.extend(stack_addrs(ip, frames))
+	symbolizer.resolve(addrs)
+	symbolizer.save()
+
+# ----------------------------------------------------------------------------
+# Output.
+# ----------------------------------------------------------------------------
+
+profile = dict()
+per_universe = dict()
 
 n_user = 0
 n_kernel = 0
 n_resolved = 0
 
-with open(args.profile_path, 'rb') as f:
-	while True:
-		rec = f.read(8)
-		if not rec:
-			break
-		ip = struct.unpack('Q', rec)[0]
-		if ip < (1 << 63):
-			n_user += 1
+for ip, frames, thread, universe in samples:
+	key = (universe, thread)
+	per_universe[key] = per_universe.get(key, 0) + 1
+
+	if not is_kernel(ip):
+		n_user += 1
+		continue
+	n_kernel += 1
+
+	if args.aggregate_by == 'symbol':
+		symbol = symbolizer.symbol(ip)
+		if symbol is None:
 			continue
+		loc = symbol, 0
+	else:
+		func, line = symbolizer.frames(ip)[0]
+		if args.line:
+			loc = (func, line)
+		elif args.isn:
+			loc = (func, line.split(':')[0] + ':' + hex(ip))
 		else:
-			n_kernel += 1
+			loc = (func, line.split(':')[0])
 
-		if args.aggregate_by == 'symbol':
-			idx = bisect.bisect_left(sym_index, ip)
-			if idx == 0:
-				continue
-			start, symbol = sym_table[idx - 1];
-			assert ip >= start
+	if loc in profile:
+		profile[loc] += 1
+	else:
+		profile[loc] = 1
+	n_resolved += 1
 
-			loc = symbol, 0
+n_all = n_user + n_kernel
+
+if args.collapsed:
+	stacks = dict()
+	for ip, frames, thread, universe in samples:
+		if thread:
+			stack = ['universe {}'.format(universe), 'thread {}'.format(thread)]
 		else:
-			addr2line.stdin.write(hex(ip) + '\n')
-			addr2line.stdin.flush()
-			func = addr2line.stdout.readline().rstrip()
-			line = addr2line.stdout.readline().rstrip()
-			if args.line:
-				loc = (func, line)
-			elif args.isn:
-				loc = (func, line.split(':')[0] + ':' + hex(ip))
-			else:
-				loc = (func, line.split(':')[0])
-
-		if loc in profile:
-			profile[loc] += 1
+			stack = ['kernel fibers']
+		if is_kernel(ip):
+			for addr in reversed(stack_addrs(ip, frames)):
+				# addr2line reports inlined frames innermost first.
+				for func, _ in reversed(symbolizer.frames(addr)):
+					stack.append(func.replace(';', ':'))
 		else:
-			profile[loc] = 1
-		n_resolved += 1
+			# User space samples are not unwound (and thor does not record mappings).
+			stack.append('[user]')
+		key = ';'.join(stack)
+		stacks[key] = stacks.get(key, 0) + 1
+	with open(args.collapsed, 'w') as f:
+		for key, count in sorted(stacks.items()):
+			f.write('{} {}\n'.format(key, count))
 
-n_all = n_user + n_kernel
+if args.by_universe:
+	for key in sorted(per_universe.keys(), key=lambda key: per_universe[key]):
+		universe, thread = key
+		if not thread:
+			print("{:.2f}% ({} samples) in kernel fibers".format(
+				per_universe[key]/n_all*100, per_universe[key]))
+		else:
+			print("{:.2f}% ({} samples) in universe {}, thread {}".format(
+				per_universe[key]/n_all*100, per_universe[key], universe, thread))
+	print()
 
 out = sorted(profile.keys(), key=lambda loc: profile[loc])
 for loc in out:
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+
+# Stores JSON reports of kernel-bench, net-bench and posix-torture --scaling
+# and compares two reports using the Mann-Whitney U test.
+
+import argparse
+import datetime
+import json
+import math
+import os
+import shutil
+import sys
+
+# Units for which smaller values are better; for all others, larger values are better.
+lower_is_better = {'ns'}
+
+def load(path_or_label):
+	if not os.path.exists(path_or_label):
+		candidate = os.path.join(args.store, path_or_label + '.json')
+		if os.path.exists(candidate):
+			path_or_label = candidate
+	with open(path_or_label) as f:
+		return json.load(f)
+
+def median(xs):
+	ys = sorted(xs)
+	n = len(ys)
+	return ys[n // 2] if n % 2 else (ys[n // 2 - 1] + ys[n // 2]) / 2
+
+# Two-sided Mann-Whitney U test (normal approximation with tie correction).
+# Returns the p-value; None if there are too few samples to tell.
+def mann_whitney(xs, ys):
+	n1, n2 = len(xs), len(ys)
+	if n1 < 3 or n2 < 3:
+		return None
+
+	# Assign average ranks to tied values.
+	values = sorted([(v, 0) for v in xs] + [(v, 1) for v in ys])
+	rank_sum = 0
+	tie_term = 0
+	i = 0
+	while i < len(values):
+		j = i
+		while j < len(values) and values[j][0] == values[i][0]:
+			j += 1
+		rank = (i + j + 1) / 2
+		rank_sum += rank * sum(1 for k in range(i, j) if values[k][1] == 0)
+		t = j - i
+		tie_term += t ** 3 - t
+		i = j
+
+	u = rank_sum - n1 * (n1 + 1) / 2
+	n = n1 + n2
+	mu = n1 * n2 / 2
+	var = n1 * n2 / 12 * ((n + 1) - tie_term / (n * (n - 1)))
+	if var <= 0:
+		return 1.0
+	# Continuity correction.
+	z = (abs(u - mu) - 0.5) / math.sqrt(var)
+	if z < 0:
+		z = 0
+	return math.erfc(z / math.sqrt(2))
+
+def do_store():
+	report = load(args.report)
+	label = args.label or '{}-{}'.format(report.get('suite', 'report'),
+		datetime.datetime.now().strftime('%Y%m%d-%H%M%S'))
+	os.makedirs(args.store, exist_ok=True)
+	path = os.path.join(args.store, label + '.json')
+	if os.path.exists(path) and not args.force:
+		sys.exit("bench-results: {} already exists (use --force to overwrite)".format(path))
+	shutil.copyfile(args.report, path)
+	print("Stored {} as {}".format(args.report, path))
+
+def do_list():
+	if not os.path.isdir(args.store):
+		return
+	for entry in sorted(os.listdir(args.store)):
+		if not entry.endswith('.json'):
+			continue
+		with open(os.path.join(args.store, entry)) as f:
+			report = json.load(f)
+		env = report.get('environment', {})
+		print("{}: {}, {} benchmarks, {} ({} CPUs)".format(entry[:-5],
+			report.get('suite', '?'), len(report.get('benchmarks', [])),
+			env.get('cpu_model', '?'), env.get('num_cpus', '?')))
+
+def do_compare():
+	base = load(args.base)
+	new = load(args.new)
+
+	base_env = base.get('environment', {})
+	new_env = new.get('environment', {})
+	for key in sorted(set(base_env) | set(new_env)):
+		if base_env.get(key) != new_env.get(key):
+			print("warning: {} differs: {!r} vs. {!r}".format(key,
+				base_env.get(key), new_env.get(key)))
+
+	base_benchmarks = {b['name']: b for b in base.get('benchmarks', [])}
+	num_regressions = 0
+	for b in new.get('benchmarks', []):
+		name = b['name']
+		a = base_benchmarks.get(name)
+		if a is None or 'samples' not in a or 'samples' not in b:
+			continue
+		if not a['samples'] or not b['samples']:
+			continue
+
+		old_median = median(a['samples'])
+		new_median = median(b['samples'])
+		change = (new_median - old_median) / old_median if old_median else 0
+		p = mann_whitney(a['samples'], b['samples'])
+
+		better_if_lower = b.get('unit') in lower_is_better
+		worse = change > 0 if better_if_lower else change < 0
+		if p is None:
+			verdict = 'too few samples'
+		elif p >= args.alpha or abs(change) < args.threshold:
+			verdict = 'no change'
+		elif worse:
+			verdict = 'REGRESSION'
+			num_regressions += 1
+		else:
+			verdict = 'improvement'
+
+		if verdict == 'no change' and not args.verbose:
+			continue
+		print("{}: {:.6g} -> {:.6g} {} ({:+.1f}%, p = {}): {}".format(name,
+			old_median, new_median, b.get('unit', ''), change * 100,
+			'n/a' if p is None else '{:.4f}'.format(p), verdict))
+
+	print("{} regression(s)".format(num_regressions))
+	if num_regressions:
+		sys.exit(1)
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--store', type=str, default='benchmark-results',
+	help="directory that holds stored reports")
+subparsers = parser.add_subparsers(dest='command', required=True)
+
+store_parser = subparsers.add_parser('store', help="add a report to the store")
+store_parser.add_argument('report', type=str)
+store_parser.add_argument('--label', type=str,
+	help="name of the stored report (default: suite and timestamp)")
+store_parser.add_argument('--force', action='store_true')
+store_parser.set_defaults(handler=do_store)
+
+list_parser = subparsers.add_parser('list', help="list stored reports")
+list_parser.set_defaults(handler=do_list)
+
+compare_parser = subparsers.add_parser('compare',
+	help="report significant changes between two reports (paths or stored labels)")
+compare_parser.add_argument('base', type=str)
+compare_parser.add_argument('new', type=str)
+compare_parser.add_argument('--alpha', type=float, default=0.01,
+	help="significance level of the Mann-Whitney U test")
+compare_parser.add_argument('--threshold', type=float, default=0.02,
+	help="ignore changes of the median that are smaller than this fraction")
+compare_parser.add_argument('--verbose', action='store_true',
+	help="also print benchmarks that did not change")
+compare_parser.set_defaults(handler=do_compare)
+
+args = parser.parse_args()
+args.handler()
@@ -4,13 +4,16 @@ import os
 import shutil
 import subprocess
 import tempfile
-import sys
 import argparse
 
 parser = argparse.ArgumentParser(description = 'Generate a managarm initrd')
 parser.add_argument('-t', '--triple', dest = 'arch',
 		choices = ['x86_64-managarm', 'aarch64-managarm'], default = 'x86_64-managarm',
 		help = 'Target system triple (default: x86_64-managarm)')
+parser.add_argument('--compress', choices = ['none', 'lz4'], default = 'none',
+		help = 'Compress the initrd; thor decompresses LZ4 images on all CPUs (default: none)')
+parser.add_argument('--no-align', dest = 'align', action = 'store_false',
+		help = 'Do not page-align file data (thor then copies all files out of the image)')
 
 args = parser.parse_args()
 
@@ -96,7 +99,7 @@ for fname in os.listdir('system-root/usr/lib/managarm/server'):
 		continue
 	add_file('system-root/usr/lib/managarm/server', 'managarm/server', fname)
 
-# Copy (= hard link) the files to a temporary directory, run GNU cpio.
+# Copy (= hard link) the files to a temporary directory, write the CPIO archive.
 
 tree_path = tempfile.mkdtemp(prefix='initrd-', dir='.')
 
@@ -112,14 +115,43 @@ for rel_path in file_list:
 	else:
 		os.link(entry.source, dest_path)
 
-proc = subprocess.Popen(['cpio', '--create', '--format=newc',
-			'-D', tree_path,
-			'--file', 'initrd.cpio',
-			'--quiet'],
-		stdin=subprocess.PIPE,
-		encoding='ascii')
-proc.communicate(input='\n'.join(file_list))
-if proc.returncode != 0:
-	sys.exit(1)
+# We write the newc archive ourselves (instead of running GNU cpio) such that the data
+# of each regular file starts at a page boundary: thor then serves the files from the
+# image's pages directly instead of copying them. To align the data, we pad the names
+# with additional NULs; extractors only use the name up to the first NUL.
+page_size = 4096
+
+def write_entry(out, name, mode, data=b'', nlink=1, mtime=0, align=False):
+	encoded = name.encode('ascii') + b'\0'
+	header_size = 110
+	if align and data:
+		start = out.tell() + header_size + len(encoded)
+		encoded += b'\0' * ((-start) % page_size)
+	fields = [0, mode, 0, 0, nlink, mtime, len(data), 0, 0, 0, 0, len(encoded), 0]
+	out.write(b'070701' + ''.join('{:08x}'.format(f) for f in fields).encode('ascii'))
+	out.write(encoded)
+	out.write(b'\0' * ((-out.tell()) % 4))
+	out.write(data)
+	out.write(b'\0' * ((-out.tell()) % 4))
+
+with open('initrd.cpio', 'wb') as out:
+	for rel_path in file_list:
+		path = os.path.join(tree_path, rel_path)
+		st = os.stat(path)
+		if file_dict[rel_path].is_dir:
+			write_entry(out, rel_path, st.st_mode, nlink=2, mtime=int(st.st_mtime))
+		else:
+			with open(path, 'rb') as f:
+				data = f.read()
+			write_entry(out, rel_path, st.st_mode, data, mtime=int(st.st_mtime),
+					align=args.align)
+	write_entry(out, 'TRAILER!!!', 0)
 
 shutil.rmtree(tree_path)
+
+# thor detects compressed images by their magic; hence, we keep the file name.
+# Independent 1 MiB blocks allow thor to decompress the image in parallel.
+if args.compress == 'lz4':
+	subprocess.check_call(['lz4', '-q', '-f', '-9', '-B6', '-BI', '--content-size',
+			'initrd.cpio', 'initrd.cpio.lz4'])
+	os.replace('initrd.cpio.lz4', 'initrd.cpio')
@@ -0,0 +1,408 @@
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <bragi/helpers-std.hpp>
+#include <CLI/App.hpp>
+#include <CLI/Formatter.hpp>
+#include <CLI/Config.hpp>
+#include <frg/span.hpp>
+#include <protocols/ostrace/ring.hpp>
+#include <ostrace.bragi.hpp>
+
+// Converts ostrace logs to Perfetto's protobuf trace format.
+// The input is processed in chunks and the output is written packet by packet,
+// hence traces of arbitrary length can be converted (also from a pipe while
+// the trace is still being recorded).
+
+namespace {
+
+// Minimal protobuf encoder for the subset of perfetto.protos.Trace that we emit.
+struct ProtoWriter {
+	void varint(uint64_t v) {
+		while(v >= 0x80) {
+			data.push_back(static_cast<char>(v | 0x80));
+			v >>= 7;
+		}
+		data.push_back(static_cast<char>(v));
+	}
+
+	void tagVarint(unsigned int field, uint64_t v) {
+		varint(field << 3);
+		varint(v);
+	}
+
+	void tagBytes(unsigned int field, std::string_view bytes) {
+		varint((field << 3) | 2);
+		varint(bytes.size());
+		data.append(bytes);
+	}
+
+	void tagMessage(unsigned int field, const ProtoWriter &message) {
+		tagBytes(field, message.data);
+	}
+
+	std::string data;
+};
+
+// Field numbers of perfetto.protos.TracePacket and friends.
+namespace pf {
+	constexpr unsigned int tracePacket = 1;
+
+	constexpr unsigned int packetTimestamp = 8;
+	constexpr unsigned int packetSequenceId = 10;
+	constexpr unsigned int packetTrackEvent = 11;
+	constexpr unsigned int packetTrackDescriptor = 60;
+
+	constexpr unsigned int trackUuid = 1;
+	constexpr unsigned int trackName = 2;
+	constexpr unsigned int trackParentUuid = 5;
+
+	constexpr unsigned int eventDebugAnnotations = 4;
+	constexpr unsigned int eventType = 9;
+	constexpr unsigned int eventTrackUuid = 11;
+	constexpr unsigned int eventName = 23;
+
+	constexpr unsigned int annotationIntValue = 4;
+	constexpr unsigned int annotationName = 10;
+
+	constexpr uint64_t typeSliceBegin = 1;
+	constexpr uint64_t typeSliceEnd = 2;
+	constexpr uint64_t typeInstant = 3;
+}
+
+// All packets are emitted on a single sequence.
+constexpr uint64_t sequenceId = 1;
+
+// CPU number of records that were not drained from a per-CPU ring.
+constexpr uint32_t unknownCpu = UINT32_MAX;
+
+struct Exporter {
+	Exporter(FILE *out, std::unordered_set<std::string> durationItems)
+	: out_{out}, durationItems_{std::move(durationItems)} { }
+
+	void announceEvent(uint64_t id, std::string name) {
+		eventNames_[id] = std::move(name);
+	}
+
+	void announceItem(uint64_t id, std::string name) {
+		if(durationItems_.contains(name))
+			durationIds_.insert(id);
+		itemNames_[id] = std::move(name);
+	}
+
+	// Events that carry a duration item become slices that end at ts; all other
+	// events become instants on the track of their CPU.
+	template<typename GetCounter>
+	void event(uint32_t cpu, uint64_t ts, uint64_t id, size_t numCtrs, GetCounter getCounter) {
+		std::optional<uint64_t> duration;
+		ProtoWriter annotations;
+		for(size_t i = 0; i < numCtrs; ++i) {
+			auto [ctrId, ctrValue] = getCounter(i);
+			if(durationIds_.contains(ctrId) && ctrValue >= 0 && !duration) {
+				duration = ctrValue;
+				continue;
+			}
+
+			ProtoWriter annotation;
+			annotation.tagBytes(pf::annotationName, itemName_(ctrId));
+			annotation.tagVarint(pf::annotationIntValue, static_cast<uint64_t>(ctrValue));
+			annotations.tagMessage(pf::eventDebugAnnotations, annotation);
+		}
+
+		auto &name = eventName_(id);
+		if(duration && *duration <= ts) {
+			auto begin = ts - *duration;
+			auto lane = sliceLane_(id, begin, ts);
+
+			ProtoWriter beginEvent;
+			beginEvent.tagVarint(pf::eventType, pf::typeSliceBegin);
+			beginEvent.tagVarint(pf::eventTrackUuid, lane);
+			beginEvent.tagBytes(pf::eventName, name);
+			beginEvent.data.append(annotations.data);
+			emitEvent_(begin, beginEvent);
+
+			ProtoWriter endEvent;
+			endEvent.tagVarint(pf::eventType, pf::typeSliceEnd);
+			endEvent.tagVarint(pf::eventTrackUuid, lane);
+			emitEvent_(ts, endEvent);
+		}else{
+			ProtoWriter instant;
+			instant.tagVarint(pf::eventType, pf::typeInstant);
+			instant.tagVarint(pf::eventTrackUuid, cpuTrack_(cpu));
+			instant.tagBytes(pf::eventName, name);
+			instant.data.append(annotations.data);
+			emitEvent_(ts, instant);
+		}
+		++numEvents;
+	}
+
+	void lost(uint32_t cpu, uint64_t ts, uint64_t n) {
+		ProtoWriter instant;
+		instant.tagVarint(pf::eventType, pf::typeInstant);
+		instant.tagVarint(pf::eventTrackUuid, cpuTrack_(cpu));
+		instant.tagBytes(pf::eventName, "ostrace: records lost (n = " + std::to_string(n) + ")");
+		emitEvent_(ts, instant);
+	}
+
+	size_t numEvents = 0;
+	size_t numLanes = 0;
+
+private:
+	// Concurrent slices of the same event would overlap on a single track.
+	// Each event gets a parent track with child tracks ("lanes") such that
+	// the slices on each lane are disjoint.
+	struct EventTrack {
+		uint64_t uuid;
+		std::vector<uint64_t> laneUuids;
+		// End of the latest slice on each lane.
+		std::vector<uint64_t> laneEnds;
+	};
+
+	const std::string &eventName_(uint64_t id) {
+		auto it = eventNames_.find(id);
+		if(it == eventNames_.end())
+			it = eventNames_.emplace(id, "event " + std::to_string(id)).first;
+		return it->second;
+	}
+
+	const std::string &itemName_(uint64_t id) {
+		auto it = itemNames_.find(id);
+		if(it == itemNames_.end())
+			it = itemNames_.emplace(id, "item " + std::to_string(id)).first;
+		return it->second;
+	}
+
+	uint64_t cpuTrack_(uint32_t cpu) {
+		auto it = cpuTracks_.find(cpu);
+		if(it != cpuTracks_.end())
+			return it->second;
+
+		auto uuid = nextUuid_++;
+		emitTrack_(uuid, 0, (cpu == unknownCpu) ? std::string{"CPU ?"}
+				: "CPU " + std::to_string(cpu));
+		cpuTracks_.emplace(cpu, uuid);
+		return uuid;
+	}
+
+	uint64_t sliceLane_(uint64_t id, uint64_t begin, uint64_t end) {
+		auto it = eventTracks_.find(id);
+		if(it == eventTracks_.end()) {
+			auto uuid = nextUuid_++;
+			emitTrack_(uuid, 0, eventName_(id));
+			it = eventTracks_.emplace(id, EventTrack{uuid, {}, {}}).first;
+		}
+		auto &track = it->second;
+
+		// Records of different CPUs arrive out of order; a lane is only reused
+		// if the slice starts after all slices that are already on the lane.
+		for(size_t i = 0; i < track.laneEnds.size(); ++i) {
+			if(track.laneEnds[i] <= begin) {
+				track.laneEnds[i] = end;
+				return track.laneUuids[i];
+			}
+		}
+
+		auto uuid = nextUuid_++;
+		emitTrack_(uuid, track.uuid, eventName_(id) + " #" + std::to_string(track.laneUuids.size()));
+		track.laneUuids.push_back(uuid);
+		track.laneEnds.push_back(end);
+		++numLanes;
+		return uuid;
+	}
+
+	void emitTrack_(uint64_t uuid, uint64_t parent, const std::string &name) {
+		ProtoWriter descriptor;
+		descriptor.tagVarint(pf::trackUuid, uuid);
+		descriptor.tagBytes(pf::trackName, name);
+		if(parent)
+			descriptor.tagVarint(pf::trackParentUuid, parent);
+
+		ProtoWriter packet;
+		packet.tagVarint(pf::packetSequenceId, sequenceId);
+		packet.tagMessage(pf::packetTrackDescriptor, descriptor);
+		emitPacket_(packet);
+	}
+
+	void emitEvent_(uint64_t ts, const ProtoWriter &event) {
+		ProtoWriter packet;
+		packet.tagVarint(pf::packetTimestamp, ts);
+		packet.tagVarint(pf::packetSequenceId, sequenceId);
+		packet.tagMessage(pf::packetTrackEvent, event);
+		emitPacket_(packet);
+	}
+
+	// A trace is a sequence of length-delimited packets; we never need to
+	// rewrite anything that was already written.
+	void emitPacket_(const ProtoWriter &packet) {
+		ProtoWriter framed;
+		framed.tagMessage(pf::tracePacket, packet);
+		if(fwrite(framed.data.data(), 1, framed.data.size(), out_) != framed.data.size())
+			err(1, "failed to write output");
+	}
+
+	FILE *out_;
+	std::unordered_set<std::string> durationItems_;
+	std::unordered_set<uint64_t> durationIds_;
+	std::unordered_map<uint64_t, std::string> eventNames_;
+	std::unordered_map<uint64_t, std::string> itemNames_;
+	std::unordered_map<uint32_t, uint64_t> cpuTracks_;
+	std::unordered_map<uint64_t, EventTrack> eventTracks_;
+	uint64_t nextUuid_ = 1;
+};
+
+// Size of the chunks that are read from the input.
+constexpr size_t chunkSize = 1 << 20;
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+	std::string inPath{"virtio-trace.bin"};
+	std::string outPath{"trace.perfetto"};
+	std::vector<std::string> durationItems{"time", "latency"};
+
+	CLI::App app{"export-ostrace: convert ostrace logs to Perfetto traces"};
+	app.add_option("path", inPath, "Path to the input file (- for stdin)");
+	app.add_option("-o,--output", outPath, "Path to the output file");
+	app.add_option("-d,--duration-item", durationItems,
+			"Items that contain the duration (in ns) of the event that they are attached to");
+	CLI11_PARSE(app, argc, argv);
+
+	int fd = 0;
+	if(inPath != "-") {
+		fd = open(inPath.c_str(), O_RDONLY);
+		if(fd < 0)
+			err(1, "failed to open input file %s", inPath.c_str());
+	}
+
+	FILE *out = fopen(outPath.c_str(), "wb");
+	if(!out)
+		err(1, "failed to open output file %s", outPath.c_str());
+
+	Exporter exporter{out, {durationItems.begin(), durationItems.end()}};
+
+	// Returns false if the record is broken.
+	auto processRecord = [&] (frg::span<const char> head_span,
+			frg::span<const char> tail_span, uint32_t id) -> bool {
+		switch (id) {
+		case bragi::message_id<managarm::ostrace::EventRecord>: {
+			auto maybeRecord = bragi::parse_head_tail<managarm::ostrace::EventRecord>(
+					head_span, tail_span);
+			if(!maybeRecord)
+				return false;
+			auto &record = maybeRecord.value();
+
+			exporter.event(unknownCpu, record.ts(), record.id(), record.ctrs_size(),
+					[&] (size_t i) {
+				return std::pair<uint64_t, int64_t>{record.ctrs(i).id(), record.ctrs(i).value()};
+			});
+		} break;
+		case bragi::message_id<managarm::ostrace::EventBatchRecord>: {
+			auto maybeRecord = bragi::parse_head_tail<managarm::ostrace::EventBatchRecord>(
+					head_span, tail_span);
+			if(!maybeRecord)
+				return false;
+			auto &batch = maybeRecord.value();
+			auto &records = batch.records();
+			if(records.size() % sizeof(protocols::ostrace::RingRecord))
+				return false;
+
+			for(size_t k = 0; k < records.size(); k += sizeof(protocols::ostrace::RingRecord)) {
+				protocols::ostrace::RingRecord record;
+				memcpy(&record, records.data() + k, sizeof(record));
+				if(record.numCtrs > protocols::ostrace::maxRingCounters)
+					return false;
+
+				if(!k && batch.lost())
+					exporter.lost(batch.cpu(), record.ts, batch.lost());
+
+				exporter.event(batch.cpu(), record.ts, record.id, record.numCtrs,
+						[&] (size_t i) {
+					return std::pair<uint64_t, int64_t>{record.ctrs[i].id, record.ctrs[i].value};
+				});
+			}
+		} break;
+		case bragi::message_id<managarm::ostrace::AnnounceEventRecord>: {
+			auto maybeRecord = bragi::parse_head_tail<managarm::ostrace::AnnounceEventRecord>(
+					head_span, tail_span);
+			if(!maybeRecord)
+				return false;
+			exporter.announceEvent(maybeRecord.value().id(), maybeRecord.value().name());
+		} break;
+		case bragi::message_id<managarm::ostrace::AnnounceItemRecord>: {
+			auto maybeRecord = bragi::parse_head_tail<managarm::ostrace::AnnounceItemRecord>(
+					head_span, tail_span);
+			if(!maybeRecord)
+				return false;
+			exporter.announceItem(maybeRecord.value().id(), maybeRecord.value().name());
+		} break;
+		default:
+			warnx("halting due to unexpected message ID %u", id);
+			return false;
+		}
+		return true;
+	};
+
+	// Only the current (incomplete) record is kept in memory.
+	std::vector<char> buffer;
+	size_t offset = 0;
+	size_t nRecords = 0;
+	bool broken = false;
+	bool eof = false;
+	while(!broken && !eof) {
+		// Discard the records that were already processed.
+		buffer.erase(buffer.begin(), buffer.begin() + offset);
+		offset = 0;
+
+		auto size = buffer.size();
+		buffer.resize(size + chunkSize);
+		auto n = read(fd, buffer.data() + size, chunkSize);
+		if(n < 0)
+			err(1, "failed to read input");
+		buffer.resize(size + n);
+		if(!n)
+			eof = true;
+
+		while(true) {
+			// All records have a head size of 8.
+			frg::span<const char> remaining{buffer.data() + offset, buffer.size() - offset};
+			if(remaining.size() < 8)
+				break;
+
+			auto preamble = bragi::read_preamble(remaining);
+			if(preamble.error()) {
+				warnx("halting due to broken preamble");
+				broken = true;
+				break;
+			}
+			if(remaining.size() < 8 + preamble.tail_size())
+				break;
+
+			if(!processRecord(remaining.subspan(0, 8),
+					remaining.subspan(8, preamble.tail_size()), preamble.id())) {
+				warnx("halting due to broken record");
+				broken = true;
+				break;
+			}
+			offset += 8 + preamble.tail_size();
+			++nRecords;
+		}
+	}
+
+	if(fclose(out))
+		err(1, "failed to close output file");
+
+	std::cerr << "processed " << nRecords << " records"
+			<< " (" << (buffer.size() - offset) << " bytes remain)" << std::endl;
+	std::cerr << "exported " << exporter.numEvents << " events using "
+			<< exporter.numLanes << " slice tracks" << std::endl;
+}
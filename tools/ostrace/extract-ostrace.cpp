@@ -3,6 +3,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
 #include <iostream>
 
 #include <bragi/helpers-std.hpp>
@@ -10,6 +11,7 @@
 #include <CLI/Formatter.hpp>
 #include <CLI/Config.hpp>
 #include <frg/span.hpp>
+#include <protocols/ostrace/ring.hpp>
 #include <ostrace.bragi.hpp>
 
 enum class ExtractMode {
@@ -64,8 +66,26 @@ int main(int argc, char **argv) {
 	uint64_t filteredEventId = 0;
 	uint64_t desiredItemId = 0;
 
-	std::vector<uint64_t> ts;
-	std::vector<uint64_t> value;
+	// Pairs of (timestamp, value). Records of different CPUs are interleaved in the file,
+	// hence we sort by timestamp before printing.
+	std::vector<std::pair<uint64_t, int64_t>> matches;
+	uint64_t nLost = 0;
+
+	auto extractEvent = [&] (uint64_t recordTs, uint64_t id,
+			auto numCtrs, auto getCounter) {
+		if(id != filteredEventId)
+			return;
+		if(mode == ExtractMode::eventOnly) {
+			matches.push_back({recordTs, 0});
+		}else if(mode == ExtractMode::specificItem) {
+			for(size_t i = 0; i < numCtrs; ++i) {
+				auto [ctrId, ctrValue] = getCounter(i);
+				if(ctrId != desiredItemId)
+					continue;
+				matches.push_back({recordTs, ctrValue});
+			}
+		}
+	};
 
 	auto extractRecord = [&] () -> bool {
 		auto preamble = bragi::read_preamble(buffer);
@@ -88,17 +108,36 @@ int main(int argc, char **argv) {
 			}
 			auto &record = maybeRecord.value();
 
-			if(record.id() == filteredEventId) {
-				if(mode == ExtractMode::eventOnly) {
-					ts.push_back(record.ts());
-				}else if(mode == ExtractMode::specificItem) {
-					for(size_t i = 0; i < record.ctrs_size(); ++i) {
-						if(record.ctrs(i).id() != desiredItemId)
-							continue;
-						ts.push_back(record.ts());
-						value.push_back(record.ctrs(i).value());
-					}
+			extractEvent(record.ts(), record.id(), record.ctrs_size(), [&] (size_t i) {
+				return std::pair<uint64_t, int64_t>{record.ctrs(i).id(), record.ctrs(i).value()};
+			});
+		} break;
+		case bragi::message_id<managarm::ostrace::EventBatchRecord>: {
+			auto maybeRecord = bragi::parse_head_tail<managarm::ostrace::EventBatchRecord>(
+					head_span, tail_span);
+			if(!maybeRecord) {
+				warnx("halting due to broken record");
+				return false;
+			}
+			auto &batch = maybeRecord.value();
+			auto &records = batch.records();
+			if(records.size() % sizeof(protocols::ostrace::RingRecord)) {
+				warnx("halting due to misaligned event batch");
+				return false;
+			}
+
+			nLost += batch.lost();
+			for(size_t k = 0; k < records.size(); k += sizeof(protocols::ostrace::RingRecord)) {
+				protocols::ostrace::RingRecord record;
+				memcpy(&record, records.data() + k, sizeof(record));
+				if(record.numCtrs > protocols::ostrace::maxRingCounters) {
+					warnx("halting due to broken ring record");
+					return false;
 				}
+
+				extractEvent(record.ts, record.id, record.numCtrs, [&] (size_t i) {
+					return std::pair<uint64_t, int64_t>{record.ctrs[i].id, record.ctrs[i].value};
+				});
 			}
 		} break;
 		case bragi::message_id<managarm::ostrace::AnnounceEventRecord>: {
@@ -135,21 +174,27 @@ int main(int argc, char **argv) {
 		++nRecords;
 	}
 
+	std::stable_sort(matches.begin(), matches.end(), [] (const auto &a, const auto &b) {
+		return a.first < b.first;
+	});
+
 	std::cout << "{\n";
 	std::cout << "\"ts\": [";
-	for(size_t i = 0; i < ts.size(); ++i)
-		std::cout << (i ? ", " : "") << ts[i];
+	for(size_t i = 0; i < matches.size(); ++i)
+		std::cout << (i ? ", " : "") << matches[i].first;
 	std::cout << "]\n";
 	if(mode == ExtractMode::specificItem) {
 		std::cout << ",\n";
 		std::cout << "\"value\": [";
-		for(size_t i = 0; i < value.size(); ++i)
-			std::cout << (i ? ", " : "") << value[i];
+		for(size_t i = 0; i < matches.size(); ++i)
+			std::cout << (i ? ", " : "") << matches[i].second;
 		std::cout << "]\n";
 	}
 	std::cout << "}" << std::endl;
 
 	std::cerr << "extracted " << nRecords << " records"
 			<< " (" << buffer.size() << " bytes remain)" << std::endl;
-	std::cerr << "found " << ts.size() << " matches" << std::endl;
+	std::cerr << "found " << matches.size() << " matches" << std::endl;
+	if(nLost)
+		std::cerr << nLost << " events were lost due to ring overruns" << std::endl;
 }
@@ -16,6 +16,15 @@ struct PrintVisitor {
 	}
 };
 
+void printEntity(mbus::Properties &props) {
+	std::cout << "found mbus entry:\n";
+	for (auto &[name, value] : props) {
+		std::cout << "\tproperty: \"" << name << "\": ";
+		std::visit(PrintVisitor {}, value);
+		std::cout << std::endl;
+	}
+}
+
 async::detached enumerateBus() {
 	auto root = co_await mbus::Instance::global().getRoot();
 
@@ -23,15 +32,14 @@ async::detached enumerateBus() {
 
 	auto handler = mbus::ObserverHandler {}
 	.withAttach([] (mbus::Entity, mbus::Properties props) {
-		std::cout << "found mbus entry:\n";
-		for (auto &[name, value] : props) {
-			std::cout << "\tproperty: \"" << name << "\": ";
-			std::visit(PrintVisitor {}, value);
-			std::cout << std::endl;
-		}
+		printEntity(props);
 	});
 
-	co_await root.linkObserver(std::move(filter), std::move(handler));
+	auto snapshot = co_await root.enumerate(std::move(filter), std::move(handler));
+	for (auto &event : snapshot.entities) {
+		auto props = event.getProperties();
+		printEntity(props);
+	}
 }
 }
 
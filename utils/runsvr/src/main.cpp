@@ -1,7 +1,13 @@
 #include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <memory>
 
 #include <async/oneshot-event.hpp>
 #include <helix/memory.hpp>
@@ -32,37 +38,66 @@ void err(const char *format, Ts &&...ts) {
 	print_to(STDERR_FILENO, format, std::forward<Ts>(ts)...);
 }
 
-static std::vector<std::byte> readEntireFile(const char *path) {
-	constexpr size_t bytesPerChunk = 8192;
+// Read-only mapping of an entire file. Mapping avoids copying the file through read();
+// the pages are shared with the page cache.
+struct MappedFile {
+	MappedFile(const char *path) {
+		auto fd = open(path, O_RDONLY);
+		if(fd < 0)
+			throw std::runtime_error("Could not open file");
+
+		struct stat st;
+		if(fstat(fd, &st)) {
+			close(fd);
+			throw std::runtime_error("fstat() failed");
+		}
+		size_ = st.st_size;
+
+		if(size_) {
+			auto window = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(window == MAP_FAILED) {
+				close(fd);
+				throw std::runtime_error("Could not map file");
+			}
+			data_ = static_cast<const std::byte *>(window);
+		}
+		close(fd);
+	}
 
-	auto fd = open(path, O_RDONLY);
-	if(fd < 0)
-		throw std::runtime_error("Could not open file");
+	MappedFile(const MappedFile &) = delete;
 
-	std::vector<std::byte> buffer;
+	MappedFile &operator= (const MappedFile &) = delete;
 
-	struct stat st;
-	if(!fstat(fd, &st)) {
-		buffer.reserve(st.st_size);
-	}else{
-		log("runsvr: fstat() failed on %s\n", path);
+	~MappedFile() {
+		if(data_)
+			munmap(const_cast<std::byte *>(data_), size_);
 	}
 
-	off_t progress = 0;
-	while(true) {
-		buffer.resize(progress + bytesPerChunk);
-		auto chunk = read(fd, buffer.data() + progress, bytesPerChunk);
-		if(!chunk)
-			break;
-		if(chunk < 0)
-			throw std::runtime_error("Error while reading file");
-		progress += chunk;
+	const std::byte *data() const {
+		return data_;
 	}
 
-	close(fd);
+	size_t size() const {
+		return size_;
+	}
+
+private:
+	const std::byte *data_ = nullptr;
+	size_t size_ = 0;
+};
 
-	buffer.resize(progress);
-	return buffer;
+static managarm::svrctl::Description readDescription(const char *path) {
+	MappedFile file{path};
+	managarm::svrctl::Description desc;
+	desc.ParseFromArray(file.data(), file.size());
+	return desc;
+}
+
+// Monotonic time in ms.
+static double monotonicMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
 }
 
 // ----------------------------------------------------------------------------
@@ -116,7 +151,7 @@ async::result<helix::UniqueLane> runServer(const char *name) {
 }
 
 async::result<void> uploadFile(const char *name) {
-	std::vector<std::byte> buffer;
+	std::unique_ptr<MappedFile> file;
 
 	auto optimisticUpload = [&] () -> async::result<bool> {
 		managarm::svrctl::CntRequest req;
@@ -152,7 +187,7 @@ async::result<void> uploadFile(const char *name) {
 			svrctlLane,
 			helix_ng::offer(
 				helix_ng::sendBuffer(ser.data(), ser.size()),
-				helix_ng::sendBuffer(buffer.data(), buffer.size()),
+				helix_ng::sendBuffer(file->data(), file->size()),
 				helix_ng::recvInline())
 		);
 		HEL_CHECK(offer.error());
@@ -169,8 +204,8 @@ async::result<void> uploadFile(const char *name) {
 	if(co_await optimisticUpload())
 		co_return;
 
-	// The kernel does not know the file; we have to read the entire contents.
-	buffer = readEntireFile(name);
+	// The kernel does not know the file; we have to send the entire contents.
+	file = std::make_unique<MappedFile>(name);
 	co_await uploadWithData();
 }
 
@@ -195,15 +230,163 @@ async::result<void> bindServer(helix::UniqueLane &lane, int mbusId) {
 	assert(resp.error() == managarm::svrctl::Error::SUCCESS);
 }
 
+// ----------------------------------------------------------------
+// Parallel launch of a dependency graph of servers.
+// ----------------------------------------------------------------
+
+struct ServerNode {
+	managarm::svrctl::Description desc;
+	std::vector<ServerNode *> requirements;
+	async::oneshot_event ready;
+
+	// Timestamps in ms since the launch started: when all requirements were ready,
+	// when SVR_RUN completed and when the server became ready.
+	double startTime = 0;
+	double runTime = 0;
+	double readyTime = 0;
+	// Requirement that became ready last, i.e., the one that delayed the start.
+	ServerNode *critical = nullptr;
+};
+
+// Files are only uploaded once, even if multiple servers need them.
+std::map<std::string, std::shared_ptr<async::oneshot_event>> uploadedFiles;
+
+async::result<void> uploadFileOnce(const std::string &path) {
+	auto it = uploadedFiles.find(path);
+	if(it != uploadedFiles.end()) {
+		auto done = it->second;
+		co_await done->wait();
+		co_return;
+	}
+
+	auto done = std::make_shared<async::oneshot_event>();
+	uploadedFiles.emplace(path, done);
+	co_await uploadFile(path.c_str());
+	done->raise();
+}
+
+// Waits until an mbus object with all of the server's ready_properties exists.
+async::result<void> waitForReadyObject(ServerNode *node) {
+	std::vector<mbus::AnyFilter> operands;
+	for(const auto &prop : node->desc.ready_properties())
+		operands.push_back(mbus::EqualsFilter(prop.name(), prop.value()));
+
+	// The observer outlives this coroutine; hence, its state is reference counted.
+	struct State {
+		async::oneshot_event found;
+		bool raised = false;
+	};
+	auto state = std::make_shared<State>();
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([state] (mbus::Entity, mbus::Properties) {
+		if(state->raised)
+			return;
+		state->raised = true;
+		state->found.raise();
+	});
+
+	auto root = co_await mbus::Instance::global().getRoot();
+	co_await root.linkObserver(mbus::Conjunction(std::move(operands)), std::move(handler));
+	co_await state->found.wait();
+}
+
+async::result<void> launchServer(ServerNode *node, double epoch) {
+	for(auto requirement : node->requirements) {
+		co_await requirement->ready.wait();
+		if(!node->critical || requirement->readyTime > node->critical->readyTime)
+			node->critical = requirement;
+	}
+	node->startTime = monotonicMs() - epoch;
+
+	log("runsvr: Running %s\n", node->desc.name().c_str());
+	for(const auto &file : node->desc.files())
+		co_await uploadFileOnce(file.path());
+	co_await runServer(node->desc.exec().c_str());
+	node->runTime = monotonicMs() - epoch;
+
+	if(node->desc.ready_properties_size())
+		co_await waitForReadyObject(node);
+	node->readyTime = monotonicMs() - epoch;
+	node->ready.raise();
+}
+
+// Starts all servers as soon as their requirements are ready and prints a boot timeline.
+async::result<void> launchGraph(const std::vector<std::string> &paths) {
+	std::map<std::string, std::unique_ptr<ServerNode>> nodes;
+	for(const auto &path : paths) {
+		auto node = std::make_unique<ServerNode>();
+		node->desc = readDescription(path.c_str());
+		auto name = node->desc.name();
+		if(!nodes.emplace(name, std::move(node)).second)
+			throw std::runtime_error("Server " + name + " is described twice");
+	}
+
+	for(auto &[name, node] : nodes) {
+		for(const auto &requirement : node->desc.dependencies()) {
+			auto it = nodes.find(requirement);
+			if(it == nodes.end())
+				throw std::runtime_error("Server " + name + " requires unknown server "
+						+ requirement);
+			node->requirements.push_back(it->second.get());
+		}
+	}
+
+	// Reject cycles (they would never start).
+	std::map<ServerNode *, int> visitState; // 1: on the DFS stack, 2: done.
+	auto visit = [&] (auto &self, ServerNode *node) -> void {
+		auto &state = visitState[node];
+		if(state == 2)
+			return;
+		if(state == 1)
+			throw std::runtime_error("Dependency cycle involving server " + node->desc.name());
+		state = 1;
+		for(auto requirement : node->requirements)
+			self(self, requirement);
+		visitState[node] = 2;
+	};
+	for(auto &[name, node] : nodes)
+		visit(visit, node.get());
+
+	auto epoch = monotonicMs();
+	for(auto &[name, node] : nodes)
+		async::detach(launchServer(node.get(), epoch));
+	for(auto &[name, node] : nodes)
+		co_await node->ready.wait();
+
+	std::vector<ServerNode *> timeline;
+	for(auto &[name, node] : nodes)
+		timeline.push_back(node.get());
+	std::sort(timeline.begin(), timeline.end(), [] (ServerNode *a, ServerNode *b) {
+		return a->startTime < b->startTime;
+	});
+
+	log("runsvr: Boot timeline (ms):\n");
+	log("    %-24s %10s %10s %10s\n", "server", "start", "running", "ready");
+	for(auto node : timeline)
+		log("    %-24s %10.1f %10.1f %10.1f\n", node->desc.name().c_str(),
+				node->startTime, node->runTime, node->readyTime);
+
+	// The critical path ends at the server that became ready last.
+	auto last = *std::max_element(timeline.begin(), timeline.end(),
+			[] (ServerNode *a, ServerNode *b) {
+		return a->readyTime < b->readyTime;
+	});
+	std::string path;
+	for(auto node = last; node; node = node->critical)
+		path = node->desc.name() + (path.empty() ? "" : " -> ") + path;
+	log("runsvr: Critical path: %s (%.1f ms)\n", path.c_str(), last->readyTime);
+}
+
 // ----------------------------------------------------------------
 // Freestanding mbus functions.
 // ----------------------------------------------------------------
 
 enum class action {
-	runsvr, run, bind, upload
+	runsvr, run, bind, upload, graph
 };
 
-async::result<void> asyncMain(action act, std::string path) {
+async::result<void> asyncMain(action act, std::string path, std::vector<std::string> paths) {
 	co_await enumerateSvrctl();
 
 	switch (act) {
@@ -215,10 +398,7 @@ async::result<void> asyncMain(action act, std::string path) {
 		}
 
 		case action::run: {
-			auto buffer = readEntireFile(path.c_str());
-
-			managarm::svrctl::Description desc;
-			desc.ParseFromArray(buffer.data(), buffer.size());
+			auto desc = readDescription(path.c_str());
 
 			log("runsvr: Running %s\n", desc.name().c_str());
 
@@ -231,10 +411,7 @@ async::result<void> asyncMain(action act, std::string path) {
 		}
 
 		case action::bind: {
-			auto buffer = readEntireFile(path.c_str());
-
-			managarm::svrctl::Description desc;
-			desc.ParseFromArray(buffer.data(), buffer.size());
+			auto desc = readDescription(path.c_str());
 
 			auto id_str = getenv("MBUS_ID");
 			log("runsvr: Binding driver %s to mbus ID %s\n", desc.name().c_str(), id_str);
@@ -255,6 +432,12 @@ async::result<void> asyncMain(action act, std::string path) {
 			break;
 		}
 
+		case action::graph: {
+			co_await launchGraph(paths);
+
+			break;
+		}
+
 		default: {
 			err("runsvr: Invalid action (this should be unreachable)\n");
 			abort();
@@ -267,6 +450,7 @@ int main(int argc, const char **argv) {
 
 	bool do_fork = false;
 	std::string path;
+	std::vector<std::string> paths;
 	action act;
 
 	CLI::App app{"runsvr"};
@@ -284,6 +468,10 @@ int main(int argc, const char **argv) {
 	CLI::App *sub_upload = app.add_subcommand("upload", "Upload a file");
 	sub_upload->add_option("path", path, "Path to file")->required();
 
+	CLI::App *sub_graph = app.add_subcommand("graph",
+			"Run servers in parallel, respecting their declared requirements");
+	sub_graph->add_option("paths", paths, "Paths to descriptions")->required();
+
 	app.require_subcommand(1);
 
 	CLI11_PARSE(app, argc, argv);
@@ -296,6 +484,8 @@ int main(int argc, const char **argv) {
 		act = action::bind;
 	else if (*sub_upload)
 		act = action::upload;
+	else if (*sub_graph)
+		act = action::graph;
 	else {
 		err("runsvr: No subcommand specified\n");
 		return 1;
@@ -313,6 +503,6 @@ int main(int argc, const char **argv) {
 		mbus::recreateInstance();
 	}
 
-	async::run(asyncMain(act, std::move(path)), helix::currentDispatcher);
+	async::run(asyncMain(act, std::move(path), std::move(paths)), helix::currentDispatcher);
 }
 